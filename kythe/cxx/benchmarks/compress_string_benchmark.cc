@@ -0,0 +1,97 @@
+/*
+ * Copyright 2017 Google Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Benchmarks for `CompressString` and the base64 codec, which shorten most of
+// the long identities the indexer produces.
+
+#include <string>
+#include <vector>
+
+#include "benchmark/benchmark.h"
+#include "kythe/cxx/common/json_proto.h"
+#include "kythe/cxx/indexer/cxx/GraphObserver.h"
+
+namespace kythe {
+namespace {
+
+/// \brief Returns `count` distinct strings of `length` bytes that look like
+/// the long identities built for template instantiations.
+std::vector<std::string> MakeIdentities(size_t count, size_t length) {
+  std::vector<std::string> identities;
+  for (size_t i = 0; i < count; ++i) {
+    std::string identity = "vector#" + std::to_string(i) + "#n#std#";
+    while (identity.size() < length) {
+      identity.append("basic_string:char:char_traits:allocator#");
+    }
+    identity.resize(length);
+    identities.push_back(std::move(identity));
+  }
+  return identities;
+}
+
+void BM_EncodeBase64(benchmark::State &state) {
+  const auto inputs = MakeIdentities(256, state.range(0));
+  size_t next = 0;
+  while (state.KeepRunning()) {
+    benchmark::DoNotOptimize(EncodeBase64(inputs[next++ % inputs.size()]));
+  }
+  state.SetBytesProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_EncodeBase64)->Arg(32)->Arg(256)->Arg(4096);
+
+void BM_DecodeBase64(benchmark::State &state) {
+  std::vector<std::string> inputs;
+  for (const auto &identity : MakeIdentities(256, state.range(0))) {
+    inputs.push_back(EncodeBase64(identity));
+  }
+  size_t next = 0;
+  std::string decoded;
+  while (state.KeepRunning()) {
+    benchmark::DoNotOptimize(
+        DecodeBase64(inputs[next++ % inputs.size()], &decoded));
+  }
+  state.SetBytesProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_DecodeBase64)->Arg(32)->Arg(256)->Arg(4096);
+
+// Identities of at most `kSha256DigestBase64MaxEncodingLength` bytes are
+// returned as-is; longer ones are hashed and encoded.
+void BM_CompressString(benchmark::State &state) {
+  const auto inputs = MakeIdentities(256, state.range(0));
+  size_t next = 0;
+  while (state.KeepRunning()) {
+    benchmark::DoNotOptimize(CompressString(inputs[next++ % inputs.size()]));
+  }
+  state.SetBytesProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_CompressString)->Arg(32)->Arg(64)->Arg(256)->Arg(4096);
+
+void BM_CompressStringInto(benchmark::State &state) {
+  const auto inputs = MakeIdentities(256, state.range(0));
+  size_t next = 0;
+  char compressed[kCompressedStringLength];
+  while (state.KeepRunning()) {
+    benchmark::DoNotOptimize(
+        CompressStringInto(inputs[next++ % inputs.size()], compressed));
+  }
+  state.SetBytesProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_CompressStringInto)->Arg(64)->Arg(256)->Arg(4096);
+
+}  // namespace
+}  // namespace kythe
+
+BENCHMARK_MAIN();
@@ -0,0 +1,449 @@
+/*
+ * Copyright 2017 Google Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// corpus_benchmark runs the C++ indexer over every compilation unit in an
+// index pack, once per indexer configuration, and measures each run's wall
+// time, CPU time, peak RSS and output size. Each unit is indexed by its own
+// indexer process so that peak RSS is per unit.
+//
+// The corpus is an index pack snapshot kept outside the repository. It
+// should hold units that represent real workloads: for example, a slice of
+// LLVM (lib/Support and lib/IR), a protobuf-heavy unit (a large .pb.cc), a
+// template metaprogramming unit and an Objective-C unit. Build one by running
+// cxx_extractor (or objc_extractor) with KYTHE_INDEX_PACK=1 and
+// KYTHE_OUTPUT_DIRECTORY set to the same directory for every unit. Don't
+// change a snapshot once results have been recorded against it.
+//
+// Each run is appended to --output as a JSON line labelled with --label (a
+// revision, say), so results from the same snapshot can be compared across
+// revisions; --baseline prints the change from an earlier --output. Run it
+// with, for example:
+//
+//   bazel run -c opt //kythe/cxx/benchmarks:corpus_benchmark --
+//       --index_pack=/data/kythe_corpus --label=$(git rev-parse HEAD)
+//       --output=/tmp/corpus.json --baseline=/tmp/corpus_before.json
+//
+// Arguments after the flags are passed to every indexer run.
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cinttypes>
+#include <fstream>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "gflags/gflags.h"
+#include "glog/logging.h"
+#include "google/protobuf/stubs/common.h"
+#include "kythe/cxx/common/index_pack.h"
+#include "kythe/proto/analysis.pb.h"
+#include "llvm/ADT/StringRef.h"
+#include "rapidjson/document.h"
+
+DEFINE_string(indexer, "", "The C++ indexer binary to run.");
+DEFINE_string(index_pack, "", "The index pack that holds the corpus.");
+DEFINE_string(units_file, "",
+              "If set, only index the units listed in this file, one "
+              "\"name hash\" pair per line, and call them by those names. "
+              "Otherwise index every unit in the pack, named by source file.");
+DEFINE_string(configurations, "",
+              "Comma-separated names of the configurations to run (empty to "
+              "run all of them).");
+DEFINE_int32(repetitions, 1,
+             "Index each unit this many times per configuration; the "
+             "summary uses the fastest run.");
+DEFINE_string(label, "", "A label for this run's results, like a revision.");
+DEFINE_string(output, "", "Append a JSON line per run to this file.");
+DEFINE_string(baseline, "",
+              "Compare the summary with the runs in this file, written by an "
+              "earlier --output.");
+DEFINE_string(scratch_dir, "/tmp",
+              "Where to write each run's output and log while it runs.");
+
+namespace kythe {
+namespace {
+
+/// \brief A way to run the indexer.
+struct Configuration {
+  /// The name results are filed under.
+  const char *name;
+  /// The flags the indexer is run with.
+  std::vector<std::string> flags;
+};
+
+/// \brief Returns the configurations to measure: Classic or Lite output,
+/// with or without template instantiations, with the in-process hash cache
+/// off or on.
+std::vector<Configuration> AllConfigurations() {
+  const std::string kLite = "--experimental_index_lite";
+  const std::string kNoTemplates = "--index_template_instantiations=false";
+  const std::string kCache = "--cache_lru_size=1000000";
+  return {
+      {"classic", {}},
+      {"classic_no_templates", {kNoTemplates}},
+      {"lite", {kLite}},
+      {"lite_no_templates", {kLite, kNoTemplates}},
+      {"classic_cache", {kCache}},
+      {"classic_no_templates_cache", {kNoTemplates, kCache}},
+      {"lite_cache", {kLite, kCache}},
+      {"lite_no_templates_cache", {kLite, kNoTemplates, kCache}},
+  };
+}
+
+/// \brief A unit in the corpus.
+struct CorpusUnit {
+  /// What results for the unit are called.
+  std::string name;
+  /// The unit's hash in the index pack.
+  std::string hash;
+};
+
+/// \brief What one indexer run cost.
+struct RunCost {
+  /// Whether the indexer exited successfully.
+  bool succeeded = false;
+  double wall_seconds = 0;
+  /// User plus system time.
+  double cpu_seconds = 0;
+  uint64_t peak_rss_bytes = 0;
+  uint64_t output_bytes = 0;
+};
+
+/// \brief Reads the units to index into `units`.
+bool ListUnits(std::vector<CorpusUnit> *units, std::string *error_text) {
+  if (!FLAGS_units_file.empty()) {
+    std::ifstream in(FLAGS_units_file);
+    if (!in) {
+      *error_text = "couldn't open " + FLAGS_units_file;
+      return false;
+    }
+    CorpusUnit unit;
+    while (in >> unit.name >> unit.hash) {
+      units->push_back(unit);
+    }
+    return true;
+  }
+  auto filesystem = IndexPackPosixFilesystem::Open(
+      FLAGS_index_pack, IndexPackFilesystem::OpenMode::kReadOnly, error_text);
+  if (filesystem == nullptr) {
+    return false;
+  }
+  std::vector<std::string> hashes;
+  if (!filesystem->ScanFiles(IndexPackFilesystem::DataKind::kCompilationUnit,
+                             [&hashes](const std::string &hash) {
+                               hashes.push_back(hash);
+                               return true;
+                             },
+                             error_text)) {
+    return false;
+  }
+  IndexPack pack(std::move(filesystem));
+  for (const auto &hash : hashes) {
+    proto::CompilationUnit unit;
+    if (!pack.ReadCompilationUnit(hash, &unit, error_text)) {
+      return false;
+    }
+    std::string name = unit.source_file_size() > 0 ? unit.source_file(0)
+                                                   : unit.v_name().signature();
+    units->push_back({name.empty() ? hash : name, hash});
+  }
+  std::sort(units->begin(), units->end(),
+            [](const CorpusUnit &a, const CorpusUnit &b) {
+              return a.name < b.name;
+            });
+  return true;
+}
+
+/// \brief Indexes `unit` with `configuration` in a child process.
+RunCost IndexUnit(const Configuration &configuration, const CorpusUnit &unit,
+                  const std::vector<std::string> &extra_args) {
+  const std::string output_path = FLAGS_scratch_dir + "/corpus_benchmark_" +
+                                  std::to_string(::getpid()) + ".entries";
+  const std::string log_path = FLAGS_scratch_dir + "/corpus_benchmark_" +
+                               configuration.name + "_" + unit.hash + ".log";
+  std::vector<std::string> args = {FLAGS_indexer,
+                                   "--index_pack=" + FLAGS_index_pack,
+                                   "--ignore_unimplemented", "-o", output_path};
+  args.insert(args.end(), configuration.flags.begin(),
+              configuration.flags.end());
+  args.insert(args.end(), extra_args.begin(), extra_args.end());
+  args.push_back(unit.hash);
+  std::vector<char *> argv;
+  for (auto &arg : args) {
+    argv.push_back(&arg[0]);
+  }
+  argv.push_back(nullptr);
+
+  RunCost cost;
+  auto start = std::chrono::steady_clock::now();
+  pid_t pid = ::fork();
+  PCHECK(pid >= 0) << "Couldn't fork";
+  if (pid == 0) {
+    int log = ::open(log_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (log >= 0) {
+      ::dup2(log, STDOUT_FILENO);
+      ::dup2(log, STDERR_FILENO);
+    }
+    ::execv(argv[0], argv.data());
+    ::_exit(127);
+  }
+  int status = 0;
+  struct rusage usage;
+  PCHECK(::wait4(pid, &status, 0, &usage) == pid) << "Couldn't wait";
+  cost.wall_seconds = std::chrono::duration<double>(
+                          std::chrono::steady_clock::now() - start)
+                          .count();
+  cost.cpu_seconds = usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6 +
+                     usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+  // ru_maxrss is in kilobytes on Linux.
+  cost.peak_rss_bytes = static_cast<uint64_t>(usage.ru_maxrss) * 1024;
+  cost.succeeded = WIFEXITED(status) && WEXITSTATUS(status) == 0;
+  struct stat output_stat;
+  if (::stat(output_path.c_str(), &output_stat) == 0) {
+    cost.output_bytes = output_stat.st_size;
+  }
+  ::unlink(output_path.c_str());
+  if (cost.succeeded) {
+    ::unlink(log_path.c_str());
+  } else {
+    fprintf(stderr, "%s failed on %s; see %s\n", configuration.name,
+            unit.name.c_str(), log_path.c_str());
+  }
+  return cost;
+}
+
+/// \brief Appends `text` to `out` as a JSON string literal.
+void AppendJsonString(const std::string &text, std::string *out) {
+  out->push_back('"');
+  for (char c : text) {
+    if (c == '"' || c == '\\') {
+      out->push_back('\\');
+      out->push_back(c);
+    } else if (static_cast<unsigned char>(c) < 0x20) {
+      char escaped[8];
+      snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+      out->append(escaped);
+    } else {
+      out->push_back(c);
+    }
+  }
+  out->push_back('"');
+}
+
+/// \brief Returns a JSON line describing one run.
+std::string RunToJson(const Configuration &configuration,
+                      const CorpusUnit &unit, int repetition,
+                      const RunCost &cost) {
+  std::string json = "{\"label\":";
+  AppendJsonString(FLAGS_label, &json);
+  json += ",\"configuration\":";
+  AppendJsonString(configuration.name, &json);
+  json += ",\"unit\":";
+  AppendJsonString(unit.name, &json);
+  json += ",\"hash\":";
+  AppendJsonString(unit.hash, &json);
+  char fields[256];
+  snprintf(fields, sizeof(fields),
+           ",\"repetition\":%d,\"succeeded\":%s,\"wall_seconds\":%.6f,"
+           "\"cpu_seconds\":%.6f,\"peak_rss_bytes\":%" PRIu64
+           ",\"output_bytes\":%" PRIu64 "}\n",
+           repetition, cost.succeeded ? "true" : "false", cost.wall_seconds,
+           cost.cpu_seconds, cost.peak_rss_bytes, cost.output_bytes);
+  json += fields;
+  return json;
+}
+
+/// \brief The summary of a configuration over the corpus.
+struct Totals {
+  size_t units = 0;
+  size_t failures = 0;
+  double wall_seconds = 0;
+  double cpu_seconds = 0;
+  /// The largest peak RSS of any unit.
+  uint64_t peak_rss_bytes = 0;
+  uint64_t output_bytes = 0;
+};
+
+/// \brief Adds a unit's fastest run to `totals`.
+void AddToTotals(const RunCost &cost, Totals *totals) {
+  ++totals->units;
+  if (!cost.succeeded) {
+    ++totals->failures;
+  }
+  totals->wall_seconds += cost.wall_seconds;
+  totals->cpu_seconds += cost.cpu_seconds;
+  totals->peak_rss_bytes = std::max(totals->peak_rss_bytes,
+                                    cost.peak_rss_bytes);
+  totals->output_bytes += cost.output_bytes;
+}
+
+/// \brief Reads the totals per configuration from an earlier --output,
+/// using the fastest run of each unit.
+bool ReadBaseline(const std::string &path, std::map<std::string, Totals> *out,
+                  std::string *error_text) {
+  std::ifstream in(path);
+  if (!in) {
+    *error_text = "couldn't open " + path;
+    return false;
+  }
+  std::map<std::pair<std::string, std::string>, RunCost> fastest;
+  std::string line;
+  while (std::getline(in, line)) {
+    rapidjson::Document run;
+    run.Parse(line.c_str());
+    if (run.HasParseError() || !run.IsObject() ||
+        !run.HasMember("configuration") || !run.HasMember("unit")) {
+      *error_text = "bad line in " + path + ": " + line;
+      return false;
+    }
+    RunCost cost;
+    cost.succeeded = run["succeeded"].GetBool();
+    cost.wall_seconds = run["wall_seconds"].GetDouble();
+    cost.cpu_seconds = run["cpu_seconds"].GetDouble();
+    cost.peak_rss_bytes = run["peak_rss_bytes"].GetUint64();
+    cost.output_bytes = run["output_bytes"].GetUint64();
+    auto key = std::make_pair(run["configuration"].GetString(),
+                              run["unit"].GetString());
+    auto found = fastest.find(key);
+    if (found == fastest.end() ||
+        cost.wall_seconds < found->second.wall_seconds) {
+      fastest[key] = cost;
+    }
+  }
+  for (const auto &run : fastest) {
+    AddToTotals(run.second, &(*out)[run.first.first]);
+  }
+  return true;
+}
+
+/// \brief Returns `value` followed by its change from `base` if there's a
+/// baseline.
+std::string Compare(double value, double base, bool has_base,
+                    const char *format) {
+  char text[64];
+  snprintf(text, sizeof(text), format, value);
+  std::string out = text;
+  if (has_base && base > 0) {
+    snprintf(text, sizeof(text), " (%+.1f%%)", (value / base - 1) * 100);
+    out += text;
+  }
+  return out;
+}
+
+int Run(const std::vector<std::string> &extra_args) {
+  std::string error_text;
+  std::vector<CorpusUnit> units;
+  if (!ListUnits(&units, &error_text)) {
+    fprintf(stderr, "Couldn't list the corpus: %s\n", error_text.c_str());
+    return 1;
+  }
+  std::map<std::string, Totals> baseline;
+  if (!FLAGS_baseline.empty() &&
+      !ReadBaseline(FLAGS_baseline, &baseline, &error_text)) {
+    fprintf(stderr, "Couldn't read the baseline: %s\n", error_text.c_str());
+    return 1;
+  }
+  std::vector<Configuration> configurations;
+  for (auto &configuration : AllConfigurations()) {
+    std::string wanted = "," + FLAGS_configurations + ",";
+    if (FLAGS_configurations.empty() ||
+        wanted.find(std::string(",") + configuration.name + ",") !=
+            std::string::npos) {
+      configurations.push_back(std::move(configuration));
+    }
+  }
+  FILE *output = nullptr;
+  if (!FLAGS_output.empty()) {
+    output = fopen(FLAGS_output.c_str(), "a");
+    if (output == nullptr) {
+      fprintf(stderr, "Couldn't open %s\n", FLAGS_output.c_str());
+      return 1;
+    }
+  }
+  std::vector<Totals> totals(configurations.size());
+  for (size_t c = 0; c < configurations.size(); ++c) {
+    for (const auto &unit : units) {
+      RunCost fastest;
+      for (int repetition = 0; repetition < std::max(FLAGS_repetitions, 1);
+           ++repetition) {
+        RunCost cost = IndexUnit(configurations[c], unit, extra_args);
+        if (output != nullptr) {
+          fputs(RunToJson(configurations[c], unit, repetition, cost).c_str(),
+                output);
+          fflush(output);
+        }
+        if (repetition == 0 || cost.wall_seconds < fastest.wall_seconds) {
+          fastest = cost;
+        }
+      }
+      AddToTotals(fastest, &totals[c]);
+    }
+  }
+  if (output != nullptr) {
+    fclose(output);
+  }
+  printf("%-28s %5s %6s %20s %20s %20s %20s\n", "configuration", "units",
+         "failed", "wall_s", "cpu_s", "max_peak_rss_mb", "output_mb");
+  for (size_t c = 0; c < configurations.size(); ++c) {
+    const Totals &t = totals[c];
+    auto base = baseline.find(configurations[c].name);
+    bool has_base = base != baseline.end();
+    Totals b = has_base ? base->second : Totals();
+    printf("%-28s %5zu %6zu %20s %20s %20s %20s\n", configurations[c].name,
+           t.units, t.failures,
+           Compare(t.wall_seconds, b.wall_seconds, has_base, "%.2f").c_str(),
+           Compare(t.cpu_seconds, b.cpu_seconds, has_base, "%.2f").c_str(),
+           Compare(t.peak_rss_bytes / 1048576.0, b.peak_rss_bytes / 1048576.0,
+                   has_base, "%.1f")
+               .c_str(),
+           Compare(t.output_bytes / 1048576.0, b.output_bytes / 1048576.0,
+                   has_base, "%.1f")
+               .c_str());
+  }
+  for (const auto &t : totals) {
+    if (t.failures != 0) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+}  // namespace
+}  // namespace kythe
+
+int main(int argc, char *argv[]) {
+  GOOGLE_PROTOBUF_VERIFY_VERSION;
+  google::InitGoogleLogging(argv[0]);
+  gflags::SetUsageMessage(
+      "corpus_benchmark --indexer=INDEXER --index_pack=DIR [indexer flags]");
+  gflags::ParseCommandLineFlags(&argc, &argv, true);
+  if (FLAGS_indexer.empty() || FLAGS_index_pack.empty()) {
+    fprintf(stderr, "Both --indexer and --index_pack are required.\n");
+    return 1;
+  }
+  return kythe::Run(std::vector<std::string>(argv + 1, argv + argc));
+}
@@ -0,0 +1,117 @@
+/*
+ * Copyright 2017 Google Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Benchmarks for `FileVNameGenerator`, which the extractor runs on every
+// required input.
+
+#include <string>
+#include <vector>
+
+#include "benchmark/benchmark.h"
+#include "glog/logging.h"
+#include "kythe/cxx/common/file_vname_generator.h"
+
+namespace kythe {
+namespace {
+
+/// A configuration shaped like a typical monorepo's: a few special cases
+/// followed by catch-all rules.
+const char kConfig[] = R"d([
+  {
+    "pattern": "bazel-out/[^/]+/(bin|genfiles)/(.*)",
+    "vname": {
+      "corpus": "kythe",
+      "root": "bazel-out/@1@",
+      "path": "@2@"
+    }
+  },
+  {
+    "pattern": "third_party/([^/]+)/(.*)",
+    "vname": {
+      "corpus": "third_party",
+      "root": "@1@",
+      "path": "@2@"
+    }
+  },
+  {
+    "pattern": "(/usr/include/c\\+\\+/[^/]+)/(.*)",
+    "vname": {
+      "corpus": "libstdcxx",
+      "root": "@1@",
+      "path": "@2@"
+    }
+  },
+  {
+    "pattern": "/usr/include/(.*)",
+    "vname": {
+      "corpus": "cstdlib",
+      "root": "/usr/include",
+      "path": "@1@"
+    }
+  },
+  {
+    "pattern": "(.*)",
+    "vname": {
+      "corpus": "kythe",
+      "path": "@1@"
+    }
+  }
+])d";
+
+/// \brief Returns paths that hit each rule of `kConfig` in turn.
+std::vector<std::string> MakePaths() {
+  std::vector<std::string> paths;
+  for (int i = 0; i < 64; ++i) {
+    std::string n = std::to_string(i);
+    paths.push_back("bazel-out/k8-fastbuild/bin/kythe/proto/p" + n + ".pb.h");
+    paths.push_back("third_party/llvm/include/llvm/ADT/Header" + n + ".h");
+    paths.push_back("/usr/include/c++/4.9/bits/header" + n + ".h");
+    paths.push_back("/usr/include/x86_64-linux-gnu/sys/h" + n + ".h");
+    paths.push_back("kythe/cxx/indexer/cxx/File" + n + ".cc");
+  }
+  return paths;
+}
+
+void BM_LookupVName(benchmark::State &state) {
+  FileVNameGenerator generator;
+  std::string error_text;
+  CHECK(generator.LoadJsonString(kConfig, &error_text)) << error_text;
+  const auto paths = MakePaths();
+  size_t next = 0;
+  while (state.KeepRunning()) {
+    benchmark::DoNotOptimize(
+        generator.LookupVName(paths[next++ % paths.size()]));
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_LookupVName);
+
+void BM_LookupVNameLastRule(benchmark::State &state) {
+  FileVNameGenerator generator;
+  std::string error_text;
+  CHECK(generator.LoadJsonString(kConfig, &error_text)) << error_text;
+  const std::string path = "kythe/cxx/indexer/cxx/KytheGraphObserver.cc";
+  while (state.KeepRunning()) {
+    benchmark::DoNotOptimize(generator.LookupVName(path));
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_LookupVNameLastRule);
+
+}  // namespace
+}  // namespace kythe
+
+BENCHMARK_MAIN();
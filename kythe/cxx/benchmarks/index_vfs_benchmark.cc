@@ -0,0 +1,134 @@
+/*
+ * Copyright 2017 Google Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Benchmarks for `IndexVFS` path lookups, which clang makes for every
+// header search and every `#include`.
+
+#include <string>
+#include <vector>
+
+#include "benchmark/benchmark.h"
+#include "kythe/cxx/common/indexing/KytheVFS.h"
+#include "kythe/proto/analysis.pb.h"
+
+namespace kythe {
+namespace {
+
+/// \brief Returns the paths of `count` headers spread over a few nested
+/// directories, like a unit's required inputs.
+std::vector<std::string> MakePaths(size_t count) {
+  std::vector<std::string> paths;
+  for (size_t i = 0; i < count; ++i) {
+    paths.push_back("/root/third_party/lib" + std::to_string(i % 16) +
+                    "/include/sub" + std::to_string(i % 7) + "/header" +
+                    std::to_string(i) + ".h");
+  }
+  return paths;
+}
+
+/// \brief Builds the `FileData` for `paths`, with small fixed content.
+google::protobuf::RepeatedPtrField<proto::FileData> MakeFiles(
+    const std::vector<std::string> &paths) {
+  google::protobuf::RepeatedPtrField<proto::FileData> files;
+  for (const auto &path : paths) {
+    proto::FileData *file = files.Add();
+    file->mutable_info()->set_path(path);
+    file->set_content("#pragma once\n");
+  }
+  return files;
+}
+
+void BM_IndexVFSCreate(benchmark::State &state) {
+  const auto files = MakeFiles(MakePaths(state.range(0)));
+  while (state.KeepRunning()) {
+    IndexVFS vfs("/root", files, {});
+    benchmark::DoNotOptimize(&vfs);
+  }
+  state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_IndexVFSCreate)->Range(64, 8192);
+
+void BM_IndexVFSStatus(benchmark::State &state) {
+  const auto paths = MakePaths(4096);
+  const auto files = MakeFiles(paths);
+  IndexVFS vfs("/root", files, {});
+  size_t next = 0;
+  while (state.KeepRunning()) {
+    benchmark::DoNotOptimize(vfs.status(paths[next++ % paths.size()]));
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_IndexVFSStatus);
+
+// Relative paths with redundant components are normalized against the
+// working directory on every lookup.
+void BM_IndexVFSStatusRelative(benchmark::State &state) {
+  const auto paths = MakePaths(4096);
+  const auto files = MakeFiles(paths);
+  IndexVFS vfs("/root", files, {});
+  std::vector<std::string> relative_paths;
+  for (const auto &path : paths) {
+    relative_paths.push_back("./third_party/../" + path.substr(6));
+  }
+  size_t next = 0;
+  while (state.KeepRunning()) {
+    benchmark::DoNotOptimize(
+        vfs.status(relative_paths[next++ % relative_paths.size()]));
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_IndexVFSStatusRelative);
+
+void BM_IndexVFSStatusMissing(benchmark::State &state) {
+  const auto paths = MakePaths(4096);
+  const auto files = MakeFiles(paths);
+  IndexVFS vfs("/root", files, {});
+  std::vector<std::string> missing_paths;
+  for (const auto &path : paths) {
+    missing_paths.push_back(path + ".missing");
+  }
+  size_t next = 0;
+  while (state.KeepRunning()) {
+    benchmark::DoNotOptimize(
+        vfs.status(missing_paths[next++ % missing_paths.size()]));
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_IndexVFSStatusMissing);
+
+// Header search probes each include directory in turn, so most lookups are
+// for paths that don't exist under the first `-I` directories.
+void BM_IndexVFSHeaderSearch(benchmark::State &state) {
+  const auto paths = MakePaths(4096);
+  const auto files = MakeFiles(paths);
+  IndexVFS vfs("/root", files, {});
+  std::vector<std::string> probes;
+  for (int dir = 0; dir < state.range(0); ++dir) {
+    probes.push_back("/root/include" + std::to_string(dir) + "/" +
+                     paths[dir].substr(6));
+  }
+  size_t next = 0;
+  while (state.KeepRunning()) {
+    benchmark::DoNotOptimize(vfs.status(probes[next++ % probes.size()]));
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_IndexVFSHeaderSearch)->Arg(8)->Arg(64);
+
+}  // namespace
+}  // namespace kythe
+
+BENCHMARK_MAIN();
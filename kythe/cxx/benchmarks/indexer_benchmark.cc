@@ -0,0 +1,103 @@
+/*
+ * Copyright 2017 Google Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Benchmarks for indexing small synthetic translation units.
+//
+// `KytheGraphObserver::VNameFromRange` is private and needs a live
+// `SourceManager`, so it is measured by indexing sources that are mostly
+// references: the difference between `BM_IndexWithKytheObserver` and
+// `BM_IndexWithNullObserver` on the same input is the cost of the Kythe
+// observer, of which building anchor VNames is the largest part.
+
+#include <memory>
+#include <string>
+
+#include "benchmark/benchmark.h"
+#include "clang/Frontend/FrontendAction.h"
+#include "glog/logging.h"
+#include "kythe/cxx/common/indexing/KytheClaimClient.h"
+#include "kythe/cxx/common/indexing/KytheGraphRecorder.h"
+#include "kythe/cxx/common/indexing/KytheOutputStream.h"
+#include "kythe/cxx/common/indexing/KytheVFS.h"
+#include "kythe/cxx/common/kythe_metadata_file.h"
+#include "kythe/cxx/indexer/cxx/GraphObserver.h"
+#include "kythe/cxx/indexer/cxx/IndexerFrontendAction.h"
+#include "kythe/cxx/indexer/cxx/KytheGraphObserver.h"
+#include "kythe/cxx/indexer/cxx/indexer_worklist.h"
+
+namespace kythe {
+namespace {
+
+/// \brief Returns a translation unit with `count` variables, each of which
+/// is referenced four times.
+std::string MakeSource(size_t count) {
+  std::string source;
+  for (size_t i = 0; i < count; ++i) {
+    source += "int v" + std::to_string(i) + ";\n";
+  }
+  source += "void use() {\n";
+  for (size_t i = 0; i < count; ++i) {
+    std::string v = "v" + std::to_string(i);
+    source += "  " + v + " = " + v + " + " + v + " * " + v + ";\n";
+  }
+  source += "}\n";
+  return source;
+}
+
+/// \brief Indexes `source` with `observer`.
+void Index(GraphObserver *observer, const std::string &source) {
+  std::unique_ptr<clang::FrontendAction> action(new IndexerFrontendAction(
+      observer, nullptr, [] { return false; },
+      [](IndexerASTVisitor *visitor) {
+        return IndexerWorklist::CreateDefaultWorklist(visitor);
+      }));
+  CHECK(RunToolOnCode(std::move(action), source, "input.cc"));
+}
+
+void BM_IndexWithNullObserver(benchmark::State &state) {
+  const std::string source = MakeSource(state.range(0));
+  while (state.KeepRunning()) {
+    NodeIdArena arena;
+    NodeIdArena::Scope arena_scope(&arena);
+    NullGraphObserver observer;
+    Index(&observer, source);
+  }
+  state.SetItemsProcessed(state.iterations() * state.range(0) * 4);
+}
+BENCHMARK(BM_IndexWithNullObserver)->Range(64, 4096);
+
+void BM_IndexWithKytheObserver(benchmark::State &state) {
+  const std::string source = MakeSource(state.range(0));
+  MetadataSupports meta_supports;
+  while (state.KeepRunning()) {
+    NodeIdArena arena;
+    NodeIdArena::Scope arena_scope(&arena);
+    NullOutputStream output;
+    KytheGraphRecorder recorder(&output);
+    StaticClaimClient claim_client;
+    llvm::IntrusiveRefCntPtr<IndexVFS> vfs(new IndexVFS("/", {}, {}, {}));
+    KytheGraphObserver observer(&recorder, &claim_client, &meta_supports, vfs,
+                                [](const char *, ProfilingEvent) {});
+    Index(&observer, source);
+  }
+  state.SetItemsProcessed(state.iterations() * state.range(0) * 4);
+}
+BENCHMARK(BM_IndexWithKytheObserver)->Range(64, 4096);
+
+}  // namespace
+}  // namespace kythe
+
+BENCHMARK_MAIN();
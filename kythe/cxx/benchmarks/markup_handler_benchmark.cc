@@ -0,0 +1,75 @@
+/*
+ * Copyright 2017 Google Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Benchmarks for `HandleMarkup` on long, heavily annotated doc comments.
+
+#include <string>
+
+#include "benchmark/benchmark.h"
+#include "kythe/cxx/doc/html_markup_handler.h"
+#include "kythe/cxx/doc/javadoxygen_markup_handler.h"
+#include "kythe/cxx/doc/markup_handler.h"
+#include "kythe/proto/xref.pb.h"
+
+namespace kythe {
+namespace {
+
+/// \brief Returns a comment with `paragraphs` paragraphs, each of which mixes
+/// links, HTML, escapes and Javadoc/Doxygen tags.
+proto::Printable MakeComment(size_t paragraphs) {
+  proto::Printable printable;
+  std::string *text = printable.mutable_raw_text();
+  for (size_t i = 0; i < paragraphs; ++i) {
+    text->append("<p>Calls [Frobnicate] with <b>bold</b>, <i>italic</i> and ");
+    text->append("{@code [Widget]&lt;T&gt;} text.\n<ul><li>one<li>two</ul>\n");
+    printable.add_link()->add_definition("kythe://c?lang=c++#Frobnicate");
+    printable.add_link()->add_definition("kythe://c?lang=c++#Widget");
+  }
+  for (size_t i = 0; i < paragraphs; ++i) {
+    text->append("@param p" + std::to_string(i) + " a \\c parameter\n");
+  }
+  text->append("\\return nothing of note\n");
+  return printable;
+}
+
+void BM_HandleMarkup(benchmark::State &state) {
+  const Printable printable(MakeComment(state.range(0)));
+  while (state.KeepRunning()) {
+    benchmark::DoNotOptimize(
+        HandleMarkup({ParseJavadoxygen, ParseHtml}, printable));
+  }
+  state.SetBytesProcessed(state.iterations() * printable.text().size());
+}
+BENCHMARK(BM_HandleMarkup)->Arg(1)->Arg(16)->Arg(256)->Arg(4096);
+
+void BM_MergeSpans(benchmark::State &state) {
+  const Printable printable(MakeComment(state.range(0)));
+  PrintableSpans more;
+  ParseJavadoxygen(printable, printable.spans(), &more);
+  while (state.KeepRunning()) {
+    PrintableSpans spans = printable.spans();
+    spans.Merge(more);
+    benchmark::DoNotOptimize(spans.size());
+  }
+  state.SetItemsProcessed(state.iterations() *
+                          (printable.spans().size() + more.size()));
+}
+BENCHMARK(BM_MergeSpans)->Arg(16)->Arg(256)->Arg(4096);
+
+}  // namespace
+}  // namespace kythe
+
+BENCHMARK_MAIN();
@@ -0,0 +1,239 @@
+/*
+ * Copyright 2017 Google Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Benchmarks for the code between the graph observer and the output file:
+// `BufferStack`, `FileOutputStream`, `KytheGraphRecorder` and the hash caches
+// that concurrent workers share.
+
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "benchmark/benchmark.h"
+#include "google/protobuf/io/zero_copy_stream.h"
+#include "kythe/cxx/common/indexing/KytheGraphRecorder.h"
+#include "kythe/cxx/common/indexing/KytheOutputStream.h"
+
+namespace kythe {
+namespace {
+
+/// \brief A `ZeroCopyOutputStream` that throws away everything written to it.
+class DiscardingOutputStream
+    : public google::protobuf::io::ZeroCopyOutputStream {
+ public:
+  bool Next(void **data, int *size) override {
+    *data = buffer_;
+    *size = sizeof(buffer_);
+    byte_count_ += sizeof(buffer_);
+    return true;
+  }
+  void BackUp(int count) override { byte_count_ -= count; }
+  google::protobuf::int64 ByteCount() const override { return byte_count_; }
+
+ private:
+  char buffer_[8192];
+  google::protobuf::int64 byte_count_ = 0;
+};
+
+/// \brief Fills `signatures` with `count` distinct, anchor-like signatures.
+void MakeSignatures(size_t count, std::vector<std::string> *signatures) {
+  signatures->clear();
+  for (size_t i = 0; i < count; ++i) {
+    signatures->push_back("kythe/cxx/indexer/cxx/KytheGraphObserver.cc@" +
+                          std::to_string(i * 16) + ":" +
+                          std::to_string(i * 16 + 7));
+  }
+}
+
+/// \brief A VName for a node in a synthetic file.
+VNameRef MakeVName(const std::string &signature) {
+  VNameRef vname;
+  vname.signature = signature;
+  vname.corpus = "kythe";
+  vname.path = "kythe/cxx/indexer/cxx/KytheGraphObserver.cc";
+  vname.language = "c++";
+  return vname;
+}
+
+void BM_BufferStackWriteToTop(benchmark::State &state) {
+  const size_t write_size = state.range(0);
+  BufferStack stack;
+  while (state.KeepRunning()) {
+    stack.Push(4096);
+    for (size_t i = 0; i < 64; ++i) {
+      benchmark::DoNotOptimize(stack.WriteToTop(write_size));
+    }
+    stack.MergeDownIfTooSmall(1024, 16384);
+    stack.Pop();
+  }
+  state.SetBytesProcessed(state.iterations() * 64 * write_size);
+}
+BENCHMARK(BM_BufferStackWriteToTop)->Arg(16)->Arg(128)->Arg(1024);
+
+void HashTop(benchmark::State &state, BufferDigest digest) {
+  const size_t size = state.range(0);
+  BufferStack stack;
+  stack.set_digest(digest);
+  stack.Push(size);
+  memset(stack.WriteToTop(size), 'k', size);
+  HashCache::Hash hash;
+  while (state.KeepRunning()) {
+    stack.HashTop(&hash);
+    benchmark::DoNotOptimize(hash);
+  }
+  state.SetBytesProcessed(state.iterations() * size);
+}
+
+void BM_BufferStackHashTop(benchmark::State &state) {
+  HashTop(state, BufferDigest::kSha256);
+}
+BENCHMARK(BM_BufferStackHashTop)->Range(256, 64 << 10);
+
+void BM_BufferStackHashTopMurmur3(benchmark::State &state) {
+  HashTop(state, BufferDigest::kMurmur3);
+}
+BENCHMARK(BM_BufferStackHashTopMurmur3)->Range(256, 64 << 10);
+
+void BM_FileOutputStreamEmitFact(benchmark::State &state) {
+  std::vector<std::string> signatures;
+  MakeSignatures(1024, &signatures);
+  DiscardingOutputStream raw_stream;
+  FileOutputStream stream(&raw_stream);
+  stream.set_flush_after_each_entry(false);
+  size_t next = 0;
+  while (state.KeepRunning()) {
+    VNameRef vname = MakeVName(signatures[next++ % signatures.size()]);
+    stream.Emit(FactRef{&vname, "/kythe/node/kind", "anchor"});
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_FileOutputStreamEmitFact);
+
+// Every iteration writes the same buffer, so all but the first are dropped
+// by the hash cache after being hashed.
+void BM_FileOutputStreamEmitBuffered(benchmark::State &state) {
+  const size_t entries = state.range(0);
+  std::vector<std::string> signatures;
+  MakeSignatures(entries, &signatures);
+  DiscardingOutputStream raw_stream;
+  FileOutputStream stream(&raw_stream);
+  stream.set_flush_after_each_entry(false);
+  while (state.KeepRunning()) {
+    stream.PushBuffer();
+    for (const auto &signature : signatures) {
+      VNameRef vname = MakeVName(signature);
+      stream.Emit(EdgeRef{&vname, "/kythe/edge/childof", &vname});
+    }
+    stream.PopBuffer();
+  }
+  state.SetItemsProcessed(state.iterations() * entries);
+}
+BENCHMARK(BM_FileOutputStreamEmitBuffered)->Range(8, 4096);
+
+void BM_RecorderAddEdge(benchmark::State &state) {
+  std::vector<std::string> signatures;
+  MakeSignatures(1024, &signatures);
+  DiscardingOutputStream raw_stream;
+  FileOutputStream stream(&raw_stream);
+  stream.set_flush_after_each_entry(false);
+  KytheGraphRecorder recorder(&stream);
+  size_t next = 0;
+  while (state.KeepRunning()) {
+    VNameRef from = MakeVName(signatures[next++ % signatures.size()]);
+    VNameRef to = MakeVName(signatures[next % signatures.size()]);
+    recorder.AddEdge(from, EdgeKindID::kRef, to);
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_RecorderAddEdge);
+
+void BM_RecorderAddOrdinalEdge(benchmark::State &state) {
+  std::vector<std::string> signatures;
+  MakeSignatures(1024, &signatures);
+  DiscardingOutputStream raw_stream;
+  FileOutputStream stream(&raw_stream);
+  stream.set_flush_after_each_entry(false);
+  KytheGraphRecorder recorder(&stream);
+  size_t next = 0;
+  while (state.KeepRunning()) {
+    VNameRef from = MakeVName(signatures[next++ % signatures.size()]);
+    VNameRef to = MakeVName(signatures[next % signatures.size()]);
+    recorder.AddEdge(from, EdgeKindID::kParam, to, next % 8);
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_RecorderAddOrdinalEdge);
+
+/// \return the hashes looked up by the hash cache benchmarks.
+const std::vector<std::array<unsigned char, HashCache::kHashSize>> &
+SharedHashes() {
+  static const auto *hashes = [] {
+    auto *hashes =
+        new std::vector<std::array<unsigned char, HashCache::kHashSize>>(4096);
+    for (size_t i = 0; i < hashes->size(); ++i) {
+      uint64_t key = (i + 1) * 0x9e3779b97f4a7c15ull;
+      (*hashes)[i].fill(0);
+      ::memcpy((*hashes)[i].data(), &key, sizeof(key));
+    }
+    return hashes;
+  }();
+  return *hashes;
+}
+
+/// \return the cache shared by the hash cache benchmarks' threads. Like
+/// --cache_bloom_bits without --cache, it only deduplicates in-process.
+HashCache *SharedLayeredCache() {
+  static HashCache *remote = new HashCache;
+  static HashCache *cache = new LayeredHashCache(remote, 0, 1 << 20);
+  return cache;
+}
+
+/// \brief Looks up the same hashes through `cache` on each of the
+/// benchmark's threads, registering the misses, as workers indexing units
+/// that share headers would.
+void LookUpSharedHashes(benchmark::State &state, HashCache *cache) {
+  const auto &hashes = SharedHashes();
+  size_t next = state.thread_index * hashes.size() / state.threads;
+  while (state.KeepRunning()) {
+    const auto &hash = *reinterpret_cast<const HashCache::Hash *>(
+        hashes[next++ % hashes.size()].data());
+    if (!cache->SawHash(hash)) {
+      cache->RegisterHash(hash);
+    }
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+
+void BM_LockingHashCacheLookups(benchmark::State &state) {
+  static LockingHashCache *cache = new LockingHashCache(SharedLayeredCache());
+  LookUpSharedHashes(state, cache);
+}
+BENCHMARK(BM_LockingHashCacheLookups)->ThreadRange(1, 8);
+
+void BM_ConcurrentHashCacheLookups(benchmark::State &state) {
+  static ConcurrentHashCache *cache =
+      new ConcurrentHashCache(SharedLayeredCache(), 1 << 16, 64);
+  ConcurrentHashCache::Worker worker(cache);
+  LookUpSharedHashes(state, &worker);
+}
+BENCHMARK(BM_ConcurrentHashCacheLookups)->ThreadRange(1, 8);
+
+}  // namespace
+}  // namespace kythe
+
+BENCHMARK_MAIN();
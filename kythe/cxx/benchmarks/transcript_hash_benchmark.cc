@@ -0,0 +1,96 @@
+/*
+ * Copyright 2017 Google Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Benchmarks for the transcript hash the extractor updates on every
+// preprocessor event, against the per-event SHA-256 it replaced.
+
+#include <string>
+#include <vector>
+
+#include <openssl/sha.h>
+
+#include "benchmark/benchmark.h"
+#include "kythe/cxx/extractor/transcript_hash.h"
+
+namespace kythe {
+namespace {
+
+/// \brief Returns `count` macro names like those seen in system headers.
+std::vector<std::string> MakeMacroNames(size_t count) {
+  std::vector<std::string> names;
+  for (size_t i = 0; i < count; ++i) {
+    names.push_back("_GLIBCXX_HAVE_FEATURE_" + std::to_string(i));
+  }
+  return names;
+}
+
+/// \brief Feeds `state.range(0)` events shaped like a `MacroDefined` (an
+/// offset and a name) followed by a `RecordSpecificLocation` (an offset and
+/// a VName) into `Hash`, then completes the transcript.
+template <typename Hash>
+void HashEvents(benchmark::State &state) {
+  const auto names = MakeMacroNames(state.range(0));
+  const std::string vname = "kythe/usr/include/c++/v1/cstddefc++";
+  size_t bytes = 0;
+  while (state.KeepRunning()) {
+    Hash hash;
+    for (unsigned offset = 0; offset < names.size(); ++offset) {
+      hash.Update(offset);
+      hash.Update(names[offset]);
+      hash.Update(offset);
+      hash.Update(vname);
+    }
+    benchmark::DoNotOptimize(hash.CompleteAndReset());
+  }
+  for (const auto &name : names) {
+    bytes += 2 * sizeof(unsigned) + name.size() + vname.size();
+  }
+  state.SetBytesProcessed(state.iterations() * bytes);
+}
+
+/// \brief The extractor's old running hash: SHA-256 over every event.
+class Sha256Hash {
+ public:
+  Sha256Hash() { ::SHA256_Init(&context_); }
+  void Update(const std::string &string) {
+    ::SHA256_Update(&context_, string.data(), string.size());
+  }
+  void Update(unsigned u) { ::SHA256_Update(&context_, &u, sizeof(u)); }
+  std::string CompleteAndReset() {
+    unsigned char sha_buf[SHA256_DIGEST_LENGTH];
+    ::SHA256_Final(sha_buf, &context_);
+    ::SHA256_Init(&context_);
+    return std::string(reinterpret_cast<char *>(sha_buf), sizeof(sha_buf));
+  }
+
+ private:
+  ::SHA256_CTX context_;
+};
+
+void BM_Sha256Transcript(benchmark::State &state) {
+  HashEvents<Sha256Hash>(state);
+}
+BENCHMARK(BM_Sha256Transcript)->Arg(16)->Arg(256)->Arg(4096);
+
+void BM_TranscriptHash(benchmark::State &state) {
+  HashEvents<TranscriptHash>(state);
+}
+BENCHMARK(BM_TranscriptHash)->Arg(16)->Arg(256)->Arg(4096);
+
+}  // namespace
+}  // namespace kythe
+
+BENCHMARK_MAIN();
@@ -0,0 +1,477 @@
+/*
+ * Copyright 2017 Google Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Benchmarks for the verifier on synthetic databases of 10^4 to 10^7 facts:
+// loading entries, `PrepareDatabase`, and solving a few common shapes of
+// goal. These are slow at the larger sizes; pick some with, for example,
+//   --benchmark_filter='Prepare.*/1000000'
+
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "benchmark/benchmark.h"
+#include "google/protobuf/io/coded_stream.h"
+#include "google/protobuf/io/zero_copy_stream_impl_lite.h"
+#include "kythe/cxx/verifier/entry_stream_loader.h"
+#include "kythe/cxx/verifier/verifier.h"
+#include "kythe/proto/storage.pb.h"
+
+namespace kythe {
+namespace verifier {
+namespace {
+
+/// The number of nodes of each kind that a synthetic graph remembers so that
+/// goals can be written about them.
+constexpr size_t kSampleCount = 1000;
+
+/// \brief A synthetic database, along with samples of its nodes.
+struct SyntheticGraph {
+  /// \brief An anchor that refers to some node.
+  struct Anchor {
+    /// The anchor's VName, in goal syntax.
+    std::string vname;
+    size_t start;
+    size_t end;
+    /// The VName of the node the anchor refers to, in goal syntax.
+    std::string target;
+    /// The kind of the node the anchor refers to.
+    std::string target_kind;
+    /// The VName of the anchor's file, in goal syntax.
+    std::string file;
+  };
+  /// The varint-delimited wire-format entries.
+  std::string entries;
+  /// The number of entries in `entries`.
+  size_t fact_count = 0;
+  /// Reference anchors.
+  std::vector<Anchor> anchors;
+  /// The VNames of variables, each of which is a child of a function, which
+  /// is a child of a record, which is a child of a namespace.
+  std::vector<std::string> variables;
+};
+
+/// \brief Generates a database shaped like the indexer's output for a corpus
+/// of similar C++ files.
+///
+/// Each file has a namespace holding a few classes; each class has a few
+/// methods; each method has parameters and locals. Every declaration has a
+/// defining anchor. Every method has a few references: half to declarations
+/// in the same file and half to declarations anywhere, skewed towards the
+/// earliest (think of a common header).
+class GraphGenerator {
+ public:
+  static constexpr size_t kRecordsPerFile = 4;
+  static constexpr size_t kFunctionsPerRecord = 4;
+  static constexpr size_t kVariablesPerFunction = 3;
+  static constexpr size_t kParamsPerFunction = 2;
+  static constexpr size_t kRefsPerFunction = 4;
+
+  /// \brief Generates whole files until there are at least `fact_count`
+  /// facts.
+  static void Generate(size_t fact_count, SyntheticGraph *graph) {
+    GraphGenerator generator(graph);
+    while (graph->fact_count < fact_count) {
+      generator.GenerateFile();
+    }
+  }
+
+ private:
+  /// \brief A declared node.
+  struct Decl {
+    proto::VName vname;
+    std::string name;
+    std::string kind;
+  };
+
+  explicit GraphGenerator(SyntheticGraph *graph)
+      : graph_(graph),
+        string_stream_(&graph->entries),
+        rng_(0x4b797468),
+        stream_(new google::protobuf::io::CodedOutputStream(&string_stream_)) {
+  }
+
+  ~GraphGenerator() {
+    // Flush the coded stream before the string stream goes away.
+    stream_.reset();
+  }
+
+  void GenerateFile() {
+    size_t file_index = file_count_++;
+    file_ = proto::VName();
+    file_.set_corpus("kythe");
+    file_.set_path("src/dir" + std::to_string(file_index % 97) + "/file" +
+                   std::to_string(file_index) + ".cc");
+    text_.clear();
+    file_decls_.clear();
+    Decl ns = Declare("package", "ns" + std::to_string(file_index % 13));
+    for (size_t r = 0; r < kRecordsPerFile; ++r) {
+      Decl record = Declare("record", "C" + std::to_string(r));
+      EmitFact(record.vname, "/kythe/subkind", "class");
+      EmitFact(record.vname, "/kythe/complete", "definition");
+      EmitEdge(record.vname, "/kythe/edge/childof", ns.vname);
+      for (size_t f = 0; f < kFunctionsPerRecord; ++f) {
+        Decl function = Declare("function", "f" + std::to_string(f));
+        EmitFact(function.vname, "/kythe/complete", "definition");
+        EmitEdge(function.vname, "/kythe/edge/childof", record.vname);
+        for (size_t v = 0; v < kVariablesPerFunction; ++v) {
+          Decl variable = Declare("variable", "v" + std::to_string(v));
+          EmitEdge(variable.vname, "/kythe/edge/childof", function.vname);
+          if (v < kParamsPerFunction) {
+            EmitEdge(function.vname, "/kythe/edge/param." + std::to_string(v),
+                     variable.vname);
+          }
+          Sample(VNameGoal(variable.vname), &graph_->variables,
+                 &variables_seen_);
+        }
+        for (size_t i = 0; i < kRefsPerFunction; ++i) {
+          GenerateRef();
+        }
+      }
+    }
+    EmitFact(file_, "/kythe/node/kind", "file");
+    EmitFact(file_, "/kythe/text", text_);
+  }
+
+  /// \brief Makes a node with a defining anchor and adds it to the file's
+  /// text.
+  Decl Declare(const std::string &kind, const std::string &name) {
+    Decl decl;
+    decl.vname = file_;
+    decl.vname.set_language("c++");
+    decl.vname.set_signature(name + "#" + std::to_string(decl_count_++));
+    decl.name = name;
+    decl.kind = kind;
+    EmitFact(decl.vname, "/kythe/node/kind", kind);
+    proto::VName anchor = EmitAnchor(name);
+    EmitEdge(anchor, "/kythe/edge/defines/binding", decl.vname);
+    file_decls_.push_back(decl);
+    if (decls_.size() < kSampleCount * 16) {
+      decls_.push_back(decl);
+    }
+    return decl;
+  }
+
+  /// \brief Makes an anchor that refers to some earlier declaration.
+  void GenerateRef() {
+    std::uniform_real_distribution<double> unit(0.0, 1.0);
+    const Decl *target;
+    if (rng_() % 2) {
+      target = &file_decls_[rng_() % file_decls_.size()];
+    } else {
+      double skew = unit(rng_);
+      target = &decls_[static_cast<size_t>(skew * skew * decls_.size())];
+    }
+    size_t start = text_.size();
+    proto::VName anchor = EmitAnchor(target->name);
+    EmitEdge(anchor, "/kythe/edge/ref", target->vname);
+    SyntheticGraph::Anchor sample;
+    sample.vname = VNameGoal(anchor);
+    sample.start = start;
+    sample.end = start + target->name.size();
+    sample.target = VNameGoal(target->vname);
+    sample.target_kind = target->kind;
+    sample.file = VNameGoal(file_);
+    Sample(sample, &graph_->anchors, &anchors_seen_);
+  }
+
+  /// \brief Appends `token` to the file's text and makes an anchor for it.
+  proto::VName EmitAnchor(const std::string &token) {
+    size_t start = text_.size();
+    size_t end = start + token.size();
+    text_ += token;
+    text_ += (rng_() % 8) ? " " : "\n";
+    proto::VName anchor = file_;
+    anchor.set_language("c++");
+    anchor.set_signature("@" + std::to_string(start) + ":" +
+                         std::to_string(end));
+    EmitFact(anchor, "/kythe/node/kind", "anchor");
+    EmitFact(anchor, "/kythe/loc/start", std::to_string(start));
+    EmitFact(anchor, "/kythe/loc/end", std::to_string(end));
+    EmitEdge(anchor, "/kythe/edge/childof", file_);
+    return anchor;
+  }
+
+  void EmitFact(const proto::VName &source, const std::string &name,
+                const std::string &value) {
+    proto::Entry entry;
+    *entry.mutable_source() = source;
+    entry.set_fact_name(name);
+    entry.set_fact_value(value);
+    Emit(entry);
+  }
+
+  void EmitEdge(const proto::VName &source, const std::string &kind,
+                const proto::VName &target) {
+    proto::Entry entry;
+    *entry.mutable_source() = source;
+    entry.set_edge_kind(kind);
+    *entry.mutable_target() = target;
+    entry.set_fact_name("/");
+    Emit(entry);
+  }
+
+  void Emit(const proto::Entry &entry) {
+    stream_->WriteVarint32(entry.ByteSize());
+    entry.SerializeWithCachedSizes(stream_.get());
+    ++graph_->fact_count;
+  }
+
+  /// \brief Keeps a uniform sample of `kSampleCount` of the values passed in
+  /// (reservoir sampling).
+  template <typename T>
+  void Sample(const T &value, std::vector<T> *samples, size_t *seen) {
+    size_t index = (*seen)++;
+    if (samples->size() < kSampleCount) {
+      samples->push_back(value);
+    } else if ((index = rng_() % (index + 1)) < kSampleCount) {
+      (*samples)[index] = value;
+    }
+  }
+
+  /// \return `vname` in the syntax used by goals.
+  static std::string VNameGoal(const proto::VName &vname) {
+    return "vname(\"" + vname.signature() + "\", \"" + vname.corpus() +
+           "\", \"" + vname.root() + "\", \"" + vname.path() + "\", \"" +
+           vname.language() + "\")";
+  }
+
+  SyntheticGraph *graph_;
+  google::protobuf::io::StringOutputStream string_stream_;
+  std::mt19937 rng_;
+  std::unique_ptr<google::protobuf::io::CodedOutputStream> stream_;
+  /// The file being generated, and its text so far.
+  proto::VName file_;
+  std::string text_;
+  /// Declarations in the file being generated.
+  std::vector<Decl> file_decls_;
+  /// The first declarations in the graph, which are the ones that other
+  /// files refer to.
+  std::vector<Decl> decls_;
+  size_t file_count_ = 0;
+  size_t decl_count_ = 0;
+  size_t anchors_seen_ = 0;
+  size_t variables_seen_ = 0;
+};
+
+/// \return a synthetic graph with at least `fact_count` facts. The last graph
+/// is cached, since generating the larger ones takes a while.
+const SyntheticGraph &GraphWithFacts(size_t fact_count) {
+  static size_t cached_fact_count = 0;
+  static std::unique_ptr<SyntheticGraph> cached_graph;
+  if (!cached_graph || cached_fact_count != fact_count) {
+    cached_graph.reset();
+    cached_graph.reset(new SyntheticGraph());
+    GraphGenerator::Generate(fact_count, cached_graph.get());
+    cached_fact_count = fact_count;
+  }
+  return *cached_graph;
+}
+
+/// \brief Loads `graph` into `verifier`.
+bool LoadGraph(const SyntheticGraph &graph, std::string *database_name,
+               Verifier *verifier) {
+  google::protobuf::io::ArrayInputStream input(
+      graph.entries.data(), graph.entries.size(), 1 << 20);
+  EntryStreamLoader loader(verifier, database_name);
+  std::string error_text;
+  return loader.Load(&input, &error_text);
+}
+
+/// \brief Goals that find anchors by their offsets and check what they refer
+/// to, as `@token ref Node` does.
+std::string AnchorGoals(const SyntheticGraph &graph) {
+  std::string goals;
+  for (size_t i = 0; i < graph.anchors.size(); ++i) {
+    const auto &anchor = graph.anchors[i];
+    std::string a = "A" + std::to_string(i);
+    std::string n = "N" + std::to_string(i);
+    goals += "#- { " + a + ".loc/start \"" + std::to_string(anchor.start) +
+             "\"\n#-   " + a + ".loc/end \"" + std::to_string(anchor.end) +
+             "\"\n#-   " + a + " ref " + n + "\n#-   " + n + ".node/kind " +
+             anchor.target_kind + " }\n";
+  }
+  return goals;
+}
+
+/// \brief Goals that walk from a variable up to its namespace.
+std::string ChainGoals(const SyntheticGraph &graph) {
+  std::string goals;
+  for (size_t i = 0; i < graph.variables.size(); ++i) {
+    std::string index = std::to_string(i);
+    goals += "#- { " + graph.variables[i] + " childof F" + index + "\n#-   F" +
+             index + " childof R" + index + "\n#-   R" + index + " childof P" +
+             index + "\n#-   P" + index + ".node/kind package }\n";
+  }
+  return goals;
+}
+
+/// \brief Goals that check that anchors don't refer to the wrong node, both
+/// directly and through an anchor found by its offsets and file. (Anchors at
+/// the same offsets in other files may well refer to that node.)
+std::string NegatedGoals(const SyntheticGraph &graph) {
+  std::string goals;
+  for (size_t i = 0; i < graph.anchors.size(); ++i) {
+    const auto &anchor = graph.anchors[i];
+    const auto &other = graph.anchors[(i + 1) % graph.anchors.size()];
+    if (anchor.target == other.target) {
+      continue;
+    }
+    std::string a = "B" + std::to_string(i);
+    goals += "#- !{ " + anchor.vname + " ref " + other.target + " }\n";
+    goals += "#- !{ " + a + ".loc/start \"" + std::to_string(anchor.start) +
+             "\"\n#-    " + a + ".loc/end \"" + std::to_string(anchor.end) +
+             "\"\n#-    " + a + " childof " + anchor.file + "\n#-    " + a +
+             " ref " + other.target + " }\n";
+  }
+  return goals;
+}
+
+/// \brief Registers the database sizes to benchmark against.
+void DatabaseSizes(benchmark::internal::Benchmark *benchmark) {
+  for (size_t facts = 10000; facts <= 10000000; facts *= 10) {
+    benchmark->Arg(facts);
+  }
+}
+
+/// \brief Registers the database sizes to benchmark against, each with one
+/// and with four threads.
+void DatabaseSizesAndThreads(benchmark::internal::Benchmark *benchmark) {
+  for (size_t facts = 10000; facts <= 10000000; facts *= 10) {
+    benchmark->ArgPair(facts, 1);
+    benchmark->ArgPair(facts, 4);
+  }
+}
+
+void BM_LoadEntries(benchmark::State &state) {
+  const SyntheticGraph &graph = GraphWithFacts(state.range(0));
+  std::string database_name = "synthetic";
+  while (state.KeepRunning()) {
+    state.PauseTiming();
+    std::unique_ptr<Verifier> verifier(new Verifier());
+    state.ResumeTiming();
+    if (!LoadGraph(graph, &database_name, verifier.get())) {
+      state.SkipWithError("couldn't load the graph");
+      break;
+    }
+    state.PauseTiming();
+    verifier.reset();
+    state.ResumeTiming();
+  }
+  state.SetItemsProcessed(state.iterations() * graph.fact_count);
+  state.SetBytesProcessed(state.iterations() * graph.entries.size());
+}
+BENCHMARK(BM_LoadEntries)->Apply(DatabaseSizes)->Unit(benchmark::kMillisecond);
+
+void BM_PrepareDatabase(benchmark::State &state) {
+  const SyntheticGraph &graph = GraphWithFacts(state.range(0));
+  std::string database_name = "synthetic";
+  while (state.KeepRunning()) {
+    state.PauseTiming();
+    std::unique_ptr<Verifier> verifier(new Verifier());
+    verifier->SetThreadCount(state.range(1));
+    if (!LoadGraph(graph, &database_name, verifier.get())) {
+      state.SkipWithError("couldn't load the graph");
+      break;
+    }
+    state.ResumeTiming();
+    if (!verifier->PrepareDatabase()) {
+      state.SkipWithError("the graph isn't well-formed");
+      break;
+    }
+    state.PauseTiming();
+    verifier.reset();
+    state.ResumeTiming();
+  }
+  state.SetItemsProcessed(state.iterations() * graph.fact_count);
+}
+BENCHMARK(BM_PrepareDatabase)
+    ->Apply(DatabaseSizesAndThreads)
+    ->Unit(benchmark::kMillisecond);
+
+/// \brief Times solving the goals that `make_goals` writes for the graph of
+/// the benchmark's size. Solving binds the goals' variables, so every
+/// iteration starts again from a fresh verifier; loading it isn't timed.
+void Solve(benchmark::State &state,
+           std::string (*make_goals)(const SyntheticGraph &),
+           bool reorder_goals) {
+  const SyntheticGraph &graph = GraphWithFacts(state.range(0));
+  const std::string goals = make_goals(graph);
+  std::string database_name = "synthetic";
+  while (state.KeepRunning()) {
+    state.PauseTiming();
+    std::unique_ptr<Verifier> verifier(new Verifier());
+    if (reorder_goals) {
+      verifier->ReorderGoals();
+    }
+    if (!LoadGraph(graph, &database_name, verifier.get()) ||
+        !verifier->LoadInlineProtoFile(goals) ||
+        !verifier->PrepareDatabase()) {
+      state.SkipWithError("couldn't set up the verifier");
+      break;
+    }
+    state.ResumeTiming();
+    if (!verifier->VerifyAllGoals(
+            [](Verifier *, const AssertionParser::Inspection &) {
+              return true;
+            })) {
+      state.SkipWithError("the goals failed");
+      break;
+    }
+    state.PauseTiming();
+    verifier.reset();
+    state.ResumeTiming();
+  }
+}
+
+void BM_SolveAnchorGoals(benchmark::State &state) {
+  Solve(state, AnchorGoals, false);
+}
+BENCHMARK(BM_SolveAnchorGoals)
+    ->Apply(DatabaseSizes)
+    ->Iterations(3)
+    ->Unit(benchmark::kMillisecond);
+
+void BM_SolveReorderedAnchorGoals(benchmark::State &state) {
+  Solve(state, AnchorGoals, true);
+}
+BENCHMARK(BM_SolveReorderedAnchorGoals)
+    ->Apply(DatabaseSizes)
+    ->Iterations(3)
+    ->Unit(benchmark::kMillisecond);
+
+void BM_SolveChainGoals(benchmark::State &state) {
+  Solve(state, ChainGoals, false);
+}
+BENCHMARK(BM_SolveChainGoals)
+    ->Apply(DatabaseSizes)
+    ->Iterations(3)
+    ->Unit(benchmark::kMillisecond);
+
+void BM_SolveNegatedGoals(benchmark::State &state) {
+  Solve(state, NegatedGoals, false);
+}
+BENCHMARK(BM_SolveNegatedGoals)
+    ->Apply(DatabaseSizes)
+    ->Iterations(3)
+    ->Unit(benchmark::kMillisecond);
+
+}  // namespace
+}  // namespace verifier
+}  // namespace kythe
+
+BENCHMARK_MAIN();
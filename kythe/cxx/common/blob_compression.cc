@@ -0,0 +1,133 @@
+/*
+ * Copyright 2017 Google Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "blob_compression.h"
+
+#include "google/protobuf/io/gzip_stream.h"
+#include "google/protobuf/io/zero_copy_stream_impl_lite.h"
+#include "kythe/cxx/common/snappy_stream.h"
+#include "llvm/ADT/StringRef.h"
+
+namespace kythe {
+namespace {
+/// The first byte of a gzip stream.
+constexpr unsigned char kGzipMagic = 0x1f;
+/// The first byte of a snappy framing format stream (the type of its stream
+/// identifier chunk).
+constexpr unsigned char kSnappyMagic = 0xff;
+}  // anonymous namespace
+
+bool ParseBlobCompression(const std::string &spec, BlobCompression *out,
+                          std::string *error_text) {
+  auto split = llvm::StringRef(spec).split(':');
+  BlobCompression compression;
+  if (split.first == "gzip") {
+    compression.format = BlobCompression::Format::kGzip;
+    if (!split.second.empty() &&
+        (split.second.getAsInteger(10, compression.gzip_level) ||
+         compression.gzip_level < 0 || compression.gzip_level > 9)) {
+      *error_text = "Bad gzip level in " + spec + " (expected 0-9)";
+      return false;
+    }
+  } else if (split.first == "snappy") {
+    compression.format = BlobCompression::Format::kSnappy;
+    if (!split.second.empty() &&
+        (split.second.getAsInteger(10, compression.threads) ||
+         compression.threads == 0)) {
+      *error_text = "Bad thread count in " + spec;
+      return false;
+    }
+  } else {
+    *error_text = "Unknown blob compression " + spec +
+                  " (expected gzip[:level] or snappy[:threads])";
+    return false;
+  }
+  *out = compression;
+  return true;
+}
+
+bool WriteCompressedBlob(
+    const BlobCompression &compression,
+    google::protobuf::io::ZeroCopyOutputStream *output,
+    const std::function<bool(google::protobuf::io::ZeroCopyOutputStream *)>
+        &write,
+    std::string *error_text) {
+  if (compression.format == BlobCompression::Format::kSnappy) {
+    SnappyFramedOutputStream stream(output);
+    stream.set_compression_threads(compression.threads);
+    if (!write(&stream)) {
+      return false;
+    }
+    if (!stream.Close()) {
+      *error_text = "Couldn't close snappy output stream.";
+      return false;
+    }
+    return true;
+  }
+  google::protobuf::io::GzipOutputStream::Options options;
+  options.format = google::protobuf::io::GzipOutputStream::GZIP;
+  options.compression_level = compression.gzip_level;
+  google::protobuf::io::GzipOutputStream stream(output, options);
+  if (!write(&stream)) {
+    return false;
+  }
+  if (!stream.Close()) {
+    *error_text = "Couldn't close gzip output stream.";
+    return false;
+  }
+  return true;
+}
+
+bool ReadCompressedBlob(
+    google::protobuf::io::ZeroCopyInputStream *input,
+    const std::function<bool(google::protobuf::io::ZeroCopyInputStream *)>
+        &read,
+    std::string *error_text) {
+  const void *data;
+  int size = 0;
+  while (size == 0) {
+    if (!input->Next(&data, &size)) {
+      // An empty blob has no content in any format.
+      google::protobuf::io::ArrayInputStream empty(nullptr, 0);
+      return read(&empty);
+    }
+  }
+  unsigned char magic = *static_cast<const unsigned char *>(data);
+  input->BackUp(size);
+  if (magic == kSnappyMagic) {
+    SnappyFramedInputStream stream(input);
+    bool user_result = read(&stream);
+    if (!stream.error().empty()) {
+      *error_text = stream.error();
+      return false;
+    }
+    return user_result;
+  }
+  if (magic != kGzipMagic) {
+    *error_text = "Unknown blob compression.";
+    return false;
+  }
+  google::protobuf::io::GzipInputStream stream(
+      input, google::protobuf::io::GzipInputStream::Format::GZIP);
+  bool user_result = read(&stream);
+  if (const char *err = stream.ZlibErrorMessage()) {
+    *error_text = err;
+    return false;
+  }
+  return user_result;
+}
+
+}  // namespace kythe
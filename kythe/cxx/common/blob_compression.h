@@ -0,0 +1,75 @@
+/*
+ * Copyright 2017 Google Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef KYTHE_CXX_COMMON_BLOB_COMPRESSION_H_
+#define KYTHE_CXX_COMMON_BLOB_COMPRESSION_H_
+
+#include <functional>
+#include <string>
+
+#include "google/protobuf/io/zero_copy_stream.h"
+
+namespace kythe {
+
+/// \brief How to compress the blobs stored in an index pack.
+///
+/// Readers don't need to be told: `ReadCompressedBlob` detects the format of
+/// each blob from its first byte, so packs may mix formats and packs written
+/// before there was a choice still read as gzip.
+struct BlobCompression {
+  enum class Format {
+    kGzip,   ///< gzip, as index packs have always used.
+    kSnappy  ///< The snappy framing format (see snappy_stream.h).
+  };
+  /// The format in which to write new blobs.
+  Format format = Format::kGzip;
+  /// The zlib compression level for `kGzip`, or -1 for zlib's default.
+  int gzip_level = -1;
+  /// The number of threads with which to compress large blobs (`kSnappy`
+  /// only).
+  size_t threads = 1;
+};
+
+/// \brief Parses a compression spec: "gzip", "gzip:<level>" or
+/// "snappy[:<threads>]".
+/// \return false on failure, with `error_text` set.
+bool ParseBlobCompression(const std::string &spec, BlobCompression *out,
+                          std::string *error_text);
+
+/// \brief Calls `write` with a stream that compresses what it is given onto
+/// `output` as `compression` says.
+/// \param write Returns false on failure, with `error_text` set.
+/// \return false on failure, with `error_text` set.
+bool WriteCompressedBlob(
+    const BlobCompression &compression,
+    google::protobuf::io::ZeroCopyOutputStream *output,
+    const std::function<bool(google::protobuf::io::ZeroCopyOutputStream *)>
+        &write,
+    std::string *error_text);
+
+/// \brief Detects how the blob in `input` was compressed, then calls `read`
+/// with a stream that decompresses it.
+/// \param read Returns false on failure, with `error_text` set.
+/// \return false if `read` fails or the blob is corrupt.
+bool ReadCompressedBlob(
+    google::protobuf::io::ZeroCopyInputStream *input,
+    const std::function<bool(google::protobuf::io::ZeroCopyInputStream *)>
+        &read,
+    std::string *error_text);
+
+}  // namespace kythe
+
+#endif  // KYTHE_CXX_COMMON_BLOB_COMPRESSION_H_
@@ -0,0 +1,155 @@
+/*
+ * Copyright 2017 Google Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "blob_compression.h"
+
+#include <string>
+
+#include "google/protobuf/io/coded_stream.h"
+#include "google/protobuf/io/gzip_stream.h"
+#include "google/protobuf/io/zero_copy_stream_impl_lite.h"
+#include "gtest/gtest.h"
+
+namespace kythe {
+namespace {
+
+std::string Compress(const BlobCompression &compression,
+                     const std::string &data) {
+  std::string out, error_text;
+  google::protobuf::io::StringOutputStream output(&out);
+  EXPECT_TRUE(WriteCompressedBlob(
+      compression, &output,
+      [&data](google::protobuf::io::ZeroCopyOutputStream *stream) {
+        google::protobuf::io::CodedOutputStream coded_stream(stream);
+        coded_stream.WriteRaw(data.data(), data.size());
+        return !coded_stream.HadError();
+      },
+      &error_text))
+      << error_text;
+  return out;
+}
+
+/// \return the decompressed content of `blob`, or "<error>" on failure.
+std::string Decompress(const std::string &blob, std::string *error_text) {
+  // Use a small block size to make sure detection doesn't need the whole
+  // header at once.
+  google::protobuf::io::ArrayInputStream input(blob.data(), blob.size(), 3);
+  std::string out;
+  if (!ReadCompressedBlob(
+          &input,
+          [&out](google::protobuf::io::ZeroCopyInputStream *stream) {
+            const void *data;
+            int size;
+            while (stream->Next(&data, &size)) {
+              out.append(static_cast<const char *>(data), size);
+            }
+            return true;
+          },
+          error_text)) {
+    return "<error>";
+  }
+  return out;
+}
+
+std::string Text(size_t size) {
+  std::string text;
+  while (text.size() < size) {
+    text += "#include \"kythe/cxx/common/index_pack.h\" ";
+    text += std::to_string(text.size());
+  }
+  text.resize(size);
+  return text;
+}
+
+TEST(BlobCompression, ParsesSpecs) {
+  BlobCompression compression;
+  std::string error_text;
+  ASSERT_TRUE(ParseBlobCompression("snappy:4", &compression, &error_text));
+  EXPECT_EQ(BlobCompression::Format::kSnappy, compression.format);
+  EXPECT_EQ(4, compression.threads);
+  ASSERT_TRUE(ParseBlobCompression("gzip:1", &compression, &error_text));
+  EXPECT_EQ(BlobCompression::Format::kGzip, compression.format);
+  EXPECT_EQ(1, compression.gzip_level);
+  ASSERT_TRUE(ParseBlobCompression("gzip", &compression, &error_text));
+  EXPECT_EQ(-1, compression.gzip_level);
+  ASSERT_TRUE(ParseBlobCompression("snappy", &compression, &error_text));
+  EXPECT_EQ(1, compression.threads);
+  EXPECT_FALSE(ParseBlobCompression("gzip:10", &compression, &error_text));
+  EXPECT_FALSE(ParseBlobCompression("snappy:0", &compression, &error_text));
+  EXPECT_FALSE(ParseBlobCompression("zstd", &compression, &error_text));
+  EXPECT_FALSE(error_text.empty());
+}
+
+TEST(BlobCompression, RoundTrips) {
+  BlobCompression gzip, fast_gzip, snappy, parallel_snappy;
+  fast_gzip.gzip_level = 1;
+  snappy.format = BlobCompression::Format::kSnappy;
+  parallel_snappy.format = BlobCompression::Format::kSnappy;
+  parallel_snappy.threads = 4;
+  for (const auto &compression : {gzip, fast_gzip, snappy, parallel_snappy}) {
+    for (size_t size : {0, 1, 100000, 3000000}) {
+      std::string text = Text(size), error_text;
+      std::string blob = Compress(compression, text);
+      EXPECT_EQ(text, Decompress(blob, &error_text)) << error_text;
+    }
+  }
+  EXPECT_EQ(Compress(snappy, Text(3000000)),
+            Compress(parallel_snappy, Text(3000000)));
+}
+
+TEST(BlobCompression, ReadsPlainGzip) {
+  std::string blob;
+  {
+    google::protobuf::io::StringOutputStream output(&blob);
+    google::protobuf::io::GzipOutputStream::Options options;
+    options.format = google::protobuf::io::GzipOutputStream::GZIP;
+    google::protobuf::io::GzipOutputStream stream(&output, options);
+    google::protobuf::io::CodedOutputStream coded_stream(&stream);
+    coded_stream.WriteRaw("legacy", 6);
+  }
+  std::string error_text;
+  EXPECT_EQ("legacy", Decompress(blob, &error_text)) << error_text;
+}
+
+TEST(BlobCompression, ReadsEmptyBlobs) {
+  std::string error_text;
+  EXPECT_EQ("", Decompress("", &error_text));
+}
+
+TEST(BlobCompression, RejectsCorruptBlobs) {
+  std::string error_text;
+  EXPECT_EQ("<error>", Decompress("plain text", &error_text));
+  EXPECT_FALSE(error_text.empty());
+  error_text.clear();
+  EXPECT_EQ("<error>", Decompress("\x1f not really gzip", &error_text));
+  EXPECT_FALSE(error_text.empty());
+  BlobCompression snappy;
+  snappy.format = BlobCompression::Format::kSnappy;
+  std::string blob = Compress(snappy, Text(1000));
+  blob.resize(blob.size() / 2);
+  error_text.clear();
+  EXPECT_EQ("<error>", Decompress(blob, &error_text));
+  EXPECT_FALSE(error_text.empty());
+}
+
+}  // namespace
+}  // namespace kythe
+
+int main(int argc, char **argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  int result = RUN_ALL_TESTS();
+  return result;
+}
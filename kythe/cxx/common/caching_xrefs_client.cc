@@ -0,0 +1,289 @@
+/*
+ * Copyright 2017 Google Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "kythe/cxx/common/caching_xrefs_client.h"
+
+#include <openssl/sha.h>
+
+#include <chrono>
+#include <fstream>
+#include <sstream>
+#include <utility>
+
+#include "glog/logging.h"
+#include "google/protobuf/io/coded_stream.h"
+#include "google/protobuf/io/zero_copy_stream_impl_lite.h"
+#include "llvm/ADT/SmallString.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/raw_ostream.h"
+
+namespace kythe {
+namespace {
+/// The size of the expiry time at the start of a cache file.
+constexpr size_t kExpiryBytes = 8;
+
+/// \return the key for a `method` call with `request`.
+std::string CacheKey(const char *method,
+                     const google::protobuf::Message &request) {
+  std::string key(method);
+  key.push_back('\0');
+  {
+    google::protobuf::io::StringOutputStream stream(&key);
+    google::protobuf::io::CodedOutputStream coded_stream(&stream);
+    // Requests with the same fields must have the same key.
+    coded_stream.SetSerializationDeterministic(true);
+    request.ByteSize();
+    request.SerializeWithCachedSizes(&coded_stream);
+  }
+  return key;
+}
+}  // anonymous namespace
+
+CachingXrefsClient::CachingXrefsClient(std::unique_ptr<XrefsClient> client,
+                                       const Options &options)
+    : client_(std::move(client)), options_(options) {
+  if (!options_.disk_cache_directory.empty()) {
+    if (auto err = llvm::sys::fs::create_directories(
+            llvm::Twine(options_.disk_cache_directory))) {
+      LOG(WARNING) << "Couldn't create " << options_.disk_cache_directory
+                   << ": " << err.message() << "; caching only in memory.";
+    } else {
+      disk_cache_ = true;
+    }
+  }
+}
+
+bool CachingXrefsClient::Nodes(const proto::NodesRequest &request,
+                               proto::NodesReply *reply,
+                               std::string *error_text) {
+  return Call("nodes", request, reply, error_text, &XrefsClient::Nodes);
+}
+
+bool CachingXrefsClient::Edges(const proto::EdgesRequest &request,
+                               proto::EdgesReply *reply,
+                               std::string *error_text) {
+  return Call("edges", request, reply, error_text, &XrefsClient::Edges);
+}
+
+bool CachingXrefsClient::Decorations(const proto::DecorationsRequest &request,
+                                     proto::DecorationsReply *reply,
+                                     std::string *error_text) {
+  return Call("decorations", request, reply, error_text,
+              &XrefsClient::Decorations);
+}
+
+bool CachingXrefsClient::Documentation(
+    const proto::DocumentationRequest &request,
+    proto::DocumentationReply *reply, std::string *error_text) {
+  return Call("documentation", request, reply, error_text,
+              &XrefsClient::Documentation);
+}
+
+template <typename Request, typename Reply>
+bool CachingXrefsClient::Call(const char *method, const Request &request,
+                              Reply *reply, std::string *error_text,
+                              bool (XrefsClient::*call)(const Request &,
+                                                        Reply *,
+                                                        std::string *)) {
+  std::string key = CacheKey(method, request);
+  std::string cached;
+  if (Lookup(key, &cached)) {
+    Reply cached_reply;
+    if (cached_reply.ParseFromString(cached)) {
+      reply->MergeFrom(cached_reply);
+      return true;
+    }
+    LOG(WARNING) << "Dropping an unreadable cached " << method << " reply.";
+  }
+  Reply fresh_reply;
+  if (!(client_.get()->*call)(request, &fresh_reply, error_text)) {
+    return false;
+  }
+  Store(key, fresh_reply.SerializeAsString());
+  reply->MergeFrom(fresh_reply);
+  return true;
+}
+
+uint64_t CachingXrefsClient::Now() const {
+  if (options_.clock) {
+    return options_.clock();
+  }
+  return std::chrono::duration_cast<std::chrono::milliseconds>(
+             std::chrono::system_clock::now().time_since_epoch())
+      .count();
+}
+
+bool CachingXrefsClient::Lookup(const std::string &key, std::string *reply) {
+  uint64_t now = Now();
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto found = entries_.find(key);
+    if (found != entries_.end()) {
+      Entry &entry = found->second;
+      if (entry.expires_ms == 0 || entry.expires_ms > now) {
+        lru_.splice(lru_.begin(), lru_, entry.lru);
+        *reply = entry.reply;
+        ++hits_;
+        return true;
+      }
+      memory_bytes_ -= key.size() + entry.reply.size();
+      lru_.erase(entry.lru);
+      entries_.erase(found);
+    }
+  }
+  uint64_t expires_ms = 0;
+  bool found = disk_cache_ && ReadFromDisk(key, reply, &expires_ms);
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (found) {
+    ++hits_;
+    StoreInMemory(key, *reply, expires_ms);
+  } else {
+    ++misses_;
+  }
+  return found;
+}
+
+void CachingXrefsClient::Store(const std::string &key,
+                               const std::string &reply) {
+  uint64_t expires_ms = options_.ttl_ms == 0 ? 0 : Now() + options_.ttl_ms;
+  if (disk_cache_) {
+    WriteToDisk(key, reply, expires_ms);
+  }
+  std::lock_guard<std::mutex> lock(mutex_);
+  StoreInMemory(key, reply, expires_ms);
+}
+
+void CachingXrefsClient::StoreInMemory(const std::string &key,
+                                       const std::string &reply,
+                                       uint64_t expires_ms) {
+  auto found = entries_.find(key);
+  if (found != entries_.end()) {
+    memory_bytes_ -= key.size() + found->second.reply.size();
+    lru_.erase(found->second.lru);
+    entries_.erase(found);
+  }
+  if (key.size() + reply.size() > options_.max_memory_bytes) {
+    return;
+  }
+  lru_.push_front(key);
+  entries_[key] = Entry{reply, expires_ms, lru_.begin()};
+  memory_bytes_ += key.size() + reply.size();
+  while (memory_bytes_ > options_.max_memory_bytes) {
+    auto evicted = entries_.find(lru_.back());
+    memory_bytes_ -= evicted->first.size() + evicted->second.reply.size();
+    entries_.erase(evicted);
+    lru_.pop_back();
+  }
+}
+
+std::string CachingXrefsClient::DiskPath(const std::string &key) const {
+  static constexpr char kHexDigits[] = "0123456789abcdef";
+  unsigned char digest[SHA256_DIGEST_LENGTH];
+  ::SHA256(reinterpret_cast<const unsigned char *>(key.data()), key.size(),
+           digest);
+  std::string name(SHA256_DIGEST_LENGTH * 2, '\0');
+  for (size_t i = 0; i < SHA256_DIGEST_LENGTH; ++i) {
+    name[i * 2] = kHexDigits[digest[i] >> 4];
+    name[i * 2 + 1] = kHexDigits[digest[i] & 0xF];
+  }
+  llvm::SmallString<256> path(options_.disk_cache_directory);
+  llvm::sys::path::append(path, name);
+  return path.str().str();
+}
+
+bool CachingXrefsClient::ReadFromDisk(const std::string &key,
+                                      std::string *reply,
+                                      uint64_t *expires_ms) {
+  std::string path = DiskPath(key);
+  std::ifstream file(path, std::ios::binary);
+  if (!file) {
+    return false;
+  }
+  std::ostringstream contents;
+  contents << file.rdbuf();
+  const std::string &data = contents.str();
+  if (data.size() < kExpiryBytes) {
+    return false;
+  }
+  // The expiry time is stored little-endian.
+  *expires_ms = 0;
+  for (size_t i = kExpiryBytes; i > 0; --i) {
+    *expires_ms = (*expires_ms << 8) | static_cast<unsigned char>(data[i - 1]);
+  }
+  if (*expires_ms != 0 && *expires_ms <= Now()) {
+    llvm::sys::fs::remove(path);
+    return false;
+  }
+  reply->assign(data, kExpiryBytes, std::string::npos);
+  return true;
+}
+
+void CachingXrefsClient::WriteToDisk(const std::string &key,
+                                     const std::string &reply,
+                                     uint64_t expires_ms) {
+  std::string path = DiskPath(key);
+  // Write to a temporary file first so that readers never see part of a
+  // reply.
+  llvm::SmallString<256> temp_path;
+  int fd;
+  if (auto err = llvm::sys::fs::createUniqueFile(path + ".%%%%%%%%.tmp", fd,
+                                                 temp_path)) {
+    LOG(WARNING) << "Couldn't cache a reply: " << err.message();
+    return;
+  }
+  char expiry[kExpiryBytes];
+  for (size_t i = 0; i < kExpiryBytes; ++i) {
+    expiry[i] = static_cast<char>((expires_ms >> (i * 8)) & 0xFF);
+  }
+  bool written;
+  {
+    llvm::raw_fd_ostream stream(fd, /*shouldClose=*/true);
+    stream.write(expiry, kExpiryBytes);
+    stream << reply;
+    stream.close();
+    written = !stream.has_error();
+    stream.clear_error();
+  }
+  if (written) {
+    if (auto err = llvm::sys::fs::rename(temp_path, path)) {
+      LOG(WARNING) << "Couldn't cache a reply: " << err.message();
+      written = false;
+    }
+  } else {
+    LOG(WARNING) << "Couldn't write a reply to " << temp_path.str().str();
+  }
+  if (!written) {
+    llvm::sys::fs::remove(temp_path);
+  }
+}
+
+size_t CachingXrefsClient::hits() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return hits_;
+}
+
+size_t CachingXrefsClient::misses() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return misses_;
+}
+
+size_t CachingXrefsClient::memory_bytes() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return memory_bytes_;
+}
+
+}  // namespace kythe
@@ -0,0 +1,156 @@
+/*
+ * Copyright 2017 Google Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef KYTHE_CXX_COMMON_CACHING_XREFS_CLIENT_H_
+#define KYTHE_CXX_COMMON_CACHING_XREFS_CLIENT_H_
+
+#include <cstdint>
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+#include "google/protobuf/message.h"
+#include "kythe/cxx/common/net_client.h"
+
+namespace kythe {
+
+/// \brief An `XrefsClient` that remembers the replies of another.
+///
+/// Replies are keyed by the call and its serialized request, so each page of
+/// a paged call (named by the request's `page_token`) is cached on its own
+/// and a cached reply keeps the `next_page_token` it was sent with. Failed
+/// calls aren't cached.
+///
+/// Replies are kept in memory, dropping the least recently used ones past
+/// `Options::max_memory_bytes`, and optionally in a directory as well, where
+/// they outlive the client and may be shared by several processes.
+///
+/// One client may be shared by several threads if the client it wraps can.
+/// Calls that miss the cache aren't serialized, so two threads that miss on
+/// the same request will both call through.
+class CachingXrefsClient : public XrefsClient {
+ public:
+  struct Options {
+    /// The most reply data (with keys) to keep in memory.
+    size_t max_memory_bytes = 64 << 20;
+    /// If nonzero, replies are dropped this long after they were received.
+    uint64_t ttl_ms = 0;
+    /// If nonempty, replies are also cached in this directory, which is
+    /// created if needed. The directory isn't bounded in size; replies in it
+    /// are only removed once they expire.
+    std::string disk_cache_directory;
+    /// Returns the current time in milliseconds since the epoch. If unset,
+    /// the system clock is used.
+    std::function<uint64_t()> clock;
+  };
+
+  /// \param client The client to call on a miss.
+  CachingXrefsClient(std::unique_ptr<XrefsClient> client,
+                     const Options &options);
+
+  bool Nodes(const proto::NodesRequest &request, proto::NodesReply *reply,
+             std::string *error_text) override;
+
+  bool Edges(const proto::EdgesRequest &request, proto::EdgesReply *reply,
+             std::string *error_text) override;
+
+  bool Decorations(const proto::DecorationsRequest &request,
+                   proto::DecorationsReply *reply,
+                   std::string *error_text) override;
+
+  bool Documentation(const proto::DocumentationRequest &request,
+                     proto::DocumentationReply *reply,
+                     std::string *error_text) override;
+
+  /// \return the number of calls answered from memory or disk.
+  size_t hits() const;
+
+  /// \return the number of calls passed on to the wrapped client.
+  size_t misses() const;
+
+  /// \return the size of the replies (with keys) kept in memory.
+  size_t memory_bytes() const;
+
+ private:
+  /// \brief A reply in memory.
+  struct Entry {
+    /// The serialized reply.
+    std::string reply;
+    /// When the reply expires, or 0 if it doesn't.
+    uint64_t expires_ms;
+    /// The entry's position in `lru_`.
+    std::list<std::string>::iterator lru;
+  };
+
+  /// \brief Answers a call from the cache or by calling `call` on `client_`.
+  /// \param method Names the call, to tell apart identical requests to
+  /// different calls.
+  template <typename Request, typename Reply>
+  bool Call(const char *method, const Request &request, Reply *reply,
+            std::string *error_text,
+            bool (XrefsClient::*call)(const Request &, Reply *,
+                                      std::string *));
+
+  /// \return the current time in milliseconds.
+  uint64_t Now() const;
+
+  /// \brief Finds the reply for `key` in memory, marking it as recently
+  /// used, or on disk, copying it into memory.
+  /// \return false if there is no unexpired reply for `key`.
+  bool Lookup(const std::string &key, std::string *reply);
+
+  /// \brief Adds `reply` to memory (and disk) as the reply for `key`.
+  void Store(const std::string &key, const std::string &reply);
+
+  /// \brief Adds `reply` to memory, evicting others as needed. Requires
+  /// `mutex_`.
+  void StoreInMemory(const std::string &key, const std::string &reply,
+                     uint64_t expires_ms);
+
+  /// \return the path of the file that caches the reply for `key`.
+  std::string DiskPath(const std::string &key) const;
+
+  /// \brief Reads the unexpired reply for `key` from disk.
+  bool ReadFromDisk(const std::string &key, std::string *reply,
+                    uint64_t *expires_ms);
+
+  /// \brief Writes `reply` to disk as the reply for `key`.
+  void WriteToDisk(const std::string &key, const std::string &reply,
+                   uint64_t expires_ms);
+
+  /// The client to call on a miss.
+  std::unique_ptr<XrefsClient> client_;
+  Options options_;
+  /// Set if `options_.disk_cache_directory` is in use.
+  bool disk_cache_ = false;
+  /// Guards the members below.
+  mutable std::mutex mutex_;
+  /// Replies in memory, by key.
+  std::unordered_map<std::string, Entry> entries_;
+  /// The keys of `entries_`, most recently used first.
+  std::list<std::string> lru_;
+  /// The size of the keys and replies in `entries_`.
+  size_t memory_bytes_ = 0;
+  size_t hits_ = 0;
+  size_t misses_ = 0;
+};
+
+}  // namespace kythe
+
+#endif  // KYTHE_CXX_COMMON_CACHING_XREFS_CLIENT_H_
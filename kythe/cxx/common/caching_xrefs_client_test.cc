@@ -0,0 +1,218 @@
+/*
+ * Copyright 2017 Google Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "kythe/cxx/common/caching_xrefs_client.h"
+
+#include <string>
+
+#include "gtest/gtest.h"
+#include "llvm/ADT/STLExtras.h"
+#include "llvm/ADT/SmallString.h"
+#include "llvm/Support/FileSystem.h"
+
+namespace kythe {
+namespace {
+
+/// \brief Answers Nodes and Edges calls with the tickets it was asked about,
+/// counting the calls.
+class CountingXrefsClient : public XrefsClient {
+ public:
+  explicit CountingXrefsClient(size_t *calls) : calls_(calls) {}
+
+  bool Nodes(const proto::NodesRequest &request, proto::NodesReply *reply,
+             std::string *error_text) override {
+    ++*calls_;
+    if (request.ticket_size() == 0) {
+      *error_text = "No tickets.";
+      return false;
+    }
+    for (const auto &ticket : request.ticket()) {
+      (*reply->mutable_nodes())[ticket].mutable_facts()->insert(
+          {"/kythe/node/kind", "record"});
+    }
+    return true;
+  }
+
+  bool Edges(const proto::EdgesRequest &request, proto::EdgesReply *reply,
+             std::string *error_text) override {
+    ++*calls_;
+    // Each page holds one ticket; its token is the index of the next.
+    size_t page = request.page_token().empty()
+                      ? 0
+                      : std::stoul(request.page_token());
+    (*reply->mutable_nodes())[request.ticket(page)];
+    if (page + 1 < static_cast<size_t>(request.ticket_size())) {
+      reply->set_next_page_token(std::to_string(page + 1));
+    }
+    return true;
+  }
+
+ private:
+  size_t *calls_;
+};
+
+class CachingXrefsClientTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    options_.clock = [this] { return now_ms_; };
+  }
+
+  void TearDown() override {
+    if (!dir_.empty()) {
+      llvm::sys::fs::remove_directories(dir_);
+    }
+  }
+
+  /// \brief Sets up `options_` to cache in a new directory.
+  void UseDiskCache() {
+    llvm::SmallString<256> dir;
+    ASSERT_FALSE(
+        llvm::sys::fs::createUniqueDirectory("caching_xrefs_client", dir));
+    dir_.assign(dir.begin(), dir.end());
+    options_.disk_cache_directory = dir_ + "/cache";
+  }
+
+  /// \return a new client that caches `CountingXrefsClient`.
+  std::unique_ptr<CachingXrefsClient> MakeClient() {
+    return llvm::make_unique<CachingXrefsClient>(
+        llvm::make_unique<CountingXrefsClient>(&calls_), options_);
+  }
+
+  CachingXrefsClient::Options options_;
+  uint64_t now_ms_ = 1000;
+  size_t calls_ = 0;
+  std::string dir_;
+};
+
+TEST_F(CachingXrefsClientTest, RepeatedRequestsHitTheCache) {
+  auto client = MakeClient();
+  proto::NodesRequest request;
+  request.add_ticket("kythe:#a");
+  std::string error_text;
+  for (int i = 0; i < 3; ++i) {
+    proto::NodesReply reply;
+    ASSERT_TRUE(client->Nodes(request, &reply, &error_text)) << error_text;
+    EXPECT_EQ(1, reply.nodes().count("kythe:#a"));
+  }
+  EXPECT_EQ(1, calls_);
+  EXPECT_EQ(2, client->hits());
+  EXPECT_EQ(1, client->misses());
+  request.add_ticket("kythe:#b");
+  proto::NodesReply reply;
+  ASSERT_TRUE(client->Nodes(request, &reply, &error_text)) << error_text;
+  EXPECT_EQ(2, reply.nodes_size());
+  EXPECT_EQ(2, calls_);
+}
+
+TEST_F(CachingXrefsClientTest, FailuresAreNotCached) {
+  auto client = MakeClient();
+  proto::NodesRequest request;
+  proto::NodesReply reply;
+  std::string error_text;
+  EXPECT_FALSE(client->Nodes(request, &reply, &error_text));
+  EXPECT_FALSE(client->Nodes(request, &reply, &error_text));
+  EXPECT_EQ(2, calls_);
+}
+
+TEST_F(CachingXrefsClientTest, PagesAreCachedSeparately) {
+  auto client = MakeClient();
+  proto::EdgesRequest request;
+  request.add_ticket("kythe:#a");
+  request.add_ticket("kythe:#b");
+  std::string error_text;
+  for (int pass = 0; pass < 2; ++pass) {
+    request.clear_page_token();
+    proto::EdgesReply first;
+    ASSERT_TRUE(client->Edges(request, &first, &error_text)) << error_text;
+    EXPECT_EQ(1, first.nodes().count("kythe:#a"));
+    ASSERT_EQ("1", first.next_page_token());
+    request.set_page_token(first.next_page_token());
+    proto::EdgesReply second;
+    ASSERT_TRUE(client->Edges(request, &second, &error_text)) << error_text;
+    EXPECT_EQ(1, second.nodes().count("kythe:#b"));
+    EXPECT_TRUE(second.next_page_token().empty());
+  }
+  EXPECT_EQ(2, calls_);
+}
+
+TEST_F(CachingXrefsClientTest, RepliesExpire) {
+  options_.ttl_ms = 100;
+  auto client = MakeClient();
+  proto::NodesRequest request;
+  request.add_ticket("kythe:#a");
+  proto::NodesReply reply;
+  std::string error_text;
+  ASSERT_TRUE(client->Nodes(request, &reply, &error_text)) << error_text;
+  now_ms_ += 99;
+  ASSERT_TRUE(client->Nodes(request, &reply, &error_text)) << error_text;
+  EXPECT_EQ(1, calls_);
+  now_ms_ += 1;
+  ASSERT_TRUE(client->Nodes(request, &reply, &error_text)) << error_text;
+  EXPECT_EQ(2, calls_);
+}
+
+TEST_F(CachingXrefsClientTest, EvictsLeastRecentlyUsed) {
+  options_.max_memory_bytes = 1;
+  auto client = MakeClient();
+  proto::NodesRequest request;
+  request.add_ticket("kythe:#a");
+  proto::NodesReply reply;
+  std::string error_text;
+  ASSERT_TRUE(client->Nodes(request, &reply, &error_text)) << error_text;
+  ASSERT_TRUE(client->Nodes(request, &reply, &error_text)) << error_text;
+  EXPECT_EQ(2, calls_);
+  EXPECT_EQ(0, client->memory_bytes());
+}
+
+TEST_F(CachingXrefsClientTest, DiskCacheOutlivesTheClient) {
+  UseDiskCache();
+  proto::NodesRequest request;
+  request.add_ticket("kythe:#a");
+  std::string error_text;
+  {
+    auto client = MakeClient();
+    proto::NodesReply reply;
+    ASSERT_TRUE(client->Nodes(request, &reply, &error_text)) << error_text;
+  }
+  auto client = MakeClient();
+  proto::NodesReply reply;
+  ASSERT_TRUE(client->Nodes(request, &reply, &error_text)) << error_text;
+  EXPECT_EQ(1, reply.nodes().count("kythe:#a"));
+  EXPECT_EQ(1, calls_);
+  EXPECT_EQ(1, client->hits());
+}
+
+TEST_F(CachingXrefsClientTest, DiskCacheRepliesExpire) {
+  UseDiskCache();
+  options_.ttl_ms = 100;
+  proto::NodesRequest request;
+  request.add_ticket("kythe:#a");
+  proto::NodesReply reply;
+  std::string error_text;
+  ASSERT_TRUE(MakeClient()->Nodes(request, &reply, &error_text));
+  now_ms_ += 100;
+  ASSERT_TRUE(MakeClient()->Nodes(request, &reply, &error_text));
+  EXPECT_EQ(2, calls_);
+}
+
+}  // namespace
+}  // namespace kythe
+
+int main(int argc, char **argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  int result = RUN_ALL_TESTS();
+  return result;
+}
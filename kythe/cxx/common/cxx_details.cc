@@ -16,6 +16,7 @@
 
 #include "kythe/cxx/common/cxx_details.h"
 #include "glog/logging.h"
+#include "kythe/cxx/common/json_proto.h"
 
 namespace kythe {
 
@@ -23,6 +24,10 @@ namespace kythe {
 const char kCxxCompilationUnitDetailsURI[] =
     "kythe.io/proto/kythe.proto.CxxCompilationUnitDetails";
 
+/// The type URI for references to shared C++ details.
+const char kCxxSharedDetailsRefURI[] =
+    "kythe.io/proto/kythe.proto.CxxSharedDetailsRef";
+
 void HeaderSearchInfo::CopyTo(
     kythe::proto::CxxCompilationUnitDetails* cxx_details) const {
   auto* info = cxx_details->mutable_header_search_info();
@@ -39,12 +44,32 @@ void HeaderSearchInfo::CopyTo(
     proto->set_is_system_header(prefix.second);
     proto->set_prefix(prefix.first);
   }
+  if (modules || !module_map_files.empty() || implicit_module_maps) {
+    auto* module_info = cxx_details->mutable_module_info();
+    module_info->set_modules(modules);
+    for (const auto& module_map_file : module_map_files) {
+      module_info->add_module_map_file(module_map_file);
+    }
+    module_info->set_implicit_module_maps(implicit_module_maps);
+    module_info->set_disable_module_hash(disable_module_hash);
+  }
+  for (const auto& resolution : include_resolutions) {
+    if (resolution.second.path.empty()) {
+      continue;
+    }
+    auto* proto = cxx_details->add_include_resolution();
+    proto->set_name(resolution.first);
+    proto->set_path(resolution.second.path);
+    proto->set_characteristic_kind(resolution.second.characteristic_kind);
+  }
 }
 
 bool HeaderSearchInfo::CopyFrom(
     const kythe::proto::CxxCompilationUnitDetails& cxx_details) {
   paths.clear();
   system_prefixes.clear();
+  module_map_files.clear();
+  include_resolutions.clear();
   const auto& info = cxx_details.header_search_info();
   angled_dir_idx = info.first_angled_dir();
   system_dir_idx = info.first_system_dir();
@@ -58,6 +83,17 @@ bool HeaderSearchInfo::CopyFrom(
   for (const auto& prefix : cxx_details.system_header_prefix()) {
     system_prefixes.emplace_back(prefix.prefix(), prefix.is_system_header());
   }
+  const auto& module_info = cxx_details.module_info();
+  modules = module_info.modules();
+  module_map_files.assign(module_info.module_map_file().begin(),
+                          module_info.module_map_file().end());
+  implicit_module_maps = module_info.implicit_module_maps();
+  disable_module_hash = module_info.disable_module_hash();
+  for (const auto& resolution : cxx_details.include_resolution()) {
+    include_resolutions[resolution.name()] = HeaderSearchInfo::Resolution{
+        resolution.path(), static_cast<clang::SrcMgr::CharacteristicKind>(
+                               resolution.characteristic_kind())};
+  }
   return (angled_dir_idx <= system_dir_idx && system_dir_idx <= paths.size());
 }
 
@@ -77,6 +113,8 @@ bool HeaderSearchInfo::CopyFrom(
   for (const auto& prefix : header_search_options.SystemHeaderPrefixes) {
     system_prefixes.emplace_back(prefix.Prefix, prefix.IsSystemHeader);
   }
+  implicit_module_maps = header_search_options.ImplicitModuleMaps;
+  disable_module_hash = header_search_options.DisableModuleHash;
   for (auto iter = header_search_info.search_dir_begin(); iter != last_dir;
        ++cur_dir_idx, ++iter) {
     if (iter == first_angled_dir) {
@@ -103,4 +141,42 @@ bool HeaderSearchInfo::CopyFrom(
   return true;
 }
 
+std::string SharedCxxDetailsDigest(const kythe::proto::CompilationUnit& unit) {
+  for (const auto& details : unit.details()) {
+    kythe::proto::CxxSharedDetailsRef ref;
+    if (details.type_url() == kCxxSharedDetailsRefURI &&
+        UnpackAny(details, &ref)) {
+      return ref.digest();
+    }
+  }
+  return "";
+}
+
+std::shared_ptr<const HeaderSearchInfo> SharedCxxDetailsCache::Find(
+    const std::string& digest) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto found = infos_.find(digest);
+  return found == infos_.end() ? nullptr : found->second;
+}
+
+bool SharedCxxDetailsCache::Add(const std::string& digest,
+                                const std::string& serialized) {
+  std::shared_ptr<HeaderSearchInfo> info;
+  kythe::proto::CxxCompilationUnitDetails details;
+  if (details.ParseFromString(serialized)) {
+    info = std::make_shared<HeaderSearchInfo>();
+    if (!info->CopyFrom(details)) {
+      info.reset();
+    }
+  }
+  std::lock_guard<std::mutex> lock(mutex_);
+  infos_.emplace(digest, info);
+  return info != nullptr;
+}
+
+bool SharedCxxDetailsCache::Contains(const std::string& digest) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return infos_.count(digest) != 0;
+}
+
 }  // namespace kythe
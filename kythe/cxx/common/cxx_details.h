@@ -20,8 +20,14 @@
 #include "clang/Basic/SourceManager.h"
 #include "clang/Lex/HeaderSearch.h"
 #include "clang/Lex/HeaderSearchOptions.h"
+#include "kythe/proto/analysis.pb.h"
 #include "kythe/proto/cxx.pb.h"
 
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
 #include <vector>
 
 namespace kythe {
@@ -46,6 +52,29 @@ struct HeaderSearchInfo {
   /// Prefixes on include paths that override the system property.
   /// The second part of the pair determines whether the property is set.
   std::vector<std::pair<std::string, bool>> system_prefixes;
+  /// Whether modules are enabled. Clang keeps this in its LangOptions, so it
+  /// isn't set by copying from Clang's header search state.
+  bool modules = false;
+  /// Module map files to load, in order. Clang keeps these in its
+  /// FrontendOptions, so they aren't set by copying from Clang's header
+  /// search state.
+  std::vector<std::string> module_map_files;
+  /// Whether to search for module maps alongside headers.
+  bool implicit_module_maps = false;
+  /// Whether module files go directly into the module cache rather than into
+  /// a subdirectory named after a hash of the compilation's options.
+  bool disable_module_hash = false;
+  /// A file found on the search paths, and the kind of directory it was found
+  /// in.
+  struct Resolution {
+    std::string path;
+    clang::SrcMgr::CharacteristicKind characteristic_kind;
+  };
+  /// Maps names that #includes found on the angled or system search paths to
+  /// what they found. The extractor maps names that were found in more than
+  /// one place to empty paths, and these aren't serialized. Clang doesn't
+  /// keep this state, so it isn't set by copying from Clang.
+  std::map<std::string, Resolution> include_resolutions;
   /// Copies HeaderSearchInfo from Clang. Returns true if we can represent the
   /// state; false if Clang is using features we don't support. This object
   /// has undefined state until the next successful CopyFrom completes.
@@ -61,6 +90,39 @@ struct HeaderSearchInfo {
 
 /// The type URI for C++ details.
 extern const char kCxxCompilationUnitDetailsURI[];
+
+/// The type URI for references to shared C++ details.
+extern const char kCxxSharedDetailsRefURI[];
+
+/// \return the digest of the shared C++ details that `unit` refers to, or
+/// empty if it doesn't refer to any. Shared details are stored as file data
+/// that isn't among the unit's required inputs.
+std::string SharedCxxDetailsDigest(const kythe::proto::CompilationUnit& unit);
+
+/// \brief Header search information from the C++ details that compilation
+/// units share (see `CxxSharedDetailsRef`), parsed once per digest. Safe to
+/// use from multiple threads.
+class SharedCxxDetailsCache {
+ public:
+  /// \return the information parsed from the details with `digest`, or null
+  /// if they haven't been added or were ill-formed.
+  std::shared_ptr<const HeaderSearchInfo> Find(const std::string& digest);
+
+  /// \brief Parses the serialized `CxxCompilationUnitDetails` in
+  /// `serialized` and keeps them as the details with `digest`.
+  /// \return false if they're ill-formed (which is also remembered).
+  bool Add(const std::string& digest, const std::string& serialized);
+
+  /// \return whether details with `digest` have been added.
+  bool Contains(const std::string& digest);
+
+ private:
+  /// Guards `infos_`.
+  std::mutex mutex_;
+  /// Parsed details by digest (null for those that were ill-formed).
+  std::unordered_map<std::string, std::shared_ptr<const HeaderSearchInfo>>
+      infos_;
+};
 }  // namespace kythe
 
 #endif  // KYTHE_CXX_COMMON_CXX_DETAILS_H_
@@ -0,0 +1,80 @@
+/*
+ * Copyright 2017 Google Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "kythe/cxx/common/cxx_details.h"
+
+#include "gtest/gtest.h"
+#include "kythe/cxx/common/json_proto.h"
+
+namespace kythe {
+namespace {
+
+TEST(SharedCxxDetailsCacheTest, ParsesDetailsOnce) {
+  HeaderSearchInfo info;
+  info.angled_dir_idx = 1;
+  info.system_dir_idx = 1;
+  info.paths.push_back(
+      HeaderSearchInfo::Path{"quoted", clang::SrcMgr::C_User, false});
+  info.paths.push_back(
+      HeaderSearchInfo::Path{"system", clang::SrcMgr::C_System, false});
+  proto::CxxCompilationUnitDetails details;
+  info.CopyTo(&details);
+  SharedCxxDetailsCache cache;
+  EXPECT_FALSE(cache.Contains("a"));
+  EXPECT_EQ(nullptr, cache.Find("a"));
+  ASSERT_TRUE(cache.Add("a", details.SerializeAsString()));
+  EXPECT_TRUE(cache.Contains("a"));
+  auto found = cache.Find("a");
+  ASSERT_NE(nullptr, found);
+  ASSERT_EQ(2, found->paths.size());
+  EXPECT_EQ("system", found->paths[1].path);
+  EXPECT_EQ(clang::SrcMgr::C_System, found->paths[1].characteristic_kind);
+  EXPECT_EQ(found, cache.Find("a"));
+}
+
+TEST(SharedCxxDetailsCacheTest, RemembersIllFormedDetails) {
+  proto::CxxCompilationUnitDetails details;
+  // The first system directory can't come before the first angled one.
+  details.mutable_header_search_info()->set_first_angled_dir(1);
+  details.mutable_header_search_info()->set_first_system_dir(0);
+  SharedCxxDetailsCache cache;
+  EXPECT_FALSE(cache.Add("a", details.SerializeAsString()));
+  EXPECT_FALSE(cache.Add("b", "not a proto"));
+  EXPECT_TRUE(cache.Contains("a"));
+  EXPECT_TRUE(cache.Contains("b"));
+  EXPECT_EQ(nullptr, cache.Find("a"));
+  EXPECT_EQ(nullptr, cache.Find("b"));
+}
+
+TEST(SharedCxxDetailsDigestTest, FindsTheReference) {
+  proto::CompilationUnit unit;
+  EXPECT_EQ("", SharedCxxDetailsDigest(unit));
+  proto::CxxCompilationUnitDetails details;
+  PackAny(details, kCxxCompilationUnitDetailsURI, unit.add_details());
+  EXPECT_EQ("", SharedCxxDetailsDigest(unit));
+  proto::CxxSharedDetailsRef ref;
+  ref.set_digest("abc");
+  PackAny(ref, kCxxSharedDetailsRefURI, unit.add_details());
+  EXPECT_EQ("abc", SharedCxxDetailsDigest(unit));
+}
+
+}  // namespace
+}  // namespace kythe
+
+int main(int argc, char **argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,416 @@
+/*
+ * Copyright 2017 Google Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "delimited_proto_reader.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <climits>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+
+#include "google/protobuf/io/gzip_stream.h"
+#include "google/protobuf/io/zero_copy_stream_impl.h"
+
+namespace kythe {
+
+class DelimitedProtoReader::Source {
+ public:
+  virtual ~Source() {}
+
+  /// \brief Sets `data` and `size` to the next piece of input. The previous
+  /// piece is no longer valid.
+  /// \return false at the end of the input.
+  virtual bool Next(const char **data, size_t *size) = 0;
+
+  /// \return a description of the error that ended the input, if any.
+  virtual std::string error() const { return std::string(); }
+};
+
+namespace {
+/// The largest record we'll read, which is also the most that
+/// `CodedInputStream` would accept.
+constexpr uint64_t kMaxRecordSize = INT_MAX;
+
+/// \brief Reads from a `ZeroCopyInputStream` that someone else owns.
+class StreamSource : public DelimitedProtoReader::Source {
+ public:
+  explicit StreamSource(google::protobuf::io::ZeroCopyInputStream *input)
+      : input_(input) {}
+
+  bool Next(const char **data, size_t *size) override {
+    const void *buffer;
+    int buffer_size;
+    if (!input_->Next(&buffer, &buffer_size)) {
+      return false;
+    }
+    *data = static_cast<const char *>(buffer);
+    *size = buffer_size;
+    return true;
+  }
+
+ private:
+  google::protobuf::io::ZeroCopyInputStream *input_;
+};
+
+/// \brief Reads a mapped file in one piece.
+class MappedSource : public DelimitedProtoReader::Source {
+ public:
+  MappedSource(void *data, size_t size) : data_(data), size_(size) {}
+  ~MappedSource() override {
+    if (data_ != nullptr) {
+      ::munmap(data_, size_);
+    }
+  }
+
+  bool Next(const char **data, size_t *size) override {
+    if (returned_ || size_ == 0) {
+      return false;
+    }
+    returned_ = true;
+    *data = static_cast<const char *>(data_);
+    *size = size_;
+    return true;
+  }
+
+ private:
+  void *data_;
+  size_t size_;
+  /// Set once the mapping has been returned.
+  bool returned_ = false;
+};
+
+/// \brief Inflates a gzip-compressed file on the calling thread.
+class GzipSource : public DelimitedProtoReader::Source {
+ public:
+  /// \param fd The file to read. Takes ownership.
+  explicit GzipSource(int fd) : file_(fd), gzip_(&file_) {
+    file_.SetCloseOnDelete(true);
+  }
+
+  bool Next(const char **data, size_t *size) override {
+    const void *buffer;
+    int buffer_size;
+    if (!gzip_.Next(&buffer, &buffer_size)) {
+      return false;
+    }
+    *data = static_cast<const char *>(buffer);
+    *size = buffer_size;
+    return true;
+  }
+
+  std::string error() const override {
+    if (file_.GetErrno() != 0) {
+      return std::string("Read failed: ") + ::strerror(file_.GetErrno());
+    }
+    const char *message = gzip_.ZlibErrorMessage();
+    return message == nullptr ? std::string()
+                              : std::string("Inflate failed: ") + message;
+  }
+
+ private:
+  google::protobuf::io::FileInputStream file_;
+  google::protobuf::io::GzipInputStream gzip_;
+};
+
+/// \brief Reads another source ahead on a helper thread.
+class ThreadedSource : public DelimitedProtoReader::Source {
+ public:
+  explicit ThreadedSource(std::unique_ptr<DelimitedProtoReader::Source> input)
+      : input_(std::move(input)), thread_([this] { ReadLoop(); }) {}
+
+  ~ThreadedSource() override {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stopping_ = true;
+    }
+    changed_.notify_all();
+    thread_.join();
+  }
+
+  bool Next(const char **data, size_t *size) override {
+    std::unique_lock<std::mutex> lock(mutex_);
+    if (!current_.empty()) {
+      spare_blocks_.push_back(std::move(current_));
+      current_.clear();
+    }
+    changed_.wait(lock, [this] { return done_ || !queue_.empty(); });
+    if (queue_.empty()) {
+      return false;
+    }
+    current_ = std::move(queue_.front());
+    queue_.pop_front();
+    lock.unlock();
+    changed_.notify_all();
+    *data = current_.data();
+    *size = current_.size();
+    return true;
+  }
+
+  std::string error() const override {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return error_;
+  }
+
+ private:
+  /// The amount of input to collect before handing it to the reader.
+  static constexpr size_t kBlockSize = 1024 * 1024;
+  /// The most blocks to read ahead.
+  static constexpr size_t kMaxQueuedBlocks = 4;
+
+  /// \brief Reads `input_` into blocks until it ends or we're stopped.
+  void ReadLoop() {
+    std::string block;
+    const char *data;
+    size_t size;
+    bool more = true;
+    while (more) {
+      block.clear();
+      while (block.size() < kBlockSize && (more = input_->Next(&data, &size))) {
+        block.append(data, size);
+      }
+      std::unique_lock<std::mutex> lock(mutex_);
+      changed_.wait(lock, [this] {
+        return stopping_ || queue_.size() < kMaxQueuedBlocks;
+      });
+      if (stopping_) {
+        break;
+      }
+      if (!block.empty()) {
+        queue_.push_back(std::move(block));
+        if (!spare_blocks_.empty()) {
+          block = std::move(spare_blocks_.back());
+          spare_blocks_.pop_back();
+        } else {
+          block = std::string();
+        }
+        block.reserve(kBlockSize);
+      }
+      if (!more) {
+        done_ = true;
+        error_ = input_->error();
+      }
+      lock.unlock();
+      changed_.notify_all();
+    }
+  }
+
+  /// The source to read ahead. Only used by the helper thread.
+  std::unique_ptr<DelimitedProtoReader::Source> input_;
+  /// The block returned by the last call to `Next`.
+  std::string current_;
+  /// Guards the fields below.
+  mutable std::mutex mutex_;
+  /// Signalled whenever `queue_`, `done_` or `stopping_` changes.
+  std::condition_variable changed_;
+  /// Blocks that have been read but not yet returned.
+  std::deque<std::string> queue_;
+  /// Blocks that are free for reuse.
+  std::vector<std::string> spare_blocks_;
+  /// Set once `input_` has ended.
+  bool done_ = false;
+  /// Set when the helper thread should exit.
+  bool stopping_ = false;
+  /// The error that ended `input_`, if any.
+  std::string error_;
+  /// Runs `ReadLoop`; started last, so every field above is initialized.
+  std::thread thread_;
+};
+
+constexpr size_t ThreadedSource::kBlockSize;
+constexpr size_t ThreadedSource::kMaxQueuedBlocks;
+}  // anonymous namespace
+
+DelimitedProtoReader::DelimitedProtoReader(
+    google::protobuf::io::ZeroCopyInputStream *input)
+    : source_(new StreamSource(input)) {}
+
+DelimitedProtoReader::DelimitedProtoReader(std::unique_ptr<Source> source)
+    : source_(std::move(source)) {}
+
+DelimitedProtoReader::~DelimitedProtoReader() {}
+
+std::unique_ptr<DelimitedProtoReader> DelimitedProtoReader::Open(
+    const std::string &path, bool inflate_thread, std::string *error_text) {
+  int fd = ::open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    *error_text = "Couldn't open " + path + ": " + ::strerror(errno);
+    return nullptr;
+  }
+  unsigned char magic[2];
+  std::unique_ptr<Source> source;
+  if (::pread(fd, magic, sizeof(magic), 0) == sizeof(magic) &&
+      magic[0] == 0x1f && magic[1] == 0x8b) {
+    source.reset(new GzipSource(fd));
+    if (inflate_thread) {
+      source.reset(new ThreadedSource(std::move(source)));
+    }
+  } else {
+    struct stat info;
+    if (::fstat(fd, &info) != 0) {
+      *error_text = "Couldn't stat " + path + ": " + ::strerror(errno);
+      ::close(fd);
+      return nullptr;
+    }
+    void *data = nullptr;
+    if (info.st_size > 0) {
+      data = ::mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (data == MAP_FAILED) {
+        *error_text = "Couldn't map " + path + ": " + ::strerror(errno);
+        ::close(fd);
+        return nullptr;
+      }
+      ::madvise(data, info.st_size, MADV_SEQUENTIAL);
+    }
+    ::close(fd);
+    source.reset(new MappedSource(data, info.st_size));
+  }
+  return std::unique_ptr<DelimitedProtoReader>(
+      new DelimitedProtoReader(std::move(source)));
+}
+
+bool DelimitedProtoReader::NextChunk() {
+  const char *data;
+  size_t size = 0;
+  while (size == 0) {
+    if (!source_->Next(&data, &size)) {
+      chunk_ = chunk_end_ = nullptr;
+      std::string error = source_->error();
+      if (!error.empty()) {
+        Fail(error);
+      }
+      return false;
+    }
+  }
+  chunk_ = data;
+  chunk_end_ = data + size;
+  return true;
+}
+
+bool DelimitedProtoReader::Fail(const std::string &error) {
+  if (error_.empty()) {
+    error_ = error;
+  }
+  return false;
+}
+
+bool DelimitedProtoReader::Next(llvm::StringRef *record) {
+  if (!error_.empty()) {
+    return false;
+  }
+  uint64_t size = 0;
+  for (unsigned shift = 0;; shift += 7) {
+    if (chunk_ == chunk_end_ && !NextChunk()) {
+      return shift == 0 ? false : Fail("Truncated record size.");
+    }
+    unsigned char byte = *chunk_++;
+    size |= static_cast<uint64_t>(byte & 0x7f) << shift;
+    if ((byte & 0x80) == 0) {
+      break;
+    }
+    if (shift >= 28) {
+      return Fail("Bad record size.");
+    }
+  }
+  if (size > kMaxRecordSize) {
+    return Fail("Record too large.");
+  }
+  if (static_cast<size_t>(chunk_end_ - chunk_) >= size) {
+    *record = llvm::StringRef(chunk_, size);
+    chunk_ += size;
+    ++records_read_;
+    return true;
+  }
+  scratch_.assign(chunk_, chunk_end_);
+  chunk_ = chunk_end_;
+  while (scratch_.size() < size) {
+    if (!NextChunk()) {
+      return Fail("Truncated record.");
+    }
+    size_t take = std::min<size_t>(size - scratch_.size(), chunk_end_ - chunk_);
+    scratch_.append(chunk_, take);
+    chunk_ += take;
+  }
+  *record = scratch_;
+  ++records_read_;
+  return true;
+}
+
+bool DelimitedProtoReader::NextMessage(google::protobuf::MessageLite *message) {
+  llvm::StringRef record;
+  if (!Next(&record)) {
+    return false;
+  }
+  if (!message->ParseFromArray(record.data(), record.size())) {
+    return Fail("Couldn't parse record " + std::to_string(records_read_ - 1) +
+                " as a " + message->GetTypeName());
+  }
+  return true;
+}
+
+bool DelimitedProtoReader::NextBatch(size_t max_records,
+                                     std::vector<std::string> *batch) {
+  // Strings already in `batch` are reused, keeping their buffers.
+  size_t count = 0;
+  llvm::StringRef record;
+  while (count < max_records && Next(&record)) {
+    if (count == batch->size()) {
+      batch->emplace_back();
+    }
+    (*batch)[count++].assign(record.data(), record.size());
+  }
+  batch->resize(count);
+  return count != 0;
+}
+
+bool ParseInParallel(size_t count, size_t threads,
+                     const std::function<bool(size_t)> &parse,
+                     size_t *failed) {
+  threads = std::max<size_t>(std::min(threads, count), 1);
+  std::vector<char> ok(count, 1);
+  // Each thread parses a contiguous range, so they don't share cache lines.
+  const size_t per_thread = (count + threads - 1) / threads;
+  auto parse_range = [&](size_t begin) {
+    size_t end = std::min(begin + per_thread, count);
+    for (size_t i = begin; i < end; ++i) {
+      ok[i] = parse(i) ? 1 : 0;
+    }
+  };
+  std::vector<std::thread> workers;
+  for (size_t thread = 1; thread < threads; ++thread) {
+    workers.emplace_back(parse_range, thread * per_thread);
+  }
+  parse_range(0);
+  for (auto &worker : workers) {
+    worker.join();
+  }
+  auto first_failure = std::find(ok.begin(), ok.end(), 0);
+  if (first_failure == ok.end()) {
+    return true;
+  }
+  *failed = first_failure - ok.begin();
+  return false;
+}
+
+}  // namespace kythe
@@ -0,0 +1,179 @@
+/*
+ * Copyright 2017 Google Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef KYTHE_CXX_COMMON_DELIMITED_PROTO_READER_H_
+#define KYTHE_CXX_COMMON_DELIMITED_PROTO_READER_H_
+
+#include <cstddef>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "google/protobuf/io/zero_copy_stream.h"
+#include "google/protobuf/message_lite.h"
+#include "llvm/ADT/StringRef.h"
+
+namespace kythe {
+
+/// \brief Reads a sequence of varint32-delimited records, like a .kindex file
+/// or a claim stream.
+///
+/// Records are returned as views into the reader's buffers, so they are only
+/// copied if they straddle two buffers. Uncompressed files are mapped;
+/// gzip-compressed files may be inflated on a helper thread while the caller
+/// works on the records it has already read.
+class DelimitedProtoReader {
+ public:
+  /// \param input The stream to read records from, on the calling thread.
+  /// Not owned. The reader may consume data past the last record it returns.
+  explicit DelimitedProtoReader(
+      google::protobuf::io::ZeroCopyInputStream *input);
+
+  /// \brief Opens the file at `path`, which may be gzip-compressed.
+  /// \param inflate_thread If true, decompress the file on a helper thread.
+  /// \param error_text Set on failure.
+  /// \return null on failure.
+  static std::unique_ptr<DelimitedProtoReader> Open(const std::string &path,
+                                                    bool inflate_thread,
+                                                    std::string *error_text);
+
+  ~DelimitedProtoReader();
+
+  DelimitedProtoReader(const DelimitedProtoReader &) = delete;
+  DelimitedProtoReader &operator=(const DelimitedProtoReader &) = delete;
+
+  /// \brief Reads the next record.
+  /// \param record Set to the record, which is valid until the next call.
+  /// \return false at the end of the input or on error (see `error`).
+  bool Next(llvm::StringRef *record);
+
+  /// \brief Reads the next record and parses it into `message`.
+  /// \return false at the end of the input or on error (see `error`).
+  bool NextMessage(google::protobuf::MessageLite *message);
+
+  /// \brief Reads up to `max_records` records into `batch`, replacing its
+  /// contents.
+  /// \return false if there were no more records.
+  bool NextBatch(size_t max_records, std::vector<std::string> *batch);
+
+  /// \return a description of the last error, or an empty string if the
+  /// input ended cleanly (or has not ended yet).
+  const std::string &error() const { return error_; }
+
+  /// \return the number of records returned so far.
+  size_t records_read() const { return records_read_; }
+
+  /// \brief Provides the input in contiguous pieces.
+  class Source;
+
+ private:
+  explicit DelimitedProtoReader(std::unique_ptr<Source> source);
+
+  /// \brief Moves on to the next nonempty piece of input.
+  /// \return false at the end of the input.
+  bool NextChunk();
+
+  /// \brief Records `error` and returns false.
+  bool Fail(const std::string &error);
+
+  /// Where the input comes from.
+  std::unique_ptr<Source> source_;
+  /// The unread part of the current piece of input.
+  const char *chunk_ = nullptr;
+  const char *chunk_end_ = nullptr;
+  /// Holds a record that straddles pieces of input.
+  std::string scratch_;
+  /// The last error encountered.
+  std::string error_;
+  /// The number of records returned so far.
+  size_t records_read_ = 0;
+};
+
+/// \brief Calls `parse(i)` for each `i < count` on up to `threads` threads.
+/// \param failed Set to the lowest `i` for which `parse` failed, if any.
+/// \return true if every call succeeded.
+bool ParseInParallel(size_t count, size_t threads,
+                     const std::function<bool(size_t)> &parse,
+                     size_t *failed);
+
+/// \brief Parses each of `records` as a `Message` on up to `threads` threads.
+/// \param messages Set to the parsed messages, in the same order.
+/// \param error_text Set on failure.
+/// \return false if any record couldn't be parsed.
+template <typename Message>
+bool ParseRecords(const std::vector<std::string> &records, size_t threads,
+                  std::vector<Message> *messages, std::string *error_text) {
+  messages->clear();
+  messages->resize(records.size());
+  size_t failed = 0;
+  if (!ParseInParallel(records.size(), threads,
+                       [&records, messages](size_t i) {
+                         return (*messages)[i].ParseFromString(records[i]);
+                       },
+                       &failed)) {
+    *error_text = "Couldn't parse record " + std::to_string(failed) +
+                  " of the batch as a " + (*messages)[failed].GetTypeName();
+    return false;
+  }
+  return true;
+}
+
+/// \brief Calls `handle` with each record of the file at `path` (which may be
+/// gzip-compressed) parsed as a `Message`, in order.
+///
+/// With more than one thread, the file is inflated on a helper thread and
+/// records are parsed in batches on `threads` threads.
+/// \param error_text Set on failure.
+/// \return false if the file couldn't be read or a record couldn't be parsed.
+template <typename Message>
+bool ForEachDelimitedMessage(const std::string &path, size_t threads,
+                             const std::function<void(Message *)> &handle,
+                             std::string *error_text) {
+  auto reader = DelimitedProtoReader::Open(path, threads > 1, error_text);
+  if (reader == nullptr) {
+    return false;
+  }
+  if (threads <= 1) {
+    Message message;
+    while (reader->NextMessage(&message)) {
+      handle(&message);
+    }
+  } else {
+    // Big enough to keep the threads busy; small enough to stay in cache.
+    const size_t kBatchSize = 256 * threads;
+    std::vector<std::string> batch;
+    std::vector<Message> messages;
+    while (reader->NextBatch(kBatchSize, &batch)) {
+      if (!ParseRecords(batch, threads, &messages, error_text)) {
+        *error_text = path + ": " + *error_text;
+        return false;
+      }
+      for (auto &message : messages) {
+        handle(&message);
+      }
+    }
+  }
+  if (!reader->error().empty()) {
+    *error_text = path + ": " + reader->error();
+    return false;
+  }
+  return true;
+}
+
+}  // namespace kythe
+
+#endif  // KYTHE_CXX_COMMON_DELIMITED_PROTO_READER_H_
@@ -0,0 +1,201 @@
+/*
+ * Copyright 2017 Google Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "delimited_proto_reader.h"
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "glog/logging.h"
+#include "google/protobuf/io/coded_stream.h"
+#include "google/protobuf/io/gzip_stream.h"
+#include "google/protobuf/io/zero_copy_stream_impl.h"
+#include "google/protobuf/io/zero_copy_stream_impl_lite.h"
+#include "gtest/gtest.h"
+#include "kythe/proto/storage.pb.h"
+
+namespace kythe {
+namespace {
+
+/// \return `count` delimited `VName`s, the i-th with signature
+/// `i` repeated `i % 64` times.
+std::string MakeRecords(size_t count) {
+  std::string records;
+  google::protobuf::io::StringOutputStream stream(&records);
+  google::protobuf::io::CodedOutputStream coded(&stream);
+  for (size_t i = 0; i < count; ++i) {
+    proto::VName vname;
+    for (size_t j = 0; j < i % 64; ++j) {
+      vname.mutable_signature()->append(std::to_string(i));
+    }
+    coded.WriteVarint32(vname.ByteSize());
+    vname.SerializeToCodedStream(&coded);
+  }
+  return records;
+}
+
+/// \return the signatures of the `VName`s read with `reader`.
+std::vector<std::string> ReadSignatures(DelimitedProtoReader *reader) {
+  std::vector<std::string> signatures;
+  proto::VName vname;
+  while (reader->NextMessage(&vname)) {
+    signatures.push_back(vname.signature());
+  }
+  return signatures;
+}
+
+/// \brief Checks that `signatures` came from `MakeRecords(count)`.
+void ExpectSignatures(size_t count,
+                      const std::vector<std::string> &signatures) {
+  ASSERT_EQ(count, signatures.size());
+  for (size_t i = 0; i < count; ++i) {
+    EXPECT_EQ(i % 64 * std::to_string(i).size(), signatures[i].size()) << i;
+  }
+}
+
+/// \return the path of a new file holding `content`, gzipped if `gzip`.
+std::string WriteFile(const std::string &content, bool gzip) {
+  const char *temp_dir = getenv("TEST_TMPDIR");
+  std::string path =
+      std::string(temp_dir ? temp_dir : "/tmp") + "/delimited_XXXXXX";
+  int fd = mkstemp(&path[0]);
+  CHECK_GE(fd, 0);
+  {
+    google::protobuf::io::FileOutputStream file(fd);
+    file.SetCloseOnDelete(true);
+    if (gzip) {
+      google::protobuf::io::GzipOutputStream::Options options;
+      options.format = google::protobuf::io::GzipOutputStream::GZIP;
+      google::protobuf::io::GzipOutputStream gzip_stream(&file, options);
+      google::protobuf::io::CodedOutputStream coded(&gzip_stream);
+      coded.WriteRaw(content.data(), content.size());
+    } else {
+      google::protobuf::io::CodedOutputStream coded(&file);
+      coded.WriteRaw(content.data(), content.size());
+    }
+  }
+  return path;
+}
+
+TEST(DelimitedProtoReaderTest, ReadsStreams) {
+  const std::string records = MakeRecords(300);
+  // Tiny blocks make most records straddle them.
+  google::protobuf::io::ArrayInputStream input(records.data(), records.size(),
+                                               3);
+  DelimitedProtoReader reader(&input);
+  ExpectSignatures(300, ReadSignatures(&reader));
+  EXPECT_EQ("", reader.error());
+  EXPECT_EQ(300, reader.records_read());
+}
+
+TEST(DelimitedProtoReaderTest, ReadsFiles) {
+  const std::string records = MakeRecords(2000);
+  for (bool gzip : {false, true}) {
+    for (bool inflate_thread : {false, true}) {
+      std::string path = WriteFile(records, gzip);
+      std::string error_text;
+      auto reader = DelimitedProtoReader::Open(path, inflate_thread,
+                                               &error_text);
+      ASSERT_TRUE(reader != nullptr) << error_text;
+      ExpectSignatures(2000, ReadSignatures(reader.get()));
+      EXPECT_EQ("", reader->error());
+      unlink(path.c_str());
+    }
+  }
+}
+
+TEST(DelimitedProtoReaderTest, ReadsEmptyFiles) {
+  std::string path = WriteFile("", false);
+  std::string error_text;
+  auto reader = DelimitedProtoReader::Open(path, false, &error_text);
+  ASSERT_TRUE(reader != nullptr) << error_text;
+  llvm::StringRef record;
+  EXPECT_FALSE(reader->Next(&record));
+  EXPECT_EQ("", reader->error());
+  unlink(path.c_str());
+}
+
+TEST(DelimitedProtoReaderTest, ReportsMissingFiles) {
+  std::string error_text;
+  EXPECT_EQ(nullptr, DelimitedProtoReader::Open("/nonexistent/file", false,
+                                                &error_text));
+  EXPECT_FALSE(error_text.empty());
+}
+
+TEST(DelimitedProtoReaderTest, ReportsTruncation) {
+  std::string records = MakeRecords(10);
+  records.pop_back();
+  google::protobuf::io::ArrayInputStream input(records.data(), records.size());
+  DelimitedProtoReader reader(&input);
+  EXPECT_EQ(9, ReadSignatures(&reader).size());
+  EXPECT_EQ("Truncated record.", reader.error());
+}
+
+TEST(DelimitedProtoReaderTest, ReadsBatches) {
+  const std::string records = MakeRecords(25);
+  google::protobuf::io::ArrayInputStream input(records.data(), records.size(),
+                                               7);
+  DelimitedProtoReader reader(&input);
+  std::vector<std::string> batch;
+  std::vector<proto::VName> vnames;
+  std::vector<std::string> signatures;
+  std::string error_text;
+  while (reader.NextBatch(10, &batch)) {
+    EXPECT_LE(batch.size(), 10);
+    ASSERT_TRUE(ParseRecords(batch, 3, &vnames, &error_text)) << error_text;
+    for (const auto &vname : vnames) {
+      signatures.push_back(vname.signature());
+    }
+  }
+  ExpectSignatures(25, signatures);
+}
+
+TEST(DelimitedProtoReaderTest, ForEachDelimitedMessage) {
+  std::string path = WriteFile(MakeRecords(5000), true);
+  for (size_t threads : {1, 4}) {
+    std::vector<std::string> signatures;
+    std::string error_text;
+    ASSERT_TRUE(ForEachDelimitedMessage<proto::VName>(
+        path, threads,
+        [&signatures](proto::VName *vname) {
+          signatures.push_back(vname->signature());
+        },
+        &error_text))
+        << error_text;
+    ExpectSignatures(5000, signatures);
+  }
+  unlink(path.c_str());
+}
+
+TEST(DelimitedProtoReaderTest, ParseInParallelFindsFirstFailure) {
+  size_t failed = 0;
+  EXPECT_TRUE(ParseInParallel(100, 4, [](size_t) { return true; }, &failed));
+  EXPECT_FALSE(ParseInParallel(
+      100, 4, [](size_t i) { return i != 37 && i != 80; }, &failed));
+  EXPECT_EQ(37, failed);
+}
+
+}  // namespace
+}  // namespace kythe
+
+int main(int argc, char **argv) {
+  GOOGLE_PROTOBUF_VERIFY_VERSION;
+  google::InitGoogleLogging(argv[0]);
+  ::testing::InitGoogleTest(&argc, argv);
+  int result = RUN_ALL_TESTS();
+  return result;
+}
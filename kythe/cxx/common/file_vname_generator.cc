@@ -16,6 +16,8 @@
 
 #include "file_vname_generator.h"
 
+#include <algorithm>
+
 #include "glog/logging.h"
 #include "rapidjson/document.h"
 #include "rapidjson/error/en.h"
@@ -83,8 +85,9 @@ bool FileVNameGenerator::ParseRule(const std::string &rule, int max_capture,
   return true;
 }
 
-kythe::proto::VName FileVNameGenerator::LookupBaseVName(
-    const std::string &path) const {
+bool FileVNameGenerator::ApplyVNameRule(const VNameRule &rule,
+                                        const std::string &path,
+                                        kythe::proto::VName *result) const {
   re2::StringPiece argv[kMaxRegexArgs];
   RE2::Arg args[kMaxRegexArgs];
   RE2::Arg *arg_pointers[kMaxRegexArgs];
@@ -92,28 +95,107 @@ kythe::proto::VName FileVNameGenerator::LookupBaseVName(
     args[n] = &argv[n];
     arg_pointers[n] = &args[n];
   }
-  for (const auto &rule : rules_) {
-    // Invariant: capture_groups <= kMaxRegexArgs
-    // RE2 will fail to match if we provide more args than there are captures
-    // for a given regex.
-    int capture_groups = rule.pattern->NumberOfCapturingGroups();
-    if (RE2::FullMatchN(path, *rule.pattern, arg_pointers, capture_groups)) {
-      kythe::proto::VName result;
-      if (!rule.corpus.empty()) {
-        result.set_corpus(ApplyRule(rule.corpus, argv, capture_groups));
-      }
-      if (!rule.root.empty()) {
-        result.set_root(ApplyRule(rule.root, argv, capture_groups));
-      }
-      if (!rule.path.empty()) {
-        result.set_path(ApplyRule(rule.path, argv, capture_groups));
+  // Invariant: capture_groups <= kMaxRegexArgs
+  // RE2 will fail to match if we provide more args than there are captures
+  // for a given regex.
+  int capture_groups = rule.pattern->NumberOfCapturingGroups();
+  if (!RE2::FullMatchN(path, *rule.pattern, arg_pointers, capture_groups)) {
+    return false;
+  }
+  if (!rule.corpus.empty()) {
+    result->set_corpus(ApplyRule(rule.corpus, argv, capture_groups));
+  }
+  if (!rule.root.empty()) {
+    result->set_root(ApplyRule(rule.root, argv, capture_groups));
+  }
+  if (!rule.path.empty()) {
+    result->set_path(ApplyRule(rule.path, argv, capture_groups));
+  }
+  return true;
+}
+
+kythe::proto::VName FileVNameGenerator::LookupBaseVNameUncached(
+    const std::string &path) const {
+  kythe::proto::VName result;
+  if (rule_set_ != nullptr) {
+    std::vector<int> matches;
+    if (rule_set_->Match(path, &matches) && !matches.empty()) {
+      int first = *std::min_element(matches.begin(), matches.end());
+      if (ApplyVNameRule(rules_[first], path, &result)) {
+        return result;
       }
+    }
+    // Older versions of RE2 can't tell us whether a set match failed
+    // because it ran out of memory, so make sure that nothing matched.
+  }
+  for (const auto &rule : rules_) {
+    if (ApplyVNameRule(rule, path, &result)) {
       return result;
     }
   }
   return kythe::proto::VName();
 }
 
+kythe::proto::VName FileVNameGenerator::LookupBaseVName(
+    const std::string &path) const {
+  {
+    std::lock_guard<std::mutex> lock(cache_mutex_);
+    auto entry = cache_index_.find(path);
+    if (entry != cache_index_.end()) {
+      cache_.splice(cache_.begin(), cache_, entry->second);
+      return entry->second->second;
+    }
+  }
+  kythe::proto::VName result = LookupBaseVNameUncached(path);
+  std::lock_guard<std::mutex> lock(cache_mutex_);
+  if (cache_capacity_ == 0 || cache_index_.count(path)) {
+    return result;
+  }
+  cache_.emplace_front(path, result);
+  cache_index_[path] = cache_.begin();
+  if (cache_.size() > cache_capacity_) {
+    cache_index_.erase(cache_.back().first);
+    cache_.pop_back();
+  }
+  return result;
+}
+
+void FileVNameGenerator::set_cache_capacity(size_t capacity) {
+  std::lock_guard<std::mutex> lock(cache_mutex_);
+  cache_capacity_ = capacity;
+  while (cache_.size() > cache_capacity_) {
+    cache_index_.erase(cache_.back().first);
+    cache_.pop_back();
+  }
+}
+
+void FileVNameGenerator::CompileRuleSet() {
+  {
+    std::lock_guard<std::mutex> lock(cache_mutex_);
+    cache_.clear();
+    cache_index_.clear();
+  }
+  rule_set_.reset();
+  if (rules_.empty()) {
+    return;
+  }
+  // Each rule's pattern has to match the whole path.
+  auto rule_set = std::unique_ptr<RE2::Set>(
+      new RE2::Set(RE2::DefaultOptions, RE2::ANCHOR_BOTH));
+  for (const auto &rule : rules_) {
+    std::string error;
+    if (rule_set->Add(rule.pattern->pattern(), &error) < 0) {
+      LOG(WARNING) << "Matching VName rules one at a time: " << error;
+      return;
+    }
+  }
+  if (!rule_set->Compile()) {
+    LOG(WARNING) << "Matching VName rules one at a time: couldn't compile set";
+    return;
+  }
+  rule_set_ = std::move(rule_set);
+}
+
 kythe::proto::VName FileVNameGenerator::LookupVName(
     const std::string &path) const {
   kythe::proto::VName vname = LookupBaseVName(path);
@@ -125,6 +207,14 @@ kythe::proto::VName FileVNameGenerator::LookupVName(
 
 bool FileVNameGenerator::LoadJsonString(const std::string &data,
                                         std::string *error_text) {
+  // Rules parsed before any error are kept, so recompile either way.
+  bool loaded = ParseJsonRules(data, error_text);
+  CompileRuleSet();
+  return loaded;
+}
+
+bool FileVNameGenerator::ParseJsonRules(const std::string &data,
+                                        std::string *error_text) {
   CHECK(error_text != nullptr);
   using Value = rapidjson::Value;
   rapidjson::Document document;
@@ -17,16 +17,26 @@
 #ifndef KYTHE_CXX_COMMON_FILE_VNAME_GENERATOR_H_
 #define KYTHE_CXX_COMMON_FILE_VNAME_GENERATOR_H_
 
+#include <list>
 #include <memory>
+#include <mutex>
 #include <string>
+#include <unordered_map>
+#include <utility>
 #include <vector>
 
 #include "kythe/proto/storage.pb.h"
 #include "re2/re2.h"
+#include "re2/set.h"
 
 namespace kythe {
 
 /// \brief Generates file VNames based on user-configurable paths and templates.
+///
+/// All of the rules' patterns are also compiled into one `RE2::Set`, so
+/// finding the first rule that matches a path takes a single pass over it
+/// rather than one match per rule. Recent lookups are remembered in a
+/// bounded LRU cache. Lookups are thread-safe.
 class FileVNameGenerator {
  public:
   FileVNameGenerator();
@@ -44,6 +54,10 @@ class FileVNameGenerator {
   /// \brief Returns a VName for the given file path.
   kythe::proto::VName LookupVName(const std::string &path) const;
 
+  /// \brief Sets how many paths' base VNames to remember (0 to remember
+  /// none).
+  void set_cache_capacity(size_t capacity);
+
  private:
   /// \brief A command to use when building a result string.
   struct StringConsNode {
@@ -82,8 +96,32 @@ class FileVNameGenerator {
     /// Substitution pattern used to construct the path.
     StringConsRule path;
   };
+  /// \brief Applies the first rule in `rules_` that matches `path`.
+  kythe::proto::VName LookupBaseVNameUncached(const std::string &path) const;
+  /// \brief Applies `rule` to `path`.
+  /// \return false if `rule` doesn't match `path`.
+  bool ApplyVNameRule(const VNameRule &rule, const std::string &path,
+                      kythe::proto::VName *result) const;
+  /// \brief Appends the rules in `json_string` to `rules_`.
+  /// \return false (with `error_text` set) if they couldn't be parsed.
+  bool ParseJsonRules(const std::string &json_string, std::string *error_text);
+  /// \brief Rebuilds `rule_set_` from `rules_` and clears the cache.
+  void CompileRuleSet();
   /// The rules to apply to incoming paths. The first one to match is used.
   std::vector<VNameRule> rules_;
+  /// Matches all of the patterns in `rules_` at once (with pattern `i`
+  /// belonging to `rules_[i]`). Null if there are no rules or the set
+  /// couldn't be compiled.
+  std::unique_ptr<RE2::Set> rule_set_;
+  /// Paths and their base VNames, most recently used first.
+  using CacheList = std::list<std::pair<std::string, kythe::proto::VName>>;
+  /// Guards `cache_`, `cache_index_` and `cache_capacity_`.
+  mutable std::mutex cache_mutex_;
+  mutable CacheList cache_;
+  /// Maps paths to their entries in `cache_`.
+  mutable std::unordered_map<std::string, CacheList::iterator> cache_index_;
+  /// The most entries to keep in `cache_`.
+  size_t cache_capacity_ = 4096;
   /// Used internally to find substitution markers when compiling rules.
   RE2 substitution_matcher_{"([^@]*)@([^@]+)@"};
 };
@@ -143,6 +143,58 @@ TEST(FileVNameGenerator, ActualConfigTests) {
           .DebugString());
 }
 
+TEST(FileVNameGenerator, MatchesManyRulesInOrder) {
+  FileVNameGenerator generator;
+  std::string json = "[";
+  for (int i = 0; i < 600; ++i) {
+    std::string n = std::to_string(i);
+    json += "{\"pattern\": \"dir" + n + "/(.*)\", \"vname\": " +
+            "{\"corpus\": \"c" + n + "\", \"path\": \"@1@\"}},";
+  }
+  json += R"j({"pattern": "dir1.*/(.*)", "vname": {"corpus": "late"}}])j";
+  std::string error_text;
+  ASSERT_TRUE(generator.LoadJsonString(json, &error_text)) << error_text;
+  kythe::proto::VName expected;
+  expected.set_corpus("c599");
+  expected.set_path("a/b.h");
+  EXPECT_EQ(expected.DebugString(),
+            generator.LookupBaseVName("dir599/a/b.h").DebugString());
+  expected.set_corpus("late");
+  expected.clear_path();
+  EXPECT_EQ(expected.DebugString(),
+            generator.LookupBaseVName("dir1x/a/b.h").DebugString());
+  EXPECT_EQ(kythe::proto::VName().DebugString(),
+            generator.LookupBaseVName("nowhere/a.h").DebugString());
+}
+
+TEST(FileVNameGenerator, CachesLookups) {
+  FileVNameGenerator generator;
+  generator.set_cache_capacity(1);
+  std::string error_text;
+  ASSERT_TRUE(generator.LoadJsonString(kSharedTestFile, &error_text))
+      << "Couldn't parse: " << error_text;
+  kythe::proto::VName first_vname;
+  first_vname.set_corpus("first");
+  kythe::proto::VName second_vname;
+  second_vname.set_corpus("second");
+  for (int i = 0; i < 3; ++i) {
+    EXPECT_EQ(first_vname.DebugString(),
+              generator.LookupBaseVName("dup/path").DebugString());
+    EXPECT_EQ(second_vname.DebugString(),
+              generator.LookupBaseVName("dup/path2").DebugString());
+  }
+  // Loading more rules invalidates cached lookups.
+  EXPECT_EQ(kythe::proto::VName().DebugString(),
+            generator.LookupBaseVName("new").DebugString());
+  ASSERT_TRUE(generator.LoadJsonString(
+      R"([{"pattern": "new", "vname": {"corpus": "new"}}])", &error_text))
+      << error_text;
+  kythe::proto::VName new_vname;
+  new_vname.set_corpus("new");
+  EXPECT_EQ(new_vname.DebugString(),
+            generator.LookupBaseVName("new").DebugString());
+}
+
 }  // namespace
 }  // namespace kythe
 
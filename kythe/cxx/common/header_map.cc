@@ -0,0 +1,114 @@
+/*
+ * Copyright 2017 Google Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "kythe/cxx/common/header_map.h"
+
+#include <ctype.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <unordered_set>
+
+#include "llvm/ADT/StringRef.h"
+
+namespace kythe {
+namespace {
+// These mirror clang/Lex/HeaderMapTypes.h.
+constexpr uint32_t kHeaderMapMagic =
+    ('h' << 24) | ('m' << 16) | ('a' << 8) | 'p';
+constexpr uint16_t kHeaderMapVersion = 1;
+
+struct HeaderMapBucket {
+  uint32_t key;     ///< Offset of the name; 0 marks an empty bucket.
+  uint32_t prefix;  ///< Offset of the start of the path.
+  uint32_t suffix;  ///< Offset of the rest of the path.
+};
+
+struct HeaderMapHeader {
+  uint32_t magic;
+  uint16_t version;
+  uint16_t reserved;
+  uint32_t strings_offset;
+  uint32_t num_entries;
+  uint32_t num_buckets;
+  uint32_t max_value_length;
+};
+}  // anonymous namespace
+
+unsigned HashHeaderMapKey(const std::string& name) {
+  unsigned result = 0;
+  for (char c : name) {
+    result += tolower(static_cast<unsigned char>(c)) * 13;
+  }
+  return result;
+}
+
+std::string BuildHeaderMap(
+    const std::vector<std::pair<std::string, std::string>>& entries) {
+  // The string table starts with an empty string so that no name is at
+  // offset 0. Paths are stored whole as prefixes with that empty suffix.
+  std::string strings(1, '\0');
+  std::vector<HeaderMapBucket> kept;
+  std::unordered_set<std::string> lowered_names;
+  uint32_t max_value_length = 0;
+  for (const auto& entry : entries) {
+    if (!lowered_names.insert(llvm::StringRef(entry.first).lower()).second) {
+      continue;
+    }
+    HeaderMapBucket bucket;
+    bucket.key = strings.size();
+    strings.append(entry.first).push_back('\0');
+    bucket.prefix = strings.size();
+    strings.append(entry.second).push_back('\0');
+    bucket.suffix = 0;
+    kept.push_back(bucket);
+    if (entry.second.size() > max_value_length) {
+      max_value_length = entry.second.size();
+    }
+  }
+  // Keep the table at most half full so that probes stay short.
+  uint32_t num_buckets = 1;
+  while (num_buckets < kept.size() * 2) {
+    num_buckets <<= 1;
+  }
+  std::vector<HeaderMapBucket> buckets(num_buckets, HeaderMapBucket{0, 0, 0});
+  for (const auto& bucket : kept) {
+    for (unsigned probe = HashHeaderMapKey(&strings[bucket.key]);; ++probe) {
+      auto& slot = buckets[probe & (num_buckets - 1)];
+      if (slot.key == 0) {
+        slot = bucket;
+        break;
+      }
+    }
+  }
+  HeaderMapHeader header;
+  header.magic = kHeaderMapMagic;
+  header.version = kHeaderMapVersion;
+  header.reserved = 0;
+  header.strings_offset =
+      sizeof(HeaderMapHeader) + sizeof(HeaderMapBucket) * num_buckets;
+  header.num_entries = kept.size();
+  header.num_buckets = num_buckets;
+  header.max_value_length = max_value_length;
+  std::string result(header.strings_offset, '\0');
+  memcpy(&result[0], &header, sizeof(header));
+  memcpy(&result[sizeof(header)], buckets.data(),
+         sizeof(HeaderMapBucket) * num_buckets);
+  result.append(strings);
+  return result;
+}
+
+}  // namespace kythe
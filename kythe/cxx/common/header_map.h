@@ -0,0 +1,44 @@
+/*
+ * Copyright 2017 Google Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef KYTHE_CXX_COMMON_HEADER_MAP_H_
+#define KYTHE_CXX_COMMON_HEADER_MAP_H_
+
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace kythe {
+
+/// \brief Builds the contents of a header map.
+///
+/// A header map is the file format Clang reads for `-I foo.hmap`: a hash
+/// table from names as spelled in `#include` directives to the files they
+/// should include. Clang compares names without regard to case; only the
+/// first of several entries whose names differ only in case is kept.
+/// \param entries Pairs of (spelled name, path to the file to include).
+/// Paths should be absolute, since Clang treats relative ones as names to
+/// search for again.
+/// \return The header map, in host byte order.
+std::string BuildHeaderMap(
+    const std::vector<std::pair<std::string, std::string>>& entries);
+
+/// \brief Hashes `name` the way Clang does when probing a header map.
+unsigned HashHeaderMapKey(const std::string& name);
+
+}  // namespace kythe
+
+#endif  // KYTHE_CXX_COMMON_HEADER_MAP_H_
@@ -0,0 +1,100 @@
+/*
+ * Copyright 2017 Google Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "header_map.h"
+
+#include <stdint.h>
+#include <string.h>
+
+#include <string>
+
+#include "gtest/gtest.h"
+#include "llvm/ADT/StringRef.h"
+
+namespace kythe {
+namespace {
+
+/// \brief Reads the `index`th 32-bit word of `map`.
+uint32_t Word(const std::string& map, size_t index) {
+  uint32_t word;
+  memcpy(&word, map.data() + index * sizeof(word), sizeof(word));
+  return word;
+}
+
+/// \brief Looks up `name` in `map` the way Clang's HeaderMap does.
+/// \return the mapped path, or the empty string if there was none.
+std::string Lookup(const std::string& map, const std::string& name) {
+  const uint32_t strings = Word(map, 2);
+  const uint32_t num_buckets = Word(map, 4);
+  for (unsigned probe = HashHeaderMapKey(name);; ++probe) {
+    const size_t bucket = 6 + (probe & (num_buckets - 1)) * 3;
+    const uint32_t key = Word(map, bucket);
+    if (key == 0) {
+      return "";
+    }
+    if (!llvm::StringRef(map.c_str() + strings + key).equals_lower(name)) {
+      continue;
+    }
+    return std::string(map.c_str() + strings + Word(map, bucket + 1)) +
+           std::string(map.c_str() + strings + Word(map, bucket + 2));
+  }
+}
+
+TEST(HeaderMapTest, EmptyMapIsWellFormed) {
+  std::string map = BuildHeaderMap({});
+  EXPECT_EQ(('h' << 24) | ('m' << 16) | ('a' << 8) | 'p', Word(map, 0));
+  EXPECT_EQ(1, Word(map, 1) & 0xffff);
+  EXPECT_EQ(0, Word(map, 1) >> 16);
+  EXPECT_EQ(0, Word(map, 3));
+  EXPECT_EQ(1, Word(map, 4));
+  EXPECT_EQ("", Lookup(map, "a.h"));
+}
+
+TEST(HeaderMapTest, FindsEntries) {
+  std::string map = BuildHeaderMap({{"a.h", "/root/include/a.h"},
+                                    {"b/c.h", "/root/third_party/b/c.h"},
+                                    {"d.h", "/d.h"}});
+  EXPECT_EQ(3, Word(map, 3));
+  EXPECT_EQ(0, Word(map, 4) & (Word(map, 4) - 1));
+  EXPECT_EQ(strlen("/root/third_party/b/c.h"), Word(map, 5));
+  EXPECT_EQ("/root/include/a.h", Lookup(map, "a.h"));
+  EXPECT_EQ("/root/third_party/b/c.h", Lookup(map, "b/c.h"));
+  EXPECT_EQ("/d.h", Lookup(map, "D.H"));
+  EXPECT_EQ("", Lookup(map, "c.h"));
+}
+
+TEST(HeaderMapTest, KeepsFirstOfNamesThatDifferInCase) {
+  std::string map = BuildHeaderMap({{"a.h", "/1/a.h"}, {"A.h", "/2/A.h"}});
+  EXPECT_EQ(1, Word(map, 3));
+  EXPECT_EQ("/1/a.h", Lookup(map, "A.h"));
+}
+
+TEST(HeaderMapTest, HandlesCollisions) {
+  // "ab" and "ba" hash to the same bucket.
+  ASSERT_EQ(HashHeaderMapKey("ab"), HashHeaderMapKey("ba"));
+  std::string map = BuildHeaderMap({{"ab", "/ab"}, {"ba", "/ba"}});
+  EXPECT_EQ("/ab", Lookup(map, "ab"));
+  EXPECT_EQ("/ba", Lookup(map, "ba"));
+}
+
+}  // anonymous namespace
+}  // namespace kythe
+
+int main(int argc, char **argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  int result = RUN_ALL_TESTS();
+  return result;
+}
@@ -0,0 +1,156 @@
+/*
+ * Copyright 2017 Google Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "http_blob_fetcher.h"
+
+#include <chrono>
+#include <thread>
+
+#include "glog/logging.h"
+#include "llvm/ADT/StringRef.h"
+#include "rapidjson/document.h"
+
+namespace kythe {
+namespace {
+/// The number of times to try each fetch.
+constexpr int kFetchAttempts = 3;
+/// The host that serves GCS objects and the JSON API.
+constexpr char kGcsHost[] = "https://storage.googleapis.com";
+
+/// \return `text` percent-encoded for use in a URI query.
+std::string EscapeQuery(const std::string &text) {
+  static const char kHexDigits[] = "0123456789ABCDEF";
+  std::string escaped;
+  for (unsigned char c : text) {
+    if (isalnum(c) || c == '-' || c == '_' || c == '.' || c == '~') {
+      escaped.push_back(c);
+    } else {
+      escaped.push_back('%');
+      escaped.push_back(kHexDigits[c >> 4]);
+      escaped.push_back(kHexDigits[c & 0xf]);
+    }
+  }
+  return escaped;
+}
+}  // anonymous namespace
+
+HttpBlobFetcher::HttpBlobFetcher(const std::string &root) {
+  llvm::StringRef root_ref = llvm::StringRef(root).rtrim('/');
+  if (root_ref.startswith("gs://")) {
+    auto bucket_and_prefix = root_ref.drop_front(5).split('/');
+    bucket_ = std::string(bucket_and_prefix.first);
+    if (!bucket_and_prefix.second.empty()) {
+      object_prefix_ = std::string(bucket_and_prefix.second) + "/";
+    }
+    base_uri_ = std::string(kGcsHost) + "/" + bucket_;
+    if (!object_prefix_.empty()) {
+      base_uri_ += "/" + std::string(bucket_and_prefix.second);
+    }
+  } else {
+    base_uri_ = std::string(root_ref);
+  }
+}
+
+std::unique_ptr<JsonClient> HttpBlobFetcher::AcquireClient() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (idle_clients_.empty()) {
+    return std::unique_ptr<JsonClient>(new JsonClient());
+  }
+  auto client = std::move(idle_clients_.back());
+  idle_clients_.pop_back();
+  return client;
+}
+
+void HttpBlobFetcher::ReleaseClient(std::unique_ptr<JsonClient> client) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  idle_clients_.push_back(std::move(client));
+}
+
+bool HttpBlobFetcher::Fetch(const std::string &path, std::string *content,
+                            std::string *error_text) {
+  const std::string uri = base_uri_ + "/" + path;
+  auto client = AcquireClient();
+  bool fetched = false;
+  for (int attempt = 0; attempt < kFetchAttempts && !fetched; ++attempt) {
+    if (attempt != 0) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(100 << attempt));
+    }
+    fetched = client->Request(uri, false, "", content);
+  }
+  ReleaseClient(std::move(client));
+  if (!fetched) {
+    *error_text = "Couldn't fetch " + uri;
+  }
+  return fetched;
+}
+
+bool HttpBlobFetcher::List(
+    const std::string &prefix,
+    const std::function<bool(const std::string &)> &callback,
+    std::string *error_text) {
+  if (bucket_.empty()) {
+    *error_text = "Can't list blobs under " + base_uri_ +
+                  "; only gs:// index packs can be listed.";
+    return false;
+  }
+  const std::string list_uri =
+      std::string(kGcsHost) + "/storage/v1/b/" + bucket_ +
+      "/o?fields=" + EscapeQuery("items(name),nextPageToken") +
+      "&prefix=" + EscapeQuery(object_prefix_ + prefix);
+  auto client = AcquireClient();
+  std::string page_token;
+  bool ok = true;
+  do {
+    std::string uri = list_uri;
+    if (!page_token.empty()) {
+      uri += "&pageToken=" + EscapeQuery(page_token);
+    }
+    rapidjson::Document page;
+    if (!client->Request(uri, false, "", &page) || !page.IsObject()) {
+      *error_text = "Couldn't list " + uri;
+      ok = false;
+      break;
+    }
+    page_token.clear();
+    if (page.HasMember("nextPageToken") && page["nextPageToken"].IsString()) {
+      page_token = page["nextPageToken"].GetString();
+    }
+    if (!page.HasMember("items") || !page["items"].IsArray()) {
+      continue;
+    }
+    const auto &items = page["items"];
+    for (auto item_iter = items.Begin(); item_iter != items.End();
+         ++item_iter) {
+      const auto &item = *item_iter;
+      if (!item.IsObject() || !item.HasMember("name") ||
+          !item["name"].IsString()) {
+        continue;
+      }
+      llvm::StringRef name(item["name"].GetString());
+      if (!name.startswith(object_prefix_)) {
+        continue;
+      }
+      if (!callback(std::string(name.drop_front(object_prefix_.size())))) {
+        page_token.clear();
+        break;
+      }
+    }
+  } while (!page_token.empty());
+  ReleaseClient(std::move(client));
+  return ok;
+}
+
+}  // namespace kythe
@@ -0,0 +1,72 @@
+/*
+ * Copyright 2017 Google Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef KYTHE_CXX_COMMON_HTTP_BLOB_FETCHER_H_
+#define KYTHE_CXX_COMMON_HTTP_BLOB_FETCHER_H_
+
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "kythe/cxx/common/net_client.h"
+#include "kythe/cxx/common/remote_index_pack.h"
+
+namespace kythe {
+
+/// \brief Fetches blobs over HTTP(S) or from Google Cloud Storage.
+///
+/// The blob at "a/b" under the root "https://host/pack" is fetched from
+/// "https://host/pack/a/b". A "gs://bucket/pack" root is read through the
+/// public GCS endpoints (so the bucket must allow unauthenticated reads),
+/// which also support listing. Failed fetches are retried a few times.
+///
+/// `JsonClient::InitNetwork` must be called before using this class.
+class HttpBlobFetcher : public BlobFetcher {
+ public:
+  /// \param root An http://, https:// or gs:// URI.
+  explicit HttpBlobFetcher(const std::string &root);
+
+  bool Fetch(const std::string &path, std::string *content,
+             std::string *error_text) override;
+
+  /// \brief Lists blobs; only supported for gs:// roots.
+  bool List(const std::string &prefix,
+            const std::function<bool(const std::string &)> &callback,
+            std::string *error_text) override;
+
+ private:
+  /// \return an idle client, or a new one if there are none.
+  std::unique_ptr<JsonClient> AcquireClient();
+  /// \brief Makes `client` available to other requests.
+  void ReleaseClient(std::unique_ptr<JsonClient> client);
+
+  /// The URI that blob paths are relative to (without a trailing slash).
+  std::string base_uri_;
+  /// For gs:// roots, the bucket name.
+  std::string bucket_;
+  /// For gs:// roots, the object name prefix of the pack (empty or ending
+  /// in a slash).
+  std::string object_prefix_;
+  /// Guards `idle_clients_`.
+  std::mutex mutex_;
+  /// Clients that aren't in use (since a `JsonClient` isn't thread-safe).
+  std::vector<std::unique_ptr<JsonClient>> idle_clients_;
+};
+
+}  // namespace kythe
+
+#endif  // KYTHE_CXX_COMMON_HTTP_BLOB_FETCHER_H_
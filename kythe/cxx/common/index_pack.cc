@@ -16,8 +16,24 @@
 
 #include "index_pack.h"
 
+#include <fcntl.h>
 #include <openssl/sha.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
 #include <uuid/uuid.h>
+#ifdef __linux__
+#include <linux/fs.h>
+#endif
+
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+
+#include <algorithm>
+#include <condition_variable>
+#include <map>
+#include <mutex>
+#include <thread>
 #include <utility>
 
 #include "glog/logging.h"
@@ -35,6 +51,27 @@ const char IndexPackFilesystem::kCompilationUnitDirectoryName[] = "units";
 const char IndexPackFilesystem::kFileDataSuffix[] = ".data";
 const char IndexPackFilesystem::kCompilationUnitSuffix[] = ".unit";
 const char IndexPackFilesystem::kTempFileSuffix[] = ".new";
+const char IndexPackFilesystem::kUnitIndexDirectoryName[] = "unit_index";
+
+bool IndexPackFilesystem::OpenUnitIndex(const std::string &root_directory,
+                                        std::string *error_text) {
+  bool writable = open_mode() == OpenMode::kReadWrite;
+  // A new index only knows about every unit if there aren't any yet.
+  bool has_units = false;
+  if (writable && !ScanFiles(DataKind::kCompilationUnit,
+                             [&has_units](const std::string &file_name) {
+                               has_units = true;
+                               return false;
+                             },
+                             error_text)) {
+    return false;
+  }
+  llvm::SmallString<256> path(root_directory);
+  llvm::sys::path::append(path, llvm::StringRef(kUnitIndexDirectoryName));
+  unit_index_ = UnitIndex::Open(std::string(path.str()), writable,
+                                !has_units, error_text);
+  return unit_index_ != nullptr;
+}
 
 std::unique_ptr<IndexPackPosixFilesystem> IndexPackPosixFilesystem::Open(
     const std::string &root_path, IndexPackFilesystem::OpenMode open_mode,
@@ -84,9 +121,164 @@ std::unique_ptr<IndexPackPosixFilesystem> IndexPackPosixFilesystem::Open(
   }
   filesystem->data_directory_ = data_path.str();
   filesystem->unit_directory_ = unit_path.str();
+  if (!filesystem->OpenUnitIndex(filesystem->root_directory_, error_text)) {
+    return nullptr;
+  }
   return filesystem;
 }
 
+bool ParsePublishBatching(const std::string &spec,
+                          IndexPackFilesystem::PublishBatching *out,
+                          std::string *error_text) {
+  const char *begin = spec.c_str();
+  char *end = nullptr;
+  errno = 0;
+  unsigned long long blobs = ::strtoull(begin, &end, 10);
+  if (end == begin || errno != 0 || (*end != '\0' && *end != ':')) {
+    *error_text = "Bad publish batching (want <blobs>[:<ms>]): " + spec;
+    return false;
+  }
+  IndexPackFilesystem::PublishBatching batching;
+  batching.max_blobs = blobs;
+  if (*end == ':') {
+    begin = end + 1;
+    unsigned long long delay = ::strtoull(begin, &end, 10);
+    if (end == begin || errno != 0 || *end != '\0') {
+      *error_text = "Bad publish batching (want <blobs>[:<ms>]): " + spec;
+      return false;
+    }
+    batching.max_delay = std::chrono::milliseconds(delay);
+  }
+  *out = batching;
+  return true;
+}
+
+IndexPackPosixFilesystem::~IndexPackPosixFilesystem() {
+  if (!publisher_.joinable()) {
+    return;
+  }
+  {
+    std::lock_guard<std::mutex> lock(publish_mutex_);
+    stopping_ = true;
+  }
+  publish_wanted_.notify_all();
+  publisher_.join();
+  if (!publish_error_.empty()) {
+    LOG(ERROR) << "Couldn't publish index pack data: " << publish_error_;
+  }
+}
+
+void IndexPackPosixFilesystem::set_publish_batching(
+    const PublishBatching &batching) {
+  CHECK(!publisher_.joinable()) << "Publish batching can only be set once.";
+  if (batching.max_blobs == 0 || open_mode_ != OpenMode::kReadWrite) {
+    return;
+  }
+  batching_ = batching;
+  publisher_ = std::thread([this]() { PublishQueuedFiles(); });
+}
+
+bool IndexPackPosixFilesystem::FlushPublishes(std::string *error_text) {
+  std::unique_lock<std::mutex> lock(publish_mutex_);
+  if (publisher_.joinable()) {
+    ++flushers_;
+    publish_wanted_.notify_all();
+    batch_published_.wait(lock,
+                          [this]() { return queue_.empty() && !publishing_; });
+    --flushers_;
+  }
+  if (!publish_error_.empty()) {
+    *error_text = publish_error_;
+    return false;
+  }
+  return true;
+}
+
+bool IndexPackPosixFilesystem::IsQueued(const std::string &file) {
+  std::lock_guard<std::mutex> lock(publish_mutex_);
+  return queued_files_.count(file) != 0;
+}
+
+bool IndexPackPosixFilesystem::QueueTempFile(const std::string &temp_path,
+                                             const std::string &file,
+                                             std::string *error_text) {
+  std::unique_lock<std::mutex> lock(publish_mutex_);
+  if (!publish_error_.empty()) {
+    lock.unlock();
+    llvm::sys::fs::remove(llvm::Twine(temp_path));
+    *error_text = publish_error_;
+    return false;
+  }
+  if (!queued_files_.insert(file).second) {
+    // The same content is already on its way.
+    lock.unlock();
+    llvm::sys::fs::remove(llvm::Twine(temp_path));
+    return true;
+  }
+  if (queue_.empty()) {
+    queued_at_ = std::chrono::steady_clock::now();
+  }
+  queue_.push_back(QueuedFile{temp_path, file});
+  // The publisher starts its timer on the first file of a batch.
+  if (queue_.size() == 1 || queue_.size() >= batching_.max_blobs) {
+    publish_wanted_.notify_all();
+  }
+  return true;
+}
+
+void IndexPackPosixFilesystem::PublishQueuedFiles() {
+  std::unique_lock<std::mutex> lock(publish_mutex_);
+  for (;;) {
+    if (queue_.empty()) {
+      if (stopping_) {
+        return;
+      }
+      publish_wanted_.wait(lock);
+      continue;
+    }
+    if (queue_.size() < batching_.max_blobs && !stopping_ && flushers_ == 0 &&
+        publish_wanted_.wait_until(lock, queued_at_ + batching_.max_delay) ==
+            std::cv_status::no_timeout) {
+      // Check whether the batch is ready yet.
+      continue;
+    }
+    std::vector<QueuedFile> batch;
+    batch.swap(queue_);
+    publishing_ = true;
+    lock.unlock();
+    std::string error_text;
+    bool ok = true;
+    for (const auto &queued : batch) {
+      if (ok) {
+        ok = PublishTempFile(queued.temp_path, queued.file, &error_text);
+      } else {
+        llvm::sys::fs::remove(llvm::Twine(queued.temp_path));
+      }
+    }
+    // Make the whole batch's names durable at once.
+    if (ok) {
+      int dir_fd = ::open(data_directory_.c_str(), O_RDONLY | O_DIRECTORY);
+      if (dir_fd < 0 || ::fsync(dir_fd) != 0) {
+        error_text = std::string("Couldn't sync ") + data_directory_ + ": " +
+                     ::strerror(errno);
+        ok = false;
+      }
+      if (dir_fd >= 0) {
+        ::close(dir_fd);
+      }
+    }
+    lock.lock();
+    for (const auto &queued : batch) {
+      queued_files_.erase(queued.file);
+    }
+    if (!ok && publish_error_.empty()) {
+      publish_error_ = error_text;
+    }
+    publishing_ = false;
+    batch_published_.notify_all();
+  }
+}
+
 std::string IndexPackPosixFilesystem::GenerateFilenameFor(
     DataKind data_kind, const std::string &hash, std::string *error_text) {
   if (hash.size() != 64) {
@@ -172,17 +364,23 @@ bool IndexPackPosixFilesystem::ReadFileContent(DataKind data_kind,
   if (file.empty()) {
     return false;
   }
+  if (publisher_.joinable() && IsQueued(file) && !FlushPublishes(error_text)) {
+    return false;
+  }
   int in_fd;
   if (auto err = llvm::sys::fs::openFileForRead(llvm::Twine(file), in_fd)) {
     *error_text = err.message() + " (" + file + ")";
     return false;
   }
   google::protobuf::io::FileInputStream file_stream(in_fd);
-  google::protobuf::io::GzipInputStream stream(
-      &file_stream, google::protobuf::io::GzipInputStream::Format::GZIP);
-  bool user_result = callback(&stream, error_text);
-  if (const char *err = stream.ZlibErrorMessage()) {
-    *error_text = err;
+  bool user_result = ReadCompressedBlob(
+      &file_stream,
+      [&callback,
+       error_text](google::protobuf::io::ZeroCopyInputStream *stream) {
+        return callback(stream, error_text);
+      },
+      error_text);
+  if (!user_result) {
     file_stream.Close();
     return false;
   }
@@ -196,6 +394,9 @@ bool IndexPackPosixFilesystem::ReadFileContent(DataKind data_kind,
 bool IndexPackPosixFilesystem::ScanFiles(DataKind data_kind,
                                          ScanCallback callback,
                                          std::string *error_text) {
+  if (!FlushPublishes(error_text)) {
+    return false;
+  }
   std::error_code err;
   llvm::sys::fs::directory_iterator current(
       llvm::Twine(directory_for(data_kind)), err),
@@ -242,16 +443,16 @@ bool IndexPackPosixFilesystem::AddFileContent(DataKind data_kind,
     return false;
   }
   google::protobuf::io::FileOutputStream file_stream(temp_fd);
-  google::protobuf::io::GzipOutputStream::Options options;
-  options.format = google::protobuf::io::GzipOutputStream::GZIP;
-  google::protobuf::io::GzipOutputStream stream(&file_stream, options);
   std::string file_hash;
-  auto callback_result = callback(&stream, &file_hash, error_text);
-  if (!callback_result) {
-    return callback_result;
-  }
-  if (!stream.Close()) {
-    *error_text = "Couldn't close gzip output stream.";
+  if (!WriteCompressedBlob(
+          blob_compression_, &file_stream,
+          [&callback, &file_hash,
+           error_text](google::protobuf::io::ZeroCopyOutputStream *stream) {
+            return callback(stream, &file_hash, error_text);
+          },
+          error_text)) {
+    file_stream.Close();
+    llvm::sys::fs::remove(llvm::Twine(temp_path));
     return false;
   }
   if (!file_stream.Close()) {
@@ -260,8 +461,37 @@ bool IndexPackPosixFilesystem::AddFileContent(DataKind data_kind,
   }
   std::string file = GenerateFilenameFor(data_kind, file_hash, error_text);
   if (file.empty()) {
+    llvm::sys::fs::remove(llvm::Twine(temp_path));
+    return false;
+  }
+  if (publisher_.joinable()) {
+    if (data_kind == DataKind::kFileData) {
+      return QueueTempFile(temp_path, file, error_text);
+    }
+    // A unit must never be visible before the data it refers to.
+    if (!FlushPublishes(error_text)) {
+      llvm::sys::fs::remove(llvm::Twine(temp_path));
+      return false;
+    }
+  }
+  return PublishTempFile(temp_path, file, error_text);
+}
+
+bool IndexPackPosixFilesystem::PublishTempFile(const std::string &temp_path,
+                                               const std::string &file,
+                                               std::string *error_text) {
+  // Unlike rename, link won't replace a file that another writer has already
+  // published.
+  if (::link(temp_path.c_str(), file.c_str()) == 0 || errno == EEXIST) {
+    llvm::sys::fs::remove(llvm::Twine(temp_path));
+    return true;
+  }
+  if (errno != EPERM && errno != ENOTSUP && errno != EOPNOTSUPP) {
+    *error_text = std::string(::strerror(errno)) + " (" + file + ")";
+    llvm::sys::fs::remove(llvm::Twine(temp_path));
     return false;
   }
+  // Some filesystems don't support hard links.
   auto err = llvm::sys::fs::rename(llvm::Twine(temp_path), llvm::Twine(file));
   if (err) {
     llvm::sys::fs::remove(llvm::Twine(temp_path));
@@ -271,6 +501,143 @@ bool IndexPackPosixFilesystem::AddFileContent(DataKind data_kind,
   return true;
 }
 
+bool IndexPackPosixFilesystem::HasFileContent(DataKind data_kind,
+                                              const std::string &file_name) {
+  std::string error_text;
+  std::string file = GenerateFilenameFor(data_kind, file_name, &error_text);
+  if (file.empty()) {
+    return false;
+  }
+  // A queued file will be published even if another writer beats us to it.
+  return (publisher_.joinable() && IsQueued(file)) ||
+         llvm::sys::fs::exists(llvm::Twine(file));
+}
+
+bool IndexPackPosixFilesystem::DeleteFileContent(DataKind data_kind,
+                                                 const std::string &file_name,
+                                                 std::string *error_text) {
+  if (open_mode_ != OpenMode::kReadWrite) {
+    *error_text = "Index pack not opened for writing.";
+    return false;
+  }
+  std::string file = GenerateFilenameFor(data_kind, file_name, error_text);
+  if (file.empty()) {
+    return false;
+  }
+  if (publisher_.joinable() && IsQueued(file) && !FlushPublishes(error_text)) {
+    return false;
+  }
+  if (::unlink(file.c_str()) != 0) {
+    *error_text = std::string(::strerror(errno)) + " (" + file + ")";
+    return false;
+  }
+  return true;
+}
+
+/// \brief Copies everything readable from `in_fd` to `out_fd`.
+/// \return true on success; false on failure.
+static bool CopyFileContents(int in_fd, int out_fd, std::string *error_text) {
+  std::vector<char> buffer(1 << 20);
+  for (;;) {
+    ssize_t count = ::read(in_fd, buffer.data(), buffer.size());
+    if (count == 0) {
+      return true;
+    }
+    if (count < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      *error_text = std::string("read failed: ") + ::strerror(errno);
+      return false;
+    }
+    for (ssize_t written = 0; written < count;) {
+      ssize_t result =
+          ::write(out_fd, buffer.data() + written, count - written);
+      if (result < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        *error_text = std::string("write failed: ") + ::strerror(errno);
+        return false;
+      }
+      written += result;
+    }
+  }
+}
+
+bool IndexPackPosixFilesystem::CloneFileContentFrom(
+    IndexPackPosixFilesystem *source, DataKind data_kind,
+    const std::string &file_name, CloneMethod *method,
+    std::string *error_text) {
+  if (open_mode_ != OpenMode::kReadWrite) {
+    *error_text = "Index pack not opened for writing.";
+    return false;
+  }
+  std::string from = source->GenerateFilenameFor(data_kind, file_name,
+                                                 error_text);
+  std::string file = GenerateFilenameFor(data_kind, file_name, error_text);
+  if (from.empty() || file.empty()) {
+    return false;
+  }
+  if (source->publisher_.joinable() && source->IsQueued(from) &&
+      !source->FlushPublishes(error_text)) {
+    return false;
+  }
+  if (publisher_.joinable() && IsQueued(file)) {
+    *method = CloneMethod::kAlreadyPresent;
+    return true;
+  }
+  if (data_kind == DataKind::kCompilationUnit && !FlushPublishes(error_text)) {
+    return false;
+  }
+  if (llvm::sys::fs::exists(llvm::Twine(file))) {
+    *method = CloneMethod::kAlreadyPresent;
+    return true;
+  }
+  int in_fd;
+  if (auto err = llvm::sys::fs::openFileForRead(llvm::Twine(from), in_fd)) {
+    *error_text = err.message() + " (" + from + ")";
+    return false;
+  }
+  std::string temp_path;
+  int temp_fd;
+  if (!OpenUniqueTempFileIn(directory_for(data_kind), &temp_fd, &temp_path,
+                            error_text)) {
+    ::close(in_fd);
+    return false;
+  }
+  bool cloned = false;
+#ifdef FICLONE
+  // Reflinks are as cheap as hard links on filesystems that support them
+  // (btrfs, xfs) and don't tie the two packs' files together.
+  cloned = ::ioctl(temp_fd, FICLONE, in_fd) == 0;
+#endif
+  if (cloned) {
+    *method = CloneMethod::kReflink;
+  } else if (::link(from.c_str(), file.c_str()) == 0 || errno == EEXIST) {
+    ::close(in_fd);
+    ::close(temp_fd);
+    llvm::sys::fs::remove(llvm::Twine(temp_path));
+    *method = CloneMethod::kHardLink;
+    return true;
+  } else if (CopyFileContents(in_fd, temp_fd, error_text)) {
+    // Links don't cross filesystems (and some filesystems have none).
+    *method = CloneMethod::kCopy;
+  } else {
+    ::close(in_fd);
+    ::close(temp_fd);
+    llvm::sys::fs::remove(llvm::Twine(temp_path));
+    return false;
+  }
+  ::close(in_fd);
+  if (::close(temp_fd) != 0) {
+    *error_text = std::string("close failed: ") + ::strerror(errno);
+    llvm::sys::fs::remove(llvm::Twine(temp_path));
+    return false;
+  }
+  return PublishTempFile(temp_path, file, error_text);
+}
+
 // We need "the lowercase ascii hex SHA-256 digest of the file contents."
 static constexpr char kHexDigits[] = "0123456789abcdef";
 
@@ -290,13 +657,71 @@ static std::string Sha256(const void *bytes, size_t length) {
 
 bool IndexPack::AddCompilationUnit(const kythe::proto::CompilationUnit &unit,
                                    std::string *error_text) {
-  return WriteMessage(IndexPackFilesystem::DataKind::kCompilationUnit, unit,
-                      error_text);
+  std::string hash;
+  bool added = false;
+  if (!WriteMessage(IndexPackFilesystem::DataKind::kCompilationUnit, unit,
+                    error_text, &hash, &added)) {
+    return false;
+  }
+  // The unit is published first so that the index never names a unit that
+  // isn't there. If we fail now, `RebuildUnitIndex` will find it.
+  UnitIndex *index = filesystem_->unit_index();
+  return !added || index == nullptr ||
+         index->Add(UnitIndex::KeysFor(unit), hash, error_text);
 }
 
-bool IndexPack::ReadFileData(const std::string &hash, std::string *out) {
+bool IndexPack::FindCompilationUnits(UnitIndex::KeyKind kind,
+                                     const std::string &key,
+                                     std::vector<std::string> *hashes,
+                                     std::string *error_text) {
+  UnitIndex *index = filesystem_->unit_index();
+  if (index == nullptr) {
+    *error_text = "Index pack doesn't keep a unit index.";
+    return false;
+  }
+  return index->Find(kind, key, hashes, error_text);
+}
+
+bool IndexPack::RebuildUnitIndex(const BatchReadOptions &options,
+                                 std::string *error_text) {
+  UnitIndex *unit_index = filesystem_->unit_index();
+  if (unit_index == nullptr) {
+    *error_text = "Index pack doesn't keep a unit index.";
+    return false;
+  }
+  std::vector<std::string> hashes;
+  if (!ScanData(IndexPackFilesystem::DataKind::kCompilationUnit,
+                [&hashes](const std::string &hash) {
+                  hashes.push_back(hash);
+                  return true;
+                },
+                error_text)) {
+    return false;
+  }
+  std::vector<std::pair<UnitIndex::Key, std::string>> records;
+  bool succeeded = true;
+  ReadCompilationUnitBatch(
+      hashes, options,
+      [&](size_t index, bool ok, kythe::proto::CompilationUnit *unit,
+          const std::string &read_error) {
+        if (!ok) {
+          *error_text = read_error;
+          succeeded = false;
+          return false;
+        }
+        for (auto &key : UnitIndex::KeysFor(*unit)) {
+          records.emplace_back(std::move(key), hashes[index]);
+        }
+        return true;
+      });
+  return succeeded && unit_index->Replace(records, error_text);
+}
+
+bool IndexPack::ReadData(IndexPackFilesystem::DataKind kind,
+                         const std::string &hash, std::string *out,
+                         std::string *error_text) {
   return filesystem_->ReadFileContent(
-      IndexPackFilesystem::DataKind::kFileData, hash,
+      kind, hash,
       [out](google::protobuf::io::ZeroCopyInputStream *stream,
             std::string *error_text) {
         out->clear();
@@ -311,34 +736,25 @@ bool IndexPack::ReadFileData(const std::string &hash, std::string *out) {
         }
         return true;
       },
-      out);
+      error_text);
 }
 
-bool IndexPack::ReadCompilationUnit(const std::string &hash,
-                                    kythe::proto::CompilationUnit *unit,
-                                    std::string *error_text) {
-  // TODO(zarko): Wrap the input stream and deserialize from it without
-  // the buffer in between.
-  std::string buffer;
-  if (!filesystem_->ReadFileContent(
-          IndexPackFilesystem::DataKind::kCompilationUnit, hash,
-          [&buffer](google::protobuf::io::ZeroCopyInputStream *stream,
-                    std::string *error_text) {
-            buffer.clear();
-            const void *data;
-            int size;
-            // The callback's caller will check for errors.
-            while (stream->Next(&data, &size)) {
-              if (size <= 0) {
-                continue;
-              }
-              buffer.append(static_cast<const char *>(data), size);
-            }
-            return true;
-          },
-          error_text)) {
-    return false;
-  }
+bool IndexPack::DeleteFileData(const std::string &hash,
+                               std::string *error_text) {
+  known_files_.erase(hash);
+  return filesystem_->DeleteFileContent(
+      IndexPackFilesystem::DataKind::kFileData, hash, error_text);
+}
+
+bool IndexPack::ReadFileData(const std::string &hash, std::string *out) {
+  return ReadData(IndexPackFilesystem::DataKind::kFileData, hash, out, out);
+}
+
+/// \brief Parses the unit named `hash` from its stored representation.
+static bool ParseCompilationUnit(const std::string &hash,
+                                 const std::string &buffer,
+                                 kythe::proto::CompilationUnit *unit,
+                                 std::string *error_text) {
   std::string format_string;
   if (!MergeJsonWithMessage(buffer, &format_string, unit)) {
     *error_text = "Invalid compilation unit: " + hash;
@@ -352,6 +768,136 @@ bool IndexPack::ReadCompilationUnit(const std::string &hash,
   return true;
 }
 
+bool IndexPack::ReadCompilationUnit(const std::string &hash,
+                                    kythe::proto::CompilationUnit *unit,
+                                    std::string *error_text) {
+  // TODO(zarko): Wrap the input stream and deserialize from it without
+  // the buffer in between.
+  std::string buffer;
+  return ReadData(IndexPackFilesystem::DataKind::kCompilationUnit, hash,
+                  &buffer, error_text) &&
+         ParseCompilationUnit(hash, buffer, unit, error_text);
+}
+
+/// \brief The result of one read in a batch.
+struct BatchReadResult {
+  /// Whether the read succeeded.
+  bool ok = false;
+  /// The data read (on success) or an error description (on failure).
+  std::string content;
+  /// The unit read, for unit batches.
+  kythe::proto::CompilationUnit unit;
+};
+
+/// \brief Runs `read` for each index in [0, `count`) on a pool of threads,
+/// passing the results to `deliver` on the calling thread.
+/// \param read Called on some thread to perform a read. Must be thread-safe.
+/// \param deliver Called on this thread with each result. Returns false to
+/// stop early.
+static void RunBatch(
+    size_t count, const IndexPack::BatchReadOptions &options,
+    const std::function<void(size_t, BatchReadResult *)> &read,
+    const std::function<bool(size_t, BatchReadResult *)> &deliver) {
+  if (options.parallelism <= 1) {
+    for (size_t index = 0; index < count; ++index) {
+      BatchReadResult result;
+      read(index, &result);
+      if (!deliver(index, &result)) {
+        return;
+      }
+    }
+    return;
+  }
+  size_t thread_count = std::min(options.parallelism, count);
+  // There must be room for every thread to have a read in flight.
+  size_t readahead = std::max(options.readahead, thread_count);
+  std::mutex mutex;
+  std::condition_variable result_ready, reader_ready;
+  size_t next_read = 0;
+  size_t outstanding = 0;
+  bool stopped = false;
+  std::map<size_t, std::unique_ptr<BatchReadResult>> results;
+  std::vector<std::thread> threads;
+  for (size_t i = 0; i < thread_count; ++i) {
+    threads.emplace_back([&]() {
+      for (;;) {
+        size_t index;
+        {
+          std::unique_lock<std::mutex> lock(mutex);
+          reader_ready.wait(lock, [&]() {
+            return stopped || next_read == count || outstanding < readahead;
+          });
+          if (stopped || next_read == count) {
+            return;
+          }
+          index = next_read++;
+          ++outstanding;
+        }
+        auto result = std::unique_ptr<BatchReadResult>(new BatchReadResult());
+        read(index, result.get());
+        std::lock_guard<std::mutex> lock(mutex);
+        results.emplace(index, std::move(result));
+        result_ready.notify_one();
+      }
+    });
+  }
+  // Reads are started in order, so the next result in order is always on
+  // its way; waiting for it can't deadlock.
+  for (size_t delivered = 0; delivered < count; ++delivered) {
+    std::unique_lock<std::mutex> lock(mutex);
+    result_ready.wait(lock, [&]() {
+      return options.in_order ? results.count(delivered) != 0
+                              : !results.empty();
+    });
+    auto found = options.in_order ? results.find(delivered) : results.begin();
+    size_t index = found->first;
+    auto result = std::move(found->second);
+    results.erase(found);
+    lock.unlock();
+    bool more = deliver(index, result.get());
+    lock.lock();
+    --outstanding;
+    stopped = !more;
+    reader_ready.notify_all();
+    if (stopped) {
+      break;
+    }
+  }
+  for (auto &thread : threads) {
+    thread.join();
+  }
+}
+
+void IndexPack::ReadFileDataBatch(const std::vector<std::string> &hashes,
+                                  const BatchReadOptions &options,
+                                  const FileDataBatchCallback &callback) {
+  RunBatch(hashes.size(), options,
+           [this, &hashes](size_t index, BatchReadResult *result) {
+             result->ok = ReadFileData(hashes[index], &result->content);
+           },
+           [&callback](size_t index, BatchReadResult *result) {
+             return callback(index, result->ok, &result->content);
+           });
+}
+
+void IndexPack::ReadCompilationUnitBatch(
+    const std::vector<std::string> &hashes, const BatchReadOptions &options,
+    const CompilationUnitBatchCallback &callback) {
+  RunBatch(
+      hashes.size(), options,
+      [this, &hashes](size_t index, BatchReadResult *result) {
+        std::string buffer;
+        const auto &hash = hashes[index];
+        result->ok = ReadData(IndexPackFilesystem::DataKind::kCompilationUnit,
+                              hash, &buffer, &result->content) &&
+                     ParseCompilationUnit(hash, buffer, &result->unit,
+                                          &result->content);
+      },
+      [&callback](size_t index, BatchReadResult *result) {
+        return callback(index, result->ok, &result->unit, result->content);
+      });
+}
+
 bool IndexPack::ScanData(IndexPackFilesystem::DataKind kind,
                          IndexPackFilesystem::ScanCallback callback,
                          std::string *error_text) {
@@ -369,9 +915,18 @@ bool IndexPack::AddFileData(const kythe::proto::FileData &content,
                    error_text, digest.empty() ? nullptr : &digest);
 }
 
+bool IndexPack::AddFileData(const char *data, size_t size,
+                            const std::string &digest,
+                            std::string *error_text) {
+  std::string sha = digest;
+  return WriteData(IndexPackFilesystem::DataKind::kFileData, data, size,
+                   error_text, sha.empty() ? nullptr : &sha);
+}
+
 bool IndexPack::WriteMessage(IndexPackFilesystem::DataKind kind,
                              const google::protobuf::Message &message,
-                             std::string *error_text) {
+                             std::string *error_text, std::string *sha,
+                             bool *added) {
   // TODO(zarko): Wrap the output stream and serialize to it without the
   // buffer in between. (This is why the filename is an out-parameter of
   // the callback to AddFileContent--we might have to calculate the hash
@@ -381,15 +936,35 @@ bool IndexPack::WriteMessage(IndexPackFilesystem::DataKind kind,
     *error_text = "Couldn't serialize message.";
     return false;
   }
+  if (sha != nullptr) {
+    sha->clear();
+  }
   return WriteData(kind, message_content.data(), message_content.size(),
-                   error_text, nullptr);
+                   error_text, sha, added);
 }
 
 bool IndexPack::WriteData(IndexPackFilesystem::DataKind kind, const char *data,
                           size_t size, std::string *error_text,
-                          std::string *sha_in) {
-  std::string sha = sha_in ? *sha_in : Sha256(data, size);
-  return filesystem_->AddFileContent(
+                          std::string *sha_inout, bool *added) {
+  if (added != nullptr) {
+    *added = false;
+  }
+  std::string sha = sha_inout && !sha_inout->empty() ? *sha_inout
+                                                     : Sha256(data, size);
+  if (sha_inout != nullptr) {
+    *sha_inout = sha;
+  }
+  auto &known = kind == IndexPackFilesystem::DataKind::kFileData
+                    ? known_files_
+                    : known_units_;
+  if (known.count(sha)) {
+    return true;
+  }
+  if (filesystem_->HasFileContent(kind, sha)) {
+    known.insert(sha);
+    return true;
+  }
+  bool written = filesystem_->AddFileContent(
       kind,
       [data, size, &sha](google::protobuf::io::ZeroCopyOutputStream *stream,
                          std::string *file_name, std::string *error_text) {
@@ -414,5 +989,12 @@ bool IndexPack::WriteData(IndexPackFilesystem::DataKind kind, const char *data,
         return true;
       },
       error_text);
+  if (written) {
+    known.insert(sha);
+    if (added != nullptr) {
+      *added = true;
+    }
+  }
+  return written;
 }
 }  // namespace kythe
@@ -17,11 +17,20 @@
 #ifndef KYTHE_CXX_COMMON_INDEX_PACK_H_
 #define KYTHE_CXX_COMMON_INDEX_PACK_H_
 
+#include <chrono>
+#include <condition_variable>
+#include <functional>
 #include <memory>
+#include <mutex>
 #include <string>
+#include <thread>
+#include <unordered_set>
 #include <utility>
+#include <vector>
 
 #include "google/protobuf/io/zero_copy_stream.h"
+#include "kythe/cxx/common/blob_compression.h"
+#include "kythe/cxx/common/unit_index.h"
 #include "kythe/proto/analysis.pb.h"
 
 namespace kythe {
@@ -94,6 +103,37 @@ class IndexPackFilesystem {
     return false;
   }
 
+  /// \brief Checks whether the underlying index pack already has some data.
+  /// \param data_kind The kind of data to look for.
+  /// \param file_name The name of the data (without extension).
+  /// \return true if the data is known to be present; false if it is absent
+  /// or if the filesystem can't tell cheaply.
+  virtual bool HasFileContent(DataKind data_kind,
+                              const std::string &file_name) {
+    return false;
+  }
+
+  /// \brief Hints that some data will be read soon. Filesystems for which
+  /// reads are slow may start fetching it in the background.
+  /// \param data_kind The kind of data that will be read.
+  /// \param file_names The names of the data (without extensions).
+  virtual void PrefetchFileContent(DataKind data_kind,
+                                   const std::vector<std::string> &file_names) {
+  }
+
+  /// \brief Attempt to remove file content from the underlying index pack.
+  /// \param data_kind The kind of data to remove.
+  /// \param file_name The name of the data (without extension).
+  /// \param error_text Non-null; used for error descriptions.
+  /// \return false on failure (including if the data was absent) and true
+  /// on success.
+  virtual bool DeleteFileContent(DataKind data_kind,
+                                 const std::string &file_name,
+                                 std::string *error_text) {
+    *error_text = "Index pack doesn't support deletion.";
+    return false;
+  }
+
   /// \brief The directory name to use for file data.
   static const char kDataDirectoryName[];
 
@@ -109,13 +149,71 @@ class IndexPackFilesystem {
   /// \brief The suffix to use for temporary file data.
   static const char kTempFileSuffix[];
 
+  /// \brief The directory name to use for the unit index.
+  static const char kUnitIndexDirectoryName[];
+
   /// \brief Returns the mode in which this index pack has been opened.
   virtual OpenMode open_mode() const = 0;
 
+  /// \brief Sets how new content is compressed. Content is always read back
+  /// in whatever format it was written.
+  void set_blob_compression(const BlobCompression &compression) {
+    blob_compression_ = compression;
+  }
+
+  /// \brief How to publish new file data in batches.
+  struct PublishBatching {
+    /// The most blobs to publish at once, or 0 to publish each blob as it
+    /// is added.
+    size_t max_blobs = 0;
+    /// The longest a blob may wait to be published.
+    std::chrono::milliseconds max_delay{100};
+  };
+
+  /// \brief Publishes new file data in batches from a background thread, if
+  /// this filesystem supports it. Compilation units are still published as
+  /// they are added, but only once all of the file data added before them
+  /// has been published. Call before adding any content.
+  virtual void set_publish_batching(const PublishBatching &batching) {}
+
+  /// \brief Returns the index of the units in this pack, or null if this
+  /// filesystem doesn't keep one.
+  UnitIndex *unit_index() { return unit_index_.get(); }
+
   virtual ~IndexPackFilesystem() {}
+
+ protected:
+  /// \brief Opens the unit index in the `kUnitIndexDirectoryName` directory
+  /// under `root_directory`. Filesystems that keep a unit index call this
+  /// once they are otherwise ready.
+  /// \return false on failure and true on success.
+  bool OpenUnitIndex(const std::string &root_directory,
+                     std::string *error_text);
+
+  /// How to compress new content.
+  BlobCompression blob_compression_;
+  /// The index of the units in this pack, or null.
+  std::unique_ptr<UnitIndex> unit_index_;
 };
 
-/// \brief A read/write `IndexPackFilesystem` that uses atomic renames.
+/// \brief Parses a batching spec for `set_publish_batching`: "<blobs>" or
+/// "<blobs>:<milliseconds>".
+/// \return false on failure, with `error_text` set.
+bool ParsePublishBatching(const std::string &spec,
+                          IndexPackFilesystem::PublishBatching *out,
+                          std::string *error_text);
+
+/// \brief A read/write `IndexPackFilesystem` that publishes files with atomic
+/// links (or renames, where links aren't supported). Data that is already
+/// present is never replaced.
+///
+/// With publish batching, each added blob is written and closed as usual,
+/// then handed to a publisher thread. The publisher links a batch of blobs
+/// into place and then syncs the data directory once, so adding content
+/// doesn't wait on a metadata round trip per blob (which dominates on network
+/// filesystems). A blob is still only ever visible under its final name once
+/// it's complete, and no compilation unit is published before the data added
+/// ahead of it.
 class IndexPackPosixFilesystem : public IndexPackFilesystem {
  public:
   /// \brief Mounts a subdirectory as an index pack.
@@ -132,10 +230,23 @@ class IndexPackPosixFilesystem : public IndexPackFilesystem {
       const std::string &root_path, IndexPackFilesystem::OpenMode open_mode,
       std::string *error_text);
 
+  /// \brief Publishes any pending blobs.
+  ~IndexPackPosixFilesystem() override;
+
   IndexPackFilesystem::OpenMode open_mode() const override {
     return open_mode_;
   }
 
+  /// \brief Starts the publisher thread (if `batching.max_blobs` is nonzero
+  /// and this filesystem is writable). Call at most once.
+  void set_publish_batching(const PublishBatching &batching) override;
+
+  /// \brief Waits until every blob added so far has been published.
+  /// \param error_text Set to the first publishing error, if any.
+  /// \return false if any blob failed to publish. Once publishing fails, no
+  /// more content can be added.
+  bool FlushPublishes(std::string *error_text);
+
   bool AddFileContent(DataKind data_kind, WriteCallback callback,
                       std::string *error_text) override;
 
@@ -145,6 +256,30 @@ class IndexPackPosixFilesystem : public IndexPackFilesystem {
   bool ScanFiles(DataKind data_kind, ScanCallback callback,
                  std::string *error_text) override;
 
+  bool HasFileContent(DataKind data_kind,
+                      const std::string &file_name) override;
+
+  bool DeleteFileContent(DataKind data_kind, const std::string &file_name,
+                         std::string *error_text) override;
+
+  /// \brief How `CloneFileContentFrom` published some data.
+  enum class CloneMethod {
+    kAlreadyPresent,  ///< This pack already had the data.
+    kReflink,         ///< The data shares storage with the source's copy.
+    kHardLink,        ///< The data is the same file as the source's copy.
+    kCopy             ///< The data was copied byte for byte.
+  };
+
+  /// \brief Publishes the data named `file_name` in `source` in this pack
+  /// as-is (without decompressing it), preferring a reflink, then a hard
+  /// link, then a plain copy.
+  /// \param method Set to the method used on success.
+  /// \param error_text Set to text describing errors should they occur.
+  /// \return true on success; false on failure.
+  bool CloneFileContentFrom(IndexPackPosixFilesystem *source,
+                            DataKind data_kind, const std::string &file_name,
+                            CloneMethod *method, std::string *error_text);
+
  private:
   /// \brief Build an IndexPackPosixFilesystem without verifying that it's OK.
   /// \param root_directory The mount point as an absolute path.
@@ -169,6 +304,33 @@ class IndexPackPosixFilesystem : public IndexPackFilesystem {
   std::string GenerateFilenameFor(DataKind data_kind, const std::string &hash,
                                   std::string *error_text);
 
+  /// \brief Publishes the complete file at `temp_path` as `file`, leaving
+  /// any existing `file` alone, and removes `temp_path`.
+  /// \return true on success; false on failure.
+  static bool PublishTempFile(const std::string &temp_path,
+                              const std::string &file,
+                              std::string *error_text);
+
+  /// \brief Hands the complete file at `temp_path` to the publisher thread
+  /// to be published as `file`.
+  /// \return true on success; false on failure.
+  bool QueueTempFile(const std::string &temp_path, const std::string &file,
+                     std::string *error_text);
+
+  /// \brief Publishes batches of queued files until asked to stop.
+  void PublishQueuedFiles();
+
+  /// \return true if `file` is waiting to be published.
+  bool IsQueued(const std::string &file);
+
+  /// A file waiting to be published.
+  struct QueuedFile {
+    /// The complete temporary file.
+    std::string temp_path;
+    /// The path to publish it at.
+    std::string file;
+  };
+
   /// Where the index pack is mounted in the external filesystem (absolute).
   std::string root_directory_;
   /// This filesystem's read/write status.
@@ -177,6 +339,31 @@ class IndexPackPosixFilesystem : public IndexPackFilesystem {
   std::string data_directory_;
   /// The path to the unit directory (absolute).
   std::string unit_directory_;
+  /// How to batch publishing.
+  PublishBatching batching_;
+  /// Publishes queued files (if batching is on).
+  std::thread publisher_;
+  /// Guards the members below.
+  std::mutex publish_mutex_;
+  /// Signaled when files are queued or when the publisher should hurry.
+  std::condition_variable publish_wanted_;
+  /// Signaled when the publisher finishes a batch.
+  std::condition_variable batch_published_;
+  /// Files waiting for the publisher, in the order they were added.
+  std::vector<QueuedFile> queue_;
+  /// When the first file in `queue_` was queued.
+  std::chrono::steady_clock::time_point queued_at_;
+  /// The final paths of the files in `queue_` and in the batch being
+  /// published.
+  std::unordered_set<std::string> queued_files_;
+  /// Whether the publisher is publishing a batch.
+  bool publishing_ = false;
+  /// The number of threads waiting in `FlushPublishes`.
+  size_t flushers_ = 0;
+  /// Whether the publisher should publish what's left and exit.
+  bool stopping_ = false;
+  /// The first publishing error, if any.
+  std::string publish_error_;
 };
 
 /// \brief A collection of compilation units and associated file data.
@@ -187,7 +374,8 @@ class IndexPack {
   explicit IndexPack(std::unique_ptr<IndexPackFilesystem> filesystem)
       : filesystem_(std::move(filesystem)) {}
 
-  /// \brief Adds a CompilationUnit to the index pack.
+  /// \brief Adds a CompilationUnit to the index pack and, if the
+  /// filesystem keeps one, to its unit index.
   /// \param unit The `CompilationUnit` to add.
   /// \param error_text Set if the return value is false.
   /// \return false on failure and true on success.
@@ -201,9 +389,17 @@ class IndexPack {
   ///
   /// If the digest of `content` is set, it will not be recomputed.
   /// Fields besides `content` and `digest` on `content` are ignored.
+  /// Data that is already in the index pack isn't compressed or written
+  /// again.
   bool AddFileData(const kythe::proto::FileData &content,
                    std::string *error_text);
 
+  /// \brief Adds the `size` bytes of file data at `data` to the index pack,
+  /// as for the `FileData` overload but without a copy into a message.
+  /// \param digest The digest of the data, or empty to compute it.
+  bool AddFileData(const char *data, size_t size, const std::string &digest,
+                   std::string *error_text);
+
   /// \brief Reads file data from the index pack.
   /// \param hash The hash of the file to read.
   /// \param out Non-null. On success, contains the file data. On failure,
@@ -220,6 +416,58 @@ class IndexPack {
                            kythe::proto::CompilationUnit *unit,
                            std::string *error_text);
 
+  /// \brief Hints that the file data for each of `hashes` will be read soon
+  /// (see `IndexPackFilesystem::PrefetchFileContent`).
+  void PrefetchFileData(const std::vector<std::string> &hashes) {
+    filesystem_->PrefetchFileContent(IndexPackFilesystem::DataKind::kFileData,
+                                     hashes);
+  }
+
+  /// \brief Options for batched reads.
+  struct BatchReadOptions {
+    /// The number of threads to read with. If this is 1 or less, reads
+    /// happen on the calling thread.
+    size_t parallelism = 8;
+    /// The most reads that may be in flight or waiting to be delivered.
+    size_t readahead = 64;
+    /// If true, results are delivered in request order; otherwise, they are
+    /// delivered as they complete.
+    bool in_order = false;
+  };
+
+  /// \brief Receives the result of one read of file data in a batch.
+  /// \param index The position of the hash in the request.
+  /// \param ok Whether the read succeeded.
+  /// \param content On success, the file data; on failure, error text.
+  /// \return true to continue reading; false to stop.
+  using FileDataBatchCallback =
+      std::function<bool(size_t index, bool ok, std::string *content)>;
+
+  /// \brief Reads the file data for each of `hashes` on up to
+  /// `options.parallelism` threads.
+  ///
+  /// `callback` is always called on the calling thread, once per hash unless
+  /// it stops early. The filesystem must allow concurrent reads.
+  void ReadFileDataBatch(const std::vector<std::string> &hashes,
+                         const BatchReadOptions &options,
+                         const FileDataBatchCallback &callback);
+
+  /// \brief Receives the result of one read of a unit in a batch.
+  /// \param index The position of the hash in the request.
+  /// \param ok Whether the read succeeded.
+  /// \param unit On success, the unit.
+  /// \param error_text On failure, an error description.
+  /// \return true to continue reading; false to stop.
+  using CompilationUnitBatchCallback = std::function<bool(
+      size_t index, bool ok, kythe::proto::CompilationUnit *unit,
+      const std::string &error_text)>;
+
+  /// \brief Reads the `CompilationUnit` for each of `hashes` on up to
+  /// `options.parallelism` threads; see `ReadFileDataBatch`.
+  void ReadCompilationUnitBatch(const std::vector<std::string> &hashes,
+                                const BatchReadOptions &options,
+                                const CompilationUnitBatchCallback &callback);
+
   /// \brief Scans over the hashes of various data in the index pack.
   /// \param kind The kind of data to scan.
   /// \param callback The callback to call with each hash. Return true to
@@ -230,22 +478,61 @@ class IndexPack {
                 std::function<bool(const std::string &hash)> callback,
                 std::string *error_text);
 
+  /// \brief Finds the units that `key` of kind `kind` maps to in the pack's
+  /// unit index, without reading any units.
+  /// \param hashes Set to the hashes of the units, sorted.
+  /// \param error_text Set to text describing errors should they occur.
+  /// \return false on failure (including if the filesystem keeps no unit
+  /// index, or if its index needs to be rebuilt) and true on success.
+  bool FindCompilationUnits(UnitIndex::KeyKind kind, const std::string &key,
+                            std::vector<std::string> *hashes,
+                            std::string *error_text);
+
+  /// \brief Replaces the pack's unit index with one built by reading every
+  /// unit in the pack, for packs with units that were added before they had
+  /// a unit index (or by writers that failed to index them).
+  /// \param error_text Set to text describing errors should they occur.
+  /// \return false on failure (including if any unit couldn't be read) and
+  /// true on success.
+  bool RebuildUnitIndex(const BatchReadOptions &options,
+                        std::string *error_text);
+
+  /// \brief Removes file data from the index pack. Units that still refer
+  /// to it will be incomplete.
+  /// \param hash The hash of the file to remove.
+  /// \param error_text Set to text describing errors should they occur.
+  /// \return true on success; false on failure.
+  bool DeleteFileData(const std::string &hash, std::string *error_text);
+
  private:
+  /// \brief Reads all of the data of kind `kind` named `hash` into `out`.
+  /// \return false on failure and true on success.
+  bool ReadData(IndexPackFilesystem::DataKind kind, const std::string &hash,
+                std::string *out, std::string *error_text);
+
   /// \brief Write data of kind `kind` with payload `message`.
+  /// \param sha If non-null, set to the SHA256 digest of the data.
+  /// \param added If non-null, set to whether the data was new to the pack.
   /// \return false on failure and true on success.
   bool WriteMessage(IndexPackFilesystem::DataKind kind,
                     const google::protobuf::Message &message,
-                    std::string *error_text);
+                    std::string *error_text, std::string *sha = nullptr,
+                    bool *added = nullptr);
 
   /// \brief Write data of kind `kind` with some raw payload.
-  /// \param sha If null, recalculates the SHA256 digest of the data.
+  /// \param sha If null or empty, recalculates the SHA256 digest of the data
+  /// (into `*sha` if it isn't null).
+  /// \param added If non-null, set to whether the data was new to the pack.
   /// \return false on failure and true on success.
   bool WriteData(IndexPackFilesystem::DataKind kind, const char *bytes,
                  size_t size, std::string *error_text,
-                 std::string *sha = nullptr);
+                 std::string *sha = nullptr, bool *added = nullptr);
 
   /// The view of the filesystem for this IndexPack.
   std::unique_ptr<IndexPackFilesystem> filesystem_;
+  /// The names of the unit and file data that this IndexPack has written or
+  /// found in `filesystem_`.
+  std::unordered_set<std::string> known_units_, known_files_;
 };
 }  // namespace kythe
 
@@ -40,14 +40,27 @@ class InMemoryIndexPackFilesystem : public IndexPackFilesystem {
       }
     }
     files_[data_kind].emplace(file_name, file_data);
+    ++add_calls_;
     return true;
   }
 
+  bool HasFileContent(DataKind data_kind,
+                      const std::string &file_name) override {
+    auto kind = files_.find(data_kind);
+    return kind != files_.end() && kind->second.count(file_name);
+  }
+
   bool ReadFileContent(DataKind data_kind, const std::string &file_name,
                        ReadCallback callback,
                        std::string *error_text) override {
-    auto record = files_[data_kind].find(file_name);
-    if (record == files_[data_kind].end()) {
+    // Don't use operator[]; batched reads call this concurrently.
+    auto kind = files_.find(data_kind);
+    if (kind == files_.end()) {
+      *error_text = "file not found";
+      return false;
+    }
+    auto record = kind->second.find(file_name);
+    if (record == kind->second.end()) {
       *error_text = "file not found";
       return false;
     }
@@ -71,6 +84,8 @@ class InMemoryIndexPackFilesystem : public IndexPackFilesystem {
 
   /// Maps from data kinds to (maps from hashes to file content).
   std::map<DataKind, std::map<std::string, std::string>> files_;
+  /// The number of calls to `AddFileContent` that have succeeded.
+  size_t add_calls_ = 0;
 };
 
 TEST(IndexPack, AddCompilationUnit) {
@@ -94,6 +109,31 @@ TEST(IndexPack, AddFileData) {
   EXPECT_TRUE(pack.AddFileData(file_data, &error_text));
 }
 
+TEST(IndexPack, SkipsWritesForKnownData) {
+  auto filesystem = std::unique_ptr<InMemoryIndexPackFilesystem>(
+      new InMemoryIndexPackFilesystem());
+  auto *files = filesystem.get();
+  kythe::proto::FileData file_data;
+  file_data.set_content("test");
+  file_data.mutable_info()->set_digest("present");
+  files->files_[IndexPackFilesystem::DataKind::kFileData]["present"] = "test";
+  IndexPack pack(std::move(filesystem));
+  std::string error_text;
+  EXPECT_TRUE(pack.AddFileData(file_data, &error_text));
+  EXPECT_EQ(0, files->add_calls_);
+  file_data.mutable_info()->set_digest("absent");
+  EXPECT_TRUE(pack.AddFileData(file_data, &error_text));
+  EXPECT_EQ(1, files->add_calls_);
+  // Known data isn't even looked up again.
+  files->files_.clear();
+  EXPECT_TRUE(pack.AddFileData(file_data, &error_text));
+  EXPECT_EQ(1, files->add_calls_);
+  kythe::proto::CompilationUnit unit;
+  EXPECT_TRUE(pack.AddCompilationUnit(unit, &error_text));
+  EXPECT_TRUE(pack.AddCompilationUnit(unit, &error_text));
+  EXPECT_EQ(2, files->add_calls_);
+}
+
 TEST(IndexPack, ScanData) {
   auto filesystem = std::unique_ptr<InMemoryIndexPackFilesystem>(
       new InMemoryIndexPackFilesystem());
@@ -203,6 +243,123 @@ TEST(IndexPack, ReadCompilationUnitBadVersion) {
   EXPECT_FALSE(error_text.empty());
 }
 
+/// \brief Builds an `IndexPack` holding file data "content<N>" named
+/// "hash<N>" for N in [0, count).
+std::unique_ptr<IndexPack> MakeFileDataPack(size_t count) {
+  auto filesystem = std::unique_ptr<InMemoryIndexPackFilesystem>(
+      new InMemoryIndexPackFilesystem());
+  for (size_t i = 0; i < count; ++i) {
+    filesystem->files_[IndexPackFilesystem::DataKind::kFileData]
+                      ["hash" + std::to_string(i)] =
+        "content" + std::to_string(i);
+  }
+  return std::unique_ptr<IndexPack>(new IndexPack(std::move(filesystem)));
+}
+
+TEST(IndexPack, ReadFileDataBatch) {
+  auto pack = MakeFileDataPack(100);
+  std::vector<std::string> hashes;
+  for (size_t i = 0; i < 100; ++i) {
+    hashes.push_back("hash" + std::to_string(i));
+  }
+  hashes.push_back("notafile");
+  for (size_t parallelism : {1, 4, 200}) {
+    IndexPack::BatchReadOptions options;
+    options.parallelism = parallelism;
+    options.readahead = 2;
+    std::vector<int> deliveries(hashes.size(), 0);
+    pack->ReadFileDataBatch(
+        hashes, options,
+        [&hashes, &deliveries](size_t index, bool ok, std::string *content) {
+          ++deliveries[index];
+          if (index == 100) {
+            EXPECT_FALSE(ok);
+            EXPECT_FALSE(content->empty());
+          } else {
+            EXPECT_TRUE(ok) << *content;
+            EXPECT_EQ("content" + std::to_string(index), *content);
+          }
+          return true;
+        });
+    EXPECT_EQ(std::vector<int>(hashes.size(), 1), deliveries)
+        << "with parallelism " << parallelism;
+  }
+}
+
+TEST(IndexPack, ReadFileDataBatchInOrder) {
+  auto pack = MakeFileDataPack(50);
+  std::vector<std::string> hashes;
+  for (size_t i = 50; i > 0; --i) {
+    hashes.push_back("hash" + std::to_string(i - 1));
+  }
+  IndexPack::BatchReadOptions options;
+  options.parallelism = 8;
+  options.in_order = true;
+  size_t next_index = 0;
+  pack->ReadFileDataBatch(
+      hashes, options,
+      [&hashes, &next_index](size_t index, bool ok, std::string *content) {
+        EXPECT_EQ(next_index++, index);
+        EXPECT_EQ("content" + hashes[index].substr(4), *content);
+        return true;
+      });
+  EXPECT_EQ(hashes.size(), next_index);
+}
+
+TEST(IndexPack, ReadFileDataBatchStops) {
+  auto pack = MakeFileDataPack(50);
+  std::vector<std::string> hashes(50, "hash0");
+  for (size_t parallelism : {1, 4}) {
+    IndexPack::BatchReadOptions options;
+    options.parallelism = parallelism;
+    size_t calls = 0;
+    pack->ReadFileDataBatch(hashes, options,
+                            [&calls](size_t index, bool ok,
+                                     std::string *content) {
+                              ++calls;
+                              return false;
+                            });
+    EXPECT_EQ(1, calls);
+  }
+  size_t calls = 0;
+  pack->ReadFileDataBatch({}, IndexPack::BatchReadOptions(),
+                          [&calls](size_t index, bool ok,
+                                   std::string *content) {
+                            ++calls;
+                            return true;
+                          });
+  EXPECT_EQ(0, calls);
+}
+
+TEST(IndexPack, ReadCompilationUnitBatch) {
+  auto filesystem = std::unique_ptr<InMemoryIndexPackFilesystem>(
+      new InMemoryIndexPackFilesystem());
+  auto &units =
+      filesystem->files_[IndexPackFilesystem::DataKind::kCompilationUnit];
+  units["good"] =
+      "{\"format\":\"kythe\",\"content\":{\"output_key\":\"a\"}}";
+  units["wrong"] =
+      "{\"format\":\"wrong\",\"content\":{\"output_key\":\"b\"}}";
+  IndexPack pack(std::move(filesystem));
+  std::vector<std::string> hashes = {"good", "wrong", "notafile", "good"};
+  IndexPack::BatchReadOptions options;
+  options.parallelism = 2;
+  std::vector<bool> results(hashes.size(), false);
+  pack.ReadCompilationUnitBatch(
+      hashes, options,
+      [&results](size_t index, bool ok, kythe::proto::CompilationUnit *unit,
+                 const std::string &error_text) {
+        results[index] = ok;
+        if (ok) {
+          EXPECT_EQ("a", unit->output_key());
+        } else {
+          EXPECT_FALSE(error_text.empty());
+        }
+        return true;
+      });
+  EXPECT_EQ(std::vector<bool>({true, false, false, true}), results);
+}
+
 // Some arbitrary but well-formed sha values.
 static const char kData1Sha[] =
     "5b41362bc82b7f3d56edc5a306db22105707d01ff4819e26faef9724a2d406c9";
@@ -228,6 +385,20 @@ class TemporaryFilesystem {
 
   /// \brief Attempts to clean up test directories.
   bool Cleanup() {
+    // Packs opened for writing keep a unit index.
+    llvm::SmallString<512> unit_index(root_);
+    llvm::sys::path::append(unit_index,
+                            IndexPackFilesystem::kUnitIndexDirectoryName);
+    if (llvm::sys::fs::is_directory(llvm::Twine(unit_index))) {
+      for (const char *name : {"journal", "table"}) {
+        llvm::SmallString<512> path(unit_index);
+        llvm::sys::path::append(path, name);
+        if (llvm::sys::fs::exists(llvm::Twine(path))) {
+          files_to_remove_.insert(path.str());
+        }
+      }
+      directories_to_remove_.insert(unit_index.str());
+    }
     // Do the best we can to clean up the temporary files we've made.
     std::error_code err;
     for (const auto &file : files_to_remove_) {
@@ -271,6 +442,13 @@ class TemporaryFilesystem {
     return !llvm::sys::fs::remove(llvm::Twine(full_path), false);
   }
 
+  /// \brief Returns whether the file file_name in directory file_dir exists.
+  bool FileExists(const std::string &file_dir, const std::string &file_name) {
+    llvm::SmallString<512> full_path(root_);
+    llvm::sys::path::append(full_path, file_dir, file_name);
+    return llvm::sys::fs::exists(llvm::Twine(full_path));
+  }
+
   /// \brief Creates a temporary directory that will be removed on exit.
   bool CreateDirectory(const std::string &relative_path) {
     llvm::SmallString<512> full_path(root_);
@@ -496,7 +674,11 @@ TEST(IndexPack, PosixAddContent) {
 
   EXPECT_TRUE(
       Insert(IndexPackFilesystem::DataKind::kFileData, kData1Sha, "data1"));
-  // NB: We check that data2 is overwriting data1 in kData1Sha.
+  EXPECT_TRUE(posix->HasFileContent(IndexPackFilesystem::DataKind::kFileData,
+                                    kData1Sha));
+  EXPECT_FALSE(posix->HasFileContent(
+      IndexPackFilesystem::DataKind::kCompilationUnit, kData1Sha));
+  // NB: We check that data2 does not replace data1 in kData1Sha.
   EXPECT_TRUE(
       Insert(IndexPackFilesystem::DataKind::kFileData, kData1Sha, "data2"));
   EXPECT_TRUE(Insert(IndexPackFilesystem::DataKind::kCompilationUnit, kData1Sha,
@@ -515,7 +697,7 @@ TEST(IndexPack, PosixAddContent) {
         return TemporaryFilesystem::ReadFromStream(stream, &content);
       },
       &error_text));
-  EXPECT_EQ("data2", content);
+  EXPECT_EQ("data1", content);
 
   EXPECT_TRUE(second_posix->ReadFileContent(
       IndexPackFilesystem::DataKind::kCompilationUnit, kData1Sha,
@@ -538,6 +720,256 @@ TEST(IndexPack, PosixAddContent) {
   EXPECT_TRUE(files.Cleanup());
 }
 
+TEST(IndexPack, PosixBatchesPublishes) {
+  TemporaryFilesystem files;
+  std::string error_text;
+  auto posix = IndexPackPosixFilesystem::Open(
+      files.root(), IndexPackFilesystem::OpenMode::kReadWrite, &error_text);
+  ASSERT_NE(nullptr, posix);
+  IndexPackFilesystem::PublishBatching batching;
+  batching.max_blobs = 10;
+  // Long enough that only a flush publishes a partial batch.
+  batching.max_delay = std::chrono::hours(1);
+  posix->set_publish_batching(batching);
+
+  auto Insert = [&posix, &error_text](IndexPackFilesystem::DataKind kind,
+                                      const std::string &hash,
+                                      const std::string &content) {
+    return posix->AddFileContent(
+        kind,
+        [&hash, &content](google::protobuf::io::ZeroCopyOutputStream *stream,
+                          std::string *file_name, std::string *error_text) {
+          *file_name = hash;
+          return TemporaryFilesystem::WriteToStream(content, stream);
+        },
+        &error_text);
+  };
+  const std::string data1 = std::string(kData1Sha) + ".data";
+  const std::string data2 = std::string(kData2Sha) + ".data";
+
+  EXPECT_TRUE(
+      Insert(IndexPackFilesystem::DataKind::kFileData, kData1Sha, "data1"));
+  EXPECT_TRUE(
+      Insert(IndexPackFilesystem::DataKind::kFileData, kData1Sha, "data1"));
+  // Queued data counts as present, but isn't published yet.
+  EXPECT_TRUE(posix->HasFileContent(IndexPackFilesystem::DataKind::kFileData,
+                                    kData1Sha));
+  EXPECT_FALSE(files.FileExists("files", data1));
+  // Adding a unit publishes the data before it.
+  EXPECT_TRUE(Insert(IndexPackFilesystem::DataKind::kCompilationUnit,
+                     kUnit1Sha, "unit1"));
+  EXPECT_TRUE(files.FileExists("files", data1));
+  EXPECT_TRUE(files.FileExists("units", std::string(kUnit1Sha) + ".unit"));
+
+  EXPECT_TRUE(
+      Insert(IndexPackFilesystem::DataKind::kFileData, kData2Sha, "data2"));
+  EXPECT_FALSE(files.FileExists("files", data2));
+  // Reads see queued data.
+  std::string content;
+  EXPECT_TRUE(posix->ReadFileContent(
+      IndexPackFilesystem::DataKind::kFileData, kData2Sha,
+      [&content](google::protobuf::io::ZeroCopyInputStream *stream,
+                 std::string *error_text) {
+        return TemporaryFilesystem::ReadFromStream(stream, &content);
+      },
+      &error_text));
+  EXPECT_EQ("data2", content);
+  EXPECT_TRUE(files.FileExists("files", data2));
+  EXPECT_TRUE(posix->FlushPublishes(&error_text)) << error_text;
+  posix.reset();
+
+  EXPECT_TRUE(files.RemoveFileIfExists("files", data1));
+  EXPECT_TRUE(files.RemoveFileIfExists("files", data2));
+  EXPECT_TRUE(
+      files.RemoveFileIfExists("units", std::string(kUnit1Sha) + ".unit"));
+  // No temporary files are left behind.
+  EXPECT_TRUE(files.RemoveDirectoryIfExists("units"));
+  EXPECT_TRUE(files.RemoveDirectoryIfExists("files"));
+  EXPECT_TRUE(files.Cleanup());
+}
+
+TEST(IndexPack, PosixPublishesBatchesOnDestruction) {
+  TemporaryFilesystem files;
+  std::string error_text;
+  auto posix = IndexPackPosixFilesystem::Open(
+      files.root(), IndexPackFilesystem::OpenMode::kReadWrite, &error_text);
+  ASSERT_NE(nullptr, posix);
+  IndexPackFilesystem::PublishBatching batching;
+  batching.max_blobs = 10;
+  batching.max_delay = std::chrono::hours(1);
+  posix->set_publish_batching(batching);
+  EXPECT_TRUE(posix->AddFileContent(
+      IndexPackFilesystem::DataKind::kFileData,
+      [](google::protobuf::io::ZeroCopyOutputStream *stream,
+         std::string *file_name, std::string *error_text) {
+        *file_name = kData1Sha;
+        return TemporaryFilesystem::WriteToStream("data1", stream);
+      },
+      &error_text));
+  posix.reset();
+  EXPECT_TRUE(
+      files.RemoveFileIfExists("files", std::string(kData1Sha) + ".data"));
+  EXPECT_TRUE(files.RemoveDirectoryIfExists("files"));
+}
+
+TEST(IndexPack, ParsePublishBatching) {
+  IndexPackFilesystem::PublishBatching batching;
+  std::string error_text;
+  ASSERT_TRUE(ParsePublishBatching("64", &batching, &error_text));
+  EXPECT_EQ(64, batching.max_blobs);
+  EXPECT_EQ(100, batching.max_delay.count());
+  ASSERT_TRUE(ParsePublishBatching("8:20", &batching, &error_text));
+  EXPECT_EQ(8, batching.max_blobs);
+  EXPECT_EQ(20, batching.max_delay.count());
+  EXPECT_FALSE(ParsePublishBatching("", &batching, &error_text));
+  EXPECT_FALSE(ParsePublishBatching("8:", &batching, &error_text));
+  EXPECT_FALSE(ParsePublishBatching("x:20", &batching, &error_text));
+}
+
+TEST(IndexPack, PosixDeleteContent) {
+  TemporaryFilesystem files;
+  ASSERT_TRUE(files.MakeDefault());
+  std::string error_text;
+  auto read_only = IndexPackPosixFilesystem::Open(
+      files.root(), IndexPackFilesystem::OpenMode::kReadOnly, &error_text);
+  ASSERT_NE(nullptr, read_only);
+  EXPECT_FALSE(read_only->DeleteFileContent(
+      IndexPackFilesystem::DataKind::kFileData, kData1Sha, &error_text));
+  EXPECT_FALSE(error_text.empty());
+  error_text.clear();
+  auto posix = IndexPackPosixFilesystem::Open(
+      files.root(), IndexPackFilesystem::OpenMode::kReadWrite, &error_text);
+  ASSERT_NE(nullptr, posix);
+  EXPECT_TRUE(posix->DeleteFileContent(IndexPackFilesystem::DataKind::kFileData,
+                                       kData1Sha, &error_text))
+      << error_text;
+  EXPECT_FALSE(posix->HasFileContent(IndexPackFilesystem::DataKind::kFileData,
+                                     kData1Sha));
+  EXPECT_TRUE(posix->HasFileContent(IndexPackFilesystem::DataKind::kFileData,
+                                    kData2Sha));
+  // Deleting again fails because the file is already gone.
+  EXPECT_FALSE(posix->DeleteFileContent(
+      IndexPackFilesystem::DataKind::kFileData, kData1Sha, &error_text));
+  EXPECT_FALSE(posix->DeleteFileContent(
+      IndexPackFilesystem::DataKind::kFileData, "../units/x", &error_text));
+}
+
+TEST(IndexPack, PosixFindCompilationUnits) {
+  TemporaryFilesystem files;
+  std::string error_text;
+  auto posix = IndexPackPosixFilesystem::Open(
+      files.root(), IndexPackFilesystem::OpenMode::kReadWrite, &error_text);
+  ASSERT_NE(nullptr, posix) << error_text;
+  IndexPack pack(std::move(posix));
+  kythe::proto::CompilationUnit unit_a, unit_b;
+  unit_a.mutable_v_name()->set_corpus("corpus");
+  unit_a.add_source_file("a.cc");
+  unit_a.set_output_key("a.o");
+  unit_b.mutable_v_name()->set_corpus("corpus");
+  unit_b.add_source_file("a.cc");
+  unit_b.set_output_key("b.o");
+  ASSERT_TRUE(pack.AddCompilationUnit(unit_a, &error_text)) << error_text;
+  ASSERT_TRUE(pack.AddCompilationUnit(unit_b, &error_text)) << error_text;
+  std::vector<std::string> units;
+  ASSERT_TRUE(pack.ScanData(IndexPackFilesystem::DataKind::kCompilationUnit,
+                            [&units](const std::string &hash) {
+                              units.push_back(hash);
+                              return true;
+                            },
+                            &error_text));
+  std::sort(units.begin(), units.end());
+  ASSERT_EQ(2, units.size());
+  kythe::proto::VName source;
+  source.set_corpus("corpus");
+  source.set_path("a.cc");
+  std::vector<std::string> found;
+  ASSERT_TRUE(pack.FindCompilationUnits(UnitIndex::KeyKind::kSourceVName,
+                                        UnitIndex::SourceVNameKey(source),
+                                        &found, &error_text))
+      << error_text;
+  EXPECT_EQ(units, found);
+  // Another reader can find the units too.
+  auto reader = IndexPackPosixFilesystem::Open(
+      files.root(), IndexPackFilesystem::OpenMode::kReadOnly, &error_text);
+  ASSERT_NE(nullptr, reader) << error_text;
+  IndexPack read_pack(std::move(reader));
+  ASSERT_TRUE(read_pack.FindCompilationUnits(UnitIndex::KeyKind::kOutputKey,
+                                             "b.o", &found, &error_text))
+      << error_text;
+  ASSERT_EQ(1, found.size());
+  kythe::proto::CompilationUnit read_unit;
+  ASSERT_TRUE(read_pack.ReadCompilationUnit(found[0], &read_unit, &error_text))
+      << error_text;
+  EXPECT_EQ("b.o", read_unit.output_key());
+  for (const auto &unit : units) {
+    EXPECT_TRUE(files.RemoveFileIfExists("units", unit + ".unit"));
+  }
+  EXPECT_TRUE(files.RemoveDirectoryIfExists("units"));
+  EXPECT_TRUE(files.RemoveDirectoryIfExists("files"));
+  EXPECT_TRUE(files.Cleanup());
+}
+
+TEST(IndexPack, PosixFindCompilationUnitsNeedsRebuild) {
+  TemporaryFilesystem files;
+  ASSERT_TRUE(files.MakeDefault());
+  std::string error_text;
+  auto posix = IndexPackPosixFilesystem::Open(
+      files.root(), IndexPackFilesystem::OpenMode::kReadWrite, &error_text);
+  ASSERT_NE(nullptr, posix) << error_text;
+  IndexPack pack(std::move(posix));
+  std::vector<std::string> found;
+  // The pack had units before it had an index, so the index can't answer.
+  EXPECT_FALSE(pack.FindCompilationUnits(UnitIndex::KeyKind::kOutputKey,
+                                         "a.o", &found, &error_text));
+  // The default pack's units aren't readable, so it can't be rebuilt.
+  EXPECT_FALSE(pack.RebuildUnitIndex(IndexPack::BatchReadOptions(),
+                                     &error_text));
+  EXPECT_TRUE(files.Cleanup());
+}
+
+TEST(IndexPack, PosixCloneContent) {
+  TemporaryFilesystem source_files, target_files;
+  ASSERT_TRUE(source_files.MakeDefault());
+  std::string error_text;
+  auto source = IndexPackPosixFilesystem::Open(
+      source_files.root(), IndexPackFilesystem::OpenMode::kReadOnly,
+      &error_text);
+  ASSERT_NE(nullptr, source);
+  auto target = IndexPackPosixFilesystem::Open(
+      target_files.root(), IndexPackFilesystem::OpenMode::kReadWrite,
+      &error_text);
+  ASSERT_NE(nullptr, target);
+  IndexPackPosixFilesystem::CloneMethod method;
+  ASSERT_TRUE(target->CloneFileContentFrom(
+      source.get(), IndexPackFilesystem::DataKind::kFileData, kData1Sha,
+      &method, &error_text))
+      << error_text;
+  EXPECT_NE(IndexPackPosixFilesystem::CloneMethod::kAlreadyPresent, method);
+  std::string content;
+  EXPECT_TRUE(target->ReadFileContent(
+      IndexPackFilesystem::DataKind::kFileData, kData1Sha,
+      [&content](google::protobuf::io::ZeroCopyInputStream *stream,
+                 std::string *error_text) {
+        return TemporaryFilesystem::ReadFromStream(stream, &content);
+      },
+      &error_text));
+  EXPECT_EQ("data1", content);
+  EXPECT_FALSE(target->HasFileContent(IndexPackFilesystem::DataKind::kFileData,
+                                      kData2Sha));
+  ASSERT_TRUE(target->CloneFileContentFrom(
+      source.get(), IndexPackFilesystem::DataKind::kFileData, kData1Sha,
+      &method, &error_text));
+  EXPECT_EQ(IndexPackPosixFilesystem::CloneMethod::kAlreadyPresent, method);
+  // The source can't be cloned into since it's read-only.
+  EXPECT_FALSE(source->CloneFileContentFrom(
+      target.get(), IndexPackFilesystem::DataKind::kFileData, kData2Sha,
+      &method, &error_text));
+  EXPECT_TRUE(target_files.RemoveFileIfExists(
+      "files", std::string(kData1Sha) + ".data"));
+  EXPECT_TRUE(target_files.RemoveDirectoryIfExists("units"));
+  EXPECT_TRUE(target_files.RemoveDirectoryIfExists("files"));
+}
+
 }  // namespace
 }  // namespace kythe
 
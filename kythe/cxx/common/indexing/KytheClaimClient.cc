@@ -16,12 +16,46 @@
 
 #include "KytheClaimClient.h"
 
+#include <fcntl.h>
 #include <libmemcached/memcached.h>
 #include <openssl/sha.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <random>
+#include <set>
+
+#include "kythe/cxx/common/indexing/memcached_pool.h"
 
 namespace kythe {
 namespace {
 constexpr char kArbitraryClaimantRoot[] = "KytheClaimClient";
+
+/// The owner published for claims that the remote client rejected.
+constexpr uint64_t kRemoteOwner = 1;
+
+/// \return a nonzero 64-bit fingerprint for `vname`.
+uint64_t ShortFingerprint(const kythe::proto::VName &vname) {
+  ClaimTable::Fingerprint fingerprint;
+  ClaimTable::FingerprintVName(vname, &fingerprint);
+  uint64_t result = 0;
+  for (size_t i = 0; i < sizeof(result); ++i) {
+    result |= static_cast<uint64_t>(fingerprint[i]) << (8 * i);
+  }
+  return result == 0 ? 1 : result;
+}
+
+/// \return `fingerprint` as an owner that isn't 0 (pending) or
+/// `kRemoteOwner`.
+uint64_t OwnerFor(uint64_t fingerprint) {
+  return fingerprint <= kRemoteOwner ? kRemoteOwner + 1 : fingerprint;
+}
 }  // anonymous namespace
 
 bool KytheClaimClient::ClaimBatch(
@@ -38,14 +72,38 @@ bool KytheClaimClient::ClaimBatch(
   return success;
 }
 
+void KytheClaimClient::ClaimAll(const kythe::proto::VName &claimant,
+                                const std::vector<kythe::proto::VName> &vnames,
+                                std::vector<bool> *claimed) {
+  claimed->resize(vnames.size());
+  for (size_t i = 0; i < vnames.size(); ++i) {
+    (*claimed)[i] = Claim(claimant, vnames[i]);
+  }
+}
+
 bool StaticClaimClient::Claim(const kythe::proto::VName &claimant,
                               const kythe::proto::VName &vname) {
   const auto lookup = claim_table_.find(vname);
-  if (lookup == claim_table_.end()) {
-    // We don't know who's responsible for this VName.
-    return process_unknown_status_;
+  if (lookup != claim_table_.end()) {
+    return VNameEquals(lookup->second, claimant);
+  }
+  if (mapped_table_ != nullptr) {
+    ClaimTable::Fingerprint vname_fingerprint;
+    ClaimTable::FingerprintVName(vname, &vname_fingerprint);
+    if (const auto *owner = mapped_table_->FindClaimant(vname_fingerprint)) {
+      // Claims are usually made on behalf of the same claimant many times in
+      // a row, so we only fingerprint it when it changes.
+      if (!has_last_claimant_ || !VNameEquals(last_claimant_, claimant)) {
+        last_claimant_ = claimant;
+        ClaimTable::FingerprintVName(claimant, &last_claimant_fingerprint_);
+        has_last_claimant_ = true;
+      }
+      return ::memcmp(owner, last_claimant_fingerprint_.data(),
+                      last_claimant_fingerprint_.size()) == 0;
+    }
   }
-  return VNameEquals(lookup->second, claimant);
+  // We don't know who's responsible for this VName.
+  return process_unknown_status_;
 }
 
 void StaticClaimClient::AssignClaim(const kythe::proto::VName &claimable,
@@ -53,30 +111,64 @@ void StaticClaimClient::AssignClaim(const kythe::proto::VName &claimable,
   claim_table_[claimable] = claimant;
 }
 
-DynamicClaimClient::~DynamicClaimClient() {
-  if (cache_) {
-    memcached_free(cache_);
-    cache_ = nullptr;
+DynamicClaimClient::DynamicClaimClient() {
+  // Batch claims are made for anonymous claimants, so we tell our own claims
+  // apart from those made by other clients with a random identity.
+  std::random_device random;
+  while (batch_claimant_.size() < 16) {
+    auto bits = random();
+    batch_claimant_.append(reinterpret_cast<const char *>(&bits),
+                           sizeof(bits));
+  }
+}
+
+KytheClaimClient::Stats DynamicClaimClient::stats() const {
+  Stats stats;
+  stats.requests = request_count_;
+  stats.rejected = rejected_requests_;
+  stats.round_trips = round_trips_;
+  stats.round_trips_saved = round_trips_saved_;
+  if (pool_) {
+    stats.latency_buckets.assign(MemcachedPool::kBuckets, 0);
+    for (size_t op = 0; op < MemcachedPool::kOpCount; ++op) {
+      const auto &histogram =
+          pool_->histogram(static_cast<MemcachedPool::Op>(op));
+      for (size_t bucket = 0; bucket < MemcachedPool::kBuckets; ++bucket) {
+        stats.latency_buckets[bucket] += histogram.buckets[bucket];
+      }
+      stats.latency_usec += histogram.total_usec;
+    }
   }
+  return stats;
+}
+
+DynamicClaimClient::~DynamicClaimClient() {
   fprintf(
       stderr, "%8lu  %8lu claims approved/rejected (%f reject fraction)\n",
       request_count_ - rejected_requests_, rejected_requests_,
       request_count_ == 0 ? 0.0 : (double)rejected_requests_ / request_count_);
+  fprintf(stderr, "%8lu  %8lu batch claim round trips/timeouts\n",
+          batch_round_trips_, batch_timeouts_);
+  fprintf(stderr, "%8lu  %8lu claim round trips made/saved by batching\n",
+          round_trips_, round_trips_saved_);
+  if (pool_) {
+    fprintf(stderr, "%s", pool_->ToString().c_str());
+  }
 }
 
 bool DynamicClaimClient::OpenMemcache(const std::string &spec) {
-  if (cache_) {
-    memcached_free(cache_);
-    cache_ = nullptr;
+  MemcachedPool::Options options;
+  options.timeout_ms = request_timeout_ms_;
+  pool_.reset(new MemcachedPool("claims", options));
+  bool opened = pool_->Open(spec);
+  if (!pool_->handle()) {
+    pool_.reset();
   }
-  std::string spec_amend = spec;
-  spec_amend.append(" --BINARY-PROTOCOL");
-  cache_ = memcached(spec_amend.c_str(), spec_amend.size());
-  if (cache_ != nullptr) {
-    memcached_return_t remote_version = memcached_version(cache_);
-    return memcached_success(remote_version);
-  }
-  return false;
+  return opened;
+}
+
+void DynamicClaimClient::UsePool(std::unique_ptr<MemcachedPool> pool) {
+  pool_ = std::move(pool);
 }
 
 using Hash = unsigned char[SHA256_DIGEST_LENGTH];
@@ -103,45 +195,500 @@ bool DynamicClaimClient::Claim(const kythe::proto::VName &claimant,
   ++request_count_;
   const auto lookup = claim_table_.find(vname);
   if (lookup == claim_table_.end()) {
-    if (!cache_) {
+    if (!pool_) {
       // Fail open.
       return true;
     }
-    Hash claimant_hash, vname_hash;
-    HashVName(claimant, 0, &claimant_hash);
+    return ClaimRemotely(claimant, vname, 0);
+  }
+
+  if (VNameEquals(lookup->second, claimant)) {
+    return true;
+  } else {
+    ++rejected_requests_;
+    return false;
+  }
+}
+
+bool DynamicClaimClient::ClaimRemotely(const kythe::proto::VName &claimant,
+                                       const kythe::proto::VName &vname,
+                                       size_t first_try) {
+  Hash claimant_hash, vname_hash;
+  HashVName(claimant, 0, &claimant_hash);
+  for (size_t tries = first_try; tries < max_redundant_claims_; ++tries) {
+    if (!pool_->Admit()) {
+      return ClaimUnavailable(claimant, vname);
+    }
+    HashVName(vname, tries, &vname_hash);
+    const auto start = MemcachedPool::Clock::now();
+    memcached_return_t add_result = memcached_add(
+        pool_->handle(), reinterpret_cast<const char *>(&vname_hash),
+        SHA256_DIGEST_LENGTH, reinterpret_cast<const char *>(&claimant_hash),
+        SHA256_DIGEST_LENGTH, 0, 0);
+    ++round_trips_;
+    if (!pool_->Record(MemcachedPool::kAdd, start, add_result)) {
+      fprintf(stderr, "memcached add failed: %s\n",
+              memcached_strerror(pool_->handle(), add_result));
+      return ClaimUnavailable(claimant, vname);
+    }
+    if (add_result != MEMCACHED_DATA_EXISTS) {
+      claim_table_[vname] = claimant;
+      return true;
+    }
+  }
+  // We failed all our tries, so assume we couldn't make a claim.
+  claim_table_[vname] = kythe::proto::VName();
+  ++rejected_requests_;
+  return false;
+}
+
+bool DynamicClaimClient::ClaimUnavailable(const kythe::proto::VName &claimant,
+                                          const kythe::proto::VName &vname) {
+  if (claim_when_unavailable_) {
+    claim_table_[vname] = claimant;
+    return true;
+  }
+  // Don't remember the refusal; we'll ask again once the map is back.
+  ++rejected_requests_;
+  return false;
+}
+
+void DynamicClaimClient::ClaimAll(
+    const kythe::proto::VName &claimant,
+    const std::vector<kythe::proto::VName> &vnames,
+    std::vector<bool> *claimed) {
+  claimed->assign(vnames.size(), false);
+  // The indices of the vnames we need to ask the remote map about.
+  std::vector<size_t> remote;
+  for (size_t i = 0; i < vnames.size(); ++i) {
+    if (pool_ && claim_table_.find(vnames[i]) == claim_table_.end()) {
+      remote.push_back(i);
+    } else {
+      (*claimed)[i] = Claim(claimant, vnames[i]);
+    }
+  }
+  if (remote.empty()) {
+    return;
+  }
+  // The keys for each try of each remote vname, in order.
+  std::vector<unsigned char> hashes(remote.size() * max_redundant_claims_ *
+                                    SHA256_DIGEST_LENGTH);
+  std::vector<const char *> keys;
+  std::vector<size_t> key_lengths;
+  for (size_t i = 0; i < remote.size(); ++i) {
     for (size_t tries = 0; tries < max_redundant_claims_; ++tries) {
-      HashVName(vname, tries, &vname_hash);
-      memcached_return_t add_result = memcached_add(
-          cache_, reinterpret_cast<const char *>(&vname_hash),
-          SHA256_DIGEST_LENGTH, reinterpret_cast<const char *>(&claimant_hash),
-          SHA256_DIGEST_LENGTH, 0, 0);
-      if (!memcached_success(add_result) &&
-          add_result != MEMCACHED_DATA_EXISTS) {
-        // We'll also pass the check below and assume we claimed the vname.
+      auto *hash = &hashes[keys.size() * SHA256_DIGEST_LENGTH];
+      HashVName(vnames[remote[i]], tries, reinterpret_cast<Hash *>(hash));
+      keys.push_back(reinterpret_cast<const char *>(hash));
+      key_lengths.push_back(SHA256_DIGEST_LENGTH);
+    }
+  }
+  // Keys that someone has already added. If the lookup fails, we fall back
+  // to making every claim as `Claim` would.
+  std::set<std::string> taken;
+  if (pool_->Admit()) {
+    ::memcached_st *cache = pool_->handle();
+    const auto start = MemcachedPool::Clock::now();
+    memcached_return_t get_result =
+        memcached_mget(cache, keys.data(), key_lengths.data(), keys.size());
+    ++round_trips_;
+    if (memcached_success(get_result)) {
+      memcached_return_t fetch_result;
+      while (memcached_result_st *result =
+                 memcached_fetch_result(cache, nullptr, &fetch_result)) {
+        taken.emplace(memcached_result_key_value(result),
+                      memcached_result_key_length(result));
+        memcached_result_free(result);
+      }
+      if (!pool_->Record(MemcachedPool::kMultiGet, start, fetch_result)) {
+        fprintf(stderr, "memcached fetch failed: %s\n",
+                memcached_strerror(cache, fetch_result));
+      }
+    } else {
+      pool_->Record(MemcachedPool::kMultiGet, start, get_result);
+      fprintf(stderr, "memcached mget failed: %s\n",
+              memcached_strerror(cache, get_result));
+    }
+  }
+  for (size_t i = 0; i < remote.size(); ++i) {
+    const auto &vname = vnames[remote[i]];
+    if (claim_table_.find(vname) != claim_table_.end()) {
+      // `vnames` had a duplicate that we've already claimed.
+      (*claimed)[remote[i]] = Claim(claimant, vname);
+      continue;
+    }
+    ++request_count_;
+    size_t first_try = 0;
+    while (first_try < max_redundant_claims_ &&
+           taken.count(std::string(
+               keys[i * max_redundant_claims_ + first_try],
+               SHA256_DIGEST_LENGTH)) != 0) {
+      ++first_try;
+    }
+    // Only claims that look like they're free cost a round trip; if another
+    // claimant takes one in the meantime, we move on to the next try.
+    (*claimed)[remote[i]] = ClaimRemotely(claimant, vname, first_try);
+  }
+}
+
+bool DynamicClaimClient::ClaimBatch(
+    std::vector<std::pair<std::string, bool>> *tokens) {
+  const auto deadline = std::chrono::steady_clock::now() +
+                        std::chrono::milliseconds(request_timeout_ms_);
+  // The distinct tokens that aren't known locally. These point to keys in
+  // `token_claims_`, which start out claimed; any the remote map doesn't
+  // decide are given to `claim_when_unavailable_` at the end.
+  std::vector<const std::string *> pending;
+  for (const auto &token : *tokens) {
+    auto inserted = token_claims_.emplace(token.first, true);
+    if (inserted.second && pool_) {
+      pending.push_back(&inserted.first->first);
+    }
+  }
+  kythe::proto::VName claim;
+  claim.set_root(kArbitraryClaimantRoot);
+  // Set if we stopped asking the remote map before running out of tries.
+  bool gave_up = false;
+  for (size_t tries = 0; tries < max_redundant_claims_ && !pending.empty();
+       ++tries) {
+    if (request_timeout_ms_ != 0 &&
+        std::chrono::steady_clock::now() >= deadline) {
+      fprintf(stderr, "memcached batch claim timed out\n");
+      gave_up = true;
+      break;
+    }
+    if (!pool_->Admit()) {
+      gave_up = true;
+      break;
+    }
+    ::memcached_st *cache = pool_->handle();
+    std::vector<unsigned char> hashes(pending.size() * SHA256_DIGEST_LENGTH);
+    std::vector<const char *> keys;
+    std::vector<size_t> key_lengths;
+    std::unordered_map<std::string, size_t> key_to_pending;
+    for (size_t i = 0; i < pending.size(); ++i) {
+      auto *hash = &hashes[i * SHA256_DIGEST_LENGTH];
+      claim.set_signature(*pending[i]);
+      HashVName(claim, tries, reinterpret_cast<Hash *>(hash));
+      keys.push_back(reinterpret_cast<const char *>(hash));
+      key_lengths.push_back(SHA256_DIGEST_LENGTH);
+      key_to_pending.emplace(std::string(keys.back(), SHA256_DIGEST_LENGTH),
+                             i);
+    }
+    // Queue up quiet adds and send them all at once. Whoever got their add
+    // in first owns the token; we find out who that was below.
+    memcached_behavior_set(cache, MEMCACHED_BEHAVIOR_NOREPLY, 1);
+    memcached_behavior_set(cache, MEMCACHED_BEHAVIOR_BUFFER_REQUESTS, 1);
+    auto start = MemcachedPool::Clock::now();
+    for (size_t i = 0; i < keys.size(); ++i) {
+      memcached_return_t add_result =
+          memcached_add(cache, keys[i], key_lengths[i], batch_claimant_.data(),
+                        batch_claimant_.size(), 0, 0);
+      if (!MemcachedPool::IsAnswer(add_result)) {
         fprintf(stderr, "memcached add failed: %s\n",
-                memcached_strerror(cache_, add_result));
+                memcached_strerror(cache, add_result));
       }
-      if (add_result != MEMCACHED_DATA_EXISTS) {
-        claim_table_[vname] = claimant;
-        return true;
+    }
+    memcached_return_t flush_result = memcached_flush_buffers(cache);
+    memcached_behavior_set(cache, MEMCACHED_BEHAVIOR_BUFFER_REQUESTS, 0);
+    memcached_behavior_set(cache, MEMCACHED_BEHAVIOR_NOREPLY, 0);
+    if (!pool_->Record(MemcachedPool::kFlush, start, flush_result)) {
+      fprintf(stderr, "memcached flush failed: %s\n",
+              memcached_strerror(cache, flush_result));
+      gave_up = true;
+      break;
+    }
+    ++batch_round_trips_;
+    ++round_trips_;
+    round_trips_saved_ += pending.size() - 1;
+    start = MemcachedPool::Clock::now();
+    memcached_return_t get_result =
+        memcached_mget(cache, keys.data(), key_lengths.data(), keys.size());
+    if (!memcached_success(get_result)) {
+      pool_->Record(MemcachedPool::kMultiGet, start, get_result);
+      fprintf(stderr, "memcached mget failed: %s\n",
+              memcached_strerror(cache, get_result));
+      gave_up = true;
+      break;
+    }
+    // For each pending token, whether the remote map answered and (if it
+    // did) whether the token is ours.
+    std::vector<bool> answered(pending.size(), false);
+    std::vector<bool> ours(pending.size(), false);
+    memcached_return_t fetch_result;
+    while (memcached_result_st *result =
+               memcached_fetch_result(cache, nullptr, &fetch_result)) {
+      auto found = key_to_pending.find(
+          std::string(memcached_result_key_value(result),
+                      memcached_result_key_length(result)));
+      if (found != key_to_pending.end()) {
+        answered[found->second] = true;
+        ours[found->second] =
+            batch_claimant_ == std::string(memcached_result_value(result),
+                                           memcached_result_length(result));
       }
+      memcached_result_free(result);
     }
+    if (!pool_->Record(MemcachedPool::kMultiGet, start, fetch_result)) {
+      fprintf(stderr, "memcached fetch failed: %s\n",
+              memcached_strerror(cache, fetch_result));
+      gave_up = true;
+    }
+    std::vector<const std::string *> next_pending;
+    for (size_t i = 0; i < pending.size(); ++i) {
+      // If the token is ours, or its add was lost, we keep our claim.
+      // Otherwise someone else holds this try and we move on to the next.
+      // If the fetch failed, unanswered tokens are left undecided.
+      if ((answered[i] && !ours[i]) || (!answered[i] && gave_up)) {
+        next_pending.push_back(pending[i]);
+      }
+    }
+    pending.swap(next_pending);
+    if (gave_up) {
+      break;
+    }
+  }
+  if (gave_up) {
+    ++batch_timeouts_;
+    for (const auto *token : pending) {
+      token_claims_[*token] = claim_when_unavailable_;
+    }
+  } else {
     // We failed all our tries, so assume we couldn't make a claim.
-    claim_table_[vname] = kythe::proto::VName();
-    ++rejected_requests_;
+    for (const auto *token : pending) {
+      token_claims_[*token] = false;
+    }
+  }
+  bool success = false;
+  for (auto &token : *tokens) {
+    ++request_count_;
+    if ((token.second = token_claims_[token.first])) {
+      success = true;
+    } else {
+      ++rejected_requests_;
+    }
+  }
+  return success;
+}
+
+void DynamicClaimClient::AssignClaim(const kythe::proto::VName &claimable,
+                                     const kythe::proto::VName &claimant) {
+  claim_table_[claimable] = claimant;
+}
+
+/// \brief A slot in the shared table. All-zero bits are an empty slot.
+struct SharedMemoryClaimClient::Slot {
+  /// The fingerprint of the claimed VName, or 0 if the slot is empty.
+  std::atomic<uint64_t> key;
+  /// The claimant responsible for the VName, `kRemoteOwner`, or 0 if the
+  /// claim is still being decided.
+  std::atomic<uint64_t> owner;
+};
+
+static_assert(ATOMIC_LLONG_LOCK_FREE == 2,
+              "Shared claim tables need lock-free 64-bit atomics.");
+
+SharedMemoryClaimClient::SharedMemoryClaimClient(
+    std::unique_ptr<KytheClaimClient> remote)
+    : remote_(std::move(remote)) {
+  std::random_device random;
+  batch_owner_ = OwnerFor((static_cast<uint64_t>(random()) << 32) ^ random());
+}
+
+SharedMemoryClaimClient::~SharedMemoryClaimClient() {
+  if (slots_ != nullptr) {
+    ::munmap(slots_, slot_count_ * sizeof(Slot));
+  }
+  fprintf(stderr,
+          "%8lu  %8lu  %8lu shared claims answered locally/remotely/when "
+          "full (%lu timeouts)\n",
+          local_claims_, remote_claims_, overflow_claims_, wait_timeouts_);
+}
+
+bool SharedMemoryClaimClient::Open(const std::string &name, size_t slot_count,
+                                   std::string *error_text) {
+  int fd = ::shm_open(name.c_str(), O_RDWR | O_CREAT, 0600);
+  if (fd < 0) {
+    *error_text = "Couldn't open " + name + ": " + strerror(errno);
+    return false;
+  }
+  struct stat info;
+  // Processes that race to create the table all pick the same size (or
+  // agree on the one that won), and fresh pages are zeroed (empty) slots.
+  if (::fstat(fd, &info) == 0 && info.st_size == 0 &&
+      ::ftruncate(fd, slot_count * sizeof(Slot)) != 0) {
+    *error_text = "Couldn't size " + name + ": " + strerror(errno);
+    ::close(fd);
     return false;
   }
+  if (::fstat(fd, &info) != 0 || info.st_size == 0 ||
+      info.st_size % sizeof(Slot) != 0) {
+    *error_text = "Bad shared claim table " + name;
+    ::close(fd);
+    return false;
+  }
+  void *data = ::mmap(nullptr, info.st_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED, fd, 0);
+  ::close(fd);
+  if (data == MAP_FAILED) {
+    *error_text = "Couldn't map " + name + ": " + strerror(errno);
+    return false;
+  }
+  if (slots_ != nullptr) {
+    ::munmap(slots_, slot_count_ * sizeof(Slot));
+  }
+  slots_ = static_cast<Slot *>(data);
+  slot_count_ = info.st_size / sizeof(Slot);
+  return true;
+}
 
-  if (VNameEquals(lookup->second, claimant)) {
+SharedMemoryClaimClient::Slot *SharedMemoryClaimClient::Reserve(
+    uint64_t key, bool *reserved) {
+  // Long probe sequences mean the table is nearly full.
+  constexpr size_t kMaxProbes = 128;
+  size_t index = key % slot_count_;
+  for (size_t probes = 0; probes < kMaxProbes && probes < slot_count_;
+       ++probes) {
+    Slot *slot = &slots_[index];
+    uint64_t current = slot->key.load(std::memory_order_acquire);
+    if (current == 0 &&
+        slot->key.compare_exchange_strong(current, key,
+                                          std::memory_order_acq_rel)) {
+      *reserved = true;
+      return slot;
+    }
+    // If the exchange failed, `current` now holds the winning key.
+    if (current == key) {
+      *reserved = false;
+      return slot;
+    }
+    index = (index + 1) % slot_count_;
+  }
+  return nullptr;
+}
+
+uint64_t SharedMemoryClaimClient::WaitForOwner(Slot *slot) {
+  const auto deadline = std::chrono::steady_clock::now() +
+                        std::chrono::milliseconds(wait_timeout_ms_);
+  for (size_t spins = 0;; ++spins) {
+    uint64_t owner = slot->owner.load(std::memory_order_acquire);
+    if (owner != 0) {
+      return owner;
+    }
+    if (spins > 64) {
+      if (std::chrono::steady_clock::now() >= deadline) {
+        ++wait_timeouts_;
+        return 0;
+      }
+      ::sched_yield();
+    }
+  }
+}
+
+bool SharedMemoryClaimClient::ClaimRemotely(
+    const kythe::proto::VName &claimant, const kythe::proto::VName &vname) {
+  return remote_ == nullptr || remote_->Claim(claimant, vname);
+}
+
+bool SharedMemoryClaimClient::Claim(const kythe::proto::VName &claimant,
+                                    const kythe::proto::VName &vname) {
+  const auto lookup = claim_table_.find(vname);
+  if (lookup != claim_table_.end()) {
+    return VNameEquals(lookup->second, claimant);
+  }
+  bool reserved = false;
+  Slot *slot =
+      slots_ == nullptr ? nullptr : Reserve(ShortFingerprint(vname), &reserved);
+  if (slot == nullptr) {
+    ++overflow_claims_;
+    return ClaimRemotely(claimant, vname);
+  }
+  uint64_t self = OwnerFor(ShortFingerprint(claimant));
+  if (reserved) {
+    ++remote_claims_;
+    bool claimed = ClaimRemotely(claimant, vname);
+    slot->owner.store(claimed ? self : kRemoteOwner,
+                      std::memory_order_release);
+    return claimed;
+  }
+  uint64_t owner = WaitForOwner(slot);
+  if (owner == 0) {
+    // Fail open.
     return true;
-  } else {
-    ++rejected_requests_;
-    return false;
   }
+  ++local_claims_;
+  return owner == self;
 }
 
-void DynamicClaimClient::AssignClaim(const kythe::proto::VName &claimable,
-                                     const kythe::proto::VName &claimant) {
+bool SharedMemoryClaimClient::ClaimBatch(
+    std::vector<std::pair<std::string, bool>> *tokens) {
+  if (slots_ == nullptr) {
+    ++overflow_claims_;
+    return remote_ == nullptr ? KytheClaimClient::ClaimBatch(tokens)
+                              : remote_->ClaimBatch(tokens);
+  }
+  kythe::proto::VName claim;
+  claim.set_root(kArbitraryClaimantRoot);
+  // The slot for each token, or null if the table is full.
+  std::vector<Slot *> slots(tokens->size(), nullptr);
+  // Whether we reserved each token's slot.
+  std::vector<bool> reserved(tokens->size(), false);
+  // The tokens to ask the remote client about and where they came from.
+  std::vector<std::pair<std::string, bool>> remote_tokens;
+  std::vector<size_t> remote_index;
+  for (size_t i = 0; i < tokens->size(); ++i) {
+    claim.set_signature((*tokens)[i].first);
+    bool was_reserved = false;
+    slots[i] = Reserve(ShortFingerprint(claim), &was_reserved);
+    reserved[i] = was_reserved;
+    if (slots[i] == nullptr || was_reserved) {
+      remote_tokens.emplace_back((*tokens)[i].first, true);
+      remote_index.push_back(i);
+    }
+  }
+  if (remote_ != nullptr && !remote_tokens.empty()) {
+    remote_->ClaimBatch(&remote_tokens);
+  }
+  // Publish our answers before waiting on anyone else's, so that processes
+  // waiting on each other's tokens can't deadlock.
+  bool success = false;
+  for (size_t i = 0; i < remote_tokens.size(); ++i) {
+    size_t index = remote_index[i];
+    bool claimed = remote_tokens[i].second;
+    (*tokens)[index].second = claimed;
+    success |= claimed;
+    if (slots[index] == nullptr) {
+      ++overflow_claims_;
+    } else {
+      ++remote_claims_;
+      slots[index]->owner.store(claimed ? batch_owner_ : kRemoteOwner,
+                                std::memory_order_release);
+    }
+  }
+  for (size_t i = 0; i < tokens->size(); ++i) {
+    if (slots[i] == nullptr || reserved[i]) {
+      continue;
+    }
+    uint64_t owner = WaitForOwner(slots[i]);
+    if (owner != 0) {
+      ++local_claims_;
+    }
+    // A token may appear twice in one batch; then we're the owner.
+    (*tokens)[i].second = owner == 0 || owner == batch_owner_;
+    success |= (*tokens)[i].second;
+  }
+  return success;
+}
+
+void SharedMemoryClaimClient::AssignClaim(
+    const kythe::proto::VName &claimable, const kythe::proto::VName &claimant) {
   claim_table_[claimable] = claimant;
 }
+
+void SharedMemoryClaimClient::Reset() {
+  claim_table_.clear();
+  if (remote_ != nullptr) {
+    remote_->Reset();
+  }
+}
 }  // namespace kythe
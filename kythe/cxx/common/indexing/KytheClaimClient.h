@@ -17,17 +17,22 @@
 #ifndef KYTHE_CXX_COMMON_INDEXING_KYTHE_CLAIM_CLIENT_H_
 #define KYTHE_CXX_COMMON_INDEXING_KYTHE_CLAIM_CLIENT_H_
 
+#include <cstdint>
 #include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
 
+#include "kythe/cxx/common/indexing/claim_table.h"
 #include "kythe/cxx/common/vname_ordering.h"
 #include "kythe/proto/storage.pb.h"
 
-extern "C" {
-struct memcached_st;
-}
-
 namespace kythe {
 
+class MemcachedPool;
+
 /// \brief Limits redundancy in indexer output by skipping over certain
 /// entities.
 class KytheClaimClient {
@@ -51,6 +56,15 @@ class KytheClaimClient {
   /// than once may fail even if the first claim succeeds. Implementations
   /// should ensure that failure is permanent.
   virtual bool ClaimBatch(std::vector<std::pair<std::string, bool>> *tokens);
+  /// \brief Makes a claim for each of `vnames` on behalf of `claimant`.
+  /// \param claimed Set to the result of `Claim(claimant, vnames[i])` for
+  /// each `i`.
+  ///
+  /// Implementations backed by a remote service should make as few round
+  /// trips as they can.
+  virtual void ClaimAll(const kythe::proto::VName &claimant,
+                        const std::vector<kythe::proto::VName> &vnames,
+                        std::vector<bool> *claimed);
   /// \brief Assigns responsibility for `claimable` to `claimant`.
   virtual void AssignClaim(const kythe::proto::VName &claimable,
                            const kythe::proto::VName &claimant) = 0;
@@ -58,6 +72,26 @@ class KytheClaimClient {
   /// \brief Resets any cached state, including any claims made by
   /// `AssignClaim`.
   virtual void Reset() {}
+
+  /// \brief Counts the claims a client has decided.
+  struct Stats {
+    /// Claims decided, including those answered from local state.
+    uint64_t requests = 0;
+    /// Claims that were rejected.
+    uint64_t rejected = 0;
+    /// Round trips made to a remote claim map.
+    uint64_t round_trips = 0;
+    /// Round trips saved by deciding claims in batches: a batch of N claims
+    /// saves N - 1.
+    uint64_t round_trips_saved = 0;
+    /// Round trips to a remote claim map, in power-of-two buckets of
+    /// microseconds (as in `MemcachedPool`). Empty if there were none.
+    std::vector<uint64_t> latency_buckets;
+    /// The total time taken by those round trips, in microseconds.
+    uint64_t latency_usec = 0;
+  };
+  /// \return the client's counters so far, if it keeps any.
+  virtual Stats stats() const { return Stats(); }
 };
 
 /// \brief A client that makes static decisions about resources when possible.
@@ -77,11 +111,25 @@ class StaticClaimClient : public KytheClaimClient {
   void AssignClaim(const kythe::proto::VName &claimable,
                    const kythe::proto::VName &claimant) override;
 
+  /// \brief Consults `table` for claimables that haven't been assigned with
+  /// `AssignClaim`.
+  void set_claim_table(std::unique_ptr<ClaimTable> table) {
+    mapped_table_ = std::move(table);
+  }
+
+  /// \brief Forgets claims made by `AssignClaim`. Keeps the claim table.
   void Reset() override { claim_table_.clear(); }
 
  private:
   /// Maps from claimables to claimants.
   std::map<kythe::proto::VName, kythe::proto::VName, VNameLess> claim_table_;
+  /// A mapped table of claims, or null.
+  std::unique_ptr<ClaimTable> mapped_table_;
+  /// The claimant whose fingerprint is in `last_claimant_fingerprint_`.
+  kythe::proto::VName last_claimant_;
+  /// The fingerprint of `last_claimant_`, if `has_last_claimant_`.
+  ClaimTable::Fingerprint last_claimant_fingerprint_;
+  bool has_last_claimant_ = false;
   /// Process data with unknown claim status?
   bool process_unknown_status_ = true;
 };
@@ -93,14 +141,36 @@ class StaticClaimClient : public KytheClaimClient {
 /// permanently dropped.
 class DynamicClaimClient : public KytheClaimClient {
  public:
+  DynamicClaimClient();
   ~DynamicClaimClient() override;
 
-  /// \brief Use a memcached instance (e.g. "--SERVER=foo:1234")
+  /// \brief Use a memcached instance (e.g. "--SERVER=foo:1234"), bounding
+  /// each request by the request timeout.
   bool OpenMemcache(const std::string &spec);
 
+  /// \brief Use `pool`, which should already be open.
+  void UsePool(std::unique_ptr<MemcachedPool> pool);
+
   bool Claim(const kythe::proto::VName &claimant,
              const kythe::proto::VName &vname) override;
 
+  /// \brief Looks up every claim that isn't already known locally with a
+  /// single multi-get before making any new claims.
+  void ClaimAll(const kythe::proto::VName &claimant,
+                const std::vector<kythe::proto::VName> &vnames,
+                std::vector<bool> *claimed) override;
+
+  /// \brief Claims every token that isn't already known locally with a
+  /// pipelined round of quiet adds followed by a single multi-get per try.
+  ///
+  /// A token is ours if the remote map holds this client's identity for it
+  /// after the adds land. Results are remembered locally, so each token
+  /// costs at most one remote claim over the life of the client. If the
+  /// remote map can't be reached, or it takes longer than the request
+  /// timeout to answer, the remaining tokens are decided by
+  /// `set_claim_when_unavailable`.
+  bool ClaimBatch(std::vector<std::pair<std::string, bool>> *tokens) override;
+
   /// Store a local override.
   void AssignClaim(const kythe::proto::VName &claimable,
                    const kythe::proto::VName &claimant) override;
@@ -108,21 +178,205 @@ class DynamicClaimClient : public KytheClaimClient {
   /// Change how many times the same VName can be claimed.
   void set_max_redundant_claims(size_t value) { max_redundant_claims_ = value; }
 
-  void Reset() override { claim_table_.clear(); }
+  /// \brief Bounds how long a single remote request (and a single
+  /// `ClaimBatch`) may take, in milliseconds. 0 uses libmemcached's defaults
+  /// and doesn't bound batches. Takes effect on the next `OpenMemcache`.
+  void set_request_timeout_ms(uint64_t value) { request_timeout_ms_ = value; }
+
+  /// \brief Decides what happens to claims that the remote map can't answer
+  /// (because a request failed or the pool's breaker is open). By default
+  /// they're granted, so that nothing is dropped (we fail open); if `value`
+  /// is false, they're refused, so that an outage doesn't make every
+  /// indexer emit everything.
+  void set_claim_when_unavailable(bool value) {
+    claim_when_unavailable_ = value;
+  }
+
+  void Reset() override {
+    claim_table_.clear();
+    token_claims_.clear();
+  }
+
+  Stats stats() const override;
 
  private:
+  /// \brief Claims `vname` in the remote map, trying the redundant claims
+  /// numbered `first_try` and up. `vname` must not be in `claim_table_`.
+  bool ClaimRemotely(const kythe::proto::VName &claimant,
+                     const kythe::proto::VName &vname, size_t first_try);
+
+  /// \brief Decides a claim on `vname` that the remote map couldn't answer.
+  bool ClaimUnavailable(const kythe::proto::VName &claimant,
+                        const kythe::proto::VName &vname);
+
   /// A local map from claimables to claimants.
   std::map<kythe::proto::VName, kythe::proto::VName, VNameLess> claim_table_;
+  /// Tokens passed to `ClaimBatch`, mapped to whether we claimed them.
+  std::unordered_map<std::string, bool> token_claims_;
+  /// The value this client stores for the tokens it claims.
+  std::string batch_claimant_;
   /// A remote map used for dynamic queries.
-  ::memcached_st *cache_ = nullptr;
+  std::unique_ptr<MemcachedPool> pool_;
   /// The maximum number of times a VName can be claimed.
   size_t max_redundant_claims_ = 1;
+  /// The remote request timeout in milliseconds, or 0 for the default.
+  uint64_t request_timeout_ms_ = 0;
+  /// Whether claims the remote map can't answer are granted.
+  bool claim_when_unavailable_ = true;
+  /// The number of round trips made by `ClaimBatch`.
+  size_t batch_round_trips_ = 0;
+  /// The number of times `ClaimBatch` gave up on the remote map.
+  size_t batch_timeouts_ = 0;
+  /// The number of round trips made to the remote map.
+  size_t round_trips_ = 0;
+  /// The number of round trips saved by batching claims.
+  size_t round_trips_saved_ = 0;
   /// The number of claim requests ever made.
   size_t request_count_ = 0;
   /// The number of claim requests that were rejected (after all tries).
   size_t rejected_requests_ = 0;
 };
 
+/// \brief A client that resolves claims between the indexers on one host
+/// through a table in POSIX shared memory.
+///
+/// The table is an open-addressed array of (VName fingerprint, owner) slots.
+/// The first process to reserve a VName's slot (with an atomic
+/// compare-and-swap) asks the remote client about it once and then
+/// publishes the answer; every other process on the host reads the answer
+/// from the table instead of making a round trip. VNames are identified by
+/// 64-bit fingerprints, so (rarely) two VNames may share a claim.
+///
+/// If the table is full, claims go straight to the remote client. If a
+/// process dies between reserving a slot and publishing its answer, the
+/// processes waiting on that slot give up after a timeout and claim the
+/// VName themselves (we fail open). Claims last as long as the table does,
+/// so each indexing run should use a fresh table.
+class SharedMemoryClaimClient : public KytheClaimClient {
+ public:
+  /// \param remote The client that decides claims no process on this host
+  /// has made yet, or null to let the first local claimant win.
+  explicit SharedMemoryClaimClient(std::unique_ptr<KytheClaimClient> remote);
+  ~SharedMemoryClaimClient() override;
+
+  /// \brief Maps the table called `name` (as for `shm_open`), creating it
+  /// with room for `slot_count` claims if it doesn't exist yet. An existing
+  /// table keeps its size.
+  /// \return false on failure (with `error_text` set).
+  bool Open(const std::string &name, size_t slot_count,
+            std::string *error_text);
+
+  bool Claim(const kythe::proto::VName &claimant,
+             const kythe::proto::VName &vname) override;
+
+  /// \brief Reserves every token's slot, asks the remote client about the
+  /// tokens we reserved in a single batch, and only then waits for the
+  /// tokens reserved by other processes.
+  bool ClaimBatch(std::vector<std::pair<std::string, bool>> *tokens) override;
+
+  /// Store a local override.
+  void AssignClaim(const kythe::proto::VName &claimable,
+                   const kythe::proto::VName &claimant) override;
+
+  /// \brief Forgets local overrides. The shared table isn't changed.
+  void Reset() override;
+
+  /// \return the remote client's counters; claims answered by the shared
+  /// table aren't counted.
+  Stats stats() const override {
+    return remote_ ? remote_->stats() : Stats();
+  }
+
+  /// \brief Sets how long to wait for another process to publish a claim.
+  void set_wait_timeout_ms(uint64_t value) { wait_timeout_ms_ = value; }
+
+ private:
+  struct Slot;
+
+  /// \brief Finds or reserves the slot for `key`.
+  /// \param reserved Set to true if we reserved the slot.
+  /// \return the slot, or null if the table is full.
+  Slot *Reserve(uint64_t key, bool *reserved);
+
+  /// \brief Waits for the owner of `slot` to be published.
+  /// \return the owner, or 0 if we timed out.
+  uint64_t WaitForOwner(Slot *slot);
+
+  /// \brief Answers a claim that no process on this host has made.
+  bool ClaimRemotely(const kythe::proto::VName &claimant,
+                     const kythe::proto::VName &vname);
+
+  /// The client to consult about new claims, or null.
+  std::unique_ptr<KytheClaimClient> remote_;
+  /// Local overrides from claimables to claimants.
+  std::map<kythe::proto::VName, kythe::proto::VName, VNameLess> claim_table_;
+  /// The mapped table, or null.
+  Slot *slots_ = nullptr;
+  /// The number of slots in `slots_`.
+  size_t slot_count_ = 0;
+  /// The owner this client publishes for the tokens it claims in batches.
+  uint64_t batch_owner_ = 0;
+  /// How long to wait for another process to publish a claim.
+  uint64_t wait_timeout_ms_ = 5000;
+  /// The number of claims answered by the shared table.
+  size_t local_claims_ = 0;
+  /// The number of claims this process answered for the host.
+  size_t remote_claims_ = 0;
+  /// The number of claims made when the table was full.
+  size_t overflow_claims_ = 0;
+  /// The number of times we gave up waiting for another process.
+  size_t wait_timeouts_ = 0;
+};
+
+/// \brief A client that serializes access to another client so that it can
+/// be shared by concurrent indexer workers.
+class LockingClaimClient : public KytheClaimClient {
+ public:
+  /// \param client The client to wrap.
+  explicit LockingClaimClient(std::unique_ptr<KytheClaimClient> client)
+      : client_(std::move(client)) {}
+
+  bool Claim(const kythe::proto::VName &claimant,
+             const kythe::proto::VName &vname) override {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return client_->Claim(claimant, vname);
+  }
+
+  bool ClaimBatch(std::vector<std::pair<std::string, bool>> *tokens) override {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return client_->ClaimBatch(tokens);
+  }
+
+  void ClaimAll(const kythe::proto::VName &claimant,
+                const std::vector<kythe::proto::VName> &vnames,
+                std::vector<bool> *claimed) override {
+    std::lock_guard<std::mutex> lock(mutex_);
+    client_->ClaimAll(claimant, vnames, claimed);
+  }
+
+  void AssignClaim(const kythe::proto::VName &claimable,
+                   const kythe::proto::VName &claimant) override {
+    std::lock_guard<std::mutex> lock(mutex_);
+    client_->AssignClaim(claimable, claimant);
+  }
+
+  void Reset() override {
+    std::lock_guard<std::mutex> lock(mutex_);
+    client_->Reset();
+  }
+
+  Stats stats() const override {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return client_->stats();
+  }
+
+ private:
+  /// The wrapped client.
+  std::unique_ptr<KytheClaimClient> client_;
+  /// Guards access to `client_`.
+  mutable std::mutex mutex_;
+};
+
 }  // namespace kythe
 
 #endif
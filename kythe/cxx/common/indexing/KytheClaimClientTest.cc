@@ -0,0 +1,172 @@
+/*
+ * Copyright 2017 Google Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "KytheClaimClient.h"
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+namespace kythe {
+namespace {
+
+proto::VName MakeVName(const std::string &path) {
+  proto::VName vname;
+  vname.set_path(path);
+  return vname;
+}
+
+/// \brief A remote client that counts the claims it's asked about.
+class CountingClaimClient : public KytheClaimClient {
+ public:
+  bool Claim(const proto::VName &claimant,
+             const proto::VName &vname) override {
+    ++claims_;
+    return claimant_path_.empty() || claimant.path() == claimant_path_;
+  }
+  bool ClaimBatch(std::vector<std::pair<std::string, bool>> *tokens) override {
+    ++batches_;
+    claims_ += tokens->size();
+    return !tokens->empty();
+  }
+  void AssignClaim(const proto::VName &claimable,
+                   const proto::VName &claimant) override {}
+
+  /// If nonempty, only this claimant may claim anything.
+  std::string claimant_path_;
+  std::atomic<size_t> claims_{0};
+  size_t batches_ = 0;
+};
+
+class SharedMemoryClaimClientTest : public ::testing::Test {
+ protected:
+  SharedMemoryClaimClientTest()
+      : name_("/kythe_claim_test_" + std::to_string(::getpid()) + "_" +
+              ::testing::UnitTest::GetInstance()->current_test_info()->name()) {
+  }
+  ~SharedMemoryClaimClientTest() override { ::shm_unlink(name_.c_str()); }
+
+  /// \return a client for the test's table.
+  std::unique_ptr<SharedMemoryClaimClient> OpenClient(
+      std::unique_ptr<KytheClaimClient> remote = nullptr,
+      size_t slot_count = 1024) {
+    std::unique_ptr<SharedMemoryClaimClient> client(
+        new SharedMemoryClaimClient(std::move(remote)));
+    std::string error_text;
+    EXPECT_TRUE(client->Open(name_, slot_count, &error_text)) << error_text;
+    return client;
+  }
+
+  std::string name_;
+};
+
+TEST_F(SharedMemoryClaimClientTest, FirstClaimantWins) {
+  auto first = OpenClient();
+  auto second = OpenClient();
+  EXPECT_TRUE(first->Claim(MakeVName("a.cc"), MakeVName("a.h")));
+  EXPECT_FALSE(second->Claim(MakeVName("b.cc"), MakeVName("a.h")));
+  EXPECT_TRUE(second->Claim(MakeVName("a.cc"), MakeVName("a.h")));
+  EXPECT_TRUE(second->Claim(MakeVName("b.cc"), MakeVName("b.h")));
+  EXPECT_FALSE(first->Claim(MakeVName("a.cc"), MakeVName("b.h")));
+}
+
+TEST_F(SharedMemoryClaimClientTest, AsksRemoteOncePerHost) {
+  auto *remote = new CountingClaimClient();
+  remote->claimant_path_ = "b.cc";
+  auto first = OpenClient(std::unique_ptr<KytheClaimClient>(remote));
+  auto second = OpenClient();
+  EXPECT_FALSE(first->Claim(MakeVName("a.cc"), MakeVName("a.h")));
+  EXPECT_EQ(1, remote->claims_);
+  // Another host owns a.h, so nobody here does.
+  EXPECT_FALSE(second->Claim(MakeVName("a.cc"), MakeVName("a.h")));
+  EXPECT_FALSE(second->Claim(MakeVName("b.cc"), MakeVName("a.h")));
+  EXPECT_EQ(1, remote->claims_);
+}
+
+TEST_F(SharedMemoryClaimClientTest, FullTableFallsBackToRemote) {
+  auto *remote = new CountingClaimClient();
+  auto client = OpenClient(std::unique_ptr<KytheClaimClient>(remote), 2);
+  for (int i = 0; i < 4; ++i) {
+    EXPECT_TRUE(client->Claim(MakeVName("a.cc"),
+                              MakeVName(std::to_string(i) + ".h")));
+  }
+  EXPECT_EQ(4, remote->claims_);
+}
+
+TEST_F(SharedMemoryClaimClientTest, BatchesRemoteClaims) {
+  auto *remote = new CountingClaimClient();
+  auto first = OpenClient(std::unique_ptr<KytheClaimClient>(remote));
+  auto second = OpenClient();
+  std::vector<std::pair<std::string, bool>> tokens = {{"x", true},
+                                                      {"y", true}};
+  EXPECT_TRUE(first->ClaimBatch(&tokens));
+  EXPECT_TRUE(tokens[0].second);
+  EXPECT_TRUE(tokens[1].second);
+  EXPECT_EQ(1, remote->batches_);
+  EXPECT_EQ(2, remote->claims_);
+  tokens = {{"x", true}, {"z", true}};
+  EXPECT_TRUE(second->ClaimBatch(&tokens));
+  EXPECT_FALSE(tokens[0].second);
+  EXPECT_TRUE(tokens[1].second);
+}
+
+TEST_F(SharedMemoryClaimClientTest, ConcurrentBatchesClaimEachTokenOnce) {
+  constexpr int kClients = 4;
+  constexpr int kTokens = 500;
+  std::vector<std::unique_ptr<SharedMemoryClaimClient>> clients;
+  for (int i = 0; i < kClients; ++i) {
+    clients.push_back(OpenClient(nullptr, 4096));
+  }
+  std::vector<std::vector<std::pair<std::string, bool>>> tokens(kClients);
+  std::vector<std::thread> threads;
+  for (int i = 0; i < kClients; ++i) {
+    threads.emplace_back([i, &clients, &tokens]() {
+      for (int token = 0; token < kTokens; ++token) {
+        // Visit the tokens in different orders.
+        tokens[i].emplace_back(
+            std::to_string((token * (2 * i + 1)) % kTokens), true);
+      }
+      clients[i]->ClaimBatch(&tokens[i]);
+    });
+  }
+  for (auto &thread : threads) {
+    thread.join();
+  }
+  std::vector<int> claims(kTokens, 0);
+  for (const auto &batch : tokens) {
+    for (const auto &token : batch) {
+      claims[std::stoi(token.first)] += token.second;
+    }
+  }
+  for (int count : claims) {
+    EXPECT_EQ(1, count);
+  }
+}
+
+}  // namespace
+}  // namespace kythe
+
+int main(int argc, char **argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  int result = RUN_ALL_TESTS();
+  return result;
+}
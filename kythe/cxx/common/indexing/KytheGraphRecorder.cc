@@ -16,154 +16,458 @@
 
 #include "KytheGraphRecorder.h"
 
+#include <algorithm>
+#include <cstring>
+#include <map>
+
 #include "llvm/ADT/SmallVector.h"
+#include "llvm/ADT/StringMap.h"
 
+#include "kythe/cxx/common/indexing/buffer_digest.h"
 #include "kythe/proto/storage.pb.h"
 
 namespace kythe {
 
-static const std::string *const kNodeKindSpellings[] = {
-    new std::string("anchor"),    new std::string("file"),
-    new std::string("variable"),  new std::string("talias"),
-    new std::string("tapp"),      new std::string("tnominal"),
-    new std::string("record"),    new std::string("sum"),
-    new std::string("constant"),  new std::string("abs"),
-    new std::string("absvar"),    new std::string("function"),
-    new std::string("lookup"),    new std::string("macro"),
-    new std::string("interface"), new std::string("package"),
-    new std::string("tsigma"),    new std::string("doc"),
-    new std::string("builtin"),   new std::string("meta"),
+namespace {
+/// \brief A spelling in one of the tables below. These are plain aggregates
+/// so that the tables are built at compile time.
+struct Spelling {
+  const char *data;
+  size_t size;
+  llvm::StringRef ref() const { return llvm::StringRef(data, size); }
 };
 
-static const std::string *kEdgeKindSpellings[] = {
-    new std::string("/kythe/edge/defines"),
-    new std::string("/kythe/edge/typed"),
-    new std::string("/kythe/edge/ref"),
-    new std::string("/kythe/edge/param"),
-    new std::string("/kythe/edge/aliases"),
-    new std::string("/kythe/edge/aliases/root"),
-    new std::string("/kythe/edge/completes/uniquely"),
-    new std::string("/kythe/edge/completes"),
-    new std::string("/kythe/edge/childof"),
-    new std::string("/kythe/edge/specializes"),
-    new std::string("/kythe/edge/ref/call"),
-    new std::string("/kythe/edge/ref/expands"),
-    new std::string("/kythe/edge/undefines"),
-    new std::string("/kythe/edge/ref/includes"),
-    new std::string("/kythe/edge/ref/queries"),
-    new std::string("/kythe/edge/instantiates"),
-    new std::string("/kythe/edge/ref/expands/transitive"),
-    new std::string("/kythe/edge/extends/public"),
-    new std::string("/kythe/edge/extends/protected"),
-    new std::string("/kythe/edge/extends/private"),
-    new std::string("/kythe/edge/extends"),
-    new std::string("/kythe/edge/extends/public/virtual"),
-    new std::string("/kythe/edge/extends/protected/virtual"),
-    new std::string("/kythe/edge/extends/private/virtual"),
-    new std::string("/kythe/edge/extends/virtual"),
-    new std::string("/kythe/edge/extends/category"),
-    new std::string("/kythe/edge/specializes/speculative"),
-    new std::string("/kythe/edge/instantiates/speculative"),
-    new std::string("/kythe/edge/documents"),
-    new std::string("/kythe/edge/ref/doc"),
-    new std::string("/kythe/edge/generates"),
-    new std::string("/kythe/edge/defines/binding"),
-    new std::string("/kythe/edge/overrides"),
-    new std::string("/kythe/edge/overrides/root"),
-    new std::string("/kythe/edge/childof/context"),
-    new std::string("/kythe/edge/bounded/upper"),
+#define KYTHE_SPELLING(literal) \
+  { literal, sizeof(literal) - 1 }
+
+/// The spelling of each `NodeKindID`.
+constexpr Spelling kNodeKindSpellings[] = {
+    KYTHE_SPELLING("anchor"),
+    KYTHE_SPELLING("file"),
+    KYTHE_SPELLING("variable"),
+    KYTHE_SPELLING("talias"),
+    KYTHE_SPELLING("tapp"),
+    KYTHE_SPELLING("tnominal"),
+    KYTHE_SPELLING("record"),
+    KYTHE_SPELLING("sum"),
+    KYTHE_SPELLING("constant"),
+    KYTHE_SPELLING("abs"),
+    KYTHE_SPELLING("absvar"),
+    KYTHE_SPELLING("function"),
+    KYTHE_SPELLING("lookup"),
+    KYTHE_SPELLING("macro"),
+    KYTHE_SPELLING("interface"),
+    KYTHE_SPELLING("package"),
+    KYTHE_SPELLING("tsigma"),
+    KYTHE_SPELLING("doc"),
+    KYTHE_SPELLING("builtin"),
+    KYTHE_SPELLING("meta"),
+    KYTHE_SPELLING("diagnostic"),
 };
+static_assert(sizeof(kNodeKindSpellings) / sizeof(kNodeKindSpellings[0]) ==
+                  static_cast<size_t>(NodeKindID::kDiagnostic) + 1,
+              "NodeKindID is missing spellings");
 
-bool of_spelling(llvm::StringRef str, EdgeKindID *edge_id) {
-  size_t edge_index = 0;
-  for (auto *edge : kEdgeKindSpellings) {
-    if (*edge == str) {
-      *edge_id = static_cast<kythe::EdgeKindID>(edge_index);
-      return true;
+/// The spelling of each `EdgeKindID`.
+constexpr Spelling kEdgeKindSpellings[] = {
+    KYTHE_SPELLING("/kythe/edge/defines"),
+    KYTHE_SPELLING("/kythe/edge/typed"),
+    KYTHE_SPELLING("/kythe/edge/ref"),
+    KYTHE_SPELLING("/kythe/edge/param"),
+    KYTHE_SPELLING("/kythe/edge/aliases"),
+    KYTHE_SPELLING("/kythe/edge/aliases/root"),
+    KYTHE_SPELLING("/kythe/edge/completes/uniquely"),
+    KYTHE_SPELLING("/kythe/edge/completes"),
+    KYTHE_SPELLING("/kythe/edge/childof"),
+    KYTHE_SPELLING("/kythe/edge/specializes"),
+    KYTHE_SPELLING("/kythe/edge/ref/call"),
+    KYTHE_SPELLING("/kythe/edge/ref/expands"),
+    KYTHE_SPELLING("/kythe/edge/undefines"),
+    KYTHE_SPELLING("/kythe/edge/ref/includes"),
+    KYTHE_SPELLING("/kythe/edge/ref/queries"),
+    KYTHE_SPELLING("/kythe/edge/instantiates"),
+    KYTHE_SPELLING("/kythe/edge/ref/expands/transitive"),
+    KYTHE_SPELLING("/kythe/edge/extends/public"),
+    KYTHE_SPELLING("/kythe/edge/extends/protected"),
+    KYTHE_SPELLING("/kythe/edge/extends/private"),
+    KYTHE_SPELLING("/kythe/edge/extends"),
+    KYTHE_SPELLING("/kythe/edge/extends/public/virtual"),
+    KYTHE_SPELLING("/kythe/edge/extends/protected/virtual"),
+    KYTHE_SPELLING("/kythe/edge/extends/private/virtual"),
+    KYTHE_SPELLING("/kythe/edge/extends/virtual"),
+    KYTHE_SPELLING("/kythe/edge/extends/category"),
+    KYTHE_SPELLING("/kythe/edge/specializes/speculative"),
+    KYTHE_SPELLING("/kythe/edge/instantiates/speculative"),
+    KYTHE_SPELLING("/kythe/edge/documents"),
+    KYTHE_SPELLING("/kythe/edge/ref/doc"),
+    KYTHE_SPELLING("/kythe/edge/generates"),
+    KYTHE_SPELLING("/kythe/edge/defines/binding"),
+    KYTHE_SPELLING("/kythe/edge/overrides"),
+    KYTHE_SPELLING("/kythe/edge/overrides/root"),
+    KYTHE_SPELLING("/kythe/edge/childof/context"),
+    KYTHE_SPELLING("/kythe/edge/bounded/upper"),
+    KYTHE_SPELLING("/kythe/edge/tagged"),
+};
+static_assert(sizeof(kEdgeKindSpellings) / sizeof(kEdgeKindSpellings[0]) ==
+                  static_cast<size_t>(EdgeKindID::kTagged) + 1,
+              "EdgeKindID is missing spellings");
+
+/// The spelling of each `PropertyID`.
+constexpr Spelling kPropertySpellings[] = {
+    KYTHE_SPELLING("/kythe/loc"),
+    KYTHE_SPELLING("/kythe/loc/uri"),
+    KYTHE_SPELLING("/kythe/loc/start"),
+    KYTHE_SPELLING("/kythe/loc/start/row"),
+    KYTHE_SPELLING("/kythe/loc/start"),
+    KYTHE_SPELLING("/kythe/loc/end"),
+    KYTHE_SPELLING("/kythe/loc/end/row"),
+    KYTHE_SPELLING("/kythe/loc/end"),
+    KYTHE_SPELLING("/kythe/text"),
+    KYTHE_SPELLING("/kythe/complete"),
+    KYTHE_SPELLING("/kythe/subkind"),
+    KYTHE_SPELLING("/kythe/node/kind"),
+    KYTHE_SPELLING("/kythe/code"),
+    KYTHE_SPELLING("/kythe/variance"),
+    KYTHE_SPELLING("/kythe/param/default"),
+    KYTHE_SPELLING("/kythe/message"),
+};
+static_assert(sizeof(kPropertySpellings) / sizeof(kPropertySpellings[0]) ==
+                  static_cast<size_t>(PropertyID::kMessage) + 1,
+              "PropertyID is missing spellings");
+
+#undef KYTHE_SPELLING
+
+/// \brief Spellings encoded as they appear in serialized entries, so that
+/// emitting a known name is a copy.
+struct EncodedSpellings {
+  /// Each `PropertyID` as a fact name.
+  std::vector<std::string> properties;
+  /// Each `EdgeKindID` as an edge kind (without an ordinal).
+  std::vector<std::string> edge_kinds;
+  /// Maps edge kind spellings back to `EdgeKindID`s.
+  llvm::StringMap<EdgeKindID> edge_kind_ids;
+};
+
+const EncodedSpellings &GetEncodedSpellings() {
+  static const EncodedSpellings *const spellings = [] {
+    auto *spellings = new EncodedSpellings();
+    for (const auto &property : kPropertySpellings) {
+      spellings->properties.push_back(
+          EntryEncoder::EncodeFactName(property.ref()));
     }
-    ++edge_index;
-  }
-  return false;
+    size_t edge_index = 0;
+    for (const auto &edge : kEdgeKindSpellings) {
+      spellings->edge_kinds.push_back(EntryEncoder::EncodeEdgeKind(edge.ref()));
+      spellings->edge_kind_ids.insert(
+          std::make_pair(edge.ref(), static_cast<EdgeKindID>(edge_index++)));
+    }
+    return spellings;
+  }();
+  return *spellings;
 }
 
-static const std::string *const kPropertySpellings[] = {
-    new std::string("/kythe/loc"),
-    new std::string("/kythe/loc/uri"),
-    new std::string("/kythe/loc/start"),
-    new std::string("/kythe/loc/start/row"),
-    new std::string("/kythe/loc/start"),
-    new std::string("/kythe/loc/end"),
-    new std::string("/kythe/loc/end/row"),
-    new std::string("/kythe/loc/end"),
-    new std::string("/kythe/text"),
-    new std::string("/kythe/complete"),
-    new std::string("/kythe/subkind"),
-    new std::string("/kythe/node/kind"),
-    new std::string("/kythe/code"),
-    new std::string("/kythe/variance"),
-    new std::string("/kythe/param/default"),
-};
+llvm::StringRef EncodedSpellingOf(PropertyID property_id) {
+  return GetEncodedSpellings()
+      .properties[static_cast<ptrdiff_t>(property_id)];
+}
 
-static const std::string *const kEmptyStringSpelling = new std::string("");
+llvm::StringRef EncodedSpellingOf(EdgeKindID edge_kind_id) {
+  return GetEncodedSpellings()
+      .edge_kinds[static_cast<ptrdiff_t>(edge_kind_id)];
+}
+}  // anonymous namespace
 
-static const std::string *const kRootPropertySpelling = new std::string("/");
+bool of_spelling(llvm::StringRef str, EdgeKindID *edge_id) {
+  const auto &ids = GetEncodedSpellings().edge_kind_ids;
+  auto found = ids.find(str);
+  if (found == ids.end()) {
+    return false;
+  }
+  *edge_id = found->second;
+  return true;
+}
 
 llvm::StringRef spelling_of(PropertyID property_id) {
-  const auto *str = kPropertySpellings[static_cast<ptrdiff_t>(property_id)];
-  return llvm::StringRef(str->data(), str->size());
+  return kPropertySpellings[static_cast<ptrdiff_t>(property_id)].ref();
 }
 
 llvm::StringRef spelling_of(NodeKindID node_kind_id) {
-  const auto *str = kNodeKindSpellings[static_cast<ptrdiff_t>(node_kind_id)];
-  return llvm::StringRef(str->data(), str->size());
+  return kNodeKindSpellings[static_cast<ptrdiff_t>(node_kind_id)].ref();
 }
 
 llvm::StringRef spelling_of(EdgeKindID edge_kind_id) {
-  const auto *str = kEdgeKindSpellings[static_cast<ptrdiff_t>(edge_kind_id)];
-  return llvm::StringRef(str->data(), str->size());
+  return kEdgeKindSpellings[static_cast<ptrdiff_t>(edge_kind_id)].ref();
+}
+
+namespace {
+/// \brief Maps the recorder's IDs to `EntryAccounting` categories.
+struct AccountingTable {
+  /// The name of each category.
+  std::vector<std::string> names;
+  /// The category for each `PropertyID`.
+  std::vector<size_t> properties;
+  /// The category for each `NodeKindID`.
+  std::vector<size_t> node_kinds;
+  /// The category for each `EdgeKindID`.
+  std::vector<size_t> edge_kinds;
+};
+
+const AccountingTable &GetAccountingTable() {
+  static const AccountingTable *const table = [] {
+    auto *table = new AccountingTable();
+    // Some IDs share spellings; give them a single category.
+    std::map<std::string, size_t> categories;
+    auto category_for = [&](const std::string &name) {
+      auto inserted = categories.emplace(name, table->names.size());
+      if (inserted.second) {
+        table->names.push_back(name);
+      }
+      return inserted.first->second;
+    };
+    for (const auto &property : kPropertySpellings) {
+      table->properties.push_back(category_for(property.ref().str()));
+    }
+    for (const auto &kind : kNodeKindSpellings) {
+      table->node_kinds.push_back(
+          category_for(spelling_of(PropertyID::kNodeKind).str() + ":" +
+                       kind.ref().str()));
+    }
+    for (const auto &kind : kEdgeKindSpellings) {
+      table->edge_kinds.push_back(category_for(kind.ref().str()));
+    }
+    return table;
+  }();
+  return *table;
+}
+
+size_t CategoryOf(PropertyID property_id) {
+  return GetAccountingTable().properties[static_cast<ptrdiff_t>(property_id)];
+}
+
+size_t CategoryOf(NodeKindID node_kind_id) {
+  return GetAccountingTable().node_kinds[static_cast<ptrdiff_t>(node_kind_id)];
+}
+
+size_t CategoryOf(EdgeKindID edge_kind_id) {
+  return GetAccountingTable().edge_kinds[static_cast<ptrdiff_t>(edge_kind_id)];
+}
+
+/// \brief Hashes a field of an entry with its size, so that the boundaries
+/// between fields are unambiguous.
+void HashField(llvm::StringRef field, Murmur3Hasher *hasher) {
+  uint64_t size = field.size();
+  hasher->Update(&size, sizeof(size));
+  hasher->Update(field.data(), field.size());
+}
+
+void HashVName(const VNameRef &vname, Murmur3Hasher *hasher) {
+  HashField(vname.signature, hasher);
+  HashField(vname.corpus, hasher);
+  HashField(vname.root, hasher);
+  HashField(vname.path, hasher);
+  HashField(vname.language, hasher);
+}
+}  // anonymous namespace
+
+bool KytheGraphRecorder::IsNew(size_t category, const VNameRef &source,
+                               llvm::StringRef kind, const VNameRef *target,
+                               int64_t ordinal, llvm::StringRef value) {
+  if (deduplicator_ == nullptr) {
+    return true;
+  }
+  Murmur3Hasher hasher;
+  HashVName(source, &hasher);
+  HashField(kind, &hasher);
+  unsigned char has_target = target != nullptr;
+  hasher.Update(&has_target, sizeof(has_target));
+  if (target != nullptr) {
+    HashVName(*target, &hasher);
+  }
+  hasher.Update(&ordinal, sizeof(ordinal));
+  HashField(value, &hasher);
+  unsigned char digest[Murmur3Hasher::kDigestSize];
+  hasher.Final(digest);
+  EntryDeduplicator::Fingerprint fingerprint;
+  ::memcpy(&fingerprint.high, digest, sizeof(fingerprint.high));
+  ::memcpy(&fingerprint.low, digest + sizeof(fingerprint.high),
+           sizeof(fingerprint.low));
+  if (deduplicator_->Insert(fingerprint)) {
+    return true;
+  }
+  if (EntryAccounting *accounting = stream_->accounting()) {
+    accounting->CountDuplicate(category);
+  }
+  return false;
+}
+
+const std::vector<std::string> &KytheGraphRecorder::AccountingCategories() {
+  return GetAccountingTable().names;
+}
+
+bool EntryKindFilter::Configure(llvm::StringRef keep, llvm::StringRef drop,
+                                std::string *error_text) {
+  const auto &names = KytheGraphRecorder::AccountingCategories();
+  std::vector<bool> dropped(names.size(), !keep.empty());
+  auto mark = [&](llvm::StringRef kinds, bool value) {
+    llvm::SmallVector<llvm::StringRef, 8> split;
+    kinds.split(split, ',', -1, false);
+    for (llvm::StringRef kind : split) {
+      kind = kind.trim();
+      auto found = std::find(names.begin(), names.end(), kind);
+      if (found == names.end()) {
+        *error_text = "Unknown entry kind " + kind.str();
+        return false;
+      }
+      dropped[found - names.begin()] = value;
+    }
+    return true;
+  };
+  if (!mark(keep, false) || !mark(drop, true)) {
+    return false;
+  }
+  if (std::find(dropped.begin(), dropped.end(), true) == dropped.end()) {
+    dropped.clear();
+  }
+  dropped_ = std::move(dropped);
+  return true;
 }
 
 void KytheGraphRecorder::AddProperty(const VNameRef &node_vname,
                                      PropertyID property_id,
                                      const std::string &property_value) {
+  if (!Admit(CategoryOf(property_id)) ||
+      !IsNew(CategoryOf(property_id), node_vname, spelling_of(property_id),
+             nullptr, -1, property_value)) {
+    return;
+  }
   stream_->Emit(
       FactRef{&node_vname, spelling_of(property_id),
-              llvm::StringRef(property_value.data(), property_value.size())});
+              llvm::StringRef(property_value.data(), property_value.size()),
+              EncodedSpellingOf(property_id)});
+}
+
+void KytheGraphRecorder::AddProperty(const VNameRef &node_vname,
+                                     NodeKindID node_kind_value) {
+  if (!Admit(CategoryOf(node_kind_value)) ||
+      !IsNew(CategoryOf(node_kind_value), node_vname,
+             spelling_of(PropertyID::kNodeKind), nullptr, -1,
+             spelling_of(node_kind_value))) {
+    return;
+  }
+  stream_->Emit(FactRef{&node_vname, spelling_of(PropertyID::kNodeKind),
+                        spelling_of(node_kind_value),
+                        EncodedSpellingOf(PropertyID::kNodeKind)});
 }
 
 void KytheGraphRecorder::AddProperty(const VNameRef &node_vname,
                                      PropertyID property_id,
                                      const size_t property_value) {
+  if (filter_ != nullptr && filter_->drops(CategoryOf(property_id))) {
+    return;
+  }
   AddProperty(node_vname, property_id, std::to_string(property_value));
 }
 
 void KytheGraphRecorder::AddMarkedSource(const VNameRef &node_vname,
                                          const MarkedSource &marked_source) {
+  if (!Admit(CategoryOf(PropertyID::kCode))) {
+    return;
+  }
   auto size = marked_source.ByteSize();
   llvm::SmallVector<char, 64> buffer(size);
   marked_source.SerializeToArray(buffer.data(), size);
-  stream_->Emit(FactRef{&node_vname, spelling_of(PropertyID::kCode),
-                        llvm::StringRef(buffer.data(), buffer.size())});
+  EmitMarkedSource(node_vname, llvm::StringRef(buffer.data(), buffer.size()));
+}
+
+void KytheGraphRecorder::AddMarkedSource(
+    const VNameRef &node_vname,
+    llvm::function_ref<const std::string *()> serialize) {
+  if (!Admit(CategoryOf(PropertyID::kCode))) {
+    return;
+  }
+  if (const std::string *serialized = serialize()) {
+    EmitMarkedSource(node_vname, *serialized);
+  }
+}
+
+void KytheGraphRecorder::EmitMarkedSource(const VNameRef &node_vname,
+                                          llvm::StringRef serialized) {
+  if (!IsNew(CategoryOf(PropertyID::kCode), node_vname,
+             spelling_of(PropertyID::kCode), nullptr, -1, serialized)) {
+    return;
+  }
+  stream_->Emit(FactRef{&node_vname, spelling_of(PropertyID::kCode), serialized,
+                        EncodedSpellingOf(PropertyID::kCode)});
 }
 
 void KytheGraphRecorder::AddEdge(const VNameRef &edge_from,
                                  EdgeKindID edge_kind_id,
                                  const VNameRef &edge_to) {
-  stream_->Emit(EdgeRef{&edge_from, spelling_of(edge_kind_id), &edge_to});
+  if (!Admit(CategoryOf(edge_kind_id)) ||
+      !IsNew(CategoryOf(edge_kind_id), edge_from, spelling_of(edge_kind_id),
+             &edge_to, -1, "")) {
+    return;
+  }
+  stream_->Emit(EdgeRef{&edge_from, spelling_of(edge_kind_id), &edge_to,
+                        EncodedSpellingOf(edge_kind_id)});
 }
 
 void KytheGraphRecorder::AddEdge(const VNameRef &edge_from,
                                  EdgeKindID edge_kind_id,
                                  const VNameRef &edge_to, uint32_t ordinal) {
+  if (!Admit(CategoryOf(edge_kind_id)) ||
+      !IsNew(CategoryOf(edge_kind_id), edge_from, spelling_of(edge_kind_id),
+             &edge_to, ordinal, "")) {
+    return;
+  }
   stream_->Emit(
       OrdinalEdgeRef{&edge_from, spelling_of(edge_kind_id), &edge_to, ordinal});
 }
 
+void KytheGraphRecorder::AddEdges(const VNameRef &edge_from,
+                                  llvm::ArrayRef<FanOutEdge> edges) {
+  if (stream_->accounting() != nullptr) {
+    // Each edge must be charged to its own kind as it's emitted.
+    for (const auto &edge : edges) {
+      if (edge.ordinal < 0) {
+        AddEdge(edge_from, edge.kind, edge.target);
+      } else {
+        AddEdge(edge_from, edge.kind, edge.target,
+                static_cast<uint32_t>(edge.ordinal));
+      }
+    }
+    return;
+  }
+  llvm::SmallVector<FanOutEdgeRef, 16> admitted;
+  for (const auto &edge : edges) {
+    size_t category = CategoryOf(edge.kind);
+    if (!Admit(category) ||
+        !IsNew(category, edge_from, spelling_of(edge.kind), &edge.target,
+               edge.ordinal, "")) {
+      continue;
+    }
+    admitted.push_back(FanOutEdgeRef{spelling_of(edge.kind), &edge.target,
+                                     EncodedSpellingOf(edge.kind),
+                                     edge.ordinal});
+  }
+  if (!admitted.empty()) {
+    stream_->EmitEdges(edge_from, admitted);
+  }
+}
+
 void KytheGraphRecorder::AddFileContent(const VNameRef &file_vname,
                                         const llvm::StringRef &file_content) {
-  AddProperty(file_vname, PropertyID::kNodeKind,
-              spelling_of(NodeKindID::kFile));
-  AddProperty(file_vname, PropertyID::kText, file_content.str());
+  AddProperty(file_vname, NodeKindID::kFile);
+  if (!Admit(CategoryOf(PropertyID::kText)) ||
+      !IsNew(CategoryOf(PropertyID::kText), file_vname,
+             spelling_of(PropertyID::kText), nullptr, -1, file_content)) {
+    return;
+  }
+  // The text is written from `file_content`, which usually points into the
+  // VFS's copy of the file, without building a string.
+  stream_->EmitContent(FactRef{&file_vname, spelling_of(PropertyID::kText),
+                               file_content,
+                               EncodedSpellingOf(PropertyID::kText)});
 }
 
 }  // namespace kythe
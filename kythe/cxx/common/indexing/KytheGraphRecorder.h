@@ -17,6 +17,12 @@
 #ifndef KYTHE_CXX_COMMON_INDEXING_KYTHE_GRAPH_RECORDER_H_
 #define KYTHE_CXX_COMMON_INDEXING_KYTHE_GRAPH_RECORDER_H_
 
+#include <string>
+#include <unordered_set>
+#include <vector>
+
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/STLExtras.h"
 #include "llvm/ADT/StringRef.h"
 
 #include "KytheOutputStream.h"
@@ -44,7 +50,8 @@ enum class NodeKindID {
   kTSigma,
   kDoc,
   kBuiltin,
-  kMeta
+  kMeta,
+  kDiagnostic
 };
 
 /// \brief Known properties of nodes. See the schema for details.
@@ -63,7 +70,8 @@ enum class PropertyID {
   kNodeKind,
   kCode,
   kVariance,
-  kParamDefault
+  kParamDefault,
+  kMessage
 };
 
 /// \brief Known edge kinds. See the schema for details.
@@ -104,6 +112,7 @@ enum class EdgeKindID {
   kOverridesRoot,
   kChildOfContext,
   kBoundedUpper,
+  kTagged,
 };
 
 /// \brief Returns the Kythe spelling of `node_kind_id`
@@ -131,6 +140,91 @@ llvm::StringRef spelling_of(EdgeKindID edge_kind_id);
 /// `spelling` (or returns false if there is no such correspondence).
 bool of_spelling(llvm::StringRef spelling, EdgeKindID *out_edge);
 
+/// \brief Selects the kinds of entries that a `KytheGraphRecorder` drops.
+///
+/// Kinds are named as in `KytheGraphRecorder::AccountingCategories()`.
+class EntryKindFilter {
+ public:
+  /// \brief Makes a filter that keeps every entry.
+  EntryKindFilter() = default;
+
+  /// \brief Replaces the kinds that this filter drops.
+  /// \param keep A comma-separated list of kinds. If nonempty, only entries of
+  /// these kinds are kept.
+  /// \param drop A comma-separated list of kinds to drop.
+  /// \param error_text Set to a description of the problem on failure.
+  /// \return false if a kind wasn't recognized.
+  bool Configure(llvm::StringRef keep, llvm::StringRef drop,
+                 std::string *error_text);
+
+  /// \return true if entries in `category` should be dropped.
+  bool drops(size_t category) const {
+    return category < dropped_.size() && dropped_[category];
+  }
+
+ private:
+  /// Whether to drop each category. Empty if nothing is dropped.
+  std::vector<bool> dropped_;
+};
+
+/// \brief Remembers which entries a `KytheGraphRecorder` has emitted so that
+/// exact duplicates can be dropped. Meant to be used for a single compilation
+/// unit; memory use grows with the number of distinct entries.
+///
+/// Entries are remembered by a 128-bit fingerprint of their source, kind,
+/// target and value, so distinct entries are only mistaken for each other
+/// with negligible probability.
+class EntryDeduplicator {
+ public:
+  /// \brief A fingerprint of an entry.
+  struct Fingerprint {
+    uint64_t high;
+    uint64_t low;
+    bool operator==(const Fingerprint &other) const {
+      return high == other.high && low == other.low;
+    }
+  };
+
+  /// \brief Remembers `fingerprint`.
+  /// \return false if it was already remembered.
+  bool Insert(const Fingerprint &fingerprint) {
+    ++entries_;
+    if (seen_.insert(fingerprint).second) {
+      return true;
+    }
+    ++duplicates_;
+    return false;
+  }
+
+  /// \return the number of entries checked.
+  size_t entries() const { return entries_; }
+
+  /// \return the number of entries that were duplicates.
+  size_t duplicates() const { return duplicates_; }
+
+ private:
+  struct FingerprintHash {
+    size_t operator()(const Fingerprint &fingerprint) const {
+      return fingerprint.low;
+    }
+  };
+  /// The fingerprints of the entries seen so far.
+  std::unordered_set<Fingerprint, FingerprintHash> seen_;
+  /// The number of entries checked.
+  size_t entries_ = 0;
+  /// The number of duplicates found.
+  size_t duplicates_ = 0;
+};
+
+/// \brief One of a batch of edges from the same node (see
+/// `KytheGraphRecorder::AddEdges`).
+struct FanOutEdge {
+  EdgeKindID kind;
+  VNameRef target;
+  /// The edge's ordinal, or -1 for none.
+  int64_t ordinal;
+};
+
 /// \brief Records Kythe nodes and edges to a provided `KytheOutputStream`.
 class KytheGraphRecorder {
  public:
@@ -155,6 +249,15 @@ class KytheGraphRecorder {
   void AddMarkedSource(const VNameRef &node_vname,
                        const MarkedSource &marked_source);
 
+  /// \brief Record a node's marked source, building it only if it would be
+  /// written.
+  ///
+  /// \param node_vname The vname of the node to modify.
+  /// \param serialize Returns the serialized marked source, or null if there
+  /// is none. It's not called if the recorder's filter drops code facts.
+  void AddMarkedSource(const VNameRef &node_vname,
+                       llvm::function_ref<const std::string *()> serialize);
+
   /// \copydoc KytheGraphRecorder::AddProperty(const
   /// VNameRef&,PropertyID,std::string&)
   void AddProperty(const VNameRef &node_vname, PropertyID property_id,
@@ -162,10 +265,7 @@ class KytheGraphRecorder {
 
   /// \copydoc KytheGraphRecorder::AddProperty(const
   /// VNameRef&,PropertyID,std::string&)
-  void AddProperty(const VNameRef &node_vname, NodeKindID node_kind_value) {
-    AddProperty(node_vname, PropertyID::kNodeKind,
-                spelling_of(node_kind_value));
-  }
+  void AddProperty(const VNameRef &node_vname, NodeKindID node_kind_value);
 
   /// \brief Records an edge between nodes.
   ///
@@ -184,7 +284,17 @@ class KytheGraphRecorder {
   void AddEdge(const VNameRef &edge_from, EdgeKindID edge_kind_id,
                const VNameRef &edge_to, uint32_t edge_ordinal);
 
+  /// \brief Records edges that all start at the same node, as if each were
+  /// passed to `AddEdge` in turn. The stream can then encode their source
+  /// once.
+  ///
+  /// \param edge_from The `VNameRef` of the node at which the edges start.
+  /// \param edges The kinds, targets and ordinals of the edges.
+  void AddEdges(const VNameRef &edge_from, llvm::ArrayRef<FanOutEdge> edges);
+
   /// \brief Records the content of a file that was visited during compilation.
+  /// The content is passed to `KytheOutputStream::EmitContent` without being
+  /// copied.
   /// \param file_vname The file's vname.
   /// \param file_content The buffer of this file's content.
   void AddFileContent(const VNameRef &file_vname,
@@ -200,9 +310,73 @@ class KytheGraphRecorder {
   /// released. Every PushEntryGroup should be paired with a PopEntryGroup.
   void PushEntryGroup() { stream_->PushBuffer(); }
 
+  /// \brief Push a new entry group for entries that belong to `file` (a
+  /// string unique to the file's vname). Paired with a PopEntryGroup.
+  /// \sa KytheOutputStream::PushFileBuffer
+  void PushFileEntryGroup(llvm::StringRef file) {
+    stream_->PushFileBuffer(file);
+  }
+
+  /// \brief Returns the names of the `EntryAccounting` categories that this
+  /// class charges entries to.
+  ///
+  /// Facts are charged by property (for example, "/kythe/code"), except for
+  /// node kind facts set with a `NodeKindID`, which are charged by kind
+  /// ("/kythe/node/kind:anchor"). Edges are charged by kind, ignoring
+  /// ordinals ("/kythe/edge/param").
+  static const std::vector<std::string> &AccountingCategories();
+
+  /// \brief Drops the entries that `filter` selects before they are built.
+  /// \param filter The filter to use, which must outlive its use by this
+  /// recorder, or null to keep every entry.
+  void set_entry_filter(const EntryKindFilter *filter) { filter_ = filter; }
+
+  /// \brief Drops entries that are exact duplicates of ones this recorder
+  /// emitted before (while using `deduplicator`). Suppressed duplicates are
+  /// charged with `EntryAccounting::CountDuplicate` if the stream is counting.
+  /// \param deduplicator The entries seen so far, which must outlive its use
+  /// by this recorder, or null to emit duplicates.
+  void set_deduplicator(EntryDeduplicator *deduplicator) {
+    deduplicator_ = deduplicator;
+  }
+
+  /// \brief Returns the number of entries this recorder has admitted (not
+  /// dropped by the entry filter), including any suppressed as duplicates.
+  size_t entries_admitted() const { return entries_admitted_; }
+
  private:
+  /// \brief Decides whether to emit the next entry, which is in `category`.
+  /// Charges the entry to `category` if the stream is counting.
+  /// \return false if the entry should be dropped.
+  bool Admit(size_t category) {
+    if (filter_ != nullptr && filter_->drops(category)) {
+      return false;
+    }
+    ++entries_admitted_;
+    if (EntryAccounting *accounting = stream_->accounting()) {
+      accounting->set_category(category);
+    }
+    return true;
+  }
+
+  /// \brief Emits an admitted code fact unless it's a duplicate.
+  void EmitMarkedSource(const VNameRef &node_vname, llvm::StringRef serialized);
+
+  /// \brief Checks an admitted entry against `deduplicator_`.
+  /// \param target The entry's target, or null for a fact.
+  /// \param ordinal The edge's ordinal, or -1 for none.
+  /// \return false if the entry is a duplicate and should be dropped.
+  bool IsNew(size_t category, const VNameRef &source, llvm::StringRef kind,
+             const VNameRef *target, int64_t ordinal, llvm::StringRef value);
+
   /// The `KytheOutputStream` to which new graph elements are written.
   KytheOutputStream *stream_;
+  /// The kinds of entries to drop, or null.
+  const EntryKindFilter *filter_ = nullptr;
+  /// The number of entries `Admit` has let through.
+  size_t entries_admitted_ = 0;
+  /// The entries emitted so far, or null if duplicates aren't dropped.
+  EntryDeduplicator *deduplicator_ = nullptr;
 };
 
 }  // namespace kythe
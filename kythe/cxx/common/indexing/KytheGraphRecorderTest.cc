@@ -0,0 +1,211 @@
+/*
+ * Copyright 2017 Google Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "KytheGraphRecorder.h"
+
+#include <algorithm>
+#include <string>
+
+#include "RecordingOutputStream.h"
+#include "google/protobuf/io/zero_copy_stream_impl_lite.h"
+#include "gtest/gtest.h"
+
+namespace kythe {
+namespace {
+
+/// \return the index of the category named `name`.
+size_t CategoryNamed(const std::string &name) {
+  const auto &names = KytheGraphRecorder::AccountingCategories();
+  return std::find(names.begin(), names.end(), name) - names.begin();
+}
+
+TEST(KytheGraphRecorder, CategoriesAreDistinct) {
+  auto names = KytheGraphRecorder::AccountingCategories();
+  std::sort(names.begin(), names.end());
+  EXPECT_EQ(names.end(), std::adjacent_find(names.begin(), names.end()));
+  const auto &unsorted = KytheGraphRecorder::AccountingCategories();
+  EXPECT_NE(unsorted.size(), CategoryNamed("/kythe/loc/start"));
+  EXPECT_NE(unsorted.size(), CategoryNamed("/kythe/node/kind:anchor"));
+  EXPECT_NE(unsorted.size(), CategoryNamed("/kythe/edge/param"));
+}
+
+TEST(KytheGraphRecorder, ChargesEntriesToTheirKinds) {
+  EntryAccounting accounting(KytheGraphRecorder::AccountingCategories());
+  std::string out;
+  {
+    google::protobuf::io::StringOutputStream raw_stream(&out);
+    FileOutputStream stream(&raw_stream);
+    stream.set_accounting(&accounting);
+    KytheGraphRecorder recorder(&stream);
+    VNameRef node;
+    node.signature = "node";
+    recorder.AddProperty(node, NodeKindID::kAnchor);
+    recorder.AddProperty(node, PropertyID::kLocationStartOffset, 10);
+    recorder.AddProperty(node, PropertyID::kLocationStart, "10");
+    recorder.AddEdge(node, EdgeKindID::kParam, node, 1);
+    stream.set_accounting(nullptr);
+  }
+  const auto &counters = accounting.counters();
+  EXPECT_EQ(1, counters[CategoryNamed("/kythe/node/kind:anchor")].entries);
+  EXPECT_EQ(2, counters[CategoryNamed("/kythe/loc/start")].entries);
+  EXPECT_EQ(1, counters[CategoryNamed("/kythe/edge/param")].entries);
+  EXPECT_EQ(0, counters[CategoryNamed("/kythe/node/kind")].entries);
+}
+
+TEST(KytheGraphRecorder, AddEdgesMatchesAddEdge) {
+  VNameRef node, other;
+  node.signature = "node";
+  other.signature = "other";
+  auto record = [&](bool batch) {
+    std::string out;
+    {
+      google::protobuf::io::StringOutputStream raw_stream(&out);
+      FileOutputStream stream(&raw_stream);
+      KytheGraphRecorder recorder(&stream);
+      EntryKindFilter filter;
+      std::string error_text;
+      EXPECT_TRUE(filter.Configure("", "/kythe/edge/ref", &error_text));
+      recorder.set_entry_filter(&filter);
+      EntryDeduplicator deduplicator;
+      recorder.set_deduplicator(&deduplicator);
+      recorder.AddEdge(node, EdgeKindID::kChildOf, other);
+      if (batch) {
+        FanOutEdge edges[] = {{EdgeKindID::kChildOf, other, -1},
+                              {EdgeKindID::kRef, other, -1},
+                              {EdgeKindID::kParam, other, 0},
+                              {EdgeKindID::kParam, node, 1}};
+        recorder.AddEdges(node, edges);
+      } else {
+        recorder.AddEdge(node, EdgeKindID::kChildOf, other);
+        recorder.AddEdge(node, EdgeKindID::kRef, other);
+        recorder.AddEdge(node, EdgeKindID::kParam, other, 0);
+        recorder.AddEdge(node, EdgeKindID::kParam, node, 1);
+      }
+      EXPECT_EQ(4, recorder.entries_admitted());
+    }
+    return out;
+  };
+  EXPECT_EQ(record(false), record(true));
+}
+
+TEST(EntryKindFilter, DropsListedKinds) {
+  EntryKindFilter filter;
+  std::string error_text;
+  ASSERT_TRUE(filter.Configure("", "/kythe/edge/documents, /kythe/code",
+                               &error_text))
+      << error_text;
+  RecordingOutputStream stream;
+  KytheGraphRecorder recorder(&stream);
+  recorder.set_entry_filter(&filter);
+  VNameRef node;
+  node.signature = "node";
+  recorder.AddEdge(node, EdgeKindID::kDocuments, node);
+  recorder.AddMarkedSource(node, MarkedSource());
+  recorder.AddEdge(node, EdgeKindID::kChildOf, node);
+  ASSERT_EQ(1, stream.entries().size());
+  EXPECT_EQ("/kythe/edge/childof", stream.entries()[0].edge_kind());
+}
+
+TEST(EntryKindFilter, DoesNotBuildDroppedMarkedSource) {
+  EntryKindFilter filter;
+  std::string error_text;
+  ASSERT_TRUE(filter.Configure("", "/kythe/code", &error_text)) << error_text;
+  RecordingOutputStream stream;
+  KytheGraphRecorder recorder(&stream);
+  VNameRef node;
+  node.signature = "node";
+  const std::string serialized = MarkedSource().SerializeAsString();
+  size_t calls = 0;
+  const auto serialize = [&]() -> const std::string * {
+    ++calls;
+    return &serialized;
+  };
+  recorder.AddMarkedSource(node, serialize);
+  recorder.AddMarkedSource(node,
+                           []() -> const std::string * { return nullptr; });
+  EXPECT_EQ(1, calls);
+  EXPECT_EQ(1, stream.entries().size());
+  recorder.set_entry_filter(&filter);
+  recorder.AddMarkedSource(node, serialize);
+  EXPECT_EQ(1, calls);
+  EXPECT_EQ(1, stream.entries().size());
+}
+
+TEST(EntryKindFilter, KeepsOnlyListedKinds) {
+  EntryKindFilter filter;
+  std::string error_text;
+  ASSERT_TRUE(filter.Configure("/kythe/node/kind:anchor,/kythe/edge/ref", "",
+                               &error_text))
+      << error_text;
+  RecordingOutputStream stream;
+  KytheGraphRecorder recorder(&stream);
+  recorder.set_entry_filter(&filter);
+  VNameRef node;
+  node.signature = "node";
+  recorder.AddProperty(node, NodeKindID::kAnchor);
+  recorder.AddProperty(node, NodeKindID::kRecord);
+  recorder.AddProperty(node, PropertyID::kLocationStartOffset, 10);
+  recorder.AddEdge(node, EdgeKindID::kRef, node);
+  ASSERT_EQ(2, stream.entries().size());
+  EXPECT_EQ("anchor", stream.entries()[0].fact_value());
+  EXPECT_EQ("/kythe/edge/ref", stream.entries()[1].edge_kind());
+}
+
+TEST(EntryDeduplicator, DropsExactDuplicates) {
+  RecordingOutputStream stream;
+  EntryAccounting accounting(KytheGraphRecorder::AccountingCategories());
+  stream.set_accounting(&accounting);
+  KytheGraphRecorder recorder(&stream);
+  EntryDeduplicator deduplicator;
+  recorder.set_deduplicator(&deduplicator);
+  VNameRef node, other;
+  node.signature = "node";
+  other.signature = "other";
+  for (int i = 0; i < 2; ++i) {
+    recorder.AddProperty(node, NodeKindID::kAnchor);
+    recorder.AddProperty(node, PropertyID::kLocationStartOffset, 10);
+    recorder.AddEdge(node, EdgeKindID::kRef, other);
+    recorder.AddEdge(node, EdgeKindID::kParam, other, 0);
+  }
+  // These differ from earlier entries in a single field.
+  recorder.AddProperty(node, PropertyID::kLocationStartOffset, 11);
+  recorder.AddEdge(node, EdgeKindID::kRef, node);
+  recorder.AddEdge(node, EdgeKindID::kParam, other, 1);
+  recorder.AddEdge(other, EdgeKindID::kRef, other);
+  EXPECT_EQ(8, stream.entries().size());
+  EXPECT_EQ(12, deduplicator.entries());
+  EXPECT_EQ(4, deduplicator.duplicates());
+  const auto &counters = accounting.counters();
+  EXPECT_EQ(1, counters[CategoryNamed("/kythe/edge/ref")].duplicate_entries);
+  EXPECT_EQ(1, counters[CategoryNamed("/kythe/edge/param")].duplicate_entries);
+  EXPECT_NE(std::string::npos, accounting.ToJson().find("duplicate_entries"));
+}
+
+TEST(EntryKindFilter, RejectsUnknownKinds) {
+  EntryKindFilter filter;
+  std::string error_text;
+  EXPECT_FALSE(filter.Configure("", "/kythe/edge/completedby", &error_text));
+  EXPECT_NE(std::string::npos, error_text.find("/kythe/edge/completedby"));
+}
+
+}  // namespace
+}  // namespace kythe
+
+int main(int argc, char **argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  int result = RUN_ALL_TESTS();
+  return result;
+}
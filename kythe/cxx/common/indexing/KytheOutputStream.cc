@@ -16,65 +16,776 @@
 
 #include "KytheOutputStream.h"
 
+#include <limits.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
 #include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <unordered_map>
+#include <unordered_set>
 
 #include <libmemcached/memcached.h>
 
+#include "kythe/cxx/common/indexing/memcached_pool.h"
+#include "leveldb/db.h"
+#include "leveldb/write_batch.h"
+
+#include "llvm/ADT/SmallVector.h"
 #include "llvm/Support/raw_ostream.h"
 
 namespace kythe {
+namespace {
+using google::protobuf::io::CodedOutputStream;
 
-bool MemcachedHashCache::OpenMemcache(const std::string &spec) {
-  if (cache_) {
-    memcached_free(cache_);
-    cache_ = nullptr;
+/// Runs of buffers at least this large are written directly (see
+/// `FileOutputStream::set_direct_fd`) even if we aren't flushing after each
+/// entry; smaller runs are cheaper to copy than to write with a syscall each.
+constexpr size_t kMinDirectWriteSize = 64 * 1024;
+
+/// The number of trailing bytes of an entry that decide whether it ends a
+/// content-defined chunk. Each byte's contribution to a gear hash is shifted
+/// out after 64 more bytes, so this is all a rolling hash would see.
+constexpr size_t kChunkWindow = 64;
+
+/// \brief A table of random values for the gear hash that places
+/// content-defined split points.
+struct GearTable {
+  GearTable() {
+    // splitmix64, so the table (and so every split point) is the same
+    // everywhere.
+    uint64_t state = 0;
+    for (auto &value : values) {
+      uint64_t z = (state += 0x9e3779b97f4a7c15ull);
+      z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+      z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+      value = z ^ (z >> 31);
+    }
   }
-  std::string spec_amend = spec;
-  spec_amend.append(" --BINARY-PROTOCOL");
-  cache_ = memcached(spec_amend.c_str(), spec_amend.size());
-  if (cache_ != nullptr) {
-    memcached_return_t remote_version = memcached_version(cache_);
-    return memcached_success(remote_version);
+  uint64_t values[256];
+};
+const GearTable kGearTable;
+
+/// Field numbers from storage.proto.
+enum VNameField : unsigned char {
+  kVNameSignature = 1,
+  kVNameCorpus = 2,
+  kVNameRoot = 3,
+  kVNamePath = 4,
+  kVNameLanguage = 5
+};
+enum EntryField : unsigned char {
+  kEntrySource = 1,
+  kEntryEdgeKind = 2,
+  kEntryTarget = 3,
+  kEntryFactName = 4,
+  kEntryFactValue = 5
+};
+
+/// \return the (single-byte) tag for length-delimited field `field`.
+constexpr unsigned char LengthDelimitedTag(unsigned char field) {
+  return (field << 3) | 2;
+}
+
+/// \return the encoded size of a length-delimited field with `length` bytes
+/// of payload.
+size_t LengthDelimitedSize(size_t length) {
+  return 1 + CodedOutputStream::VarintSize32(length) + length;
+}
+
+/// \return the encoded size of a string field (which is omitted if empty).
+size_t StringFieldSize(llvm::StringRef value) {
+  return value.empty() ? 0 : LengthDelimitedSize(value.size());
+}
+
+/// \brief Writes the tag and length prefix for a length-delimited field.
+unsigned char *WriteFieldHeader(unsigned char field, size_t length,
+                                unsigned char *target) {
+  *target++ = LengthDelimitedTag(field);
+  return CodedOutputStream::WriteVarint32ToArray(length, target);
+}
+
+/// \brief Writes a string field (unless it's empty).
+unsigned char *WriteStringField(unsigned char field, llvm::StringRef value,
+                                unsigned char *target) {
+  if (value.empty()) {
+    return target;
   }
-  return false;
+  target = WriteFieldHeader(field, value.size(), target);
+  ::memcpy(target, value.data(), value.size());
+  return target + value.size();
+}
+
+/// \brief Copies an already-encoded field.
+unsigned char *WriteEncodedField(llvm::StringRef encoded,
+                                 unsigned char *target) {
+  ::memcpy(target, encoded.data(), encoded.size());
+  return target + encoded.size();
+}
+
+/// \return `value` encoded as string field `field`.
+std::string EncodeStringField(unsigned char field, llvm::StringRef value) {
+  std::string encoded(StringFieldSize(value), '\0');
+  WriteStringField(field, value,
+                   reinterpret_cast<unsigned char *>(&encoded[0]));
+  return encoded;
+}
+
+/// The fact name of every edge, encoded.
+constexpr char kEncodedEdgeFactName[] = {
+    static_cast<char>(LengthDelimitedTag(kEntryFactName)), 1, '/'};
+
+/// \return the encoded size of `vname` (without a tag or length prefix).
+size_t VNameSize(const VNameRef &vname) {
+  return StringFieldSize(vname.signature) + StringFieldSize(vname.corpus) +
+         StringFieldSize(vname.root) + StringFieldSize(vname.path) +
+         StringFieldSize(vname.language);
+}
+
+/// \brief Writes `vname` as message field `field`.
+unsigned char *WriteVNameField(unsigned char field, const VNameRef &vname,
+                               size_t vname_size, unsigned char *target) {
+  target = WriteFieldHeader(field, vname_size, target);
+  target = WriteStringField(kVNameSignature, vname.signature, target);
+  target = WriteStringField(kVNameCorpus, vname.corpus, target);
+  target = WriteStringField(kVNameRoot, vname.root, target);
+  target = WriteStringField(kVNamePath, vname.path, target);
+  return WriteStringField(kVNameLanguage, vname.language, target);
+}
+}  // anonymous namespace
+
+std::string EntryEncoder::EncodeFactName(llvm::StringRef fact_name) {
+  return EncodeStringField(kEntryFactName, fact_name);
+}
+
+std::string EntryEncoder::EncodeEdgeKind(llvm::StringRef edge_kind) {
+  return EncodeStringField(kEntryEdgeKind, edge_kind);
+}
+
+EntryEncoder::EntryEncoder(const FactRef &fact)
+    : source_(fact.source),
+      fact_name_(fact.fact_name),
+      fact_value_(fact.fact_value),
+      encoded_fact_name_(fact.encoded_fact_name) {
+  ComputeSizes();
+}
+
+EntryEncoder::EntryEncoder(const EdgeRef &edge)
+    : source_(edge.source),
+      edge_kind_(edge.edge_kind),
+      target_(edge.target),
+      fact_name_("/"),
+      encoded_edge_kind_(edge.encoded_edge_kind),
+      encoded_fact_name_(kEncodedEdgeFactName, sizeof(kEncodedEdgeFactName)) {
+  ComputeSizes();
+}
+
+EntryEncoder::EntryEncoder(const OrdinalEdgeRef &edge)
+    : source_(edge.source),
+      edge_kind_(edge.edge_kind),
+      target_(edge.target),
+      fact_name_("/"),
+      encoded_fact_name_(kEncodedEdgeFactName, sizeof(kEncodedEdgeFactName)) {
+  ordinal_suffix_length_ =
+      ::sprintf(ordinal_suffix_, ".%u", static_cast<unsigned>(edge.ordinal));
+  ComputeSizes();
+}
+
+EntryEncoder::EntryEncoder(const VNameRef &source,
+                           llvm::StringRef encoded_source,
+                           const FanOutEdgeRef &edge)
+    : source_(&source),
+      encoded_source_(encoded_source),
+      edge_kind_(edge.edge_kind),
+      target_(edge.target),
+      fact_name_("/"),
+      encoded_fact_name_(kEncodedEdgeFactName, sizeof(kEncodedEdgeFactName)) {
+  if (edge.ordinal < 0) {
+    encoded_edge_kind_ = edge.encoded_edge_kind;
+  } else {
+    ordinal_suffix_length_ = ::sprintf(ordinal_suffix_, ".%u",
+                                       static_cast<unsigned>(edge.ordinal));
+  }
+  ComputeSizes();
+}
+
+std::string EntryEncoder::EncodeSource(const VNameRef &source) {
+  size_t source_size = VNameSize(source);
+  std::string encoded(LengthDelimitedSize(source_size), '\0');
+  WriteVNameField(kEntrySource, source, source_size,
+                  reinterpret_cast<unsigned char *>(&encoded[0]));
+  return encoded;
 }
 
+void EntryEncoder::ComputeSizes() {
+  if (!encoded_source_.empty()) {
+    size_ = encoded_source_.size();
+  } else {
+    source_size_ = VNameSize(*source_);
+    size_ = LengthDelimitedSize(source_size_);
+  }
+  size_t edge_kind_size = edge_kind_.size() + ordinal_suffix_length_;
+  if (!encoded_edge_kind_.empty()) {
+    size_ += encoded_edge_kind_.size();
+  } else if (edge_kind_size != 0) {
+    size_ += LengthDelimitedSize(edge_kind_size);
+  }
+  if (target_ != nullptr) {
+    target_size_ = VNameSize(*target_);
+    size_ += LengthDelimitedSize(target_size_);
+  }
+  size_ += encoded_fact_name_.empty() ? StringFieldSize(fact_name_)
+                                      : encoded_fact_name_.size();
+  size_ += StringFieldSize(fact_value_);
+}
+
+unsigned char *EntryEncoder::Write(unsigned char *target) const {
+  target = WritePrefix(target);
+  ::memcpy(target, fact_value_.data(), fact_value_.size());
+  return target + fact_value_.size();
+}
+
+unsigned char *EntryEncoder::WritePrefix(unsigned char *target) const {
+  if (!encoded_source_.empty()) {
+    target = WriteEncodedField(encoded_source_, target);
+  } else {
+    target = WriteVNameField(kEntrySource, *source_, source_size_, target);
+  }
+  size_t edge_kind_size = edge_kind_.size() + ordinal_suffix_length_;
+  if (!encoded_edge_kind_.empty()) {
+    target = WriteEncodedField(encoded_edge_kind_, target);
+  } else if (edge_kind_size != 0) {
+    target = WriteFieldHeader(kEntryEdgeKind, edge_kind_size, target);
+    ::memcpy(target, edge_kind_.data(), edge_kind_.size());
+    target += edge_kind_.size();
+    ::memcpy(target, ordinal_suffix_, ordinal_suffix_length_);
+    target += ordinal_suffix_length_;
+  }
+  if (target_ != nullptr) {
+    target = WriteVNameField(kEntryTarget, *target_, target_size_, target);
+  }
+  if (!encoded_fact_name_.empty()) {
+    target = WriteEncodedField(encoded_fact_name_, target);
+  } else {
+    target = WriteStringField(kEntryFactName, fact_name_, target);
+  }
+  if (fact_value_.empty()) {
+    return target;
+  }
+  return WriteFieldHeader(kEntryFactValue, fact_value_.size(), target);
+}
+
+MemcachedHashCache::MemcachedHashCache() {}
+
 MemcachedHashCache::~MemcachedHashCache() {
-  if (cache_) {
-    memcached_free(cache_);
-    cache_ = nullptr;
+  if (pool_) {
+    fprintf(stderr, "%s", pool_->ToString().c_str());
   }
 }
 
+bool MemcachedHashCache::OpenMemcache(const std::string &spec) {
+  pool_.reset(new MemcachedPool("hash cache", MemcachedPool::Options()));
+  bool opened = pool_->Open(spec);
+  if (!pool_->handle()) {
+    pool_.reset();
+  }
+  return opened;
+}
+
+void MemcachedHashCache::UsePool(std::unique_ptr<MemcachedPool> pool) {
+  pool_ = std::move(pool);
+}
+
 void MemcachedHashCache::RegisterHash(const Hash &hash) {
-  if (!cache_) {
+  if (!pool_ || !pool_->Admit()) {
     return;
   }
   char value = 1;
-  memcached_return_t add_result =
-      memcached_add(cache_, reinterpret_cast<const char *>(hash), kHashSize,
-                    &value, sizeof(value), 0, 0);
-  if (!memcached_success(add_result) && add_result != MEMCACHED_DATA_EXISTS) {
+  const auto start = MemcachedPool::Clock::now();
+  memcached_return_t add_result = memcached_add(
+      pool_->handle(), reinterpret_cast<const char *>(hash), kHashSize, &value,
+      sizeof(value), 0, 0);
+  if (!pool_->Record(MemcachedPool::kAdd, start, add_result)) {
     fprintf(stderr, "memcached add failed: %s\n",
-            memcached_strerror(cache_, add_result));
+            memcached_strerror(pool_->handle(), add_result));
   }
 }
 
 bool MemcachedHashCache::SawHash(const Hash &hash) {
-  if (!cache_) {
+  if (!pool_ || !pool_->Admit()) {
+    // Treat the outage as a miss.
     return false;
   }
-  memcached_return_t ex_result =
-      memcached_exist(cache_, reinterpret_cast<const char *>(hash), kHashSize);
-  if (ex_result == MEMCACHED_SUCCESS) {
-    return true;
-  } else if (ex_result != MEMCACHED_NOTFOUND) {
+  const auto start = MemcachedPool::Clock::now();
+  memcached_return_t ex_result = memcached_exist(
+      pool_->handle(), reinterpret_cast<const char *>(hash), kHashSize);
+  if (!pool_->Record(MemcachedPool::kGet, start, ex_result)) {
     fprintf(stderr, "memcached exist failed: %s\n",
-            memcached_strerror(cache_, ex_result));
+            memcached_strerror(pool_->handle(), ex_result));
+  }
+  return ex_result == MEMCACHED_SUCCESS;
+}
+
+LevelDBHashCache::~LevelDBHashCache() { delete db_; }
+
+bool LevelDBHashCache::Open(const std::string &path, std::string *error_text) {
+  delete db_;
+  db_ = nullptr;
+  ::leveldb::Options options;
+  options.create_if_missing = true;
+  ::leveldb::Status status = ::leveldb::DB::Open(options, path, &db_);
+  if (!status.ok()) {
+    *error_text = status.ToString();
+    db_ = nullptr;
+    return false;
+  }
+  return true;
+}
+
+void LevelDBHashCache::RegisterHash(const Hash &hash) {
+  if (!db_) {
+    return;
+  }
+  ::leveldb::Status status = db_->Put(
+      ::leveldb::WriteOptions(),
+      ::leveldb::Slice(reinterpret_cast<const char *>(hash), kHashSize), "");
+  if (!status.ok()) {
+    fprintf(stderr, "leveldb put failed: %s\n", status.ToString().c_str());
+  }
+}
+
+bool LevelDBHashCache::SawHash(const Hash &hash) {
+  if (!db_) {
+    return false;
   }
+  std::string value;
+  ::leveldb::Status status = db_->Get(
+      ::leveldb::ReadOptions(),
+      ::leveldb::Slice(reinterpret_cast<const char *>(hash), kHashSize),
+      &value);
+  if (!status.ok() && !status.IsNotFound()) {
+    fprintf(stderr, "leveldb get failed: %s\n", status.ToString().c_str());
+  }
+  return status.ok();
+}
+
+void LevelDBHashCache::RegisterHashes(const std::vector<const Hash *> &hashes) {
+  if (!db_ || hashes.empty()) {
+    return;
+  }
+  ::leveldb::WriteBatch batch;
+  for (const auto *hash : hashes) {
+    batch.Put(
+        ::leveldb::Slice(reinterpret_cast<const char *>(*hash), kHashSize), "");
+  }
+  ::leveldb::Status status = db_->Write(::leveldb::WriteOptions(), &batch);
+  if (!status.ok()) {
+    fprintf(stderr, "leveldb write failed: %s\n", status.ToString().c_str());
+  }
+}
+
+void MemcachedHashCache::SawHashes(const std::vector<const Hash *> &hashes,
+                                   std::vector<bool> *seen) {
+  seen->assign(hashes.size(), false);
+  if (!pool_ || hashes.empty() || !pool_->Admit()) {
+    return;
+  }
+  ::memcached_st *cache = pool_->handle();
+  std::vector<const char *> keys;
+  std::vector<size_t> key_lengths;
+  std::unordered_multimap<std::string, size_t> key_to_index;
+  for (size_t i = 0; i < hashes.size(); ++i) {
+    keys.push_back(reinterpret_cast<const char *>(*hashes[i]));
+    key_lengths.push_back(kHashSize);
+    key_to_index.emplace(std::string(keys.back(), kHashSize), i);
+  }
+  const auto start = MemcachedPool::Clock::now();
+  memcached_return_t get_result =
+      memcached_mget(cache, keys.data(), key_lengths.data(), keys.size());
+  if (!memcached_success(get_result)) {
+    pool_->Record(MemcachedPool::kMultiGet, start, get_result);
+    fprintf(stderr, "memcached mget failed: %s\n",
+            memcached_strerror(cache, get_result));
+    return;
+  }
+  memcached_return_t fetch_result;
+  while (memcached_result_st *result =
+             memcached_fetch_result(cache, nullptr, &fetch_result)) {
+    std::string key(memcached_result_key_value(result),
+                    memcached_result_key_length(result));
+    auto found = key_to_index.equal_range(key);
+    for (auto index = found.first; index != found.second; ++index) {
+      (*seen)[index->second] = true;
+    }
+    memcached_result_free(result);
+  }
+  if (!pool_->Record(MemcachedPool::kMultiGet, start, fetch_result)) {
+    fprintf(stderr, "memcached fetch failed: %s\n",
+            memcached_strerror(cache, fetch_result));
+  }
+}
+
+void MemcachedHashCache::RegisterHashes(
+    const std::vector<const Hash *> &hashes) {
+  if (!pool_ || hashes.empty() || !pool_->Admit()) {
+    return;
+  }
+  ::memcached_st *cache = pool_->handle();
+  // Queue up quiet adds and send them all at once; we don't care whether
+  // another client registered the same hash first.
+  memcached_behavior_set(cache, MEMCACHED_BEHAVIOR_NOREPLY, 1);
+  memcached_behavior_set(cache, MEMCACHED_BEHAVIOR_BUFFER_REQUESTS, 1);
+  char value = 1;
+  const auto start = MemcachedPool::Clock::now();
+  for (const auto *hash : hashes) {
+    memcached_return_t add_result =
+        memcached_add(cache, reinterpret_cast<const char *>(*hash), kHashSize,
+                      &value, sizeof(value), 0, 0);
+    if (!MemcachedPool::IsAnswer(add_result)) {
+      fprintf(stderr, "memcached add failed: %s\n",
+              memcached_strerror(cache, add_result));
+    }
+  }
+  memcached_return_t flush_result = memcached_flush_buffers(cache);
+  if (!pool_->Record(MemcachedPool::kFlush, start, flush_result)) {
+    fprintf(stderr, "memcached flush failed: %s\n",
+            memcached_strerror(cache, flush_result));
+  }
+  memcached_behavior_set(cache, MEMCACHED_BEHAVIOR_BUFFER_REQUESTS, 0);
+  memcached_behavior_set(cache, MEMCACHED_BEHAVIOR_NOREPLY, 0);
+}
+
+LayeredHashCache::LayeredHashCache(HashCache *remote, size_t lru_size,
+                                   size_t bloom_bits)
+    : remote_(remote),
+      lru_size_(lru_size),
+      bloom_((bloom_bits + 63) / 64),
+      bloom_bits_(bloom_.size() * 64) {
+  SetSizeLimits(remote->min_size(), remote->max_size());
+  set_average_chunk_size(remote->average_chunk_size());
+  set_batch_size(remote->batch_size());
+}
+
+bool LayeredHashCache::SawHashLocally(const Hash &hash) {
+  if (lru_size_ != 0) {
+    Key key;
+    ::memcpy(key.data(), hash, kHashSize);
+    auto found = lru_index_.find(key);
+    if (found != lru_index_.end()) {
+      lru_.splice(lru_.begin(), lru_, found->second);
+      ++stats_.lru_hits;
+      return true;
+    }
+  }
+  if (bloom_bits_ != 0) {
+    for (size_t probe = 0; probe < kBloomProbes; ++probe) {
+      uint32_t bit;
+      ::memcpy(&bit, hash + probe * sizeof(bit), sizeof(bit));
+      bit %= bloom_bits_;
+      if (!(bloom_[bit / 64] & (1ull << (bit % 64)))) {
+        return false;
+      }
+    }
+    ++stats_.bloom_hits;
+    return true;
+  }
+  return false;
+}
+
+void LayeredHashCache::InsertConfirmed(const Hash &hash) {
+  if (lru_size_ == 0) {
+    return;
+  }
+  Key key;
+  ::memcpy(key.data(), hash, kHashSize);
+  if (lru_index_.count(key)) {
+    return;
+  }
+  if (lru_.size() >= lru_size_) {
+    lru_index_.erase(lru_.back());
+    lru_.pop_back();
+  }
+  lru_.push_front(key);
+  lru_index_[key] = lru_.begin();
+}
+
+void LayeredHashCache::InsertRegistered(const Hash &hash) {
+  if (bloom_bits_ == 0) {
+    return;
+  }
+  for (size_t probe = 0; probe < kBloomProbes; ++probe) {
+    uint32_t bit;
+    ::memcpy(&bit, hash + probe * sizeof(bit), sizeof(bit));
+    bit %= bloom_bits_;
+    bloom_[bit / 64] |= 1ull << (bit % 64);
+  }
+}
+
+void LayeredHashCache::RegisterHash(const Hash &hash) {
+  InsertRegistered(hash);
+  remote_->RegisterHash(hash);
+}
+
+bool LayeredHashCache::SawHash(const Hash &hash) {
+  if (SawHashLocally(hash)) {
+    return true;
+  }
+  if (remote_->SawHash(hash)) {
+    ++stats_.remote_hits;
+    InsertConfirmed(hash);
+    return true;
+  }
+  ++stats_.misses;
   return false;
 }
 
+void LayeredHashCache::SawHashes(const std::vector<const Hash *> &hashes,
+                                 std::vector<bool> *seen) {
+  seen->assign(hashes.size(), false);
+  std::vector<const Hash *> remote_hashes;
+  std::vector<size_t> remote_indices;
+  for (size_t i = 0; i < hashes.size(); ++i) {
+    if (SawHashLocally(*hashes[i])) {
+      (*seen)[i] = true;
+    } else {
+      remote_hashes.push_back(hashes[i]);
+      remote_indices.push_back(i);
+    }
+  }
+  if (remote_hashes.empty()) {
+    return;
+  }
+  std::vector<bool> remote_seen;
+  remote_->SawHashes(remote_hashes, &remote_seen);
+  for (size_t i = 0; i < remote_hashes.size(); ++i) {
+    if (remote_seen[i]) {
+      ++stats_.remote_hits;
+      InsertConfirmed(*remote_hashes[i]);
+      (*seen)[remote_indices[i]] = true;
+    } else {
+      ++stats_.misses;
+    }
+  }
+}
+
+void LayeredHashCache::RegisterHashes(const std::vector<const Hash *> &hashes) {
+  for (const auto *hash : hashes) {
+    InsertRegistered(*hash);
+  }
+  remote_->RegisterHashes(hashes);
+}
+
+constexpr size_t ConcurrentHashCache::kMaxProbes;
+
+ConcurrentHashCache::ConcurrentHashCache(HashCache *cache, size_t table_size,
+                                         size_t registration_batch_size)
+    : cache_(cache),
+      table_size_(1),
+      registration_batch_size_(std::max<size_t>(registration_batch_size, 1)) {
+  while (table_size_ < table_size) {
+    table_size_ <<= 1;
+  }
+  table_.reset(new std::atomic<uint64_t>[table_size_]);
+  for (size_t slot = 0; slot < table_size_; ++slot) {
+    table_[slot].store(0, std::memory_order_relaxed);
+  }
+  SetSizeLimits(cache->min_size(), cache->max_size());
+  set_average_chunk_size(cache->average_chunk_size());
+  set_batch_size(cache->batch_size());
+}
+
+ConcurrentHashCache::Claim ConcurrentHashCache::ClaimHash(const Hash &hash) {
+  uint64_t key;
+  ::memcpy(&key, hash, sizeof(key));
+  if (key == 0) {
+    // 0 marks empty slots.
+    key = 1;
+  }
+  // Only the keys themselves are shared through the table, so there's
+  // nothing for a stronger memory order to publish.
+  const size_t probes = std::min(kMaxProbes, table_size_);
+  for (size_t probe = 0; probe < probes; ++probe) {
+    auto &slot = table_[(key + probe) & (table_size_ - 1)];
+    uint64_t current = slot.load(std::memory_order_relaxed);
+    if (current == 0) {
+      if (slot.compare_exchange_strong(current, key,
+                                       std::memory_order_relaxed)) {
+        return Claim::kClaimed;
+      }
+      // `current` is now whatever beat us to the slot.
+    }
+    if (current == key) {
+      return Claim::kTaken;
+    }
+  }
+  return Claim::kFull;
+}
+
+bool ConcurrentHashCache::LookUpHash(const Hash &hash, size_t *claimed_hits) {
+  if (ClaimHash(hash) == Claim::kTaken) {
+    ++*claimed_hits;
+    return true;
+  }
+  std::lock_guard<std::mutex> lock(mutex_);
+  return cache_->SawHash(hash);
+}
+
+void ConcurrentHashCache::LookUpHashes(const std::vector<const Hash *> &hashes,
+                                       std::vector<bool> *seen,
+                                       size_t *claimed_hits) {
+  seen->assign(hashes.size(), true);
+  std::vector<const Hash *> unclaimed_hashes;
+  std::vector<size_t> unclaimed_indices;
+  for (size_t i = 0; i < hashes.size(); ++i) {
+    if (ClaimHash(*hashes[i]) == Claim::kTaken) {
+      ++*claimed_hits;
+    } else {
+      unclaimed_hashes.push_back(hashes[i]);
+      unclaimed_indices.push_back(i);
+    }
+  }
+  if (unclaimed_hashes.empty()) {
+    return;
+  }
+  std::vector<bool> cache_seen;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    cache_->SawHashes(unclaimed_hashes, &cache_seen);
+  }
+  for (size_t i = 0; i < unclaimed_hashes.size(); ++i) {
+    (*seen)[unclaimed_indices[i]] = cache_seen[i];
+  }
+}
+
+void ConcurrentHashCache::RegisterHash(const Hash &hash) {
+  ClaimHash(hash);
+  std::lock_guard<std::mutex> lock(mutex_);
+  cache_->RegisterHash(hash);
+}
+
+bool ConcurrentHashCache::SawHash(const Hash &hash) {
+  size_t claimed_hits = 0;
+  bool seen = LookUpHash(hash, &claimed_hits);
+  claimed_hits_.fetch_add(claimed_hits, std::memory_order_relaxed);
+  return seen;
+}
+
+void ConcurrentHashCache::SawHashes(const std::vector<const Hash *> &hashes,
+                                    std::vector<bool> *seen) {
+  size_t claimed_hits = 0;
+  LookUpHashes(hashes, seen, &claimed_hits);
+  claimed_hits_.fetch_add(claimed_hits, std::memory_order_relaxed);
+}
+
+void ConcurrentHashCache::RegisterHashes(
+    const std::vector<const Hash *> &hashes) {
+  for (const auto *hash : hashes) {
+    ClaimHash(*hash);
+  }
+  std::lock_guard<std::mutex> lock(mutex_);
+  cache_->RegisterHashes(hashes);
+}
+
+HashCache::Stats ConcurrentHashCache::stats() const {
+  Stats stats;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stats = cache_->stats();
+  }
+  stats.claimed_hits += claimed_hits_.load(std::memory_order_relaxed);
+  return stats;
+}
+
+ConcurrentHashCache::Worker::Worker(ConcurrentHashCache *shared)
+    : shared_(shared) {
+  SetSizeLimits(shared->min_size(), shared->max_size());
+  set_average_chunk_size(shared->average_chunk_size());
+  set_batch_size(shared->batch_size());
+}
+
+void ConcurrentHashCache::Worker::RegisterHash(const Hash &hash) {
+  pending_.emplace_back();
+  ::memcpy(pending_.back().data(), hash, kHashSize);
+  if (pending_.size() >= shared_->registration_batch_size_) {
+    Flush();
+  }
+}
+
+bool ConcurrentHashCache::Worker::SawHash(const Hash &hash) {
+  return shared_->LookUpHash(hash, &claimed_hits_);
+}
+
+void ConcurrentHashCache::Worker::SawHashes(
+    const std::vector<const Hash *> &hashes, std::vector<bool> *seen) {
+  shared_->LookUpHashes(hashes, seen, &claimed_hits_);
+}
+
+void ConcurrentHashCache::Worker::RegisterHashes(
+    const std::vector<const Hash *> &hashes) {
+  for (const auto *hash : hashes) {
+    RegisterHash(*hash);
+  }
+}
+
+void ConcurrentHashCache::Worker::Flush() {
+  shared_->claimed_hits_.fetch_add(claimed_hits_, std::memory_order_relaxed);
+  claimed_hits_ = 0;
+  if (pending_.empty()) {
+    return;
+  }
+  std::vector<const Hash *> hashes;
+  hashes.reserve(pending_.size());
+  for (const auto &hash : pending_) {
+    hashes.push_back(reinterpret_cast<const Hash *>(hash.data()));
+  }
+  shared_->RegisterHashes(hashes);
+  pending_.clear();
+}
+
+void EntryAccounting::Merge(const EntryAccounting &other) {
+  assert(other.counters_.size() == counters_.size());
+  for (size_t category = 0; category < counters_.size(); ++category) {
+    const auto &from = other.counters_[category];
+    auto &to = counters_[category];
+    to.entries += from.entries;
+    to.bytes += from.bytes;
+    to.dropped_entries += from.dropped_entries;
+    to.dropped_bytes += from.dropped_bytes;
+    to.duplicate_entries += from.duplicate_entries;
+  }
+}
+
+std::string EntryAccounting::ToJson() const {
+  std::string out;
+  llvm::raw_string_ostream ostream(out);
+  ostream << "{";
+  bool first = true;
+  for (size_t category = 0; category < counters_.size(); ++category) {
+    const auto &counters = counters_[category];
+    if (counters.entries == 0 && counters.duplicate_entries == 0) {
+      continue;
+    }
+    if (!first) {
+      ostream << ",";
+    }
+    first = false;
+    // Category names are Kythe spellings, which don't need escaping.
+    ostream << "\"" << names_[category] << "\":{\"entries\":"
+            << counters.entries << ",\"bytes\":" << counters.bytes
+            << ",\"dropped_entries\":" << counters.dropped_entries
+            << ",\"dropped_bytes\":" << counters.dropped_bytes;
+    if (counters.duplicate_entries != 0) {
+      ostream << ",\"duplicate_entries\":" << counters.duplicate_entries;
+    }
+    ostream << "}";
+  }
+  ostream << "}";
+  return ostream.str();
+}
+
 std::string FileOutputStream::Stats::ToString() const {
   std::string out;
   llvm::raw_string_ostream ostream(out);
@@ -82,74 +793,526 @@ std::string FileOutputStream::Stats::ToString() const {
           << buffers_retired_ << " retired " << hashes_matched_ << " matches "
           << (buffers_retired_ ? (total_bytes_ / buffers_retired_) : 0)
           << " bytes/buffer";
+  if (content_splits_ != 0) {
+    ostream << " " << content_splits_ << " content splits";
+  }
+  if (total_bytes_ != 0) {
+    ostream << " " << (100 * bytes_matched_ / total_bytes_)
+            << "% bytes matched";
+  }
+  if (hash_batches_ != 0) {
+    ostream << " " << hash_batches_ << " batches " << round_trips_saved_
+            << " round trips saved " << (stall_usec_ / 1000) << " ms stalled";
+  }
+  if (direct_writes_ != 0) {
+    ostream << " " << direct_writes_ << " direct writes " << direct_bytes_
+            << " direct bytes";
+  }
+  if (content_facts_ != 0) {
+    ostream << " " << content_facts_ << " content facts " << content_bytes_
+            << " content bytes";
+  }
+  if (writer_stalls_ != 0) {
+    ostream << " " << writer_stalls_ << " writer stalls";
+  }
+  if (cache_stats_.lru_hits + cache_stats_.bloom_hits +
+          cache_stats_.remote_hits + cache_stats_.misses +
+          cache_stats_.claimed_hits !=
+      0) {
+    ostream << " " << cache_stats_.lru_hits << " lru hits "
+            << cache_stats_.bloom_hits << " bloom hits "
+            << cache_stats_.remote_hits << " remote hits "
+            << cache_stats_.misses << " misses";
+  }
+  if (cache_stats_.claimed_hits != 0) {
+    ostream << " " << cache_stats_.claimed_hits << " claimed hits";
+  }
   return ostream.str();
 }
 
 FileOutputStream::~FileOutputStream() {
+  for (auto &group : file_groups_) {
+    RetireFileGroup(&group.second);
+  }
   while (!buffers_.empty()) {
     // Shake out any less-than-minimum-sized buffers that remain.
     EmitAndReleaseTopBuffer();
   }
+  EmitPendingBuffers();
+  ReportToTuner();
+  if (writer_ != nullptr) {
+    writer_->Close();
+    stats_.writer_stalls_ = writer_->stalls();
+  }
   if (show_stats_) {
+    stats_.cache_stats_ = cache_->stats();
     fprintf(stderr, "%s\n", stats_.ToString().c_str());
     fflush(stderr);
   }
 }
 
-void FileOutputStream::EnqueueEntry(const proto::Entry &entry) {
+void FileOutputStream::AddCharge(size_t bytes, std::vector<Charge> *charges) {
+  size_t category = accounting_->category();
+  accounting_->Count(category, 1, bytes);
+  if (!charges->empty() && charges->back().category == category) {
+    ++charges->back().entries;
+    charges->back().bytes += bytes;
+  } else {
+    charges->push_back(Charge{category, 1, bytes});
+  }
+}
+
+void FileOutputStream::EnqueueEntry(const EntryEncoder &entry) {
+  if (!open_groups_.empty()) {
+    EnqueueGroupedEntry(entry);
+    return;
+  }
+  size_t entry_size = entry.size();
   if (cache_ == &default_cache_ || buffers_.empty()) {
-    {
-      google::protobuf::io::CodedOutputStream coded_stream(stream_);
-      coded_stream.WriteVarint32(entry.ByteSize());
-      entry.SerializeToCodedStream(&coded_stream);
+    // Entries outside of buffers must not overtake buffers that were retired
+    // before them.
+    EmitPendingBuffers();
+    if (accounting_ != nullptr) {
+      size_t size_size = CodedOutputStream::VarintSize32(entry_size);
+      accounting_->Count(accounting_->category(), 1, entry_size + size_size);
     }
-    if (flush_after_each_entry_) {
-      stream_->Flush();
+    {
+      CodedOutputStream coded_stream(stream_);
+      coded_stream.WriteVarint32(entry_size);
+      if (auto *target =
+              coded_stream.GetDirectBufferForNBytesAndAdvance(entry_size)) {
+        entry.Write(target);
+      } else {
+        llvm::SmallVector<unsigned char, 512> data(entry_size);
+        entry.Write(data.data());
+        coded_stream.WriteRaw(data.data(), entry_size);
+      }
     }
+    MaybeFlush();
     return;
   }
 
-  size_t entry_size = entry.ByteSize();
-  size_t size_size =
-      google::protobuf::io::CodedOutputStream::VarintSize32(entry_size);
+  size_t size_size = CodedOutputStream::VarintSize32(entry_size);
   size_t size_delta = entry_size + size_size;
   unsigned char *buffer = buffers_.WriteToTop(size_delta);
+  buffer = CodedOutputStream::WriteVarint32ToArray(entry_size, buffer);
+  entry.Write(buffer);
+  stats_.total_bytes_ += size_delta;
+  if (accounting_ != nullptr) {
+    AddCharge(size_delta, &charges_.back());
+  }
 
-  google::protobuf::io::CodedOutputStream::WriteVarint32ToArray(entry_size,
-                                                                buffer);
-  if (!entry.SerializeToArray(&buffer[size_size], size_delta - size_size)) {
-    assert(0 && "bad proto size calculation");
+  if (buffers_.top_size() >= max_size_) {
+    ++stats_.buffers_split_;
+    EmitAndReleaseTopBuffer();
+    PushBuffer();
+  } else if (average_chunk_size_ != 0 && buffers_.top_size() >= min_size_ &&
+             IsChunkBoundary(buffer, entry_size)) {
+    ++stats_.content_splits_;
+    EmitAndReleaseTopBuffer();
+    PushBuffer();
   }
+}
+
+void FileOutputStream::EnqueueGroupedEntry(const EntryEncoder &entry) {
+  FileGroup *group = open_groups_.back();
+  size_t entry_size = entry.size();
+  size_t size_delta = entry_size + CodedOutputStream::VarintSize32(entry_size);
+  size_t insertion_point = group->data.size();
+  group->data.resize(insertion_point + size_delta);
+  auto *buffer = reinterpret_cast<unsigned char *>(&group->data[0]) +
+                 insertion_point;
+  buffer = CodedOutputStream::WriteVarint32ToArray(entry_size, buffer);
+  entry.Write(buffer);
   stats_.total_bytes_ += size_delta;
+  if (accounting_ != nullptr) {
+    AddCharge(size_delta, &group->charges);
+  }
+  if (group->data.size() >= max_size_) {
+    ++stats_.buffers_split_;
+    RetireFileGroup(group);
+  }
+}
+
+void FileOutputStream::RetireFileGroup(FileGroup *group) {
+  if (group->data.empty()) {
+    return;
+  }
+  // The group goes through the stack so that it's hashed, batched and
+  // written like any other buffer.
+  buffers_.Push(group->data.size());
+  ::memcpy(buffers_.WriteToTop(group->data.size()), group->data.data(),
+           group->data.size());
+  charges_.push_back(std::move(group->charges));
+  EmitAndReleaseTopBuffer();
+  group->data.clear();
+  group->charges.clear();
+}
 
+void FileOutputStream::EmitEdges(const VNameRef &source,
+                                 llvm::ArrayRef<FanOutEdgeRef> edges) {
+  const std::string encoded_source = EntryEncoder::EncodeSource(source);
+  if (accounting_ != nullptr || !open_groups_.empty()) {
+    for (const auto &edge : edges) {
+      EnqueueEntry(EntryEncoder(source, encoded_source, edge));
+    }
+    return;
+  }
+  if (cache_ == &default_cache_ || buffers_.empty()) {
+    EmitPendingBuffers();
+    {
+      CodedOutputStream coded_stream(stream_);
+      llvm::SmallVector<unsigned char, 512> data;
+      for (const auto &edge : edges) {
+        EntryEncoder entry(source, encoded_source, edge);
+        size_t entry_size = entry.size();
+        coded_stream.WriteVarint32(entry_size);
+        if (auto *target =
+                coded_stream.GetDirectBufferForNBytesAndAdvance(entry_size)) {
+          entry.Write(target);
+        } else {
+          data.resize(entry_size);
+          entry.Write(data.data());
+          coded_stream.WriteRaw(data.data(), entry_size);
+        }
+      }
+    }
+    MaybeFlush();
+    return;
+  }
+  const unsigned char *last_entry = nullptr;
+  size_t last_entry_size = 0;
+  for (const auto &edge : edges) {
+    EntryEncoder entry(source, encoded_source, edge);
+    last_entry_size = entry.size();
+    size_t size_delta =
+        last_entry_size + CodedOutputStream::VarintSize32(last_entry_size);
+    unsigned char *buffer = buffers_.WriteToTop(size_delta);
+    buffer = CodedOutputStream::WriteVarint32ToArray(last_entry_size, buffer);
+    entry.Write(buffer);
+    last_entry = buffer;
+    stats_.total_bytes_ += size_delta;
+  }
+  if (last_entry == nullptr) {
+    return;
+  }
   if (buffers_.top_size() >= max_size_) {
     ++stats_.buffers_split_;
     EmitAndReleaseTopBuffer();
     PushBuffer();
+  } else if (average_chunk_size_ != 0 && buffers_.top_size() >= min_size_ &&
+             IsChunkBoundary(last_entry, last_entry_size)) {
+    ++stats_.content_splits_;
+    EmitAndReleaseTopBuffer();
+    PushBuffer();
+  }
+}
+
+bool FileOutputStream::IsChunkBoundary(const unsigned char *entry,
+                                       size_t size) const {
+  uint64_t hash = 0;
+  for (size_t i = size - std::min(size, kChunkWindow); i < size; ++i) {
+    hash = (hash << 1) + kGearTable.values[entry[i]];
+  }
+  // The high bits depend on the whole window. Splitting with probability
+  // `size / average_chunk_size_` puts split points about
+  // `average_chunk_size_` bytes apart however large the entries are.
+  return (hash >> 32) * average_chunk_size_ < static_cast<uint64_t>(size)
+                                                  << 32;
+}
+
+void FileOutputStream::EmitContent(const FactRef &fact) {
+  EntryEncoder entry(fact);
+  if (entry.fact_value().size() < kMinDirectWriteSize) {
+    // Small values are cheaper to buffer like any other entry.
+    EnqueueEntry(entry);
+    return;
+  }
+  // Like any unbuffered entry, this mustn't overtake retired buffers.
+  EmitPendingBuffers();
+  size_t entry_size = entry.size();
+  size_t size_size = CodedOutputStream::VarintSize32(entry_size);
+  if (accounting_ != nullptr) {
+    accounting_->Count(accounting_->category(), 1, entry_size + size_size);
   }
+  llvm::SmallVector<unsigned char, 512> prefix(size_size + entry.prefix_size());
+  entry.WritePrefix(
+      CodedOutputStream::WriteVarint32ToArray(entry_size, prefix.data()));
+  pieces_.clear();
+  pieces_.emplace_back(reinterpret_cast<const char *>(prefix.data()),
+                       prefix.size());
+  pieces_.push_back(entry.fact_value());
+  WritePieces(pieces_);
+  ++stats_.content_facts_;
+  stats_.content_bytes_ += entry_size + size_size;
+  MaybeFlush();
 }
 
 void FileOutputStream::EmitAndReleaseTopBuffer() {
   HashCache::Hash hash;
   buffers_.HashTop(&hash);
-  if (!cache_->SawHash(hash)) {
-    buffers_.CopyTopToStream(stream_);
-    if (flush_after_each_entry_) {
-      stream_->Flush();
+  if (cache_->batch_size() > 1) {
+    pending_buffers_.emplace_back();
+    auto &pending = pending_buffers_.back();
+    ::memcpy(pending.hash, hash, sizeof(hash));
+    {
+      google::protobuf::io::StringOutputStream data_stream(&pending.data);
+      buffers_.CopyTopToStream(&data_stream);
+    }
+    pending.charges = std::move(charges_.back());
+    buffers_.Pop();
+    charges_.pop_back();
+    ++stats_.buffers_retired_;
+    if (pending_buffers_.size() >= cache_->batch_size()) {
+      EmitPendingBuffers();
+      MaybeReportToTuner();
+    }
+    return;
+  }
+  bool seen;
+  if (tuner_ != nullptr) {
+    auto start = std::chrono::steady_clock::now();
+    seen = cache_->SawHash(hash);
+    lookup_usec_ += std::chrono::duration_cast<std::chrono::microseconds>(
+                        std::chrono::steady_clock::now() - start)
+                        .count();
+  } else {
+    seen = cache_->SawHash(hash);
+  }
+  if (!seen) {
+    if (direct_fd_ < 0) {
+      buffers_.CopyTopToStream(stream_);
+    } else {
+      pieces_.clear();
+      buffers_.AppendTopSlabs(&pieces_);
+      WritePieces(pieces_);
     }
+    MaybeFlush();
     cache_->RegisterHash(hash);
   } else {
     ++stats_.hashes_matched_;
+    stats_.bytes_matched_ += buffers_.top_size();
+    DropCharges(charges_.back());
   }
   buffers_.Pop();
+  charges_.pop_back();
   ++stats_.buffers_retired_;
+  MaybeReportToTuner();
+}
+
+void FileOutputStream::ReportToTuner() {
+  if (tuner_ == nullptr) {
+    return;
+  }
+  auto now = std::chrono::steady_clock::now();
+  BufferSizeTuner::Sample current;
+  current.bytes = stats_.total_bytes_;
+  current.bytes_matched = stats_.bytes_matched_;
+  current.lookup_usec = lookup_usec_;
+  BufferSizeTuner::Sample sample;
+  sample.bytes = current.bytes - reported_.bytes;
+  sample.bytes_matched = current.bytes_matched - reported_.bytes_matched;
+  sample.lookup_usec = current.lookup_usec - reported_.lookup_usec;
+  sample.elapsed_usec =
+      std::chrono::duration_cast<std::chrono::microseconds>(now - reported_at_)
+          .count();
+  reported_ = current;
+  reported_at_ = now;
+  tuner_->Report(sample);
+  tuner_->GetLimits(&min_size_, &max_size_);
+}
+
+void FileOutputStream::DropCharges(const std::vector<Charge> &charges) {
+  if (accounting_ == nullptr) {
+    return;
+  }
+  for (const auto &charge : charges) {
+    accounting_->Drop(charge.category, charge.entries, charge.bytes);
+  }
+}
+
+void FileOutputStream::EmitPendingBuffers() {
+  if (pending_buffers_.empty()) {
+    return;
+  }
+  std::vector<const HashCache::Hash *> hashes;
+  for (const auto &pending : pending_buffers_) {
+    hashes.push_back(&pending.hash);
+  }
+  std::vector<bool> seen;
+  auto start = std::chrono::steady_clock::now();
+  cache_->SawHashes(hashes, &seen);
+  size_t stall_usec = std::chrono::duration_cast<std::chrono::microseconds>(
+                          std::chrono::steady_clock::now() - start)
+                          .count();
+  stats_.stall_usec_ += stall_usec;
+  lookup_usec_ += stall_usec;
+  // The same buffer may appear more than once in a batch.
+  std::unordered_set<std::string> emitted;
+  std::vector<const HashCache::Hash *> new_hashes;
+  pieces_.clear();
+  for (size_t i = 0; i < pending_buffers_.size(); ++i) {
+    const auto &pending = pending_buffers_[i];
+    std::string key(reinterpret_cast<const char *>(pending.hash),
+                    HashCache::kHashSize);
+    if (seen[i] || !emitted.insert(key).second) {
+      ++stats_.hashes_matched_;
+      stats_.bytes_matched_ += pending.data.size();
+      DropCharges(pending.charges);
+      continue;
+    }
+    pieces_.emplace_back(pending.data);
+    new_hashes.push_back(&pending.hash);
+  }
+  WritePieces(pieces_);
+  MaybeFlush();
+  cache_->RegisterHashes(new_hashes);
+  ++stats_.hash_batches_;
+  stats_.round_trips_saved_ += hashes.size() - 1;
+  if (!new_hashes.empty()) {
+    stats_.round_trips_saved_ += new_hashes.size() - 1;
+  }
+  pending_buffers_.clear();
 }
 
-void FileOutputStream::PushBuffer() { buffers_.Push(max_size_); }
+void FileOutputStream::WriteDelimitedEntries(llvm::StringRef entries) {
+  assert(buffers_.empty() && open_groups_.empty() &&
+         "can't write entries while buffers are open");
+  EmitPendingBuffers();
+  pieces_.assign(1, entries);
+  WritePieces(pieces_);
+  MaybeFlush();
+}
+
+bool FileOutputStream::Sync() {
+  assert(buffers_.empty() && open_groups_.empty() &&
+         "can't sync while buffers are open");
+  EmitPendingBuffers();
+  if (writer_ != nullptr) {
+    return writer_->Sync();
+  }
+  if (flushable_stream_ != nullptr) {
+    return flushable_stream_->Flush();
+  }
+  return true;
+}
+
+void FileOutputStream::WritePieces(const std::vector<llvm::StringRef> &pieces) {
+  size_t total_size = 0;
+  for (const auto &piece : pieces) {
+    total_size += piece.size();
+  }
+  if (total_size == 0) {
+    return;
+  }
+  std::vector<llvm::StringRef> unwritten;
+  const std::vector<llvm::StringRef> *to_copy = &pieces;
+  if (direct_fd_ >= 0 &&
+      (flush_after_each_entry_ || total_size >= kMinDirectWriteSize)) {
+    // Anything already in the stream has to reach the file first.
+    flushable_stream_->Flush();
+    unwritten = pieces;
+    if (WriteDirect(&unwritten)) {
+      return;
+    }
+    to_copy = &unwritten;
+  }
+  google::protobuf::io::CodedOutputStream coded_stream(stream_);
+  for (const auto &piece : *to_copy) {
+    coded_stream.WriteRaw(piece.data(), piece.size());
+  }
+}
+
+bool FileOutputStream::WriteDirect(std::vector<llvm::StringRef> *pieces) {
+  size_t next = 0;
+  std::vector<struct iovec> iovecs;
+  while (next < pieces->size()) {
+    iovecs.clear();
+    for (size_t i = next; i < pieces->size() && iovecs.size() < IOV_MAX; ++i) {
+      iovecs.push_back(
+          {const_cast<char *>((*pieces)[i].data()), (*pieces)[i].size()});
+    }
+    ssize_t written = ::writev(direct_fd_, iovecs.data(), iovecs.size());
+    if (written < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      ::perror("Direct write failed; copying output instead");
+      direct_fd_ = -1;
+      pieces->erase(pieces->begin(), pieces->begin() + next);
+      return false;
+    }
+    ++stats_.direct_writes_;
+    stats_.direct_bytes_ += written;
+    // Skip past what was written, which may end partway through a piece.
+    size_t remaining = written;
+    while (next < pieces->size() && remaining >= (*pieces)[next].size()) {
+      remaining -= (*pieces)[next].size();
+      ++next;
+    }
+    if (remaining != 0) {
+      (*pieces)[next] = (*pieces)[next].drop_front(remaining);
+    }
+  }
+  return true;
+}
+
+size_t FileOutputStream::buffered_bytes() const {
+  size_t bytes = buffers_.allocated_bytes() +
+                 pending_buffers_.capacity() * sizeof(PendingBuffer) +
+                 open_groups_.capacity() * sizeof(FileGroup *);
+  for (const auto &group : file_groups_) {
+    bytes += sizeof(group) + group.first.capacity() +
+             group.second.data.capacity() +
+             group.second.charges.capacity() * sizeof(Charge);
+  }
+  for (const auto &pending : pending_buffers_) {
+    bytes += pending.data.capacity() +
+             pending.charges.capacity() * sizeof(Charge);
+  }
+  for (const auto &charges : charges_) {
+    bytes += sizeof(charges) + charges.capacity() * sizeof(Charge);
+  }
+  return bytes;
+}
+
+void FileOutputStream::PushBuffer() {
+  if (!open_groups_.empty()) {
+    // Nested buffers belong to the enclosing file.
+    open_groups_.push_back(open_groups_.back());
+    return;
+  }
+  buffers_.Push(max_size_);
+  charges_.emplace_back();
+}
+
+void FileOutputStream::PushFileBuffer(llvm::StringRef file) {
+  if (cache_ == &default_cache_) {
+    // Nothing is deduplicated, so there's no point in grouping.
+    PushBuffer();
+    return;
+  }
+  open_groups_.push_back(&file_groups_[file.str()]);
+}
 
 void FileOutputStream::PopBuffer() {
+  if (!open_groups_.empty()) {
+    open_groups_.pop_back();
+    if (open_groups_.empty()) {
+      // Every file's emission is complete.
+      for (auto &group : file_groups_) {
+        RetireFileGroup(&group.second);
+      }
+      file_groups_.clear();
+    }
+    return;
+  }
   if (buffers_.MergeDownIfTooSmall(min_size_, max_size_)) {
     ++stats_.buffers_merged_;
+    auto &merged = charges_.back();
+    auto &merge_into = charges_[charges_.size() - 2];
+    merge_into.insert(merge_into.end(), merged.begin(), merged.end());
+    charges_.pop_back();
   } else {
     EmitAndReleaseTopBuffer();
   }
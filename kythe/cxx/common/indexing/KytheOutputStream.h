@@ -18,21 +18,35 @@
 #define KYTHE_CXX_COMMON_INDEXING_KYTHE_OUTPUT_STREAM_H_
 
 #include <openssl/sha.h>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <list>
+#include <map>
 #include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
 #include <vector>
 
 #include "google/protobuf/io/coded_stream.h"
 #include "google/protobuf/io/zero_copy_stream_impl.h"
 
+#include "kythe/cxx/common/indexing/async_output_stream.h"
+#include "kythe/cxx/common/indexing/buffer_digest.h"
+#include "kythe/cxx/common/indexing/buffer_size_tuner.h"
 #include "kythe/proto/common.pb.h"
 #include "kythe/proto/storage.pb.h"
+#include "llvm/ADT/ArrayRef.h"
 #include "llvm/ADT/StringRef.h"
 
-extern "C" {
-struct memcached_st;
-}
+namespace leveldb {
+class DB;
+}  // namespace leveldb
 
 namespace kythe {
+
+class MemcachedPool;
 /// \brief Code marked with semantic spans.
 using MarkedSource = kythe::proto::common::MarkedSource;
 
@@ -63,6 +77,9 @@ struct FactRef {
   const VNameRef *source;
   llvm::StringRef fact_name;
   llvm::StringRef fact_value;
+  /// `fact_name` as encoded by `EntryEncoder::EncodeFactName`, or empty to
+  /// encode it when the fact is written.
+  llvm::StringRef encoded_fact_name;
   /// Overwrites all of the fields in `entry` that can differ between single
   /// facts.
   void Expand(proto::Entry *entry) const {
@@ -76,6 +93,9 @@ struct EdgeRef {
   const VNameRef *source;
   llvm::StringRef edge_kind;
   const VNameRef *target;
+  /// `edge_kind` as encoded by `EntryEncoder::EncodeEdgeKind`, or empty to
+  /// encode it when the edge is written.
+  llvm::StringRef encoded_edge_kind;
   /// Overwrites all of the fields in `entry` that can differ between edges
   /// without ordinals.
   void Expand(proto::Entry *entry) const {
@@ -104,6 +124,98 @@ struct OrdinalEdgeRef {
     target->Expand(entry->mutable_target());
   }
 };
+/// A collection of references to the components of one of a batch of edges
+/// that share a source (see `KytheOutputStream::EmitEdges`).
+struct FanOutEdgeRef {
+  llvm::StringRef edge_kind;
+  const VNameRef *target;
+  /// `edge_kind` as encoded by `EntryEncoder::EncodeEdgeKind`, or empty to
+  /// encode it when the edge is written. Unused for edges with ordinals.
+  llvm::StringRef encoded_edge_kind;
+  /// The edge's ordinal, or -1 if it has none.
+  int64_t ordinal;
+};
+
+/// \brief Encodes a single `Entry` in wire format directly from references to
+/// its components, without building an intermediate `proto::Entry`.
+///
+/// The encoding is byte-for-byte identical to serializing the `proto::Entry`
+/// that the ref's `Expand` method would produce (with a fact name of "/" for
+/// edges).
+class EntryEncoder {
+ public:
+  explicit EntryEncoder(const FactRef &fact);
+  explicit EntryEncoder(const EdgeRef &edge);
+  explicit EntryEncoder(const OrdinalEdgeRef &edge);
+  /// \brief Encodes an edge from `source`, which has already been encoded
+  /// (by `EncodeSource`) as `encoded_source`.
+  EntryEncoder(const VNameRef &source, llvm::StringRef encoded_source,
+               const FanOutEdgeRef &edge);
+  EntryEncoder(const EntryEncoder &) = delete;
+  EntryEncoder &operator=(const EntryEncoder &) = delete;
+
+  /// \return the size of the encoded entry (without a length prefix).
+  size_t size() const { return size_; }
+
+  /// \return `fact_name` encoded as an entry's fact name field, including its
+  /// tag and length, for use as a `FactRef::encoded_fact_name`.
+  static std::string EncodeFactName(llvm::StringRef fact_name);
+
+  /// \return `edge_kind` encoded as an entry's edge kind field, including its
+  /// tag and length, for use as an `EdgeRef::encoded_edge_kind`.
+  static std::string EncodeEdgeKind(llvm::StringRef edge_kind);
+
+  /// \return `source` encoded as an entry's source field, including its tag
+  /// and length, for use with the `FanOutEdgeRef` constructor.
+  static std::string EncodeSource(const VNameRef &source);
+
+  /// \brief Writes the encoded entry to `target`, which must have room for
+  /// `size()` bytes.
+  /// \return a pointer just past the last byte written.
+  unsigned char *Write(unsigned char *target) const;
+
+  /// \return the fact value, whose bytes end the encoded entry.
+  llvm::StringRef fact_value() const { return fact_value_; }
+
+  /// \return the size of the encoded entry up to the bytes of its fact value.
+  size_t prefix_size() const { return size_ - fact_value_.size(); }
+
+  /// \brief Writes the first `prefix_size()` bytes of the encoded entry, so
+  /// that the fact value can be written from where it lives.
+  /// \return a pointer just past the last byte written.
+  unsigned char *WritePrefix(unsigned char *target) const;
+
+ private:
+  /// \brief Computes the encoded sizes of the entry and its components.
+  void ComputeSizes();
+
+  /// The entry's source. Always encoded (even if empty).
+  const VNameRef *source_;
+  /// The encoded source field, or empty to encode `source_`.
+  llvm::StringRef encoded_source_;
+  /// The entry's edge kind (not including any ordinal suffix).
+  llvm::StringRef edge_kind_;
+  /// The entry's target, or null if the entry is a fact.
+  const VNameRef *target_ = nullptr;
+  /// The entry's fact name.
+  llvm::StringRef fact_name_;
+  /// The entry's fact value.
+  llvm::StringRef fact_value_;
+  /// The encoded edge kind field, or empty to encode `edge_kind_`.
+  llvm::StringRef encoded_edge_kind_;
+  /// The encoded fact name field, or empty to encode `fact_name_`.
+  llvm::StringRef encoded_fact_name_;
+  /// A suffix (".ordinal") to append to `edge_kind_`.
+  char ordinal_suffix_[12];
+  /// The length of `ordinal_suffix_`, or 0 for entries without ordinals.
+  size_t ordinal_suffix_length_ = 0;
+  /// The encoded size of `source_` (without a tag or length prefix).
+  size_t source_size_ = 0;
+  /// The encoded size of `target_` (without a tag or length prefix).
+  size_t target_size_ = 0;
+  /// The encoded size of the whole entry.
+  size_t size_ = 0;
+};
 
 /// \brief Keeps track of whether hashes have been seen before.
 class HashCache {
@@ -115,6 +227,39 @@ class HashCache {
   virtual void RegisterHash(const Hash &hash) {}
   /// \return true if `hash` has been seen before.
   virtual bool SawHash(const Hash &hash) { return false; }
+  /// \brief Checks a batch of hashes at once.
+  /// \param hashes The hashes to check.
+  /// \param seen Set to a vector where the ith element is true if the ith
+  /// hash in `hashes` has been seen before.
+  virtual void SawHashes(const std::vector<const Hash *> &hashes,
+                         std::vector<bool> *seen) {
+    seen->clear();
+    for (const auto *hash : hashes) {
+      seen->push_back(SawHash(*hash));
+    }
+  }
+  /// \brief Notes that all of `hashes` were seen. Implementations may do
+  /// this asynchronously.
+  virtual void RegisterHashes(const std::vector<const Hash *> &hashes) {
+    for (const auto *hash : hashes) {
+      RegisterHash(*hash);
+    }
+  }
+  /// \brief Counts how lookups were answered by caches with local layers.
+  struct Stats {
+    /// Lookups answered by a local table of confirmed hits.
+    size_t lru_hits = 0;
+    /// Lookups answered by a local filter of registered hashes.
+    size_t bloom_hits = 0;
+    /// Lookups answered (positively) by a remote cache.
+    size_t remote_hits = 0;
+    /// Lookups for hashes that hadn't been seen.
+    size_t misses = 0;
+    /// Lookups answered by a table of hashes claimed by concurrent workers.
+    size_t claimed_hits = 0;
+  };
+  /// \return lookup counters, if this cache keeps any.
+  virtual Stats stats() const { return Stats(); }
   /// \brief Sets guidelines about the amount of source data per hash.
   /// \param min_size no fewer than this many bytes should be hashed.
   /// \param max_size no more than this many bytes should be hashed.
@@ -124,26 +269,369 @@ class HashCache {
   }
   size_t min_size() const { return min_size_; }
   size_t max_size() const { return max_size_; }
+  /// \brief Places split points in long runs of entries by content rather
+  /// than by size, so that an edit only changes the hashes of the buffers
+  /// around it. Buffers are still split once they reach `max_size`.
+  /// \param average_size The expected number of bytes past `min_size` between
+  /// content-defined split points, or 0 to only split at `max_size`.
+  void set_average_chunk_size(size_t average_size) {
+    average_chunk_size_ = average_size;
+  }
+  size_t average_chunk_size() const { return average_chunk_size_; }
+  /// \brief Sets the number of hashes that should be checked at once.
+  ///
+  /// If this is greater than 1, clients may hold back data until they've
+  /// collected this many hashes, then pass them all to `SawHashes` and
+  /// `RegisterHashes`.
+  void set_batch_size(size_t batch_size) { batch_size_ = batch_size; }
+  size_t batch_size() const { return batch_size_; }
 
  private:
   size_t min_size_ = 0;
   size_t max_size_ = 32 * 1024;
+  size_t average_chunk_size_ = 0;
+  size_t batch_size_ = 1;
 };
 
-/// \brief A `HashCache` that uses a memcached server.
+/// \brief A `HashCache` that uses a pool of memcached servers.
+///
+/// While the pool is turning requests away, every hash is treated as a miss
+/// and registrations are dropped.
 class MemcachedHashCache : public HashCache {
  public:
+  MemcachedHashCache();
   ~MemcachedHashCache() override;
 
-  /// \brief Use a memcached instance (e.g. "--SERVER=foo:1234")
+  /// \brief Use a memcached instance (e.g. "--SERVER=foo:1234") with the
+  /// default pool options.
   bool OpenMemcache(const std::string &spec);
 
+  /// \brief Use `pool`, which should already be open.
+  void UsePool(std::unique_ptr<MemcachedPool> pool);
+
+  void RegisterHash(const Hash &hash) override;
+
+  bool SawHash(const Hash &hash) override;
+
+  /// \brief Checks all of `hashes` with a single multi-get.
+  void SawHashes(const std::vector<const Hash *> &hashes,
+                 std::vector<bool> *seen) override;
+
+  /// \brief Adds all of `hashes` without waiting for replies.
+  void RegisterHashes(const std::vector<const Hash *> &hashes) override;
+
+ private:
+  std::unique_ptr<MemcachedPool> pool_;
+};
+
+/// \brief A `HashCache` that persists hashes in a local LevelDB database.
+///
+/// Unlike `MemcachedHashCache`, hashes survive between runs without a server.
+/// LevelDB serializes access internally, so this cache is thread-safe.
+class LevelDBHashCache : public HashCache {
+ public:
+  ~LevelDBHashCache() override;
+
+  /// \brief Opens (or creates) the database at `path`.
+  /// \param error_text Set to a description of the problem on failure.
+  /// \return true on success.
+  bool Open(const std::string &path, std::string *error_text);
+
   void RegisterHash(const Hash &hash) override;
 
   bool SawHash(const Hash &hash) override;
 
+  /// \brief Adds all of `hashes` in a single write batch.
+  void RegisterHashes(const std::vector<const Hash *> &hashes) override;
+
  private:
-  ::memcached_st *cache_ = nullptr;
+  ::leveldb::DB *db_ = nullptr;
+};
+
+/// \brief A `HashCache` that answers lookups locally when it can before
+/// consulting another (usually remote) `HashCache`.
+///
+/// Hashes that the remote cache confirmed to be seen are kept in a bounded
+/// LRU table. Hashes that this cache registered are added to a Bloom filter.
+/// Bloom filter hits aren't confirmed with the remote cache, so a false
+/// positive will cause a buffer to be dropped as if it were a duplicate; size
+/// the filter accordingly. Not thread-safe.
+class LayeredHashCache : public HashCache {
+ public:
+  /// \param remote The cache to consult for local misses. Must outlive this
+  /// object.
+  /// \param lru_size The maximum number of confirmed hits to remember.
+  /// \param bloom_bits The size of the Bloom filter in bits, or 0 to disable
+  /// it.
+  LayeredHashCache(HashCache *remote, size_t lru_size, size_t bloom_bits);
+
+  void RegisterHash(const Hash &hash) override;
+
+  bool SawHash(const Hash &hash) override;
+
+  void SawHashes(const std::vector<const Hash *> &hashes,
+                 std::vector<bool> *seen) override;
+
+  void RegisterHashes(const std::vector<const Hash *> &hashes) override;
+
+  Stats stats() const override { return stats_; }
+
+ private:
+  using Key = std::array<unsigned char, kHashSize>;
+  struct KeyHash {
+    size_t operator()(const Key &key) const {
+      // The key is already a cryptographic hash.
+      size_t result;
+      ::memcpy(&result, key.data(), sizeof(result));
+      return result;
+    }
+  };
+  /// The number of bits probed in the Bloom filter for each hash.
+  static constexpr size_t kBloomProbes = kHashSize / sizeof(uint32_t);
+
+  /// \return true if `hash` was answered locally.
+  bool SawHashLocally(const Hash &hash);
+  /// \brief Remembers that the remote cache has seen `hash`.
+  void InsertConfirmed(const Hash &hash);
+  /// \brief Adds `hash` to the Bloom filter.
+  void InsertRegistered(const Hash &hash);
+
+  /// The cache to consult on local misses.
+  HashCache *remote_;
+  /// The maximum size of `lru_`.
+  size_t lru_size_;
+  /// Confirmed hits, most recently used first.
+  std::list<Key> lru_;
+  /// Maps from confirmed hits to their positions in `lru_`.
+  std::unordered_map<Key, std::list<Key>::iterator, KeyHash> lru_index_;
+  /// The Bloom filter of registered hashes.
+  std::vector<uint64_t> bloom_;
+  /// The number of bits in `bloom_`.
+  size_t bloom_bits_;
+  /// Lookup counters.
+  Stats stats_;
+};
+
+/// \brief A `HashCache` that serializes access to another `HashCache`.
+///
+/// This allows a single cache (which may wrap a connection that can't be
+/// shared between threads) to be used by concurrent indexer workers.
+class LockingHashCache : public HashCache {
+ public:
+  /// \param cache The cache to wrap. Must outlive this object.
+  explicit LockingHashCache(HashCache *cache) : cache_(cache) {
+    SetSizeLimits(cache->min_size(), cache->max_size());
+    set_average_chunk_size(cache->average_chunk_size());
+    set_batch_size(cache->batch_size());
+  }
+
+  void RegisterHash(const Hash &hash) override {
+    std::lock_guard<std::mutex> lock(mutex_);
+    cache_->RegisterHash(hash);
+  }
+
+  bool SawHash(const Hash &hash) override {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return cache_->SawHash(hash);
+  }
+
+  void SawHashes(const std::vector<const Hash *> &hashes,
+                 std::vector<bool> *seen) override {
+    std::lock_guard<std::mutex> lock(mutex_);
+    cache_->SawHashes(hashes, seen);
+  }
+
+  void RegisterHashes(const std::vector<const Hash *> &hashes) override {
+    std::lock_guard<std::mutex> lock(mutex_);
+    cache_->RegisterHashes(hashes);
+  }
+
+  Stats stats() const override {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return cache_->stats();
+  }
+
+ private:
+  /// The wrapped cache.
+  HashCache *cache_;
+  /// Guards access to `cache_`.
+  mutable std::mutex mutex_;
+};
+
+/// \brief A `HashCache` that lets concurrent indexer workers share another
+/// `HashCache` without taking a lock for every lookup.
+///
+/// The first lookup of a hash claims it in a fixed-size, lock-free
+/// open-addressing table, and only that lookup consults the wrapped cache
+/// (under a lock). Later lookups of a claimed hash are answered from the
+/// table, even if the worker that claimed it is still writing its buffer, so
+/// concurrent workers never both write the same buffer. Hashes are known in
+/// the table by their first 64 bits; as with `LayeredHashCache`'s Bloom
+/// filter, a collision will cause a buffer to be dropped as a duplicate. Once
+/// a hash's neighborhood of the table is full, lookups for it go straight to
+/// the wrapped cache.
+///
+/// Registrations made through a `Worker` are passed on to the wrapped cache
+/// in batches.
+class ConcurrentHashCache : public HashCache {
+ public:
+  /// \param cache The cache to wrap. Must outlive this object.
+  /// \param table_size The number of hashes that can be claimed. Rounded up
+  /// to a power of two.
+  /// \param registration_batch_size How many registrations each `Worker`
+  /// collects before passing them on.
+  ConcurrentHashCache(HashCache *cache, size_t table_size,
+                      size_t registration_batch_size);
+
+  /// \brief A single worker's view of a `ConcurrentHashCache`. Not
+  /// thread-safe.
+  class Worker : public HashCache {
+   public:
+    /// \param shared The cache to share. Must outlive this object.
+    explicit Worker(ConcurrentHashCache *shared);
+    ~Worker() override { Flush(); }
+
+    /// \brief Registers `hash` with the next batch.
+    void RegisterHash(const Hash &hash) override;
+
+    bool SawHash(const Hash &hash) override;
+
+    void SawHashes(const std::vector<const Hash *> &hashes,
+                   std::vector<bool> *seen) override;
+
+    /// \brief Registers `hashes` with the next batch.
+    void RegisterHashes(const std::vector<const Hash *> &hashes) override;
+
+    Stats stats() const override { return shared_->stats(); }
+
+    /// \brief Passes on the registrations collected so far.
+    void Flush();
+
+   private:
+    /// The cache this worker shares.
+    ConcurrentHashCache *shared_;
+    /// Registrations that haven't been passed on.
+    std::vector<std::array<unsigned char, kHashSize>> pending_;
+    /// Lookups answered by the table that haven't been counted in `shared_`.
+    size_t claimed_hits_ = 0;
+  };
+
+  void RegisterHash(const Hash &hash) override;
+
+  bool SawHash(const Hash &hash) override;
+
+  void SawHashes(const std::vector<const Hash *> &hashes,
+                 std::vector<bool> *seen) override;
+
+  void RegisterHashes(const std::vector<const Hash *> &hashes) override;
+
+  Stats stats() const override;
+
+ private:
+  /// The outcome of trying to claim a hash.
+  enum class Claim {
+    kClaimed,  ///< The hash is ours to look up in the wrapped cache.
+    kTaken,    ///< The hash was already claimed.
+    kFull      ///< There was no room to claim the hash.
+  };
+  /// The number of slots probed before the table is considered full.
+  static constexpr size_t kMaxProbes = 32;
+
+  /// \brief Tries to claim `hash` in the table.
+  Claim ClaimHash(const Hash &hash);
+  /// \brief Looks up `hash`, adding 1 to `claimed_hits` if the table
+  /// answered.
+  bool LookUpHash(const Hash &hash, size_t *claimed_hits);
+  /// \brief Looks up `hashes`, adding the number answered by the table to
+  /// `claimed_hits`.
+  void LookUpHashes(const std::vector<const Hash *> &hashes,
+                    std::vector<bool> *seen, size_t *claimed_hits);
+
+  /// The wrapped cache.
+  HashCache *cache_;
+  /// Guards access to `cache_`.
+  mutable std::mutex mutex_;
+  /// The claimed keys, or 0 for empty slots.
+  std::unique_ptr<std::atomic<uint64_t>[]> table_;
+  /// The number of slots in `table_` (a power of two).
+  size_t table_size_;
+  /// How many registrations each `Worker` collects before passing them on.
+  size_t registration_batch_size_;
+  /// Lookups answered by the table.
+  std::atomic<size_t> claimed_hits_{0};
+};
+
+/// \brief Counts entries and their serialized bytes by category.
+///
+/// Categories are dense indices chosen by whoever writes to the stream (see
+/// `KytheGraphRecorder::AccountingCategories`). Writers call `set_category`
+/// before each entry; streams charge the entry to that category with `Count`
+/// and, if they later drop it as a duplicate, with `Drop`. Not thread-safe.
+class EntryAccounting {
+ public:
+  /// \brief The counters for a single category.
+  struct Counters {
+    /// The number of entries written.
+    size_t entries = 0;
+    /// The size of those entries, including their length prefixes.
+    size_t bytes = 0;
+    /// The number of those entries dropped by a `HashCache`.
+    size_t dropped_entries = 0;
+    /// The size of the dropped entries.
+    size_t dropped_bytes = 0;
+    /// The number of exact duplicates of entries in this category that were
+    /// suppressed before they were written (and so aren't counted above).
+    size_t duplicate_entries = 0;
+  };
+
+  /// \param names The name of each category.
+  explicit EntryAccounting(std::vector<std::string> names)
+      : names_(std::move(names)), counters_(names_.size()) {}
+
+  /// \brief Charges subsequent entries to `category`.
+  void set_category(size_t category) {
+    assert(category < counters_.size());
+    category_ = category;
+  }
+  /// \return the category to charge the next entry to.
+  size_t category() const { return category_; }
+
+  /// \brief Notes that `entries` entries of `bytes` total bytes were written
+  /// to `category`.
+  void Count(size_t category, size_t entries, size_t bytes) {
+    counters_[category].entries += entries;
+    counters_[category].bytes += bytes;
+  }
+  /// \brief Notes that `entries` entries of `bytes` total bytes that were
+  /// counted in `category` were dropped.
+  void Drop(size_t category, size_t entries, size_t bytes) {
+    counters_[category].dropped_entries += entries;
+    counters_[category].dropped_bytes += bytes;
+  }
+
+  /// \brief Notes that an exact duplicate of an entry in `category` was
+  /// suppressed.
+  void CountDuplicate(size_t category) {
+    ++counters_[category].duplicate_entries;
+  }
+
+  /// \brief Adds `other`'s counters to these. `other` must have the same
+  /// categories.
+  void Merge(const EntryAccounting &other);
+
+  const std::vector<std::string> &names() const { return names_; }
+  const std::vector<Counters> &counters() const { return counters_; }
+
+  /// \return the nonzero counters as a JSON object keyed by category name.
+  std::string ToJson() const;
+
+ private:
+  /// The name of each category.
+  std::vector<std::string> names_;
+  /// The counters for each category.
+  std::vector<Counters> counters_;
+  /// The category to charge the next entry to.
+  size_t category_ = 0;
 };
 
 // Interface for receiving Kythe data.
@@ -152,14 +640,56 @@ class KytheOutputStream {
   virtual void Emit(const FactRef &fact) = 0;
   virtual void Emit(const EdgeRef &edge) = 0;
   virtual void Emit(const OrdinalEdgeRef &edge) = 0;
+  /// \brief Emits a fact whose value is bulk content, like a file's text.
+  /// Such facts needn't be grouped with the entries in the current buffer or
+  /// hashed with them, since their content is identified by the node they
+  /// describe. Streams may write them straight from `fact`'s value.
+  virtual void EmitContent(const FactRef &fact) { Emit(fact); }
+  /// \brief Emits edges that all start at `source`. Streams may encode the
+  /// source once for the whole batch. Every edge is charged to the current
+  /// `EntryAccounting` category.
+  virtual void EmitEdges(const VNameRef &source,
+                         llvm::ArrayRef<FanOutEdgeRef> edges) {
+    for (const auto &edge : edges) {
+      if (edge.ordinal < 0) {
+        Emit(EdgeRef{&source, edge.edge_kind, edge.target,
+                     edge.encoded_edge_kind});
+      } else {
+        Emit(OrdinalEdgeRef{&source, edge.edge_kind, edge.target,
+                            static_cast<uint32_t>(edge.ordinal)});
+      }
+    }
+  }
   /// Add a buffer to the buffer stack to group facts, edges, and buffers
   /// together.
   virtual void PushBuffer() {}
+  /// \brief Like `PushBuffer`, but names the file (the claimed file's
+  /// vname, in some form unique to it) that the buffer's entries belong to.
+  /// Streams that group output by file gather the entries of every buffer
+  /// pushed for the same file together, however those buffers nest, so that
+  /// each hashed group holds a single file's entries. Other streams treat
+  /// this like `PushBuffer`. Popped with `PopBuffer`.
+  virtual void PushFileBuffer(llvm::StringRef file) { PushBuffer(); }
   /// Pop the last buffer from the buffer stack.
   virtual void PopBuffer() {}
   /// \brief Use a given `HashCache` to deduplicate buffers.
   virtual void UseHashCache(HashCache *cache) {}
+  /// \brief Charges subsequent entries to `accounting`, which must outlive
+  /// its use by this stream.
+  /// \param accounting The counters to update, or null to stop counting.
+  virtual void set_accounting(EntryAccounting *accounting) {
+    accounting_ = accounting;
+  }
+  /// \return the counters entries are charged to (or null).
+  EntryAccounting *accounting() const { return accounting_; }
+  /// \return an estimate of the bytes the stream has allocated to hold
+  /// entries it hasn't written yet.
+  virtual size_t buffered_bytes() const { return 0; }
   virtual ~KytheOutputStream() {}
+
+ protected:
+  /// The counters entries are charged to (or null).
+  EntryAccounting *accounting_ = nullptr;
 };
 
 /// \brief An output stream that drops its output.
@@ -177,6 +707,10 @@ class BufferStack {
   /// in `hash`.
   void HashTop(HashCache::Hash *hash) const {
     assert(buffers_ != nullptr);
+    if (digest_ == BufferDigest::kMurmur3) {
+      HashTopFast(hash);
+      return;
+    }
     ::SHA256_CTX sha;
     ::SHA256_Init(&sha);
     for (Buffer *joined = buffers_; joined; joined = joined->joined) {
@@ -184,6 +718,10 @@ class BufferStack {
     }
     ::SHA256_Final(reinterpret_cast<unsigned char *>(hash), &sha);
   }
+  /// \brief Selects the digest `HashTop` uses. Hashes made with different
+  /// digests never match, so a cache only deduplicates buffers hashed with
+  /// the digest that registered them.
+  void set_digest(BufferDigest digest) { digest_ = digest; }
   /// \brief Copies the buffer at the top of the stack to some `stream`.
   void CopyTopToStream(
       google::protobuf::io::ZeroCopyOutputStream *stream) const {
@@ -207,6 +745,17 @@ class BufferStack {
       }
     }
   }
+  /// \brief Appends the slabs that make up the buffer at the top of the
+  /// stack to `slabs`, in the order `CopyTopToStream` would write them.
+  void AppendTopSlabs(std::vector<llvm::StringRef> *slabs) const {
+    for (Buffer *joined = buffers_; joined; joined = joined->joined) {
+      if (!joined->slab.empty()) {
+        slabs->emplace_back(
+            reinterpret_cast<const char *>(joined->slab.data()),
+            joined->slab.size());
+      }
+    }
+  }
   /// \brief Allocates space for writing data to the buffer on the top of
   /// the stack.
   /// \return A pointer to `bytes` bytes of storage.
@@ -283,6 +832,20 @@ class BufferStack {
     return true;
   }
   bool empty() const { return buffers_ == nullptr; }
+  /// \brief Returns the bytes allocated for the buffers on the stack and on
+  /// the freelist.
+  size_t allocated_bytes() const {
+    size_t bytes = 0;
+    for (Buffer *open = buffers_; open; open = open->previous) {
+      for (Buffer *joined = open; joined; joined = joined->joined) {
+        bytes += sizeof(Buffer) + joined->slab.capacity();
+      }
+    }
+    for (Buffer *free = free_buffers_; free; free = free->previous) {
+      bytes += sizeof(Buffer) + free->slab.capacity();
+    }
+    return bytes;
+  }
   ~BufferStack() {
     while (!empty()) {
       Pop();
@@ -309,6 +872,26 @@ class BufferStack {
   Buffer *buffers_ = nullptr;
   /// Inactive buffers ready for allocation.
   Buffer *free_buffers_ = nullptr;
+  /// The digest `HashTop` uses.
+  BufferDigest digest_ = BufferDigest::kSha256;
+
+  /// \brief Hashes the top buffer with `Murmur3Hasher`. The 128-bit digest
+  /// fills the first half of `hash`. The second half is the digest of the
+  /// first half, so every word of `hash` is well-mixed (the Bloom filter in
+  /// `LayeredHashCache` probes with each of them).
+  void HashTopFast(HashCache::Hash *hash) const {
+    static_assert(HashCache::kHashSize == 2 * Murmur3Hasher::kDigestSize,
+                  "Murmur3 digests must fill half of a hash.");
+    auto *bytes = reinterpret_cast<unsigned char *>(hash);
+    Murmur3Hasher hasher;
+    for (Buffer *joined = buffers_; joined; joined = joined->joined) {
+      hasher.Update(joined->slab.data(), joined->slab.size());
+    }
+    hasher.Final(bytes);
+    Murmur3Hasher widener(Murmur3Hasher::kDigestSize);
+    widener.Update(bytes, Murmur3Hasher::kDigestSize);
+    widener.Final(bytes + Murmur3Hasher::kDigestSize);
+  }
 };
 
 // A `KytheOutputStream` that records `Entry` instances to a
@@ -316,71 +899,258 @@ class BufferStack {
 class FileOutputStream : public KytheOutputStream {
  public:
   explicit FileOutputStream(google::protobuf::io::FileOutputStream *stream)
-      : stream_(stream) {
-    edge_entry_.set_fact_name("/");
-    UseHashCache(&default_cache_);
-  }
+      : FileOutputStream(stream, stream) {}
+
+  /// \brief Records entries to a stream that can't be flushed (for example,
+  /// an in-memory `StringOutputStream`).
+  explicit FileOutputStream(google::protobuf::io::ZeroCopyOutputStream *stream)
+      : FileOutputStream(stream, nullptr) {}
 
   /// \brief Dump stats to standard out on destruction?
   void set_show_stats(bool value) { show_stats_ = value; }
   void set_flush_after_each_entry(bool value) {
     flush_after_each_entry_ = value;
   }
-  void Emit(const FactRef &fact) override {
-    fact.Expand(&fact_entry_);
-    EnqueueEntry(fact_entry_);
+  /// \brief Selects the digest used to hash buffers for deduplication.
+  void set_buffer_digest(BufferDigest digest) { buffers_.set_digest(digest); }
+  /// \brief Writes large (or, when flushing after each entry, all) runs of
+  /// retired buffers straight to `fd` with `writev` instead of copying them
+  /// through the stream. The stream is flushed first, so the order of the
+  /// output is unchanged.
+  /// \param fd The descriptor the stream given to the constructor writes
+  /// to, or -1 to always copy. Only valid for a stream that can be flushed.
+  void set_direct_fd(int fd) {
+    assert(fd < 0 || flushable_stream_ != nullptr);
+    assert(fd < 0 || writer_ == nullptr);
+    direct_fd_ = fd;
   }
-  void Emit(const EdgeRef &edge) override {
-    edge.Expand(&edge_entry_);
-    EnqueueEntry(edge_entry_);
+  /// \brief Copies output to the underlying stream on a writer thread, so
+  /// that the work that stream does (like compression and `write(2)` calls)
+  /// doesn't hold up the caller. When flushing after each entry, entries are
+  /// handed to the writer right away and the underlying stream is flushed as
+  /// soon as the writer has copied them; everything is written and flushed
+  /// by the time this stream is destroyed. The underlying stream must not be
+  /// used by anyone else until then.
+  /// \pre Nothing has been written to this stream and direct writes are off.
+  void StartWriterThread() {
+    assert(writer_ == nullptr && direct_fd_ < 0);
+    writer_ = std::unique_ptr<AsyncOutputStream>(
+        new AsyncOutputStream(stream_, flushable_stream_));
+    stream_ = writer_.get();
   }
+  void Emit(const FactRef &fact) override { EnqueueEntry(EntryEncoder(fact)); }
+  void Emit(const EdgeRef &edge) override { EnqueueEntry(EntryEncoder(edge)); }
   void Emit(const OrdinalEdgeRef &edge) override {
-    edge.Expand(&edge_entry_);
-    EnqueueEntry(edge_entry_);
+    EnqueueEntry(EntryEncoder(edge));
   }
+  /// \brief Encodes `source` once and writes the edges together, checking
+  /// whether to flush or split the current buffer only after the last one.
+  void EmitEdges(const VNameRef &source,
+                 llvm::ArrayRef<FanOutEdgeRef> edges) override;
+  /// \brief Writes large values outside any open buffer, gathering them with
+  /// the rest of their entry in a single `writev` if direct writes are on.
+  void EmitContent(const FactRef &fact) override;
   void UseHashCache(HashCache *cache) override {
+    // Pending buffers were retired under the old cache.
+    EmitPendingBuffers();
     cache_ = cache;
     min_size_ = cache_->min_size();
     max_size_ = cache_->max_size();
+    average_chunk_size_ = cache_->average_chunk_size();
+    if (tuner_ != nullptr) {
+      tuner_->GetLimits(&min_size_, &max_size_);
+    }
+  }
+  /// \brief Takes buffer size limits from `tuner` (which must outlive this
+  /// stream) instead of from the hash cache, and reports to it how well
+  /// buffers deduplicate.
+  void set_size_tuner(BufferSizeTuner *tuner) {
+    ReportToTuner();
+    tuner_ = tuner;
+    if (tuner_ != nullptr) {
+      tuner_->GetLimits(&min_size_, &max_size_);
+    }
   }
   ~FileOutputStream() override;
   void PushBuffer() override;
+  /// \brief Sends the entries in this buffer (and in any buffers pushed
+  /// while it's open) to a group for `file` rather than to the buffer stack.
+  /// A file's group is retired like any buffer once it reaches the maximum
+  /// buffer size, and whatever is left of every group is retired when the
+  /// outermost file buffer is popped. Does nothing special without a hash
+  /// cache to deduplicate against.
+  void PushFileBuffer(llvm::StringRef file) override;
   void PopBuffer() override;
+  /// \brief Also settles any buffers waiting on a batched hash check, so that
+  /// their entries are charged to the old counters.
+  void set_accounting(EntryAccounting *accounting) override {
+    EmitPendingBuffers();
+    accounting_ = accounting;
+  }
+  /// \brief Counts the buffer stack (including its freelist) and the
+  /// buffers waiting on a batched hash check.
+  size_t buffered_bytes() const override;
+
+  /// \brief Copies a sequence of already-serialized, varint-delimited
+  /// entries (such as the output of another `FileOutputStream`) to the
+  /// underlying stream.
+  /// \pre No buffers are open on this stream.
+  void WriteDelimitedEntries(llvm::StringRef entries);
+
+  /// \brief Writes everything emitted so far to the underlying stream and
+  /// flushes it (if it can be flushed), waiting for the writer thread if
+  /// there is one.
+  /// \pre No buffers are open on this stream.
+  /// \return false if the underlying stream couldn't be written.
+  bool Sync();
 
   /// \brief Statistics about delimited deduplication.
   struct Stats {
     /// How many buffers we've emitted.
     size_t buffers_retired_ = 0;
-    /// How many buffers we've split.
+    /// How many buffers we've split because they reached the maximum size.
     size_t buffers_split_ = 0;
+    /// How many buffers we've split at content-defined points.
+    size_t content_splits_ = 0;
     /// How many buffers we've merged together.
     size_t buffers_merged_ = 0;
     /// How many buffers we didn't emit because their hashes matched.
     size_t hashes_matched_ = 0;
+    /// How many bytes were in the buffers whose hashes matched.
+    size_t bytes_matched_ = 0;
     /// How many bytes in total we've seen (whether or not they were emitted).
     size_t total_bytes_ = 0;
+    /// How many batches of hashes we've checked at once.
+    size_t hash_batches_ = 0;
+    /// How many hash cache round trips we avoided by batching (assuming one
+    /// round trip each to check and to register a batch).
+    size_t round_trips_saved_ = 0;
+    /// How long we've spent waiting for batched hash checks, in microseconds.
+    size_t stall_usec_ = 0;
+    /// How many `writev` calls we've made for direct writes.
+    size_t direct_writes_ = 0;
+    /// How many bytes we've written directly.
+    size_t direct_bytes_ = 0;
+    /// How many content facts we've written outside of buffers.
+    size_t content_facts_ = 0;
+    /// How many bytes of content facts we've written outside of buffers.
+    size_t content_bytes_ = 0;
+    /// How many times we've waited for the writer thread to catch up.
+    size_t writer_stalls_ = 0;
+    /// A snapshot of the hash cache's own lookup counters.
+    HashCache::Stats cache_stats_;
     /// \brief Return a summary of these statistics as a string.
     std::string ToString() const;
   } stats_;
 
  private:
+  FileOutputStream(google::protobuf::io::ZeroCopyOutputStream *stream,
+                   google::protobuf::io::FileOutputStream *flushable_stream)
+      : stream_(stream), flushable_stream_(flushable_stream) {
+    UseHashCache(&default_cache_);
+  }
+
   /// The output stream to write on.
-  google::protobuf::io::FileOutputStream *stream_;
-  /// A prototypical Kythe fact, used only to build other Kythe facts.
-  proto::Entry fact_entry_;
-  /// A prototypical Kythe edge, used only to build same.
-  proto::Entry edge_entry_;
+  google::protobuf::io::ZeroCopyOutputStream *stream_;
+  /// `stream_`, if it supports flushing; otherwise null.
+  google::protobuf::io::FileOutputStream *flushable_stream_;
   /// Buffers we're holding back for deduplication.
   BufferStack buffers_;
 
+  /// A run of consecutive entries in a buffer charged to the same category.
+  struct Charge {
+    /// The `EntryAccounting` category.
+    size_t category;
+    /// The number of entries in the run.
+    size_t entries;
+    /// The size of the run in bytes.
+    size_t bytes;
+  };
+  /// The charges for each buffer in `buffers_`, bottom first. Charges are only
+  /// recorded while `accounting_` is set.
+  std::vector<std::vector<Charge>> charges_;
+  /// \brief Charges the entries in `charges` as dropped.
+  void DropCharges(const std::vector<Charge> &charges);
+  /// \brief Appends a charge of one `bytes`-byte entry in the current
+  /// category to `charges`.
+  void AddCharge(size_t bytes, std::vector<Charge> *charges);
+
+  /// The entries gathered for a file by `PushFileBuffer`.
+  struct FileGroup {
+    /// The group's delimited entries.
+    std::string data;
+    /// The group's charges.
+    std::vector<Charge> charges;
+  };
+  /// Groups by file. Ordered so that groups are retired in the same order
+  /// from run to run.
+  std::map<std::string, FileGroup> file_groups_;
+  /// The group for each open file buffer (and for each buffer pushed while
+  /// one is open), innermost last.
+  std::vector<FileGroup *> open_groups_;
+  /// \brief Adds an entry to the innermost open group.
+  void EnqueueGroupedEntry(const EntryEncoder &entry);
+  /// \brief Retires the entries in `group` as a single buffer.
+  void RetireFileGroup(FileGroup *group);
+
+  /// A retired buffer waiting on a batched hash check.
+  struct PendingBuffer {
+    /// The hash of `data`.
+    HashCache::Hash hash;
+    /// The buffer's delimited entries.
+    std::string data;
+    /// The buffer's charges.
+    std::vector<Charge> charges;
+  };
+  /// Retired buffers waiting on a batched hash check, in retirement order.
+  std::vector<PendingBuffer> pending_buffers_;
+
   /// Emits all data from the top buffer (if the hash cache says it's relevant).
+  /// If the hash cache prefers batches, the buffer's data may instead be held
+  /// in `pending_buffers_` until a full batch is ready.
   void EmitAndReleaseTopBuffer();
+  /// Checks all pending buffers against the hash cache at once and emits the
+  /// relevant ones in order.
+  void EmitPendingBuffers();
   /// Emits an entry or adds it to a buffer (if the stack is nonempty).
-  void EnqueueEntry(const proto::Entry &entry);
+  void EnqueueEntry(const EntryEncoder &entry);
+  /// \brief Writes `pieces` to the output in order. Large runs (or any run,
+  /// when flushing after each entry) go straight to `direct_fd_` if it's set;
+  /// everything else is copied through `stream_`.
+  void WritePieces(const std::vector<llvm::StringRef> &pieces);
+  /// \brief Writes `pieces` to `direct_fd_`.
+  /// \return false if the write failed; then `direct_fd_` is cleared and
+  /// the pieces that weren't written are left in `pieces` starting at
+  /// a partial first piece.
+  bool WriteDirect(std::vector<llvm::StringRef> *pieces);
+  /// The descriptor for direct writes, or -1.
+  int direct_fd_ = -1;
+  /// Scratch space for the pieces of a write.
+  std::vector<llvm::StringRef> pieces_;
+  /// If non-null, copies output to the stream given to the constructor on
+  /// a writer thread; then `stream_` points here.
+  std::unique_ptr<AsyncOutputStream> writer_;
+  /// Flushes `stream_` if flushing after each entry is enabled and possible.
+  void MaybeFlush() {
+    if (!flush_after_each_entry_) {
+      return;
+    }
+    if (writer_ != nullptr) {
+      writer_->Flush();
+    } else if (flushable_stream_ != nullptr) {
+      flushable_stream_->Flush();
+    }
+  }
   /// The minimum size a buffer must be to get emitted.
   size_t min_size_ = 0;
   /// The maximum size a buffer can reach before it's split.
   size_t max_size_ = 32 * 1024;
+  /// If nonzero, the expected distance past `min_size_` between
+  /// content-defined split points.
+  size_t average_chunk_size_ = 0;
+  /// \return true if the buffer at the top of the stack should be split
+  /// after the `size`-byte entry just written to it at `entry`.
+  bool IsChunkBoundary(const unsigned char *entry, size_t size) const;
   /// Whether we should flush the output stream after each entry
   /// (when the buffer stack is empty).
   bool flush_after_each_entry_;
@@ -390,6 +1160,27 @@ class FileOutputStream : public KytheOutputStream {
   HashCache default_cache_;
   /// Whether we should dump stats to standard out on destruction.
   bool show_stats_ = false;
+
+  /// If non-null, sets `min_size_` and `max_size_`.
+  BufferSizeTuner *tuner_ = nullptr;
+  /// The time spent waiting for `cache_`, measured while `tuner_` is set.
+  uint64_t lookup_usec_ = 0;
+  /// What had already been reported to `tuner_`, and when.
+  BufferSizeTuner::Sample reported_;
+  std::chrono::steady_clock::time_point reported_at_ =
+      std::chrono::steady_clock::now();
+  /// \brief Reports to `tuner_` once enough has happened since the last
+  /// report, then picks up its limits.
+  void MaybeReportToTuner() {
+    if (tuner_ != nullptr &&
+        stats_.total_bytes_ - reported_.bytes >= kTunerReportBytes) {
+      ReportToTuner();
+    }
+  }
+  /// \brief Reports everything since the last report to `tuner_`, if set.
+  void ReportToTuner();
+  /// How many bytes to buffer between reports to `tuner_`.
+  static constexpr size_t kTunerReportBytes = 256 * 1024;
 };
 
 }  // namespace kythe
@@ -0,0 +1,801 @@
+/*
+ * Copyright 2017 Google Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "KytheOutputStream.h"
+
+#include <sys/stat.h>
+
+#include <atomic>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "glog/logging.h"
+#include "google/protobuf/io/coded_stream.h"
+#include "google/protobuf/io/zero_copy_stream_impl_lite.h"
+#include "gtest/gtest.h"
+#include "leveldb/db.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/MemoryBuffer.h"
+
+namespace kythe {
+namespace {
+
+/// \brief A `HashCache` that keeps every hash in memory and counts lookups.
+class CountingHashCache : public HashCache {
+ public:
+  void RegisterHash(const Hash &hash) override { hashes_.insert(Key(hash)); }
+  bool SawHash(const Hash &hash) override {
+    ++lookups_;
+    return hashes_.count(Key(hash)) != 0;
+  }
+  size_t lookups() const { return lookups_; }
+
+ private:
+  static std::string Key(const Hash &hash) {
+    return std::string(reinterpret_cast<const char *>(hash), kHashSize);
+  }
+  std::set<std::string> hashes_;
+  size_t lookups_ = 0;
+};
+
+/// \brief Fills `hash` with the SHA256 digest of `text`.
+void MakeHash(const std::string &text, HashCache::Hash *hash) {
+  ::SHA256(reinterpret_cast<const unsigned char *>(text.data()), text.size(),
+           *hash);
+}
+
+TEST(LayeredHashCache, MissesGoRemote) {
+  CountingHashCache remote;
+  LayeredHashCache cache(&remote, 16, 0);
+  HashCache::Hash hash;
+  MakeHash("a", &hash);
+  EXPECT_FALSE(cache.SawHash(hash));
+  EXPECT_EQ(1, remote.lookups());
+  EXPECT_EQ(1, cache.stats().misses);
+}
+
+TEST(LayeredHashCache, ConfirmedHitsAreRemembered) {
+  CountingHashCache remote;
+  LayeredHashCache cache(&remote, 16, 0);
+  HashCache::Hash hash;
+  MakeHash("a", &hash);
+  remote.RegisterHash(hash);
+  EXPECT_TRUE(cache.SawHash(hash));
+  EXPECT_TRUE(cache.SawHash(hash));
+  EXPECT_EQ(1, remote.lookups());
+  EXPECT_EQ(1, cache.stats().remote_hits);
+  EXPECT_EQ(1, cache.stats().lru_hits);
+}
+
+TEST(LayeredHashCache, LruEvictsOldestHit) {
+  CountingHashCache remote;
+  LayeredHashCache cache(&remote, 1, 0);
+  HashCache::Hash first, second;
+  MakeHash("a", &first);
+  MakeHash("b", &second);
+  remote.RegisterHash(first);
+  remote.RegisterHash(second);
+  EXPECT_TRUE(cache.SawHash(first));
+  EXPECT_TRUE(cache.SawHash(second));
+  EXPECT_TRUE(cache.SawHash(first));
+  EXPECT_EQ(3, remote.lookups());
+}
+
+TEST(LayeredHashCache, RegisteredHashesHitBloomFilter) {
+  CountingHashCache remote;
+  LayeredHashCache cache(&remote, 0, 1 << 16);
+  HashCache::Hash registered, other;
+  MakeHash("a", &registered);
+  MakeHash("b", &other);
+  cache.RegisterHash(registered);
+  EXPECT_TRUE(cache.SawHash(registered));
+  EXPECT_EQ(0, remote.lookups());
+  EXPECT_EQ(1, cache.stats().bloom_hits);
+  EXPECT_FALSE(cache.SawHash(other));
+  EXPECT_EQ(1, remote.lookups());
+}
+
+TEST(LayeredHashCache, BatchedLookupsOnlySendMisses) {
+  CountingHashCache remote;
+  LayeredHashCache cache(&remote, 16, 1 << 16);
+  HashCache::Hash local, remote_only, missing;
+  MakeHash("a", &local);
+  MakeHash("b", &remote_only);
+  MakeHash("c", &missing);
+  cache.RegisterHashes({&local});
+  remote.RegisterHash(remote_only);
+  std::vector<bool> seen;
+  cache.SawHashes({&local, &remote_only, &missing}, &seen);
+  EXPECT_EQ(std::vector<bool>({true, true, false}), seen);
+  EXPECT_EQ(2, remote.lookups());
+}
+
+TEST(ConcurrentHashCache, ClaimedHashesAreAnsweredLocally) {
+  CountingHashCache remote;
+  ConcurrentHashCache cache(&remote, 16, 1);
+  HashCache::Hash hash;
+  MakeHash("a", &hash);
+  EXPECT_FALSE(cache.SawHash(hash));
+  EXPECT_TRUE(cache.SawHash(hash));
+  EXPECT_EQ(1, remote.lookups());
+  EXPECT_EQ(1, cache.stats().claimed_hits);
+}
+
+TEST(ConcurrentHashCache, FullTableFallsBackToCache) {
+  CountingHashCache remote;
+  ConcurrentHashCache cache(&remote, 1, 1);
+  HashCache::Hash first, second;
+  MakeHash("a", &first);
+  MakeHash("b", &second);
+  EXPECT_FALSE(cache.SawHash(first));
+  EXPECT_FALSE(cache.SawHash(second));
+  cache.RegisterHash(second);
+  EXPECT_TRUE(cache.SawHash(second));
+  EXPECT_EQ(3, remote.lookups());
+}
+
+TEST(ConcurrentHashCache, WorkersRegisterInBatches) {
+  CountingHashCache remote;
+  ConcurrentHashCache cache(&remote, 16, 2);
+  HashCache::Hash first, second, third;
+  MakeHash("a", &first);
+  MakeHash("b", &second);
+  MakeHash("c", &third);
+  {
+    ConcurrentHashCache::Worker worker(&cache);
+    worker.RegisterHash(first);
+    EXPECT_FALSE(remote.SawHash(first));
+    worker.RegisterHashes({&second, &third});
+    EXPECT_TRUE(remote.SawHash(first));
+    EXPECT_TRUE(remote.SawHash(second));
+    EXPECT_FALSE(remote.SawHash(third));
+  }
+  EXPECT_TRUE(remote.SawHash(third));
+}
+
+TEST(ConcurrentHashCache, EachHashIsClaimedOnce) {
+  CountingHashCache remote;
+  ConcurrentHashCache cache(&remote, 1024, 8);
+  constexpr size_t kHashes = 256;
+  std::vector<HashCache::Hash> hashes(kHashes);
+  for (size_t i = 0; i < kHashes; ++i) {
+    MakeHash(std::to_string(i), &hashes[i]);
+  }
+  std::vector<std::atomic<int>> misses(kHashes);
+  for (auto &count : misses) {
+    count = 0;
+  }
+  std::vector<std::thread> threads;
+  for (size_t thread = 0; thread < 4; ++thread) {
+    threads.emplace_back([&, thread] {
+      ConcurrentHashCache::Worker worker(&cache);
+      for (size_t n = 0; n < kHashes; ++n) {
+        // Start each thread at a different hash.
+        size_t i = (n + thread * kHashes / 4) % kHashes;
+        if (!worker.SawHash(hashes[i])) {
+          ++misses[i];
+          worker.RegisterHash(hashes[i]);
+        }
+      }
+    });
+  }
+  for (auto &thread : threads) {
+    thread.join();
+  }
+  for (const auto &count : misses) {
+    EXPECT_EQ(1, count);
+  }
+  EXPECT_EQ(kHashes, remote.lookups());
+  EXPECT_EQ(3 * kHashes, cache.stats().claimed_hits);
+}
+
+/// \brief Serializes `entry` with its length prefix, as `FileOutputStream`
+/// is expected to.
+std::string DelimitedEntry(const proto::Entry &entry) {
+  std::string out;
+  {
+    google::protobuf::io::StringOutputStream stream(&out);
+    google::protobuf::io::CodedOutputStream coded_stream(&stream);
+    coded_stream.WriteVarint32(entry.ByteSize());
+    entry.SerializeToCodedStream(&coded_stream);
+  }
+  return out;
+}
+
+/// \brief Emits the refs given to `emit` to a `FileOutputStream` and returns
+/// its output.
+template <typename F>
+std::string EmitToString(F emit) {
+  std::string out;
+  {
+    google::protobuf::io::StringOutputStream stream(&out);
+    FileOutputStream output(&stream);
+    output.set_flush_after_each_entry(false);
+    emit(&output);
+  }
+  return out;
+}
+
+/// \brief Manages a temporary directory for a `LevelDBHashCache`.
+class TemporaryDatabase {
+ public:
+  TemporaryDatabase() {
+    CHECK(!llvm::sys::fs::createUniqueDirectory("hash_cache", root_));
+    path_ = root_.str().str() + "/db";
+  }
+  ~TemporaryDatabase() {
+    ::leveldb::DestroyDB(path_, ::leveldb::Options());
+    llvm::sys::fs::remove(llvm::Twine(root_));
+  }
+  const std::string &path() const { return path_; }
+
+ private:
+  llvm::SmallString<256> root_;
+  std::string path_;
+};
+
+TEST(LevelDBHashCache, HashesPersistAcrossOpens) {
+  TemporaryDatabase db;
+  HashCache::Hash a, b, c;
+  MakeHash("a", &a);
+  MakeHash("b", &b);
+  MakeHash("c", &c);
+  std::string error_text;
+  {
+    LevelDBHashCache cache;
+    ASSERT_TRUE(cache.Open(db.path(), &error_text)) << error_text;
+    EXPECT_FALSE(cache.SawHash(a));
+    cache.RegisterHash(a);
+    cache.RegisterHashes({&b});
+    EXPECT_TRUE(cache.SawHash(a));
+  }
+  LevelDBHashCache cache;
+  ASSERT_TRUE(cache.Open(db.path(), &error_text)) << error_text;
+  EXPECT_TRUE(cache.SawHash(a));
+  EXPECT_TRUE(cache.SawHash(b));
+  EXPECT_FALSE(cache.SawHash(c));
+}
+
+TEST(EntryEncoder, FactMatchesProto) {
+  VNameRef source;
+  source.signature = "sig";
+  source.path = "a/b.cc";
+  source.language = "c++";
+  FactRef fact{&source, "/kythe/node/kind", "record"};
+  proto::Entry entry;
+  fact.Expand(&entry);
+  EXPECT_EQ(DelimitedEntry(entry), EmitToString([&](FileOutputStream *out) {
+              out->Emit(fact);
+            }));
+}
+
+TEST(EntryEncoder, EmptyFieldsMatchProto) {
+  VNameRef source;
+  FactRef fact{&source, "", ""};
+  proto::Entry entry;
+  fact.Expand(&entry);
+  EXPECT_EQ(DelimitedEntry(entry), EmitToString([&](FileOutputStream *out) {
+              out->Emit(fact);
+            }));
+}
+
+TEST(EntryEncoder, EdgesMatchProto) {
+  VNameRef source;
+  source.signature = "from";
+  source.corpus = "corpus";
+  VNameRef target;
+  target.signature = "to";
+  target.root = "root";
+  EdgeRef edge{&source, "/kythe/edge/childof", &target};
+  OrdinalEdgeRef ordinal{&source, "/kythe/edge/param", &target, 12345};
+  proto::Entry edge_entry, ordinal_entry;
+  edge_entry.set_fact_name("/");
+  ordinal_entry.set_fact_name("/");
+  edge.Expand(&edge_entry);
+  ordinal.Expand(&ordinal_entry);
+  EXPECT_EQ(DelimitedEntry(edge_entry) + DelimitedEntry(ordinal_entry),
+            EmitToString([&](FileOutputStream *out) {
+              out->Emit(edge);
+              out->Emit(ordinal);
+            }));
+}
+
+TEST(EntryEncoder, PreEncodedNamesMatchProto) {
+  VNameRef source;
+  source.signature = "from";
+  VNameRef target;
+  target.signature = "to";
+  const std::string fact_name = EntryEncoder::EncodeFactName("/kythe/text");
+  const std::string edge_kind =
+      EntryEncoder::EncodeEdgeKind("/kythe/edge/childof");
+  FactRef fact{&source, "/kythe/text", "text", fact_name};
+  EdgeRef edge{&source, "/kythe/edge/childof", &target, edge_kind};
+  proto::Entry fact_entry, edge_entry;
+  fact.Expand(&fact_entry);
+  edge_entry.set_fact_name("/");
+  edge.Expand(&edge_entry);
+  EXPECT_EQ(DelimitedEntry(fact_entry) + DelimitedEntry(edge_entry),
+            EmitToString([&](FileOutputStream *out) {
+              out->Emit(fact);
+              out->Emit(edge);
+            }));
+  EXPECT_EQ("", EntryEncoder::EncodeFactName(""));
+}
+
+TEST(EntryEncoder, FanOutEdgesMatchSingleEdges) {
+  VNameRef source;
+  source.signature = "from";
+  source.corpus = "corpus";
+  VNameRef target, other;
+  target.signature = "to";
+  other.signature = "other";
+  other.path = "path";
+  const std::string edge_kind =
+      EntryEncoder::EncodeEdgeKind("/kythe/edge/childof");
+  FanOutEdgeRef edges[] = {
+      {"/kythe/edge/childof", &target, edge_kind, -1},
+      {"/kythe/edge/param", &other, "", 0},
+      {"/kythe/edge/param", &target, "", 12345}};
+  const std::string expected = EmitToString([&](FileOutputStream *out) {
+    out->Emit(EdgeRef{&source, "/kythe/edge/childof", &target});
+    out->Emit(OrdinalEdgeRef{&source, "/kythe/edge/param", &other, 0});
+    out->Emit(OrdinalEdgeRef{&source, "/kythe/edge/param", &target, 12345});
+  });
+  EXPECT_EQ(expected, EmitToString([&](FileOutputStream *out) {
+              out->EmitEdges(source, edges);
+            }));
+  // The same bytes go through the buffer stack.
+  EXPECT_EQ(expected, EmitToString([&](FileOutputStream *out) {
+              out->PushBuffer();
+              out->EmitEdges(source, edges);
+              out->PopBuffer();
+            }));
+}
+
+TEST(EntryEncoder, LongValuesMatchProto) {
+  VNameRef source;
+  source.signature = "file";
+  std::string text(100000, 'x');
+  FactRef fact{&source, "/kythe/text", text};
+  proto::Entry entry;
+  fact.Expand(&entry);
+  EXPECT_EQ(DelimitedEntry(entry), EmitToString([&](FileOutputStream *out) {
+              out->Emit(fact);
+            }));
+}
+
+TEST(EntryEncoder, BufferedEntriesMatchProto) {
+  VNameRef source;
+  source.signature = "sig";
+  FactRef fact{&source, "/kythe/node/kind", "function"};
+  proto::Entry entry;
+  fact.Expand(&entry);
+  CountingHashCache cache;
+  EXPECT_EQ(DelimitedEntry(entry), EmitToString([&](FileOutputStream *out) {
+              out->UseHashCache(&cache);
+              out->PushBuffer();
+              out->Emit(fact);
+              out->PopBuffer();
+            }));
+}
+
+/// \brief Emits the refs given to `emit` to a `FileOutputStream` that
+/// writes retired buffers directly to a file and returns the file's content.
+template <typename F>
+std::string EmitDirectlyToFile(bool flush_after_each_entry, F emit,
+                               size_t *direct_writes) {
+  int fd;
+  llvm::SmallString<256> path;
+  CHECK(!llvm::sys::fs::createTemporaryFile("direct", "entries", fd, path));
+  {
+    google::protobuf::io::FileOutputStream stream(fd);
+    {
+      FileOutputStream output(&stream);
+      output.set_flush_after_each_entry(flush_after_each_entry);
+      output.set_direct_fd(fd);
+      emit(&output);
+      *direct_writes = output.stats_.direct_writes_;
+    }
+    CHECK(stream.Close());
+  }
+  auto buffer = llvm::MemoryBuffer::getFile(path);
+  CHECK(buffer);
+  llvm::sys::fs::remove(path);
+  return (*buffer)->getBuffer().str();
+}
+
+TEST(FileOutputStream, DirectWritesKeepOrder) {
+  VNameRef source;
+  source.signature = "sig";
+  FactRef kind{&source, "/kythe/node/kind", "function"};
+  std::string large_text(100 * 1024, 'x');
+  FactRef text{&source, "/kythe/text", large_text};
+  // Entries are only buffered when there's a real cache to check them with.
+  std::unique_ptr<CountingHashCache> cache;
+  auto emit = [&](FileOutputStream *out) {
+    out->UseHashCache(cache.get());
+    out->Emit(kind);
+    out->PushBuffer();
+    out->Emit(text);
+    out->Emit(kind);
+    out->PopBuffer();
+    out->Emit(kind);
+    out->PushBuffer();
+    out->Emit(kind);
+    out->PopBuffer();
+    out->WriteDelimitedEntries(EmitToString(
+        [&](FileOutputStream *inner) { inner->Emit(text); }));
+  };
+  cache.reset(new CountingHashCache());
+  std::string expected = EmitToString(emit);
+  size_t direct_writes = 0;
+  cache.reset(new CountingHashCache());
+  EXPECT_EQ(expected, EmitDirectlyToFile(false, emit, &direct_writes));
+  // Only the large buffer and the large delimited entry.
+  EXPECT_EQ(2, direct_writes);
+  cache.reset(new CountingHashCache());
+  EXPECT_EQ(expected, EmitDirectlyToFile(true, emit, &direct_writes));
+  // Every retired buffer that wasn't a duplicate, too.
+  EXPECT_EQ(3, direct_writes);
+}
+
+/// \brief Emits a long buffer of facts to a stream that shares `cache`,
+/// inserting an extra fact after the `insert_at`th one (if it's in range)
+/// and taking size limits from `tuner` if it's set.
+/// \return the stream's statistics.
+FileOutputStream::Stats EmitLongBuffer(HashCache *cache, size_t insert_at,
+                                       BufferSizeTuner *tuner = nullptr) {
+  std::string out;
+  google::protobuf::io::StringOutputStream stream(&out);
+  FileOutputStream output(&stream);
+  output.set_flush_after_each_entry(false);
+  output.UseHashCache(cache);
+  output.set_size_tuner(tuner);
+  output.PushBuffer();
+  for (size_t i = 0; i < 2000; ++i) {
+    if (i == insert_at) {
+      VNameRef inserted;
+      inserted.signature = "inserted";
+      output.Emit(FactRef{&inserted, "/kythe/node/kind", "variable"});
+    }
+    VNameRef source;
+    std::string signature = "sig" + std::to_string(i);
+    source.signature = signature;
+    output.Emit(FactRef{&source, "/kythe/node/kind", "function"});
+  }
+  output.PopBuffer();
+  return output.stats_;
+}
+
+TEST(FileOutputStream, ContentDefinedChunksSurviveEdits) {
+  for (size_t average_size : {0, 1024}) {
+    CountingHashCache cache;
+    cache.SetSizeLimits(256, 4096);
+    cache.set_average_chunk_size(average_size);
+    auto first = EmitLongBuffer(&cache, 2000);
+    EXPECT_EQ(0, first.bytes_matched_);
+    EXPECT_EQ(average_size != 0, first.content_splits_ != 0);
+    size_t total = first.total_bytes_;
+    EXPECT_EQ(total, EmitLongBuffer(&cache, 2000).bytes_matched_);
+    size_t matched = EmitLongBuffer(&cache, 10).bytes_matched_;
+    if (average_size == 0) {
+      // Every split point after the edit moved.
+      EXPECT_LT(matched, total / 10);
+    } else {
+      // Only the chunk with the edit changed.
+      EXPECT_GT(matched, total * 9 / 10);
+    }
+  }
+}
+
+TEST(FileOutputStream, ReportsToSizeTuner) {
+  BufferSizeTuner::Options options;
+  options.min_size = 256;
+  options.max_size = 4096;
+  options.window_bytes = 1000;
+  BufferSizeTuner tuner(options);
+  CountingHashCache cache;
+  cache.SetSizeLimits(1, 2);
+  {
+    std::string out;
+    google::protobuf::io::StringOutputStream stream(&out);
+    FileOutputStream output(&stream);
+    output.UseHashCache(&cache);
+    output.set_size_tuner(&tuner);
+    output.PushBuffer();
+    output.PopBuffer();
+  }
+  size_t min_size, max_size;
+  tuner.GetLimits(&min_size, &max_size);
+  // Nothing was buffered, so no window was full.
+  EXPECT_EQ(4096, max_size);
+  EmitLongBuffer(&cache, 2000, &tuner);
+  tuner.GetLimits(&min_size, &max_size);
+  EXPECT_NE(4096, max_size);
+  EXPECT_EQ(max_size / 16, min_size);
+}
+
+TEST(FileOutputStream, ContentSkipsBuffers) {
+  VNameRef source;
+  source.signature = "sig";
+  FactRef kind{&source, "/kythe/node/kind", "file"};
+  std::string large_text(100 * 1024, 'x');
+  FactRef text{&source, "/kythe/text", large_text};
+  FactRef small_text{&source, "/kythe/text", "small"};
+  proto::Entry kind_entry, text_entry, small_text_entry;
+  kind.Expand(&kind_entry);
+  text.Expand(&text_entry);
+  small_text.Expand(&small_text_entry);
+  std::unique_ptr<CountingHashCache> cache;
+  auto emit = [&](FileOutputStream *out) {
+    out->UseHashCache(cache.get());
+    out->PushBuffer();
+    out->Emit(kind);
+    out->EmitContent(text);
+    out->EmitContent(small_text);
+    out->PopBuffer();
+  };
+  // The large text is written at once; the small text stays in its buffer.
+  std::string expected = DelimitedEntry(text_entry) +
+                         DelimitedEntry(kind_entry) +
+                         DelimitedEntry(small_text_entry);
+  cache.reset(new CountingHashCache());
+  EXPECT_EQ(expected, EmitToString(emit));
+  size_t direct_writes = 0;
+  cache.reset(new CountingHashCache());
+  EXPECT_EQ(expected, EmitDirectlyToFile(false, emit, &direct_writes));
+  EXPECT_EQ(1, direct_writes);
+}
+
+/// \brief Emits the refs given to `emit` to a `FileOutputStream` that
+/// writes to a file on a writer thread and returns the file's content.
+template <typename F>
+std::string EmitToFileOnWriterThread(bool flush_after_each_entry, F emit) {
+  int fd;
+  llvm::SmallString<256> path;
+  CHECK(!llvm::sys::fs::createTemporaryFile("writer", "entries", fd, path));
+  {
+    google::protobuf::io::FileOutputStream stream(fd);
+    {
+      FileOutputStream output(&stream);
+      output.set_flush_after_each_entry(flush_after_each_entry);
+      output.StartWriterThread();
+      emit(&output);
+    }
+    CHECK(stream.Close());
+  }
+  auto buffer = llvm::MemoryBuffer::getFile(path);
+  CHECK(buffer);
+  llvm::sys::fs::remove(path);
+  return (*buffer)->getBuffer().str();
+}
+
+TEST(FileOutputStream, WriterThreadKeepsOrder) {
+  VNameRef source;
+  source.signature = "sig";
+  std::vector<std::string> values;
+  for (int i = 0; i < 1000; ++i) {
+    values.push_back(std::string(i % 7 * 100, 'x') + std::to_string(i));
+  }
+  std::unique_ptr<CountingHashCache> cache;
+  auto emit = [&](FileOutputStream *out) {
+    out->UseHashCache(cache.get());
+    for (size_t i = 0; i < values.size(); ++i) {
+      FactRef fact{&source, "/kythe/text", values[i]};
+      if (i % 3 == 0) {
+        out->Emit(fact);
+      } else {
+        out->PushBuffer();
+        out->Emit(fact);
+        out->PopBuffer();
+      }
+    }
+    out->WriteDelimitedEntries(EmitToString([&](FileOutputStream *inner) {
+      inner->Emit(FactRef{&source, "/kythe/text", "last"});
+    }));
+  };
+  cache.reset(new CountingHashCache());
+  std::string expected = EmitToString(emit);
+  cache.reset(new CountingHashCache());
+  EXPECT_EQ(expected, EmitToFileOnWriterThread(false, emit));
+  cache.reset(new CountingHashCache());
+  EXPECT_EQ(expected, EmitToFileOnWriterThread(true, emit));
+}
+
+TEST(FileOutputStream, SyncWritesThroughToFile) {
+  VNameRef source;
+  source.signature = "sig";
+  FactRef kind{&source, "/kythe/node/kind", "function"};
+  auto emit = [&](FileOutputStream *out) {
+    out->Emit(kind);
+    out->PushBuffer();
+    out->Emit(kind);
+    out->PopBuffer();
+  };
+  std::string expected = EmitToString(emit);
+  for (bool writer_thread : {false, true}) {
+    int fd;
+    llvm::SmallString<256> path;
+    CHECK(!llvm::sys::fs::createTemporaryFile("sync", "entries", fd, path));
+    google::protobuf::io::FileOutputStream stream(fd);
+    {
+      FileOutputStream output(&stream);
+      output.set_flush_after_each_entry(false);
+      if (writer_thread) {
+        output.StartWriterThread();
+      }
+      emit(&output);
+      EXPECT_TRUE(output.Sync());
+      struct stat info;
+      ASSERT_EQ(0, fstat(fd, &info));
+      EXPECT_EQ(expected.size(), info.st_size) << writer_thread;
+    }
+    CHECK(stream.Close());
+    llvm::sys::fs::remove(path);
+  }
+}
+
+/// \brief Emits a unit's entries to a stream that shares `cache`. The
+/// unit's declarations alternate between its main file (whose entries
+/// mention `main_name`) and a header (whose entries are the same every time).
+/// \param by_file Whether to push buffers with `PushFileBuffer`.
+/// \return the stream's statistics.
+FileOutputStream::Stats EmitUnit(HashCache *cache, const std::string &main_name,
+                                 bool by_file) {
+  std::string out;
+  google::protobuf::io::StringOutputStream stream(&out);
+  FileOutputStream output(&stream);
+  output.set_flush_after_each_entry(false);
+  output.UseHashCache(cache);
+  auto push = [&](const std::string &file) {
+    if (by_file) {
+      output.PushFileBuffer(file);
+    } else {
+      output.PushBuffer();
+    }
+  };
+  push("main.cc");
+  for (size_t decl = 0; decl < 20; ++decl) {
+    bool in_header = decl % 2 == 0;
+    std::string signature =
+        (in_header ? "header" : main_name) + std::to_string(decl);
+    VNameRef source;
+    source.signature = signature;
+    push(in_header ? "a.h" : "main.cc");
+    output.Emit(FactRef{&source, "/kythe/node/kind", "function"});
+    // A nested buffer belongs to the same file.
+    output.PushBuffer();
+    output.Emit(FactRef{&source, "/kythe/complete", "definition"});
+    output.PopBuffer();
+    output.PopBuffer();
+  }
+  output.PopBuffer();
+  return output.stats_;
+}
+
+TEST(FileOutputStream, FileBuffersGroupEntriesByFile) {
+  for (bool by_file : {false, true}) {
+    CountingHashCache cache;
+    cache.SetSizeLimits(1024, 32 * 1024);
+    auto first = EmitUnit(&cache, "first", by_file);
+    EXPECT_EQ(0, first.bytes_matched_);
+    auto second = EmitUnit(&cache, "second", by_file);
+    if (by_file) {
+      // The header's group is the same in both units.
+      EXPECT_EQ(2, second.buffers_retired_);
+      EXPECT_LT(0, second.bytes_matched_);
+      EXPECT_GT(second.total_bytes_, second.bytes_matched_);
+    } else {
+      // Small buffers merged into one that mixes both files.
+      EXPECT_EQ(0, second.bytes_matched_);
+    }
+  }
+}
+
+TEST(FileOutputStream, FileBuffersNeedAHashCache) {
+  VNameRef source;
+  source.signature = "sig";
+  std::string grouped = EmitToString([&](FileOutputStream *out) {
+    out->PushFileBuffer("a.h");
+    out->Emit(FactRef{&source, "/kythe/node/kind", "function"});
+    out->PushFileBuffer("b.h");
+    out->Emit(FactRef{&source, "/kythe/complete", "definition"});
+    out->PopBuffer();
+    out->PopBuffer();
+  });
+  std::string plain = EmitToString([&](FileOutputStream *out) {
+    out->Emit(FactRef{&source, "/kythe/node/kind", "function"});
+    out->Emit(FactRef{&source, "/kythe/complete", "definition"});
+  });
+  EXPECT_EQ(plain, grouped);
+}
+
+TEST(EntryAccounting, CountsEntriesByCategory) {
+  VNameRef source;
+  source.signature = "sig";
+  FactRef kind{&source, "/kythe/node/kind", "function"};
+  FactRef text{&source, "/kythe/text", "text"};
+  proto::Entry kind_entry, text_entry;
+  kind.Expand(&kind_entry);
+  text.Expand(&text_entry);
+  EntryAccounting accounting({"kind", "text", "unused"});
+  std::string out = EmitToString([&](FileOutputStream *out) {
+    out->set_accounting(&accounting);
+    accounting.set_category(0);
+    out->Emit(kind);
+    out->Emit(kind);
+    accounting.set_category(1);
+    out->Emit(text);
+    out->set_accounting(nullptr);
+  });
+  const auto &counters = accounting.counters();
+  EXPECT_EQ(2, counters[0].entries);
+  EXPECT_EQ(2 * DelimitedEntry(kind_entry).size(), counters[0].bytes);
+  EXPECT_EQ(1, counters[1].entries);
+  EXPECT_EQ(DelimitedEntry(text_entry).size(), counters[1].bytes);
+  EXPECT_EQ(0, counters[2].entries);
+  EXPECT_EQ(out.size(), counters[0].bytes + counters[1].bytes);
+  EXPECT_EQ(
+      "{\"kind\":{\"entries\":2,\"bytes\":" +
+          std::to_string(counters[0].bytes) +
+          ",\"dropped_entries\":0,\"dropped_bytes\":0},"
+          "\"text\":{\"entries\":1,\"bytes\":" +
+          std::to_string(counters[1].bytes) +
+          ",\"dropped_entries\":0,\"dropped_bytes\":0}}",
+      accounting.ToJson());
+}
+
+TEST(EntryAccounting, CountsBuffersDroppedByHashCache) {
+  VNameRef source;
+  source.signature = "sig";
+  FactRef kind{&source, "/kythe/node/kind", "function"};
+  FactRef text{&source, "/kythe/text", "text"};
+  CountingHashCache cache;
+  EntryAccounting accounting({"kind", "text"});
+  std::string out = EmitToString([&](FileOutputStream *out) {
+    out->UseHashCache(&cache);
+    out->set_accounting(&accounting);
+    for (int i = 0; i < 2; ++i) {
+      out->PushBuffer();
+      accounting.set_category(0);
+      out->Emit(kind);
+      accounting.set_category(1);
+      out->Emit(text);
+      out->PopBuffer();
+    }
+    out->set_accounting(nullptr);
+  });
+  const auto &counters = accounting.counters();
+  EXPECT_EQ(2, counters[0].entries);
+  EXPECT_EQ(1, counters[0].dropped_entries);
+  EXPECT_EQ(counters[0].bytes, 2 * counters[0].dropped_bytes);
+  EXPECT_EQ(2, counters[1].entries);
+  EXPECT_EQ(1, counters[1].dropped_entries);
+  EXPECT_EQ(out.size(), counters[0].bytes + counters[1].bytes -
+                            counters[0].dropped_bytes -
+                            counters[1].dropped_bytes);
+}
+
+}  // namespace
+}  // namespace kythe
+
+int main(int argc, char **argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  int result = RUN_ALL_TESTS();
+  return result;
+}
@@ -22,6 +22,7 @@
 #include "llvm/Support/FileSystem.h"
 #include "llvm/Support/Path.h"
 #include "llvm/Support/TimeValue.h"
+#include "snappy.h"
 
 namespace kythe {
 
@@ -30,9 +31,22 @@ static inline std::pair<uint64_t, uint64_t> PairFromUid(
   return std::make_pair(uid.getDevice(), uid.getFile());
 }
 
-IndexVFS::IndexVFS(const std::string &working_directory,
-                   const std::vector<proto::FileData> &virtual_files,
-                   const std::vector<llvm::StringRef> &virtual_dirs)
+/// \return an estimate of the bytes `map` has allocated: its buckets (a
+/// pointer and a hash each) and an entry and copy of the key for each item.
+template <typename V>
+static size_t StringMapBytes(const llvm::StringMap<V> &map) {
+  size_t bytes = map.getNumBuckets() * (sizeof(void *) + sizeof(unsigned));
+  for (const auto &entry : map) {
+    bytes += sizeof(entry) + entry.getKeyLength() + 1;
+  }
+  return bytes;
+}
+
+IndexVFS::IndexVFS(
+    const std::string &working_directory,
+    const google::protobuf::RepeatedPtrField<proto::FileData> &virtual_files,
+    const std::vector<llvm::StringRef> &virtual_dirs,
+    const std::vector<MappedFile> &mapped_files)
     : virtual_files_(virtual_files), working_directory_(working_directory) {
   assert(llvm::sys::path::is_absolute(working_directory) &&
          "Working directory must be absolute.");
@@ -44,6 +58,24 @@ IndexVFS::IndexVFS(const std::string &working_directory,
           llvm::StringRef(data.content().data(), data.content().size());
     }
   }
+  for (const auto &file : mapped_files) {
+    llvm::StringRef content = file.content->getBuffer();
+    size_t size = content.size();
+    if (file.compressed) {
+      // A corrupt block is mapped as an empty file that fails to read.
+      if (!snappy::GetUncompressedLength(content.data(), content.size(),
+                                         &size)) {
+        size = 0;
+      }
+      compressed_bytes_ += content.size();
+    }
+    if (auto *record = FileRecordForPath(ToStringRef(file.info.path()),
+                                         BehaviorOnMissing::kCreateFile,
+                                         size)) {
+      record->data = content;
+      record->compressed = file.compressed;
+    }
+  }
   for (llvm::StringRef dir : virtual_dirs) {
     FileRecordForPath(dir, BehaviorOnMissing::kCreateDirectory, 0);
   }
@@ -55,11 +87,75 @@ IndexVFS::~IndexVFS() {
   }
 }
 
+size_t IndexVFS::heap_bytes() const {
+  size_t bytes = 0;
+  for (const auto &file : virtual_files_) {
+    bytes += file.SpaceUsed();
+  }
+  for (const auto &entry : uid_to_record_map_) {
+    const FileRecord *record = entry.second;
+    bytes += sizeof(*record) + record->label.capacity() +
+             record->vname.SpaceUsed() - sizeof(record->vname) +
+             StringMapBytes(record->children);
+  }
+  return bytes + compressed_bytes_ + uid_to_record_map_.getMemorySize() +
+         StringMapBytes(lookup_cache_);
+}
+
+llvm::ErrorOr<std::unique_ptr<llvm::MemoryBuffer>> IndexVFS::File::getBuffer(
+    const llvm::Twine &Name, int64_t FileSize, bool RequiresNullTerminator,
+    bool IsVolatile) {
+  name_ = Name.str();
+  if (!record_->compressed) {
+    return llvm::MemoryBuffer::getMemBuffer(record_->data, name_,
+                                            RequiresNullTerminator);
+  }
+  const llvm::StringRef compressed = record_->data;
+  size_t size = 0;
+  if (!snappy::GetUncompressedLength(compressed.data(), compressed.size(),
+                                     &size) ||
+      size != record_->status.getSize()) {
+    return make_error_code(llvm::errc::io_error);
+  }
+  // The new buffer is null-terminated past its end and is owned by the
+  // caller, so the uncompressed copy lasts only as long as Clang needs it.
+  std::unique_ptr<llvm::MemoryBuffer> buffer(
+      llvm::MemoryBuffer::getNewUninitMemBuffer(size, name_));
+  if (!buffer) {
+    return make_error_code(llvm::errc::not_enough_memory);
+  }
+  if (!snappy::RawUncompress(compressed.data(), compressed.size(),
+                             const_cast<char *>(buffer->getBufferStart()))) {
+    return make_error_code(llvm::errc::io_error);
+  }
+  return std::move(buffer);
+}
+
+void IndexVFS::AddRealDirectory(llvm::StringRef path) {
+  real_directories_.push_back(path.rtrim('/'));
+}
+
+bool IndexVFS::IsInRealDirectory(llvm::StringRef path) const {
+  for (const auto &dir : real_directories_) {
+    if (path.startswith(dir) &&
+        (path.size() == dir.size() || path[dir.size()] == '/')) {
+      return true;
+    }
+  }
+  return false;
+}
+
 llvm::ErrorOr<clang::vfs::Status> IndexVFS::status(const llvm::Twine &path) {
+  llvm::SmallString<256> path_storage;
+  llvm::StringRef path_ref = path.toStringRef(path_storage);
+  if (!real_directories_.empty() && IsInRealDirectory(path_ref)) {
+    return clang::vfs::getRealFileSystem()->status(path_ref);
+  }
   if (const auto *record =
-          FileRecordForPath(path.str(), BehaviorOnMissing::kReturnError, 0)) {
+          FileRecordForPath(path_ref, BehaviorOnMissing::kReturnError, 0)) {
     return record->status;
   }
+  ++misses_;
   return make_error_code(llvm::errc::no_such_file_or_directory);
 }
 
@@ -77,12 +173,18 @@ bool IndexVFS::get_vname(const llvm::StringRef &path, proto::VName *vname) {
 
 llvm::ErrorOr<std::unique_ptr<clang::vfs::File>> IndexVFS::openFileForRead(
     const llvm::Twine &path) {
+  llvm::SmallString<256> path_storage;
+  llvm::StringRef path_ref = path.toStringRef(path_storage);
+  if (!real_directories_.empty() && IsInRealDirectory(path_ref)) {
+    return clang::vfs::getRealFileSystem()->openFileForRead(path_ref);
+  }
   if (FileRecord *record =
-          FileRecordForPath(path.str(), BehaviorOnMissing::kReturnError, 0)) {
+          FileRecordForPath(path_ref, BehaviorOnMissing::kReturnError, 0)) {
     if (record->status.getType() == llvm::sys::fs::file_type::regular_file) {
       return std::unique_ptr<clang::vfs::File>(new File(record));
     }
   }
+  ++misses_;
   return make_error_code(llvm::errc::no_such_file_or_directory);
 }
 
@@ -103,18 +205,24 @@ void IndexVFS::SetVName(const std::string &path, const proto::VName &vname) {
 
 bool IndexVFS::get_vname(const clang::FileEntry *entry,
                          proto::VName *merge_with) {
-  auto record = uid_to_record_map_.find(PairFromUid(entry->getUniqueID()));
-  if (record != uid_to_record_map_.end()) {
-    if (record->second->status.getType() ==
-            llvm::sys::fs::file_type::regular_file &&
-        record->second->has_vname) {
-      merge_with->CopyFrom(record->second->vname);
-      return true;
-    }
+  if (const auto *vname = get_vname(entry)) {
+    merge_with->CopyFrom(*vname);
+    return true;
   }
   return false;
 }
 
+const proto::VName *IndexVFS::get_vname(const clang::FileEntry *entry) {
+  auto record = uid_to_record_map_.find(PairFromUid(entry->getUniqueID()));
+  if (record != uid_to_record_map_.end() &&
+      record->second->status.getType() ==
+          llvm::sys::fs::file_type::regular_file &&
+      record->second->has_vname) {
+    return &record->second->vname;
+  }
+  return nullptr;
+}
+
 std::string IndexVFS::get_debug_uid_string(const llvm::sys::fs::UniqueID &uid) {
   auto record = uid_to_record_map_.find(PairFromUid(uid));
   if (record != uid_to_record_map_.end()) {
@@ -163,6 +271,7 @@ IndexVFS::FileRecord *IndexVFS::FileRecordForPathRoot(const llvm::Twine &path,
                             llvm::sys::fs::all_read),
          false, root_name});
     root_name_to_root_map_[root_name] = name_record;
+    lookup_cache_.clear();
     uid_to_record_map_[PairFromUid(name_record->status.getUniqueID())] =
         name_record;
   }
@@ -173,6 +282,20 @@ IndexVFS::FileRecord *IndexVFS::FileRecordForPathRoot(const llvm::Twine &path,
 IndexVFS::FileRecord *IndexVFS::FileRecordForPath(llvm::StringRef path,
                                                   BehaviorOnMissing behavior,
                                                   size_t size) {
+  if (behavior != BehaviorOnMissing::kReturnError) {
+    return WalkFileRecordForPath(path, behavior, size);
+  }
+  auto cached = lookup_cache_.find(path);
+  if (cached != lookup_cache_.end()) {
+    return cached->second;
+  }
+  FileRecord *record = WalkFileRecordForPath(path, behavior, size);
+  lookup_cache_[path] = record;
+  return record;
+}
+
+IndexVFS::FileRecord *IndexVFS::WalkFileRecordForPath(
+    llvm::StringRef path, BehaviorOnMissing behavior, size_t size) {
   using namespace llvm::sys::path;
   std::vector<llvm::StringRef> path_components;
   int skip_count = 0;
@@ -246,17 +369,17 @@ IndexVFS::FileRecord *IndexVFS::AllocOrReturnFileRecord(
     FileRecord *parent, bool create_if_missing, llvm::StringRef label,
     llvm::sys::fs::file_type type, size_t size) {
   assert(parent != nullptr);
-  for (auto &record : parent->children) {
-    if (record->label == label) {
-      if (create_if_missing && (record->status.getSize() != size ||
-                                record->status.getType() != type)) {
-        fprintf(stderr, "Warning: path %s/%s: defined inconsistently (%s/%s)\n",
-                parent->status.getName().str().c_str(), label.str().c_str(),
-                NameOfFileType(type), NameOfFileType(record->status.getType()));
-        return nullptr;
-      }
-      return record;
+  auto found = parent->children.find(label);
+  if (found != parent->children.end()) {
+    FileRecord *record = found->second;
+    if (create_if_missing && (record->status.getSize() != size ||
+                              record->status.getType() != type)) {
+      fprintf(stderr, "Warning: path %s/%s: defined inconsistently (%s/%s)\n",
+              parent->status.getName().str().c_str(), label.str().c_str(),
+              NameOfFileType(type), NameOfFileType(record->status.getType()));
+      return nullptr;
     }
+    return record;
   }
   if (!create_if_missing) {
     return nullptr;
@@ -268,7 +391,8 @@ IndexVFS::FileRecord *IndexVFS::AllocOrReturnFileRecord(
                          llvm::sys::TimeValue(), 0, 0, size, type,
                          llvm::sys::fs::all_read),
       false, label};
-  parent->children.push_back(new_record);
+  parent->children[label] = new_record;
+  lookup_cache_.clear();
   uid_to_record_map_[PairFromUid(new_record->status.getUniqueID())] =
       new_record;
   return new_record;
@@ -19,6 +19,9 @@
 
 #include "clang/Basic/FileManager.h"
 #include "clang/Basic/VirtualFileSystem.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/StringMap.h"
+#include "kythe/cxx/common/indexing/MappedFileStore.h"
 #include "kythe/proto/analysis.pb.h"
 
 namespace kythe {
@@ -28,13 +31,24 @@ namespace kythe {
 /// IndexVFS normalizes all paths (using the working directory for
 /// relative paths). This means that foo/bar/../baz is assumed to be the
 /// same as foo/baz.
+///
+/// The results of lookups (including failed ones) are cached by the path
+/// they were made with, since header search probes the same few paths in
+/// every include directory over and over.
 class IndexVFS : public clang::vfs::FileSystem {
  public:
   /// \param working_directory The absolute path to the working directory.
-  /// \param virtual_files Files to map.
+  /// \param virtual_files Files to map. They must outlive this `IndexVFS`.
+  /// \param virtual_dirs Directories to map.
+  /// \param mapped_files Additional files to map whose content is held
+  /// elsewhere. Their content must outlive this `IndexVFS`. Compressed files
+  /// are uncompressed into a new buffer each time they're read, so those
+  /// that are never opened stay compressed.
   IndexVFS(const std::string &working_directory,
-           const std::vector<proto::FileData> &virtual_files,
-           const std::vector<llvm::StringRef> &virtual_dirs);
+           const google::protobuf::RepeatedPtrField<proto::FileData>
+               &virtual_files,
+           const std::vector<llvm::StringRef> &virtual_dirs,
+           const std::vector<MappedFile> &mapped_files = {});
   ~IndexVFS();
   /// \brief Implements clang::vfs::FileSystem::status.
   llvm::ErrorOr<clang::vfs::Status> status(const llvm::Twine &path) override;
@@ -44,6 +58,12 @@ class IndexVFS : public clang::vfs::FileSystem {
   /// \brief Unimplemented and unused.
   clang::vfs::directory_iterator dir_begin(
       const llvm::Twine &dir, std::error_code &error_code) override;
+  /// \brief Sends lookups of paths under `path` to the real filesystem.
+  ///
+  /// This is for directories that Clang writes to directly, like a module
+  /// cache, and then reads back through this filesystem.
+  /// \param path An absolute, normalized directory path.
+  void AddRealDirectory(llvm::StringRef path);
   /// \brief Associates a vname with a path.
   void SetVName(const std::string &path, const proto::VName &vname);
   /// \brief Returns the vname associated with some `FileEntry`.
@@ -51,12 +71,28 @@ class IndexVFS : public clang::vfs::FileSystem {
   /// \param merge_with The `VName` to copy the vname onto.
   /// \return true if a match was found; false otherwise.
   bool get_vname(const clang::FileEntry *entry, proto::VName *merge_with);
+  /// \brief Returns the vname associated with some `FileEntry` without
+  /// copying it.
+  /// \param entry The `FileEntry` to look up.
+  /// \return the vname, which lives as long as this `IndexVFS`, or null if
+  /// there was no match.
+  const proto::VName *get_vname(const clang::FileEntry *entry);
   /// \brief Returns the vname associated with some `path`.
   /// \param path The path to look up.
   /// \param merge_with The `VName` to copy the vname onto.
   /// \return true if a match was found; false otherwise.
   bool get_vname(const llvm::StringRef &path, proto::VName *merge_with);
 
+  /// \return the number of `status` and `openFileForRead` calls for paths
+  /// that weren't mapped (such as header search probes).
+  size_t misses() const { return misses_; }
+
+  /// \return an estimate of the heap bytes held for the files in this VFS:
+  /// the contents of the virtual files, the compressed mapped files and the
+  /// records for every path. Other mapped files are in the page cache and
+  /// aren't counted.
+  size_t heap_bytes() const;
+
   /// \brief Returns a string representation of `uid` for error messages.
   std::string get_debug_uid_string(const llvm::sys::fs::UniqueID &uid);
   const std::string &working_directory() const { return working_directory_; }
@@ -65,6 +101,8 @@ class IndexVFS : public clang::vfs::FileSystem {
   }
   std::error_code setCurrentWorkingDirectory(const llvm::Twine &Path) override {
     working_directory_ = Path.str();
+    // Relative paths in the cache were resolved against the old directory.
+    lookup_cache_.clear();
     return std::error_code();
   }
 
@@ -79,10 +117,13 @@ class IndexVFS : public clang::vfs::FileSystem {
     std::string label;
     /// This file's VName, if set.
     proto::VName vname;
-    /// This directory's children.
-    std::vector<FileRecord *> children;
+    /// This directory's children, keyed by their labels.
+    llvm::StringMap<FileRecord *> children;
     /// This file's content.
     llvm::StringRef data;
+    /// Whether `data` is a raw snappy block (whose uncompressed size is in
+    /// `status`).
+    bool compressed;
   };
 
   /// \brief A clang::vfs::File that wraps a `FileRecord`.
@@ -93,13 +134,12 @@ class IndexVFS : public clang::vfs::FileSystem {
       return record_->status;
     }
     std::error_code close() override { return std::error_code(); }
+    /// \brief Returns a buffer that refers to the file's content, or (if
+    /// the file is compressed) a new buffer that owns its uncompressed
+    /// content.
     llvm::ErrorOr<std::unique_ptr<llvm::MemoryBuffer>> getBuffer(
         const llvm::Twine &Name, int64_t FileSize, bool RequiresNullTerminator,
-        bool IsVolatile) override {
-      name_ = Name.str();
-      return llvm::MemoryBuffer::getMemBuffer(record_->data, name_,
-                                              RequiresNullTerminator);
-    }
+        bool IsVolatile) override;
 
    private:
     FileRecord *record_;
@@ -127,6 +167,11 @@ class IndexVFS : public clang::vfs::FileSystem {
   FileRecord *FileRecordForPath(llvm::StringRef path,
                                 BehaviorOnMissing behavior, size_t size);
 
+  /// \brief Implements `FileRecordForPath` by walking the components of
+  /// `path` from the root, without consulting `lookup_cache_`.
+  FileRecord *WalkFileRecordForPath(llvm::StringRef path,
+                                    BehaviorOnMissing behavior, size_t size);
+
   /// \brief Creates a new or returns an existing `FileRecord`.
   /// \param parent The parent `FileRecord`.
   /// \param create_if_missing Create a FileRecord if it's missing.
@@ -140,14 +185,27 @@ class IndexVFS : public clang::vfs::FileSystem {
                                       size_t size);
 
   /// The virtual files that were included in the index.
-  const std::vector<proto::FileData> &virtual_files_;
+  const google::protobuf::RepeatedPtrField<proto::FileData> &virtual_files_;
   /// The working directory. Must be absolute.
   std::string working_directory_;
   /// Maps root names to root nodes. For indexes captured from Unix
   /// environments, there will be only one root name (the empty string).
   std::map<std::string, FileRecord *> root_name_to_root_map_;
   /// Maps unique IDs to file records.
-  std::map<std::pair<uint64_t, uint64_t>, FileRecord *> uid_to_record_map_;
+  llvm::DenseMap<std::pair<uint64_t, uint64_t>, FileRecord *>
+      uid_to_record_map_;
+  /// Maps paths, as they were passed to `FileRecordForPath`, to the records
+  /// they named when looked up with `kReturnError` (or to null if there were
+  /// none). Cleared whenever a record is created.
+  llvm::StringMap<FileRecord *> lookup_cache_;
+  /// The number of lookups that found nothing.
+  size_t misses_ = 0;
+  /// The total size of the compressed mapped files.
+  size_t compressed_bytes_ = 0;
+  /// Directories whose contents are looked up on the real filesystem.
+  std::vector<std::string> real_directories_;
+  /// \return true if `path` is in one of `real_directories_`.
+  bool IsInRealDirectory(llvm::StringRef path) const;
 };
 
 }  // namespace kythe
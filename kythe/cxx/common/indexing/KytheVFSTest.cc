@@ -0,0 +1,156 @@
+/*
+ * Copyright 2017 Google Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "KytheVFS.h"
+
+#include <cstdlib>
+#include <fstream>
+
+#include "google/protobuf/arena.h"
+#include "gtest/gtest.h"
+#include "kythe/proto/analysis.pb.h"
+
+namespace kythe {
+namespace {
+
+class IndexVFSTest : public ::testing::Test {
+ protected:
+  IndexVFSTest() {
+    AddFile("/root/include/a.h", "a");
+    AddFile("/root/src/b.h", "bb");
+    vfs_ = new IndexVFS("/root/src", files_, {"/root/empty"});
+  }
+
+  void AddFile(const std::string &path, const std::string &content) {
+    proto::FileData *file = files_.Add();
+    file->mutable_info()->set_path(path);
+    file->set_content(content);
+  }
+
+  bool Exists(const std::string &path) {
+    return static_cast<bool>(vfs_->status(path));
+  }
+
+  google::protobuf::RepeatedPtrField<proto::FileData> files_;
+  llvm::IntrusiveRefCntPtr<IndexVFS> vfs_;
+};
+
+TEST_F(IndexVFSTest, FindsFilesAndDirectories) {
+  auto status = vfs_->status("/root/include/a.h");
+  ASSERT_TRUE(static_cast<bool>(status));
+  EXPECT_EQ(1, status->getSize());
+  EXPECT_FALSE(status->isDirectory());
+  status = vfs_->status("/root/include");
+  ASSERT_TRUE(static_cast<bool>(status));
+  EXPECT_TRUE(status->isDirectory());
+  EXPECT_TRUE(Exists("/root/empty"));
+  EXPECT_TRUE(Exists("b.h"));
+  EXPECT_TRUE(Exists("../include/./a.h"));
+  EXPECT_FALSE(Exists("/root/include/b.h"));
+  EXPECT_FALSE(Exists("/root/missing/a.h"));
+}
+
+TEST_F(IndexVFSTest, RepeatsLookupResults) {
+  for (int i = 0; i < 3; ++i) {
+    EXPECT_TRUE(Exists("/root/src/b.h"));
+    EXPECT_FALSE(Exists("/root/empty/b.h"));
+  }
+  auto file = vfs_->openFileForRead("/root/src/b.h");
+  ASSERT_TRUE(static_cast<bool>(file));
+  auto buffer = (*file)->getBuffer("/root/src/b.h");
+  ASSERT_TRUE(static_cast<bool>(buffer));
+  EXPECT_EQ("bb", (*buffer)->getBuffer());
+  EXPECT_FALSE(static_cast<bool>(vfs_->openFileForRead("/root/src")));
+}
+
+TEST_F(IndexVFSTest, ResolvesRelativePathsAfterChangingDirectory) {
+  EXPECT_TRUE(Exists("b.h"));
+  EXPECT_FALSE(Exists("a.h"));
+  vfs_->setCurrentWorkingDirectory("/root/include");
+  EXPECT_FALSE(Exists("b.h"));
+  EXPECT_TRUE(Exists("a.h"));
+}
+
+TEST_F(IndexVFSTest, ReadsRealDirectories) {
+  const char *tmp_dir = getenv("TEST_TMPDIR");
+  const std::string dir = tmp_dir != nullptr ? tmp_dir : "/tmp";
+  const std::string path = dir + "/real_module.pcm";
+  std::ofstream(path) << "pcm";
+  EXPECT_FALSE(Exists(path));
+  vfs_->AddRealDirectory(dir + "/");
+  EXPECT_TRUE(Exists(path));
+  EXPECT_TRUE(Exists(dir));
+  EXPECT_TRUE(Exists("/root/include/a.h"));
+  auto file = vfs_->openFileForRead(path);
+  ASSERT_TRUE(static_cast<bool>(file));
+  auto buffer = (*file)->getBuffer(path);
+  ASSERT_TRUE(static_cast<bool>(buffer));
+  EXPECT_EQ("pcm", (*buffer)->getBuffer());
+  EXPECT_FALSE(Exists(dir + "_other/real_module.pcm"));
+}
+
+TEST(IndexVFS, MapsFilesOnAnArena) {
+  google::protobuf::Arena arena;
+  auto *files = google::protobuf::Arena::CreateMessage<
+      google::protobuf::RepeatedPtrField<proto::FileData>>(&arena);
+  proto::FileData *file = files->Add();
+  file->mutable_info()->set_path("/root/src/c.h");
+  file->set_content("ccc");
+  llvm::IntrusiveRefCntPtr<IndexVFS> vfs(new IndexVFS("/root/src", *files, {}));
+  auto opened = vfs->openFileForRead("c.h");
+  ASSERT_TRUE(static_cast<bool>(opened));
+  auto buffer = (*opened)->getBuffer("c.h");
+  ASSERT_TRUE(static_cast<bool>(buffer));
+  EXPECT_EQ("ccc", (*buffer)->getBuffer());
+}
+
+TEST(IndexVFS, UncompressesCompressedFilesWhenRead) {
+  google::protobuf::RepeatedPtrField<proto::FileData> files;
+  std::string content(4096, 'x');
+  content += "end";
+  proto::FileInfo info;
+  info.set_path("/src/big.h");
+  std::vector<MappedFile> mapped = {CompressFile(info, content)};
+  ASSERT_TRUE(mapped[0].compressed);
+  EXPECT_LT(mapped[0].content->getBufferSize(), content.size());
+  info.set_path("/src/bad.h");
+  mapped.push_back(CompressFile(info, ""));
+  mapped.back().content = llvm::MemoryBuffer::getMemBufferCopy("\xff\xff");
+  llvm::IntrusiveRefCntPtr<IndexVFS> vfs(
+      new IndexVFS("/src", files, {}, mapped));
+  auto status = vfs->status("big.h");
+  ASSERT_TRUE(static_cast<bool>(status));
+  EXPECT_EQ(content.size(), status->getSize());
+  EXPECT_LE(mapped[0].content->getBufferSize(), vfs->heap_bytes());
+  auto file = vfs->openFileForRead("big.h");
+  ASSERT_TRUE(static_cast<bool>(file));
+  auto buffer = (*file)->getBuffer("big.h", -1, true, false);
+  ASSERT_TRUE(static_cast<bool>(buffer));
+  EXPECT_EQ(content, (*buffer)->getBuffer());
+  EXPECT_EQ('\0', *(*buffer)->getBufferEnd());
+  file = vfs->openFileForRead("bad.h");
+  ASSERT_TRUE(static_cast<bool>(file));
+  EXPECT_FALSE(static_cast<bool>((*file)->getBuffer("bad.h", -1, true, false)));
+}
+
+}  // namespace
+}  // namespace kythe
+
+int main(int argc, char **argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  int result = RUN_ALL_TESTS();
+  return result;
+}
@@ -0,0 +1,193 @@
+/*
+ * Copyright 2017 Google Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "MappedFileStore.h"
+
+#include <errno.h>
+#include <unistd.h>
+
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Path.h"
+#include "snappy.h"
+
+namespace kythe {
+namespace {
+/// The suffix given to partially-written files.
+constexpr char kTempFileSuffix[] = ".new";
+}  // anonymous namespace
+
+MappedFile CompressFile(const proto::FileInfo &info, llvm::StringRef content) {
+  std::string compressed;
+  snappy::Compress(content.data(), content.size(), &compressed);
+  MappedFile file;
+  file.info = info;
+  file.content = llvm::MemoryBuffer::getMemBufferCopy(compressed);
+  file.compressed = true;
+  return file;
+}
+
+std::unique_ptr<MappedFileStore> MappedFileStore::Open(
+    const std::string &root_path, std::string *error_text) {
+  llvm::SmallString<256> abs_root(root_path);
+  if (auto err = llvm::sys::fs::make_absolute(abs_root)) {
+    *error_text = err.message();
+    return nullptr;
+  }
+  if (auto err = llvm::sys::fs::create_directories(llvm::Twine(abs_root))) {
+    *error_text = err.message();
+    return nullptr;
+  }
+  return std::unique_ptr<MappedFileStore>(new MappedFileStore(abs_root.str()));
+}
+
+std::string MappedFileStore::PathForDigest(const std::string &digest) const {
+  if (digest.size() != 64) {
+    return "";
+  }
+  // This also takes care of bad digests with path separators or extensions.
+  for (char c : digest) {
+    if (!((c >= '0' && c <= '9') || (c >= 'a' && c <= 'f'))) {
+      return "";
+    }
+  }
+  llvm::SmallString<256> path(root_);
+  llvm::sys::path::append(path, digest);
+  return path.str();
+}
+
+std::shared_ptr<llvm::MemoryBuffer> MappedFileStore::MapLocked(
+    const std::string &digest, const std::string &path) {
+  auto found = mapped_.find(digest);
+  if (found != mapped_.end()) {
+    if (auto buffer = found->second.lock()) {
+      RetainLocked(digest, buffer);
+      return buffer;
+    }
+  }
+  auto buffer = llvm::MemoryBuffer::getFile(path, /*FileSize=*/-1,
+                                            /*RequiresNullTerminator=*/true);
+  if (!buffer) {
+    return nullptr;
+  }
+  ++maps_;
+  std::shared_ptr<llvm::MemoryBuffer> shared(std::move(*buffer));
+  mapped_[digest] = shared;
+  RetainLocked(digest, shared);
+  return shared;
+}
+
+void MappedFileStore::RetainLocked(
+    const std::string &digest,
+    const std::shared_ptr<llvm::MemoryBuffer> &buffer) {
+  if (retained_bytes_ == 0) {
+    return;
+  }
+  auto found = retained_index_.find(digest);
+  if (found != retained_index_.end()) {
+    retained_.splice(retained_.begin(), retained_, found->second);
+    return;
+  }
+  retained_.emplace_front(digest, buffer);
+  retained_index_[digest] = retained_.begin();
+  retained_size_ += buffer->getBufferSize();
+  TrimLocked();
+}
+
+void MappedFileStore::TrimLocked() {
+  while (retained_size_ > retained_bytes_) {
+    retained_size_ -= retained_.back().second->getBufferSize();
+    retained_index_.erase(retained_.back().first);
+    retained_.pop_back();
+  }
+}
+
+void MappedFileStore::set_retained_bytes(size_t bytes) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  retained_bytes_ = bytes;
+  TrimLocked();
+}
+
+size_t MappedFileStore::maps() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return maps_;
+}
+
+std::shared_ptr<llvm::MemoryBuffer> MappedFileStore::Find(
+    const std::string &digest) {
+  std::string path = PathForDigest(digest);
+  if (path.empty()) {
+    return nullptr;
+  }
+  std::lock_guard<std::mutex> lock(mutex_);
+  return MapLocked(digest, path);
+}
+
+std::shared_ptr<llvm::MemoryBuffer> MappedFileStore::Insert(
+    const std::string &digest, llvm::StringRef content,
+    std::string *error_text) {
+  std::string path = PathForDigest(digest);
+  if (path.empty()) {
+    *error_text = "Invalid name: name is not a valid lowercase SHA256 digest";
+    return nullptr;
+  }
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (auto existing = MapLocked(digest, path)) {
+    return existing;
+  }
+  // Write to a temporary file, then rename it into place. Renaming is atomic,
+  // so other readers (including other processes) never see partial content.
+  int fd;
+  llvm::SmallString<256> temp_path;
+  if (auto err = llvm::sys::fs::createUniqueFile(
+          llvm::Twine(path) + ".%%%%%%%%" + kTempFileSuffix, fd, temp_path)) {
+    *error_text = err.message();
+    return nullptr;
+  }
+  const char *data = content.data();
+  size_t remaining = content.size();
+  while (remaining > 0) {
+    ssize_t written = ::write(fd, data, remaining);
+    if (written < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      *error_text = std::string("Couldn't write ") + temp_path.c_str();
+      ::close(fd);
+      llvm::sys::fs::remove(llvm::Twine(temp_path));
+      return nullptr;
+    }
+    data += written;
+    remaining -= written;
+  }
+  if (::close(fd) != 0) {
+    *error_text = std::string("Couldn't close ") + temp_path.c_str();
+    llvm::sys::fs::remove(llvm::Twine(temp_path));
+    return nullptr;
+  }
+  if (auto err = llvm::sys::fs::rename(llvm::Twine(temp_path),
+                                       llvm::Twine(path))) {
+    *error_text = err.message();
+    llvm::sys::fs::remove(llvm::Twine(temp_path));
+    return nullptr;
+  }
+  auto mapped = MapLocked(digest, path);
+  if (!mapped) {
+    *error_text = "Couldn't map " + path;
+  }
+  return mapped;
+}
+
+}  // namespace kythe
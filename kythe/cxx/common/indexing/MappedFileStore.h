@@ -0,0 +1,133 @@
+/*
+ * Copyright 2017 Google Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef KYTHE_CXX_COMMON_INDEXING_MAPPED_FILE_STORE_H_
+#define KYTHE_CXX_COMMON_INDEXING_MAPPED_FILE_STORE_H_
+
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+#include "kythe/proto/analysis.pb.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Support/MemoryBuffer.h"
+
+namespace kythe {
+
+/// \brief A file whose content is held outside of a `proto::FileData`.
+struct MappedFile {
+  /// The file's path and digest.
+  proto::FileInfo info;
+  /// The file's content. Null-terminated (past the end of the buffer)
+  /// unless `compressed` is set.
+  std::shared_ptr<llvm::MemoryBuffer> content;
+  /// If set, `content` holds the file's content as a raw snappy block, to be
+  /// uncompressed whenever the file is read.
+  bool compressed = false;
+};
+
+/// \brief Makes a `MappedFile` that holds a snappy-compressed copy of
+/// `content` on the heap.
+MappedFile CompressFile(const proto::FileInfo &info, llvm::StringRef content);
+
+/// \brief A local, content-addressed store of decompressed file content.
+///
+/// Files are stored uncompressed under their SHA-256 digests in a directory on
+/// the local disk and are memory-mapped when read. Mappings are shared while
+/// any `MappedFile` refers to them, so units that depend on the same headers
+/// share a single (clean, page-cache-backed) copy of each header's content.
+/// The store may be shared between threads and between processes.
+///
+/// A mapping normally lasts only as long as some unit refers to it. A store
+/// can also keep recently-used mappings alive, so that a process indexing
+/// units one after another doesn't reopen and remap the headers they share.
+class MappedFileStore {
+ public:
+  /// \brief Opens (creating if necessary) a store rooted at `root_path`.
+  /// \param error_text Set to an error description on failure.
+  /// \return the store, or null on failure.
+  static std::unique_ptr<MappedFileStore> Open(const std::string &root_path,
+                                               std::string *error_text);
+
+  /// \brief Looks up content by digest.
+  /// \param digest The lowercase hex SHA-256 digest of the content.
+  /// \return the mapped content, or null if it isn't in the store.
+  std::shared_ptr<llvm::MemoryBuffer> Find(const std::string &digest);
+
+  /// \brief Adds content to the store (if it isn't already present).
+  /// \param digest The lowercase hex SHA-256 digest of `content`.
+  /// \param content The content to store.
+  /// \param error_text Set to an error description on failure.
+  /// \return the mapped content, or null on failure.
+  std::shared_ptr<llvm::MemoryBuffer> Insert(const std::string &digest,
+                                             llvm::StringRef content,
+                                             std::string *error_text);
+
+  /// \brief Keeps the most recently used mappings alive while they total no
+  /// more than `bytes`, even once nothing else refers to them.
+  void set_retained_bytes(size_t bytes);
+
+  /// \return the number of times content has been mapped from disk.
+  size_t maps() const;
+
+ private:
+  explicit MappedFileStore(const std::string &root) : root_(root) {}
+
+  /// \return the path for `digest`, or an empty string if `digest` isn't a
+  /// valid lowercase SHA-256 digest.
+  std::string PathForDigest(const std::string &digest) const;
+
+  /// \brief Maps the file at `path` (which stores `digest`).
+  /// \pre `mutex_` is held.
+  std::shared_ptr<llvm::MemoryBuffer> MapLocked(const std::string &digest,
+                                                const std::string &path);
+
+  /// \brief Marks `buffer` as the most recently used mapping.
+  /// \pre `mutex_` is held.
+  void RetainLocked(const std::string &digest,
+                    const std::shared_ptr<llvm::MemoryBuffer> &buffer);
+
+  /// \brief Drops the least recently used mappings until the rest fit in
+  /// `retained_bytes_`.
+  /// \pre `mutex_` is held.
+  void TrimLocked();
+
+  /// The absolute path to the directory holding the store.
+  std::string root_;
+  /// Guards the members below.
+  mutable std::mutex mutex_;
+  /// Live mappings, keyed by digest.
+  std::unordered_map<std::string, std::weak_ptr<llvm::MemoryBuffer>> mapped_;
+  /// A retained mapping and its digest.
+  using Retained = std::pair<std::string, std::shared_ptr<llvm::MemoryBuffer>>;
+  /// Retained mappings, most recently used first.
+  std::list<Retained> retained_;
+  /// Maps digests to their entries in `retained_`.
+  std::unordered_map<std::string, std::list<Retained>::iterator>
+      retained_index_;
+  /// The total size of the mappings in `retained_`.
+  size_t retained_size_ = 0;
+  /// The most `retained_` may hold.
+  size_t retained_bytes_ = 0;
+  /// The number of times content has been mapped from disk.
+  size_t maps_ = 0;
+};
+
+}  // namespace kythe
+
+#endif  // KYTHE_CXX_COMMON_INDEXING_MAPPED_FILE_STORE_H_
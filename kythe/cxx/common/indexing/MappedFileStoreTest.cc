@@ -0,0 +1,147 @@
+/*
+ * Copyright 2017 Google Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "MappedFileStore.h"
+
+#include "glog/logging.h"
+#include "gtest/gtest.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Path.h"
+
+namespace kythe {
+namespace {
+
+/// SHA256 of "data1".
+constexpr char kData1Sha[] =
+    "5b41362bc82b7f3d56edc5a306db22105707d01ff4819e26faef9724a2d406c9";
+
+/// \brief Manages a temporary directory for a `MappedFileStore`.
+class TemporaryDirectory {
+ public:
+  TemporaryDirectory() {
+    CHECK(!llvm::sys::fs::createUniqueDirectory("mapped_file_store", root_));
+  }
+  ~TemporaryDirectory() {
+    std::error_code err;
+    for (llvm::sys::fs::directory_iterator file(llvm::Twine(root_), err), end;
+         !err && file != end; file.increment(err)) {
+      llvm::sys::fs::remove(file->path());
+    }
+    llvm::sys::fs::remove(llvm::Twine(root_));
+  }
+  std::string root() const { return root_.str(); }
+
+ private:
+  llvm::SmallString<256> root_;
+};
+
+TEST(MappedFileStore, FindMissing) {
+  TemporaryDirectory dir;
+  std::string error_text;
+  auto store = MappedFileStore::Open(dir.root(), &error_text);
+  ASSERT_NE(nullptr, store) << error_text;
+  EXPECT_EQ(nullptr, store->Find(kData1Sha));
+}
+
+TEST(MappedFileStore, InsertThenFind) {
+  TemporaryDirectory dir;
+  std::string error_text;
+  auto store = MappedFileStore::Open(dir.root(), &error_text);
+  ASSERT_NE(nullptr, store) << error_text;
+  auto inserted = store->Insert(kData1Sha, "data1", &error_text);
+  ASSERT_NE(nullptr, inserted) << error_text;
+  EXPECT_EQ("data1", inserted->getBuffer());
+  EXPECT_EQ('\0', *inserted->getBufferEnd());
+  auto found = store->Find(kData1Sha);
+  ASSERT_NE(nullptr, found);
+  // Live mappings are shared.
+  EXPECT_EQ(inserted.get(), found.get());
+}
+
+TEST(MappedFileStore, SharedBetweenStores) {
+  TemporaryDirectory dir;
+  std::string error_text;
+  auto first = MappedFileStore::Open(dir.root(), &error_text);
+  ASSERT_NE(nullptr, first) << error_text;
+  ASSERT_NE(nullptr, first->Insert(kData1Sha, "data1", &error_text))
+      << error_text;
+  auto second = MappedFileStore::Open(dir.root(), &error_text);
+  ASSERT_NE(nullptr, second) << error_text;
+  auto found = second->Find(kData1Sha);
+  ASSERT_NE(nullptr, found);
+  EXPECT_EQ("data1", found->getBuffer());
+}
+
+/// SHA256 of "data2".
+constexpr char kData2Sha[] =
+    "d98cf53e0c8b77c14a96358d5b69584225b4bb9026423cbc2f7b0161894c402c";
+
+TEST(MappedFileStore, RemapsReleasedContent) {
+  TemporaryDirectory dir;
+  std::string error_text;
+  auto store = MappedFileStore::Open(dir.root(), &error_text);
+  ASSERT_NE(nullptr, store) << error_text;
+  ASSERT_NE(nullptr, store->Insert(kData1Sha, "data1", &error_text))
+      << error_text;
+  EXPECT_EQ(1, store->maps());
+  ASSERT_NE(nullptr, store->Find(kData1Sha));
+  EXPECT_EQ(2, store->maps());
+}
+
+TEST(MappedFileStore, RetainsRecentlyUsedContent) {
+  TemporaryDirectory dir;
+  std::string error_text;
+  auto store = MappedFileStore::Open(dir.root(), &error_text);
+  ASSERT_NE(nullptr, store) << error_text;
+  store->set_retained_bytes(5);
+  ASSERT_NE(nullptr, store->Insert(kData1Sha, "data1", &error_text))
+      << error_text;
+  auto found = store->Find(kData1Sha);
+  ASSERT_NE(nullptr, found);
+  EXPECT_EQ("data1", found->getBuffer());
+  EXPECT_EQ(1, store->maps());
+  found.reset();
+  // This pushes data1 out of the retained set.
+  ASSERT_NE(nullptr, store->Insert(kData2Sha, "data2", &error_text))
+      << error_text;
+  EXPECT_EQ(2, store->maps());
+  ASSERT_NE(nullptr, store->Find(kData2Sha));
+  EXPECT_EQ(2, store->maps());
+  ASSERT_NE(nullptr, store->Find(kData1Sha));
+  EXPECT_EQ(3, store->maps());
+  store->set_retained_bytes(0);
+  ASSERT_NE(nullptr, store->Find(kData1Sha));
+  EXPECT_EQ(4, store->maps());
+}
+
+TEST(MappedFileStore, RejectsBadDigests) {
+  TemporaryDirectory dir;
+  std::string error_text;
+  auto store = MappedFileStore::Open(dir.root(), &error_text);
+  ASSERT_NE(nullptr, store) << error_text;
+  EXPECT_EQ(nullptr, store->Insert("../escape", "data1", &error_text));
+  EXPECT_FALSE(error_text.empty());
+  EXPECT_EQ(nullptr, store->Find("../escape"));
+}
+
+}  // namespace
+}  // namespace kythe
+
+int main(int argc, char **argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  int result = RUN_ALL_TESTS();
+  return result;
+}
@@ -0,0 +1,133 @@
+/*
+ * Copyright 2017 Google Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "kythe/cxx/common/indexing/analysis_server.h"
+
+#include <limits.h>
+
+#include "google/protobuf/io/coded_stream.h"
+#include "google/protobuf/wire_format_lite.h"
+
+namespace kythe {
+
+bool AnalysisServer::ReadMessage(google::protobuf::Message *message,
+                                 bool *at_end) {
+  google::protobuf::io::CodedInputStream coded_input(input_);
+  coded_input.SetTotalBytesLimit(INT_MAX, -1);
+  google::protobuf::uint32 byte_size;
+  if (!coded_input.ReadVarint32(&byte_size)) {
+    *at_end = coded_input.CurrentPosition() == 0;
+    return false;
+  }
+  *at_end = false;
+  coded_input.PushLimit(byte_size);
+  return message->ParseFromCodedStream(&coded_input) &&
+         coded_input.ConsumedEntireMessage();
+}
+
+void AnalysisServer::WriteEntries(ChunkedOutputStream *entries) {
+  using google::protobuf::internal::WireFormatLite;
+  static const uint32_t kValueTag = WireFormatLite::MakeTag(
+      proto::AnalysisOutput::kValueFieldNumber,
+      WireFormatLite::WIRETYPE_LENGTH_DELIMITED);
+  google::protobuf::io::CodedOutputStream coded_output(output_);
+  size_t offset = 0;
+  uint32_t entry_size;
+  size_t size_length;
+  while (entries->ReadVarint32(offset, &entry_size, &size_length) &&
+         offset + size_length + entry_size <= entries->size()) {
+    // An AnalysisOutput holding only `value` is its tag, the entry's size
+    // and the entry itself, so the entry's bytes can be copied as they are.
+    size_t begin = offset + size_length;
+    offset = begin + entry_size;
+    if (entry_size == 0) {
+      // proto3 leaves empty fields out.
+      coded_output.WriteVarint32(0);
+      continue;
+    }
+    coded_output.WriteVarint32(
+        google::protobuf::io::CodedOutputStream::VarintSize32(kValueTag) +
+        size_length + entry_size);
+    coded_output.WriteTag(kValueTag);
+    coded_output.WriteVarint32(entry_size);
+    slices_.clear();
+    entries->Slices(begin, offset, &slices_);
+    for (const auto &slice : slices_) {
+      coded_output.WriteRaw(slice.data(), slice.size());
+    }
+  }
+  entries->Consume(offset);
+}
+
+void AnalysisServer::WriteResult(const proto::AnalysisResult &result) {
+  google::protobuf::io::CodedOutputStream coded_output(output_);
+  proto::AnalysisOutput output;
+  *output.mutable_final_result() = result;
+  coded_output.WriteVarint32(output.ByteSize());
+  output.SerializeWithCachedSizes(&coded_output);
+}
+
+void AnalysisServer::Flush() {
+  if (flushable_output_ != nullptr) {
+    flushable_output_->Flush();
+  }
+}
+
+bool AnalysisServer::Serve(const Analyzer &analyzer, std::string *error_text) {
+  for (;;) {
+    proto::AnalysisRequest request;
+    bool at_end = false;
+    if (!ReadMessage(&request, &at_end)) {
+      if (at_end) {
+        return true;
+      }
+      *error_text = "Couldn't read analysis request " +
+                    std::to_string(requests_served_);
+      return false;
+    }
+    std::vector<proto::FileData> files(
+        request.compilation().required_input_size());
+    for (size_t i = 0; i < files.size(); ++i) {
+      if (!ReadMessage(&files[i], &at_end) || !files[i].has_info()) {
+        *error_text = "Couldn't read file data for " +
+                      request.compilation().required_input(i).info().path();
+        return false;
+      }
+    }
+    ChunkedOutputStream entries;
+    entries.set_drain(max_buffered_bytes_, [this, &entries] {
+      WriteEntries(&entries);
+      Flush();
+    });
+    std::string analysis_error;
+    {
+      FileOutputStream entry_stream(&entries);
+      entry_stream.set_flush_after_each_entry(false);
+      analysis_error = analyzer(request, &files, &entry_stream);
+    }
+    proto::AnalysisResult result;
+    if (!analysis_error.empty()) {
+      result.set_status(proto::AnalysisResult::INCOMPLETE);
+      result.set_summary(analysis_error);
+    }
+    WriteEntries(&entries);
+    WriteResult(result);
+    Flush();
+    ++requests_served_;
+  }
+}
+
+}  // namespace kythe
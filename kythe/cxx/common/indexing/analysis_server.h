@@ -0,0 +1,116 @@
+/*
+ * Copyright 2017 Google Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef KYTHE_CXX_COMMON_INDEXING_ANALYSIS_SERVER_H_
+#define KYTHE_CXX_COMMON_INDEXING_ANALYSIS_SERVER_H_
+
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "google/protobuf/io/zero_copy_stream.h"
+#include "google/protobuf/io/zero_copy_stream_impl.h"
+#include "google/protobuf/message.h"
+#include "kythe/cxx/common/indexing/KytheOutputStream.h"
+#include "kythe/cxx/common/indexing/chunked_output_stream.h"
+#include "kythe/proto/analysis.pb.h"
+
+namespace kythe {
+
+/// \brief Serves the `CompilationAnalyzer` service from
+/// kythe/proto/analysis_service.proto over a pair of byte streams, so that a
+/// single indexer process can handle many requests.
+///
+/// Every message on either stream is prefixed by its varint-encoded size.
+/// Each `AnalysisRequest` is followed by one `FileData` for each of its
+/// compilation's required inputs, in order; `file_data_service` is ignored.
+/// Each request is answered with one `AnalysisOutput` per entry (holding the
+/// serialized `Entry`) and then one holding the `final_result`.
+///
+/// Entries are buffered in chunks as they are emitted and framed as
+/// `AnalysisOutput`s straight from those chunks. Once a request has buffered
+/// `max_buffered_bytes`, the entries so far are sent (and the output
+/// flushed) before analysis continues, so a large compilation doesn't have
+/// to fit in memory twice.
+class AnalysisServer {
+ public:
+  /// \brief Analyzes a request, writing its entries to `output`.
+  /// \return empty if OK; otherwise, an error description.
+  using Analyzer = std::function<std::string(
+      const proto::AnalysisRequest &request,
+      std::vector<proto::FileData> *files, KytheOutputStream *output)>;
+
+  /// \brief Serves requests from `input`, flushing `output` after each
+  /// response.
+  AnalysisServer(google::protobuf::io::ZeroCopyInputStream *input,
+                 google::protobuf::io::FileOutputStream *output)
+      : AnalysisServer(input, output, output) {}
+
+  /// \brief Serves requests from `input` to a stream that can't be flushed
+  /// (for example, an in-memory `StringOutputStream`).
+  AnalysisServer(google::protobuf::io::ZeroCopyInputStream *input,
+                 google::protobuf::io::ZeroCopyOutputStream *output)
+      : AnalysisServer(input, output, nullptr) {}
+
+  /// \brief Serves requests with `analyzer` until `input` ends.
+  /// \return false if `input` was malformed; `error_text` will say why.
+  bool Serve(const Analyzer &analyzer, std::string *error_text);
+
+  /// \return the number of requests served so far.
+  size_t requests_served() const { return requests_served_; }
+
+  /// \brief Sets how many bytes of entries a request may buffer before they
+  /// are sent.
+  void set_max_buffered_bytes(size_t bytes) { max_buffered_bytes_ = bytes; }
+
+ private:
+  AnalysisServer(google::protobuf::io::ZeroCopyInputStream *input,
+                 google::protobuf::io::ZeroCopyOutputStream *output,
+                 google::protobuf::io::FileOutputStream *flushable_output)
+      : input_(input), output_(output), flushable_output_(flushable_output) {}
+
+  /// \brief Reads a size-prefixed message from `input_`.
+  /// \param at_end Set to true if `input_` ended cleanly before the message.
+  /// \return false if no message could be read.
+  bool ReadMessage(google::protobuf::Message *message, bool *at_end);
+
+  /// \brief Writes the complete varint-delimited `Entry` messages at the
+  /// front of `entries` as `AnalysisOutput`s to `output_` and consumes them.
+  void WriteEntries(ChunkedOutputStream *entries);
+
+  /// \brief Writes `result` as the last `AnalysisOutput` of a response.
+  void WriteResult(const proto::AnalysisResult &result);
+
+  /// \brief Flushes `output_` if it can be flushed.
+  void Flush();
+
+  /// The stream to read requests from.
+  google::protobuf::io::ZeroCopyInputStream *input_;
+  /// The stream to write responses to.
+  google::protobuf::io::ZeroCopyOutputStream *output_;
+  /// `output_`, if it supports flushing; otherwise null.
+  google::protobuf::io::FileOutputStream *flushable_output_;
+  /// The number of requests served so far.
+  size_t requests_served_ = 0;
+  /// The number of bytes of entries to buffer before sending them.
+  size_t max_buffered_bytes_ = 4 * 1024 * 1024;
+  /// Scratch space for slices of entries.
+  std::vector<llvm::StringRef> slices_;
+};
+
+}  // namespace kythe
+
+#endif  // KYTHE_CXX_COMMON_INDEXING_ANALYSIS_SERVER_H_
@@ -0,0 +1,169 @@
+/*
+ * Copyright 2017 Google Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "analysis_server.h"
+
+#include "google/protobuf/io/coded_stream.h"
+#include "google/protobuf/io/zero_copy_stream_impl_lite.h"
+#include "gtest/gtest.h"
+#include "kythe/proto/storage.pb.h"
+
+namespace kythe {
+namespace {
+
+/// \brief Appends `message` to `stream`, prefixed by its size.
+void AppendMessage(const google::protobuf::Message &message,
+                   std::string *stream) {
+  google::protobuf::io::StringOutputStream raw_stream(stream);
+  google::protobuf::io::CodedOutputStream coded_stream(&raw_stream);
+  coded_stream.WriteVarint32(message.ByteSize());
+  message.SerializeWithCachedSizes(&coded_stream);
+}
+
+/// \brief Appends a request for a compilation of `path` to `stream`,
+/// followed by the file's `content`.
+void AppendRequest(const std::string &path, const std::string &content,
+                   std::string *stream) {
+  proto::AnalysisRequest request;
+  request.mutable_compilation()->add_required_input()->mutable_info()->set_path(
+      path);
+  AppendMessage(request, stream);
+  proto::FileData file;
+  file.mutable_info()->set_path(path);
+  file.set_content(content);
+  AppendMessage(file, stream);
+}
+
+/// \brief Reads every size-prefixed `AnalysisOutput` in `stream`.
+std::vector<proto::AnalysisOutput> ReadOutputs(const std::string &stream) {
+  std::vector<proto::AnalysisOutput> outputs;
+  google::protobuf::io::ArrayInputStream raw_stream(stream.data(),
+                                                    stream.size());
+  google::protobuf::io::CodedInputStream coded_stream(&raw_stream);
+  google::protobuf::uint32 byte_size;
+  while (coded_stream.ReadVarint32(&byte_size)) {
+    auto limit = coded_stream.PushLimit(byte_size);
+    outputs.emplace_back();
+    EXPECT_TRUE(outputs.back().ParseFromCodedStream(&coded_stream));
+    coded_stream.PopLimit(limit);
+  }
+  return outputs;
+}
+
+/// \brief Emits a single fact naming the request's only file, or fails if
+/// the file is empty.
+std::string AnalyzeFile(const proto::AnalysisRequest &request,
+                        std::vector<proto::FileData> *files,
+                        KytheOutputStream *output) {
+  if (files->size() != 1 || files->front().content().empty()) {
+    return "empty file";
+  }
+  VNameRef file;
+  file.path = files->front().info().path();
+  output->Emit(FactRef{&file, "/kythe/text", files->front().content()});
+  return "";
+}
+
+TEST(AnalysisServer, AnswersEachRequest) {
+  std::string input;
+  AppendRequest("a.cc", "int a;", &input);
+  AppendRequest("b.cc", "", &input);
+  std::string output;
+  google::protobuf::io::ArrayInputStream input_stream(input.data(),
+                                                      input.size());
+  {
+    google::protobuf::io::StringOutputStream output_stream(&output);
+    AnalysisServer server(&input_stream, &output_stream);
+    std::string error_text;
+    ASSERT_TRUE(server.Serve(AnalyzeFile, &error_text)) << error_text;
+    EXPECT_EQ(2, server.requests_served());
+  }
+  auto outputs = ReadOutputs(output);
+  ASSERT_EQ(3, outputs.size());
+  proto::Entry entry;
+  ASSERT_TRUE(entry.ParseFromString(outputs[0].value()));
+  EXPECT_EQ("a.cc", entry.source().path());
+  EXPECT_EQ("int a;", entry.fact_value());
+  EXPECT_TRUE(outputs[1].value().empty());
+  EXPECT_EQ(proto::AnalysisResult::COMPLETE,
+            outputs[1].final_result().status());
+  EXPECT_EQ(proto::AnalysisResult::INCOMPLETE,
+            outputs[2].final_result().status());
+  EXPECT_EQ("empty file", outputs[2].final_result().summary());
+}
+
+TEST(AnalysisServer, SendsEntriesOnceBufferIsFull) {
+  std::string input;
+  AppendRequest("a.cc", "int a;", &input);
+  std::string output;
+  google::protobuf::io::ArrayInputStream input_stream(input.data(),
+                                                      input.size());
+  std::vector<std::string> values;
+  for (int i = 0; i < 20; ++i) {
+    values.push_back(std::string(i * 10000, 'x') + std::to_string(i));
+  }
+  {
+    google::protobuf::io::StringOutputStream output_stream(&output);
+    AnalysisServer server(&input_stream, &output_stream);
+    server.set_max_buffered_bytes(1);
+    std::string error_text;
+    ASSERT_TRUE(server.Serve(
+        [&](const proto::AnalysisRequest &request,
+            std::vector<proto::FileData> *files, KytheOutputStream *output) {
+          VNameRef file;
+          file.path = "a.cc";
+          for (const auto &value : values) {
+            output->Emit(FactRef{&file, "/kythe/text", value});
+          }
+          return std::string();
+        },
+        &error_text))
+        << error_text;
+  }
+  auto outputs = ReadOutputs(output);
+  ASSERT_EQ(values.size() + 1, outputs.size());
+  for (size_t i = 0; i < values.size(); ++i) {
+    proto::Entry entry;
+    ASSERT_TRUE(entry.ParseFromString(outputs[i].value()));
+    EXPECT_EQ(values[i], entry.fact_value());
+  }
+  EXPECT_EQ(proto::AnalysisResult::COMPLETE,
+            outputs.back().final_result().status());
+}
+
+TEST(AnalysisServer, RejectsTruncatedInput) {
+  std::string input;
+  AppendRequest("a.cc", "int a;", &input);
+  input.resize(input.size() - 2);
+  std::string output;
+  google::protobuf::io::ArrayInputStream input_stream(input.data(),
+                                                      input.size());
+  google::protobuf::io::StringOutputStream output_stream(&output);
+  AnalysisServer server(&input_stream, &output_stream);
+  std::string error_text;
+  EXPECT_FALSE(server.Serve(AnalyzeFile, &error_text));
+  EXPECT_EQ("Couldn't read file data for a.cc", error_text);
+  EXPECT_EQ(0, server.requests_served());
+}
+
+}  // namespace
+}  // namespace kythe
+
+int main(int argc, char **argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  int result = RUN_ALL_TESTS();
+  return result;
+}
@@ -0,0 +1,175 @@
+/*
+ * Copyright 2017 Google Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "kythe/cxx/common/indexing/async_output_stream.h"
+
+#include <algorithm>
+#include <cassert>
+#include <climits>
+
+#include "google/protobuf/io/coded_stream.h"
+
+namespace kythe {
+
+constexpr size_t AsyncOutputStream::kDefaultChunkSize;
+constexpr size_t AsyncOutputStream::kDefaultMaxQueuedChunks;
+
+AsyncOutputStream::AsyncOutputStream(
+    google::protobuf::io::ZeroCopyOutputStream *output,
+    google::protobuf::io::FileOutputStream *flushable_output,
+    size_t chunk_size, size_t max_queued_chunks)
+    : output_(output),
+      flushable_output_(flushable_output),
+      chunk_size_(std::min<size_t>(std::max<size_t>(chunk_size, 1), INT_MAX)),
+      max_queued_chunks_(std::max<size_t>(max_queued_chunks, 1)) {
+  chunk_.resize(chunk_size_);
+  thread_ = std::thread([this] { WriteLoop(); });
+}
+
+AsyncOutputStream::~AsyncOutputStream() { Close(); }
+
+bool AsyncOutputStream::Next(void **data, int *size) {
+  if (closed_) {
+    return false;
+  }
+  if (chunk_used_ == chunk_size_) {
+    RetireChunk(false);
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (failed_) {
+      return false;
+    }
+  }
+  *data = &chunk_[chunk_used_];
+  *size = static_cast<int>(chunk_size_ - chunk_used_);
+  byte_count_ += *size;
+  chunk_used_ = chunk_size_;
+  return true;
+}
+
+void AsyncOutputStream::BackUp(int count) {
+  assert(static_cast<size_t>(count) <= chunk_used_);
+  chunk_used_ -= count;
+  byte_count_ -= count;
+}
+
+google::protobuf::int64 AsyncOutputStream::ByteCount() const {
+  return byte_count_;
+}
+
+void AsyncOutputStream::RetireChunk(bool flush) {
+  if (chunk_used_ == 0 && !(flush && unflushed_)) {
+    return;
+  }
+  unflushed_ = !flush;
+  std::unique_lock<std::mutex> lock(mutex_);
+  if (!queue_.empty() &&
+      queue_.back().data.size() + chunk_used_ <= chunk_size_) {
+    // The writer hasn't gotten to the last chunk yet, so there's no need to
+    // hand off another one.
+    queue_.back().data.append(chunk_.data(), chunk_used_);
+    queue_.back().flush |= flush;
+    chunk_used_ = 0;
+    return;
+  }
+  if (queue_.size() >= max_queued_chunks_) {
+    ++stalls_;
+    queue_changed_.wait(
+        lock, [this] { return queue_.size() < max_queued_chunks_; });
+  }
+  chunk_.resize(chunk_used_);
+  queue_.emplace_back();
+  queue_.back().data = std::move(chunk_);
+  queue_.back().flush = flush;
+  if (spare_chunks_.empty()) {
+    chunk_ = std::string();
+  } else {
+    chunk_ = std::move(spare_chunks_.back());
+    spare_chunks_.pop_back();
+  }
+  queue_changed_.notify_all();
+  lock.unlock();
+  chunk_.resize(chunk_size_);
+  chunk_used_ = 0;
+}
+
+void AsyncOutputStream::WriteChunk(const Chunk &chunk) {
+  bool had_error = false;
+  {
+    google::protobuf::io::CodedOutputStream coded_stream(output_);
+    coded_stream.WriteRaw(chunk.data.data(), chunk.data.size());
+    had_error = coded_stream.HadError();
+  }
+  if (chunk.flush && flushable_output_ != nullptr) {
+    had_error |= !flushable_output_->Flush();
+  }
+  if (had_error) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    failed_ = true;
+  }
+}
+
+void AsyncOutputStream::WriteLoop() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  for (;;) {
+    queue_changed_.wait(lock, [this] { return stopping_ || !queue_.empty(); });
+    if (queue_.empty()) {
+      return;
+    }
+    Chunk chunk = std::move(queue_.front());
+    queue_.pop_front();
+    busy_ = true;
+    // Let a producer that's waiting for room get going again.
+    queue_changed_.notify_all();
+    lock.unlock();
+    WriteChunk(chunk);
+    lock.lock();
+    busy_ = false;
+    chunk.data.clear();
+    spare_chunks_.push_back(std::move(chunk.data));
+    queue_changed_.notify_all();
+  }
+}
+
+void AsyncOutputStream::Flush() {
+  if (!closed_) {
+    RetireChunk(true);
+  }
+}
+
+bool AsyncOutputStream::Sync() {
+  Flush();
+  std::unique_lock<std::mutex> lock(mutex_);
+  queue_changed_.wait(lock, [this] { return queue_.empty() && !busy_; });
+  return !failed_;
+}
+
+bool AsyncOutputStream::Close() {
+  if (closed_) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return !failed_;
+  }
+  bool ok = Sync();
+  closed_ = true;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stopping_ = true;
+  }
+  queue_changed_.notify_all();
+  thread_.join();
+  return ok;
+}
+
+}  // namespace kythe
@@ -0,0 +1,145 @@
+/*
+ * Copyright 2017 Google Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef KYTHE_CXX_COMMON_INDEXING_ASYNC_OUTPUT_STREAM_H_
+#define KYTHE_CXX_COMMON_INDEXING_ASYNC_OUTPUT_STREAM_H_
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "google/protobuf/io/zero_copy_stream.h"
+#include "google/protobuf/io/zero_copy_stream_impl.h"
+
+namespace kythe {
+
+/// \brief A `ZeroCopyOutputStream` that copies the data written to it to
+/// another stream on a writer thread.
+///
+/// Data is collected into chunks. Full chunks (and, on `Flush`, partial
+/// ones) are handed to the writer thread, which copies them to the
+/// underlying stream; any work that stream does (like compression or
+/// `write(2)` calls) happens on the writer thread. While the writer is busy,
+/// small flushed chunks are coalesced so that flushing often doesn't mean
+/// writing often. At most `max_queued_chunks` chunks wait for the writer at
+/// once; after that, writes block until it catches up.
+class AsyncOutputStream : public google::protobuf::io::ZeroCopyOutputStream {
+ public:
+  /// \param output The stream to which to write data. Not owned. Only used
+  /// by the writer thread until the stream is closed.
+  /// \param flushable_output `output`, if it can be flushed; otherwise null.
+  /// \param chunk_size The amount of data to collect before handing it off.
+  /// \param max_queued_chunks The number of chunks that may wait for the
+  /// writer.
+  AsyncOutputStream(google::protobuf::io::ZeroCopyOutputStream *output,
+                    google::protobuf::io::FileOutputStream *flushable_output,
+                    size_t chunk_size = kDefaultChunkSize,
+                    size_t max_queued_chunks = kDefaultMaxQueuedChunks);
+
+  /// \brief Calls `Close()`.
+  ~AsyncOutputStream() override;
+
+  bool Next(void **data, int *size) override;
+  void BackUp(int count) override;
+  google::protobuf::int64 ByteCount() const override;
+
+  /// \brief Hands off all data written so far without waiting for it to be
+  /// written. Once the writer has copied it to the underlying stream, that
+  /// stream is flushed (if it can be).
+  void Flush();
+
+  /// \brief Hands off all data written so far and waits until it has been
+  /// written (and flushed, if the underlying stream can be flushed).
+  /// \return false if writing to the underlying stream failed.
+  bool Sync();
+
+  /// \brief Writes all data and stops the writer thread. No more data may
+  /// be written after the stream is closed.
+  /// \return false if writing to the underlying stream failed.
+  bool Close();
+
+  /// \return how many times a write has waited for the writer to catch up.
+  size_t stalls() const { return stalls_; }
+
+  /// The default amount of data to collect before handing it off.
+  static constexpr size_t kDefaultChunkSize = 256 * 1024;
+  /// The default number of chunks that may wait for the writer.
+  static constexpr size_t kDefaultMaxQueuedChunks = 4;
+
+ private:
+  /// \brief Data handed off to the writer.
+  struct Chunk {
+    /// The data to write.
+    std::string data;
+    /// Whether to flush the underlying stream after writing `data`.
+    bool flush = false;
+  };
+
+  /// \brief Hands off the first `chunk_used_` bytes of `chunk_`.
+  /// \param flush Whether the underlying stream should be flushed after
+  /// they're written.
+  void RetireChunk(bool flush);
+
+  /// \brief Copies `chunk` to `output_`.
+  void WriteChunk(const Chunk &chunk);
+
+  /// \brief Writes chunks from `queue_` until the stream is closed.
+  void WriteLoop();
+
+  /// The stream to which we write data.
+  google::protobuf::io::ZeroCopyOutputStream *output_;
+  /// `output_`, if it can be flushed; otherwise null.
+  google::protobuf::io::FileOutputStream *flushable_output_;
+  /// The size of each chunk.
+  size_t chunk_size_;
+  /// The number of chunks that may wait in `queue_`.
+  size_t max_queued_chunks_;
+  /// The chunk that's being filled.
+  std::string chunk_;
+  /// The number of bytes in `chunk_` that are in use.
+  size_t chunk_used_ = 0;
+  /// The total number of bytes written to this stream.
+  google::protobuf::int64 byte_count_ = 0;
+  /// Set if data has been handed off since the last flushed chunk was.
+  bool unflushed_ = false;
+  /// How many times `RetireChunk` has waited for room in `queue_`.
+  size_t stalls_ = 0;
+  /// Set after `Close()` has been called.
+  bool closed_ = false;
+  /// The writer thread.
+  std::thread thread_;
+  /// Guards `queue_`, `spare_chunks_`, `busy_`, `stopping_`, and `failed_`.
+  std::mutex mutex_;
+  /// Signalled when `queue_` or `busy_` changes.
+  std::condition_variable queue_changed_;
+  /// Chunks waiting to be written by the writer thread.
+  std::deque<Chunk> queue_;
+  /// Chunk buffers that are free for reuse.
+  std::vector<std::string> spare_chunks_;
+  /// Set while the writer thread is writing a chunk.
+  bool busy_ = false;
+  /// Set when the writer thread should exit.
+  bool stopping_ = false;
+  /// Set if writing to `output_` failed.
+  bool failed_ = false;
+};
+
+}  // namespace kythe
+
+#endif  // KYTHE_CXX_COMMON_INDEXING_ASYNC_OUTPUT_STREAM_H_
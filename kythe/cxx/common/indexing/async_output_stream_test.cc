@@ -0,0 +1,93 @@
+/*
+ * Copyright 2017 Google Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "async_output_stream.h"
+
+#include <unistd.h>
+
+#include <string>
+
+#include "google/protobuf/io/coded_stream.h"
+#include "google/protobuf/io/zero_copy_stream_impl.h"
+#include "google/protobuf/io/zero_copy_stream_impl_lite.h"
+#include "gtest/gtest.h"
+
+namespace kythe {
+namespace {
+
+/// \brief Writes `data` to `stream` in one go.
+void Write(google::protobuf::io::ZeroCopyOutputStream *stream,
+           const std::string &data) {
+  google::protobuf::io::CodedOutputStream coded_stream(stream);
+  coded_stream.WriteRaw(data.data(), data.size());
+}
+
+TEST(AsyncOutputStream, CopiesDataInOrder) {
+  std::string expected;
+  for (int i = 0; i < 10000; ++i) {
+    expected.append(std::to_string(i));
+  }
+  std::string out;
+  {
+    google::protobuf::io::StringOutputStream raw_stream(&out);
+    // Small chunks and a short queue, so that the writer falls behind.
+    AsyncOutputStream stream(&raw_stream, nullptr, 16, 1);
+    for (size_t i = 0; i < expected.size(); i += 7) {
+      Write(&stream, expected.substr(i, 7));
+      if (i % 5 == 0) {
+        stream.Flush();
+      }
+    }
+    EXPECT_EQ(expected.size(), stream.ByteCount());
+    EXPECT_TRUE(stream.Close());
+  }
+  EXPECT_EQ(expected, out);
+}
+
+TEST(AsyncOutputStream, SyncFlushesUnderlyingStream) {
+  int fds[2];
+  ASSERT_EQ(0, ::pipe(fds));
+  google::protobuf::io::FileOutputStream raw_stream(fds[1]);
+  AsyncOutputStream stream(&raw_stream, &raw_stream);
+  Write(&stream, "hello");
+  EXPECT_TRUE(stream.Sync());
+  char data[6] = {0};
+  EXPECT_EQ(5, ::read(fds[0], data, sizeof(data)));
+  EXPECT_EQ(std::string("hello"), data);
+  EXPECT_TRUE(stream.Close());
+  EXPECT_TRUE(raw_stream.Close());
+  ::close(fds[0]);
+}
+
+TEST(AsyncOutputStream, ReportsWriteErrors) {
+  int fds[2];
+  ASSERT_EQ(0, ::pipe(fds));
+  ::close(fds[1]);
+  google::protobuf::io::FileOutputStream raw_stream(fds[0]);
+  AsyncOutputStream stream(&raw_stream, &raw_stream);
+  Write(&stream, "can't be written to the read end of a pipe");
+  EXPECT_FALSE(stream.Close());
+  ::close(fds[0]);
+}
+
+}  // namespace
+}  // namespace kythe
+
+int main(int argc, char **argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  int result = RUN_ALL_TESTS();
+  return result;
+}
@@ -0,0 +1,125 @@
+/*
+ * Copyright 2017 Google Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "kythe/cxx/common/indexing/buffer_digest.h"
+
+#include <algorithm>
+#include <cstring>
+
+namespace kythe {
+namespace {
+constexpr uint64_t kC1 = 0x87c37b91114253d5ull;
+constexpr uint64_t kC2 = 0x4cf5ad432745937full;
+
+inline uint64_t Rotl64(uint64_t x, int r) { return (x << r) | (x >> (64 - r)); }
+
+/// \brief Reads a little-endian 64-bit word.
+inline uint64_t Load64(const unsigned char *data) {
+  uint64_t word;
+  ::memcpy(&word, data, sizeof(word));
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+  word = __builtin_bswap64(word);
+#endif
+  return word;
+}
+
+/// \brief Writes a little-endian 64-bit word.
+inline void Store64(uint64_t word, unsigned char *data) {
+  for (int i = 0; i < 8; ++i) {
+    data[i] = static_cast<unsigned char>(word >> (8 * i));
+  }
+}
+
+inline uint64_t FMix64(uint64_t k) {
+  k ^= k >> 33;
+  k *= 0xff51afd7ed558ccdull;
+  k ^= k >> 33;
+  k *= 0xc4ceb9fe1a85ec53ull;
+  k ^= k >> 33;
+  return k;
+}
+
+inline uint64_t MixK1(uint64_t k1) { return Rotl64(k1 * kC1, 31) * kC2; }
+
+inline uint64_t MixK2(uint64_t k2) { return Rotl64(k2 * kC2, 33) * kC1; }
+}  // anonymous namespace
+
+bool ParseBufferDigest(const std::string &name, BufferDigest *digest) {
+  if (name == "sha256") {
+    *digest = BufferDigest::kSha256;
+  } else if (name == "murmur3") {
+    *digest = BufferDigest::kMurmur3;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+void Murmur3Hasher::MixBlock(const unsigned char *block) {
+  h1_ ^= MixK1(Load64(block));
+  h1_ = Rotl64(h1_, 27) + h2_;
+  h1_ = h1_ * 5 + 0x52dce729;
+  h2_ ^= MixK2(Load64(block + 8));
+  h2_ = Rotl64(h2_, 31) + h1_;
+  h2_ = h2_ * 5 + 0x38495ab5;
+}
+
+void Murmur3Hasher::Update(const void *data, size_t size) {
+  const auto *bytes = static_cast<const unsigned char *>(data);
+  length_ += size;
+  if (tail_size_ != 0) {
+    size_t fill = std::min(size, sizeof(tail_) - tail_size_);
+    ::memcpy(tail_ + tail_size_, bytes, fill);
+    tail_size_ += fill;
+    bytes += fill;
+    size -= fill;
+    if (tail_size_ < sizeof(tail_)) {
+      return;
+    }
+    MixBlock(tail_);
+    tail_size_ = 0;
+  }
+  for (; size >= 16; bytes += 16, size -= 16) {
+    MixBlock(bytes);
+  }
+  ::memcpy(tail_, bytes, size);
+  tail_size_ = size;
+}
+
+void Murmur3Hasher::Final(unsigned char *digest) {
+  if (tail_size_ > 8) {
+    unsigned char k2[8] = {0};
+    ::memcpy(k2, tail_ + 8, tail_size_ - 8);
+    h2_ ^= MixK2(Load64(k2));
+  }
+  if (tail_size_ > 0) {
+    unsigned char k1[8] = {0};
+    ::memcpy(k1, tail_, std::min<size_t>(tail_size_, 8));
+    h1_ ^= MixK1(Load64(k1));
+  }
+  h1_ ^= length_;
+  h2_ ^= length_;
+  h1_ += h2_;
+  h2_ += h1_;
+  h1_ = FMix64(h1_);
+  h2_ = FMix64(h2_);
+  h1_ += h2_;
+  h2_ += h1_;
+  Store64(h1_, digest);
+  Store64(h2_, digest + 8);
+}
+
+}  // namespace kythe
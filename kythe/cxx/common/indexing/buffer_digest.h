@@ -0,0 +1,74 @@
+/*
+ * Copyright 2017 Google Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef KYTHE_CXX_COMMON_INDEXING_BUFFER_DIGEST_H_
+#define KYTHE_CXX_COMMON_INDEXING_BUFFER_DIGEST_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+namespace kythe {
+
+/// \brief The digests `BufferStack` can use to hash buffers.
+enum class BufferDigest {
+  /// SHA-256. OpenSSL uses the SHA extensions (x86 SHA-NI or the ARMv8
+  /// crypto extensions) when the CPU has them.
+  kSha256,
+  /// MurmurHash3 (x64, 128-bit). Much cheaper than SHA-256, but not
+  /// collision-resistant: only use it with caches that nobody else writes.
+  kMurmur3
+};
+
+/// \brief Parses a digest name ("sha256" or "murmur3").
+/// \return false if `name` isn't a known digest.
+bool ParseBufferDigest(const std::string &name, BufferDigest *digest);
+
+/// \brief Computes the 128-bit x64 variant of MurmurHash3 incrementally.
+///
+/// The result is the same as hashing the concatenation of all the data
+/// passed to `Update` at once, and doesn't depend on the host's byte order.
+class Murmur3Hasher {
+ public:
+  /// The size of the digest in bytes.
+  static constexpr size_t kDigestSize = 16;
+
+  explicit Murmur3Hasher(uint64_t seed = 0) : h1_(seed), h2_(seed) {}
+
+  /// \brief Hashes `size` more bytes at `data`.
+  void Update(const void *data, size_t size);
+
+  /// \brief Writes the digest to `digest`. The hasher mustn't be used
+  /// afterward.
+  void Final(unsigned char *digest);
+
+ private:
+  /// \brief Mixes a 16-byte block into the state.
+  void MixBlock(const unsigned char *block);
+
+  /// The state.
+  uint64_t h1_, h2_;
+  /// Bytes that don't make up a full block yet.
+  unsigned char tail_[16];
+  /// The number of bytes in `tail_`.
+  size_t tail_size_ = 0;
+  /// The total number of bytes hashed.
+  uint64_t length_ = 0;
+};
+
+}  // namespace kythe
+
+#endif  // KYTHE_CXX_COMMON_INDEXING_BUFFER_DIGEST_H_
@@ -0,0 +1,98 @@
+/*
+ * Copyright 2017 Google Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "buffer_digest.h"
+
+#include <algorithm>
+#include <cstring>
+#include <string>
+
+#include "KytheOutputStream.h"
+#include "gtest/gtest.h"
+
+namespace kythe {
+namespace {
+
+/// \return the digest of `data` as a hex string, hashing it in pieces of at
+/// most `piece_size` bytes.
+std::string HexDigest(const std::string &data, size_t piece_size) {
+  Murmur3Hasher hasher;
+  for (size_t at = 0; at < data.size(); at += piece_size) {
+    hasher.Update(data.data() + at, std::min(piece_size, data.size() - at));
+  }
+  unsigned char digest[Murmur3Hasher::kDigestSize];
+  hasher.Final(digest);
+  std::string hex;
+  for (unsigned char byte : digest) {
+    hex.push_back("0123456789abcdef"[byte >> 4]);
+    hex.push_back("0123456789abcdef"[byte & 15]);
+  }
+  return hex;
+}
+
+TEST(Murmur3Hasher, MatchesReferenceValues) {
+  EXPECT_EQ("00000000000000000000000000000000", HexDigest("", 1));
+  EXPECT_EQ("029bbd41b3a7d8cb191dae486a901e5b", HexDigest("hello", 5));
+  EXPECT_EQ("6c1b07bc7bbc4be347939ac4a93c437a",
+            HexDigest("The quick brown fox jumps over the lazy dog", 64));
+}
+
+TEST(Murmur3Hasher, IgnoresHowInputIsSplit) {
+  std::string data;
+  for (int i = 0; i < 3 * 256; ++i) {
+    data.push_back(static_cast<char>(i));
+  }
+  EXPECT_EQ("b626b903306c92cf3846f3e2e5d953fa", HexDigest(data, data.size()));
+  for (size_t piece_size : {1, 7, 15, 16, 17, 100}) {
+    EXPECT_EQ(HexDigest(data, data.size()), HexDigest(data, piece_size));
+  }
+}
+
+TEST(BufferDigest, ParsesNames) {
+  BufferDigest digest = BufferDigest::kSha256;
+  EXPECT_TRUE(ParseBufferDigest("murmur3", &digest));
+  EXPECT_EQ(BufferDigest::kMurmur3, digest);
+  EXPECT_TRUE(ParseBufferDigest("sha256", &digest));
+  EXPECT_EQ(BufferDigest::kSha256, digest);
+  EXPECT_FALSE(ParseBufferDigest("md5", &digest));
+}
+
+TEST(BufferDigest, HashTopUsesSelectedDigest) {
+  BufferStack stack;
+  stack.Push(64);
+  memcpy(stack.WriteToTop(5), "hello", 5);
+  HashCache::Hash sha256, murmur3, murmur3_again;
+  stack.HashTop(&sha256);
+  stack.set_digest(BufferDigest::kMurmur3);
+  stack.HashTop(&murmur3);
+  stack.HashTop(&murmur3_again);
+  EXPECT_NE(0, memcmp(sha256, murmur3, HashCache::kHashSize));
+  EXPECT_EQ(0, memcmp(murmur3, murmur3_again, HashCache::kHashSize));
+  unsigned char digest[Murmur3Hasher::kDigestSize];
+  Murmur3Hasher hasher;
+  hasher.Update("hello", 5);
+  hasher.Final(digest);
+  EXPECT_EQ(0, memcmp(digest, murmur3, sizeof(digest)));
+}
+
+}  // namespace
+}  // namespace kythe
+
+int main(int argc, char **argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  int result = RUN_ALL_TESTS();
+  return result;
+}
@@ -0,0 +1,101 @@
+/*
+ * Copyright 2017 Google Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "kythe/cxx/common/indexing/buffer_size_tuner.h"
+
+#include <algorithm>
+#include <cstdio>
+
+#include "glog/logging.h"
+
+namespace kythe {
+
+BufferSizeTuner::BufferSizeTuner(const Options &options)
+    : options_(options),
+      min_ratio_(options.max_size == 0 ? 0.0
+                                       : static_cast<double>(options.min_size) /
+                                             options.max_size),
+      max_size_(std::min(options.largest_max_size,
+                         std::max(options.smallest_max_size,
+                                  options.max_size))) {
+  CHECK_LE(options.smallest_max_size, options.largest_max_size);
+  CHECK_GT(options.step, 1.0);
+}
+
+void BufferSizeTuner::GetLimits(size_t *min_size, size_t *max_size) const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  *max_size = max_size_;
+  *min_size = static_cast<size_t>(max_size_ * min_ratio_);
+}
+
+bool BufferSizeTuner::Scale(double factor) {
+  size_t scaled = static_cast<size_t>(max_size_ * factor);
+  scaled = std::min(options_.largest_max_size,
+                    std::max(options_.smallest_max_size, scaled));
+  if (scaled == max_size_) {
+    return false;
+  }
+  max_size_ = scaled;
+  return true;
+}
+
+bool BufferSizeTuner::Report(const Sample &sample) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  window_.bytes += sample.bytes;
+  window_.bytes_matched += sample.bytes_matched;
+  window_.lookup_usec += sample.lookup_usec;
+  window_.elapsed_usec += sample.elapsed_usec;
+  if (window_.bytes < options_.window_bytes) {
+    return false;
+  }
+  double matched = static_cast<double>(window_.bytes_matched) / window_.bytes;
+  double stalled =
+      window_.elapsed_usec == 0
+          ? 0.0
+          : std::min(1.0, static_cast<double>(window_.lookup_usec) /
+                              window_.elapsed_usec);
+  double score = matched - stalled;
+  window_ = Sample();
+  if (score < last_score_) {
+    growing_ = !growing_;
+  }
+  last_score_ = score;
+  last_matched_ = matched;
+  last_stalled_ = stalled;
+  // At a bound this holds still until the score gets worse.
+  bool changed = Scale(growing_ ? options_.step : 1.0 / options_.step);
+  ++steps_;
+  // The lock is held, so this can't call ToString.
+  size_t min_size = static_cast<size_t>(max_size_ * min_ratio_);
+  LOG(INFO) << "Buffer sizes: min " << min_size << " max " << max_size_
+            << " after window " << steps_ << " ("
+            << static_cast<int>(matched * 100) << "% bytes matched, "
+            << static_cast<int>(stalled * 100) << "% time waiting for cache)";
+  return changed;
+}
+
+std::string BufferSizeTuner::ToString() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  char buffer[160];
+  ::snprintf(buffer, sizeof(buffer),
+             "min %zu max %zu after %zu windows (%.1f%% bytes matched, %.1f%% "
+             "time waiting for cache)",
+             static_cast<size_t>(max_size_ * min_ratio_), max_size_, steps_,
+             last_matched_ * 100, last_stalled_ * 100);
+  return buffer;
+}
+
+}  // namespace kythe
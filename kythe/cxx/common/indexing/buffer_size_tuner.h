@@ -0,0 +1,110 @@
+/*
+ * Copyright 2017 Google Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef KYTHE_CXX_COMMON_INDEXING_BUFFER_SIZE_TUNER_H_
+#define KYTHE_CXX_COMMON_INDEXING_BUFFER_SIZE_TUNER_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <string>
+
+namespace kythe {
+
+/// \brief Adjusts the size limits that `FileOutputStream`s use to merge
+/// and split buffers, based on how well the buffers deduplicate.
+///
+/// Streams report what happened to the buffers they retired. Every
+/// `window_bytes` of reports, the tuner scores the window as the fraction
+/// of bytes that matched the hash cache minus the fraction of time spent
+/// waiting for it, and moves the limits a step: in the same direction as
+/// the last step if the score didn't get worse, otherwise back. At a bound,
+/// the limits stay put until the score gets worse. Larger
+/// buffers mean fewer lookups but fewer matches, so this climbs toward the
+/// best tradeoff for the corpus and the state of the cache. The ratio
+/// between the minimum and maximum size is kept. Thread-safe; streams on
+/// several workers can share one tuner.
+class BufferSizeTuner {
+ public:
+  struct Options {
+    /// The limits to start with.
+    size_t min_size = 4096;
+    size_t max_size = 32 * 1024;
+    /// The bounds on the maximum size.
+    size_t smallest_max_size = 4096;
+    size_t largest_max_size = 256 * 1024;
+    /// How many bytes of buffers to see between adjustments.
+    uint64_t window_bytes = 16 << 20;
+    /// How much to scale the limits by at each step.
+    double step = 1.25;
+  };
+
+  /// \brief What happened to some retired buffers.
+  struct Sample {
+    /// The total size of the buffers.
+    uint64_t bytes = 0;
+    /// The total size of the buffers that the hash cache had seen.
+    uint64_t bytes_matched = 0;
+    /// How long was spent waiting for the hash cache, in microseconds.
+    uint64_t lookup_usec = 0;
+    /// How long the stream took to produce the buffers, in microseconds.
+    uint64_t elapsed_usec = 0;
+  };
+
+  explicit BufferSizeTuner(const Options &options);
+
+  /// \brief Gets the limits streams should use now.
+  void GetLimits(size_t *min_size, size_t *max_size) const;
+
+  /// \brief Records `sample` and adjusts the limits at the end of a window.
+  /// \return true if the limits changed.
+  bool Report(const Sample &sample);
+
+  /// \return a description of the current limits and the last window's
+  /// score.
+  std::string ToString() const;
+
+ private:
+  /// \brief Scales the limits by `factor`, within bounds.
+  /// \return false if the limits were already at the bound.
+  bool Scale(double factor);
+
+  /// The fixed parameters.
+  const Options options_;
+  /// The ratio of the minimum to the maximum size.
+  const double min_ratio_;
+  /// Guards the state below.
+  mutable std::mutex mutex_;
+  /// The current maximum size.
+  size_t max_size_;
+  /// The reports for the current window.
+  Sample window_;
+  /// The score of the last complete window, or a negative number if
+  /// there wasn't one.
+  double last_score_ = -2.0;
+  /// The fractions of bytes matched and of time spent waiting in the last
+  /// complete window.
+  double last_matched_ = 0.0;
+  double last_stalled_ = 0.0;
+  /// Whether the last step made the limits larger.
+  bool growing_ = true;
+  /// The number of adjustments made.
+  size_t steps_ = 0;
+};
+
+}  // namespace kythe
+
+#endif  // KYTHE_CXX_COMMON_INDEXING_BUFFER_SIZE_TUNER_H_
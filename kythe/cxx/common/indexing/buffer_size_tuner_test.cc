@@ -0,0 +1,122 @@
+/*
+ * Copyright 2017 Google Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "kythe/cxx/common/indexing/buffer_size_tuner.h"
+
+#include <cmath>
+
+#include "gtest/gtest.h"
+
+namespace kythe {
+namespace {
+
+BufferSizeTuner::Options SmallWindows() {
+  BufferSizeTuner::Options options;
+  options.min_size = 1024;
+  options.max_size = 8192;
+  options.smallest_max_size = 2048;
+  options.largest_max_size = 1 << 20;
+  options.window_bytes = 1000;
+  options.step = 2.0;
+  return options;
+}
+
+/// \return a full window in which `matched` of the bytes matched and
+/// `stalled` of the time was spent waiting.
+BufferSizeTuner::Sample Window(double matched, double stalled) {
+  BufferSizeTuner::Sample sample;
+  sample.bytes = 1000;
+  sample.bytes_matched = static_cast<uint64_t>(matched * 1000);
+  sample.elapsed_usec = 1000;
+  sample.lookup_usec = static_cast<uint64_t>(stalled * 1000);
+  return sample;
+}
+
+TEST(BufferSizeTuner, StartsWithTheGivenLimits) {
+  BufferSizeTuner tuner(SmallWindows());
+  size_t min_size, max_size;
+  tuner.GetLimits(&min_size, &max_size);
+  EXPECT_EQ(1024, min_size);
+  EXPECT_EQ(8192, max_size);
+}
+
+TEST(BufferSizeTuner, WaitsForAFullWindow) {
+  BufferSizeTuner tuner(SmallWindows());
+  BufferSizeTuner::Sample sample = Window(0.5, 0.0);
+  sample.bytes = 600;
+  EXPECT_FALSE(tuner.Report(sample));
+  EXPECT_TRUE(tuner.Report(sample));
+  size_t min_size, max_size;
+  tuner.GetLimits(&min_size, &max_size);
+  // The first step grows the limits, keeping their ratio.
+  EXPECT_EQ(16384, max_size);
+  EXPECT_EQ(2048, min_size);
+}
+
+TEST(BufferSizeTuner, StaysWithinBounds) {
+  BufferSizeTuner tuner(SmallWindows());
+  size_t min_size, max_size;
+  // A score that always improves keeps pushing the limits up.
+  for (int i = 0; i < 40; ++i) {
+    tuner.Report(Window(i / 40.0, 0.0));
+    tuner.GetLimits(&min_size, &max_size);
+    EXPECT_GE(max_size, 2048);
+    EXPECT_LE(max_size, 1 << 20);
+  }
+  EXPECT_EQ(1 << 20, max_size);
+}
+
+TEST(BufferSizeTuner, ClimbsToTheBestSize) {
+  BufferSizeTuner tuner(SmallWindows());
+  // Buffers dedup worse as they grow, but lookups stall less: the score is
+  // best at a maximum size of 64KiB.
+  auto score = [](size_t max_size) {
+    double distance = std::log2(max_size) - 16;
+    return 0.5 - 0.05 * distance * distance;
+  };
+  size_t min_size, max_size;
+  for (int i = 0; i < 30; ++i) {
+    tuner.GetLimits(&min_size, &max_size);
+    tuner.Report(Window(score(max_size), 0.0));
+  }
+  // It settles around the peak, stepping back and forth.
+  for (int i = 0; i < 10; ++i) {
+    tuner.GetLimits(&min_size, &max_size);
+    EXPECT_GE(max_size, 32768);
+    EXPECT_LE(max_size, 131072);
+    tuner.Report(Window(score(max_size), 0.0));
+  }
+}
+
+TEST(BufferSizeTuner, StallsCountAgainstLargerBuffers) {
+  BufferSizeTuner tuner(SmallWindows());
+  size_t min_size, max_size;
+  tuner.GetLimits(&min_size, &max_size);
+  // Growing made waiting for the cache worse, so the next step shrinks.
+  tuner.Report(Window(0.5, 0.1));
+  tuner.Report(Window(0.5, 0.3));
+  tuner.GetLimits(&min_size, &max_size);
+  EXPECT_EQ(8192, max_size);
+}
+
+}  // namespace
+}  // namespace kythe
+
+int main(int argc, char **argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  int result = RUN_ALL_TESTS();
+  return result;
+}
@@ -0,0 +1,117 @@
+/*
+ * Copyright 2017 Google Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "kythe/cxx/common/indexing/chunked_output_stream.h"
+
+#include <algorithm>
+#include <cassert>
+
+namespace kythe {
+namespace {
+/// The number of consumed chunks to keep for reuse.
+constexpr size_t kMaxFreeChunks = 4;
+}  // anonymous namespace
+
+ChunkedOutputStream::ChunkedOutputStream(size_t chunk_size)
+    : chunk_size_(std::max<size_t>(chunk_size, 16)) {}
+
+bool ChunkedOutputStream::Next(void **data, int *size) {
+  if (drain_ && size_ >= high_water_) {
+    drain_();
+  }
+  if (chunks_.empty() || tail_ == chunk_size_) {
+    if (free_chunks_.empty()) {
+      chunks_.emplace_back(new char[chunk_size_]);
+    } else {
+      chunks_.push_back(std::move(free_chunks_.back()));
+      free_chunks_.pop_back();
+    }
+    tail_ = 0;
+  }
+  size_t available = chunk_size_ - tail_;
+  *data = chunks_.back().get() + tail_;
+  *size = available;
+  tail_ = chunk_size_;
+  size_ += available;
+  byte_count_ += available;
+  return true;
+}
+
+void ChunkedOutputStream::BackUp(int count) {
+  assert(count >= 0 && static_cast<size_t>(count) <= tail_);
+  tail_ -= count;
+  size_ -= count;
+  byte_count_ -= count;
+}
+
+unsigned char ChunkedOutputStream::at(size_t offset) const {
+  size_t position = head_ + offset;
+  return chunks_[position / chunk_size_][position % chunk_size_];
+}
+
+void ChunkedOutputStream::Slices(size_t begin, size_t end,
+                                 std::vector<llvm::StringRef> *slices) const {
+  assert(begin <= end && end <= size_);
+  size_t position = head_ + begin;
+  for (size_t left = end - begin; left > 0;) {
+    size_t offset = position % chunk_size_;
+    size_t length = std::min(chunk_size_ - offset, left);
+    slices->emplace_back(chunks_[position / chunk_size_].get() + offset,
+                         length);
+    position += length;
+    left -= length;
+  }
+}
+
+bool ChunkedOutputStream::ReadVarint32(size_t offset, uint32_t *value,
+                                       size_t *length) const {
+  uint32_t result = 0;
+  for (size_t i = 0; i < 5; ++i) {
+    if (offset + i >= size_) {
+      return false;
+    }
+    unsigned char byte = at(offset + i);
+    if (i == 4 && byte > 0x0f) {
+      return false;
+    }
+    result |= static_cast<uint32_t>(byte & 0x7f) << (7 * i);
+    if ((byte & 0x80) == 0) {
+      *value = result;
+      *length = i + 1;
+      return true;
+    }
+  }
+  return false;
+}
+
+void ChunkedOutputStream::Consume(size_t count) {
+  assert(count <= size_);
+  size_ -= count;
+  head_ += count;
+  while (!chunks_.empty() && head_ >= chunk_size_) {
+    if (free_chunks_.size() < kMaxFreeChunks) {
+      free_chunks_.push_back(std::move(chunks_.front()));
+    }
+    chunks_.pop_front();
+    head_ -= chunk_size_;
+  }
+  if (chunks_.empty()) {
+    head_ = 0;
+    tail_ = 0;
+  }
+}
+
+}  // namespace kythe
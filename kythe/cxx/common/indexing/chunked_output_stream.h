@@ -0,0 +1,102 @@
+/*
+ * Copyright 2017 Google Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef KYTHE_CXX_COMMON_INDEXING_CHUNKED_OUTPUT_STREAM_H_
+#define KYTHE_CXX_COMMON_INDEXING_CHUNKED_OUTPUT_STREAM_H_
+
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <vector>
+
+#include "google/protobuf/io/zero_copy_stream.h"
+#include "llvm/ADT/StringRef.h"
+
+namespace kythe {
+
+/// \brief A `ZeroCopyOutputStream` that keeps what is written to it in a
+/// list of fixed-size chunks until it is consumed from the front.
+///
+/// Unlike a `StringOutputStream`, nothing is copied as the stream grows, and
+/// chunks that have been consumed are reused. Consumers read the buffered
+/// bytes in place as slices. A drain callback may be set to consume data
+/// once too much of it is buffered, which bounds the stream's memory use.
+class ChunkedOutputStream : public google::protobuf::io::ZeroCopyOutputStream {
+ public:
+  /// \param chunk_size The size of each chunk.
+  explicit ChunkedOutputStream(size_t chunk_size = kDefaultChunkSize);
+
+  bool Next(void **data, int *size) override;
+  void BackUp(int count) override;
+  google::protobuf::int64 ByteCount() const override { return byte_count_; }
+
+  /// \return the number of bytes written but not yet consumed.
+  size_t size() const { return size_; }
+
+  /// \brief Calls `drain` from `Next` whenever at least `high_water` bytes
+  /// are buffered. Everything written before that call is available to it.
+  void set_drain(size_t high_water, std::function<void()> drain) {
+    high_water_ = high_water;
+    drain_ = std::move(drain);
+  }
+
+  /// \brief Appends the buffered bytes in [`begin`, `end`) to `slices`.
+  /// \pre `begin <= end <= size()`.
+  void Slices(size_t begin, size_t end,
+              std::vector<llvm::StringRef> *slices) const;
+
+  /// \brief Reads the varint at `offset` into `value`.
+  /// \param length Set to the number of bytes in the varint.
+  /// \return false if the buffered bytes end before the varint does (or it
+  /// doesn't fit in 32 bits).
+  bool ReadVarint32(size_t offset, uint32_t *value, size_t *length) const;
+
+  /// \brief Discards the first `count` buffered bytes.
+  /// \pre `count <= size()`.
+  void Consume(size_t count);
+
+  /// The default chunk size.
+  static constexpr size_t kDefaultChunkSize = 64 * 1024;
+
+ private:
+  /// \return the byte at `offset` in the buffered data.
+  unsigned char at(size_t offset) const;
+
+  /// The size of each chunk.
+  const size_t chunk_size_;
+  /// Chunks holding buffered data, oldest first. The last one may be
+  /// partly filled.
+  std::deque<std::unique_ptr<char[]>> chunks_;
+  /// Consumed chunks kept for reuse.
+  std::vector<std::unique_ptr<char[]>> free_chunks_;
+  /// The offset in the first chunk of the first buffered byte.
+  size_t head_ = 0;
+  /// The number of bytes used in the last chunk.
+  size_t tail_ = 0;
+  /// The number of buffered bytes.
+  size_t size_ = 0;
+  /// The number of bytes ever written.
+  google::protobuf::int64 byte_count_ = 0;
+  /// Call `drain_` once this many bytes are buffered.
+  size_t high_water_ = 0;
+  /// If set, consumes buffered data.
+  std::function<void()> drain_;
+};
+
+}  // namespace kythe
+
+#endif  // KYTHE_CXX_COMMON_INDEXING_CHUNKED_OUTPUT_STREAM_H_
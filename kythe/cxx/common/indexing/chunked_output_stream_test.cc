@@ -0,0 +1,122 @@
+/*
+ * Copyright 2017 Google Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "kythe/cxx/common/indexing/chunked_output_stream.h"
+
+#include <string>
+
+#include "google/protobuf/io/coded_stream.h"
+#include "gtest/gtest.h"
+
+namespace kythe {
+namespace {
+
+/// \return the buffered bytes in [`begin`, `end`) of `stream`.
+std::string Read(const ChunkedOutputStream &stream, size_t begin,
+                 size_t end) {
+  std::vector<llvm::StringRef> slices;
+  stream.Slices(begin, end, &slices);
+  std::string result;
+  for (const auto &slice : slices) {
+    result.append(slice.data(), slice.size());
+  }
+  return result;
+}
+
+TEST(ChunkedOutputStream, KeepsDataAcrossChunks) {
+  ChunkedOutputStream stream(16);
+  std::string data;
+  for (int i = 0; i < 100; ++i) {
+    data.push_back('a' + i % 26);
+  }
+  {
+    google::protobuf::io::CodedOutputStream coded_stream(&stream);
+    coded_stream.WriteRaw(data.data(), data.size());
+  }
+  EXPECT_EQ(data.size(), stream.size());
+  EXPECT_EQ(data.size(), stream.ByteCount());
+  EXPECT_EQ(data, Read(stream, 0, stream.size()));
+  EXPECT_EQ(data.substr(10, 30), Read(stream, 10, 40));
+  std::vector<llvm::StringRef> slices;
+  stream.Slices(10, 40, &slices);
+  EXPECT_EQ(3, slices.size());
+}
+
+TEST(ChunkedOutputStream, ConsumesFromTheFront) {
+  ChunkedOutputStream stream(16);
+  std::string data(40, 'x');
+  data += "tail";
+  {
+    google::protobuf::io::CodedOutputStream coded_stream(&stream);
+    coded_stream.WriteRaw(data.data(), data.size());
+  }
+  stream.Consume(40);
+  EXPECT_EQ(4, stream.size());
+  EXPECT_EQ("tail", Read(stream, 0, 4));
+  {
+    google::protobuf::io::CodedOutputStream coded_stream(&stream);
+    coded_stream.WriteRaw("more", 4);
+  }
+  EXPECT_EQ("tailmore", Read(stream, 0, stream.size()));
+  stream.Consume(stream.size());
+  EXPECT_EQ(0, stream.size());
+  EXPECT_EQ(data.size() + 4, stream.ByteCount());
+}
+
+TEST(ChunkedOutputStream, ReadsVarints) {
+  ChunkedOutputStream stream(16);
+  {
+    google::protobuf::io::CodedOutputStream coded_stream(&stream);
+    coded_stream.WriteRaw("0123456789abcde", 15);
+    coded_stream.WriteVarint32(300);
+    coded_stream.WriteVarint32(5);
+  }
+  uint32_t value;
+  size_t length;
+  ASSERT_TRUE(stream.ReadVarint32(15, &value, &length));
+  EXPECT_EQ(300, value);
+  EXPECT_EQ(2, length);
+  ASSERT_TRUE(stream.ReadVarint32(17, &value, &length));
+  EXPECT_EQ(5, value);
+  EXPECT_EQ(1, length);
+  EXPECT_FALSE(stream.ReadVarint32(18, &value, &length));
+}
+
+TEST(ChunkedOutputStream, DrainsAtHighWater) {
+  ChunkedOutputStream stream(16);
+  std::string drained;
+  stream.set_drain(32, [&] {
+    drained += Read(stream, 0, stream.size());
+    stream.Consume(stream.size());
+  });
+  std::string data(100, 'y');
+  {
+    google::protobuf::io::CodedOutputStream coded_stream(&stream);
+    coded_stream.WriteRaw(data.data(), data.size());
+  }
+  EXPECT_LT(stream.size(), 32 + 16);
+  EXPECT_FALSE(drained.empty());
+  EXPECT_EQ(data, drained + Read(stream, 0, stream.size()));
+}
+
+}  // namespace
+}  // namespace kythe
+
+int main(int argc, char **argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  int result = RUN_ALL_TESTS();
+  return result;
+}
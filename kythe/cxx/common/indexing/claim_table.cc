@@ -0,0 +1,198 @@
+/*
+ * Copyright 2017 Google Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "claim_table.h"
+
+#include <openssl/sha.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+#include "llvm/Support/Endian.h"
+
+namespace kythe {
+namespace {
+using llvm::support::endian::read32le;
+using llvm::support::endian::read64le;
+using llvm::support::endian::write32le;
+using llvm::support::endian::write64le;
+
+/// \brief Adds a length-prefixed field to a fingerprint.
+void AddField(::SHA256_CTX *sha, const std::string &field) {
+  unsigned char size[8];
+  write64le(size, field.size());
+  ::SHA256_Update(sha, size, sizeof(size));
+  ::SHA256_Update(sha, field.data(), field.size());
+}
+
+/// \return the first slot to probe for `fingerprint`.
+uint64_t HomeSlot(const unsigned char *fingerprint, uint64_t slot_count) {
+  return read64le(fingerprint) % slot_count;
+}
+}  // anonymous namespace
+
+constexpr char ClaimTable::kMagic[];
+constexpr size_t ClaimTable::kMagicSize;
+constexpr size_t ClaimTable::kHeaderSize;
+constexpr size_t ClaimTable::kSlotSize;
+constexpr uint32_t ClaimTable::kEmptySlot;
+
+void ClaimTable::FingerprintVName(const proto::VName &vname,
+                                  Fingerprint *fingerprint) {
+  ::SHA256_CTX sha;
+  ::SHA256_Init(&sha);
+  AddField(&sha, vname.signature());
+  AddField(&sha, vname.corpus());
+  AddField(&sha, vname.root());
+  AddField(&sha, vname.path());
+  AddField(&sha, vname.language());
+  unsigned char digest[SHA256_DIGEST_LENGTH];
+  ::SHA256_Final(digest, &sha);
+  ::memcpy(fingerprint->data(), digest, fingerprint->size());
+}
+
+void ClaimTable::Builder::AssignClaim(const proto::VName &dependency,
+                                      const proto::VName &claimant) {
+  Fingerprint claimant_fingerprint, dependency_fingerprint;
+  FingerprintVName(claimant, &claimant_fingerprint);
+  FingerprintVName(dependency, &dependency_fingerprint);
+  auto index = claimant_index_.emplace(claimant_fingerprint, claimants_.size());
+  if (index.second) {
+    claimants_.push_back(claimant_fingerprint);
+  }
+  claims_[dependency_fingerprint] = index.first->second;
+}
+
+void ClaimTable::Builder::Build(std::string *out, double load_factor) const {
+  // Keep at least one slot empty so that probes always terminate.
+  uint64_t slot_count = std::max<uint64_t>(
+      claims_.size() + 1, std::ceil(claims_.size() / load_factor));
+  out->assign(kHeaderSize + claimants_.size() * sizeof(Fingerprint) +
+                  slot_count * kSlotSize,
+              '\0');
+  auto *data = reinterpret_cast<unsigned char *>(&(*out)[0]);
+  ::memcpy(data, kMagic, kMagicSize);
+  write64le(data + kMagicSize, claimants_.size());
+  write64le(data + kMagicSize + 8, slot_count);
+  write64le(data + kMagicSize + 16, claims_.size());
+  unsigned char *claimants = data + kHeaderSize;
+  for (const auto &claimant : claimants_) {
+    ::memcpy(claimants, claimant.data(), claimant.size());
+    claimants += claimant.size();
+  }
+  unsigned char *slots = claimants;
+  for (uint64_t slot = 0; slot < slot_count; ++slot) {
+    write32le(slots + slot * kSlotSize + sizeof(Fingerprint), kEmptySlot);
+  }
+  for (const auto &claim : claims_) {
+    uint64_t slot = HomeSlot(claim.first.data(), slot_count);
+    while (read32le(slots + slot * kSlotSize + sizeof(Fingerprint)) !=
+           kEmptySlot) {
+      slot = (slot + 1) % slot_count;
+    }
+    ::memcpy(slots + slot * kSlotSize, claim.first.data(), claim.first.size());
+    write32le(slots + slot * kSlotSize + sizeof(Fingerprint), claim.second);
+  }
+}
+
+std::unique_ptr<ClaimTable> ClaimTable::Open(const std::string &path,
+                                             std::string *error_text) {
+  auto buffer = llvm::MemoryBuffer::getFile(path, /*FileSize=*/-1,
+                                            /*RequiresNullTerminator=*/false);
+  if (!buffer) {
+    *error_text = "Couldn't map " + path + ": " + buffer.getError().message();
+    return nullptr;
+  }
+  return FromBuffer(std::move(*buffer), error_text);
+}
+
+std::unique_ptr<ClaimTable> ClaimTable::FromBuffer(
+    std::unique_ptr<llvm::MemoryBuffer> buffer, std::string *error_text) {
+  llvm::StringRef data = buffer->getBuffer();
+  if (data.size() < kHeaderSize || !HasMagic(data)) {
+    *error_text = "Not a claim table.";
+    return nullptr;
+  }
+  const auto *start = reinterpret_cast<const unsigned char *>(data.data());
+  uint64_t claimant_count = read64le(start + kMagicSize);
+  uint64_t slot_count = read64le(start + kMagicSize + 8);
+  uint64_t size = read64le(start + kMagicSize + 16);
+  uint64_t body_size = data.size() - kHeaderSize;
+  if (claimant_count > body_size / sizeof(Fingerprint) ||
+      slot_count > body_size / kSlotSize || size >= slot_count ||
+      claimant_count * sizeof(Fingerprint) + slot_count * kSlotSize !=
+          body_size) {
+    *error_text = "Bad claim table size.";
+    return nullptr;
+  }
+  std::unique_ptr<ClaimTable> table(new ClaimTable(std::move(buffer)));
+  table->claimants_ = start + kHeaderSize;
+  table->claimant_count_ = claimant_count;
+  table->slots_ = table->claimants_ + claimant_count * sizeof(Fingerprint);
+  table->slot_count_ = slot_count;
+  table->size_ = size;
+  return table;
+}
+
+const unsigned char *ClaimTable::FindClaimant(
+    const Fingerprint &dependency) const {
+  if (slot_count_ == 0) {
+    return nullptr;
+  }
+  uint64_t slot = HomeSlot(dependency.data(), slot_count_);
+  for (uint64_t probes = 0; probes < slot_count_; ++probes) {
+    const unsigned char *entry = slots_ + slot * kSlotSize;
+    uint32_t claimant = read32le(entry + sizeof(Fingerprint));
+    if (claimant == kEmptySlot) {
+      return nullptr;
+    }
+    if (::memcmp(entry, dependency.data(), dependency.size()) == 0) {
+      return claimant < claimant_count_
+                 ? claimants_ + claimant * sizeof(Fingerprint)
+                 : nullptr;
+    }
+    slot = (slot + 1) % slot_count_;
+  }
+  return nullptr;
+}
+
+proto::VName ContentClaimable(const std::string &digest,
+                              const std::string &context) {
+  // No file VName has this language, so these never collide with them.
+  proto::VName claimable;
+  claimable.set_language("kythe:content");
+  claimable.set_path(digest);
+  claimable.set_signature(context);
+  return claimable;
+}
+
+std::string ClaimShardName(const proto::CompilationUnit &unit) {
+  std::string wire;
+  unit.SerializeToString(&wire);
+  unsigned char digest[SHA256_DIGEST_LENGTH];
+  ::SHA256(reinterpret_cast<const unsigned char *>(wire.data()), wire.size(),
+           digest);
+  static const char kHexDigits[] = "0123456789abcdef";
+  std::string name;
+  for (unsigned char byte : digest) {
+    name.push_back(kHexDigits[byte >> 4]);
+    name.push_back(kHexDigits[byte & 0xf]);
+  }
+  return name + ".claims";
+}
+
+}  // namespace kythe
@@ -0,0 +1,155 @@
+/*
+ * Copyright 2017 Google Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef KYTHE_CXX_COMMON_INDEXING_CLAIM_TABLE_H_
+#define KYTHE_CXX_COMMON_INDEXING_CLAIM_TABLE_H_
+
+#include <array>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "kythe/proto/analysis.pb.h"
+#include "kythe/proto/storage.pb.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Support/MemoryBuffer.h"
+
+namespace kythe {
+
+/// \brief A read-only, hash-indexed table of static claims that is used
+/// directly from a memory mapping.
+///
+/// The table maps dependency VNames to the VNames of the compilation units
+/// that are responsible for them. VNames are stored as fingerprints, so the
+/// table can only answer whether a given claimant owns a given dependency.
+/// Loading a table costs a single `mmap`, and indexers on the same host that
+/// use the same table share its pages.
+///
+/// The format (all integers are little-endian) is:
+///
+///     magic (8 bytes)
+///     claimant count (8 bytes)
+///     slot count (8 bytes)
+///     dependency count (8 bytes)
+///     claimants (16-byte fingerprints)
+///     slots (16-byte dependency fingerprint, 4-byte claimant index)
+///
+/// Slots form an open-addressed hash table with linear probing; an empty slot
+/// has claimant index `kEmptySlot`.
+class ClaimTable {
+ public:
+  /// \brief A fingerprint of a VName.
+  using Fingerprint = std::array<unsigned char, 16>;
+
+  /// The magic number at the start of every table.
+  static constexpr char kMagic[] = "KYCLAIM\x01";
+  static constexpr size_t kMagicSize = 8;
+  /// The size of the table's header.
+  static constexpr size_t kHeaderSize = kMagicSize + 3 * 8;
+  /// The size of a slot.
+  static constexpr size_t kSlotSize = 16 + 4;
+  /// The claimant index of an empty slot.
+  static constexpr uint32_t kEmptySlot = 0xffffffff;
+
+  /// \brief Builds a table in memory.
+  class Builder {
+   public:
+    /// \brief Makes `claimant` responsible for `dependency`, replacing any
+    /// earlier assignment.
+    void AssignClaim(const proto::VName &dependency,
+                     const proto::VName &claimant);
+
+    /// \brief Serializes the table to `out`.
+    /// \param load_factor The fraction of slots that should be full.
+    void Build(std::string *out, double load_factor = 0.75) const;
+
+   private:
+    /// Maps dependency fingerprints to claimant indices.
+    std::map<Fingerprint, uint32_t> claims_;
+    /// Maps claimant fingerprints to their indices.
+    std::map<Fingerprint, uint32_t> claimant_index_;
+    /// Claimant fingerprints, by index.
+    std::vector<Fingerprint> claimants_;
+  };
+
+  /// \brief Maps the table at `path`.
+  /// \return the table, or null on failure (with `error_text` set).
+  static std::unique_ptr<ClaimTable> Open(const std::string &path,
+                                          std::string *error_text);
+
+  /// \brief Uses the table in `buffer`.
+  /// \return the table, or null if `buffer` isn't a well-formed table (with
+  /// `error_text` set).
+  static std::unique_ptr<ClaimTable> FromBuffer(
+      std::unique_ptr<llvm::MemoryBuffer> buffer, std::string *error_text);
+
+  /// \return true if `data` starts like a claim table.
+  static bool HasMagic(llvm::StringRef data) {
+    return data.startswith(llvm::StringRef(kMagic, kMagicSize));
+  }
+
+  /// \brief Computes the fingerprint used for `vname`.
+  static void FingerprintVName(const proto::VName &vname,
+                               Fingerprint *fingerprint);
+
+  /// \brief Looks up the claimant for a dependency.
+  /// \return the fingerprint of the claimant responsible for `dependency`, or
+  /// null if the table doesn't know about `dependency`.
+  const unsigned char *FindClaimant(const Fingerprint &dependency) const;
+
+  /// \return the number of dependencies in the table.
+  size_t size() const { return size_; }
+
+ private:
+  explicit ClaimTable(std::unique_ptr<llvm::MemoryBuffer> buffer)
+      : buffer_(std::move(buffer)) {}
+
+  /// The mapped table.
+  std::unique_ptr<llvm::MemoryBuffer> buffer_;
+  /// The start of the claimant fingerprints.
+  const unsigned char *claimants_ = nullptr;
+  /// The number of claimants.
+  uint64_t claimant_count_ = 0;
+  /// The start of the slots.
+  const unsigned char *slots_ = nullptr;
+  /// The number of slots.
+  uint64_t slot_count_ = 0;
+  /// The number of dependencies (full slots).
+  size_t size_ = 0;
+};
+
+/// \brief Returns the claimable that stands for every copy of a file whose
+/// content has the digest `digest`, entered in the preprocessor context
+/// `context`.
+///
+/// Claiming these instead of file VNames means that identical headers
+/// checked in at several paths (or in several corpora) are indexed once.
+proto::VName ContentClaimable(const std::string &digest,
+                              const std::string &context);
+
+/// \brief Returns the name of the file that holds `unit`'s claim shard: the
+/// hex SHA-256 digest of `unit`'s wire encoding followed by ".claims".
+///
+/// A claim shard (written by `static_claim --shard_dir`) is a claim stream
+/// with the claims on every dependency of one unit, both those the unit owns
+/// and those owned by other units, so an indexer needs only the shards of the
+/// units it indexes.
+std::string ClaimShardName(const proto::CompilationUnit &unit);
+
+}  // namespace kythe
+
+#endif  // KYTHE_CXX_COMMON_INDEXING_CLAIM_TABLE_H_
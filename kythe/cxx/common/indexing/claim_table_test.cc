@@ -0,0 +1,166 @@
+/*
+ * Copyright 2017 Google Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "claim_table.h"
+
+#include <algorithm>
+#include <string>
+
+#include "KytheClaimClient.h"
+#include "gtest/gtest.h"
+#include "kythe/proto/storage.pb.h"
+
+namespace kythe {
+namespace {
+
+proto::VName MakeVName(const std::string &path) {
+  proto::VName vname;
+  vname.set_corpus("corpus");
+  vname.set_path(path);
+  return vname;
+}
+
+/// \return a table built from `builder`.
+std::unique_ptr<ClaimTable> BuildTable(const ClaimTable::Builder &builder,
+                                       double load_factor = 0.75) {
+  std::string data;
+  builder.Build(&data, load_factor);
+  std::string error_text;
+  auto table = ClaimTable::FromBuffer(
+      llvm::MemoryBuffer::getMemBufferCopy(data), &error_text);
+  EXPECT_NE(nullptr, table) << error_text;
+  return table;
+}
+
+/// \return true if the owner of `dependency` in `table` is `claimant`.
+bool Owns(const ClaimTable &table, const proto::VName &claimant,
+          const proto::VName &dependency) {
+  ClaimTable::Fingerprint claimant_fingerprint, dependency_fingerprint;
+  ClaimTable::FingerprintVName(claimant, &claimant_fingerprint);
+  ClaimTable::FingerprintVName(dependency, &dependency_fingerprint);
+  const auto *owner = table.FindClaimant(dependency_fingerprint);
+  return owner != nullptr &&
+         std::equal(claimant_fingerprint.begin(), claimant_fingerprint.end(),
+                    owner);
+}
+
+TEST(ClaimTable, Empty) {
+  ClaimTable::Builder builder;
+  auto table = BuildTable(builder);
+  ASSERT_NE(nullptr, table);
+  EXPECT_EQ(0, table->size());
+  ClaimTable::Fingerprint fingerprint;
+  ClaimTable::FingerprintVName(MakeVName("a.h"), &fingerprint);
+  EXPECT_EQ(nullptr, table->FindClaimant(fingerprint));
+}
+
+TEST(ClaimTable, FindsEveryClaim) {
+  ClaimTable::Builder builder;
+  for (int i = 0; i < 1000; ++i) {
+    builder.AssignClaim(MakeVName(std::to_string(i) + ".h"),
+                        MakeVName(std::to_string(i % 7) + ".cc"));
+  }
+  // A full table makes for long probe sequences.
+  auto table = BuildTable(builder, 1.0);
+  ASSERT_NE(nullptr, table);
+  EXPECT_EQ(1000, table->size());
+  for (int i = 0; i < 1000; ++i) {
+    auto header = MakeVName(std::to_string(i) + ".h");
+    EXPECT_TRUE(Owns(*table, MakeVName(std::to_string(i % 7) + ".cc"), header));
+    EXPECT_FALSE(
+        Owns(*table, MakeVName(std::to_string((i + 1) % 7) + ".cc"), header));
+  }
+  ClaimTable::Fingerprint fingerprint;
+  ClaimTable::FingerprintVName(MakeVName("1000.h"), &fingerprint);
+  EXPECT_EQ(nullptr, table->FindClaimant(fingerprint));
+}
+
+TEST(ClaimTable, LaterAssignmentsWin) {
+  ClaimTable::Builder builder;
+  builder.AssignClaim(MakeVName("a.h"), MakeVName("a.cc"));
+  builder.AssignClaim(MakeVName("a.h"), MakeVName("b.cc"));
+  auto table = BuildTable(builder);
+  ASSERT_NE(nullptr, table);
+  EXPECT_EQ(1, table->size());
+  EXPECT_TRUE(Owns(*table, MakeVName("b.cc"), MakeVName("a.h")));
+}
+
+TEST(ClaimTable, RejectsBadTables) {
+  ClaimTable::Builder builder;
+  builder.AssignClaim(MakeVName("a.h"), MakeVName("a.cc"));
+  std::string data;
+  builder.Build(&data);
+  auto load = [](const std::string &data) {
+    std::string error_text;
+    return ClaimTable::FromBuffer(llvm::MemoryBuffer::getMemBufferCopy(data),
+                                  &error_text);
+  };
+  EXPECT_NE(nullptr, load(data));
+  EXPECT_EQ(nullptr, load(data.substr(0, 8)));
+  EXPECT_EQ(nullptr, load(data.substr(1)));
+  EXPECT_EQ(nullptr, load(data.substr(0, 40)));
+  EXPECT_EQ(nullptr, load(data + "x"));
+}
+
+TEST(ClaimTable, ContentClaimablesDependOnDigestAndContext) {
+  proto::VName claimable = ContentClaimable("digest", "context");
+  EXPECT_TRUE(VNameEquals(claimable, ContentClaimable("digest", "context")));
+  EXPECT_FALSE(VNameEquals(claimable, ContentClaimable("digest", "")));
+  EXPECT_FALSE(VNameEquals(claimable, ContentClaimable("other", "context")));
+  proto::VName file;
+  file.set_path("digest");
+  file.set_signature("context");
+  EXPECT_FALSE(VNameEquals(claimable, file));
+}
+
+TEST(ClaimTable, ShardNamesDependOnTheWholeUnit) {
+  proto::CompilationUnit unit;
+  unit.mutable_v_name()->set_signature("unit");
+  std::string name = ClaimShardName(unit);
+  EXPECT_EQ(64 + 7, name.size());
+  EXPECT_EQ(".claims", name.substr(64));
+  EXPECT_EQ(name, ClaimShardName(unit));
+  unit.add_argument("-DFOO");
+  EXPECT_NE(name, ClaimShardName(unit));
+}
+
+TEST(ClaimTable, BacksStaticClaimClient) {
+  ClaimTable::Builder builder;
+  builder.AssignClaim(MakeVName("a.h"), MakeVName("a.cc"));
+  builder.AssignClaim(MakeVName("b.h"), MakeVName("b.cc"));
+  StaticClaimClient client;
+  client.set_process_unknown_status(false);
+  client.set_claim_table(BuildTable(builder));
+  EXPECT_TRUE(client.Claim(MakeVName("a.cc"), MakeVName("a.h")));
+  EXPECT_FALSE(client.Claim(MakeVName("a.cc"), MakeVName("b.h")));
+  EXPECT_FALSE(client.Claim(MakeVName("a.cc"), MakeVName("c.h")));
+  EXPECT_TRUE(client.Claim(MakeVName("b.cc"), MakeVName("b.h")));
+  // Local assignments override the table.
+  client.AssignClaim(MakeVName("b.h"), MakeVName("a.cc"));
+  EXPECT_TRUE(client.Claim(MakeVName("a.cc"), MakeVName("b.h")));
+  EXPECT_FALSE(client.Claim(MakeVName("b.cc"), MakeVName("b.h")));
+  client.Reset();
+  EXPECT_TRUE(client.Claim(MakeVName("b.cc"), MakeVName("b.h")));
+}
+
+}  // namespace
+}  // namespace kythe
+
+int main(int argc, char **argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  int result = RUN_ALL_TESTS();
+  return result;
+}
@@ -0,0 +1,202 @@
+/*
+ * Copyright 2017 Google Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "kythe/cxx/common/indexing/delta_output_stream.h"
+
+#include <cstring>
+
+#include "google/protobuf/io/coded_stream.h"
+#include "google/protobuf/wire_format_lite.h"
+#include "kythe/cxx/common/indexing/sorting_output_stream.h"
+
+namespace kythe {
+namespace {
+using google::protobuf::io::CodedInputStream;
+using google::protobuf::io::CodedOutputStream;
+using google::protobuf::internal::WireFormatLite;
+
+/// The number of bytes handed out by each call to `Next`.
+constexpr size_t kChunkSize = 64 * 1024;
+
+/// The values of `EntryDelta::Kind`.
+constexpr int kAdd = 0;
+constexpr int kDelete = 1;
+}  // anonymous namespace
+
+DeltaOutputStream::DeltaOutputStream(
+    google::protobuf::io::ZeroCopyOutputStream *output,
+    std::unique_ptr<DelimitedProtoReader> base,
+    google::protobuf::io::ZeroCopyOutputStream *snapshot)
+    : output_(output), base_(std::move(base)), snapshot_(snapshot) {
+  AdvanceBase();
+}
+
+bool DeltaOutputStream::Next(void **data, int *size) {
+  if (closed_ || !ParsePending()) {
+    return false;
+  }
+  if (pending_.size() < pending_size_ + kChunkSize) {
+    pending_.resize(pending_size_ + kChunkSize);
+  }
+  *data = &pending_[pending_size_];
+  *size = kChunkSize;
+  pending_size_ += kChunkSize;
+  return true;
+}
+
+void DeltaOutputStream::BackUp(int count) { pending_size_ -= count; }
+
+google::protobuf::int64 DeltaOutputStream::ByteCount() const {
+  return parsed_bytes_ + pending_size_;
+}
+
+bool DeltaOutputStream::AdvanceBase() {
+  has_base_entry_ = false;
+  llvm::StringRef record;
+  if (!base_->Next(&record)) {
+    if (!base_->error().empty()) {
+      error_ = "Couldn't read the base: " + base_->error();
+      return false;
+    }
+    return true;
+  }
+  std::string previous_key = std::move(base_key_);
+  base_entry_.assign(record.data(), record.size());
+  if (!SortingOutputStream::EntrySortKey(record, &base_key_)) {
+    error_ = "Malformed entry " + std::to_string(base_->records_read()) +
+             " in the base";
+    return false;
+  }
+  if (!previous_key.empty() && base_key_ <= previous_key) {
+    error_ = "The base isn't sorted at entry " +
+             std::to_string(base_->records_read());
+    return false;
+  }
+  has_base_entry_ = true;
+  return true;
+}
+
+bool DeltaOutputStream::MergeEntry(llvm::StringRef entry,
+                                   const std::string &key) {
+  // Keys are never empty, so this also accepts the first entry.
+  if (key <= last_key_) {
+    error_ = "Entry out of order at offset " + std::to_string(parsed_bytes_);
+    return false;
+  }
+  while (has_base_entry_ && base_key_ < key) {
+    WriteDelta(kDelete, base_entry_);
+    ++deleted_;
+    if (!AdvanceBase()) {
+      return false;
+    }
+  }
+  if (has_base_entry_ && base_key_ == key) {
+    // Keys end with the fact value, so the entries are the same.
+    ++unchanged_;
+    if (!AdvanceBase()) {
+      return false;
+    }
+  } else {
+    WriteDelta(kAdd, entry);
+    ++added_;
+  }
+  last_key_ = key;
+  return true;
+}
+
+void DeltaOutputStream::WriteDelta(int kind, llvm::StringRef entry) {
+  // This is the wire encoding of an EntryDelta; ADD, being the default,
+  // isn't written.
+  size_t entry_field_size =
+      1 + CodedOutputStream::VarintSize32(entry.size()) + entry.size();
+  CodedOutputStream coded_output(output_);
+  coded_output.WriteVarint32(entry_field_size + (kind == kAdd ? 0 : 2));
+  if (kind != kAdd) {
+    coded_output.WriteTag(
+        WireFormatLite::MakeTag(1, WireFormatLite::WIRETYPE_VARINT));
+    coded_output.WriteVarint32(kind);
+  }
+  coded_output.WriteTag(
+      WireFormatLite::MakeTag(2, WireFormatLite::WIRETYPE_LENGTH_DELIMITED));
+  coded_output.WriteVarint32(entry.size());
+  coded_output.WriteRaw(entry.data(), entry.size());
+}
+
+bool DeltaOutputStream::ParsePending() {
+  if (!error_.empty()) {
+    return false;
+  }
+  size_t offset = 0;
+  std::string key;
+  while (offset < pending_size_) {
+    CodedInputStream input(
+        reinterpret_cast<const google::protobuf::uint8 *>(pending_.data()) +
+            offset,
+        pending_size_ - offset);
+    google::protobuf::uint32 entry_size;
+    if (!input.ReadVarint32(&entry_size)) {
+      break;
+    }
+    size_t header_size = input.CurrentPosition();
+    if (pending_size_ - offset - header_size < entry_size) {
+      break;
+    }
+    llvm::StringRef entry(pending_.data() + offset + header_size, entry_size);
+    if (!SortingOutputStream::EntrySortKey(entry, &key)) {
+      error_ = "Malformed entry at offset " +
+               std::to_string(parsed_bytes_ + offset);
+      return false;
+    }
+    if (!MergeEntry(entry, key)) {
+      return false;
+    }
+    if (snapshot_ != nullptr) {
+      CodedOutputStream coded_output(snapshot_);
+      coded_output.WriteRaw(pending_.data() + offset,
+                            header_size + entry_size);
+    }
+    offset += header_size + entry_size;
+  }
+  if (offset != 0) {
+    std::memmove(&pending_[0], pending_.data() + offset,
+                 pending_size_ - offset);
+    pending_size_ -= offset;
+    parsed_bytes_ += offset;
+  }
+  return true;
+}
+
+bool DeltaOutputStream::Close(std::string *error_text) {
+  if (closed_) {
+    return true;
+  }
+  closed_ = true;
+  if (ParsePending() && pending_size_ != 0) {
+    error_ = "Truncated entry at offset " + std::to_string(parsed_bytes_);
+  }
+  while (error_.empty() && has_base_entry_) {
+    WriteDelta(kDelete, base_entry_);
+    ++deleted_;
+    AdvanceBase();
+  }
+  if (!error_.empty()) {
+    *error_text = error_;
+    return false;
+  }
+  return true;
+}
+
+}  // namespace kythe
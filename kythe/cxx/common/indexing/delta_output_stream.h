@@ -0,0 +1,117 @@
+/*
+ * Copyright 2017 Google Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef KYTHE_CXX_COMMON_INDEXING_DELTA_OUTPUT_STREAM_H_
+#define KYTHE_CXX_COMMON_INDEXING_DELTA_OUTPUT_STREAM_H_
+
+#include <memory>
+#include <string>
+
+#include "google/protobuf/io/zero_copy_stream.h"
+#include "kythe/cxx/common/delimited_proto_reader.h"
+#include "llvm/ADT/StringRef.h"
+
+namespace kythe {
+
+/// \brief Turns a sorted stream of varint-delimited wire-format `Entry`
+/// messages into the changes since an earlier, also sorted, stream (the
+/// base).
+///
+/// Entries must be written in GraphStore order without duplicates, as a
+/// `SortingOutputStream` writes them, and the base must be in the same order
+/// (like the output of an earlier run with --experimental_sort_output). The
+/// two are merged as entries arrive: each written entry that isn't in the
+/// base is written to the underlying stream as a varint-delimited
+/// `kythe.proto.EntryDelta` with kind ADD, and each base entry that isn't
+/// written is written as one with kind DELETE. Entries in both are dropped,
+/// so the output is proportional to what changed. Deltas are written in
+/// GraphStore order of their entries.
+///
+/// Since the delta alone can't serve as the base of the next run, every
+/// entry written may also be copied to a snapshot stream.
+class DeltaOutputStream : public google::protobuf::io::ZeroCopyOutputStream {
+ public:
+  /// \param output The stream to which to write deltas. Not owned.
+  /// \param base The entries of the earlier run.
+  /// \param snapshot If non-null, the stream to which to copy every entry
+  /// written. Not owned.
+  DeltaOutputStream(google::protobuf::io::ZeroCopyOutputStream *output,
+                    std::unique_ptr<DelimitedProtoReader> base,
+                    google::protobuf::io::ZeroCopyOutputStream *snapshot =
+                        nullptr);
+
+  bool Next(void **data, int *size) override;
+  void BackUp(int count) override;
+  google::protobuf::int64 ByteCount() const override;
+
+  /// \brief Writes deletions for the rest of the base. No more data may be
+  /// written after the stream is closed.
+  /// \return false if either stream was malformed or out of order;
+  /// `error_text` will say why.
+  bool Close(std::string *error_text);
+
+  /// \return the number of entries added so far.
+  size_t added() const { return added_; }
+  /// \return the number of entries deleted so far.
+  size_t deleted() const { return deleted_; }
+  /// \return the number of entries found in the base so far.
+  size_t unchanged() const { return unchanged_; }
+
+ private:
+  /// \brief Merges the complete entries at the start of `pending_`.
+  bool ParsePending();
+
+  /// \brief Moves to the next entry of the base, if any.
+  bool AdvanceBase();
+
+  /// \brief Merges `entry`, whose sort key is `key`, with the base.
+  bool MergeEntry(llvm::StringRef entry, const std::string &key);
+
+  /// \brief Writes a delta of `kind` (an `EntryDelta::Kind`) for `entry`.
+  void WriteDelta(int kind, llvm::StringRef entry);
+
+  /// The stream to write deltas to.
+  google::protobuf::io::ZeroCopyOutputStream *output_;
+  /// The entries of the earlier run.
+  std::unique_ptr<DelimitedProtoReader> base_;
+  /// The stream to copy entries to, or null.
+  google::protobuf::io::ZeroCopyOutputStream *snapshot_;
+  /// The current entry of the base (valid if `has_base_entry_`).
+  std::string base_entry_;
+  /// The sort key of `base_entry_`.
+  std::string base_key_;
+  /// Whether `base_entry_` holds an entry that hasn't been merged.
+  bool has_base_entry_ = false;
+  /// The sort key of the last entry written.
+  std::string last_key_;
+  /// Bytes written to this stream that haven't been merged yet.
+  std::string pending_;
+  /// The number of bytes of `pending_` that hold data.
+  size_t pending_size_ = 0;
+  /// The number of bytes merged out of `pending_` so far.
+  google::protobuf::int64 parsed_bytes_ = 0;
+  size_t added_ = 0;
+  size_t deleted_ = 0;
+  size_t unchanged_ = 0;
+  /// The first error encountered, if any.
+  std::string error_;
+  /// Set once `Close` has been called.
+  bool closed_ = false;
+};
+
+}  // namespace kythe
+
+#endif  // KYTHE_CXX_COMMON_INDEXING_DELTA_OUTPUT_STREAM_H_
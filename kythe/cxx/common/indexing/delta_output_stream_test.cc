@@ -0,0 +1,146 @@
+/*
+ * Copyright 2017 Google Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "kythe/cxx/common/indexing/delta_output_stream.h"
+
+#include <string>
+#include <vector>
+
+#include "google/protobuf/io/coded_stream.h"
+#include "google/protobuf/io/zero_copy_stream_impl_lite.h"
+#include "gtest/gtest.h"
+#include "kythe/proto/delta.pb.h"
+#include "kythe/proto/storage.pb.h"
+#include "llvm/ADT/STLExtras.h"
+
+namespace kythe {
+namespace {
+
+/// \return an entry with the given source signature and fact value.
+proto::Entry MakeFact(const std::string &signature, const std::string &value) {
+  proto::Entry entry;
+  entry.mutable_source()->set_signature(signature);
+  entry.set_fact_name("/kythe/text");
+  entry.set_fact_value(value);
+  return entry;
+}
+
+/// \return `entries` as a stream of varint-delimited messages.
+std::string Delimit(const std::vector<proto::Entry> &entries) {
+  std::string out;
+  google::protobuf::io::StringOutputStream raw_stream(&out);
+  google::protobuf::io::CodedOutputStream coded_stream(&raw_stream);
+  for (const auto &entry : entries) {
+    coded_stream.WriteVarint32(entry.ByteSize());
+    entry.SerializeWithCachedSizes(&coded_stream);
+  }
+  return out;
+}
+
+/// \brief The result of writing entries through a `DeltaOutputStream`.
+struct Delta {
+  /// Set if `Close` failed.
+  std::string error_text;
+  /// The deltas written, each as "+value" or "-value".
+  std::vector<std::string> changes;
+  /// The snapshot written.
+  std::string snapshot;
+  size_t unchanged = 0;
+};
+
+/// \brief Writes `entries` through a `DeltaOutputStream` over `base`.
+Delta WriteDelta(const std::vector<proto::Entry> &base,
+                 const std::vector<proto::Entry> &entries) {
+  std::string base_data = Delimit(base);
+  google::protobuf::io::ArrayInputStream base_stream(base_data.data(),
+                                                     base_data.size());
+  Delta delta;
+  std::string out;
+  {
+    google::protobuf::io::StringOutputStream raw_stream(&out);
+    google::protobuf::io::StringOutputStream snapshot_stream(&delta.snapshot);
+    DeltaOutputStream delta_stream(
+        &raw_stream, llvm::make_unique<DelimitedProtoReader>(&base_stream),
+        &snapshot_stream);
+    {
+      google::protobuf::io::CodedOutputStream coded_stream(&delta_stream);
+      for (const auto &entry : entries) {
+        coded_stream.WriteVarint32(entry.ByteSize());
+        entry.SerializeWithCachedSizes(&coded_stream);
+      }
+    }
+    delta_stream.Close(&delta.error_text);
+    delta.unchanged = delta_stream.unchanged();
+  }
+  google::protobuf::io::CodedInputStream input(
+      reinterpret_cast<const google::protobuf::uint8 *>(out.data()),
+      out.size());
+  google::protobuf::uint32 size;
+  while (input.ReadVarint32(&size)) {
+    auto limit = input.PushLimit(size);
+    proto::EntryDelta change;
+    EXPECT_TRUE(change.ParseFromCodedStream(&input));
+    input.PopLimit(limit);
+    delta.changes.push_back(
+        (change.kind() == proto::EntryDelta::DELETE ? "-" : "+") +
+        change.entry().fact_value());
+  }
+  return delta;
+}
+
+TEST(DeltaOutputStream, WritesOnlyChanges) {
+  std::vector<proto::Entry> entries = {MakeFact("b", "b"), MakeFact("c", "c"),
+                                       MakeFact("d", "d"), MakeFact("e", "e")};
+  Delta delta = WriteDelta(
+      {MakeFact("a", "a"), MakeFact("b", "b"), MakeFact("d", "d")}, entries);
+  EXPECT_EQ("", delta.error_text);
+  std::vector<std::string> expected = {"-a", "+c", "+e"};
+  EXPECT_EQ(expected, delta.changes);
+  EXPECT_EQ(2, delta.unchanged);
+  EXPECT_EQ(Delimit(entries), delta.snapshot);
+}
+
+TEST(DeltaOutputStream, ChangedValuesAreReplaced) {
+  Delta delta = WriteDelta({MakeFact("a", "old"), MakeFact("z", "z")},
+                           {MakeFact("a", "new"), MakeFact("z", "z")});
+  EXPECT_EQ("", delta.error_text);
+  std::vector<std::string> expected = {"+new", "-old"};
+  EXPECT_EQ(expected, delta.changes);
+  EXPECT_EQ(1, delta.unchanged);
+}
+
+TEST(DeltaOutputStream, DeletesTheRestOfTheBase) {
+  Delta delta = WriteDelta({MakeFact("a", "a"), MakeFact("b", "b")}, {});
+  EXPECT_EQ("", delta.error_text);
+  std::vector<std::string> expected = {"-a", "-b"};
+  EXPECT_EQ(expected, delta.changes);
+}
+
+TEST(DeltaOutputStream, RejectsUnsortedInput) {
+  EXPECT_NE("", WriteDelta({}, {MakeFact("b", "b"), MakeFact("a", "a")})
+                    .error_text);
+  EXPECT_NE("", WriteDelta({MakeFact("b", "b"), MakeFact("a", "a")}, {})
+                    .error_text);
+}
+
+}  // namespace
+}  // namespace kythe
+
+int main(int argc, char **argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  int result = RUN_ALL_TESTS();
+  return result;
+}
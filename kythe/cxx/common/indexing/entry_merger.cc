@@ -0,0 +1,305 @@
+/*
+ * Copyright 2017 Google Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "kythe/cxx/common/indexing/entry_merger.h"
+
+#include <algorithm>
+#include <utility>
+
+#include "google/protobuf/io/coded_stream.h"
+#include "kythe/cxx/common/indexing/sorting_output_stream.h"
+#include "llvm/ADT/STLExtras.h"
+#include "llvm/ADT/StringRef.h"
+
+namespace kythe {
+namespace {
+using google::protobuf::io::CodedOutputStream;
+}  // anonymous namespace
+
+/// \brief An input and the batches read from it.
+struct SortedEntryMerger::Input {
+  /// The name of the input, for errors.
+  std::string name;
+  /// Reads the input. Only used by the prefetch thread reading `ready`.
+  std::unique_ptr<DelimitedProtoReader> reader;
+  /// The batch being merged. Only used by the merging thread.
+  std::vector<Record> current;
+  /// The number of records in `current` (which may hold stale records past
+  /// the end, so that their buffers can be reused).
+  size_t current_size = 0;
+  /// The position of the head in `current`.
+  size_t position = 0;
+  /// Set if `current` is the input's last batch.
+  bool current_is_last = false;
+  /// Set if the input couldn't be read past the end of `current`.
+  std::string current_error;
+  /// The batch read ahead. Only used by a prefetch thread while the input is
+  /// queued or being read, and under the merger's mutex otherwise.
+  std::vector<Record> ready;
+  /// The number of records in `ready`.
+  size_t ready_size = 0;
+  /// Set (under the merger's mutex) once `ready` holds the next batch.
+  bool has_ready = false;
+  /// Set with `has_ready` if `ready` is the last batch.
+  bool at_end = false;
+  /// Set with `has_ready` if the input couldn't be read.
+  std::string error;
+  /// The key of the last record in the last batch read (by the prefetcher).
+  std::string last_key;
+  /// The number of records read so far (by the prefetcher).
+  size_t records_read = 0;
+  /// \return the key of the head record.
+  llvm::StringRef head_key() const {
+    const Record &record = current[position];
+    return llvm::StringRef(record.data).take_front(record.key_size);
+  }
+  /// \return the head entry.
+  llvm::StringRef head_entry() const {
+    const Record &record = current[position];
+    return llvm::StringRef(record.data).drop_front(record.key_size);
+  }
+};
+
+/// \brief Picks the input with the smallest head key.
+///
+/// Leaf `i` of the tree is input `i`; internal node `n` (for `0 < n < k`)
+/// holds the loser of the match between its children `2n` and `2n + 1`, where
+/// node `k + i` stands for leaf `i`. Node 0 holds the overall winner.
+/// Exhausted inputs lose to everything.
+class SortedEntryMerger::LoserTree {
+ public:
+  /// \param inputs The inputs to choose between. Not owned.
+  explicit LoserTree(const std::vector<std::unique_ptr<Input>> *inputs)
+      : inputs_(inputs), nodes_(std::max<size_t>(inputs->size(), 1)) {
+    if (!inputs->empty()) {
+      nodes_[0] = Build(1);
+    }
+  }
+
+  /// \return the winning input, or null if all are exhausted.
+  Input *winner() const {
+    if (inputs_->empty() || done(nodes_[0])) {
+      return nullptr;
+    }
+    return (*inputs_)[nodes_[0]].get();
+  }
+
+  /// \brief Replays the matches on the path from the winner, whose head has
+  /// changed, to the root.
+  void ReplayWinner() {
+    size_t winner = nodes_[0];
+    for (size_t node = (winner + inputs_->size()) / 2; node > 0; node /= 2) {
+      if (Beats(nodes_[node], winner)) {
+        std::swap(nodes_[node], winner);
+      }
+    }
+    nodes_[0] = winner;
+  }
+
+ private:
+  /// \return whether input `i` is exhausted.
+  bool done(size_t i) const {
+    const Input &input = *(*inputs_)[i];
+    return input.position >= input.current_size;
+  }
+
+  /// \return whether input `a`'s head comes before input `b`'s.
+  bool Beats(size_t a, size_t b) const {
+    if (done(a) || done(b)) {
+      return !done(a) && done(b);
+    }
+    int order = (*inputs_)[a]->head_key().compare((*inputs_)[b]->head_key());
+    return order < 0 || (order == 0 && a < b);
+  }
+
+  /// \brief Plays the matches below `node`, recording their losers.
+  /// \return the winner.
+  size_t Build(size_t node) {
+    if (node >= inputs_->size()) {
+      return node - inputs_->size();
+    }
+    size_t left = Build(node * 2);
+    size_t right = Build(node * 2 + 1);
+    if (Beats(right, left)) {
+      nodes_[node] = left;
+      return right;
+    }
+    nodes_[node] = right;
+    return left;
+  }
+
+  const std::vector<std::unique_ptr<Input>> *inputs_;
+  std::vector<size_t> nodes_;
+};
+
+SortedEntryMerger::SortedEntryMerger(
+    google::protobuf::io::ZeroCopyOutputStream *output, Options options)
+    : output_(output), options_(options) {}
+
+SortedEntryMerger::~SortedEntryMerger() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stopping_ = true;
+  }
+  queue_changed_.notify_all();
+  for (auto &thread : threads_) {
+    thread.join();
+  }
+}
+
+void SortedEntryMerger::AddInput(std::string name,
+                                 std::unique_ptr<DelimitedProtoReader> reader) {
+  auto input = llvm::make_unique<Input>();
+  input->name = std::move(name);
+  input->reader = std::move(reader);
+  inputs_.push_back(std::move(input));
+}
+
+void SortedEntryMerger::PrefetchLoop() {
+  for (;;) {
+    Input *input;
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      queue_changed_.wait(lock,
+                          [this] { return stopping_ || !queue_.empty(); });
+      if (stopping_) {
+        return;
+      }
+      input = queue_.front();
+      queue_.pop_front();
+    }
+    Prefetch(input);
+  }
+}
+
+void SortedEntryMerger::Prefetch(Input *input) {
+  size_t size = 0;
+  size_t bytes = 0;
+  bool at_end = false;
+  std::string error;
+  llvm::StringRef entry;
+  while (bytes < options_.batch_bytes) {
+    if (!input->reader->Next(&entry)) {
+      at_end = true;
+      if (!input->reader->error().empty()) {
+        error = input->name + ": " + input->reader->error();
+      }
+      break;
+    }
+    ++input->records_read;
+    if (size == input->ready.size()) {
+      input->ready.emplace_back();
+    }
+    Record &record = input->ready[size];
+    if (!SortingOutputStream::EntrySortKey(entry, &record.data)) {
+      error = input->name + ": malformed entry " +
+              std::to_string(input->records_read);
+      at_end = true;
+      break;
+    }
+    record.key_size = record.data.size();
+    llvm::StringRef key(record.data);
+    if (key < input->last_key) {
+      error = input->name + ": entry " + std::to_string(input->records_read) +
+              " is out of order";
+      at_end = true;
+      break;
+    }
+    input->last_key.assign(key.data(), key.size());
+    record.data.append(entry.data(), entry.size());
+    bytes += record.data.size();
+    ++size;
+  }
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    input->ready_size = size;
+    input->at_end = at_end;
+    input->error = std::move(error);
+    input->has_ready = true;
+  }
+  batch_ready_.notify_all();
+}
+
+bool SortedEntryMerger::NextBatch(Input *input) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  batch_ready_.wait(lock, [input] { return input->has_ready; });
+  input->has_ready = false;
+  std::swap(input->current, input->ready);
+  input->current_size = input->ready_size;
+  input->position = 0;
+  input->current_is_last = input->at_end;
+  input->current_error = std::move(input->error);
+  input->error.clear();
+  if (!input->at_end) {
+    queue_.push_back(input);
+    queue_changed_.notify_one();
+  }
+  return input->current_size != 0;
+}
+
+bool SortedEntryMerger::Merge(std::string *error_text) {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (auto &input : inputs_) {
+      queue_.push_back(input.get());
+    }
+  }
+  for (size_t i = 0; i < std::max<size_t>(options_.prefetch_threads, 1); ++i) {
+    threads_.emplace_back([this] { PrefetchLoop(); });
+  }
+  queue_changed_.notify_all();
+  for (auto &input : inputs_) {
+    NextBatch(input.get());
+  }
+  LoserTree tree(&inputs_);
+  std::string last_key;
+  bool wrote_any = false;
+  {
+    CodedOutputStream coded_output(output_);
+    while (Input *input = tree.winner()) {
+      ++entries_read_;
+      llvm::StringRef key = input->head_key();
+      if (!wrote_any || key != last_key) {
+        llvm::StringRef entry = input->head_entry();
+        coded_output.WriteVarint32(entry.size());
+        coded_output.WriteRaw(entry.data(), entry.size());
+        last_key.assign(key.data(), key.size());
+        wrote_any = true;
+        ++entries_written_;
+      }
+      if (++input->position == input->current_size) {
+        // An input's error arrives with its last batch.
+        if (!input->current_error.empty()) {
+          *error_text = input->current_error;
+          return false;
+        }
+        if (!input->current_is_last) {
+          NextBatch(input);
+        }
+      }
+      tree.ReplayWinner();
+    }
+  }
+  for (auto &input : inputs_) {
+    if (!input->current_error.empty()) {
+      *error_text = input->current_error;
+      return false;
+    }
+  }
+  return true;
+}
+
+}  // namespace kythe
@@ -0,0 +1,122 @@
+/*
+ * Copyright 2017 Google Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef KYTHE_CXX_COMMON_INDEXING_ENTRY_MERGER_H_
+#define KYTHE_CXX_COMMON_INDEXING_ENTRY_MERGER_H_
+
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "google/protobuf/io/zero_copy_stream.h"
+#include "kythe/cxx/common/delimited_proto_reader.h"
+
+namespace kythe {
+
+/// \brief Merges streams of varint-delimited wire-format `Entry` messages,
+/// each sorted in GraphStore order (like the output of a
+/// `SortingOutputStream`), into one sorted stream without duplicates.
+///
+/// Inputs are read ahead in batches on a pool of prefetch threads, which also
+/// compute each entry's sort key, so the merging thread only compares keys
+/// and copies entries. The smallest head is picked with a loser tree, which
+/// takes one comparison per level to replace it. An entry equal to the last
+/// one written (from any input) is dropped.
+class SortedEntryMerger {
+ public:
+  struct Options {
+    /// Read this many bytes of entries from an input at a time. Each input
+    /// holds up to two batches.
+    size_t batch_bytes = 256 * 1024;
+    /// The number of threads that read inputs ahead.
+    size_t prefetch_threads = 4;
+  };
+
+  /// \param output The stream to which to write merged entries. Not owned.
+  SortedEntryMerger(google::protobuf::io::ZeroCopyOutputStream *output,
+                    Options options);
+
+  /// \brief Stops the prefetch threads.
+  ~SortedEntryMerger();
+
+  SortedEntryMerger(const SortedEntryMerger &) = delete;
+  SortedEntryMerger &operator=(const SortedEntryMerger &) = delete;
+
+  /// \brief Adds an input to merge. Must be called before `Merge`.
+  /// \param name The name to use for the input in errors.
+  /// \param reader Reads the input. It is only used by one thread at a time,
+  /// but not necessarily the caller's.
+  void AddInput(std::string name, std::unique_ptr<DelimitedProtoReader> reader);
+
+  /// \brief Merges all inputs to the output. May only be called once.
+  /// \return false if an input was malformed, unreadable or out of order;
+  /// `error_text` will say which and why.
+  bool Merge(std::string *error_text);
+
+  /// \return the number of entries read from all inputs.
+  size_t entries_read() const { return entries_read_; }
+  /// \return the number of entries written.
+  size_t entries_written() const { return entries_written_; }
+
+ private:
+  /// \brief An entry together with its sort key.
+  struct Record {
+    /// The sort key followed by the entry.
+    std::string data;
+    /// The size of the key at the start of `data`.
+    size_t key_size;
+  };
+
+  struct Input;
+  class LoserTree;
+
+  /// \brief Reads the next batch of `input` into its `ready` slot. Called on
+  /// a prefetch thread.
+  void Prefetch(Input *input);
+
+  /// \brief Waits for `input`'s next batch and makes it current.
+  /// \return false if the input is exhausted.
+  bool NextBatch(Input *input);
+
+  /// \brief Runs prefetch requests until the merger is destroyed.
+  void PrefetchLoop();
+
+  /// The stream to write merged entries to.
+  google::protobuf::io::ZeroCopyOutputStream *output_;
+  Options options_;
+  std::vector<std::unique_ptr<Input>> inputs_;
+  /// Guards `queue_`, `stopping_` and each input's prefetched batch.
+  std::mutex mutex_;
+  /// Signalled when `queue_` changes or `stopping_` is set.
+  std::condition_variable queue_changed_;
+  /// Signalled when an input's batch is ready.
+  std::condition_variable batch_ready_;
+  /// Inputs waiting to be read ahead.
+  std::deque<Input *> queue_;
+  /// Set when the prefetch threads should exit.
+  bool stopping_ = false;
+  std::vector<std::thread> threads_;
+  size_t entries_read_ = 0;
+  size_t entries_written_ = 0;
+};
+
+}  // namespace kythe
+
+#endif  // KYTHE_CXX_COMMON_INDEXING_ENTRY_MERGER_H_
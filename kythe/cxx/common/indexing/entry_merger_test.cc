@@ -0,0 +1,144 @@
+/*
+ * Copyright 2017 Google Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "kythe/cxx/common/indexing/entry_merger.h"
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "google/protobuf/io/coded_stream.h"
+#include "google/protobuf/io/zero_copy_stream_impl_lite.h"
+#include "gtest/gtest.h"
+#include "kythe/proto/storage.pb.h"
+#include "llvm/ADT/STLExtras.h"
+
+namespace kythe {
+namespace {
+
+/// \return an entry with the given source signature.
+proto::Entry MakeFact(const std::string &signature) {
+  proto::Entry entry;
+  entry.mutable_source()->set_signature(signature);
+  entry.set_fact_name("/kythe/text");
+  entry.set_fact_value(signature);
+  return entry;
+}
+
+/// \return the signatures as a stream of varint-delimited entries.
+std::string Delimit(const std::vector<std::string> &signatures) {
+  std::string out;
+  google::protobuf::io::StringOutputStream raw_stream(&out);
+  google::protobuf::io::CodedOutputStream coded_stream(&raw_stream);
+  for (const auto &signature : signatures) {
+    proto::Entry entry = MakeFact(signature);
+    coded_stream.WriteVarint32(entry.ByteSize());
+    entry.SerializeWithCachedSizes(&coded_stream);
+  }
+  return out;
+}
+
+/// \brief The result of merging some inputs.
+struct Merged {
+  bool ok = false;
+  std::string error_text;
+  /// The signatures of the entries written.
+  std::vector<std::string> signatures;
+  size_t entries_read = 0;
+};
+
+/// \brief Merges `inputs`, reading `batch_bytes` at a time.
+Merged MergeInputs(const std::vector<std::vector<std::string>> &inputs,
+                   size_t batch_bytes) {
+  std::vector<std::string> data;
+  std::vector<std::unique_ptr<google::protobuf::io::ArrayInputStream>> streams;
+  for (const auto &input : inputs) {
+    data.push_back(Delimit(input));
+  }
+  Merged merged;
+  std::string out;
+  {
+    google::protobuf::io::StringOutputStream raw_stream(&out);
+    SortedEntryMerger::Options options;
+    options.batch_bytes = batch_bytes;
+    options.prefetch_threads = 3;
+    SortedEntryMerger merger(&raw_stream, options);
+    for (size_t i = 0; i < data.size(); ++i) {
+      streams.push_back(
+          llvm::make_unique<google::protobuf::io::ArrayInputStream>(
+              data[i].data(), data[i].size()));
+      merger.AddInput("input" + std::to_string(i),
+                      llvm::make_unique<DelimitedProtoReader>(
+                          streams.back().get()));
+    }
+    merged.ok = merger.Merge(&merged.error_text);
+    merged.entries_read = merger.entries_read();
+  }
+  google::protobuf::io::ArrayInputStream out_stream(out.data(), out.size());
+  DelimitedProtoReader reader(&out_stream);
+  proto::Entry entry;
+  while (reader.NextMessage(&entry)) {
+    merged.signatures.push_back(entry.source().signature());
+  }
+  EXPECT_EQ("", reader.error());
+  return merged;
+}
+
+TEST(SortedEntryMerger, MergesAndDeduplicates) {
+  for (size_t batch_bytes : {1, 1 << 20}) {
+    Merged merged = MergeInputs(
+        {{"a", "c", "e"}, {"b", "c", "d"}, {}, {"a", "f", "f"}}, batch_bytes);
+    EXPECT_TRUE(merged.ok) << merged.error_text;
+    std::vector<std::string> expected = {"a", "b", "c", "d", "e", "f"};
+    EXPECT_EQ(expected, merged.signatures);
+    EXPECT_EQ(9, merged.entries_read);
+  }
+}
+
+TEST(SortedEntryMerger, MergesManyInputs) {
+  std::vector<std::vector<std::string>> inputs(37);
+  std::vector<std::string> expected;
+  for (int i = 0; i < 1000; ++i) {
+    char signature[8];
+    snprintf(signature, sizeof(signature), "%04d", i);
+    inputs[(i * 7) % inputs.size()].push_back(signature);
+    expected.push_back(signature);
+  }
+  Merged merged = MergeInputs(inputs, 64);
+  EXPECT_TRUE(merged.ok) << merged.error_text;
+  EXPECT_EQ(expected, merged.signatures);
+}
+
+TEST(SortedEntryMerger, RejectsUnsortedInput) {
+  Merged merged = MergeInputs({{"a", "b"}, {"c", "a"}}, 1);
+  EXPECT_FALSE(merged.ok);
+  EXPECT_NE(std::string::npos, merged.error_text.find("input1"));
+}
+
+TEST(SortedEntryMerger, MergesNoInputs) {
+  Merged merged = MergeInputs({}, 1);
+  EXPECT_TRUE(merged.ok);
+  EXPECT_TRUE(merged.signatures.empty());
+}
+
+}  // namespace
+}  // namespace kythe
+
+int main(int argc, char **argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  int result = RUN_ALL_TESTS();
+  return result;
+}
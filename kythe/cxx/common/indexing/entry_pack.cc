@@ -0,0 +1,464 @@
+/*
+ * Copyright 2017 Google Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "kythe/cxx/common/indexing/entry_pack.h"
+
+#include <algorithm>
+#include <cstring>
+
+#include "google/protobuf/io/coded_stream.h"
+#include "google/protobuf/wire_format_lite.h"
+
+namespace kythe {
+namespace {
+using google::protobuf::io::CodedInputStream;
+using google::protobuf::io::CodedOutputStream;
+using google::protobuf::internal::WireFormatLite;
+
+/// The number of bytes handed out by each call to `Next`.
+constexpr size_t kChunkSize = 64 * 1024;
+
+/// \brief Appends `value` to `out` as a varint.
+void AppendVarint(uint64_t value, std::string *out) {
+  while (value >= 0x80) {
+    out->push_back(static_cast<char>(value | 0x80));
+    value >>= 7;
+  }
+  out->push_back(static_cast<char>(value));
+}
+
+/// \brief Reads a length-delimited field from `input`, which reads from the
+/// array starting at `base`, and points `value` at it.
+bool ReadField(CodedInputStream *input, const char *base,
+               llvm::StringRef *value) {
+  google::protobuf::uint32 size;
+  if (!input->ReadVarint32(&size)) {
+    return false;
+  }
+  int offset = input->CurrentPosition();
+  if (!input->Skip(size)) {
+    return false;
+  }
+  *value = llvm::StringRef(base + offset, size);
+  return true;
+}
+
+/// \brief Points the fields of `vname` at those of the wire-format `VName`
+/// in `data`.
+bool ParseVName(llvm::StringRef data, VNameRef *vname) {
+  CodedInputStream input(
+      reinterpret_cast<const google::protobuf::uint8 *>(data.data()),
+      data.size());
+  while (google::protobuf::uint32 tag = input.ReadTag()) {
+    llvm::StringRef *field = nullptr;
+    if (WireFormatLite::GetTagWireType(tag) ==
+        WireFormatLite::WIRETYPE_LENGTH_DELIMITED) {
+      switch (WireFormatLite::GetTagFieldNumber(tag)) {
+        case 1:
+          field = &vname->signature;
+          break;
+        case 2:
+          field = &vname->corpus;
+          break;
+        case 3:
+          field = &vname->root;
+          break;
+        case 4:
+          field = &vname->path;
+          break;
+        case 5:
+          field = &vname->language;
+          break;
+      }
+    }
+    if (field == nullptr) {
+      if (!WireFormatLite::SkipField(&input, tag)) {
+        return false;
+      }
+    } else if (!ReadField(&input, data.data(), field)) {
+      return false;
+    }
+  }
+  return input.ConsumedEntireMessage();
+}
+}  // anonymous namespace
+
+void EntryRef::Expand(proto::Entry *entry) const {
+  entry->Clear();
+  source.Expand(entry->mutable_source());
+  entry->mutable_edge_kind()->assign(edge_kind.data(), edge_kind.size());
+  if (has_target) {
+    target.Expand(entry->mutable_target());
+  }
+  entry->mutable_fact_name()->assign(fact_name.data(), fact_name.size());
+  entry->mutable_fact_value()->assign(fact_value.data(), fact_value.size());
+}
+
+bool EntryRef::Parse(llvm::StringRef entry) {
+  *this = EntryRef();
+  CodedInputStream input(
+      reinterpret_cast<const google::protobuf::uint8 *>(entry.data()),
+      entry.size());
+  while (google::protobuf::uint32 tag = input.ReadTag()) {
+    bool ok = false;
+    llvm::StringRef field;
+    if (WireFormatLite::GetTagWireType(tag) !=
+        WireFormatLite::WIRETYPE_LENGTH_DELIMITED) {
+      ok = WireFormatLite::SkipField(&input, tag);
+    } else {
+      switch (WireFormatLite::GetTagFieldNumber(tag)) {
+        case 1:
+          ok = ReadField(&input, entry.data(), &field) &&
+               ParseVName(field, &source);
+          break;
+        case 2:
+          ok = ReadField(&input, entry.data(), &edge_kind);
+          break;
+        case 3:
+          ok = ReadField(&input, entry.data(), &field) &&
+               ParseVName(field, &target);
+          has_target = true;
+          break;
+        case 4:
+          ok = ReadField(&input, entry.data(), &fact_name);
+          break;
+        case 5:
+          ok = ReadField(&input, entry.data(), &fact_value);
+          break;
+        default:
+          ok = WireFormatLite::SkipField(&input, tag);
+      }
+    }
+    if (!ok) {
+      return false;
+    }
+  }
+  return input.ConsumedEntireMessage();
+}
+
+constexpr size_t EntryPackOutputStream::kDefaultMaxBlockEntries;
+constexpr size_t EntryPackOutputStream::kDefaultMaxBlockBytes;
+
+EntryPackOutputStream::EntryPackOutputStream(
+    google::protobuf::io::ZeroCopyOutputStream *output,
+    size_t max_block_entries, size_t max_block_bytes)
+    : output_(output),
+      max_block_entries_(max_block_entries),
+      max_block_bytes_(max_block_bytes) {}
+
+bool EntryPackOutputStream::Next(void **data, int *size) {
+  if (closed_ || !ParsePending()) {
+    return false;
+  }
+  if (pending_.size() < pending_size_ + kChunkSize) {
+    pending_.resize(pending_size_ + kChunkSize);
+  }
+  *data = &pending_[pending_size_];
+  *size = kChunkSize;
+  pending_size_ += kChunkSize;
+  return true;
+}
+
+void EntryPackOutputStream::BackUp(int count) { pending_size_ -= count; }
+
+google::protobuf::int64 EntryPackOutputStream::ByteCount() const {
+  return parsed_bytes_ + pending_size_;
+}
+
+bool EntryPackOutputStream::ParsePending() {
+  if (!error_.empty()) {
+    return false;
+  }
+  size_t offset = 0;
+  while (offset < pending_size_) {
+    CodedInputStream input(
+        reinterpret_cast<const google::protobuf::uint8 *>(pending_.data()) +
+            offset,
+        pending_size_ - offset);
+    google::protobuf::uint32 entry_size;
+    if (!input.ReadVarint32(&entry_size)) {
+      break;
+    }
+    size_t header_size = input.CurrentPosition();
+    if (pending_size_ - offset - header_size < entry_size) {
+      break;
+    }
+    EntryRef entry;
+    if (!entry.Parse(llvm::StringRef(pending_.data() + offset + header_size,
+                                     entry_size))) {
+      error_ = "Malformed entry at offset " +
+               std::to_string(parsed_bytes_ + offset);
+      return false;
+    }
+    AddEntry(entry);
+    block_bytes_ += header_size + entry_size;
+    offset += header_size + entry_size;
+    if (block_entries_ >= max_block_entries_ ||
+        block_bytes_ >= max_block_bytes_) {
+      WriteBlock();
+    }
+  }
+  if (offset != 0) {
+    std::memmove(&pending_[0], pending_.data() + offset,
+                 pending_size_ - offset);
+    pending_size_ -= offset;
+    parsed_bytes_ += offset;
+  }
+  return true;
+}
+
+void EntryPackOutputStream::AddString(llvm::StringRef value,
+                                      entry_pack::Column column) {
+  uint32_t index = 0;
+  if (!value.empty()) {
+    auto inserted = string_indices_.insert(
+        std::make_pair(value, static_cast<uint32_t>(strings_.size() + 1)));
+    if (inserted.second) {
+      strings_.push_back(inserted.first->getKey());
+    }
+    index = inserted.first->getValue();
+  }
+  AppendVarint(index, &columns_[column]);
+}
+
+void EntryPackOutputStream::AddEntry(const EntryRef &entry) {
+  AppendVarint(entry.has_target ? entry_pack::kHasTarget : 0,
+               &columns_[entry_pack::kFlags]);
+  AddString(entry.source.signature, entry_pack::kSourceSignature);
+  AddString(entry.source.corpus, entry_pack::kSourceCorpus);
+  AddString(entry.source.root, entry_pack::kSourceRoot);
+  AddString(entry.source.path, entry_pack::kSourcePath);
+  AddString(entry.source.language, entry_pack::kSourceLanguage);
+  AddString(entry.edge_kind, entry_pack::kEdgeKind);
+  if (entry.has_target) {
+    AddString(entry.target.signature, entry_pack::kTargetSignature);
+    AddString(entry.target.corpus, entry_pack::kTargetCorpus);
+    AddString(entry.target.root, entry_pack::kTargetRoot);
+    AddString(entry.target.path, entry_pack::kTargetPath);
+    AddString(entry.target.language, entry_pack::kTargetLanguage);
+  }
+  AddString(entry.fact_name, entry_pack::kFactName);
+  AppendVarint(entry.fact_value.size(), &columns_[entry_pack::kFactValue]);
+  columns_[entry_pack::kFactValue].append(entry.fact_value.data(),
+                                          entry.fact_value.size());
+  ++block_entries_;
+}
+
+void EntryPackOutputStream::WriteBlock() {
+  CodedOutputStream coded_output(output_);
+  if (!wrote_magic_) {
+    coded_output.WriteRaw(entry_pack::kMagic, entry_pack::kMagicSize);
+    wrote_magic_ = true;
+  }
+  if (block_entries_ == 0) {
+    return;
+  }
+  block_.clear();
+  AppendVarint(block_entries_, &block_);
+  AppendVarint(strings_.size(), &block_);
+  for (const auto &string : strings_) {
+    AppendVarint(string.size(), &block_);
+    block_.append(string.data(), string.size());
+  }
+  for (auto &column : columns_) {
+    AppendVarint(column.size(), &block_);
+    block_.append(column);
+    column.clear();
+  }
+  coded_output.WriteVarint64(block_.size());
+  coded_output.WriteRaw(block_.data(), block_.size());
+  strings_.clear();
+  string_indices_.clear();
+  block_entries_ = 0;
+  block_bytes_ = 0;
+  ++blocks_written_;
+}
+
+bool EntryPackOutputStream::Close(std::string *error_text) {
+  if (closed_) {
+    return true;
+  }
+  closed_ = true;
+  if (ParsePending() && pending_size_ != 0) {
+    error_ = "Truncated entry at offset " + std::to_string(parsed_bytes_);
+  }
+  if (!error_.empty()) {
+    *error_text = error_;
+    return false;
+  }
+  WriteBlock();
+  return true;
+}
+
+EntryPackReader::EntryPackReader(
+    google::protobuf::io::ZeroCopyInputStream *input)
+    : input_(input) {}
+
+bool EntryPackReader::Fail(const std::string &error) {
+  if (error_.empty()) {
+    error_ = error;
+  }
+  return false;
+}
+
+bool EntryPackReader::ReadVarint(llvm::StringRef *data, uint64_t *value) {
+  *value = 0;
+  for (size_t i = 0; i < data->size() && i < 10; ++i) {
+    unsigned char byte = (*data)[i];
+    *value |= static_cast<uint64_t>(byte & 0x7f) << (7 * i);
+    if ((byte & 0x80) == 0) {
+      *data = data->drop_front(i + 1);
+      return true;
+    }
+  }
+  return false;
+}
+
+bool EntryPackReader::ReadBytes(llvm::StringRef *data, llvm::StringRef *bytes) {
+  uint64_t size;
+  if (!ReadVarint(data, &size) || size > data->size()) {
+    return false;
+  }
+  *bytes = data->take_front(size);
+  *data = data->drop_front(size);
+  return true;
+}
+
+bool EntryPackReader::ReadString(entry_pack::Column column,
+                                 llvm::StringRef *value) {
+  uint64_t index;
+  if (!ReadVarint(&columns_[column], &index) || index >= strings_.size()) {
+    return Fail("Bad string index in column " + std::to_string(column));
+  }
+  *value = strings_[index];
+  return true;
+}
+
+size_t EntryPackReader::ReadRaw(size_t count, std::string *out) {
+  size_t read = 0;
+  while (read < count) {
+    const void *data;
+    int size;
+    if (!input_->Next(&data, &size)) {
+      break;
+    }
+    size_t used = std::min<size_t>(size, count - read);
+    out->append(static_cast<const char *>(data), used);
+    input_->BackUp(size - used);
+    read += used;
+  }
+  return read;
+}
+
+bool EntryPackReader::ReadBlock() {
+  if (!read_magic_) {
+    std::string magic;
+    if (ReadRaw(entry_pack::kMagicSize, &magic) != entry_pack::kMagicSize ||
+        magic != llvm::StringRef(entry_pack::kMagic, entry_pack::kMagicSize)) {
+      return Fail("Not an entry pack");
+    }
+    read_magic_ = true;
+  }
+  uint64_t body_size = 0;
+  for (size_t shift = 0;; shift += 7) {
+    std::string byte;
+    if (ReadRaw(1, &byte) == 0) {
+      // The pack may only end between blocks.
+      return shift == 0 ? false : Fail("Truncated block header");
+    }
+    if (shift > 63) {
+      return Fail("Bad block size");
+    }
+    body_size |= static_cast<uint64_t>(byte[0] & 0x7f) << shift;
+    if ((byte[0] & 0x80) == 0) {
+      break;
+    }
+  }
+  block_.clear();
+  if (ReadRaw(body_size, &block_) != body_size) {
+    return Fail("Truncated block");
+  }
+  llvm::StringRef body(block_);
+  uint64_t string_count;
+  if (!ReadVarint(&body, &entries_left_) ||
+      !ReadVarint(&body, &string_count) || string_count > body.size()) {
+    return Fail("Bad block header");
+  }
+  strings_.assign(1, llvm::StringRef());
+  for (uint64_t i = 0; i < string_count; ++i) {
+    strings_.emplace_back();
+    if (!ReadBytes(&body, &strings_.back())) {
+      return Fail("Bad string table");
+    }
+  }
+  for (auto &column : columns_) {
+    if (!ReadBytes(&body, &column)) {
+      return Fail("Bad column");
+    }
+  }
+  if (!body.empty()) {
+    return Fail("Trailing data in block");
+  }
+  return true;
+}
+
+bool EntryPackReader::Next(EntryRef *entry) {
+  if (!error_.empty()) {
+    return false;
+  }
+  while (entries_left_ == 0) {
+    for (const auto &column : columns_) {
+      if (!column.empty()) {
+        return Fail("Trailing data in column");
+      }
+    }
+    if (!ReadBlock()) {
+      return false;
+    }
+  }
+  uint64_t flags;
+  if (!ReadVarint(&columns_[entry_pack::kFlags], &flags)) {
+    return Fail("Bad flags");
+  }
+  *entry = EntryRef();
+  entry->has_target = (flags & entry_pack::kHasTarget) != 0;
+  if (!ReadString(entry_pack::kSourceSignature, &entry->source.signature) ||
+      !ReadString(entry_pack::kSourceCorpus, &entry->source.corpus) ||
+      !ReadString(entry_pack::kSourceRoot, &entry->source.root) ||
+      !ReadString(entry_pack::kSourcePath, &entry->source.path) ||
+      !ReadString(entry_pack::kSourceLanguage, &entry->source.language) ||
+      !ReadString(entry_pack::kEdgeKind, &entry->edge_kind)) {
+    return false;
+  }
+  if (entry->has_target &&
+      (!ReadString(entry_pack::kTargetSignature, &entry->target.signature) ||
+       !ReadString(entry_pack::kTargetCorpus, &entry->target.corpus) ||
+       !ReadString(entry_pack::kTargetRoot, &entry->target.root) ||
+       !ReadString(entry_pack::kTargetPath, &entry->target.path) ||
+       !ReadString(entry_pack::kTargetLanguage, &entry->target.language))) {
+    return false;
+  }
+  if (!ReadString(entry_pack::kFactName, &entry->fact_name)) {
+    return false;
+  }
+  if (!ReadBytes(&columns_[entry_pack::kFactValue], &entry->fact_value)) {
+    return Fail("Bad fact value");
+  }
+  --entries_left_;
+  return true;
+}
+
+}  // namespace kythe
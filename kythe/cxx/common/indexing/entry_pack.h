@@ -0,0 +1,240 @@
+/*
+ * Copyright 2017 Google Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef KYTHE_CXX_COMMON_INDEXING_ENTRY_PACK_H_
+#define KYTHE_CXX_COMMON_INDEXING_ENTRY_PACK_H_
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "google/protobuf/io/zero_copy_stream.h"
+#include "kythe/cxx/common/indexing/KytheOutputStream.h"
+#include "kythe/proto/storage.pb.h"
+#include "llvm/ADT/StringMap.h"
+#include "llvm/ADT/StringRef.h"
+
+namespace kythe {
+
+/// \brief An `Entry` whose fields refer to data held elsewhere. Entries
+/// always have a source (even an empty one).
+struct EntryRef {
+  VNameRef source;
+  llvm::StringRef edge_kind;
+  /// Whether the entry has a target (even an empty one).
+  bool has_target = false;
+  VNameRef target;
+  llvm::StringRef fact_name;
+  llvm::StringRef fact_value;
+
+  /// \brief Overwrites `entry` with a copy of this entry.
+  void Expand(proto::Entry *entry) const;
+
+  /// \brief Makes this entry refer to the fields of a wire-format `Entry`.
+  /// \return false if `entry` isn't a well-formed `Entry`.
+  bool Parse(llvm::StringRef entry);
+};
+
+/// \brief The entry pack format.
+///
+/// An entry pack is a compact encoding of a stream of entries. Most of the
+/// bytes in an entry stream are VName components and fact and edge names
+/// that are repeated in entry after entry; an entry pack stores each of
+/// these strings once per block and refers to them by index. Entries are
+/// also stored column by column, which makes packs compress better.
+///
+///     pack   := kMagic block*
+///     block  := varint(size of body) body
+///     body   := varint(entry count) varint(string count) string* column*
+///     string := varint(size) bytes
+///     column := varint(size) bytes
+///
+/// String 0 is always the empty string and isn't stored; the strings in the
+/// table are numbered from 1. There are `kColumnCount` columns, in the order
+/// of `Column`. The flags column holds a varint per entry (see `Flags`).
+/// The target columns hold a varint string index for each entry with a
+/// target; the other index columns hold one for every entry. The fact value
+/// column holds each entry's value as a varint size followed by its bytes.
+namespace entry_pack {
+/// The bytes at the start of every entry pack.
+constexpr char kMagic[] = "KYTHEPK\x01";
+/// The size of `kMagic`.
+constexpr size_t kMagicSize = sizeof(kMagic) - 1;
+
+/// Per-entry flags.
+enum Flags : uint32_t { kHasTarget = 1 };
+
+/// The columns in each block.
+enum Column : size_t {
+  kFlags,
+  kSourceSignature,
+  kSourceCorpus,
+  kSourceRoot,
+  kSourcePath,
+  kSourceLanguage,
+  kEdgeKind,
+  kTargetSignature,
+  kTargetCorpus,
+  kTargetRoot,
+  kTargetPath,
+  kTargetLanguage,
+  kFactName,
+  kFactValue,
+  kColumnCount
+};
+}  // namespace entry_pack
+
+/// \brief Converts a stream of varint-delimited wire-format `Entry` messages
+/// (like the output of a `FileOutputStream`) to an entry pack.
+///
+/// Entries are collected into a block until the block holds
+/// `max_block_entries` entries or `max_block_bytes` bytes of entries, and
+/// then the block is written to the underlying stream.
+class EntryPackOutputStream
+    : public google::protobuf::io::ZeroCopyOutputStream {
+ public:
+  /// \param output The stream to which to write the pack. Not owned.
+  /// \param max_block_entries The most entries to put in a block.
+  /// \param max_block_bytes The most bytes of (delimited) entries to put in
+  /// a block.
+  explicit EntryPackOutputStream(
+      google::protobuf::io::ZeroCopyOutputStream *output,
+      size_t max_block_entries = kDefaultMaxBlockEntries,
+      size_t max_block_bytes = kDefaultMaxBlockBytes);
+
+  bool Next(void **data, int *size) override;
+  void BackUp(int count) override;
+  google::protobuf::int64 ByteCount() const override;
+
+  /// \brief Writes the last block to the underlying stream. No more data may
+  /// be written after the stream is closed. The underlying stream is not
+  /// closed.
+  /// \return false if the input was malformed; `error_text` will say why.
+  bool Close(std::string *error_text);
+
+  /// \return the number of blocks written so far.
+  size_t blocks_written() const { return blocks_written_; }
+
+  /// The default most entries to put in a block.
+  static constexpr size_t kDefaultMaxBlockEntries = 16 * 1024;
+  /// The default most bytes of entries to put in a block.
+  static constexpr size_t kDefaultMaxBlockBytes = 4 * 1024 * 1024;
+
+ private:
+  /// \brief Adds the complete entries at the start of `pending_` to the
+  /// block, writing it out when it fills up.
+  bool ParsePending();
+
+  /// \brief Adds `entry` to the block.
+  void AddEntry(const EntryRef &entry);
+
+  /// \brief Appends the index of `value` in the block's string table to
+  /// `column`, adding it to the table if necessary.
+  void AddString(llvm::StringRef value, entry_pack::Column column);
+
+  /// \brief Writes the block to `output_` and starts a new one.
+  void WriteBlock();
+
+  /// The stream to write the pack to.
+  google::protobuf::io::ZeroCopyOutputStream *output_;
+  /// The most entries to put in a block.
+  size_t max_block_entries_;
+  /// The most bytes of entries to put in a block.
+  size_t max_block_bytes_;
+  /// Bytes written to this stream that haven't been parsed yet.
+  std::string pending_;
+  /// The number of bytes of `pending_` that hold data.
+  size_t pending_size_ = 0;
+  /// The number of bytes parsed out of `pending_` so far.
+  google::protobuf::int64 parsed_bytes_ = 0;
+  /// The block's string table, mapping strings to their indices.
+  llvm::StringMap<uint32_t> string_indices_;
+  /// The block's strings, in index order (starting with string 1).
+  std::vector<llvm::StringRef> strings_;
+  /// The block's columns.
+  std::string columns_[entry_pack::kColumnCount];
+  /// The number of entries in the block.
+  size_t block_entries_ = 0;
+  /// The number of bytes of entries in the block.
+  size_t block_bytes_ = 0;
+  /// Scratch space for encoding blocks.
+  std::string block_;
+  /// The number of blocks written so far.
+  size_t blocks_written_ = 0;
+  /// Set once `kMagic` has been written.
+  bool wrote_magic_ = false;
+  /// The first error encountered while writing, if any.
+  std::string error_;
+  /// Set once `Close` has been called.
+  bool closed_ = false;
+};
+
+/// \brief Reads the entries in an entry pack.
+class EntryPackReader {
+ public:
+  /// \param input The stream from which to read the pack. Not owned.
+  explicit EntryPackReader(google::protobuf::io::ZeroCopyInputStream *input);
+
+  /// \brief Reads the next entry. The fields of `entry` stay valid until the
+  /// next call.
+  /// \return false at the end of the pack or on error (see `error()`).
+  bool Next(EntryRef *entry);
+
+  /// \return a description of the first error, or an empty string if the
+  /// pack ended cleanly (or hasn't ended yet).
+  const std::string &error() const { return error_; }
+
+ private:
+  /// \brief Reads a varint-encoded value from the front of `data`.
+  static bool ReadVarint(llvm::StringRef *data, uint64_t *value);
+
+  /// \brief Reads a varint-delimited string from the front of `data`.
+  static bool ReadBytes(llvm::StringRef *data, llvm::StringRef *bytes);
+
+  /// \brief Appends up to `count` bytes from `input_` to `out`.
+  /// \return the number of bytes read, which is less than `count` only if
+  /// the input ended.
+  size_t ReadRaw(size_t count, std::string *out);
+
+  /// \brief Reads a string index from `column` and looks it up.
+  bool ReadString(entry_pack::Column column, llvm::StringRef *value);
+
+  /// \brief Reads the next block into `block_`.
+  /// \return false at the end of the pack or on error.
+  bool ReadBlock();
+
+  /// \brief Records `error` and returns false.
+  bool Fail(const std::string &error);
+
+  /// The stream from which we read the pack.
+  google::protobuf::io::ZeroCopyInputStream *input_;
+  /// The current block's body.
+  std::string block_;
+  /// The current block's strings, including the empty string 0.
+  std::vector<llvm::StringRef> strings_;
+  /// The unread parts of the current block's columns.
+  llvm::StringRef columns_[entry_pack::kColumnCount];
+  /// The number of entries left in the current block.
+  uint64_t entries_left_ = 0;
+  /// Set once the magic has been read.
+  bool read_magic_ = false;
+  /// The first error encountered, if any.
+  std::string error_;
+};
+
+}  // namespace kythe
+
+#endif  // KYTHE_CXX_COMMON_INDEXING_ENTRY_PACK_H_
@@ -0,0 +1,173 @@
+/*
+ * Copyright 2017 Google Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "entry_pack.h"
+
+#include <string>
+#include <vector>
+
+#include "google/protobuf/io/coded_stream.h"
+#include "google/protobuf/io/zero_copy_stream_impl_lite.h"
+#include "gtest/gtest.h"
+#include "kythe/proto/storage.pb.h"
+
+namespace kythe {
+namespace {
+
+/// \brief Writes `entries` to an entry pack with blocks of at most
+/// `max_block_entries` entries.
+std::string Pack(const std::vector<proto::Entry> &entries,
+                 size_t max_block_entries, size_t *blocks_written) {
+  std::string out;
+  google::protobuf::io::StringOutputStream raw_stream(&out);
+  EntryPackOutputStream pack_stream(&raw_stream, max_block_entries);
+  {
+    google::protobuf::io::CodedOutputStream coded_stream(&pack_stream);
+    for (const auto &entry : entries) {
+      coded_stream.WriteVarint32(entry.ByteSize());
+      entry.SerializeWithCachedSizes(&coded_stream);
+    }
+  }
+  std::string error_text;
+  EXPECT_TRUE(pack_stream.Close(&error_text)) << error_text;
+  *blocks_written = pack_stream.blocks_written();
+  return out;
+}
+
+/// \brief Reads the entries in `pack`.
+/// \param error Set to the reader's error, if any.
+std::vector<proto::Entry> Unpack(const std::string &pack,
+                                 std::string *error) {
+  google::protobuf::io::ArrayInputStream raw_stream(pack.data(), pack.size(),
+                                                    7);
+  EntryPackReader reader(&raw_stream);
+  std::vector<proto::Entry> entries;
+  EntryRef entry;
+  while (reader.Next(&entry)) {
+    entries.emplace_back();
+    entry.Expand(&entries.back());
+  }
+  *error = reader.error();
+  return entries;
+}
+
+std::vector<proto::Entry> TestEntries() {
+  std::vector<proto::Entry> entries;
+  for (int i = 0; i < 100; ++i) {
+    proto::Entry fact;
+    fact.mutable_source()->set_signature("node" + std::to_string(i / 3));
+    fact.mutable_source()->set_corpus("corpus");
+    fact.mutable_source()->set_path("some/file/path.cc");
+    fact.mutable_source()->set_language("c++");
+    fact.set_fact_name("/kythe/node/kind");
+    fact.set_fact_value(i % 2 ? "function" : std::string(i * 10, 'v'));
+    entries.push_back(fact);
+    proto::Entry edge;
+    *edge.mutable_source() = fact.source();
+    edge.set_edge_kind("/kythe/edge/childof");
+    *edge.mutable_target() = fact.source();
+    edge.mutable_target()->set_signature("parent");
+    edge.set_fact_name("/");
+    entries.push_back(edge);
+  }
+  proto::Entry empty_target;
+  empty_target.mutable_source()->set_signature(std::string("a\0b", 3));
+  empty_target.mutable_target();
+  entries.push_back(empty_target);
+  proto::Entry no_target;
+  no_target.mutable_source()->set_signature("b");
+  entries.push_back(no_target);
+  return entries;
+}
+
+TEST(EntryPack, RoundTrips) {
+  auto entries = TestEntries();
+  size_t blocks = 0;
+  std::string pack = Pack(entries, 64, &blocks);
+  EXPECT_EQ(4, blocks);
+  std::string error;
+  auto unpacked = Unpack(pack, &error);
+  EXPECT_EQ("", error);
+  ASSERT_EQ(entries.size(), unpacked.size());
+  for (size_t i = 0; i < entries.size(); ++i) {
+    EXPECT_EQ(entries[i].SerializeAsString(), unpacked[i].SerializeAsString())
+        << i;
+  }
+  EXPECT_FALSE(unpacked[unpacked.size() - 1].has_target());
+  EXPECT_TRUE(unpacked[unpacked.size() - 2].has_target());
+}
+
+TEST(EntryPack, IsSmallerThanEntryStream) {
+  auto entries = TestEntries();
+  size_t stream_size = 0;
+  for (const auto &entry : entries) {
+    stream_size += entry.ByteSize() + 2;
+  }
+  size_t blocks = 0;
+  std::string pack = Pack(entries, 1 << 20, &blocks);
+  EXPECT_EQ(1, blocks);
+  EXPECT_LT(pack.size(), stream_size);
+}
+
+TEST(EntryPack, EmptyPackHasMagic) {
+  size_t blocks = 0;
+  std::string pack = Pack({}, 64, &blocks);
+  EXPECT_EQ(0, blocks);
+  EXPECT_EQ(std::string(entry_pack::kMagic, entry_pack::kMagicSize), pack);
+  std::string error;
+  EXPECT_TRUE(Unpack(pack, &error).empty());
+  EXPECT_EQ("", error);
+}
+
+TEST(EntryPack, RejectsBadInput) {
+  std::string error;
+  EXPECT_TRUE(Unpack("not a pack", &error).empty());
+  EXPECT_EQ("Not an entry pack", error);
+  size_t blocks = 0;
+  std::string pack = Pack(TestEntries(), 64, &blocks);
+  Unpack(pack.substr(0, pack.size() - 1), &error);
+  EXPECT_EQ("Truncated block", error);
+  pack[entry_pack::kMagicSize + 3] ^= 0x7f;
+  Unpack(pack, &error);
+  EXPECT_NE("", error);
+}
+
+TEST(EntryRef, ParsesWireFormat) {
+  proto::Entry entry;
+  entry.mutable_source()->set_root("root");
+  entry.mutable_target()->set_language("go");
+  entry.set_edge_kind("/kythe/edge/ref");
+  entry.set_fact_name("/");
+  std::string wire = entry.SerializeAsString();
+  EntryRef ref;
+  ASSERT_TRUE(ref.Parse(wire));
+  EXPECT_EQ("root", ref.source.root);
+  EXPECT_TRUE(ref.has_target);
+  EXPECT_EQ("go", ref.target.language);
+  proto::Entry expanded;
+  ref.Expand(&expanded);
+  EXPECT_EQ(wire, expanded.SerializeAsString());
+  EXPECT_FALSE(ref.Parse(wire.substr(0, wire.size() - 1)));
+}
+
+}  // namespace
+}  // namespace kythe
+
+int main(int argc, char **argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  int result = RUN_ALL_TESTS();
+  return result;
+}
@@ -0,0 +1,59 @@
+/*
+ * Copyright 2017 Google Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "kythe/cxx/common/indexing/entry_wire.h"
+
+#include "google/protobuf/wire_format_lite.h"
+
+namespace kythe {
+
+using google::protobuf::io::CodedInputStream;
+using google::protobuf::internal::WireFormatLite;
+
+bool ReadVNameFields(CodedInputStream *input, std::string fields[5]) {
+  google::protobuf::uint32 size;
+  if (!input->ReadVarint32(&size)) {
+    return false;
+  }
+  // Reading past the end of an in-memory buffer looks like the end of a
+  // message, so check that the whole VName is there before parsing it.
+  if (size > 0) {
+    const void *data;
+    int available = 0;
+    if (!input->GetDirectBufferPointer(&data, &available) ||
+        static_cast<google::protobuf::uint32>(available) < size) {
+      return false;
+    }
+  }
+  auto limit = input->PushLimit(size);
+  while (google::protobuf::uint32 tag = input->ReadTag()) {
+    int field = WireFormatLite::GetTagFieldNumber(tag);
+    if (field >= 1 && field <= 5 &&
+        WireFormatLite::GetTagWireType(tag) ==
+            WireFormatLite::WIRETYPE_LENGTH_DELIMITED) {
+      if (!WireFormatLite::ReadString(input, &fields[field - 1])) {
+        return false;
+      }
+    } else if (!WireFormatLite::SkipField(input, tag)) {
+      return false;
+    }
+  }
+  bool consumed = input->ConsumedEntireMessage();
+  input->PopLimit(limit);
+  return consumed;
+}
+
+}  // namespace kythe
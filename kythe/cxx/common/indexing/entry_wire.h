@@ -0,0 +1,38 @@
+/*
+ * Copyright 2017 Google Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef KYTHE_CXX_COMMON_INDEXING_ENTRY_WIRE_H_
+#define KYTHE_CXX_COMMON_INDEXING_ENTRY_WIRE_H_
+
+#include <string>
+
+#include "google/protobuf/io/coded_stream.h"
+
+namespace kythe {
+
+/// \brief Reads a length-delimited `VName` (such as an `Entry`'s source or
+/// target, just after its tag) into its five fields, in VName order, without
+/// parsing it into a message. Fields the VName doesn't set are left alone.
+///
+/// `input` must read from memory (as a `CodedInputStream` over an array
+/// does), so that a VName cut short by the end of the input is caught.
+/// \return false if the VName is malformed or truncated.
+bool ReadVNameFields(google::protobuf::io::CodedInputStream *input,
+                     std::string fields[5]);
+
+}  // namespace kythe
+
+#endif  // KYTHE_CXX_COMMON_INDEXING_ENTRY_WIRE_H_
@@ -0,0 +1,76 @@
+/*
+ * Copyright 2017 Google Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "kythe/cxx/common/indexing/entry_wire.h"
+
+#include <string>
+
+#include "gtest/gtest.h"
+#include "kythe/proto/storage.pb.h"
+
+namespace kythe {
+namespace {
+
+using google::protobuf::io::CodedInputStream;
+
+TEST(EntryWireTest, ReadsVNameFieldsInOrder) {
+  proto::Entry entry;
+  entry.mutable_source()->set_signature("sig");
+  entry.mutable_source()->set_corpus("corpus");
+  entry.mutable_source()->set_language("c++");
+  entry.set_fact_name("/kythe/node/kind");
+  std::string data = entry.SerializeAsString();
+  CodedInputStream input(
+      reinterpret_cast<const google::protobuf::uint8 *>(data.data()),
+      data.size());
+  ASSERT_EQ(0x0a, input.ReadTag());
+  std::string fields[5];
+  ASSERT_TRUE(ReadVNameFields(&input, fields));
+  EXPECT_EQ("sig", fields[0]);
+  EXPECT_EQ("corpus", fields[1]);
+  EXPECT_EQ("", fields[2]);
+  EXPECT_EQ("", fields[3]);
+  EXPECT_EQ("c++", fields[4]);
+  // The rest of the entry is left to the caller.
+  EXPECT_EQ(0x22, input.ReadTag());
+}
+
+TEST(EntryWireTest, RejectsTruncatedVNames) {
+  const std::string data("\x05\x0a\x03s", 4);
+  CodedInputStream input(
+      reinterpret_cast<const google::protobuf::uint8 *>(data.data()),
+      data.size());
+  std::string fields[5];
+  EXPECT_FALSE(ReadVNameFields(&input, fields));
+}
+
+TEST(EntryWireTest, RejectsFieldsThatOverrunTheVName) {
+  // The VName is 2 bytes long, but its signature claims 3.
+  const std::string data("\x02\x0a\x03sig", 6);
+  CodedInputStream input(
+      reinterpret_cast<const google::protobuf::uint8 *>(data.data()),
+      data.size());
+  std::string fields[5];
+  EXPECT_FALSE(ReadVNameFields(&input, fields));
+}
+
+}  // namespace
+}  // namespace kythe
+
+int main(int argc, char **argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
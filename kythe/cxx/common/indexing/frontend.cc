@@ -16,34 +16,149 @@
 
 #include "kythe/cxx/common/indexing/frontend.h"
 
+#include <errno.h>
 #include <fcntl.h>
+#include <string.h>
 #include <sys/stat.h>
 #include <unistd.h>
+#include <algorithm>
+#include <numeric>
 #include <string>
 
 #include "gflags/gflags.h"
+#include "kythe/cxx/common/indexing/analysis_server.h"
+#include "kythe/cxx/common/indexing/claim_table.h"
+#include "kythe/cxx/common/indexing/hash_snapshot.h"
+#include "kythe/cxx/common/indexing/index_journal.h"
+#include "kythe/cxx/common/indexing/job_cost_model.h"
+#include "kythe/cxx/common/indexing/memcached_pool.h"
+#include "kythe/cxx/common/indexing/work_queue.h"
 #include "google/protobuf/io/coded_stream.h"
 #include "google/protobuf/io/gzip_stream.h"
 #include "google/protobuf/io/zero_copy_stream.h"
 #include "google/protobuf/io/zero_copy_stream_impl.h"
+#include "kythe/cxx/common/delimited_proto_reader.h"
+#include "kythe/cxx/common/http_blob_fetcher.h"
+#include "kythe/cxx/common/net_client.h"
 #include "kythe/cxx/common/path_utils.h"
 #include "kythe/cxx/common/proto_conversions.h"
+#include "kythe/cxx/common/remote_index_pack.h"
+#include "kythe/cxx/common/segmented_index_pack.h"
+#include "kythe/cxx/common/snappy_stream.h"
 #include "kythe/proto/claim.pb.h"
 #include "llvm/ADT/STLExtras.h"
 
 DEFINE_string(o, "-", "Output filename");
 DEFINE_string(i, "-", "Input filename");
+DEFINE_bool(experimental_serve_analysis_requests, false,
+            "Answer a stream of analysis requests read from the input "
+            "instead of indexing the files named on the command line. See "
+            "kythe/cxx/common/indexing/analysis_server.h.");
+DEFINE_uint64(experimental_analysis_buffer_bytes, 4 << 20,
+              "With --experimental_serve_analysis_requests, send a unit's "
+              "entries once this many bytes of them are buffered instead of "
+              "waiting for the unit to finish.");
 DEFINE_bool(ignore_unimplemented, true,
             "Continue indexing even if we find something we don't support.");
 DEFINE_bool(flush_after_each_entry, true,
             "Flush output after writing each entry.");
 DEFINE_string(static_claim, "", "Use a static claim table.");
+DEFINE_int32(static_claim_read_threads, 4,
+             "Inflate and parse a --static_claim stream on this many "
+             "threads.");
+DEFINE_string(experimental_static_claim_shards, "",
+              "Instead of loading a whole --static_claim table, load the "
+              "claims for each unit from the shard that static_claim "
+              "--shard_dir wrote for it in this directory.");
 DEFINE_bool(claim_unknown, true, "Process files with unknown claim status.");
 DEFINE_string(index_pack, "", "Mount an index pack rooted at this directory.");
-DEFINE_string(cache, "", "Use a memcache instance (ex: \"--SERVER=foo:1234\")");
+DEFINE_int32(index_pack_read_threads, 8,
+             "Read file content from --index_pack on this many threads.");
+DEFINE_int32(index_pack_readahead, 64,
+             "Let reads from --index_pack run at most this many files ahead "
+             "of decoding.");
+DEFINE_string(index_pack_cache_dir, "",
+              "When --index_pack is remote (an http://, https:// or gs:// "
+              "URI), keep the data read from it in this local directory.");
+DEFINE_uint64(index_pack_cache_bytes, 10ull << 30,
+              "Keep at most this many bytes of data in "
+              "--index_pack_cache_dir, dropping the least recently used.");
+DEFINE_int32(index_pack_fetch_threads, 16,
+             "Fetch the inputs of units from a remote --index_pack on this "
+             "many background threads.");
+DEFINE_string(cache, "",
+              "Use a memcache instance, or a pool of them with keys spread "
+              "by consistent hashing (ex: \"--SERVER=foo:1234 "
+              "--SERVER=bar:1234\")");
+DEFINE_uint64(cache_timeout_ms, 0,
+              "Treat a request to --cache (or a fingerprint cache) that "
+              "takes longer than this many milliseconds as a miss; 0 uses "
+              "libmemcached's defaults");
+DEFINE_int32(memcached_server_failure_limit, 2,
+             "Drop a memcached server from its pool after this many errors "
+             "in a row, moving its keys to the other servers");
+DEFINE_int32(memcached_retry_timeout_s, 30,
+             "Try a dropped memcached server again after this many seconds");
+DEFINE_int32(memcached_breaker_failures, 8,
+             "Stop sending requests to a memcached pool after this many "
+             "failures in a row (0 to never stop)");
+DEFINE_uint64(memcached_breaker_open_ms, 5000,
+              "Wait this many milliseconds before probing a memcached pool "
+              "that stopped taking requests");
 DEFINE_int32(min_size, 4096, "Minimum size of an entry bundle");
 DEFINE_int32(max_size, 1024 * 32, "Maximum size of an entry bundle");
+DEFINE_bool(experimental_adaptive_buffer_sizes, false,
+            "Adjust --min_size and --max_size while indexing to trade "
+            "deduplication against time spent waiting for --cache, logging "
+            "each choice.");
+DEFINE_int32(adaptive_max_size_floor, 4096,
+             "With --experimental_adaptive_buffer_sizes, the smallest "
+             "maximum size to try.");
+DEFINE_int32(adaptive_max_size_ceiling, 1024 * 256,
+             "With --experimental_adaptive_buffer_sizes, the largest "
+             "maximum size to try.");
+DEFINE_uint64(experimental_average_chunk_size, 0,
+              "If nonzero, split long entry bundles at points chosen by "
+              "their content, about this many bytes past --min_size apart, "
+              "so that edits don't shift every later bundle.");
 DEFINE_bool(cache_stats, false, "Show cache stats");
+DEFINE_int32(cache_batch_size, 1,
+             "Check this many entry bundles against the cache at once");
+DEFINE_uint64(cache_lru_size, 0,
+              "Remember up to this many cache hits in-process (0 to disable)");
+DEFINE_uint64(cache_bloom_bits, 0,
+              "Size in bits of an in-process Bloom filter of registered "
+              "entry bundles (0 to disable). False positives cause bundles "
+              "to be dropped as duplicates.");
+DEFINE_string(experimental_hash_snapshot_in, "",
+              "Before indexing, register the entry bundle hashes in this "
+              "snapshot with the hash cache (--cache or --cache_bloom_bits), "
+              "so that a cold cache starts from an earlier run's state "
+              "(EXPERIMENTAL)");
+DEFINE_string(experimental_hash_snapshot_out, "",
+              "After indexing, write the entry bundle hashes this run "
+              "registered or found in the hash cache to a snapshot at this "
+              "path (EXPERIMENTAL)");
+DEFINE_uint64(experimental_hash_claim_table_size, 0,
+              "With more than one --jobs, let workers claim up to this many "
+              "entry bundle hashes in a lock-free table, so that lookups of "
+              "hashes another worker already claimed don't lock the hash "
+              "cache (0 to lock for every lookup). Hashes are compared by "
+              "their first 64 bits (EXPERIMENTAL)");
+DEFINE_string(experimental_header_fingerprint_db, "",
+              "Skip headers that were indexed by an earlier run with the same "
+              "content and preprocessor context, keeping their fingerprints "
+              "in a LevelDB database at this path (EXPERIMENTAL)");
+DEFINE_string(experimental_header_fingerprint_cache, "",
+              "Like --experimental_header_fingerprint_db, but keep the "
+              "fingerprints in a memcache instance (EXPERIMENTAL)");
+DEFINE_string(experimental_instantiation_fingerprint_db, "",
+              "Skip implicit template instantiations that were indexed by an "
+              "earlier run, keeping their fingerprints in a LevelDB database "
+              "at this path (EXPERIMENTAL)");
+DEFINE_string(experimental_instantiation_fingerprint_cache, "",
+              "Like --experimental_instantiation_fingerprint_db, but keep the "
+              "fingerprints in a memcache instance (EXPERIMENTAL)");
 DEFINE_string(icorpus, "", "Corpus to use for files specified with -i");
 DEFINE_bool(normalize_file_vnames, false, "Normalize incoming file vnames.");
 DEFINE_string(experimental_dynamic_claim_cache, "",
@@ -56,7 +171,130 @@ DEFINE_string(experimental_dynamic_claim_cache, "",
 // between translation units.
 DEFINE_uint64(experimental_dynamic_overclaim, 1,
               "Maximum number of dynamic claims per claimable (EXPERIMENTAL)");
+DEFINE_uint64(experimental_dynamic_claim_timeout_ms, 0,
+              "Give up on the dynamic claim cache (and claim whatever is "
+              "left) if a request or a batch of claims takes longer than "
+              "this many milliseconds; 0 means no limit (EXPERIMENTAL)");
+DEFINE_bool(experimental_dynamic_claim_when_unavailable, true,
+            "Claim whatever the dynamic claim cache can't decide because it "
+            "is unavailable; if false, skip it instead (EXPERIMENTAL)");
+DEFINE_string(experimental_work_queue, "",
+              "Divide the inputs between every indexer given the same inputs "
+              "and --experimental_work_queue_run, taking leases on them "
+              "through this memcache instance (EXPERIMENTAL)");
+DEFINE_string(experimental_work_queue_run, "",
+              "Names the indexing run for --experimental_work_queue; use a new "
+              "name for each run (EXPERIMENTAL)");
+DEFINE_int32(experimental_work_lease_s, 600,
+             "Leases from --experimental_work_queue lapse unless they are "
+             "renewed within this many seconds (EXPERIMENTAL)");
+DEFINE_int32(experimental_work_lease_max_s, 0,
+             "If nonzero, stop renewing a unit's lease after this many "
+             "seconds, so an idle indexer can take over a straggler "
+             "(EXPERIMENTAL)");
+DEFINE_uint64(experimental_work_poll_ms, 5000,
+              "How often to check on inputs leased by other indexers "
+              "(EXPERIMENTAL)");
+DEFINE_uint64(experimental_work_queue_timeout_ms, 0,
+              "Bounds each request to --experimental_work_queue; 0 uses "
+              "libmemcached's defaults (EXPERIMENTAL)");
+DEFINE_string(experimental_shared_claim_table, "",
+              "Resolve claims between the indexers on this host through the "
+              "POSIX shared memory table with this name (like "
+              "/kythe_claims), asking --experimental_dynamic_claim_cache (if "
+              "set) only about claims new to the host. Claims persist "
+              "until the table is removed, so use a new name for each "
+              "indexing run (EXPERIMENTAL)");
+DEFINE_uint64(experimental_shared_claim_slots, 1 << 22,
+              "The number of claims a new shared claim table has room for "
+              "(EXPERIMENTAL)");
 DEFINE_bool(test_claim, false, "Use an in-memory claim database for testing.");
+DEFINE_int32(prefetch_units, 1,
+             "Decode up to this many compilation units ahead of the units "
+             "being indexed, on a background thread (0 to decode each unit "
+             "when it's needed).");
+DEFINE_uint64(prefetch_bytes, 1ull << 30,
+              "Stop decoding units ahead of time once this many bytes of "
+              "file content are waiting to be indexed. At least one unit is "
+              "always decoded ahead of time.");
+DEFINE_bool(experimental_schedule_largest_first, false,
+            "Index the compilation units that are predicted to take the "
+            "longest first, rather than in the order they were given.");
+DEFINE_string(experimental_job_history, "",
+              "Predict how long each compilation unit will take from the "
+              "durations in this file, log the predictions next to the actual "
+              "durations, and update the file afterward.");
+DEFINE_string(experimental_cost_probes, "",
+              "Weigh compilation units by the token counts in this report "
+              "from the indexer's --experimental_cost_probe_output when "
+              "predicting their costs.");
+DEFINE_bool(experimental_compress_inputs, false,
+            "Keep the content of files that aren't in the file cache "
+            "snappy-compressed in memory, uncompressing each file only while "
+            "the indexer has it open.");
+DEFINE_string(file_cache_dir, "",
+              "Keep decompressed file content in this local directory and "
+              "share memory-mapped copies of it between compilation units.");
+DEFINE_int32(file_cache_retained_mb, 256,
+             "With --file_cache_dir, keep up to this many megabytes of the "
+             "most recently used mappings alive between compilation units, "
+             "so that units indexed one after another don't reopen and remap "
+             "the headers they share.");
+DEFINE_int32(jobs, 1,
+             "Index up to this many compilation units concurrently. Output "
+             "is still written as a single stream, one unit at a time.");
+DEFINE_string(output_compression, "none",
+              "Compress output: \"none\" or \"snappy\" (the snappy framing "
+              "format). Compressed output is only flushed in large blocks.");
+DEFINE_uint64(compression_block_size, 1 << 20,
+              "Compress output in blocks of this many bytes.");
+DEFINE_bool(compression_thread, false,
+            "Compress output on a helper thread.");
+DEFINE_bool(experimental_writer_thread, false,
+            "Compress and write output on a helper thread. With "
+            "--flush_after_each_entry, entries are still flushed as soon as "
+            "that thread has written them.");
+DEFINE_string(experimental_buffer_digest, "sha256",
+              "Hash buffers for deduplication with \"sha256\" or \"murmur3\" "
+              "(faster, but only safe with a private --cache).");
+DEFINE_string(experimental_leveldb_output, "",
+              "Write entries into the LevelDB GraphStore at this path instead "
+              "of writing an entry stream to -o.");
+DEFINE_string(experimental_write_request_output, "",
+              "Write entries to this file (or pipe) as varint-delimited "
+              "GraphStore WriteRequests grouped by source VName instead of "
+              "writing an entry stream to -o.");
+DEFINE_uint64(experimental_write_requests_in_flight, 4,
+              "With --experimental_write_request_output, how many "
+              "WriteRequests may be outstanding at once before indexing "
+              "waits for them.");
+DEFINE_uint64(experimental_output_shards, 0,
+              "If nonzero, split entries between this many files by their "
+              "source VNames. -o names the files with a pattern holding the "
+              "shard number, like out-%05d-of-00064.");
+DEFINE_string(experimental_output_format, "entries",
+              "Write output as \"entries\" (a stream of delimited Entry "
+              "messages) or as an \"entry_pack\" (see entry_pack.h).");
+DEFINE_bool(experimental_sort_output, false,
+            "Write entries sorted in GraphStore order and without duplicates. "
+            "Nothing is written until indexing is finished.");
+DEFINE_uint64(experimental_sort_buffer_bytes, 256ull << 20,
+              "Hold this many bytes of entries in memory before spilling a "
+              "sorted run to disk (with --experimental_sort_output).");
+DEFINE_string(experimental_sort_temp_dir, "",
+              "Spill sorted runs to this directory instead of the system's "
+              "temporary directory (with --experimental_sort_output).");
+DEFINE_string(experimental_delta_base, "",
+              "If set, write to -o only the changes since this earlier output "
+              "of --experimental_sort_output, as delimited EntryDelta "
+              "messages (see kythe/proto/delta.proto).");
+DEFINE_string(experimental_delta_snapshot, "",
+              "With --experimental_delta_base, also write every sorted entry "
+              "to this file, to be the base of the next run.");
+DEFINE_string(experimental_index_journal, "",
+              "Record each unit in this file once its output has been synced "
+              "to -o; if the file already exists, skip the units it records "
+              "and append to -o after their output (EXPERIMENTAL)");
 
 namespace kythe {
 
@@ -72,98 +310,428 @@ llvm::StringRef strip_silent_input_prefix(llvm::StringRef argument) {
   }
   return {};
 }
+/// \brief Opens a pool of the memcached servers in `spec`.
+/// \param name Identifies the pool in its statistics.
+/// \param timeout_ms Bounds each request; 0 uses libmemcached's defaults.
+/// \return the pool, or null if its servers couldn't be reached.
+std::unique_ptr<MemcachedPool> OpenMemcachedPool(const char *name,
+                                                 const std::string &spec,
+                                                 uint64_t timeout_ms) {
+  MemcachedPool::Options options;
+  options.timeout_ms = timeout_ms;
+  options.server_failure_limit = FLAGS_memcached_server_failure_limit;
+  options.retry_timeout_s = FLAGS_memcached_retry_timeout_s;
+  options.breaker_failures = FLAGS_memcached_breaker_failures;
+  options.breaker_open_ms = FLAGS_memcached_breaker_open_ms;
+  auto pool = llvm::make_unique<MemcachedPool>(name, options);
+  if (!pool->Open(spec)) {
+    return nullptr;
+  }
+  return pool;
+}
 /// \brief Reads the output of the static claim tool.
 ///
 /// `path` should be a file that contains a GZip-compressed sequence of
-/// varint-prefixed wire format ClaimAssignment protobuf messages.
+/// varint-prefixed wire format ClaimAssignment protobuf messages or a
+/// `ClaimTable` (which is mapped rather than read).
 void DecodeStaticClaimTable(const std::string &path,
                             kythe::StaticClaimClient *client) {
-  using namespace google::protobuf::io;
   int fd = open(path.c_str(), O_RDONLY, S_IREAD | S_IWRITE);
   CHECK_GE(fd, 0) << "Couldn't open input file " << path;
-  FileInputStream file_input_stream(fd);
-  GzipInputStream gzip_input_stream(&file_input_stream);
-  google::protobuf::uint32 byte_size;
-  for (;;) {
-    CodedInputStream coded_input_stream(&gzip_input_stream);
-    coded_input_stream.SetTotalBytesLimit(INT_MAX, -1);
-    if (!coded_input_stream.ReadVarint32(&byte_size)) {
-      break;
-    }
-    coded_input_stream.PushLimit(byte_size);
-    kythe::proto::ClaimAssignment claim;
-    CHECK(claim.ParseFromCodedStream(&coded_input_stream));
-    // NB: We don't filter on compilation unit here. A dependency has three
-    // static states (wrt some CU): unknown, owned by CU, owned by another CU.
-    client->AssignClaim(claim.dependency_v_name(), claim.compilation_v_name());
+  char magic[ClaimTable::kMagicSize];
+  ssize_t magic_size = pread(fd, magic, sizeof(magic), 0);
+  if (magic_size > 0 &&
+      ClaimTable::HasMagic(llvm::StringRef(magic, magic_size))) {
+    close(fd);
+    std::string error_text;
+    auto table = ClaimTable::Open(path, &error_text);
+    CHECK(table) << "Couldn't load claim table " << path << ": " << error_text;
+    client->set_claim_table(std::move(table));
+    return;
   }
   close(fd);
+  std::string error_text;
+  CHECK(ForEachDelimitedMessage<proto::ClaimAssignment>(
+      path, std::max(FLAGS_static_claim_read_threads, 1),
+      [client](proto::ClaimAssignment *claim) {
+        // NB: We don't filter on compilation unit here. A dependency has three
+        // static states (wrt some CU): unknown, owned by CU, owned by another
+        // CU.
+        client->AssignClaim(claim->dependency_v_name(),
+                            claim->compilation_v_name());
+      },
+      &error_text))
+      << "Couldn't read static claims: " << error_text;
+}
+
+/// \brief Reads the claim shard that `static_claim --shard_dir` wrote for
+/// `unit` in `directory` and passes its claims to `client`.
+///
+/// A unit without a shard (one that static_claim didn't see) is left with
+/// unknown claim status for everything it depends on.
+void LoadStaticClaimShard(const std::string &directory,
+                          const proto::CompilationUnit &unit,
+                          KytheClaimClient *client) {
+  std::string path = JoinPath(directory, ClaimShardName(unit));
+  if (::access(path.c_str(), F_OK) != 0) {
+    LOG(WARNING) << "No claim shard for " << unit.v_name().DebugString()
+                 << " at " << path;
+    return;
+  }
+  std::string error_text;
+  // Shards are small, so there's nothing to gain from more threads.
+  CHECK(ForEachDelimitedMessage<proto::ClaimAssignment>(
+      path, 1,
+      [client](proto::ClaimAssignment *claim) {
+        client->AssignClaim(claim->dependency_v_name(),
+                            claim->compilation_v_name());
+      },
+      &error_text))
+      << "Couldn't read claim shard " << path << ": " << error_text;
+}
+
+/// \brief Adds `file_data` to a job, leaving `file_data` unspecified.
+///
+/// If `file_store` is non-null and `file_data` has a digest, `file_data`'s
+/// content is copied to `file_store` and its mapped copy is appended to
+/// `mapped_files`. Otherwise, if --experimental_compress_inputs is set, a
+/// compressed copy of `file_data` is appended to `mapped_files`; if it isn't,
+/// `file_data` is moved to the end of `virtual_files`.
+void AddFileData(proto::FileData *file_data, MappedFileStore *file_store,
+                 google::protobuf::RepeatedPtrField<proto::FileData>
+                     *virtual_files,
+                 std::vector<MappedFile> *mapped_files) {
+  if (file_store != nullptr && !file_data->info().digest().empty()) {
+    std::string error_text;
+    if (auto content = file_store->Insert(file_data->info().digest(),
+                                          file_data->content(), &error_text)) {
+      MappedFile mapped;
+      mapped.info = file_data->info();
+      mapped.content = std::move(content);
+      mapped_files->push_back(std::move(mapped));
+      return;
+    }
+    LOG(WARNING) << "Couldn't add " << file_data->info().path()
+                 << " to the file cache: " << error_text;
+  }
+  if (FLAGS_experimental_compress_inputs) {
+    mapped_files->push_back(
+        CompressFile(file_data->info(), ToStringRef(file_data->content())));
+    return;
+  }
+  // This copies if `file_data` isn't on `virtual_files`' arena, which only
+  // happens when the file cache fails or for files from analysis requests.
+  virtual_files->Add()->Swap(file_data);
 }
 
 /// \brief Reads data from a .kindex file into memory.
 /// \param path The path from which the file should be read.
-/// \param virtual_files A vector to be filled with FileData.
+/// \param file_store If non-null, the store to keep file content in.
+/// \param virtual_files To be filled with FileData. Files are parsed onto
+/// its arena.
+/// \param mapped_files A vector to be filled with content from `file_store`.
 /// \param unit A `CompilationUnit` to be decoded from the .kindex.
-void DecodeIndexFile(const std::string &path,
-                     std::vector<proto::FileData> *virtual_files,
+void DecodeIndexFile(const std::string &path, MappedFileStore *file_store,
+                     google::protobuf::RepeatedPtrField<proto::FileData>
+                         *virtual_files,
+                     std::vector<MappedFile> *mapped_files,
                      proto::CompilationUnit *unit) {
-  using namespace google::protobuf::io;
-  int fd = open(path.c_str(), O_RDONLY, S_IREAD | S_IWRITE);
-  CHECK_GE(fd, 0) << "Couldn't open input file " << path;
-  FileInputStream file_input_stream(fd);
-  GzipInputStream gzip_input_stream(&file_input_stream);
-  google::protobuf::uint32 byte_size;
-  for (;;) {
-    CodedInputStream coded_input_stream(&gzip_input_stream);
-    coded_input_stream.SetTotalBytesLimit(INT_MAX, -1);
-    if (!coded_input_stream.ReadVarint32(&byte_size)) {
-      break;
+  std::string error_text;
+  // Inflate on a helper thread while file content is being stored.
+  auto reader = DelimitedProtoReader::Open(path, true, &error_text);
+  CHECK(reader != nullptr) << "Couldn't open input file " << path << ": "
+                           << error_text;
+  if (unit) {
+    CHECK(reader->NextMessage(unit)) << "Never saw a CompilationUnit in "
+                                     << path << ": " << reader->error();
+  }
+  if (file_store == nullptr && !FLAGS_experimental_compress_inputs) {
+    // Every file stays in the job, so parse each straight into place.
+    for (;;) {
+      proto::FileData *content = virtual_files->Add();
+      if (!reader->NextMessage(content)) {
+        virtual_files->RemoveLast();
+        break;
+      }
+      CHECK(content->has_info());
     }
-    coded_input_stream.PushLimit(byte_size);
-    if (unit) {
-      CHECK(unit->ParseFromCodedStream(&coded_input_stream));
-      unit = nullptr;
-    } else {
-      proto::FileData content;
-      CHECK(content.ParseFromCodedStream(&coded_input_stream));
+  } else {
+    // Most content moves to the store (or is compressed), so parse into one
+    // reused message rather than leave copies on the arena.
+    proto::FileData content;
+    while (reader->NextMessage(&content)) {
       CHECK(content.has_info());
-      virtual_files->push_back(std::move(content));
+      AddFileData(&content, file_store, virtual_files, mapped_files);
     }
   }
-  CHECK(!unit) << "Never saw a CompilationUnit.";
-  close(fd);
+  CHECK(reader->error().empty()) << path << ": " << reader->error();
+}
+
+/// \brief Reads only the `CompilationUnit` from a .kindex file.
+/// \return false if the file couldn't be read.
+bool PeekIndexFileUnit(const std::string &path, proto::CompilationUnit *unit) {
+  std::string error_text;
+  auto reader = DelimitedProtoReader::Open(path, false, &error_text);
+  return reader != nullptr && reader->NextMessage(unit);
 }
 
 /// \brief Reads data from an index pack into memory.
 /// \param cu_hash The hash of the compilation unit to read.
 /// \param index_pack The index pack from which to read.
-/// \param virtual_files A vector to be filled with FileData.
+/// \param file_store If non-null, the store to keep file content in. Content
+/// already in the store is not read from `index_pack`.
+/// \param virtual_files To be filled with FileData. Files are allocated on
+/// its arena.
+/// \param mapped_files A vector to be filled with content from `file_store`.
 /// \param unit A `CompilationUnit` to be decoded from the index pack.
+/// \param shared_details Filled in with any shared details the unit refers
+/// to that it doesn't already hold.
 void DecodeIndexPack(const std::string &cu_hash,
                      std::unique_ptr<IndexPack> index_pack,
-                     std::vector<proto::FileData> *virtual_files,
-                     proto::CompilationUnit *unit) {
+                     MappedFileStore *file_store,
+                     google::protobuf::RepeatedPtrField<proto::FileData>
+                         *virtual_files,
+                     std::vector<MappedFile> *mapped_files,
+                     proto::CompilationUnit *unit,
+                     SharedCxxDetailsCache *shared_details) {
   std::string error_text;
   CHECK(index_pack->ReadCompilationUnit(cu_hash, unit, &error_text))
       << "Could not read " << cu_hash << ": " << error_text;
+  // Shared details are only read and parsed for the first unit that refers
+  // to them.
+  std::string details_digest = SharedCxxDetailsDigest(*unit);
+  if (!details_digest.empty() && !shared_details->Contains(details_digest)) {
+    std::string content;
+    CHECK(index_pack->ReadFileData(details_digest, &content))
+        << "Could not read shared details " << details_digest
+        << " from the index pack: " << content;
+    if (!shared_details->Add(details_digest, content)) {
+      LOG(WARNING) << "Shared details " << details_digest
+                   << " are ill-formed.";
+    }
+  }
+  // Inputs that aren't in `file_store` are read concurrently; `read_inputs`
+  // maps each read back to its input.
+  std::vector<const proto::CompilationUnit::FileInput *> read_inputs;
+  std::vector<std::string> read_digests;
   for (const auto &input : unit->required_input()) {
     const auto &info = input.info();
     CHECK(!info.path().empty());
     CHECK(!info.digest().empty())
         << "Required input " << info.path() << " is missing its digest.";
-    std::string read_data;
-    CHECK(index_pack->ReadFileData(info.digest(), &read_data))
-        << "Could not read " << info.path() << " (digest " << info.digest()
-        << ") from the index pack: " << read_data;
-    proto::FileData file_data;
-    file_data.set_content(read_data);
-    file_data.mutable_info()->set_path(info.path());
-    file_data.mutable_info()->set_digest(info.digest());
-    virtual_files->push_back(std::move(file_data));
+    if (file_store != nullptr) {
+      if (auto content = file_store->Find(info.digest())) {
+        MappedFile mapped;
+        mapped.info.set_path(info.path());
+        mapped.info.set_digest(info.digest());
+        mapped.content = std::move(content);
+        mapped_files->push_back(std::move(mapped));
+        continue;
+      }
+    }
+    read_inputs.push_back(&input);
+    read_digests.push_back(info.digest());
+  }
+  // Remote packs start fetching everything now; the reads below pick up
+  // whatever has arrived.
+  index_pack->PrefetchFileData(read_digests);
+  IndexPack::BatchReadOptions options;
+  options.parallelism = std::max(FLAGS_index_pack_read_threads, 1);
+  options.readahead = std::max(FLAGS_index_pack_readahead, 1);
+  // Deliver in order so that the unit's files are always added in the same
+  // order.
+  options.in_order = true;
+  // Whether content leaves the arena (for the store or to be compressed).
+  const bool moves_content =
+      file_store != nullptr || FLAGS_experimental_compress_inputs;
+  proto::FileData stored_data;
+  index_pack->ReadFileDataBatch(
+      read_digests, options,
+      [&](size_t index, bool ok, std::string *content) {
+        const auto &info = read_inputs[index]->info();
+        CHECK(ok) << "Could not read " << info.path() << " (digest "
+                  << info.digest() << ") from the index pack: " << *content;
+        // Content bound for the store (or for compression) is staged in
+        // `stored_data` so that it isn't left on the arena.
+        proto::FileData *file_data =
+            moves_content ? &stored_data : virtual_files->Add();
+        file_data->mutable_content()->swap(*content);
+        file_data->mutable_info()->set_path(info.path());
+        file_data->mutable_info()->set_digest(info.digest());
+        if (moves_content) {
+          AddFileData(file_data, file_store, virtual_files, mapped_files);
+        }
+        return true;
+      });
+}
+
+/// \brief Normalize input file vnames by cleaning paths and clearing
+/// signatures.
+void NormalizeFileVNames(IndexerJob *job) {
+  llvm::SmallString<1024> clean_path;
+  for (auto &input : *job->unit->mutable_required_input()) {
+    llvm::StringRef path = ToStringRef(input.v_name().path());
+    // Most paths are already clean; leave those alone.
+    if (!IsCleanPath(path)) {
+      path = CleanPath(path, &clean_path);
+      input.mutable_v_name()->set_path(path.data(), path.size());
+    }
+    input.mutable_v_name()->clear_signature();
+  }
+}
+
+/// \brief Fills in the parts of `job` that depend on its (already decoded)
+/// compilation unit.
+void SetUpJobForUnit(IndexerJob *job) {
+  job->working_directory = job->unit->working_directory();
+  if (!llvm::sys::path::is_absolute(job->working_directory)) {
+    llvm::SmallString<1024> stored_wd;
+    CHECK(!llvm::sys::fs::make_absolute(stored_wd));
+    job->working_directory = stored_wd.str();
+  }
+  if (FLAGS_normalize_file_vnames) {
+    NormalizeFileVNames(job);
   }
 }
 }  // anonymous namespace
 
+IndexerJob::IndexerJob()
+    : arena(llvm::make_unique<google::protobuf::Arena>()),
+      virtual_files(google::protobuf::Arena::CreateMessage<
+                    google::protobuf::RepeatedPtrField<proto::FileData>>(
+          arena.get())),
+      unit(google::protobuf::Arena::CreateMessage<proto::CompilationUnit>(
+          arena.get())) {}
+
+PrefetchingJobSource::PrefetchingJobSource(size_t job_count, size_t max_jobs,
+                                           size_t max_bytes, Loader loader,
+                                           std::vector<size_t> order)
+    : job_count_(job_count),
+      max_jobs_(std::max<size_t>(max_jobs, 1)),
+      max_bytes_(max_bytes),
+      loader_(std::move(loader)),
+      order_(std::move(order)) {
+  CHECK(order_.empty() || order_.size() == job_count_);
+  if (max_jobs != 0) {
+    thread_ = std::thread([this] { Prefetch(); });
+  }
+}
+
+PrefetchingJobSource::PrefetchingJobSource(size_t max_jobs, size_t max_bytes,
+                                           Loader loader, Picker picker)
+    : job_count_(0),
+      max_jobs_(std::max<size_t>(max_jobs, 1)),
+      max_bytes_(max_bytes),
+      loader_(std::move(loader)),
+      picker_(std::move(picker)) {
+  if (max_jobs != 0) {
+    thread_ = std::thread([this] { Prefetch(); });
+  }
+}
+
+PrefetchingJobSource::~PrefetchingJobSource() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stopping_ = true;
+  }
+  has_space_.notify_all();
+  if (thread_.joinable()) {
+    thread_.join();
+  }
+}
+
+size_t PrefetchingJobSource::JobSize(const IndexerJob &job) {
+  size_t size = 0;
+  for (const auto &file : *job.virtual_files) {
+    size += file.content().size();
+  }
+  for (const auto &file : job.mapped_files) {
+    if (file.compressed) {
+      size += file.content->getBufferSize();
+    }
+  }
+  return size;
+}
+
+void PrefetchingJobSource::Prefetch() {
+  for (size_t position = 0; picker_ || position < job_count_; ++position) {
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      has_space_.wait(lock, [this] {
+        return stopping_ || queue_.empty() ||
+               (queue_.size() < max_jobs_ && queued_bytes_ < max_bytes_);
+      });
+      if (stopping_) {
+        return;
+      }
+    }
+    std::unique_ptr<IndexerJob> job;
+    if (!Load(position, &job)) {
+      break;
+    }
+    size_t job_size = JobSize(*job);
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      queued_bytes_ += job_size;
+      queue_.push_back(std::move(job));
+    }
+    job_ready_.notify_one();
+  }
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    done_ = true;
+  }
+  job_ready_.notify_all();
+}
+
+bool PrefetchingJobSource::Load(size_t position,
+                                std::unique_ptr<IndexerJob> *job) {
+  if (!picker_ && position >= job_count_) {
+    return false;
+  }
+  size_t index = order_.empty() ? position : order_[position];
+  if (picker_ && !picker_(&index)) {
+    return false;
+  }
+  *job = llvm::make_unique<IndexerJob>();
+  (*job)->index = index;
+  loader_(index, job->get());
+  (*job)->position = position;
+  return true;
+}
+
+bool PrefetchingJobSource::Next(std::unique_ptr<IndexerJob> *job) {
+  if (!thread_.joinable()) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (done_ || !Load(next_position_, job)) {
+      done_ = true;
+      return false;
+    }
+    ++next_position_;
+    return true;
+  }
+  {
+    std::unique_lock<std::mutex> lock(mutex_);
+    job_ready_.wait(lock, [this] { return done_ || !queue_.empty(); });
+    if (queue_.empty()) {
+      return false;
+    }
+    *job = std::move(queue_.front());
+    queue_.pop_front();
+    queued_bytes_ -= JobSize(**job);
+  }
+  has_space_.notify_one();
+  return true;
+}
+
+PrefetchingJobSource::Depth PrefetchingJobSource::depth() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  Depth depth;
+  depth.jobs = queue_.size();
+  depth.bytes = queued_bytes_;
+  return depth;
+}
+
 std::string IndexerContext::UsageMessage(const std::string &program_title,
                                          const std::string &program_name) {
   std::string message = "Command-line frontend for " + program_title;
@@ -182,6 +750,50 @@ If -index_pack is specified, there must be exactly one positional parameter.
 This parameter should be the compilation unit ID from the mounted index pack
 that is meant to be indexed. No additional input parameters may be specified.
 
+If -index_pack is an http://, https:// or gs:// URI, the pack is read from
+remote storage as the units need it, keeping what was read in
+-index_pack_cache_dir (which is required). The inputs of each unit are fetched
+in the background as soon as the unit has been read.
+
+If -jobs is greater than 1, compilation units from multiple .kindex files or
+index pack inputs will be indexed concurrently. Output for each unit is written
+contiguously and in the order the units were indexed, which is the order they
+were specified unless -experimental_schedule_largest_first is set.
+
+If -output_compression=snappy is specified, the Entry stream is compressed
+using the snappy framing format. The verifier can read such streams with
+-input_compression=snappy.
+
+If -experimental_sort_output is specified, the Entry stream is sorted in
+GraphStore order and deduplicated (spilling to disk as needed) before it is
+written, so it needn't be piped through a separate sort.
+
+If -experimental_delta_base is also specified, it names the sorted output of an
+earlier run over the same units, and only the entries that were added or
+deleted since are written to -o, as delimited kythe.proto.EntryDelta messages.
+-experimental_delta_snapshot names a file to which the full sorted output is
+also written, so that it can be the base of the next run.
+
+If -experimental_output_format=entry_pack is specified, entries are written in
+blocks that store each VName component and fact or edge name once; see
+kythe/cxx/common/indexing/entry_pack.h. The verifier can read such output with
+-input_format=entry_pack.
+
+If -experimental_output_shards=N is specified, entries are split between N
+files named by substituting each shard number into -o (which must then contain
+one integer conversion, like out-%05d-of-00064). Each entry goes to the shard
+picked by a stable hash of its source VName, so a node's facts and outgoing
+edges are always written to the same shard. Compression and sorting apply to
+each shard separately.
+
+If -experimental_leveldb_output is specified, entries are written directly
+into a LevelDB GraphStore (readable by the Go leveldb GraphStore) instead of
+to -o.
+
+If -experimental_write_request_output is specified, entries are written as
+GraphStore WriteRequests (see kythe/proto/storage_service.proto), one for each
+source VName in a batch, instead of to -o.
+
 If -test_claim is specified, you may specify that one or more kindex or index
 pack inputs should not produce any output by prepending the prefix "silent:"
 to the input's name.
@@ -215,9 +827,214 @@ bool IndexerContext::HasIndexArguments() {
   return had_index;
 }
 
-void IndexerContext::LoadDataFromIndex(const std::string &kindex_file_or_cu) {
-  jobs_.emplace_back();
-  auto *job = &jobs_.back();
+JobCostModel::Features IndexerContext::PeekJobFeatures(
+    const std::string &kindex_file_or_cu) const {
+  std::string name = strip_silent_input_prefix(kindex_file_or_cu);
+  if (name.empty()) {
+    name = kindex_file_or_cu;
+  }
+  JobCostModel::Features features;
+  proto::CompilationUnit unit;
+  bool read_unit = false;
+  if (!FLAGS_index_pack.empty()) {
+    // Index packs don't tell us how big their files are without reading them.
+    std::string error_text;
+    auto filesystem = OpenIndexPack(&error_text);
+    read_unit = filesystem != nullptr &&
+                IndexPack(std::move(filesystem))
+                    .ReadCompilationUnit(name, &unit, &error_text);
+  } else {
+    uint64_t size;
+    if (!llvm::sys::fs::file_size(name, size)) {
+      features.bytes = size;
+    }
+    read_unit = PeekIndexFileUnit(name, &unit);
+  }
+  if (!read_unit) {
+    LOG(WARNING) << "Couldn't read " << name << " to predict its cost.";
+  }
+  features.inputs = unit.required_input_size();
+  return features;
+}
+
+void IndexerContext::OpenRemoteIndexPack() {
+  if (!IndexPackRemoteFilesystem::IsRemote(FLAGS_index_pack)) {
+    return;
+  }
+  CHECK(!FLAGS_index_pack_cache_dir.empty())
+      << "--index_pack_cache_dir is needed for a remote --index_pack.";
+  JsonClient::InitNetwork();
+  RemoteBlobStore::Options options;
+  options.cache_directory = FLAGS_index_pack_cache_dir;
+  options.max_cache_bytes = FLAGS_index_pack_cache_bytes;
+  options.prefetch_threads = std::max(FLAGS_index_pack_fetch_threads, 0);
+  std::string error_text;
+  remote_index_pack_ = RemoteBlobStore::Open(
+      llvm::make_unique<HttpBlobFetcher>(FLAGS_index_pack), options,
+      &error_text);
+  CHECK(remote_index_pack_) << "Couldn't open the cache for "
+                            << FLAGS_index_pack << ": " << error_text;
+}
+
+std::unique_ptr<IndexPackFilesystem> IndexerContext::OpenIndexPack(
+    std::string *error_text) const {
+  if (remote_index_pack_ != nullptr) {
+    return llvm::make_unique<IndexPackRemoteFilesystem>(remote_index_pack_);
+  }
+  return kythe::OpenIndexPackFilesystem(
+      FLAGS_index_pack, kythe::IndexPackFilesystem::OpenMode::kReadOnly,
+      error_text);
+}
+
+void IndexerContext::OpenCostModel() {
+  if (!FLAGS_experimental_schedule_largest_first &&
+      FLAGS_experimental_job_history.empty() &&
+      FLAGS_experimental_cost_probes.empty()) {
+    return;
+  }
+  cost_model_ = llvm::make_unique<JobCostModel>();
+  std::string error_text;
+  if (!FLAGS_experimental_job_history.empty() &&
+      !cost_model_->LoadHistory(FLAGS_experimental_job_history,
+                                &error_text)) {
+    LOG(WARNING) << "Ignoring job history: " << error_text;
+    cost_model_ = llvm::make_unique<JobCostModel>();
+  }
+  if (!FLAGS_experimental_cost_probes.empty() &&
+      !cost_model_->LoadProbes(FLAGS_experimental_cost_probes, &error_text)) {
+    LOG(WARNING) << "Ignoring cost probes: " << error_text;
+  }
+}
+
+void IndexerContext::PredictJobCosts() {
+  job_features_.resize(job_count_);
+  job_predictions_.resize(job_count_);
+  for (size_t index = 0; index < job_count_; ++index) {
+    job_features_[index] = PeekJobFeatures(args_[index + 1]);
+    cost_model_->ApplyProbe(args_[index + 1], &job_features_[index]);
+    job_predictions_[index] =
+        cost_model_->Predict(args_[index + 1], job_features_[index]);
+  }
+}
+
+void IndexerContext::RecordJobCost(const IndexerJob &job,
+                                   double millis) const {
+  if (cost_model_ == nullptr || job.index >= job_predictions_.size()) {
+    return;
+  }
+  fprintf(stderr, "Cost of unit %zu (%s): predicted %.0f ms, took %.0f ms\n",
+          job.index, args_[job.index + 1].c_str(),
+          job_predictions_[job.index], millis);
+  cost_model_->Record(args_[job.index + 1], job_features_[job.index], millis);
+}
+
+std::string IndexerContext::job_key(const IndexerJob &job) const {
+  if (serving() || job.index + 1 >= args_.size()) {
+    return "";
+  }
+  return args_[job.index + 1];
+}
+
+void IndexerContext::FinishJob(size_t index, bool indexed) const {
+  if (work_queue_ == nullptr) {
+    return;
+  }
+  if (indexed && !kythe_output_->Sync()) {
+    fprintf(stderr, "Error flushing the output for %s.\n",
+            args_[index + 1].c_str());
+    indexed = false;
+  }
+  if (indexed) {
+    work_queue_->Finish(index);
+  } else {
+    work_queue_->Release(index);
+  }
+}
+
+void IndexerContext::CommitJob(size_t index) const {
+  if (journal_ == nullptr) {
+    return;
+  }
+  int fd = output_files_[0].fd;
+  if (!kythe_output_->Sync() || ::fdatasync(fd) != 0) {
+    ::perror("Error syncing output");
+    ::exit(1);
+  }
+  off_t offset = ::lseek(fd, 0, SEEK_CUR);
+  std::string error_text;
+  if (offset < 0 ||
+      !journal_->Commit(args_[index + 1], offset, &error_text)) {
+    fprintf(stderr, "Error writing the index journal: %s\n",
+            offset < 0 ? strerror(errno) : error_text.c_str());
+    ::exit(1);
+  }
+}
+
+void IndexerContext::OpenJournal() {
+  if (FLAGS_experimental_index_journal.empty()) {
+    return;
+  }
+  CHECK(HasIndexArguments() && !FLAGS_experimental_serve_analysis_requests)
+      << "--experimental_index_journal needs .kindex files or index pack "
+      << "units.";
+  // Resuming means cutting -o back to the last committed unit and appending,
+  // which only works for a single, unencoded stream of entries.
+  CHECK(FLAGS_o != "-" && FLAGS_experimental_leveldb_output.empty() &&
+        FLAGS_experimental_write_request_output.empty() &&
+        FLAGS_experimental_output_shards == 0 &&
+        FLAGS_output_compression == "none" &&
+        FLAGS_experimental_output_format == "entries" &&
+        !FLAGS_experimental_sort_output)
+      << "--experimental_index_journal needs plain, unsorted entries in a "
+      << "single -o file.";
+  // Claims and hashes registered with a shared store for units whose output
+  // was cut off would make the new run leave their entries out.
+  CHECK(FLAGS_cache.empty() && FLAGS_experimental_dynamic_claim_cache.empty() &&
+        FLAGS_experimental_shared_claim_table.empty() &&
+        FLAGS_experimental_header_fingerprint_db.empty() &&
+        FLAGS_experimental_header_fingerprint_cache.empty() &&
+        FLAGS_experimental_instantiation_fingerprint_db.empty() &&
+        FLAGS_experimental_instantiation_fingerprint_cache.empty())
+      << "--experimental_index_journal can't be used with remote hash "
+      << "caches, dynamic or shared claims, or fingerprint stores.";
+  std::string error_text;
+  journal_ = IndexJournal::Open(FLAGS_experimental_index_journal, &error_text);
+  CHECK(journal_) << "Couldn't open the index journal: " << error_text;
+}
+
+void IndexerContext::OpenWorkQueue() {
+  if (FLAGS_experimental_work_queue.empty()) {
+    return;
+  }
+  CHECK(HasIndexArguments() && !FLAGS_experimental_serve_analysis_requests)
+      << "--experimental_work_queue needs .kindex files or index pack units.";
+  CHECK(!FLAGS_experimental_work_queue_run.empty())
+      << "--experimental_work_queue needs --experimental_work_queue_run.";
+  auto pool = OpenMemcachedPool("work queue", FLAGS_experimental_work_queue,
+                                FLAGS_experimental_work_queue_timeout_ms);
+  CHECK(pool) << "Couldn't open the work queue at "
+              << FLAGS_experimental_work_queue;
+  char host[256] = {};
+  gethostname(host, sizeof(host) - 1);
+  std::string owner = std::string(host) + ":" + std::to_string(getpid());
+  std::vector<std::string> units(args_.begin() + 1, args_.end());
+  LeasedWorkQueue::Options options;
+  options.lease_ttl_s = std::max(FLAGS_experimental_work_lease_s, 1);
+  options.max_lease_s = std::max(FLAGS_experimental_work_lease_max_s, 0);
+  options.poll_ms = FLAGS_experimental_work_poll_ms;
+  // Spread indexers over the list so they don't all contend for its start.
+  if (!units.empty()) {
+    options.start = std::hash<std::string>()(owner) % units.size();
+  }
+  work_queue_ = llvm::make_unique<LeasedWorkQueue>(
+      std::move(units),
+      llvm::make_unique<MemcachedWorkLeaseStore>(
+          std::move(pool), FLAGS_experimental_work_queue_run, owner),
+      options);
+}
+
+void IndexerContext::LoadDataFromIndex(const std::string &kindex_file_or_cu,
+                                       IndexerJob *job) const {
   std::string name = strip_silent_input_prefix(kindex_file_or_cu);
   if (name.empty()) {
     job->silent = false;
@@ -227,28 +1044,21 @@ void IndexerContext::LoadDataFromIndex(const std::string &kindex_file_or_cu) {
   }
   if (!FLAGS_index_pack.empty()) {
     std::string error_text;
-    auto filesystem = kythe::IndexPackPosixFilesystem::Open(
-        FLAGS_index_pack, kythe::IndexPackFilesystem::OpenMode::kReadOnly,
-        &error_text);
+    auto filesystem = OpenIndexPack(&error_text);
     CHECK(filesystem) << "Couldn't open index pack from " << FLAGS_index_pack
                       << ": " << error_text;
     DecodeIndexPack(name, llvm::make_unique<IndexPack>(std::move(filesystem)),
-                    &job->virtual_files, &job->unit);
+                    file_store_.get(), job->virtual_files,
+                    &job->mapped_files, job->unit, &shared_cxx_details_);
   } else {
-    DecodeIndexFile(name, &job->virtual_files, &job->unit);
-  }
-  job->working_directory = job->unit.working_directory();
-  if (!llvm::sys::path::is_absolute(job->working_directory)) {
-    llvm::SmallString<1024> stored_wd;
-    CHECK(!llvm::sys::fs::make_absolute(stored_wd));
-    job->working_directory = stored_wd.str();
+    DecodeIndexFile(name, file_store_.get(), job->virtual_files,
+                    &job->mapped_files, job->unit);
   }
+  SetUpJobForUnit(job);
 }
 
 void IndexerContext::LoadDataFromUnpackedFile(
-    const std::string &default_filename) {
-  jobs_.emplace_back();
-  auto *job = &jobs_.back();
+    const std::string &default_filename, IndexerJob *job) {
   allow_filesystem_access_ = true;
   int read_fd = STDIN_FILENO;
   std::string source_file_name = default_filename;
@@ -277,31 +1087,150 @@ void IndexerContext::LoadDataFromUnpackedFile(
   close(read_fd);
   // clang wants the source file to be null-terminated, but this should
   // not be in range of the StringRef. std::string ends with \0.
-  proto::FileData file_data;
-  file_data.mutable_info()->set_path(source_file_name);
-  file_data.set_content(source_data.str());
-  job->virtual_files.push_back(std::move(file_data));
+  proto::FileData *file_data = job->virtual_files->Add();
+  file_data->mutable_info()->set_path(source_file_name);
+  file_data->set_content(source_data.str());
   for (const auto &arg : args_) {
-    job->unit.add_argument(arg);
+    job->unit->add_argument(arg);
+  }
+  job->unit->mutable_v_name()->set_corpus(FLAGS_icorpus);
+  if (FLAGS_normalize_file_vnames) {
+    NormalizeFileVNames(job);
+  }
+}
+
+void IndexerContext::OpenFileStore() {
+  if (!FLAGS_file_cache_dir.empty()) {
+    std::string error_text;
+    file_store_ = MappedFileStore::Open(FLAGS_file_cache_dir, &error_text);
+    CHECK(file_store_) << "Couldn't open file cache at "
+                       << FLAGS_file_cache_dir << ": " << error_text;
+    file_store_->set_retained_bytes(
+        static_cast<size_t>(std::max(FLAGS_file_cache_retained_mb, 0)) << 20);
+  }
+}
+
+void IndexerContext::OpenJobSource(const std::string &default_filename) {
+  PrefetchingJobSource::Loader loader;
+  if (FLAGS_experimental_serve_analysis_requests) {
+    // Jobs arrive with requests; see `ServeAnalysisRequests`.
+    job_count_ = 0;
+    loader = [](size_t index, IndexerJob *job) {};
+  } else if (HasIndexArguments()) {
+    job_count_ = args_.size() - 1;
+    loader = [this](size_t index, IndexerJob *job) {
+      LoadDataFromIndex(args_[index + 1], job);
+    };
+    if (cost_model_ != nullptr) {
+      PredictJobCosts();
+    }
+  } else {
+    // There's only one job, and it has side effects on the context itself
+    // (like enabling filesystem access), so load it now.
+    job_count_ = 1;
+    auto job = std::make_shared<IndexerJob>();
+    LoadDataFromUnpackedFile(default_filename, job.get());
+    loader = [job](size_t index, IndexerJob *out) {
+      *out = std::move(*job);
+      out->index = index;
+    };
+  }
+  if (work_queue_ != nullptr) {
+    // Which jobs this indexer gets depends on what the others have taken.
+    job_source_ = llvm::make_unique<PrefetchingJobSource>(
+        std::max(FLAGS_prefetch_units, 0), FLAGS_prefetch_bytes,
+        std::move(loader),
+        [this](size_t *index) {
+          while (work_queue_->Next(index)) {
+            if (journal_ == nullptr ||
+                !journal_->IsCommitted(args_[*index + 1])) {
+              return true;
+            }
+            work_queue_->Finish(*index);
+          }
+          return false;
+        });
+    return;
+  }
+  std::vector<size_t> order;
+  if (FLAGS_experimental_schedule_largest_first && !job_predictions_.empty()) {
+    order = JobCostModel::LargestFirst(job_predictions_);
+  }
+  if (journal_ != nullptr && journal_->committed_count() != 0) {
+    // Skip the units whose output an earlier run already committed.
+    if (order.empty()) {
+      order.resize(job_count_);
+      std::iota(order.begin(), order.end(), 0);
+    }
+    order.erase(std::remove_if(order.begin(), order.end(),
+                               [this](size_t index) {
+                                 return journal_->IsCommitted(args_[index + 1]);
+                               }),
+                order.end());
+    fprintf(stderr, "Resuming: %zu of %zu units were already indexed.\n",
+            job_count_ - order.size(), job_count_);
+    job_count_ = order.size();
+  }
+  job_source_ = llvm::make_unique<PrefetchingJobSource>(
+      job_count_, std::max(FLAGS_prefetch_units, 0), FLAGS_prefetch_bytes,
+      std::move(loader), std::move(order));
+}
+
+bool IndexerContext::NextJob(std::unique_ptr<IndexerJob> *job) {
+  if (!job_source_->Next(job)) {
+    return false;
+  }
+  if (!static_claim_shards_.empty()) {
+    // Claims from different shards never disagree, so they can accumulate
+    // in one client as workers take jobs.
+    LoadStaticClaimShard(static_claim_shards_, *(*job)->unit,
+                         claim_client_.get());
   }
-  job->unit.mutable_v_name()->set_corpus(FLAGS_icorpus);
+  return true;
 }
 
 void IndexerContext::InitializeClaimClient() {
+  std::unique_ptr<kythe::DynamicClaimClient> dynamic_claims;
   if (!FLAGS_experimental_dynamic_claim_cache.empty()) {
-    auto dynamic_claims = std::unique_ptr<kythe::DynamicClaimClient>(
+    dynamic_claims = std::unique_ptr<kythe::DynamicClaimClient>(
         new kythe::DynamicClaimClient());
     dynamic_claims->set_max_redundant_claims(
         FLAGS_experimental_dynamic_overclaim);
-    if (!dynamic_claims->OpenMemcache(FLAGS_experimental_dynamic_claim_cache)) {
+    dynamic_claims->set_request_timeout_ms(
+        FLAGS_experimental_dynamic_claim_timeout_ms);
+    dynamic_claims->set_claim_when_unavailable(
+        FLAGS_experimental_dynamic_claim_when_unavailable);
+    auto pool = OpenMemcachedPool("claims",
+                                  FLAGS_experimental_dynamic_claim_cache,
+                                  FLAGS_experimental_dynamic_claim_timeout_ms);
+    if (!pool) {
       fprintf(stderr, "Can't open memcached\n");
       exit(1);
     }
+    dynamic_claims->UsePool(std::move(pool));
+  }
+  if (!FLAGS_experimental_shared_claim_table.empty()) {
+    CHECK(FLAGS_static_claim.empty())
+        << "Shared claim tables can't be used with static claims.";
+    auto shared_claims = llvm::make_unique<kythe::SharedMemoryClaimClient>(
+        std::move(dynamic_claims));
+    std::string error_text;
+    CHECK(shared_claims->Open(FLAGS_experimental_shared_claim_table,
+                              FLAGS_experimental_shared_claim_slots,
+                              &error_text))
+        << error_text;
+    claim_client_ = std::move(shared_claims);
+  } else if (dynamic_claims) {
     claim_client_ = std::move(dynamic_claims);
   } else {
     auto static_claims = std::unique_ptr<kythe::StaticClaimClient>(
         new kythe::StaticClaimClient());
-    if (!FLAGS_static_claim.empty()) {
+    if (!FLAGS_experimental_static_claim_shards.empty()) {
+      CHECK(FLAGS_static_claim.empty())
+          << "Claim shards can't be used with a --static_claim table.";
+      // Each job's shard is loaded as the job is handed out; see `NextJob`.
+      static_claim_shards_ = FLAGS_experimental_static_claim_shards;
+    } else if (!FLAGS_static_claim.empty()) {
       DecodeStaticClaimTable(FLAGS_static_claim, static_claims.get());
     }
     static_claims->set_process_unknown_status(FLAGS_claim_unknown);
@@ -309,72 +1238,563 @@ void IndexerContext::InitializeClaimClient() {
   }
 }
 
-void IndexerContext::NormalizeFileVNames() {
-  for (auto &job : jobs_) {
-    for (auto &input : *job.unit.mutable_required_input()) {
-      input.mutable_v_name()->set_path(
-          CleanPath(ToStringRef(input.v_name().path())));
-      input.mutable_v_name()->clear_signature();
+void IndexerContext::OpenOutputStreams() {
+  if (!FLAGS_experimental_leveldb_output.empty()) {
+    CHECK(FLAGS_experimental_write_request_output.empty())
+        << "Entries can't be written to LevelDB and as WriteRequests.";
+    CHECK_EQ(FLAGS_output_compression, "none")
+        << "LevelDB output can't be compressed.";
+    CHECK(!FLAGS_experimental_sort_output)
+        << "LevelDB output is always sorted.";
+    CHECK_EQ(FLAGS_experimental_output_shards, 0u)
+        << "LevelDB output can't be sharded.";
+    CHECK_EQ(FLAGS_experimental_output_format, "entries")
+        << "LevelDB output has its own format.";
+    leveldb_output_ = llvm::make_unique<LevelDBOutputStream>();
+    std::string error_text;
+    if (!leveldb_output_->Open(FLAGS_experimental_leveldb_output,
+                               &error_text)) {
+      fprintf(stderr, "Can't open LevelDB output: %s\n", error_text.c_str());
+      ::exit(1);
     }
+    leveldb_sink_ = llvm::make_unique<LevelDBEntrySink>(leveldb_output_.get());
+    kythe_output_.reset(new kythe::FileOutputStream(leveldb_sink_.get()));
+    kythe_output_->set_show_stats(FLAGS_cache_stats);
+    kythe_output_->set_buffer_digest(buffer_digest());
+    kythe_output_->set_size_tuner(buffer_size_tuner());
+    if (FLAGS_experimental_writer_thread) {
+      kythe_output_->StartWriterThread();
+    }
+    return;
   }
-}
-
-void IndexerContext::OpenOutputStreams() {
-  write_fd_ = STDOUT_FILENO;
-  if (FLAGS_o != "-") {
-    write_fd_ = ::open(FLAGS_o.c_str(), O_WRONLY | O_CREAT | O_TRUNC,
-                       S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
-    if (write_fd_ == -1) {
-      ::perror("Can't open output file");
+  if (!FLAGS_experimental_write_request_output.empty()) {
+    CHECK_EQ(FLAGS_output_compression, "none")
+        << "WriteRequest output can't be compressed.";
+    CHECK(!FLAGS_experimental_sort_output)
+        << "WriteRequest output can't be sorted.";
+    CHECK_EQ(FLAGS_experimental_output_shards, 0u)
+        << "WriteRequest output can't be sharded.";
+    CHECK_EQ(FLAGS_experimental_output_format, "entries")
+        << "WriteRequest output has its own format.";
+    write_request_fd_ =
+        ::open(FLAGS_experimental_write_request_output.c_str(),
+               O_WRONLY | O_CREAT | O_TRUNC, S_IREAD | S_IWRITE);
+    if (write_request_fd_ == -1) {
+      ::perror("Can't open WriteRequest output");
       ::exit(1);
     }
+    graphstore_writer_ =
+        llvm::make_unique<DelimitedWriteRequestWriter>(write_request_fd_);
+    graphstore_output_ = llvm::make_unique<GraphStoreWriteStream>(
+        graphstore_writer_.get(), FLAGS_experimental_write_requests_in_flight);
+    graphstore_buffer_ = llvm::make_unique<ChunkedOutputStream>();
+    graphstore_buffer_->set_drain(
+        ChunkedOutputStream::kDefaultChunkSize,
+        [this] { graphstore_output_->ForwardFrom(graphstore_buffer_.get()); });
+    kythe_output_.reset(new kythe::FileOutputStream(graphstore_buffer_.get()));
+    kythe_output_->set_show_stats(FLAGS_cache_stats);
+    kythe_output_->set_buffer_digest(buffer_digest());
+    kythe_output_->set_size_tuner(buffer_size_tuner());
+    if (FLAGS_experimental_writer_thread) {
+      kythe_output_->StartWriterThread();
+    }
+    return;
+  }
+  if (FLAGS_experimental_output_shards != 0) {
+    CHECK(FLAGS_o != "-") << "Sharded output needs a -o shard pattern.";
+    std::vector<google::protobuf::io::ZeroCopyOutputStream *> shards;
+    output_files_.resize(FLAGS_experimental_output_shards);
+    for (size_t shard = 0; shard < output_files_.size(); ++shard) {
+      std::string path;
+      CHECK(ShardingOutputStream::FormatShardPath(FLAGS_o, shard, &path))
+          << "-o must contain exactly one integer conversion (like %05d) "
+          << "with --experimental_output_shards.";
+      OpenOutputFile(path, &output_files_[shard]);
+      shards.push_back(output_files_[shard].entries());
+    }
+    sharded_output_ = llvm::make_unique<ShardingOutputStream>(shards);
+    kythe_output_.reset(new kythe::FileOutputStream(sharded_output_.get()));
+  } else {
+    output_files_.resize(1);
+    OpenOutputFile(FLAGS_o, &output_files_[0],
+                   journal_ != nullptr
+                       ? static_cast<int64_t>(journal_->committed_offset())
+                       : -1);
+    const OutputFile &file = output_files_[0];
+    if (file.entries() == file.raw.get()) {
+      // Only the raw stream can be flushed and written around.
+      kythe_output_.reset(new kythe::FileOutputStream(file.raw.get()));
+      if (!FLAGS_experimental_writer_thread) {
+        kythe_output_->set_direct_fd(file.fd);
+      }
+    } else {
+      kythe_output_.reset(new kythe::FileOutputStream(file.entries()));
+    }
   }
-  raw_output_.reset(new google::protobuf::io::FileOutputStream(write_fd_));
-  kythe_output_.reset(new kythe::FileOutputStream(raw_output_.get()));
   kythe_output_->set_show_stats(FLAGS_cache_stats);
   kythe_output_->set_flush_after_each_entry(FLAGS_flush_after_each_entry);
+  kythe_output_->set_buffer_digest(buffer_digest());
+  kythe_output_->set_size_tuner(buffer_size_tuner());
+  if (FLAGS_experimental_writer_thread) {
+    kythe_output_->StartWriterThread();
+  }
+}
+
+google::protobuf::io::ZeroCopyOutputStream *
+IndexerContext::OutputFile::entries() const {
+  if (sorted) {
+    return sorted.get();
+  }
+  if (delta) {
+    return delta.get();
+  }
+  if (packed) {
+    return packed.get();
+  }
+  if (compressed) {
+    return compressed.get();
+  }
+  return raw.get();
+}
+
+void IndexerContext::OpenOutputFile(const std::string &path, OutputFile *file,
+                                    int64_t resume_offset) {
+  file->fd = STDOUT_FILENO;
+  if (path != "-") {
+    file->fd = ::open(path.c_str(),
+                      O_WRONLY | O_CREAT | (resume_offset < 0 ? O_TRUNC : 0),
+                      S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+    if (file->fd == -1) {
+      ::perror(("Can't open output file " + path).c_str());
+      ::exit(1);
+    }
+  }
+  if (resume_offset >= 0) {
+    struct stat info;
+    if (::fstat(file->fd, &info) != 0 || info.st_size < resume_offset) {
+      fprintf(stderr, "Output file %s is shorter than the journal says.\n",
+              path.c_str());
+      ::exit(1);
+    }
+    // Drop whatever a unit that didn't finish left behind.
+    if (::ftruncate(file->fd, resume_offset) != 0 ||
+        ::lseek(file->fd, resume_offset, SEEK_SET) < 0) {
+      ::perror(("Can't resume output file " + path).c_str());
+      ::exit(1);
+    }
+  }
+  file->raw.reset(new google::protobuf::io::FileOutputStream(file->fd));
+  google::protobuf::io::ZeroCopyOutputStream *entry_output = file->raw.get();
+  if (FLAGS_output_compression == "snappy") {
+    file->compressed = llvm::make_unique<SnappyFramedOutputStream>(
+        file->raw.get(), FLAGS_compression_block_size,
+        FLAGS_compression_thread);
+    entry_output = file->compressed.get();
+  } else {
+    CHECK_EQ(FLAGS_output_compression, "none")
+        << "Unknown --output_compression.";
+  }
+  if (FLAGS_experimental_output_format == "entry_pack") {
+    file->packed = llvm::make_unique<EntryPackOutputStream>(entry_output);
+    entry_output = file->packed.get();
+  } else {
+    CHECK_EQ(FLAGS_experimental_output_format, "entries")
+        << "Unknown --experimental_output_format.";
+  }
+  if (!FLAGS_experimental_delta_base.empty()) {
+    CHECK(FLAGS_experimental_sort_output)
+        << "--experimental_delta_base needs --experimental_sort_output.";
+    CHECK_EQ(FLAGS_experimental_output_shards, 0u)
+        << "Sharded output can't be written as deltas.";
+    CHECK_EQ(FLAGS_experimental_output_format, "entries")
+        << "Deltas have their own format.";
+    std::string error_text;
+    auto base = DelimitedProtoReader::Open(FLAGS_experimental_delta_base,
+                                           false, &error_text);
+    if (!base) {
+      fprintf(stderr, "Can't open delta base %s: %s\n",
+              FLAGS_experimental_delta_base.c_str(), error_text.c_str());
+      ::exit(1);
+    }
+    if (!FLAGS_experimental_delta_snapshot.empty()) {
+      file->snapshot_fd =
+          ::open(FLAGS_experimental_delta_snapshot.c_str(),
+                 O_WRONLY | O_CREAT | O_TRUNC, S_IREAD | S_IWRITE);
+      if (file->snapshot_fd == -1) {
+        ::perror("Can't open delta snapshot");
+        ::exit(1);
+      }
+      file->snapshot.reset(
+          new google::protobuf::io::FileOutputStream(file->snapshot_fd));
+    }
+    file->delta = llvm::make_unique<DeltaOutputStream>(
+        entry_output, std::move(base), file->snapshot.get());
+    entry_output = file->delta.get();
+  } else {
+    CHECK(FLAGS_experimental_delta_snapshot.empty())
+        << "--experimental_delta_snapshot needs --experimental_delta_base.";
+  }
+  if (FLAGS_experimental_sort_output) {
+    file->sorted = llvm::make_unique<SortingOutputStream>(
+        entry_output, FLAGS_experimental_sort_buffer_bytes,
+        FLAGS_experimental_sort_temp_dir);
+  }
+}
+
+void IndexerContext::CloseOutputFile(OutputFile *file) {
+  if (file->sorted) {
+    std::string error_text;
+    if (!file->sorted->Close(&error_text)) {
+      fprintf(stderr, "Error sorting output: %s\n", error_text.c_str());
+      ::exit(1);
+    }
+    file->sorted.reset();
+  }
+  if (file->delta) {
+    std::string error_text;
+    if (!file->delta->Close(&error_text)) {
+      fprintf(stderr, "Error writing deltas: %s\n", error_text.c_str());
+      ::exit(1);
+    }
+    if (FLAGS_cache_stats) {
+      fprintf(stderr, "Deltas: %zu added, %zu deleted, %zu unchanged\n",
+              file->delta->added(), file->delta->deleted(),
+              file->delta->unchanged());
+    }
+    file->delta.reset();
+    if (file->snapshot) {
+      file->snapshot.reset();
+      if (::close(file->snapshot_fd) != 0) {
+        ::perror("Error closing delta snapshot");
+        ::exit(1);
+      }
+    }
+  }
+  if (file->packed) {
+    std::string error_text;
+    if (!file->packed->Close(&error_text)) {
+      fprintf(stderr, "Error packing output: %s\n", error_text.c_str());
+      ::exit(1);
+    }
+    file->packed.reset();
+  }
+  if (file->compressed && !file->compressed->Close()) {
+    fprintf(stderr, "Error writing compressed output\n");
+    ::exit(1);
+  }
+  file->compressed.reset();
+  file->raw.reset();
+  if (::close(file->fd) != 0) {
+    ::perror("Error closing output file");
+    ::exit(1);
+  }
+}
+
+BufferDigest IndexerContext::buffer_digest() const {
+  BufferDigest digest;
+  CHECK(ParseBufferDigest(FLAGS_experimental_buffer_digest, &digest))
+      << "Unknown --experimental_buffer_digest.";
+  return digest;
 }
 
 void IndexerContext::CloseOutputStreams() {
   if (kythe_output_) {
     kythe_output_.reset();
-    raw_output_.reset();
-    if (::close(write_fd_) != 0) {
-      ::perror("Error closing output file");
-      ::exit(1);
+    if (leveldb_output_) {
+      std::string error_text;
+      if (!leveldb_sink_->Close(&error_text) ||
+          !leveldb_output_->Close(&error_text)) {
+        fprintf(stderr, "Error writing LevelDB output: %s\n",
+                error_text.c_str());
+        ::exit(1);
+      }
+      leveldb_sink_.reset();
+      leveldb_output_.reset();
+      return;
+    }
+    if (graphstore_output_) {
+      graphstore_output_->ForwardFrom(graphstore_buffer_.get());
+      std::string error_text;
+      if (graphstore_buffer_->size() != 0) {
+        fprintf(stderr, "Truncated entry in WriteRequest output\n");
+        ::exit(1);
+      }
+      if (!graphstore_output_->Close(&error_text)) {
+        fprintf(stderr, "Error sending WriteRequests: %s\n",
+                error_text.c_str());
+        ::exit(1);
+      }
+      if (::close(write_request_fd_) != 0) {
+        ::perror("Error closing WriteRequest output");
+        ::exit(1);
+      }
+      graphstore_output_.reset();
+      graphstore_writer_.reset();
+      graphstore_buffer_.reset();
+      write_request_fd_ = -1;
+      return;
     }
+    if (sharded_output_) {
+      std::string error_text;
+      if (!sharded_output_->Close(&error_text)) {
+        fprintf(stderr, "Error sharding output: %s\n", error_text.c_str());
+        ::exit(1);
+      }
+      sharded_output_.reset();
+    }
+    for (auto &file : output_files_) {
+      CloseOutputFile(&file);
+    }
+    output_files_.clear();
   }
 }
 
+void IndexerContext::OpenBufferSizeTuner() {
+  if (!FLAGS_experimental_adaptive_buffer_sizes) {
+    return;
+  }
+  BufferSizeTuner::Options options;
+  options.min_size = FLAGS_min_size;
+  options.max_size = FLAGS_max_size;
+  options.smallest_max_size = FLAGS_adaptive_max_size_floor;
+  options.largest_max_size = FLAGS_adaptive_max_size_ceiling;
+  CHECK_LE(options.smallest_max_size, options.largest_max_size)
+      << "--adaptive_max_size_floor must not exceed "
+      << "--adaptive_max_size_ceiling.";
+  buffer_size_tuner_ = llvm::make_unique<BufferSizeTuner>(options);
+}
+
 void IndexerContext::OpenHashCache() {
   if (!FLAGS_cache.empty()) {
     auto memcache_hash_cache = llvm::make_unique<MemcachedHashCache>();
-    CHECK(memcache_hash_cache->OpenMemcache(FLAGS_cache));
+    auto pool =
+        OpenMemcachedPool("hash cache", FLAGS_cache, FLAGS_cache_timeout_ms);
+    CHECK(pool) << "Can't open " << FLAGS_cache;
+    memcache_hash_cache->UsePool(std::move(pool));
     memcache_hash_cache->SetSizeLimits(FLAGS_min_size, FLAGS_max_size);
-    hash_cache_ = std::move(memcache_hash_cache);
+    memcache_hash_cache->set_average_chunk_size(
+        FLAGS_experimental_average_chunk_size);
+    memcache_hash_cache->set_batch_size(std::max(FLAGS_cache_batch_size, 1));
+    remote_hash_cache_ = std::move(memcache_hash_cache);
+  }
+  if (FLAGS_cache_lru_size != 0 || FLAGS_cache_bloom_bits != 0) {
+    if (!remote_hash_cache_) {
+      // Only deduplicate output produced by this process.
+      remote_hash_cache_ = llvm::make_unique<HashCache>();
+      remote_hash_cache_->SetSizeLimits(FLAGS_min_size, FLAGS_max_size);
+      remote_hash_cache_->set_average_chunk_size(
+          FLAGS_experimental_average_chunk_size);
+    }
+    hash_cache_ = llvm::make_unique<LayeredHashCache>(
+        remote_hash_cache_.get(), FLAGS_cache_lru_size, FLAGS_cache_bloom_bits);
+  } else {
+    hash_cache_ = std::move(remote_hash_cache_);
+  }
+  if (!FLAGS_experimental_hash_snapshot_out.empty()) {
+    CHECK(hash_cache_) << "--experimental_hash_snapshot_out needs a hash "
+                       << "cache (--cache or --cache_bloom_bits).";
+    snapshotted_hash_cache_ = std::move(hash_cache_);
+    auto snapshot =
+        llvm::make_unique<SnapshotHashCache>(snapshotted_hash_cache_.get());
+    hash_snapshot_ = snapshot.get();
+    hash_cache_ = std::move(snapshot);
+  }
+  if (!FLAGS_experimental_hash_snapshot_in.empty()) {
+    CHECK(hash_cache_) << "--experimental_hash_snapshot_in needs a hash "
+                       << "cache (--cache or --cache_bloom_bits).";
+    size_t count = 0;
+    std::string error_text;
+    CHECK(LoadHashSnapshot(FLAGS_experimental_hash_snapshot_in,
+                           hash_cache_.get(), &count, &error_text))
+        << "Couldn't load the hash snapshot: " << error_text;
+    LOG(INFO) << "Loaded " << count << " hashes from "
+              << FLAGS_experimental_hash_snapshot_in;
+  }
+}
+
+namespace {
+/// \brief Opens a fingerprint store from a pair of flags.
+/// \param kind What the fingerprints are of (for error messages).
+/// \param db_path The path to a LevelDB database, or empty.
+/// \param cache_spec The memcache instance to use, or empty.
+/// \return the store, or null if both `db_path` and `cache_spec` are empty.
+std::unique_ptr<HashCache> OpenFingerprintStore(const char *kind,
+                                                const std::string &db_path,
+                                                const std::string &cache_spec) {
+  CHECK(db_path.empty() || cache_spec.empty())
+      << "Use at most one database or cache for " << kind << " fingerprints.";
+  if (!db_path.empty()) {
+    auto db = llvm::make_unique<LevelDBHashCache>();
+    std::string error_text;
+    CHECK(db->Open(db_path, &error_text))
+        << "Couldn't open " << kind << " fingerprints at " << db_path << ": "
+        << error_text;
+    return std::move(db);
+  } else if (!cache_spec.empty()) {
+    auto cache = llvm::make_unique<MemcachedHashCache>();
+    auto pool = OpenMemcachedPool(kind, cache_spec, FLAGS_cache_timeout_ms);
+    CHECK(pool) << "Can't open the " << kind << " fingerprint cache at "
+                << cache_spec;
+    cache->UsePool(std::move(pool));
+    return std::move(cache);
+  }
+  return nullptr;
+}
+}  // anonymous namespace
+
+void IndexerContext::OpenHeaderFingerprints() {
+  header_fingerprints_ =
+      OpenFingerprintStore("header", FLAGS_experimental_header_fingerprint_db,
+                           FLAGS_experimental_header_fingerprint_cache);
+}
+
+void IndexerContext::OpenInstantiationFingerprints() {
+  instantiation_fingerprints_ = OpenFingerprintStore(
+      "instantiation", FLAGS_experimental_instantiation_fingerprint_db,
+      FLAGS_experimental_instantiation_fingerprint_cache);
+}
+
+void IndexerContext::ShareResourcesBetweenWorkers() {
+  claim_client_ =
+      llvm::make_unique<LockingClaimClient>(std::move(claim_client_));
+  if (hash_cache_ && FLAGS_experimental_hash_claim_table_size != 0) {
+    // Each worker registers this many hashes with the cache at once.
+    constexpr size_t kRegistrationBatchSize = 64;
+    auto concurrent_hash_cache = llvm::make_unique<ConcurrentHashCache>(
+        hash_cache_.get(), FLAGS_experimental_hash_claim_table_size,
+        kRegistrationBatchSize);
+    concurrent_hash_cache_ = concurrent_hash_cache.get();
+    shared_hash_cache_ = std::move(concurrent_hash_cache);
+  } else if (hash_cache_) {
+    shared_hash_cache_ = llvm::make_unique<LockingHashCache>(hash_cache_.get());
+  }
+  if (header_fingerprints_) {
+    shared_header_fingerprints_ =
+        llvm::make_unique<LockingHashCache>(header_fingerprints_.get());
+  }
+  if (instantiation_fingerprints_) {
+    shared_instantiation_fingerprints_ = llvm::make_unique<LockingHashCache>(
+        instantiation_fingerprints_.get());
   }
 }
 
+std::unique_ptr<HashCache> IndexerContext::NewWorkerHashCache() const {
+  if (concurrent_hash_cache_ == nullptr) {
+    return nullptr;
+  }
+  return llvm::make_unique<ConcurrentHashCache::Worker>(concurrent_hash_cache_);
+}
+
 IndexerContext::IndexerContext(const std::vector<std::string> &args,
                                const std::string &default_filename)
     : args_(args), ignore_unimplemented_(FLAGS_ignore_unimplemented) {
+  CHECK_GE(FLAGS_jobs, 1) << "--jobs must be positive.";
+  worker_count_ = FLAGS_jobs;
   args_.erase(std::remove(args_.begin(), args_.end(), std::string()),
               args_.end());
-  if (HasIndexArguments()) {
-    for (size_t arg = 1; arg < args_.size(); ++arg) {
-      LoadDataFromIndex(args[arg]);
-    }
-  } else {
-    LoadDataFromUnpackedFile(default_filename);
-  }
-  if (FLAGS_normalize_file_vnames) {
-    NormalizeFileVNames();
-  }
+  OpenFileStore();
+  OpenRemoteIndexPack();
+  OpenCostModel();
+  OpenJournal();
+  OpenWorkQueue();
+  OpenJobSource(default_filename);
   InitializeClaimClient();
+  OpenBufferSizeTuner();
   OpenOutputStreams();
   OpenHashCache();
+  OpenHeaderFingerprints();
+  OpenInstantiationFingerprints();
+  if (worker_count_ > job_count_) {
+    worker_count_ = std::max<size_t>(job_count_, 1);
+  }
+  if (worker_count_ > 1) {
+    ShareResourcesBetweenWorkers();
+  }
 }
 
-IndexerContext::~IndexerContext() { CloseOutputStreams(); }
+IndexerContext::~IndexerContext() {
+  if (work_queue_ != nullptr) {
+    // Don't wait on units leased by other indexers if we're stopping early.
+    work_queue_->Stop();
+    auto stats = work_queue_->stats();
+    fprintf(stderr,
+            "Work queue: leased %zu units (%zu taken over), %zu finished "
+            "elsewhere, %zu taken while unavailable, waited %zu times\n",
+            stats.acquired, stats.taken_over, stats.done_elsewhere,
+            stats.unavailable, stats.waits);
+  }
+  CloseOutputStreams();
+  if (buffer_size_tuner_ != nullptr) {
+    LOG(INFO) << "Final buffer sizes: " << buffer_size_tuner_->ToString();
+  }
+  std::string error_text;
+  if (hash_snapshot_ != nullptr) {
+    if (hash_snapshot_->WriteSnapshot(FLAGS_experimental_hash_snapshot_out,
+                                      &error_text)) {
+      LOG(INFO) << "Wrote " << hash_snapshot_->size() << " hashes to "
+                << FLAGS_experimental_hash_snapshot_out;
+    } else {
+      fprintf(stderr, "Error: %s\n", error_text.c_str());
+    }
+  }
+  if (cost_model_ != nullptr && !FLAGS_experimental_job_history.empty() &&
+      !cost_model_->SaveHistory(FLAGS_experimental_job_history,
+                                &error_text)) {
+    fprintf(stderr, "Error: %s\n", error_text.c_str());
+  }
+}
+
+bool IndexerContext::serving() const {
+  return FLAGS_experimental_serve_analysis_requests;
+}
+
+bool IndexerContext::ServeAnalysisRequests(const JobIndexer &index,
+                                           std::string *error_text) {
+  CHECK(serving());
+  CHECK(sharded_output_ == nullptr) << "Analysis responses can't be sharded.";
+  CHECK_EQ(output_files_.size(), 1u);
+  CHECK(output_files_[0].compressed == nullptr)
+      << "Analysis responses can't be compressed.";
+  CHECK(output_files_[0].sorted == nullptr)
+      << "Analysis responses can't be sorted.";
+  CHECK(output_files_[0].packed == nullptr)
+      << "Analysis responses can't be packed.";
+  CHECK(leveldb_output_ == nullptr)
+      << "Analysis responses can't be written to LevelDB.";
+  CHECK(graphstore_output_ == nullptr)
+      << "Analysis responses can't be written as WriteRequests.";
+  int read_fd = STDIN_FILENO;
+  if (FLAGS_i != "-") {
+    read_fd = ::open(FLAGS_i.c_str(), O_RDONLY);
+    if (read_fd == -1) {
+      ::perror("Can't open input file");
+      ::exit(1);
+    }
+  }
+  google::protobuf::io::FileInputStream input(read_fd);
+  input.SetCloseOnDelete(read_fd != STDIN_FILENO);
+  AnalysisServer server(&input, output_files_[0].raw.get());
+  server.set_max_buffered_bytes(FLAGS_experimental_analysis_buffer_bytes);
+  size_t job_index = 0;
+  return server.Serve(
+      [&](const proto::AnalysisRequest &request,
+          std::vector<proto::FileData> *files, KytheOutputStream *output) {
+        IndexerJob job;
+        *job.unit = request.compilation();
+        job.silent = false;
+        job.index = job_index++;
+        for (auto &file : *files) {
+          AddFileData(&file, file_store_.get(), job.virtual_files,
+                      &job.mapped_files);
+        }
+        SetUpJobForUnit(&job);
+        if (!static_claim_shards_.empty()) {
+          LoadStaticClaimShard(static_claim_shards_, *job.unit,
+                               claim_client_.get());
+        }
+        return index(&job, output);
+      },
+      error_text);
+}
 
 }  // namespace kythe
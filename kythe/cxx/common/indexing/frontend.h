@@ -17,14 +17,36 @@
 #ifndef KYTHE_CXX_COMMON_FRONTEND_H_
 #define KYTHE_CXX_COMMON_FRONTEND_H_
 
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
 #include <string>
+#include <thread>
 #include <vector>
 
 #include "glog/logging.h"
+#include "google/protobuf/arena.h"
 #include "google/protobuf/io/zero_copy_stream.h"
+#include "google/protobuf/repeated_field.h"
+#include "kythe/cxx/common/cxx_details.h"
 #include "kythe/cxx/common/index_pack.h"
 #include "kythe/cxx/common/indexing/KytheClaimClient.h"
 #include "kythe/cxx/common/indexing/KytheOutputStream.h"
+#include "kythe/cxx/common/indexing/MappedFileStore.h"
+#include "kythe/cxx/common/indexing/delta_output_stream.h"
+#include "kythe/cxx/common/indexing/entry_pack.h"
+#include "kythe/cxx/common/indexing/graphstore_write_stream.h"
+#include "kythe/cxx/common/indexing/hash_snapshot.h"
+#include "kythe/cxx/common/indexing/index_journal.h"
+#include "kythe/cxx/common/indexing/job_cost_model.h"
+#include "kythe/cxx/common/indexing/leveldb_output_stream.h"
+#include "kythe/cxx/common/indexing/sharding_output_stream.h"
+#include "kythe/cxx/common/indexing/sorting_output_stream.h"
+#include "kythe/cxx/common/indexing/work_queue.h"
+#include "kythe/cxx/common/remote_index_pack.h"
+#include "kythe/cxx/common/snappy_stream.h"
 #include "kythe/proto/analysis.pb.h"
 #include "llvm/Support/FileSystem.h"
 #include "llvm/Support/Path.h"
@@ -32,16 +54,119 @@
 namespace kythe {
 
 /// \brief A compilation unit to be indexed.
+///
+/// The job's messages are parsed onto its own arena, so a unit with thousands
+/// of inputs is freed in one go along with the job.
 struct IndexerJob {
-  /// All files necessary for the compilation under analysis.
-  std::vector<proto::FileData> virtual_files;
-  /// The compilation under analysis.
-  proto::CompilationUnit unit;
+  IndexerJob();
+  /// Owns `virtual_files` and `unit`. Declared first so that it's destroyed
+  /// last.
+  std::unique_ptr<google::protobuf::Arena> arena;
+  /// All files necessary for the compilation under analysis (except for those
+  /// in `mapped_files`). Allocated on `arena`.
+  google::protobuf::RepeatedPtrField<proto::FileData> *virtual_files;
+  /// Files necessary for the compilation whose content is held in a
+  /// `MappedFileStore`.
+  std::vector<MappedFile> mapped_files;
+  /// The compilation under analysis. Allocated on `arena`.
+  proto::CompilationUnit *unit;
   /// The absolute working directory in which indexing is taking place. This may
   /// not exist on the local filesystem.
   std::string working_directory;
   /// If set, this job should not produce any output.
   bool silent;
+  /// The position of this job in the indexer's input list.
+  size_t index = 0;
+  /// The position of this job in the order jobs are handed out.
+  size_t position = 0;
+};
+
+/// \brief Hands out `IndexerJob`s in order, decoding upcoming jobs on a
+/// background thread while earlier jobs are being indexed. With no room for
+/// prefetched jobs, each job is decoded by the thread that asks for it and
+/// no thread is started (as forked workers need).
+class PrefetchingJobSource {
+ public:
+  /// \brief Fills in the job at some position in the input list.
+  using Loader = std::function<void(size_t index, IndexerJob *job)>;
+  /// \brief Chooses the position in the input list of the next job.
+  /// \return false if there are no more jobs.
+  using Picker = std::function<bool(size_t *index)>;
+  /// \param job_count The number of jobs to produce.
+  /// \param max_jobs The maximum number of decoded jobs to hold at once, or 0
+  /// to decode each job in `Next` rather than on a background thread.
+  /// \param max_bytes Stop prefetching once this many bytes of file content
+  /// are waiting to be handed out. At least one job is always prefetched.
+  /// \param loader Called (from the background thread, if there is one) to
+  /// decode each job.
+  /// \param order The indices of the jobs in the order to produce them, or
+  /// empty to produce them in index order.
+  PrefetchingJobSource(size_t job_count, size_t max_jobs, size_t max_bytes,
+                       Loader loader, std::vector<size_t> order = {});
+  /// \brief Produces jobs in the order `picker` chooses them. `picker` is
+  /// called from the background thread (if there is one), and only once
+  /// there is room for another job.
+  PrefetchingJobSource(size_t max_jobs, size_t max_bytes, Loader loader,
+                       Picker picker);
+  ~PrefetchingJobSource();
+
+  /// \brief Blocks until the next job has been decoded, then moves it to
+  /// `job`. Safe to call from multiple threads.
+  /// \return false if there are no more jobs.
+  bool Next(std::unique_ptr<IndexerJob> *job);
+
+  /// \brief The decoded jobs waiting to be handed out.
+  struct Depth {
+    size_t jobs = 0;
+    /// The sum of their `JobSize`s.
+    size_t bytes = 0;
+  };
+  /// \return how many jobs are waiting now. Safe to call from any thread.
+  Depth depth();
+
+  /// \return the approximate number of bytes `job` holds in memory. Content
+  /// in `mapped_files` is backed by the page cache and isn't counted unless
+  /// it's compressed (and so on the heap).
+  static size_t JobSize(const IndexerJob &job);
+
+ private:
+  /// \brief Decodes jobs until all have been produced or we're stopped.
+  void Prefetch();
+
+  /// \brief Decodes the job at `position` in the order jobs are produced.
+  /// \return false if there are no more jobs.
+  bool Load(size_t position, std::unique_ptr<IndexerJob> *job);
+
+  /// The total number of jobs to produce.
+  const size_t job_count_;
+  /// The maximum number of jobs to hold in `queue_`.
+  const size_t max_jobs_;
+  /// The maximum number of content bytes to hold in `queue_`.
+  const size_t max_bytes_;
+  /// Decodes jobs.
+  Loader loader_;
+  /// The order in which to produce jobs (if not empty).
+  std::vector<size_t> order_;
+  /// If set, chooses jobs in place of `job_count_` and `order_`.
+  Picker picker_;
+  /// Guards the fields below.
+  std::mutex mutex_;
+  /// Signaled when a job is queued or no more jobs will be queued.
+  std::condition_variable job_ready_;
+  /// Signaled when a job is removed from the queue or we're stopping.
+  std::condition_variable has_space_;
+  /// Decoded jobs that haven't been handed out yet.
+  std::deque<std::unique_ptr<IndexerJob>> queue_;
+  /// The sum of `JobSize` over `queue_`.
+  size_t queued_bytes_ = 0;
+  /// Set once all jobs have been queued.
+  bool done_ = false;
+  /// Set when the prefetch thread should exit early.
+  bool stopping_ = false;
+  /// The position of the next job `Next` decodes, without a prefetch thread.
+  size_t next_position_ = 0;
+  /// Runs `Prefetch`, unless jobs are decoded in `Next`.
+  std::thread thread_;
 };
 
 /// \brief Handles common tasks related to invoking a Kythe indexer from the
@@ -57,18 +182,66 @@ class IndexerContext {
   ~IndexerContext();
 
   /// \brief If non-null, the hash cache to use. Owned by `IndexerContext`.
-  HashCache *hash_cache() const { return hash_cache_.get(); }
+  /// Safe to share between workers if `worker_count()` is greater than 1.
+  HashCache *hash_cache() const {
+    return shared_hash_cache_ ? shared_hash_cache_.get() : hash_cache_.get();
+  }
+  /// \brief Returns a view of `hash_cache()` for a single worker to use
+  /// instead of it, or null if workers should use `hash_cache()` itself. The
+  /// view must be destroyed before `IndexerContext`.
+  std::unique_ptr<HashCache> NewWorkerHashCache() const;
+  /// \brief If non-null, the fingerprints of headers indexed by earlier runs.
+  /// Owned by `IndexerContext`. Safe to share between workers.
+  HashCache *header_fingerprints() const {
+    return shared_header_fingerprints_ ? shared_header_fingerprints_.get()
+                                       : header_fingerprints_.get();
+  }
+  /// \brief If non-null, the fingerprints of implicit template instantiations
+  /// indexed by earlier runs. Owned by `IndexerContext`. Safe to share between
+  /// workers.
+  HashCache *instantiation_fingerprints() const {
+    return shared_instantiation_fingerprints_
+               ? shared_instantiation_fingerprints_.get()
+               : instantiation_fingerprints_.get();
+  }
+  /// \brief Header search information from the shared C++ details that
+  /// units in --index_pack refer to, kept across jobs. Safe to share between
+  /// workers.
+  SharedCxxDetailsCache *shared_cxx_details() { return &shared_cxx_details_; }
+  /// \brief The number of jobs that may be indexed concurrently. Never
+  /// greater than the number of jobs (unless there are none) or less than 1.
+  size_t worker_count() const { return worker_count_; }
   /// \brief If true, the indexer is permitted to touch the local filesystem.
   bool allow_filesystem_access() const { return allow_filesystem_access_; }
   /// \brief If true, the indexer should handle unknown elements gracefully.
   bool ignore_unimplemented() const { return ignore_unimplemented_; }
-  /// \brief Indexer jobs to complete.
-  std::vector<IndexerJob> *jobs() { return &jobs_; }
-  /// \brief The claim client to use for this compilation. Not null.
+  /// \brief The number of indexer jobs to complete.
+  size_t job_count() const { return job_count_; }
+  /// \brief Blocks until the next job to complete is ready and moves it to
+  /// `job`. Jobs are produced in input order (or largest first, with
+  /// --experimental_schedule_largest_first, or as they are leased, with
+  /// --experimental_work_queue); upcoming jobs are decoded in the
+  /// background. Safe to call from multiple threads.
+  /// With --experimental_static_claim_shards, also loads the job's claims.
+  /// \return false if there are no more jobs.
+  bool NextJob(std::unique_ptr<IndexerJob> *job);
+  /// \return how many decoded jobs are waiting to be handed out.
+  PrefetchingJobSource::Depth job_queue_depth() const {
+    return job_source_ ? job_source_->depth() : PrefetchingJobSource::Depth();
+  }
+  /// \brief The claim client to use for this compilation. Not null. Safe to
+  /// share between workers if `worker_count()` is greater than 1.
   KytheClaimClient *claim_client() const {
     CHECK(claim_client_ != nullptr);
     return claim_client_.get();
   }
+  /// \brief The digest that output streams should hash buffers with.
+  BufferDigest buffer_digest() const;
+  /// \brief If non-null, the tuner that output streams should take buffer
+  /// size limits from. Owned by `IndexerContext`; thread-safe.
+  BufferSizeTuner *buffer_size_tuner() const {
+    return buffer_size_tuner_.get();
+  }
   /// \brief The output stream to use for this compilation. Not null; owned
   /// by `IndexerContext` and closed on destruction.
   FileOutputStream *output() const {
@@ -76,6 +249,43 @@ class IndexerContext {
     return kythe_output_.get();
   }
 
+  /// \brief Logs how long `job` took next to how long it was predicted to
+  /// take, and remembers it in the job history (if there is one). Safe to
+  /// call from multiple threads.
+  void RecordJobCost(const IndexerJob &job, double millis) const;
+  /// \return the name `job` was given on the command line, which keys it in
+  /// the job history and in cost probes, or empty if it has none (as for
+  /// served jobs).
+  std::string job_key(const IndexerJob &job) const;
+  /// \brief With --experimental_work_queue, flushes `output()` and records
+  /// that the job for input `index` is done, so that no other indexer takes
+  /// it. Only call from the thread that writes to `output()`, once the job's
+  /// entries have been written to it.
+  /// \param indexed false if the job failed; its lease is then left to lapse
+  /// so that another indexer retries it.
+  void FinishJob(size_t index, bool indexed) const;
+  /// \brief With --experimental_index_journal, syncs `output()` and records
+  /// that everything produced by the job for input `index` has been written
+  /// to it, so that a run that picks up after this one skips that job. Exits
+  /// on error. Only call from the thread that writes to `output()`, between
+  /// jobs.
+  void CommitJob(size_t index) const;
+  /// \brief Indexes a job, writing its entries to `output`.
+  /// \return empty if OK; otherwise, an error description.
+  using JobIndexer =
+      std::function<std::string(IndexerJob *job, KytheOutputStream *output)>;
+  /// \brief If true, jobs come from `ServeAnalysisRequests` rather than from
+  /// `NextJob` (which produces none).
+  bool serving() const;
+  /// \brief Answers the analysis requests read from the input (see
+  /// `AnalysisServer`) until it ends, using `index` to index each request's
+  /// job. Responses are written to the output in place of `output()`, which
+  /// must not be used. The context's caches and claim client are shared by
+  /// all requests.
+  /// \pre `serving()`
+  /// \return false if the input was malformed; `error_text` will say why.
+  bool ServeAnalysisRequests(const JobIndexer &index, std::string *error_text);
+
   /// \brief Generates a usage message for this indexer.
   /// \param program_title a description of the indexer
   /// ("the Kythe C++ indexer")
@@ -90,36 +300,165 @@ class IndexerContext {
   /// \brief Loads from an index pack or .kindex.
   /// \param kindex_file_or_cu The name of the .kindex (with extension) or
   /// the compilation unit hash.
-  void LoadDataFromIndex(const std::string &kindex_file_or_cu);
+  /// \param job The job to fill in.
+  void LoadDataFromIndex(const std::string &kindex_file_or_cu,
+                         IndexerJob *job) const;
   /// \brief Load data from an unpacked file.
   /// \param default_filename The filename to use if we're reading from stdin.
-  void LoadDataFromUnpackedFile(const std::string &default_filename);
+  /// \param job The job to fill in.
+  void LoadDataFromUnpackedFile(const std::string &default_filename,
+                                IndexerJob *job);
+  /// \brief Reads enough of a .kindex or index pack unit to predict its
+  /// cost.
+  JobCostModel::Features PeekJobFeatures(
+      const std::string &kindex_file_or_cu) const;
+  /// \brief Set up the store for a remote --index_pack (if it is remote).
+  void OpenRemoteIndexPack();
+  /// \brief Opens --index_pack for reading.
+  /// \return the filesystem, or null on failure with `error_text` set.
+  std::unique_ptr<IndexPackFilesystem> OpenIndexPack(
+      std::string *error_text) const;
+  /// \brief Open the index journal (if one was requested).
+  void OpenJournal();
+  /// \brief Set up the shared work queue (if one was requested).
+  void OpenWorkQueue();
+  /// \brief Set up the job cost model (if scheduling or a job history was
+  /// requested).
+  void OpenCostModel();
+  /// \brief Fills in `job_features_` and `job_predictions_`.
+  void PredictJobCosts();
+  /// \brief Open the file cache (if one was requested).
+  void OpenFileStore();
+  /// \brief Sets up `job_source_` to produce jobs for each input.
+  /// \param default_filename The filename to use if we're reading from stdin.
+  void OpenJobSource(const std::string &default_filename);
   /// \brief Initialize a claim client.
   void InitializeClaimClient();
-  /// \brief Normalize input file vnames by cleaning paths and clearing
-  /// signatures.
-  void NormalizeFileVNames();
+  /// \brief Create the buffer size tuner (if one was requested).
+  void OpenBufferSizeTuner();
   /// \brief Prepare to write to output.
   void OpenOutputStreams();
   /// \brief Flush output.
   void CloseOutputStreams();
   /// \brief Configure the hash cache (if one was requested).
   void OpenHashCache();
+  /// \brief Open the header fingerprint store (if one was requested).
+  void OpenHeaderFingerprints();
+  /// \brief Open the instantiation fingerprint store (if one was requested).
+  void OpenInstantiationFingerprints();
+  /// \brief Wrap the claim client and hash caches such that they may be used
+  /// from multiple threads.
+  void ShareResourcesBetweenWorkers();
 
   /// Command-line arguments, pruned of empty strings and gflags.
   std::vector<std::string> args_;
-  /// Indexer jobs to complete.
-  std::vector<IndexerJob> jobs_;
-  /// The file descriptor to which we're writing output.
-  int write_fd_ = -1;
-  /// Wraps `write_fd_`.
-  std::unique_ptr<google::protobuf::io::FileOutputStream> raw_output_;
-  /// Wraps `raw_output_`.
+  /// If non-null, keeps decompressed file content for jobs.
+  std::unique_ptr<MappedFileStore> file_store_;
+  /// See `shared_cxx_details()`.
+  SharedCxxDetailsCache shared_cxx_details_;
+  /// If non-null, reads and caches --index_pack, which is remote. Shared by
+  /// the filesystems opened for each job.
+  std::shared_ptr<RemoteBlobStore> remote_index_pack_;
+  /// The number of indexer jobs to complete.
+  size_t job_count_ = 0;
+  /// If non-null, predicts how long jobs will take.
+  std::unique_ptr<JobCostModel> cost_model_;
+  /// What was known about each job when its cost was predicted.
+  std::vector<JobCostModel::Features> job_features_;
+  /// The predicted cost of each job, in milliseconds.
+  std::vector<double> job_predictions_;
+  /// If non-null, records which jobs' output has been committed.
+  std::unique_ptr<IndexJournal> journal_;
+  /// If non-null, divides the inputs between this indexer and others.
+  std::unique_ptr<LeasedWorkQueue> work_queue_;
+  /// Produces indexer jobs to complete.
+  std::unique_ptr<PrefetchingJobSource> job_source_;
+  /// \brief An output file and the streams that write to it.
+  struct OutputFile {
+    /// The file descriptor to which we're writing output.
+    int fd = -1;
+    /// Wraps `fd`.
+    std::unique_ptr<google::protobuf::io::FileOutputStream> raw;
+    /// If non-null, compresses data before it's written to `raw`.
+    std::unique_ptr<SnappyFramedOutputStream> compressed;
+    /// If non-null, packs entries before they're written to `compressed`
+    /// (or `raw`).
+    std::unique_ptr<EntryPackOutputStream> packed;
+    /// The file descriptor for --experimental_delta_snapshot, or -1.
+    int snapshot_fd = -1;
+    /// If non-null, wraps `snapshot_fd`.
+    std::unique_ptr<google::protobuf::io::FileOutputStream> snapshot;
+    /// If non-null, writes the changes since --experimental_delta_base to
+    /// `compressed` (or `raw`) and copies entries to `snapshot`.
+    std::unique_ptr<DeltaOutputStream> delta;
+    /// If non-null, sorts entries before they're written to `delta` (or
+    /// `packed`, `compressed` or `raw`).
+    std::unique_ptr<SortingOutputStream> sorted;
+    /// \return the stream to which this file's entries should be written.
+    google::protobuf::io::ZeroCopyOutputStream *entries() const;
+  };
+  /// \brief Opens `path` ("-" for stdout) and the streams that write to it,
+  /// as the output flags specify. Exits on error.
+  /// \param resume_offset If not negative, keep this many bytes of the
+  /// existing file and write after them instead of truncating it.
+  static void OpenOutputFile(const std::string &path, OutputFile *file,
+                             int64_t resume_offset = -1);
+  /// \brief Flushes and closes `file`. Exits on error.
+  static void CloseOutputFile(OutputFile *file);
+
+  /// The files to which we're writing output: one, or one per shard.
+  std::vector<OutputFile> output_files_;
+  /// If non-null, splits entries between `output_files_`.
+  std::unique_ptr<ShardingOutputStream> sharded_output_;
+  /// If non-null, receives entries instead of `output_files_`.
+  std::unique_ptr<LevelDBOutputStream> leveldb_output_;
+  /// Forwards entries from `kythe_output_` to `leveldb_output_`.
+  std::unique_ptr<LevelDBEntrySink> leveldb_sink_;
+  /// The descriptor for --experimental_write_request_output, or -1.
+  int write_request_fd_ = -1;
+  /// Sends `graphstore_output_`'s requests to `write_request_fd_`.
+  std::unique_ptr<GraphStoreWriter> graphstore_writer_;
+  /// If non-null, receives entries as GraphStore `WriteRequest`s instead of
+  /// `output_files_`.
+  std::unique_ptr<GraphStoreWriteStream> graphstore_output_;
+  /// Holds entries from `kythe_output_` until they're forwarded to
+  /// `graphstore_output_`.
+  std::unique_ptr<ChunkedOutputStream> graphstore_buffer_;
+  /// If non-null, adapts the buffer sizes of `kythe_output_` and of the
+  /// workers' output streams.
+  std::unique_ptr<BufferSizeTuner> buffer_size_tuner_;
+  /// Writes to the only output file's `entries()` (or `sharded_output_`,
+  /// `leveldb_sink_` or `graphstore_buffer_`).
   std::unique_ptr<FileOutputStream> kythe_output_;
   /// The claim client to use during analysis.
   std::unique_ptr<kythe::KytheClaimClient> claim_client_;
+  /// The directory holding a claim shard for each unit, or empty.
+  std::string static_claim_shards_;
+  /// If non-null, the cache that `hash_cache_` consults on local misses.
+  std::unique_ptr<HashCache> remote_hash_cache_;
+  /// If non-null, the cache that `hash_cache_` records hashes from for
+  /// --experimental_hash_snapshot_out.
+  std::unique_ptr<HashCache> snapshotted_hash_cache_;
   /// The hash cache to use during analysis (or null).
   std::unique_ptr<HashCache> hash_cache_;
+  /// If non-null, `hash_cache_`, which records the hashes to snapshot.
+  SnapshotHashCache *hash_snapshot_ = nullptr;
+  /// If non-null, shares `hash_cache_` between workers.
+  std::unique_ptr<HashCache> shared_hash_cache_;
+  /// If non-null, `shared_hash_cache_`, of which workers get their own views.
+  ConcurrentHashCache *concurrent_hash_cache_ = nullptr;
+  /// Fingerprints of headers indexed by earlier runs (or null).
+  std::unique_ptr<HashCache> header_fingerprints_;
+  /// If non-null, serializes access to `header_fingerprints_` between workers.
+  std::unique_ptr<HashCache> shared_header_fingerprints_;
+  /// Fingerprints of implicit template instantiations indexed by earlier runs
+  /// (or null).
+  std::unique_ptr<HashCache> instantiation_fingerprints_;
+  /// If non-null, serializes access to `instantiation_fingerprints_` between
+  /// workers.
+  std::unique_ptr<HashCache> shared_instantiation_fingerprints_;
+  /// The number of jobs that may be indexed concurrently.
+  size_t worker_count_ = 1;
   /// Whether access to the local filesystem is allowed during analysis.
   bool allow_filesystem_access_ = false;
   /// Whether to ignore missing cases during analysis.
@@ -0,0 +1,245 @@
+/*
+ * Copyright 2017 Google Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "kythe/cxx/common/indexing/graphstore_write_stream.h"
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+#include "google/protobuf/io/coded_stream.h"
+#include "google/protobuf/io/zero_copy_stream_impl_lite.h"
+
+namespace kythe {
+namespace {
+/// \brief Appends a key for `vname` to `key` that differs whenever any of
+/// its fields do.
+void AppendVNameKey(const VNameRef &vname, std::string *key) {
+  const llvm::StringRef fields[] = {vname.signature, vname.corpus, vname.root,
+                                    vname.path, vname.language};
+  for (const auto &field : fields) {
+    key->append(std::to_string(field.size()));
+    key->push_back(':');
+    key->append(field.data(), field.size());
+  }
+}
+}  // anonymous namespace
+
+bool DelimitedWriteRequestWriter::Write(const proto::WriteRequest &request,
+                                        std::string *error_text) {
+  std::string data;
+  {
+    google::protobuf::io::StringOutputStream string_stream(&data);
+    google::protobuf::io::CodedOutputStream coded_stream(&string_stream);
+    coded_stream.WriteVarint32(request.ByteSize());
+    request.SerializeWithCachedSizes(&coded_stream);
+  }
+  std::lock_guard<std::mutex> lock(mutex_);
+  for (size_t written = 0; written < data.size();) {
+    ssize_t result =
+        ::write(fd_, data.data() + written, data.size() - written);
+    if (result < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      *error_text = std::string("write failed: ") + strerror(errno);
+      return false;
+    }
+    written += result;
+  }
+  return true;
+}
+
+GraphStoreWriteStream::GraphStoreWriteStream(GraphStoreWriter *writer,
+                                             size_t max_in_flight,
+                                             size_t batch_bytes)
+    : writer_(writer),
+      max_in_flight_(std::max<size_t>(max_in_flight, 1)),
+      batch_bytes_(batch_bytes) {
+  for (size_t i = 0; i < max_in_flight_; ++i) {
+    senders_.emplace_back([this] { SendRequests(); });
+  }
+}
+
+GraphStoreWriteStream::~GraphStoreWriteStream() {
+  std::string error_text;
+  Close(&error_text);
+}
+
+void GraphStoreWriteStream::SetError(const std::string &error) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (error_.empty()) {
+    error_ = error;
+  }
+}
+
+size_t GraphStoreWriteStream::requests_sent() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return requests_sent_;
+}
+
+void GraphStoreWriteStream::Add(const VNameRef &source,
+                                llvm::StringRef edge_kind,
+                                llvm::StringRef fact_name,
+                                const VNameRef *target,
+                                llvm::StringRef fact_value) {
+  key_.clear();
+  AppendVNameKey(source, &key_);
+  auto &request = pending_[key_];
+  if (!request.has_source()) {
+    source.Expand(request.mutable_source());
+    pending_bytes_ += key_.size();
+  }
+  auto *update = request.add_update();
+  update->set_edge_kind(edge_kind.data(), edge_kind.size());
+  update->set_fact_name(fact_name.data(), fact_name.size());
+  update->set_fact_value(fact_value.data(), fact_value.size());
+  size_t entry_bytes = edge_kind.size() + fact_name.size() + fact_value.size();
+  if (target != nullptr) {
+    target->Expand(update->mutable_target());
+    entry_bytes += target->signature.size() + target->corpus.size() +
+                   target->root.size() + target->path.size() +
+                   target->language.size();
+  }
+  pending_bytes_ += entry_bytes;
+  ++entries_written_;
+  if (accounting_ != nullptr) {
+    accounting_->Count(accounting_->category(), 1, entry_bytes);
+  }
+  if (pending_bytes_ >= batch_bytes_) {
+    Flush();
+  }
+}
+
+void GraphStoreWriteStream::Flush() {
+  for (auto &request : pending_) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    queue_not_full_.wait(lock,
+                         [this] { return queue_.size() < max_in_flight_; });
+    queue_.emplace_back();
+    queue_.back().Swap(&request.second);
+    lock.unlock();
+    queue_not_empty_.notify_one();
+  }
+  pending_.clear();
+  pending_bytes_ = 0;
+}
+
+void GraphStoreWriteStream::SendRequests() {
+  proto::WriteRequest request;
+  std::string error_text;
+  for (;;) {
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      queue_not_empty_.wait(lock,
+                            [this] { return closing_ || !queue_.empty(); });
+      if (queue_.empty()) {
+        return;
+      }
+      request.Swap(&queue_.front());
+      queue_.pop_front();
+      if (!error_.empty()) {
+        // Once a request has failed, the output is incomplete anyway; don't
+        // keep the indexer waiting on a broken GraphStore.
+        lock.unlock();
+        queue_not_full_.notify_one();
+        continue;
+      }
+    }
+    queue_not_full_.notify_one();
+    bool ok = writer_->Write(request, &error_text);
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (ok) {
+      ++requests_sent_;
+    } else if (error_.empty()) {
+      error_ = error_text;
+    }
+  }
+}
+
+void GraphStoreWriteStream::Emit(const FactRef &fact) {
+  Add(*fact.source, "", fact.fact_name, nullptr, fact.fact_value);
+}
+
+void GraphStoreWriteStream::Emit(const EdgeRef &edge) {
+  Add(*edge.source, edge.edge_kind, "/", edge.target, "");
+}
+
+void GraphStoreWriteStream::Emit(const OrdinalEdgeRef &edge) {
+  edge_kind_.assign(edge.edge_kind.data(), edge.edge_kind.size());
+  edge_kind_.push_back('.');
+  edge_kind_.append(std::to_string(edge.ordinal));
+  Add(*edge.source, edge_kind_, "/", edge.target, "");
+}
+
+void GraphStoreWriteStream::ForwardFrom(ChunkedOutputStream *entries) {
+  proto::Entry entry;
+  std::vector<llvm::StringRef> slices;
+  for (;;) {
+    uint32_t entry_size;
+    size_t header_size;
+    if (!entries->ReadVarint32(0, &entry_size, &header_size) ||
+        entries->size() - header_size < entry_size) {
+      break;
+    }
+    slices.clear();
+    entries->Slices(header_size, header_size + entry_size, &slices);
+    llvm::StringRef data;
+    if (slices.size() == 1) {
+      data = slices[0];
+    } else {
+      entry_buffer_.clear();
+      for (const auto &slice : slices) {
+        entry_buffer_.append(slice.data(), slice.size());
+      }
+      data = entry_buffer_;
+    }
+    if (!entry.ParseFromArray(data.data(), data.size())) {
+      SetError("Malformed entry");
+    } else {
+      VNameRef source(entry.source());
+      VNameRef target(entry.target());
+      Add(source, entry.edge_kind(), entry.fact_name(),
+          entry.has_target() ? &target : nullptr, entry.fact_value());
+    }
+    entries->Consume(header_size + entry_size);
+  }
+}
+
+bool GraphStoreWriteStream::Close(std::string *error_text) {
+  if (!senders_.empty()) {
+    Flush();
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      closing_ = true;
+    }
+    queue_not_empty_.notify_all();
+    for (auto &sender : senders_) {
+      sender.join();
+    }
+    senders_.clear();
+  }
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (!error_.empty()) {
+    *error_text = error_;
+    return false;
+  }
+  return true;
+}
+
+}  // namespace kythe
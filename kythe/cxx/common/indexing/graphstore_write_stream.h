@@ -0,0 +1,163 @@
+/*
+ * Copyright 2017 Google Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef KYTHE_CXX_COMMON_INDEXING_GRAPHSTORE_WRITE_STREAM_H_
+#define KYTHE_CXX_COMMON_INDEXING_GRAPHSTORE_WRITE_STREAM_H_
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "kythe/cxx/common/indexing/KytheOutputStream.h"
+#include "kythe/cxx/common/indexing/chunked_output_stream.h"
+#include "kythe/proto/storage.pb.h"
+#include "llvm/ADT/StringRef.h"
+
+namespace kythe {
+
+/// \brief Sends `WriteRequest`s to a GraphStore (see `GraphStore.Write` in
+/// kythe/proto/storage_service.proto).
+class GraphStoreWriter {
+ public:
+  virtual ~GraphStoreWriter() {}
+
+  /// \brief Sends `request` and waits until it has been accepted.
+  /// May be called from several threads at once.
+  /// \param error_text Set to a description of the problem on failure.
+  /// \return true on success.
+  virtual bool Write(const proto::WriteRequest &request,
+                     std::string *error_text) = 0;
+};
+
+/// \brief A `GraphStoreWriter` that writes each request as a varint-delimited
+/// message to a file descriptor (such as a pipe to a loader).
+class DelimitedWriteRequestWriter : public GraphStoreWriter {
+ public:
+  /// \param fd The descriptor to write to. Not owned.
+  explicit DelimitedWriteRequestWriter(int fd) : fd_(fd) {}
+
+  bool Write(const proto::WriteRequest &request,
+             std::string *error_text) override;
+
+ private:
+  /// The descriptor to write to.
+  int fd_;
+  /// Keeps requests from different threads from interleaving.
+  std::mutex mutex_;
+};
+
+/// \brief A `KytheOutputStream` that sends entries to a GraphStore as
+/// `WriteRequest`s.
+///
+/// Entries are collected until `batch_bytes` of them are pending; then one
+/// request is made for each source VName among them and those requests are
+/// sent by `max_in_flight` threads. Once `max_in_flight` requests are also
+/// waiting to be sent, emitting blocks until a sender catches up. Requests
+/// may be applied in any order, which is fine for a GraphStore: writing an
+/// entry only ever replaces a value with the same one. Emitting isn't
+/// thread-safe.
+class GraphStoreWriteStream : public KytheOutputStream {
+ public:
+  /// \param writer Sends requests. Not owned.
+  /// \param max_in_flight How many requests may be sent at once.
+  /// \param batch_bytes Make requests once this many bytes of names and
+  /// values are pending.
+  explicit GraphStoreWriteStream(GraphStoreWriter *writer,
+                                 size_t max_in_flight = 4,
+                                 size_t batch_bytes = 1 << 20);
+
+  /// \brief Sends any pending entries and waits for the senders to finish.
+  ~GraphStoreWriteStream() override;
+
+  void Emit(const FactRef &fact) override;
+  void Emit(const EdgeRef &edge) override;
+  void Emit(const OrdinalEdgeRef &edge) override;
+
+  /// \brief Emits and consumes the complete entries at the front of
+  /// `entries`, a sequence of varint-delimited wire-format `Entry` messages
+  /// (such as the output of a `FileOutputStream`). A trailing partial entry
+  /// is left in `entries`.
+  void ForwardFrom(ChunkedOutputStream *entries);
+
+  /// \brief Sends any pending entries and waits for the senders to finish.
+  /// \return false if any request failed or any entry was malformed;
+  /// `error_text` will describe the first problem.
+  bool Close(std::string *error_text);
+
+  /// \return the number of entries emitted so far.
+  size_t entries_written() const { return entries_written_; }
+
+  /// \return the number of requests sent successfully so far.
+  size_t requests_sent() const;
+
+ private:
+  /// \brief Adds an update from `source` to the pending requests.
+  void Add(const VNameRef &source, llvm::StringRef edge_kind,
+           llvm::StringRef fact_name, const VNameRef *target,
+           llvm::StringRef fact_value);
+
+  /// \brief Queues the pending requests, blocking while the queue is full.
+  void Flush();
+
+  /// \brief Sends queued requests until the stream is closed.
+  void SendRequests();
+
+  /// \brief Records `error` if it is the first problem.
+  void SetError(const std::string &error);
+
+  /// Sends requests.
+  GraphStoreWriter *writer_;
+  /// How many requests may be sent (or queued) at once.
+  const size_t max_in_flight_;
+  /// The number of pending bytes at which to make requests.
+  const size_t batch_bytes_;
+  /// Requests that haven't been queued yet, keyed by encoded source VName.
+  std::unordered_map<std::string, proto::WriteRequest> pending_;
+  /// The size of the names and values in `pending_`.
+  size_t pending_bytes_ = 0;
+  /// Scratch space for source VName keys.
+  std::string key_;
+  /// Scratch space for edge kinds with ordinals.
+  std::string edge_kind_;
+  /// Scratch space for entries that span chunks in `ForwardFrom`.
+  std::string entry_buffer_;
+  /// The number of entries emitted.
+  size_t entries_written_ = 0;
+  /// Guards the fields below.
+  mutable std::mutex mutex_;
+  /// Signalled when `queue_` shrinks.
+  std::condition_variable queue_not_full_;
+  /// Signalled when `queue_` grows or the stream closes.
+  std::condition_variable queue_not_empty_;
+  /// Requests waiting for a sender.
+  std::deque<proto::WriteRequest> queue_;
+  /// Set once senders should exit after draining `queue_`.
+  bool closing_ = false;
+  /// The first error encountered, if any.
+  std::string error_;
+  /// The number of requests sent successfully.
+  size_t requests_sent_ = 0;
+  /// The sender threads.
+  std::vector<std::thread> senders_;
+};
+
+}  // namespace kythe
+
+#endif  // KYTHE_CXX_COMMON_INDEXING_GRAPHSTORE_WRITE_STREAM_H_
@@ -0,0 +1,197 @@
+/*
+ * Copyright 2017 Google Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "kythe/cxx/common/indexing/graphstore_write_stream.h"
+
+#include <unistd.h>
+
+#include <algorithm>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "google/protobuf/io/coded_stream.h"
+#include "gtest/gtest.h"
+
+namespace kythe {
+namespace {
+
+/// \brief A `GraphStoreWriter` that remembers the requests sent to it.
+class RecordingWriter : public GraphStoreWriter {
+ public:
+  bool Write(const proto::WriteRequest &request,
+             std::string *error_text) override {
+    std::unique_lock<std::mutex> lock(mutex_);
+    ++active_;
+    max_active_ = std::max(max_active_, active_);
+    // Give other senders a chance to overlap with this one.
+    lock.unlock();
+    std::this_thread::yield();
+    lock.lock();
+    --active_;
+    requests_.push_back(request);
+    if (fail_) {
+      *error_text = "unavailable";
+      return false;
+    }
+    return true;
+  }
+
+  /// \return the number of updates sent for each source signature.
+  std::map<std::string, size_t> UpdatesBySource() {
+    std::map<std::string, size_t> result;
+    for (const auto &request : requests_) {
+      result[request.source().signature()] += request.update_size();
+    }
+    return result;
+  }
+
+  std::mutex mutex_;
+  std::vector<proto::WriteRequest> requests_;
+  size_t active_ = 0;
+  size_t max_active_ = 0;
+  bool fail_ = false;
+};
+
+TEST(GraphStoreWriteStream, GroupsEntriesBySource) {
+  RecordingWriter writer;
+  GraphStoreWriteStream stream(&writer);
+  VNameRef one, two;
+  one.signature = "one";
+  two.signature = "two";
+  stream.Emit(FactRef{&one, "/kythe/node/kind", "function"});
+  stream.Emit(EdgeRef{&two, "/kythe/edge/ref", &one});
+  stream.Emit(OrdinalEdgeRef{&one, "/kythe/edge/param", &two, 1});
+  std::string error_text;
+  ASSERT_TRUE(stream.Close(&error_text)) << error_text;
+  EXPECT_EQ(3, stream.entries_written());
+  EXPECT_EQ(2, stream.requests_sent());
+  ASSERT_EQ(2, writer.requests_.size());
+  for (const auto &request : writer.requests_) {
+    if (request.source().signature() == "one") {
+      ASSERT_EQ(2, request.update_size());
+      EXPECT_EQ("/kythe/node/kind", request.update(0).fact_name());
+      EXPECT_EQ("function", request.update(0).fact_value());
+      EXPECT_FALSE(request.update(0).has_target());
+      EXPECT_EQ("/kythe/edge/param.1", request.update(1).edge_kind());
+      EXPECT_EQ("/", request.update(1).fact_name());
+      EXPECT_EQ("two", request.update(1).target().signature());
+    } else {
+      EXPECT_EQ("two", request.source().signature());
+      ASSERT_EQ(1, request.update_size());
+      EXPECT_EQ("/kythe/edge/ref", request.update(0).edge_kind());
+    }
+  }
+}
+
+TEST(GraphStoreWriteStream, BoundsRequestsInFlight) {
+  RecordingWriter writer;
+  // With a one-byte batch size, every entry becomes its own request.
+  GraphStoreWriteStream stream(&writer, 2, 1);
+  std::vector<std::string> signatures;
+  for (int i = 0; i < 100; ++i) {
+    signatures.push_back("node" + std::to_string(i));
+  }
+  for (const auto &signature : signatures) {
+    VNameRef node;
+    node.signature = signature;
+    stream.Emit(FactRef{&node, "/kythe/text", "text"});
+  }
+  std::string error_text;
+  ASSERT_TRUE(stream.Close(&error_text)) << error_text;
+  EXPECT_EQ(100, writer.requests_.size());
+  EXPECT_LE(writer.max_active_, 2);
+  EXPECT_EQ(100, writer.UpdatesBySource().size());
+}
+
+TEST(GraphStoreWriteStream, ForwardsDelimitedEntries) {
+  RecordingWriter writer;
+  GraphStoreWriteStream stream(&writer);
+  ChunkedOutputStream entries(16);
+  entries.set_drain(32, [&] { stream.ForwardFrom(&entries); });
+  {
+    FileOutputStream file_stream(&entries);
+    VNameRef node;
+    node.signature = "node";
+    for (int i = 0; i < 20; ++i) {
+      file_stream.Emit(FactRef{&node, "/kythe/text", "some text"});
+      file_stream.Emit(EdgeRef{&node, "/kythe/edge/ref", &node});
+    }
+  }
+  stream.ForwardFrom(&entries);
+  EXPECT_EQ(0, entries.size());
+  std::string error_text;
+  ASSERT_TRUE(stream.Close(&error_text)) << error_text;
+  auto updates = writer.UpdatesBySource();
+  ASSERT_EQ(1, updates.size());
+  EXPECT_EQ(40, updates["node"]);
+}
+
+TEST(GraphStoreWriteStream, ReportsFailedRequests) {
+  RecordingWriter writer;
+  writer.fail_ = true;
+  GraphStoreWriteStream stream(&writer);
+  VNameRef node;
+  node.signature = "node";
+  stream.Emit(FactRef{&node, "/kythe/text", "text"});
+  std::string error_text;
+  EXPECT_FALSE(stream.Close(&error_text));
+  EXPECT_EQ("unavailable", error_text);
+  EXPECT_EQ(0, stream.requests_sent());
+}
+
+TEST(DelimitedWriteRequestWriter, WritesDelimitedRequests) {
+  int fds[2];
+  ASSERT_EQ(0, ::pipe(fds));
+  DelimitedWriteRequestWriter writer(fds[1]);
+  proto::WriteRequest request;
+  request.mutable_source()->set_signature("node");
+  request.add_update()->set_fact_name("/kythe/text");
+  std::string error_text;
+  ASSERT_TRUE(writer.Write(request, &error_text)) << error_text;
+  ASSERT_TRUE(writer.Write(request, &error_text)) << error_text;
+  ::close(fds[1]);
+  std::string data;
+  char buffer[256];
+  ssize_t count;
+  while ((count = ::read(fds[0], buffer, sizeof(buffer))) > 0) {
+    data.append(buffer, count);
+  }
+  ::close(fds[0]);
+  google::protobuf::io::CodedInputStream input(
+      reinterpret_cast<const google::protobuf::uint8 *>(data.data()),
+      data.size());
+  for (int i = 0; i < 2; ++i) {
+    google::protobuf::uint32 size;
+    ASSERT_TRUE(input.ReadVarint32(&size));
+    auto limit = input.PushLimit(size);
+    proto::WriteRequest read;
+    ASSERT_TRUE(read.ParseFromCodedStream(&input));
+    input.PopLimit(limit);
+    EXPECT_EQ("node", read.source().signature());
+    EXPECT_EQ(1, read.update_size());
+  }
+  EXPECT_EQ(data.size(), input.CurrentPosition());
+}
+
+}  // namespace
+}  // namespace kythe
+
+int main(int argc, char **argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  int result = RUN_ALL_TESTS();
+  return result;
+}
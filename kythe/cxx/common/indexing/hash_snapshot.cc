@@ -0,0 +1,150 @@
+/*
+ * Copyright 2017 Google Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "kythe/cxx/common/indexing/hash_snapshot.h"
+
+#include <errno.h>
+#include <stdio.h>
+
+#include <algorithm>
+
+#include "llvm/Support/MemoryBuffer.h"
+
+namespace kythe {
+namespace {
+/// Starts every snapshot.
+constexpr char kSnapshotMagic[] = "kythehs1";
+constexpr size_t kMagicSize = sizeof(kSnapshotMagic) - 1;
+/// The magic is followed by the number of hashes as a little-endian uint64.
+constexpr size_t kHeaderSize = kMagicSize + 8;
+/// How many hashes to register at once while loading.
+constexpr size_t kLoadBatchSize = 1024;
+}  // anonymous namespace
+
+SnapshotHashCache::SnapshotHashCache(HashCache *cache) : cache_(cache) {
+  SetSizeLimits(cache->min_size(), cache->max_size());
+  set_average_chunk_size(cache->average_chunk_size());
+  set_batch_size(cache->batch_size());
+}
+
+void SnapshotHashCache::Remember(const Hash &hash) {
+  Key key;
+  ::memcpy(key.data(), hash, kHashSize);
+  hashes_.insert(key);
+}
+
+void SnapshotHashCache::RegisterHash(const Hash &hash) {
+  Remember(hash);
+  cache_->RegisterHash(hash);
+}
+
+bool SnapshotHashCache::SawHash(const Hash &hash) {
+  if (!cache_->SawHash(hash)) {
+    return false;
+  }
+  Remember(hash);
+  return true;
+}
+
+void SnapshotHashCache::SawHashes(const std::vector<const Hash *> &hashes,
+                                  std::vector<bool> *seen) {
+  cache_->SawHashes(hashes, seen);
+  for (size_t i = 0; i < hashes.size() && i < seen->size(); ++i) {
+    if ((*seen)[i]) {
+      Remember(*hashes[i]);
+    }
+  }
+}
+
+void SnapshotHashCache::RegisterHashes(
+    const std::vector<const Hash *> &hashes) {
+  for (const auto *hash : hashes) {
+    Remember(*hash);
+  }
+  cache_->RegisterHashes(hashes);
+}
+
+bool SnapshotHashCache::WriteSnapshot(const std::string &path,
+                                      std::string *error_text) const {
+  std::vector<Key> sorted(hashes_.begin(), hashes_.end());
+  std::sort(sorted.begin(), sorted.end());
+  std::string header(kSnapshotMagic, kMagicSize);
+  uint64_t count = sorted.size();
+  for (size_t byte = 0; byte < 8; ++byte) {
+    header.push_back(static_cast<char>(count >> (byte * 8)));
+  }
+  // Write to a temporary file first so a failed write doesn't clobber the
+  // previous snapshot.
+  std::string temp_path = path + ".tmp";
+  FILE *file = fopen(temp_path.c_str(), "wb");
+  if (file == nullptr) {
+    *error_text = "couldn't open " + temp_path + ": " + strerror(errno);
+    return false;
+  }
+  bool ok = fwrite(header.data(), header.size(), 1, file) == 1;
+  if (ok && !sorted.empty()) {
+    ok = fwrite(sorted.data(), kHashSize, sorted.size(), file) ==
+         sorted.size();
+  }
+  ok = fclose(file) == 0 && ok;
+  if (!ok || rename(temp_path.c_str(), path.c_str()) != 0) {
+    *error_text = "couldn't write " + path + ": " + strerror(errno);
+    remove(temp_path.c_str());
+    return false;
+  }
+  return true;
+}
+
+bool LoadHashSnapshot(const std::string &path, HashCache *cache,
+                      size_t *count, std::string *error_text) {
+  auto buffer = llvm::MemoryBuffer::getFile(path);
+  if (!buffer) {
+    *error_text = "couldn't read " + path + ": " + buffer.getError().message();
+    return false;
+  }
+  llvm::StringRef data = (*buffer)->getBuffer();
+  if (data.size() < kHeaderSize ||
+      data.substr(0, kMagicSize) != llvm::StringRef(kSnapshotMagic)) {
+    *error_text = path + " isn't a hash snapshot";
+    return false;
+  }
+  uint64_t hash_count = 0;
+  for (size_t byte = 0; byte < 8; ++byte) {
+    uint64_t value = static_cast<unsigned char>(data[kMagicSize + byte]);
+    hash_count |= value << (byte * 8);
+  }
+  data = data.substr(kHeaderSize);
+  if (data.size() / HashCache::kHashSize != hash_count ||
+      data.size() % HashCache::kHashSize != 0) {
+    *error_text = path + " is truncated";
+    return false;
+  }
+  const auto *hashes = reinterpret_cast<const HashCache::Hash *>(data.data());
+  std::vector<const HashCache::Hash *> batch;
+  for (uint64_t i = 0; i < hash_count; ++i) {
+    batch.push_back(&hashes[i]);
+    if (batch.size() == kLoadBatchSize || i + 1 == hash_count) {
+      cache->RegisterHashes(batch);
+      batch.clear();
+    }
+  }
+  if (count != nullptr) {
+    *count = hash_count;
+  }
+  return true;
+}
+
+}  // namespace kythe
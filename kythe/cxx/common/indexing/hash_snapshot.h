@@ -0,0 +1,92 @@
+/*
+ * Copyright 2017 Google Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef KYTHE_CXX_COMMON_INDEXING_HASH_SNAPSHOT_H_
+#define KYTHE_CXX_COMMON_INDEXING_HASH_SNAPSHOT_H_
+
+#include <string.h>
+
+#include <array>
+#include <string>
+#include <unordered_set>
+#include <vector>
+
+#include "kythe/cxx/common/indexing/KytheOutputStream.h"
+
+namespace kythe {
+
+/// \brief A `HashCache` that passes everything through to another cache and
+/// remembers every hash that was registered or found to have been seen, so
+/// that they can be written to a snapshot.
+///
+/// A snapshot lets a cache that has been emptied (by a restart, or by moving
+/// to a new cluster) be warmed with the state an earlier run left behind.
+/// Snapshots hold each hash once, in sorted order, after a small header.
+/// Not thread-safe.
+class SnapshotHashCache : public HashCache {
+ public:
+  /// \param cache The cache to wrap. Must outlive this object.
+  explicit SnapshotHashCache(HashCache *cache);
+
+  void RegisterHash(const Hash &hash) override;
+
+  bool SawHash(const Hash &hash) override;
+
+  void SawHashes(const std::vector<const Hash *> &hashes,
+                 std::vector<bool> *seen) override;
+
+  void RegisterHashes(const std::vector<const Hash *> &hashes) override;
+
+  Stats stats() const override { return cache_->stats(); }
+
+  /// \return the number of distinct hashes that would be written.
+  size_t size() const { return hashes_.size(); }
+
+  /// \brief Writes the hashes seen so far to a snapshot at `path`.
+  /// \param error_text Set to an error description on failure.
+  /// \return false on failure.
+  bool WriteSnapshot(const std::string &path, std::string *error_text) const;
+
+ private:
+  using Key = std::array<unsigned char, kHashSize>;
+  struct KeyHash {
+    size_t operator()(const Key &key) const {
+      // The key is already a cryptographic hash.
+      size_t result;
+      ::memcpy(&result, key.data(), sizeof(result));
+      return result;
+    }
+  };
+  /// \brief Remembers `hash`.
+  void Remember(const Hash &hash);
+
+  /// The wrapped cache.
+  HashCache *cache_;
+  /// Every hash registered with or seen by `cache_`.
+  std::unordered_set<Key, KeyHash> hashes_;
+};
+
+/// \brief Registers every hash in the snapshot at `path` with `cache`, a
+/// batch at a time (so that a `MemcachedHashCache` pipelines its adds).
+/// \param count Set to the number of hashes loaded (if not null).
+/// \param error_text Set to an error description on failure.
+/// \return false on failure; some hashes may have been loaded.
+bool LoadHashSnapshot(const std::string &path, HashCache *cache,
+                      size_t *count, std::string *error_text);
+
+}  // namespace kythe
+
+#endif  // KYTHE_CXX_COMMON_INDEXING_HASH_SNAPSHOT_H_
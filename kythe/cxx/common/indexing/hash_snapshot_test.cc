@@ -0,0 +1,147 @@
+/*
+ * Copyright 2017 Google Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "kythe/cxx/common/indexing/hash_snapshot.h"
+
+#include <stdio.h>
+#include <unistd.h>
+
+#include <set>
+
+#include "gtest/gtest.h"
+#include "llvm/ADT/SmallString.h"
+#include "llvm/Support/FileSystem.h"
+
+namespace kythe {
+namespace {
+
+/// \brief A `HashCache` that remembers every hash registered with it.
+class SetHashCache : public HashCache {
+ public:
+  void RegisterHash(const Hash &hash) override {
+    hashes_.insert(std::string(reinterpret_cast<const char *>(hash),
+                               kHashSize));
+    ++registrations_;
+  }
+  bool SawHash(const Hash &hash) override {
+    return hashes_.count(std::string(reinterpret_cast<const char *>(hash),
+                                     kHashSize)) != 0;
+  }
+  void RegisterHashes(const std::vector<const Hash *> &hashes) override {
+    ++batches_;
+    HashCache::RegisterHashes(hashes);
+  }
+  std::set<std::string> hashes_;
+  size_t registrations_ = 0;
+  size_t batches_ = 0;
+};
+
+/// \brief Fills `hash` with `value`.
+void MakeHash(unsigned char value, HashCache::Hash *hash) {
+  memset(*hash, value, HashCache::kHashSize);
+}
+
+class HashSnapshotTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    int fd;
+    llvm::SmallString<256> path;
+    ASSERT_FALSE(
+        llvm::sys::fs::createTemporaryFile("hashes", "snapshot", fd, path));
+    close(fd);
+    path_ = std::string(path.data(), path.size());
+  }
+  void TearDown() override { llvm::sys::fs::remove(path_); }
+
+  std::string path_;
+};
+
+TEST_F(HashSnapshotTest, RoundTripsRegisteredAndSeenHashes) {
+  HashCache::Hash one, two, three;
+  MakeHash(1, &one);
+  MakeHash(2, &two);
+  MakeHash(3, &three);
+  SetHashCache remote;
+  remote.RegisterHash(three);
+  SnapshotHashCache snapshot(&remote);
+  snapshot.RegisterHash(two);
+  snapshot.RegisterHashes({&one, &two});
+  EXPECT_TRUE(snapshot.SawHash(three));
+  EXPECT_EQ(3, snapshot.size());
+  std::string error_text;
+  ASSERT_TRUE(snapshot.WriteSnapshot(path_, &error_text)) << error_text;
+
+  SetHashCache fresh;
+  size_t count = 0;
+  ASSERT_TRUE(LoadHashSnapshot(path_, &fresh, &count, &error_text))
+      << error_text;
+  EXPECT_EQ(3, count);
+  EXPECT_TRUE(fresh.SawHash(one));
+  EXPECT_TRUE(fresh.SawHash(two));
+  EXPECT_TRUE(fresh.SawHash(three));
+}
+
+TEST_F(HashSnapshotTest, MissesAreNotRemembered) {
+  HashCache::Hash one;
+  MakeHash(1, &one);
+  SetHashCache remote;
+  SnapshotHashCache snapshot(&remote);
+  std::vector<bool> seen;
+  snapshot.SawHashes({&one}, &seen);
+  EXPECT_FALSE(snapshot.SawHash(one));
+  EXPECT_EQ(0, snapshot.size());
+}
+
+TEST_F(HashSnapshotTest, LoadsInBatches) {
+  SetHashCache remote;
+  SnapshotHashCache snapshot(&remote);
+  for (unsigned value = 0; value < 2000; ++value) {
+    HashCache::Hash hash = {};
+    hash[0] = value & 0xff;
+    hash[1] = value >> 8;
+    snapshot.RegisterHash(hash);
+  }
+  std::string error_text;
+  ASSERT_TRUE(snapshot.WriteSnapshot(path_, &error_text)) << error_text;
+  SetHashCache fresh;
+  size_t count = 0;
+  ASSERT_TRUE(LoadHashSnapshot(path_, &fresh, &count, &error_text))
+      << error_text;
+  EXPECT_EQ(2000, count);
+  EXPECT_EQ(2000, fresh.hashes_.size());
+  EXPECT_EQ(2, fresh.batches_);
+}
+
+TEST_F(HashSnapshotTest, RejectsOtherFiles) {
+  FILE *file = fopen(path_.c_str(), "w");
+  ASSERT_NE(nullptr, file);
+  fputs("not a snapshot", file);
+  fclose(file);
+  SetHashCache cache;
+  std::string error_text;
+  EXPECT_FALSE(LoadHashSnapshot(path_, &cache, nullptr, &error_text));
+  EXPECT_FALSE(error_text.empty());
+  EXPECT_EQ(0, cache.registrations_);
+}
+
+}  // namespace
+}  // namespace kythe
+
+int main(int argc, char **argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  int result = RUN_ALL_TESTS();
+  return result;
+}
@@ -0,0 +1,111 @@
+/*
+ * Copyright 2017 Google Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "kythe/cxx/common/indexing/index_journal.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "llvm/ADT/StringRef.h"
+
+namespace kythe {
+
+std::unique_ptr<IndexJournal> IndexJournal::Open(const std::string &path,
+                                                 std::string *error_text) {
+  int fd = ::open(path.c_str(), O_RDWR | O_CREAT,
+                  S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+  if (fd < 0) {
+    *error_text = "couldn't open " + path + ": " + strerror(errno);
+    return nullptr;
+  }
+  std::unique_ptr<IndexJournal> journal(new IndexJournal(fd));
+  std::string contents;
+  char buffer[64 * 1024];
+  for (;;) {
+    ssize_t count = ::read(fd, buffer, sizeof(buffer));
+    if (count < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      *error_text = "couldn't read " + path + ": " + strerror(errno);
+      return nullptr;
+    }
+    if (count == 0) {
+      break;
+    }
+    contents.append(buffer, count);
+  }
+  llvm::StringRef rest(contents);
+  size_t kept = 0;
+  for (size_t end; (end = rest.find('\n')) != llvm::StringRef::npos;) {
+    llvm::StringRef line = rest.substr(0, end);
+    rest = rest.substr(end + 1);
+    auto fields = line.split(' ');
+    uint64_t offset;
+    if (fields.second.empty() || fields.first.getAsInteger(10, offset)) {
+      *error_text = path + " has a malformed record: " + line.str();
+      return nullptr;
+    }
+    journal->committed_.insert(fields.second.str());
+    journal->committed_offset_ = offset;
+    kept += line.size() + 1;
+  }
+  // Drop a record that was torn by a crash so later ones start on a line.
+  if (kept != contents.size() &&
+      (::ftruncate(fd, kept) != 0 || ::lseek(fd, kept, SEEK_SET) < 0)) {
+    *error_text = "couldn't truncate " + path + ": " + strerror(errno);
+    return nullptr;
+  }
+  return journal;
+}
+
+IndexJournal::~IndexJournal() { ::close(fd_); }
+
+bool IndexJournal::Commit(const std::string &unit, uint64_t offset,
+                          std::string *error_text) {
+  if (unit.empty() || unit.find('\n') != std::string::npos) {
+    *error_text = "can't record unit name \"" + unit + "\"";
+    return false;
+  }
+  std::string record = std::to_string(offset) + " " + unit + "\n";
+  const char *data = record.data();
+  size_t size = record.size();
+  while (size > 0) {
+    ssize_t written = ::write(fd_, data, size);
+    if (written < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      *error_text = std::string("couldn't write the journal: ") +
+                    strerror(errno);
+      return false;
+    }
+    data += written;
+    size -= written;
+  }
+  if (::fdatasync(fd_) != 0) {
+    *error_text = std::string("couldn't sync the journal: ") + strerror(errno);
+    return false;
+  }
+  committed_.insert(unit);
+  committed_offset_ = offset;
+  return true;
+}
+
+}  // namespace kythe
@@ -0,0 +1,76 @@
+/*
+ * Copyright 2017 Google Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef KYTHE_CXX_COMMON_INDEXING_INDEX_JOURNAL_H_
+#define KYTHE_CXX_COMMON_INDEXING_INDEX_JOURNAL_H_
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <unordered_set>
+
+namespace kythe {
+
+/// \brief Records which units of a run have had their output committed, so
+/// that a run that died can pick up where it left off.
+///
+/// The journal is a text file with one line per committed unit: the size of
+/// the output file once the unit's entries were written and synced, then a
+/// space, then the unit's name. Each line is synced before `Commit` returns.
+/// A partial last line (from a crash in the middle of a commit) is dropped
+/// when the journal is opened. Not thread-safe.
+class IndexJournal {
+ public:
+  /// \brief Opens (creating if necessary) the journal at `path`.
+  /// \param error_text Set to an error description on failure.
+  /// \return the journal, or null on failure.
+  static std::unique_ptr<IndexJournal> Open(const std::string &path,
+                                            std::string *error_text);
+  ~IndexJournal();
+
+  /// \return true if `unit` has been committed.
+  bool IsCommitted(const std::string &unit) const {
+    return committed_.count(unit) != 0;
+  }
+
+  /// \return the number of units that have been committed.
+  size_t committed_count() const { return committed_.size(); }
+
+  /// \return the size the output file had when the last unit was committed
+  /// (0 if none has been). Anything after this point may be torn.
+  uint64_t committed_offset() const { return committed_offset_; }
+
+  /// \brief Durably records that `unit`'s output has been written and that
+  /// the output file is `offset` bytes long.
+  /// \param error_text Set to an error description on failure.
+  /// \return false on failure.
+  bool Commit(const std::string &unit, uint64_t offset,
+              std::string *error_text);
+
+ private:
+  explicit IndexJournal(int fd) : fd_(fd) {}
+
+  /// The journal file.
+  int fd_;
+  /// The names of the units that have been committed.
+  std::unordered_set<std::string> committed_;
+  /// The output size recorded by the last commit.
+  uint64_t committed_offset_ = 0;
+};
+
+}  // namespace kythe
+
+#endif  // KYTHE_CXX_COMMON_INDEXING_INDEX_JOURNAL_H_
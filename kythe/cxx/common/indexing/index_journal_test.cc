@@ -0,0 +1,122 @@
+/*
+ * Copyright 2017 Google Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "kythe/cxx/common/indexing/index_journal.h"
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "gtest/gtest.h"
+
+namespace kythe {
+namespace {
+
+class IndexJournalTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    const char *tmpdir = getenv("TEST_TMPDIR");
+    std::string pattern =
+        std::string(tmpdir != nullptr ? tmpdir : "/tmp") + "/journalXXXXXX";
+    int fd = mkstemp(&pattern[0]);
+    ASSERT_GE(fd, 0);
+    close(fd);
+    path_ = pattern;
+  }
+  void TearDown() override { unlink(path_.c_str()); }
+
+  /// \brief Appends `data` to the journal file.
+  void Append(const std::string &data) {
+    int fd = open(path_.c_str(), O_WRONLY | O_APPEND);
+    ASSERT_GE(fd, 0);
+    ASSERT_EQ(data.size(), write(fd, data.data(), data.size()));
+    close(fd);
+  }
+
+  std::string path_;
+};
+
+TEST_F(IndexJournalTest, StartsEmpty) {
+  std::string error_text;
+  auto journal = IndexJournal::Open(path_, &error_text);
+  ASSERT_TRUE(journal) << error_text;
+  EXPECT_EQ(0, journal->committed_count());
+  EXPECT_EQ(0, journal->committed_offset());
+  EXPECT_FALSE(journal->IsCommitted("a.kindex"));
+}
+
+TEST_F(IndexJournalTest, RemembersCommits) {
+  std::string error_text;
+  {
+    auto journal = IndexJournal::Open(path_, &error_text);
+    ASSERT_TRUE(journal) << error_text;
+    ASSERT_TRUE(journal->Commit("a.kindex", 100, &error_text)) << error_text;
+    ASSERT_TRUE(journal->Commit("dir/b c.kindex", 250, &error_text))
+        << error_text;
+    EXPECT_TRUE(journal->IsCommitted("a.kindex"));
+    EXPECT_EQ(250, journal->committed_offset());
+  }
+  auto journal = IndexJournal::Open(path_, &error_text);
+  ASSERT_TRUE(journal) << error_text;
+  EXPECT_EQ(2, journal->committed_count());
+  EXPECT_TRUE(journal->IsCommitted("a.kindex"));
+  EXPECT_TRUE(journal->IsCommitted("dir/b c.kindex"));
+  EXPECT_FALSE(journal->IsCommitted("c.kindex"));
+  EXPECT_EQ(250, journal->committed_offset());
+}
+
+TEST_F(IndexJournalTest, DropsTornRecord) {
+  Append("100 a.kindex\n250 b.ki");
+  std::string error_text;
+  {
+    auto journal = IndexJournal::Open(path_, &error_text);
+    ASSERT_TRUE(journal) << error_text;
+    EXPECT_EQ(1, journal->committed_count());
+    EXPECT_FALSE(journal->IsCommitted("b.ki"));
+    EXPECT_EQ(100, journal->committed_offset());
+    ASSERT_TRUE(journal->Commit("c.kindex", 300, &error_text)) << error_text;
+  }
+  auto journal = IndexJournal::Open(path_, &error_text);
+  ASSERT_TRUE(journal) << error_text;
+  EXPECT_EQ(2, journal->committed_count());
+  EXPECT_TRUE(journal->IsCommitted("c.kindex"));
+  EXPECT_EQ(300, journal->committed_offset());
+}
+
+TEST_F(IndexJournalTest, RejectsMalformedRecords) {
+  Append("a.kindex\n");
+  std::string error_text;
+  EXPECT_FALSE(IndexJournal::Open(path_, &error_text));
+  EXPECT_FALSE(error_text.empty());
+}
+
+TEST_F(IndexJournalTest, RejectsUnrecordableNames) {
+  std::string error_text;
+  auto journal = IndexJournal::Open(path_, &error_text);
+  ASSERT_TRUE(journal) << error_text;
+  EXPECT_FALSE(journal->Commit("a\nb", 10, &error_text));
+  EXPECT_FALSE(journal->Commit("", 10, &error_text));
+  EXPECT_EQ(0, journal->committed_count());
+}
+
+}  // namespace
+}  // namespace kythe
+
+int main(int argc, char **argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  int result = RUN_ALL_TESTS();
+  return result;
+}
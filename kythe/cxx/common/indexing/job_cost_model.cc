@@ -0,0 +1,172 @@
+/*
+ * Copyright 2017 Google Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "kythe/cxx/common/indexing/job_cost_model.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <numeric>
+#include <sstream>
+
+namespace kythe {
+namespace {
+/// One required input is worth this many bytes of input when weighing units.
+constexpr double kBytesPerInput = 16384;
+/// One required input is worth about this many claimed tokens.
+constexpr double kTokensPerInput = 2048;
+/// The indexer does much less for a token in a file it doesn't claim.
+constexpr double kUnclaimedTokenWeight = 0.25;
+}  // anonymous namespace
+
+double JobCostModel::Weight(const Features &features) {
+  if (features.claimed_tokens != 0 || features.unclaimed_tokens != 0) {
+    return (features.claimed_tokens +
+            features.unclaimed_tokens * kUnclaimedTokenWeight) /
+           kTokensPerInput;
+  }
+  return features.inputs + features.bytes / kBytesPerInput;
+}
+
+bool JobCostModel::LoadHistory(const std::string &path,
+                               std::string *error_text) {
+  std::ifstream input(path);
+  if (!input) {
+    if (errno == ENOENT) {
+      return true;
+    }
+    *error_text = "Couldn't open " + path + ": " + std::strerror(errno);
+    return false;
+  }
+  // Each line is "millis\tinputs\tbytes\tkey".
+  std::string line;
+  size_t line_number = 0;
+  std::lock_guard<std::mutex> lock(mutex_);
+  while (std::getline(input, line)) {
+    ++line_number;
+    if (line.empty()) {
+      continue;
+    }
+    std::istringstream fields(line);
+    Sample sample;
+    std::string key;
+    if (!(fields >> sample.millis >> sample.features.inputs >>
+          sample.features.bytes) ||
+        fields.get() != '\t' || !std::getline(fields, key) || key.empty()) {
+      *error_text = path + ":" + std::to_string(line_number) + ": bad sample";
+      return false;
+    }
+    history_[key] = sample;
+  }
+  return true;
+}
+
+bool JobCostModel::SaveHistory(const std::string &path,
+                               std::string *error_text) const {
+  std::ofstream output(path, std::ios::trunc);
+  std::lock_guard<std::mutex> lock(mutex_);
+  for (const auto &entry : history_) {
+    output << entry.second.millis << '\t' << entry.second.features.inputs
+           << '\t' << entry.second.features.bytes << '\t' << entry.first
+           << '\n';
+  }
+  output.close();
+  if (!output) {
+    *error_text = "Couldn't write " + path;
+    return false;
+  }
+  return true;
+}
+
+bool JobCostModel::LoadProbes(const std::string &path,
+                              std::string *error_text) {
+  std::ifstream input(path);
+  if (!input) {
+    *error_text = "Couldn't open " + path + ": " + std::strerror(errno);
+    return false;
+  }
+  // Unit lines are "unit\tclaimed\tunclaimed\tmacro_expansions\tkey".
+  std::map<std::string, std::pair<uint64_t, uint64_t>> probes;
+  std::string line;
+  size_t line_number = 0;
+  while (std::getline(input, line)) {
+    ++line_number;
+    if (line.compare(0, 5, "unit\t") != 0) {
+      continue;
+    }
+    std::istringstream fields(line.substr(5));
+    uint64_t claimed, unclaimed, expansions;
+    std::string key;
+    if (!(fields >> claimed >> unclaimed >> expansions) ||
+        fields.get() != '\t' || !std::getline(fields, key) || key.empty()) {
+      *error_text = path + ":" + std::to_string(line_number) + ": bad probe";
+      return false;
+    }
+    probes[key] = std::make_pair(claimed, unclaimed);
+  }
+  std::lock_guard<std::mutex> lock(mutex_);
+  probes_.swap(probes);
+  return true;
+}
+
+void JobCostModel::ApplyProbe(const std::string &key,
+                              Features *features) const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto found = probes_.find(key);
+  if (found != probes_.end()) {
+    features->claimed_tokens = found->second.first;
+    features->unclaimed_tokens = found->second.second;
+  }
+}
+
+double JobCostModel::Predict(const std::string &key,
+                             const Features &features) const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto found = history_.find(key);
+  if (found != history_.end()) {
+    return found->second.millis;
+  }
+  double total_millis = 0, total_weight = 0;
+  for (const auto &entry : history_) {
+    total_millis += entry.second.millis;
+    total_weight += Weight(entry.second.features);
+  }
+  double millis_per_weight =
+      total_weight > 0 ? total_millis / total_weight : 1.0;
+  return Weight(features) * millis_per_weight;
+}
+
+void JobCostModel::Record(const std::string &key, const Features &features,
+                          double millis) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto &sample = history_[key];
+  sample.features = features;
+  sample.millis = millis;
+}
+
+std::vector<size_t> JobCostModel::LargestFirst(
+    const std::vector<double> &costs) {
+  std::vector<size_t> order(costs.size());
+  std::iota(order.begin(), order.end(), 0);
+  std::stable_sort(order.begin(), order.end(), [&costs](size_t a, size_t b) {
+    return costs[a] > costs[b];
+  });
+  return order;
+}
+
+}  // namespace kythe
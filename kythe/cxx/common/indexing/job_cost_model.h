@@ -0,0 +1,101 @@
+/*
+ * Copyright 2017 Google Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef KYTHE_CXX_COMMON_INDEXING_JOB_COST_MODEL_H_
+#define KYTHE_CXX_COMMON_INDEXING_JOB_COST_MODEL_H_
+
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace kythe {
+
+/// \brief Predicts how long compilation units will take to index, from their
+/// sizes and from how long they took in earlier runs.
+///
+/// A unit that has been indexed before is predicted to take as long as it
+/// did last time. Other units are predicted from their `weight`, scaled by
+/// the average time per unit of weight in the history. A unit's weight comes
+/// from its probed token counts if it has them. If there is no history,
+/// predictions are weights rather than milliseconds; they are still good
+/// enough to order jobs. Thread-safe.
+class JobCostModel {
+ public:
+  /// \brief What is known about a unit before it is indexed.
+  struct Features {
+    /// The number of required inputs.
+    size_t inputs = 0;
+    /// The size of the unit's inputs, if known (or some proxy for it).
+    uint64_t bytes = 0;
+    /// Tokens a cost probe lexed in files the unit claimed and in other
+    /// files, if the unit was probed. These aren't kept in the history.
+    uint64_t claimed_tokens = 0;
+    uint64_t unclaimed_tokens = 0;
+  };
+
+  /// \brief Loads the durations recorded by an earlier run's `SaveHistory`.
+  /// A missing file is an empty history.
+  /// \return false if the file couldn't be read; `error_text` will say why.
+  bool LoadHistory(const std::string &path, std::string *error_text);
+
+  /// \brief Writes every recorded duration to `path`, replacing it.
+  /// \return false on failure; `error_text` will say why.
+  bool SaveHistory(const std::string &path, std::string *error_text) const;
+
+  /// \brief Loads the "unit" lines of a cost probe report (see
+  /// `UnitCostProbe::ToTsv`), replacing any loaded before. Other lines are
+  /// skipped.
+  /// \return false if the file couldn't be read; `error_text` will say why.
+  bool LoadProbes(const std::string &path, std::string *error_text);
+
+  /// \brief Fills in the token counts of `features` if the unit called `key`
+  /// was probed.
+  void ApplyProbe(const std::string &key, Features *features) const;
+
+  /// \return the predicted cost, in milliseconds, of the unit called `key`.
+  double Predict(const std::string &key, const Features &features) const;
+
+  /// \brief Records that the unit called `key` took `millis` to index.
+  void Record(const std::string &key, const Features &features, double millis);
+
+  /// \return the indices of `costs` from the most to the least expensive.
+  /// Equal costs keep their relative order.
+  static std::vector<size_t> LargestFirst(const std::vector<double> &costs);
+
+  /// \return how heavy a unit with `features` is for prediction purposes.
+  static double Weight(const Features &features);
+
+ private:
+  /// \brief A unit's most recent duration.
+  struct Sample {
+    Features features;
+    double millis = 0;
+  };
+
+  /// Guards `history_` and `probes_`.
+  mutable std::mutex mutex_;
+  /// Maps from unit keys to their most recent durations.
+  std::map<std::string, Sample> history_;
+  /// Maps from unit keys to their probed (claimed, unclaimed) token counts.
+  std::map<std::string, std::pair<uint64_t, uint64_t>> probes_;
+};
+
+}  // namespace kythe
+
+#endif  // KYTHE_CXX_COMMON_INDEXING_JOB_COST_MODEL_H_
@@ -0,0 +1,127 @@
+/*
+ * Copyright 2017 Google Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "job_cost_model.h"
+
+#include <cstdio>
+#include <fstream>
+
+#include "gtest/gtest.h"
+#include "llvm/ADT/SmallString.h"
+#include "llvm/Support/FileSystem.h"
+
+namespace kythe {
+namespace {
+
+JobCostModel::Features MakeFeatures(size_t inputs, uint64_t bytes) {
+  JobCostModel::Features features;
+  features.inputs = inputs;
+  features.bytes = bytes;
+  return features;
+}
+
+TEST(JobCostModel, OrdersLargestFirst) {
+  EXPECT_EQ(std::vector<size_t>({1, 0, 2, 3}),
+            JobCostModel::LargestFirst({2.0, 5.0, 2.0, 1.0}));
+  EXPECT_TRUE(JobCostModel::LargestFirst({}).empty());
+}
+
+TEST(JobCostModel, PredictsWeightWithoutHistory) {
+  JobCostModel model;
+  EXPECT_EQ(JobCostModel::Weight(MakeFeatures(3, 16384)),
+            model.Predict("a", MakeFeatures(3, 16384)));
+  EXPECT_EQ(4.0, JobCostModel::Weight(MakeFeatures(3, 16384)));
+}
+
+TEST(JobCostModel, PredictsFromHistory) {
+  JobCostModel model;
+  model.Record("a", MakeFeatures(10, 0), 100);
+  model.Record("b", MakeFeatures(30, 0), 700);
+  // Known units take as long as they did last time.
+  EXPECT_EQ(100, model.Predict("a", MakeFeatures(20, 0)));
+  // Other units are scaled by 800ms per 40 inputs.
+  EXPECT_EQ(40, model.Predict("c", MakeFeatures(2, 0)));
+}
+
+TEST(JobCostModel, SavesAndLoadsHistory) {
+  llvm::SmallString<256> path;
+  ASSERT_FALSE(
+      llvm::sys::fs::createTemporaryFile("job_history", "tsv", path));
+  std::string history(path.begin(), path.end());
+  std::string error_text;
+  {
+    JobCostModel model;
+    model.Record("unit one.kindex", MakeFeatures(10, 2048), 125);
+    ASSERT_TRUE(model.SaveHistory(history, &error_text)) << error_text;
+  }
+  JobCostModel model;
+  ASSERT_TRUE(model.LoadHistory(history, &error_text)) << error_text;
+  EXPECT_EQ(125, model.Predict("unit one.kindex", MakeFeatures(0, 0)));
+  {
+    std::ofstream output(history, std::ios::app);
+    output << "garbage\n";
+  }
+  EXPECT_FALSE(model.LoadHistory(history, &error_text));
+  EXPECT_NE(std::string::npos, error_text.find(":2: bad sample"));
+  llvm::sys::fs::remove(path);
+}
+
+TEST(JobCostModel, WeighsProbedTokens) {
+  llvm::SmallString<256> path;
+  ASSERT_FALSE(llvm::sys::fs::createTemporaryFile("cost_probes", "tsv", path));
+  std::string probes(path.begin(), path.end());
+  {
+    std::ofstream output(probes);
+    output << "unit\t2048\t4096\t7\tunit one.kindex\n"
+           << "file\t2048\t0\t7\ta.cc\n"
+           << "file\t0\t4096\t0\ta.h\n";
+  }
+  JobCostModel model;
+  std::string error_text;
+  ASSERT_TRUE(model.LoadProbes(probes, &error_text)) << error_text;
+  auto features = MakeFeatures(100, 0);
+  model.ApplyProbe("unit one.kindex", &features);
+  EXPECT_EQ(2048, features.claimed_tokens);
+  EXPECT_EQ(4096, features.unclaimed_tokens);
+  // Probed tokens replace the input count; unclaimed ones count for less.
+  EXPECT_EQ(1.5, JobCostModel::Weight(features));
+  features = MakeFeatures(100, 0);
+  model.ApplyProbe("unit two.kindex", &features);
+  EXPECT_EQ(100.0, JobCostModel::Weight(features));
+  {
+    std::ofstream output(probes, std::ios::app);
+    output << "unit\tgarbage\n";
+  }
+  EXPECT_FALSE(model.LoadProbes(probes, &error_text));
+  EXPECT_NE(std::string::npos, error_text.find(":4: bad probe"));
+  llvm::sys::fs::remove(path);
+}
+
+TEST(JobCostModel, MissingHistoryIsEmpty) {
+  JobCostModel model;
+  std::string error_text;
+  EXPECT_TRUE(model.LoadHistory("/nonexistent/job_history", &error_text))
+      << error_text;
+}
+
+}  // namespace
+}  // namespace kythe
+
+int main(int argc, char **argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  int result = RUN_ALL_TESTS();
+  return result;
+}
@@ -0,0 +1,232 @@
+/*
+ * Copyright 2017 Google Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "kythe/cxx/common/indexing/leveldb_output_stream.h"
+
+#include <cstring>
+
+#include "google/protobuf/io/coded_stream.h"
+#include "kythe/proto/storage.pb.h"
+#include "leveldb/db.h"
+#include "leveldb/write_batch.h"
+
+namespace kythe {
+namespace {
+/// Prefixes every entry key (see kythe/go/storage/keyvalue).
+constexpr char kEntryKeyPrefix[] = "entry:";
+/// Separates the parts of an entry key.
+constexpr char kEntryKeySep = '\n';
+/// Separates the fields of an encoded VName.
+constexpr char kVNameFieldSep = '\0';
+/// The number of bytes handed out by each call to `LevelDBEntrySink::Next`.
+constexpr size_t kChunkSize = 64 * 1024;
+
+/// \brief Appends the encoding of `vname` to `key`.
+/// \return false if `vname` can't be encoded.
+bool AppendVName(const VNameRef &vname, std::string *key) {
+  const llvm::StringRef fields[] = {vname.signature, vname.corpus, vname.root,
+                                    vname.path, vname.language};
+  for (size_t i = 0; i < 5; ++i) {
+    if (fields[i].find(kVNameFieldSep) != llvm::StringRef::npos ||
+        fields[i].find(kEntryKeySep) != llvm::StringRef::npos) {
+      return false;
+    }
+    if (i != 0) {
+      key->push_back(kVNameFieldSep);
+    }
+    key->append(fields[i].data(), fields[i].size());
+  }
+  return true;
+}
+}  // anonymous namespace
+
+bool LevelDBOutputStream::EncodeKey(const VNameRef &source,
+                                    llvm::StringRef edge_kind,
+                                    llvm::StringRef fact_name,
+                                    const VNameRef *target, std::string *key) {
+  if (edge_kind.find(kEntryKeySep) != llvm::StringRef::npos ||
+      fact_name.find(kEntryKeySep) != llvm::StringRef::npos) {
+    return false;
+  }
+  key->assign(kEntryKeyPrefix);
+  if (!AppendVName(source, key)) {
+    return false;
+  }
+  key->push_back(kEntryKeySep);
+  key->append(edge_kind.data(), edge_kind.size());
+  key->push_back(kEntryKeySep);
+  key->append(fact_name.data(), fact_name.size());
+  key->push_back(kEntryKeySep);
+  return target == nullptr || AppendVName(*target, key);
+}
+
+LevelDBOutputStream::LevelDBOutputStream(size_t batch_bytes)
+    : batch_(new ::leveldb::WriteBatch()), batch_bytes_(batch_bytes) {}
+
+LevelDBOutputStream::~LevelDBOutputStream() {
+  Flush();
+  delete db_;
+}
+
+bool LevelDBOutputStream::Open(const std::string &path,
+                               std::string *error_text) {
+  delete db_;
+  db_ = nullptr;
+  ::leveldb::Options options;
+  options.create_if_missing = true;
+  ::leveldb::Status status = ::leveldb::DB::Open(options, path, &db_);
+  if (!status.ok()) {
+    *error_text = status.ToString();
+    db_ = nullptr;
+    return false;
+  }
+  return true;
+}
+
+void LevelDBOutputStream::Put(const VNameRef &source,
+                              llvm::StringRef edge_kind,
+                              llvm::StringRef fact_name, const VNameRef *target,
+                              llvm::StringRef fact_value) {
+  if (!EncodeKey(source, edge_kind, fact_name, target, &key_)) {
+    if (error_.empty()) {
+      error_ = "Can't encode a key for an entry from " + source.signature.str();
+    }
+    ++entries_rejected_;
+    return;
+  }
+  batch_->Put(key_, ::leveldb::Slice(fact_value.data(), fact_value.size()));
+  batch_size_ += key_.size() + fact_value.size();
+  ++entries_written_;
+  if (accounting_ != nullptr) {
+    accounting_->Count(accounting_->category(), 1,
+                       key_.size() + fact_value.size());
+  }
+  if (batch_size_ >= batch_bytes_) {
+    Flush();
+  }
+}
+
+void LevelDBOutputStream::Flush() {
+  if (db_ == nullptr || batch_size_ == 0) {
+    return;
+  }
+  ::leveldb::Status status =
+      db_->Write(::leveldb::WriteOptions(), batch_.get());
+  if (!status.ok() && error_.empty()) {
+    error_ = "leveldb write failed: " + status.ToString();
+  }
+  batch_->Clear();
+  batch_size_ = 0;
+}
+
+void LevelDBOutputStream::Emit(const FactRef &fact) {
+  Put(*fact.source, "", fact.fact_name, nullptr, fact.fact_value);
+}
+
+void LevelDBOutputStream::Emit(const EdgeRef &edge) {
+  Put(*edge.source, edge.edge_kind, "/", edge.target, "");
+}
+
+void LevelDBOutputStream::Emit(const OrdinalEdgeRef &edge) {
+  edge_kind_.assign(edge.edge_kind.data(), edge.edge_kind.size());
+  edge_kind_.push_back('.');
+  edge_kind_.append(std::to_string(edge.ordinal));
+  Put(*edge.source, edge_kind_, "/", edge.target, "");
+}
+
+size_t LevelDBOutputStream::WriteDelimitedEntries(llvm::StringRef entries) {
+  size_t offset = 0;
+  proto::Entry entry;
+  while (offset < entries.size()) {
+    google::protobuf::io::CodedInputStream input(
+        reinterpret_cast<const google::protobuf::uint8 *>(entries.data()) +
+            offset,
+        entries.size() - offset);
+    google::protobuf::uint32 entry_size;
+    if (!input.ReadVarint32(&entry_size)) {
+      break;
+    }
+    size_t header_size = input.CurrentPosition();
+    if (entries.size() - offset - header_size < entry_size) {
+      break;
+    }
+    if (!entry.ParseFromArray(entries.data() + offset + header_size,
+                              entry_size)) {
+      if (error_.empty()) {
+        error_ = "Malformed entry";
+      }
+      ++entries_rejected_;
+    } else {
+      VNameRef source(entry.source());
+      VNameRef target(entry.target());
+      Put(source, entry.edge_kind(), entry.fact_name(),
+          entry.has_target() ? &target : nullptr, entry.fact_value());
+    }
+    offset += header_size + entry_size;
+  }
+  return offset;
+}
+
+bool LevelDBOutputStream::Close(std::string *error_text) {
+  Flush();
+  delete db_;
+  db_ = nullptr;
+  if (!error_.empty()) {
+    *error_text = error_;
+    return false;
+  }
+  return true;
+}
+
+bool LevelDBEntrySink::Next(void **data, int *size) {
+  Forward();
+  if (pending_.size() < pending_size_ + kChunkSize) {
+    pending_.resize(pending_size_ + kChunkSize);
+  }
+  *data = &pending_[pending_size_];
+  *size = kChunkSize;
+  pending_size_ += kChunkSize;
+  return true;
+}
+
+void LevelDBEntrySink::BackUp(int count) { pending_size_ -= count; }
+
+google::protobuf::int64 LevelDBEntrySink::ByteCount() const {
+  return forwarded_bytes_ + pending_size_;
+}
+
+void LevelDBEntrySink::Forward() {
+  size_t consumed = output_->WriteDelimitedEntries(
+      llvm::StringRef(pending_.data(), pending_size_));
+  if (consumed != 0) {
+    std::memmove(&pending_[0], pending_.data() + consumed,
+                 pending_size_ - consumed);
+    pending_size_ -= consumed;
+    forwarded_bytes_ += consumed;
+  }
+}
+
+bool LevelDBEntrySink::Close(std::string *error_text) {
+  Forward();
+  if (pending_size_ != 0) {
+    *error_text = "Truncated entry at offset " +
+                  std::to_string(forwarded_bytes_);
+    return false;
+  }
+  return true;
+}
+
+}  // namespace kythe
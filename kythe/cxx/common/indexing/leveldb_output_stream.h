@@ -0,0 +1,147 @@
+/*
+ * Copyright 2017 Google Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef KYTHE_CXX_COMMON_INDEXING_LEVELDB_OUTPUT_STREAM_H_
+#define KYTHE_CXX_COMMON_INDEXING_LEVELDB_OUTPUT_STREAM_H_
+
+#include <memory>
+#include <string>
+
+#include "google/protobuf/io/zero_copy_stream.h"
+#include "kythe/cxx/common/indexing/KytheOutputStream.h"
+#include "llvm/ADT/StringRef.h"
+
+namespace leveldb {
+class WriteBatch;
+}  // namespace leveldb
+
+namespace kythe {
+
+/// \brief A `KytheOutputStream` that writes entries straight into a LevelDB
+/// GraphStore.
+///
+/// Keys and values use the encoding of kythe/go/storage/keyvalue, so the
+/// database can be opened with the Go `leveldb` GraphStore: the key is
+/// "entry:" followed by the source VName, edge kind, fact name and target
+/// VName (each VName's fields joined with NULs), separated by newlines; the
+/// value is the fact value. Entries are written in `WriteBatch`es. Writing an
+/// entry twice just overwrites it. Not thread-safe.
+class LevelDBOutputStream : public KytheOutputStream {
+ public:
+  /// \param batch_bytes Write a batch once it holds this many bytes of keys
+  /// and values.
+  explicit LevelDBOutputStream(size_t batch_bytes = 4 << 20);
+
+  /// \brief Writes any pending batch and closes the database.
+  ~LevelDBOutputStream() override;
+
+  /// \brief Opens (or creates) the database at `path`.
+  /// \param error_text Set to a description of the problem on failure.
+  /// \return true on success.
+  bool Open(const std::string &path, std::string *error_text);
+
+  void Emit(const FactRef &fact) override;
+  void Emit(const EdgeRef &edge) override;
+  void Emit(const OrdinalEdgeRef &edge) override;
+
+  /// \brief Writes the complete entries at the start of `entries`, a
+  /// sequence of varint-delimited wire-format `Entry` messages (such as the
+  /// output of a `FileOutputStream`).
+  /// \return the number of bytes consumed. A trailing partial entry isn't
+  /// consumed.
+  size_t WriteDelimitedEntries(llvm::StringRef entries);
+
+  /// \brief Writes any pending batch and closes the database.
+  /// \return false if any write failed or any entry couldn't be encoded;
+  /// `error_text` will describe the first problem.
+  bool Close(std::string *error_text);
+
+  /// \return the number of entries written so far.
+  size_t entries_written() const { return entries_written_; }
+
+  /// \return the number of entries that were dropped because their keys
+  /// couldn't be encoded.
+  size_t entries_rejected() const { return entries_rejected_; }
+
+  /// \brief Encodes the GraphStore key for an entry.
+  /// \param target The entry's target, or null for a fact.
+  /// \return false if a VName field contains a NUL or any part of the key
+  /// contains a newline (which the Go GraphStore also rejects).
+  static bool EncodeKey(const VNameRef &source, llvm::StringRef edge_kind,
+                        llvm::StringRef fact_name, const VNameRef *target,
+                        std::string *key);
+
+ private:
+  /// \brief Adds an entry to the current batch.
+  void Put(const VNameRef &source, llvm::StringRef edge_kind,
+           llvm::StringRef fact_name, const VNameRef *target,
+           llvm::StringRef fact_value);
+
+  /// \brief Writes the current batch, if it isn't empty.
+  void Flush();
+
+  /// The database we're writing to (or null).
+  ::leveldb::DB *db_ = nullptr;
+  /// Entries that haven't been written yet.
+  std::unique_ptr<::leveldb::WriteBatch> batch_;
+  /// The size of the keys and values in `batch_`.
+  size_t batch_size_ = 0;
+  /// The size at which to write `batch_`.
+  size_t batch_bytes_;
+  /// Scratch space for keys.
+  std::string key_;
+  /// Scratch space for edge kinds with ordinals.
+  std::string edge_kind_;
+  /// The number of entries written.
+  size_t entries_written_ = 0;
+  /// The number of entries rejected.
+  size_t entries_rejected_ = 0;
+  /// The first error encountered, if any.
+  std::string error_;
+};
+
+/// \brief Forwards a stream of varint-delimited entries (like the output of
+/// a `FileOutputStream`) to a `LevelDBOutputStream`.
+class LevelDBEntrySink : public google::protobuf::io::ZeroCopyOutputStream {
+ public:
+  /// \param output The stream to forward entries to. Not owned.
+  explicit LevelDBEntrySink(LevelDBOutputStream *output) : output_(output) {}
+
+  bool Next(void **data, int *size) override;
+  void BackUp(int count) override;
+  google::protobuf::int64 ByteCount() const override;
+
+  /// \brief Forwards any remaining entries.
+  /// \return false if a partial entry was left over.
+  bool Close(std::string *error_text);
+
+ private:
+  /// \brief Forwards the complete entries at the start of `pending_`.
+  void Forward();
+
+  /// The stream to forward entries to.
+  LevelDBOutputStream *output_;
+  /// Bytes that haven't been forwarded yet.
+  std::string pending_;
+  /// The number of bytes of `pending_` that hold data.
+  size_t pending_size_ = 0;
+  /// The number of bytes forwarded so far.
+  google::protobuf::int64 forwarded_bytes_ = 0;
+};
+
+}  // namespace kythe
+
+#endif  // KYTHE_CXX_COMMON_INDEXING_LEVELDB_OUTPUT_STREAM_H_
@@ -0,0 +1,167 @@
+/*
+ * Copyright 2017 Google Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "leveldb_output_stream.h"
+
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "google/protobuf/io/coded_stream.h"
+#include "gtest/gtest.h"
+#include "kythe/proto/storage.pb.h"
+#include "leveldb/db.h"
+#include "llvm/ADT/SmallString.h"
+#include "llvm/Support/FileSystem.h"
+
+namespace kythe {
+namespace {
+
+/// \return the bytes of `literal`, including any embedded NULs.
+template <size_t N>
+std::string Bytes(const char (&literal)[N]) {
+  return std::string(literal, N - 1);
+}
+
+class LevelDBOutputStreamTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    llvm::SmallString<256> dir;
+    ASSERT_FALSE(
+        llvm::sys::fs::createUniqueDirectory("leveldb_output_stream", dir));
+    dir_.assign(dir.begin(), dir.end());
+    path_ = dir_ + "/db";
+  }
+
+  void TearDown() override {
+    ::leveldb::DestroyDB(path_, ::leveldb::Options());
+    llvm::sys::fs::remove(dir_);
+  }
+
+  /// \return the keys and values in the database, in order.
+  std::vector<std::pair<std::string, std::string>> ReadAll() {
+    std::vector<std::pair<std::string, std::string>> result;
+    ::leveldb::DB *db = nullptr;
+    ::leveldb::Status status =
+        ::leveldb::DB::Open(::leveldb::Options(), path_, &db);
+    EXPECT_TRUE(status.ok()) << status.ToString();
+    if (db == nullptr) {
+      return result;
+    }
+    std::unique_ptr<::leveldb::Iterator> it(
+        db->NewIterator(::leveldb::ReadOptions()));
+    for (it->SeekToFirst(); it->Valid(); it->Next()) {
+      result.emplace_back(it->key().ToString(), it->value().ToString());
+    }
+    it.reset();
+    delete db;
+    return result;
+  }
+
+  std::string dir_;
+  std::string path_;
+};
+
+TEST_F(LevelDBOutputStreamTest, UsesGoKeyEncoding) {
+  VNameRef source, target;
+  source.signature = "sig";
+  source.corpus = "corpus";
+  source.language = "c++";
+  target.signature = "t";
+  std::string key;
+  ASSERT_TRUE(LevelDBOutputStream::EncodeKey(source, "/kythe/edge/ref", "/",
+                                             &target, &key));
+  EXPECT_EQ(Bytes("entry:sig\0corpus\0\0\0c++\n/kythe/edge/ref\n/\nt\0\0\0\0"),
+            key);
+  ASSERT_TRUE(LevelDBOutputStream::EncodeKey(source, "", "/kythe/node/kind",
+                                             nullptr, &key));
+  EXPECT_EQ(Bytes("entry:sig\0corpus\0\0\0c++\n\n/kythe/node/kind\n"), key);
+  source.path = "bad\npath";
+  EXPECT_FALSE(LevelDBOutputStream::EncodeKey(source, "", "/kythe/text",
+                                              nullptr, &key));
+}
+
+TEST_F(LevelDBOutputStreamTest, WritesEntries) {
+  {
+    LevelDBOutputStream stream(16);
+    std::string error_text;
+    ASSERT_TRUE(stream.Open(path_, &error_text)) << error_text;
+    VNameRef node, param;
+    node.signature = "node";
+    param.signature = "param";
+    stream.Emit(FactRef{&node, "/kythe/node/kind", "function"});
+    stream.Emit(EdgeRef{&node, "/kythe/edge/childof", &param});
+    stream.Emit(OrdinalEdgeRef{&node, "/kythe/edge/param", &param, 1});
+    stream.Emit(FactRef{&node, "/kythe/node/kind", "function"});
+    EXPECT_TRUE(stream.Close(&error_text)) << error_text;
+    EXPECT_EQ(4, stream.entries_written());
+  }
+  auto entries = ReadAll();
+  ASSERT_EQ(3, entries.size());
+  EXPECT_EQ(Bytes("entry:node\0\0\0\0\n\n/kythe/node/kind\n"),
+            entries[0].first);
+  EXPECT_EQ("function", entries[0].second);
+  EXPECT_EQ(Bytes("entry:node\0\0\0\0\n/kythe/edge/childof\n/\n"
+                  "param\0\0\0\0"),
+            entries[1].first);
+  EXPECT_EQ("", entries[1].second);
+  EXPECT_NE(std::string::npos, entries[2].first.find("/kythe/edge/param.1\n"));
+}
+
+TEST_F(LevelDBOutputStreamTest, AcceptsDelimitedEntries) {
+  {
+    LevelDBOutputStream stream;
+    std::string error_text;
+    ASSERT_TRUE(stream.Open(path_, &error_text)) << error_text;
+    LevelDBEntrySink sink(&stream);
+    {
+      FileOutputStream file_stream(&sink);
+      VNameRef node;
+      node.signature = "node";
+      file_stream.Emit(FactRef{&node, "/kythe/text", "text"});
+      file_stream.Emit(EdgeRef{&node, "/kythe/edge/ref", &node});
+    }
+    EXPECT_TRUE(sink.Close(&error_text)) << error_text;
+    EXPECT_TRUE(stream.Close(&error_text)) << error_text;
+  }
+  auto entries = ReadAll();
+  ASSERT_EQ(2, entries.size());
+  EXPECT_EQ(Bytes("entry:node\0\0\0\0\n\n/kythe/text\n"), entries[0].first);
+  EXPECT_EQ("text", entries[0].second);
+  EXPECT_EQ(Bytes("entry:node\0\0\0\0\n/kythe/edge/ref\n/\n"
+                  "node\0\0\0\0"),
+            entries[1].first);
+}
+
+TEST_F(LevelDBOutputStreamTest, RejectsUnencodableEntries) {
+  LevelDBOutputStream stream;
+  std::string error_text;
+  ASSERT_TRUE(stream.Open(path_, &error_text)) << error_text;
+  VNameRef node;
+  node.signature = llvm::StringRef("a\0b", 3);
+  stream.Emit(FactRef{&node, "/kythe/text", "text"});
+  EXPECT_EQ(1, stream.entries_rejected());
+  EXPECT_FALSE(stream.Close(&error_text));
+}
+
+}  // namespace
+}  // namespace kythe
+
+int main(int argc, char **argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  int result = RUN_ALL_TESTS();
+  return result;
+}
@@ -0,0 +1,177 @@
+/*
+ * Copyright 2017 Google Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "kythe/cxx/common/indexing/memcached_pool.h"
+
+#include <cinttypes>
+#include <cstdio>
+
+namespace kythe {
+namespace {
+const char *const kOpNames[] = {"get", "add", "mget", "flush"};
+}  // anonymous namespace
+
+constexpr size_t MemcachedPool::kBuckets;
+
+MemcachedPool::MemcachedPool(const std::string &name, const Options &options)
+    : name_(name), options_(options) {}
+
+MemcachedPool::~MemcachedPool() {
+  if (cache_) {
+    memcached_free(cache_);
+    cache_ = nullptr;
+  }
+}
+
+bool MemcachedPool::Open(const std::string &spec) {
+  if (cache_) {
+    memcached_free(cache_);
+    cache_ = nullptr;
+  }
+  std::string spec_amend = spec;
+  spec_amend.append(" --BINARY-PROTOCOL");
+  cache_ = memcached(spec_amend.c_str(), spec_amend.size());
+  if (cache_ == nullptr) {
+    return false;
+  }
+  // Only the keys on a failed server move to its neighbors on the ring.
+  memcached_behavior_set(cache_, MEMCACHED_BEHAVIOR_DISTRIBUTION,
+                         MEMCACHED_DISTRIBUTION_CONSISTENT_KETAMA);
+  memcached_behavior_set(cache_, MEMCACHED_BEHAVIOR_REMOVE_FAILED_SERVERS, 1);
+  memcached_behavior_set(cache_, MEMCACHED_BEHAVIOR_SERVER_FAILURE_LIMIT,
+                         options_.server_failure_limit);
+  memcached_behavior_set(cache_, MEMCACHED_BEHAVIOR_RETRY_TIMEOUT,
+                         options_.retry_timeout_s);
+  memcached_behavior_set(cache_, MEMCACHED_BEHAVIOR_TCP_NODELAY, 1);
+  if (options_.timeout_ms != 0) {
+    memcached_behavior_set(cache_, MEMCACHED_BEHAVIOR_CONNECT_TIMEOUT,
+                           options_.timeout_ms);
+    memcached_behavior_set(cache_, MEMCACHED_BEHAVIOR_POLL_TIMEOUT,
+                           options_.timeout_ms);
+    // These are in microseconds.
+    memcached_behavior_set(cache_, MEMCACHED_BEHAVIOR_SND_TIMEOUT,
+                           options_.timeout_ms * 1000);
+    memcached_behavior_set(cache_, MEMCACHED_BEHAVIOR_RCV_TIMEOUT,
+                           options_.timeout_ms * 1000);
+  }
+  memcached_return_t remote_version = memcached_version(cache_);
+  return memcached_success(remote_version);
+}
+
+bool MemcachedPool::Admit() {
+  if (!breaker_open_) {
+    return true;
+  }
+  if (!probing_ &&
+      Clock::now() - breaker_opened_at_ >=
+          std::chrono::milliseconds(options_.breaker_open_ms)) {
+    probing_ = true;
+    return true;
+  }
+  ++rejected_;
+  return false;
+}
+
+bool MemcachedPool::IsAnswer(memcached_return_t result) {
+  switch (result) {
+    case MEMCACHED_SUCCESS:
+    case MEMCACHED_NOTFOUND:
+    case MEMCACHED_DATA_EXISTS:
+    case MEMCACHED_END:
+    case MEMCACHED_BUFFERED:
+    case MEMCACHED_STORED:
+    case MEMCACHED_NOTSTORED:
+      return true;
+    default:
+      return false;
+  }
+}
+
+bool MemcachedPool::Record(Op op, Clock::time_point start,
+                           memcached_return_t result) {
+  const auto now = Clock::now();
+  uint64_t usec =
+      std::chrono::duration_cast<std::chrono::microseconds>(now - start)
+          .count();
+  size_t bucket = 0;
+  while (bucket + 1 < kBuckets && (usec >> bucket) != 0) {
+    ++bucket;
+  }
+  auto &histogram = histograms_[op];
+  ++histogram.buckets[bucket];
+  ++histogram.count;
+  histogram.total_usec += usec;
+  if (IsAnswer(result)) {
+    consecutive_failures_ = 0;
+    breaker_open_ = false;
+    probing_ = false;
+    return true;
+  }
+  ++histogram.failures;
+  ++consecutive_failures_;
+  if (probing_ ||
+      (!breaker_open_ && options_.breaker_failures != 0 &&
+       consecutive_failures_ >= options_.breaker_failures)) {
+    if (!probing_) {
+      fprintf(stderr, "memcached pool %s: opening breaker after %u failures\n",
+              name_.c_str(), consecutive_failures_);
+    }
+    probing_ = false;
+    breaker_open_ = true;
+    breaker_opened_at_ = now;
+    ++breaker_trips_;
+  }
+  return false;
+}
+
+const char *MemcachedPool::OpName(Op op) { return kOpNames[op]; }
+
+uint64_t MemcachedPool::Histogram::Quantile(double fraction) const {
+  uint64_t seen = 0;
+  for (size_t bucket = 0; bucket < kBuckets; ++bucket) {
+    seen += buckets[bucket];
+    if (seen != 0 && seen >= fraction * count) {
+      return uint64_t(1) << bucket;
+    }
+  }
+  return uint64_t(1) << (kBuckets - 1);
+}
+
+std::string MemcachedPool::ToString() const {
+  char line[256];
+  snprintf(line, sizeof(line),
+           "memcached pool %s: %" PRIu64 " breaker trips, %" PRIu64
+           " requests turned away\n",
+           name_.c_str(), breaker_trips_, rejected_);
+  std::string out = line;
+  for (size_t op = 0; op < kOpCount; ++op) {
+    const auto &histogram = histograms_[op];
+    if (histogram.count == 0) {
+      continue;
+    }
+    snprintf(line, sizeof(line),
+             "  %-5s %8" PRIu64 " ops %8" PRIu64 " failed  mean %" PRIu64
+             "us  p50 <%" PRIu64 "us  p99 <%" PRIu64 "us  max <%" PRIu64
+             "us\n",
+             kOpNames[op], histogram.count, histogram.failures,
+             histogram.total_usec / histogram.count, histogram.Quantile(0.5),
+             histogram.Quantile(0.99), histogram.Quantile(1.0));
+    out.append(line);
+  }
+  return out;
+}
+
+}  // namespace kythe
@@ -0,0 +1,137 @@
+/*
+ * Copyright 2017 Google Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef KYTHE_CXX_COMMON_INDEXING_MEMCACHED_POOL_H_
+#define KYTHE_CXX_COMMON_INDEXING_MEMCACHED_POOL_H_
+
+#include <libmemcached/memcached.h>
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+namespace kythe {
+
+/// \brief A connection to a pool of memcached servers, shared by the clients
+/// that keep hashes and claims in memcache.
+///
+/// Keys are spread over the servers in the spec (e.g.
+/// "--SERVER=a:11211 --SERVER=b:11211") with ketama consistent hashing, so
+/// when a server fails and is ejected only its keys move. Every operation is
+/// bounded by `Options::timeout_ms`. After `Options::breaker_failures`
+/// failed operations in a row the circuit breaker opens and `Admit` turns
+/// requests away for `Options::breaker_open_ms`; then a single probe is let
+/// through, and its result decides whether the breaker closes again. While
+/// requests are turned away, clients act as though the cache were degraded
+/// (hash lookups miss; claims follow the claim client's policy). The pool
+/// keeps a latency histogram for each kind of operation. Like the
+/// underlying handle, a pool is not thread-safe.
+class MemcachedPool {
+ public:
+  using Clock = std::chrono::steady_clock;
+
+  struct Options {
+    /// How long a single operation may take, in milliseconds. 0 uses
+    /// libmemcached's defaults.
+    uint64_t timeout_ms = 0;
+    /// How many errors in a row eject a server from the ring.
+    uint32_t server_failure_limit = 2;
+    /// How long an ejected server stays out of the ring, in seconds.
+    uint32_t retry_timeout_s = 30;
+    /// How many failed operations in a row open the breaker. 0 means the
+    /// breaker never opens.
+    uint32_t breaker_failures = 8;
+    /// How long the breaker stays open before probing, in milliseconds.
+    uint64_t breaker_open_ms = 5000;
+  };
+
+  /// The kinds of operation that get their own latency histogram.
+  enum Op { kGet, kAdd, kMultiGet, kFlush, kOpCount };
+
+  /// Latencies are kept in power-of-two buckets of microseconds: bucket 0
+  /// holds operations under 1us, and bucket `b` those under `2^b` us.
+  static constexpr size_t kBuckets = 32;
+
+  struct Histogram {
+    uint64_t buckets[kBuckets] = {};
+    uint64_t count = 0;
+    uint64_t failures = 0;
+    uint64_t total_usec = 0;
+
+    /// \return an upper bound on the `fraction` quantile, in microseconds.
+    uint64_t Quantile(double fraction) const;
+  };
+
+  /// \param name Identifies the pool in `ToString`.
+  MemcachedPool(const std::string &name, const Options &options);
+  ~MemcachedPool();
+
+  MemcachedPool(const MemcachedPool &) = delete;
+  MemcachedPool &operator=(const MemcachedPool &) = delete;
+
+  /// \brief Connects to the servers in `spec`.
+  /// \return false if the servers couldn't be reached.
+  bool Open(const std::string &spec);
+
+  /// \return the handle to make requests on, or null if not open.
+  ::memcached_st *handle() const { return cache_; }
+
+  /// \brief Decides whether a request should go to the servers.
+  /// \return false if the breaker is open.
+  bool Admit();
+
+  /// \brief Records that an `op` begun at `start` finished with `result`.
+  /// \return false if `result` means the servers didn't answer.
+  bool Record(Op op, Clock::time_point start, memcached_return_t result);
+
+  /// \return false if `result` is a failure to reach the servers, rather
+  /// than an answer (like a miss, or a key that already exists).
+  static bool IsAnswer(memcached_return_t result);
+
+  /// \return whether the breaker is turning requests away.
+  bool breaker_open() const { return breaker_open_; }
+
+  /// \return the number of requests `Admit` turned away.
+  uint64_t rejected() const { return rejected_; }
+
+  /// \return the latency histogram for `op`.
+  const Histogram &histogram(Op op) const { return histograms_[op]; }
+
+  /// \return a short name for `op` ("get", "add", ...).
+  static const char *OpName(Op op);
+
+  /// \return the latency histograms and breaker activity.
+  std::string ToString() const;
+
+ private:
+  std::string name_;
+  Options options_;
+  ::memcached_st *cache_ = nullptr;
+  Histogram histograms_[kOpCount];
+  /// The number of failed operations since the last success.
+  uint32_t consecutive_failures_ = 0;
+  bool breaker_open_ = false;
+  /// Set while the single probe after a cooldown is outstanding.
+  bool probing_ = false;
+  Clock::time_point breaker_opened_at_;
+  uint64_t breaker_trips_ = 0;
+  uint64_t rejected_ = 0;
+};
+
+}  // namespace kythe
+
+#endif  // KYTHE_CXX_COMMON_INDEXING_MEMCACHED_POOL_H_
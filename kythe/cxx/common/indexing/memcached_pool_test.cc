@@ -0,0 +1,110 @@
+/*
+ * Copyright 2017 Google Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "kythe/cxx/common/indexing/memcached_pool.h"
+
+#include "gtest/gtest.h"
+
+namespace kythe {
+namespace {
+
+MemcachedPool::Options BreakAfter(uint32_t failures, uint64_t open_ms) {
+  MemcachedPool::Options options;
+  options.breaker_failures = failures;
+  options.breaker_open_ms = open_ms;
+  return options;
+}
+
+/// \brief Records `count` operations that finished with `result`.
+void RecordMany(MemcachedPool *pool, size_t count, memcached_return_t result) {
+  for (size_t i = 0; i < count; ++i) {
+    pool->Record(MemcachedPool::kGet, MemcachedPool::Clock::now(), result);
+  }
+}
+
+TEST(MemcachedPool, AnswersAreNotFailures) {
+  EXPECT_TRUE(MemcachedPool::IsAnswer(MEMCACHED_SUCCESS));
+  EXPECT_TRUE(MemcachedPool::IsAnswer(MEMCACHED_NOTFOUND));
+  EXPECT_TRUE(MemcachedPool::IsAnswer(MEMCACHED_DATA_EXISTS));
+  EXPECT_TRUE(MemcachedPool::IsAnswer(MEMCACHED_END));
+  EXPECT_TRUE(MemcachedPool::IsAnswer(MEMCACHED_BUFFERED));
+  EXPECT_FALSE(MemcachedPool::IsAnswer(MEMCACHED_FAILURE));
+}
+
+TEST(MemcachedPool, BreakerOpensAfterFailuresInARow) {
+  MemcachedPool pool("test", BreakAfter(3, 60 * 1000));
+  RecordMany(&pool, 2, MEMCACHED_FAILURE);
+  // A success resets the count.
+  RecordMany(&pool, 1, MEMCACHED_NOTFOUND);
+  RecordMany(&pool, 2, MEMCACHED_FAILURE);
+  EXPECT_TRUE(pool.Admit());
+  EXPECT_FALSE(pool.breaker_open());
+  RecordMany(&pool, 1, MEMCACHED_FAILURE);
+  EXPECT_TRUE(pool.breaker_open());
+  EXPECT_FALSE(pool.Admit());
+  EXPECT_FALSE(pool.Admit());
+  EXPECT_EQ(2, pool.rejected());
+}
+
+TEST(MemcachedPool, BreakerProbesOnceAfterCooldown) {
+  MemcachedPool pool("test", BreakAfter(1, 0));
+  RecordMany(&pool, 1, MEMCACHED_FAILURE);
+  ASSERT_TRUE(pool.breaker_open());
+  // Only one request gets through until the probe finishes.
+  EXPECT_TRUE(pool.Admit());
+  EXPECT_FALSE(pool.Admit());
+  // A failed probe keeps the breaker open.
+  RecordMany(&pool, 1, MEMCACHED_FAILURE);
+  EXPECT_TRUE(pool.breaker_open());
+  EXPECT_TRUE(pool.Admit());
+  RecordMany(&pool, 1, MEMCACHED_SUCCESS);
+  EXPECT_FALSE(pool.breaker_open());
+  EXPECT_TRUE(pool.Admit());
+  EXPECT_TRUE(pool.Admit());
+}
+
+TEST(MemcachedPool, BreakerCanBeDisabled) {
+  MemcachedPool pool("test", BreakAfter(0, 0));
+  RecordMany(&pool, 100, MEMCACHED_FAILURE);
+  EXPECT_FALSE(pool.breaker_open());
+  EXPECT_TRUE(pool.Admit());
+}
+
+TEST(MemcachedPool, KeepsHistogramsPerOp) {
+  MemcachedPool pool("test", MemcachedPool::Options());
+  const auto start =
+      MemcachedPool::Clock::now() - std::chrono::microseconds(100);
+  EXPECT_TRUE(pool.Record(MemcachedPool::kAdd, start, MEMCACHED_SUCCESS));
+  EXPECT_FALSE(pool.Record(MemcachedPool::kAdd, start, MEMCACHED_FAILURE));
+  const std::string stats = pool.ToString();
+  EXPECT_NE(std::string::npos, stats.find("memcached pool test"));
+  EXPECT_NE(std::string::npos, stats.find("add"));
+  EXPECT_NE(std::string::npos, stats.find("2 ops"));
+  EXPECT_NE(std::string::npos, stats.find("1 failed"));
+  // Every latency was at least 100us, so the median bucket is past 64us.
+  EXPECT_EQ(std::string::npos, stats.find("p50 <64us"));
+  // Ops that never ran aren't listed.
+  EXPECT_EQ(std::string::npos, stats.find("mget"));
+}
+
+}  // namespace
+}  // namespace kythe
+
+int main(int argc, char **argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  int result = RUN_ALL_TESTS();
+  return result;
+}
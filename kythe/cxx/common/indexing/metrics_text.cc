@@ -0,0 +1,166 @@
+/*
+ * Copyright 2017 Google Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "kythe/cxx/common/indexing/metrics_text.h"
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+
+namespace kythe {
+namespace {
+/// \brief Appends `text` to `out`, escaping backslashes and newlines (and,
+/// if `quotes`, double quotes).
+void AppendEscaped(const std::string &text, bool quotes, std::string *out) {
+  for (char c : text) {
+    if (c == '\\' || (quotes && c == '"')) {
+      out->push_back('\\');
+      out->push_back(c);
+    } else if (c == '\n') {
+      out->append("\\n");
+    } else {
+      out->push_back(c);
+    }
+  }
+}
+
+/// \brief Appends `value` in the exposition format's number syntax.
+void AppendValue(double value, std::string *out) {
+  char buffer[32];
+  snprintf(buffer, sizeof(buffer), "%.17g", value);
+  out->append(buffer);
+}
+}  // anonymous namespace
+
+void MetricsText::Describe(const std::string &name, const std::string &help,
+                           const char *type) {
+  if (!described_.insert(name).second) {
+    return;
+  }
+  text_.append("# HELP ");
+  text_.append(name);
+  text_.push_back(' ');
+  AppendEscaped(help, false, &text_);
+  text_.append("\n# TYPE ");
+  text_.append(name);
+  text_.push_back(' ');
+  text_.append(type);
+  text_.push_back('\n');
+}
+
+void MetricsText::AddSample(const std::string &name, const Labels &labels,
+                            double value) {
+  text_.append(name);
+  if (!labels.empty()) {
+    text_.push_back('{');
+    for (size_t i = 0; i < labels.size(); ++i) {
+      if (i != 0) {
+        text_.push_back(',');
+      }
+      text_.append(labels[i].first);
+      text_.append("=\"");
+      AppendEscaped(labels[i].second, true, &text_);
+      text_.push_back('"');
+    }
+    text_.push_back('}');
+  }
+  text_.push_back(' ');
+  AppendValue(value, &text_);
+  text_.push_back('\n');
+}
+
+void MetricsText::AddCounter(const std::string &name, const std::string &help,
+                             double value, const Labels &labels) {
+  Describe(name, help, "counter");
+  AddSample(name, labels, value);
+}
+
+void MetricsText::AddGauge(const std::string &name, const std::string &help,
+                           double value, const Labels &labels) {
+  Describe(name, help, "gauge");
+  AddSample(name, labels, value);
+}
+
+void MetricsText::AddHistogram(const std::string &name,
+                               const std::string &help,
+                               const std::vector<double> &upper_bounds,
+                               const std::vector<uint64_t> &counts,
+                               uint64_t overflow, double sum,
+                               const Labels &labels) {
+  Describe(name, help, "histogram");
+  const std::string bucket = name + "_bucket";
+  Labels bucket_labels = labels;
+  bucket_labels.emplace_back("le", "");
+  uint64_t cumulative = 0;
+  for (size_t i = 0; i < upper_bounds.size() && i < counts.size(); ++i) {
+    cumulative += counts[i];
+    std::string bound;
+    AppendValue(upper_bounds[i], &bound);
+    bucket_labels.back().second = bound;
+    AddSample(bucket, bucket_labels, cumulative);
+  }
+  cumulative += overflow;
+  bucket_labels.back().second = "+Inf";
+  AddSample(bucket, bucket_labels, cumulative);
+  AddSample(name + "_sum", labels, sum);
+  AddSample(name + "_count", labels, cumulative);
+}
+
+MetricsDump::MetricsDump(std::string path, std::chrono::milliseconds period,
+                         Collector collect)
+    : path_(std::move(path)), period_(period), collect_(std::move(collect)) {}
+
+bool MetricsDump::MaybeWrite(std::string *error_text) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (written_ && Clock::now() - last_write_ < period_) {
+    return true;
+  }
+  return WriteLocked(error_text);
+}
+
+bool MetricsDump::Write(std::string *error_text) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return WriteLocked(error_text);
+}
+
+bool MetricsDump::WriteLocked(std::string *error_text) {
+  last_write_ = Clock::now();
+  written_ = true;
+  MetricsText metrics;
+  collect_(&metrics);
+  const std::string temp_path = path_ + ".tmp";
+  FILE *file = fopen(temp_path.c_str(), "w");
+  if (file == nullptr) {
+    *error_text = temp_path + ": " + strerror(errno);
+    return false;
+  }
+  const std::string &text = metrics.text();
+  bool ok = fwrite(text.data(), 1, text.size(), file) == text.size();
+  ok = (fclose(file) == 0) && ok;
+  if (!ok) {
+    *error_text = temp_path + ": " + strerror(errno);
+    remove(temp_path.c_str());
+    return false;
+  }
+  if (rename(temp_path.c_str(), path_.c_str()) != 0) {
+    *error_text = path_ + ": " + strerror(errno);
+    remove(temp_path.c_str());
+    return false;
+  }
+  return true;
+}
+
+}  // namespace kythe
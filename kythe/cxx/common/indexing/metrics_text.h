@@ -0,0 +1,128 @@
+/*
+ * Copyright 2017 Google Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef KYTHE_CXX_COMMON_INDEXING_METRICS_TEXT_H_
+#define KYTHE_CXX_COMMON_INDEXING_METRICS_TEXT_H_
+
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <set>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace kythe {
+
+/// \brief Builds a snapshot of metrics in the Prometheus text exposition
+/// format.
+///
+/// Each metric name is described (with `# HELP` and `# TYPE` lines) the
+/// first time it's added; later samples with the same name should differ
+/// in their labels. Rates like units per second are left to the consumer,
+/// which can derive them from the counters.
+class MetricsText {
+ public:
+  /// Label names and values for one sample.
+  using Labels = std::vector<std::pair<std::string, std::string>>;
+
+  /// \brief Adds a sample of a value that only goes up.
+  void AddCounter(const std::string &name, const std::string &help,
+                  double value, const Labels &labels = {});
+
+  /// \brief Adds a sample of a value that can go up and down.
+  void AddGauge(const std::string &name, const std::string &help,
+                double value, const Labels &labels = {});
+
+  /// \brief Adds a histogram.
+  /// \param upper_bounds The inclusive upper bound of each bucket, in
+  /// increasing order.
+  /// \param counts The number of observations in each bucket (not
+  /// cumulative); the same length as `upper_bounds`.
+  /// \param overflow The number of observations above the last bound.
+  /// \param sum The sum of all observations.
+  void AddHistogram(const std::string &name, const std::string &help,
+                    const std::vector<double> &upper_bounds,
+                    const std::vector<uint64_t> &counts, uint64_t overflow,
+                    double sum, const Labels &labels = {});
+
+  /// \return the metrics added so far.
+  const std::string &text() const { return text_; }
+
+ private:
+  /// \brief Describes `name` if it hasn't been described yet.
+  void Describe(const std::string &name, const std::string &help,
+                const char *type);
+  /// \brief Appends one sample line.
+  void AddSample(const std::string &name, const Labels &labels,
+                 double value);
+
+  /// The exposition so far.
+  std::string text_;
+  /// The metric names that have been described.
+  std::set<std::string> described_;
+};
+
+/// \brief Writes snapshots of metrics to a file every so often, replacing
+/// the file atomically so that a collector (like node_exporter's textfile
+/// collector) never sees a partial snapshot.
+///
+/// Snapshots are taken when the owner calls `MaybeWrite`, at points where
+/// the counters are consistent, rather than from a background thread that
+/// would race with their updates. Thread-safe.
+class MetricsDump {
+ public:
+  /// \brief Adds the current metrics to a snapshot.
+  using Collector = std::function<void(MetricsText *)>;
+
+  /// \param path The file to write.
+  /// \param period The least time between snapshots.
+  /// \param collect Called (under the dump's lock) to take each snapshot.
+  MetricsDump(std::string path, std::chrono::milliseconds period,
+              Collector collect);
+
+  MetricsDump(const MetricsDump &) = delete;
+  MetricsDump &operator=(const MetricsDump &) = delete;
+
+  /// \brief Writes a snapshot if `period` has passed since the last one.
+  /// \return false on failure; `error_text` will say why.
+  bool MaybeWrite(std::string *error_text);
+
+  /// \brief Writes a snapshot now.
+  /// \return false on failure; `error_text` will say why.
+  bool Write(std::string *error_text);
+
+ private:
+  using Clock = std::chrono::steady_clock;
+
+  /// \brief Writes a snapshot. Must be called with `mutex_` held.
+  bool WriteLocked(std::string *error_text);
+
+  const std::string path_;
+  const std::chrono::milliseconds period_;
+  Collector collect_;
+  /// Guards the fields below and calls to `collect_`.
+  std::mutex mutex_;
+  /// When the last snapshot was written.
+  Clock::time_point last_write_;
+  /// Set once a snapshot has been written.
+  bool written_ = false;
+};
+
+}  // namespace kythe
+
+#endif  // KYTHE_CXX_COMMON_INDEXING_METRICS_TEXT_H_
@@ -0,0 +1,113 @@
+/*
+ * Copyright 2017 Google Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "kythe/cxx/common/indexing/metrics_text.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <sstream>
+
+#include "gtest/gtest.h"
+
+namespace kythe {
+namespace {
+
+TEST(MetricsTextTest, DescribesEachNameOnce) {
+  MetricsText metrics;
+  metrics.AddCounter("units_total", "Units indexed.", 3, {{"kind", "a"}});
+  metrics.AddCounter("units_total", "Units indexed.", 4, {{"kind", "b"}});
+  metrics.AddGauge("queued", "Queued units.", 2);
+  EXPECT_EQ(
+      "# HELP units_total Units indexed.\n"
+      "# TYPE units_total counter\n"
+      "units_total{kind=\"a\"} 3\n"
+      "units_total{kind=\"b\"} 4\n"
+      "# HELP queued Queued units.\n"
+      "# TYPE queued gauge\n"
+      "queued 2\n",
+      metrics.text());
+}
+
+TEST(MetricsTextTest, EscapesLabelValuesAndHelp) {
+  MetricsText metrics;
+  metrics.AddGauge("g", "a\\b\nc", 0.5, {{"path", "x\"y\\z\n"}});
+  EXPECT_EQ(
+      "# HELP g a\\\\b\\nc\n"
+      "# TYPE g gauge\n"
+      "g{path=\"x\\\"y\\\\z\\n\"} 0.5\n",
+      metrics.text());
+}
+
+TEST(MetricsTextTest, HistogramBucketsAreCumulative) {
+  MetricsText metrics;
+  metrics.AddHistogram("latency_seconds", "Latency.", {0.5, 1}, {2, 3}, 1,
+                       4.5, {{"op", "add"}});
+  EXPECT_EQ(
+      "# HELP latency_seconds Latency.\n"
+      "# TYPE latency_seconds histogram\n"
+      "latency_seconds_bucket{op=\"add\",le=\"0.5\"} 2\n"
+      "latency_seconds_bucket{op=\"add\",le=\"1\"} 5\n"
+      "latency_seconds_bucket{op=\"add\",le=\"+Inf\"} 6\n"
+      "latency_seconds_sum{op=\"add\"} 4.5\n"
+      "latency_seconds_count{op=\"add\"} 6\n",
+      metrics.text());
+}
+
+std::string ReadFile(const std::string &path) {
+  std::ifstream in(path);
+  std::stringstream text;
+  text << in.rdbuf();
+  return text.str();
+}
+
+TEST(MetricsDumpTest, WritesAtMostOncePerPeriod) {
+  const char *tmp_dir = getenv("TEST_TMPDIR");
+  const std::string path =
+      std::string(tmp_dir != nullptr ? tmp_dir : "/tmp") + "/metrics.prom";
+  int snapshots = 0;
+  MetricsDump dump(path, std::chrono::hours(1), [&](MetricsText *metrics) {
+    metrics->AddCounter("snapshots_total", "Snapshots.", ++snapshots);
+  });
+  std::string error_text;
+  ASSERT_TRUE(dump.MaybeWrite(&error_text)) << error_text;
+  ASSERT_TRUE(dump.MaybeWrite(&error_text)) << error_text;
+  EXPECT_EQ(1, snapshots);
+  EXPECT_NE(std::string::npos, ReadFile(path).find("snapshots_total 1\n"));
+  ASSERT_TRUE(dump.Write(&error_text)) << error_text;
+  EXPECT_EQ(2, snapshots);
+  EXPECT_NE(std::string::npos, ReadFile(path).find("snapshots_total 2\n"));
+  // The temporary file is renamed into place.
+  EXPECT_EQ(nullptr, fopen((path + ".tmp").c_str(), "r"));
+  std::remove(path.c_str());
+}
+
+TEST(MetricsDumpTest, ReportsWriteErrors) {
+  MetricsDump dump("/nonexistent/dir/metrics.prom", std::chrono::seconds(0),
+                   [](MetricsText *metrics) {});
+  std::string error_text;
+  EXPECT_FALSE(dump.Write(&error_text));
+  EXPECT_FALSE(error_text.empty());
+}
+
+}  // namespace
+}  // namespace kythe
+
+int main(int argc, char **argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  int result = RUN_ALL_TESTS();
+  return result;
+}
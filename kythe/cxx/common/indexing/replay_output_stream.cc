@@ -0,0 +1,103 @@
+/*
+ * Copyright 2017 Google Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "kythe/cxx/common/indexing/replay_output_stream.h"
+
+namespace kythe {
+
+proto::Entry *ReplayOutputStream::Add(Op op, uint32_t ordinal) {
+  records_.push_back(Record{op, proto::Entry(), ordinal});
+  return &records_.back().entry;
+}
+
+void ReplayOutputStream::Emit(const FactRef &fact) {
+  proto::Entry *entry = Add(Op::kFact);
+  fact.Expand(entry);
+  ++entries_;
+  bytes_ += sizeof(Record) + entry->ByteSize();
+}
+
+void ReplayOutputStream::EmitContent(const FactRef &fact) {
+  proto::Entry *entry = Add(Op::kContent);
+  fact.Expand(entry);
+  ++entries_;
+  bytes_ += sizeof(Record) + entry->ByteSize();
+}
+
+void ReplayOutputStream::Emit(const EdgeRef &edge) {
+  proto::Entry *entry = Add(Op::kEdge);
+  edge.Expand(entry);
+  ++entries_;
+  bytes_ += sizeof(Record) + entry->ByteSize();
+}
+
+void ReplayOutputStream::Emit(const OrdinalEdgeRef &edge) {
+  proto::Entry *entry = Add(Op::kOrdinalEdge, edge.ordinal);
+  // Keep the edge kind as given; `Expand` would append the ordinal to it.
+  edge.source->Expand(entry->mutable_source());
+  edge.target->Expand(entry->mutable_target());
+  entry->mutable_edge_kind()->assign(edge.edge_kind.data(),
+                                     edge.edge_kind.size());
+  ++entries_;
+  bytes_ += sizeof(Record) + entry->ByteSize();
+}
+
+void ReplayOutputStream::PushBuffer() { Add(Op::kPush); }
+
+void ReplayOutputStream::PushFileBuffer(llvm::StringRef file) {
+  Add(Op::kPushFile)->mutable_fact_value()->assign(file.data(), file.size());
+}
+
+void ReplayOutputStream::PopBuffer() { Add(Op::kPop); }
+
+void ReplayOutputStream::ReplayOnto(KytheOutputStream *output) {
+  for (const auto &record : records_) {
+    const proto::Entry &entry = record.entry;
+    VNameRef source(entry.source());
+    VNameRef target(entry.target());
+    switch (record.op) {
+      case Op::kFact:
+        output->Emit(FactRef{&source, entry.fact_name(), entry.fact_value()});
+        break;
+      case Op::kContent:
+        output->EmitContent(
+            FactRef{&source, entry.fact_name(), entry.fact_value()});
+        break;
+      case Op::kEdge:
+        output->Emit(EdgeRef{&source, entry.edge_kind(), &target});
+        break;
+      case Op::kOrdinalEdge:
+        output->Emit(OrdinalEdgeRef{&source, entry.edge_kind(), &target,
+                                    record.ordinal});
+        break;
+      case Op::kPush:
+        output->PushBuffer();
+        break;
+      case Op::kPushFile:
+        output->PushFileBuffer(entry.fact_value());
+        break;
+      case Op::kPop:
+        output->PopBuffer();
+        break;
+    }
+  }
+  records_.clear();
+  records_.shrink_to_fit();
+  entries_ = 0;
+  bytes_ = 0;
+}
+
+}  // namespace kythe
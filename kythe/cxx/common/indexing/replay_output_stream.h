@@ -0,0 +1,86 @@
+/*
+ * Copyright 2017 Google Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef KYTHE_CXX_COMMON_INDEXING_REPLAY_OUTPUT_STREAM_H_
+#define KYTHE_CXX_COMMON_INDEXING_REPLAY_OUTPUT_STREAM_H_
+
+#include <vector>
+
+#include "KytheOutputStream.h"
+#include "kythe/proto/storage.pb.h"
+
+namespace kythe {
+
+/// \brief A `KytheOutputStream` that holds everything written to it in
+/// memory until it is replayed onto another stream.
+///
+/// Buffers pushed and popped and content facts are replayed as such, so the
+/// stream being replayed onto groups and hashes them as if it had been
+/// written to directly. Entries aren't charged to an `EntryAccounting`.
+class ReplayOutputStream : public KytheOutputStream {
+ public:
+  void Emit(const FactRef &fact) override;
+  void Emit(const EdgeRef &edge) override;
+  void Emit(const OrdinalEdgeRef &edge) override;
+  void EmitContent(const FactRef &fact) override;
+  void PushBuffer() override;
+  void PushFileBuffer(llvm::StringRef file) override;
+  void PopBuffer() override;
+  size_t buffered_bytes() const override { return bytes_; }
+
+  /// \brief Writes everything written to this stream so far to `output`, in
+  /// the order in which it was written, then forgets it.
+  void ReplayOnto(KytheOutputStream *output);
+
+  /// \return the number of entries held.
+  size_t entries() const { return entries_; }
+
+ private:
+  enum class Op {
+    kFact,
+    kContent,
+    kEdge,
+    kOrdinalEdge,
+    kPush,
+    kPushFile,
+    kPop
+  };
+
+  /// \brief Something written to the stream.
+  struct Record {
+    Op op;
+    /// The entry written, with any ordinal left out of its edge kind. For a
+    /// `kPushFile`, the file is held in the fact value.
+    proto::Entry entry;
+    /// The ordinal of a `kOrdinalEdge`.
+    uint32_t ordinal;
+  };
+
+  /// \brief Appends a record for `op`.
+  /// \return its entry, to be filled in.
+  proto::Entry *Add(Op op, uint32_t ordinal = 0);
+
+  /// Everything written so far, in order.
+  std::vector<Record> records_;
+  /// The number of records holding entries.
+  size_t entries_ = 0;
+  /// An estimate of the memory held by `records_`' entries.
+  size_t bytes_ = 0;
+};
+
+}  // namespace kythe
+
+#endif  // KYTHE_CXX_COMMON_INDEXING_REPLAY_OUTPUT_STREAM_H_
@@ -0,0 +1,96 @@
+/*
+ * Copyright 2017 Google Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "kythe/cxx/common/indexing/replay_output_stream.h"
+
+#include <string>
+
+#include "gtest/gtest.h"
+
+namespace kythe {
+namespace {
+
+/// \brief Describes each call made to it on a line of `log`.
+class LoggingOutputStream : public KytheOutputStream {
+ public:
+  void Emit(const FactRef &fact) override {
+    log += "fact " + fact.source->signature.str() + " " +
+           fact.fact_name.str() + "=" + fact.fact_value.str() + "\n";
+  }
+  void EmitContent(const FactRef &fact) override {
+    log += "content " + fact.source->signature.str() + " " +
+           fact.fact_name.str() + "=" + fact.fact_value.str() + "\n";
+  }
+  void Emit(const EdgeRef &edge) override {
+    log += "edge " + edge.source->signature.str() + " " +
+           edge.edge_kind.str() + " " + edge.target->signature.str() + "\n";
+  }
+  void Emit(const OrdinalEdgeRef &edge) override {
+    log += "edge " + edge.source->signature.str() + " " +
+           edge.edge_kind.str() + "." + std::to_string(edge.ordinal) + " " +
+           edge.target->signature.str() + "\n";
+  }
+  void PushBuffer() override { log += "push\n"; }
+  void PushFileBuffer(llvm::StringRef file) override {
+    log += "push " + file.str() + "\n";
+  }
+  void PopBuffer() override { log += "pop\n"; }
+
+  std::string log;
+};
+
+TEST(ReplayOutputStreamTest, ReplaysInOrder) {
+  proto::VName a_vname, b_vname;
+  a_vname.set_signature("a");
+  b_vname.set_signature("b");
+  VNameRef a(a_vname), b(b_vname);
+  ReplayOutputStream replay;
+  replay.PushBuffer();
+  replay.Emit(FactRef{&a, "/kythe/node/kind", "file"});
+  replay.EmitContent(FactRef{&a, "/kythe/text", "int x;"});
+  replay.PopBuffer();
+  replay.PushFileBuffer("#corpus#a.h");
+  replay.Emit(EdgeRef{&a, "/kythe/edge/childof", &b});
+  replay.PopBuffer();
+  replay.Emit(OrdinalEdgeRef{&b, "/kythe/edge/param", &a, 2});
+  EXPECT_EQ(4, replay.entries());
+  EXPECT_LT(0, replay.buffered_bytes());
+  LoggingOutputStream output;
+  replay.ReplayOnto(&output);
+  EXPECT_EQ(
+      "push\n"
+      "fact a /kythe/node/kind=file\n"
+      "content a /kythe/text=int x;\n"
+      "pop\n"
+      "push #corpus#a.h\n"
+      "edge a /kythe/edge/childof b\n"
+      "pop\n"
+      "edge b /kythe/edge/param.2 a\n",
+      output.log);
+  EXPECT_EQ(0, replay.entries());
+  EXPECT_EQ(0, replay.buffered_bytes());
+  LoggingOutputStream empty;
+  replay.ReplayOnto(&empty);
+  EXPECT_EQ("", empty.log);
+}
+
+}  // namespace
+}  // namespace kythe
+
+int main(int argc, char **argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,205 @@
+/*
+ * Copyright 2017 Google Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "kythe/cxx/common/indexing/sharding_output_stream.h"
+
+#include <cstring>
+
+#include "glog/logging.h"
+#include "google/protobuf/io/coded_stream.h"
+#include "google/protobuf/wire_format_lite.h"
+#include "kythe/cxx/common/indexing/buffer_digest.h"
+#include "kythe/cxx/common/indexing/entry_wire.h"
+
+namespace kythe {
+namespace {
+using google::protobuf::io::CodedInputStream;
+using google::protobuf::io::CodedOutputStream;
+using google::protobuf::internal::WireFormatLite;
+
+/// The number of bytes handed out by each call to `Next`.
+constexpr size_t kChunkSize = 64 * 1024;
+
+/// \brief Hashes `field`'s size (as a little-endian 64-bit integer) and then
+/// its content.
+void HashField(const std::string &field, Murmur3Hasher *hasher) {
+  unsigned char size[8];
+  uint64_t value = field.size();
+  for (size_t i = 0; i < sizeof(size); ++i) {
+    size[i] = static_cast<unsigned char>(value >> (8 * i));
+  }
+  hasher->Update(size, sizeof(size));
+  hasher->Update(field.data(), field.size());
+}
+}  // anonymous namespace
+
+bool ShardingOutputStream::SourceHash(llvm::StringRef entry, uint64_t *hash) {
+  CodedInputStream input(reinterpret_cast<const google::protobuf::uint8 *>(
+                             entry.data()),
+                         entry.size());
+  std::string source[5];
+  while (google::protobuf::uint32 tag = input.ReadTag()) {
+    bool ok = false;
+    if (WireFormatLite::GetTagFieldNumber(tag) == 1 &&
+        WireFormatLite::GetTagWireType(tag) ==
+            WireFormatLite::WIRETYPE_LENGTH_DELIMITED) {
+      ok = ReadVNameFields(&input, source);
+    } else {
+      ok = WireFormatLite::SkipField(&input, tag);
+    }
+    if (!ok) {
+      return false;
+    }
+  }
+  if (!input.ConsumedEntireMessage()) {
+    return false;
+  }
+  Murmur3Hasher hasher;
+  for (const auto &field : source) {
+    HashField(field, &hasher);
+  }
+  unsigned char digest[Murmur3Hasher::kDigestSize];
+  hasher.Final(digest);
+  *hash = 0;
+  for (size_t i = 0; i < sizeof(*hash); ++i) {
+    *hash |= static_cast<uint64_t>(digest[i]) << (8 * i);
+  }
+  return true;
+}
+
+bool ShardingOutputStream::FormatShardPath(const std::string &pattern,
+                                           size_t shard, std::string *path) {
+  path->clear();
+  size_t conversions = 0;
+  for (size_t i = 0; i < pattern.size(); ++i) {
+    if (pattern[i] != '%') {
+      path->push_back(pattern[i]);
+      continue;
+    }
+    if (++i < pattern.size() && pattern[i] == '%') {
+      path->push_back('%');
+      continue;
+    }
+    char pad = ' ';
+    if (i < pattern.size() && pattern[i] == '0') {
+      pad = '0';
+      ++i;
+    }
+    size_t width = 0;
+    while (i < pattern.size() && pattern[i] >= '0' && pattern[i] <= '9') {
+      width = width * 10 + (pattern[i] - '0');
+      if (width > 64) {
+        return false;
+      }
+      ++i;
+    }
+    if (i == pattern.size() || pattern[i] != 'd') {
+      return false;
+    }
+    std::string number = std::to_string(shard);
+    if (number.size() < width) {
+      path->append(width - number.size(), pad);
+    }
+    path->append(number);
+    ++conversions;
+  }
+  return conversions == 1;
+}
+
+ShardingOutputStream::ShardingOutputStream(
+    std::vector<google::protobuf::io::ZeroCopyOutputStream *> shards)
+    : shards_(std::move(shards)), entry_counts_(shards_.size(), 0) {
+  CHECK(!shards_.empty());
+}
+
+bool ShardingOutputStream::Next(void **data, int *size) {
+  if (closed_ || !ParsePending()) {
+    return false;
+  }
+  if (pending_.size() < pending_size_ + kChunkSize) {
+    pending_.resize(pending_size_ + kChunkSize);
+  }
+  *data = &pending_[pending_size_];
+  *size = kChunkSize;
+  pending_size_ += kChunkSize;
+  return true;
+}
+
+void ShardingOutputStream::BackUp(int count) { pending_size_ -= count; }
+
+google::protobuf::int64 ShardingOutputStream::ByteCount() const {
+  return parsed_bytes_ + pending_size_;
+}
+
+bool ShardingOutputStream::ParsePending() {
+  if (!error_.empty()) {
+    return false;
+  }
+  size_t offset = 0;
+  while (offset < pending_size_) {
+    CodedInputStream input(
+        reinterpret_cast<const google::protobuf::uint8 *>(pending_.data()) +
+            offset,
+        pending_size_ - offset);
+    google::protobuf::uint32 entry_size;
+    if (!input.ReadVarint32(&entry_size)) {
+      break;
+    }
+    size_t header_size = input.CurrentPosition();
+    if (pending_size_ - offset - header_size < entry_size) {
+      break;
+    }
+    llvm::StringRef entry(pending_.data() + offset + header_size, entry_size);
+    uint64_t hash;
+    if (!SourceHash(entry, &hash)) {
+      error_ = "Malformed entry at offset " +
+               std::to_string(parsed_bytes_ + offset);
+      return false;
+    }
+    size_t shard = hash % shards_.size();
+    {
+      CodedOutputStream coded_output(shards_[shard]);
+      coded_output.WriteRaw(pending_.data() + offset,
+                            header_size + entry_size);
+    }
+    ++entry_counts_[shard];
+    offset += header_size + entry_size;
+  }
+  if (offset != 0) {
+    std::memmove(&pending_[0], pending_.data() + offset,
+                 pending_size_ - offset);
+    pending_size_ -= offset;
+    parsed_bytes_ += offset;
+  }
+  return true;
+}
+
+bool ShardingOutputStream::Close(std::string *error_text) {
+  if (closed_) {
+    return true;
+  }
+  closed_ = true;
+  if (ParsePending() && pending_size_ != 0) {
+    error_ = "Truncated entry at offset " + std::to_string(parsed_bytes_);
+  }
+  if (!error_.empty()) {
+    *error_text = error_;
+    return false;
+  }
+  return true;
+}
+
+}  // namespace kythe
@@ -0,0 +1,88 @@
+/*
+ * Copyright 2017 Google Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef KYTHE_CXX_COMMON_INDEXING_SHARDING_OUTPUT_STREAM_H_
+#define KYTHE_CXX_COMMON_INDEXING_SHARDING_OUTPUT_STREAM_H_
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "google/protobuf/io/zero_copy_stream.h"
+#include "llvm/ADT/StringRef.h"
+
+namespace kythe {
+
+/// \brief Splits a stream of varint-delimited wire-format `Entry` messages
+/// (like the output of a `FileOutputStream`) between several streams.
+///
+/// Each entry goes to the shard picked by a hash of its source VName, so all
+/// of a node's facts and outgoing edges end up in the same shard. The hash
+/// depends only on the VName's fields, so it is the same from run to run and
+/// from host to host. Entries keep their relative order within a shard.
+class ShardingOutputStream : public google::protobuf::io::ZeroCopyOutputStream {
+ public:
+  /// \param shards The streams to which to write entries. Not owned. Must
+  /// not be empty.
+  explicit ShardingOutputStream(
+      std::vector<google::protobuf::io::ZeroCopyOutputStream *> shards);
+
+  bool Next(void **data, int *size) override;
+  void BackUp(int count) override;
+  google::protobuf::int64 ByteCount() const override;
+
+  /// \brief Writes out any entries still held by this stream. No more data
+  /// may be written after the stream is closed. The shards are not closed.
+  /// \return false if the input was malformed; `error_text` will say why.
+  bool Close(std::string *error_text);
+
+  /// \return the number of entries written to `shard` so far.
+  size_t entries_written(size_t shard) const { return entry_counts_[shard]; }
+
+  /// \brief Hashes the source VName of a wire-format `Entry`.
+  /// \return false if `entry` isn't a well-formed `Entry`.
+  static bool SourceHash(llvm::StringRef entry, uint64_t *hash);
+
+  /// \brief Substitutes `shard` into `pattern`, which must contain exactly
+  /// one integer conversion (like `%d` or `%05d`). `%%` stands for `%`.
+  /// \return false if `pattern` isn't a valid shard pattern.
+  static bool FormatShardPath(const std::string &pattern, size_t shard,
+                              std::string *path);
+
+ private:
+  /// \brief Writes the complete entries at the start of `pending_` to their
+  /// shards.
+  bool ParsePending();
+
+  /// The streams to write entries to.
+  std::vector<google::protobuf::io::ZeroCopyOutputStream *> shards_;
+  /// The number of entries written to each shard.
+  std::vector<size_t> entry_counts_;
+  /// Bytes written to this stream that haven't been routed yet.
+  std::string pending_;
+  /// The number of bytes of `pending_` that hold data.
+  size_t pending_size_ = 0;
+  /// The number of bytes routed out of `pending_` so far.
+  google::protobuf::int64 parsed_bytes_ = 0;
+  /// The first error encountered while writing, if any.
+  std::string error_;
+  /// Set once `Close` has been called.
+  bool closed_ = false;
+};
+
+}  // namespace kythe
+
+#endif  // KYTHE_CXX_COMMON_INDEXING_SHARDING_OUTPUT_STREAM_H_
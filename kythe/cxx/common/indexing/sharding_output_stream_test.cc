@@ -0,0 +1,208 @@
+/*
+ * Copyright 2017 Google Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "sharding_output_stream.h"
+
+#include <memory>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "KytheOutputStream.h"
+#include "google/protobuf/io/coded_stream.h"
+#include "google/protobuf/io/zero_copy_stream_impl_lite.h"
+#include "gtest/gtest.h"
+#include "kythe/proto/storage.pb.h"
+
+namespace kythe {
+namespace {
+
+/// \brief Splits a stream of entries into `shard_count` strings.
+class ShardedStrings {
+ public:
+  explicit ShardedStrings(size_t shard_count) : shards_(shard_count) {
+    std::vector<google::protobuf::io::ZeroCopyOutputStream *> streams;
+    for (auto &shard : shards_) {
+      raw_streams_.emplace_back(
+          new google::protobuf::io::StringOutputStream(&shard));
+      streams.push_back(raw_streams_.back().get());
+    }
+    stream_.reset(new ShardingOutputStream(streams));
+  }
+
+  ShardingOutputStream *stream() { return stream_.get(); }
+
+  /// \brief Closes the sharding stream and parses each shard's entries.
+  std::vector<std::vector<proto::Entry>> Finish() {
+    std::string error_text;
+    EXPECT_TRUE(stream_->Close(&error_text)) << error_text;
+    std::vector<size_t> counts;
+    for (size_t i = 0; i < shards_.size(); ++i) {
+      counts.push_back(stream_->entries_written(i));
+    }
+    stream_.reset();
+    raw_streams_.clear();
+    std::vector<std::vector<proto::Entry>> result(shards_.size());
+    for (size_t i = 0; i < shards_.size(); ++i) {
+      google::protobuf::io::CodedInputStream input(
+          reinterpret_cast<const google::protobuf::uint8 *>(shards_[i].data()),
+          shards_[i].size());
+      google::protobuf::uint32 size;
+      while (input.ReadVarint32(&size)) {
+        auto limit = input.PushLimit(size);
+        result[i].emplace_back();
+        EXPECT_TRUE(result[i].back().ParseFromCodedStream(&input));
+        input.PopLimit(limit);
+      }
+      EXPECT_EQ(counts[i], result[i].size());
+    }
+    return result;
+  }
+
+ private:
+  std::vector<std::string> shards_;
+  std::vector<std::unique_ptr<google::protobuf::io::StringOutputStream>>
+      raw_streams_;
+  std::unique_ptr<ShardingOutputStream> stream_;
+};
+
+TEST(ShardingOutputStream, KeepsSourcesTogether) {
+  ShardedStrings shards(4);
+  {
+    FileOutputStream stream(shards.stream());
+    for (int i = 0; i < 100; ++i) {
+      VNameRef source, target;
+      std::string signature = "node" + std::to_string(i % 20);
+      std::string value = std::to_string(i);
+      source.signature = signature;
+      source.corpus = "corpus";
+      target.signature = value;
+      stream.Emit(FactRef{&source, "/kythe/text", value});
+      stream.Emit(EdgeRef{&source, "/kythe/edge/ref", &target});
+    }
+  }
+  auto entries = shards.Finish();
+  std::set<std::string> seen;
+  size_t total = 0;
+  size_t used_shards = 0;
+  for (size_t i = 0; i < entries.size(); ++i) {
+    std::set<std::string> here;
+    int last_value = -1;
+    for (const auto &entry : entries[i]) {
+      here.insert(entry.source().signature());
+      if (entry.fact_name() == "/kythe/text") {
+        int value = std::stoi(entry.fact_value());
+        EXPECT_LT(last_value, value);
+        last_value = value;
+      }
+    }
+    for (const auto &signature : here) {
+      EXPECT_TRUE(seen.insert(signature).second) << signature;
+    }
+    total += entries[i].size();
+    used_shards += !entries[i].empty();
+  }
+  EXPECT_EQ(200, total);
+  EXPECT_EQ(20, seen.size());
+  EXPECT_LT(1, used_shards);
+}
+
+TEST(ShardingOutputStream, SourceHashIgnoresEncoding) {
+  proto::Entry fact;
+  fact.mutable_source()->set_signature("sig");
+  fact.mutable_source()->set_path("path");
+  fact.set_fact_name("/kythe/node/kind");
+  fact.set_fact_value("record");
+  proto::Entry edge;
+  *edge.mutable_source() = fact.source();
+  edge.set_edge_kind("/kythe/edge/childof");
+  edge.mutable_target()->set_signature("other");
+  edge.set_fact_name("/");
+  // The same source, with its fields written in reverse order.
+  std::string reversed;
+  {
+    google::protobuf::io::StringOutputStream raw_stream(&reversed);
+    google::protobuf::io::CodedOutputStream coded_stream(&raw_stream);
+    std::string source;
+    {
+      google::protobuf::io::StringOutputStream source_stream(&source);
+      google::protobuf::io::CodedOutputStream coded_source(&source_stream);
+      coded_source.WriteTag(4 << 3 | 2);
+      coded_source.WriteVarint32(4);
+      coded_source.WriteString("path");
+      coded_source.WriteTag(1 << 3 | 2);
+      coded_source.WriteVarint32(3);
+      coded_source.WriteString("sig");
+    }
+    coded_stream.WriteTag(4 << 3 | 2);
+    coded_stream.WriteVarint32(1);
+    coded_stream.WriteString("/");
+    coded_stream.WriteTag(1 << 3 | 2);
+    coded_stream.WriteVarint32(source.size());
+    coded_stream.WriteString(source);
+  }
+  uint64_t fact_hash, edge_hash, reversed_hash, other_hash;
+  ASSERT_TRUE(
+      ShardingOutputStream::SourceHash(fact.SerializeAsString(), &fact_hash));
+  ASSERT_TRUE(
+      ShardingOutputStream::SourceHash(edge.SerializeAsString(), &edge_hash));
+  ASSERT_TRUE(ShardingOutputStream::SourceHash(reversed, &reversed_hash));
+  fact.mutable_source()->set_path("other");
+  ASSERT_TRUE(
+      ShardingOutputStream::SourceHash(fact.SerializeAsString(), &other_hash));
+  EXPECT_EQ(fact_hash, edge_hash);
+  EXPECT_EQ(fact_hash, reversed_hash);
+  EXPECT_NE(fact_hash, other_hash);
+  EXPECT_FALSE(ShardingOutputStream::SourceHash("\x0a\x05", &fact_hash));
+}
+
+TEST(ShardingOutputStream, FormatsShardPaths) {
+  std::string path;
+  EXPECT_TRUE(
+      ShardingOutputStream::FormatShardPath("out-%05d-of-00064", 7, &path));
+  EXPECT_EQ("out-00007-of-00064", path);
+  EXPECT_TRUE(ShardingOutputStream::FormatShardPath("100%%-%d", 12, &path));
+  EXPECT_EQ("100%-12", path);
+  EXPECT_TRUE(ShardingOutputStream::FormatShardPath("%3d", 5, &path));
+  EXPECT_EQ("  5", path);
+  EXPECT_FALSE(ShardingOutputStream::FormatShardPath("out", 0, &path));
+  EXPECT_FALSE(ShardingOutputStream::FormatShardPath("%d-%d", 0, &path));
+  EXPECT_FALSE(ShardingOutputStream::FormatShardPath("%s", 0, &path));
+  EXPECT_FALSE(ShardingOutputStream::FormatShardPath("out%", 0, &path));
+}
+
+TEST(ShardingOutputStream, RejectsTruncatedInput) {
+  std::string out;
+  google::protobuf::io::StringOutputStream raw_stream(&out);
+  ShardingOutputStream sharded_stream({&raw_stream});
+  void *data;
+  int size;
+  ASSERT_TRUE(sharded_stream.Next(&data, &size));
+  static_cast<char *>(data)[0] = 10;
+  sharded_stream.BackUp(size - 1);
+  std::string error_text;
+  EXPECT_FALSE(sharded_stream.Close(&error_text));
+  EXPECT_NE(std::string::npos, error_text.find("Truncated"));
+}
+
+}  // namespace
+}  // namespace kythe
+
+int main(int argc, char **argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  int result = RUN_ALL_TESTS();
+  return result;
+}
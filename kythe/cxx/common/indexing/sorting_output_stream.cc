@@ -0,0 +1,343 @@
+/*
+ * Copyright 2017 Google Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "kythe/cxx/common/indexing/sorting_output_stream.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstring>
+#include <queue>
+
+#include "google/protobuf/io/coded_stream.h"
+#include "google/protobuf/io/zero_copy_stream_impl.h"
+#include "google/protobuf/wire_format_lite.h"
+#include "kythe/cxx/common/indexing/entry_wire.h"
+#include "llvm/ADT/SmallString.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Path.h"
+
+namespace kythe {
+namespace {
+using google::protobuf::io::CodedInputStream;
+using google::protobuf::io::CodedOutputStream;
+using google::protobuf::internal::WireFormatLite;
+
+/// The number of bytes handed out by each call to `Next`.
+constexpr size_t kChunkSize = 64 * 1024;
+
+/// \brief Appends `field` to `key` such that keys built from the same
+/// sequence of fields compare like the fields do. The encoding escapes NUL
+/// bytes as 00 FF and terminates each field with 00 01.
+void AppendKeyField(const std::string &field, std::string *key) {
+  for (char c : field) {
+    if (c == '\0') {
+      key->append("\0\xff", 2);
+    } else {
+      key->push_back(c);
+    }
+  }
+  key->append("\0\x01", 2);
+}
+}  // anonymous namespace
+
+bool SortingOutputStream::EntrySortKey(llvm::StringRef entry,
+                                       std::string *key) {
+  CodedInputStream input(reinterpret_cast<const google::protobuf::uint8 *>(
+                             entry.data()),
+                         entry.size());
+  std::string source[5], target[5], edge_kind, fact_name, fact_value;
+  while (google::protobuf::uint32 tag = input.ReadTag()) {
+    bool ok = false;
+    if (WireFormatLite::GetTagWireType(tag) !=
+        WireFormatLite::WIRETYPE_LENGTH_DELIMITED) {
+      ok = WireFormatLite::SkipField(&input, tag);
+    } else {
+      switch (WireFormatLite::GetTagFieldNumber(tag)) {
+        case 1:
+          ok = ReadVNameFields(&input, source);
+          break;
+        case 2:
+          ok = WireFormatLite::ReadString(&input, &edge_kind);
+          break;
+        case 3:
+          ok = ReadVNameFields(&input, target);
+          break;
+        case 4:
+          ok = WireFormatLite::ReadString(&input, &fact_name);
+          break;
+        case 5:
+          ok = WireFormatLite::ReadString(&input, &fact_value);
+          break;
+        default:
+          ok = WireFormatLite::SkipField(&input, tag);
+      }
+    }
+    if (!ok) {
+      return false;
+    }
+  }
+  if (!input.ConsumedEntireMessage()) {
+    return false;
+  }
+  key->clear();
+  for (const auto &field : source) {
+    AppendKeyField(field, key);
+  }
+  AppendKeyField(edge_kind, key);
+  AppendKeyField(fact_name, key);
+  for (const auto &field : target) {
+    AppendKeyField(field, key);
+  }
+  AppendKeyField(fact_value, key);
+  return true;
+}
+
+/// \brief Reads back the records in a spilled run.
+class SortingOutputStream::RunReader {
+ public:
+  /// \param path The run to read.
+  explicit RunReader(const std::string &path)
+      : fd_(::open(path.c_str(), O_RDONLY)), input_(fd_) {}
+  ~RunReader() {
+    if (fd_ >= 0) {
+      ::close(fd_);
+    }
+  }
+
+  /// \return false if the run couldn't be opened.
+  bool ok() const { return fd_ >= 0; }
+
+  /// \brief Reads the next record into `record()`.
+  /// \return false at the end of the run or on error (see `failed()`).
+  bool Next() {
+    CodedInputStream coded_input(&input_);
+    google::protobuf::uint32 data_size, key_size;
+    if (!coded_input.ReadVarint32(&data_size)) {
+      failed_ = coded_input.CurrentPosition() != 0;
+      return false;
+    }
+    if (!coded_input.ReadVarint32(&key_size) || key_size > data_size ||
+        !coded_input.ReadString(&record_.data, data_size)) {
+      failed_ = true;
+      return false;
+    }
+    record_.key_size = key_size;
+    return true;
+  }
+
+  /// \return the record most recently read by `Next`.
+  const Record &record() const { return record_; }
+
+  /// \return true if the run was malformed.
+  bool failed() const { return failed_; }
+
+ private:
+  /// The file holding the run.
+  int fd_;
+  /// Reads from `fd_`.
+  google::protobuf::io::FileInputStream input_;
+  /// The current record.
+  Record record_;
+  /// Whether the run was malformed.
+  bool failed_ = false;
+};
+
+SortingOutputStream::SortingOutputStream(
+    google::protobuf::io::ZeroCopyOutputStream *output,
+    size_t max_buffer_bytes, std::string temp_dir)
+    : output_(output),
+      max_buffer_bytes_(max_buffer_bytes),
+      temp_dir_(std::move(temp_dir)) {}
+
+SortingOutputStream::~SortingOutputStream() {
+  for (const auto &run : runs_) {
+    llvm::sys::fs::remove(run.path);
+  }
+}
+
+bool SortingOutputStream::Next(void **data, int *size) {
+  if (closed_ || !ParsePending()) {
+    return false;
+  }
+  if (pending_.size() < pending_size_ + kChunkSize) {
+    pending_.resize(pending_size_ + kChunkSize);
+  }
+  *data = &pending_[pending_size_];
+  *size = kChunkSize;
+  pending_size_ += kChunkSize;
+  return true;
+}
+
+void SortingOutputStream::BackUp(int count) { pending_size_ -= count; }
+
+google::protobuf::int64 SortingOutputStream::ByteCount() const {
+  return parsed_bytes_ + pending_size_;
+}
+
+bool SortingOutputStream::ParsePending() {
+  if (!error_.empty()) {
+    return false;
+  }
+  size_t offset = 0;
+  while (offset < pending_size_) {
+    CodedInputStream input(
+        reinterpret_cast<const google::protobuf::uint8 *>(pending_.data()) +
+            offset,
+        pending_size_ - offset);
+    google::protobuf::uint32 entry_size;
+    if (!input.ReadVarint32(&entry_size)) {
+      break;
+    }
+    size_t header_size = input.CurrentPosition();
+    if (pending_size_ - offset - header_size < entry_size) {
+      break;
+    }
+    llvm::StringRef entry(pending_.data() + offset + header_size, entry_size);
+    Record record;
+    if (!EntrySortKey(entry, &record.data)) {
+      error_ = "Malformed entry at offset " +
+               std::to_string(parsed_bytes_ + offset);
+      return false;
+    }
+    record.key_size = record.data.size();
+    record.data.append(entry.data(), entry.size());
+    buffered_bytes_ += record.data.size();
+    records_.push_back(std::move(record));
+    offset += header_size + entry_size;
+    if (buffered_bytes_ >= max_buffer_bytes_ && !Spill()) {
+      return false;
+    }
+  }
+  if (offset != 0) {
+    std::memmove(&pending_[0], pending_.data() + offset,
+                 pending_size_ - offset);
+    pending_size_ -= offset;
+    parsed_bytes_ += offset;
+  }
+  return true;
+}
+
+void SortingOutputStream::SortRecords() {
+  std::sort(records_.begin(), records_.end(),
+            [](const Record &a, const Record &b) { return a.data < b.data; });
+  records_.erase(std::unique(records_.begin(), records_.end(),
+                             [](const Record &a, const Record &b) {
+                               return a.key() == b.key();
+                             }),
+                 records_.end());
+}
+
+bool SortingOutputStream::Spill() {
+  SortRecords();
+  int fd = -1;
+  llvm::SmallString<256> path;
+  std::error_code error =
+      temp_dir_.empty()
+          ? llvm::sys::fs::createTemporaryFile("kythe_sort", "run", fd, path)
+          : llvm::sys::fs::createUniqueFile(
+                temp_dir_ + "/kythe_sort-%%%%%%%%.run", fd, path);
+  if (error) {
+    error_ = "Couldn't create a run file: " + error.message();
+    return false;
+  }
+  runs_.push_back({std::string(path.begin(), path.end())});
+  {
+    google::protobuf::io::FileOutputStream file_output(fd);
+    {
+      CodedOutputStream coded_output(&file_output);
+      for (const auto &record : records_) {
+        coded_output.WriteVarint32(record.data.size());
+        coded_output.WriteVarint32(record.key_size);
+        coded_output.WriteString(record.data);
+      }
+    }
+    if (!file_output.Close()) {
+      error_ = "Couldn't write " + runs_.back().path;
+      return false;
+    }
+  }
+  records_.clear();
+  buffered_bytes_ = 0;
+  return true;
+}
+
+void SortingOutputStream::WriteEntry(llvm::StringRef entry) {
+  CodedOutputStream coded_output(output_);
+  coded_output.WriteVarint32(entry.size());
+  coded_output.WriteRaw(entry.data(), entry.size());
+}
+
+bool SortingOutputStream::Close(std::string *error_text) {
+  if (closed_) {
+    return true;
+  }
+  closed_ = true;
+  if (ParsePending() && pending_size_ != 0) {
+    error_ = "Truncated entry at offset " + std::to_string(parsed_bytes_);
+  }
+  if (error_.empty() && runs_.empty()) {
+    SortRecords();
+    for (const auto &record : records_) {
+      WriteEntry(record.entry());
+    }
+    records_.clear();
+  } else if (error_.empty() && (records_.empty() || Spill())) {
+    std::vector<std::unique_ptr<RunReader>> readers;
+    auto later = [](const RunReader *a, const RunReader *b) {
+      return a->record().data > b->record().data;
+    };
+    std::priority_queue<RunReader *, std::vector<RunReader *>, decltype(later)>
+        heads(later);
+    for (const auto &run : runs_) {
+      readers.push_back(llvm::make_unique<RunReader>(run.path));
+      if (!readers.back()->ok()) {
+        error_ = "Couldn't open " + run.path;
+        break;
+      }
+      if (readers.back()->Next()) {
+        heads.push(readers.back().get());
+      }
+    }
+    std::string last_key;
+    bool wrote_any = false;
+    while (error_.empty() && !heads.empty()) {
+      RunReader *head = heads.top();
+      heads.pop();
+      if (!wrote_any || head->record().key() != last_key) {
+        WriteEntry(head->record().entry());
+        last_key = head->record().key();
+        wrote_any = true;
+      }
+      if (head->Next()) {
+        heads.push(head);
+      }
+    }
+    for (size_t i = 0; i < readers.size(); ++i) {
+      if (readers[i]->failed()) {
+        error_ = "Couldn't read " + runs_[i].path;
+      }
+    }
+  }
+  if (!error_.empty()) {
+    *error_text = error_;
+    return false;
+  }
+  return true;
+}
+
+}  // namespace kythe
@@ -0,0 +1,132 @@
+/*
+ * Copyright 2017 Google Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef KYTHE_CXX_COMMON_INDEXING_SORTING_OUTPUT_STREAM_H_
+#define KYTHE_CXX_COMMON_INDEXING_SORTING_OUTPUT_STREAM_H_
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "google/protobuf/io/zero_copy_stream.h"
+#include "llvm/ADT/StringRef.h"
+
+namespace kythe {
+
+/// \brief Sorts and deduplicates a stream of varint-delimited wire-format
+/// `Entry` messages (like the output of a `FileOutputStream`) with bounded
+/// memory.
+///
+/// Entries are written in GraphStore order: by source, edge kind, fact name,
+/// target (comparing VNames by signature, corpus, root, path and language)
+/// and finally fact value. Identical entries are written once. Entries are
+/// held in memory until they take up `max_buffer_bytes`; then they are
+/// sorted and spilled to a temporary file. `Close` merges the spilled runs
+/// with whatever is left in memory and writes the result to the underlying
+/// stream.
+class SortingOutputStream : public google::protobuf::io::ZeroCopyOutputStream {
+ public:
+  /// \param output The stream to which to write sorted entries. Not owned.
+  /// \param max_buffer_bytes The amount of entry data to hold in memory.
+  /// \param temp_dir The directory for spilled runs, or empty to use the
+  /// system's temporary directory.
+  SortingOutputStream(google::protobuf::io::ZeroCopyOutputStream *output,
+                      size_t max_buffer_bytes, std::string temp_dir = "");
+
+  /// \brief Removes any spilled runs. Does not call `Close()`.
+  ~SortingOutputStream() override;
+
+  bool Next(void **data, int *size) override;
+  void BackUp(int count) override;
+  google::protobuf::int64 ByteCount() const override;
+
+  /// \brief Writes the sorted entries to the underlying stream. No more data
+  /// may be written after the stream is closed.
+  /// \return false if the input was malformed or a spilled run couldn't be
+  /// written or read; `error_text` will say why.
+  bool Close(std::string *error_text);
+
+  /// \return the number of runs spilled to disk so far.
+  size_t runs_spilled() const { return runs_.size(); }
+
+  /// \brief Computes a key for an entry such that comparing keys bytewise
+  /// compares entries in GraphStore order. No key is a prefix of another.
+  /// \return false if `entry` isn't a well-formed `Entry`.
+  static bool EntrySortKey(llvm::StringRef entry, std::string *key);
+
+ private:
+  /// \brief An entry together with its sort key.
+  struct Record {
+    /// The sort key followed by the entry.
+    std::string data;
+    /// The size of the key at the start of `data`.
+    size_t key_size;
+    llvm::StringRef key() const {
+      return llvm::StringRef(data).take_front(key_size);
+    }
+    llvm::StringRef entry() const {
+      return llvm::StringRef(data).drop_front(key_size);
+    }
+  };
+
+  /// \brief A sorted run spilled to disk.
+  struct Run {
+    /// The path of the file holding the run.
+    std::string path;
+  };
+
+  class RunReader;
+
+  /// \brief Moves the complete entries at the start of `pending_` into
+  /// `records_`, spilling if the buffer fills up.
+  bool ParsePending();
+
+  /// \brief Sorts and deduplicates `records_`.
+  void SortRecords();
+
+  /// \brief Sorts `records_` and writes them to a new run.
+  bool Spill();
+
+  /// \brief Writes a delimited entry to `output_`.
+  void WriteEntry(llvm::StringRef entry);
+
+  /// The stream to write sorted entries to.
+  google::protobuf::io::ZeroCopyOutputStream *output_;
+  /// The amount of record data to hold in `records_`.
+  size_t max_buffer_bytes_;
+  /// Where to spill runs.
+  std::string temp_dir_;
+  /// Bytes written to this stream that haven't been parsed into records yet.
+  std::string pending_;
+  /// The number of bytes of `pending_` that hold data.
+  size_t pending_size_ = 0;
+  /// The number of bytes parsed out of `pending_` so far.
+  google::protobuf::int64 parsed_bytes_ = 0;
+  /// Entries that haven't been spilled yet.
+  std::vector<Record> records_;
+  /// The total size of `records_`' data.
+  size_t buffered_bytes_ = 0;
+  /// Runs that have been spilled.
+  std::vector<Run> runs_;
+  /// The first error encountered while writing, if any.
+  std::string error_;
+  /// Set once `Close` has been called.
+  bool closed_ = false;
+};
+
+}  // namespace kythe
+
+#endif  // KYTHE_CXX_COMMON_INDEXING_SORTING_OUTPUT_STREAM_H_
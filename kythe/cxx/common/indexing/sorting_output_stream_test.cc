@@ -0,0 +1,170 @@
+/*
+ * Copyright 2017 Google Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "sorting_output_stream.h"
+
+#include <string>
+#include <vector>
+
+#include "KytheOutputStream.h"
+#include "google/protobuf/io/coded_stream.h"
+#include "google/protobuf/io/zero_copy_stream_impl_lite.h"
+#include "gtest/gtest.h"
+#include "kythe/proto/storage.pb.h"
+
+namespace kythe {
+namespace {
+
+/// \return an entry with the given source signature, fact name and value.
+proto::Entry MakeFact(const std::string &signature, const std::string &name,
+                      const std::string &value) {
+  proto::Entry entry;
+  entry.mutable_source()->set_signature(signature);
+  entry.set_fact_name(name);
+  entry.set_fact_value(value);
+  return entry;
+}
+
+/// \brief Writes `entries` through a `SortingOutputStream` that holds at
+/// most `buffer_bytes` in memory.
+/// \return the entries that were written to the underlying stream.
+std::vector<proto::Entry> SortEntries(const std::vector<proto::Entry> &entries,
+                                      size_t buffer_bytes,
+                                      size_t *runs_spilled) {
+  std::string out;
+  {
+    google::protobuf::io::StringOutputStream raw_stream(&out);
+    SortingOutputStream sorted_stream(&raw_stream, buffer_bytes);
+    {
+      google::protobuf::io::CodedOutputStream coded_stream(&sorted_stream);
+      for (const auto &entry : entries) {
+        coded_stream.WriteVarint32(entry.ByteSize());
+        entry.SerializeWithCachedSizes(&coded_stream);
+      }
+    }
+    std::string error_text;
+    EXPECT_TRUE(sorted_stream.Close(&error_text)) << error_text;
+    *runs_spilled = sorted_stream.runs_spilled();
+  }
+  std::vector<proto::Entry> result;
+  google::protobuf::io::CodedInputStream input(
+      reinterpret_cast<const google::protobuf::uint8 *>(out.data()),
+      out.size());
+  google::protobuf::uint32 size;
+  while (input.ReadVarint32(&size)) {
+    auto limit = input.PushLimit(size);
+    result.emplace_back();
+    EXPECT_TRUE(result.back().ParseFromCodedStream(&input));
+    input.PopLimit(limit);
+  }
+  return result;
+}
+
+std::vector<proto::Entry> ShuffledEntries() {
+  std::vector<proto::Entry> entries;
+  for (int i = 0; i < 50; ++i) {
+    int n = (i * 37) % 50;
+    entries.push_back(MakeFact("node" + std::to_string(n / 10), "/kythe/fact",
+                               std::to_string(n % 10)));
+    entries.push_back(entries.back());
+  }
+  return entries;
+}
+
+void ExpectSortedAndUnique(const std::vector<proto::Entry> &entries) {
+  ASSERT_EQ(50, entries.size());
+  for (int i = 0; i < 50; ++i) {
+    EXPECT_EQ("node" + std::to_string(i / 10), entries[i].source().signature());
+    EXPECT_EQ(std::to_string(i % 10), entries[i].fact_value());
+  }
+}
+
+TEST(SortingOutputStream, SortsInMemory) {
+  size_t runs = 0;
+  ExpectSortedAndUnique(SortEntries(ShuffledEntries(), 1 << 20, &runs));
+  EXPECT_EQ(0, runs);
+}
+
+TEST(SortingOutputStream, SortsSpilledRuns) {
+  size_t runs = 0;
+  ExpectSortedAndUnique(SortEntries(ShuffledEntries(), 256, &runs));
+  EXPECT_LT(1, runs);
+}
+
+TEST(SortingOutputStream, UsesGraphStoreOrder) {
+  proto::Entry edge;
+  edge.mutable_source()->set_signature("a");
+  edge.set_edge_kind("/kythe/edge/ref");
+  edge.mutable_target()->set_signature("b");
+  edge.set_fact_name("/");
+  proto::Entry fact = MakeFact("a", "/kythe/node/kind", "anchor");
+  proto::Entry other_corpus = fact;
+  other_corpus.mutable_source()->set_corpus("c");
+  proto::Entry longer_signature = MakeFact("aa", "/", "");
+  size_t runs = 0;
+  auto sorted =
+      SortEntries({longer_signature, other_corpus, edge, fact}, 1 << 20, &runs);
+  ASSERT_EQ(4, sorted.size());
+  EXPECT_EQ(fact.DebugString(), sorted[0].DebugString());
+  EXPECT_EQ(edge.DebugString(), sorted[1].DebugString());
+  EXPECT_EQ(other_corpus.DebugString(), sorted[2].DebugString());
+  EXPECT_EQ(longer_signature.DebugString(), sorted[3].DebugString());
+}
+
+TEST(SortingOutputStream, WorksBelowFileOutputStream) {
+  std::string out;
+  {
+    google::protobuf::io::StringOutputStream raw_stream(&out);
+    SortingOutputStream sorted_stream(&raw_stream, 64);
+    {
+      FileOutputStream stream(&sorted_stream);
+      VNameRef second, first;
+      second.signature = "2";
+      first.signature = "1";
+      stream.Emit(FactRef{&second, "/kythe/text", "two"});
+      stream.Emit(FactRef{&first, "/kythe/text", "one"});
+      stream.Emit(FactRef{&second, "/kythe/text", "two"});
+    }
+    std::string error_text;
+    EXPECT_TRUE(sorted_stream.Close(&error_text)) << error_text;
+  }
+  EXPECT_NE(std::string::npos, out.find("one"));
+  EXPECT_LT(out.find("one"), out.find("two"));
+  EXPECT_EQ(out.find("two"), out.rfind("two"));
+}
+
+TEST(SortingOutputStream, RejectsTruncatedInput) {
+  std::string out;
+  google::protobuf::io::StringOutputStream raw_stream(&out);
+  SortingOutputStream sorted_stream(&raw_stream, 1 << 20);
+  void *data;
+  int size;
+  ASSERT_TRUE(sorted_stream.Next(&data, &size));
+  static_cast<char *>(data)[0] = 10;
+  sorted_stream.BackUp(size - 1);
+  std::string error_text;
+  EXPECT_FALSE(sorted_stream.Close(&error_text));
+  EXPECT_NE(std::string::npos, error_text.find("Truncated"));
+}
+
+}  // namespace
+}  // namespace kythe
+
+int main(int argc, char **argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  int result = RUN_ALL_TESTS();
+  return result;
+}
@@ -0,0 +1,240 @@
+/*
+ * Copyright 2017 Google Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "kythe/cxx/common/indexing/work_queue.h"
+
+#include <openssl/sha.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <algorithm>
+
+#include "kythe/cxx/common/indexing/memcached_pool.h"
+
+namespace kythe {
+
+MemcachedWorkLeaseStore::MemcachedWorkLeaseStore(
+    std::unique_ptr<MemcachedPool> pool, const std::string &run,
+    const std::string &owner)
+    : pool_(std::move(pool)), run_(run), owner_(owner) {}
+
+MemcachedWorkLeaseStore::~MemcachedWorkLeaseStore() {}
+
+std::string MemcachedWorkLeaseStore::Key(const std::string &unit,
+                                         const char *suffix) const {
+  std::string name = run_;
+  name.push_back('\0');
+  name.append(unit);
+  unsigned char hash[SHA256_DIGEST_LENGTH];
+  ::SHA256(reinterpret_cast<const unsigned char *>(name.data()), name.size(),
+           hash);
+  static const char kHexDigits[] = "0123456789abcdef";
+  std::string key = "kythe_work:";
+  for (unsigned char byte : hash) {
+    key.push_back(kHexDigits[byte >> 4]);
+    key.push_back(kHexDigits[byte & 0xf]);
+  }
+  key.append(suffix);
+  return key;
+}
+
+WorkLeaseStore::Result MemcachedWorkLeaseStore::Acquire(
+    const std::string &unit, uint32_t ttl_s) {
+  if (!pool_->Admit()) {
+    return Result::kError;
+  }
+  const std::string done_key = Key(unit, ":done");
+  auto start = MemcachedPool::Clock::now();
+  size_t value_length;
+  uint32_t flags;
+  memcached_return_t get_result;
+  char *value = memcached_get(pool_->handle(), done_key.data(),
+                              done_key.size(), &value_length, &flags,
+                              &get_result);
+  free(value);
+  if (!pool_->Record(MemcachedPool::kGet, start, get_result)) {
+    fprintf(stderr, "memcached get failed: %s\n",
+            memcached_strerror(pool_->handle(), get_result));
+    return Result::kError;
+  }
+  if (get_result == MEMCACHED_SUCCESS) {
+    return Result::kDone;
+  }
+  if (!pool_->Admit()) {
+    return Result::kError;
+  }
+  const std::string lease_key = Key(unit, ":lease");
+  start = MemcachedPool::Clock::now();
+  memcached_return_t add_result =
+      memcached_add(pool_->handle(), lease_key.data(), lease_key.size(),
+                    owner_.data(), owner_.size(), ttl_s, 0);
+  if (!pool_->Record(MemcachedPool::kAdd, start, add_result)) {
+    fprintf(stderr, "memcached add failed: %s\n",
+            memcached_strerror(pool_->handle(), add_result));
+    return Result::kError;
+  }
+  // The text protocol says NOTSTORED; the binary protocol says DATA_EXISTS.
+  return add_result == MEMCACHED_NOTSTORED ||
+                 add_result == MEMCACHED_DATA_EXISTS
+             ? Result::kHeld
+             : Result::kAcquired;
+}
+
+bool MemcachedWorkLeaseStore::Renew(const std::string &unit, uint32_t ttl_s) {
+  if (!pool_->Admit()) {
+    return false;
+  }
+  const std::string lease_key = Key(unit, ":lease");
+  auto start = MemcachedPool::Clock::now();
+  memcached_return_t set_result =
+      memcached_set(pool_->handle(), lease_key.data(), lease_key.size(),
+                    owner_.data(), owner_.size(), ttl_s, 0);
+  return pool_->Record(MemcachedPool::kAdd, start, set_result);
+}
+
+bool MemcachedWorkLeaseStore::Finish(const std::string &unit) {
+  if (!pool_->Admit()) {
+    return false;
+  }
+  const std::string done_key = Key(unit, ":done");
+  auto start = MemcachedPool::Clock::now();
+  memcached_return_t set_result =
+      memcached_set(pool_->handle(), done_key.data(), done_key.size(),
+                    owner_.data(), owner_.size(), 0, 0);
+  if (!pool_->Record(MemcachedPool::kAdd, start, set_result)) {
+    fprintf(stderr, "memcached set failed: %s\n",
+            memcached_strerror(pool_->handle(), set_result));
+    return false;
+  }
+  // The done key is what counts; a lease left behind just lapses.
+  const std::string lease_key = Key(unit, ":lease");
+  start = MemcachedPool::Clock::now();
+  pool_->Record(
+      MemcachedPool::kAdd, start,
+      memcached_delete(pool_->handle(), lease_key.data(), lease_key.size(), 0));
+  return true;
+}
+
+LeasedWorkQueue::LeasedWorkQueue(std::vector<std::string> units,
+                                 std::unique_ptr<WorkLeaseStore> store,
+                                 const Options &options)
+    : units_(std::move(units)),
+      options_(options),
+      store_(std::move(store)),
+      seen_held_(units_.size(), false) {
+  for (size_t offset = 0; offset < units_.size(); ++offset) {
+    pending_.push_back((options_.start + offset) % units_.size());
+  }
+  renewer_ = std::thread([this] { RenewLeases(); });
+}
+
+LeasedWorkQueue::~LeasedWorkQueue() {
+  Stop();
+  renewer_.join();
+}
+
+void LeasedWorkQueue::Stop() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stopping_ = true;
+  }
+  stop_.notify_all();
+}
+
+bool LeasedWorkQueue::Next(size_t *index) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (!stopping_) {
+    while (!pending_.empty()) {
+      size_t unit = pending_.front();
+      pending_.pop_front();
+      switch (store_->Acquire(units_[unit], options_.lease_ttl_s)) {
+        case WorkLeaseStore::Result::kAcquired:
+          ++stats_.acquired;
+          if (seen_held_[unit]) {
+            ++stats_.taken_over;
+          }
+          leased_[unit] = Clock::now();
+          *index = unit;
+          return true;
+        case WorkLeaseStore::Result::kHeld:
+          seen_held_[unit] = true;
+          held_.push_back(unit);
+          break;
+        case WorkLeaseStore::Result::kDone:
+          ++stats_.done_elsewhere;
+          break;
+        case WorkLeaseStore::Result::kError:
+          if (options_.lease_when_unavailable) {
+            ++stats_.unavailable;
+            *index = unit;
+            return true;
+          }
+          held_.push_back(unit);
+          break;
+      }
+    }
+    if (held_.empty()) {
+      return false;
+    }
+    // Everything left is held elsewhere. Wait for those indexers to finish
+    // or for their leases to lapse.
+    ++stats_.waits;
+    stop_.wait_for(lock, std::chrono::milliseconds(options_.poll_ms),
+                   [this] { return stopping_; });
+    pending_.swap(held_);
+  }
+  return false;
+}
+
+void LeasedWorkQueue::Finish(size_t index) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  leased_.erase(index);
+  if (!store_->Finish(units_[index])) {
+    fprintf(stderr, "Couldn't mark %s as finished.\n", units_[index].c_str());
+  }
+}
+
+void LeasedWorkQueue::Release(size_t index) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  leased_.erase(index);
+}
+
+LeasedWorkQueue::Stats LeasedWorkQueue::stats() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return stats_;
+}
+
+void LeasedWorkQueue::RenewLeases() {
+  const auto period =
+      std::chrono::milliseconds(std::max<uint64_t>(options_.lease_ttl_s, 3) *
+                                1000 / 3);
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (!stop_.wait_for(lock, period, [this] { return stopping_; })) {
+    const auto now = Clock::now();
+    for (const auto &lease : leased_) {
+      if (options_.max_lease_s != 0 &&
+          now - lease.second >= std::chrono::seconds(options_.max_lease_s)) {
+        continue;
+      }
+      if (!store_->Renew(units_[lease.first], options_.lease_ttl_s)) {
+        fprintf(stderr, "Couldn't renew the lease on %s.\n",
+                units_[lease.first].c_str());
+      }
+    }
+  }
+}
+
+}  // namespace kythe
@@ -0,0 +1,179 @@
+/*
+ * Copyright 2017 Google Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef KYTHE_CXX_COMMON_INDEXING_WORK_QUEUE_H_
+#define KYTHE_CXX_COMMON_INDEXING_WORK_QUEUE_H_
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+namespace kythe {
+
+class MemcachedPool;
+
+/// \brief Records which of a list of units shared by many indexers have
+/// been leased or finished.
+///
+/// A lease lapses unless it is renewed, so units leased by an indexer that
+/// died or stalled are handed out again.
+class WorkLeaseStore {
+ public:
+  enum class Result {
+    kAcquired,  ///< The unit is now leased to the caller.
+    kHeld,      ///< Someone else holds a lease on the unit.
+    kDone,      ///< The unit has been finished.
+    kError      ///< The store couldn't be reached.
+  };
+  virtual ~WorkLeaseStore() = default;
+  /// \brief Tries to lease `unit` for `ttl_s` seconds.
+  virtual Result Acquire(const std::string &unit, uint32_t ttl_s) = 0;
+  /// \brief Extends the caller's lease on `unit` to `ttl_s` seconds from now.
+  /// \return false if the store couldn't be reached.
+  virtual bool Renew(const std::string &unit, uint32_t ttl_s) = 0;
+  /// \brief Marks `unit` as finished and drops its lease.
+  /// \return false if the store couldn't be reached.
+  virtual bool Finish(const std::string &unit) = 0;
+};
+
+/// \brief Keeps work leases in memcache.
+///
+/// Each unit has a lease key, added with the lease's time to live (so only
+/// one indexer can hold it), and a done key. Keys are hashed from the run
+/// name and the unit, so any unit name can be used. Not thread-safe.
+class MemcachedWorkLeaseStore : public WorkLeaseStore {
+ public:
+  /// \param pool An open pool.
+  /// \param run Names this run, so that units in it don't collide with the
+  /// same units in other runs. Every indexer in the run must use the same
+  /// name.
+  /// \param owner Identifies the caller in the leases it holds.
+  MemcachedWorkLeaseStore(std::unique_ptr<MemcachedPool> pool,
+                          const std::string &run, const std::string &owner);
+  ~MemcachedWorkLeaseStore() override;
+  Result Acquire(const std::string &unit, uint32_t ttl_s) override;
+  bool Renew(const std::string &unit, uint32_t ttl_s) override;
+  bool Finish(const std::string &unit) override;
+
+ private:
+  /// \return the key for `unit` ending in `suffix`.
+  std::string Key(const std::string &unit, const char *suffix) const;
+
+  std::unique_ptr<MemcachedPool> pool_;
+  const std::string run_;
+  const std::string owner_;
+};
+
+/// \brief Hands out units from a list shared by many indexers, taking a
+/// lease on each from a `WorkLeaseStore` first.
+///
+/// Each indexer makes a pass over the list (starting wherever it likes, so
+/// that indexers spread out), taking the units nobody else holds. Units that
+/// were held are tried again every `poll_ms` until they are finished or
+/// their leases lapse. Leases on units that have been handed out are renewed
+/// on a background thread until they are finished or have been held for
+/// `max_lease_s`; after that, an idle indexer may take them over. Thread-safe.
+class LeasedWorkQueue {
+ public:
+  struct Options {
+    /// How long a lease lasts without being renewed, in seconds.
+    uint32_t lease_ttl_s = 600;
+    /// If nonzero, stop renewing a lease after this many seconds, so that
+    /// a straggling unit is handed to another indexer as well.
+    uint32_t max_lease_s = 0;
+    /// How long to wait before trying units held by others again.
+    uint64_t poll_ms = 5000;
+    /// The position in the list at which to start.
+    size_t start = 0;
+    /// Whether to take units when the store can't be reached (indexing
+    /// them here as well as anywhere else) rather than skipping them.
+    bool lease_when_unavailable = true;
+  };
+
+  struct Stats {
+    /// Units leased to this indexer.
+    size_t acquired = 0;
+    /// Units leased after they had been seen held by someone else.
+    size_t taken_over = 0;
+    /// Units found finished by someone else.
+    size_t done_elsewhere = 0;
+    /// Units taken because the store couldn't be reached.
+    size_t unavailable = 0;
+    /// Times spent waiting for units held by others.
+    size_t waits = 0;
+  };
+
+  /// \param units The names of the units, identical for every indexer.
+  LeasedWorkQueue(std::vector<std::string> units,
+                  std::unique_ptr<WorkLeaseStore> store,
+                  const Options &options);
+  ~LeasedWorkQueue();
+
+  /// \brief Blocks until a unit has been leased to this indexer.
+  /// \param index Set to the unit's position in the list.
+  /// \return false once every unit has been finished (or handed out here).
+  bool Next(size_t *index);
+
+  /// \brief Marks the unit at `index` as finished.
+  void Finish(size_t index);
+
+  /// \brief Stops renewing the lease on the unit at `index` without
+  /// finishing it, so that another indexer can retry the unit once the lease
+  /// lapses.
+  void Release(size_t index);
+
+  /// \brief Makes `Next` return false from now on.
+  void Stop();
+
+  Stats stats() const;
+
+ private:
+  using Clock = std::chrono::steady_clock;
+
+  /// \brief Renews the leases in `leased_` until we're stopping.
+  void RenewLeases();
+
+  const std::vector<std::string> units_;
+  const Options options_;
+  /// Guards the members below.
+  mutable std::mutex mutex_;
+  /// Signaled when we're stopping.
+  std::condition_variable stop_;
+  std::unique_ptr<WorkLeaseStore> store_;
+  /// Units to try in this pass.
+  std::deque<size_t> pending_;
+  /// Units that were held by others in this pass.
+  std::deque<size_t> held_;
+  /// Units that have been seen held by others.
+  std::vector<bool> seen_held_;
+  /// Units leased here but not finished, and when they were leased.
+  std::unordered_map<size_t, Clock::time_point> leased_;
+  Stats stats_;
+  bool stopping_ = false;
+  /// Runs `RenewLeases`.
+  std::thread renewer_;
+};
+
+}  // namespace kythe
+
+#endif  // KYTHE_CXX_COMMON_INDEXING_WORK_QUEUE_H_
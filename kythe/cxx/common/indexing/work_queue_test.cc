@@ -0,0 +1,223 @@
+/*
+ * Copyright 2017 Google Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "kythe/cxx/common/indexing/work_queue.h"
+
+#include <map>
+#include <set>
+
+#include "gtest/gtest.h"
+#include "llvm/ADT/STLExtras.h"
+
+namespace kythe {
+namespace {
+
+/// \brief Lease state shared by several `FakeLeaseStore`s.
+struct FakeLeases {
+  std::mutex mutex;
+  /// Maps leased units to their owners.
+  std::map<std::string, int> leases;
+  std::set<std::string> done;
+  /// Whether the store is reachable.
+  bool available = true;
+};
+
+class FakeLeaseStore : public WorkLeaseStore {
+ public:
+  FakeLeaseStore(FakeLeases *leases, int owner)
+      : leases_(leases), owner_(owner) {}
+  Result Acquire(const std::string &unit, uint32_t ttl_s) override {
+    std::lock_guard<std::mutex> lock(leases_->mutex);
+    if (!leases_->available) {
+      return Result::kError;
+    }
+    if (leases_->done.count(unit)) {
+      return Result::kDone;
+    }
+    return leases_->leases.emplace(unit, owner_).second ? Result::kAcquired
+                                                        : Result::kHeld;
+  }
+  bool Renew(const std::string &unit, uint32_t ttl_s) override {
+    std::lock_guard<std::mutex> lock(leases_->mutex);
+    return leases_->available;
+  }
+  bool Finish(const std::string &unit) override {
+    std::lock_guard<std::mutex> lock(leases_->mutex);
+    if (!leases_->available) {
+      return false;
+    }
+    leases_->done.insert(unit);
+    leases_->leases.erase(unit);
+    return true;
+  }
+
+ private:
+  FakeLeases *leases_;
+  int owner_;
+};
+
+LeasedWorkQueue::Options FastOptions(size_t start) {
+  LeasedWorkQueue::Options options;
+  options.poll_ms = 1;
+  options.start = start;
+  return options;
+}
+
+TEST(LeasedWorkQueueTest, HandsOutEachUnitOnce) {
+  FakeLeases leases;
+  LeasedWorkQueue queue({"a", "b", "c"},
+                        llvm::make_unique<FakeLeaseStore>(&leases, 1),
+                        FastOptions(1));
+  size_t index;
+  ASSERT_TRUE(queue.Next(&index));
+  EXPECT_EQ(1, index);
+  queue.Finish(index);
+  ASSERT_TRUE(queue.Next(&index));
+  EXPECT_EQ(2, index);
+  queue.Finish(index);
+  ASSERT_TRUE(queue.Next(&index));
+  EXPECT_EQ(0, index);
+  queue.Finish(index);
+  EXPECT_FALSE(queue.Next(&index));
+  EXPECT_EQ(3, queue.stats().acquired);
+  EXPECT_EQ(3, leases.done.size());
+}
+
+TEST(LeasedWorkQueueTest, SkipsUnitsFinishedElsewhere) {
+  FakeLeases leases;
+  leases.done.insert("a");
+  LeasedWorkQueue queue({"a", "b"},
+                        llvm::make_unique<FakeLeaseStore>(&leases, 1),
+                        FastOptions(0));
+  size_t index;
+  ASSERT_TRUE(queue.Next(&index));
+  EXPECT_EQ(1, index);
+  queue.Finish(index);
+  EXPECT_FALSE(queue.Next(&index));
+  EXPECT_EQ(1, queue.stats().done_elsewhere);
+}
+
+TEST(LeasedWorkQueueTest, SplitsUnitsBetweenQueues) {
+  FakeLeases leases;
+  std::vector<std::string> units = {"a", "b", "c", "d"};
+  LeasedWorkQueue first(units, llvm::make_unique<FakeLeaseStore>(&leases, 1),
+                        FastOptions(0));
+  LeasedWorkQueue second(units, llvm::make_unique<FakeLeaseStore>(&leases, 2),
+                         FastOptions(2));
+  size_t index;
+  ASSERT_TRUE(first.Next(&index));
+  EXPECT_EQ(0, index);
+  ASSERT_TRUE(second.Next(&index));
+  EXPECT_EQ(2, index);
+  ASSERT_TRUE(first.Next(&index));
+  EXPECT_EQ(1, index);
+  ASSERT_TRUE(second.Next(&index));
+  EXPECT_EQ(3, index);
+  for (size_t unit = 0; unit < units.size(); ++unit) {
+    (unit % 2 == 0 ? second : first).Finish(unit);
+  }
+  EXPECT_FALSE(first.Next(&index));
+  EXPECT_FALSE(second.Next(&index));
+  EXPECT_EQ(4, leases.done.size());
+}
+
+TEST(LeasedWorkQueueTest, ReleasedUnitsAreLeftUnfinished) {
+  FakeLeases leases;
+  LeasedWorkQueue queue({"a"}, llvm::make_unique<FakeLeaseStore>(&leases, 1),
+                        FastOptions(0));
+  size_t index;
+  ASSERT_TRUE(queue.Next(&index));
+  queue.Release(index);
+  EXPECT_EQ(0, leases.done.size());
+  EXPECT_EQ(1, leases.leases.count("a"));
+}
+
+TEST(LeasedWorkQueueTest, TakesOverLapsedLeases) {
+  FakeLeases leases;
+  leases.leases["a"] = 2;
+  LeasedWorkQueue queue({"a"}, llvm::make_unique<FakeLeaseStore>(&leases, 1),
+                        FastOptions(0));
+  std::thread lapse([&leases] {
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    std::lock_guard<std::mutex> lock(leases.mutex);
+    leases.leases.clear();
+  });
+  size_t index;
+  ASSERT_TRUE(queue.Next(&index));
+  lapse.join();
+  EXPECT_EQ(0, index);
+  EXPECT_EQ(1, queue.stats().taken_over);
+  EXPECT_LE(1, queue.stats().waits);
+  EXPECT_EQ(1, leases.leases["a"]);
+}
+
+TEST(LeasedWorkQueueTest, WaitsForUnitsHeldElsewhere) {
+  FakeLeases leases;
+  leases.leases["a"] = 2;
+  LeasedWorkQueue queue({"a"}, llvm::make_unique<FakeLeaseStore>(&leases, 1),
+                        FastOptions(0));
+  std::thread finish([&leases] {
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    std::lock_guard<std::mutex> lock(leases.mutex);
+    leases.leases.clear();
+    leases.done.insert("a");
+  });
+  size_t index;
+  EXPECT_FALSE(queue.Next(&index));
+  finish.join();
+  EXPECT_EQ(0, queue.stats().acquired);
+  EXPECT_EQ(1, queue.stats().done_elsewhere);
+}
+
+TEST(LeasedWorkQueueTest, HandsOutUnitsWhenUnavailable) {
+  FakeLeases leases;
+  leases.available = false;
+  LeasedWorkQueue queue({"a", "b"},
+                        llvm::make_unique<FakeLeaseStore>(&leases, 1),
+                        FastOptions(0));
+  size_t index;
+  ASSERT_TRUE(queue.Next(&index));
+  EXPECT_EQ(0, index);
+  queue.Finish(index);
+  ASSERT_TRUE(queue.Next(&index));
+  EXPECT_EQ(1, index);
+  queue.Finish(index);
+  EXPECT_FALSE(queue.Next(&index));
+  EXPECT_EQ(2, queue.stats().unavailable);
+}
+
+TEST(LeasedWorkQueueTest, StopEndsWaiting) {
+  FakeLeases leases;
+  leases.leases["a"] = 2;
+  LeasedWorkQueue queue({"a"}, llvm::make_unique<FakeLeaseStore>(&leases, 1),
+                        FastOptions(0));
+  std::thread stop([&queue] {
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    queue.Stop();
+  });
+  size_t index;
+  EXPECT_FALSE(queue.Next(&index));
+  stop.join();
+}
+
+}  // namespace
+}  // namespace kythe
+
+int main(int argc, char **argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  int result = RUN_ALL_TESTS();
+  return result;
+}
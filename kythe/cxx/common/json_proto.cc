@@ -16,60 +16,391 @@
 
 #include "json_proto.h"
 
-#include <openssl/base64.h>
 #include <openssl/sha.h>
 
+#include <algorithm>
+#include <limits>
+#include <memory>
+#include <vector>
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#include <tmmintrin.h>
+#endif
+
 #include "glog/logging.h"
 #include "google/protobuf/io/coded_stream.h"
 #include "google/protobuf/io/zero_copy_stream_impl.h"
 #include "google/protobuf/message.h"
 #include "rapidjson/document.h"
 #include "rapidjson/filewritestream.h"
+#include "rapidjson/reader.h"
 #include "rapidjson/stringbuffer.h"
 #include "rapidjson/writer.h"
 
 namespace kythe {
+namespace {
+/// \brief A RapidJSON input stream that reads from a `ZeroCopyInputStream`.
+class ZeroCopyInputStreamReader {
+ public:
+  typedef char Ch;
+  explicit ZeroCopyInputStreamReader(
+      google::protobuf::io::ZeroCopyInputStream *stream)
+      : stream_(stream) {
+    Refill();
+  }
+  Ch Peek() const { return current_ == end_ ? '\0' : *current_; }
+  Ch Take() {
+    if (current_ == end_) {
+      return '\0';
+    }
+    Ch c = *current_++;
+    ++count_;
+    if (current_ == end_) {
+      Refill();
+    }
+    return c;
+  }
+  size_t Tell() const { return count_; }
+  // Only used for in-situ parsing, which we don't support.
+  Ch *PutBegin() {
+    CHECK(false);
+    return nullptr;
+  }
+  void Put(Ch) { CHECK(false); }
+  void Flush() { CHECK(false); }
+  size_t PutEnd(Ch *) {
+    CHECK(false);
+    return 0;
+  }
+
+ private:
+  void Refill() {
+    const void *data;
+    int size;
+    while (stream_->Next(&data, &size)) {
+      if (size > 0) {
+        current_ = static_cast<const Ch *>(data);
+        end_ = current_ + size;
+        return;
+      }
+    }
+    current_ = end_ = nullptr;
+  }
+
+  google::protobuf::io::ZeroCopyInputStream *stream_;
+  const Ch *current_ = nullptr;
+  const Ch *end_ = nullptr;
+  size_t count_ = 0;
+};
+
+/// \brief A RapidJSON output stream that writes to a `ZeroCopyOutputStream`.
+class ZeroCopyOutputStreamWriter {
+ public:
+  typedef char Ch;
+  explicit ZeroCopyOutputStreamWriter(
+      google::protobuf::io::ZeroCopyOutputStream *stream)
+      : stream_(stream) {}
+  ~ZeroCopyOutputStreamWriter() { Flush(); }
+  void Put(Ch c) {
+    while (current_ == end_) {
+      void *data;
+      int size;
+      if (!stream_->Next(&data, &size)) {
+        ok_ = false;
+        return;
+      }
+      current_ = static_cast<Ch *>(data);
+      end_ = current_ + size;
+    }
+    *current_++ = c;
+  }
+  /// \brief Returns any unused part of the current buffer to the stream.
+  void Flush() {
+    if (current_ != end_) {
+      stream_->BackUp(end_ - current_);
+    }
+    current_ = end_ = nullptr;
+  }
+  /// \return false if the underlying stream failed.
+  bool ok() const { return ok_; }
+
+ private:
+  google::protobuf::io::ZeroCopyOutputStream *stream_;
+  Ch *current_ = nullptr;
+  Ch *end_ = nullptr;
+  bool ok_ = true;
+};
+
+/// \brief A RapidJSON output stream that appends to a string.
+class StringAppendWriter {
+ public:
+  typedef char Ch;
+  explicit StringAppendWriter(std::string *out) : out_(out) {}
+  void Put(Ch c) { out_->push_back(c); }
+  void Flush() {}
+
+ private:
+  std::string *out_;
+};
+
+constexpr char kBase64Alphabet[] =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+/// Marks bytes outside of `kBase64Alphabet` in `kBase64DecodeTable`.
+constexpr unsigned char kBase64Invalid = 0xff;
+
+/// \brief Maps each byte to its value in `kBase64Alphabet`.
+struct Base64DecodeTable {
+  Base64DecodeTable() {
+    std::fill(values, values + 256, kBase64Invalid);
+    for (unsigned char i = 0; i < 64; ++i) {
+      values[static_cast<unsigned char>(kBase64Alphabet[i])] = i;
+    }
+  }
+  unsigned char operator[](unsigned char c) const { return values[c]; }
+  unsigned char values[256];
+};
+const Base64DecodeTable kBase64DecodeTable;
+
+/// \brief Writes the four characters that encode `a`, `b` and `c` to `out`.
+inline void EncodeBase64Triple(unsigned char a, unsigned char b,
+                               unsigned char c, unsigned char *out) {
+  out[0] = kBase64Alphabet[a >> 2];
+  out[1] = kBase64Alphabet[((a & 0x03) << 4) | (b >> 4)];
+  out[2] = kBase64Alphabet[((b & 0x0f) << 2) | (c >> 6)];
+  out[3] = kBase64Alphabet[c & 0x3f];
+}
+
+/// \brief Encodes the longest prefix of `size` bytes from `in` that is a
+/// multiple of 3 long into `out`.
+/// \return the length of the prefix that was encoded.
+using Base64EncodeBlocks = size_t (*)(const unsigned char *in, size_t size,
+                                      unsigned char *out);
+
+/// \brief Decodes a prefix of `size` characters from `in`, made of whole
+/// groups of four characters, into `out`. Stops before the first group that
+/// holds padding or an invalid character.
+/// \return the length of the prefix that was decoded.
+using Base64DecodeBlocks = size_t (*)(const unsigned char *in, size_t size,
+                                      unsigned char *out);
+
+size_t EncodeBlocksScalar(const unsigned char *in, size_t size,
+                          unsigned char *out) {
+  size_t done = 0;
+  for (; size - done >= 3; done += 3, out += 4) {
+    EncodeBase64Triple(in[done], in[done + 1], in[done + 2], out);
+  }
+  return done;
+}
+
+size_t DecodeBlocksScalar(const unsigned char *in, size_t size,
+                          unsigned char *out) {
+  size_t done = 0;
+  for (; size - done >= 4; done += 4, out += 3) {
+    const unsigned char a = kBase64DecodeTable[in[done]];
+    const unsigned char b = kBase64DecodeTable[in[done + 1]];
+    const unsigned char c = kBase64DecodeTable[in[done + 2]];
+    const unsigned char d = kBase64DecodeTable[in[done + 3]];
+    // Values are below 64, so this only holds if one of them is invalid.
+    if ((a | b | c | d) == kBase64Invalid) {
+      break;
+    }
+    out[0] = (a << 2) | (b >> 4);
+    out[1] = (b << 4) | (c >> 2);
+    out[2] = (c << 6) | d;
+  }
+  return done;
+}
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define KYTHE_HAVE_SSSE3_BASE64 1
+// These follow Muła and Lemire's SSE base64 codecs. Each step moves 12 bytes
+// to or from 16 characters, loading or storing 16 bytes at a time, so the
+// loops stop early enough to keep those accesses in bounds.
+
+__attribute__((target("ssse3"))) size_t EncodeBlocksSsse3(
+    const unsigned char *in, size_t size, unsigned char *out) {
+  const __m128i shuffle =
+      _mm_set_epi8(10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1);
+  const __m128i shift_lut =
+      _mm_setr_epi8('a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+                    '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+                    '0' - 52, '+' - 62, '/' - 63, 'A', 0, 0);
+  size_t done = 0;
+  for (; size - done >= 16; done += 12, out += 16) {
+    __m128i bytes = _mm_shuffle_epi8(
+        _mm_loadu_si128(reinterpret_cast<const __m128i *>(in + done)),
+        shuffle);
+    // Move each sextet into its own byte.
+    const __m128i high = _mm_mulhi_epu16(
+        _mm_and_si128(bytes, _mm_set1_epi32(0x0fc0fc00)),
+        _mm_set1_epi32(0x04000040));
+    const __m128i low = _mm_mullo_epi16(
+        _mm_and_si128(bytes, _mm_set1_epi32(0x003f03f0)),
+        _mm_set1_epi32(0x01000010));
+    const __m128i indices = _mm_or_si128(high, low);
+    // Pick the offset from each sextet to its character.
+    __m128i range = _mm_subs_epu8(indices, _mm_set1_epi8(51));
+    range = _mm_or_si128(
+        range, _mm_and_si128(_mm_cmpgt_epi8(_mm_set1_epi8(26), indices),
+                             _mm_set1_epi8(13)));
+    _mm_storeu_si128(
+        reinterpret_cast<__m128i *>(out),
+        _mm_add_epi8(_mm_shuffle_epi8(shift_lut, range), indices));
+  }
+  return done + EncodeBlocksScalar(in + done, size - done, out);
+}
+
+__attribute__((target("ssse3"))) size_t DecodeBlocksSsse3(
+    const unsigned char *in, size_t size, unsigned char *out) {
+  // Indexed by high nibble: the offset from a character to its value.
+  const __m128i shift_lut = _mm_setr_epi8(0, 0, 19, 4, -65, -65, -71, -71, 0,
+                                          0, 0, 0, 0, 0, 0, 0);
+  // Indexed by low nibble: the set of valid high nibbles.
+  const __m128i mask_lut = _mm_setr_epi8(
+      static_cast<char>(0xa8), static_cast<char>(0xf8),
+      static_cast<char>(0xf8), static_cast<char>(0xf8),
+      static_cast<char>(0xf8), static_cast<char>(0xf8),
+      static_cast<char>(0xf8), static_cast<char>(0xf8),
+      static_cast<char>(0xf8), static_cast<char>(0xf8),
+      static_cast<char>(0xf0), 0x54, 0x50, 0x50, 0x50, 0x54);
+  const __m128i bit_lut =
+      _mm_setr_epi8(0x01, 0x02, 0x04, 0x08, 0x10, 0x20, 0x40,
+                    static_cast<char>(0x80), 0, 0, 0, 0, 0, 0, 0, 0);
+  const __m128i pack =
+      _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1);
+  size_t done = 0;
+  // Stop while there are 24 characters left so that the 16-byte store
+  // stays inside the `size / 4 * 3` bytes of output.
+  for (; size - done >= 24; done += 16, out += 12) {
+    const __m128i chars =
+        _mm_loadu_si128(reinterpret_cast<const __m128i *>(in + done));
+    const __m128i high_nibbles =
+        _mm_and_si128(_mm_srli_epi32(chars, 4), _mm_set1_epi8(0x0f));
+    const __m128i low_nibbles = _mm_and_si128(chars, _mm_set1_epi8(0x0f));
+    const __m128i invalid = _mm_cmpeq_epi8(
+        _mm_and_si128(_mm_shuffle_epi8(mask_lut, low_nibbles),
+                      _mm_shuffle_epi8(bit_lut, high_nibbles)),
+        _mm_setzero_si128());
+    if (_mm_movemask_epi8(invalid) != 0) {
+      break;
+    }
+    // '+' and '/' share a high nibble; '/' needs 16 rather than 19.
+    const __m128i shift = _mm_add_epi8(
+        _mm_shuffle_epi8(shift_lut, high_nibbles),
+        _mm_and_si128(_mm_cmpeq_epi8(chars, _mm_set1_epi8('/')),
+                      _mm_set1_epi8(-3)));
+    const __m128i values = _mm_add_epi8(chars, shift);
+    const __m128i pairs =
+        _mm_maddubs_epi16(values, _mm_set1_epi32(0x01400140));
+    const __m128i triples = _mm_madd_epi16(pairs, _mm_set1_epi32(0x00011000));
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(out),
+                     _mm_shuffle_epi8(triples, pack));
+  }
+  return done + DecodeBlocksScalar(in + done, size - done, out);
+}
+#endif
+
+/// \brief The block codecs to use on this machine.
+struct Base64Codec {
+  Base64EncodeBlocks encode_blocks;
+  Base64DecodeBlocks decode_blocks;
+};
+
+Base64Codec ChooseBase64Codec() {
+#if defined(KYTHE_HAVE_SSSE3_BASE64)
+  if (__builtin_cpu_supports("ssse3")) {
+    return Base64Codec{EncodeBlocksSsse3, DecodeBlocksSsse3};
+  }
+#endif
+  return Base64Codec{EncodeBlocksScalar, DecodeBlocksScalar};
+}
+
+const Base64Codec &GetBase64Codec() {
+  static const Base64Codec codec = ChooseBase64Codec();
+  return codec;
+}
+}  // anonymous namespace
 
 bool DecodeBase64(const google::protobuf::string &data,
                   google::protobuf::string *decoded) {
-  size_t expected_size;
-  if (::EVP_DecodedLength(&expected_size, data.size()) != 1) {
+  if (data.size() % 4 != 0) {
     return false;
   }
-
-  if (expected_size == 0) {
+  if (data.empty()) {
     decoded->clear();
     return true;
   }
-  decoded->resize(expected_size);
-
+  decoded->resize(data.size() / 4 * 3);
   size_t written_size;
-  uint8_t *output = reinterpret_cast<uint8_t *>(&(*decoded)[0]);
-  const uint8_t *input = reinterpret_cast<const uint8_t *>(data.data());
-  if (::EVP_DecodeBase64(output, &written_size, decoded->size(), input,
-                         data.size()) != 1) {
+  if (!DecodeBase64(data.data(), data.size(),
+                    reinterpret_cast<unsigned char *>(&(*decoded)[0]),
+                    &written_size)) {
     return false;
   }
   decoded->resize(written_size);
   return true;
 }
 
-google::protobuf::string EncodeBase64(const google::protobuf::string &data) {
-  google::protobuf::string encoded;
-
-  size_t expected_size;
-  CHECK(::EVP_EncodedLength(&expected_size, data.size()));
-  CHECK(expected_size > 0);
-
-  // expected_size includes trailing NULL, resize() does not.
-  encoded.resize(expected_size - 1);
+bool DecodeBase64(const char *data, size_t size, unsigned char *out,
+                  size_t *out_size) {
+  if (size % 4 != 0) {
+    return false;
+  }
+  const unsigned char *in = reinterpret_cast<const unsigned char *>(data);
+  size_t done = GetBase64Codec().decode_blocks(in, size, out);
+  in += done;
+  out += done / 4 * 3;
+  size -= done;
+  *out_size = done / 4 * 3;
+  for (; size > 0; in += 4, size -= 4) {
+    const size_t quad_size = (in[3] != '=') ? 3 : (in[2] != '=') ? 2 : 1;
+    // Padding may only appear at the end of the encoding.
+    if (quad_size != 3 && size != 4) {
+      return false;
+    }
+    unsigned char values[4] = {};
+    for (size_t i = 0; i < quad_size + 1; ++i) {
+      values[i] = kBase64DecodeTable[in[i]];
+      if (values[i] == kBase64Invalid) {
+        return false;
+      }
+    }
+    out[0] = (values[0] << 2) | (values[1] >> 4);
+    if (quad_size > 1) {
+      out[1] = (values[1] << 4) | (values[2] >> 2);
+    }
+    if (quad_size > 2) {
+      out[2] = (values[2] << 6) | values[3];
+    }
+    out += quad_size;
+    *out_size += quad_size;
+  }
+  return true;
+}
 
-  const uint8_t *input = reinterpret_cast<const uint8_t *>(data.data());
-  uint8_t *output = reinterpret_cast<uint8_t *>(&encoded[0]);
-  const size_t encoded_size = ::EVP_EncodeBlock(output, input, data.size());
+size_t EncodeBase64(const unsigned char *data, size_t size, char *out) {
+  unsigned char *begin = reinterpret_cast<unsigned char *>(out);
+  size_t done = GetBase64Codec().encode_blocks(data, size, begin);
+  unsigned char *output = begin + done / 3 * 4;
+  if (done < size) {
+    const size_t left = size - done;
+    EncodeBase64Triple(data[done], left > 1 ? data[done + 1] : 0, 0, output);
+    output[3] = '=';
+    if (left == 1) {
+      output[2] = '=';
+    }
+    output += 4;
+  }
+  return output - begin;
+}
 
-  // Shrink-to-fit the actual encoded size.
-  encoded.resize(encoded_size);
+google::protobuf::string EncodeBase64(const google::protobuf::string &data) {
+  google::protobuf::string encoded(Base64EncodedLength(data.size()), '\0');
+  if (!data.empty()) {
+    EncodeBase64(reinterpret_cast<const unsigned char *>(data.data()),
+                 data.size(), &encoded[0]);
+  }
   return encoded;
 }
 
@@ -165,34 +496,71 @@ bool JsonOfMessage(const google::protobuf::Message &message, W *writer) {
   return true;
 }
 
-bool WriteMessageAsJsonToString(const google::protobuf::Message &message,
-                                std::string *out) {
-  rapidjson::StringBuffer buffer;
-  rapidjson::Writer<rapidjson::StringBuffer> writer(buffer);
-  if (!JsonOfMessage(message, &writer)) {
+/// \brief Writes `message` with `writer`, wrapped if `format_key` is set.
+/// \tparam W A RapidJSON Writer.
+template <typename W>
+bool WrappedJsonOfMessage(const google::protobuf::Message &message,
+                          const std::string *format_key, W *writer) {
+  if (format_key == nullptr) {
+    return JsonOfMessage(message, writer);
+  }
+  writer->StartObject();
+  writer->Key("format");
+  writer->String(format_key->c_str());
+  writer->Key("content");
+  if (!JsonOfMessage(message, writer)) {
     return false;
   }
-  *out = buffer.GetString();
+  writer->EndObject();
   return true;
 }
 
-bool WriteMessageAsJsonToString(const google::protobuf::Message &message,
-                                const std::string &format_key,
-                                std::string *out) {
-  rapidjson::StringBuffer buffer;
-  rapidjson::Writer<rapidjson::StringBuffer> writer(buffer);
-  writer.StartObject();
-  writer.Key("format");
-  writer.String(format_key.c_str());
-  writer.Key("content");
-  if (!JsonOfMessage(message, &writer)) {
+/// \brief Writes `message` as JSON to `out`, wrapped if `format_key` is set.
+bool WriteJsonToString(const google::protobuf::Message &message,
+                       const std::string *format_key, std::string *out) {
+  std::string buffer;
+  StringAppendWriter stream(&buffer);
+  rapidjson::Writer<StringAppendWriter> writer(stream);
+  if (!WrappedJsonOfMessage(message, format_key, &writer)) {
     return false;
   }
-  writer.EndObject();
-  *out = buffer.GetString();
+  out->swap(buffer);
   return true;
 }
 
+/// \brief Writes `message` as JSON to `out`, wrapped if `format_key` is set.
+bool WriteJsonToStream(const google::protobuf::Message &message,
+                       const std::string *format_key,
+                       google::protobuf::io::ZeroCopyOutputStream *out) {
+  ZeroCopyOutputStreamWriter stream(out);
+  rapidjson::Writer<ZeroCopyOutputStreamWriter> writer(stream);
+  bool ok = WrappedJsonOfMessage(message, format_key, &writer);
+  stream.Flush();
+  return ok && stream.ok();
+}
+
+bool WriteMessageAsJsonToString(const google::protobuf::Message &message,
+                                std::string *out) {
+  return WriteJsonToString(message, nullptr, out);
+}
+
+bool WriteMessageAsJsonToString(const google::protobuf::Message &message,
+                                const std::string &format_key,
+                                std::string *out) {
+  return WriteJsonToString(message, &format_key, out);
+}
+
+bool WriteMessageAsJson(const google::protobuf::Message &message,
+                        google::protobuf::io::ZeroCopyOutputStream *out) {
+  return WriteJsonToStream(message, nullptr, out);
+}
+
+bool WriteMessageAsJson(const google::protobuf::Message &message,
+                        const std::string &format_key,
+                        google::protobuf::io::ZeroCopyOutputStream *out) {
+  return WriteJsonToStream(message, &format_key, out);
+}
+
 bool MessageOfJson(const rapidjson::Value &value,
                    google::protobuf::Message *message) {
   using namespace rapidjson;
@@ -299,26 +667,327 @@ bool MessageOfJson(const rapidjson::Value &value,
   return true;
 }
 
-bool MergeJsonWithMessage(const std::string &in, std::string *format_key,
-                          google::protobuf::Message *message) {
-  rapidjson::Document document;
-  document.Parse(in.c_str());
-  if (document.HasParseError()) {
+namespace {
+/// \brief Merges JSON into a protobuf as RapidJSON's SAX reader parses it,
+/// using the same mapping as `MessageOfJson`.
+class MessageBuilder {
+ public:
+  /// \param message The message to merge with.
+  /// \param wrapped If true, the root object is a format wrapper and only its
+  /// "content" is merged with `message`.
+  MessageBuilder(google::protobuf::Message *message, bool wrapped)
+      : message_(message), wrapped_(wrapped) {}
+
+  /// \brief Checks the format wrapper once parsing has finished.
+  /// \param format_key If non-null, set to the wrapper's format field.
+  /// \return true if the merged message should be kept.
+  bool Finish(std::string *format_key) {
+    if (!wrapped_) {
+      return true;
+    }
+    if (!have_format_ || !have_content_) {
+      return false;
+    }
+    if (format_key) {
+      *format_key = format_;
+    }
+    if (format_ != "kythe") {
+      return false;
+    }
+    if (scratch_) {
+      message_->MergeFrom(*scratch_);
+    }
+    return true;
+  }
+
+  bool Null() { return Skip(); }
+  bool Bool(bool value) {
+    if (Skip()) {
+      return true;
+    }
+    const auto *field =
+        ScalarField(google::protobuf::FieldDescriptor::CPPTYPE_BOOL);
+    if (field == nullptr) {
+      return false;
+    }
+    auto *message = frames_.back().message;
+    if (field->is_repeated()) {
+      message->GetReflection()->AddBool(message, field, value);
+    } else {
+      message->GetReflection()->SetBool(message, field, value);
+    }
+    return FinishValue();
+  }
+  bool Int(int value) {
+    if (Skip()) {
+      return true;
+    }
+    const auto *field =
+        ScalarField(google::protobuf::FieldDescriptor::CPPTYPE_INT32);
+    if (field == nullptr) {
+      return false;
+    }
+    auto *message = frames_.back().message;
+    if (field->is_repeated()) {
+      message->GetReflection()->AddInt32(message, field, value);
+    } else {
+      message->GetReflection()->SetInt32(message, field, value);
+    }
+    return FinishValue();
+  }
+  bool Uint(unsigned value) {
+    if (value > static_cast<unsigned>(std::numeric_limits<int>::max())) {
+      return Skip();
+    }
+    return Int(static_cast<int>(value));
+  }
+  bool Int64(int64_t) { return Skip(); }
+  bool Uint64(uint64_t) { return Skip(); }
+  bool Double(double) { return Skip(); }
+  bool String(const char *str, rapidjson::SizeType length, bool) {
+    if (Skip()) {
+      return true;
+    }
+    if (!frames_.empty() && frames_.back().message == nullptr) {
+      if (wrapper_key_ != WrapperKey::Format) {
+        return false;
+      }
+      format_.assign(str, length);
+      have_format_ = true;
+      return true;
+    }
+    const auto *field =
+        ScalarField(google::protobuf::FieldDescriptor::CPPTYPE_STRING);
+    if (field == nullptr) {
+      return false;
+    }
+    google::protobuf::string value(str, length);
+    if (field->type() == google::protobuf::FieldDescriptor::TYPE_BYTES) {
+      google::protobuf::string decoded;
+      if (!DecodeBase64(value, &decoded)) {
+        return false;
+      }
+      value.swap(decoded);
+    }
+    auto *message = frames_.back().message;
+    if (field->is_repeated()) {
+      message->GetReflection()->AddString(message, field, std::move(value));
+    } else {
+      message->GetReflection()->SetString(message, field, std::move(value));
+    }
+    return FinishValue();
+  }
+  bool Key(const char *str, rapidjson::SizeType length, bool) {
+    if (skip_depth_ > 0) {
+      return true;
+    }
+    Frame &top = frames_.back();
+    if (top.message == nullptr) {
+      std::string key(str, length);
+      if (key == "format") {
+        wrapper_key_ = WrapperKey::Format;
+      } else if (key == "content") {
+        wrapper_key_ = WrapperKey::Content;
+      } else {
+        skip_value_ = true;
+      }
+      return true;
+    }
+    top.field = top.message->GetDescriptor()->FindFieldByName(
+        google::protobuf::string(str, length));
+    // Ignore unknown fields.
+    skip_value_ = top.field == nullptr;
+    return true;
+  }
+  bool StartObject() {
+    if (SkipContainer()) {
+      return true;
+    }
+    if (frames_.empty()) {
+      frames_.push_back(Frame{wrapped_ ? nullptr : message_});
+      return true;
+    }
+    Frame &top = frames_.back();
+    google::protobuf::Message *child = nullptr;
+    if (top.message == nullptr) {
+      if (wrapper_key_ != WrapperKey::Content) {
+        return false;
+      }
+      have_content_ = true;
+      if (have_format_ && format_ == "kythe") {
+        child = message_;
+      } else {
+        // Don't touch `message_` until we know the format is right.
+        if (!scratch_) {
+          scratch_.reset(message_->New());
+        }
+        child = scratch_.get();
+      }
+    } else {
+      const auto *field = top.field;
+      if (field == nullptr ||
+          field->cpp_type() !=
+              google::protobuf::FieldDescriptor::CPPTYPE_MESSAGE ||
+          field->is_repeated() != top.in_array) {
+        return false;
+      }
+      auto *reflection = top.message->GetReflection();
+      child = top.in_array ? reflection->AddMessage(top.message, field)
+                           : reflection->MutableMessage(top.message, field);
+      FinishValue();
+    }
+    frames_.push_back(Frame{child});
+    return true;
+  }
+  bool EndObject(rapidjson::SizeType) {
+    if (skip_depth_ > 0) {
+      --skip_depth_;
+      return true;
+    }
+    frames_.pop_back();
+    return true;
+  }
+  bool StartArray() {
+    if (SkipContainer()) {
+      return true;
+    }
+    if (frames_.empty() || frames_.back().message == nullptr) {
+      return false;
+    }
+    Frame &top = frames_.back();
+    if (top.field == nullptr || !top.field->is_repeated() || top.in_array) {
+      return false;
+    }
+    top.in_array = true;
+    return true;
+  }
+  bool EndArray(rapidjson::SizeType) {
+    if (skip_depth_ > 0) {
+      --skip_depth_;
+      return true;
+    }
+    frames_.back().in_array = false;
+    frames_.back().field = nullptr;
+    return true;
+  }
+
+ private:
+  /// \brief An object being parsed.
+  struct Frame {
+    /// The message being merged with, or null for the format wrapper.
+    google::protobuf::Message *message;
+    /// The field of `message` the next value belongs to.
+    const google::protobuf::FieldDescriptor *field = nullptr;
+    /// Are we inside `field`'s array?
+    bool in_array = false;
+  };
+
+  enum class WrapperKey { Format, Content };
+
+  /// \return true if the current scalar should be ignored.
+  bool Skip() {
+    if (skip_depth_ > 0) {
+      return true;
+    }
+    if (skip_value_) {
+      skip_value_ = false;
+      return true;
+    }
     return false;
   }
-  if (!document.IsObject() || !document.HasMember("format") ||
-      !document.HasMember("content") || !document["format"].IsString() ||
-      !document["content"].IsObject()) {
+
+  /// \return true if the object or array being started should be ignored.
+  bool SkipContainer() {
+    if (skip_depth_ > 0 || skip_value_) {
+      skip_value_ = false;
+      ++skip_depth_;
+      return true;
+    }
     return false;
   }
-  std::string in_format = document["format"].GetString();
-  if (format_key) {
-    *format_key = in_format;
+
+  /// \return the field the current scalar should be stored in if it has the
+  /// type `type`, or null if the scalar is invalid here.
+  const google::protobuf::FieldDescriptor *ScalarField(
+      google::protobuf::FieldDescriptor::CppType type) {
+    if (frames_.empty() || frames_.back().message == nullptr) {
+      return nullptr;
+    }
+    const Frame &top = frames_.back();
+    if (top.field == nullptr || top.field->cpp_type() != type ||
+        top.field->is_repeated() != top.in_array) {
+      return nullptr;
+    }
+    return top.field;
+  }
+
+  /// \brief Finishes a value stored in the current field.
+  bool FinishValue() {
+    if (!frames_.back().in_array) {
+      frames_.back().field = nullptr;
+    }
+    return true;
   }
-  if (in_format == "kythe") {
-    return MessageOfJson(document["content"], message);
+
+  /// The message to merge with.
+  google::protobuf::Message *message_;
+  /// Holds content that appeared before the wrapper's format.
+  std::unique_ptr<google::protobuf::Message> scratch_;
+  /// Whether the root object is a format wrapper.
+  bool wrapped_;
+  /// The objects being parsed, outermost first.
+  std::vector<Frame> frames_;
+  /// The number of ignored objects and arrays we're inside.
+  size_t skip_depth_ = 0;
+  /// Should the next value be ignored?
+  bool skip_value_ = false;
+  /// The wrapper key whose value comes next.
+  WrapperKey wrapper_key_ = WrapperKey::Format;
+  /// The wrapper's format, if we've seen it.
+  std::string format_;
+  bool have_format_ = false;
+  bool have_content_ = false;
+};
+
+/// \brief Merges the JSON in `stream` with `message`.
+/// \param wrapped Whether `stream` holds a format wrapper.
+/// \param format_key If non-null, set to the wrapper's format field.
+template <typename InputStream>
+bool MergeJsonStream(InputStream *stream, bool wrapped,
+                     std::string *format_key,
+                     google::protobuf::Message *message) {
+  MessageBuilder builder(message, wrapped);
+  rapidjson::Reader reader;
+  reader.Parse(*stream, builder);
+  if (reader.HasParseError()) {
+    return false;
   }
-  return false;
+  return builder.Finish(format_key);
+}
+}  // anonymous namespace
+
+bool MergeJsonWithMessage(const std::string &in, std::string *format_key,
+                          google::protobuf::Message *message) {
+  rapidjson::StringStream stream(in.c_str());
+  return MergeJsonStream(&stream, true, format_key, message);
+}
+
+bool MergeJsonWithMessage(const rapidjson::Document &document,
+                          google::protobuf::Message *message) {
+  return MessageOfJson(document, message);
+}
+
+bool MergeJsonWithMessage(google::protobuf::io::ZeroCopyInputStream *in,
+                          std::string *format_key,
+                          google::protobuf::Message *message) {
+  ZeroCopyInputStreamReader stream(in);
+  return MergeJsonStream(&stream, true, format_key, message);
+}
+
+bool MergeJsonWithMessage(google::protobuf::io::ZeroCopyInputStream *in,
+                          google::protobuf::Message *message) {
+  ZeroCopyInputStreamReader stream(in);
+  return MergeJsonStream(&stream, false, nullptr, message);
 }
 
 void PackAny(const google::protobuf::Message &message, const char *type_uri,
@@ -20,6 +20,7 @@
 #include <string>
 
 #include "google/protobuf/any.pb.h"
+#include "google/protobuf/io/zero_copy_stream.h"
 #include "google/protobuf/message.h"
 #include "rapidjson/document.h"
 
@@ -42,6 +43,25 @@ bool MergeJsonWithMessage(const std::string &in, std::string *format_key,
 bool MergeJsonWithMessage(const rapidjson::Document &document,
                           google::protobuf::Message *message);
 
+/// \brief Deserializes a protobuf from its JSON form, including the format
+/// wrapper, as it is read from `in`. No intermediate DOM is built, so memory
+/// use doesn't depend on the size of the input.
+/// \param in The stream to deserialize.
+/// \param format_key Set to the wrapper's format field.
+/// \param message Merged with the JSON data.
+/// \return true on success; false on failure.
+bool MergeJsonWithMessage(google::protobuf::io::ZeroCopyInputStream *in,
+                          std::string *format_key,
+                          google::protobuf::Message *message);
+
+/// \brief Deserializes a protobuf from its JSON form without expecting a
+/// wrapper, as it is read from `in`.
+/// \param in The stream to deserialize.
+/// \param message Merged with the JSON data.
+/// \return true on success; false on failure.
+bool MergeJsonWithMessage(google::protobuf::io::ZeroCopyInputStream *in,
+                          google::protobuf::Message *message);
+
 /// \brief Serializes a protobuf to JSON form, including the format wrapper.
 /// \param message The protobuf to serialize.
 /// \param format_key Specifies the format to declare in the wrapper.
@@ -58,6 +78,24 @@ bool WriteMessageAsJsonToString(const google::protobuf::Message &message,
 bool WriteMessageAsJsonToString(const google::protobuf::Message &message,
                                 std::string *out);
 
+/// \brief Serializes a protobuf to JSON form, including the format wrapper,
+/// writing it to `out` as it is produced.
+/// \param message The protobuf to serialize.
+/// \param format_key Specifies the format to declare in the wrapper.
+/// \param out The stream to write to.
+/// \return True on success; false on failure.
+bool WriteMessageAsJson(const google::protobuf::Message &message,
+                        const std::string &format_key,
+                        google::protobuf::io::ZeroCopyOutputStream *out);
+
+/// \brief Serializes a protobuf to JSON form with no wrapper, writing it to
+/// `out` as it is produced.
+/// \param message The protobuf to serialize.
+/// \param out The stream to write to.
+/// \return True on success; false on failure.
+bool WriteMessageAsJson(const google::protobuf::Message &message,
+                        google::protobuf::io::ZeroCopyOutputStream *out);
+
 /// \brief Wrap a protobuf up into an Any.
 /// \param message The message to wrap.
 /// \param type_uri The URI of the message type.
@@ -79,11 +117,29 @@ bool UnpackAny(const google::protobuf::Any &any,
 bool DecodeBase64(const google::protobuf::string &data,
                   google::protobuf::string *decoded);
 
+/// \brief Decodes `size` base64-encoded characters from `data`.
+/// \param out Set to the decoded bytes; must have room for `size / 4 * 3`.
+/// \param out_size Set to the number of bytes written to `out`.
+/// \return false on failure.
+bool DecodeBase64(const char *data, size_t size, unsigned char *out,
+                  size_t *out_size);
+
 /// \brief Encodes a string as base64.
 /// \param data The string to encode.
 /// \param encoded Set to the encoded value.
 google::protobuf::string EncodeBase64(const google::protobuf::string &data);
 
+/// \return the length of the base64 encoding of `size` bytes.
+constexpr size_t Base64EncodedLength(size_t size) {
+  return (size + 2) / 3 * 4;
+}
+
+/// \brief Encodes `size` bytes from `data` as base64 without allocating.
+/// \param out Set to the encoding; must have room for
+/// `Base64EncodedLength(size)` characters. No terminator is written.
+/// \return the number of characters written to `out`.
+size_t EncodeBase64(const unsigned char *data, size_t size, char *out);
+
 }  // namespace kythe
 
 #endif  // KYTHE_CXX_COMMON_JSON_PROTO_H_
@@ -17,6 +17,7 @@
 #include "json_proto.h"
 
 #include "glog/logging.h"
+#include "google/protobuf/io/zero_copy_stream_impl_lite.h"
 #include "gtest/gtest.h"
 #include "kythe/proto/analysis.pb.h"
 
@@ -84,6 +85,86 @@ TEST(JsonProto, Deserialize) {
   EXPECT_EQ("e2", has_repeated_field.entries(1).edge_kind());
 }
 
+TEST(JsonProto, DeserializeStrictly) {
+  proto::FileData file_data;
+  std::string format_string;
+  // Unknown fields are skipped, however deeply nested.
+  ASSERT_TRUE(MergeJsonWithMessage(
+      "{\"extra\":[{\"a\":[1,{}]}],\"format\":\"kythe\",\"content\":{"
+      "\"unknown\":{\"path\":[null]},\"info\":{\"path\":\"here\"}}}",
+      &format_string, &file_data));
+  EXPECT_EQ("here", file_data.info().path());
+  // Values must have the field's type.
+  EXPECT_FALSE(MergeJsonWithMessage(
+      "{\"format\":\"kythe\",\"content\":{\"info\":{\"path\":1}}}",
+      &format_string, &file_data));
+  EXPECT_FALSE(MergeJsonWithMessage(
+      "{\"format\":\"kythe\",\"content\":{\"info\":[]}}", &format_string,
+      &file_data));
+  proto::Entries entries;
+  EXPECT_FALSE(MergeJsonWithMessage(
+      "{\"format\":\"kythe\",\"content\":{\"entries\":{}}}",
+      &format_string, &entries));
+  EXPECT_FALSE(MergeJsonWithMessage(
+      "{\"format\":\"kythe\",\"content\":{\"entries\":[[]]}}",
+      &format_string, &entries));
+  EXPECT_FALSE(MergeJsonWithMessage("{\"format\":\"kythe\",\"content\":[]}",
+                                    &format_string, &entries));
+  EXPECT_FALSE(MergeJsonWithMessage("{\"format\":\"kythe\",\"content\":{}",
+                                    &format_string, &entries));
+}
+
+TEST(JsonProto, DeserializeContentBeforeFormat) {
+  proto::FileData file_data;
+  std::string format_string;
+  ASSERT_TRUE(MergeJsonWithMessage(
+      "{\"content\":{\"content\":\"dGV4dA==\"},\"format\":\"kythe\"}",
+      &format_string, &file_data));
+  EXPECT_EQ("text", file_data.content());
+  file_data.Clear();
+  ASSERT_FALSE(MergeJsonWithMessage(
+      "{\"content\":{\"content\":\"dGV4dA==\"},\"format\":\"wrong\"}",
+      &format_string, &file_data));
+  EXPECT_EQ("wrong", format_string);
+  EXPECT_TRUE(file_data.content().empty());
+}
+
+TEST(JsonProto, RoundTripThroughStreams) {
+  proto::Entries entries;
+  for (int i = 0; i < 1000; ++i) {
+    auto *entry = entries.add_entries();
+    entry->set_edge_kind("/kythe/edge/childof");
+    entry->mutable_source()->set_signature("source" + std::to_string(i));
+    entry->set_fact_value(std::string(i % 7, '\0'));
+  }
+  std::string wrapped, unwrapped;
+  {
+    google::protobuf::io::StringOutputStream wrapped_stream(&wrapped);
+    ASSERT_TRUE(WriteMessageAsJson(entries, "kythe", &wrapped_stream));
+    google::protobuf::io::StringOutputStream unwrapped_stream(&unwrapped);
+    ASSERT_TRUE(WriteMessageAsJson(entries, &unwrapped_stream));
+  }
+  std::string expected;
+  ASSERT_TRUE(WriteMessageAsJsonToString(entries, "kythe", &expected));
+  EXPECT_EQ(expected, wrapped);
+  ASSERT_TRUE(WriteMessageAsJsonToString(entries, &expected));
+  EXPECT_EQ(expected, unwrapped);
+
+  proto::Entries parsed;
+  std::string format_string;
+  // Read in small pieces to cross many buffer boundaries.
+  google::protobuf::io::ArrayInputStream wrapped_input(wrapped.data(),
+                                                       wrapped.size(), 7);
+  ASSERT_TRUE(MergeJsonWithMessage(&wrapped_input, &format_string, &parsed));
+  EXPECT_EQ("kythe", format_string);
+  EXPECT_EQ(entries.DebugString(), parsed.DebugString());
+  parsed.Clear();
+  google::protobuf::io::ArrayInputStream unwrapped_input(unwrapped.data(),
+                                                         unwrapped.size(), 5);
+  ASSERT_TRUE(MergeJsonWithMessage(&unwrapped_input, &parsed));
+  EXPECT_EQ(entries.DebugString(), parsed.DebugString());
+}
+
 TEST(JsonProto, Encode64) {
   EXPECT_EQ("aGVsbG8K", EncodeBase64("hello\n"));
   EXPECT_EQ("", EncodeBase64(""));
@@ -106,6 +187,63 @@ TEST(JsonProto, Decode64) {
   DecodeBase64("!", &buffer);
 }
 
+/// \return the base64 encoding of `data`, computed one bit at a time.
+std::string SlowEncodeBase64(const std::string &data) {
+  static const char kAlphabet[] =
+      "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+  std::string encoded;
+  size_t bits = data.size() * 8;
+  for (size_t bit = 0; bit < bits; bit += 6) {
+    unsigned value = 0;
+    for (size_t i = bit; i < bit + 6; ++i) {
+      unsigned char byte = i < bits ? data[i / 8] : 0;
+      value = (value << 1) | ((byte >> (7 - i % 8)) & 1);
+    }
+    encoded.push_back(kAlphabet[value]);
+  }
+  while (encoded.size() % 4 != 0) {
+    encoded.push_back('=');
+  }
+  return encoded;
+}
+
+TEST(JsonProto, RoundTrip64) {
+  for (size_t size = 0; size < 100; ++size) {
+    std::string data;
+    for (size_t i = 0; i < size; ++i) {
+      data.push_back(static_cast<char>((i * 67 + size) & 0xff));
+    }
+    std::string encoded = EncodeBase64(data);
+    EXPECT_EQ(SlowEncodeBase64(data), encoded);
+    char raw[Base64EncodedLength(100)];
+    ASSERT_EQ(encoded.size(),
+              EncodeBase64(reinterpret_cast<const unsigned char *>(data.data()),
+                           data.size(), raw));
+    EXPECT_EQ(encoded, std::string(raw, encoded.size()));
+    google::protobuf::string decoded;
+    EXPECT_TRUE(DecodeBase64(encoded, &decoded));
+    EXPECT_EQ(data, decoded);
+  }
+}
+
+TEST(JsonProto, Decode64RejectsBadCharacters) {
+  const std::string encoded = EncodeBase64(std::string(60, '\x5a'));
+  google::protobuf::string buffer;
+  for (size_t i = 0; i < encoded.size(); ++i) {
+    for (char bad : {'!', '=', '\0', '\x80', ':', '@', '[', '`', '{'}) {
+      if (bad == '=' && i + 1 == encoded.size()) {
+        continue;  // This is just padding.
+      }
+      std::string corrupt = encoded;
+      corrupt[i] = bad;
+      EXPECT_FALSE(DecodeBase64(corrupt, &buffer)) << i << " " << bad;
+    }
+  }
+  EXPECT_FALSE(DecodeBase64("YnllCg==YnllCg==", &buffer));
+  EXPECT_FALSE(DecodeBase64("YnllCg=", &buffer));
+  EXPECT_FALSE(DecodeBase64("Y===", &buffer));
+}
+
 }  // namespace
 }  // namespace kythe
 
@@ -16,45 +16,20 @@
 
 #include "kythe_metadata_file.h"
 
+#include <openssl/sha.h>
+
 #include "glog/logging.h"
 #include "kythe/cxx/common/json_proto.h"  // DecodeBase64
 #include "kythe/cxx/common/proto_conversions.h"
+#include "kythe/cxx/common/vname_ordering.h"
 #include "kythe/proto/storage.pb.h"
-#include "rapidjson/document.h"
 #include "rapidjson/error/en.h"
+#include "rapidjson/memorystream.h"
+#include "rapidjson/reader.h"
 
 namespace kythe {
 
-#define JSON_SAFE_LOAD(key, type)                                         \
-  const auto key##_pair = value.FindMember(#key);                         \
-  if (key##_pair == value.MemberEnd() || !key##_pair->value.Is##type()) { \
-    LOG(WARNING) << "Unexpected or missing key " #key " : " #type;        \
-    return false;                                                         \
-  }                                                                       \
-  const auto &key = key##_pair->value;
-
-#define JSON_SAFE_LOAD_STRING(dest, key)                                 \
-  const auto key##_pair = value.FindMember(#key);                        \
-  if (key##_pair != value.MemberEnd() && key##_pair->value.IsString()) { \
-    dest = key##_pair->value.GetString();                                \
-  }
-
 namespace {
-bool LoadVName(const rapidjson::Value &value, proto::VName *vname_out) {
-  JSON_SAFE_LOAD_STRING(*(vname_out->mutable_signature()), signature);
-  JSON_SAFE_LOAD_STRING(*(vname_out->mutable_root()), root);
-  JSON_SAFE_LOAD_STRING(*(vname_out->mutable_path()), path);
-  JSON_SAFE_LOAD_STRING(*(vname_out->mutable_language()), language);
-  JSON_SAFE_LOAD_STRING(*(vname_out->mutable_corpus()), corpus);
-  if (vname_out->corpus().empty() && vname_out->path().empty() &&
-      vname_out->root().empty() && vname_out->signature().empty() &&
-      vname_out->language().empty()) {
-    LOG(WARNING) << "When loading metadata: empty vname.";
-    return false;
-  }
-  return true;
-}
-
 /// \brief Attempts to load buffer as a header-style metadata file.
 /// \param buffer data to try and parse.
 /// \return the decoded metadata on success or null on failure.
@@ -97,95 +72,392 @@ std::unique_ptr<llvm::MemoryBuffer> LoadHeaderMetadata(
              ? llvm::MemoryBuffer::getMemBufferCopy(ToStringRef(decoded))
              : nullptr;
 }
-}  // anonymous namespace
 
-bool KytheMetadataSupport::LoadMetaElement(const rapidjson::Value &value,
-                                           MetadataFile::Rule *rule) {
-  JSON_SAFE_LOAD(type, String);
-  if (type == "nop") {
+/// \brief The kinds of JSON value we distinguish when checking metadata.
+enum class JsonKind { Missing, String, Uint, Number, Object, Array, Other };
+
+/// \brief Builds metadata rules as RapidJSON's SAX reader parses a kythe0
+/// metadata file, so that large files needn't be held as a DOM.
+///
+/// When a key is repeated, only its first value is used.
+class MetadataBuilder {
+ public:
+  /// \brief Checks the root object once parsing has finished.
+  /// \return false (after logging a warning) if it isn't kythe0 metadata.
+  bool Finish() const {
+    if (type_kind_ != JsonKind::String) {
+      LOG(WARNING) << "When loading metadata: JSON element is missing type.";
+      return false;
+    }
+    if (type_ != "kythe0") {
+      LOG(WARNING) << "When loading metadata: JSON element has unexpected type "
+                   << type_;
+      return false;
+    }
+    if (meta_kind_ != JsonKind::Array) {
+      LOG(WARNING)
+          << "When loading metadata: kythe0.meta missing or not an array";
+      return false;
+    }
     return true;
   }
-  if (type != "anchor_defines") {
-    LOG(WARNING) << "When loading metadata: unknown meta type.";
-    return false;
+
+  /// \brief Moves the rules parsed so far out of the builder.
+  std::vector<MetadataFile::Rule> TakeRules() { return std::move(rules_); }
+
+  bool Null() { return Scalar(JsonKind::Other, "", 0); }
+  bool Bool(bool) { return Scalar(JsonKind::Other, "", 0); }
+  bool Int(int) { return Scalar(JsonKind::Number, "", 0); }
+  bool Uint(unsigned value) { return Scalar(JsonKind::Uint, "", value); }
+  bool Int64(int64_t) { return Scalar(JsonKind::Number, "", 0); }
+  bool Uint64(uint64_t) { return Scalar(JsonKind::Number, "", 0); }
+  bool Double(double) { return Scalar(JsonKind::Number, "", 0); }
+  bool String(const char *str, rapidjson::SizeType length, bool) {
+    return Scalar(JsonKind::String, llvm::StringRef(str, length), 0);
   }
-  JSON_SAFE_LOAD(begin, Number);
-  JSON_SAFE_LOAD(end, Number);
-  JSON_SAFE_LOAD(edge, String);
-  JSON_SAFE_LOAD(vname, Object);
-  proto::VName vname_out;
-  if (!LoadVName(vname, &vname_out)) {
-    return false;
+  bool Key(const char *str, rapidjson::SizeType length, bool) {
+    if (skip_depth_ > 0) {
+      return true;
+    }
+    llvm::StringRef key(str, length);
+    key_ = MetaKey::None;
+    switch (contexts_.back()) {
+      case Context::Root:
+        if (key == "type" && type_kind_ == JsonKind::Missing) {
+          key_ = MetaKey::Type;
+        } else if (key == "meta" && meta_kind_ == JsonKind::Missing) {
+          key_ = MetaKey::Meta;
+        }
+        break;
+      case Context::Element:
+        for (size_t i = 0; i < kElementKeyCount; ++i) {
+          if (key == kElementKeys[i] &&
+              element_.kinds[i] == JsonKind::Missing) {
+            key_ = static_cast<MetaKey>(static_cast<size_t>(MetaKey::Type) + i);
+          }
+        }
+        break;
+      case Context::VName:
+        for (size_t i = 0; i < kVNameKeyCount; ++i) {
+          if (key == kVNameKeys[i] && !vname_seen_[i]) {
+            vname_seen_[i] = true;
+            key_ = MetaKey::VNameField;
+            vname_field_ = i;
+          }
+        }
+        break;
+      default:
+        break;
+    }
+    skip_value_ = key_ == MetaKey::None;
+    return true;
   }
-  if (!begin.IsUint() || !end.IsUint()) {
-    return false;
+  bool StartObject() {
+    if (SkipContainer()) {
+      return true;
+    }
+    if (contexts_.empty()) {
+      contexts_.push_back(Context::Root);
+      return true;
+    }
+    switch (contexts_.back()) {
+      case Context::Meta:
+        element_ = Element();
+        contexts_.push_back(Context::Element);
+        return true;
+      case Context::Element:
+        if (key_ == MetaKey::VName) {
+          element_.kinds[ElementIndex(MetaKey::VName)] = JsonKind::Object;
+          std::fill(vname_seen_, vname_seen_ + kVNameKeyCount, false);
+          contexts_.push_back(Context::VName);
+          return true;
+        }
+        break;
+      default:
+        break;
+    }
+    return Container(JsonKind::Object);
   }
-  unsigned begin_int = begin.GetUint();
-  unsigned end_int = end.GetUint();
-  llvm::StringRef edge_string = edge.GetString();
-  if (edge_string.empty()) {
-    LOG(WARNING) << "When loading metadata: empty edge.";
-    return false;
+  bool EndObject(rapidjson::SizeType) {
+    if (skip_depth_ > 0) {
+      --skip_depth_;
+      return true;
+    }
+    Context context = contexts_.back();
+    contexts_.pop_back();
+    key_ = MetaKey::None;
+    if (context == Context::Element) {
+      MetadataFile::Rule rule;
+      if (!BuildRule(&rule)) {
+        return false;
+      }
+      rules_.push_back(std::move(rule));
+    }
+    return true;
   }
-  bool reverse_edge = false;
-  if (edge_string[0] == '%') {
-    edge_string = edge_string.drop_front(1);
-    reverse_edge = true;
+  bool StartArray() {
+    if (SkipContainer()) {
+      return true;
+    }
+    if (!contexts_.empty() && contexts_.back() == Context::Root &&
+        key_ == MetaKey::Meta) {
+      meta_kind_ = JsonKind::Array;
+      contexts_.push_back(Context::Meta);
+      return true;
+    }
+    return Container(JsonKind::Array);
+  }
+  bool EndArray(rapidjson::SizeType) {
+    if (skip_depth_ > 0) {
+      --skip_depth_;
+      return true;
+    }
+    contexts_.pop_back();
+    key_ = MetaKey::None;
+    return true;
   }
-  *rule =
-      MetadataFile::Rule{begin_int,   end_int,   "/kythe/edge/defines/binding",
-                         edge_string, vname_out, reverse_edge};
-  return true;
-}
 
-#undef JSON_SAFE_LOAD
-#undef JSON_SAFE_LOAD_STRING
+ private:
+  enum class Context { Root, Meta, Element, VName };
+  /// The keys we look at. The element keys are in the same order as
+  /// `kElementKeys`.
+  enum class MetaKey { None, Meta, Type, Begin, End, Edge, VName, VNameField };
 
-std::unique_ptr<MetadataFile> KytheMetadataSupport::LoadFromJSON(
-    llvm::StringRef json) {
-  rapidjson::Document document;
-  document.Parse(json.str().c_str());
-  if (document.HasParseError()) {
-    LOG(WARNING) << rapidjson::GetParseError_En(document.GetParseError())
-                 << " near offset " << document.GetErrorOffset();
-    return nullptr;
+  static constexpr size_t kElementKeyCount = 5;
+  static const char *const kElementKeys[kElementKeyCount];
+  static constexpr size_t kVNameKeyCount = 5;
+  static const char *const kVNameKeys[kVNameKeyCount];
+
+  /// \brief What we know about a kythe0.meta[i] element.
+  struct Element {
+    Element() { std::fill(kinds, kinds + kElementKeyCount, JsonKind::Missing); }
+    JsonKind kinds[kElementKeyCount];
+    std::string type;
+    unsigned begin = 0;
+    unsigned end = 0;
+    std::string edge;
+    proto::VName vname;
+  };
+
+  static size_t ElementIndex(MetaKey key) {
+    return static_cast<size_t>(key) - static_cast<size_t>(MetaKey::Type);
   }
-  if (!document.IsObject()) {
-    LOG(WARNING)
-        << "When loading metadata: root element in JSON was not an object.";
-    return nullptr;
+
+  /// \brief Records a scalar value for the current key.
+  bool Scalar(JsonKind kind, llvm::StringRef string_value,
+              unsigned uint_value) {
+    if (skip_depth_ > 0) {
+      return true;
+    }
+    if (skip_value_) {
+      skip_value_ = false;
+      return true;
+    }
+    if (contexts_.empty()) {
+      LOG(WARNING)
+          << "When loading metadata: root element in JSON was not an object.";
+      return false;
+    }
+    switch (contexts_.back()) {
+      case Context::Root:
+        if (key_ == MetaKey::Type) {
+          type_kind_ = kind;
+          type_ = string_value.str();
+        } else {
+          meta_kind_ = kind;
+        }
+        return true;
+      case Context::Meta:
+        LOG(WARNING) << "When loading metadata: kythe0.meta[i] not an object";
+        return false;
+      case Context::Element:
+        element_.kinds[ElementIndex(key_)] = kind;
+        if (key_ == MetaKey::Type) {
+          element_.type = string_value.str();
+        } else if (key_ == MetaKey::Edge) {
+          element_.edge = string_value.str();
+        } else if (key_ == MetaKey::Begin) {
+          element_.begin = uint_value;
+        } else if (key_ == MetaKey::End) {
+          element_.end = uint_value;
+        }
+        return true;
+      case Context::VName:
+        // Values that aren't strings are ignored.
+        if (kind == JsonKind::String) {
+          *VNameField(vname_field_) = string_value.str();
+        }
+        return true;
+    }
+    return true;
   }
-  const auto doc_type = document.FindMember("type");
-  if (doc_type == document.MemberEnd() || !doc_type->value.IsString()) {
-    LOG(WARNING) << "When loading metadata: JSON element is missing type.";
-    return nullptr;
+
+  /// \brief Records an object or array for the current key and skips it.
+  bool Container(JsonKind kind) {
+    if (contexts_.empty()) {
+      LOG(WARNING)
+          << "When loading metadata: root element in JSON was not an object.";
+      return false;
+    }
+    switch (contexts_.back()) {
+      case Context::Root:
+        (key_ == MetaKey::Type ? type_kind_ : meta_kind_) = kind;
+        break;
+      case Context::Meta:
+        LOG(WARNING) << "When loading metadata: kythe0.meta[i] not an object";
+        return false;
+      case Context::Element:
+        element_.kinds[ElementIndex(key_)] = kind;
+        break;
+      default:
+        break;
+    }
+    skip_depth_ = 1;
+    return true;
   }
-  const auto doc_type_val = llvm::StringRef(doc_type->value.GetString());
-  if (doc_type_val != "kythe0") {
-    LOG(WARNING) << "When loading metadata: JSON element has unexpected type "
-                 << doc_type_val.str();
-    return nullptr;
+
+  /// \return true if the object or array being started should be ignored.
+  bool SkipContainer() {
+    if (skip_depth_ > 0 || skip_value_) {
+      skip_value_ = false;
+      ++skip_depth_;
+      return true;
+    }
+    return false;
   }
-  const auto meta = document.FindMember("meta");
-  if (meta == document.MemberEnd() || !meta->value.IsArray()) {
-    LOG(WARNING)
-        << "When loading metadata: kythe0.meta missing or not an array";
-    return nullptr;
+
+  std::string *VNameField(size_t index) {
+    switch (index) {
+      case 0:
+        return element_.vname.mutable_signature();
+      case 1:
+        return element_.vname.mutable_root();
+      case 2:
+        return element_.vname.mutable_path();
+      case 3:
+        return element_.vname.mutable_language();
+      default:
+        return element_.vname.mutable_corpus();
+    }
   }
-  std::vector<MetadataFile::Rule> rules;
-  for (rapidjson::Value::ConstValueIterator meta_element = meta->value.Begin();
-       meta_element != meta->value.End(); ++meta_element) {
-    if (!meta_element->IsObject()) {
-      LOG(WARNING) << "When loading metadata: kythe0.meta[i] not an object";
-      return nullptr;
+
+  /// \brief Checks that `kind` (for `key`) is `expected` or warns.
+  bool CheckKind(MetaKey key, const char *expected_name, bool ok) {
+    if (!ok) {
+      LOG(WARNING) << "Unexpected or missing key "
+                   << kElementKeys[ElementIndex(key)] << " : "
+                   << expected_name;
+    }
+    return ok;
+  }
+
+  /// \brief Builds the rule for the element that just ended.
+  bool BuildRule(MetadataFile::Rule *rule) {
+    const auto kind = [this](MetaKey key) {
+      return element_.kinds[ElementIndex(key)];
+    };
+    if (!CheckKind(MetaKey::Type, "String",
+                   kind(MetaKey::Type) == JsonKind::String)) {
+      return false;
+    }
+    if (element_.type == "nop") {
+      *rule = MetadataFile::Rule();
+      return true;
+    }
+    if (element_.type != "anchor_defines") {
+      LOG(WARNING) << "When loading metadata: unknown meta type.";
+      return false;
+    }
+    const auto is_number = [&kind](MetaKey key) {
+      return kind(key) == JsonKind::Uint || kind(key) == JsonKind::Number;
+    };
+    if (!CheckKind(MetaKey::Begin, "Number", is_number(MetaKey::Begin)) ||
+        !CheckKind(MetaKey::End, "Number", is_number(MetaKey::End)) ||
+        !CheckKind(MetaKey::Edge, "String",
+                   kind(MetaKey::Edge) == JsonKind::String) ||
+        !CheckKind(MetaKey::VName, "Object",
+                   kind(MetaKey::VName) == JsonKind::Object)) {
+      return false;
     }
-    MetadataFile::Rule rule;
-    if (!LoadMetaElement(*meta_element, &rule)) {
-      return nullptr;
+    const auto &vname = element_.vname;
+    if (vname.corpus().empty() && vname.path().empty() &&
+        vname.root().empty() && vname.signature().empty() &&
+        vname.language().empty()) {
+      LOG(WARNING) << "When loading metadata: empty vname.";
+      return false;
     }
-    rules.push_back(rule);
+    if (kind(MetaKey::Begin) != JsonKind::Uint ||
+        kind(MetaKey::End) != JsonKind::Uint) {
+      return false;
+    }
+    llvm::StringRef edge_string = element_.edge;
+    if (edge_string.empty()) {
+      LOG(WARNING) << "When loading metadata: empty edge.";
+      return false;
+    }
+    bool reverse_edge = false;
+    if (edge_string[0] == '%') {
+      edge_string = edge_string.drop_front(1);
+      reverse_edge = true;
+    }
+    *rule = MetadataFile::Rule{element_.begin,
+                               element_.end,
+                               "/kythe/edge/defines/binding",
+                               edge_string.str(),
+                               vname,
+                               reverse_edge};
+    return true;
+  }
+
+  /// The objects and arrays we're inside, outermost first.
+  std::vector<Context> contexts_;
+  /// The key whose value comes next.
+  MetaKey key_ = MetaKey::None;
+  /// The number of ignored objects and arrays we're inside.
+  size_t skip_depth_ = 0;
+  /// Should the next value be ignored?
+  bool skip_value_ = false;
+  /// The root's type.
+  JsonKind type_kind_ = JsonKind::Missing;
+  std::string type_;
+  /// The kind of the root's meta value.
+  JsonKind meta_kind_ = JsonKind::Missing;
+  /// The element being parsed.
+  Element element_;
+  /// Which of `kVNameKeys` we've seen in the current vname.
+  bool vname_seen_[kVNameKeyCount] = {};
+  /// The index in `kVNameKeys` of the vname field whose value comes next.
+  size_t vname_field_ = 0;
+  /// The rules for the elements parsed so far.
+  std::vector<MetadataFile::Rule> rules_;
+};
+
+const char *const MetadataBuilder::kElementKeys[] = {"type", "begin", "end",
+                                                     "edge", "vname"};
+const char *const MetadataBuilder::kVNameKeys[] = {
+    "signature", "root", "path", "language", "corpus"};
+constexpr size_t MetadataBuilder::kElementKeyCount;
+constexpr size_t MetadataBuilder::kVNameKeyCount;
+}  // anonymous namespace
+
+std::unique_ptr<MetadataFile> KytheMetadataSupport::LoadFromJSON(
+    llvm::StringRef json) {
+  rapidjson::MemoryStream stream(json.data(), json.size());
+  MetadataBuilder builder;
+  rapidjson::Reader reader;
+  reader.Parse(stream, builder);
+  if (reader.HasParseError()) {
+    // The builder has already explained why it stopped the parse.
+    if (reader.GetParseErrorCode() != rapidjson::kParseErrorTermination) {
+      LOG(WARNING) << rapidjson::GetParseError_En(reader.GetParseErrorCode())
+                   << " near offset " << reader.GetErrorOffset();
+    }
+    return nullptr;
   }
-  return MetadataFile::LoadFromRules(rules.begin(), rules.end());
+  if (!builder.Finish()) {
+    return nullptr;
+  }
+  return MetadataFile::LoadFromRules(builder.TakeRules());
 }
 
 std::unique_ptr<kythe::MetadataFile> KytheMetadataSupport::ParseFile(
@@ -198,13 +470,98 @@ std::unique_ptr<kythe::MetadataFile> KytheMetadataSupport::ParseFile(
   return metadata;
 }
 
+void MetadataSupports::Add(std::unique_ptr<MetadataSupport> support) {
+  support->UseVNameLookup([this](const std::string &path, proto::VName *out) {
+    return RecordingLookup(path, out);
+  });
+  supports_.push_back(std::move(support));
+}
+
 void MetadataSupports::UseVNameLookup(VNameLookup lookup) const {
-  for (auto &support : supports_) {
-    support->UseVNameLookup(lookup);
+  lookup_ = std::move(lookup);
+}
+
+void MetadataSupports::set_cache_capacity(size_t capacity) {
+  cache_capacity_ = capacity;
+  while (cache_order_.size() > cache_capacity_) {
+    cache_.erase(cache_order_.front());
+    cache_order_.pop_front();
+  }
+}
+
+bool MetadataSupports::RecordingLookup(const std::string &path,
+                                       proto::VName *out) const {
+  proto::VName vname;
+  bool found = lookup_(path, &vname);
+  if (recording_ != nullptr) {
+    // Supports tend to ask about the same few paths over and over.
+    bool seen = false;
+    for (const auto &lookup : *recording_) {
+      if (lookup.path == path) {
+        seen = true;
+        break;
+      }
+    }
+    if (!seen) {
+      recording_->push_back(LookupResult{path, found, vname});
+    }
+  }
+  if (found) {
+    out->MergeFrom(vname);
+  }
+  return found;
+}
+
+bool MetadataSupports::LookupsMatch(const CacheEntry &entry) const {
+  for (const auto &lookup : entry.lookups) {
+    proto::VName vname;
+    if (lookup_(lookup.path, &vname) != lookup.found ||
+        (lookup.found && !VNameEquals(vname, lookup.vname))) {
+      return false;
+    }
+  }
+  return true;
+}
+
+std::shared_ptr<const kythe::MetadataFile> MetadataSupports::ParseFile(
+    const std::string &filename, const llvm::MemoryBuffer *buffer) const {
+  if (cache_capacity_ == 0) {
+    return ParseUncached(filename, buffer);
+  }
+  Digest digest;
+  {
+    ::SHA256_CTX sha;
+    ::SHA256_Init(&sha);
+    uint64_t size = filename.size();
+    ::SHA256_Update(&sha, &size, sizeof(size));
+    ::SHA256_Update(&sha, filename.data(), filename.size());
+    ::SHA256_Update(&sha, buffer->getBufferStart(), buffer->getBufferSize());
+    ::SHA256_Final(digest.data(), &sha);
+  }
+  auto cached = cache_.find(digest);
+  if (cached != cache_.end()) {
+    if (LookupsMatch(cached->second)) {
+      return cached->second.file;
+    }
+  } else {
+    if (cache_order_.size() >= cache_capacity_) {
+      cache_.erase(cache_order_.front());
+      cache_order_.pop_front();
+    }
+    cached = cache_.emplace(digest, CacheEntry()).first;
+    cache_order_.push_back(digest);
   }
+  // Parse (or, if the VName configuration changed, reparse) the file,
+  // replacing what was cached.
+  CacheEntry &entry = cached->second;
+  entry.lookups.clear();
+  recording_ = &entry.lookups;
+  entry.file = ParseUncached(filename, buffer);
+  recording_ = nullptr;
+  return entry.file;
 }
 
-std::unique_ptr<kythe::MetadataFile> MetadataSupports::ParseFile(
+std::unique_ptr<kythe::MetadataFile> MetadataSupports::ParseUncached(
     const std::string &filename, const llvm::MemoryBuffer *buffer) const {
   std::string modified_filename = filename;
   std::unique_ptr<llvm::MemoryBuffer> decoded_buffer_storage;
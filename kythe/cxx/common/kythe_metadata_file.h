@@ -20,11 +20,16 @@
 #include "kythe/proto/storage.pb.h"
 
 #include "llvm/ADT/StringRef.h"
+#include "llvm/ADT/iterator_range.h"
 #include "llvm/Support/MemoryBuffer.h"
-#include "rapidjson/document.h"
 
+#include <algorithm>
+#include <array>
+#include <deque>
 #include <map>
 #include <memory>
+#include <string>
+#include <vector>
 
 namespace kythe {
 
@@ -41,24 +46,55 @@ class MetadataFile {
                            ///< from.
   };
 
+  using RuleIterator = std::vector<Rule>::const_iterator;
+
   /// Creates a new MetadataFile from a list of rules ranging from `begin` to
   /// `end`.
   template <typename InputIterator>
   static std::unique_ptr<MetadataFile> LoadFromRules(InputIterator begin,
                                                      InputIterator end) {
+    return LoadFromRules(std::vector<Rule>(begin, end));
+  }
+
+  /// Creates a new MetadataFile that takes ownership of `rules`.
+  static std::unique_ptr<MetadataFile> LoadFromRules(std::vector<Rule> rules) {
     std::unique_ptr<MetadataFile> meta_file(new MetadataFile());
-    for (auto rule = begin; rule != end; ++rule) {
-      meta_file->rules_.emplace(rule->begin, *rule);
-    }
+    // Rules with the same range keep their relative order.
+    std::stable_sort(rules.begin(), rules.end(), RangeLess());
+    meta_file->rules_ = std::move(rules);
     return meta_file;
   }
 
-  /// Rules to apply keyed on `begin`.
-  const std::multimap<unsigned, Rule> &rules() const { return rules_; }
+  /// Rules to apply, sorted on (`begin`, `end`).
+  const std::vector<Rule> &rules() const { return rules_; }
+
+  /// \return the rules matching exactly the range [`begin`, `end`), in the
+  /// order they were loaded. Takes time logarithmic in the number of rules.
+  llvm::iterator_range<RuleIterator> RulesForRange(unsigned begin,
+                                                   unsigned end) const {
+    auto found = std::equal_range(rules_.begin(), rules_.end(),
+                                  std::make_pair(begin, end), RangeLess());
+    return llvm::make_range(found.first, found.second);
+  }
 
  private:
-  /// Rules to apply keyed on `begin`.
-  std::multimap<unsigned, Rule> rules_;
+  /// Orders rules (and (begin, end) pairs) on their ranges.
+  struct RangeLess {
+    static std::pair<unsigned, unsigned> Key(const Rule &rule) {
+      return std::make_pair(rule.begin, rule.end);
+    }
+    static const std::pair<unsigned, unsigned> &Key(
+        const std::pair<unsigned, unsigned> &range) {
+      return range;
+    }
+    template <typename L, typename R>
+    bool operator()(const L &lhs, const R &rhs) const {
+      return Key(lhs) < Key(rhs);
+    }
+  };
+
+  /// Rules to apply, sorted on (`begin`, `end`).
+  std::vector<Rule> rules_;
 };
 
 /// \brief Provides interested MetadataSupport classes with the ability to
@@ -97,6 +133,12 @@ class MetadataSupport {
 /// a non-null result from `ParseFile` is elected to provide metadata for a
 /// given (`filename`, `buffer`) pair.
 ///
+/// Results are cached by a digest of the filename and contents, so a file
+/// included by many compilation units is only parsed once per process. Since
+/// a parse may depend on the `VNameLookup`, each cached result remembers the
+/// lookups made while building it. The result is reused only if the current
+/// lookup still gives the same answers.
+///
 /// If the metadata file ends in .h, we assume that it is a valid C++ header
 /// that begins with a comment marker followed immediately by a base64-encoded
 /// buffer. We will decode and parse this buffer using the filename with the .h
@@ -109,17 +151,69 @@ class MetadataSupport {
 /// If the comment is a /* */-style comment, newlines (\n) are permitted.
 class MetadataSupports {
  public:
-  void Add(std::unique_ptr<MetadataSupport> support) {
-    supports_.push_back(std::move(support));
-  }
+  MetadataSupports() = default;
+  MetadataSupports(const MetadataSupports &) = delete;
+  MetadataSupports &operator=(const MetadataSupports &) = delete;
 
-  std::unique_ptr<kythe::MetadataFile> ParseFile(
+  void Add(std::unique_ptr<MetadataSupport> support);
+
+  /// \brief Parses the metadata file `filename` with contents `buffer`.
+  /// \return the parsed file, which may be shared with earlier callers, or
+  /// null on failure.
+  std::shared_ptr<const kythe::MetadataFile> ParseFile(
       const std::string &filename, const llvm::MemoryBuffer *buffer) const;
 
   void UseVNameLookup(VNameLookup lookup) const;
 
+  /// \brief Keep at most `capacity` parsed files cached. 0 disables caching.
+  void set_cache_capacity(size_t capacity);
+
  private:
+  /// \brief The digest identifying a metadata file's name and contents.
+  using Digest = std::array<unsigned char, 32>;
+
+  /// \brief A lookup made during a parse and the answer it got.
+  struct LookupResult {
+    std::string path;
+    bool found;
+    proto::VName vname;
+  };
+
+  /// \brief A cached result of `ParseFile`.
+  struct CacheEntry {
+    /// The parsed file, or null if parsing failed.
+    std::shared_ptr<const kythe::MetadataFile> file;
+    /// The lookups made while parsing `file`.
+    std::vector<LookupResult> lookups;
+  };
+
+  /// \brief Parses `filename` without consulting the cache.
+  std::unique_ptr<kythe::MetadataFile> ParseUncached(
+      const std::string &filename, const llvm::MemoryBuffer *buffer) const;
+
+  /// \brief Answers lookups from the supports, recording them if a parse is
+  /// being cached.
+  bool RecordingLookup(const std::string &path, proto::VName *out) const;
+
+  /// \return true if `lookup_` still gives the answers in `entry`.
+  bool LookupsMatch(const CacheEntry &entry) const;
+
   std::vector<std::unique_ptr<MetadataSupport>> supports_;
+  // ParseFile and UseVNameLookup are const for the sake of callers that share
+  // one MetadataSupports between compilation units; the cache and the current
+  // lookup are bookkeeping they don't observe.
+  /// The lookup to use for new parses.
+  mutable VNameLookup lookup_ = [](const std::string &path, proto::VName *out) {
+    return false;
+  };
+  /// The lookups made by the parse in progress, or null.
+  mutable std::vector<LookupResult> *recording_ = nullptr;
+  /// Cached parses.
+  mutable std::map<Digest, CacheEntry> cache_;
+  /// The keys of `cache_`, oldest first.
+  mutable std::deque<Digest> cache_order_;
+  /// The most entries to keep in `cache_`.
+  size_t cache_capacity_ = 4096;
 };
 
 /// \brief Enables support for raw JSON-encoded metadata files.
@@ -133,10 +227,6 @@ class KytheMetadataSupport : public MetadataSupport {
   /// \brief Load the JSON-encoded metadata from `json`.
   /// \return null on failure.
   static std::unique_ptr<MetadataFile> LoadFromJSON(llvm::StringRef json);
-  /// \brief Load the metadata rule from `value` into the Rule `rule`.
-  /// \return false on failure.
-  static bool LoadMetaElement(const rapidjson::Value &value,
-                              MetadataFile::Rule *rule);
 };
 
 }  // namespace kythe
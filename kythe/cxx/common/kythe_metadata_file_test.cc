@@ -0,0 +1,156 @@
+/*
+ * Copyright 2017 Google Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "kythe/cxx/common/kythe_metadata_file.h"
+
+#include "glog/logging.h"
+#include "google/protobuf/descriptor.pb.h"
+#include "gtest/gtest.h"
+#include "kythe/cxx/common/protobuf_metadata_file.h"
+
+namespace kythe {
+namespace {
+
+constexpr char kKytheMetadata[] =
+    "{\"type\":\"kythe0\",\"meta\":[{\"type\":\"anchor_defines\",\"begin\":1,"
+    "\"end\":3,\"edge\":\"%/kythe/edge/generates\",\"vname\":{\"signature\":"
+    "\"s\",\"corpus\":\"c\"}}]}";
+
+std::unique_ptr<llvm::MemoryBuffer> MakeBuffer(llvm::StringRef data) {
+  return llvm::MemoryBuffer::getMemBufferCopy(data);
+}
+
+/// \brief Returns the serialized GeneratedCodeInfo for a single annotation.
+std::string MakeProtobufMetadata() {
+  google::protobuf::GeneratedCodeInfo info;
+  auto *annotation = info.add_annotation();
+  annotation->set_source_file("a.proto");
+  annotation->add_path(4);
+  annotation->add_path(0);
+  annotation->set_begin(10);
+  annotation->set_end(20);
+  return info.SerializeAsString();
+}
+
+MetadataFile::Rule MakeRule(unsigned begin, unsigned end,
+                            const std::string &signature) {
+  MetadataFile::Rule rule;
+  rule.begin = begin;
+  rule.end = end;
+  rule.edge_in = "/kythe/edge/defines/binding";
+  rule.edge_out = "/kythe/edge/generates";
+  rule.vname.set_signature(signature);
+  rule.reverse_edge = true;
+  return rule;
+}
+
+TEST(MetadataFile, FindsRulesForExactRanges) {
+  std::vector<MetadataFile::Rule> rules = {
+      MakeRule(5, 9, "a"), MakeRule(1, 3, "b"), MakeRule(5, 7, "c"),
+      MakeRule(5, 9, "d"), MakeRule(1, 3, "e")};
+  auto file = MetadataFile::LoadFromRules(rules.begin(), rules.end());
+  std::vector<std::string> found;
+  for (const auto &rule : file->RulesForRange(5, 9)) {
+    found.push_back(rule.vname.signature());
+  }
+  // Rules sharing a range stay in the order they were given.
+  EXPECT_EQ((std::vector<std::string>{"a", "d"}), found);
+  found.clear();
+  for (const auto &rule : file->RulesForRange(1, 3)) {
+    found.push_back(rule.vname.signature());
+  }
+  EXPECT_EQ((std::vector<std::string>{"b", "e"}), found);
+  EXPECT_TRUE(file->RulesForRange(5, 8).empty());
+  EXPECT_TRUE(file->RulesForRange(0, 3).empty());
+  EXPECT_TRUE(file->RulesForRange(10, 12).empty());
+  ASSERT_EQ(5, file->rules().size());
+  EXPECT_EQ("c", file->rules()[2].vname.signature());
+}
+
+TEST(MetadataSupports, ReusesParsesOfIdenticalFiles) {
+  MetadataSupports supports;
+  supports.Add(std::unique_ptr<MetadataSupport>(new KytheMetadataSupport()));
+  auto buffer = MakeBuffer(kKytheMetadata);
+  auto first = supports.ParseFile("a.meta", buffer.get());
+  ASSERT_TRUE(first != nullptr);
+  ASSERT_EQ(1, first->rules().size());
+  EXPECT_EQ("c", first->rules().front().vname.corpus());
+  auto copy = MakeBuffer(kKytheMetadata);
+  EXPECT_EQ(first, supports.ParseFile("a.meta", copy.get()));
+  // The filename is part of the key, since supports may depend on it.
+  auto other = supports.ParseFile("b.meta", buffer.get());
+  ASSERT_TRUE(other != nullptr);
+  EXPECT_NE(first, other);
+}
+
+TEST(MetadataSupports, CachesFailures) {
+  MetadataSupports supports;
+  supports.Add(std::unique_ptr<MetadataSupport>(new KytheMetadataSupport()));
+  auto buffer = MakeBuffer("{]");
+  EXPECT_TRUE(supports.ParseFile("a.meta", buffer.get()) == nullptr);
+  EXPECT_TRUE(supports.ParseFile("a.meta", buffer.get()) == nullptr);
+}
+
+TEST(MetadataSupports, ReparsesWhenLookupsChange) {
+  MetadataSupports supports;
+  supports.Add(
+      std::unique_ptr<MetadataSupport>(new ProtobufMetadataSupport()));
+  std::string corpus = "first";
+  supports.UseVNameLookup([&corpus](const std::string &path,
+                                    proto::VName *out) {
+    out->set_corpus(corpus);
+    return true;
+  });
+  auto buffer = MakeBuffer(MakeProtobufMetadata());
+  auto first = supports.ParseFile("a.pb.h.meta", buffer.get());
+  ASSERT_TRUE(first != nullptr);
+  ASSERT_EQ(1, first->rules().size());
+  EXPECT_EQ("first", first->rules().front().vname.corpus());
+  EXPECT_EQ(first, supports.ParseFile("a.pb.h.meta", buffer.get()));
+  corpus = "second";
+  auto second = supports.ParseFile("a.pb.h.meta", buffer.get());
+  ASSERT_TRUE(second != nullptr);
+  EXPECT_NE(first, second);
+  EXPECT_EQ("second", second->rules().front().vname.corpus());
+  // Earlier results are unchanged.
+  EXPECT_EQ("first", first->rules().front().vname.corpus());
+}
+
+TEST(MetadataSupports, EvictsOldestEntries) {
+  MetadataSupports supports;
+  supports.Add(std::unique_ptr<MetadataSupport>(new KytheMetadataSupport()));
+  supports.set_cache_capacity(1);
+  auto buffer = MakeBuffer(kKytheMetadata);
+  auto first = supports.ParseFile("a.meta", buffer.get());
+  supports.ParseFile("b.meta", buffer.get());
+  auto again = supports.ParseFile("a.meta", buffer.get());
+  ASSERT_TRUE(again != nullptr);
+  EXPECT_NE(first, again);
+  supports.set_cache_capacity(0);
+  EXPECT_NE(supports.ParseFile("a.meta", buffer.get()),
+            supports.ParseFile("a.meta", buffer.get()));
+}
+
+}  // anonymous namespace
+}  // namespace kythe
+
+int main(int argc, char **argv) {
+  GOOGLE_PROTOBUF_VERIFY_VERSION;
+  google::InitGoogleLogging(argv[0]);
+  ::testing::InitGoogleTest(&argc, argv);
+  int result = RUN_ALL_TESTS();
+  return result;
+}
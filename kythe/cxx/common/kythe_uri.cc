@@ -20,14 +20,32 @@
 
 namespace kythe {
 
-/// \brief Returns whether a byte should be escaped.
-/// \param mode The escaping mode to use.
-/// \param c The byte to examine.
-inline bool should_escape(UriEscapeMode mode, char c) {
-  return !((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
-           (c >= '0' && c <= '9') || c == '-' || c == '.' || c == '_' ||
-           c == '~' || (mode == UriEscapeMode::kEscapePaths && c == '/'));
-}
+namespace {
+/// \brief Which bytes need escaping under each `UriEscapeMode`.
+class EscapeTable {
+ public:
+  EscapeTable() {
+    for (int c = 0; c < 256; ++c) {
+      bool keep = (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
+                  (c >= '0' && c <= '9') || c == '-' || c == '.' ||
+                  c == '_' || c == '~';
+      escape_all_[c] = !keep;
+      escape_paths_[c] = !keep && c != '/';
+    }
+  }
+
+  /// \brief Returns a table, indexed by unsigned byte, that is true for
+  /// the bytes that should be escaped under `mode`.
+  static const bool *ForMode(UriEscapeMode mode) {
+    static const EscapeTable* const kTable = new EscapeTable();
+    return mode == UriEscapeMode::kEscapeAll ? kTable->escape_all_
+                                             : kTable->escape_paths_;
+  }
+
+ private:
+  bool escape_all_[256];
+  bool escape_paths_[256];
+};
 
 /// \brief Returns the value of a hex digit.
 /// \param digit The hex digit.
@@ -43,63 +61,64 @@ inline int value_for_hex_digit(char c) {
   return -1;
 }
 
-static constexpr char kHexDigits[] = "0123456789ABCDEF";
-
-static std::string UriEscape(UriEscapeMode mode, llvm::StringRef uri) {
-  size_t num_escapes = 0;
-  for (char c : uri) {
-    if (should_escape(mode, c)) {
-      ++num_escapes;
+/// \brief Returns whether every escape sequence in `string` is well-formed.
+bool IsWellEscaped(llvm::StringRef string) {
+  for (size_t i = string.find('%'); i != llvm::StringRef::npos;
+       i = string.find('%', i + 3)) {
+    if (i + 3 > string.size() || value_for_hex_digit(string[i + 1]) < 0 ||
+        value_for_hex_digit(string[i + 2]) < 0) {
+      return false;
     }
   }
-  std::string result;
-  result.reserve(num_escapes * 2 + uri.size());
-  for (char c : uri) {
-    if (should_escape(mode, c)) {
-      result.push_back('%');
-      result.push_back(kHexDigits[(c >> 4) & 0xF]);
-      result.push_back(kHexDigits[c & 0xF]);
-    } else {
-      result.push_back(c);
+  return true;
+}
+
+constexpr char kHexDigits[] = "0123456789ABCDEF";
+}  // anonymous namespace
+
+void UriEscape(UriEscapeMode mode, llvm::StringRef uri, std::string* out) {
+  const bool* should_escape = EscapeTable::ForMode(mode);
+  const char* run = uri.begin();
+  for (const char *c = uri.begin(), *end = uri.end(); c != end; ++c) {
+    if (should_escape[static_cast<unsigned char>(*c)]) {
+      // Copy the unescaped run before this byte all at once.
+      out->append(run, c);
+      out->push_back('%');
+      out->push_back(kHexDigits[(*c >> 4) & 0xF]);
+      out->push_back(kHexDigits[*c & 0xF]);
+      run = c + 1;
     }
   }
-  return result;
+  out->append(run, uri.end());
 }
 
 std::string UriEscape(UriEscapeMode mode, const std::string& uri) {
-  return UriEscape(mode, llvm::StringRef(uri));
+  std::string result;
+  result.reserve(uri.size());
+  UriEscape(mode, uri, &result);
+  return result;
 }
 
-/// \brief URI-unescapes a string.
-/// \param string The string to unescape.
-/// \return A pair of (success, error-or-unescaped-string).
-std::pair<bool, std::string> UriUnescape(const std::string& string) {
-  size_t num_escapes = 0;
-  for (size_t i = 0, s = string.size(); i < s; ++i) {
-    if (string[i] == '%') {
-      ++num_escapes;
-      if (i + 3 > string.size()) {
-        return std::make_pair(false, "bad escape");
-      }
-      i += 2;
+bool UriUnescape(llvm::StringRef string, std::string* out) {
+  for (size_t i = 0, s = string.size(); i < s;) {
+    size_t escape = string.find('%', i);
+    if (escape == llvm::StringRef::npos) {
+      out->append(string.data() + i, s - i);
+      break;
     }
-  }
-  std::string result;
-  result.reserve(string.size() - num_escapes * 2);
-  for (size_t i = 0, s = string.size(); i < s; ++i) {
-    char c = string[i];
-    if (c != '%') {
-      result.push_back(c);
-      continue;
+    out->append(string.data() + i, escape - i);
+    if (escape + 3 > s) {
+      return false;
     }
-    int high = value_for_hex_digit(string[++i]);
-    int low = value_for_hex_digit(string[++i]);
+    int high = value_for_hex_digit(string[escape + 1]);
+    int low = value_for_hex_digit(string[escape + 2]);
     if (high < 0 || low < 0) {
-      return std::make_pair(false, "bad hex digit");
+      return false;
     }
-    result.push_back((high << 4) | low);
+    out->push_back((high << 4) | low);
+    i = escape + 3;
   }
-  return std::make_pair(true, result);
+  return true;
 }
 
 /// The URI scheme label for Kythe.
@@ -107,38 +126,39 @@ static constexpr char kUriScheme[] = "kythe";
 static constexpr char kUriPrefix[] = "kythe:";
 
 std::string URI::ToString() const {
-  std::string result = kUriPrefix;
-  if (vname_.signature().empty() && vname_.path().empty() &&
-      vname_.root().empty() && vname_.corpus().empty() &&
-      vname_.language().empty()) {
-    return result;
-  }
+  std::string result;
+  AppendToString(&result);
+  return result;
+}
+
+void URI::AppendToString(std::string* out) const {
+  out->append(kUriPrefix);
   llvm::StringRef signature = ToStringRef(vname_.signature());
   llvm::StringRef path = ToStringRef(vname_.path());
   llvm::StringRef corpus = ToStringRef(vname_.corpus());
   llvm::StringRef language = ToStringRef(vname_.language());
   llvm::StringRef root = ToStringRef(vname_.root());
   if (!corpus.empty()) {
-    result.append("//");
-    result.append(UriEscape(UriEscapeMode::kEscapePaths, corpus));
+    out->append("//");
+    UriEscape(UriEscapeMode::kEscapePaths, corpus, out);
   }
   if (!language.empty()) {
-    result.append("?lang=");
-    result.append(UriEscape(UriEscapeMode::kEscapeAll, language));
+    out->append("?lang=");
+    UriEscape(UriEscapeMode::kEscapeAll, language, out);
   }
   if (!path.empty()) {
-    result.append("?path=");
-    result.append(UriEscape(UriEscapeMode::kEscapePaths, CleanPath(path)));
+    out->append("?path=");
+    llvm::SmallString<256> clean_path;
+    UriEscape(UriEscapeMode::kEscapePaths, CleanPath(path, &clean_path), out);
   }
   if (!root.empty()) {
-    result.append("?root=");
-    result.append(UriEscape(UriEscapeMode::kEscapePaths, root));
+    out->append("?root=");
+    UriEscape(UriEscapeMode::kEscapePaths, root, out);
   }
   if (!signature.empty()) {
-    result.push_back('#');
-    result.append(UriEscape(UriEscapeMode::kEscapeAll, signature));
+    out->push_back('#');
+    UriEscape(UriEscapeMode::kEscapeAll, signature, out);
   }
-  return result;
 }
 
 /// \brief Separate out the scheme component of `uri` if one exists.
@@ -160,10 +180,12 @@ static std::pair<llvm::StringRef, llvm::StringRef> SplitScheme(
 
 URI::URI(const kythe::proto::VName& from_vname) : vname_(from_vname) {}
 
-bool URI::ParseString(const std::string& in_string) {
-  llvm::StringRef string(in_string);
+bool URIView::Parse(llvm::StringRef string) {
+  *this = URIView();
+  URIView result;
   auto head_fragment = string.split('#');
-  auto head = head_fragment.first, fragment = head_fragment.second;
+  auto head = head_fragment.first;
+  result.signature_ = head_fragment.second;
   auto scheme_head = SplitScheme(head);
   auto scheme = scheme_head.first;
   head = scheme_head.second;
@@ -179,43 +201,64 @@ bool URI::ParseString(const std::string& in_string) {
   auto head_attrs = head.split('?');
   head = head_attrs.first;
   auto attrs = head_attrs.second;
-  std::string corpus;
   if (!head.empty()) {
     if (!head.startswith("//")) {
       return false;
     }
-    auto maybe_corpus = UriUnescape(head.drop_front(2));
-    if (!maybe_corpus.first) {
-      return false;
-    }
-    corpus = maybe_corpus.second;
+    result.corpus_ = head.drop_front(2);
   }
-  auto maybe_sig = UriUnescape(fragment);
-  if (!maybe_sig.first) {
+  if (!IsWellEscaped(result.corpus_) || !IsWellEscaped(result.signature_)) {
     return false;
   }
-  auto signature = maybe_sig.second;
   while (!attrs.empty()) {
     auto attr_rest = attrs.split('?');
     auto attr = attr_rest.first;
     attrs = attr_rest.second;
     auto name_value = attr.split('=');
-    auto maybe_value = UriUnescape(name_value.second);
-    if (!maybe_value.first || maybe_value.second.empty()) {
+    if (name_value.second.empty() || !IsWellEscaped(name_value.second)) {
       return false;
     }
     if (name_value.first == "lang") {
-      vname_.set_language(maybe_value.second);
+      result.language_ = name_value.second;
     } else if (name_value.first == "root") {
-      vname_.set_root(maybe_value.second);
+      result.root_ = name_value.second;
     } else if (name_value.first == "path") {
-      vname_.set_path(CleanPath(maybe_value.second));
+      result.path_ = name_value.second;
     } else {
       return false;
     }
   }
-  vname_.set_signature(signature);
-  vname_.set_corpus(corpus);
+  *this = result;
+  return true;
+}
+
+/// \brief Unescapes `escaped` into `field` of `vname`.
+///
+/// Parse() checked every escape, so this can't fail.
+static void SetUnescaped(llvm::StringRef escaped, std::string* field) {
+  field->clear();
+  UriUnescape(escaped, field);
+}
+
+void URIView::ToVName(kythe::proto::VName* vname) const {
+  SetUnescaped(signature_, vname->mutable_signature());
+  SetUnescaped(corpus_, vname->mutable_corpus());
+  SetUnescaped(root_, vname->mutable_root());
+  SetUnescaped(language_, vname->mutable_language());
+  std::string* path = vname->mutable_path();
+  SetUnescaped(path_, path);
+  if (!IsCleanPath(*path)) {
+    llvm::SmallString<256> clean_path;
+    *path = CleanPath(*path, &clean_path).str();
+  }
+}
+
+bool URI::ParseString(llvm::StringRef string) {
+  URIView view;
+  if (!view.Parse(string)) {
+    return false;
+  }
+  view.ToVName(&vname_);
   return true;
 }
 
@@ -20,6 +20,7 @@
 #include <string>
 
 #include "kythe/cxx/common/vname_ordering.h"
+#include "llvm/ADT/StringRef.h"
 #include "kythe/proto/storage.pb.h"
 
 namespace kythe {
@@ -35,6 +36,48 @@ enum class UriEscapeMode {
 /// \param string The string to escape.
 std::string UriEscape(UriEscapeMode mode, const std::string &uri);
 
+/// \brief URI-escapes a string, appending the result to `out`.
+/// \param mode The escaping mode to use.
+/// \param string The string to escape.
+/// \param out The string to append to.
+void UriEscape(UriEscapeMode mode, llvm::StringRef string, std::string *out);
+
+/// \brief URI-unescapes a string, appending the result to `out`.
+/// \param string The string to unescape.
+/// \param out The string to append to.
+/// \return false if `string` contains a malformed escape sequence.
+bool UriUnescape(llvm::StringRef string, std::string *out);
+
+/// \brief The still-escaped components of an encoded Kythe URI.
+///
+/// A `URIView` refers into the string it was parsed from and never copies
+/// it, so it must not outlive that string. Use it to pick a ticket apart
+/// when you don't need a full `URI`.
+class URIView {
+ public:
+  /// \brief Splits `uri` into its components.
+  /// \param uri The encoded URI, which must outlive this view.
+  /// \return false if `uri` is malformed; the view is then left empty.
+  bool Parse(llvm::StringRef uri);
+
+  /// \brief Unescapes this view's components into `vname`, overwriting
+  /// them and canonicalizing the path.
+  void ToVName(kythe::proto::VName *vname) const;
+
+  llvm::StringRef escaped_signature() const { return signature_; }
+  llvm::StringRef escaped_corpus() const { return corpus_; }
+  llvm::StringRef escaped_root() const { return root_; }
+  llvm::StringRef escaped_path() const { return path_; }
+  llvm::StringRef escaped_language() const { return language_; }
+
+ private:
+  llvm::StringRef signature_;
+  llvm::StringRef corpus_;
+  llvm::StringRef root_;
+  llvm::StringRef path_;
+  llvm::StringRef language_;
+};
+
 /// \brief A Kythe URI.
 ///
 /// URIs are not in 1:1 correspondence with VNames--particularly because
@@ -53,7 +96,7 @@ class URI {
   /// \brief Constructs a URI from an encoded string.
   /// \param uri The string to construct from.
   /// \return (true, URI) on success; (false, empty URI) on failure.
-  static std::pair<bool, URI> FromString(const std::string &uri) {
+  static std::pair<bool, URI> FromString(llvm::StringRef uri) {
     URI result;
     bool is_ok = result.ParseString(uri);
     return std::make_pair(is_ok, result);
@@ -64,6 +107,11 @@ class URI {
   /// \return This URI, appropriately escaped.
   std::string ToString() const;
 
+  /// \brief Encodes this URI, appending it to `out`.
+  ///
+  /// Reusing `out` across calls avoids allocating for every ticket.
+  void AppendToString(std::string *out) const;
+
   /// \return This URI as a VName.
   const kythe::proto::VName &v_name() const { return vname_; }
 
@@ -71,7 +119,7 @@ class URI {
   /// \brief Attempts to overwrite vname_ using the provided URI string.
   /// \param uri The URI to parse.
   /// \return true on success
-  bool ParseString(const std::string &uri);
+  bool ParseString(llvm::StringRef uri);
 
   /// The VName this URI represents.
   kythe::proto::VName vname_;
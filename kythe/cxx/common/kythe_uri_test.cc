@@ -287,6 +287,51 @@ TEST(KytheUri, Strings) {
   }
 }
 
+TEST(KytheUri, AppendToString) {
+  std::string out = "ticket ";
+  MakeURI().Corpus("a b").Path("c/../d").Signature("#").uri().AppendToString(
+      &out);
+  EXPECT_EQ("ticket kythe://a%20b?path=d#%23", out);
+}
+
+TEST(KytheUri, EscapeAndUnescape) {
+  std::string out = "x";
+  UriEscape(UriEscapeMode::kEscapePaths, "a/b c+d\xff", &out);
+  EXPECT_EQ("xa/b%20c%2Bd%FF", out);
+  EXPECT_EQ("a%2Fb", UriEscape(UriEscapeMode::kEscapeAll, "a/b"));
+  out.clear();
+  EXPECT_TRUE(UriUnescape("a/b%20c%2bd%FF", &out));
+  EXPECT_EQ("a/b c+d\xff", out);
+  EXPECT_FALSE(UriUnescape("%2", &out));
+  EXPECT_FALSE(UriUnescape("%zz", &out));
+}
+
+TEST(KytheUri, View) {
+  constexpr char ticket[] =
+      "kythe://c%2B%2B?lang=L?path=a/../b?root=R#sig%20nature";
+  URIView view;
+  ASSERT_TRUE(view.Parse(ticket));
+  EXPECT_EQ("c%2B%2B", view.escaped_corpus());
+  EXPECT_EQ(ticket + 8, view.escaped_corpus().data());
+  EXPECT_EQ("L", view.escaped_language());
+  EXPECT_EQ("a/../b", view.escaped_path());
+  EXPECT_EQ("R", view.escaped_root());
+  EXPECT_EQ("sig%20nature", view.escaped_signature());
+  kythe::proto::VName vname;
+  vname.set_path("old");
+  view.ToVName(&vname);
+  EXPECT_EQ("c++", vname.corpus());
+  EXPECT_EQ("L", vname.language());
+  EXPECT_EQ("b", vname.path());
+  EXPECT_EQ("R", vname.root());
+  EXPECT_EQ("sig nature", vname.signature());
+  for (const char *bad :
+       {"kythe://%zz", "kythe:#%2", "kythe:?path=", "kythe:?bad=1", "x:"}) {
+    EXPECT_FALSE(view.Parse(bad)) << bad;
+    EXPECT_TRUE(view.escaped_corpus().empty()) << bad;
+  }
+}
+
 }  // anonymous namespace
 }  // namespace kythe
 
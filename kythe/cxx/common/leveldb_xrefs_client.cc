@@ -0,0 +1,931 @@
+/*
+ * Copyright 2017 Google Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "kythe/cxx/common/leveldb_xrefs_client.h"
+
+#include <algorithm>
+#include <deque>
+#include <map>
+#include <unordered_map>
+#include <unordered_set>
+
+#include "kythe/cxx/common/json_proto.h"
+#include "kythe/cxx/common/kythe_uri.h"
+#include "kythe/proto/internal.pb.h"
+#include "kythe/proto/serving.pb.h"
+#include "leveldb/cache.h"
+#include "leveldb/db.h"
+#include "leveldb/options.h"
+
+namespace kythe {
+namespace {
+
+// Key prefixes used by the combined serving table (see
+// kythe/go/serving/xrefs/xrefs.go).
+constexpr char kEdgeSetsPrefix[] = "edgeSets:";
+constexpr char kEdgePagesPrefix[] = "edgePages:";
+constexpr char kDecorationsPrefix[] = "decor:";
+constexpr char kCrossReferencesPrefix[] = "xrefs:";
+constexpr char kCrossReferencesPagePrefix[] = "xrefPages:";
+
+/// Edges pages are this long unless the request says otherwise.
+constexpr int kDefaultPageSize = 2048;
+/// Edges pages are never longer than this.
+constexpr int kMaxPageSize = 10000;
+
+constexpr char kDefines[] = "/kythe/edge/defines";
+constexpr char kDefinesBinding[] = "/kythe/edge/defines/binding";
+constexpr char kDocumentedBy[] = "%/kythe/edge/documents";
+constexpr char kParam[] = "/kythe/edge/param";
+constexpr char kNodeKind[] = "/kythe/node/kind";
+constexpr char kText[] = "/kythe/text";
+constexpr char kCode[] = "/kythe/code";
+
+/// \brief Canonicalizes each of `tickets`.
+/// \return false (and sets `error_text`) if any of them can't be parsed.
+bool FixTickets(const google::protobuf::RepeatedPtrField<std::string> &tickets,
+                std::vector<std::string> *fixed, std::string *error_text) {
+  if (tickets.empty()) {
+    *error_text = "no tickets specified";
+    return false;
+  }
+  for (const auto &ticket : tickets) {
+    auto uri = URI::FromString(ticket);
+    if (!uri.first) {
+      *error_text = "invalid ticket \"" + ticket + "\"";
+      return false;
+    }
+    fixed->push_back(uri.second.ToString());
+  }
+  return true;
+}
+
+/// \brief Returns true if `glob` matches some prefix of `text`.
+///
+/// `**` matches any string, `*` any string without a '/', and `?` any
+/// character but '/'.
+bool GlobMatchesPrefix(const char *glob, const char *glob_end,
+                       const char *text, const char *text_end) {
+  while (glob != glob_end) {
+    if (*glob == '*') {
+      bool any = glob + 1 != glob_end && glob[1] == '*';
+      glob += any ? 2 : 1;
+      for (;; ++text) {
+        if (GlobMatchesPrefix(glob, glob_end, text, text_end)) {
+          return true;
+        }
+        if (text == text_end || (!any && *text == '/')) {
+          return false;
+        }
+      }
+    }
+    if (text == text_end || (*glob == '?' ? *text == '/' : *glob != *text)) {
+      return false;
+    }
+    ++glob;
+    ++text;
+  }
+  return true;
+}
+
+/// \brief The fact filters of a request.
+///
+/// Like the Go server, a fact is kept if any filter glob matches anywhere in
+/// its name.
+class FactFilter {
+ public:
+  explicit FactFilter(
+      const google::protobuf::RepeatedPtrField<std::string> &globs)
+      : globs_(globs) {}
+
+  bool empty() const { return globs_.empty(); }
+
+  bool Matches(const std::string &name) const {
+    const char *end = name.data() + name.size();
+    for (const auto &glob : globs_) {
+      for (const char *start = name.data();; ++start) {
+        if (GlobMatchesPrefix(glob.data(), glob.data() + glob.size(), start,
+                              end)) {
+          return true;
+        }
+        if (start == end) {
+          break;
+        }
+      }
+    }
+    return false;
+  }
+
+ private:
+  const google::protobuf::RepeatedPtrField<std::string> &globs_;
+};
+
+/// \brief Copies the facts of `node` that pass `filter` to `info`.
+/// \return true if any facts were copied.
+bool NodeToInfo(const FactFilter &filter, const proto::serving::Node &node,
+                proto::common::NodeInfo *info) {
+  for (const auto &fact : node.fact()) {
+    if (filter.Matches(fact.name())) {
+      (*info->mutable_facts())[fact.name()] = fact.value();
+    }
+  }
+  return info->facts_size() != 0;
+}
+
+/// \brief Tracks how much of a page of edges has been filled so far.
+class EdgePager {
+ public:
+  /// \param skip The number of edges to skip before the page begins.
+  /// \param max The number of edges on a page.
+  EdgePager(int skip, int max) : skip_(skip), max_(max) {}
+
+  /// \brief Claims the edges out of the next `count` that belong on this
+  /// page.
+  /// \return the range [first, second) of those edges that are on the page.
+  std::pair<int, int> Claim(int count) {
+    if (count <= skip_) {
+      skip_ -= count;
+      return {0, 0};
+    }
+    int begin = skip_;
+    skip_ = 0;
+    int end = std::min(count, begin + (max_ - total_));
+    total_ += end - begin;
+    return {begin, end};
+  }
+
+  /// \brief Returns true if we don't need to read an edge page with `count`
+  /// edges, either because we're skipping over all of them or because this
+  /// page is full.
+  bool SkipPage(int count) {
+    if (count <= skip_) {
+      skip_ -= count;
+      return true;
+    }
+    return full();
+  }
+
+  bool full() const { return total_ >= max_; }
+
+  /// The number of edges on this page so far.
+  int total() const { return total_; }
+
+ private:
+  int skip_;
+  int max_;
+  int total_ = 0;
+};
+
+/// \brief Maps byte offsets in a file to line and column numbers.
+///
+/// This is a port of the Go `xrefs.Normalizer`.
+class Normalizer {
+ public:
+  explicit Normalizer(const std::string &text) : text_size_(text.size()) {
+    line_begin_.push_back(0);
+    for (size_t i = 0; i < text.size(); ++i) {
+      if (text[i] == '\n') {
+        line_begin_.push_back(i + 1);
+      }
+    }
+  }
+
+  /// \brief Normalizes the point at `offset`, clamping it to the text.
+  void ByteOffset(int offset, proto::common::Point *point) const {
+    offset = std::max(0, std::min(offset, text_size_));
+    int line =
+        std::upper_bound(line_begin_.begin(), line_begin_.end(), offset) -
+        line_begin_.begin();
+    point->set_byte_offset(offset);
+    point->set_line_number(line);
+    point->set_column_offset(offset - line_begin_[line - 1]);
+  }
+
+  /// \brief Normalizes `point`, which may be given by its byte offset or by
+  /// its line and column.
+  void Point(const proto::common::Point &point,
+             proto::common::Point *normal) const {
+    if (point.byte_offset() > 0) {
+      ByteOffset(point.byte_offset(), normal);
+      return;
+    }
+    if (point.line_number() <= 0) {
+      normal->set_line_number(1);
+      return;
+    }
+    int lines = line_begin_.size();
+    int line = std::min(point.line_number(), lines);
+    // Each line's length includes its newline (real or not).
+    int line_length =
+        (line < lines ? line_begin_[line] : text_size_ + 1) -
+        line_begin_[line - 1];
+    int column = point.line_number() > lines ? line_length - 1
+                                             : point.column_offset();
+    column = std::max(0, std::min(column, line_length - 1));
+    normal->set_line_number(line);
+    normal->set_column_offset(column);
+    normal->set_byte_offset(line_begin_[line - 1] + column);
+  }
+
+  /// \brief Normalizes the span [start, end).
+  void SpanOffsets(int start, int end, proto::common::Span *span) const {
+    ByteOffset(start, span->mutable_start());
+    ByteOffset(end, span->mutable_end());
+  }
+
+  /// \brief Normalizes `location`, checking that any span it has is valid.
+  /// \return false (and sets `error_text`) if it isn't.
+  bool Location(const proto::Location &location, proto::Location *normal,
+                std::string *error_text) const {
+    normal->set_ticket(location.ticket());
+    normal->set_kind(location.kind());
+    if (location.kind() == proto::Location::FILE) {
+      return true;
+    }
+    if (!location.has_span()) {
+      *error_text = "invalid SPAN: missing span";
+      return false;
+    } else if (!location.span().has_start()) {
+      *error_text = "invalid SPAN: missing span start point";
+      return false;
+    } else if (!location.span().has_end()) {
+      *error_text = "invalid SPAN: missing span end point";
+      return false;
+    }
+    auto *span = normal->mutable_span();
+    Point(location.span().start(), span->mutable_start());
+    Point(location.span().end(), span->mutable_end());
+    if (span->start().byte_offset() > span->end().byte_offset()) {
+      *error_text = "invalid SPAN: start (" +
+                    std::to_string(span->start().byte_offset()) +
+                    ") is after end (" +
+                    std::to_string(span->end().byte_offset()) + ")";
+      return false;
+    }
+    return true;
+  }
+
+ private:
+  /// The size of the text.
+  int text_size_;
+  /// The offset at which each line begins.
+  std::vector<int> line_begin_;
+};
+
+/// \brief Returns true if [start, end) is bounded by (or, for AROUND_SPAN,
+/// bounds) [start_boundary, end_boundary).
+bool InSpanBounds(proto::DecorationsRequest::SpanKind kind, int start, int end,
+                  int start_boundary, int end_boundary) {
+  switch (kind) {
+    case proto::DecorationsRequest::WITHIN_SPAN:
+      return start >= start_boundary && end <= end_boundary;
+    case proto::DecorationsRequest::AROUND_SPAN:
+      return start <= start_boundary && end >= end_boundary;
+    default:
+      return false;
+  }
+}
+
+/// \brief Converts a serving anchor to an xrefs anchor.
+/// \param text Whether to keep the anchor's text.
+void ExpandedAnchorToAnchor(const proto::serving::ExpandedAnchor &expanded,
+                            bool text, proto::Anchor *anchor) {
+  anchor->set_ticket(expanded.ticket());
+  const auto &kind = expanded.kind();
+  anchor->set_kind(!kind.empty() && kind[0] == '%' ? kind.substr(1) : kind);
+  auto uri = URI::FromString(expanded.ticket());
+  if (uri.first) {
+    // An anchor's parent is its file: the anchor's VName without its
+    // signature or language.
+    proto::VName file = uri.second.v_name();
+    file.clear_signature();
+    file.clear_language();
+    anchor->set_parent(URI(file).ToString());
+  }
+  if (text) {
+    anchor->set_text(expanded.text());
+  }
+  *anchor->mutable_span() = expanded.span();
+  anchor->set_snippet(expanded.snippet());
+  *anchor->mutable_snippet_span() = expanded.snippet_span();
+}
+
+/// \brief Appends the edges of `from` to `to`, group by group.
+void MergeEdgeSet(const proto::EdgeSet &from, proto::EdgeSet *to) {
+  for (const auto &group : from.groups()) {
+    auto *edges = (*to->mutable_groups())[group.first].mutable_edge();
+    edges->MergeFrom(group.second.edge());
+  }
+}
+
+/// \brief Orders the targets of `edges` by ordinal, as the Go server's
+/// `extractParams` does: if the ordinals aren't a permutation, the edges
+/// stay in their given order.
+std::vector<std::string> ExtractParams(
+    const google::protobuf::RepeatedPtrField<proto::EdgeSet::Group::Edge>
+        &edges) {
+  std::vector<std::string> params(edges.size());
+  for (const auto &edge : edges) {
+    int ordinal = edge.ordinal();
+    if (ordinal < 0 || ordinal >= edges.size() || !params[ordinal].empty()) {
+      for (int i = 0; i < edges.size(); ++i) {
+        params[i] = edges.Get(i).target_ticket();
+      }
+      return params;
+    }
+    params[ordinal] = edge.target_ticket();
+  }
+  return params;
+}
+
+/// \brief Adds the tickets that `marked_source` (and its children) link to
+/// to `tickets`.
+void AddMarkedSourceLinks(const proto::common::MarkedSource &marked_source,
+                          std::set<std::string> *tickets) {
+  for (const auto &child : marked_source.child()) {
+    AddMarkedSourceLinks(child, tickets);
+  }
+  for (const auto &link : marked_source.link()) {
+    tickets->insert(link.definition().begin(), link.definition().end());
+  }
+}
+
+}  // anonymous namespace
+
+LevelDBXrefsClient::LevelDBXrefsClient(size_t cache_bytes)
+    : cache_bytes_(cache_bytes) {}
+
+LevelDBXrefsClient::~LevelDBXrefsClient() {
+  // The database has to go before its cache.
+  db_.reset();
+  cache_.reset();
+}
+
+bool LevelDBXrefsClient::Open(const std::string &path,
+                              std::string *error_text) {
+  db_.reset();
+  cache_.reset(::leveldb::NewLRUCache(cache_bytes_));
+  ::leveldb::Options options;
+  options.create_if_missing = false;
+  options.block_cache = cache_.get();
+  ::leveldb::DB *db = nullptr;
+  ::leveldb::Status status = ::leveldb::DB::Open(options, path, &db);
+  if (!status.ok()) {
+    *error_text = "Couldn't open " + path + ": " + status.ToString();
+    return false;
+  }
+  db_.reset(db);
+  return true;
+}
+
+bool LevelDBXrefsClient::Lookup(const std::string &key,
+                                google::protobuf::Message *value, bool *found,
+                                std::string *error_text) {
+  if (!db_) {
+    *error_text = "The serving table isn't open.";
+    return false;
+  }
+  std::string data;
+  ::leveldb::Status status = db_->Get(::leveldb::ReadOptions(), key, &data);
+  if (status.IsNotFound()) {
+    *found = false;
+    return true;
+  }
+  if (!status.ok()) {
+    *error_text = "lookup error for " + key + ": " + status.ToString();
+    return false;
+  }
+  if (!value->ParseFromString(data)) {
+    *error_text = "couldn't parse the value for " + key;
+    return false;
+  }
+  *found = true;
+  return true;
+}
+
+bool LevelDBXrefsClient::Nodes(const proto::NodesRequest &request,
+                               proto::NodesReply *reply,
+                               std::string *error_text) {
+  std::vector<std::string> tickets;
+  if (!FixTickets(request.ticket(), &tickets, error_text)) {
+    return false;
+  }
+  FactFilter filter(request.filter());
+  for (const auto &ticket : tickets) {
+    proto::serving::PagedEdgeSet edge_set;
+    bool found;
+    if (!Lookup(kEdgeSetsPrefix + ticket, &edge_set, &found, error_text)) {
+      return false;
+    }
+    if (!found) {
+      continue;
+    }
+    proto::common::NodeInfo info;
+    for (const auto &fact : edge_set.source().fact()) {
+      // Unlike Edges, Nodes returns every fact if there are no filters.
+      if (filter.empty() || filter.Matches(fact.name())) {
+        (*info.mutable_facts())[fact.name()] = fact.value();
+      }
+    }
+    if (info.facts_size() != 0) {
+      (*reply->mutable_nodes())[edge_set.source().ticket()].Swap(&info);
+    }
+  }
+  return true;
+}
+
+bool LevelDBXrefsClient::Edges(const proto::EdgesRequest &request,
+                               proto::EdgesReply *reply,
+                               std::string *error_text) {
+  std::vector<std::string> tickets;
+  if (!FixTickets(request.ticket(), &tickets, error_text)) {
+    return false;
+  }
+  int page_size = request.page_size();
+  if (page_size < 0) {
+    *error_text = "invalid page_size: " + std::to_string(page_size);
+    return false;
+  } else if (page_size == 0) {
+    page_size = kDefaultPageSize;
+  } else if (page_size > kMaxPageSize) {
+    page_size = kMaxPageSize;
+  }
+  int page_start = 0;
+  if (!request.page_token().empty()) {
+    std::string record;
+    proto::internal::PageToken token;
+    if (!DecodeBase64(request.page_token(), &record) ||
+        !token.ParseFromString(record) || token.index() < 0) {
+      *error_text = "invalid page_token: \"" + request.page_token() + "\"";
+      return false;
+    }
+    page_start = token.index();
+  }
+  std::unordered_set<std::string> kinds(request.kind().begin(),
+                                        request.kind().end());
+  auto allowed = [&kinds](const std::string &kind) {
+    return kinds.empty() || kinds.count(kind) != 0;
+  };
+  FactFilter filter(request.filter());
+  std::unordered_set<std::string> node_tickets;
+  auto add_node = [&](const proto::serving::Node &node) {
+    if (!filter.empty() && node_tickets.insert(node.ticket()).second) {
+      proto::common::NodeInfo info;
+      if (NodeToInfo(filter, node, &info)) {
+        (*reply->mutable_nodes())[node.ticket()].Swap(&info);
+      }
+    }
+  };
+  EdgePager pager(page_start, page_size);
+  // Adds the part of `group` on this page to `edge_set`.
+  auto add_group = [&](const proto::serving::EdgeGroup &group,
+                       proto::EdgeSet *edge_set) {
+    auto range = pager.Claim(group.edge_size());
+    if (range.first == range.second) {
+      return;
+    }
+    auto *out = (*edge_set->mutable_groups())[group.kind()].mutable_edge();
+    for (int i = range.first; i < range.second; ++i) {
+      const auto &edge = group.edge(i);
+      auto *out_edge = out->Add();
+      out_edge->set_target_ticket(edge.target().ticket());
+      out_edge->set_ordinal(edge.ordinal());
+      add_node(edge.target());
+    }
+  };
+  std::map<std::string, google::protobuf::int64> totals;
+  for (const auto &ticket : tickets) {
+    proto::serving::PagedEdgeSet paged_set;
+    bool found;
+    if (!Lookup(kEdgeSetsPrefix + ticket, &paged_set, &found, error_text)) {
+      return false;
+    }
+    if (!found) {
+      continue;
+    }
+    for (const auto &group : paged_set.group()) {
+      if (allowed(group.kind())) {
+        totals[group.kind()] += group.edge_size();
+      }
+    }
+    for (const auto &index : paged_set.page_index()) {
+      if (allowed(index.edge_kind())) {
+        totals[index.edge_kind()] += index.edge_count();
+      }
+    }
+    // Don't bother with the edges if the page is already full.
+    if (pager.full()) {
+      continue;
+    }
+    proto::EdgeSet edge_set;
+    for (const auto &group : paged_set.group()) {
+      if (allowed(group.kind())) {
+        add_group(group, &edge_set);
+        if (pager.full()) {
+          break;
+        }
+      }
+    }
+    for (const auto &index : paged_set.page_index()) {
+      if (pager.full()) {
+        break;
+      }
+      if (!allowed(index.edge_kind()) || pager.SkipPage(index.edge_count())) {
+        continue;
+      }
+      proto::serving::EdgePage page;
+      if (!Lookup(kEdgePagesPrefix + index.page_key(), &page, &found,
+                  error_text)) {
+        return false;
+      }
+      if (!found) {
+        *error_text = "internal error: missing edge page: \"" +
+                      index.page_key() + "\"";
+        return false;
+      }
+      add_group(page.edges_group(), &edge_set);
+    }
+    if (edge_set.groups_size() != 0) {
+      MergeEdgeSet(edge_set,
+                   &(*reply->mutable_edge_sets())[paged_set.source().ticket()]);
+      add_node(paged_set.source());
+    }
+  }
+  google::protobuf::int64 total_possible = 0;
+  for (const auto &total : totals) {
+    (*reply->mutable_total_edges_by_kind())[total.first] += total.second;
+    total_possible += total.second;
+  }
+  if (pager.total() != 0 && page_start + pager.total() != total_possible) {
+    proto::internal::PageToken token;
+    token.set_index(page_start + pager.total());
+    reply->set_next_page_token(EncodeBase64(token.SerializeAsString()));
+  }
+  return true;
+}
+
+bool LevelDBXrefsClient::AllEdges(proto::EdgesRequest request,
+                                  proto::EdgesReply *reply,
+                                  std::string *error_text) {
+  request.set_page_size(kMaxPageSize);
+  do {
+    proto::EdgesReply page;
+    if (!Edges(request, &page, error_text)) {
+      return false;
+    }
+    for (const auto &edge_set : page.edge_sets()) {
+      MergeEdgeSet(edge_set.second,
+                   &(*reply->mutable_edge_sets())[edge_set.first]);
+    }
+    for (auto &node : *page.mutable_nodes()) {
+      (*reply->mutable_nodes())[node.first].Swap(&node.second);
+    }
+    if (request.page_token().empty()) {
+      *reply->mutable_total_edges_by_kind() = page.total_edges_by_kind();
+    }
+    request.set_page_token(page.next_page_token());
+  } while (!request.page_token().empty());
+  return true;
+}
+
+bool LevelDBXrefsClient::Decorations(const proto::DecorationsRequest &request,
+                                     proto::DecorationsReply *reply,
+                                     std::string *error_text) {
+  if (!request.has_location() || request.location().ticket().empty()) {
+    *error_text = "missing location";
+    return false;
+  }
+  auto uri = URI::FromString(request.location().ticket());
+  if (!uri.first) {
+    *error_text = "invalid ticket \"" + request.location().ticket() + "\"";
+    return false;
+  }
+  if (!request.dirty_buffer().empty()) {
+    *error_text = "dirty buffers are not supported";
+    return false;
+  }
+  proto::serving::FileDecorations decor;
+  bool found;
+  if (!Lookup(kDecorationsPrefix + uri.second.ToString(), &decor, &found,
+              error_text)) {
+    return false;
+  }
+  if (!found || (!decor.has_file() &&
+                 (decor.diagnostic_size() == 0 || !request.diagnostics()))) {
+    *error_text = "file decorations not found";
+    return false;
+  }
+  if (!decor.has_file()) {
+    // Files that aren't in the index may still have diagnostics.
+    *reply->mutable_location() = request.location();
+    *reply->mutable_diagnostic() = decor.diagnostic();
+    return true;
+  }
+  const std::string &text = decor.file().text();
+  Normalizer normalizer(text);
+  proto::Location location;
+  if (!normalizer.Location(request.location(), &location, error_text)) {
+    return false;
+  }
+  *reply->mutable_location() = location;
+  if (request.source_text()) {
+    reply->set_encoding(decor.file().encoding());
+    if (location.kind() == proto::Location::FILE) {
+      reply->set_source_text(text);
+    } else {
+      int start = location.span().start().byte_offset();
+      int end = location.span().end().byte_offset();
+      reply->set_source_text(text.substr(start, end - start));
+    }
+  }
+  // The span with which to constrain the set of returned references.
+  int start_boundary = 0;
+  int end_boundary = text.size();
+  auto span_kind = request.span_kind();
+  if (location.kind() == proto::Location::FILE) {
+    span_kind = proto::DecorationsRequest::WITHIN_SPAN;
+  } else {
+    start_boundary = location.span().start().byte_offset();
+    end_boundary = location.span().end().byte_offset();
+  }
+  if (request.references()) {
+    FactFilter filter(request.filter());
+    std::unordered_map<std::string, const proto::serving::Node *> targets;
+    if (!filter.empty()) {
+      for (const auto &node : decor.target()) {
+        targets[node.ticket()] = &node;
+      }
+    }
+    auto add_node = [&](const std::string &ticket) {
+      auto node = targets.find(ticket);
+      if (node == targets.end() || reply->nodes().count(ticket)) {
+        return;
+      }
+      proto::common::NodeInfo info;
+      if (NodeToInfo(filter, *node->second, &info)) {
+        (*reply->mutable_nodes())[ticket].Swap(&info);
+      }
+    };
+    std::unordered_map<std::string, const proto::serving::ExpandedAnchor *>
+        definitions;
+    if (request.target_definitions()) {
+      for (const auto &definition : decor.target_definitions()) {
+        definitions[definition.ticket()] = &definition;
+      }
+    }
+    // Adds the definition `ticket` to the reply if we know about it.
+    auto add_definition = [&](const std::string &ticket) {
+      auto definition = definitions.find(ticket);
+      if (definition == definitions.end()) {
+        return false;
+      }
+      auto &anchor = (*reply->mutable_definition_locations())[ticket];
+      if (anchor.ticket().empty()) {
+        ExpandedAnchorToAnchor(*definition->second, false, &anchor);
+      }
+      return true;
+    };
+    std::unordered_set<std::string> bindings;
+    for (const auto &decoration : decor.decoration()) {
+      int start = decoration.anchor().start_offset();
+      int end = decoration.anchor().end_offset();
+      if (!InSpanBounds(span_kind, start, end, start_boundary, end_boundary)) {
+        continue;
+      }
+      auto *reference = reply->add_reference();
+      reference->set_target_ticket(decoration.target());
+      reference->set_kind(decoration.kind());
+      normalizer.SpanOffsets(start, end, reference->mutable_span());
+      if (request.target_definitions()) {
+        reference->set_target_definition(decoration.target_definition());
+        add_definition(decoration.target_definition());
+      }
+      if (request.extends_overrides() &&
+          (decoration.kind() == kDefines ||
+           decoration.kind() == kDefinesBinding)) {
+        bindings.insert(decoration.target());
+      }
+      add_node(decoration.target());
+    }
+    for (const auto &stored : decor.target_override()) {
+      if (!bindings.count(stored.overriding())) {
+        continue;
+      }
+      auto *override_ =
+          (*reply->mutable_extends_overrides())[stored.overriding()]
+              .add_override();
+      override_->set_target(stored.overridden());
+      override_->set_kind(
+          static_cast<proto::DecorationsReply::Override::Kind>(stored.kind()));
+      *override_->mutable_marked_source() = stored.marked_source();
+      add_node(stored.overridden());
+      if (request.target_definitions() &&
+          add_definition(stored.overridden_definition())) {
+        override_->set_target_definition(stored.overridden_definition());
+      }
+    }
+  }
+  if (request.diagnostics()) {
+    for (const auto &diagnostic : decor.diagnostic()) {
+      if (!diagnostic.has_span()) {
+        *reply->add_diagnostic() = diagnostic;
+        continue;
+      }
+      int start = diagnostic.span().start().byte_offset();
+      int end = diagnostic.span().end().byte_offset();
+      if (!InSpanBounds(span_kind, start, end, start_boundary, end_boundary)) {
+        continue;
+      }
+      auto *out = reply->add_diagnostic();
+      *out = diagnostic;
+      normalizer.SpanOffsets(start, end, out->mutable_span());
+    }
+  }
+  return true;
+}
+
+bool LevelDBXrefsClient::Documentation(
+    const proto::DocumentationRequest &request,
+    proto::DocumentationReply *reply, std::string *error_text) {
+  if (request.include_children()) {
+    *error_text = "include_children is not supported";
+    return false;
+  }
+  std::vector<std::string> tickets;
+  if (!FixTickets(request.ticket(), &tickets, error_text)) {
+    return false;
+  }
+  // Signatures and binding definitions come from each node's
+  // cross-references.
+  std::map<std::string, proto::common::MarkedSource> signatures;
+  std::map<std::string, proto::Anchor> definitions;
+  for (const auto &ticket : tickets) {
+    proto::serving::PagedCrossReferences xrefs;
+    bool found;
+    if (!Lookup(kCrossReferencesPrefix + ticket, &xrefs, &found,
+                error_text)) {
+      return false;
+    }
+    if (!found) {
+      continue;
+    }
+    if (xrefs.has_marked_source()) {
+      signatures[ticket] = xrefs.marked_source();
+    }
+    std::vector<const proto::serving::ExpandedAnchor *> bindings;
+    for (const auto &group : xrefs.group()) {
+      if (group.kind() == kDefinesBinding) {
+        for (const auto &anchor : group.anchor()) {
+          bindings.push_back(&anchor);
+        }
+      }
+    }
+    // `bindings` points into these, so they mustn't move.
+    std::deque<proto::serving::PagedCrossReferences::Page> pages;
+    for (const auto &index : xrefs.page_index()) {
+      if (index.kind() != kDefinesBinding) {
+        continue;
+      }
+      pages.emplace_back();
+      if (!Lookup(kCrossReferencesPagePrefix + index.page_key(),
+                  &pages.back(), &found, error_text)) {
+        return false;
+      }
+      for (const auto &anchor : pages.back().group().anchor()) {
+        bindings.push_back(&anchor);
+      }
+    }
+    // Ambiguous definitions are left out.
+    if (bindings.size() == 1) {
+      ExpandedAnchorToAnchor(*bindings[0], true, &definitions[ticket]);
+    }
+  }
+  // Find the doc nodes that document each ticket.
+  proto::EdgesRequest documents_request;
+  for (const auto &ticket : tickets) {
+    documents_request.add_ticket(ticket);
+  }
+  documents_request.add_kind(kDocumentedBy);
+  documents_request.add_filter(kNodeKind);
+  proto::EdgesReply documents_reply;
+  if (!AllEdges(documents_request, &documents_reply, error_text)) {
+    return false;
+  }
+  std::map<std::string, std::vector<std::string>> docs_for_ticket;
+  proto::NodesRequest text_request;
+  proto::EdgesRequest links_request;
+  for (const auto &edge_set : documents_reply.edge_sets()) {
+    for (const auto &group : edge_set.second.groups()) {
+      for (const auto &edge : group.second.edge()) {
+        auto node = documents_reply.nodes().find(edge.target_ticket());
+        if (node == documents_reply.nodes().end()) {
+          continue;
+        }
+        auto kind = node->second.facts().find(kNodeKind);
+        if (kind == node->second.facts().end() || kind->second != "doc") {
+          continue;
+        }
+        docs_for_ticket[edge_set.first].push_back(edge.target_ticket());
+        text_request.add_ticket(edge.target_ticket());
+        links_request.add_ticket(edge.target_ticket());
+      }
+    }
+  }
+  proto::NodesReply text_reply;
+  proto::EdgesReply links_reply;
+  if (text_request.ticket_size() != 0) {
+    text_request.add_filter(kText);
+    links_request.add_kind(kParam);
+    if (!Nodes(text_request, &text_reply, error_text) ||
+        !AllEdges(links_request, &links_reply, error_text)) {
+      return false;
+    }
+  }
+  std::set<std::string> linked_tickets;
+  for (const auto &ticket : tickets) {
+    auto *document = reply->add_document();
+    document->set_ticket(ticket);
+    linked_tickets.insert(ticket);
+    auto signature = signatures.find(ticket);
+    if (signature != signatures.end()) {
+      document->mutable_marked_source()->Swap(&signature->second);
+    } else {
+      // Fall back to the node's own code fact.
+      proto::NodesRequest code_request;
+      proto::NodesReply code_reply;
+      code_request.add_ticket(ticket);
+      code_request.add_filter(kCode);
+      if (!Nodes(code_request, &code_reply, error_text)) {
+        return false;
+      }
+      for (const auto &node : code_reply.nodes()) {
+        auto code = node.second.facts().find(kCode);
+        if (code != node.second.facts().end()) {
+          document->mutable_marked_source()->ParseFromString(code->second);
+        }
+      }
+    }
+    AddMarkedSourceLinks(document->marked_source(), &linked_tickets);
+    // Assume the longest document is the best one to show.
+    auto *text = document->mutable_text();
+    for (const auto &doc : docs_for_ticket[ticket]) {
+      auto node = text_reply.nodes().find(doc);
+      if (node == text_reply.nodes().end()) {
+        continue;
+      }
+      auto doc_text = node->second.facts().find(kText);
+      if (doc_text == node->second.facts().end() ||
+          doc_text->second.size() <= text->raw_text().size()) {
+        continue;
+      }
+      text->set_raw_text(doc_text->second);
+      text->clear_link();
+      auto links = links_reply.edge_sets().find(doc);
+      if (links == links_reply.edge_sets().end()) {
+        continue;
+      }
+      for (const auto &group : links->second.groups()) {
+        for (const auto &param : ExtractParams(group.second.edge())) {
+          text->add_link()->add_definition(param);
+          linked_tickets.insert(param);
+        }
+      }
+    }
+  }
+  proto::NodesRequest nodes_request;
+  for (const auto &ticket : linked_tickets) {
+    nodes_request.add_ticket(ticket);
+  }
+  *nodes_request.mutable_filter() = request.filter();
+  proto::NodesReply nodes_reply;
+  if (!Nodes(nodes_request, &nodes_reply, error_text)) {
+    return false;
+  }
+  for (auto &node : *nodes_reply.mutable_nodes()) {
+    auto definition = definitions.find(node.first);
+    if (definition != definitions.end()) {
+      node.second.set_definition(definition->second.ticket());
+    }
+    (*reply->mutable_nodes())[node.first].Swap(&node.second);
+  }
+  for (auto &definition : definitions) {
+    (*reply->mutable_definition_locations())[definition.second.ticket()].Swap(
+        &definition.second);
+  }
+  return true;
+}
+
+}  // namespace kythe
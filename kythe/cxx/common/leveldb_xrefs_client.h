@@ -0,0 +1,97 @@
+/*
+ * Copyright 2017 Google Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef KYTHE_CXX_COMMON_LEVELDB_XREFS_CLIENT_H_
+#define KYTHE_CXX_COMMON_LEVELDB_XREFS_CLIENT_H_
+
+#include <memory>
+#include <string>
+
+#include "google/protobuf/message.h"
+#include "kythe/cxx/common/net_client.h"
+
+namespace leveldb {
+class Cache;
+class DB;
+}  // namespace leveldb
+
+namespace kythe {
+
+/// \brief An `XrefsClient` that answers requests in-process from serving
+/// tables in a local LevelDB.
+///
+/// The database is a combined serving table as written by
+/// kythe/go/serving/tools/write_tables: each key is "edgeSets:", "edgePages:",
+/// "decor:", "xrefs:" or "xrefPages:" followed by a ticket or page key, and
+/// each value is the matching kythe.proto.serving message. Replies follow the
+/// Go `xrefs.Table`, including its page tokens, but none of its slow paths are
+/// ported: `Decorations` doesn't accept dirty buffers or compute overrides
+/// that weren't stored with the file, and `Documentation` only looks at the
+/// requested nodes themselves (without children or other definitions).
+///
+/// LevelDB reads may run concurrently, so one client may be shared by
+/// several threads once it is open.
+class LevelDBXrefsClient : public XrefsClient {
+ public:
+  /// \param cache_bytes The size of the LevelDB block cache. The default
+  /// keeps the hot parts of a large table in memory for interactive use.
+  explicit LevelDBXrefsClient(size_t cache_bytes = 64 << 20);
+  ~LevelDBXrefsClient() override;
+
+  /// \brief Opens the existing serving table at `path`.
+  /// \param error_text Set to a description of the problem on failure.
+  /// \return true on success.
+  bool Open(const std::string &path, std::string *error_text);
+
+  bool Nodes(const proto::NodesRequest &request, proto::NodesReply *reply,
+             std::string *error_text) override;
+
+  bool Edges(const proto::EdgesRequest &request, proto::EdgesReply *reply,
+             std::string *error_text) override;
+
+  bool Decorations(const proto::DecorationsRequest &request,
+                   proto::DecorationsReply *reply,
+                   std::string *error_text) override;
+
+  bool Documentation(const proto::DocumentationRequest &request,
+                     proto::DocumentationReply *reply,
+                     std::string *error_text) override;
+
+ private:
+  /// \brief Reads and parses the value stored at `key`.
+  /// \param value Set to the stored message.
+  /// \param found Set to false if there is no such key.
+  /// \param error_text Set to a description of the problem on failure.
+  /// \return false if the key couldn't be read or parsed (but true if it
+  /// wasn't there at all).
+  bool Lookup(const std::string &key, google::protobuf::Message *value,
+              bool *found, std::string *error_text);
+
+  /// \brief Like `Edges`, but follows every page and combines them.
+  bool AllEdges(proto::EdgesRequest request, proto::EdgesReply *reply,
+                std::string *error_text);
+
+  /// The size of `cache_`.
+  size_t cache_bytes_;
+  /// The block cache used by `db_`. Must outlive it.
+  std::unique_ptr<::leveldb::Cache> cache_;
+  /// The open database, or null.
+  std::unique_ptr<::leveldb::DB> db_;
+};
+
+}  // namespace kythe
+
+#endif  // KYTHE_CXX_COMMON_LEVELDB_XREFS_CLIENT_H_
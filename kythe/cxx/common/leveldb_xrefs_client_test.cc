@@ -0,0 +1,309 @@
+/*
+ * Copyright 2017 Google Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "kythe/cxx/common/leveldb_xrefs_client.h"
+
+#include <string>
+
+#include "google/protobuf/text_format.h"
+#include "gtest/gtest.h"
+#include "kythe/proto/serving.pb.h"
+#include "leveldb/db.h"
+#include "llvm/ADT/SmallString.h"
+#include "llvm/Support/FileSystem.h"
+
+namespace kythe {
+namespace {
+
+class LevelDBXrefsClientTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    llvm::SmallString<256> dir;
+    ASSERT_FALSE(
+        llvm::sys::fs::createUniqueDirectory("leveldb_xrefs_client", dir));
+    dir_.assign(dir.begin(), dir.end());
+    path_ = dir_ + "/db";
+    ::leveldb::Options options;
+    options.create_if_missing = true;
+    ::leveldb::DB *db = nullptr;
+    ASSERT_TRUE(::leveldb::DB::Open(options, path_, &db).ok());
+    db_.reset(db);
+  }
+
+  void TearDown() override {
+    db_.reset();
+    ::leveldb::DestroyDB(path_, ::leveldb::Options());
+    llvm::sys::fs::remove(dir_);
+  }
+
+  /// \brief Stores the text-format `message` as the value of `key`.
+  template <typename Message>
+  void Put(const std::string &key, const std::string &text) {
+    Message message;
+    ASSERT_TRUE(google::protobuf::TextFormat::ParseFromString(text, &message))
+        << text;
+    ASSERT_TRUE(db_->Put(::leveldb::WriteOptions(), key,
+                         message.SerializeAsString())
+                    .ok());
+  }
+
+  /// \brief Closes the database and opens it with `client_`.
+  void OpenClient() {
+    db_.reset();
+    std::string error_text;
+    ASSERT_TRUE(client_.Open(path_, &error_text)) << error_text;
+  }
+
+  std::string dir_;
+  std::string path_;
+  std::unique_ptr<::leveldb::DB> db_;
+  LevelDBXrefsClient client_;
+};
+
+TEST_F(LevelDBXrefsClientTest, OpenFailsWithoutDatabase) {
+  LevelDBXrefsClient client;
+  std::string error_text;
+  EXPECT_FALSE(client.Open(dir_ + "/missing", &error_text));
+  EXPECT_FALSE(error_text.empty());
+}
+
+TEST_F(LevelDBXrefsClientTest, NodesFiltersFacts) {
+  Put<proto::serving::PagedEdgeSet>("edgeSets:kythe:#a", R"(
+      source {
+        ticket: "kythe:#a"
+        fact { name: "/kythe/node/kind" value: "record" }
+        fact { name: "/kythe/subkind" value: "class" }
+      })");
+  OpenClient();
+  proto::NodesRequest request;
+  request.add_ticket("kythe:#a");
+  request.add_ticket("kythe:#missing");
+  request.add_filter("/kythe/node/*");
+  proto::NodesReply reply;
+  std::string error_text;
+  ASSERT_TRUE(client_.Nodes(request, &reply, &error_text)) << error_text;
+  ASSERT_EQ(1, reply.nodes_size());
+  const auto &facts = reply.nodes().at("kythe:#a").facts();
+  ASSERT_EQ(1, facts.size());
+  EXPECT_EQ("record", facts.at("/kythe/node/kind"));
+  request.clear_filter();
+  reply.Clear();
+  ASSERT_TRUE(client_.Nodes(request, &reply, &error_text)) << error_text;
+  EXPECT_EQ(2, reply.nodes().at("kythe:#a").facts_size());
+}
+
+TEST_F(LevelDBXrefsClientTest, EdgesReadsPagesAndPaginates) {
+  Put<proto::serving::PagedEdgeSet>("edgeSets:kythe:#a", R"(
+      source { ticket: "kythe:#a" }
+      group {
+        kind: "/kythe/edge/childof"
+        edge {
+          target {
+            ticket: "kythe:#b"
+            fact { name: "/kythe/node/kind" value: "record" }
+          }
+        }
+        edge { target { ticket: "kythe:#c" } }
+      }
+      page_index {
+        edge_kind: "/kythe/edge/childof"
+        edge_count: 2
+        page_key: "p1"
+      }
+      page_index { edge_kind: "/kythe/edge/param" edge_count: 1 page_key: "p2" }
+      total_edges: 5)");
+  Put<proto::serving::EdgePage>("edgePages:p1", R"(
+      page_key: "p1"
+      edges_group {
+        kind: "/kythe/edge/childof"
+        edge { target { ticket: "kythe:#d" } }
+        edge { target { ticket: "kythe:#e" } }
+      })");
+  OpenClient();
+  proto::EdgesRequest request;
+  request.add_ticket("kythe:#a");
+  request.add_kind("/kythe/edge/childof");
+  request.add_filter("/kythe/node/kind");
+  proto::EdgesReply reply;
+  std::string error_text;
+  ASSERT_TRUE(client_.Edges(request, &reply, &error_text)) << error_text;
+  EXPECT_EQ(4, reply.total_edges_by_kind().at("/kythe/edge/childof"));
+  EXPECT_EQ(0, reply.total_edges_by_kind().count("/kythe/edge/param"));
+  const auto &edges =
+      reply.edge_sets().at("kythe:#a").groups().at("/kythe/edge/childof");
+  ASSERT_EQ(4, edges.edge_size());
+  EXPECT_EQ("kythe:#b", edges.edge(0).target_ticket());
+  EXPECT_EQ("kythe:#e", edges.edge(3).target_ticket());
+  ASSERT_EQ(1, reply.nodes_size());
+  EXPECT_EQ("record", reply.nodes().at("kythe:#b").facts().at(
+                          "/kythe/node/kind"));
+  EXPECT_TRUE(reply.next_page_token().empty());
+
+  request.set_page_size(3);
+  std::string targets;
+  for (int pages = 0; pages < 3; ++pages) {
+    reply.Clear();
+    ASSERT_TRUE(client_.Edges(request, &reply, &error_text)) << error_text;
+    for (const auto &group : reply.edge_sets().at("kythe:#a").groups()) {
+      for (const auto &edge : group.second.edge()) {
+        targets += edge.target_ticket().substr(7);
+      }
+    }
+    if (reply.next_page_token().empty()) {
+      break;
+    }
+    request.set_page_token(reply.next_page_token());
+  }
+  EXPECT_EQ("bcde", targets);
+  EXPECT_TRUE(reply.next_page_token().empty());
+
+  request.set_page_token("not a token");
+  EXPECT_FALSE(client_.Edges(request, &reply, &error_text));
+}
+
+TEST_F(LevelDBXrefsClientTest, DecorationsNormalizesSpans) {
+  Put<proto::serving::FileDecorations>("decor:kythe://c?path=f", R"(
+      file { ticket: "kythe://c?path=f" text: "int x;\nint y;\n" }
+      decoration {
+        anchor { start_offset: 4 end_offset: 5 }
+        kind: "/kythe/edge/defines/binding"
+        target: "kythe:#x"
+        target_definition: "kythe://c?path=f#ax"
+      }
+      decoration {
+        anchor { start_offset: 11 end_offset: 12 }
+        kind: "/kythe/edge/ref"
+        target: "kythe:#y"
+      }
+      target {
+        ticket: "kythe:#x"
+        fact { name: "/kythe/node/kind" value: "variable" }
+      }
+      target_definitions {
+        ticket: "kythe://c?path=f#ax"
+        kind: "/kythe/edge/defines/binding"
+        text: "x"
+      })");
+  OpenClient();
+  proto::DecorationsRequest request;
+  request.mutable_location()->set_ticket("kythe://c?path=f");
+  request.set_references(true);
+  request.set_target_definitions(true);
+  request.set_source_text(true);
+  request.add_filter("**");
+  proto::DecorationsReply reply;
+  std::string error_text;
+  ASSERT_TRUE(client_.Decorations(request, &reply, &error_text))
+      << error_text;
+  EXPECT_EQ("int x;\nint y;\n", reply.source_text());
+  ASSERT_EQ(2, reply.reference_size());
+  const auto &y = reply.reference(1);
+  EXPECT_EQ("kythe:#y", y.target_ticket());
+  EXPECT_EQ(2, y.span().start().line_number());
+  EXPECT_EQ(4, y.span().start().column_offset());
+  EXPECT_EQ(12, y.span().end().byte_offset());
+  ASSERT_EQ(1, reply.nodes_size());
+  EXPECT_EQ(1, reply.nodes().count("kythe:#x"));
+  const auto &definition =
+      reply.definition_locations().at("kythe://c?path=f#ax");
+  EXPECT_EQ("kythe://c?path=f", definition.parent());
+  EXPECT_TRUE(definition.text().empty());
+
+  // Only ask for the second line.
+  auto *location = request.mutable_location();
+  location->set_kind(proto::Location::SPAN);
+  location->mutable_span()->mutable_start()->set_line_number(2);
+  location->mutable_span()->mutable_end()->set_line_number(2);
+  location->mutable_span()->mutable_end()->set_column_offset(6);
+  reply.Clear();
+  ASSERT_TRUE(client_.Decorations(request, &reply, &error_text))
+      << error_text;
+  EXPECT_EQ("int y;", reply.source_text());
+  ASSERT_EQ(1, reply.reference_size());
+  EXPECT_EQ("kythe:#y", reply.reference(0).target_ticket());
+
+  request.mutable_location()->set_ticket("kythe://c?path=missing");
+  EXPECT_FALSE(client_.Decorations(request, &reply, &error_text));
+}
+
+TEST_F(LevelDBXrefsClientTest, DocumentationFindsTextAndLinks) {
+  Put<proto::serving::PagedEdgeSet>("edgeSets:kythe:#f", R"(
+      source {
+        ticket: "kythe:#f"
+        fact { name: "/kythe/node/kind" value: "function" }
+      }
+      group {
+        kind: "%/kythe/edge/documents"
+        edge {
+          target {
+            ticket: "kythe:#doc"
+            fact { name: "/kythe/node/kind" value: "doc" }
+          }
+        }
+      })");
+  Put<proto::serving::PagedEdgeSet>("edgeSets:kythe:#doc", R"(
+      source {
+        ticket: "kythe:#doc"
+        fact { name: "/kythe/node/kind" value: "doc" }
+        fact { name: "/kythe/text" value: "Calls [g]." }
+      }
+      group {
+        kind: "/kythe/edge/param"
+        edge { target { ticket: "kythe:#g" } ordinal: 0 }
+      })");
+  Put<proto::serving::PagedEdgeSet>("edgeSets:kythe:#g", R"(
+      source {
+        ticket: "kythe:#g"
+        fact { name: "/kythe/node/kind" value: "function" }
+      })");
+  Put<proto::serving::PagedCrossReferences>("xrefs:kythe:#f", R"(
+      source_ticket: "kythe:#f"
+      group {
+        kind: "/kythe/edge/defines/binding"
+        anchor { ticket: "kythe://c?lang=c%2B%2B?path=f#a" text: "f" }
+      }
+      marked_source { kind: IDENTIFIER pre_text: "f" })");
+  OpenClient();
+  proto::DocumentationRequest request;
+  request.add_ticket("kythe:#f");
+  request.add_filter("/kythe/node/kind");
+  proto::DocumentationReply reply;
+  std::string error_text;
+  ASSERT_TRUE(client_.Documentation(request, &reply, &error_text))
+      << error_text;
+  ASSERT_EQ(1, reply.document_size());
+  const auto &document = reply.document(0);
+  EXPECT_EQ("Calls [g].", document.text().raw_text());
+  ASSERT_EQ(1, document.text().link_size());
+  EXPECT_EQ("kythe:#g", document.text().link(0).definition(0));
+  EXPECT_EQ("f", document.marked_source().pre_text());
+  EXPECT_EQ(2, reply.nodes_size());
+  EXPECT_EQ("kythe://c?lang=c%2B%2B?path=f#a",
+            reply.nodes().at("kythe:#f").definition());
+  ASSERT_EQ(1, reply.definition_locations_size());
+  EXPECT_EQ("kythe://c?path=f", reply.definition_locations()
+                                    .at("kythe://c?lang=c%2B%2B?path=f#a")
+                                    .parent());
+}
+
+}  // namespace
+}  // namespace kythe
+
+int main(int argc, char **argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  int result = RUN_ALL_TESTS();
+  return result;
+}
@@ -93,6 +93,12 @@ bool JsonClient::Request(const std::string &uri, bool post,
 
 bool JsonClient::Request(const std::string &uri, bool post,
                          const std::string &request, std::string *response) {
+  return Request(uri, post, "application/json", request, response);
+}
+
+bool JsonClient::Request(const std::string &uri, bool post,
+                         const std::string &content_type,
+                         const std::string &request, std::string *response) {
   to_send_ = request;
   send_head_ = 0;
   received_.clear();
@@ -105,7 +111,8 @@ bool JsonClient::Request(const std::string &uri, bool post,
   ::curl_easy_setopt(curl_, CURLOPT_WRITEDATA, this);
   ::curl_slist *headers = nullptr;
   if (post) {
-    headers = ::curl_slist_append(headers, "Content-Type: application/json");
+    headers = ::curl_slist_append(headers,
+                                  ("Content-Type: " + content_type).c_str());
     ::curl_easy_setopt(curl_, CURLOPT_HTTPHEADER, headers);
     ::curl_easy_setopt(curl_, CURLOPT_POSTFIELDSIZE, request.size());
   }
@@ -134,24 +141,149 @@ bool JsonClient::Request(const std::string &uri, bool post,
   return true;
 }
 
-bool XrefsJsonClient::Roundtrip(const std::string &endpoint,
-                                const google::protobuf::Message &request,
-                                google::protobuf::Message *response,
-                                std::string *error_text) {
-  std::string request_json;
-  if (!WriteMessageAsJsonToString(request, &request_json)) {
-    if (error_text) {
-      *error_text = "Couldn't serialize message.";
+JsonMultiClient::JsonMultiClient(size_t max_connections)
+    : multi_(::curl_multi_init()) {
+  CHECK(multi_ != nullptr);
+  ::curl_multi_setopt(multi_, CURLMOPT_MAX_HOST_CONNECTIONS,
+                      static_cast<long>(max_connections));
+#if LIBCURL_VERSION_NUM >= 0x072f00
+  ::curl_multi_setopt(multi_, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX);
+#endif
+}
+
+JsonMultiClient::~JsonMultiClient() {
+  for (auto &transfer : transfers_) {
+    ::curl_multi_remove_handle(multi_, transfer.first);
+    ::curl_slist_free_all(transfer.second->headers);
+    ::curl_easy_cleanup(transfer.first);
+  }
+  for (CURL *handle : idle_handles_) {
+    ::curl_easy_cleanup(handle);
+  }
+  ::curl_multi_cleanup(multi_);
+}
+
+size_t JsonMultiClient::CurlWriteCallback(void *data, size_t size,
+                                          size_t nmemb, void *user) {
+  static_cast<Transfer *>(user)->received.append(static_cast<char *>(data),
+                                                 size * nmemb);
+  return size * nmemb;
+}
+
+void JsonMultiClient::Request(const std::string &uri, bool post,
+                              const std::string &content_type,
+                              const std::string &request, Callback done) {
+  CURL *handle;
+  if (idle_handles_.empty()) {
+    handle = ::curl_easy_init();
+    CHECK(handle != nullptr);
+  } else {
+    // Resetting a handle keeps its connection and DNS caches.
+    handle = idle_handles_.back();
+    idle_handles_.pop_back();
+    ::curl_easy_reset(handle);
+  }
+  std::unique_ptr<Transfer> transfer(new Transfer());
+  transfer->uri = uri;
+  transfer->to_send = request;
+  transfer->done = std::move(done);
+  ::curl_easy_setopt(handle, CURLOPT_URL, transfer->uri.c_str());
+  ::curl_easy_setopt(handle, CURLOPT_WRITEFUNCTION, CurlWriteCallback);
+  ::curl_easy_setopt(handle, CURLOPT_WRITEDATA, transfer.get());
+#if LIBCURL_VERSION_NUM >= 0x072f00
+  ::curl_easy_setopt(handle, CURLOPT_HTTP_VERSION, CURL_HTTP_VERSION_2TLS);
+  // Wait for a connection that can be multiplexed rather than opening a new
+  // one.
+  ::curl_easy_setopt(handle, CURLOPT_PIPEWAIT, 1L);
+#endif
+  if (post) {
+    transfer->headers = ::curl_slist_append(
+        transfer->headers, ("Content-Type: " + content_type).c_str());
+    ::curl_easy_setopt(handle, CURLOPT_HTTPHEADER, transfer->headers);
+    ::curl_easy_setopt(handle, CURLOPT_POSTFIELDS, transfer->to_send.data());
+    ::curl_easy_setopt(handle, CURLOPT_POSTFIELDSIZE,
+                       static_cast<long>(transfer->to_send.size()));
+  }
+  transfers_[handle] = std::move(transfer);
+  ::curl_multi_add_handle(multi_, handle);
+}
+
+void JsonMultiClient::Wait() {
+  while (!transfers_.empty()) {
+    int running = 0;
+    ::CURLMcode code = ::curl_multi_perform(multi_, &running);
+    if (code != CURLM_OK) {
+      LOG(ERROR) << "curl_multi_perform: " << ::curl_multi_strerror(code);
+      std::vector<CURL *> handles;
+      for (const auto &transfer : transfers_) {
+        handles.push_back(transfer.first);
+      }
+      for (CURL *handle : handles) {
+        Finish(handle, CURLE_FAILED_INIT);
+      }
+      continue;
     }
-    return false;
+    int messages_left = 0;
+    ::CURLMsg *message;
+    while ((message = ::curl_multi_info_read(multi_, &messages_left))) {
+      if (message->msg == CURLMSG_DONE) {
+        Finish(message->easy_handle, message->data.result);
+      }
+    }
+    if (running > 0) {
+      ::curl_multi_wait(multi_, nullptr, 0, 1000, nullptr);
+    }
+  }
+}
+
+void JsonMultiClient::Finish(CURL *handle, ::CURLcode result) {
+  auto found = transfers_.find(handle);
+  CHECK(found != transfers_.end());
+  std::unique_ptr<Transfer> transfer = std::move(found->second);
+  transfers_.erase(found);
+  ::curl_multi_remove_handle(multi_, handle);
+  ::curl_slist_free_all(transfer->headers);
+  long response_code = 0;
+  if (!result) {
+    result = ::curl_easy_getinfo(handle, CURLINFO_RESPONSE_CODE,
+                                 &response_code);
   }
-  std::string response_buffer;
-  if (!client_->Request(endpoint, true, request_json, &response_buffer)) {
+  bool ok = true;
+  if (result) {
+    LOG(ERROR) << "(uri: " << transfer->uri
+               << "): " << ::curl_easy_strerror(result);
+    ok = false;
+  } else if (response_code != 200) {
+    LOG(ERROR) << "(uri: " << transfer->uri << "): response "
+               << response_code;
+    ok = false;
+  }
+  idle_handles_.push_back(handle);
+  transfer->done(ok, &transfer->received);
+}
+
+namespace {
+/// The Content-Types of the two encodings of xrefs messages.
+const char kJsonContentType[] = "application/json";
+const char kProtoContentType[] = "application/x-protobuf";
+
+/// \brief Encodes an xrefs request as JSON or as a binary protobuf.
+bool EncodeRequest(const google::protobuf::Message &request, bool json,
+                   std::string *body, std::string *error_text) {
+  if (json ? !WriteMessageAsJsonToString(request, body)
+           : !request.SerializeToString(body)) {
     if (error_text) {
-      *error_text = "Network client error.";
+      *error_text = "Couldn't serialize message.";
     }
     return false;
   }
+  return true;
+}
+
+/// \brief Decodes an xrefs reply into `response`, if it isn't null.
+bool DecodeReply(const std::string &response_buffer,
+                 google::protobuf::Message *response,
+                 std::string *error_text) {
   if (response) {
     google::protobuf::io::ArrayInputStream stream(response_buffer.data(),
                                                   response_buffer.size());
@@ -165,4 +297,116 @@ bool XrefsJsonClient::Roundtrip(const std::string &endpoint,
   }
   return true;
 }
+
+/// \brief Decodes the reply to a finished asynchronous call and passes the
+/// result to `done`.
+void FinishCall(bool ok, const std::string &response_buffer,
+                google::protobuf::Message *response,
+                const XrefsJsonMultiClient::Callback &done) {
+  std::string error_text;
+  if (!ok) {
+    done(false, "Network client error.");
+  } else if (!DecodeReply(response_buffer, response, &error_text)) {
+    done(false, error_text);
+  } else {
+    done(true, error_text);
+  }
+}
+}  // anonymous namespace
+
+bool XrefsJsonClient::Roundtrip(const std::string &endpoint,
+                                const google::protobuf::Message &request,
+                                google::protobuf::Message *response,
+                                std::string *error_text) {
+  std::string body, response_buffer;
+  if (!json_requests_) {
+    if (!EncodeRequest(request, false, &body, error_text)) {
+      return false;
+    }
+    if (client_->Request(endpoint, true, kProtoContentType, body,
+                         &response_buffer)) {
+      return DecodeReply(response_buffer, response, error_text);
+    }
+  }
+  if (!EncodeRequest(request, true, &body, error_text)) {
+    return false;
+  }
+  if (!client_->Request(endpoint, true, kJsonContentType, body,
+                        &response_buffer)) {
+    if (error_text) {
+      *error_text = "Network client error.";
+    }
+    return false;
+  }
+  if (!json_requests_) {
+    LOG(WARNING) << "(uri: " << endpoint
+                 << "): binary request failed; using JSON from now on";
+    json_requests_ = true;
+  }
+  return DecodeReply(response_buffer, response, error_text);
+}
+
+void XrefsJsonMultiClient::Start(const std::string &endpoint,
+                                 const google::protobuf::Message &request,
+                                 google::protobuf::Message *response,
+                                 Callback done) {
+  std::string body, error_text;
+  if (!EncodeRequest(request, json_requests_, &body, &error_text)) {
+    done(false, error_text);
+    return;
+  }
+  if (json_requests_) {
+    client_->Request(endpoint, true, kJsonContentType, body,
+                     [response, done](bool ok, std::string *response_buffer) {
+                       FinishCall(ok, *response_buffer, response, done);
+                     });
+    return;
+  }
+  // If the binary request fails, it is decoded again from `body` to be sent
+  // as JSON, since `request` may be gone by then.
+  std::shared_ptr<google::protobuf::Message> retry(request.New());
+  client_->Request(
+      endpoint, true, kProtoContentType, body,
+      [this, endpoint, body, retry, response, done](
+          bool ok, std::string *response_buffer) {
+        if (ok) {
+          FinishCall(ok, *response_buffer, response, done);
+          return;
+        }
+        std::string json_body;
+        if (!retry->ParseFromString(body) ||
+            !EncodeRequest(*retry, true, &json_body, nullptr)) {
+          done(false, "Couldn't serialize message.");
+          return;
+        }
+        client_->Request(
+            endpoint, true, kJsonContentType, json_body,
+            [this, endpoint, response, done](bool ok,
+                                             std::string *response_buffer) {
+              if (ok && !json_requests_) {
+                LOG(WARNING) << "(uri: " << endpoint
+                             << "): binary request failed; using JSON from "
+                                "now on";
+                json_requests_ = true;
+              }
+              FinishCall(ok, *response_buffer, response, done);
+            });
+      });
+}
+
+bool XrefsJsonMultiClient::Roundtrip(const std::string &endpoint,
+                                     const google::protobuf::Message &request,
+                                     google::protobuf::Message *response,
+                                     std::string *error_text) {
+  bool result = false;
+  Start(endpoint, request, response,
+        [&result, error_text](bool ok, const std::string &error) {
+          result = ok;
+          if (!ok && error_text) {
+            *error_text = error;
+          }
+        });
+  client_->Wait();
+  return result;
+}
 }  // namespace kythe
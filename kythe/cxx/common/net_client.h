@@ -17,8 +17,11 @@
 #ifndef KYTHE_CXX_COMMON_NET_CLIENT_H_
 #define KYTHE_CXX_COMMON_NET_CLIENT_H_
 
+#include <functional>
 #include <memory>
 #include <string>
+#include <unordered_map>
+#include <vector>
 
 #include <curl/curl.h>
 
@@ -68,6 +71,17 @@ class JsonClient {
   bool Request(const std::string &uri, bool post, const std::string &request,
                std::string *response);
 
+  /// \brief Issue a request with a body of any type.
+  /// \param uri The URI to request.
+  /// \param post Issue this request as a post?
+  /// \param content_type The MIME type of `request`.
+  /// \param request The string to issue as the request.
+  /// \param response The raw string to fill with the response.
+  /// \return true on success and false on failure
+  bool Request(const std::string &uri, bool post,
+               const std::string &content_type, const std::string &request,
+               std::string *response);
+
  private:
   static size_t CurlWriteCallback(void *data, size_t size, size_t nmemb,
                                   void *user);
@@ -84,6 +98,78 @@ class JsonClient {
   std::string received_;
 };
 
+/// \brief Issues many JSON-formatted RPCs at once.
+///
+/// Requests are queued with `Request` and performed by `Wait`. Connections
+/// are kept alive and reused between requests; at most `max_connections`
+/// are opened to any one host. Where the server supports HTTP/2, requests to
+/// the same host share a single multiplexed connection.
+///
+/// JsonMultiClient is not thread-safe. Callbacks are run by `Wait`.
+class JsonMultiClient {
+ public:
+  /// \brief Called once a request has finished.
+  /// \param ok true if the request succeeded.
+  /// \param response The body of the response; may be moved from.
+  using Callback = std::function<void(bool ok, std::string *response)>;
+
+  /// \param max_connections The most connections to open to one host.
+  explicit JsonMultiClient(size_t max_connections = 8);
+  /// \brief Cancels any requests that haven't finished without calling their
+  /// callbacks.
+  ~JsonMultiClient();
+
+  /// \brief Queue a request. Nothing is sent until `Wait` is called.
+  /// \param uri The URI to request.
+  /// \param post Issue this request as a post?
+  /// \param request The string to issue as the request.
+  /// \param done Called with the response when the request finishes.
+  void Request(const std::string &uri, bool post, const std::string &request,
+               Callback done) {
+    Request(uri, post, "application/json", request, std::move(done));
+  }
+
+  /// \brief Queue a request with a body of any type.
+  /// \param uri The URI to request.
+  /// \param post Issue this request as a post?
+  /// \param content_type The MIME type of `request`.
+  /// \param request The string to issue as the request.
+  /// \param done Called with the response when the request finishes.
+  void Request(const std::string &uri, bool post,
+               const std::string &content_type, const std::string &request,
+               Callback done);
+
+  /// \brief Performs queued requests until there are none left, including
+  /// any queued by callbacks.
+  void Wait();
+
+  /// \return the number of requests that haven't finished.
+  size_t pending() const { return transfers_.size(); }
+
+ private:
+  /// \brief The state of a single request.
+  struct Transfer {
+    std::string uri;
+    std::string to_send;
+    std::string received;
+    ::curl_slist *headers = nullptr;
+    Callback done;
+  };
+
+  static size_t CurlWriteCallback(void *data, size_t size, size_t nmemb,
+                                  void *user);
+
+  /// \brief Retires the request using `handle` and calls its callback.
+  void Finish(CURL *handle, ::CURLcode result);
+
+  /// The network context shared by all requests.
+  CURLM *multi_;
+  /// Requests that haven't finished yet, keyed by their handles.
+  std::unordered_map<CURL *, std::unique_ptr<Transfer>> transfers_;
+  /// Handles that are free to be reused.
+  std::vector<CURL *> idle_handles_;
+};
+
 /// \brief A client for a Kythe xrefs service.
 class XrefsClient {
  public:
@@ -144,7 +230,11 @@ class XrefsClient {
   }
 };
 
-/// \brief A client for a Kythe xrefs service that talks JSON.
+/// \brief A client for a Kythe xrefs service.
+///
+/// Requests are sent as binary protobufs. If the server rejects one but
+/// accepts the same request as JSON, the client sends JSON from then on.
+/// Replies are always binary protobufs.
 class XrefsJsonClient : public XrefsClient {
  public:
   /// \param client The JsonClient to use.
@@ -181,6 +271,90 @@ class XrefsJsonClient : public XrefsClient {
                  google::protobuf::Message *response, std::string *error_text);
 
   std::unique_ptr<JsonClient> client_;
+  /// Set once the server has shown that it only accepts JSON requests.
+  bool json_requests_ = false;
+  std::string nodes_uri_;
+  std::string edges_uri_;
+  std::string decorations_uri_;
+  std::string documentation_uri_;
+};
+
+/// \brief A client for a Kythe xrefs service that can have many calls in
+/// flight at once. Requests and replies are encoded as for `XrefsJsonClient`.
+///
+/// Each `*Async` call is queued and sent when `Wait` is called. The reply
+/// must stay alive until the call's callback has run. The synchronous
+/// `XrefsClient` calls also wait for any queued asynchronous calls.
+class XrefsJsonMultiClient : public XrefsClient {
+ public:
+  /// \brief Called once a call has finished.
+  /// \param ok true if the call succeeded and its reply was filled in.
+  /// \param error_text On failure, a description of the error.
+  using Callback = std::function<void(bool ok, const std::string &error_text)>;
+
+  /// \param client The JsonMultiClient to use.
+  /// \param base_uri The base URI of the service ("http://localhost:8080")
+  XrefsJsonMultiClient(std::unique_ptr<JsonMultiClient> client,
+                       const std::string &base_uri)
+      : client_(std::move(client)),
+        nodes_uri_(base_uri + "/nodes?proto=1"),
+        edges_uri_(base_uri + "/edges?proto=1"),
+        decorations_uri_(base_uri + "/decorations?proto=1"),
+        documentation_uri_(base_uri + "/documentation?proto=1") {}
+
+  void NodesAsync(const proto::NodesRequest &request, proto::NodesReply *reply,
+                  Callback done) {
+    Start(nodes_uri_, request, reply, std::move(done));
+  }
+  void EdgesAsync(const proto::EdgesRequest &request, proto::EdgesReply *reply,
+                  Callback done) {
+    Start(edges_uri_, request, reply, std::move(done));
+  }
+  void DecorationsAsync(const proto::DecorationsRequest &request,
+                        proto::DecorationsReply *reply, Callback done) {
+    Start(decorations_uri_, request, reply, std::move(done));
+  }
+  void DocumentationAsync(const proto::DocumentationRequest &request,
+                          proto::DocumentationReply *reply, Callback done) {
+    Start(documentation_uri_, request, reply, std::move(done));
+  }
+
+  /// \brief Waits for all queued calls to finish and runs their callbacks.
+  void Wait() { client_->Wait(); }
+
+  bool Nodes(const proto::NodesRequest &request, proto::NodesReply *reply,
+             std::string *error_text) override {
+    return Roundtrip(nodes_uri_, request, reply, error_text);
+  }
+  bool Edges(const proto::EdgesRequest &request, proto::EdgesReply *reply,
+             std::string *error_text) override {
+    return Roundtrip(edges_uri_, request, reply, error_text);
+  }
+  bool Decorations(const proto::DecorationsRequest &request,
+                   proto::DecorationsReply *reply,
+                   std::string *error_text) override {
+    return Roundtrip(decorations_uri_, request, reply, error_text);
+  }
+  bool Documentation(const proto::DocumentationRequest &request,
+                     proto::DocumentationReply *reply,
+                     std::string *error_text) override {
+    return Roundtrip(documentation_uri_, request, reply, error_text);
+  }
+
+ private:
+  /// \brief Queues a call. If the request can't be encoded, `done` is called
+  /// right away.
+  void Start(const std::string &endpoint,
+             const google::protobuf::Message &request,
+             google::protobuf::Message *response, Callback done);
+
+  bool Roundtrip(const std::string &endpoint,
+                 const google::protobuf::Message &request,
+                 google::protobuf::Message *response, std::string *error_text);
+
+  std::unique_ptr<JsonMultiClient> client_;
+  /// Set once the server has shown that it only accepts JSON requests.
+  bool json_requests_ = false;
   std::string nodes_uri_;
   std::string edges_uri_;
   std::string decorations_uri_;
@@ -43,6 +43,31 @@ void TestNodeRequest() {
   CHECK_EQ("/kythe/node/kind", node.facts().begin()->first);
   CHECK_EQ("file", node.facts().begin()->second);
 }
+
+void TestConcurrentNodeRequests() {
+  kythe::XrefsJsonMultiClient client(
+      std::unique_ptr<kythe::JsonMultiClient>(new kythe::JsonMultiClient()),
+      FLAGS_xrefs);
+  kythe::proto::NodesRequest request;
+  request.add_ticket("kythe:?lang=c%2B%2B#SOMEFILE");
+  std::vector<kythe::proto::NodesReply> responses(16);
+  size_t finished = 0;
+  for (auto &response : responses) {
+    client.NodesAsync(request, &response,
+                      [&finished](bool ok, const std::string &error) {
+                        CHECK(ok) << error;
+                        ++finished;
+                      });
+  }
+  CHECK_EQ(0, finished);
+  client.Wait();
+  CHECK_EQ(responses.size(), finished);
+  for (const auto &response : responses) {
+    CHECK_EQ(1, response.nodes().size()) << response.DebugString();
+    CHECK_EQ(request.ticket(0), response.nodes().begin()->first)
+        << response.DebugString();
+  }
+}
 }  // namespace
 
 int main(int argc, char **argv) {
@@ -51,5 +76,6 @@ int main(int argc, char **argv) {
   gflags::ParseCommandLineFlags(&argc, &argv, true);
   kythe::JsonClient::InitNetwork();
   TestNodeRequest();
+  TestConcurrentNodeRequests();
   return 0;
 }
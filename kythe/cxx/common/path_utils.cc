@@ -23,21 +23,64 @@
 #include "llvm/Support/Path.h"
 
 namespace kythe {
+bool IsCleanPath(llvm::StringRef in_path) {
+  if (in_path.empty() || in_path == "/") {
+    return true;
+  }
+  // Leave root names ("//net") and trailing separators to remove_dots.
+  if (in_path.startswith("//") || in_path.endswith("/")) {
+    return false;
+  }
+  size_t component_begin = in_path[0] == '/' ? 1 : 0;
+  while (component_begin <= in_path.size()) {
+    size_t component_end = in_path.find('/', component_begin);
+    if (component_end == llvm::StringRef::npos) {
+      component_end = in_path.size();
+    }
+    llvm::StringRef component =
+        in_path.slice(component_begin, component_end);
+    if (component.empty() || component == "." || component == "..") {
+      return false;
+    }
+    component_begin = component_end + 1;
+  }
+  return true;
+}
+
+llvm::StringRef CleanPath(llvm::StringRef in_path,
+                          llvm::SmallVectorImpl<char>* buffer) {
+  if (IsCleanPath(in_path)) {
+    return in_path;
+  }
+  buffer->assign(in_path.begin(), in_path.end());
+  llvm::sys::path::remove_dots(*buffer, true);
+  return llvm::StringRef(buffer->data(), buffer->size());
+}
+
 std::string CleanPath(llvm::StringRef in_path) {
-  llvm::SmallString<1024> out_path = in_path;
-  llvm::sys::path::remove_dots(out_path, true);
-  return out_path.str();
+  llvm::SmallString<1024> buffer;
+  return CleanPath(in_path, &buffer).str();
+}
+
+void JoinPath(llvm::StringRef a, llvm::StringRef b,
+              llvm::SmallVectorImpl<char>* out) {
+  out->assign(a.begin(), a.end());
+  llvm::sys::path::append(*out, b);
 }
 
 std::string JoinPath(llvm::StringRef a, llvm::StringRef b) {
-  llvm::SmallString<1024> out_path = a;
-  llvm::sys::path::append(out_path, b);
+  llvm::SmallString<1024> out_path;
+  JoinPath(a, b, &out_path);
   return out_path.str();
 }
 
 std::string MakeCleanAbsolutePath(const std::string& in_path) {
   std::string abs_path = clang::tooling::getAbsolutePath(in_path);
-  return CleanPath(abs_path);
+  if (IsCleanPath(abs_path)) {
+    return abs_path;
+  }
+  llvm::SmallString<1024> buffer;
+  return CleanPath(abs_path, &buffer).str();
 }
 
 std::string RelativizePath(const std::string& to_relativize,
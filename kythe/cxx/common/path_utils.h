@@ -49,9 +49,27 @@ std::string MakeCleanAbsolutePath(const std::string &in_path);
 /// \param in_path The path to convert.
 std::string CleanPath(llvm::StringRef in_path);
 
+/// \brief Lexically eliminate `.` and `..` from `in_path`, copying it only if
+/// it needs to change.
+/// \param in_path The path to convert.
+/// \param buffer Storage for the result if `in_path` isn't already clean.
+/// \return `in_path` itself if it was already clean; otherwise, `buffer`.
+llvm::StringRef CleanPath(llvm::StringRef in_path,
+                          llvm::SmallVectorImpl<char> *buffer);
+
+/// \brief Returns true if `CleanPath` would return `in_path` unchanged.
+///
+/// This is a quick syntactic check: it may return false for some paths that
+/// are already clean, but never returns true for one that isn't.
+bool IsCleanPath(llvm::StringRef in_path);
+
 /// \brief Append path `b` to path `a`, cleaning and returning the result.
 std::string JoinPath(llvm::StringRef a, llvm::StringRef b);
 
+/// \brief Append path `b` to path `a`, replacing the contents of `out`.
+void JoinPath(llvm::StringRef a, llvm::StringRef b,
+              llvm::SmallVectorImpl<char> *out);
+
 /// \brief Looks up a file for an #include-ish pragma.
 /// \param preprocessor The preprocessor to use to consume the filename tokens.
 /// \param search_path The path used to find the file in the filesystem.
@@ -86,6 +86,33 @@ TEST(PathUtilsTest, JoinPath) {
   EXPECT_EQ("a/c", JoinPath("a", "/c"));
 }
 
+TEST(PathUtilsTest, JoinPathIntoBuffer) {
+  llvm::SmallString<16> out("junk");
+  JoinPath("a/", "c", &out);
+  EXPECT_EQ("a/c", out.str());
+}
+
+TEST(PathUtilsTest, IsCleanPath) {
+  for (const char *path : {"", "/", "a", "a/c", "/a/c", "/Users", "a.b/.c"}) {
+    EXPECT_TRUE(IsCleanPath(path)) << path;
+    EXPECT_EQ(path, CleanPath(path)) << path;
+  }
+  for (const char *path : {".", "..", "a//c", "a/c/", "a/./c", "a/../c",
+                           "/../a", "//Users", "///Users", "a/.."}) {
+    EXPECT_FALSE(IsCleanPath(path)) << path;
+  }
+}
+
+TEST(PathUtilsTest, CleanPathIntoBuffer) {
+  llvm::SmallString<16> buffer;
+  llvm::StringRef clean("/a/b/c");
+  // Clean paths are returned as they are.
+  EXPECT_EQ(clean.data(), CleanPath(clean, &buffer).data());
+  EXPECT_TRUE(buffer.empty());
+  EXPECT_EQ("/a/c", CleanPath("/../a/b/../././/c", &buffer));
+  EXPECT_EQ("/a/c", buffer.str());
+}
+
 }  // anonymous namespace
 }  // namespace kythe
 
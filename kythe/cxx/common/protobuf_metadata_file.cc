@@ -53,6 +53,7 @@ std::unique_ptr<kythe::MetadataFile> ProtobufMetadataSupport::ParseFile(
     return nullptr;
   }
   std::vector<MetadataFile::Rule> rules;
+  rules.reserve(info.annotation_size());
   for (const auto &annotation : info.annotation()) {
     MetadataFile::Rule rule;
     rule.begin = annotation.begin();
@@ -61,8 +62,8 @@ std::unique_ptr<kythe::MetadataFile> ProtobufMetadataSupport::ParseFile(
     rule.edge_in = "/kythe/edge/defines/binding";
     rule.edge_out = "/kythe/edge/generates";
     rule.reverse_edge = true;
-    rules.push_back(rule);
+    rules.push_back(std::move(rule));
   }
-  return MetadataFile::LoadFromRules(rules.begin(), rules.end());
+  return MetadataFile::LoadFromRules(std::move(rules));
 }
 }  // namespace kythe
@@ -0,0 +1,398 @@
+/*
+ * Copyright 2017 Google Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "remote_index_pack.h"
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <tuple>
+
+#include "glog/logging.h"
+#include "google/protobuf/io/zero_copy_stream_impl_lite.h"
+#include "kythe/cxx/common/blob_compression.h"
+#include "llvm/ADT/SmallString.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Path.h"
+
+namespace kythe {
+namespace {
+/// The suffix of blobs being written to the cache.
+constexpr char kCacheTempSuffix[] = ".tmp";
+
+/// \brief Writes all of `data` to `fd`.
+bool WriteFully(int fd, const char *data, size_t size) {
+  while (size != 0) {
+    ssize_t written = ::write(fd, data, size);
+    if (written < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return false;
+    }
+    data += written;
+    size -= written;
+  }
+  return true;
+}
+}  // anonymous namespace
+
+RemoteBlobStore::RemoteBlobStore(std::unique_ptr<BlobFetcher> fetcher,
+                                 const Options &options)
+    : fetcher_(std::move(fetcher)),
+      cache_directory_(options.cache_directory),
+      max_cache_bytes_(options.max_cache_bytes) {}
+
+std::unique_ptr<RemoteBlobStore> RemoteBlobStore::Open(
+    std::unique_ptr<BlobFetcher> fetcher, const Options &options,
+    std::string *error_text) {
+  if (options.cache_directory.empty()) {
+    *error_text = "A remote blob store needs a cache directory.";
+    return nullptr;
+  }
+  std::unique_ptr<RemoteBlobStore> store(
+      new RemoteBlobStore(std::move(fetcher), options));
+  if (!store->LoadCache(error_text)) {
+    return nullptr;
+  }
+  for (size_t i = 0; i < options.prefetch_threads; ++i) {
+    store->prefetch_threads_.emplace_back(&RemoteBlobStore::RunPrefetchThread,
+                                          store.get());
+  }
+  return store;
+}
+
+RemoteBlobStore::~RemoteBlobStore() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stopping_ = true;
+    pending_prefetches_ -= prefetch_queue_.size();
+    prefetch_queue_.clear();
+  }
+  changed_.notify_all();
+  for (auto &thread : prefetch_threads_) {
+    thread.join();
+  }
+}
+
+std::string RemoteBlobStore::CachePath(const std::string &name) const {
+  llvm::SmallString<256> path(cache_directory_);
+  llvm::sys::path::append(path, name);
+  return std::string(path.str());
+}
+
+bool RemoteBlobStore::LoadCache(std::string *error_text) {
+  if (auto err =
+          llvm::sys::fs::create_directories(llvm::Twine(cache_directory_))) {
+    *error_text = "Couldn't create " + cache_directory_ + ": " + err.message();
+    return false;
+  }
+  // (access time, name, size) for each cached blob.
+  using CachedBlob = std::tuple<struct timespec, std::string, uint64_t>;
+  std::vector<CachedBlob> blobs;
+  std::error_code err;
+  llvm::sys::fs::directory_iterator current(llvm::Twine(cache_directory_),
+                                            err),
+      end;
+  for (; !err && current != end; current = current.increment(err)) {
+    const std::string path = current->path();
+    if (llvm::StringRef(path).endswith(kCacheTempSuffix)) {
+      // Left behind by a store that didn't finish writing it.
+      llvm::sys::fs::remove(llvm::Twine(path));
+      continue;
+    }
+    struct stat file_stat;
+    if (::stat(path.c_str(), &file_stat) != 0 || !S_ISREG(file_stat.st_mode)) {
+      continue;
+    }
+    blobs.emplace_back(file_stat.st_mtim,
+                       std::string(llvm::sys::path::filename(path)),
+                       file_stat.st_size);
+  }
+  if (err) {
+    *error_text = "Couldn't list " + cache_directory_ + ": " + err.message();
+    return false;
+  }
+  // Most recently used first.
+  std::sort(blobs.begin(), blobs.end(),
+            [](const CachedBlob &a, const CachedBlob &b) {
+              const auto &ta = std::get<0>(a), &tb = std::get<0>(b);
+              return std::tie(tb.tv_sec, tb.tv_nsec) <
+                     std::tie(ta.tv_sec, ta.tv_nsec);
+            });
+  std::lock_guard<std::mutex> lock(mutex_);
+  for (const auto &blob : blobs) {
+    const std::string &name = std::get<1>(blob);
+    lru_.push_back(name);
+    entries_[name] = CacheEntry{std::get<2>(blob), std::prev(lru_.end())};
+    cached_bytes_ += std::get<2>(blob);
+  }
+  Evict();
+  return true;
+}
+
+bool RemoteBlobStore::ReadCachedBlob(const std::string &name,
+                                     std::string *blob) {
+  int fd = ::open(CachePath(name).c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return false;
+  }
+  struct stat file_stat;
+  if (::fstat(fd, &file_stat) != 0) {
+    ::close(fd);
+    return false;
+  }
+  size_t size = file_stat.st_size, done = 0;
+  blob->resize(size);
+  while (done < size) {
+    ssize_t count = ::read(fd, &(*blob)[done], size - done);
+    if (count < 0 && errno == EINTR) {
+      continue;
+    }
+    if (count <= 0) {
+      break;
+    }
+    done += count;
+  }
+  // Record the use for the next store to load this cache.
+  ::futimens(fd, nullptr);
+  ::close(fd);
+  return done == size;
+}
+
+void RemoteBlobStore::StoreCachedBlob(const std::string &name,
+                                      const std::string &blob) {
+  if (blob.size() > max_cache_bytes_) {
+    return;
+  }
+  llvm::SmallString<256> model(cache_directory_);
+  llvm::sys::path::append(model,
+                          std::string("%%%%%%%%%%%%%%%%") + kCacheTempSuffix);
+  int fd;
+  llvm::SmallString<256> temp_path;
+  if (auto err = llvm::sys::fs::createUniqueFile(model, fd, temp_path)) {
+    LOG(WARNING) << "Couldn't cache " << name << ": " << err.message();
+    return;
+  }
+  bool written = WriteFully(fd, blob.data(), blob.size());
+  if (::close(fd) != 0) {
+    written = false;
+  }
+  if (written) {
+    if (auto err = llvm::sys::fs::rename(temp_path, CachePath(name))) {
+      LOG(WARNING) << "Couldn't cache " << name << ": " << err.message();
+      written = false;
+    }
+  } else {
+    LOG(WARNING) << "Couldn't cache " << name << ": " << strerror(errno);
+  }
+  if (!written) {
+    llvm::sys::fs::remove(temp_path);
+    return;
+  }
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto found = entries_.find(name);
+  if (found != entries_.end()) {
+    cached_bytes_ -= found->second.size;
+    lru_.erase(found->second.lru);
+    entries_.erase(found);
+  }
+  lru_.push_front(name);
+  entries_[name] = CacheEntry{blob.size(), lru_.begin()};
+  cached_bytes_ += blob.size();
+  Evict();
+}
+
+void RemoteBlobStore::Evict() {
+  while (cached_bytes_ > max_cache_bytes_ && !lru_.empty()) {
+    const std::string &name = lru_.back();
+    llvm::sys::fs::remove(llvm::Twine(CachePath(name)));
+    auto found = entries_.find(name);
+    cached_bytes_ -= found->second.size;
+    entries_.erase(found);
+    lru_.pop_back();
+  }
+}
+
+bool RemoteBlobStore::Read(const std::string &path, std::string *blob,
+                           std::string *error_text) {
+  const std::string name = llvm::sys::path::filename(path).str();
+  {
+    std::unique_lock<std::mutex> lock(mutex_);
+    for (;;) {
+      changed_.wait(lock, [this, &name] { return !in_flight_.count(name); });
+      auto found = entries_.find(name);
+      if (found == entries_.end()) {
+        break;
+      }
+      lru_.splice(lru_.begin(), lru_, found->second.lru);
+      lock.unlock();
+      if (ReadCachedBlob(name, blob)) {
+        return true;
+      }
+      lock.lock();
+      // The blob was evicted after we found it, or its file is damaged.
+      found = entries_.find(name);
+      if (found != entries_.end()) {
+        llvm::sys::fs::remove(llvm::Twine(CachePath(name)));
+        cached_bytes_ -= found->second.size;
+        lru_.erase(found->second.lru);
+        entries_.erase(found);
+      }
+    }
+    in_flight_.insert(name);
+    ++fetch_count_;
+  }
+  bool fetched = fetcher_->Fetch(path, blob, error_text);
+  if (fetched) {
+    StoreCachedBlob(name, *blob);
+  }
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    in_flight_.erase(name);
+  }
+  changed_.notify_all();
+  return fetched;
+}
+
+void RemoteBlobStore::Prefetch(const std::vector<std::string> &paths) {
+  if (prefetch_threads_.empty()) {
+    return;
+  }
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (const auto &path : paths) {
+      const std::string name = llvm::sys::path::filename(path).str();
+      if (entries_.count(name) || in_flight_.count(name)) {
+        continue;
+      }
+      prefetch_queue_.push_back(path);
+      ++pending_prefetches_;
+    }
+  }
+  changed_.notify_all();
+}
+
+void RemoteBlobStore::WaitForPrefetches() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  changed_.wait(lock, [this] { return pending_prefetches_ == 0; });
+}
+
+void RemoteBlobStore::RunPrefetchThread() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  for (;;) {
+    changed_.wait(lock,
+                  [this] { return stopping_ || !prefetch_queue_.empty(); });
+    if (stopping_) {
+      return;
+    }
+    std::string path = std::move(prefetch_queue_.front());
+    prefetch_queue_.pop_front();
+    lock.unlock();
+    // `Read` does nothing more than mark the blob as used if an earlier
+    // request already brought it in.
+    std::string blob, error_text;
+    if (!Read(path, &blob, &error_text)) {
+      LOG(WARNING) << "Couldn't prefetch " << path << ": " << error_text;
+    }
+    lock.lock();
+    --pending_prefetches_;
+    changed_.notify_all();
+  }
+}
+
+size_t RemoteBlobStore::fetch_count() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return fetch_count_;
+}
+
+uint64_t RemoteBlobStore::cached_bytes() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return cached_bytes_;
+}
+
+bool IndexPackRemoteFilesystem::IsRemote(const std::string &root) {
+  llvm::StringRef root_ref(root);
+  return root_ref.startswith("http://") || root_ref.startswith("https://") ||
+         root_ref.startswith("gs://");
+}
+
+std::string IndexPackRemoteFilesystem::PathFor(DataKind data_kind,
+                                               const std::string &file_name) {
+  if (data_kind == DataKind::kFileData) {
+    return std::string(kDataDirectoryName) + "/" + file_name + kFileDataSuffix;
+  }
+  return std::string(kCompilationUnitDirectoryName) + "/" + file_name +
+         kCompilationUnitSuffix;
+}
+
+bool IndexPackRemoteFilesystem::ReadFileContent(DataKind data_kind,
+                                                const std::string &file_name,
+                                                ReadCallback callback,
+                                                std::string *error_text) {
+  std::string blob;
+  if (!store_->Read(PathFor(data_kind, file_name), &blob, error_text)) {
+    return false;
+  }
+  google::protobuf::io::ArrayInputStream input(blob.data(), blob.size());
+  return ReadCompressedBlob(
+      &input,
+      [&callback,
+       error_text](google::protobuf::io::ZeroCopyInputStream *stream) {
+        return callback(stream, error_text);
+      },
+      error_text);
+}
+
+bool IndexPackRemoteFilesystem::ScanFiles(DataKind data_kind,
+                                          ScanCallback callback,
+                                          std::string *error_text) {
+  const std::string directory = data_kind == DataKind::kFileData
+                                    ? kDataDirectoryName
+                                    : kCompilationUnitDirectoryName;
+  const llvm::StringRef suffix = data_kind == DataKind::kFileData
+                                     ? kFileDataSuffix
+                                     : kCompilationUnitSuffix;
+  return store_->List(directory + "/",
+                      [&](const std::string &path) {
+                        llvm::StringRef name(path);
+                        name = name.drop_front(directory.size() + 1);
+                        if (name.find('/') != llvm::StringRef::npos ||
+                            !name.endswith(suffix)) {
+                          // Ignore files we don't understand.
+                          return true;
+                        }
+                        return callback(std::string(name.drop_back(
+                            suffix.size())));
+                      },
+                      error_text);
+}
+
+void IndexPackRemoteFilesystem::PrefetchFileContent(
+    DataKind data_kind, const std::vector<std::string> &file_names) {
+  std::vector<std::string> paths;
+  paths.reserve(file_names.size());
+  for (const auto &file_name : file_names) {
+    paths.push_back(PathFor(data_kind, file_name));
+  }
+  store_->Prefetch(paths);
+}
+
+}  // namespace kythe
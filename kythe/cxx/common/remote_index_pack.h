@@ -0,0 +1,228 @@
+/*
+ * Copyright 2017 Google Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef KYTHE_CXX_COMMON_REMOTE_INDEX_PACK_H_
+#define KYTHE_CXX_COMMON_REMOTE_INDEX_PACK_H_
+
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "kythe/cxx/common/index_pack.h"
+
+namespace kythe {
+
+/// \brief Fetches blobs from remote storage by path.
+class BlobFetcher {
+ public:
+  virtual ~BlobFetcher() {}
+
+  /// \brief Fetches the blob at `path` (like "files/abc.data"). Must be
+  /// thread-safe.
+  /// \param content Non-null; set to the blob on success.
+  /// \param error_text Non-null; set to an error description on failure.
+  /// \return false on failure.
+  virtual bool Fetch(const std::string &path, std::string *content,
+                     std::string *error_text) = 0;
+
+  /// \brief Lists the paths of the blobs that start with `prefix`.
+  /// \param callback Called with each path. Returns false to stop.
+  /// \param error_text Non-null; set to an error description on failure.
+  /// \return false on failure (including if listing isn't supported).
+  virtual bool List(const std::string &prefix,
+                    const std::function<bool(const std::string &)> &callback,
+                    std::string *error_text) {
+    *error_text = "Listing isn't supported by this blob fetcher.";
+    return false;
+  }
+};
+
+/// \brief Reads blobs through a `BlobFetcher`, keeping copies in a local
+/// directory.
+///
+/// The cache holds at most `max_cache_bytes` of blobs; when it would grow
+/// past that, the least recently used blobs are removed. Blobs are cached
+/// under the last component of their path, which must be unique (as for
+/// index pack data, which is named by digest). Concurrent reads of the same
+/// blob fetch it once. The cache directory should be used by one
+/// `RemoteBlobStore` at a time; it is reloaded (oldest access first) when a
+/// new store is opened on it.
+///
+/// `RemoteBlobStore` is thread-safe.
+class RemoteBlobStore {
+ public:
+  struct Options {
+    /// The local directory in which to cache blobs. Created if missing.
+    std::string cache_directory;
+    /// The most blob data to keep in `cache_directory`.
+    uint64_t max_cache_bytes = 10ull << 30;
+    /// The number of threads that fetch prefetched blobs. If 0, `Prefetch`
+    /// does nothing.
+    size_t prefetch_threads = 16;
+  };
+
+  /// \brief Opens a store that fetches blobs with `fetcher`.
+  /// \return the new store, or null on failure with `error_text` set.
+  static std::unique_ptr<RemoteBlobStore> Open(
+      std::unique_ptr<BlobFetcher> fetcher, const Options &options,
+      std::string *error_text);
+
+  /// \brief Stops prefetching. Prefetches that haven't started are dropped.
+  ~RemoteBlobStore();
+
+  /// \brief Reads the blob at `path` from the cache, fetching it first if
+  /// it isn't there.
+  /// \param blob Non-null; set to the blob on success.
+  /// \param error_text Non-null; set to an error description on failure.
+  /// \return false on failure.
+  bool Read(const std::string &path, std::string *blob,
+            std::string *error_text);
+
+  /// \brief Starts fetching each of the blobs at `paths` that aren't cached
+  /// yet in the background.
+  void Prefetch(const std::vector<std::string> &paths);
+
+  /// \brief Blocks until every requested prefetch has finished.
+  void WaitForPrefetches();
+
+  /// \brief Lists remote blobs; see `BlobFetcher::List`.
+  bool List(const std::string &prefix,
+            const std::function<bool(const std::string &)> &callback,
+            std::string *error_text) {
+    return fetcher_->List(prefix, callback, error_text);
+  }
+
+  /// \return the number of blobs fetched from remote storage so far.
+  size_t fetch_count() const;
+
+  /// \return the size of the blobs currently in the cache.
+  uint64_t cached_bytes() const;
+
+ private:
+  RemoteBlobStore(std::unique_ptr<BlobFetcher> fetcher,
+                  const Options &options);
+
+  /// \brief Indexes the blobs already in the cache directory.
+  bool LoadCache(std::string *error_text);
+
+  /// \brief Reads the cached blob `name` into `blob`, marking it as
+  /// recently used.
+  /// \return false if it couldn't be read (for example, if it was evicted).
+  bool ReadCachedBlob(const std::string &name, std::string *blob);
+
+  /// \brief Adds `blob` to the cache as `name`, evicting others as needed.
+  void StoreCachedBlob(const std::string &name, const std::string &blob);
+
+  /// \brief Drops least recently used blobs until the cache fits in
+  /// `max_cache_bytes_`. Requires `mutex_`.
+  void Evict();
+
+  /// \return the cache file path for the blob `name`.
+  std::string CachePath(const std::string &name) const;
+
+  /// \brief Handles prefetch requests until the store is destroyed.
+  void RunPrefetchThread();
+
+  /// \brief A blob in the cache.
+  struct CacheEntry {
+    /// The size of the blob.
+    uint64_t size;
+    /// The blob's position in `lru_`.
+    std::list<std::string>::iterator lru;
+  };
+
+  /// Fetches blobs that aren't cached.
+  std::unique_ptr<BlobFetcher> fetcher_;
+  /// Where cached blobs are kept.
+  std::string cache_directory_;
+  /// The most blob data to keep in `cache_directory_`.
+  uint64_t max_cache_bytes_;
+  /// Guards the members below.
+  mutable std::mutex mutex_;
+  /// Signalled when a fetch or prefetch finishes or a prefetch is requested.
+  std::condition_variable changed_;
+  /// The cached blobs, by name.
+  std::unordered_map<std::string, CacheEntry> entries_;
+  /// The names of the cached blobs, most recently used first.
+  std::list<std::string> lru_;
+  /// The total size of the cached blobs.
+  uint64_t cached_bytes_ = 0;
+  /// The names of the blobs being fetched.
+  std::unordered_set<std::string> in_flight_;
+  /// Paths waiting to be prefetched.
+  std::deque<std::string> prefetch_queue_;
+  /// The number of prefetches queued or running.
+  size_t pending_prefetches_ = 0;
+  /// The number of blobs fetched so far.
+  size_t fetch_count_ = 0;
+  /// Set when the prefetch threads should exit.
+  bool stopping_ = false;
+  /// Threads that fetch blobs from `prefetch_queue_`.
+  std::vector<std::thread> prefetch_threads_;
+};
+
+/// \brief A read-only `IndexPackFilesystem` for an index pack in remote
+/// storage (laid out like an `IndexPackPosixFilesystem`), read through a
+/// `RemoteBlobStore`.
+///
+/// Many filesystems may share one store (and so one cache).
+/// `PrefetchFileContent` fetches data in the background, so an indexer can
+/// start on a unit while the rest of its inputs are still arriving.
+class IndexPackRemoteFilesystem : public IndexPackFilesystem {
+ public:
+  explicit IndexPackRemoteFilesystem(std::shared_ptr<RemoteBlobStore> store)
+      : store_(std::move(store)) {}
+
+  /// \return true if `root` names a remote index pack (an http://,
+  /// https:// or gs:// URI).
+  static bool IsRemote(const std::string &root);
+
+  IndexPackFilesystem::OpenMode open_mode() const override {
+    return IndexPackFilesystem::OpenMode::kReadOnly;
+  }
+
+  bool ReadFileContent(DataKind data_kind, const std::string &file_name,
+                       ReadCallback callback, std::string *error_text) override;
+
+  /// \brief Lists data through the store's fetcher, which may not support
+  /// it.
+  bool ScanFiles(DataKind data_kind, ScanCallback callback,
+                 std::string *error_text) override;
+
+  void PrefetchFileContent(DataKind data_kind,
+                           const std::vector<std::string> &file_names) override;
+
+  /// \return the path of the data `file_name` of kind `data_kind` relative
+  /// to the root of the pack.
+  static std::string PathFor(DataKind data_kind, const std::string &file_name);
+
+ private:
+  /// The store to read blobs from.
+  std::shared_ptr<RemoteBlobStore> store_;
+};
+
+}  // namespace kythe
+
+#endif  // KYTHE_CXX_COMMON_REMOTE_INDEX_PACK_H_
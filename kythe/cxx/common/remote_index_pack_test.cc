@@ -0,0 +1,326 @@
+/*
+ * Copyright 2017 Google Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "remote_index_pack.h"
+
+#include <chrono>
+#include <map>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "glog/logging.h"
+#include "gtest/gtest.h"
+#include "kythe/proto/analysis.pb.h"
+#include "llvm/ADT/STLExtras.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Path.h"
+
+namespace kythe {
+namespace {
+
+using DataKind = IndexPackFilesystem::DataKind;
+using OpenMode = IndexPackFilesystem::OpenMode;
+
+/// \brief A temporary directory that is removed with its contents.
+class TemporaryDirectory {
+ public:
+  TemporaryDirectory() {
+    CHECK_EQ(0,
+             llvm::sys::fs::createUniqueDirectory("remote_index_pack", root_)
+                 .value());
+  }
+  ~TemporaryDirectory() { llvm::sys::fs::remove_directories(root_); }
+
+  std::string root() const { return std::string(root_.str()); }
+
+ private:
+  llvm::SmallString<256> root_;
+};
+
+/// \brief Serves blobs from memory, counting fetches.
+class FakeBlobFetcher : public BlobFetcher {
+ public:
+  explicit FakeBlobFetcher(std::chrono::milliseconds delay =
+                               std::chrono::milliseconds(0))
+      : delay_(delay) {}
+
+  /// \brief Serves every file under `root`, named by its relative path.
+  void AddDirectory(const std::string &root) {
+    std::error_code err;
+    for (llvm::sys::fs::recursive_directory_iterator current(
+             llvm::Twine(root), err),
+         end;
+         !err && current != end; current.increment(err)) {
+      auto buffer = llvm::MemoryBuffer::getFile(current->path());
+      if (!buffer) {
+        continue;
+      }
+      std::string path = current->path();
+      blobs_[path.substr(root.size() + 1)] =
+          std::string((*buffer)->getBuffer());
+    }
+    EXPECT_FALSE(err);
+  }
+
+  void Add(const std::string &path, const std::string &blob) {
+    blobs_[path] = blob;
+  }
+
+  bool Fetch(const std::string &path, std::string *content,
+             std::string *error_text) override {
+    std::this_thread::sleep_for(delay_);
+    std::lock_guard<std::mutex> lock(mutex_);
+    ++fetches_[path];
+    auto found = blobs_.find(path);
+    if (found == blobs_.end()) {
+      *error_text = "No blob at " + path;
+      return false;
+    }
+    *content = found->second;
+    return true;
+  }
+
+  bool List(const std::string &prefix,
+            const std::function<bool(const std::string &)> &callback,
+            std::string *error_text) override {
+    for (auto blob = blobs_.lower_bound(prefix);
+         blob != blobs_.end() &&
+         llvm::StringRef(blob->first).startswith(prefix);
+         ++blob) {
+      if (!callback(blob->first)) {
+        break;
+      }
+    }
+    return true;
+  }
+
+  /// \return the number of times `path` has been fetched.
+  int fetches(const std::string &path) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return fetches_[path];
+  }
+
+ private:
+  std::chrono::milliseconds delay_;
+  std::map<std::string, std::string> blobs_;
+  std::mutex mutex_;
+  std::map<std::string, int> fetches_;
+};
+
+/// \brief A small index pack (in a local directory) to serve remotely.
+struct TestPack {
+  TestPack() {
+    std::string error_text;
+    IndexPack pack(IndexPackPosixFilesystem::Open(
+        dir.root(), OpenMode::kReadWrite, &error_text));
+    for (const char *name : {"1", "2", "3"}) {
+      proto::FileData file_data;
+      file_data.set_content(std::string("content") + name);
+      CHECK(pack.AddFileData(file_data, &error_text)) << error_text;
+    }
+    CHECK(pack.ScanData(DataKind::kFileData,
+                        [this](const std::string &hash) {
+                          file_digests.push_back(hash);
+                          return true;
+                        },
+                        &error_text))
+        << error_text;
+    proto::CompilationUnit unit;
+    unit.mutable_v_name()->set_signature("unit");
+    for (const auto &digest : file_digests) {
+      unit.add_required_input()->mutable_info()->set_digest(digest);
+    }
+    CHECK(pack.AddCompilationUnit(unit, &error_text)) << error_text;
+    CHECK(pack.ScanData(DataKind::kCompilationUnit,
+                        [this](const std::string &hash) {
+                          unit_hash = hash;
+                          return true;
+                        },
+                        &error_text))
+        << error_text;
+  }
+
+  TemporaryDirectory dir;
+  std::string unit_hash;
+  std::vector<std::string> file_digests;
+};
+
+std::shared_ptr<RemoteBlobStore> OpenStore(
+    std::unique_ptr<BlobFetcher> fetcher, const std::string &cache_directory,
+    uint64_t max_cache_bytes = 1 << 20) {
+  RemoteBlobStore::Options options;
+  options.cache_directory = cache_directory;
+  options.max_cache_bytes = max_cache_bytes;
+  options.prefetch_threads = 4;
+  std::string error_text;
+  auto store =
+      RemoteBlobStore::Open(std::move(fetcher), options, &error_text);
+  EXPECT_TRUE(store != nullptr) << error_text;
+  return std::move(store);
+}
+
+TEST(RemoteIndexPack, IsRemote) {
+  EXPECT_TRUE(IndexPackRemoteFilesystem::IsRemote("gs://bucket/pack"));
+  EXPECT_TRUE(IndexPackRemoteFilesystem::IsRemote("https://host/pack"));
+  EXPECT_TRUE(IndexPackRemoteFilesystem::IsRemote("http://host/pack"));
+  EXPECT_FALSE(IndexPackRemoteFilesystem::IsRemote("/local/pack"));
+  EXPECT_FALSE(IndexPackRemoteFilesystem::IsRemote("gs"));
+}
+
+TEST(RemoteIndexPack, ReadsThroughCache) {
+  TestPack test_pack;
+  TemporaryDirectory cache;
+  auto *fetcher = new FakeBlobFetcher();
+  fetcher->AddDirectory(test_pack.dir.root());
+  auto store = OpenStore(std::unique_ptr<BlobFetcher>(fetcher), cache.root());
+  const std::string unit_path = IndexPackRemoteFilesystem::PathFor(
+      DataKind::kCompilationUnit, test_pack.unit_hash);
+  for (int pass = 0; pass < 2; ++pass) {
+    IndexPack pack(llvm::make_unique<IndexPackRemoteFilesystem>(store));
+    proto::CompilationUnit unit;
+    std::string error_text, content;
+    ASSERT_TRUE(pack.ReadCompilationUnit(test_pack.unit_hash, &unit,
+                                         &error_text))
+        << error_text;
+    EXPECT_EQ("unit", unit.v_name().signature());
+    ASSERT_TRUE(pack.ReadFileData(test_pack.file_digests[0], &content))
+        << content;
+    EXPECT_EQ(0, content.find("content"));
+  }
+  EXPECT_EQ(1, fetcher->fetches(unit_path));
+  EXPECT_EQ(2, store->fetch_count());
+  store.reset();
+  // A new store finds what the old one left in the cache.
+  auto *empty_fetcher = new FakeBlobFetcher();
+  store =
+      OpenStore(std::unique_ptr<BlobFetcher>(empty_fetcher), cache.root());
+  IndexPack pack(llvm::make_unique<IndexPackRemoteFilesystem>(store));
+  std::string content;
+  ASSERT_TRUE(pack.ReadFileData(test_pack.file_digests[0], &content))
+      << content;
+  EXPECT_EQ(0, content.find("content"));
+  EXPECT_EQ(0, store->fetch_count());
+}
+
+TEST(RemoteIndexPack, ReportsMissingBlobs) {
+  TemporaryDirectory cache;
+  auto store = OpenStore(llvm::make_unique<FakeBlobFetcher>(), cache.root());
+  IndexPack pack(llvm::make_unique<IndexPackRemoteFilesystem>(store));
+  std::string content;
+  const std::string digest(64, '0');
+  EXPECT_FALSE(pack.ReadFileData(digest, &content));
+  EXPECT_NE(std::string::npos, content.find(digest)) << content;
+  EXPECT_EQ(0, store->cached_bytes());
+}
+
+TEST(RemoteIndexPack, EvictsLeastRecentlyUsed) {
+  TemporaryDirectory cache;
+  auto *fetcher = new FakeBlobFetcher();
+  for (const char *name : {"a", "b", "c"}) {
+    fetcher->Add(std::string("blobs/") + name, std::string(100, *name));
+  }
+  auto store =
+      OpenStore(std::unique_ptr<BlobFetcher>(fetcher), cache.root(), 250);
+  std::string blob, error_text;
+  for (const char *name : {"a", "b", "a", "c"}) {
+    ASSERT_TRUE(store->Read(std::string("blobs/") + name, &blob, &error_text))
+        << error_text;
+    EXPECT_EQ(std::string(100, *name), blob);
+  }
+  EXPECT_EQ(200, store->cached_bytes());
+  ASSERT_TRUE(store->Read("blobs/a", &blob, &error_text));
+  ASSERT_TRUE(store->Read("blobs/c", &blob, &error_text));
+  EXPECT_EQ(1, fetcher->fetches("blobs/a"));
+  EXPECT_EQ(1, fetcher->fetches("blobs/c"));
+  ASSERT_TRUE(store->Read("blobs/b", &blob, &error_text));
+  EXPECT_EQ(2, fetcher->fetches("blobs/b"));
+}
+
+TEST(RemoteIndexPack, PrefetchesRequiredInputs) {
+  TestPack test_pack;
+  TemporaryDirectory cache;
+  auto *fetcher = new FakeBlobFetcher();
+  fetcher->AddDirectory(test_pack.dir.root());
+  auto store = OpenStore(std::unique_ptr<BlobFetcher>(fetcher), cache.root());
+  IndexPack pack(llvm::make_unique<IndexPackRemoteFilesystem>(store));
+  pack.PrefetchFileData(test_pack.file_digests);
+  store->WaitForPrefetches();
+  EXPECT_EQ(3, store->fetch_count());
+  pack.PrefetchFileData(test_pack.file_digests);
+  store->WaitForPrefetches();
+  IndexPack::BatchReadOptions options;
+  size_t read = 0;
+  pack.ReadFileDataBatch(test_pack.file_digests, options,
+                         [&read](size_t index, bool ok, std::string *content) {
+                           EXPECT_TRUE(ok) << *content;
+                           ++read;
+                           return true;
+                         });
+  EXPECT_EQ(3, read);
+  EXPECT_EQ(3, store->fetch_count());
+}
+
+TEST(RemoteIndexPack, ConcurrentReadsFetchOnce) {
+  TemporaryDirectory cache;
+  auto *fetcher = new FakeBlobFetcher(std::chrono::milliseconds(20));
+  fetcher->Add("blobs/a", "blob");
+  auto store = OpenStore(std::unique_ptr<BlobFetcher>(fetcher), cache.root());
+  std::vector<std::thread> threads;
+  for (int i = 0; i < 8; ++i) {
+    threads.emplace_back([&store] {
+      std::string blob, error_text;
+      EXPECT_TRUE(store->Read("blobs/a", &blob, &error_text)) << error_text;
+      EXPECT_EQ("blob", blob);
+    });
+  }
+  for (auto &thread : threads) {
+    thread.join();
+  }
+  EXPECT_EQ(1, fetcher->fetches("blobs/a"));
+}
+
+TEST(RemoteIndexPack, ScansUnits) {
+  TestPack test_pack;
+  TemporaryDirectory cache;
+  auto *fetcher = new FakeBlobFetcher();
+  fetcher->AddDirectory(test_pack.dir.root());
+  fetcher->Add("units/README", "not a unit");
+  auto store = OpenStore(std::unique_ptr<BlobFetcher>(fetcher), cache.root());
+  IndexPack pack(llvm::make_unique<IndexPackRemoteFilesystem>(store));
+  std::vector<std::string> hashes;
+  std::string error_text;
+  ASSERT_TRUE(pack.ScanData(DataKind::kCompilationUnit,
+                            [&hashes](const std::string &hash) {
+                              hashes.push_back(hash);
+                              return true;
+                            },
+                            &error_text))
+      << error_text;
+  EXPECT_EQ(std::vector<std::string>{test_pack.unit_hash}, hashes);
+}
+
+}  // namespace
+}  // namespace kythe
+
+int main(int argc, char **argv) {
+  GOOGLE_PROTOBUF_VERIFY_VERSION;
+  google::InitGoogleLogging(argv[0]);
+  ::testing::InitGoogleTest(&argc, argv);
+  int result = RUN_ALL_TESTS();
+  return result;
+}
@@ -0,0 +1,732 @@
+/*
+ * Copyright 2017 Google Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "segmented_index_pack.h"
+
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstring>
+#include <queue>
+#include <utility>
+
+#include "glog/logging.h"
+#include "google/protobuf/io/coded_stream.h"
+#include "google/protobuf/io/zero_copy_stream_impl.h"
+#include "google/protobuf/io/zero_copy_stream_impl_lite.h"
+#include "llvm/Support/Endian.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Path.h"
+
+namespace kythe {
+namespace {
+using llvm::support::endian::read32le;
+using llvm::support::endian::read64le;
+using llvm::support::endian::write32le;
+using llvm::support::endian::write64le;
+
+/// The magic number at the start of every index file.
+constexpr char kIndexMagic[] = "KYPACKI\x01";
+constexpr size_t kMagicSize = 8;
+/// An index file header is the magic number and the entry count.
+constexpr size_t kIndexHeaderSize = kMagicSize + 8;
+/// A key is a kind byte followed by a raw SHA-256 digest.
+constexpr size_t kDigestSize = 32;
+constexpr size_t kKeySize = 1 + kDigestSize;
+/// An index entry is a key, three bytes of padding, a 32-bit segment number,
+/// a 64-bit offset and a 64-bit length.
+constexpr size_t kEntrySegment = kKeySize + 3;
+constexpr size_t kEntryOffset = kEntrySegment + 4;
+constexpr size_t kEntryLength = kEntryOffset + 8;
+constexpr size_t kEntrySize = kEntryLength + 8;
+/// A segment record header is a key followed by a 64-bit payload length.
+constexpr size_t kRecordHeaderSize = kKeySize + 8;
+/// Writers start a new segment once the newest one is this big.
+constexpr uint64_t kDefaultMaxSegmentBytes = 1ull << 30;
+/// Writers flush automatically once they have this many unindexed records.
+constexpr size_t kMaxPendingRecords = 1 << 20;
+/// How many times to list the index directory if files vanish while we
+/// are mapping them (because a concurrent `MergeIndexes` removed them).
+constexpr int kMaxIndexListAttempts = 8;
+const char kIndexSuffix[] = ".idx";
+const char kSegmentSuffix[] = ".seg";
+
+char KindByte(IndexPackFilesystem::DataKind data_kind) {
+  return data_kind == IndexPackFilesystem::DataKind::kFileData ? 'f' : 'u';
+}
+
+int HexValue(char c) {
+  if (c >= '0' && c <= '9') {
+    return c - '0';
+  }
+  if (c >= 'a' && c <= 'f') {
+    return c - 'a' + 10;
+  }
+  return -1;
+}
+
+/// \brief Builds the key for the blob of kind `data_kind` named `name`.
+/// \param key Must have room for `kKeySize` bytes.
+/// \return false if `name` isn't a lowercase hex SHA-256 digest.
+bool MakeKey(IndexPackFilesystem::DataKind data_kind, const std::string &name,
+             char *key, std::string *error_text) {
+  if (name.size() != kDigestSize * 2) {
+    *error_text = "Invalid name: bad SHA256 digest length.";
+    return false;
+  }
+  key[0] = KindByte(data_kind);
+  for (size_t i = 0; i < kDigestSize; ++i) {
+    int high = HexValue(name[i * 2]), low = HexValue(name[i * 2 + 1]);
+    if (high < 0 || low < 0) {
+      *error_text = "Invalid name: name is not a valid lowercase SHA256 digest";
+      return false;
+    }
+    key[i + 1] = static_cast<char>((high << 4) | low);
+  }
+  return true;
+}
+
+/// \return the lowercase hex digest in `key`.
+std::string KeyName(const char *key) {
+  static constexpr char kHexDigits[] = "0123456789abcdef";
+  std::string name(kDigestSize * 2, '\0');
+  for (size_t i = 0; i < kDigestSize; ++i) {
+    unsigned char byte = key[i + 1];
+    name[i * 2] = kHexDigits[byte >> 4];
+    name[i * 2 + 1] = kHexDigits[byte & 0xF];
+  }
+  return name;
+}
+
+/// \return the index of the first of the `count` sorted entries at
+/// `entries` whose key is not less than the `key_size`-byte prefix `key`.
+size_t LowerBound(const char *entries, size_t count, const char *key,
+                  size_t key_size) {
+  size_t low = 0, high = count;
+  while (low < high) {
+    size_t middle = low + (high - low) / 2;
+    if (::memcmp(entries + middle * kEntrySize, key, key_size) < 0) {
+      low = middle + 1;
+    } else {
+      high = middle;
+    }
+  }
+  return low;
+}
+
+/// \brief Merges runs of sorted entries, yielding each key once.
+class EntryMerger {
+ public:
+  /// \brief Adds the `count` sorted entries at `entries`.
+  void AddRun(const char *entries, size_t count) {
+    if (count != 0) {
+      heads_.push(Run{entries, entries + count * kEntrySize});
+    }
+  }
+
+  /// \return the next entry, or null after the last one.
+  const char *Next() {
+    while (!heads_.empty()) {
+      Run run = heads_.top();
+      heads_.pop();
+      const char *entry = run.next;
+      run.next += kEntrySize;
+      if (run.next != run.end) {
+        heads_.push(run);
+      }
+      if (last_ == nullptr || ::memcmp(last_, entry, kKeySize) != 0) {
+        last_ = entry;
+        return entry;
+      }
+    }
+    return nullptr;
+  }
+
+ private:
+  struct Run {
+    const char *next;
+    const char *end;
+  };
+  struct RunGreater {
+    bool operator()(const Run &a, const Run &b) const {
+      return ::memcmp(a.next, b.next, kKeySize) > 0;
+    }
+  };
+  std::priority_queue<Run, std::vector<Run>, RunGreater> heads_;
+  /// The last entry returned.
+  const char *last_ = nullptr;
+};
+
+/// \brief Writes all of `data` to `fd`.
+bool WriteFully(int fd, const char *data, size_t size) {
+  while (size != 0) {
+    ssize_t written = ::write(fd, data, size);
+    if (written < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return false;
+    }
+    data += written;
+    size -= written;
+  }
+  return true;
+}
+
+/// \brief Reads exactly `size` bytes from `fd` at `offset`.
+bool ReadFully(int fd, uint64_t offset, char *data, size_t size) {
+  while (size != 0) {
+    ssize_t read = ::pread(fd, data, size, offset);
+    if (read < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return false;
+    }
+    if (read == 0) {
+      return false;
+    }
+    data += read;
+    size -= read;
+    offset += read;
+  }
+  return true;
+}
+
+/// \brief Lists the files in `directory` with extension `suffix`.
+bool ListFiles(const std::string &directory, const char *suffix,
+               std::vector<std::string> *paths, std::string *error_text) {
+  std::error_code err;
+  llvm::sys::fs::directory_iterator current(llvm::Twine(directory), err), end;
+  for (; !err && current != end; current = current.increment(err)) {
+    const std::string &path = current->path();
+    if (llvm::sys::path::extension(path) == suffix) {
+      paths->push_back(path);
+    }
+  }
+  if (err) {
+    *error_text = err.message() + " (" + directory + ")";
+    return false;
+  }
+  return true;
+}
+}  // anonymous namespace
+
+const char IndexPackSegmentedFilesystem::kSegmentDirectoryName[] = "segments";
+const char IndexPackSegmentedFilesystem::kIndexDirectoryName[] = "index";
+
+IndexPackSegmentedFilesystem::IndexPackSegmentedFilesystem(
+    IndexPackFilesystem::OpenMode open_mode, std::string segment_directory,
+    std::string index_directory)
+    : open_mode_(open_mode),
+      segment_directory_(std::move(segment_directory)),
+      index_directory_(std::move(index_directory)),
+      max_segment_bytes_(kDefaultMaxSegmentBytes) {}
+
+std::unique_ptr<IndexPackSegmentedFilesystem>
+IndexPackSegmentedFilesystem::Open(const std::string &root_path,
+                                   IndexPackFilesystem::OpenMode open_mode,
+                                   std::string *error_text) {
+  llvm::SmallString<256> abs_root(root_path);
+  if (auto err = llvm::sys::fs::make_absolute(abs_root)) {
+    *error_text = err.message();
+    return nullptr;
+  }
+  llvm::SmallString<256> segment_path = abs_root;
+  llvm::sys::path::append(segment_path,
+                          llvm::StringRef(kSegmentDirectoryName));
+  llvm::SmallString<256> index_path = abs_root;
+  llvm::sys::path::append(index_path, llvm::StringRef(kIndexDirectoryName));
+  for (const auto &path : {segment_path, index_path}) {
+    if (open_mode == OpenMode::kReadWrite) {
+      if (auto err = llvm::sys::fs::create_directories(llvm::Twine(path))) {
+        *error_text = err.message();
+        return nullptr;
+      }
+      continue;
+    }
+    bool is_dir;
+    if (auto err = llvm::sys::fs::is_directory(llvm::Twine(path), is_dir)) {
+      *error_text = err.message();
+      return nullptr;
+    }
+    if (!is_dir) {
+      *error_text = std::string(path.str()) + " is not a directory.";
+      return nullptr;
+    }
+  }
+  auto filesystem = std::unique_ptr<IndexPackSegmentedFilesystem>(
+      new IndexPackSegmentedFilesystem(open_mode,
+                                       std::string(segment_path.str()),
+                                       std::string(index_path.str())));
+  if (!filesystem->LoadIndexes(error_text)) {
+    return nullptr;
+  }
+  if (open_mode == OpenMode::kReadWrite) {
+    // Start appending to the newest segment.
+    std::vector<std::string> segments;
+    if (!ListFiles(filesystem->segment_directory_, kSegmentSuffix, &segments,
+                   error_text)) {
+      return nullptr;
+    }
+    for (const auto &path : segments) {
+      uint32_t segment;
+      if (!llvm::sys::path::stem(path).getAsInteger(10, segment) &&
+          segment > filesystem->append_segment_) {
+        filesystem->append_segment_ = segment;
+      }
+    }
+  }
+  if (!filesystem->OpenUnitIndex(std::string(abs_root.str()), error_text)) {
+    return nullptr;
+  }
+  return filesystem;
+}
+
+bool IndexPackSegmentedFilesystem::IsSegmented(const std::string &root_path) {
+  llvm::SmallString<256> segment_path(root_path);
+  llvm::sys::path::append(segment_path,
+                          llvm::StringRef(kSegmentDirectoryName));
+  return llvm::sys::fs::is_directory(llvm::Twine(segment_path));
+}
+
+IndexPackSegmentedFilesystem::~IndexPackSegmentedFilesystem() {
+  if (open_mode_ == OpenMode::kReadWrite) {
+    std::string error_text;
+    if (!Flush(&error_text)) {
+      LOG(ERROR) << "Couldn't flush index pack: " << error_text;
+    }
+  }
+  if (append_fd_ >= 0) {
+    ::close(append_fd_);
+  }
+  for (const auto &segment_fd : read_fds_) {
+    ::close(segment_fd.second);
+  }
+}
+
+std::string IndexPackSegmentedFilesystem::SegmentPath(uint32_t segment) const {
+  char name[16];
+  ::snprintf(name, sizeof(name), "%08u", segment);
+  llvm::SmallString<256> path(segment_directory_);
+  llvm::sys::path::append(path, std::string(name) + kSegmentSuffix);
+  return std::string(path.str());
+}
+
+std::shared_ptr<const IndexPackSegmentedFilesystem::IndexFile>
+IndexPackSegmentedFilesystem::LoadIndexFile(const std::string &path,
+                                            std::error_code *error,
+                                            std::string *error_text) {
+  auto buffer = llvm::MemoryBuffer::getFile(path, /*FileSize=*/-1,
+                                            /*RequiresNullTerminator=*/false);
+  if (!buffer) {
+    *error = buffer.getError();
+    *error_text = error->message() + " (" + path + ")";
+    return nullptr;
+  }
+  auto index = std::make_shared<IndexFile>();
+  index->path = path;
+  index->buffer = std::move(*buffer);
+  const char *start = index->buffer->getBufferStart();
+  size_t size = index->buffer->getBufferSize();
+  if (size < kIndexHeaderSize || ::memcmp(start, kIndexMagic, kMagicSize)) {
+    *error = std::make_error_code(std::errc::invalid_argument);
+    *error_text = "Not an index pack index: " + path;
+    return nullptr;
+  }
+  index->entries = start + kIndexHeaderSize;
+  index->count = read64le(start + kMagicSize);
+  if ((size - kIndexHeaderSize) / kEntrySize != index->count ||
+      (size - kIndexHeaderSize) % kEntrySize != 0) {
+    *error = std::make_error_code(std::errc::invalid_argument);
+    *error_text = "Truncated index pack index: " + path;
+    return nullptr;
+  }
+  return index;
+}
+
+bool IndexPackSegmentedFilesystem::LoadIndexes(std::string *error_text) {
+  for (int attempt = 0; attempt < kMaxIndexListAttempts; ++attempt) {
+    std::vector<std::string> paths;
+    if (!ListFiles(index_directory_, kIndexSuffix, &paths, error_text)) {
+      return false;
+    }
+    std::vector<std::shared_ptr<const IndexFile>> indexes;
+    bool vanished = false;
+    for (const auto &path : paths) {
+      std::error_code error;
+      auto index = LoadIndexFile(path, &error, error_text);
+      if (index == nullptr) {
+        if (error != std::errc::no_such_file_or_directory) {
+          return false;
+        }
+        vanished = true;
+        break;
+      }
+      indexes.push_back(std::move(index));
+    }
+    if (!vanished) {
+      std::lock_guard<std::mutex> lock(mutex_);
+      indexes_ = std::move(indexes);
+      return true;
+    }
+  }
+  *error_text = "Index files kept disappearing from " + index_directory_;
+  return false;
+}
+
+std::shared_ptr<const IndexPackSegmentedFilesystem::IndexFile>
+IndexPackSegmentedFilesystem::WriteIndexFile(
+    const std::function<const char *()> &next_entry, std::string *error_text) {
+  llvm::SmallString<256> model(index_directory_);
+  llvm::sys::path::append(model, std::string("%%%%%%%%%%%%%%%%") +
+                                     IndexPackFilesystem::kTempFileSuffix);
+  int fd;
+  llvm::SmallString<256> temp_path;
+  if (auto err = llvm::sys::fs::createUniqueFile(model, fd, temp_path)) {
+    *error_text = err.message();
+    return nullptr;
+  }
+  google::protobuf::io::FileOutputStream file_stream(fd);
+  bool ok = true;
+  {
+    google::protobuf::io::CodedOutputStream stream(&file_stream);
+    char header[kIndexHeaderSize];
+    ::memcpy(header, kIndexMagic, kMagicSize);
+    // The count is filled in once we know it.
+    write64le(header + kMagicSize, 0);
+    stream.WriteRaw(header, kIndexHeaderSize);
+    uint64_t count = 0;
+    while (const char *entry = next_entry()) {
+      stream.WriteRaw(entry, kEntrySize);
+      ++count;
+    }
+    ok = !stream.HadError();
+    write64le(header + kMagicSize, count);
+    if (ok) {
+      stream.Trim();
+      ok = file_stream.Flush() &&
+           ::pwrite(fd, header + kMagicSize, 8, kMagicSize) == 8;
+    }
+  }
+  if (!file_stream.Close() || !ok) {
+    llvm::sys::fs::remove(llvm::Twine(temp_path));
+    *error_text = "Couldn't write index file " + std::string(temp_path.str());
+    return nullptr;
+  }
+  llvm::SmallString<256> path(temp_path);
+  llvm::sys::path::replace_extension(path, kIndexSuffix);
+  if (auto err =
+          llvm::sys::fs::rename(llvm::Twine(temp_path), llvm::Twine(path))) {
+    llvm::sys::fs::remove(llvm::Twine(temp_path));
+    *error_text = err.message();
+    return nullptr;
+  }
+  std::error_code error;
+  return LoadIndexFile(std::string(path.str()), &error, error_text);
+}
+
+bool IndexPackSegmentedFilesystem::FindLocation(const char *key,
+                                                Location *location) const {
+  auto pending = pending_.find(std::string(key, kKeySize));
+  if (pending != pending_.end()) {
+    *location = pending->second;
+    return true;
+  }
+  for (const auto &index : indexes_) {
+    size_t found = LowerBound(index->entries, index->count, key, kKeySize);
+    const char *entry = index->entries + found * kEntrySize;
+    if (found != index->count && !::memcmp(entry, key, kKeySize)) {
+      location->segment = read32le(entry + kEntrySegment);
+      location->offset = read64le(entry + kEntryOffset);
+      location->length = read64le(entry + kEntryLength);
+      return true;
+    }
+  }
+  return false;
+}
+
+bool IndexPackSegmentedFilesystem::Append(const std::string &record,
+                                          Location *location,
+                                          std::string *error_text) {
+  for (;;) {
+    if (append_fd_ < 0) {
+      std::string path = SegmentPath(append_segment_);
+      append_fd_ = ::open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0666);
+      if (append_fd_ < 0) {
+        *error_text = std::string(::strerror(errno)) + " (" + path + ")";
+        return false;
+      }
+    }
+    // The lock keeps other writers from appending between our fstat (which
+    // tells us where the record will start) and our write.
+    if (::flock(append_fd_, LOCK_EX) != 0) {
+      *error_text = std::string("flock: ") + ::strerror(errno);
+      return false;
+    }
+    struct stat segment_stat;
+    if (::fstat(append_fd_, &segment_stat) != 0) {
+      *error_text = std::string("fstat: ") + ::strerror(errno);
+      ::flock(append_fd_, LOCK_UN);
+      return false;
+    }
+    uint64_t offset = segment_stat.st_size;
+    if (offset != 0 && offset + record.size() > max_segment_bytes_) {
+      ::flock(append_fd_, LOCK_UN);
+      ::close(append_fd_);
+      append_fd_ = -1;
+      ++append_segment_;
+      continue;
+    }
+    bool written = WriteFully(append_fd_, record.data(), record.size());
+    int write_errno = errno;
+    ::flock(append_fd_, LOCK_UN);
+    if (!written) {
+      // Whatever we managed to write is unindexed and will be ignored.
+      *error_text = std::string("write: ") + ::strerror(write_errno);
+      return false;
+    }
+    location->segment = append_segment_;
+    location->offset = offset;
+    return true;
+  }
+}
+
+int IndexPackSegmentedFilesystem::ReadDescriptorFor(uint32_t segment,
+                                                    std::string *error_text) {
+  auto found = read_fds_.find(segment);
+  if (found != read_fds_.end()) {
+    return found->second;
+  }
+  std::string path = SegmentPath(segment);
+  int fd = ::open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    *error_text = std::string(::strerror(errno)) + " (" + path + ")";
+    return -1;
+  }
+  read_fds_.emplace(segment, fd);
+  return fd;
+}
+
+bool IndexPackSegmentedFilesystem::AddFileContent(DataKind data_kind,
+                                                  WriteCallback callback,
+                                                  std::string *error_text) {
+  if (open_mode_ != OpenMode::kReadWrite) {
+    *error_text = "Index pack not opened for writing.";
+    return false;
+  }
+  // Leave room for the header so that we don't need to copy the payload.
+  std::string record(kRecordHeaderSize, '\0');
+  std::string file_hash;
+  {
+    google::protobuf::io::StringOutputStream string_stream(&record);
+    if (!WriteCompressedBlob(
+            blob_compression_, &string_stream,
+            [&callback, &file_hash,
+             error_text](google::protobuf::io::ZeroCopyOutputStream *stream) {
+              return callback(stream, &file_hash, error_text);
+            },
+            error_text)) {
+      return false;
+    }
+  }
+  char *header = &record[0];
+  if (!MakeKey(data_kind, file_hash, header, error_text)) {
+    return false;
+  }
+  Location location;
+  location.length = record.size() - kRecordHeaderSize;
+  write64le(header + kKeySize, location.length);
+  std::lock_guard<std::mutex> lock(mutex_);
+  Location existing;
+  if (FindLocation(header, &existing)) {
+    // Data is named by its digest, so there's no need to store it twice.
+    return true;
+  }
+  if (!Append(record, &location, error_text)) {
+    return false;
+  }
+  pending_.emplace(std::string(header, kKeySize), location);
+  return pending_.size() < kMaxPendingRecords || FlushLocked(error_text);
+}
+
+bool IndexPackSegmentedFilesystem::ReadFileContent(DataKind data_kind,
+                                                   const std::string &file_name,
+                                                   ReadCallback callback,
+                                                   std::string *error_text) {
+  char key[kKeySize];
+  if (!MakeKey(data_kind, file_name, key, error_text)) {
+    return false;
+  }
+  Location location;
+  int fd;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!FindLocation(key, &location)) {
+      *error_text = "Not found in index pack: " + file_name;
+      return false;
+    }
+    fd = ReadDescriptorFor(location.segment, error_text);
+    if (fd < 0) {
+      return false;
+    }
+  }
+  std::string record(kRecordHeaderSize + location.length, '\0');
+  if (!ReadFully(fd, location.offset, &record[0], record.size())) {
+    *error_text = "Couldn't read " + file_name + " from " +
+                  SegmentPath(location.segment);
+    return false;
+  }
+  if (::memcmp(record.data(), key, kKeySize) != 0 ||
+      read64le(record.data() + kKeySize) != location.length) {
+    *error_text = "Corrupt record for " + file_name + " in " +
+                  SegmentPath(location.segment);
+    return false;
+  }
+  google::protobuf::io::ArrayInputStream array_stream(
+      record.data() + kRecordHeaderSize, location.length);
+  return ReadCompressedBlob(
+      &array_stream,
+      [&callback,
+       error_text](google::protobuf::io::ZeroCopyInputStream *stream) {
+        return callback(stream, error_text);
+      },
+      error_text);
+}
+
+bool IndexPackSegmentedFilesystem::ScanFiles(DataKind data_kind,
+                                             ScanCallback callback,
+                                             std::string *error_text) {
+  // Copy what we need so that `callback` may use this filesystem.
+  std::vector<std::shared_ptr<const IndexFile>> indexes;
+  std::string pending;
+  char kind = KindByte(data_kind);
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    indexes = indexes_;
+    for (const auto &record : pending_) {
+      if (record.first[0] == kind) {
+        pending.append(record.first);
+        pending.resize(pending.size() + kEntrySize - kKeySize);
+      }
+    }
+  }
+  EntryMerger merger;
+  merger.AddRun(pending.data(), pending.size() / kEntrySize);
+  char next_kind = kind + 1;
+  for (const auto &index : indexes) {
+    size_t begin = LowerBound(index->entries, index->count, &kind, 1);
+    size_t end = LowerBound(index->entries, index->count, &next_kind, 1);
+    merger.AddRun(index->entries + begin * kEntrySize, end - begin);
+  }
+  while (const char *entry = merger.Next()) {
+    if (!callback(KeyName(entry))) {
+      break;
+    }
+  }
+  return true;
+}
+
+bool IndexPackSegmentedFilesystem::HasFileContent(
+    DataKind data_kind, const std::string &file_name) {
+  char key[kKeySize];
+  std::string error_text;
+  if (!MakeKey(data_kind, file_name, key, &error_text)) {
+    return false;
+  }
+  std::lock_guard<std::mutex> lock(mutex_);
+  Location location;
+  return FindLocation(key, &location);
+}
+
+bool IndexPackSegmentedFilesystem::Flush(std::string *error_text) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return FlushLocked(error_text);
+}
+
+bool IndexPackSegmentedFilesystem::FlushLocked(std::string *error_text) {
+  if (pending_.empty()) {
+    return true;
+  }
+  auto record = pending_.begin();
+  char entry[kEntrySize] = {0};
+  auto index = WriteIndexFile(
+      [this, &record, &entry]() -> const char * {
+        if (record == pending_.end()) {
+          return nullptr;
+        }
+        ::memcpy(entry, record->first.data(), kKeySize);
+        write32le(entry + kEntrySegment, record->second.segment);
+        write64le(entry + kEntryOffset, record->second.offset);
+        write64le(entry + kEntryLength, record->second.length);
+        ++record;
+        return entry;
+      },
+      error_text);
+  if (index == nullptr) {
+    return false;
+  }
+  indexes_.push_back(std::move(index));
+  pending_.clear();
+  return true;
+}
+
+bool IndexPackSegmentedFilesystem::MergeIndexes(std::string *error_text) {
+  if (open_mode_ != OpenMode::kReadWrite) {
+    *error_text = "Index pack not opened for writing.";
+    return false;
+  }
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (!FlushLocked(error_text)) {
+    return false;
+  }
+  if (indexes_.size() < 2) {
+    return true;
+  }
+  EntryMerger merger;
+  for (const auto &index : indexes_) {
+    merger.AddRun(index->entries, index->count);
+  }
+  auto merged =
+      WriteIndexFile([&merger]() { return merger.Next(); }, error_text);
+  if (merged == nullptr) {
+    return false;
+  }
+  // Readers that list the directory from here on will see some of the old
+  // files and the new one, which is harmless. Readers that miss a file we
+  // remove will list the directory again.
+  for (const auto &index : indexes_) {
+    llvm::sys::fs::remove(llvm::Twine(index->path));
+  }
+  indexes_.clear();
+  indexes_.push_back(std::move(merged));
+  return true;
+}
+
+std::unique_ptr<IndexPackFilesystem> OpenIndexPackFilesystem(
+    const std::string &root_path, IndexPackFilesystem::OpenMode open_mode,
+    std::string *error_text) {
+  if (IndexPackSegmentedFilesystem::IsSegmented(root_path)) {
+    return IndexPackSegmentedFilesystem::Open(root_path, open_mode,
+                                              error_text);
+  }
+  return IndexPackPosixFilesystem::Open(root_path, open_mode, error_text);
+}
+
+}  // namespace kythe
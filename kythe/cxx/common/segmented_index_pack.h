@@ -0,0 +1,210 @@
+/*
+ * Copyright 2017 Google Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef KYTHE_CXX_COMMON_SEGMENTED_INDEX_PACK_H_
+#define KYTHE_CXX_COMMON_SEGMENTED_INDEX_PACK_H_
+
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "kythe/cxx/common/index_pack.h"
+#include "llvm/Support/MemoryBuffer.h"
+
+namespace kythe {
+
+/// \brief An `IndexPackFilesystem` that appends data to a few large segment
+/// files instead of storing each blob in its own file.
+///
+/// The `segments` directory holds numbered segment files. Each record in a
+/// segment is a header (the data kind, the raw SHA-256 digest and the
+/// little-endian payload length) followed by the compressed payload. Writers
+/// hold an exclusive `flock` on the newest segment while appending to it, so
+/// any number of processes can share it; once it grows past
+/// `max_segment_bytes` the next writer starts a new one.
+///
+/// The `index` directory holds sorted index files that map (kind, digest) to
+/// (segment, offset, length). Each writer adds an index file covering its own
+/// records when it is flushed or destroyed; until then, only that writer can
+/// see them. Index files are mmap'd and binary-searched. `MergeIndexes`
+/// replaces all of them with one file.
+///
+/// Units are added to the unit index (see `UnitIndex`) as they are written,
+/// so other processes may find a unit there before its writer has flushed.
+class IndexPackSegmentedFilesystem : public IndexPackFilesystem {
+ public:
+  /// \brief Mounts a directory as a segmented index pack.
+  /// \param root_path The root path to use.
+  /// \param open_mode Whether to mount the root path read-only.
+  /// \param error_text Non-null; set to an error description on failure.
+  ///
+  /// If `open_mode` is `kReadWrite`, `Open` will attempt to create the
+  /// directory structure if it does not already exist.
+  ///
+  /// \return A new `IndexPackSegmentedFilesystem`, or `null` on error.
+  static std::unique_ptr<IndexPackSegmentedFilesystem> Open(
+      const std::string &root_path, IndexPackFilesystem::OpenMode open_mode,
+      std::string *error_text);
+
+  /// \return true if `root_path` looks like a segmented index pack.
+  static bool IsSegmented(const std::string &root_path);
+
+  /// \brief Flushes any unindexed records, logging on failure.
+  ~IndexPackSegmentedFilesystem() override;
+
+  IndexPackFilesystem::OpenMode open_mode() const override {
+    return open_mode_;
+  }
+
+  /// \brief Appends content to the newest segment. Content whose digest is
+  /// already in the pack is not written again.
+  bool AddFileContent(DataKind data_kind, WriteCallback callback,
+                      std::string *error_text) override;
+
+  bool ReadFileContent(DataKind data_kind, const std::string &file_name,
+                       ReadCallback callback, std::string *error_text) override;
+
+  /// \brief Calls `callback` for each digest of kind `data_kind` once, in
+  /// sorted order.
+  bool ScanFiles(DataKind data_kind, ScanCallback callback,
+                 std::string *error_text) override;
+
+  bool HasFileContent(DataKind data_kind,
+                      const std::string &file_name) override;
+
+  /// \brief Writes an index file for the records added since the last flush,
+  /// making them visible to filesystems opened afterward.
+  /// \return false on failure and true on success.
+  bool Flush(std::string *error_text);
+
+  /// \brief Flushes, then replaces every index file this filesystem has
+  /// loaded with a single merged one. Index files added concurrently by other
+  /// writers are left alone.
+  /// \return false on failure and true on success.
+  bool MergeIndexes(std::string *error_text);
+
+  /// \brief Sets the size after which writers start a new segment.
+  void set_max_segment_bytes(uint64_t max_segment_bytes) {
+    max_segment_bytes_ = max_segment_bytes;
+  }
+
+  /// \return the number of index files this filesystem has loaded.
+  size_t index_file_count() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return indexes_.size();
+  }
+
+  /// \brief The directory name to use for segments.
+  static const char kSegmentDirectoryName[];
+
+  /// \brief The directory name to use for index files.
+  static const char kIndexDirectoryName[];
+
+ private:
+  /// \brief Where a record's payload lives.
+  struct Location {
+    /// The number of the segment holding the record.
+    uint32_t segment;
+    /// The offset of the record's header in the segment.
+    uint64_t offset;
+    /// The size of the record's compressed payload.
+    uint64_t length;
+  };
+
+  /// \brief A mapped index file.
+  struct IndexFile {
+    /// The absolute path to the file.
+    std::string path;
+    /// The mapped file.
+    std::unique_ptr<llvm::MemoryBuffer> buffer;
+    /// The first sorted entry.
+    const char *entries;
+    /// The number of entries.
+    size_t count;
+  };
+
+  IndexPackSegmentedFilesystem(IndexPackFilesystem::OpenMode open_mode,
+                               std::string segment_directory,
+                               std::string index_directory);
+
+  /// \brief Maps every index file in `index_directory_` into `indexes_`.
+  bool LoadIndexes(std::string *error_text);
+
+  /// \brief Maps the index file at `path`.
+  /// \return null on failure, with `*error` set.
+  static std::shared_ptr<const IndexFile> LoadIndexFile(
+      const std::string &path, std::error_code *error,
+      std::string *error_text);
+
+  /// \brief Writes the entries returned by `next_entry` to a new index file
+  /// and maps it. `next_entry` returns null after the last entry.
+  std::shared_ptr<const IndexFile> WriteIndexFile(
+      const std::function<const char *()> &next_entry,
+      std::string *error_text);
+
+  /// \brief Looks up the record with key `key`. Requires `mutex_`.
+  bool FindLocation(const char *key, Location *location) const;
+
+  /// \brief Appends `record` to the newest segment. Requires `mutex_`.
+  bool Append(const std::string &record, Location *location,
+              std::string *error_text);
+
+  /// \return a descriptor open for reading `segment`. Requires `mutex_`.
+  int ReadDescriptorFor(uint32_t segment, std::string *error_text);
+
+  /// \brief Implements `Flush`. Requires `mutex_`.
+  bool FlushLocked(std::string *error_text);
+
+  /// \return the path to segment `segment`.
+  std::string SegmentPath(uint32_t segment) const;
+
+  /// This filesystem's read/write status.
+  IndexPackFilesystem::OpenMode open_mode_;
+  /// The path to the segment directory (absolute).
+  std::string segment_directory_;
+  /// The path to the index directory (absolute).
+  std::string index_directory_;
+  /// The size after which writers start a new segment.
+  uint64_t max_segment_bytes_;
+  /// Guards the fields below.
+  mutable std::mutex mutex_;
+  /// Index files that have been mapped.
+  std::vector<std::shared_ptr<const IndexFile>> indexes_;
+  /// Records this filesystem has appended but not indexed, by key.
+  std::map<std::string, Location> pending_;
+  /// The newest segment we know about.
+  uint32_t append_segment_ = 0;
+  /// The descriptor for appending to `append_segment_`, or -1.
+  int append_fd_ = -1;
+  /// Descriptors for reading segments, by segment number.
+  std::unordered_map<uint32_t, int> read_fds_;
+};
+
+/// \brief Opens the index pack at `root_path` as an
+/// `IndexPackSegmentedFilesystem` if it is segmented and as an
+/// `IndexPackPosixFilesystem` otherwise.
+/// \return the new filesystem, or null on failure with `error_text` set.
+std::unique_ptr<IndexPackFilesystem> OpenIndexPackFilesystem(
+    const std::string &root_path, IndexPackFilesystem::OpenMode open_mode,
+    std::string *error_text);
+
+}  // namespace kythe
+
+#endif  // KYTHE_CXX_COMMON_SEGMENTED_INDEX_PACK_H_
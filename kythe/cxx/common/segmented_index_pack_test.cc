@@ -0,0 +1,386 @@
+/*
+ * Copyright 2017 Google Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "segmented_index_pack.h"
+
+#include <string>
+#include <vector>
+
+#include "glog/logging.h"
+#include "gtest/gtest.h"
+#include "kythe/proto/analysis.pb.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Path.h"
+
+namespace kythe {
+namespace {
+
+using DataKind = IndexPackFilesystem::DataKind;
+using OpenMode = IndexPackFilesystem::OpenMode;
+
+// Some arbitrary but well-formed sha values.
+static const char kData1Sha[] =
+    "5b41362bc82b7f3d56edc5a306db22105707d01ff4819e26faef9724a2d406c9";
+static const char kData2Sha[] =
+    "d98cf53e0c8b77c14a96358d5b69584225b4bb9026423cbc2f7b0161894c402c";
+static const char kUnit1Sha[] =
+    "a7f4909446e1cc8286ceae47afe6ccb698af99769be9c5b4a7fa0aa7cc37667f";
+
+/// \brief A temporary directory that is removed with its contents.
+class TemporaryDirectory {
+ public:
+  TemporaryDirectory() {
+    CHECK_EQ(0, llvm::sys::fs::createUniqueDirectory("segmented_index_pack",
+                                                     root_)
+                    .value());
+  }
+  ~TemporaryDirectory() { llvm::sys::fs::remove_directories(root_); }
+
+  std::string root() const { return std::string(root_.str()); }
+
+  /// \return the number of files in `relative_path` with extension `suffix`.
+  size_t CountFiles(const std::string &relative_path, const char *suffix) {
+    llvm::SmallString<256> path(root_);
+    llvm::sys::path::append(path, relative_path);
+    std::error_code err;
+    size_t count = 0;
+    for (llvm::sys::fs::directory_iterator current(llvm::Twine(path), err),
+         end;
+         !err && current != end; current = current.increment(err)) {
+      count += llvm::sys::path::extension(current->path()) == suffix;
+    }
+    EXPECT_FALSE(err);
+    return count;
+  }
+
+ private:
+  llvm::SmallString<256> root_;
+};
+
+bool Insert(IndexPackFilesystem *filesystem, DataKind kind,
+            const std::string &hash, const std::string &content,
+            std::string *error_text) {
+  return filesystem->AddFileContent(
+      kind,
+      [&hash, &content](google::protobuf::io::ZeroCopyOutputStream *stream,
+                        std::string *file_name, std::string *error_text) {
+        *file_name = hash;
+        void *buffer;
+        int size;
+        size_t written = 0;
+        while (written < content.size()) {
+          if (!stream->Next(&buffer, &size)) {
+            return false;
+          }
+          size_t chunk = std::min<size_t>(size, content.size() - written);
+          ::memcpy(buffer, content.data() + written, chunk);
+          written += chunk;
+          stream->BackUp(size - chunk);
+        }
+        return true;
+      },
+      error_text);
+}
+
+/// \return the content named `hash`, or "<missing>" if it couldn't be read.
+std::string Read(IndexPackFilesystem *filesystem, DataKind kind,
+                 const std::string &hash) {
+  std::string content, error_text;
+  if (!filesystem->ReadFileContent(
+          kind, hash,
+          [&content](google::protobuf::io::ZeroCopyInputStream *stream,
+                     std::string *error_text) {
+            const void *data;
+            int size;
+            while (stream->Next(&data, &size)) {
+              content.append(static_cast<const char *>(data), size);
+            }
+            return true;
+          },
+          &error_text)) {
+    return "<missing>";
+  }
+  return content;
+}
+
+std::vector<std::string> Scan(IndexPackFilesystem *filesystem,
+                              DataKind kind) {
+  std::vector<std::string> names;
+  std::string error_text;
+  EXPECT_TRUE(filesystem->ScanFiles(kind,
+                                    [&names](const std::string &name) {
+                                      names.push_back(name);
+                                      return true;
+                                    },
+                                    &error_text))
+      << error_text;
+  return names;
+}
+
+TEST(SegmentedIndexPack, OpenReadOnlyNeedsLayout) {
+  TemporaryDirectory dir;
+  std::string error_text;
+  EXPECT_EQ(nullptr, IndexPackSegmentedFilesystem::Open(
+                         dir.root(), OpenMode::kReadOnly, &error_text));
+  EXPECT_FALSE(error_text.empty());
+  EXPECT_FALSE(IndexPackSegmentedFilesystem::IsSegmented(dir.root()));
+  EXPECT_NE(nullptr, IndexPackSegmentedFilesystem::Open(
+                         dir.root(), OpenMode::kReadWrite, &error_text));
+  EXPECT_TRUE(IndexPackSegmentedFilesystem::IsSegmented(dir.root()));
+  EXPECT_NE(nullptr, IndexPackSegmentedFilesystem::Open(
+                         dir.root(), OpenMode::kReadOnly, &error_text));
+}
+
+TEST(SegmentedIndexPack, RecordsBecomeVisibleOnFlush) {
+  TemporaryDirectory dir;
+  std::string error_text;
+  auto writer = IndexPackSegmentedFilesystem::Open(
+      dir.root(), OpenMode::kReadWrite, &error_text);
+  ASSERT_NE(nullptr, writer) << error_text;
+  ASSERT_TRUE(Insert(writer.get(), DataKind::kFileData, kData1Sha, "data1",
+                     &error_text))
+      << error_text;
+  ASSERT_TRUE(Insert(writer.get(), DataKind::kCompilationUnit, kData1Sha,
+                     "unit1", &error_text))
+      << error_text;
+  EXPECT_EQ("data1", Read(writer.get(), DataKind::kFileData, kData1Sha));
+  EXPECT_EQ("unit1",
+            Read(writer.get(), DataKind::kCompilationUnit, kData1Sha));
+  auto early_reader = IndexPackSegmentedFilesystem::Open(
+      dir.root(), OpenMode::kReadOnly, &error_text);
+  ASSERT_NE(nullptr, early_reader) << error_text;
+  EXPECT_EQ("<missing>",
+            Read(early_reader.get(), DataKind::kFileData, kData1Sha));
+  ASSERT_TRUE(writer->Flush(&error_text)) << error_text;
+  auto reader = IndexPackSegmentedFilesystem::Open(
+      dir.root(), OpenMode::kReadOnly, &error_text);
+  ASSERT_NE(nullptr, reader) << error_text;
+  EXPECT_EQ("data1", Read(reader.get(), DataKind::kFileData, kData1Sha));
+  EXPECT_EQ("unit1",
+            Read(reader.get(), DataKind::kCompilationUnit, kData1Sha));
+  EXPECT_EQ("<missing>", Read(reader.get(), DataKind::kFileData, kData2Sha));
+  EXPECT_FALSE(Insert(reader.get(), DataKind::kFileData, kData2Sha, "data2",
+                      &error_text));
+  EXPECT_EQ(1, dir.CountFiles("segments", ".seg"));
+  EXPECT_EQ(1, dir.CountFiles("index", ".idx"));
+}
+
+TEST(SegmentedIndexPack, RejectsBadNames) {
+  TemporaryDirectory dir;
+  std::string error_text;
+  auto writer = IndexPackSegmentedFilesystem::Open(
+      dir.root(), OpenMode::kReadWrite, &error_text);
+  ASSERT_NE(nullptr, writer) << error_text;
+  EXPECT_FALSE(Insert(writer.get(), DataKind::kFileData, "../etc", "data",
+                      &error_text));
+  std::string upper(kData1Sha);
+  upper[0] = 'B';
+  EXPECT_FALSE(
+      Insert(writer.get(), DataKind::kFileData, upper, "data", &error_text));
+  EXPECT_EQ("<missing>", Read(writer.get(), DataKind::kFileData, upper));
+}
+
+TEST(SegmentedIndexPack, WritersShareSegments) {
+  TemporaryDirectory dir;
+  std::string error_text;
+  {
+    auto first = IndexPackSegmentedFilesystem::Open(
+        dir.root(), OpenMode::kReadWrite, &error_text);
+    auto second = IndexPackSegmentedFilesystem::Open(
+        dir.root(), OpenMode::kReadWrite, &error_text);
+    ASSERT_NE(nullptr, first) << error_text;
+    ASSERT_NE(nullptr, second) << error_text;
+    ASSERT_TRUE(Insert(first.get(), DataKind::kFileData, kData1Sha, "data1",
+                       &error_text));
+    ASSERT_TRUE(Insert(second.get(), DataKind::kFileData, kData2Sha, "data2",
+                       &error_text));
+    ASSERT_TRUE(Insert(first.get(), DataKind::kCompilationUnit, kUnit1Sha,
+                       "unit1", &error_text));
+    // Both writers have the same data; both indexes will mention it.
+    ASSERT_TRUE(Insert(second.get(), DataKind::kFileData, kData1Sha, "data1",
+                       &error_text));
+  }
+  EXPECT_EQ(1, dir.CountFiles("segments", ".seg"));
+  EXPECT_EQ(2, dir.CountFiles("index", ".idx"));
+  auto reader = IndexPackSegmentedFilesystem::Open(
+      dir.root(), OpenMode::kReadOnly, &error_text);
+  ASSERT_NE(nullptr, reader) << error_text;
+  EXPECT_EQ("data1", Read(reader.get(), DataKind::kFileData, kData1Sha));
+  EXPECT_EQ("data2", Read(reader.get(), DataKind::kFileData, kData2Sha));
+  EXPECT_EQ("unit1",
+            Read(reader.get(), DataKind::kCompilationUnit, kUnit1Sha));
+  EXPECT_EQ(std::vector<std::string>({kData1Sha, kData2Sha}),
+            Scan(reader.get(), DataKind::kFileData));
+  EXPECT_EQ(std::vector<std::string>({kUnit1Sha}),
+            Scan(reader.get(), DataKind::kCompilationUnit));
+}
+
+TEST(SegmentedIndexPack, StartsNewSegments) {
+  TemporaryDirectory dir;
+  std::string error_text;
+  {
+    auto writer = IndexPackSegmentedFilesystem::Open(
+        dir.root(), OpenMode::kReadWrite, &error_text);
+    ASSERT_NE(nullptr, writer) << error_text;
+    writer->set_max_segment_bytes(1);
+    for (const char *sha : {kData1Sha, kData2Sha, kUnit1Sha}) {
+      ASSERT_TRUE(Insert(writer.get(), DataKind::kFileData, sha, sha,
+                         &error_text))
+          << error_text;
+    }
+  }
+  EXPECT_EQ(3, dir.CountFiles("segments", ".seg"));
+  auto writer = IndexPackSegmentedFilesystem::Open(
+      dir.root(), OpenMode::kReadWrite, &error_text);
+  ASSERT_NE(nullptr, writer) << error_text;
+  for (const char *sha : {kData1Sha, kData2Sha, kUnit1Sha}) {
+    EXPECT_EQ(sha, Read(writer.get(), DataKind::kFileData, sha));
+  }
+  // New writers append to the newest segment.
+  ASSERT_TRUE(Insert(writer.get(), DataKind::kCompilationUnit, kUnit1Sha,
+                     "unit1", &error_text));
+  EXPECT_EQ(3, dir.CountFiles("segments", ".seg"));
+}
+
+TEST(SegmentedIndexPack, ScanMergesPendingAndIndexed) {
+  TemporaryDirectory dir;
+  std::string error_text;
+  auto writer = IndexPackSegmentedFilesystem::Open(
+      dir.root(), OpenMode::kReadWrite, &error_text);
+  ASSERT_NE(nullptr, writer) << error_text;
+  ASSERT_TRUE(Insert(writer.get(), DataKind::kFileData, kData2Sha, "data2",
+                     &error_text));
+  ASSERT_TRUE(writer->Flush(&error_text));
+  ASSERT_TRUE(Insert(writer.get(), DataKind::kFileData, kData1Sha, "data1",
+                     &error_text));
+  ASSERT_TRUE(Insert(writer.get(), DataKind::kCompilationUnit, kUnit1Sha,
+                     "unit1", &error_text));
+  EXPECT_EQ(std::vector<std::string>({kData1Sha, kData2Sha}),
+            Scan(writer.get(), DataKind::kFileData));
+  EXPECT_EQ(std::vector<std::string>({kUnit1Sha}),
+            Scan(writer.get(), DataKind::kCompilationUnit));
+  size_t calls = 0;
+  EXPECT_TRUE(writer->ScanFiles(DataKind::kFileData,
+                                [&calls](const std::string &name) {
+                                  ++calls;
+                                  return false;
+                                },
+                                &error_text));
+  EXPECT_EQ(1, calls);
+}
+
+TEST(SegmentedIndexPack, MergeIndexes) {
+  TemporaryDirectory dir;
+  std::string error_text;
+  for (const char *sha : {kData1Sha, kData2Sha, kData1Sha}) {
+    auto writer = IndexPackSegmentedFilesystem::Open(
+        dir.root(), OpenMode::kReadWrite, &error_text);
+    ASSERT_NE(nullptr, writer) << error_text;
+    // Each writer sees the earlier writers' data, so only two flush.
+    ASSERT_TRUE(
+        Insert(writer.get(), DataKind::kFileData, sha, sha, &error_text));
+  }
+  EXPECT_EQ(2, dir.CountFiles("index", ".idx"));
+  auto writer = IndexPackSegmentedFilesystem::Open(
+      dir.root(), OpenMode::kReadWrite, &error_text);
+  ASSERT_NE(nullptr, writer) << error_text;
+  ASSERT_TRUE(Insert(writer.get(), DataKind::kCompilationUnit, kUnit1Sha,
+                     "unit1", &error_text));
+  ASSERT_TRUE(writer->MergeIndexes(&error_text)) << error_text;
+  EXPECT_EQ(1, writer->index_file_count());
+  EXPECT_EQ(1, dir.CountFiles("index", ".idx"));
+  EXPECT_EQ(0, dir.CountFiles("index", ".new"));
+  auto reader = IndexPackSegmentedFilesystem::Open(
+      dir.root(), OpenMode::kReadOnly, &error_text);
+  ASSERT_NE(nullptr, reader) << error_text;
+  EXPECT_EQ(kData1Sha, Read(reader.get(), DataKind::kFileData, kData1Sha));
+  EXPECT_EQ(kData2Sha, Read(reader.get(), DataKind::kFileData, kData2Sha));
+  EXPECT_EQ("unit1",
+            Read(reader.get(), DataKind::kCompilationUnit, kUnit1Sha));
+  EXPECT_EQ(std::vector<std::string>({kData1Sha, kData2Sha}),
+            Scan(reader.get(), DataKind::kFileData));
+}
+
+TEST(SegmentedIndexPack, OpenIndexPackFilesystemDetectsLayout) {
+  TemporaryDirectory dir;
+  std::string error_text;
+  {
+    auto posix =
+        OpenIndexPackFilesystem(dir.root(), OpenMode::kReadWrite, &error_text);
+    ASSERT_NE(nullptr, posix) << error_text;
+    EXPECT_EQ(nullptr,
+              dynamic_cast<IndexPackSegmentedFilesystem *>(posix.get()));
+  }
+  TemporaryDirectory segmented_dir;
+  ASSERT_NE(nullptr,
+            IndexPackSegmentedFilesystem::Open(segmented_dir.root(),
+                                               OpenMode::kReadWrite,
+                                               &error_text));
+  auto segmented = OpenIndexPackFilesystem(segmented_dir.root(),
+                                           OpenMode::kReadOnly, &error_text);
+  ASSERT_NE(nullptr, segmented) << error_text;
+  EXPECT_NE(nullptr,
+            dynamic_cast<IndexPackSegmentedFilesystem *>(segmented.get()));
+}
+
+TEST(SegmentedIndexPack, WorksWithIndexPack) {
+  TemporaryDirectory dir;
+  std::string error_text;
+  kythe::proto::FileData file_data;
+  file_data.set_content("content");
+  kythe::proto::CompilationUnit unit;
+  unit.mutable_v_name()->set_signature("unit");
+  {
+    IndexPack pack(IndexPackSegmentedFilesystem::Open(
+        dir.root(), OpenMode::kReadWrite, &error_text));
+    ASSERT_TRUE(pack.AddFileData(file_data, &error_text)) << error_text;
+    ASSERT_TRUE(pack.AddCompilationUnit(unit, &error_text)) << error_text;
+  }
+  IndexPack pack(
+      OpenIndexPackFilesystem(dir.root(), OpenMode::kReadOnly, &error_text));
+  std::string unit_hash;
+  ASSERT_TRUE(pack.ScanData(DataKind::kCompilationUnit,
+                            [&unit_hash](const std::string &hash) {
+                              unit_hash = hash;
+                              return true;
+                            },
+                            &error_text));
+  kythe::proto::CompilationUnit read_unit;
+  ASSERT_TRUE(pack.ReadCompilationUnit(unit_hash, &read_unit, &error_text))
+      << error_text;
+  EXPECT_EQ("unit", read_unit.v_name().signature());
+  std::string file_hash;
+  ASSERT_TRUE(pack.ScanData(DataKind::kFileData,
+                            [&file_hash](const std::string &hash) {
+                              file_hash = hash;
+                              return true;
+                            },
+                            &error_text));
+  std::string content;
+  ASSERT_TRUE(pack.ReadFileData(file_hash, &content)) << content;
+  EXPECT_EQ("content", content);
+}
+
+}  // namespace
+}  // namespace kythe
+
+int main(int argc, char **argv) {
+  GOOGLE_PROTOBUF_VERIFY_VERSION;
+  google::InitGoogleLogging(argv[0]);
+  ::testing::InitGoogleTest(&argc, argv);
+  int result = RUN_ALL_TESTS();
+  return result;
+}
@@ -0,0 +1,417 @@
+/*
+ * Copyright 2017 Google Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "snappy_stream.h"
+
+#include <algorithm>
+#include <climits>
+#include <cstring>
+
+#include "glog/logging.h"
+#include "google/protobuf/io/coded_stream.h"
+#include "snappy.h"
+
+namespace kythe {
+namespace {
+/// Chunk types from the snappy framing format.
+enum ChunkType : unsigned char {
+  kCompressedData = 0x00,
+  kUncompressedData = 0x01,
+  kStreamIdentifier = 0xff
+};
+
+/// The payload of the stream identifier chunk.
+constexpr char kStreamIdentifierData[] = "sNaPpY";
+constexpr size_t kStreamIdentifierSize = sizeof(kStreamIdentifierData) - 1;
+
+/// The size of the type and length header in front of each chunk.
+constexpr size_t kChunkHeaderSize = 4;
+
+/// The size of the checksum at the start of each data chunk.
+constexpr size_t kChecksumSize = 4;
+
+/// The maximum amount of uncompressed data allowed in a single chunk.
+constexpr size_t kMaxChunkData = 65536;
+
+/// Don't bother storing compressed data unless it saves at least 1/8 of the
+/// uncompressed size (following the framing format's recommendation).
+bool WorthCompressing(size_t uncompressed, size_t compressed) {
+  return compressed < uncompressed - uncompressed / 8;
+}
+
+/// \return the CRC-32C (Castagnoli) checksum of `data`.
+uint32_t Crc32c(const char *data, size_t size) {
+  static const auto *table = [] {
+    auto *table = new uint32_t[256];
+    for (uint32_t i = 0; i < 256; ++i) {
+      uint32_t crc = i;
+      for (int bit = 0; bit < 8; ++bit) {
+        crc = (crc >> 1) ^ ((crc & 1) ? 0x82f63b78 : 0);
+      }
+      table[i] = crc;
+    }
+    return table;
+  }();
+  uint32_t crc = ~0u;
+  for (size_t i = 0; i < size; ++i) {
+    crc = table[(crc ^ static_cast<unsigned char>(data[i])) & 0xff] ^
+          (crc >> 8);
+  }
+  return ~crc;
+}
+
+/// \return the checksum of `data` masked as required by the framing format.
+uint32_t MaskedCrc32c(const char *data, size_t size) {
+  uint32_t crc = Crc32c(data, size);
+  return ((crc >> 15) | (crc << 17)) + 0xa282ead8;
+}
+
+/// \brief Writes `value` to `out` as `bytes` little-endian bytes.
+void WriteLittleEndian(uint32_t value, size_t bytes, char *out) {
+  for (size_t i = 0; i < bytes; ++i) {
+    out[i] = static_cast<char>((value >> (8 * i)) & 0xff);
+  }
+}
+
+/// \return the `bytes`-byte little-endian value at `in`.
+uint32_t ReadLittleEndian(const char *in, size_t bytes) {
+  uint32_t value = 0;
+  for (size_t i = 0; i < bytes; ++i) {
+    value |= static_cast<uint32_t>(static_cast<unsigned char>(in[i]))
+             << (8 * i);
+  }
+  return value;
+}
+}  // anonymous namespace
+
+constexpr size_t SnappyFramedOutputStream::kDefaultBlockSize;
+
+SnappyFramedOutputStream::SnappyFramedOutputStream(
+    google::protobuf::io::ZeroCopyOutputStream *output, size_t block_size,
+    bool use_thread)
+    : output_(output),
+      block_size_(std::min<size_t>(std::max<size_t>(block_size, 1), INT_MAX)) {
+  block_.resize(block_size_);
+  if (use_thread) {
+    thread_ = std::thread([this] { CompressLoop(); });
+  }
+}
+
+SnappyFramedOutputStream::~SnappyFramedOutputStream() { Close(); }
+
+bool SnappyFramedOutputStream::Next(void **data, int *size) {
+  if (closed_) {
+    return false;
+  }
+  if (block_used_ == block_size_) {
+    RetireBlock();
+  }
+  *data = &block_[block_used_];
+  *size = static_cast<int>(block_size_ - block_used_);
+  byte_count_ += *size;
+  block_used_ = block_size_;
+  return true;
+}
+
+void SnappyFramedOutputStream::BackUp(int count) {
+  CHECK_LE(static_cast<size_t>(count), block_used_);
+  block_used_ -= count;
+  byte_count_ -= count;
+}
+
+google::protobuf::int64 SnappyFramedOutputStream::ByteCount() const {
+  return byte_count_;
+}
+
+void SnappyFramedOutputStream::RetireBlock() {
+  block_.resize(block_used_);
+  block_used_ = 0;
+  retired_block_ = true;
+  if (!thread_.joinable()) {
+    WriteBlock(block_);
+    block_.resize(block_size_);
+    return;
+  }
+  std::unique_lock<std::mutex> lock(mutex_);
+  // Keep at most two blocks in flight so that a slow output stream applies
+  // backpressure instead of growing memory without bound.
+  queue_changed_.wait(lock, [this] { return queue_.size() < 2; });
+  queue_.push_back(std::move(block_));
+  if (spare_blocks_.empty()) {
+    block_ = std::string();
+  } else {
+    block_ = std::move(spare_blocks_.back());
+    spare_blocks_.pop_back();
+  }
+  queue_changed_.notify_all();
+  lock.unlock();
+  block_.resize(block_size_);
+}
+
+void SnappyFramedOutputStream::EncodeChunk(const char *data, size_t size,
+                                           std::string *out) {
+  size_t start = out->size();
+  out->resize(start + kChunkHeaderSize + kChecksumSize +
+              snappy::MaxCompressedLength(size));
+  char *header = &(*out)[start];
+  char *payload = header + kChunkHeaderSize + kChecksumSize;
+  size_t payload_size = 0;
+  snappy::RawCompress(data, size, payload, &payload_size);
+  bool compress = WorthCompressing(size, payload_size);
+  if (!compress) {
+    ::memcpy(payload, data, size);
+    payload_size = size;
+  }
+  header[0] = static_cast<char>(compress ? kCompressedData
+                                         : kUncompressedData);
+  WriteLittleEndian(payload_size + kChecksumSize, 3, &header[1]);
+  WriteLittleEndian(MaskedCrc32c(data, size), kChecksumSize,
+                    &header[kChunkHeaderSize]);
+  out->resize(start + kChunkHeaderSize + kChecksumSize + payload_size);
+}
+
+void SnappyFramedOutputStream::WriteBlock(const std::string &block) {
+  google::protobuf::io::CodedOutputStream coded_stream(output_);
+  if (needs_stream_identifier_) {
+    char header[kChunkHeaderSize];
+    header[0] = static_cast<char>(kStreamIdentifier);
+    WriteLittleEndian(kStreamIdentifierSize, 3, &header[1]);
+    coded_stream.WriteRaw(header, kChunkHeaderSize);
+    coded_stream.WriteRaw(kStreamIdentifierData, kStreamIdentifierSize);
+    needs_stream_identifier_ = false;
+  }
+  size_t chunk_count = (block.size() + kMaxChunkData - 1) / kMaxChunkData;
+  size_t thread_count = std::min(compression_threads_, chunk_count);
+  if (thread_count <= 1) {
+    for (size_t offset = 0; offset < block.size(); offset += kMaxChunkData) {
+      compressed_.clear();
+      EncodeChunk(block.data() + offset,
+                  std::min(kMaxChunkData, block.size() - offset),
+                  &compressed_);
+      coded_stream.WriteRaw(compressed_.data(), compressed_.size());
+    }
+  } else {
+    // Chunks are independent, so they can be encoded in any order.
+    std::vector<std::string> chunks(chunk_count);
+    std::vector<std::thread> threads;
+    for (size_t first = 0; first < thread_count; ++first) {
+      threads.emplace_back([&block, &chunks, first, thread_count] {
+        for (size_t i = first; i < chunks.size(); i += thread_count) {
+          size_t offset = i * kMaxChunkData;
+          EncodeChunk(block.data() + offset,
+                      std::min(kMaxChunkData, block.size() - offset),
+                      &chunks[i]);
+        }
+      });
+    }
+    for (auto &thread : threads) {
+      thread.join();
+    }
+    for (const auto &chunk : chunks) {
+      coded_stream.WriteRaw(chunk.data(), chunk.size());
+    }
+  }
+  if (coded_stream.HadError()) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    failed_ = true;
+  }
+}
+
+void SnappyFramedOutputStream::CompressLoop() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  for (;;) {
+    queue_changed_.wait(lock, [this] { return stopping_ || !queue_.empty(); });
+    if (queue_.empty()) {
+      return;
+    }
+    std::string block = std::move(queue_.front());
+    queue_.pop_front();
+    busy_ = true;
+    lock.unlock();
+    WriteBlock(block);
+    lock.lock();
+    busy_ = false;
+    spare_blocks_.push_back(std::move(block));
+    queue_changed_.notify_all();
+  }
+}
+
+bool SnappyFramedOutputStream::Flush() {
+  if (closed_) {
+    return !failed_;
+  }
+  // Always retire at least one block so that even an empty stream starts with
+  // a stream identifier.
+  if (block_used_ != 0 || !retired_block_) {
+    RetireBlock();
+  }
+  std::unique_lock<std::mutex> lock(mutex_);
+  queue_changed_.wait(lock, [this] { return queue_.empty() && !busy_; });
+  return !failed_;
+}
+
+bool SnappyFramedOutputStream::Close() {
+  if (closed_) {
+    return !failed_;
+  }
+  bool ok = Flush();
+  closed_ = true;
+  if (thread_.joinable()) {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stopping_ = true;
+    }
+    queue_changed_.notify_all();
+    thread_.join();
+  }
+  return ok;
+}
+
+SnappyFramedInputStream::SnappyFramedInputStream(
+    google::protobuf::io::ZeroCopyInputStream *input)
+    : input_(input) {}
+
+bool SnappyFramedInputStream::Next(const void **data, int *size) {
+  while (chunk_used_ == chunk_.size()) {
+    if (!ReadChunk()) {
+      return false;
+    }
+  }
+  *data = chunk_.data() + chunk_used_;
+  *size = static_cast<int>(chunk_.size() - chunk_used_);
+  byte_count_ += *size;
+  chunk_used_ = chunk_.size();
+  return true;
+}
+
+void SnappyFramedInputStream::BackUp(int count) {
+  CHECK_LE(static_cast<size_t>(count), chunk_used_);
+  chunk_used_ -= count;
+  byte_count_ -= count;
+}
+
+bool SnappyFramedInputStream::Skip(int count) {
+  const void *data;
+  int size;
+  while (count > 0) {
+    if (!Next(&data, &size)) {
+      return false;
+    }
+    if (size > count) {
+      BackUp(size - count);
+      return true;
+    }
+    count -= size;
+  }
+  return true;
+}
+
+google::protobuf::int64 SnappyFramedInputStream::ByteCount() const {
+  return byte_count_;
+}
+
+size_t SnappyFramedInputStream::ReadRaw(char *out, size_t count) {
+  size_t read = 0;
+  while (read < count) {
+    const void *data;
+    int size;
+    if (!input_->Next(&data, &size)) {
+      break;
+    }
+    size_t copy = std::min(count - read, static_cast<size_t>(size));
+    ::memcpy(out + read, data, copy);
+    read += copy;
+    if (copy < static_cast<size_t>(size)) {
+      input_->BackUp(size - copy);
+    }
+  }
+  return read;
+}
+
+bool SnappyFramedInputStream::Fail(const std::string &error) {
+  error_ = error;
+  return false;
+}
+
+bool SnappyFramedInputStream::ReadChunk() {
+  if (!error_.empty()) {
+    return false;
+  }
+  char header[kChunkHeaderSize];
+  size_t header_read = ReadRaw(header, kChunkHeaderSize);
+  if (header_read == 0) {
+    return false;
+  }
+  if (header_read != kChunkHeaderSize) {
+    return Fail("truncated chunk header");
+  }
+  unsigned char type = static_cast<unsigned char>(header[0]);
+  size_t length = ReadLittleEndian(&header[1], 3);
+  if (type != kStreamIdentifier && !saw_stream_identifier_) {
+    return Fail("missing stream identifier");
+  }
+  if (type > kUncompressedData && type < 0x80) {
+    return Fail("unsupported unskippable chunk type");
+  }
+  compressed_.resize(length);
+  if (ReadRaw(&compressed_[0], length) != length) {
+    return Fail("truncated chunk");
+  }
+  switch (type) {
+    case kStreamIdentifier:
+      if (compressed_ != kStreamIdentifierData) {
+        return Fail("bad stream identifier");
+      }
+      saw_stream_identifier_ = true;
+      return true;
+    case kCompressedData:
+    case kUncompressedData:
+      break;
+    default:
+      // Padding and reserved skippable chunks.
+      return true;
+  }
+  if (length < kChecksumSize) {
+    return Fail("data chunk too short");
+  }
+  uint32_t checksum = ReadLittleEndian(compressed_.data(), kChecksumSize);
+  const char *payload = compressed_.data() + kChecksumSize;
+  size_t payload_size = length - kChecksumSize;
+  if (type == kCompressedData) {
+    size_t data_size = 0;
+    if (!snappy::GetUncompressedLength(payload, payload_size, &data_size) ||
+        data_size > kMaxChunkData) {
+      return Fail("bad compressed chunk");
+    }
+    chunk_.resize(data_size);
+    if (!snappy::RawUncompress(payload, payload_size, &chunk_[0])) {
+      return Fail("bad compressed chunk");
+    }
+  } else {
+    if (payload_size > kMaxChunkData) {
+      return Fail("uncompressed chunk too long");
+    }
+    chunk_.assign(payload, payload_size);
+  }
+  chunk_used_ = 0;
+  if (MaskedCrc32c(chunk_.data(), chunk_.size()) != checksum) {
+    chunk_.clear();
+    return Fail("checksum mismatch");
+  }
+  return true;
+}
+
+}  // namespace kythe
@@ -0,0 +1,177 @@
+/*
+ * Copyright 2017 Google Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef KYTHE_CXX_COMMON_SNAPPY_STREAM_H_
+#define KYTHE_CXX_COMMON_SNAPPY_STREAM_H_
+
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "google/protobuf/io/zero_copy_stream.h"
+
+namespace kythe {
+
+/// \brief A `ZeroCopyOutputStream` that compresses the data written to it
+/// using the snappy framing format.
+///
+/// Data is buffered into blocks and each block is compressed as a sequence
+/// of chunks as described in third_party/snappy/framing_format.txt. The
+/// output can be read back with `SnappyFramedInputStream` (or any other
+/// reader for "Snappy framed" streams).
+class SnappyFramedOutputStream
+    : public google::protobuf::io::ZeroCopyOutputStream {
+ public:
+  /// \param output The stream to which to write compressed data. Not owned.
+  /// \param block_size The amount of data to buffer before compressing it.
+  /// \param use_thread If true, compress and write blocks on a helper thread.
+  explicit SnappyFramedOutputStream(
+      google::protobuf::io::ZeroCopyOutputStream *output,
+      size_t block_size = kDefaultBlockSize, bool use_thread = false);
+
+  /// \brief Calls `Close()`.
+  ~SnappyFramedOutputStream() override;
+
+  bool Next(void **data, int *size) override;
+  void BackUp(int count) override;
+  google::protobuf::int64 ByteCount() const override;
+
+  /// \brief Compresses and writes all data buffered so far.
+  ///
+  /// The underlying stream is not flushed.
+  /// \return false if writing to the underlying stream failed.
+  bool Flush();
+
+  /// \brief Flushes buffered data and stops the helper thread (if any).
+  /// No more data may be written after the stream is closed.
+  /// \return false if writing to the underlying stream failed.
+  bool Close();
+
+  /// \brief Compresses the chunks of each block on up to `threads` threads.
+  /// Must be called before any data is written.
+  void set_compression_threads(size_t threads) {
+    compression_threads_ = std::max<size_t>(threads, 1);
+  }
+
+  /// The default amount of data to buffer before compressing it.
+  static constexpr size_t kDefaultBlockSize = 1024 * 1024;
+
+ private:
+  /// \brief Appends the chunk holding the `size` bytes at `data` to `out`.
+  static void EncodeChunk(const char *data, size_t size, std::string *out);
+
+  /// \brief Hands off the current block for compression.
+  void RetireBlock();
+
+  /// \brief Compresses `block` and writes it to `output_`.
+  void WriteBlock(const std::string &block);
+
+  /// \brief Compresses blocks from `queue_` until the stream is closed.
+  void CompressLoop();
+
+  /// The stream to which we write compressed data.
+  google::protobuf::io::ZeroCopyOutputStream *output_;
+  /// The size of each uncompressed block.
+  size_t block_size_;
+  /// The number of threads with which to compress each block.
+  size_t compression_threads_ = 1;
+  /// The block that's being filled.
+  std::string block_;
+  /// The number of bytes in `block_` that are in use.
+  size_t block_used_ = 0;
+  /// The total number of (uncompressed) bytes written to this stream.
+  google::protobuf::int64 byte_count_ = 0;
+  /// Scratch space for compressed chunks.
+  std::string compressed_;
+  /// Set if we haven't yet written the stream identifier. Only accessed by
+  /// the thread that calls `WriteBlock`.
+  bool needs_stream_identifier_ = true;
+  /// Set once we've retired at least one block.
+  bool retired_block_ = false;
+  /// Set after `Close()` has been called.
+  bool closed_ = false;
+  /// The helper thread, if any.
+  std::thread thread_;
+  /// Guards `queue_`, `spare_blocks_`, `busy_`, `stopping_`, and `failed_`.
+  std::mutex mutex_;
+  /// Signalled when `queue_` or `busy_` changes.
+  std::condition_variable queue_changed_;
+  /// Blocks waiting to be compressed by the helper thread.
+  std::deque<std::string> queue_;
+  /// Blocks that are free for reuse.
+  std::vector<std::string> spare_blocks_;
+  /// Set while the helper thread is compressing a block.
+  bool busy_ = false;
+  /// Set when the helper thread should exit.
+  bool stopping_ = false;
+  /// Set if writing to `output_` failed.
+  bool failed_ = false;
+};
+
+/// \brief A `ZeroCopyInputStream` that decompresses a stream written in the
+/// snappy framing format (for example, by `SnappyFramedOutputStream`).
+class SnappyFramedInputStream
+    : public google::protobuf::io::ZeroCopyInputStream {
+ public:
+  /// \param input The stream from which to read compressed data. Not owned.
+  explicit SnappyFramedInputStream(
+      google::protobuf::io::ZeroCopyInputStream *input);
+
+  bool Next(const void **data, int *size) override;
+  void BackUp(int count) override;
+  bool Skip(int count) override;
+  google::protobuf::int64 ByteCount() const override;
+
+  /// \return a description of the last error, or an empty string if the
+  /// stream ended cleanly (or has not ended yet).
+  const std::string &error() const { return error_; }
+
+ private:
+  /// \brief Decodes the next chunk with data into `chunk_`.
+  /// \return false at the end of the stream or on error.
+  bool ReadChunk();
+
+  /// \brief Reads up to `count` bytes from `input_` into `out`.
+  /// \return the number of bytes read, which is less than `count` only if
+  /// the underlying stream ended.
+  size_t ReadRaw(char *out, size_t count);
+
+  /// \brief Records `error` and returns false.
+  bool Fail(const std::string &error);
+
+  /// The stream from which we read compressed data.
+  google::protobuf::io::ZeroCopyInputStream *input_;
+  /// The current decompressed chunk.
+  std::string chunk_;
+  /// The number of bytes of `chunk_` that have been returned from `Next`.
+  size_t chunk_used_ = 0;
+  /// Scratch space for compressed chunks.
+  std::string compressed_;
+  /// The total number of (uncompressed) bytes read from this stream.
+  google::protobuf::int64 byte_count_ = 0;
+  /// Set once we've validated the stream identifier.
+  bool saw_stream_identifier_ = false;
+  /// The last error encountered.
+  std::string error_;
+};
+
+}  // namespace kythe
+
+#endif  // KYTHE_CXX_COMMON_SNAPPY_STREAM_H_
@@ -0,0 +1,172 @@
+/*
+ * Copyright 2017 Google Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "snappy_stream.h"
+
+#include <string>
+
+#include "google/protobuf/io/coded_stream.h"
+#include "google/protobuf/io/zero_copy_stream_impl_lite.h"
+#include "gtest/gtest.h"
+
+namespace kythe {
+namespace {
+
+/// \brief Compresses `data` with a `SnappyFramedOutputStream`.
+std::string Compress(const std::string &data, size_t block_size,
+                     bool use_thread, size_t compression_threads = 1) {
+  std::string out;
+  {
+    google::protobuf::io::StringOutputStream raw_output(&out);
+    SnappyFramedOutputStream output(&raw_output, block_size, use_thread);
+    output.set_compression_threads(compression_threads);
+    {
+      google::protobuf::io::CodedOutputStream coded_output(&output);
+      coded_output.WriteRaw(data.data(), data.size());
+    }
+    EXPECT_TRUE(output.Close());
+  }
+  return out;
+}
+
+/// \brief Decompresses `data` with a `SnappyFramedInputStream`.
+/// \param error Set to the stream's error after reading.
+std::string Decompress(const std::string &data, std::string *error) {
+  google::protobuf::io::ArrayInputStream raw_input(data.data(), data.size());
+  SnappyFramedInputStream input(&raw_input);
+  std::string out;
+  const void *buffer;
+  int size;
+  while (input.Next(&buffer, &size)) {
+    out.append(static_cast<const char *>(buffer), size);
+  }
+  *error = input.error();
+  return out;
+}
+
+/// \return `size` bytes of text that compresses well.
+std::string CompressibleText(size_t size) {
+  std::string text;
+  while (text.size() < size) {
+    text += "/kythe/edge/childof /kythe/node/kind ";
+    text += std::to_string(text.size());
+  }
+  text.resize(size);
+  return text;
+}
+
+/// \return `size` bytes of text that doesn't compress.
+std::string IncompressibleText(size_t size) {
+  std::string text(size, '\0');
+  uint32_t state = 12345;
+  for (auto &c : text) {
+    state = state * 1103515245 + 12345;
+    c = static_cast<char>(state >> 24);
+  }
+  return text;
+}
+
+TEST(SnappyStream, EmptyStreamHasIdentifier) {
+  std::string compressed = Compress("", 1024, false);
+  EXPECT_EQ(std::string("\xff\x06\x00\x00sNaPpY", 10), compressed);
+  std::string error;
+  EXPECT_EQ("", Decompress(compressed, &error));
+  EXPECT_EQ("", error);
+}
+
+TEST(SnappyStream, RoundTripsSmallInput) {
+  std::string error;
+  EXPECT_EQ("hello", Decompress(Compress("hello", 1024, false), &error));
+  EXPECT_EQ("", error);
+}
+
+TEST(SnappyStream, RoundTripsLargeInput) {
+  std::string text = CompressibleText(1000000);
+  std::string compressed = Compress(text, 300000, false);
+  EXPECT_LT(compressed.size(), text.size() / 2);
+  std::string error;
+  EXPECT_EQ(text, Decompress(compressed, &error));
+  EXPECT_EQ("", error);
+}
+
+TEST(SnappyStream, RoundTripsOnHelperThread) {
+  std::string text = CompressibleText(1000000);
+  EXPECT_EQ(Compress(text, 100000, false), Compress(text, 100000, true));
+  std::string error;
+  EXPECT_EQ(text, Decompress(Compress(text, 100000, true), &error));
+  EXPECT_EQ("", error);
+}
+
+TEST(SnappyStream, RoundTripsWithCompressionThreads) {
+  std::string text = CompressibleText(1000000) + IncompressibleText(100000);
+  std::string compressed = Compress(text, 300000, false);
+  EXPECT_EQ(compressed, Compress(text, 300000, false, 4));
+  EXPECT_EQ(compressed, Compress(text, 300000, true, 3));
+  std::string error;
+  EXPECT_EQ(text, Decompress(Compress(text, 300000, false, 4), &error));
+  EXPECT_EQ("", error);
+}
+
+TEST(SnappyStream, StoresIncompressibleDataUncompressed) {
+  std::string text = IncompressibleText(100000);
+  std::string compressed = Compress(text, 1 << 20, false);
+  // Identifier + two chunks with 8 byte headers.
+  EXPECT_EQ(10 + 8 + 65536 + 8 + (100000 - 65536), compressed.size());
+  EXPECT_EQ('\x01', compressed[10]);
+  std::string error;
+  EXPECT_EQ(text, Decompress(compressed, &error));
+  EXPECT_EQ("", error);
+}
+
+TEST(SnappyStream, DetectsCorruption) {
+  std::string compressed = Compress(IncompressibleText(1000), 1024, false);
+  compressed[compressed.size() - 1] ^= 1;
+  std::string error;
+  Decompress(compressed, &error);
+  EXPECT_EQ("checksum mismatch", error);
+}
+
+TEST(SnappyStream, DetectsTruncation) {
+  std::string compressed = Compress(CompressibleText(1000), 1024, false);
+  compressed.resize(compressed.size() - 1);
+  std::string error;
+  Decompress(compressed, &error);
+  EXPECT_EQ("truncated chunk", error);
+}
+
+TEST(SnappyStream, RequiresStreamIdentifier) {
+  std::string compressed = Compress("hello", 1024, false);
+  std::string error;
+  Decompress(compressed.substr(10), &error);
+  EXPECT_EQ("missing stream identifier", error);
+}
+
+TEST(SnappyStream, AcceptsConcatenatedStreams) {
+  std::string error;
+  EXPECT_EQ("helloworld",
+            Decompress(Compress("hello", 1024, false) +
+                           Compress("world", 1024, false),
+                       &error));
+  EXPECT_EQ("", error);
+}
+
+}  // namespace
+}  // namespace kythe
+
+int main(int argc, char **argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
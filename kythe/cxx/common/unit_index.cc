@@ -0,0 +1,583 @@
+/*
+ * Copyright 2017 Google Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "unit_index.h"
+
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstring>
+#include <functional>
+
+#include "google/protobuf/io/coded_stream.h"
+#include "google/protobuf/io/zero_copy_stream_impl.h"
+#include "kythe/cxx/common/kythe_uri.h"
+#include "kythe/proto/buildinfo.pb.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Support/Endian.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Path.h"
+
+namespace kythe {
+namespace {
+using llvm::support::endian::read32le;
+using llvm::support::endian::read64le;
+using llvm::support::endian::write32le;
+using llvm::support::endian::write64le;
+
+/// The magic number at the start of the table.
+constexpr char kTableMagic[] = "KYUNITI\x01";
+constexpr size_t kMagicSize = 8;
+/// The table header is the magic number and the record count. An array of
+/// 64-bit record offsets (from the start of the file) follows it.
+constexpr size_t kTableHeaderSize = kMagicSize + 8;
+/// The magic number at the start of each batch in the journal.
+constexpr char kBatchMagic[] = "KYUJ";
+/// A batch header is the magic number and the 32-bit size of the records
+/// that follow it.
+constexpr size_t kBatchHeaderSize = 8;
+/// A record is a 32-bit key size, the key and a raw SHA-256 digest.
+constexpr size_t kDigestSize = 32;
+constexpr size_t kRecordOverhead = 4 + kDigestSize;
+const char kTableName[] = "table";
+const char kJournalName[] = "journal";
+const char kTempSuffix[] = ".new";
+constexpr char kBuildDetailsURI[] = "kythe.io/proto/kythe.proto.BuildDetails";
+
+int HexValue(char c) {
+  if (c >= '0' && c <= '9') {
+    return c - '0';
+  }
+  if (c >= 'a' && c <= 'f') {
+    return c - 'a' + 10;
+  }
+  return -1;
+}
+
+/// \brief Decodes the lowercase hex SHA-256 digest `hash` into `digest`.
+/// \return false if `hash` isn't one.
+bool DecodeDigest(const std::string &hash, std::string *digest,
+                  std::string *error_text) {
+  if (hash.size() != kDigestSize * 2) {
+    *error_text = "Invalid name: bad SHA256 digest length.";
+    return false;
+  }
+  digest->resize(kDigestSize);
+  for (size_t i = 0; i < kDigestSize; ++i) {
+    int high = HexValue(hash[i * 2]), low = HexValue(hash[i * 2 + 1]);
+    if (high < 0 || low < 0) {
+      *error_text = "Invalid name: name is not a valid lowercase SHA256 digest";
+      return false;
+    }
+    (*digest)[i] = static_cast<char>((high << 4) | low);
+  }
+  return true;
+}
+
+/// \return the lowercase hex encoding of the raw digest `digest`.
+std::string EncodeDigest(llvm::StringRef digest) {
+  static constexpr char kHexDigits[] = "0123456789abcdef";
+  std::string hash(digest.size() * 2, '\0');
+  for (size_t i = 0; i < digest.size(); ++i) {
+    unsigned char byte = digest[i];
+    hash[i * 2] = kHexDigits[byte >> 4];
+    hash[i * 2 + 1] = kHexDigits[byte & 0xF];
+  }
+  return hash;
+}
+
+/// \brief Appends the record for `key` and `digest` to `out`.
+void AppendRecord(llvm::StringRef key, llvm::StringRef digest,
+                  std::string *out) {
+  char size[4];
+  write32le(size, key.size());
+  out->append(size, sizeof(size));
+  out->append(key.data(), key.size());
+  out->append(digest.data(), digest.size());
+}
+
+/// \brief Splits the record at `data + *pos` into `key` and `digest` and
+/// advances `*pos` past it.
+/// \return false if the record doesn't fit in the `size` bytes at `data`.
+bool ParseRecord(const char *data, size_t size, size_t *pos,
+                 llvm::StringRef *key, llvm::StringRef *digest) {
+  if (*pos > size || size - *pos < kRecordOverhead) {
+    return false;
+  }
+  uint32_t key_size = read32le(data + *pos);
+  if (size - *pos - kRecordOverhead < key_size) {
+    return false;
+  }
+  *key = llvm::StringRef(data + *pos + 4, key_size);
+  *digest = llvm::StringRef(data + *pos + 4 + key_size, kDigestSize);
+  *pos += kRecordOverhead + key_size;
+  return true;
+}
+
+/// \brief Finds record `index` in the mapped table `table`.
+/// \return false if the table is corrupt.
+bool TableRecord(const llvm::MemoryBuffer &table, size_t index,
+                 llvm::StringRef *key, llvm::StringRef *digest) {
+  const char *start = table.getBufferStart();
+  size_t pos = read64le(start + kTableHeaderSize + index * 8);
+  return ParseRecord(start, table.getBufferSize(), &pos, key, digest);
+}
+
+/// \brief Writes all of `data` to `fd`.
+bool WriteFully(int fd, const char *data, size_t size) {
+  while (size != 0) {
+    ssize_t written = ::write(fd, data, size);
+    if (written < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return false;
+    }
+    data += written;
+    size -= written;
+  }
+  return true;
+}
+
+/// \brief Holds an `flock` on a descriptor (if there is one) while in scope.
+class FileLock {
+ public:
+  FileLock(int fd, int operation) : fd_(fd) {
+    locked_ = fd_ < 0 || ::flock(fd_, operation) == 0;
+  }
+  ~FileLock() {
+    if (fd_ >= 0 && locked_) {
+      ::flock(fd_, LOCK_UN);
+    }
+  }
+  /// \return whether the lock was taken, setting `error_text` if not.
+  bool locked(std::string *error_text) const {
+    if (!locked_) {
+      *error_text = std::string("flock: ") + ::strerror(errno);
+    }
+    return locked_;
+  }
+
+ private:
+  int fd_;
+  bool locked_;
+};
+}  // anonymous namespace
+
+std::unique_ptr<UnitIndex> UnitIndex::Open(const std::string &directory,
+                                           bool writable, bool complete,
+                                           std::string *error_text) {
+  if (writable) {
+    if (auto err = llvm::sys::fs::create_directories(llvm::Twine(directory))) {
+      *error_text = err.message();
+      return nullptr;
+    }
+  }
+  llvm::SmallString<256> journal_path(directory);
+  llvm::sys::path::append(journal_path, llvm::StringRef(kJournalName));
+  int fd = writable ? ::open(journal_path.c_str(),
+                             O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0666)
+                    : ::open(journal_path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0 && (writable || errno != ENOENT)) {
+    *error_text = std::string(::strerror(errno)) + " (" +
+                  std::string(journal_path.str()) + ")";
+    return nullptr;
+  }
+  std::unique_ptr<UnitIndex> index(new UnitIndex(directory, fd, writable));
+  bool create_table = writable && complete;
+  FileLock lock(fd, create_table ? LOCK_EX : LOCK_SH);
+  if (!lock.locked(error_text) || !index->Load(error_text)) {
+    return nullptr;
+  }
+  if (create_table && !index->has_table()) {
+    // The pack has no units, so the journal holds all there is to know.
+    std::set<Record> journal;
+    journal.swap(index->journal_);
+    if (!index->WriteTable(false, journal, error_text)) {
+      return nullptr;
+    }
+  }
+  return index;
+}
+
+UnitIndex::~UnitIndex() {
+  if (journal_fd_ >= 0) {
+    ::close(journal_fd_);
+  }
+}
+
+std::string UnitIndex::PathFor(const char *name) const {
+  llvm::SmallString<256> path(directory_);
+  llvm::sys::path::append(path, llvm::StringRef(name));
+  return std::string(path.str());
+}
+
+std::string UnitIndex::SourceVNameKey(const proto::VName &vname) {
+  proto::VName file;
+  file.set_corpus(vname.corpus());
+  file.set_root(vname.root());
+  file.set_path(vname.path());
+  return URI(file).ToString();
+}
+
+std::vector<UnitIndex::Key> UnitIndex::KeysFor(
+    const proto::CompilationUnit &unit) {
+  std::vector<Key> keys;
+  for (const auto &source_file : unit.source_file()) {
+    proto::VName vname;
+    vname.set_corpus(unit.v_name().corpus());
+    vname.set_root(unit.v_name().root());
+    vname.set_path(source_file);
+    for (const auto &input : unit.required_input()) {
+      if (input.info().path() == source_file && input.has_v_name()) {
+        vname = input.v_name();
+        break;
+      }
+    }
+    keys.emplace_back(KeyKind::kSourceVName, SourceVNameKey(vname));
+  }
+  if (!unit.output_key().empty()) {
+    keys.emplace_back(KeyKind::kOutputKey, unit.output_key());
+  }
+  for (const auto &detail : unit.details()) {
+    proto::BuildDetails build_details;
+    if (detail.type_url() == kBuildDetailsURI &&
+        build_details.ParseFromString(detail.value()) &&
+        !build_details.build_target().empty()) {
+      keys.emplace_back(KeyKind::kBuildTarget, build_details.build_target());
+    }
+  }
+  return keys;
+}
+
+bool UnitIndex::Load(std::string *error_text) {
+  table_.reset();
+  table_count_ = 0;
+  journal_.clear();
+  const std::string table_path = PathFor(kTableName);
+  auto buffer = llvm::MemoryBuffer::getFile(table_path, /*FileSize=*/-1,
+                                            /*RequiresNullTerminator=*/false);
+  if (buffer) {
+    const char *start = (*buffer)->getBufferStart();
+    size_t size = (*buffer)->getBufferSize();
+    if (size < kTableHeaderSize || ::memcmp(start, kTableMagic, kMagicSize)) {
+      *error_text = "Not a unit index table: " + table_path;
+      return false;
+    }
+    uint64_t count = read64le(start + kMagicSize);
+    if (count > (size - kTableHeaderSize) / 8) {
+      *error_text = "Truncated unit index table: " + table_path;
+      return false;
+    }
+    table_ = std::move(*buffer);
+    table_count_ = count;
+  } else if (buffer.getError() != std::errc::no_such_file_or_directory) {
+    *error_text = buffer.getError().message() + " (" + table_path + ")";
+    return false;
+  }
+  if (journal_fd_ < 0) {
+    return true;
+  }
+  struct stat journal_stat;
+  if (::fstat(journal_fd_, &journal_stat) != 0) {
+    *error_text = std::string("fstat: ") + ::strerror(errno);
+    return false;
+  }
+  std::string journal(journal_stat.st_size, '\0');
+  size_t read = 0;
+  while (read < journal.size()) {
+    ssize_t count =
+        ::pread(journal_fd_, &journal[read], journal.size() - read, read);
+    if (count < 0 && errno == EINTR) {
+      continue;
+    }
+    if (count <= 0) {
+      *error_text = "Couldn't read " + PathFor(kJournalName);
+      return false;
+    }
+    read += count;
+  }
+  for (size_t pos = 0; pos < journal.size();) {
+    if (journal.size() - pos < kBatchHeaderSize ||
+        journal.compare(pos, 4, kBatchMagic) != 0 ||
+        journal.size() - pos - kBatchHeaderSize <
+            read32le(journal.data() + pos + 4)) {
+      *error_text = "Corrupt unit index journal " + PathFor(kJournalName) +
+                    "; rebuild the unit index.";
+      return false;
+    }
+    size_t end = pos + kBatchHeaderSize + read32le(journal.data() + pos + 4);
+    pos += kBatchHeaderSize;
+    llvm::StringRef key, digest;
+    while (pos < end) {
+      if (!ParseRecord(journal.data(), end, &pos, &key, &digest)) {
+        *error_text = "Corrupt unit index journal " + PathFor(kJournalName) +
+                      "; rebuild the unit index.";
+        return false;
+      }
+      journal_.emplace(key.str(), digest.str());
+    }
+  }
+  return true;
+}
+
+bool UnitIndex::Add(const std::vector<Key> &keys, const std::string &hash,
+                    std::string *error_text) {
+  if (!writable_) {
+    *error_text = "Unit index not opened for writing.";
+    return false;
+  }
+  std::string digest;
+  if (!DecodeDigest(hash, &digest, error_text)) {
+    return false;
+  }
+  if (keys.empty()) {
+    return true;
+  }
+  std::vector<Record> records;
+  std::string batch(kBatchHeaderSize, '\0');
+  ::memcpy(&batch[0], kBatchMagic, 4);
+  for (const auto &key : keys) {
+    records.emplace_back(static_cast<char>(key.first) + key.second, digest);
+    AppendRecord(records.back().first, digest, &batch);
+  }
+  write32le(&batch[4], batch.size() - kBatchHeaderSize);
+  FileLock lock(journal_fd_, LOCK_EX);
+  if (!lock.locked(error_text)) {
+    return false;
+  }
+  struct stat journal_stat;
+  if (::fstat(journal_fd_, &journal_stat) != 0) {
+    *error_text = std::string("fstat: ") + ::strerror(errno);
+    return false;
+  }
+  // Nobody else can append while we hold the lock, so a partial batch can
+  // be cut off again.
+  if (!WriteFully(journal_fd_, batch.data(), batch.size())) {
+    *error_text = std::string("write: ") + ::strerror(errno);
+    if (::ftruncate(journal_fd_, journal_stat.st_size) != 0) {
+      *error_text += "; the unit index journal may be corrupt";
+    }
+    return false;
+  }
+  journal_.insert(records.begin(), records.end());
+  if (static_cast<uint64_t>(journal_stat.st_size) + batch.size() <=
+      max_journal_bytes_) {
+    return true;
+  }
+  // Pick up any records that other writers have added before compacting.
+  if (!Load(error_text)) {
+    return false;
+  }
+  std::set<Record> journal;
+  journal.swap(journal_);
+  return WriteTable(has_table(), journal, error_text);
+}
+
+bool UnitIndex::Find(KeyKind kind, const std::string &key,
+                     std::vector<std::string> *hashes,
+                     std::string *error_text) const {
+  hashes->clear();
+  if (!table_) {
+    *error_text = "The unit index in " + directory_ +
+                  " predates some of its pack's units; rebuild it.";
+    return false;
+  }
+  const std::string wanted = static_cast<char>(kind) + key;
+  std::set<std::string> found;
+  llvm::StringRef record_key, digest;
+  size_t low = 0, high = table_count_;
+  while (low < high) {
+    size_t middle = low + (high - low) / 2;
+    if (!TableRecord(*table_, middle, &record_key, &digest)) {
+      *error_text = "Corrupt unit index table in " + directory_;
+      return false;
+    }
+    if (record_key < wanted) {
+      low = middle + 1;
+    } else {
+      high = middle;
+    }
+  }
+  for (size_t i = low; i < table_count_; ++i) {
+    if (!TableRecord(*table_, i, &record_key, &digest)) {
+      *error_text = "Corrupt unit index table in " + directory_;
+      return false;
+    }
+    if (record_key != wanted) {
+      break;
+    }
+    found.insert(EncodeDigest(digest));
+  }
+  for (auto record = journal_.lower_bound(Record(wanted, std::string()));
+       record != journal_.end() && record->first == wanted; ++record) {
+    found.insert(EncodeDigest(record->second));
+  }
+  hashes->assign(found.begin(), found.end());
+  return true;
+}
+
+bool UnitIndex::Compact(std::string *error_text) {
+  if (!writable_) {
+    *error_text = "Unit index not opened for writing.";
+    return false;
+  }
+  FileLock lock(journal_fd_, LOCK_EX);
+  if (!lock.locked(error_text) || !Load(error_text)) {
+    return false;
+  }
+  if (journal_.empty()) {
+    return true;
+  }
+  std::set<Record> journal;
+  journal.swap(journal_);
+  return WriteTable(has_table(), journal, error_text);
+}
+
+bool UnitIndex::Replace(
+    const std::vector<std::pair<Key, std::string>> &records,
+    std::string *error_text) {
+  if (!writable_) {
+    *error_text = "Unit index not opened for writing.";
+    return false;
+  }
+  FileLock lock(journal_fd_, LOCK_EX);
+  if (!lock.locked(error_text) || !Load(error_text)) {
+    return false;
+  }
+  // Keep the journal: it may hold units added while `records` was built.
+  std::set<Record> all;
+  all.swap(journal_);
+  std::string digest;
+  for (const auto &record : records) {
+    if (!DecodeDigest(record.second, &digest, error_text)) {
+      return false;
+    }
+    all.emplace(static_cast<char>(record.first.first) + record.first.second,
+                digest);
+  }
+  return WriteTable(false, all, error_text);
+}
+
+bool UnitIndex::WriteTable(bool keep_table, const std::set<Record> &extra,
+                           std::string *error_text) {
+  // Calls `visit` with each record in the table (if kept) and `extra` once,
+  // in order.
+  auto merge = [&](const std::function<void(llvm::StringRef,
+                                            llvm::StringRef)> &visit) {
+    size_t table_count = keep_table ? table_count_ : 0;
+    size_t next = 0;
+    llvm::StringRef key, digest;
+    bool have_table_record = false;
+    auto extra_record = extra.begin();
+    for (;;) {
+      if (!have_table_record && next < table_count) {
+        if (!TableRecord(*table_, next++, &key, &digest)) {
+          return false;
+        }
+        have_table_record = true;
+      }
+      if (!have_table_record && extra_record == extra.end()) {
+        return true;
+      }
+      // Negative if the table's record comes first; zero if they match.
+      int order;
+      if (!have_table_record) {
+        order = 1;
+      } else if (extra_record == extra.end()) {
+        order = -1;
+      } else {
+        order = key.compare(extra_record->first);
+        if (order == 0) {
+          order = digest.compare(extra_record->second);
+        }
+      }
+      if (order <= 0) {
+        visit(key, digest);
+        have_table_record = false;
+        if (order == 0) {
+          ++extra_record;
+        }
+      } else {
+        visit(extra_record->first, extra_record->second);
+        ++extra_record;
+      }
+    }
+  };
+  std::vector<uint64_t> offsets;
+  uint64_t records_size = 0;
+  if (!merge([&](llvm::StringRef key, llvm::StringRef digest) {
+        offsets.push_back(records_size);
+        records_size += kRecordOverhead + key.size();
+      })) {
+    *error_text = "Corrupt unit index table in " + directory_;
+    return false;
+  }
+  llvm::SmallString<256> model(directory_);
+  llvm::sys::path::append(model,
+                          std::string("%%%%%%%%%%%%%%%%") + kTempSuffix);
+  int fd;
+  llvm::SmallString<256> temp_path;
+  if (auto err = llvm::sys::fs::createUniqueFile(model, fd, temp_path)) {
+    *error_text = err.message();
+    return false;
+  }
+  google::protobuf::io::FileOutputStream file_stream(fd);
+  bool ok = true;
+  {
+    google::protobuf::io::CodedOutputStream stream(&file_stream);
+    char word[8];
+    stream.WriteRaw(kTableMagic, kMagicSize);
+    write64le(word, offsets.size());
+    stream.WriteRaw(word, sizeof(word));
+    const uint64_t base = kTableHeaderSize + offsets.size() * 8;
+    for (uint64_t offset : offsets) {
+      write64le(word, base + offset);
+      stream.WriteRaw(word, sizeof(word));
+    }
+    std::string record;
+    merge([&](llvm::StringRef key, llvm::StringRef digest) {
+      record.clear();
+      AppendRecord(key, digest, &record);
+      stream.WriteRaw(record.data(), record.size());
+    });
+    ok = !stream.HadError();
+  }
+  if (!file_stream.Close() || !ok) {
+    llvm::sys::fs::remove(llvm::Twine(temp_path));
+    *error_text = "Couldn't write " + std::string(temp_path.str());
+    return false;
+  }
+  const std::string table_path = PathFor(kTableName);
+  if (auto err = llvm::sys::fs::rename(llvm::Twine(temp_path),
+                                       llvm::Twine(table_path))) {
+    llvm::sys::fs::remove(llvm::Twine(temp_path));
+    *error_text = err.message();
+    return false;
+  }
+  // If we stop before this, the journal's records are also in the table,
+  // which is harmless.
+  if (::ftruncate(journal_fd_, 0) != 0) {
+    *error_text = std::string("ftruncate: ") + ::strerror(errno);
+    return false;
+  }
+  return Load(error_text);
+}
+
+}  // namespace kythe
@@ -0,0 +1,158 @@
+/*
+ * Copyright 2017 Google Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef KYTHE_CXX_COMMON_UNIT_INDEX_H_
+#define KYTHE_CXX_COMMON_UNIT_INDEX_H_
+
+#include <memory>
+#include <set>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "kythe/proto/analysis.pb.h"
+#include "kythe/proto/storage.pb.h"
+#include "llvm/Support/MemoryBuffer.h"
+
+namespace kythe {
+
+/// \brief Maps keys derived from compilation units (their main source files,
+/// output keys and build targets) to the digests of those units, so that an
+/// index pack can find units without reading every one of them.
+///
+/// The index lives in its own directory. Writers append batches of records
+/// to the `journal` file, each with one `write` under an exclusive `flock`
+/// on the journal, so any number of processes can share it. `Compact`
+/// (which writers run themselves once the journal grows large) folds the
+/// journal into the `table` file. The table holds the records sorted by key
+/// behind an array of their offsets, so it can be mapped and binary-searched
+/// without being parsed. Opening the index maps the table and reads the
+/// journal under a shared lock; lookups take O(log n) time in the table plus
+/// a search of the journal's records, and see the records that were written
+/// before the index was opened or that were added through it.
+///
+/// An index without a table doesn't know about the units that were in its
+/// pack before it was created; lookups in it fail until `Replace` gives it
+/// a table.
+class UnitIndex {
+ public:
+  /// \brief The kinds of keys that units are indexed by.
+  enum class KeyKind : char {
+    kSourceVName = 's',  ///< A main source file (see `SourceVNameKey`).
+    kOutputKey = 'o',    ///< The unit's `output_key`.
+    kBuildTarget = 't'   ///< The `build_target` in the unit's BuildDetails.
+  };
+
+  /// \brief A kind of key and the key itself.
+  using Key = std::pair<KeyKind, std::string>;
+
+  /// \brief Opens the index in `directory`.
+  /// \param writable If true, creates the directory and journal if they
+  /// don't exist, and allows writes.
+  /// \param complete If true and the index has no table, gives it an empty
+  /// one. Pass true only if the pack has no units yet.
+  /// \return the index, or null on failure with `error_text` set.
+  static std::unique_ptr<UnitIndex> Open(const std::string &directory,
+                                         bool writable, bool complete,
+                                         std::string *error_text);
+
+  ~UnitIndex();
+
+  /// \return the keys to index `unit` by.
+  static std::vector<Key> KeysFor(const proto::CompilationUnit &unit);
+
+  /// \return the key for the source file named `vname`: the URI of its
+  /// corpus, root and path.
+  static std::string SourceVNameKey(const proto::VName &vname);
+
+  /// \brief Records that each of `keys` maps to the unit with digest `hash`.
+  /// \return false on failure and true on success.
+  bool Add(const std::vector<Key> &keys, const std::string &hash,
+           std::string *error_text);
+
+  /// \brief Finds the digests of the units that `key` of kind `kind` maps
+  /// to.
+  /// \param hashes Set to the digests, sorted and without duplicates.
+  /// \return false on failure (including if the index has no table) and
+  /// true on success.
+  bool Find(KeyKind kind, const std::string &key,
+            std::vector<std::string> *hashes, std::string *error_text) const;
+
+  /// \brief Folds the journal into the table.
+  /// \return false on failure and true on success.
+  bool Compact(std::string *error_text);
+
+  /// \brief Replaces the table with one holding each (key, digest) pair in
+  /// `records` and the contents of the journal, and empties the journal.
+  /// \return false on failure and true on success.
+  bool Replace(const std::vector<std::pair<Key, std::string>> &records,
+               std::string *error_text);
+
+  /// \return whether the index has a table.
+  bool has_table() const { return table_ != nullptr; }
+
+  /// \return the number of records read from the journal or added since
+  /// the last compaction.
+  size_t journal_record_count() const { return journal_.size(); }
+
+  /// \brief Sets the journal size past which `Add` compacts the index.
+  void set_max_journal_bytes(uint64_t max_journal_bytes) {
+    max_journal_bytes_ = max_journal_bytes;
+  }
+
+ private:
+  /// \brief A key (its kind byte followed by its text) and a raw SHA-256
+  /// digest.
+  using Record = std::pair<std::string, std::string>;
+
+  UnitIndex(std::string directory, int journal_fd, bool writable)
+      : directory_(std::move(directory)),
+        journal_fd_(journal_fd),
+        writable_(writable) {}
+
+  /// \brief Maps the table and reads the journal. Requires a lock on the
+  /// journal.
+  bool Load(std::string *error_text);
+
+  /// \brief Writes a table holding the records in the current table (if
+  /// `keep_table`) and in `extra`, maps it and empties the journal.
+  /// Requires an exclusive lock on the journal.
+  bool WriteTable(bool keep_table, const std::set<Record> &extra,
+                  std::string *error_text);
+
+  /// \return the path to the file `name` in the index directory.
+  std::string PathFor(const char *name) const;
+
+  /// The directory holding the index (absolute).
+  std::string directory_;
+  /// The journal (open for appending if the index is writable), or -1 if
+  /// it doesn't exist.
+  int journal_fd_;
+  /// Whether the index may be written.
+  bool writable_;
+  /// The mapped table, or null.
+  std::unique_ptr<llvm::MemoryBuffer> table_;
+  /// The number of records in `table_`.
+  size_t table_count_ = 0;
+  /// The records in the journal (or added since it was read).
+  std::set<Record> journal_;
+  /// The journal size past which `Add` compacts.
+  uint64_t max_journal_bytes_ = 64 << 20;
+};
+
+}  // namespace kythe
+
+#endif  // KYTHE_CXX_COMMON_UNIT_INDEX_H_
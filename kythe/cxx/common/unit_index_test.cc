@@ -0,0 +1,207 @@
+/*
+ * Copyright 2017 Google Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "unit_index.h"
+
+#include <string>
+#include <vector>
+
+#include "glog/logging.h"
+#include "gtest/gtest.h"
+#include "kythe/proto/buildinfo.pb.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Path.h"
+
+namespace kythe {
+namespace {
+
+using KeyKind = UnitIndex::KeyKind;
+
+// Some arbitrary but well-formed sha values.
+static const char kUnit1Sha[] =
+    "5b41362bc82b7f3d56edc5a306db22105707d01ff4819e26faef9724a2d406c9";
+static const char kUnit2Sha[] =
+    "d98cf53e0c8b77c14a96358d5b69584225b4bb9026423cbc2f7b0161894c402c";
+static const char kUnit3Sha[] =
+    "a7f4909446e1cc8286ceae47afe6ccb698af99769be9c5b4a7fa0aa7cc37667f";
+
+/// \brief A temporary directory that is removed with its contents.
+class TemporaryDirectory {
+ public:
+  TemporaryDirectory() {
+    CHECK_EQ(0, llvm::sys::fs::createUniqueDirectory("unit_index", root_)
+                    .value());
+    llvm::sys::path::append(root_, "index");
+  }
+  ~TemporaryDirectory() {
+    llvm::sys::fs::remove_directories(llvm::sys::path::parent_path(root_));
+  }
+
+  std::string root() const { return std::string(root_.str()); }
+
+ private:
+  llvm::SmallString<256> root_;
+};
+
+/// \return the digests that (kind, key) maps to in `index`, or "<error>".
+std::vector<std::string> Find(const UnitIndex &index, KeyKind kind,
+                              const std::string &key) {
+  std::vector<std::string> hashes;
+  std::string error_text;
+  if (!index.Find(kind, key, &hashes, &error_text)) {
+    return {"<error>"};
+  }
+  return hashes;
+}
+
+TEST(UnitIndex, KeysForUnit) {
+  proto::CompilationUnit unit;
+  unit.mutable_v_name()->set_corpus("corpus");
+  unit.mutable_v_name()->set_language("c++");
+  unit.add_source_file("a.cc");
+  unit.add_source_file("b.cc");
+  auto *input = unit.add_required_input();
+  input->mutable_info()->set_path("b.cc");
+  input->mutable_v_name()->set_corpus("other");
+  input->mutable_v_name()->set_path("src/b.cc");
+  unit.set_output_key("a.o");
+  proto::BuildDetails details;
+  details.set_build_target("//a:a");
+  auto *any = unit.add_details();
+  any->set_type_url("kythe.io/proto/kythe.proto.BuildDetails");
+  details.SerializeToString(any->mutable_value());
+  std::vector<UnitIndex::Key> expected = {
+      {KeyKind::kSourceVName, "kythe://corpus?path=a.cc"},
+      {KeyKind::kSourceVName, "kythe://other?path=src/b.cc"},
+      {KeyKind::kOutputKey, "a.o"},
+      {KeyKind::kBuildTarget, "//a:a"}};
+  EXPECT_EQ(expected, UnitIndex::KeysFor(unit));
+  proto::VName vname;
+  vname.set_corpus("corpus");
+  vname.set_path("a.cc");
+  vname.set_language("c++");
+  EXPECT_EQ("kythe://corpus?path=a.cc", UnitIndex::SourceVNameKey(vname));
+}
+
+TEST(UnitIndex, FindsJournaledAndCompactedRecords) {
+  TemporaryDirectory directory;
+  std::string error_text;
+  auto index = UnitIndex::Open(directory.root(), true, true, &error_text);
+  ASSERT_TRUE(index) << error_text;
+  ASSERT_TRUE(index->Add({{KeyKind::kSourceVName, "a"},
+                          {KeyKind::kOutputKey, "a"}},
+                         kUnit2Sha, &error_text))
+      << error_text;
+  ASSERT_TRUE(index->Add({{KeyKind::kSourceVName, "a"}}, kUnit1Sha,
+                         &error_text))
+      << error_text;
+  std::vector<std::string> both = {kUnit1Sha, kUnit2Sha};
+  EXPECT_EQ(both, Find(*index, KeyKind::kSourceVName, "a"));
+  EXPECT_EQ(std::vector<std::string>{kUnit2Sha},
+            Find(*index, KeyKind::kOutputKey, "a"));
+  EXPECT_TRUE(Find(*index, KeyKind::kBuildTarget, "a").empty());
+  EXPECT_EQ(3, index->journal_record_count());
+  ASSERT_TRUE(index->Compact(&error_text)) << error_text;
+  EXPECT_EQ(0, index->journal_record_count());
+  ASSERT_TRUE(index->Add({{KeyKind::kSourceVName, "a"},
+                          {KeyKind::kSourceVName, "b"}},
+                         kUnit3Sha, &error_text))
+      << error_text;
+  // A reader sees the table and the journal.
+  auto reader = UnitIndex::Open(directory.root(), false, false, &error_text);
+  ASSERT_TRUE(reader) << error_text;
+  std::vector<std::string> all = {kUnit1Sha, kUnit3Sha, kUnit2Sha};
+  EXPECT_EQ(all, Find(*reader, KeyKind::kSourceVName, "a"));
+  EXPECT_EQ(std::vector<std::string>{kUnit3Sha},
+            Find(*reader, KeyKind::kSourceVName, "b"));
+  EXPECT_EQ(std::vector<std::string>{kUnit2Sha},
+            Find(*reader, KeyKind::kOutputKey, "a"));
+  EXPECT_TRUE(Find(*reader, KeyKind::kSourceVName, "").empty());
+  EXPECT_TRUE(Find(*reader, KeyKind::kSourceVName, "c").empty());
+  EXPECT_FALSE(reader->Add({{KeyKind::kSourceVName, "c"}}, kUnit1Sha,
+                           &error_text));
+}
+
+TEST(UnitIndex, CompactsLargeJournals) {
+  TemporaryDirectory directory;
+  std::string error_text;
+  auto index = UnitIndex::Open(directory.root(), true, true, &error_text);
+  ASSERT_TRUE(index) << error_text;
+  index->set_max_journal_bytes(1);
+  ASSERT_TRUE(index->Add({{KeyKind::kBuildTarget, "//a"}}, kUnit1Sha,
+                         &error_text))
+      << error_text;
+  ASSERT_TRUE(index->Add({{KeyKind::kBuildTarget, "//a"}}, kUnit1Sha,
+                         &error_text))
+      << error_text;
+  EXPECT_EQ(0, index->journal_record_count());
+  EXPECT_EQ(std::vector<std::string>{kUnit1Sha},
+            Find(*index, KeyKind::kBuildTarget, "//a"));
+}
+
+TEST(UnitIndex, IncompleteUntilReplaced) {
+  TemporaryDirectory directory;
+  std::string error_text;
+  // An index opened over a pack that already had units can't answer.
+  auto index = UnitIndex::Open(directory.root(), true, false, &error_text);
+  ASSERT_TRUE(index) << error_text;
+  ASSERT_TRUE(index->Add({{KeyKind::kOutputKey, "new.o"}}, kUnit3Sha,
+                         &error_text))
+      << error_text;
+  EXPECT_FALSE(index->has_table());
+  EXPECT_EQ(std::vector<std::string>{"<error>"},
+            Find(*index, KeyKind::kOutputKey, "new.o"));
+  ASSERT_TRUE(index->Replace({{{KeyKind::kOutputKey, "old.o"}, kUnit1Sha},
+                              {{KeyKind::kOutputKey, "old.o"}, kUnit2Sha}},
+                             &error_text))
+      << error_text;
+  auto reader = UnitIndex::Open(directory.root(), false, false, &error_text);
+  ASSERT_TRUE(reader) << error_text;
+  std::vector<std::string> old = {kUnit1Sha, kUnit2Sha};
+  EXPECT_EQ(old, Find(*reader, KeyKind::kOutputKey, "old.o"));
+  EXPECT_EQ(std::vector<std::string>{kUnit3Sha},
+            Find(*reader, KeyKind::kOutputKey, "new.o"));
+}
+
+TEST(UnitIndex, RejectsBadDigests) {
+  TemporaryDirectory directory;
+  std::string error_text;
+  auto index = UnitIndex::Open(directory.root(), true, true, &error_text);
+  ASSERT_TRUE(index) << error_text;
+  EXPECT_FALSE(
+      index->Add({{KeyKind::kOutputKey, "a.o"}}, "not a digest", &error_text));
+  EXPECT_TRUE(Find(*index, KeyKind::kOutputKey, "a.o").empty());
+}
+
+TEST(UnitIndex, MissingIndexIsIncomplete) {
+  TemporaryDirectory directory;
+  std::string error_text;
+  auto index = UnitIndex::Open(directory.root(), false, false, &error_text);
+  ASSERT_TRUE(index) << error_text;
+  EXPECT_EQ(std::vector<std::string>{"<error>"},
+            Find(*index, KeyKind::kOutputKey, "a.o"));
+}
+
+}  // namespace
+}  // namespace kythe
+
+int main(int argc, char **argv) {
+  GOOGLE_PROTOBUF_VERIFY_VERSION;
+  google::InitGoogleLogging(argv[0]);
+  ::testing::InitGoogleTest(&argc, argv);
+  int result = RUN_ALL_TESTS();
+  return result;
+}
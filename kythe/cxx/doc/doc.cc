@@ -18,20 +18,38 @@
 // extracted from the Kythe graph.
 
 #include <fcntl.h>
+#include <openssl/sha.h>
 #include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
 
 #include "gflags/gflags.h"
 #include "glog/logging.h"
 #include "google/protobuf/io/zero_copy_stream_impl.h"
 #include "google/protobuf/text_format.h"
 #include "kythe/cxx/common/kythe_uri.h"
+#include "kythe/cxx/common/leveldb_xrefs_client.h"
 #include "kythe/cxx/common/net_client.h"
 #include "kythe/cxx/doc/html_markup_handler.h"
 #include "kythe/cxx/doc/html_renderer.h"
 #include "kythe/cxx/doc/javadoxygen_markup_handler.h"
 #include "kythe/cxx/doc/markup_handler.h"
+#include "llvm/ADT/SmallString.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/raw_ostream.h"
 
 DEFINE_string(xrefs, "http://localhost:8080", "Base URI for xrefs service");
+DEFINE_string(xrefs_leveldb, "",
+              "If set, read serving tables from this LevelDB instead of "
+              "querying --xrefs");
 DEFINE_string(corpus, "test", "Default corpus to use");
 DEFINE_string(path, "",
               "Look up this path in the xrefs service and process all "
@@ -42,6 +60,19 @@ DEFINE_string(save_response, "",
 DEFINE_string(css, "", "Include this stylesheet path in the resulting HTML.");
 DEFINE_bool(common_signatures, false,
             "Render the MarkedSource proto from standard in.");
+DEFINE_string(output_dir, "",
+              "Document each path given on the command line, writing "
+              "output_dir/<path>.html for each one.");
+DEFINE_int32(jobs, 4, "With --output_dir, render on this many threads.");
+DEFINE_int32(max_connections, 8,
+             "With --output_dir, make at most this many concurrent requests "
+             "to the xrefs service.");
+DEFINE_string(cache_dir, "",
+              "With --output_dir, keep documentation replies in this "
+              "directory and reuse them on later runs.");
+DEFINE_string(corpus_revision, "",
+              "The revision of the corpus being documented; part of the key "
+              "for --cache_dir entries.");
 
 namespace kythe {
 namespace {
@@ -60,13 +91,21 @@ constexpr char kDocFooter[] = R"(
 )";
 constexpr char kDefinesBinding[] = "/kythe/edge/defines/binding";
 
-int DocumentNodesFrom(const proto::DocumentationReply& doc_reply) {
-  ::fputs(kDocHeaderPrefix, stdout);
+/// \brief Renders `doc_reply` as a standalone HTML page.
+std::string RenderHtmlPage(const proto::DocumentationReply& doc_reply) {
+  size_t page_size = sizeof(kDocHeaderPrefix) + sizeof(kDocHeaderSuffix) +
+                     sizeof(kDocFooter) + FLAGS_css.size();
+  for (const auto& document : doc_reply.document()) {
+    page_size += EstimateRenderedSize(document);
+  }
+  std::string page;
+  page.reserve(page_size);
+  page += kDocHeaderPrefix;
   if (!FLAGS_css.empty()) {
-    ::fprintf(stdout, "<link rel=\"stylesheet\" type=\"text/css\" href=\"%s\">",
-              FLAGS_css.c_str());
+    page += "<link rel=\"stylesheet\" type=\"text/css\" href=\"" +
+            FLAGS_css + "\">";
   }
-  ::fputs(kDocHeaderSuffix, stdout);
+  page += kDocHeaderSuffix;
   DocumentHtmlRendererOptions options(doc_reply);
   options.make_link_uri = [](const proto::Anchor& anchor) {
     return anchor.parent();
@@ -81,14 +120,18 @@ int DocumentNodesFrom(const proto::DocumentationReply& doc_reply) {
     }
     return std::string();
   };
+  const std::vector<MarkupHandler> handlers = {ParseJavadoxygen, ParseHtml};
   for (const auto& document : doc_reply.document()) {
     if (document.has_text()) {
-      auto html =
-          RenderDocument(options, {ParseJavadoxygen, ParseHtml}, document);
-      ::fputs(html.c_str(), stdout);
+      RenderDocument(options, handlers, document, &page);
     }
   }
-  ::fputs(kDocFooter, stdout);
+  page += kDocFooter;
+  return page;
+}
+
+int DocumentNodesFrom(const proto::DocumentationReply& doc_reply) {
+  ::fputs(RenderHtmlPage(doc_reply).c_str(), stdout);
   return 0;
 }
 
@@ -117,20 +160,51 @@ int RenderMarkedSourceFromStdin() {
   return 0;
 }
 
-int DocumentNodesFrom(XrefsJsonClient* client, const proto::VName& file_name) {
+/// \brief Finds the file named by `path`, which is either a Kythe URI or a
+/// path in --corpus.
+/// \return false if `path` can't be parsed.
+bool ParseFileName(const std::string& path, proto::VName* file_name) {
+  auto ticket = URI::FromString(path);
+  if (!ticket.first) {
+    ticket = URI::FromString(
+        "kythe://" + UriEscape(UriEscapeMode::kEscapePaths, FLAGS_corpus) +
+        "?path=" + UriEscape(UriEscapeMode::kEscapePaths, path));
+  }
+  if (!ticket.first) {
+    ::fprintf(stderr, "Couldn't parse URI %s\n", path.c_str());
+    return false;
+  }
+  *file_name = ticket.second.v_name();
+  return true;
+}
+
+proto::DecorationsRequest DecorationsRequestFor(const proto::VName& file_name) {
   proto::DecorationsRequest request;
-  proto::DecorationsReply reply;
   request.mutable_location()->set_ticket(URI(file_name).ToString());
   request.set_references(true);
-  std::string error;
-  CHECK(client->Decorations(request, &reply, &error)) << error;
+  return request;
+}
+
+/// \return a request for the documentation of everything with a
+/// defines/binding anchor in `reply`.
+proto::DocumentationRequest DocumentationRequestFor(
+    const proto::DecorationsReply& reply) {
   proto::DocumentationRequest doc_request;
-  proto::DocumentationReply doc_reply;
   for (const auto& reference : reply.reference()) {
     if (reference.kind() == kDefinesBinding) {
       doc_request.add_ticket(reference.target_ticket());
     }
   }
+  return doc_request;
+}
+
+int DocumentNodesFrom(XrefsClient* client, const proto::VName& file_name) {
+  proto::DecorationsReply reply;
+  std::string error;
+  CHECK(client->Decorations(DecorationsRequestFor(file_name), &reply, &error))
+      << error;
+  proto::DocumentationRequest doc_request = DocumentationRequestFor(reply);
+  proto::DocumentationReply doc_reply;
   fprintf(stderr, "Looking for %d tickets\n", doc_request.ticket_size());
   CHECK(client->Documentation(doc_request, &doc_reply, &error)) << error;
   if (!FLAGS_save_response.empty()) {
@@ -155,6 +229,244 @@ int DocumentNodesFrom(XrefsJsonClient* client, const proto::VName& file_name) {
   }
   return DocumentNodesFrom(doc_reply);
 }
+
+/// \brief A file being documented in batch mode.
+struct BatchItem {
+  /// The path to the file as given on the command line.
+  std::string path;
+  proto::VName file_name;
+  /// Where the rendered page goes.
+  std::string output_file;
+  /// Where the documentation reply is cached, or empty if it isn't.
+  std::string cache_file;
+  proto::DecorationsReply decorations;
+  proto::DocumentationReply documentation;
+};
+
+/// \return the name of the cache entry for `file_name` at --corpus_revision.
+std::string CacheFileFor(const proto::VName& file_name) {
+  std::string key = FLAGS_corpus_revision;
+  key.push_back('\0');
+  key += URI(file_name).ToString();
+  unsigned char digest[SHA256_DIGEST_LENGTH];
+  ::SHA256(reinterpret_cast<const unsigned char*>(key.data()), key.size(),
+           digest);
+  static const char kHexDigits[] = "0123456789abcdef";
+  std::string name;
+  for (unsigned char byte : digest) {
+    name.push_back(kHexDigits[byte >> 4]);
+    name.push_back(kHexDigits[byte & 0xf]);
+  }
+  llvm::SmallString<256> cache_file(FLAGS_cache_dir);
+  llvm::sys::path::append(cache_file, name + ".pb");
+  return std::string(cache_file.str());
+}
+
+/// \return the page for `file_name` under --output_dir.
+std::string OutputFileFor(const proto::VName& file_name) {
+  llvm::StringRef path = file_name.path();
+  llvm::SmallString<256> output_file(FLAGS_output_dir);
+  llvm::sys::path::append(output_file, path.ltrim('/'));
+  output_file += ".html";
+  return std::string(output_file.str());
+}
+
+/// \brief Replaces the contents of `path` with `content` such that readers
+/// never see a partial file.
+bool WriteFileAtomically(const std::string& path, const std::string& content) {
+  auto parent = llvm::sys::path::parent_path(path);
+  if (!parent.empty() && llvm::sys::fs::create_directories(parent)) {
+    ::fprintf(stderr, "Couldn't create %s\n", parent.str().c_str());
+    return false;
+  }
+  int fd;
+  llvm::SmallString<256> temp_path;
+  if (llvm::sys::fs::createUniqueFile(path + ".tmp-%%%%%%", fd, temp_path)) {
+    ::fprintf(stderr, "Couldn't create a temporary file for %s\n",
+              path.c_str());
+    return false;
+  }
+  bool ok = true;
+  {
+    llvm::raw_fd_ostream stream(fd, /*shouldClose=*/true);
+    stream << content;
+    stream.close();
+    if (stream.has_error()) {
+      stream.clear_error();
+      ok = false;
+    }
+  }
+  if (!ok || llvm::sys::fs::rename(temp_path, path)) {
+    ::fprintf(stderr, "Couldn't write %s\n", path.c_str());
+    llvm::sys::fs::remove(temp_path);
+    return false;
+  }
+  return true;
+}
+
+/// \brief Loads `item`'s documentation from the cache.
+/// \param up_to_date Set to true if `item`'s page was written after the
+/// cache entry was, so it needn't be rendered again.
+/// \return true if the cache had an entry for `item`.
+bool LoadCachedDocumentation(BatchItem* item, bool* up_to_date) {
+  *up_to_date = false;
+  llvm::sys::fs::file_status cache_status, output_status;
+  if (llvm::sys::fs::status(item->cache_file, cache_status) ||
+      !llvm::sys::fs::is_regular_file(cache_status)) {
+    return false;
+  }
+  auto buffer = llvm::MemoryBuffer::getFile(item->cache_file);
+  if (!buffer || !item->documentation.ParseFromArray(
+                     (*buffer)->getBufferStart(), (*buffer)->getBufferSize())) {
+    ::fprintf(stderr, "Ignoring unreadable cache entry %s\n",
+              item->cache_file.c_str());
+    item->documentation.Clear();
+    return false;
+  }
+  *up_to_date =
+      !llvm::sys::fs::status(item->output_file, output_status) &&
+      llvm::sys::fs::is_regular_file(output_status) &&
+      output_status.getLastModificationTime() >=
+          cache_status.getLastModificationTime();
+  return true;
+}
+
+/// \brief Documents each of `paths`, writing a page for each under
+/// --output_dir.
+///
+/// Replies are fetched from `client` on this thread while --jobs threads
+/// render the ones that have arrived. If `multi_client` is set, it is used
+/// to keep many requests in flight at once. If --cache_dir is set, only
+/// files without a cache entry for --corpus_revision are fetched, and only
+/// pages older than their cache entries are rendered.
+/// \return 0 if every file was documented.
+int DocumentBatch(XrefsClient* client, XrefsJsonMultiClient* multi_client,
+                  const std::vector<std::string>& paths) {
+  std::deque<BatchItem> items;
+  for (const auto& path : paths) {
+    items.emplace_back();
+    auto& item = items.back();
+    item.path = path;
+    if (!ParseFileName(path, &item.file_name)) {
+      return 1;
+    }
+    item.output_file = OutputFileFor(item.file_name);
+    if (!FLAGS_cache_dir.empty()) {
+      item.cache_file = CacheFileFor(item.file_name);
+    }
+  }
+  std::atomic<size_t> failures(0);
+  std::mutex queue_mutex;
+  std::condition_variable queue_ready;
+  std::deque<BatchItem*> render_queue;
+  bool fetching = true;
+  auto render = [&](BatchItem* item) {
+    {
+      std::lock_guard<std::mutex> lock(queue_mutex);
+      render_queue.push_back(item);
+    }
+    queue_ready.notify_one();
+  };
+  std::vector<std::thread> workers;
+  for (int i = 0; i < std::max(1, FLAGS_jobs); ++i) {
+    workers.emplace_back([&]() {
+      for (;;) {
+        BatchItem* item;
+        {
+          std::unique_lock<std::mutex> lock(queue_mutex);
+          queue_ready.wait(
+              lock, [&]() { return !render_queue.empty() || !fetching; });
+          if (render_queue.empty()) {
+            return;
+          }
+          item = render_queue.front();
+          render_queue.pop_front();
+        }
+        if (!WriteFileAtomically(item->output_file,
+                                 RenderHtmlPage(item->documentation))) {
+          ++failures;
+        }
+        // Rendered replies can be large; don't hold on to them.
+        item->documentation.Clear();
+      }
+    });
+  }
+  auto fetched = [&](BatchItem* item) {
+    item->decorations.Clear();
+    if (!item->cache_file.empty() &&
+        !WriteFileAtomically(item->cache_file,
+                             item->documentation.SerializeAsString())) {
+      ++failures;
+    }
+    render(item);
+  };
+  auto fail = [&](const BatchItem& item, const std::string& error_text) {
+    ::fprintf(stderr, "Couldn't document %s: %s\n", item.path.c_str(),
+              error_text.c_str());
+    ++failures;
+  };
+  size_t cached = 0, skipped = 0;
+  for (auto& item : items) {
+    BatchItem* item_ptr = &item;
+    if (!item.cache_file.empty()) {
+      bool up_to_date;
+      if (LoadCachedDocumentation(item_ptr, &up_to_date)) {
+        ++cached;
+        if (up_to_date) {
+          item.documentation.Clear();
+          ++skipped;
+        } else {
+          render(item_ptr);
+        }
+        continue;
+      }
+    }
+    if (multi_client == nullptr) {
+      std::string error_text;
+      if (!client->Decorations(DecorationsRequestFor(item.file_name),
+                               &item.decorations, &error_text) ||
+          !client->Documentation(DocumentationRequestFor(item.decorations),
+                                 &item.documentation, &error_text)) {
+        fail(item, error_text);
+      } else {
+        fetched(item_ptr);
+      }
+      continue;
+    }
+    multi_client->DecorationsAsync(
+        DecorationsRequestFor(item.file_name), &item.decorations,
+        [&, item_ptr](bool ok, const std::string& error_text) {
+          if (!ok) {
+            fail(*item_ptr, error_text);
+            return;
+          }
+          multi_client->DocumentationAsync(
+              DocumentationRequestFor(item_ptr->decorations),
+              &item_ptr->documentation,
+              [&, item_ptr](bool doc_ok, const std::string& doc_error) {
+                if (doc_ok) {
+                  fetched(item_ptr);
+                } else {
+                  fail(*item_ptr, doc_error);
+                }
+              });
+        });
+  }
+  if (multi_client != nullptr) {
+    multi_client->Wait();
+  }
+  {
+    std::lock_guard<std::mutex> lock(queue_mutex);
+    fetching = false;
+  }
+  queue_ready.notify_all();
+  for (auto& worker : workers) {
+    worker.join();
+  }
+  ::fprintf(stderr, "Documented %zu files (%zu from cache, %zu unchanged)\n",
+            items.size() - failures, cached, skipped);
+  return failures == 0 ? 0 : 1;
+}
 }  // anonymous namespace
 }  // namespace kythe
 
@@ -172,30 +484,65 @@ doc
 doc -common_signatures
   Renders the text-format proto::common::MarkedSource message provided on standard
   input into several common forms.
+doc -corpus foo -output_dir out [-cache_dir cache -corpus_revision r] a.cc b.cc
+  Formats documentation for each of a.cc and b.cc, writing out/a.cc.html and
+  out/b.cc.html. Replies are kept in cache; a later run with the same
+  -corpus_revision only renders pages that are missing or out of date.
 )");
   gflags::ParseCommandLineFlags(&argc, &argv, true);
+  if (!FLAGS_cache_dir.empty() && FLAGS_corpus_revision.empty()) {
+    ::fprintf(stderr, "-cache_dir requires -corpus_revision\n");
+    return 1;
+  }
   if (FLAGS_common_signatures) {
     return kythe::RenderMarkedSourceFromStdin();
+  } else if (!FLAGS_output_dir.empty()) {
+    std::unique_ptr<kythe::XrefsClient> client;
+    kythe::XrefsJsonMultiClient* multi_client = nullptr;
+    if (!FLAGS_xrefs_leveldb.empty()) {
+      auto* leveldb_client = new kythe::LevelDBXrefsClient();
+      client.reset(leveldb_client);
+      std::string error_text;
+      if (!leveldb_client->Open(FLAGS_xrefs_leveldb, &error_text)) {
+        ::fprintf(stderr, "%s\n", error_text.c_str());
+        return 1;
+      }
+    } else {
+      kythe::JsonClient::InitNetwork();
+      multi_client = new kythe::XrefsJsonMultiClient(
+          std::unique_ptr<kythe::JsonMultiClient>(
+              new kythe::JsonMultiClient(std::max(1, FLAGS_max_connections))),
+          FLAGS_xrefs);
+      client.reset(multi_client);
+    }
+    std::vector<std::string> paths(argv + 1, argv + argc);
+    if (!FLAGS_path.empty()) {
+      paths.push_back(FLAGS_path);
+    }
+    return kythe::DocumentBatch(client.get(), multi_client, paths);
   } else if (FLAGS_path.empty()) {
     return kythe::DocumentNodesFromStdin();
   } else {
-    kythe::JsonClient::InitNetwork();
-    kythe::XrefsJsonClient client(
-        std::unique_ptr<kythe::JsonClient>(new kythe::JsonClient()),
-        FLAGS_xrefs);
-    auto ticket = kythe::URI::FromString(FLAGS_path);
-    if (!ticket.first) {
-      ticket = kythe::URI::FromString(
-          "kythe://" +
-          kythe::UriEscape(kythe::UriEscapeMode::kEscapePaths, FLAGS_corpus) +
-          "?path=" +
-          kythe::UriEscape(kythe::UriEscapeMode::kEscapePaths, FLAGS_path));
-    }
-    if (!ticket.first) {
-      ::fprintf(stderr, "Couldn't parse URI %s\n", FLAGS_path.c_str());
+    std::unique_ptr<kythe::XrefsClient> client;
+    if (!FLAGS_xrefs_leveldb.empty()) {
+      auto* leveldb_client = new kythe::LevelDBXrefsClient();
+      client.reset(leveldb_client);
+      std::string error_text;
+      if (!leveldb_client->Open(FLAGS_xrefs_leveldb, &error_text)) {
+        ::fprintf(stderr, "%s\n", error_text.c_str());
+        return 1;
+      }
+    } else {
+      kythe::JsonClient::InitNetwork();
+      client.reset(new kythe::XrefsJsonClient(
+          std::unique_ptr<kythe::JsonClient>(new kythe::JsonClient()),
+          FLAGS_xrefs));
+    }
+    kythe::proto::VName file_name;
+    if (!kythe::ParseFileName(FLAGS_path, &file_name)) {
       return 1;
     }
-    return kythe::DocumentNodesFrom(&client, ticket.second.v_name());
+    return kythe::DocumentNodesFrom(client.get(), file_name);
   }
   return 0;
 }
@@ -23,6 +23,8 @@ namespace kythe {
 namespace {
 /// Don't recurse more than this many times when rendering MarkedSource.
 constexpr size_t kMaxRenderDepth = 10;
+/// About how many bytes of tags and CSS classes surround each document.
+constexpr size_t kDocumentOverhead = 512;
 
 /// \brief A RAII class to deal with styled div/span tags.
 class CssTag {
@@ -59,13 +61,13 @@ class CssTag {
   std::string* buffer_;
 };
 
-std::string RenderPrintable(const HtmlRendererOptions& options,
-                            const std::vector<MarkupHandler>& handlers,
-                            const proto::Printable& printable_proto,
-                            Printable::RejectPolicy filter) {
+void RenderPrintable(const HtmlRendererOptions& options,
+                     const std::vector<MarkupHandler>& handlers,
+                     const proto::Printable& printable_proto,
+                     Printable::RejectPolicy filter, std::string* out) {
   Printable printable(printable_proto, filter);
   auto markdoc = HandleMarkup(handlers, printable);
-  return RenderHtml(options, markdoc);
+  RenderHtml(options, markdoc, out);
 }
 
 /// \brief Appends a representation of `c` to `buffer`, possibly using an HTML
@@ -86,67 +88,99 @@ void AppendEscapedHtmlCharacter(std::string* buffer, char c) {
   }
 }
 
-/// \brief Content of a tagged block (e.g., a @param or a @returns).
-struct TaggedText {
-  std::string buffer;
+/// \brief The content of tag blocks (e.g., a @param or a @returns).
+class TagBlocks {
+ public:
+  /// \brief Returns the buffer for the block with ID and ordinal `block`.
+  /// The buffer remains valid until the next call.
+  std::string* block(std::pair<PrintableSpan::TagBlockId, size_t> block) {
+    auto& blocks = blocks_[static_cast<size_t>(block.first)];
+    if (blocks.size() <= block.second) {
+      blocks.resize(block.second + 1);
+    }
+    blocks[block.second].used = true;
+    return &blocks[block.second].text;
+  }
+
+  /// \brief Calls `f(id, text)` for each block that was used, in order of ID
+  /// and then ordinal.
+  template <typename F>
+  void ForEach(F f) const {
+    for (size_t id = 0; id < kIdCount; ++id) {
+      for (const auto& block : blocks_[id]) {
+        if (block.used) {
+          f(static_cast<PrintableSpan::TagBlockId>(id), block.text);
+        }
+      }
+    }
+  }
+
+ private:
+  static constexpr size_t kIdCount =
+      static_cast<size_t>(PrintableSpan::TagBlockId::See) + 1;
+  struct Block {
+    bool used = false;
+    std::string text;
+  };
+  /// Blocks indexed by ID and then by ordinal. Ordinals are usually dense.
+  std::vector<Block> blocks_[kIdCount];
 };
 
-/// \brief A map from tag block IDs and ordinals to their content.
-using TagBlocks =
-    std::map<std::pair<PrintableSpan::TagBlockId, size_t>, TaggedText>;
+constexpr size_t TagBlocks::kIdCount;
 
-/// \brief Renders the content of `tag_blocks` to the block `out`.
+/// \brief Renders the content of `tag_blocks` to `out`.
 void RenderTagBlocks(const HtmlRendererOptions& options,
-                     const TagBlocks& tag_blocks, TaggedText* out) {
+                     const TagBlocks& tag_blocks, std::string* out) {
   bool first_block = true;
   PrintableSpan::TagBlockId block_id;
-  for (const auto& block : tag_blocks) {
-    if (first_block || block_id != block.first.first) {
+  tag_blocks.ForEach([&](PrintableSpan::TagBlockId id,
+                         const std::string& text) {
+    if (first_block || block_id != id) {
       if (!first_block) {
-        out->buffer.append("</ul>");
-        CssTag::CloseTag(CssTag::Kind::Div, &out->buffer);
+        out->append("</ul>");
+        CssTag::CloseTag(CssTag::Kind::Div, out);
       }
-      block_id = block.first.first;
+      block_id = id;
       first_block = false;
       {
         CssTag title(CssTag::Kind::Div, options.tag_section_title_div,
-                     &out->buffer);
-        switch (block.first.first) {
+                     out);
+        switch (id) {
           case PrintableSpan::TagBlockId::Author:
-            out->buffer.append("Author");
+            out->append("Author");
             break;
           case PrintableSpan::TagBlockId::Returns:
-            out->buffer.append("Returns");
+            out->append("Returns");
             break;
           case PrintableSpan::TagBlockId::Since:
-            out->buffer.append("Since");
+            out->append("Since");
             break;
           case PrintableSpan::TagBlockId::Version:
-            out->buffer.append("Version");
+            out->append("Version");
             break;
           case PrintableSpan::TagBlockId::Throws:
-            out->buffer.append("Throws");
+            out->append("Throws");
             break;
           case PrintableSpan::TagBlockId::Param:
-            out->buffer.append("Parameter");
+            out->append("Parameter");
             break;
           case PrintableSpan::TagBlockId::See:
-            out->buffer.append("See");
+            out->append("See");
             break;
         }
       }
       CssTag::OpenTag(CssTag::Kind::Div, options.tag_section_content_div,
-                      &out->buffer);
-      out->buffer.append("<ul>");
+                      out);
+      out->append("<ul>");
     }
-    out->buffer.append("<li>");
-    out->buffer.append(block.second.buffer);
-    out->buffer.append("</li>");
-  }
+    out->append("<li>");
+    out->append(text);
+    out->append("</li>");
+  });
   if (!first_block) {
     // We've opened a ul and a div that we need to close.
-    out->buffer.append("</ul>");
-    CssTag::CloseTag(CssTag::Kind::Div, &out->buffer);
+    out->append("</ul>");
+    CssTag::CloseTag(CssTag::Kind::Div, out);
   }
 }
 
@@ -182,14 +216,17 @@ void AppendEscapedHtmlString(const SourceString& source, std::string* dest) {
 /// Target buffer for RenderSimpleIdentifier.
 class RenderSimpleIdentifierTarget {
  public:
+  /// \param buffer The buffer to append to. Must outlive this target.
+  explicit RenderSimpleIdentifierTarget(std::string* buffer)
+      : buffer_(buffer), start_(buffer->size()) {}
   /// \brief Escapes and appends `source` to the buffer.
   template <typename SourceString>
   void Append(const SourceString& source) {
     if (!prepend_buffer_.empty() && !source.empty()) {
-      AppendEscapedHtmlString(prepend_buffer_, &buffer_);
+      AppendEscapedHtmlString(prepend_buffer_, buffer_);
       prepend_buffer_.clear();
     }
-    AppendEscapedHtmlString(source, &buffer_);
+    AppendEscapedHtmlString(source, buffer_);
   }
   /// \brief Escapes and adds `source` before the (non-empty) text that would
   /// be added by the next call to `Append`.
@@ -197,19 +234,21 @@ class RenderSimpleIdentifierTarget {
   void AppendFinalListToken(const SourceString& source) {
     prepend_buffer_.append(std::string(source));
   }
-  const std::string buffer() const { return buffer_; }
-  void AppendRaw(const std::string& text) { buffer_.append(text); }
-  /// \brief Make sure that there's a space between the current content of the
-  /// buffer and whatever is appended to it later on.
+  std::string* buffer() const { return buffer_; }
+  void AppendRaw(const std::string& text) { buffer_->append(text); }
+  /// \brief Make sure that there's a space between the text appended by this
+  /// target and whatever is appended to it later on.
   void AppendHeuristicSpace() {
-    if (!buffer_.empty() && buffer_[buffer_.size() - 1] != ' ') {
+    if (buffer_->size() != start_ && buffer_->back() != ' ') {
       prepend_buffer_.push_back(' ');
     }
   }
 
  private:
   /// The buffer used to hold escaped data.
-  std::string buffer_;
+  std::string* buffer_;
+  /// The size of `buffer_` when this target was made.
+  size_t start_;
   /// Unescaped text that should be escaped and appended before any other text
   /// is appended to `buffer_`.
   std::string prepend_buffer_;
@@ -304,13 +343,12 @@ void RenderSimpleIdentifier(const proto::common::MarkedSource& sig,
       out->AppendRaw(link_text);
       out->AppendRaw("\" title=\"");
       {
-        RenderSimpleIdentifierTarget target;
+        RenderSimpleIdentifierTarget target(out->buffer());
         RenderSimpleIdentifierState state;
         state.render_identifier = true;
         state.render_context = true;
         state.render_types = true;
         RenderSimpleIdentifier(sig, &target, state, 0);
-        out->AppendRaw(target.buffer());
       }
       out->AppendRaw("\">");
       has_open_link = true;
@@ -354,17 +392,29 @@ void RenderSimpleParams(const proto::common::MarkedSource& sig,
     case proto::common::MarkedSource::PARAMETER:
       for (const auto& child : sig.child()) {
         out->emplace_back();
-        RenderSimpleIdentifierTarget target;
+        RenderSimpleIdentifierTarget target(&out->back());
         RenderSimpleIdentifierState state;
         state.render_identifier = true;
         RenderSimpleIdentifier(child, &target, state, depth + 1);
-        out->back().append(target.buffer());
       }
       break;
     default:
       break;
   }
 }
+
+size_t EstimateMarkedSourceSize(const proto::common::MarkedSource& sig,
+                                size_t depth) {
+  if (depth >= kMaxRenderDepth) {
+    return 0;
+  }
+  size_t size = sig.pre_text().size() + sig.post_text().size() +
+                sig.post_child_text().size() * sig.child_size();
+  for (const auto& child : sig.child()) {
+    size += EstimateMarkedSourceSize(child, depth + 1);
+  }
+  return size;
+}
 }  // anonymous namespace
 
 const proto::common::NodeInfo* DocumentHtmlRendererOptions::node_info(
@@ -380,10 +430,10 @@ const proto::Anchor* DocumentHtmlRendererOptions::anchor_for_ticket(
                                                           : &anchor->second;
 }
 
-std::string RenderSignature(const HtmlRendererOptions& options,
-                            const proto::common::MarkedSource& sig,
-                            bool linkify) {
-  RenderSimpleIdentifierTarget target;
+void RenderSignature(const HtmlRendererOptions& options,
+                     const proto::common::MarkedSource& sig, bool linkify,
+                     std::string* out) {
+  RenderSimpleIdentifierTarget target(out);
   RenderSimpleIdentifierState state;
   state.render_identifier = true;
   state.render_types = true;
@@ -391,33 +441,43 @@ std::string RenderSignature(const HtmlRendererOptions& options,
   state.linkify = linkify;
   state.options = &options;
   RenderSimpleIdentifier(sig, &target, state, 0);
-  return target.buffer();
+}
+
+std::string RenderSignature(const HtmlRendererOptions& options,
+                            const proto::common::MarkedSource& sig,
+                            bool linkify) {
+  std::string result;
+  RenderSignature(options, sig, linkify, &result);
+  return result;
 }
 
 std::string RenderSimpleIdentifier(const proto::common::MarkedSource& sig) {
-  RenderSimpleIdentifierTarget target;
+  std::string result;
+  RenderSimpleIdentifierTarget target(&result);
   RenderSimpleIdentifierState state;
   state.render_identifier = true;
   RenderSimpleIdentifier(sig, &target, state, 0);
-  return target.buffer();
+  return result;
 }
 
 std::string RenderSimpleQualifiedName(const proto::common::MarkedSource& sig,
                                       bool include_identifier) {
-  RenderSimpleIdentifierTarget target;
+  std::string result;
+  RenderSimpleIdentifierTarget target(&result);
   RenderSimpleIdentifierState state;
   state.render_identifier = include_identifier;
   state.render_context = true;
   RenderSimpleIdentifier(sig, &target, state, 0);
-  return target.buffer();
+  return result;
 }
 
 std::string RenderInitializer(const proto::common::MarkedSource& sig) {
-  RenderSimpleIdentifierTarget target;
+  std::string result;
+  RenderSimpleIdentifierTarget target(&result);
   RenderSimpleIdentifierState state;
   state.render_initializer = true;
   RenderSimpleIdentifier(sig, &target, state, 0);
-  return target.buffer();
+  return result;
 }
 
 std::vector<std::string> RenderSimpleParams(
@@ -427,8 +487,8 @@ std::vector<std::string> RenderSimpleParams(
   return result;
 }
 
-std::string RenderHtml(const HtmlRendererOptions& options,
-                       const Printable& printable) {
+void RenderHtml(const HtmlRendererOptions& options, const Printable& printable,
+                std::string* main_text) {
   struct OpenSpan {
     const PrintableSpan* span;
     bool valid;
@@ -441,18 +501,18 @@ std::string RenderHtml(const HtmlRendererOptions& options,
   // currently in a <pre> context. This does not affect escaping, since
   // tags can appear in a <pre>.
   std::stack<FormatState> format_states;
-  // Elements on `open_tags` point to values of `tag_blocks`. The element on
+  // Elements on `open_tags` name blocks in `tag_blocks`. The element on
   // top of the stack is the tag block whose buffer we're currently appending
   // data to (if any). This stack should usually have one or zero elements,
   // given the syntactic restrictions of the markup languages we're translating
   // from.
-  std::stack<TaggedText*> open_tags;
-  std::map<std::pair<PrintableSpan::TagBlockId, size_t>, TaggedText> tag_blocks;
-  TaggedText main_text;
-  // `out` points to either `main_text` if `open_tags` is empty or a value of
-  // `tag_blocks` (particularly, the one referenced by the top of `open_tags`)
-  // if the stack is non-empty.
-  TaggedText* out = &main_text;
+  std::stack<std::pair<PrintableSpan::TagBlockId, size_t>> open_tags;
+  TagBlocks tag_blocks;
+  // `out` points to either `main_text` if `open_tags` is empty or a buffer in
+  // `tag_blocks` (particularly, the one named by the top of `open_tags`)
+  // if the stack is non-empty. It's looked up again whenever the top changes,
+  // since opening a block may move the others.
+  std::string* out = main_text;
   PrintableSpan default_span(0, printable.text().size(),
                              PrintableSpan::Semantic::Raw);
   open_spans.push(OpenSpan{&default_span, true});
@@ -467,41 +527,42 @@ std::string RenderHtml(const HtmlRendererOptions& options,
           if (!open_tags.empty()) {
             open_tags.pop();
           }
-          out = open_tags.empty() ? &main_text : open_tags.top();
+          out = open_tags.empty() ? main_text
+                                  : tag_blocks.block(open_tags.top());
         } break;
         case PrintableSpan::Semantic::UriLink:
-          out->buffer.append("</a>");
+          out->append("</a>");
           break;
         case PrintableSpan::Semantic::Uri:
-          out->buffer.append("\">");
+          out->append("\">");
           break;
         case PrintableSpan::Semantic::Link:
           if (open_spans.top().valid) {
-            out->buffer.append("</a>");
+            out->append("</a>");
           }
           break;
         case PrintableSpan::Semantic::CodeRef:
-          out->buffer.append("</tt>");
+          out->append("</tt>");
           break;
         case PrintableSpan::Semantic::Paragraph:
-          out->buffer.append("</p>");
+          out->append("</p>");
           break;
         case PrintableSpan::Semantic::ListItem:
-          out->buffer.append("</li>");
+          out->append("</li>");
           break;
         case PrintableSpan::Semantic::UnorderedList:
-          out->buffer.append("</ul>");
+          out->append("</ul>");
           break;
         case PrintableSpan::Semantic::Styled:
-          out->buffer.append("</");
-          out->buffer.append(TagNameForStyle(open_spans.top().span->style()));
-          out->buffer.append(">");
+          out->append("</");
+          out->append(TagNameForStyle(open_spans.top().span->style()));
+          out->append(">");
           break;
         case PrintableSpan::Semantic::CodeBlock:
           if (!format_states.empty()) {
             format_states.pop();
             if (!format_states.empty() && !format_states.top().in_pre_block) {
-              out->buffer.append("</pre>");
+              out->append("</pre>");
             }
           }
           break;
@@ -522,14 +583,14 @@ std::string RenderHtml(const HtmlRendererOptions& options,
       switch (open_spans.top().span->semantic()) {
         case PrintableSpan::Semantic::TagBlock: {
           auto block = open_spans.top().span->tag_block();
-          out = &tag_blocks[block];
-          open_tags.push(out);
+          out = tag_blocks.block(block);
+          open_tags.push(block);
         } break;
         case PrintableSpan::Semantic::UriLink:
-          out->buffer.append("<a ");
+          out->append("<a ");
           break;
         case PrintableSpan::Semantic::Uri:
-          out->buffer.append("href=\"");
+          out->append("href=\"");
           break;
         case PrintableSpan::Semantic::Link:
           open_spans.top().valid = false;  // Invalid until proven otherwise.
@@ -541,43 +602,43 @@ std::string RenderHtml(const HtmlRendererOptions& options,
                 if (const auto* def_anchor =
                         options.anchor_for_ticket(def_info->definition())) {
                   open_spans.top().valid = true;
-                  out->buffer.append("<a href=\"");
+                  out->append("<a href=\"");
                   auto link_uri =
                       options.make_semantic_link_uri(*def_anchor, definition);
                   if (link_uri.empty()) {
                     link_uri = options.make_link_uri(*def_anchor);
                   }
                   // + 2 for the closing ">.
-                  out->buffer.reserve(out->buffer.size() + link_uri.size() + 2);
+                  out->reserve(out->size() + link_uri.size() + 2);
                   for (auto c : link_uri) {
-                    AppendEscapedHtmlCharacter(&out->buffer, c);
+                    AppendEscapedHtmlCharacter(out, c);
                   }
-                  out->buffer.append("\">");
+                  out->append("\">");
                 }
               }
             }
           }
           break;
         case PrintableSpan::Semantic::CodeRef:
-          out->buffer.append("<tt>");
+          out->append("<tt>");
           break;
         case PrintableSpan::Semantic::Paragraph:
-          out->buffer.append("<p>");
+          out->append("<p>");
           break;
         case PrintableSpan::Semantic::ListItem:
-          out->buffer.append("<li>");
+          out->append("<li>");
           break;
         case PrintableSpan::Semantic::UnorderedList:
-          out->buffer.append("<ul>");
+          out->append("<ul>");
           break;
         case PrintableSpan::Semantic::Styled:
-          out->buffer.append("<");
-          out->buffer.append(TagNameForStyle(open_spans.top().span->style()));
-          out->buffer.append(">");
+          out->append("<");
+          out->append(TagNameForStyle(open_spans.top().span->style()));
+          out->append(">");
           break;
         case PrintableSpan::Semantic::CodeBlock:
           if (!format_states.empty() && !format_states.top().in_pre_block) {
-            out->buffer.append("<pre>");
+            out->append("<pre>");
           }
           format_states.push(FormatState{true});
           break;
@@ -586,22 +647,39 @@ std::string RenderHtml(const HtmlRendererOptions& options,
       }
     }
     if (open_spans.top().span->semantic() == PrintableSpan::Semantic::Escaped) {
-      out->buffer.push_back(printable.text()[i]);
+      out->push_back(printable.text()[i]);
     } else if (open_spans.top().span->semantic() !=
                PrintableSpan::Semantic::Markup) {
       char c = printable.text()[i];
-      AppendEscapedHtmlCharacter(&out->buffer, c);
+      AppendEscapedHtmlCharacter(out, c);
     }
   }
   RenderTagBlocks(options, tag_blocks, out);
-  return out->buffer;
 }
 
-std::string RenderDocument(
-    const HtmlRendererOptions& options,
-    const std::vector<MarkupHandler>& handlers,
+std::string RenderHtml(const HtmlRendererOptions& options,
+                       const Printable& printable) {
+  std::string result;
+  result.reserve(printable.text().size());
+  RenderHtml(options, printable, &result);
+  return result;
+}
+
+size_t EstimateRenderedSize(
     const proto::DocumentationReply::Document& document) {
-  std::string text_out;
+  size_t size = kDocumentOverhead + document.text().raw_text().size() +
+                2 * EstimateMarkedSourceSize(document.marked_source(), 0);
+  for (const auto& child : document.children()) {
+    size += EstimateRenderedSize(child);
+  }
+  return size;
+}
+
+void RenderDocument(const HtmlRendererOptions& options,
+                    const std::vector<MarkupHandler>& handlers,
+                    const proto::DocumentationReply::Document& document,
+                    std::string* out) {
+  std::string& text_out = *out;
   {
     CssTag root(CssTag::Kind::Div, options.doc_div, &text_out);
     {
@@ -609,8 +687,7 @@ std::string RenderDocument(
       {
         CssTag type_div(CssTag::Kind::Div, options.type_name_div, &text_out);
         CssTag type_name(CssTag::Kind::Span, options.name_span, &text_out);
-        text_out.append(
-            RenderSignature(options, document.marked_source(), true));
+        RenderSignature(options, document.marked_source(), true, &text_out);
       }
       {
         CssTag detail_div(CssTag::Kind::Div, options.sig_detail_div, &text_out);
@@ -661,13 +738,22 @@ std::string RenderDocument(
     }
     {
       CssTag content_div(CssTag::Kind::Div, options.content_div, &text_out);
-      text_out.append(RenderPrintable(options, handlers, document.text(),
-                                      Printable::IncludeAll));
+      RenderPrintable(options, handlers, document.text(),
+                      Printable::IncludeAll, &text_out);
     }
     for (const auto& child : document.children()) {
-      text_out.append(RenderDocument(options, handlers, child));
+      RenderDocument(options, handlers, child, &text_out);
     }
   }
+}
+
+std::string RenderDocument(
+    const HtmlRendererOptions& options,
+    const std::vector<MarkupHandler>& handlers,
+    const proto::DocumentationReply::Document& document) {
+  std::string text_out;
+  text_out.reserve(EstimateRenderedSize(document));
+  RenderDocument(options, handlers, document, &text_out);
   return text_out;
 }
 
@@ -106,12 +106,32 @@ class DocumentHtmlRendererOptions : public HtmlRendererOptions {
 std::string RenderHtml(const HtmlRendererOptions& options,
                        const Printable& printable);
 
+/// \brief Render `printable` as HTML according to `options`, appending the
+/// result to `out`.
+void RenderHtml(const HtmlRendererOptions& options, const Printable& printable,
+                std::string* out);
+
 /// \brief Render `document` as HTML according to `options`, using `handlers` to
 /// process markup.
 std::string RenderDocument(const HtmlRendererOptions& options,
                            const std::vector<MarkupHandler>& handlers,
                            const proto::DocumentationReply::Document& document);
 
+/// \brief Render `document` as HTML according to `options`, using `handlers` to
+/// process markup, appending the result to `out`.
+///
+/// Nothing is rendered into temporary strings that scale with the size of
+/// `document`, so callers rendering many documents can `reserve` once (using
+/// `EstimateRenderedSize`) and render them all into one buffer.
+void RenderDocument(const HtmlRendererOptions& options,
+                    const std::vector<MarkupHandler>& handlers,
+                    const proto::DocumentationReply::Document& document,
+                    std::string* out);
+
+/// \return about how many bytes `RenderDocument` will produce for `document`.
+size_t EstimateRenderedSize(
+    const proto::DocumentationReply::Document& document);
+
 /// \brief Extract and render the simple identifiers for parameters in `sig`.
 std::vector<std::string> RenderSimpleParams(
     const proto::common::MarkedSource& sig);
@@ -136,6 +156,11 @@ std::string RenderSignature(const HtmlRendererOptions& options,
                             const proto::common::MarkedSource& sig,
                             bool linkify);
 
+/// \brief Render `sig` as a full signature, appending the result to `out`.
+void RenderSignature(const HtmlRendererOptions& options,
+                     const proto::common::MarkedSource& sig, bool linkify,
+                     std::string* out);
+
 }  // namespace kythe
 
 #endif
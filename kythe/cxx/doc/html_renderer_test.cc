@@ -164,6 +164,17 @@ TEST_F(HtmlRendererTest, JavadocTagBlocks) {
 @author a
 @author b)"));
 }
+TEST_F(HtmlRendererTest, JavadocTagBlocksAreOrderedByKind) {
+  EXPECT_EQ(
+      "text\n<div class=\"kythe-doc-tag-section-title\">Author</div>"
+      "<div class=\"kythe-doc-tag-section-content\"><ul><li> a</li></ul></div>"
+      "<div class=\"kythe-doc-tag-section-title\">Returns</div>"
+      "<div class=\"kythe-doc-tag-section-content\"><ul><li> r\n</li></ul>"
+      "</div>",
+      RenderJavadoc(R"(text
+@return r
+@author a)"));
+}
 TEST_F(HtmlRendererTest, JavadocTagBlockEmbedsCodeRef) {
   EXPECT_EQ(
       "text\n<div class=\"kythe-doc-tag-section-title\">Author</div>"
@@ -323,6 +334,35 @@ TEST_F(HtmlRendererTest, RenderSimpleQualifiedName) {
   EXPECT_EQ("namespace::(anonymous namespace)::ClassContainer::FunctionName",
             kythe::RenderSimpleQualifiedName(marked, true));
 }
+TEST_F(HtmlRendererTest, RenderSignatureAppends) {
+  proto::common::MarkedSource marked;
+  ASSERT_TRUE(TextFormat::ParseFromString(kSampleMarkedSource, &marked))
+      << "(invalid ascii protobuf)";
+  std::string out = "<span>";
+  kythe::RenderSignature(options_, marked, false, &out);
+  EXPECT_EQ("<span>" + kythe::RenderSignature(options_, marked, false), out);
+}
+TEST_F(HtmlRendererTest, RenderDocumentAppends) {
+  proto::DocumentationReply::Document document;
+  ASSERT_TRUE(TextFormat::ParseFromString(R"(
+      text {
+        raw_text: "Hello, [world]! @return nothing"
+        link: { definition: "kythe://foo" }
+      }
+      children { text { raw_text: "child" } }
+  )",
+                                          &document));
+  ASSERT_TRUE(TextFormat::ParseFromString(kSampleMarkedSource,
+                                          document.mutable_marked_source()));
+  std::string expected =
+      kythe::RenderDocument(options_, {ParseJavadoxygen}, document);
+  EXPECT_NE(std::string::npos, expected.find("kythe://foop"));
+  EXPECT_NE(std::string::npos, expected.find("child"));
+  std::string out = "prefix";
+  kythe::RenderDocument(options_, {ParseJavadoxygen}, document, &out);
+  EXPECT_EQ("prefix" + expected, out);
+  EXPECT_LE(expected.size(), kythe::EstimateRenderedSize(document));
+}
 }  // anonymous namespace
 }  // namespace kythe
 
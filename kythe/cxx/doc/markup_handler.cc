@@ -15,19 +15,49 @@
  */
 
 #include <algorithm>
+#include <iterator>
 #include <stack>
+#include <utility>
 
 #include "kythe/cxx/doc/markup_handler.h"
 
 namespace kythe {
 
-void PrintableSpans::Merge(const PrintableSpans& o) {
-  spans_.insert(spans_.end(), o.spans_.begin(), o.spans_.end());
-  spans_.erase(
-      std::remove_if(spans_.begin(), spans_.end(),
+namespace {
+/// \brief Drops empty or negative-length spans from `spans` and sorts the
+/// rest. Spans are usually emitted nearly in order, so this checks first.
+void SortValidSpans(std::vector<PrintableSpan>* spans) {
+  spans->erase(
+      std::remove_if(spans->begin(), spans->end(),
                      [](const PrintableSpan& s) { return !s.is_valid(); }),
-      spans_.end());
-  std::sort(spans_.begin(), spans_.end());
+      spans->end());
+  if (!std::is_sorted(spans->begin(), spans->end())) {
+    std::sort(spans->begin(), spans->end());
+  }
+}
+}  // anonymous namespace
+
+void PrintableSpans::Merge(const PrintableSpans& o) {
+  PrintableSpans more = o;
+  Merge(std::move(more));
+}
+
+void PrintableSpans::Merge(PrintableSpans&& o) {
+  // Sorting only `o` and merging keeps repeated merges (one per markup
+  // handler) linear in the number of spans already stored.
+  SortValidSpans(&spans_);
+  SortValidSpans(&o.spans_);
+  if (o.spans_.empty()) {
+    return;
+  }
+  std::vector<PrintableSpan> merged;
+  merged.reserve(spans_.size() + o.spans_.size());
+  std::merge(std::make_move_iterator(spans_.begin()),
+             std::make_move_iterator(spans_.end()),
+             std::make_move_iterator(o.spans_.begin()),
+             std::make_move_iterator(o.spans_.end()),
+             std::back_inserter(merged));
+  spans_.swap(merged);
 }
 
 namespace {
@@ -122,7 +152,7 @@ Printable HandleMarkup(const std::vector<MarkupHandler>& handlers,
   for (const auto& handler : handlers) {
     PrintableSpans next_spans;
     handler(printable, spans, &next_spans);
-    spans.Merge(next_spans);
+    spans.Merge(std::move(next_spans));
   }
   return Printable(printable.text(), std::move(spans));
 }
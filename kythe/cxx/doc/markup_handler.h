@@ -102,6 +102,10 @@ class PrintableSpans {
   /// \brief Insert all spans from `more`.
   /// Empty or negative-length spans are discarded.
   void Merge(const PrintableSpans& more);
+  /// \brief Insert all spans from `more`, reusing its storage.
+  /// Empty or negative-length spans are discarded. This takes time linear in
+  /// the number of stored spans (plus the time to sort `more`).
+  void Merge(PrintableSpans&& more);
   /// Construct a span and insert it.
   template <typename... T> void Emplace(T&&... span_args) {
     spans_.emplace_back(span_args...);
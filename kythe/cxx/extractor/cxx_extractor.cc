@@ -39,9 +39,13 @@
 #include "kythe/cxx/common/language.h"
 #include "kythe/cxx/common/path_utils.h"
 #include "kythe/cxx/common/proto_conversions.h"
+#include "kythe/cxx/common/segmented_index_pack.h"
+#include "kythe/cxx/extractor/transcript_hash.h"
 #include "kythe/proto/analysis.pb.h"
 #include "kythe/proto/buildinfo.pb.h"
 #include "kythe/proto/cxx.pb.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/MemoryBuffer.h"
 #include "llvm/Support/Path.h"
 #include "llvm/Support/TargetSelect.h"
 #include "third_party/llvm/src/clang_builtin_headers.h"
@@ -68,20 +72,16 @@ std::string LowercaseStringHexEncodeSha(
   return sha_text;
 }
 
-/// \brief A SHA-256 hash accumulator.
+/// \brief Accumulates the preprocessor events that make up a transcript.
 class RunningHash {
  public:
-  RunningHash() { ::SHA256_Init(&sha_context_); }
   /// \brief Update the hash.
   /// \param bytes Start of the memory to use to update.
   /// \param length Number of bytes to read.
-  void Update(const void* bytes, size_t length) {
-    ::SHA256_Update(&sha_context_,
-                    reinterpret_cast<const unsigned char*>(bytes), length);
-  }
+  void Update(const void* bytes, size_t length) { hash_.Update(bytes, length); }
   /// \brief Update the hash with a string.
   /// \param string The string to include in the hash.
-  void Update(llvm::StringRef string) { Update(string.data(), string.size()); }
+  void Update(llvm::StringRef string) { hash_.Update(string); }
   /// \brief Update the hash with a `ConditionValueKind`.
   /// \param cvk The enumerator to include in the hash.
   void Update(clang::PPCallbacks::ConditionValueKind cvk) {
@@ -106,17 +106,12 @@ class RunningHash {
   }
   /// \brief Update the hash with some unsigned integer.
   /// \param u The unsigned integer to include in the hash.
-  void Update(unsigned u) { Update(&u, sizeof(u)); }
+  void Update(unsigned u) { hash_.Update(u); }
   /// \brief Return the hash up to this point and reset internal state.
-  std::string CompleteAndReset() {
-    unsigned char sha_buf[SHA256_DIGEST_LENGTH];
-    ::SHA256_Final(sha_buf, &sha_context_);
-    ::SHA256_Init(&sha_context_);
-    return LowercaseStringHexEncodeSha(sha_buf);
-  }
+  std::string CompleteAndReset() { return hash_.CompleteAndReset(); }
 
  private:
-  ::SHA256_CTX sha_context_;
+  TranscriptHash hash_;
 };
 
 /// \brief Returns the lowercase-string-hex-encoded sha256 digest of the first
@@ -138,6 +133,7 @@ struct ExtractorState {
   std::string* main_source_file_transcript;
   std::unordered_map<std::string, SourceFile>* source_files;
   std::string* main_source_file_stdin_alternate;
+  std::map<std::string, HeaderSearchInfo::Resolution>* include_resolutions;
 };
 
 /// \brief The state we've accumulated within a particular file.
@@ -292,6 +288,20 @@ class ExtractorPPCallbacks : public clang::PPCallbacks {
   std::string FixStdinPath(const clang::FileEntry* file,
                            const std::string& path);
 
+  /// \brief Records how an `#include` that found `path` was resolved, if it
+  /// was found in a way that doesn't depend on where the `#include` was.
+  ///
+  /// Only files found on the angled or system search paths qualify: any
+  /// other `#include` of the same name that searches that far must find the
+  /// same file. Files found relative to an includer or by `#include_next`
+  /// depend on the includer, so these aren't recorded. Names that resolve
+  /// to different files are recorded with empty paths.
+  void RecordIncludeResolution(const clang::Token& include_token,
+                               llvm::StringRef file_name,
+                               llvm::StringRef search_path,
+                               llvm::StringRef relative_path,
+                               const std::string& path);
+
   /// The `SourceManager` used for the compilation.
   clang::SourceManager* source_manager_;
   /// The `Preprocessor` we're attached to.
@@ -313,6 +323,11 @@ class ExtractorPPCallbacks : public clang::PPCallbacks {
   /// Non-empty if the main source file was stdin ("-") and we have chosen
   /// a new name for it.
   std::string* main_source_file_stdin_alternate_;
+  /// Maps `FileID` hash values to the concatenated VName fields that
+  /// `RecordSpecificLocation` adds to the history for locations in them.
+  std::unordered_map<unsigned, std::string> location_vnames_;
+  /// Names found on the search paths and what they resolved to.
+  std::map<std::string, HeaderSearchInfo::Resolution>* include_resolutions_;
 };
 
 ExtractorPPCallbacks::ExtractorPPCallbacks(ExtractorState state)
@@ -322,7 +337,8 @@ ExtractorPPCallbacks::ExtractorPPCallbacks(ExtractorState state)
       source_files_(state.source_files),
       index_writer_(state.index_writer),
       main_source_file_stdin_alternate_(
-          state.main_source_file_stdin_alternate) {
+          state.main_source_file_stdin_alternate),
+      include_resolutions_(state.include_resolutions) {
   class ClaimPragmaHandlerWrapper : public clang::PragmaHandler {
    public:
     ClaimPragmaHandlerWrapper(ExtractorPPCallbacks* context)
@@ -435,12 +451,13 @@ void ExtractorPPCallbacks::AddFile(const clang::FileEntry* file,
                                    const std::string& in_path) {
   std::string path = FixStdinPath(file, in_path);
   auto contents =
-      source_files_->insert(std::make_pair(in_path, SourceFile{std::string()}));
+      source_files_->insert(std::make_pair(in_path, SourceFile()));
   if (contents.second) {
     const llvm::MemoryBuffer* buffer =
         source_manager_->getMemoryBufferForFile(file);
-    contents.first->second.file_content.assign(buffer->getBufferStart(),
-                                               buffer->getBufferEnd());
+    contents.first->second.file_content = buffer->getBuffer();
+    contents.first->second.digest = index_writer_->DigestFor(
+        file, contents.first->second.file_content);
     contents.first->second.vname.CopyFrom(index_writer_->VNameForPath(
         RelativizePath(path, index_writer_->root_directory())));
     VLOG(1) << "added content for " << path << ": mapped to "
@@ -476,7 +493,7 @@ void ExtractorPPCallbacks::MacroExpands(
   }
   if (macro_name.getLocation().isFileID()) {
     llvm::StringRef macro_name_string =
-        macro_name.getIdentifierInfo()->getName().str();
+        macro_name.getIdentifierInfo()->getName();
     RecordMacroExpansion(
         macro_name.getLocation(),
         getMacroUnexpandedString(range, *preprocessor_, macro_name_string,
@@ -498,25 +515,37 @@ void ExtractorPPCallbacks::Defined(
 }
 
 void ExtractorPPCallbacks::RecordSpecificLocation(clang::SourceLocation loc) {
-  if (loc.isValid() && loc.isFileID() &&
-      source_manager_->getFileID(loc) != preprocessor_->getPredefinesFileID()) {
-    history()->Update(source_manager_->getFileOffset(loc));
-    const auto filename_ref = source_manager_->getFilename(loc);
-    const auto* file_ref =
-        source_manager_->getFileEntryForID(source_manager_->getFileID(loc));
-    if (file_ref) {
-      auto vname = index_writer_->VNameForPath(
-          RelativizePath(FixStdinPath(file_ref, filename_ref),
-                         index_writer_->root_directory()));
-      history()->Update(ToStringRef(vname.signature()));
-      history()->Update(ToStringRef(vname.corpus()));
-      history()->Update(ToStringRef(vname.root()));
-      history()->Update(ToStringRef(vname.path()));
-      history()->Update(ToStringRef(vname.language()));
-    } else {
-      LOG(WARNING) << "No FileRef for " << filename_ref.str() << " (location "
-                   << loc.printToString(*source_manager_) << ")";
-    }
+  if (!loc.isValid() || !loc.isFileID()) {
+    return;
+  }
+  const clang::FileID file_id = source_manager_->getFileID(loc);
+  if (file_id == preprocessor_->getPredefinesFileID()) {
+    return;
+  }
+  history()->Update(source_manager_->getFileOffset(loc));
+  // Macro-heavy code records the same few files over and over, so we only
+  // look up each file's VName once.
+  auto cached = location_vnames_.find(file_id.getHashValue());
+  if (cached != location_vnames_.end()) {
+    history()->Update(cached->second);
+    return;
+  }
+  const auto filename_ref = source_manager_->getFilename(loc);
+  const auto* file_ref = source_manager_->getFileEntryForID(file_id);
+  if (file_ref) {
+    auto vname = index_writer_->VNameForPath(
+        RelativizePath(FixStdinPath(file_ref, filename_ref),
+                       index_writer_->root_directory()));
+    std::string& record = location_vnames_[file_id.getHashValue()];
+    record.append(vname.signature());
+    record.append(vname.corpus());
+    record.append(vname.root());
+    record.append(vname.path());
+    record.append(vname.language());
+    history()->Update(record);
+  } else {
+    LOG(WARNING) << "No FileRef for " << filename_ref.str() << " (location "
+                 << loc.printToString(*source_manager_) << ")";
   }
 }
 
@@ -528,7 +557,7 @@ void ExtractorPPCallbacks::MacroDefined(
     return;
   }
   llvm::StringRef macro_name_string =
-      macro_name.getIdentifierInfo()->getName().str();
+      macro_name.getIdentifierInfo()->getName();
   history()->Update(source_manager_->getFileOffset(macro_location));
   history()->Update(macro_name_string);
 }
@@ -541,7 +570,7 @@ void ExtractorPPCallbacks::MacroUndefined(
     return;
   }
   llvm::StringRef macro_name_string =
-      macro_name.getIdentifierInfo()->getName().str();
+      macro_name.getIdentifierInfo()->getName();
   history()->Update(source_manager_->getFileOffset(macro_location));
   if (macro_definition) {
     // We don't just care that a macro was undefined; we care that
@@ -584,7 +613,7 @@ void ExtractorPPCallbacks::Ifdef(
                   macro_definition
                       ? clang::PPCallbacks::ConditionValueKind::CVK_True
                       : clang::PPCallbacks::ConditionValueKind::CVK_False,
-                  macro_name.getIdentifierInfo()->getName().str());
+                  macro_name.getIdentifierInfo()->getName());
 }
 
 void ExtractorPPCallbacks::Ifndef(
@@ -594,7 +623,7 @@ void ExtractorPPCallbacks::Ifndef(
                   macro_definition
                       ? clang::PPCallbacks::ConditionValueKind::CVK_False
                       : clang::PPCallbacks::ConditionValueKind::CVK_True,
-                  macro_name.getIdentifierInfo()->getName().str());
+                  macro_name.getIdentifierInfo()->getName());
 }
 
 std::string IncludeDirGroupToString(const clang::frontend::IncludeDirGroup& G) {
@@ -660,6 +689,49 @@ void ExtractorPPCallbacks::InclusionDirective(
   last_inclusion_directive_path_ =
       AddFile(File, FileName, SearchPath, RelativePath);
   last_inclusion_offset_ = source_manager_->getFileOffset(HashLoc);
+  RecordIncludeResolution(IncludeTok, FileName, SearchPath, RelativePath,
+                          last_inclusion_directive_path_);
+}
+
+void ExtractorPPCallbacks::RecordIncludeResolution(
+    const clang::Token& include_token, llvm::StringRef file_name,
+    llvm::StringRef search_path, llvm::StringRef relative_path,
+    const std::string& path) {
+  // MSVC-compatible lookups search the directories of every includer.
+  const auto* directive = include_token.getIdentifierInfo();
+  if (directive == nullptr ||
+      directive->getPPKeywordID() == clang::tok::pp_include_next ||
+      search_path.empty() || relative_path != file_name ||
+      preprocessor_->getLangOpts().MSVCCompat) {
+    return;
+  }
+  auto& file_manager = source_manager_->getFileManager();
+  const auto* search_path_entry = file_manager.getDirectory(search_path);
+  if (search_path_entry == nullptr ||
+      search_path_entry ==
+          file_manager.getFile(current_files_.top().file_path)->getDir()) {
+    return;
+  }
+  const auto& header_search = preprocessor_->getHeaderSearchInfo();
+  bool angled = false;
+  for (auto dir = header_search.search_dir_begin(),
+            end = header_search.search_dir_end();
+       dir != end; ++dir) {
+    angled = angled || dir == header_search.angled_dir_begin();
+    if (dir->getLookupType() != clang::DirectoryLookup::LT_NormalDir ||
+        dir->getDir() != search_path_entry) {
+      continue;
+    }
+    if (angled) {
+      auto inserted = include_resolutions_->emplace(
+          file_name, HeaderSearchInfo::Resolution{
+                         path, dir->getDirCharacteristic()});
+      if (!inserted.second && inserted.first->second.path != path) {
+        inserted.first->second.path.clear();
+      }
+    }
+    return;
+  }
 }
 
 std::string ExtractorPPCallbacks::AddFile(const clang::FileEntry* file,
@@ -752,7 +824,8 @@ class ExtractorAction : public clang::PreprocessorFrontendAction {
         llvm::make_unique<ExtractorPPCallbacks>(ExtractorState{
             index_writer_, &getCompilerInstance().getSourceManager(),
             preprocessor, &main_source_file_, &main_source_file_transcript_,
-            &source_files_, &main_source_file_stdin_alternate_}));
+            &source_files_, &main_source_file_stdin_alternate_,
+            &include_resolutions_}));
     preprocessor->EnterMainSourceFile();
     clang::Token token;
     do {
@@ -775,6 +848,10 @@ class ExtractorAction : public clang::PreprocessorFrontendAction {
     index_writer_->set_triple(getCompilerInstance().getTargetOpts().Triple);
     HeaderSearchInfo info;
     bool info_valid = info.CopyFrom(header_search_options, header_search_info);
+    info.modules = getCompilerInstance().getLangOpts().Modules;
+    info.module_map_files =
+        getCompilerInstance().getFrontendOpts().ModuleMapFiles;
+    info.include_resolutions = std::move(include_resolutions_);
     RecordModuleInfo(&header_search_info.getModuleMap());
     callback_(main_source_file_, main_source_file_transcript_, source_files_,
               info_valid ? &info : nullptr,
@@ -783,9 +860,9 @@ class ExtractorAction : public clang::PreprocessorFrontendAction {
 
  private:
   void RecordModuleInfo(const clang::ModuleMap* module_map) {
-    // TODO(zarko): Record module flags (::DisableModuleHash, ::ModuleMaps)
-    // from HeaderSearchOptions; support "apple-style headermaps" (see
-    // Clang's InitHeaderSearch.cpp.)
+    // Module flags are recorded along with the header search state.
+    // TODO(zarko): Support "apple-style headermaps" (see Clang's
+    // InitHeaderSearch.cpp.)
     auto* source_manager = &getCompilerInstance().getSourceManager();
     for (auto modules = module_map->module_begin(),
               modules_end = module_map->module_end();
@@ -804,12 +881,13 @@ class ExtractorAction : public clang::PreprocessorFrontendAction {
       }
       if (const auto* file = source_manager->getFileEntryForID(file_id)) {
         auto contents = source_files_.insert(
-            std::make_pair(file->getName(), SourceFile{std::string()}));
+            std::make_pair(file->getName(), SourceFile()));
         if (contents.second) {
           const llvm::MemoryBuffer* buffer =
               source_manager->getMemoryBufferForFile(file);
-          contents.first->second.file_content.assign(buffer->getBufferStart(),
-                                                     buffer->getBufferEnd());
+          contents.first->second.file_content = buffer->getBuffer();
+          contents.first->second.digest = index_writer_->DigestFor(
+              file, contents.first->second.file_content);
           contents.first->second.vname.CopyFrom(
               index_writer_->VNameForPath(RelativizePath(
                   file->getName(), index_writer_->root_directory())));
@@ -833,19 +911,43 @@ class ExtractorAction : public clang::PreprocessorFrontendAction {
   /// Nonempty if the main source file was stdin ("-") and we have chosen
   /// an alternate name for it.
   std::string main_source_file_stdin_alternate_;
+  /// Names found on the search paths and what they resolved to.
+  std::map<std::string, HeaderSearchInfo::Resolution> include_resolutions_;
 };
 
 }  // anonymous namespace
 
+std::unique_ptr<IndexPack> OpenIndexPackForWriting(
+    const std::string& path, bool segmented, BlobCompression compression,
+    const IndexPackFilesystem::PublishBatching& batching,
+    std::string* error_text) {
+  std::unique_ptr<IndexPackFilesystem> filesystem;
+  llvm::SmallString<256> unit_path(path);
+  llvm::sys::path::append(unit_path,
+                          IndexPackFilesystem::kCompilationUnitDirectoryName);
+  if (segmented && !llvm::sys::fs::exists(llvm::Twine(unit_path))) {
+    filesystem = IndexPackSegmentedFilesystem::Open(
+        path, IndexPackFilesystem::OpenMode::kReadWrite, error_text);
+  } else {
+    filesystem = OpenIndexPackFilesystem(
+        path, IndexPackFilesystem::OpenMode::kReadWrite, error_text);
+  }
+  if (!filesystem) {
+    return nullptr;
+  }
+  filesystem->set_blob_compression(compression);
+  filesystem->set_publish_batching(batching);
+  return llvm::make_unique<IndexPack>(std::move(filesystem));
+}
+
 void IndexPackWriterSink::OpenIndex(const std::string& path,
                                     const std::string& hash) {
   CHECK(!pack_) << "Opening multiple index packs.";
   std::string error_text;
-  auto filesystem = IndexPackPosixFilesystem::Open(
-      path, IndexPackFilesystem::OpenMode::kReadWrite, &error_text);
-  CHECK(filesystem) << "Couldn't open index pack in " << path << ": "
-                    << error_text;
-  pack_.reset(new IndexPack(std::move(filesystem)));
+  pack_ = OpenIndexPackForWriting(path, segmented_, compression_, batching_,
+                                  &error_text);
+  CHECK(pack_) << "Couldn't open index pack in " << path << ": "
+               << error_text;
 }
 
 void IndexPackWriterSink::WriteHeader(
@@ -862,6 +964,66 @@ void IndexPackWriterSink::WriteFileContent(
   CHECK(pack_->AddFileData(content, &error_text)) << error_text;
 }
 
+void IndexPackWriterSink::WriteFileBuffer(
+    const kythe::proto::FileInfo& info, llvm::StringRef content) {
+  CHECK(pack_) << "Index pack not opened.";
+  std::string error_text;
+  CHECK(pack_->AddFileData(content.data(), content.size(), info.digest(),
+                           &error_text))
+      << error_text;
+}
+
+void SharedIndexPack::AddCompilationUnit(
+    const kythe::proto::CompilationUnit& unit) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  std::string error_text;
+  CHECK(pack_->AddCompilationUnit(unit, &error_text)) << error_text;
+}
+
+void SharedIndexPack::AddFileData(const kythe::proto::FileData& content) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (!content.info().digest().empty() &&
+      !written_digests_.insert(content.info().digest()).second) {
+    ++skipped_files_;
+    return;
+  }
+  std::string error_text;
+  CHECK(pack_->AddFileData(content, &error_text)) << error_text;
+}
+
+void SharedIndexPack::AddFileBuffer(const std::string& digest,
+                                    llvm::StringRef content) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (!digest.empty() && !written_digests_.insert(digest).second) {
+    ++skipped_files_;
+    return;
+  }
+  std::string error_text;
+  CHECK(pack_->AddFileData(content.data(), content.size(), digest,
+                           &error_text))
+      << error_text;
+}
+
+size_t SharedIndexPack::skipped_files() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return skipped_files_;
+}
+
+void SharedIndexPackWriterSink::WriteHeader(
+    const kythe::proto::CompilationUnit& header) {
+  pack_->AddCompilationUnit(header);
+}
+
+void SharedIndexPackWriterSink::WriteFileContent(
+    const kythe::proto::FileData& content) {
+  pack_->AddFileData(content);
+}
+
+void SharedIndexPackWriterSink::WriteFileBuffer(
+    const kythe::proto::FileInfo& info, llvm::StringRef content) {
+  pack_->AddFileBuffer(info.digest(), content);
+}
+
 void KindexWriterSink::OpenIndex(const std::string& directory,
                                  const std::string& hash) {
   using namespace google::protobuf::io;
@@ -905,6 +1067,35 @@ void KindexWriterSink::WriteFileContent(const kythe::proto::FileData& content) {
       << "Couldn't write content to " << open_path_;
 }
 
+void KindexWriterSink::WriteFileBuffer(const kythe::proto::FileInfo& info,
+                                       llvm::StringRef content) {
+  // This writes the same bytes as serializing a `FileData` with `content`
+  // and `info` set, but without first copying `content` into one.
+  using google::protobuf::io::CodedOutputStream;
+  constexpr uint32_t kContentTag = (1 << 3) | 2;  // content = 1, delimited
+  constexpr uint32_t kInfoTag = (2 << 3) | 2;     // info = 2, delimited
+  const uint32_t content_size = content.size();
+  const uint32_t info_size = info.ByteSize();
+  // Empty bytes fields are omitted, but `info` is always present.
+  uint32_t size = CodedOutputStream::VarintSize32(kInfoTag) +
+                  CodedOutputStream::VarintSize32(info_size) + info_size;
+  if (content_size != 0) {
+    size += CodedOutputStream::VarintSize32(kContentTag) +
+            CodedOutputStream::VarintSize32(content_size) + content_size;
+  }
+  coded_stream_->WriteVarint32(size);
+  if (content_size != 0) {
+    coded_stream_->WriteTag(kContentTag);
+    coded_stream_->WriteVarint32(content_size);
+    coded_stream_->WriteRaw(content.data(), content_size);
+  }
+  coded_stream_->WriteTag(kInfoTag);
+  coded_stream_->WriteVarint32(info_size);
+  info.SerializeWithCachedSizes(coded_stream_.get());
+  CHECK(!coded_stream_->HadError())
+      << "Couldn't write content to " << open_path_;
+}
+
 bool IndexWriter::SetVNameConfiguration(const std::string& json) {
   std::string error_text;
   if (!vname_generator_.LoadJsonString(json, &error_text)) {
@@ -923,6 +1114,27 @@ kythe::proto::VName IndexWriter::VNameForPath(const std::string& path) {
   return out;
 }
 
+std::string IndexWriter::DigestFor(const clang::FileEntry* file,
+                                   llvm::StringRef content) {
+  FileStat file_stat;
+  // Only trust the cache if we're looking at the same file that Clang read
+  // (and not, say, one from a virtual filesystem) and it hasn't grown or
+  // shrunk since.
+  if (digest_cache_ == nullptr ||
+      !FileDigestCache::Stat(file->getName(), &file_stat) ||
+      llvm::sys::fs::UniqueID(file_stat.device, file_stat.inode) !=
+          file->getUniqueID() ||
+      file_stat.size != content.size()) {
+    return Sha256(content.data(), content.size());
+  }
+  std::string digest;
+  if (!digest_cache_->Lookup(file_stat, &digest)) {
+    digest = Sha256(content.data(), content.size());
+    digest_cache_->Store(file_stat, digest);
+  }
+  return digest;
+}
+
 void IndexWriter::FillFileInput(
     const std::string& clang_path, const SourceFile& source_file,
     kythe::proto::CompilationUnit_FileInput* file_input) {
@@ -935,8 +1147,10 @@ void IndexWriter::FillFileInput(
   // it. (clang also refers to standard input as <stdin>, so we're
   // consistent there.)
   file_info->set_path(clang_path == "-" ? "<stdin>" : clang_path);
-  file_info->set_digest(Sha256(source_file.file_content.c_str(),
-                               source_file.file_content.size()));
+  file_info->set_digest(!source_file.digest.empty()
+                            ? source_file.digest
+                            : Sha256(source_file.file_content.data(),
+                                     source_file.file_content.size()));
   for (const auto& row : source_file.include_history) {
     auto* row_pb = file_input->mutable_context()->add_row();
     row_pb->set_source_context(row.first);
@@ -994,10 +1208,21 @@ void IndexWriter::WriteIndex(
   unit_vname->set_language(supported_language::ToString(lang));
   unit_vname->clear_path();
 
+  // Shared details are written along with the unit's files.
+  std::string shared_details;
+  kythe::proto::FileInfo shared_details_info;
   if (header_search_info != nullptr) {
     kythe::proto::CxxCompilationUnitDetails cxx_details;
     header_search_info->CopyTo(&cxx_details);
-    PackAny(cxx_details, kCxxCompilationUnitDetailsURI, unit.add_details());
+    if (share_cxx_details_) {
+      cxx_details.SerializeToString(&shared_details);
+      kythe::proto::CxxSharedDetailsRef ref;
+      ref.set_digest(Sha256(shared_details.data(), shared_details.size()));
+      shared_details_info.set_digest(ref.digest());
+      PackAny(ref, kCxxSharedDetailsRefURI, unit.add_details());
+    } else {
+      PackAny(cxx_details, kCxxCompilationUnitDetailsURI, unit.add_details());
+    }
   }
 
   if (!target_name_.empty()) {
@@ -1025,13 +1250,14 @@ void IndexWriter::WriteIndex(
   }
   sink->OpenIndex(output_directory_, identifying_blob_digest);
   sink->WriteHeader(unit);
+  if (!shared_details_info.digest().empty()) {
+    sink->WriteFileBuffer(shared_details_info, shared_details);
+  }
   unsigned info_index = 0;
   for (const auto& file : source_files) {
-    kythe::proto::FileData file_content;
-    file_content.set_content(file.second.file_content);
-    file_content.mutable_info()->CopyFrom(
-        unit.required_input(info_index++).info());
-    sink->WriteFileContent(file_content);
+    // Clang's buffers are still alive, so sinks can write from them directly.
+    sink->WriteFileBuffer(unit.required_input(info_index++).info(),
+                          file.second.file_content);
   }
 }
 
@@ -1072,14 +1298,40 @@ static std::string LoadFileOrDie(const std::string& file) {
 constexpr char kBuiltinResourceDirectory[] = "/kythe_builtins";
 
 void ExtractorConfiguration::SetVNameConfig(const std::string& path) {
-  if (!index_writer_.SetVNameConfiguration(LoadFileOrDie(path))) {
+  std::string json = LoadFileOrDie(path);
+  if (!index_writer_.SetVNameConfiguration(json)) {
     fprintf(stderr, "Couldn't configure vnames from %s\n", path.c_str());
     exit(1);
   }
+  vname_config_digest_ = Sha256(json.data(), json.size());
+}
+
+void ExtractorConfiguration::UseDigestCache(const std::string& path,
+                                            size_t slot_count) {
+  index_writer_.set_digest_cache(nullptr);
+  digest_cache_ = llvm::make_unique<FileDigestCache>();
+  std::string error_text;
+  if (digest_cache_->Open(path, slot_count, &error_text)) {
+    index_writer_.set_digest_cache(digest_cache_.get());
+  } else {
+    // The cache is only an optimization; extract without it.
+    LOG(WARNING) << error_text;
+    digest_cache_.reset();
+  }
+}
+
+void ExtractorConfiguration::UseExtractionCache(const std::string& directory) {
+  extraction_cache_ = llvm::make_unique<ExtractionCache>();
+  std::string error_text;
+  if (!extraction_cache_->Open(directory, &error_text)) {
+    LOG(WARNING) << error_text;
+    extraction_cache_.reset();
+  }
 }
 
 void ExtractorConfiguration::SetArgs(const std::vector<std::string>& args) {
   final_args_ = args;
+  map_builtin_resources_ = true;
   std::string executable = !final_args_.empty() ? final_args_[0] : "";
   if (final_args_.size() >= 3 && final_args_[1] == "--with_executable") {
     executable = final_args_[2];
@@ -1120,6 +1372,32 @@ void ExtractorConfiguration::InitializeFromEnvironment() {
   }
   if (const char* env_index_pack = getenv("KYTHE_INDEX_PACK")) {
     using_index_packs_ = (strlen(env_index_pack) != 0);
+    using_segmented_index_packs_ = (strcmp(env_index_pack, "segmented") == 0);
+  }
+  if (const char* env_compression = getenv("KYTHE_INDEX_PACK_COMPRESSION")) {
+    std::string error_text;
+    CHECK(ParseBlobCompression(env_compression, &index_pack_compression_,
+                               &error_text))
+        << error_text;
+  }
+  if (const char* env_batch = getenv("KYTHE_INDEX_PACK_PUBLISH_BATCH")) {
+    std::string error_text;
+    CHECK(ParsePublishBatching(env_batch, &index_pack_batching_, &error_text))
+        << error_text;
+  }
+  if (const char* env_share = getenv("KYTHE_SHARE_CXX_DETAILS")) {
+    index_writer_.set_share_cxx_details(using_index_packs_ &&
+                                        strcmp(env_share, "1") == 0);
+  }
+  if (const char* env_digest_cache = getenv("KYTHE_DIGEST_CACHE")) {
+    if (const char* env_slots = getenv("KYTHE_DIGEST_CACHE_SLOTS")) {
+      UseDigestCache(env_digest_cache, strtoull(env_slots, nullptr, 10));
+    } else {
+      UseDigestCache(env_digest_cache);
+    }
+  }
+  if (const char* env_extraction_cache = getenv("KYTHE_EXTRACTION_CACHE")) {
+    UseExtractionCache(env_extraction_cache);
   }
   if (const char* env_output_directory = getenv("KYTHE_OUTPUT_DIRECTORY")) {
     index_writer_.set_output_directory(env_output_directory);
@@ -1131,34 +1409,163 @@ void ExtractorConfiguration::InitializeFromEnvironment() {
 
 bool ExtractorConfiguration::Extract(supported_language::Language lang,
                                      std::unique_ptr<IndexWriterSink> sink) {
-  llvm::IntrusiveRefCntPtr<clang::FileManager> file_manager(
-      new clang::FileManager(file_system_options_));
+  return Extract(lang, std::move(sink), nullptr);
+}
+
+bool ExtractorConfiguration::Extract(supported_language::Language lang,
+                                     std::unique_ptr<IndexWriterSink> sink,
+                                     InputDigests* inputs) {
+  if (file_manager_ == nullptr ||
+      file_manager_->getFileSystemOpts().WorkingDir !=
+          file_system_options_.WorkingDir) {
+    file_manager_ = new clang::FileManager(file_system_options_);
+  }
   index_writer_.set_target_name(target_name_);
   index_writer_.set_rule_type(rule_type_);
   index_writer_.set_output_path(output_path_);
   auto extractor = NewExtractor(
       &index_writer_,
-      [this, &lang, &sink](
+      [this, &lang, &sink, inputs](
           const std::string& main_source_file,
           const PreprocessorTranscript& transcript,
           const std::unordered_map<std::string, SourceFile>& source_files,
           const HeaderSearchInfo* header_search_info, bool had_errors) {
+        if (inputs != nullptr) {
+          for (const auto& file : source_files) {
+            inputs->emplace_back(
+                file.first, !file.second.digest.empty()
+                                ? file.second.digest
+                                : Sha256(file.second.file_content.data(),
+                                         file.second.file_content.size()));
+          }
+        }
         index_writer_.WriteIndex(lang, std::move(sink), main_source_file,
                                  transcript, source_files, header_search_info,
                                  had_errors, file_system_options_.WorkingDir);
       });
   clang::tooling::ToolInvocation invocation(final_args_, extractor.release(),
-                                            file_manager.get());
+                                            file_manager_.get());
   if (map_builtin_resources_) {
     MapCompilerResources(&invocation, kBuiltinResourceDirectory);
   }
   return invocation.run();
 }
 
+bool ExtractorConfiguration::OpenSharedIndexPack(std::string* error_text) {
+  if (!using_index_packs_) {
+    return true;
+  }
+  auto pack = OpenIndexPackForWriting(index_writer_.output_directory(),
+                                      using_segmented_index_packs_,
+                                      index_pack_compression_,
+                                      index_pack_batching_, error_text);
+  if (!pack) {
+    return false;
+  }
+  shared_index_pack_ = std::make_shared<SharedIndexPack>(std::move(pack));
+  return true;
+}
+
+std::string ExtractorConfiguration::ExtractionCacheKey(
+    supported_language::Language lang) const {
+  std::string working_directory = file_system_options_.WorkingDir;
+  if (working_directory.empty()) {
+    llvm::SmallString<256> current_path;
+    if (!llvm::sys::fs::current_path(current_path)) {
+      working_directory = current_path.str();
+    }
+  }
+  // Everything but the inputs that can change the compilation unit.
+  std::vector<std::string> parts = {supported_language::ToString(lang),
+                                    working_directory,
+                                    target_name_,
+                                    rule_type_,
+                                    output_path_,
+                                    index_writer_.corpus(),
+                                    index_writer_.root_directory(),
+                                    vname_config_digest_,
+                                    std::to_string(final_args_.size())};
+  parts.insert(parts.end(), final_args_.begin(), final_args_.end());
+  // Clang also looks for headers in these.
+  for (const char* variable : {"CPATH", "C_INCLUDE_PATH", "CPLUS_INCLUDE_PATH",
+                               "OBJC_INCLUDE_PATH", "OBJCPLUS_INCLUDE_PATH"}) {
+    const char* value = getenv(variable);
+    parts.push_back(value != nullptr ? std::string("=") + value : "");
+  }
+  return ExtractionCache::ActionKey(parts);
+}
+
+bool ExtractorConfiguration::DigestInput(const std::string& path,
+                                         std::string* digest) {
+  llvm::StringRef path_ref(path);
+  // MapCompilerResources put these headers in the virtual filesystem.
+  const std::string builtin_prefix =
+      std::string(kBuiltinResourceDirectory) + "/include/";
+  if (map_builtin_resources_ && path_ref.startswith(builtin_prefix)) {
+    llvm::StringRef name = path_ref.drop_front(builtin_prefix.size());
+    for (const auto* file = builtin_headers_create(); file->name; ++file) {
+      if (name == file->name) {
+        *digest = Sha256(file->data, strlen(file->data));
+        return true;
+      }
+    }
+    return false;
+  }
+  llvm::SmallString<256> absolute_path(path_ref);
+  if (llvm::sys::path::is_relative(absolute_path) &&
+      !file_system_options_.WorkingDir.empty()) {
+    absolute_path = file_system_options_.WorkingDir;
+    llvm::sys::path::append(absolute_path, path_ref);
+  }
+  std::string file_path = absolute_path.str();
+  FileStat file_stat;
+  bool have_stat = FileDigestCache::Stat(file_path, &file_stat);
+  if (have_stat && digest_cache_ && digest_cache_->Lookup(file_stat, digest)) {
+    return true;
+  }
+  auto buffer = llvm::MemoryBuffer::getFile(file_path);
+  if (!buffer) {
+    return false;
+  }
+  *digest = Sha256((*buffer)->getBufferStart(), (*buffer)->getBufferSize());
+  if (have_stat && digest_cache_ &&
+      file_stat.size == (*buffer)->getBufferSize()) {
+    digest_cache_->Store(file_stat, *digest);
+  }
+  return true;
+}
+
 bool ExtractorConfiguration::Extract(supported_language::Language lang) {
   std::unique_ptr<IndexWriterSink> sink;
-  if (using_index_packs_) {
-    sink.reset(new IndexPackWriterSink());
+  if (shared_index_pack_) {
+    sink.reset(new SharedIndexPackWriterSink(shared_index_pack_));
+  } else if (using_index_packs_) {
+    sink.reset(new IndexPackWriterSink(using_segmented_index_packs_,
+                                       index_pack_compression_,
+                                       index_pack_batching_));
+  } else if (extraction_cache_ && !kindex_path_.empty()) {
+    // Index packs already share file data among units, so only kindex
+    // files are cached.
+    const std::string key = ExtractionCacheKey(lang);
+    auto digest_input = [this](const std::string& path, std::string* digest) {
+      return DigestInput(path, digest);
+    };
+    if (extraction_cache_->Restore(key, digest_input, kindex_path_)) {
+      return true;
+    }
+    InputDigests inputs;
+    if (!Extract(lang,
+                 std::unique_ptr<IndexWriterSink>(
+                     new KindexWriterSink(kindex_path_)),
+                 &inputs)) {
+      return false;
+    }
+    std::string error_text;
+    if (!inputs.empty() &&
+        !extraction_cache_->Store(key, inputs, kindex_path_, &error_text)) {
+      LOG(WARNING) << "Couldn't cache the extraction: " << error_text;
+    }
+    return true;
   } else {
     sink.reset(new KindexWriterSink(kindex_path_));
   }
@@ -18,8 +18,10 @@
 #define KYTHE_CXX_EXTRACTOR_EXTRACTOR_H_
 
 #include <memory>
+#include <mutex>
 #include <string>
 #include <unordered_map>
+#include <unordered_set>
 
 #include "clang/Tooling/Tooling.h"
 #include "glog/logging.h"
@@ -27,10 +29,13 @@
 #include "google/protobuf/io/gzip_stream.h"
 #include "google/protobuf/io/zero_copy_stream.h"
 #include "google/protobuf/io/zero_copy_stream_impl.h"
+#include "kythe/cxx/common/blob_compression.h"
 #include "kythe/cxx/common/cxx_details.h"
 #include "kythe/cxx/common/file_vname_generator.h"
 #include "kythe/cxx/common/index_pack.h"
 #include "kythe/cxx/common/language.h"
+#include "kythe/cxx/extractor/extraction_cache.h"
+#include "kythe/cxx/extractor/file_digest_cache.h"
 #include "kythe/proto/analysis.pb.h"
 
 namespace clang {
@@ -62,7 +67,13 @@ enum class ClaimDirective {
 
 /// \brief A record for a single source file.
 struct SourceFile {
-  std::string file_content;  ///< The full uninterpreted file content.
+  /// The full uninterpreted file content. This points into the buffer
+  /// Clang loaded, so it is only valid until the `ExtractorCallback` for the
+  /// compilation returns.
+  llvm::StringRef file_content;
+  /// The SHA-256 digest of `file_content`, or empty if it hasn't been
+  /// computed yet.
+  std::string digest;
   struct FileHandlingAnnotations {
     ClaimDirective default_claim;  ///< Claiming behavior for this version.
     /// The (include-#-offset, that-version) components of the tuple set
@@ -111,22 +122,112 @@ class IndexWriterSink {
   virtual void WriteHeader(const kythe::proto::CompilationUnit &header) = 0;
   /// \brief Writes a `FileData` record to the indexfile.
   virtual void WriteFileContent(const kythe::proto::FileData &content) = 0;
+  /// \brief Writes the record for the file described by `info` with
+  /// content `content`, which is only valid during the call. By default
+  /// this copies `content` into a `FileData` for `WriteFileContent`; sinks
+  /// that can write straight from the buffer should override it.
+  virtual void WriteFileBuffer(const kythe::proto::FileInfo &info,
+                               llvm::StringRef content) {
+    kythe::proto::FileData data;
+    data.set_content(content.data(), content.size());
+    data.mutable_info()->CopyFrom(info);
+    WriteFileContent(data);
+  }
   virtual ~IndexWriterSink() {}
 };
 
 /// \brief Writes extracted data to an index pack.
 class IndexPackWriterSink : public IndexWriterSink {
  public:
+  /// \param segmented If true, create a segmented index pack (see
+  /// `IndexPackSegmentedFilesystem`) if the output directory isn't already
+  /// an index pack.
+  /// \param compression How to compress the blobs written to the pack.
+  /// \param batching How to batch publishing new blobs.
+  explicit IndexPackWriterSink(
+      bool segmented = false, BlobCompression compression = BlobCompression(),
+      IndexPackFilesystem::PublishBatching batching =
+          IndexPackFilesystem::PublishBatching())
+      : segmented_(segmented), compression_(compression), batching_(batching) {}
+
   void OpenIndex(const std::string &path,
                  const std::string &unit_hash) override;
   void WriteHeader(const kythe::proto::CompilationUnit &header) override;
   void WriteFileContent(const kythe::proto::FileData &content) override;
+  void WriteFileBuffer(const kythe::proto::FileInfo &info,
+                       llvm::StringRef content) override;
 
  private:
+  /// Whether to create segmented index packs.
+  bool segmented_;
+  /// How to compress blobs.
+  BlobCompression compression_;
+  /// How to batch publishing.
+  IndexPackFilesystem::PublishBatching batching_;
   /// The open index pack, if any.
   std::unique_ptr<IndexPack> pack_;
 };
 
+/// \brief Opens (or creates) the index pack at `path` for writing.
+/// \param segmented Whether to make a new pack segmented.
+/// \param compression How to compress new blobs.
+/// \param batching How to batch publishing new blobs.
+/// \return null on failure (with `error_text` set).
+std::unique_ptr<IndexPack> OpenIndexPackForWriting(
+    const std::string &path, bool segmented, BlobCompression compression,
+    const IndexPackFilesystem::PublishBatching &batching,
+    std::string *error_text);
+
+/// \brief An index pack that several extractions in one process (possibly
+/// on different threads) write to. Each file's data is written once, no
+/// matter how many compilation units require it.
+class SharedIndexPack {
+ public:
+  explicit SharedIndexPack(std::unique_ptr<IndexPack> pack)
+      : pack_(std::move(pack)) {}
+
+  /// \brief Adds `unit` to the pack or terminates.
+  void AddCompilationUnit(const kythe::proto::CompilationUnit &unit);
+  /// \brief Adds `content` to the pack (unless it was added already) or
+  /// terminates.
+  void AddFileData(const kythe::proto::FileData &content);
+  /// \brief Adds `content`, whose digest is `digest` (or empty if it
+  /// should be computed), as for `AddFileData`.
+  void AddFileBuffer(const std::string &digest, llvm::StringRef content);
+
+  /// \return the number of times file data was skipped because it had
+  /// already been written.
+  size_t skipped_files();
+
+ private:
+  /// Guards the other members.
+  std::mutex mutex_;
+  /// The pack to write to.
+  std::unique_ptr<IndexPack> pack_;
+  /// The digests of the file data written so far.
+  std::unordered_set<std::string> written_digests_;
+  /// See `skipped_files()`.
+  size_t skipped_files_ = 0;
+};
+
+/// \brief An `IndexWriterSink` that writes to a `SharedIndexPack`.
+class SharedIndexPackWriterSink : public IndexWriterSink {
+ public:
+  explicit SharedIndexPackWriterSink(std::shared_ptr<SharedIndexPack> pack)
+      : pack_(std::move(pack)) {}
+
+  /// \brief Does nothing; the shared pack is already open.
+  void OpenIndex(const std::string &path,
+                 const std::string &unit_hash) override {}
+  void WriteHeader(const kythe::proto::CompilationUnit &header) override;
+  void WriteFileContent(const kythe::proto::FileData &content) override;
+  void WriteFileBuffer(const kythe::proto::FileInfo &info,
+                       llvm::StringRef content) override;
+
+ private:
+  std::shared_ptr<SharedIndexPack> pack_;
+};
+
 /// \brief An `IndexWriterSink` that writes to physical .kindex files.
 class KindexWriterSink : public IndexWriterSink {
  public:
@@ -137,6 +238,8 @@ class KindexWriterSink : public IndexWriterSink {
                  const std::string &unit_hash) override;
   void WriteHeader(const kythe::proto::CompilationUnit &header) override;
   void WriteFileContent(const kythe::proto::FileData &content) override;
+  void WriteFileBuffer(const kythe::proto::FileInfo &info,
+                       llvm::StringRef content) override;
   ~KindexWriterSink();
 
  private:
@@ -173,6 +276,7 @@ class IndexWriter {
   void set_triple(const std::string &triple) { triple_ = triple; }
   /// \brief Configure the default corpus.
   void set_corpus(const std::string &corpus) { corpus_ = corpus; }
+  const std::string &corpus() const { return corpus_; }
   /// \brief Record the name of the target that generated this compilation.
   void set_target_name(const std::string &target) { target_name_ = target; }
   /// \brief Record the rule type that generated this compilation.
@@ -184,9 +288,20 @@ class IndexWriter {
   bool SetVNameConfiguration(const std::string &json_string);
   /// \brief Configure where the indexer will output files.
   void set_output_directory(const std::string &dir) { output_directory_ = dir; }
+  const std::string &output_directory() const { return output_directory_; }
   /// \brief Configure the path used for the root.
   void set_root_directory(const std::string &dir) { root_directory_ = dir; }
   const std::string &root_directory() const { return root_directory_; }
+  /// \brief Use `cache` (which must outlive this writer) to avoid hashing
+  /// files that haven't changed since an earlier extraction.
+  void set_digest_cache(FileDigestCache *cache) { digest_cache_ = cache; }
+  /// \brief If set, C++ details are written to the sink as file data named
+  /// by their digest, and units refer to them with a `CxxSharedDetailsRef`.
+  /// Only index packs can hold shared details.
+  void set_share_cxx_details(bool share) { share_cxx_details_ = share; }
+  /// \brief Computes the digest of `content`, which Clang read from `file`.
+  /// Consults and updates the digest cache, if there is one.
+  std::string DigestFor(const clang::FileEntry *file, llvm::StringRef content);
   /// \brief Write the index file to `sink`, consuming the sink in the process.
   void WriteIndex(
       supported_language::Language lang, std::unique_ptr<IndexWriterSink> sink,
@@ -225,6 +340,10 @@ class IndexWriter {
   std::string rule_type_;
   /// If nonempty, the output path generated by this compilation.
   std::string output_path_;
+  /// If non-null, the cache of file digests to use. Not owned.
+  FileDigestCache *digest_cache_ = nullptr;
+  /// See `set_share_cxx_details`.
+  bool share_cxx_details_ = false;
 };
 
 /// \brief Creates a `FrontendAction` that records information about a
@@ -250,6 +369,16 @@ class ExtractorConfiguration {
   void InitializeFromEnvironment();
   /// \brief Load the VName config file from `path` or terminate.
   void SetVNameConfig(const std::string &path);
+  /// \brief Keep file digests in the shared cache at `path`, creating it
+  /// with room for `slot_count` digests if needed. Logs a warning and
+  /// carries on without a cache if it can't be opened.
+  void UseDigestCache(const std::string &path, size_t slot_count = 1 << 20);
+  /// \brief Keep the kindex files written to the path given to
+  /// `SetKindexOutputFile` in the `ExtractionCache` in `directory`, and
+  /// copy them from there instead of extracting actions whose arguments,
+  /// configuration and inputs haven't changed. Logs a warning and carries
+  /// on without a cache if it can't be opened.
+  void UseExtractionCache(const std::string &directory);
   /// \brief If a kindex file will be written, write it here.
   void SetKindexOutputFile(const std::string &path) { kindex_path_ = path; }
   /// \brief Record the name of the target that generated this compilation.
@@ -258,6 +387,24 @@ class ExtractorConfiguration {
   void SetRuleType(const std::string &rule_type) { rule_type_ = rule_type; }
   /// \brief Record the output path produced by this compilation.
   void SetOutputPath(const std::string &path) { output_path_ = path; }
+  /// \brief Resolve relative paths against `dir` instead of the current
+  /// directory. Clang's driver also needs `-working-directory` in the args.
+  void SetWorkingDirectory(const std::string &dir) {
+    file_system_options_.WorkingDir = dir;
+  }
+  /// \brief If the environment calls for an index pack, opens it as a
+  /// `SharedIndexPack` that later extractions (and other configurations)
+  /// will write to.
+  /// \return false on failure (with `error_text` set).
+  bool OpenSharedIndexPack(std::string *error_text);
+  /// \brief Write to `pack` instead of opening an index pack or kindex
+  /// file for each extraction.
+  void set_shared_index_pack(std::shared_ptr<SharedIndexPack> pack) {
+    shared_index_pack_ = std::move(pack);
+  }
+  const std::shared_ptr<SharedIndexPack> &shared_index_pack() const {
+    return shared_index_pack_;
+  }
   /// \brief Executes the extractor with this configuration, returning true on
   /// success.
   bool Extract(supported_language::Language lang);
@@ -267,16 +414,44 @@ class ExtractorConfiguration {
                std::unique_ptr<IndexWriterSink> sink);
 
  private:
+  /// \brief As for the public `Extract`, also recording the path and digest
+  /// of every input in `inputs` if it isn't null.
+  bool Extract(supported_language::Language lang,
+               std::unique_ptr<IndexWriterSink> sink, InputDigests *inputs);
+  /// \return the key that names the action this configuration describes,
+  /// extracted as `lang`, in the extraction cache.
+  std::string ExtractionCacheKey(supported_language::Language lang) const;
+  /// \brief Computes the current digest of the input that Clang would find
+  /// at `path`, as an `InputDigester`.
+  bool DigestInput(const std::string &path, std::string *digest);
+
   /// The argument list to pass to Clang.
   std::vector<std::string> final_args_;
   /// The FileSystemOptions to use during extraction.
   clang::FileSystemOptions file_system_options_;
+  /// The FileManager used by the last extraction. It is reused (along with
+  /// its stat cache) for as long as the working directory stays the same.
+  llvm::IntrusiveRefCntPtr<clang::FileManager> file_manager_;
   /// The IndexWriter to use.
   IndexWriter index_writer_;
   /// True if we should use our internal system headers; false if not.
   bool map_builtin_resources_ = true;
   /// True if we should use index packs; false if not.
   bool using_index_packs_ = false;
+  /// True if new index packs should be segmented.
+  bool using_segmented_index_packs_ = false;
+  /// How to compress blobs in index packs.
+  BlobCompression index_pack_compression_;
+  /// How to batch publishing blobs in index packs.
+  IndexPackFilesystem::PublishBatching index_pack_batching_;
+  /// The host-wide cache of file digests, if one is configured.
+  std::unique_ptr<FileDigestCache> digest_cache_;
+  /// The cache of earlier extractions, if one is configured.
+  std::unique_ptr<ExtractionCache> extraction_cache_;
+  /// The digest of the VName configuration, which goes into cache keys.
+  std::string vname_config_digest_;
+  /// If set, the index pack that every extraction writes to.
+  std::shared_ptr<SharedIndexPack> shared_index_pack_;
   /// If nonempty, emit kindex files to this exact path.
   std::string kindex_path_;
   /// If nonempty, the name of the target that generated this compilation.
@@ -0,0 +1,108 @@
+/*
+ * Copyright 2017 Google Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// cxx_extractor_batch extracts every command in a compilation database
+// (documented at <http://clang.llvm.org/docs/JSONCompilationDatabase.html>)
+// in a single process, running several extractions at once. It reads the
+// same environment variables as cxx_extractor. If KYTHE_INDEX_PACK is set,
+// every extraction writes to the same index pack and each file's data is
+// written to it once.
+
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <vector>
+
+#include "clang/Tooling/JSONCompilationDatabase.h"
+#include "gflags/gflags.h"
+#include "glog/logging.h"
+#include "google/protobuf/stubs/common.h"
+#include "kythe/cxx/common/language.h"
+#include "llvm/Support/TargetSelect.h"
+
+#include "cxx_extractor.h"
+
+DEFINE_int32(jobs, 0,
+             "The number of commands to extract at once (0 for one per CPU).");
+
+int main(int argc, char* argv[]) {
+  GOOGLE_PROTOBUF_VERIFY_VERSION;
+  google::InitGoogleLogging(argv[0]);
+  gflags::SetVersionString("0.1");
+  gflags::SetUsageMessage(
+      "cxx_extractor_batch [--jobs=N] compile_commands.json");
+  gflags::ParseCommandLineFlags(&argc, &argv, true);
+  if (argc != 2) {
+    fprintf(stderr, "Call as %s [--jobs=N] compile_commands.json\n", argv[0]);
+    return 1;
+  }
+  std::string error_text;
+  auto database = clang::tooling::JSONCompilationDatabase::loadFromFile(
+      argv[1], error_text);
+  if (database == nullptr) {
+    fprintf(stderr, "Couldn't load %s: %s\n", argv[1], error_text.c_str());
+    return 1;
+  }
+  const auto commands = database->getAllCompileCommands();
+  // Configurations aren't thread-safe, so each worker gets its own, but
+  // they all share the index pack (if any) opened by this one.
+  kythe::ExtractorConfiguration config;
+  config.InitializeFromEnvironment();
+  CHECK(config.OpenSharedIndexPack(&error_text)) << error_text;
+  llvm::InitializeAllTargetInfos();
+  size_t jobs =
+      FLAGS_jobs > 0 ? FLAGS_jobs : std::thread::hardware_concurrency();
+  jobs = std::max<size_t>(1, std::min(jobs, commands.size()));
+  std::atomic<size_t> next_command(0);
+  std::atomic<size_t> failed_commands(0);
+  std::vector<std::thread> workers;
+  for (size_t job = 0; job < jobs; ++job) {
+    workers.emplace_back([&]() {
+      kythe::ExtractorConfiguration worker_config;
+      worker_config.InitializeFromEnvironment();
+      worker_config.set_shared_index_pack(config.shared_index_pack());
+      for (size_t index = next_command++; index < commands.size();
+           index = next_command++) {
+        const auto& command = commands[index];
+        // This is what extract_compilation_database.sh does, except that we
+        // can't chdir on a thread.
+        std::vector<std::string> args = {argv[0], "--with_executable"};
+        args.insert(args.end(), command.CommandLine.begin(),
+                    command.CommandLine.end());
+        args.push_back("-working-directory");
+        args.push_back(command.Directory);
+        worker_config.SetWorkingDirectory(command.Directory);
+        worker_config.SetArgs(args);
+        if (!worker_config.Extract(kythe::supported_language::Language::kCpp)) {
+          ++failed_commands;
+          LOG(WARNING) << "Errors while extracting " << command.Filename;
+        }
+      }
+    });
+  }
+  for (auto& worker : workers) {
+    worker.join();
+  }
+  fprintf(stderr, "Extracted %zu commands (%zu with errors)", commands.size(),
+          failed_commands.load());
+  if (config.shared_index_pack()) {
+    fprintf(stderr, "; skipped %zu duplicate files",
+            config.shared_index_pack()->skipped_files());
+  }
+  fprintf(stderr, "\n");
+  google::protobuf::ShutdownProtobufLibrary();
+  return 0;
+}
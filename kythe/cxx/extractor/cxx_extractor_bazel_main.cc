@@ -16,9 +16,26 @@
 
 // cxx_extractor_bazel is a C++ extractor meant to be run as a Bazel
 // extra_action.
+//
+// Starting an extractor for every action means paying to load the binary
+// and parse the VName configuration every time. Instead, a long-running
+// server can be started with
+//
+//   cxx_extractor_bazel --experimental_serve=/path/to/socket vname-config
+//
+// and actions run with --experimental_server=/path/to/socket will ask it to
+// do their extraction. The server forks a copy of its warm state for each
+// request. If no server answers, actions extract in-process as usual.
+// With --experimental_digest_cache=/path/to/file, file digests are kept in
+// a cache shared by every extractor on the host, and with
+// --experimental_extraction_cache=/path/to/dir, actions whose arguments
+// and inputs haven't changed since an earlier extraction copy the kindex
+// file that extraction wrote instead of running the preprocessor again.
 
 #include <fcntl.h>
+#include <limits.h>
 #include <sys/stat.h>
+#include <unistd.h>
 
 #include "gflags/gflags.h"
 #include "glog/logging.h"
@@ -27,9 +44,22 @@
 #include "google/protobuf/io/zero_copy_stream_impl.h"
 #include "google/protobuf/stubs/common.h"
 #include "kythe/cxx/common/language.h"
+#include "llvm/Support/TargetSelect.h"
 #include "third_party/bazel/src/main/protobuf/extra_actions_base.pb.h"
 
 #include "cxx_extractor.h"
+#include "extractor_server.h"
+
+DEFINE_string(experimental_serve, "",
+              "If set, serve extraction requests on this Unix socket. The "
+              "only argument is then the default vname config.");
+DEFINE_string(experimental_server, "",
+              "If set, ask the extractor server on this Unix socket to do "
+              "the extraction (extracting in-process if it doesn't answer).");
+DEFINE_string(experimental_digest_cache, "",
+              "If set, keep file digests in the cache at this path.");
+DEFINE_string(experimental_extraction_cache, "",
+              "If set, reuse earlier extractions kept in this directory.");
 
 static void LoadExtraAction(const std::string &path,
                             blaze::ExtraActionInfo *info,
@@ -46,10 +76,74 @@ static void LoadExtraAction(const std::string &path,
   *cpp_info = info->GetExtension(blaze::CppCompileInfo::cpp_compile_info);
 }
 
+/// \brief Extracts the action described by `extra_action_file` to
+/// `output_file` using `config`, which should already know its VName
+/// configuration.
+static void ExtractAction(kythe::ExtractorConfiguration *config,
+                          const std::string &extra_action_file,
+                          const std::string &output_file) {
+  blaze::ExtraActionInfo info;
+  blaze::CppCompileInfo cpp_info;
+  LoadExtraAction(extra_action_file, &info, &cpp_info);
+  std::vector<std::string> args;
+  args.push_back(cpp_info.tool());
+  args.insert(args.end(), cpp_info.compiler_option().begin(),
+              cpp_info.compiler_option().end());
+  args.push_back(cpp_info.source_file());
+  config->SetKindexOutputFile(output_file);
+  config->SetArgs(args);
+  config->SetTargetName(info.owner());
+  config->SetOutputPath(cpp_info.output_file());
+  config->Extract(kythe::supported_language::Language::kCpp);
+}
+
+/// \brief Serves (working directory, extra-action-file, output-file,
+/// vname-config) requests on `socket_path`.
+/// \return only if the server couldn't start.
+static int Serve(const std::string &socket_path,
+                 const std::string &vname_config) {
+  kythe::ExtractorConfiguration config;
+  if (!FLAGS_experimental_digest_cache.empty()) {
+    config.UseDigestCache(FLAGS_experimental_digest_cache);
+  }
+  if (!FLAGS_experimental_extraction_cache.empty()) {
+    config.UseExtractionCache(FLAGS_experimental_extraction_cache);
+  }
+  config.SetVNameConfig(vname_config);
+  llvm::InitializeAllTargetInfos();
+  std::string error_text;
+  kythe::ServeExtractorRequests(
+      socket_path,
+      [&config, &vname_config](const std::vector<std::string> &request) {
+        // Each request runs in its own child, so it's fine to change the
+        // working directory or the configuration here.
+        if (request.size() != 4 || chdir(request[0].c_str()) != 0) {
+          return false;
+        }
+        if (request[3] != vname_config) {
+          config.SetVNameConfig(request[3]);
+        }
+        ExtractAction(&config, request[1], request[2]);
+        return true;
+      },
+      &error_text);
+  LOG(ERROR) << error_text;
+  return 1;
+}
+
 int main(int argc, char *argv[]) {
   GOOGLE_PROTOBUF_VERIFY_VERSION;
   google::InitGoogleLogging(argv[0]);
   gflags::SetVersionString("0.1");
+  gflags::ParseCommandLineFlags(&argc, &argv, true);
+  if (!FLAGS_experimental_serve.empty()) {
+    if (argc != 2) {
+      fprintf(stderr, "Call as %s --experimental_serve=socket vname-config\n",
+              argv[0]);
+      return 1;
+    }
+    return Serve(FLAGS_experimental_serve, argv[1]);
+  }
   if (argc != 4) {
     fprintf(stderr, "Call as %s extra-action-file output-file vname-config\n",
             argv[0]);
@@ -58,21 +152,29 @@ int main(int argc, char *argv[]) {
   std::string extra_action_file = argv[1];
   std::string output_file = argv[2];
   std::string vname_config = argv[3];
-  blaze::ExtraActionInfo info;
-  blaze::CppCompileInfo cpp_info;
-  LoadExtraAction(extra_action_file, &info, &cpp_info);
+  if (!FLAGS_experimental_server.empty()) {
+    char working_directory[PATH_MAX];
+    bool handled = false;
+    std::string error_text;
+    if (getcwd(working_directory, sizeof(working_directory)) != nullptr &&
+        kythe::SendExtractorRequest(
+            FLAGS_experimental_server,
+            {working_directory, extra_action_file, output_file, vname_config},
+            &handled, &error_text) &&
+        handled) {
+      return 0;
+    }
+    LOG(WARNING) << "Extracting in-process: " << error_text;
+  }
   kythe::ExtractorConfiguration config;
-  std::vector<std::string> args;
-  args.push_back(cpp_info.tool());
-  args.insert(args.end(), cpp_info.compiler_option().begin(),
-              cpp_info.compiler_option().end());
-  args.push_back(cpp_info.source_file());
-  config.SetKindexOutputFile(output_file);
-  config.SetArgs(args);
+  if (!FLAGS_experimental_digest_cache.empty()) {
+    config.UseDigestCache(FLAGS_experimental_digest_cache);
+  }
+  if (!FLAGS_experimental_extraction_cache.empty()) {
+    config.UseExtractionCache(FLAGS_experimental_extraction_cache);
+  }
   config.SetVNameConfig(vname_config);
-  config.SetTargetName(info.owner());
-  config.SetOutputPath(cpp_info.output_file());
-  config.Extract(kythe::supported_language::Language::kCpp);
+  ExtractAction(&config, extra_action_file, output_file);
   google::protobuf::ShutdownProtobufLibrary();
   return 0;
 }
@@ -26,7 +26,27 @@
 //
 // If KYTHE_INDEX_PACK is set to "1", the extractor will treat
 // KYTHE_OUTPUT_DIRECTORY as an index pack. Instead of emitting kindex files,
-// it will instead follow the index pack protocol.
+// it will instead follow the index pack protocol. If KYTHE_INDEX_PACK is set
+// to "segmented", new index packs will append to shared segment files rather
+// than writing one file per blob (existing index packs keep their layout).
+// KYTHE_INDEX_PACK_COMPRESSION chooses how new blobs are compressed: "gzip"
+// (the default), "gzip:<level>" or "snappy[:<threads>]". Readers detect the
+// format of each blob, so packs may mix them.
+// KYTHE_INDEX_PACK_PUBLISH_BATCH ("<blobs>[:<milliseconds>]") has new
+// blobs in unsegmented packs published in batches of up to that many blobs
+// (waiting at most 100ms, or the given time, to fill a batch), with one
+// directory sync per batch. This helps most on network filesystems.
+// If KYTHE_SHARE_CXX_DETAILS is "1", units in index packs refer to their
+// C++ details (header search paths and the like, which are usually the same
+// for every unit in a build) by digest instead of holding a copy, and the
+// details are stored once as file data. Indexers parse them once per digest.
+//
+// If KYTHE_DIGEST_CACHE names a file, the extractor keeps the digests of
+// the files it reads there (creating it if needed) and reuses them for files
+// whose inode, size, and modification and status change times are the same
+// on later runs. The file can be shared by every extractor on a host.
+// KYTHE_DIGEST_CACHE_SLOTS sets how many digests a new cache holds (by
+// default 2^20; each takes 80 bytes).
 //
 // If the first two arguments are --with_executable /foo/bar, the extractor
 // will consider /foo/bar to be the executable it was called as for purposes
@@ -0,0 +1,217 @@
+/*
+ * Copyright 2017 Google Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "extraction_cache.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <openssl/sha.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace kythe {
+namespace {
+
+/// Begins every entry (and every key), so that entries written by an
+/// extractor with a different format are never read.
+constexpr char kMagic[] = "kythe-extraction-cache 1\n";
+
+constexpr char kHexDigits[] = "0123456789abcdef";
+
+/// \brief Reads the whole file at `path` into `content`.
+bool ReadFile(const std::string& path, std::string* content) {
+  int fd = ::open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    return false;
+  }
+  content->clear();
+  char buffer[1 << 16];
+  ssize_t count;
+  while ((count = ::read(fd, buffer, sizeof(buffer))) > 0) {
+    content->append(buffer, count);
+  }
+  ::close(fd);
+  return count == 0;
+}
+
+/// \brief Writes all of `data` to `fd`.
+bool WriteAll(int fd, const char* data, size_t size) {
+  while (size > 0) {
+    ssize_t count = ::write(fd, data, size);
+    if (count < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return false;
+    }
+    data += count;
+    size -= count;
+  }
+  return true;
+}
+
+/// \brief Writes `header` followed by the contents of the file at `from` to
+/// `to`, atomically replacing `to`.
+bool CopyFileAtomically(const std::string& from, const std::string& header,
+                        const std::string& to, std::string* error_text) {
+  std::string content;
+  if (!ReadFile(from, &content)) {
+    *error_text = "couldn't read " + from + ": " + strerror(errno);
+    return false;
+  }
+  std::string temp_path = to + ".XXXXXX";
+  int fd = ::mkstemp(&temp_path[0]);
+  if (fd < 0) {
+    *error_text = "couldn't create " + temp_path + ": " + strerror(errno);
+    return false;
+  }
+  bool ok = ::fchmod(fd, 0644) == 0 &&
+            WriteAll(fd, header.data(), header.size()) &&
+            WriteAll(fd, content.data(), content.size());
+  ok = ::close(fd) == 0 && ok;
+  if (!ok || ::rename(temp_path.c_str(), to.c_str()) != 0) {
+    *error_text = "couldn't write " + to + ": " + strerror(errno);
+    ::unlink(temp_path.c_str());
+    return false;
+  }
+  return true;
+}
+
+}  // anonymous namespace
+
+bool ExtractionCache::Open(const std::string& directory,
+                           std::string* error_text) {
+  if (::mkdir(directory.c_str(), 0755) != 0 && errno != EEXIST) {
+    *error_text = "couldn't create " + directory + ": " + strerror(errno);
+    return false;
+  }
+  struct stat directory_stat;
+  if (::stat(directory.c_str(), &directory_stat) != 0 ||
+      !S_ISDIR(directory_stat.st_mode)) {
+    *error_text = directory + " isn't a directory";
+    return false;
+  }
+  directory_ = directory;
+  return true;
+}
+
+std::string ExtractionCache::ActionKey(const std::vector<std::string>& parts) {
+  SHA256_CTX context;
+  ::SHA256_Init(&context);
+  ::SHA256_Update(&context, kMagic, sizeof(kMagic) - 1);
+  for (const auto& part : parts) {
+    // Prefix each part with its length so that ("ab", "c") and ("a", "bc")
+    // don't collide.
+    unsigned char length[8];
+    for (size_t i = 0; i < sizeof(length); ++i) {
+      length[i] = static_cast<uint64_t>(part.size()) >> (i * 8);
+    }
+    ::SHA256_Update(&context, length, sizeof(length));
+    ::SHA256_Update(&context, part.data(), part.size());
+  }
+  unsigned char digest[SHA256_DIGEST_LENGTH];
+  ::SHA256_Final(digest, &context);
+  std::string key(SHA256_DIGEST_LENGTH * 2, '\0');
+  for (size_t i = 0; i < SHA256_DIGEST_LENGTH; ++i) {
+    key[i * 2] = kHexDigits[digest[i] >> 4];
+    key[i * 2 + 1] = kHexDigits[digest[i] & 0xF];
+  }
+  return key;
+}
+
+std::string ExtractionCache::EntryPath(const std::string& key) const {
+  return directory_ + "/" + key + ".entry";
+}
+
+// An entry is laid out as
+//
+//   kMagic
+//   <number of inputs>\n
+//   <digest> <path>\n    (once for each input)
+//   <the bytes of the index file>
+
+bool ExtractionCache::Restore(const std::string& key,
+                              const InputDigester& digest_input,
+                              const std::string& output_path) {
+  std::string entry;
+  if (directory_.empty() || !ReadFile(EntryPath(key), &entry) ||
+      entry.compare(0, sizeof(kMagic) - 1, kMagic) != 0) {
+    ++misses_;
+    return false;
+  }
+  size_t pos = sizeof(kMagic) - 1;
+  char* count_end = nullptr;
+  unsigned long long count = strtoull(entry.c_str() + pos, &count_end, 10);
+  if (count_end == entry.c_str() + pos || *count_end != '\n') {
+    ++misses_;
+    return false;
+  }
+  pos = count_end - entry.c_str() + 1;
+  std::string digest;
+  for (unsigned long long i = 0; i < count; ++i) {
+    size_t space = entry.find(' ', pos);
+    size_t newline = entry.find('\n', space);
+    if (space == std::string::npos || newline == std::string::npos ||
+        !digest_input(entry.substr(space + 1, newline - space - 1),
+                      &digest) ||
+        entry.compare(pos, space - pos, digest) != 0) {
+      ++misses_;
+      return false;
+    }
+    pos = newline + 1;
+  }
+  int fd = ::open(output_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+  if (fd < 0) {
+    ++misses_;
+    return false;
+  }
+  bool ok = WriteAll(fd, entry.data() + pos, entry.size() - pos);
+  if (::close(fd) != 0 || !ok) {
+    ++misses_;
+    return false;
+  }
+  ++hits_;
+  return true;
+}
+
+bool ExtractionCache::Store(const std::string& key, const InputDigests& inputs,
+                            const std::string& output_path,
+                            std::string* error_text) {
+  if (directory_.empty()) {
+    *error_text = "the extraction cache isn't open";
+    return false;
+  }
+  std::string header = kMagic;
+  header.append(std::to_string(inputs.size()));
+  header.push_back('\n');
+  for (const auto& input : inputs) {
+    if (input.first.find('\n') != std::string::npos ||
+        input.second.find_first_of(" \n") != std::string::npos) {
+      *error_text = "can't record the input " + input.first;
+      return false;
+    }
+    header.append(input.second);
+    header.push_back(' ');
+    header.append(input.first);
+    header.push_back('\n');
+  }
+  return CopyFileAtomically(output_path, header, EntryPath(key), error_text);
+}
+
+}  // namespace kythe
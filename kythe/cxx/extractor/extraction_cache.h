@@ -0,0 +1,95 @@
+/*
+ * Copyright 2017 Google Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef KYTHE_CXX_EXTRACTOR_EXTRACTION_CACHE_H_
+#define KYTHE_CXX_EXTRACTOR_EXTRACTION_CACHE_H_
+
+#include <stddef.h>
+
+#include <functional>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace kythe {
+
+/// \brief Computes the lowercase hex SHA-256 digest of the current contents
+/// of the input at `path`.
+/// \return false if the input couldn't be read.
+using InputDigester =
+    std::function<bool(const std::string& path, std::string* digest)>;
+
+/// \brief (path, lowercase hex SHA-256 digest) pairs for the inputs that an
+/// extraction read.
+using InputDigests = std::vector<std::pair<std::string, std::string>>;
+
+/// \brief Remembers the index files written by earlier extractions, so that
+/// an action whose arguments, configuration and inputs haven't changed
+/// needn't be extracted again.
+///
+/// An action is named by a key (see `ActionKey`) over everything but its
+/// inputs that goes into its compilation unit. The inputs themselves aren't
+/// known until the preprocessor has found them, so each entry holds the
+/// paths and digests of the inputs the last extraction of its action read
+/// along with a copy of the index file that extraction wrote. A lookup
+/// only succeeds if every one of those inputs still has the digest it had.
+/// As with any cache that discovers its inputs this way, a new header that
+/// would now shadow one of the recorded ones goes unnoticed.
+///
+/// Entries are single files written under temporary names and renamed into
+/// place, so extractors sharing a directory see either a whole entry or
+/// none at all.
+class ExtractionCache {
+ public:
+  /// \brief Uses the cache in `directory`, creating it if it doesn't exist.
+  /// \return false on failure (with `error_text` set).
+  bool Open(const std::string& directory, std::string* error_text);
+
+  /// \brief Returns the key for the action described by `parts`. Keys
+  /// differ whenever any of the parts (or their order) do.
+  static std::string ActionKey(const std::vector<std::string>& parts);
+
+  /// \brief Copies the index file recorded for `key` to `output_path` if
+  /// each of the inputs it was extracted from still has the same digest,
+  /// as computed by `digest_input`.
+  /// \return true on a hit.
+  bool Restore(const std::string& key, const InputDigester& digest_input,
+               const std::string& output_path);
+
+  /// \brief Records that extracting the action `key` read `inputs` and
+  /// wrote the index file at `output_path`, replacing any earlier entry.
+  /// \return false on failure (with `error_text` set).
+  bool Store(const std::string& key, const InputDigests& inputs,
+             const std::string& output_path, std::string* error_text);
+
+  /// \return the number of successful restores so far.
+  size_t hits() const { return hits_; }
+  /// \return the number of failed restores so far.
+  size_t misses() const { return misses_; }
+
+ private:
+  /// \return the path of the entry for `key`.
+  std::string EntryPath(const std::string& key) const;
+
+  /// The directory holding the entries.
+  std::string directory_;
+  size_t hits_ = 0;
+  size_t misses_ = 0;
+};
+
+}  // namespace kythe
+
+#endif  // KYTHE_CXX_EXTRACTOR_EXTRACTION_CACHE_H_
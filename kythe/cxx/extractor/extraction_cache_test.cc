@@ -0,0 +1,179 @@
+/*
+ * Copyright 2017 Google Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "extraction_cache.h"
+
+#include <stdio.h>
+
+#include <map>
+#include <string>
+
+#include "glog/logging.h"
+#include "gtest/gtest.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Path.h"
+
+namespace kythe {
+namespace {
+
+/// \brief A temporary directory that is removed with its contents.
+class TemporaryDirectory {
+ public:
+  TemporaryDirectory() {
+    CHECK_EQ(0, llvm::sys::fs::createUniqueDirectory("extraction_cache",
+                                                      root_)
+                    .value());
+  }
+  ~TemporaryDirectory() { llvm::sys::fs::remove_directories(root_); }
+
+  std::string Path(const std::string& name) const {
+    llvm::SmallString<256> path(root_);
+    llvm::sys::path::append(path, name);
+    return std::string(path.str());
+  }
+
+ private:
+  llvm::SmallString<256> root_;
+};
+
+void WriteFile(const std::string& path, const std::string& content) {
+  FILE* file = fopen(path.c_str(), "wb");
+  CHECK(file != nullptr);
+  CHECK_EQ(content.size(), fwrite(content.data(), 1, content.size(), file));
+  CHECK_EQ(0, fclose(file));
+}
+
+std::string ReadFile(const std::string& path) {
+  FILE* file = fopen(path.c_str(), "rb");
+  CHECK(file != nullptr);
+  std::string content;
+  char buffer[256];
+  size_t count;
+  while ((count = fread(buffer, 1, sizeof(buffer), file)) > 0) {
+    content.append(buffer, count);
+  }
+  CHECK_EQ(0, fclose(file));
+  return content;
+}
+
+/// \brief Digests inputs by looking them up in a table.
+class FakeInputs {
+ public:
+  void Set(const std::string& path, const std::string& digest) {
+    digests_[path] = digest;
+  }
+
+  InputDigester digester() {
+    return [this](const std::string& path, std::string* digest) {
+      auto found = digests_.find(path);
+      if (found == digests_.end()) {
+        return false;
+      }
+      *digest = found->second;
+      return true;
+    };
+  }
+
+ private:
+  std::map<std::string, std::string> digests_;
+};
+
+TEST(ExtractionCache, ActionKeysDependOnEveryPart) {
+  std::string key = ExtractionCache::ActionKey({"ab", "c"});
+  EXPECT_EQ(64, key.size());
+  EXPECT_EQ(key, ExtractionCache::ActionKey({"ab", "c"}));
+  EXPECT_NE(key, ExtractionCache::ActionKey({"a", "bc"}));
+  EXPECT_NE(key, ExtractionCache::ActionKey({"c", "ab"}));
+  EXPECT_NE(key, ExtractionCache::ActionKey({"ab", "c", ""}));
+}
+
+TEST(ExtractionCache, RestoresUnchangedActions) {
+  TemporaryDirectory dir;
+  ExtractionCache cache;
+  std::string error_text;
+  ASSERT_TRUE(cache.Open(dir.Path("cache"), &error_text)) << error_text;
+  FakeInputs inputs;
+  inputs.Set("a.cc", "1");
+  inputs.Set("dir/a b.h", "2");
+  std::string key = ExtractionCache::ActionKey({"clang", "a.cc"});
+  EXPECT_FALSE(cache.Restore(key, inputs.digester(), dir.Path("out")));
+  WriteFile(dir.Path("out"), std::string("kindex\0\n data", 13));
+  ASSERT_TRUE(cache.Store(key, {{"a.cc", "1"}, {"dir/a b.h", "2"}},
+                          dir.Path("out"), &error_text))
+      << error_text;
+  ASSERT_TRUE(cache.Restore(key, inputs.digester(), dir.Path("restored")));
+  EXPECT_EQ(std::string("kindex\0\n data", 13),
+            ReadFile(dir.Path("restored")));
+  EXPECT_EQ(1, cache.hits());
+  EXPECT_EQ(1, cache.misses());
+
+  // Entries persist and are shared by every cache in the directory.
+  ExtractionCache other_cache;
+  ASSERT_TRUE(other_cache.Open(dir.Path("cache"), &error_text));
+  EXPECT_TRUE(other_cache.Restore(key, inputs.digester(), dir.Path("again")));
+  EXPECT_FALSE(other_cache.Restore(ExtractionCache::ActionKey({"clang"}),
+                                   inputs.digester(), dir.Path("again")));
+}
+
+TEST(ExtractionCache, MissesChangedInputs) {
+  TemporaryDirectory dir;
+  ExtractionCache cache;
+  std::string error_text;
+  ASSERT_TRUE(cache.Open(dir.Path("cache"), &error_text)) << error_text;
+  std::string key = ExtractionCache::ActionKey({"clang", "a.cc"});
+  WriteFile(dir.Path("out"), "old");
+  ASSERT_TRUE(cache.Store(key, {{"a.cc", "1"}, {"a.h", "2"}}, dir.Path("out"),
+                          &error_text))
+      << error_text;
+  FakeInputs inputs;
+  inputs.Set("a.cc", "1");
+  // An input that can't be read, ...
+  EXPECT_FALSE(cache.Restore(key, inputs.digester(), dir.Path("restored")));
+  // ... or that has changed, is a miss.
+  inputs.Set("a.h", "3");
+  EXPECT_FALSE(cache.Restore(key, inputs.digester(), dir.Path("restored")));
+  // A new extraction replaces the entry.
+  WriteFile(dir.Path("out"), "new");
+  ASSERT_TRUE(cache.Store(key, {{"a.cc", "1"}, {"a.h", "3"}}, dir.Path("out"),
+                          &error_text))
+      << error_text;
+  ASSERT_TRUE(cache.Restore(key, inputs.digester(), dir.Path("restored")));
+  EXPECT_EQ("new", ReadFile(dir.Path("restored")));
+}
+
+TEST(ExtractionCache, RejectsUnrecordableInputs) {
+  TemporaryDirectory dir;
+  ExtractionCache cache;
+  std::string error_text;
+  EXPECT_FALSE(cache.Store("key", {}, dir.Path("out"), &error_text));
+  ASSERT_TRUE(cache.Open(dir.Path("cache"), &error_text)) << error_text;
+  WriteFile(dir.Path("out"), "out");
+  EXPECT_FALSE(
+      cache.Store("key", {{"a\n.h", "1"}}, dir.Path("out"), &error_text));
+  EXPECT_FALSE(cache.Store("key", {}, dir.Path("missing"), &error_text));
+  WriteFile(dir.Path("file"), "");
+  EXPECT_FALSE(cache.Open(dir.Path("file"), &error_text));
+}
+
+}  // namespace
+}  // namespace kythe
+
+int main(int argc, char** argv) {
+  google::InitGoogleLogging(argv[0]);
+  ::testing::InitGoogleTest(&argc, argv);
+  int result = RUN_ALL_TESTS();
+  return result;
+}
@@ -0,0 +1,189 @@
+/*
+ * Copyright 2017 Google Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "extractor_server.h"
+
+#include <errno.h>
+#include <signal.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+namespace kythe {
+namespace {
+
+#ifdef MSG_NOSIGNAL
+/// Report writes to closed sockets as errors instead of raising SIGPIPE.
+constexpr int kSendFlags = MSG_NOSIGNAL;
+#else
+constexpr int kSendFlags = 0;
+#endif
+
+/// \brief Fills in the address of the socket at `socket_path`.
+bool SocketAddress(const std::string& socket_path, struct sockaddr_un* address,
+                   std::string* error_text) {
+  memset(address, 0, sizeof(*address));
+  address->sun_family = AF_UNIX;
+  if (socket_path.empty() || socket_path.size() >= sizeof(address->sun_path)) {
+    *error_text = "Bad socket path " + socket_path;
+    return false;
+  }
+  memcpy(address->sun_path, socket_path.c_str(), socket_path.size() + 1);
+  return true;
+}
+
+/// \brief Writes all of `data` to `fd`.
+bool WriteAll(int fd, const std::string& data) {
+  size_t written = 0;
+  while (written < data.size()) {
+    ssize_t result =
+        ::send(fd, data.data() + written, data.size() - written, kSendFlags);
+    if (result < 0 && errno == EINTR) {
+      continue;
+    }
+    if (result <= 0) {
+      return false;
+    }
+    written += result;
+  }
+  return true;
+}
+
+/// \brief Reads from `fd` until end of file.
+bool ReadAll(int fd, std::string* data) {
+  char buffer[4096];
+  for (;;) {
+    ssize_t result = ::read(fd, buffer, sizeof(buffer));
+    if (result < 0 && errno == EINTR) {
+      continue;
+    }
+    if (result < 0) {
+      return false;
+    }
+    if (result == 0) {
+      return true;
+    }
+    data->append(buffer, result);
+  }
+}
+
+/// \brief Reads a request from `connection`, handles it and replies.
+void HandleConnection(int connection, const ExtractorRequestHandler& handler) {
+  std::string data;
+  if (!ReadAll(connection, &data)) {
+    return;
+  }
+  // Requests are a sequence of NUL-terminated fields.
+  std::vector<std::string> request;
+  size_t start = 0;
+  for (size_t end = data.find('\0'); end != std::string::npos;
+       end = data.find('\0', start)) {
+    request.emplace_back(data, start, end - start);
+    start = end + 1;
+  }
+  if (start != data.size()) {
+    return;
+  }
+  WriteAll(connection, handler(request) ? "1" : "0");
+}
+
+}  // anonymous namespace
+
+bool ServeExtractorRequests(const std::string& socket_path,
+                            const ExtractorRequestHandler& handler,
+                            std::string* error_text) {
+  struct sockaddr_un address;
+  if (!SocketAddress(socket_path, &address, error_text)) {
+    return false;
+  }
+  int listener = ::socket(AF_UNIX, SOCK_STREAM, 0);
+  if (listener < 0) {
+    *error_text = std::string("Couldn't create socket: ") + strerror(errno);
+    return false;
+  }
+  ::unlink(socket_path.c_str());
+  if (::bind(listener, reinterpret_cast<struct sockaddr*>(&address),
+             sizeof(address)) != 0 ||
+      ::listen(listener, SOMAXCONN) != 0) {
+    *error_text = "Couldn't listen on " + socket_path + ": " + strerror(errno);
+    ::close(listener);
+    return false;
+  }
+  // Let the kernel reap finished children.
+  ::signal(SIGCHLD, SIG_IGN);
+  for (;;) {
+    int connection = ::accept(listener, nullptr, nullptr);
+    if (connection < 0) {
+      if (errno == EINTR || errno == ECONNABORTED) {
+        continue;
+      }
+      *error_text = std::string("Couldn't accept: ") + strerror(errno);
+      ::close(listener);
+      return false;
+    }
+    pid_t child = ::fork();
+    if (child == 0) {
+      ::close(listener);
+      ::signal(SIGCHLD, SIG_DFL);
+      HandleConnection(connection, handler);
+      ::close(connection);
+      // Don't run the server's exit handlers or flush its buffers twice.
+      ::_exit(0);
+    }
+    // If we couldn't fork, the client sees the connection close and does
+    // the work itself.
+    ::close(connection);
+  }
+}
+
+bool SendExtractorRequest(const std::string& socket_path,
+                          const std::vector<std::string>& request,
+                          bool* succeeded, std::string* error_text) {
+  struct sockaddr_un address;
+  if (!SocketAddress(socket_path, &address, error_text)) {
+    return false;
+  }
+  int connection = ::socket(AF_UNIX, SOCK_STREAM, 0);
+  if (connection < 0) {
+    *error_text = std::string("Couldn't create socket: ") + strerror(errno);
+    return false;
+  }
+  if (::connect(connection, reinterpret_cast<struct sockaddr*>(&address),
+                sizeof(address)) != 0) {
+    *error_text = "Couldn't connect to " + socket_path + ": " + strerror(errno);
+    ::close(connection);
+    return false;
+  }
+  std::string data;
+  for (const auto& field : request) {
+    data.append(field);
+    data.push_back('\0');
+  }
+  std::string reply;
+  bool sent = WriteAll(connection, data) &&
+              ::shutdown(connection, SHUT_WR) == 0 &&
+              ReadAll(connection, &reply);
+  ::close(connection);
+  if (!sent || reply.size() != 1) {
+    *error_text = "No reply from " + socket_path;
+    return false;
+  }
+  *succeeded = reply == "1";
+  return true;
+}
+
+}  // namespace kythe
@@ -0,0 +1,56 @@
+/*
+ * Copyright 2017 Google Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef KYTHE_CXX_EXTRACTOR_EXTRACTOR_SERVER_H_
+#define KYTHE_CXX_EXTRACTOR_EXTRACTOR_SERVER_H_
+
+#include <functional>
+#include <string>
+#include <vector>
+
+namespace kythe {
+
+/// \brief Handles one request to an extractor server.
+/// \param request The fields the client sent.
+/// \return true if the request succeeded.
+using ExtractorRequestHandler =
+    std::function<bool(const std::vector<std::string>& request)>;
+
+/// \brief Answers requests on the Unix socket at `socket_path` until the
+/// process is killed. Any existing file at `socket_path` is replaced.
+///
+/// The server forks a child for every connection, so each request starts
+/// from the state the server had when it began serving (warm caches and
+/// all) and runs in parallel with the others. A handler that changes the
+/// working directory, leaks memory or crashes only affects its own request.
+/// The server process has to be single-threaded for this to be safe.
+/// \return false (with `error_text` set) if the socket couldn't be set up.
+bool ServeExtractorRequests(const std::string& socket_path,
+                            const ExtractorRequestHandler& handler,
+                            std::string* error_text);
+
+/// \brief Sends `request` to the server at `socket_path` and waits for it
+/// to be handled.
+/// \param succeeded Set to the value the handler returned.
+/// \return false if no server answered (with `error_text` set), in which
+/// case the caller should do the work itself.
+bool SendExtractorRequest(const std::string& socket_path,
+                          const std::vector<std::string>& request,
+                          bool* succeeded, std::string* error_text);
+
+}  // namespace kythe
+
+#endif  // KYTHE_CXX_EXTRACTOR_EXTRACTOR_SERVER_H_
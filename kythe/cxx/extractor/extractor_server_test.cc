@@ -0,0 +1,139 @@
+/*
+ * Copyright 2017 Google Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "extractor_server.h"
+
+#include <signal.h>
+#include <stdlib.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "glog/logging.h"
+#include "gtest/gtest.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Path.h"
+
+namespace kythe {
+namespace {
+
+/// \brief Runs an extractor server in a child process for the duration of
+/// a test.
+class TestServer {
+ public:
+  TestServer() {
+    CHECK_EQ(0, llvm::sys::fs::createUniqueDirectory("extractor_server",
+                                                      root_)
+                    .value());
+    llvm::SmallString<256> path(root_);
+    llvm::sys::path::append(path, "socket");
+    socket_path_ = std::string(path.str());
+    server_ = fork();
+    CHECK_GE(server_, 0);
+    if (server_ == 0) {
+      std::string error_text;
+      ServeExtractorRequests(socket_path_, Handle, &error_text);
+      LOG(ERROR) << error_text;
+      _exit(1);
+    }
+    // Wait for the server to start listening.
+    for (int tries = 0; tries < 500; ++tries) {
+      bool succeeded;
+      std::string error_text;
+      if (SendExtractorRequest(socket_path_, {"ping"}, &succeeded,
+                               &error_text)) {
+        break;
+      }
+      std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+  }
+
+  ~TestServer() {
+    kill(server_, SIGKILL);
+    waitpid(server_, nullptr, 0);
+    llvm::sys::fs::remove_directories(root_);
+  }
+
+  const std::string& socket_path() const { return socket_path_; }
+
+ private:
+  static bool Handle(const std::vector<std::string>& request) {
+    if (!request.empty() && request[0] == "crash") {
+      abort();
+    }
+    if (!request.empty() && request[0] == "chdir") {
+      // This only affects the child handling this request.
+      CHECK_EQ(0, chdir("/"));
+    }
+    return request.size() == 3 && request[1] == "ok" && request[2].empty();
+  }
+
+  llvm::SmallString<256> root_;
+  std::string socket_path_;
+  pid_t server_;
+};
+
+TEST(ExtractorServer, AnswersRequests) {
+  TestServer server;
+  bool succeeded = false;
+  std::string error_text;
+  ASSERT_TRUE(SendExtractorRequest(server.socket_path(), {"x", "ok", ""},
+                                   &succeeded, &error_text))
+      << error_text;
+  EXPECT_TRUE(succeeded);
+  ASSERT_TRUE(SendExtractorRequest(server.socket_path(), {"x", "no", ""},
+                                   &succeeded, &error_text))
+      << error_text;
+  EXPECT_FALSE(succeeded);
+}
+
+TEST(ExtractorServer, IsolatesRequests) {
+  TestServer server;
+  bool succeeded = false;
+  std::string error_text;
+  EXPECT_FALSE(SendExtractorRequest(server.socket_path(), {"crash"},
+                                    &succeeded, &error_text));
+  ASSERT_TRUE(SendExtractorRequest(server.socket_path(), {"chdir", "ok", ""},
+                                   &succeeded, &error_text))
+      << error_text;
+  EXPECT_TRUE(succeeded);
+  ASSERT_TRUE(SendExtractorRequest(server.socket_path(), {"x", "ok", ""},
+                                   &succeeded, &error_text))
+      << error_text;
+  EXPECT_TRUE(succeeded);
+}
+
+TEST(ExtractorServer, FailsWithoutServer) {
+  bool succeeded = false;
+  std::string error_text;
+  EXPECT_FALSE(SendExtractorRequest("/nonexistent/socket", {"x"}, &succeeded,
+                                    &error_text));
+  EXPECT_FALSE(error_text.empty());
+}
+
+}  // namespace
+}  // namespace kythe
+
+int main(int argc, char** argv) {
+  google::InitGoogleLogging(argv[0]);
+  ::testing::InitGoogleTest(&argc, argv);
+  int result = RUN_ALL_TESTS();
+  return result;
+}
@@ -0,0 +1,283 @@
+/*
+ * Copyright 2017 Google Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "file_digest_cache.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+
+namespace kythe {
+namespace {
+
+/// Marks a file as a digest cache (in the header's `sequence`).
+constexpr uint64_t kMagic = 0x314348434744594bULL;  // "KYDGCHC1"
+
+/// Files whose status changed this close to the snapshot time aren't
+/// trusted, since file timestamps may be coarser than the clock.
+constexpr uint64_t kSlackNs = 2000000000ULL;
+
+/// The number of slots to probe before giving up (and, when storing,
+/// evicting the first one).
+constexpr size_t kMaxProbes = 8;
+
+uint64_t TimespecNs(const struct timespec& time) {
+  return static_cast<uint64_t>(time.tv_sec) * 1000000000ULL + time.tv_nsec;
+}
+
+/// \brief Parses a 64-character hex digest into four words.
+bool ParseDigest(const std::string& digest, uint64_t words[4]) {
+  if (digest.size() != 64) {
+    return false;
+  }
+  for (size_t word = 0; word < 4; ++word) {
+    uint64_t value = 0;
+    for (size_t i = 0; i < 16; ++i) {
+      char c = digest[word * 16 + i];
+      value <<= 4;
+      if (c >= '0' && c <= '9') {
+        value |= c - '0';
+      } else if (c >= 'a' && c <= 'f') {
+        value |= c - 'a' + 10;
+      } else {
+        return false;
+      }
+    }
+    words[word] = value;
+  }
+  return true;
+}
+
+std::string FormatDigest(const uint64_t words[4]) {
+  static const char kHexDigits[] = "0123456789abcdef";
+  std::string digest(64, '0');
+  for (size_t word = 0; word < 4; ++word) {
+    for (size_t i = 0; i < 16; ++i) {
+      digest[word * 16 + i] = kHexDigits[(words[word] >> (60 - 4 * i)) & 0xf];
+    }
+  }
+  return digest;
+}
+
+}  // anonymous namespace
+
+/// \brief A slot in the table. All-zero bits are an empty slot.
+struct FileDigestCache::Slot {
+  /// Even when the slot is stable, odd while it's being written, and 0 if
+  /// it has never been written. The header slot holds `kMagic` instead.
+  std::atomic<uint64_t> sequence;
+  std::atomic<uint64_t> device;
+  std::atomic<uint64_t> inode;
+  std::atomic<uint64_t> size;
+  std::atomic<uint64_t> mtime_ns;
+  std::atomic<uint64_t> ctime_ns;
+  /// The SHA-256 digest of this version of the file.
+  std::atomic<uint64_t> digest[4];
+};
+
+static_assert(ATOMIC_LLONG_LOCK_FREE == 2,
+              "Shared digest caches need lock-free 64-bit atomics.");
+
+FileDigestCache::FileDigestCache() = default;
+
+FileDigestCache::~FileDigestCache() {
+  if (slots_ != nullptr) {
+    ::munmap(slots_, slot_count_ * sizeof(Slot));
+  }
+}
+
+bool FileDigestCache::Open(const std::string& path, size_t slot_count,
+                           std::string* error_text) {
+  int fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0666);
+  if (fd < 0) {
+    *error_text = "Couldn't open " + path + ": " + strerror(errno);
+    return false;
+  }
+  slot_count = std::max<size_t>(slot_count, 1);
+  struct stat info;
+  // As with shared claim tables, racing creators agree on a size and fresh
+  // pages are zeroed (empty) slots.
+  if (::fstat(fd, &info) == 0 && info.st_size == 0 &&
+      ::ftruncate(fd, (slot_count + 1) * sizeof(Slot)) != 0) {
+    *error_text = "Couldn't size " + path + ": " + strerror(errno);
+    ::close(fd);
+    return false;
+  }
+  if (::fstat(fd, &info) != 0 ||
+      static_cast<size_t>(info.st_size) < 2 * sizeof(Slot) ||
+      info.st_size % sizeof(Slot) != 0) {
+    *error_text = "Bad digest cache " + path;
+    ::close(fd);
+    return false;
+  }
+  void* data = ::mmap(nullptr, info.st_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED, fd, 0);
+  ::close(fd);
+  if (data == MAP_FAILED) {
+    *error_text = "Couldn't map " + path + ": " + strerror(errno);
+    return false;
+  }
+  Slot* slots = static_cast<Slot*>(data);
+  uint64_t magic = 0;
+  if (!slots[0].sequence.compare_exchange_strong(magic, kMagic) &&
+      magic != kMagic) {
+    *error_text = path + " isn't a digest cache";
+    ::munmap(data, info.st_size);
+    return false;
+  }
+  if (slots_ != nullptr) {
+    ::munmap(slots_, slot_count_ * sizeof(Slot));
+  }
+  slots_ = slots;
+  slot_count_ = info.st_size / sizeof(Slot);
+  struct timespec now;
+  ::clock_gettime(CLOCK_REALTIME, &now);
+  snapshot_time_ns_ = TimespecNs(now);
+  return true;
+}
+
+bool FileDigestCache::Stat(const std::string& path, FileStat* file_stat) {
+  struct stat info;
+  if (::stat(path.c_str(), &info) != 0 || !S_ISREG(info.st_mode)) {
+    return false;
+  }
+  file_stat->device = info.st_dev;
+  file_stat->inode = info.st_ino;
+  file_stat->size = info.st_size;
+#ifdef __APPLE__
+  file_stat->mtime_ns = TimespecNs(info.st_mtimespec);
+  file_stat->ctime_ns = TimespecNs(info.st_ctimespec);
+#else
+  file_stat->mtime_ns = TimespecNs(info.st_mtim);
+  file_stat->ctime_ns = TimespecNs(info.st_ctim);
+#endif
+  return true;
+}
+
+bool FileDigestCache::IsStable(const FileStat& file_stat) const {
+  return file_stat.ctime_ns + kSlackNs < snapshot_time_ns_;
+}
+
+size_t FileDigestCache::HomeSlot(const FileStat& file_stat) const {
+  uint64_t hash = file_stat.inode * 0x9e3779b97f4a7c15ULL;
+  hash ^= file_stat.device + (hash >> 29);
+  return 1 + hash % (slot_count_ - 1);
+}
+
+bool FileDigestCache::Lookup(const FileStat& file_stat, std::string* digest) {
+  if (slots_ == nullptr || !IsStable(file_stat)) {
+    ++misses_;
+    return false;
+  }
+  size_t index = HomeSlot(file_stat);
+  for (size_t probes = 0; probes < kMaxProbes && probes < slot_count_ - 1;
+       ++probes, index = index + 1 == slot_count_ ? 1 : index + 1) {
+    Slot* slot = &slots_[index];
+    uint64_t sequence = slot->sequence.load(std::memory_order_acquire);
+    if (sequence == 0) {
+      break;
+    }
+    if (sequence & 1) {
+      continue;
+    }
+    FileStat cached;
+    cached.device = slot->device.load(std::memory_order_relaxed);
+    cached.inode = slot->inode.load(std::memory_order_relaxed);
+    cached.size = slot->size.load(std::memory_order_relaxed);
+    cached.mtime_ns = slot->mtime_ns.load(std::memory_order_relaxed);
+    cached.ctime_ns = slot->ctime_ns.load(std::memory_order_relaxed);
+    uint64_t words[4];
+    for (size_t word = 0; word < 4; ++word) {
+      words[word] = slot->digest[word].load(std::memory_order_relaxed);
+    }
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (slot->sequence.load(std::memory_order_relaxed) != sequence) {
+      continue;
+    }
+    if (cached.device != file_stat.device || cached.inode != file_stat.inode) {
+      continue;
+    }
+    if (cached.size != file_stat.size ||
+        cached.mtime_ns != file_stat.mtime_ns ||
+        cached.ctime_ns != file_stat.ctime_ns) {
+      break;
+    }
+    *digest = FormatDigest(words);
+    ++hits_;
+    return true;
+  }
+  ++misses_;
+  return false;
+}
+
+void FileDigestCache::Store(const FileStat& file_stat,
+                            const std::string& digest) {
+  uint64_t words[4];
+  if (slots_ == nullptr || !IsStable(file_stat) ||
+      !ParseDigest(digest, words)) {
+    return;
+  }
+  Slot* target = nullptr;
+  uint64_t sequence = 0;
+  size_t index = HomeSlot(file_stat);
+  for (size_t probes = 0; probes < kMaxProbes && probes < slot_count_ - 1;
+       ++probes, index = index + 1 == slot_count_ ? 1 : index + 1) {
+    Slot* slot = &slots_[index];
+    sequence = slot->sequence.load(std::memory_order_acquire);
+    if (sequence & 1) {
+      // Someone else is writing here (maybe about this very file).
+      return;
+    }
+    if (sequence == 0 ||
+        (slot->device.load(std::memory_order_relaxed) == file_stat.device &&
+         slot->inode.load(std::memory_order_relaxed) == file_stat.inode)) {
+      target = slot;
+      break;
+    }
+  }
+  if (target == nullptr) {
+    // Every slot we looked at belongs to another file; evict the first.
+    target = &slots_[HomeSlot(file_stat)];
+    sequence = target->sequence.load(std::memory_order_acquire);
+    if (sequence & 1) {
+      return;
+    }
+  }
+  // If the sequence moved since we read it, another writer got here first.
+  if (!target->sequence.compare_exchange_strong(sequence, sequence + 1,
+                                                std::memory_order_acq_rel)) {
+    return;
+  }
+  std::atomic_thread_fence(std::memory_order_release);
+  target->device.store(file_stat.device, std::memory_order_relaxed);
+  target->inode.store(file_stat.inode, std::memory_order_relaxed);
+  target->size.store(file_stat.size, std::memory_order_relaxed);
+  target->mtime_ns.store(file_stat.mtime_ns, std::memory_order_relaxed);
+  target->ctime_ns.store(file_stat.ctime_ns, std::memory_order_relaxed);
+  for (size_t word = 0; word < 4; ++word) {
+    target->digest[word].store(words[word], std::memory_order_relaxed);
+  }
+  target->sequence.store(sequence + 2, std::memory_order_release);
+}
+
+}  // namespace kythe
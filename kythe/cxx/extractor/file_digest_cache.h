@@ -0,0 +1,113 @@
+/*
+ * Copyright 2017 Google Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef KYTHE_CXX_EXTRACTOR_FILE_DIGEST_CACHE_H_
+#define KYTHE_CXX_EXTRACTOR_FILE_DIGEST_CACHE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <string>
+
+namespace kythe {
+
+/// \brief The parts of a file's status that identify one version of its
+/// contents.
+struct FileStat {
+  uint64_t device = 0;
+  uint64_t inode = 0;
+  uint64_t size = 0;
+  uint64_t mtime_ns = 0;
+  uint64_t ctime_ns = 0;
+};
+
+/// \brief A persistent table of file digests shared by every extractor on a
+/// host, so that headers that haven't changed aren't hashed again by each
+/// compilation that includes them.
+///
+/// The table is a file mapped into memory and laid out as an open-addressed
+/// array of slots keyed by (device, inode). A slot also records the size,
+/// modification time and status change time of the version it describes;
+/// any write to a file changes its status change time (even if the
+/// modification time is set back), so a lookup only succeeds if the file
+/// is still the version that was hashed. Slots are guarded by sequence
+/// counters: writers that race for a slot drop their updates and readers
+/// that race with a writer see a miss, never a torn entry.
+///
+/// Files whose status changed shortly before the cache was opened (or at
+/// any point after) are neither looked up nor stored, because we can't tell
+/// whether the contents Clang read match the status we saw.
+class FileDigestCache {
+ public:
+  FileDigestCache();
+  ~FileDigestCache();
+  FileDigestCache(const FileDigestCache&) = delete;
+  FileDigestCache& operator=(const FileDigestCache&) = delete;
+
+  /// \brief Maps the cache at `path`, creating it with room for
+  /// `slot_count` digests if it doesn't exist yet. An existing cache keeps
+  /// its size. Also records the current time as the cache's snapshot time.
+  /// \return false on failure (with `error_text` set).
+  bool Open(const std::string& path, size_t slot_count,
+            std::string* error_text);
+
+  /// \brief Reads the status of the file at `path`.
+  /// \return false if the file couldn't be examined.
+  static bool Stat(const std::string& path, FileStat* file_stat);
+
+  /// \return true if the file with status `file_stat` last changed long
+  /// enough before the snapshot time to be looked up or stored.
+  bool IsStable(const FileStat& file_stat) const;
+
+  /// \brief Looks up the digest for the version of a file with status
+  /// `file_stat`.
+  /// \param digest Set to the lowercase hex SHA-256 digest on success.
+  /// \return true if the cache has a digest for that version.
+  bool Lookup(const FileStat& file_stat, std::string* digest);
+
+  /// \brief Records that the version of a file with status `file_stat` has
+  /// the lowercase hex SHA-256 digest `digest`. Does nothing if the file
+  /// isn't stable or another process is updating the same slot.
+  void Store(const FileStat& file_stat, const std::string& digest);
+
+  /// \brief Sets the time against which `IsStable` measures files.
+  void set_snapshot_time_ns(uint64_t value) { snapshot_time_ns_ = value; }
+
+  /// \return the number of successful lookups so far.
+  size_t hits() const { return hits_; }
+  /// \return the number of failed lookups so far.
+  size_t misses() const { return misses_; }
+
+ private:
+  struct Slot;
+
+  /// \return the slot where probing for `file_stat` starts.
+  size_t HomeSlot(const FileStat& file_stat) const;
+
+  /// The mapped table. The first slot is a header.
+  Slot* slots_ = nullptr;
+  /// The number of slots in `slots_`, including the header.
+  size_t slot_count_ = 0;
+  /// Files whose status changed after this time (less some slack) aren't
+  /// trusted.
+  uint64_t snapshot_time_ns_ = 0;
+  size_t hits_ = 0;
+  size_t misses_ = 0;
+};
+
+}  // namespace kythe
+
+#endif  // KYTHE_CXX_EXTRACTOR_FILE_DIGEST_CACHE_H_
@@ -0,0 +1,188 @@
+/*
+ * Copyright 2017 Google Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "file_digest_cache.h"
+
+#include <stdio.h>
+#include <time.h>
+
+#include <string>
+
+#include "glog/logging.h"
+#include "gtest/gtest.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Path.h"
+
+namespace kythe {
+namespace {
+
+constexpr char kDigest[] =
+    "2c26b46b68ffc68ff99b453c1d30413413422d706483bfa0f98a5e886266e7ae";
+constexpr char kOtherDigest[] =
+    "fcde2b2edba56bf408601fb721fe9b5c338d10ee429ea04fae5511b68fbf8fb9";
+
+/// \brief A temporary directory that is removed with its contents.
+class TemporaryDirectory {
+ public:
+  TemporaryDirectory() {
+    CHECK_EQ(0, llvm::sys::fs::createUniqueDirectory("file_digest_cache",
+                                                      root_)
+                    .value());
+  }
+  ~TemporaryDirectory() { llvm::sys::fs::remove_directories(root_); }
+
+  std::string Path(const std::string& name) const {
+    llvm::SmallString<256> path(root_);
+    llvm::sys::path::append(path, name);
+    return std::string(path.str());
+  }
+
+ private:
+  llvm::SmallString<256> root_;
+};
+
+void WriteFile(const std::string& path, const std::string& content) {
+  FILE* file = fopen(path.c_str(), "wb");
+  CHECK(file != nullptr);
+  CHECK_EQ(content.size(), fwrite(content.data(), 1, content.size(), file));
+  CHECK_EQ(0, fclose(file));
+}
+
+/// \return a time far enough in the future that files changed now are
+/// stable.
+uint64_t Later() {
+  return (static_cast<uint64_t>(time(nullptr)) + 60) * 1000000000ULL;
+}
+
+TEST(FileDigestCache, StoresAndLooksUp) {
+  TemporaryDirectory dir;
+  WriteFile(dir.Path("foo.h"), "foo");
+  FileStat file_stat;
+  ASSERT_TRUE(FileDigestCache::Stat(dir.Path("foo.h"), &file_stat));
+  FileDigestCache cache;
+  std::string error_text;
+  ASSERT_TRUE(cache.Open(dir.Path("cache"), 16, &error_text)) << error_text;
+  cache.set_snapshot_time_ns(Later());
+  std::string digest;
+  EXPECT_FALSE(cache.Lookup(file_stat, &digest));
+  cache.Store(file_stat, kDigest);
+  ASSERT_TRUE(cache.Lookup(file_stat, &digest));
+  EXPECT_EQ(kDigest, digest);
+  EXPECT_EQ(1, cache.hits());
+  EXPECT_EQ(1, cache.misses());
+}
+
+TEST(FileDigestCache, PersistsAcrossOpens) {
+  TemporaryDirectory dir;
+  WriteFile(dir.Path("foo.h"), "foo");
+  FileStat file_stat;
+  ASSERT_TRUE(FileDigestCache::Stat(dir.Path("foo.h"), &file_stat));
+  std::string error_text;
+  {
+    FileDigestCache cache;
+    ASSERT_TRUE(cache.Open(dir.Path("cache"), 16, &error_text)) << error_text;
+    cache.set_snapshot_time_ns(Later());
+    cache.Store(file_stat, kDigest);
+  }
+  FileDigestCache cache;
+  // The existing cache keeps its size.
+  ASSERT_TRUE(cache.Open(dir.Path("cache"), 1024, &error_text)) << error_text;
+  cache.set_snapshot_time_ns(Later());
+  std::string digest;
+  ASSERT_TRUE(cache.Lookup(file_stat, &digest));
+  EXPECT_EQ(kDigest, digest);
+}
+
+TEST(FileDigestCache, MissesChangedFiles) {
+  TemporaryDirectory dir;
+  WriteFile(dir.Path("foo.h"), "foo");
+  FileStat file_stat;
+  ASSERT_TRUE(FileDigestCache::Stat(dir.Path("foo.h"), &file_stat));
+  FileDigestCache cache;
+  std::string error_text;
+  ASSERT_TRUE(cache.Open(dir.Path("cache"), 16, &error_text)) << error_text;
+  cache.set_snapshot_time_ns(Later());
+  cache.Store(file_stat, kDigest);
+  FileStat changed = file_stat;
+  changed.ctime_ns += 1;
+  std::string digest;
+  EXPECT_FALSE(cache.Lookup(changed, &digest));
+  changed = file_stat;
+  changed.size += 1;
+  EXPECT_FALSE(cache.Lookup(changed, &digest));
+  // A new version replaces the old one.
+  cache.Store(changed, kOtherDigest);
+  ASSERT_TRUE(cache.Lookup(changed, &digest));
+  EXPECT_EQ(kOtherDigest, digest);
+  EXPECT_FALSE(cache.Lookup(file_stat, &digest));
+}
+
+TEST(FileDigestCache, DistinguishesFiles) {
+  TemporaryDirectory dir;
+  WriteFile(dir.Path("foo.h"), "foo");
+  WriteFile(dir.Path("bar.h"), "bar");
+  FileStat foo_stat, bar_stat;
+  ASSERT_TRUE(FileDigestCache::Stat(dir.Path("foo.h"), &foo_stat));
+  ASSERT_TRUE(FileDigestCache::Stat(dir.Path("bar.h"), &bar_stat));
+  FileDigestCache cache;
+  std::string error_text;
+  // A single data slot forces the files to collide.
+  ASSERT_TRUE(cache.Open(dir.Path("cache"), 1, &error_text)) << error_text;
+  cache.set_snapshot_time_ns(Later());
+  cache.Store(foo_stat, kDigest);
+  std::string digest;
+  EXPECT_FALSE(cache.Lookup(bar_stat, &digest));
+  cache.Store(bar_stat, kOtherDigest);
+  ASSERT_TRUE(cache.Lookup(bar_stat, &digest));
+  EXPECT_EQ(kOtherDigest, digest);
+  EXPECT_FALSE(cache.Lookup(foo_stat, &digest));
+}
+
+TEST(FileDigestCache, IgnoresRecentChanges) {
+  TemporaryDirectory dir;
+  WriteFile(dir.Path("foo.h"), "foo");
+  FileStat file_stat;
+  ASSERT_TRUE(FileDigestCache::Stat(dir.Path("foo.h"), &file_stat));
+  FileDigestCache cache;
+  std::string error_text;
+  ASSERT_TRUE(cache.Open(dir.Path("cache"), 16, &error_text)) << error_text;
+  // foo.h was written just before the cache was opened.
+  EXPECT_FALSE(cache.IsStable(file_stat));
+  cache.Store(file_stat, kDigest);
+  cache.set_snapshot_time_ns(Later());
+  std::string digest;
+  EXPECT_FALSE(cache.Lookup(file_stat, &digest));
+}
+
+TEST(FileDigestCache, RejectsOtherFiles) {
+  TemporaryDirectory dir;
+  WriteFile(dir.Path("cache"), std::string(160, 'x'));
+  FileDigestCache cache;
+  std::string error_text;
+  EXPECT_FALSE(cache.Open(dir.Path("cache"), 16, &error_text));
+  EXPECT_FALSE(error_text.empty());
+  EXPECT_FALSE(FileDigestCache::Stat(dir.Path("missing"), nullptr));
+}
+
+}  // namespace
+}  // namespace kythe
+
+int main(int argc, char** argv) {
+  google::InitGoogleLogging(argv[0]);
+  ::testing::InitGoogleTest(&argc, argv);
+  int result = RUN_ALL_TESTS();
+  return result;
+}
@@ -16,12 +16,46 @@
 
 #include "objc_bazel_support.h"
 
+#include <llvm/ADT/SmallVector.h>
 #include <llvm/ADT/StringRef.h>
 #include "re2/re2.h"
 
+#include <stdio.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <fstream>
 #include <sstream>
+#include <utility>
 
 namespace kythe {
+namespace {
+
+/// \brief Replaces every occurrence of `from` in `text` with `to`.
+void ReplaceAll(std::string *text, const std::string &from,
+                const std::string &to) {
+  for (size_t pos = text->find(from); pos != std::string::npos;
+       pos = text->find(from, pos + to.size())) {
+    text->replace(pos, from.size(), to);
+  }
+}
+
+/// \brief Replaces the placeholders Bazel uses for Xcode paths in `arg`.
+std::string FixArg(std::string arg, const std::string &devdir,
+                   const std::string &sdkroot) {
+  ReplaceAll(&arg, "__BAZEL_XCODE_DEVELOPER_DIR__", devdir);
+  ReplaceAll(&arg, "__BAZEL_XCODE_SDKROOT__", sdkroot);
+  return arg;
+}
+
+/// The environment variables that select an Xcode installation and SDK.
+const char *const kXcodeVariables[] = {
+    "XCODE_VERSION_OVERRIDE", "APPLE_SDK_PLATFORM",
+    "APPLE_SDK_VERSION_OVERRIDE", "DEVELOPER_DIR", "SDKROOT",
+};
+
+}  // anonymous namespace
 
 // This is inspiried by Python's commands.mkarg
 // https://hg.python.org/cpython/file/tip/Lib/commands.py#l81
@@ -73,10 +107,7 @@ void FillWithFixedArgs(std::vector<std::string> &args,
                        const std::string &devdir, const std::string &sdkroot) {
   args.push_back(ci.tool());
   for (const auto &i : ci.compiler_option()) {
-    std::string arg = i;
-    RE2::GlobalReplace(&arg, "__BAZEL_XCODE_DEVELOPER_DIR__", devdir);
-    RE2::GlobalReplace(&arg, "__BAZEL_XCODE_SDKROOT__", sdkroot);
-    args.push_back(arg);
+    args.push_back(FixArg(i, devdir, sdkroot));
   }
   args.push_back(ci.source_file());
 }
@@ -85,10 +116,108 @@ void FillWithFixedArgs(std::vector<std::string> &args,
                        const blaze::SpawnInfo &si, const std::string &devdir,
                        const std::string &sdkroot) {
   for (const auto &i : si.argument()) {
-    std::string arg = i;
-    RE2::GlobalReplace(&arg, "__BAZEL_XCODE_DEVELOPER_DIR__", devdir);
-    RE2::GlobalReplace(&arg, "__BAZEL_XCODE_SDKROOT__", sdkroot);
-    args.push_back(arg);
+    args.push_back(FixArg(i, devdir, sdkroot));
+  }
+}
+
+XcodePathCache::XcodePathCache(std::string cache_path,
+                               int64_t max_age_seconds)
+    : cache_path_(std::move(cache_path)), max_age_seconds_(max_age_seconds) {}
+
+std::string XcodePathCache::Resolve(
+    const google::protobuf::RepeatedPtrField<blaze::EnvironmentVariable> &vars,
+    const std::string &script) {
+  std::string key = script;
+  for (const char *name : kXcodeVariables) {
+    key.append(" ").append(name).append("=");
+    for (const auto &env : vars) {
+      if (env.name() == name) {
+        key.append(env.value());
+      }
+    }
+  }
+  if (!cache_path_.empty()) {
+    if (!loaded_) {
+      Load(&entries_);
+      loaded_ = true;
+    }
+    auto found = entries_.find(key);
+    if (found != entries_.end() && IsFresh(found->second, script)) {
+      return found->second.value;
+    }
+  }
+  ++scripts_run_;
+  Entry entry;
+  struct stat script_stat;
+  bool script_exists = ::stat(script.c_str(), &script_stat) == 0;
+  entry.value = RunScript(BuildEnvVarCommandPrefix(vars) + script);
+  entry.script_mtime = script_exists ? script_stat.st_mtime : 0;
+  entry.script_size = script_exists ? script_stat.st_size : 0;
+  entry.resolved_at = ::time(nullptr);
+  // Keys and values are stored one per line, separated by a tab; don't try
+  // to store anything that would break that. Don't remember failures either.
+  if (!cache_path_.empty() && script_exists && !entry.value.empty() &&
+      key.find_first_of("\t\n") == std::string::npos &&
+      entry.value.find_first_of("\t\n") == std::string::npos) {
+    Store(key, entry);
+  }
+  return entry.value;
+}
+
+bool XcodePathCache::IsFresh(const Entry &entry,
+                             const std::string &script) const {
+  int64_t now = ::time(nullptr);
+  if (now < entry.resolved_at || now - entry.resolved_at > max_age_seconds_) {
+    return false;
+  }
+  struct stat file_stat;
+  if (::stat(script.c_str(), &file_stat) != 0 ||
+      file_stat.st_mtime != entry.script_mtime ||
+      file_stat.st_size != entry.script_size) {
+    return false;
+  }
+  return ::stat(entry.value.c_str(), &file_stat) == 0;
+}
+
+void XcodePathCache::Load(std::map<std::string, Entry> *entries) const {
+  std::ifstream input(cache_path_);
+  std::string line;
+  while (std::getline(input, line)) {
+    llvm::SmallVector<llvm::StringRef, 5> fields;
+    llvm::StringRef(line).split(fields, '\t');
+    Entry entry;
+    if (fields.size() != 5 || fields[2].getAsInteger(10, entry.script_mtime) ||
+        fields[3].getAsInteger(10, entry.script_size) ||
+        fields[4].getAsInteger(10, entry.resolved_at)) {
+      continue;
+    }
+    entry.value = fields[1].str();
+    (*entries)[fields[0].str()] = entry;
+  }
+}
+
+void XcodePathCache::Store(const std::string &key, const Entry &entry) {
+  // Pick up whatever other extractors have stored since we loaded.
+  std::map<std::string, Entry> merged;
+  Load(&merged);
+  merged[key] = entry;
+  entries_[key] = entry;
+  std::string temp_path = cache_path_ + ".tmp." + std::to_string(::getpid());
+  {
+    std::ofstream output(temp_path, std::ios::trunc);
+    for (const auto &stored : merged) {
+      output << stored.first << '\t' << stored.second.value << '\t'
+             << stored.second.script_mtime << '\t'
+             << stored.second.script_size << '\t'
+             << stored.second.resolved_at << '\n';
+    }
+    if (!output.flush()) {
+      ::unlink(temp_path.c_str());
+      return;
+    }
+  }
+  if (::rename(temp_path.c_str(), cache_path_.c_str()) != 0) {
+    ::unlink(temp_path.c_str());
   }
 }
 
@@ -17,6 +17,8 @@
 #ifndef KYTHE_CXX_EXTRACTOR_OBJC_BAZEL_SUPPORT_H_
 #define KYTHE_CXX_EXTRACTOR_OBJC_BAZEL_SUPPORT_H_
 
+#include <cstdint>
+#include <map>
 #include <string>
 #include <vector>
 
@@ -61,6 +63,69 @@ void FillWithFixedArgs(std::vector<std::string> &args,
                        const blaze::SpawnInfo &si, const std::string &devdir,
                        const std::string &sdkroot);
 
+/// \brief Remembers what the developer directory and SDK root scripts
+/// printed in a host-local cache file, so that only the first action for each
+/// Xcode version and platform pays for running them.
+///
+/// Entries are keyed by the script and by the Xcode-related variables Bazel
+/// sets for the action (`XCODE_VERSION_OVERRIDE`, `APPLE_SDK_PLATFORM`,
+/// `APPLE_SDK_VERSION_OVERRIDE`, `DEVELOPER_DIR` and `SDKROOT`); scripts must
+/// not depend on anything else in the action's environment. An entry is
+/// dropped when the script changes, when the path it names goes away or when
+/// it is older than `max_age_seconds` (which catches `xcode-select -s`).
+/// The cache file is replaced atomically, so concurrent extractors at worst
+/// repeat each other's work.
+class XcodePathCache {
+ public:
+  /// \param cache_path Where to keep entries. If empty, nothing is cached.
+  /// \param max_age_seconds How long an entry may be used.
+  explicit XcodePathCache(std::string cache_path,
+                          int64_t max_age_seconds = 3600);
+
+  /// \brief Runs `script` with the environment `vars`, or returns what it
+  /// printed for an earlier action with the same Xcode configuration.
+  /// \return the trimmed output of the script, or the empty string.
+  std::string Resolve(
+      const google::protobuf::RepeatedPtrField<blaze::EnvironmentVariable>
+          &vars,
+      const std::string &script);
+
+  /// \return the number of calls to `Resolve` that ran their script.
+  size_t scripts_run() const { return scripts_run_; }
+
+ private:
+  struct Entry {
+    /// What the script printed.
+    std::string value;
+    /// The modification time of the script at the time it was run.
+    int64_t script_mtime;
+    /// The size of the script at the time it was run.
+    int64_t script_size;
+    /// When the script was run, in seconds since the epoch.
+    int64_t resolved_at;
+  };
+
+  /// \brief Reads the entries in `cache_path_` into `entries`.
+  void Load(std::map<std::string, Entry> *entries) const;
+
+  /// \brief Adds `entry` to the cache file, keeping others' entries.
+  void Store(const std::string &key, const Entry &entry);
+
+  /// \return true if `entry` may still be used for `script`.
+  bool IsFresh(const Entry &entry, const std::string &script) const;
+
+  /// The file to keep entries in.
+  std::string cache_path_;
+  /// How long entries may be used.
+  int64_t max_age_seconds_;
+  /// Entries read from (or written to) `cache_path_`.
+  std::map<std::string, Entry> entries_;
+  /// Whether `entries_` has been loaded yet.
+  bool loaded_ = false;
+  /// The number of scripts we've run.
+  size_t scripts_run_ = 0;
+};
+
 }  // namespace kythe
 
 #endif  // KYTHE_CXX_EXTRACTOR_OBJC_BAZEL_SUPPORT_H_
@@ -16,6 +16,11 @@
 
 #include "objc_bazel_support.h"
 
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
 #include "glog/logging.h"
 #include "gtest/gtest.h"
 
@@ -151,6 +156,93 @@ TEST(ObjcExtractorBazelMain, TestRunScriptThatFails) {
 //  EXPECT_EQ("", RunScript("/usr/bin/xcrun"));
 //}
 
+/// \brief A temporary directory holding a script that prints the
+/// directory's path and counts how often it was run.
+class XcodePathCacheTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    char dir_template[] = "/tmp/xcode_path_cache_test.XXXXXX";
+    ASSERT_NE(nullptr, mkdtemp(dir_template));
+    dir_ = dir_template;
+    script_ = dir_ + "/get_devdir.sh";
+    cache_ = dir_ + "/cache";
+    WriteScript("");
+  }
+
+  void TearDown() override {
+    RunScript("rm -rf " + SanitizeArgument(dir_));
+  }
+
+  void WriteScript(const std::string &extra) {
+    FILE *script = fopen(script_.c_str(), "w");
+    ASSERT_NE(nullptr, script);
+    fprintf(script, "#!/bin/sh\necho run >> %s/count\necho %s%s\n",
+            dir_.c_str(), dir_.c_str(), extra.c_str());
+    fclose(script);
+    chmod(script_.c_str(), 0755);
+  }
+
+  google::protobuf::RepeatedPtrField<blaze::EnvironmentVariable> Vars(
+      const std::string &platform, const std::string &other) {
+    google::protobuf::RepeatedPtrField<blaze::EnvironmentVariable> vars;
+    auto *e = vars.Add();
+    e->set_name("APPLE_SDK_PLATFORM");
+    e->set_value(platform);
+    e = vars.Add();
+    e->set_name("OTHER");
+    e->set_value(other);
+    return vars;
+  }
+
+  std::string dir_;
+  std::string script_;
+  std::string cache_;
+};
+
+TEST_F(XcodePathCacheTest, RemembersResultsAcrossInstances) {
+  {
+    XcodePathCache paths(cache_);
+    EXPECT_EQ(dir_, paths.Resolve(Vars("iOS", "a"), script_));
+    EXPECT_EQ(dir_, paths.Resolve(Vars("iOS", "a"), script_));
+    EXPECT_EQ(1, paths.scripts_run());
+  }
+  XcodePathCache paths(cache_);
+  EXPECT_EQ(dir_, paths.Resolve(Vars("iOS", "b"), script_));
+  EXPECT_EQ(0, paths.scripts_run());
+  EXPECT_EQ(dir_, paths.Resolve(Vars("macOS", "b"), script_));
+  EXPECT_EQ(1, paths.scripts_run());
+  EXPECT_EQ("run\nrun", RunScript("cat " + SanitizeArgument(dir_ + "/count")));
+}
+
+TEST_F(XcodePathCacheTest, DropsStaleEntries) {
+  XcodePathCache(cache_).Resolve(Vars("iOS", ""), script_);
+  {
+    XcodePathCache paths(cache_, -1);
+    paths.Resolve(Vars("iOS", ""), script_);
+    EXPECT_EQ(1, paths.scripts_run());
+  }
+  WriteScript("/.");
+  {
+    XcodePathCache paths(cache_);
+    EXPECT_EQ(dir_ + "/.", paths.Resolve(Vars("iOS", ""), script_));
+    EXPECT_EQ(1, paths.scripts_run());
+  }
+  WriteScript("/missing");
+  {
+    XcodePathCache paths(cache_);
+    paths.Resolve(Vars("iOS", ""), script_);
+    paths.Resolve(Vars("iOS", ""), script_);
+    EXPECT_EQ(2, paths.scripts_run());
+  }
+}
+
+TEST_F(XcodePathCacheTest, CachesNothingWithoutAPath) {
+  XcodePathCache paths("");
+  EXPECT_EQ(dir_, paths.Resolve(Vars("iOS", ""), script_));
+  EXPECT_EQ(dir_, paths.Resolve(Vars("iOS", ""), script_));
+  EXPECT_EQ(2, paths.scripts_run());
+}
+
 }  // namespace
 }  // namespace kythe
 
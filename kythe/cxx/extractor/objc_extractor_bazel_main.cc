@@ -64,6 +64,11 @@
 //    name = "get_sdkroot",
 //    srcs = ["get_sdkroot.sh"],
 //  )
+//
+// What the scripts print is cached for each Xcode version and platform in
+// $KYTHE_XCODE_PATH_CACHE (by default, kythe_xcode_path_cache in $TMPDIR or
+// /tmp). Set KYTHE_XCODE_PATH_CACHE to the empty string to run the scripts
+// for every action.
 
 #include <fcntl.h>
 #include <sys/stat.h>
@@ -87,6 +92,8 @@ struct XAState {
   std::string vname_config;
   std::string devdir_script;
   std::string sdkroot_script;
+  /// Resolves the developer directory and SDK root.
+  kythe::XcodePathCache *xcode_paths;
 };
 
 static bool ContainsUnsupportedArg(const std::vector<std::string> &args) {
@@ -104,9 +111,10 @@ static bool LoadSpawnInfo(const XAState &xa_state,
                           kythe::ExtractorConfiguration &config) {
   blaze::SpawnInfo spawn_info = info.GetExtension(blaze::SpawnInfo::spawn_info);
 
-  auto cmdPrefix = kythe::BuildEnvVarCommandPrefix(spawn_info.variable());
-  auto devdir = kythe::RunScript(cmdPrefix + xa_state.devdir_script);
-  auto sdkroot = kythe::RunScript(cmdPrefix + xa_state.sdkroot_script);
+  auto devdir = xa_state.xcode_paths->Resolve(spawn_info.variable(),
+                                               xa_state.devdir_script);
+  auto sdkroot = xa_state.xcode_paths->Resolve(spawn_info.variable(),
+                                                xa_state.sdkroot_script);
 
   std::vector<std::string> args;
   kythe::FillWithFixedArgs(args, spawn_info, devdir, sdkroot);
@@ -133,9 +141,10 @@ static bool LoadCppInfo(const XAState &xa_state,
   blaze::CppCompileInfo cpp_info =
       info.GetExtension(blaze::CppCompileInfo::cpp_compile_info);
 
-  auto cmdPrefix = kythe::BuildEnvVarCommandPrefix(cpp_info.variable());
-  auto devdir = kythe::RunScript(cmdPrefix + xa_state.devdir_script);
-  auto sdkroot = kythe::RunScript(cmdPrefix + xa_state.sdkroot_script);
+  auto devdir = xa_state.xcode_paths->Resolve(cpp_info.variable(),
+                                               xa_state.devdir_script);
+  auto sdkroot = xa_state.xcode_paths->Resolve(cpp_info.variable(),
+                                                xa_state.sdkroot_script);
 
   std::vector<std::string> args;
   kythe::FillWithFixedArgs(args, cpp_info, devdir, sdkroot);
@@ -194,6 +203,16 @@ int main(int argc, char *argv[]) {
   xa_state.vname_config = argv[3];
   xa_state.devdir_script = argv[4];
   xa_state.sdkroot_script = argv[5];
+  std::string cache_path;
+  if (const char *env_cache_path = getenv("KYTHE_XCODE_PATH_CACHE")) {
+    cache_path = env_cache_path;
+  } else {
+    const char *tmpdir = getenv("TMPDIR");
+    cache_path = std::string(tmpdir && *tmpdir ? tmpdir : "/tmp") +
+                 "/kythe_xcode_path_cache";
+  }
+  kythe::XcodePathCache xcode_paths(cache_path);
+  xa_state.xcode_paths = &xcode_paths;
 
   kythe::ExtractorConfiguration config;
   bool success = LoadExtraAction(xa_state, config);
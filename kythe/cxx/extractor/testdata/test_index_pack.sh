@@ -33,3 +33,15 @@ test -e "${OUT_DIR}/units" || exit 1
 test -e "${OUT_DIR}/files" || exit 1
 [[ $(ls -1 "${OUT_DIR}"/files/*.data | wc -l) -eq 3 ]]
 [[ $(ls -1 "${OUT_DIR}"/units/*.unit | wc -l) -eq 1 ]]
+# Segmented index packs share a segment and skip data they already have.
+rm -rf -- "${OUT_DIR}"
+mkdir -p "${OUT_DIR}"
+for run in 1 2; do
+  KYTHE_OUTPUT_DIRECTORY="${OUT_DIR}" KYTHE_INDEX_PACK="segmented" \
+      "${EXTRACTOR}" --with_executable "/usr/bin/g++" \
+      -I./kythe/cxx/extractor/testdata \
+      ./kythe/cxx/extractor/testdata/transcript_main.cc
+done
+test -e "${OUT_DIR}/units" && exit 1
+[[ $(ls -1 "${OUT_DIR}"/segments/*.seg | wc -l) -eq 1 ]]
+[[ $(ls -1 "${OUT_DIR}"/index/*.idx | wc -l) -eq 1 ]]
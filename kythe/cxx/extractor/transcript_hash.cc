@@ -0,0 +1,101 @@
+/*
+ * Copyright 2017 Google Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "transcript_hash.h"
+
+#include <string.h>
+
+#include <openssl/sha.h>
+
+namespace kythe {
+namespace {
+
+constexpr uint64_t kC1 = 0x87c37b91114253d5ULL;
+constexpr uint64_t kC2 = 0x4cf5ad432745937fULL;
+
+inline uint64_t Rotl64(uint64_t x, int r) { return (x << r) | (x >> (64 - r)); }
+
+}  // anonymous namespace
+
+void TranscriptHash::Reset() {
+  h1_ = 0;
+  h2_ = 0;
+  length_ = 0;
+  tail_size_ = 0;
+}
+
+void TranscriptHash::MixBlock(const unsigned char* block) {
+  // Blocks are read in host byte order. Transcripts already depend on it:
+  // offsets and enumerators are hashed as raw memory.
+  uint64_t k1, k2;
+  ::memcpy(&k1, block, sizeof(k1));
+  ::memcpy(&k2, block + sizeof(k1), sizeof(k2));
+  k1 *= kC1;
+  k1 = Rotl64(k1, 31);
+  k1 *= kC2;
+  h1_ ^= k1;
+  h1_ = Rotl64(h1_, 27);
+  h1_ += h2_;
+  h1_ = h1_ * 5 + 0x52dce729;
+  k2 *= kC2;
+  k2 = Rotl64(k2, 33);
+  k2 *= kC1;
+  h2_ ^= k2;
+  h2_ = Rotl64(h2_, 31);
+  h2_ += h1_;
+  h2_ = h2_ * 5 + 0x38495ab5;
+}
+
+void TranscriptHash::UpdateBlocks(const void* bytes, size_t length) {
+  const auto* data = static_cast<const unsigned char*>(bytes);
+  length_ += length;
+  if (tail_size_ != 0) {
+    size_t fill = kBlockSize - tail_size_;
+    ::memcpy(tail_ + tail_size_, data, fill);
+    MixBlock(tail_);
+    data += fill;
+    length -= fill;
+    tail_size_ = 0;
+  }
+  for (; length >= kBlockSize; data += kBlockSize, length -= kBlockSize) {
+    MixBlock(data);
+  }
+  ::memcpy(tail_, data, length);
+  tail_size_ = length;
+}
+
+std::string TranscriptHash::CompleteAndReset() {
+  // The tail and the length make sure that streams that differ only in
+  // their last partial block (or in trailing zeroes) get different digests.
+  ::SHA256_CTX sha_context;
+  ::SHA256_Init(&sha_context);
+  ::SHA256_Update(&sha_context, &h1_, sizeof(h1_));
+  ::SHA256_Update(&sha_context, &h2_, sizeof(h2_));
+  ::SHA256_Update(&sha_context, &length_, sizeof(length_));
+  ::SHA256_Update(&sha_context, tail_, tail_size_);
+  unsigned char sha_buf[SHA256_DIGEST_LENGTH];
+  ::SHA256_Final(sha_buf, &sha_context);
+  Reset();
+  static constexpr char kHexDigits[] = "0123456789abcdef";
+  std::string sha_text(SHA256_DIGEST_LENGTH * 2, '\0');
+  for (unsigned i = 0; i < SHA256_DIGEST_LENGTH; ++i) {
+    sha_text[i * 2] = kHexDigits[(sha_buf[i] >> 4) & 0xF];
+    sha_text[i * 2 + 1] = kHexDigits[sha_buf[i] & 0xF];
+  }
+  return sha_text;
+}
+
+}  // namespace kythe
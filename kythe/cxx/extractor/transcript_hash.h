@@ -0,0 +1,86 @@
+/*
+ * Copyright 2017 Google Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef KYTHE_CXX_EXTRACTOR_TRANSCRIPT_HASH_H_
+#define KYTHE_CXX_EXTRACTOR_TRANSCRIPT_HASH_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+#include "llvm/ADT/StringRef.h"
+
+namespace kythe {
+
+/// \brief Accumulates the preprocessor events that identify a transcript.
+///
+/// The extractor feeds every macro definition, expansion and conditional it
+/// sees through one of these, so the per-event cost matters. Bytes are mixed
+/// into a 128-bit MurmurHash3-style state; SHA-256 is only run once, over
+/// that state, when the transcript is completed. As with a plain SHA-256 over
+/// the stream, only the concatenation of the updates is significant.
+class TranscriptHash {
+ public:
+  TranscriptHash() { Reset(); }
+
+  /// \brief Update the hash.
+  /// \param bytes Start of the memory to use to update.
+  /// \param length Number of bytes to read.
+  void Update(const void* bytes, size_t length) {
+    // Most events are a few bytes long; keep those out of the block loop.
+    if (tail_size_ + length < kBlockSize) {
+      ::memcpy(tail_ + tail_size_, bytes, length);
+      tail_size_ += length;
+      length_ += length;
+      return;
+    }
+    UpdateBlocks(bytes, length);
+  }
+
+  /// \brief Update the hash with a string.
+  void Update(llvm::StringRef string) { Update(string.data(), string.size()); }
+
+  /// \brief Update the hash with some unsigned integer.
+  void Update(unsigned u) { Update(&u, sizeof(u)); }
+
+  /// \brief Return the lowercase hex SHA-256 digest of the state up to this
+  /// point and reset internal state.
+  std::string CompleteAndReset();
+
+ private:
+  static constexpr size_t kBlockSize = 16;
+
+  void Reset();
+
+  /// \brief Implements `Update` for updates that fill the tail.
+  void UpdateBlocks(const void* bytes, size_t length);
+
+  /// \brief Mixes one `kBlockSize`-byte block into the state.
+  void MixBlock(const unsigned char* block);
+
+  uint64_t h1_;
+  uint64_t h2_;
+  /// The number of bytes seen since the last reset.
+  uint64_t length_;
+  /// Bytes that don't yet make up a full block.
+  unsigned char tail_[kBlockSize];
+  size_t tail_size_;
+};
+
+}  // namespace kythe
+
+#endif  // KYTHE_CXX_EXTRACTOR_TRANSCRIPT_HASH_H_
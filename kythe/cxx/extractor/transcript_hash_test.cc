@@ -0,0 +1,78 @@
+/*
+ * Copyright 2017 Google Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "transcript_hash.h"
+
+#include <string>
+
+#include "glog/logging.h"
+#include "gtest/gtest.h"
+
+namespace kythe {
+namespace {
+
+std::string HashOf(llvm::StringRef data) {
+  TranscriptHash hash;
+  hash.Update(data);
+  return hash.CompleteAndReset();
+}
+
+TEST(TranscriptHash, IsHexSha256Sized) {
+  std::string digest = HashOf("#define FOO 1");
+  EXPECT_EQ(64, digest.size());
+  EXPECT_EQ(std::string::npos, digest.find_first_not_of("0123456789abcdef"));
+}
+
+TEST(TranscriptHash, OnlyConcatenationMatters) {
+  const std::string data = "0123456789abcdefghijklmnopqrstuvwxyz#if FOO";
+  const std::string expected = HashOf(data);
+  for (size_t split = 0; split <= data.size(); ++split) {
+    TranscriptHash hash;
+    hash.Update(llvm::StringRef(data).take_front(split));
+    hash.Update(llvm::StringRef(data).drop_front(split));
+    EXPECT_EQ(expected, hash.CompleteAndReset()) << split;
+  }
+}
+
+TEST(TranscriptHash, DistinguishesStreams) {
+  EXPECT_NE(HashOf(""), HashOf(std::string(1, '\0')));
+  EXPECT_NE(HashOf(std::string(16, '\0')), HashOf(std::string(17, '\0')));
+  EXPECT_NE(HashOf(std::string(32, '\0')), HashOf(std::string(16, '\0')));
+  EXPECT_NE(HashOf("0123456789abcdefX"), HashOf("0123456789abcdefY"));
+  EXPECT_NE(HashOf("0123456789abcdef0123456789abcdeX"),
+            HashOf("0123456789abcdef0123456789abcdeY"));
+}
+
+TEST(TranscriptHash, ResetsAfterCompletion) {
+  TranscriptHash hash;
+  hash.Update("#undef BAR");
+  hash.Update(42u);
+  const std::string first = hash.CompleteAndReset();
+  EXPECT_EQ(HashOf(""), hash.CompleteAndReset());
+  hash.Update("#undef BAR");
+  hash.Update(42u);
+  EXPECT_EQ(first, hash.CompleteAndReset());
+}
+
+}  // namespace
+}  // namespace kythe
+
+int main(int argc, char** argv) {
+  google::InitGoogleLogging(argv[0]);
+  ::testing::InitGoogleTest(&argc, argv);
+  int result = RUN_ALL_TESTS();
+  return result;
+}
@@ -169,6 +169,15 @@ static GraphObserver::NodeId NodeIdForFlag(const GraphObserver::NodeId &VarId) {
                                "google/gflag#" + VarId.getRawIdentity());
 }
 
+LibraryInterests GoogleFlagsLibrarySupport::getInterests() const {
+  LibraryInterests Interests;
+  Interests.Calls = false;
+  Interests.DeclKinds = {clang::Decl::Var};
+  Interests.DeclNamePrefixes = {"FLAGS_"};
+  Interests.ProfileLabel = "google_flags_library_support";
+  return Interests;
+}
+
 void GoogleFlagsLibrarySupport::InspectVariable(
     IndexerASTVisitor &V, GraphObserver::NodeId &NodeId,
     GraphObserver::NodeId &DeclBodyNodeId, const clang::VarDecl *Decl,
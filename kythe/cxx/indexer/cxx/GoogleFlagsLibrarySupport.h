@@ -33,6 +33,10 @@ class GoogleFlagsLibrarySupport : public LibrarySupport {
  public:
   GoogleFlagsLibrarySupport() {}
 
+  /// \brief Flags are global variables named FLAGS_*; nothing else is
+  /// inspected.
+  LibraryInterests getInterests() const override;
+
   /// \brief Emits a google/gflag node if `Decl` is a flag.
   void InspectVariable(IndexerASTVisitor &V, GraphObserver::NodeId &DeclNodeId,
                        GraphObserver::NodeId &DeclBodyNodeId,
@@ -0,0 +1,101 @@
+/*
+ * Copyright 2017 Google Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// This file uses the Clang style conventions.
+
+#include "GraphObserver.h"
+
+#include <cstring>
+
+namespace kythe {
+namespace {
+/// The arena made current by the innermost `NodeIdArena::Scope` on this thread.
+thread_local NodeIdArena *CurrentArena = nullptr;
+
+/// The identity shared by all `NodeId`s with empty identities, which are
+/// commonly used as placeholders.
+const std::string *EmptyIdentity() {
+  static const std::string *Empty = new std::string();
+  return Empty;
+}
+}  // anonymous namespace
+
+const std::string *NodeIdArena::InternLocked(llvm::StringRef Identity) {
+  auto Found = Identities.find(Identity);
+  if (Found != Identities.end()) {
+    return Found->second;
+  }
+  Storage.emplace_back(Identity.data(), Identity.size());
+  const std::string *Canonical = &Storage.back();
+  Identities.emplace(llvm::StringRef(*Canonical), Canonical);
+  return Canonical;
+}
+
+const std::string *NodeIdArena::Intern(llvm::StringRef Identity) {
+  if (Identity.empty()) {
+    return EmptyIdentity();
+  }
+  std::lock_guard<std::mutex> Lock(Mutex);
+  if (Identity.size() <= kSha256DigestBase64MaxEncodingLength) {
+    return InternLocked(Identity);
+  }
+  auto Found = Compressed.find(Identity);
+  if (Found != Compressed.end()) {
+    return Found->second;
+  }
+  ++Compressions;
+  char Buffer[kCompressedStringLength];
+  const std::string *Canonical = InternLocked(
+      llvm::StringRef(Buffer, CompressStringInto(Identity, Buffer)));
+  char *Key = CompressedKeys.Allocate<char>(Identity.size());
+  ::memcpy(Key, Identity.data(), Identity.size());
+  Compressed.emplace(llvm::StringRef(Key, Identity.size()), Canonical);
+  return Canonical;
+}
+
+const std::string *NodeIdArena::InternUncompressed(llvm::StringRef Identity) {
+  if (Identity.empty()) {
+    return EmptyIdentity();
+  }
+  std::lock_guard<std::mutex> Lock(Mutex);
+  return InternLocked(Identity);
+}
+
+size_t NodeIdArena::identity_count() const {
+  std::lock_guard<std::mutex> Lock(Mutex);
+  return Identities.size();
+}
+
+size_t NodeIdArena::compression_count() const {
+  std::lock_guard<std::mutex> Lock(Mutex);
+  return Compressions;
+}
+
+NodeIdArena &NodeIdArena::Current() {
+  if (CurrentArena != nullptr) {
+    return *CurrentArena;
+  }
+  static thread_local NodeIdArena ThreadArena;
+  return ThreadArena;
+}
+
+NodeIdArena::Scope::Scope(NodeIdArena *Arena) : Previous(CurrentArena) {
+  CurrentArena = Arena;
+}
+
+NodeIdArena::Scope::~Scope() { CurrentArena = Previous; }
+
+}  // namespace kythe
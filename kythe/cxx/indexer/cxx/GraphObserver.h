@@ -24,6 +24,10 @@
 
 #include <openssl/sha.h>  // for SHA256
 
+#include <deque>
+#include <mutex>
+#include <unordered_map>
+
 #include "clang/Basic/SourceLocation.h"
 #include "clang/Basic/SourceManager.h"
 #include "clang/Basic/Specifiers.h"
@@ -32,6 +36,7 @@
 #include "llvm/ADT/APSInt.h"
 #include "llvm/ADT/Hashing.h"
 #include "llvm/ADT/StringRef.h"
+#include "llvm/Support/Allocator.h"
 #include "llvm/Support/Casting.h"
 #include "llvm/Support/raw_ostream.h"
 
@@ -46,49 +51,191 @@ namespace kythe {
 // base64 has a 4:3 overhead and SHA256_DIGEST_LENGTH is 32. 32*4/3 = 42.
 constexpr size_t kSha256DigestBase64MaxEncodingLength = 42;
 
+/// The length of the strings `CompressString` produces from long inputs.
+constexpr size_t kCompressedStringLength =
+    Base64EncodedLength(SHA256_DIGEST_LENGTH);
+
+/// \brief Writes the base64-encoded SHA256 digest of `InString` to `Out`,
+/// which must have room for `kCompressedStringLength` characters.
+/// \return the number of characters written.
+inline size_t CompressStringInto(llvm::StringRef InString, char *Out) {
+  unsigned char Digest[SHA256_DIGEST_LENGTH];
+  ::SHA256(reinterpret_cast<const unsigned char *>(InString.data()),
+           InString.size(), Digest);
+  return EncodeBase64(Digest, sizeof(Digest), Out);
+}
+
 /// \brief A one-way hash for `InString`.
 template <typename String>
 String CompressString(const String &InString, bool Force = false) {
   if (InString.size() <= kSha256DigestBase64MaxEncodingLength && !Force) {
     return InString;
   }
-  ::SHA256_CTX Sha;
-  ::SHA256_Init(&Sha);
-  ::SHA256_Update(&Sha,
-                  reinterpret_cast<const unsigned char *>(InString.data()),
-                  InString.size());
-  String Hash(SHA256_DIGEST_LENGTH, '\0');
-  ::SHA256_Final(reinterpret_cast<unsigned char *>(&Hash[0]), &Sha);
-  return EncodeBase64(Hash);
+  String Compressed(kCompressedStringLength, '\0');
+  CompressStringInto(llvm::StringRef(InString.data(), InString.size()),
+                     &Compressed[0]);
+  return Compressed;
 }
 
+/// \brief Owns the identities of the `GraphObserver::NodeId`s created while
+/// indexing a translation unit.
+///
+/// Each distinct identity is compressed (with `CompressString`) and copied
+/// only once, so `NodeId`s can refer to their identities by pointer. Two
+/// identities interned in the same arena are equal iff their pointers are.
+/// All `NodeId`s that refer to an arena must be destroyed before it is.
+class NodeIdArena {
+ public:
+  NodeIdArena() = default;
+  NodeIdArena(const NodeIdArena &) = delete;
+  NodeIdArena &operator=(const NodeIdArena &) = delete;
+
+  /// \brief Returns the canonical copy of `CompressString(Identity)`.
+  const std::string *Intern(llvm::StringRef Identity);
+
+  /// \brief Returns the canonical copy of `Identity`, which is used verbatim.
+  const std::string *InternUncompressed(llvm::StringRef Identity);
+
+  /// \brief Returns the number of distinct identities in this arena.
+  size_t identity_count() const;
+
+  /// \brief Returns the number of times an identity had to be hashed.
+  size_t compression_count() const;
+
+  /// \brief Returns the arena for new `NodeId`s on the calling thread.
+  ///
+  /// This is the innermost `Scope`'s arena or, outside of any `Scope`, an
+  /// arena that lives as long as the thread.
+  static NodeIdArena &Current();
+
+  /// \brief Makes an arena current on the calling thread for the lifetime of
+  /// the `Scope`.
+  class Scope {
+   public:
+    explicit Scope(NodeIdArena *Arena);
+    ~Scope();
+    Scope(const Scope &) = delete;
+    Scope &operator=(const Scope &) = delete;
+
+   private:
+    NodeIdArena *Previous;
+  };
+
+ private:
+  struct StringRefHash {
+    size_t operator()(llvm::StringRef S) const { return llvm::hash_value(S); }
+  };
+  using IdentityMap =
+      std::unordered_map<llvm::StringRef, const std::string *, StringRefHash>;
+
+  /// \brief Returns the canonical copy of `Identity`. `Mutex` must be held.
+  const std::string *InternLocked(llvm::StringRef Identity);
+
+  /// Guards all other fields (NodeIds may be created on multiple threads).
+  mutable std::mutex Mutex;
+  /// Storage for canonical identities. Elements never move.
+  std::deque<std::string> Storage;
+  /// Maps identity text to its canonical copy in `Storage`.
+  IdentityMap Identities;
+  /// Maps identities that are too long to be used verbatim to the canonical
+  /// copies of their compressed versions.
+  IdentityMap Compressed;
+  /// Storage for the keys of `Compressed`.
+  llvm::BumpPtrAllocator CompressedKeys;
+  /// The number of times we've called `CompressString`.
+  size_t Compressions = 0;
+};
+
 enum class ProfilingEvent {
   Enter,  ///< A profiling section was entered.
-  Exit    ///< A profiling section was left.
+  Exit,   ///< A profiling section was left.
+  Hit,    ///< A lookup in a labelled cache succeeded.
+  Miss    ///< A lookup in a labelled cache failed.
 };
 
 /// \brief A callback used to report a profiling event.
 ///
 /// Profile events have labels (formatted as lowercase strings with words
-/// separated by underscores) and event types.
+/// separated by underscores) and event types. Enter and Exit events label
+/// sections of work; Hit and Miss events label caches. An empty callback
+/// means that profiling is off; call callbacks that may be empty through
+/// `ReportProfilingEvent`.
 using ProfilingCallback = std::function<void(const char *, ProfilingEvent)>;
 
-/// \brief Ensures that Enter events are paired with Exit events.
+/// \brief Reports `Event` for `Label` to `Callback`, unless profiling is off.
+inline void ReportProfilingEvent(const ProfilingCallback &Callback,
+                                 const char *Label, ProfilingEvent Event) {
+  if (Callback) {
+    Callback(Label, Event);
+  }
+}
+
+/// \brief Ensures that Enter events are paired with Exit events. When
+/// profiling is off, this costs a test of the callback on entry and exit.
 class ProfileBlock {
  public:
   /// \param Callback reporting callback; must outlive `ProfileBlock`
   /// \param SectionName name for the section; must outlive `ProfileBlock`
   ProfileBlock(const ProfilingCallback &Callback, const char *SectionName)
-      : Callback(Callback), SectionName(SectionName) {
-    Callback(SectionName, ProfilingEvent::Enter);
+      : Callback(Callback ? &Callback : nullptr), SectionName(SectionName) {
+    if (this->Callback != nullptr) {
+      (*this->Callback)(SectionName, ProfilingEvent::Enter);
+    }
+  }
+  ~ProfileBlock() {
+    if (Callback != nullptr) {
+      (*Callback)(SectionName, ProfilingEvent::Exit);
+    }
   }
-  ~ProfileBlock() { Callback(SectionName, ProfilingEvent::Exit); }
 
  private:
-  const ProfilingCallback &Callback;
+  /// The callback to report to, or null if profiling is off.
+  const ProfilingCallback *Callback;
   const char *SectionName;
 };
 
+/// \brief A node's marked source, which is only built if an observer asks for
+/// it.
+///
+/// Generating marked source means pretty-printing and re-lexing a declaration,
+/// so observers should call `serialize` only once they know that the node's
+/// code fact will be written.
+class LazyMarkedSource {
+ public:
+  /// \brief Builds marked source on demand.
+  class Supplier {
+   public:
+    virtual ~Supplier() {}
+    /// \return the serialized marked source, or null if there is none. The
+    /// result is owned by the supplier.
+    virtual const std::string *serialize() = 0;
+  };
+
+  LazyMarkedSource(None) {}
+  LazyMarkedSource(Supplier *Lazy) : Lazy(Lazy) {}
+  /// \param Eager marked source that has already been built; must outlive
+  /// this `LazyMarkedSource`.
+  LazyMarkedSource(const MarkedSource &Eager) : Eager(&Eager) {}
+
+  /// \return the serialized marked source, or null if there is none. The
+  /// result is valid for the lifetime of this `LazyMarkedSource`.
+  const std::string *serialize() const {
+    if (Lazy != nullptr) {
+      return Lazy->serialize();
+    }
+    if (Eager != nullptr) {
+      Eager->SerializeToString(&Serialized);
+      return &Serialized;
+    }
+    return nullptr;
+  }
+
+ private:
+  Supplier *Lazy = nullptr;
+  const MarkedSource *Eager = nullptr;
+  mutable std::string Serialized;
+};
+
 /// \brief An interface for processing elements discovered as part of a
 /// compilation unit.
 ///
@@ -119,10 +266,14 @@ class GraphObserver {
     virtual bool operator!=(const ClaimToken &RHS) const = 0;
   };
 
-  /// \brief Takes care of balancing calls to `Delimit` and `Undelimit`.
+  /// \brief Takes care of balancing calls to `Delimit` (or `DelimitAt`) and
+  /// `Undelimit`.
   class Delimiter {
    public:
     Delimiter(GraphObserver &Self) : S(Self) { S.Delimit(); }
+    Delimiter(GraphObserver &Self, clang::SourceLocation Loc) : S(Self) {
+      S.DelimitAt(Loc);
+    }
     ~Delimiter() { S.Undelimit(); }
 
    private:
@@ -132,6 +283,10 @@ class GraphObserver {
   /// \brief Push another group onto the group stack, assigning
   /// any observations that follow to it.
   virtual void Delimit() {}
+  /// \brief Push another group for the observations made about whatever
+  /// is at `Loc` (such as a declaration). Observers may gather the groups
+  /// for each file together.
+  virtual void DelimitAt(clang::SourceLocation Loc) { Delimit(); }
   /// \brief Pop the last group from the group stack.
   virtual void Undelimit() {}
 
@@ -141,47 +296,58 @@ class GraphObserver {
   /// provides evidence of its provenance (and may be used to determine whether
   /// the node should be analyzed), and its `Identity`, a string of bytes
   /// determined by the `IndexerASTHooks` and `GraphObserver` override.
+  ///
+  /// `NodeId`s are pointer-sized handles: the `Identity` is interned in the
+  /// current `NodeIdArena` when the `NodeId` is constructed, so copies and
+  /// comparisons don't touch the identity's text.
   class NodeId {
    public:
-    NodeId(const ClaimToken *Token, const std::string &Identity)
-        : Token(Token), Identity(CompressString(Identity)) {}
-    NodeId(const NodeId &C) { *this = C; }
+    NodeId(const ClaimToken *Token, llvm::StringRef Identity)
+        : Token(Token), Identity(NodeIdArena::Current().Intern(Identity)) {}
+    NodeId(const NodeId &C) = default;
+    NodeId &operator=(const NodeId &C) = default;
     NodeId &operator=(const NodeId *C) {
       Token = C->Token;
       Identity = C->Identity;
       return *this;
     }
     static NodeId CreateUncompressed(const ClaimToken *Token,
-                                     const std::string &Identity) {
-      NodeId NewId(Token, "");
-      NewId.Identity = Identity;
-      return NewId;
+                                     llvm::StringRef Identity) {
+      return NodeId(Token,
+                    NodeIdArena::Current().InternUncompressed(Identity));
     }
     /// \brief Returns a string representation of this `NodeId`.
-    std::string ToString() const { return Identity; }
+    std::string ToString() const { return *Identity; }
     /// \brief Returns a string reference representation of this `NodeId`'s
     /// Identity.
-    /// This `NodeId` must outlive the `StringRef`.
+    /// The `NodeIdArena` for this `NodeId` must outlive the `StringRef`.
     llvm::StringRef IdentityRef() const {
-      return llvm::StringRef(Identity.data(), Identity.size());
+      return llvm::StringRef(Identity->data(), Identity->size());
     }
     /// \brief Returns a string representation of this `NodeId`
     /// annotated by its claim token.
     std::string ToClaimedString() const {
-      return Token->StampIdentity(Identity);
+      return Token->StampIdentity(*Identity);
     }
     bool operator==(const NodeId &RHS) const {
-      return *Token == *RHS.Token && Identity == RHS.Identity;
+      return Identity == RHS.Identity && *Token == *RHS.Token;
     }
-    bool operator!=(const NodeId &RHS) const {
-      return *Token != *RHS.Token || Identity != RHS.Identity;
-    }
-    const std::string &getRawIdentity() const { return Identity; }
+    bool operator!=(const NodeId &RHS) const { return !(*this == RHS); }
+    const std::string &getRawIdentity() const { return *Identity; }
     const ClaimToken *getToken() const { return Token; }
+    /// \brief Returns a hash of this `NodeId`'s identity that is consistent
+    /// with `operator==`.
+    size_t getIdentityHash() const {
+      return std::hash<const std::string *>()(Identity);
+    }
 
    private:
+    NodeId(const ClaimToken *Token, const std::string *Identity)
+        : Token(Token), Identity(Identity) {}
+
     const ClaimToken *Token;
-    std::string Identity;
+    /// The interned identity, owned by a `NodeIdArena`.
+    const std::string *Identity;
   };
 
   /// \brief A range of source text, potentially associated with a node.
@@ -342,7 +508,7 @@ class GraphObserver {
   virtual NodeId recordTypeAliasNode(
       const NameId &AliasName, const NodeId &AliasedType,
       const MaybeFew<NodeId> &RootAliasedType,
-      const MaybeFew<MarkedSource> &MarkedSource) = 0;
+      const LazyMarkedSource &MarkedSource) = 0;
 
   /// \brief Returns the ID for a nominal type node (such as a struct,
   /// typedef or enum).
@@ -357,7 +523,7 @@ class GraphObserver {
   /// \param Parent if non-null, the parent node of this nominal type.
   /// \return the `NodeId` for the type node corresponding to `TypeName`.
   virtual NodeId recordNominalTypeNode(
-      const NameId &TypeName, const MaybeFew<MarkedSource> &MarkedSource,
+      const NameId &TypeName, const LazyMarkedSource &MarkedSource,
       const NodeId *Parent) = 0;
 
   /// \brief Records a type application node, returning its ID.
@@ -417,8 +583,7 @@ class GraphObserver {
   /// \param Node The NodeId of the record.
   /// \param MarkedSource marked source for this interface.
   virtual void recordInterfaceNode(const NodeId &Node,
-                                   const MaybeFew<MarkedSource> &MarkedSource) {
-  }
+                                   const LazyMarkedSource &MarkedSource) {}
 
   /// \brief Records a node representing a record type (such as a class or
   /// struct).
@@ -428,7 +593,7 @@ class GraphObserver {
   /// \param MarkedSource marked source for this record.
   virtual void recordRecordNode(const NodeId &Node, RecordKind Kind,
                                 Completeness RecordCompleteness,
-                                const MaybeFew<MarkedSource> &MarkedSource) {}
+                                const LazyMarkedSource &MarkedSource) {}
 
   /// \brief Records a node representing a function.
   /// \param Node The NodeId of the function.
@@ -438,7 +603,7 @@ class GraphObserver {
   virtual void recordFunctionNode(const NodeId &Node,
                                   Completeness FunctionCompleteness,
                                   FunctionSubkind Subkind,
-                                  const MaybeFew<MarkedSource> &MarkedSource) {}
+                                  const LazyMarkedSource &MarkedSource) {}
 
   /// \brief Describes whether an enum is scoped (`enum class`).
   enum class EnumKind {
@@ -468,7 +633,7 @@ class GraphObserver {
 
   /// \brief Explicitly record marked source for some `Node`.
   virtual void recordMarkedSource(const NodeId &Node,
-                                  const MaybeFew<MarkedSource> &MarkedSource) {}
+                                  const LazyMarkedSource &MarkedSource) {}
 
   /// \brief Records a node representing a variable in a dependent type
   /// abstraction.
@@ -518,14 +683,13 @@ class GraphObserver {
   // type.
   virtual void recordVariableNode(const NodeId &DeclNode, Completeness Compl,
                                   VariableSubkind Subkind,
-                                  const MaybeFew<MarkedSource> &MarkedSource) {}
+                                  const LazyMarkedSource &MarkedSource) {}
 
   /// \brief Records that a namespace has been declared.
   /// \param DeclNode The identifier for this particular element.
   /// \param MarkedSource marked source for this namespace.
   virtual void recordNamespaceNode(const NodeId &DeclNode,
-                                   const MaybeFew<MarkedSource> &MarkedSource) {
-  }
+                                   const LazyMarkedSource &MarkedSource) {}
 
   // TODO(zarko): recordExpandedTypeEdge -- records that a type was seen
   // to have some canonical type during a compilation. (This is a 'canonical'
@@ -768,6 +932,11 @@ class GraphObserver {
   virtual void recordIncludesRange(const Range &SourceRange,
                                    const clang::FileEntry *File) {}
 
+  /// \brief Records a diagnostic about the whole compilation unit, such as a
+  /// note that its output is incomplete.
+  /// \param Message A short human-readable description.
+  virtual void recordUnitDiagnostic(const std::string &Message) {}
+
   /// \brief Called when a new input file is entered.
   ///
   /// The file entered in the first `pushFile` is the compilation unit being
@@ -840,6 +1009,25 @@ class GraphObserver {
     return claimed;
   }
 
+  /// \return the number of implicit instantiations of each primary template
+  /// to index, or 0 to index all of them (and never call
+  /// `claimInstantiationSample`).
+  virtual size_t instantiationSampleLimit() { return 0; }
+
+  /// \brief Checks whether an implicit instantiation that the caller would
+  /// otherwise index is among the instantiations of its primary template
+  /// that are indexed at all.
+  ///
+  /// Instantiations outside the sample still get their node and the edges
+  /// relating it to the template, but nothing they contain is indexed.
+  /// \param PrimaryIdentifier Identifies the primary template.
+  /// \param Identifier Identifies the instantiation (as passed to
+  /// `claimImplicitNode`).
+  virtual bool claimInstantiationSample(const std::string &PrimaryIdentifier,
+                                        const std::string &Identifier) {
+    return true;
+  }
+
   /// \brief Checks whether this `GraphObserver` should emit data for
   /// nodes at some `SourceLocation`.
   ///
@@ -916,7 +1104,8 @@ class GraphObserver {
   clang::SourceManager *SourceManager = nullptr;
   clang::LangOptions *LangOptions = nullptr;
   clang::Preprocessor *Preprocessor = nullptr;
-  ProfilingCallback ReportProfileEvent = [](const char *, ProfilingEvent) {};
+  /// Receives profiling events; empty if profiling is off.
+  ProfilingCallback ReportProfileEvent;
 };
 
 inline GraphObserver::~GraphObserver() {}
@@ -954,7 +1143,7 @@ class NullGraphObserver : public GraphObserver {
   NodeId recordTypeAliasNode(
       const NameId &AliasName, const NodeId &AliasedType,
       const MaybeFew<NodeId> &RootAliasedType,
-      const MaybeFew<MarkedSource> &MarkedSource) override {
+      const LazyMarkedSource &MarkedSource) override {
     return NodeId(getDefaultClaimToken(), "");
   }
 
@@ -963,7 +1152,7 @@ class NullGraphObserver : public GraphObserver {
   }
 
   NodeId recordNominalTypeNode(const NameId &TypeName,
-                               const MaybeFew<MarkedSource> &MarkedSource,
+                               const LazyMarkedSource &MarkedSource,
                                const NodeId *Parent) override {
     return NodeId(getDefaultClaimToken(), "");
   }
@@ -44,10 +44,12 @@
 #include "gflags/gflags.h"
 #include "kythe/cxx/indexer/cxx/clang_utils.h"
 #include "kythe/cxx/indexer/cxx/marked_source.h"
+#include "llvm/ADT/STLExtras.h"
 #include "llvm/Support/MathExtras.h"
 #include "llvm/Support/raw_ostream.h"
 
 #include <algorithm>
+#include <limits>
 
 DEFINE_bool(experimental_alias_template_instantiations, false,
             "Ignore template instantation information when generating IDs.");
@@ -55,6 +57,20 @@ DEFINE_bool(experimental_threaded_claiming, false,
             "Defer answering claims and submit them in bulk when possible.");
 DEFINE_bool(emit_anchors_on_builtins, true,
             "Emit anchors on builtin types like int and float.");
+DEFINE_bool(experimental_lazy_parent_map, false,
+            "Build the parent map one top-level declaration at a time.");
+DEFINE_int32(experimental_lazy_parent_map_entries, 1 << 20,
+             "Keep at most about this many entries in the lazy parent map.");
+DEFINE_bool(cache_lexer_results, true,
+            "Remember the tokens and name ranges lexed at each source "
+            "location for the rest of the translation unit.");
+DEFINE_bool(experimental_count_pruned_nodes, false,
+            "Report how many AST nodes lie under each unclaimed declaration "
+            "that traversal skips. This walks the skipped subtrees.");
+DEFINE_bool(index_doc_comments_by_file, true,
+            "Sort the translation unit's documentation comments by file in "
+            "one pass and skip clang's comment search for declarations "
+            "that can't have one.");
 
 namespace kythe {
 
@@ -95,19 +111,6 @@ void MapOverrideRoots(const clang::CXXMethodDecl *M, const F &Fn) {
   }
 }
 
-template <typename F>
-void MapOverrideRoots(const clang::ObjCMethodDecl *M, const F &Fn) {
-  if (!M->isOverriding()) {
-    Fn(M);
-  } else {
-    SmallVector<const ObjCMethodDecl *, 4> overrides;
-    M->getOverriddenMethods(overrides);
-    for (const auto &PM : overrides) {
-      MapOverrideRoots(PM, Fn);
-    }
-  }
-}
-
 clang::QualType FollowAliasChain(const clang::TypedefNameDecl *TND) {
   clang::Qualifiers Qs;
   clang::QualType QT;
@@ -248,6 +251,49 @@ bool SkipAliasedDecl(const clang::Decl *D) {
 bool IsObjCForwardDecl(const clang::ObjCInterfaceDecl *decl) {
   return !decl->isThisDeclarationADefinition();
 }
+
+/// \brief Counts the nodes that `IndexerASTVisitor` would have visited
+/// underneath a declaration had it not been pruned.
+class PrunedNodeCounter : public RecursiveASTVisitor<PrunedNodeCounter> {
+ public:
+  bool shouldVisitTemplateInstantiations() const { return true; }
+  bool shouldVisitImplicitCode() const { return true; }
+  bool shouldUseDataRecursionFor(clang::Stmt *S) const { return false; }
+
+  bool TraverseDecl(clang::Decl *D) {
+    if (D != nullptr) {
+      ++Count;
+    }
+    return RecursiveASTVisitor<PrunedNodeCounter>::TraverseDecl(D);
+  }
+
+  bool TraverseStmt(clang::Stmt *S) {
+    if (S != nullptr) {
+      ++Count;
+    }
+    return RecursiveASTVisitor<PrunedNodeCounter>::TraverseStmt(S);
+  }
+
+  size_t Count = 0;
+};
+
+/// \brief Reports a "pruned_node" hit for each node under `D`, which was
+/// pruned because it is unclaimed, if --experimental_count_pruned_nodes is
+/// set.
+void ReportPrunedNodes(GraphObserver &Observer, clang::Decl *D) {
+  if (!FLAGS_experimental_count_pruned_nodes) {
+    return;
+  }
+  PrunedNodeCounter Counter;
+  Counter.TraverseDecl(D);
+  const auto &Report = Observer.getProfilingCallback();
+  if (!Report) {
+    return;
+  }
+  for (size_t I = 0; I < Counter.Count; ++I) {
+    Report("pruned_node", ProfilingEvent::Hit);
+  }
+}
 }  // anonymous namespace
 
 bool IsClaimableForTraverse(const clang::Decl *decl) {
@@ -280,7 +326,8 @@ enum class Prunability {
   kNone,
   kImmediate,
   kDeferIncompleteFunctions,
-  kDeferred
+  kDeferred,
+  kSampledOut
 };
 
 /// \brief RAII class used to pair claimImplicitNode/finishImplicitNode
@@ -295,6 +342,11 @@ class PruneCheck {
       if (!visitor_->Observer.claimLocation(decl->getLocation())) {
         can_prune_ = Prunability::kImmediate;
       }
+      ReportProfilingEvent(visitor_->Observer.getProfilingCallback(),
+                           "prune_unclaimed_decl",
+                           can_prune_ == Prunability::kImmediate
+                               ? ProfilingEvent::Hit
+                               : ProfilingEvent::Miss);
       return;
     }
     if (llvm::isa<clang::FunctionDecl>(decl)) {
@@ -321,12 +373,20 @@ class PruneCheck {
           !visitor_->Observer.claimImplicitNode(cleanup_id_)) {
         can_prune_ = Prunability::kDeferred;
       }
+      if (can_prune_ != Prunability::kDeferred ||
+          FLAGS_experimental_threaded_claiming) {
+        CheckInstantiationSample(decl);
+      }
     } else if (llvm::isa<clang::ClassTemplateSpecializationDecl>(decl)) {
       GenerateCleanupId(decl);
       if (FLAGS_experimental_threaded_claiming ||
           !visitor_->Observer.claimImplicitNode(cleanup_id_)) {
         can_prune_ = Prunability::kDeferIncompleteFunctions;
       }
+      if (can_prune_ != Prunability::kDeferIncompleteFunctions ||
+          FLAGS_experimental_threaded_claiming) {
+        CheckInstantiationSample(decl);
+      }
     }
   }
   ~PruneCheck() {
@@ -342,6 +402,35 @@ class PruneCheck {
   const std::string &cleanup_id() { return cleanup_id_; }
 
  private:
+  /// \brief Marks `decl` as sampled out if it is an implicit instantiation
+  /// that isn't among those of its primary template that are indexed. Only
+  /// called for decls this unit is (or, with threaded claiming, may be)
+  /// responsible for, so that each distinct instantiation is counted once.
+  void CheckInstantiationSample(const clang::Decl *decl) {
+    if (visitor_->Observer.instantiationSampleLimit() == 0) {
+      return;
+    }
+    const clang::Decl *primary = nullptr;
+    if (const auto *czdecl =
+            dyn_cast<clang::ClassTemplateSpecializationDecl>(decl)) {
+      if (!czdecl->isExplicitInstantiationOrSpecialization()) {
+        primary = czdecl->getSpecializedTemplate()->getTemplatedDecl();
+      }
+    } else if (const auto *fdecl = dyn_cast<clang::FunctionDecl>(decl)) {
+      if (const auto *info = fdecl->getTemplateSpecializationInfo()) {
+        if (!info->isExplicitInstantiationOrSpecialization()) {
+          primary = info->getTemplate()->getTemplatedDecl();
+        }
+      }
+    }
+    if (primary != nullptr &&
+        !visitor_->Observer.claimInstantiationSample(
+            visitor_->BuildNodeIdForDecl(primary).getRawIdentity(),
+            cleanup_id_)) {
+      can_prune_ = Prunability::kSampledOut;
+    }
+  }
+
   void GenerateCleanupId(const clang::Decl *decl) {
     // TODO(zarko): Check to see if non-function members of a class
     // can be traversed once per argument set.
@@ -356,8 +445,8 @@ class PruneCheck {
       llvm::raw_string_ostream ostream(cleanup_id_);
       while (!(current_decl = current_node.get<clang::Decl>()) ||
              !isa<clang::TranslationUnitDecl>(current_decl)) {
-        IndexedParent *parent = visitor_->getIndexedParent(current_node);
-        if (parent == nullptr) {
+        auto parent = visitor_->getIndexedParent(current_node);
+        if (!parent) {
           break;
         }
         current_node = parent->Parent;
@@ -390,21 +479,21 @@ class PruneCheck {
   IndexerASTVisitor *visitor_;
 };
 
-void IndexerASTVisitor::deleteAllParents() {
-  if (!AllParents) {
-    return;
-  }
-  for (const auto &Entry : *AllParents) {
-    delete Entry.second.getPointer();
-  }
-  AllParents.reset(nullptr);
-}
-
-IndexedParent *IndexerASTVisitor::getIndexedParent(
+const PackedIndexedParent *IndexerASTVisitor::getIndexedParentEntry(
     const ast_type_traits::DynTypedNode &Node) {
   CHECK(Node.getMemoizationData() != nullptr)
       << "Invariant broken: only nodes that support memoization may be "
          "used in the parent map.";
+  if (FLAGS_experimental_lazy_parent_map) {
+    if (!LazyParents) {
+      ProfileBlock block(Observer.getProfilingCallback(),
+                         "build_parent_skeleton");
+      LazyParents = llvm::make_unique<LazyIndexedParentMap>(
+          *Context.getTranslationUnitDecl(),
+          FLAGS_experimental_lazy_parent_map_entries);
+    }
+    return LazyParents->find(Node);
+  }
   if (!AllParents) {
     // We always need to run over the whole translation unit, as
     // hasAncestor can escape any subtree.
@@ -418,23 +507,33 @@ IndexedParent *IndexerASTVisitor::getIndexedParent(
   if (I == AllParents->end()) {
     return nullptr;
   }
-  return I->second.getPointer();
+  return &I->second;
 }
 
-bool IndexerASTVisitor::declDominatesPrunableSubtree(const clang::Decl *Decl) {
-  const auto Node = clang::ast_type_traits::DynTypedNode::create(*Decl);
-  if (!AllParents) {
-    ProfileBlock block(Observer.getProfilingCallback(), "build_parent_map");
-    AllParents =
-        IndexedParentASTVisitor::buildMap(*Context.getTranslationUnitDecl());
+size_t IndexerASTVisitor::parentMapBytes() const {
+  if (LazyParents) {
+    return LazyParents->allocatedBytes();
   }
-  IndexedParentMap::const_iterator I =
-      AllParents->find(Node.getMemoizationData());
-  if (I == AllParents->end()) {
+  return AllParents ? AllParents->getMemorySize() : 0;
+}
+
+llvm::Optional<IndexedParent> IndexerASTVisitor::getIndexedParent(
+    const ast_type_traits::DynTypedNode &Node) {
+  const auto *Entry = getIndexedParentEntry(Node);
+  if (Entry == nullptr || Entry->empty()) {
+    return llvm::None;
+  }
+  return Entry->unpack();
+}
+
+bool IndexerASTVisitor::declDominatesPrunableSubtree(const clang::Decl *Decl) {
+  const auto *Entry = getIndexedParentEntry(
+      clang::ast_type_traits::DynTypedNode::create(*Decl));
+  if (Entry == nullptr) {
     // Safe default.
     return false;
   }
-  return I->second.getInt() == 0;
+  return !Entry->claimable();
 }
 
 bool IndexerASTVisitor::IsDefinition(const clang::VarDecl *VD) {
@@ -452,6 +551,59 @@ bool IndexerASTVisitor::IsDefinition(const clang::VarDecl *VD) {
   return VD->isThisDeclarationADefinition() != VarDecl::DeclarationOnly;
 }
 
+template <typename ValueType, typename ComputeFn>
+ValueType IndexerASTVisitor::MemoizeLexerResult(
+    llvm::DenseMap<unsigned, ValueType> &Cache, clang::SourceLocation Loc,
+    ComputeFn Compute) const {
+  if (!FLAGS_cache_lexer_results) {
+    return Compute();
+  }
+  auto Found = Cache.find(Loc.getRawEncoding());
+  if (Found != Cache.end()) {
+    ReportProfilingEvent(Observer.getProfilingCallback(), "lexer_cache",
+                         ProfilingEvent::Hit);
+    return Found->second;
+  }
+  ReportProfilingEvent(Observer.getProfilingCallback(), "lexer_cache",
+                       ProfilingEvent::Miss);
+  ValueType Value = Compute();
+  Cache[Loc.getRawEncoding()] = Value;
+  return Value;
+}
+
+IndexerASTVisitor::LexerResult IndexerASTVisitor::getRawToken(
+    clang::SourceLocation StartLocation, clang::Token &Token) const {
+  auto Lexed = MemoizeLexerResult(RawTokens, StartLocation, [&] {
+    std::pair<clang::Token, LexerResult> Result;
+    Result.second = Observer.getPreprocessor()->getRawToken(
+                        StartLocation, Result.first,
+                        true /* ignoreWhiteSpace */)
+                        ? LexerResult::Failure
+                        : LexerResult::Success;
+    return Result;
+  });
+  Token = Lexed.first;
+  return Lexed.second;
+}
+
+clang::SourceRange IndexerASTVisitor::RangeForASTEntityFromSourceLocation(
+    clang::SourceLocation StartLocation) const {
+  return MemoizeLexerResult(EntityRanges, StartLocation, [&] {
+    return kythe::RangeForASTEntityFromSourceLocation(
+        *Observer.getSourceManager(), *Observer.getLangOptions(),
+        StartLocation);
+  });
+}
+
+clang::SourceRange IndexerASTVisitor::RangeForSingleTokenFromSourceLocation(
+    clang::SourceLocation StartLocation) const {
+  return MemoizeLexerResult(SingleTokenRanges, StartLocation, [&] {
+    return kythe::RangeForSingleTokenFromSourceLocation(
+        *Observer.getSourceManager(), *Observer.getLangOptions(),
+        StartLocation);
+  });
+}
+
 SourceRange IndexerASTVisitor::ConsumeToken(
     SourceLocation StartLocation, clang::tok::TokenKind ExpectedKind) const {
   clang::Token Token;
@@ -527,8 +679,7 @@ clang::SourceRange IndexerASTVisitor::RangeForNameOfDeclaration(
       // selector.
       const SourceLocation &Loc = M->getSelectorLoc(0);
       if (Loc.isValid() && Loc.isFileID()) {
-        return RangeForSingleTokenFromSourceLocation(
-            *Observer.getSourceManager(), *Observer.getLangOptions(), Loc);
+        return RangeForSingleTokenFromSourceLocation(Loc);
       }
 
       // If the selector location is not valid or is not a file, return the
@@ -537,8 +688,7 @@ clang::SourceRange IndexerASTVisitor::RangeForNameOfDeclaration(
       return M->getSourceRange();
     }
   }
-  return RangeForASTEntityFromSourceLocation(
-      *Observer.getSourceManager(), *Observer.getLangOptions(), StartLocation);
+  return RangeForASTEntityFromSourceLocation(StartLocation);
 }
 
 void IndexerASTVisitor::MaybeRecordDefinitionRange(
@@ -791,6 +941,73 @@ void IndexerASTVisitor::HandleFileLevelComments(
   }
 }
 
+void IndexerASTVisitor::IndexDocComments() {
+  DocCommentsIndexed = true;
+  const auto &SM = Context.getSourceManager();
+  // The comment list is in translation unit order, so each file's comments
+  // stay in order even where an #include splits them up.
+  for (auto *Comment : Context.getRawCommentList().getComments()) {
+    auto Begin = SM.getDecomposedLoc(Comment->getLocStart());
+    auto &File = DocCommentsByFile[Begin.first];
+    if (File.Ranges.empty()) {
+      bool Invalid = false;
+      File.Buffer = SM.getBufferData(Begin.first, &Invalid);
+      if (Invalid) {
+        File.Buffer = llvm::StringRef();
+      }
+    }
+    File.Ranges.emplace_back(Begin.second,
+                             Begin.second + Comment->getRawText(SM).size());
+  }
+}
+
+bool IndexerASTVisitor::MayHaveDocComment(const clang::Decl *Decl) const {
+  // Clang searches from the start or the name of the declaration. Find the
+  // smallest span in one file that holds both.
+  const auto &SM = Context.getSourceManager();
+  clang::FileID File;
+  unsigned Low = std::numeric_limits<unsigned>::max();
+  unsigned High = 0;
+  for (clang::SourceLocation Loc : {Decl->getLocStart(), Decl->getLocation()}) {
+    if (Loc.isInvalid() || Loc.isMacroID()) {
+      return true;
+    }
+    auto Decomposed = SM.getDecomposedLoc(Loc);
+    if (File.isInvalid()) {
+      File = Decomposed.first;
+    } else if (File != Decomposed.first) {
+      return true;
+    }
+    Low = std::min(Low, Decomposed.second);
+    High = std::max(High, Decomposed.second);
+  }
+  auto Found = DocCommentsByFile.find(File);
+  if (Found == DocCommentsByFile.end()) {
+    return false;
+  }
+  const auto &Comments = Found->second;
+  if (Comments.Buffer.empty() || High > Comments.Buffer.size()) {
+    return true;
+  }
+  // A trailing comment must start on the line where clang's search starts.
+  const size_t LineEnd = Comments.Buffer.find('\n', High);
+  auto Next = std::lower_bound(Comments.Ranges.begin(), Comments.Ranges.end(),
+                               std::make_pair(Low, 0u));
+  if (Next != Comments.Ranges.end() &&
+      (LineEnd == llvm::StringRef::npos || Next->first <= LineEnd)) {
+    return true;
+  }
+  // A leading comment can't be separated from the declaration by other
+  // declarations or by preprocessor directives.
+  if (Next == Comments.Ranges.begin()) {
+    return false;
+  }
+  const auto &Previous = *std::prev(Next);
+  return Previous.second > Low ||
+         Comments.Buffer.slice(Previous.second, Low).find_first_of(
+             ";{}#@") == llvm::StringRef::npos;
+}
+
 void IndexerASTVisitor::VisitComment(
     const clang::RawComment *Comment, const clang::DeclContext *DC,
     const GraphObserver::NodeId &DocumentedNode) {
@@ -944,7 +1161,14 @@ bool IndexerASTVisitor::VisitDecl(const clang::Decl *Decl) {
     // Template instantiation can't add any documentation text.
     return true;
   }
+  if (DocCommentsIndexed && !MayHaveDocComment(Decl)) {
+    return true;
+  }
   const auto *Comment = Context.getRawCommentForDeclNoCache(Decl);
+  if (FLAGS_index_doc_comments_by_file && !DocCommentsIndexed) {
+    // The first search loads comments from any external AST source.
+    IndexDocComments();
+  }
   if (!Comment) {
     // Fast path: if there are no attached documentation comments, bail.
     return true;
@@ -990,13 +1214,57 @@ bool IndexerASTVisitor::VisitDecl(const clang::Decl *Decl) {
   return true;
 }
 
+bool IndexerASTVisitor::CheckBudget() {
+  if (Budget == nullptr) {
+    return true;
+  }
+  auto Previous = Budget->state();
+  auto Current = Budget->check();
+  if (Current == Previous) {
+    return Current != UnitBudgetMonitor::State::Hard;
+  }
+  if (Memory != nullptr) {
+    bool Hard = Current == UnitBudgetMonitor::State::Hard;
+    Memory->sample(Hard ? "unit_budget_hard" : "unit_budget_soft");
+    llvm::errs() << "Memory when the unit passed its "
+                 << (Hard ? "hard" : "soft") << " limit (" << Budget->reason()
+                 << "):\n"
+                 << Memory->summary();
+  }
+  if (Previous == UnitBudgetMonitor::State::Normal) {
+    Verbosity = kythe::Verbosity::Lite;
+    TemplateMode = BehaviorOnTemplates::SkipInstantiations;
+    ReportProfilingEvent(Observer.getProfilingCallback(), "unit_budget_soft",
+                         ProfilingEvent::Hit);
+  }
+  if (Current == UnitBudgetMonitor::State::Hard) {
+    ReportProfilingEvent(Observer.getProfilingCallback(), "unit_budget_hard",
+                         ProfilingEvent::Hit);
+    return false;
+  }
+  return true;
+}
+
 bool IndexerASTVisitor::TraverseDecl(clang::Decl *Decl) {
-  if (ShouldStopIndexing()) {
+  if (ShouldStopIndexing() || !CheckBudget()) {
     return false;
   }
-  if (Decl == nullptr) {
+  if (Decl == nullptr || SkippedDecls.count(Decl) != 0) {
     return true;
   }
+  ++TraversedDecls;
+  if (Memory != nullptr && TraversedDecls % kMemorySampleInterval == 0) {
+    Memory->sample("traversal");
+  }
+  const bool TopLevel =
+      (LazyParents || HotDecls != nullptr) &&
+      (Decl == Job->Decl || IndexedParentASTVisitor::isSkeletonContext(
+                                Decl->getLexicalDeclContext()));
+  if (LazyParents && TopLevel) {
+    // Keep the parents of the nodes we're about to visit close at hand.
+    LazyParents->enterDecl(Decl);
+  }
+  HotDeclProfiler::Scope HotDeclScope(TopLevel ? HotDecls : nullptr, Decl);
   struct RestoreBool {
     RestoreBool(bool *to_restore)
         : to_restore_(to_restore), state_(*to_restore) {}
@@ -1018,7 +1286,10 @@ bool IndexerASTVisitor::TraverseDecl(clang::Decl *Decl) {
       PruneCheck Prune(this, Decl);
       auto can_prune = Prune.can_prune();
       if (can_prune == Prunability::kImmediate) {
+        ReportPrunedNodes(Observer, Decl);
         return true;
+      } else if (can_prune == Prunability::kSampledOut) {
+        return VisitSampledOutInstantiation(Decl);
       } else if (can_prune != Prunability::kNone) {
         Worklist->EnqueueJobForImplicitDecl(
             Decl, can_prune == Prunability::kDeferIncompleteFunctions,
@@ -1034,12 +1305,15 @@ bool IndexerASTVisitor::TraverseDecl(clang::Decl *Decl) {
     PruneCheck Prune(this, Decl);
     auto can_prune = Prune.can_prune();
     if (can_prune == Prunability::kImmediate) {
+      ReportPrunedNodes(Observer, Decl);
       return true;
+    } else if (can_prune == Prunability::kSampledOut) {
+      return VisitSampledOutInstantiation(Decl);
     } else if (can_prune == Prunability::kDeferIncompleteFunctions) {
       Job->PruneIncompleteFunctions = true;
     }
   }
-  GraphObserver::Delimiter Del(Observer);
+  GraphObserver::Delimiter Del(Observer, Decl->getLocation());
   // For clang::FunctionDecl and all subclasses thereof push blame data.
   if (auto *FD = dyn_cast_or_null<clang::FunctionDecl>(Decl)) {
     if (unsigned BuiltinID = FD->getBuiltinID()) {
@@ -1181,9 +1455,7 @@ bool IndexerASTVisitor::VisitMemberExpr(const clang::MemberExpr *E) {
     return true;
   }
   if (const auto *FieldDecl = E->getMemberDecl()) {
-    auto Range = RangeForASTEntityFromSourceLocation(
-        *Observer.getSourceManager(), *Observer.getLangOptions(),
-        E->getMemberLoc());
+    auto Range = RangeForASTEntityFromSourceLocation(E->getMemberLoc());
     auto StmtId = BuildNodeIdForImplicitStmt(E);
     if (auto RCC = RangeInCurrentContext(StmtId, Range)) {
       Observer.recordDeclUseLocation(RCC.primary(),
@@ -1315,10 +1587,7 @@ bool IndexerASTVisitor::VisitCXXPseudoDestructorExpr(
   if (auto DDId = BuildNodeIdForDependentName(
           NNSLoc, DtorName, E->getTildeLoc(), TyId, EmitRanges::Yes)) {
     clang::SourceRange SR = E->getSourceRange();
-    SR.setEnd(RangeForASTEntityFromSourceLocation(*Observer.getSourceManager(),
-                                                  *Observer.getLangOptions(),
-                                                  SR.getEnd())
-                  .getEnd());
+    SR.setEnd(RangeForASTEntityFromSourceLocation(SR.getEnd()).getEnd());
     auto StmtId = BuildNodeIdForImplicitStmt(E);
     if (auto RCC = RangeInCurrentContext(StmtId, SR)) {
       RecordCallEdges(RCC.primary(), DDId.primary());
@@ -1378,9 +1647,7 @@ bool IndexerASTVisitor::VisitCallExpr(const clang::CallExpr *E) {
     if (const auto *Callee = E->getCalleeDecl()) {
       auto CalleeId = BuildNodeIdForRefToDecl(Callee);
       RecordCallEdges(RCC.primary(), CalleeId);
-      for (const auto &S : Supports) {
-        S->InspectCallExpr(*this, E, RCC.primary(), CalleeId);
-      }
+      Supports.InspectCallExpr(*this, E, RCC.primary(), CalleeId);
     } else if (const auto *CE = E->getCallee()) {
       if (auto CalleeId = BuildNodeIdForExpr(CE, EmitRanges::Yes)) {
         RecordCallEdges(RCC.primary(), CalleeId.primary());
@@ -1390,9 +1657,44 @@ bool IndexerASTVisitor::VisitCallExpr(const clang::CallExpr *E) {
   return true;
 }
 
+template <typename BuildFn>
+MaybeFew<GraphObserver::NodeId>
+IndexerASTVisitor::MemoizeNodeId(MemoizedBuilder Builder, const void *Key,
+                                 const char *Label, BuildFn Build) {
+  const auto MemoKey = std::make_pair(Key, static_cast<unsigned>(Builder));
+  const auto Found = NodeIdMemo.find(MemoKey);
+  if (Found != NodeIdMemo.end()) {
+    ReportProfilingEvent(Observer.getProfilingCallback(), Label,
+                         ProfilingEvent::Hit);
+    return Found->second;
+  }
+  ReportProfilingEvent(Observer.getProfilingCallback(), Label,
+                       ProfilingEvent::Miss);
+  const uint64_t ReadsBefore = RangeContextReads;
+  MaybeFew<GraphObserver::NodeId> Result = Build();
+  if (RangeContextReads == ReadsBefore) {
+    // Build may have added to the memo and invalidated Found.
+    NodeIdMemo.insert(std::make_pair(MemoKey, Result));
+  }
+  return Result;
+}
+
 MaybeFew<GraphObserver::NodeId>
 IndexerASTVisitor::BuildNodeIdForImplicitTemplateInstantiation(
     const clang::Decl *Decl) {
+  if (!isa<clang::FunctionDecl>(Decl)) {
+    return None();
+  }
+  return MemoizeNodeId(MemoizedBuilder::ImplicitInstantiation, Decl,
+                       "implicit_instantiation_ids", [&] {
+                         return ComputeNodeIdForImplicitTemplateInstantiation(
+                             Decl);
+                       });
+}
+
+MaybeFew<GraphObserver::NodeId>
+IndexerASTVisitor::ComputeNodeIdForImplicitTemplateInstantiation(
+    const clang::Decl *Decl) {
   std::vector<GraphObserver::NodeId> NIDS;
   std::vector<const GraphObserver::NodeId *> NIDPS;
   const clang::TemplateArgumentLoc *ArgsAsWritten = nullptr;
@@ -1510,18 +1812,22 @@ MaybeFew<GraphObserver::NodeId> IndexerASTVisitor::BuildNodeIdForDeclContext(
     if (llvm::isa<TranslationUnitDecl>(DCDecl)) {
       return None();
     }
-    if (llvm::isa<ClassTemplatePartialSpecializationDecl>(DCDecl)) {
-      return BuildNodeIdForDecl(DCDecl, 0);
-    } else if (auto *CRD = dyn_cast<const clang::CXXRecordDecl>(DCDecl)) {
-      if (const auto *CTD = CRD->getDescribedClassTemplate()) {
-        return BuildNodeIdForDecl(DCDecl, 0);
-      }
-    } else if (auto *FD = dyn_cast<const clang::FunctionDecl>(DCDecl)) {
-      if (FD->getDescribedFunctionTemplate()) {
-        return BuildNodeIdForDecl(DCDecl, 0);
-      }
-    }
-    return BuildNodeIdForDecl(DCDecl);
+    return MemoizeNodeId(
+        MemoizedBuilder::DeclContext, DCDecl, "decl_context_ids",
+        [&]() -> MaybeFew<GraphObserver::NodeId> {
+          if (llvm::isa<ClassTemplatePartialSpecializationDecl>(DCDecl)) {
+            return BuildNodeIdForDecl(DCDecl, 0);
+          } else if (auto *CRD = dyn_cast<const clang::CXXRecordDecl>(DCDecl)) {
+            if (const auto *CTD = CRD->getDescribedClassTemplate()) {
+              return BuildNodeIdForDecl(DCDecl, 0);
+            }
+          } else if (auto *FD = dyn_cast<const clang::FunctionDecl>(DCDecl)) {
+            if (FD->getDescribedFunctionTemplate()) {
+              return BuildNodeIdForDecl(DCDecl, 0);
+            }
+          }
+          return BuildNodeIdForDecl(DCDecl);
+        });
   }
   return None();
 }
@@ -1603,16 +1909,13 @@ bool IndexerASTVisitor::VisitDeclRefOrIvarRefExpr(
     return true;
   }
   if (SL.isValid()) {
-    SourceRange Range = RangeForASTEntityFromSourceLocation(
-        *Observer.getSourceManager(), *Observer.getLangOptions(), SL);
+    SourceRange Range = RangeForASTEntityFromSourceLocation(SL);
     auto StmtId = BuildNodeIdForImplicitStmt(Expr);
     if (auto RCC = RangeInCurrentContext(StmtId, Range)) {
       GraphObserver::NodeId DeclId = BuildNodeIdForRefToDecl(TargetDecl);
       Observer.recordDeclUseLocation(RCC.primary(), DeclId,
                                      GraphObserver::Claimability::Unclaimable);
-      for (const auto &S : Supports) {
-        S->InspectDeclRef(*this, SL, RCC.primary(), DeclId, TargetDecl);
-      }
+      Supports.InspectDeclRef(*this, SL, RCC.primary(), DeclId, TargetDecl);
     }
   }
   return true;
@@ -1757,11 +2060,10 @@ bool IndexerASTVisitor::VisitVarDecl(const clang::VarDecl *Decl) {
     Observer.recordVariableNode(BodyDeclNode,
                                 GraphObserver::Completeness::Incomplete,
                                 GraphObserver::VariableSubkind::None, None());
-    Observer.recordMarkedSource(DeclNode, Marks.GenerateMarkedSource(DeclNode));
-    for (const auto &S : Supports) {
-      S->InspectVariable(*this, DeclNode, BodyDeclNode, Decl,
-                         GraphObserver::Completeness::Incomplete, Completions);
-    }
+    Observer.recordMarkedSource(DeclNode, &Marks);
+    Supports.InspectVariable(*this, DeclNode, BodyDeclNode, Decl,
+                             GraphObserver::Completeness::Incomplete,
+                             Completions);
     return true;
   }
   FileID DeclFile = Observer.getSourceManager()->getFileID(Decl->getLocation());
@@ -1794,11 +2096,10 @@ bool IndexerASTVisitor::VisitVarDecl(const clang::VarDecl *Decl) {
   Observer.recordVariableNode(BodyDeclNode,
                               GraphObserver::Completeness::Definition,
                               GraphObserver::VariableSubkind::None, None());
-  Observer.recordMarkedSource(DeclNode, Marks.GenerateMarkedSource(DeclNode));
-  for (const auto &S : Supports) {
-    S->InspectVariable(*this, DeclNode, BodyDeclNode, Decl,
-                       GraphObserver::Completeness::Definition, Completions);
-  }
+  Observer.recordMarkedSource(DeclNode, &Marks);
+  Supports.InspectVariable(*this, DeclNode, BodyDeclNode, Decl,
+                           GraphObserver::Completeness::Definition,
+                           Completions);
   return true;
 }
 
@@ -1811,16 +2112,13 @@ bool IndexerASTVisitor::VisitNamespaceDecl(const clang::NamespaceDecl *Decl) {
     SourceLocation Loc = Decl->getLocStart();
     if (Decl->isInline() && Loc.isValid() && Loc.isFileID()) {
       // Skip the `inline` keyword.
-      Loc = RangeForSingleTokenFromSourceLocation(
-                *Observer.getSourceManager(), *Observer.getLangOptions(), Loc)
-                .getEnd();
+      Loc = RangeForSingleTokenFromSourceLocation(Loc).getEnd();
       if (Loc.isValid() && Loc.isFileID()) {
         SkipWhitespace(*Observer.getSourceManager(), &Loc);
       }
     }
     if (Loc.isValid() && Loc.isFileID()) {
-      NameRange = RangeForASTEntityFromSourceLocation(
-          *Observer.getSourceManager(), *Observer.getLangOptions(), Loc);
+      NameRange = RangeForASTEntityFromSourceLocation(Loc);
     }
   } else {
     NameRange = RangeForNameOfDeclaration(Decl);
@@ -1831,7 +2129,7 @@ bool IndexerASTVisitor::VisitNamespaceDecl(const clang::NamespaceDecl *Decl) {
     Observer.recordDeclUseLocation(RCC.primary(), DeclNode,
                                    GraphObserver::Claimability::Unclaimable);
   }
-  Observer.recordNamespaceNode(DeclNode, Marks.GenerateMarkedSource(DeclNode));
+  Observer.recordNamespaceNode(DeclNode, &Marks);
   AddChildOfEdgeToDeclContext(Decl, DeclNode);
   return true;
 }
@@ -1851,8 +2149,7 @@ bool IndexerASTVisitor::VisitFieldDecl(const clang::FieldDecl *Decl) {
   // which may be declared along with a complete class definition but later
   // defined in a separate translation unit.
   Observer.recordVariableNode(DeclNode, GraphObserver::Completeness::Definition,
-                              GraphObserver::VariableSubkind::Field,
-                              Marks.GenerateMarkedSource(DeclNode));
+                              GraphObserver::VariableSubkind::Field, &Marks);
   if (const auto *TSI = Decl->getTypeSourceInfo()) {
     // TODO(zarko): Record storage classes for fields.
     AscribeSpelledType(TSI->getTypeLoc(), Decl->getType(), DeclNode);
@@ -1879,7 +2176,7 @@ bool IndexerASTVisitor::VisitEnumConstantDecl(
       RangeInCurrentContext(Decl->isImplicit(), DeclNode, NameRange), DeclNode);
   Observer.recordIntegerConstantNode(DeclNode, Decl->getInitVal());
   AddChildOfEdgeToDeclContext(Decl, DeclNode);
-  Observer.recordMarkedSource(DeclNode, Marks.GenerateMarkedSource(DeclNode));
+  Observer.recordMarkedSource(DeclNode, &Marks);
   return true;
 }
 
@@ -1909,7 +2206,7 @@ bool IndexerASTVisitor::VisitEnumDecl(const clang::EnumDecl *Decl) {
   // or !Decl->isCompleteDefinition()? Do those calls have the same meaning
   // as Decl->getDefinition() != Decl? The Clang documentation suggests that
   // there is a subtle difference.
-  Observer.recordMarkedSource(DeclNode, Marks.GenerateMarkedSource(DeclNode));
+  Observer.recordMarkedSource(DeclNode, &Marks);
   // TODO(zarko): Add edges to previous decls.
   if (Decl->getDefinition() != Decl) {
     // TODO(jdennett): Should we use Type::isIncompleteType() instead of doing
@@ -1957,6 +2254,38 @@ bool IndexerASTVisitor::TraverseClassTemplateDecl(
 // NB: The Traverse* member that's called is based on the dynamic type of the
 // AST node it's being called with (so only one of
 // TraverseClassTemplate{Partial}SpecializationDecl will be called).
+bool IndexerASTVisitor::VisitSampledOutInstantiation(clang::Decl *Decl) {
+  ReportProfilingEvent(Observer.getProfilingCallback(), "sampled_out_decl",
+                       ProfilingEvent::Hit);
+  // Set up the context the decl would have been visited in by its Traverse
+  // method, then visit it without traversing its children.
+  GraphObserver::Delimiter Del(Observer, Decl->getLocation());
+  auto R = RestoreStack(Job->RangeContext);
+  auto B = RestoreStack(Job->BlameStack);
+  bool UITI = Job->UnderneathImplicitTemplateInstantiation;
+  Job->UnderneathImplicitTemplateInstantiation = true;
+  bool Result = true;
+  if (auto *CTSD = dyn_cast<clang::ClassTemplateSpecializationDecl>(Decl)) {
+    Job->RangeContext.push_back(BuildNodeIdForDecl(CTSD));
+    Result = VisitRecordDecl(CTSD);
+  } else if (auto *FD = dyn_cast<clang::FunctionDecl>(Decl)) {
+    if (const auto RangeId = BuildNodeIdForRefToDeclContext(FD)) {
+      Job->RangeContext.push_back(RangeId.primary());
+    } else {
+      Job->RangeContext.push_back(BuildNodeIdForDecl(FD));
+    }
+    if (const auto BlameId = BuildNodeIdForDeclContext(FD)) {
+      Job->BlameStack.push_back(IndexJob::SomeNodes(1, BlameId.primary()));
+    } else {
+      Job->BlameStack.push_back(
+          IndexJob::SomeNodes(1, BuildNodeIdForRefToDecl(FD)));
+    }
+    Result = VisitFunctionDecl(FD);
+  }
+  Job->UnderneathImplicitTemplateInstantiation = UITI;
+  return Result;
+}
+
 bool IndexerASTVisitor::TraverseClassTemplateSpecializationDecl(
     clang::ClassTemplateSpecializationDecl *TD) {
   auto R = RestoreStack(Job->RangeContext);
@@ -2115,6 +2444,8 @@ MaybeFew<GraphObserver::Range> IndexerASTVisitor::ExplicitRangeInCurrentContext(
   if (!SR.getBegin().isValid()) {
     return None();
   }
+  // Results that depend on the RangeContext mustn't be memoized.
+  ++RangeContextReads;
   if (!Job->RangeContext.empty() &&
       !FLAGS_experimental_alias_template_instantiations) {
     return GraphObserver::Range(SR, Job->RangeContext.back());
@@ -2300,7 +2631,7 @@ bool IndexerASTVisitor::VisitRecordDecl(const clang::RecordDecl *Decl) {
   if (Decl->getDefinition() != Decl) {
     Observer.recordRecordNode(BodyDeclNode, RK,
                               GraphObserver::Completeness::Incomplete, None());
-    Observer.recordMarkedSource(DeclNode, Marks.GenerateMarkedSource(DeclNode));
+    Observer.recordMarkedSource(DeclNode, &Marks);
     return true;
   }
   FileID DeclFile = Observer.getSourceManager()->getFileID(Decl->getLocation());
@@ -2340,7 +2671,7 @@ bool IndexerASTVisitor::VisitRecordDecl(const clang::RecordDecl *Decl) {
   }
   Observer.recordRecordNode(BodyDeclNode, RK,
                             GraphObserver::Completeness::Definition, None());
-  Observer.recordMarkedSource(DeclNode, Marks.GenerateMarkedSource(DeclNode));
+  Observer.recordMarkedSource(DeclNode, &Marks);
   return true;
 }
 
@@ -2554,8 +2885,7 @@ bool IndexerASTVisitor::VisitFunctionDecl(clang::FunctionDecl *Decl) {
           // for the variable we are initializing.
           const SourceLocation &Loc = Init->getMemberLocation();
           if (Loc.isValid() && Loc.isFileID()) {
-            MemberSR = RangeForSingleTokenFromSourceLocation(
-                *Observer.getSourceManager(), *Observer.getLangOptions(), Loc);
+            MemberSR = RangeForSingleTokenFromSourceLocation(Loc);
           }
           if (auto RCC = ExplicitRangeInCurrentContext(MemberSR)) {
             const auto &ID = BuildNodeIdForRefToDecl(M);
@@ -2603,8 +2933,7 @@ bool IndexerASTVisitor::VisitFunctionDecl(clang::FunctionDecl *Decl) {
   if (!IsFunctionDefinition && Decl->getBuiltinID() == 0) {
     Observer.recordFunctionNode(
         InnerNode, GraphObserver::Completeness::Incomplete, Subkind, None());
-    Observer.recordMarkedSource(OuterNode,
-                                Marks.GenerateMarkedSource(OuterNode));
+    Observer.recordMarkedSource(OuterNode, &Marks);
     return true;
   }
   if (NameRangeInContext) {
@@ -2630,7 +2959,7 @@ bool IndexerASTVisitor::VisitFunctionDecl(clang::FunctionDecl *Decl) {
   }
   Observer.recordFunctionNode(
       InnerNode, GraphObserver::Completeness::Definition, Subkind, None());
-  Observer.recordMarkedSource(OuterNode, Marks.GenerateMarkedSource(OuterNode));
+  Observer.recordMarkedSource(OuterNode, &Marks);
   return true;
 }
 
@@ -2649,9 +2978,7 @@ IndexerASTVisitor::BuildNodeIdForTypedefNameDecl(
     GraphObserver::NameId AliasNameId(BuildNameIdForDecl(Decl));
     return Observer.recordTypeAliasNode(
         AliasNameId, AliasedTypeId.primary(),
-        BuildNodeIdForType(FollowAliasChain(Decl)),
-        Marks.GenerateMarkedSource(Observer.nodeIdForTypeAliasNode(
-            AliasNameId, AliasedTypeId.primary())));
+        BuildNodeIdForType(FollowAliasChain(Decl)), &Marks);
   }
   return None();
 }
@@ -2769,8 +3096,8 @@ MaybeFew<GraphObserver::NodeId> IndexerASTVisitor::GetDeclChildOf(
   const clang::Decl *CurrentNodeAsDecl;
   while (!(CurrentNodeAsDecl = CurrentNode.get<clang::Decl>()) ||
          !isa<clang::TranslationUnitDecl>(CurrentNodeAsDecl)) {
-    IndexedParent *IP = getIndexedParent(CurrentNode);
-    if (IP == nullptr) {
+    auto IP = getIndexedParent(CurrentNode);
+    if (!IP) {
       break;
     }
     // We would rather name 'template <etc> class C' as C, not C::C, but
@@ -2900,8 +3227,8 @@ GraphObserver::NameId IndexerASTVisitor::BuildNameIdForDecl(
     // NestedNameSpecifier return memoization data. Can we claim an invariant
     // that if we start at any Decl, we will always encounter nodes with
     // memoization data?
-    IndexedParent *IP = getIndexedParent(CurrentNode);
-    if (IP == nullptr) {
+    auto IP = getIndexedParent(CurrentNode);
+    if (!IP) {
       // Make sure that we don't miss out on implicit nodes.
       if (CurrentNodeAsDecl && CurrentNodeAsDecl->isImplicit()) {
         if (const NamedDecl *ND = dyn_cast<NamedDecl>(CurrentNodeAsDecl)) {
@@ -2992,7 +3319,11 @@ GraphObserver::NameId IndexerASTVisitor::BuildNameIdForDecl(
 template <typename TemplateDeclish>
 uint64_t IndexerASTVisitor::SemanticHashTemplateDeclish(
     const TemplateDeclish *Decl) {
-  return std::hash<std::string>()(BuildNameIdForDecl(Decl).ToString());
+  return MemoizeSemanticHash(
+      TemplateDeclishToHash, static_cast<const clang::Decl *>(Decl),
+      "semantic_hash_template_decl", [this, Decl] {
+        return std::hash<std::string>()(BuildNameIdForDecl(Decl).ToString());
+      });
 }
 
 uint64_t IndexerASTVisitor::SemanticHash(const clang::TemplateName &TN) {
@@ -3064,7 +3395,10 @@ uint64_t IndexerASTVisitor::SemanticHash(const clang::TemplateArgument &TA) {
 
 uint64_t IndexerASTVisitor::SemanticHash(const clang::QualType &T) {
   QualType CQT(T.getCanonicalType());
-  return std::hash<std::string>()(CQT.getAsString());
+  return MemoizeSemanticHash(
+      TypeToHash, static_cast<const void *>(CQT.getAsOpaquePtr()),
+      "semantic_hash_type",
+      [&CQT] { return std::hash<std::string>()(CQT.getAsString()); });
 }
 
 uint64_t IndexerASTVisitor::SemanticHash(const clang::EnumDecl *ED) {
@@ -3086,11 +3420,14 @@ uint64_t IndexerASTVisitor::SemanticHash(const clang::EnumDecl *ED) {
 
 uint64_t IndexerASTVisitor::SemanticHash(
     const clang::TemplateArgumentList *RD) {
-  uint64_t hash = 0;
-  for (const auto &A : RD->asArray()) {
-    hash ^= SemanticHash(A);
-  }
-  return hash;
+  return MemoizeSemanticHash(TemplateArgumentListToHash, RD,
+                             "semantic_hash_template_args", [this, RD] {
+                               uint64_t hash = 0;
+                               for (const auto &A : RD->asArray()) {
+                                 hash ^= SemanticHash(A);
+                               }
+                               return hash;
+                             });
 }
 
 uint64_t IndexerASTVisitor::SemanticHash(const clang::RecordDecl *RD) {
@@ -3159,8 +3496,8 @@ MaybeFew<GraphObserver::NodeId> IndexerASTVisitor::BuildNodeIdForImplicitStmt(
         return None();
       }
     }
-    IndexedParent *IP = getIndexedParent(CurrentNode);
-    if (IP == nullptr) {
+    auto IP = getIndexedParent(CurrentNode);
+    if (!IP) {
       break;
     }
     StmtPath.push_back(IP->Index);
@@ -3251,8 +3588,8 @@ GraphObserver::NodeId IndexerASTVisitor::BuildNodeIdForDecl(
   const clang::Decl *CurrentNodeAsDecl;
   while (!(CurrentNodeAsDecl = CurrentNode.get<clang::Decl>()) ||
          !isa<clang::TranslationUnitDecl>(CurrentNodeAsDecl)) {
-    IndexedParent *IP = getIndexedParent(CurrentNode);
-    if (IP == nullptr) {
+    auto IP = getIndexedParent(CurrentNode);
+    if (!IP) {
       break;
     }
     CurrentNode = IP->Parent;
@@ -3407,6 +3744,19 @@ MaybeFew<GraphObserver::NodeId> IndexerASTVisitor::ApplyBuiltinTypeConstructor(
 
 MaybeFew<GraphObserver::NodeId> IndexerASTVisitor::BuildNodeIdForTemplateName(
     const clang::TemplateName &Name, const clang::SourceLocation L) {
+  if (Name.getKind() != TemplateName::Template) {
+    return ComputeNodeIdForTemplateName(Name, L);
+  }
+  // The location is only used to make a TypeSourceInfo that emits no ranges.
+  return MemoizeNodeId(
+      MemoizedBuilder::TemplateName, Name.getAsVoidPointer(),
+      "template_name_ids",
+      [&] { return ComputeNodeIdForTemplateName(Name, L); });
+}
+
+MaybeFew<GraphObserver::NodeId>
+IndexerASTVisitor::ComputeNodeIdForTemplateName(
+    const clang::TemplateName &Name, const clang::SourceLocation L) {
   // TODO(zarko): Do we need to canonicalize `Name`?
   // Maybe with Context.getCanonicalTemplateName()?
   switch (Name.getKind()) {
@@ -3496,10 +3846,8 @@ MaybeFew<GraphObserver::NodeId> IndexerASTVisitor::BuildNodeIdForDependentName(
     Ostream << "invalid";
   }
   Ostream << "@";
-  if (auto RCC =
-          ExplicitRangeInCurrentContext(RangeForASTEntityFromSourceLocation(
-              *Observer.getSourceManager(), *Observer.getLangOptions(),
-              IdLoc))) {
+  if (auto RCC = ExplicitRangeInCurrentContext(
+          RangeForASTEntityFromSourceLocation(IdLoc))) {
     Observer.AppendRangeToStream(Ostream, RCC.primary());
   } else {
     Ostream << "invalid";
@@ -3584,10 +3932,8 @@ MaybeFew<GraphObserver::NodeId> IndexerASTVisitor::BuildNodeIdForDependentName(
 #undef UNEXPECTED_DECLARATION_NAME_KIND
   }
   if (ER == EmitRanges::Yes) {
-    if (auto RCC =
-            ExplicitRangeInCurrentContext(RangeForASTEntityFromSourceLocation(
-                *Observer.getSourceManager(), *Observer.getLangOptions(),
-                IdLoc))) {
+    if (auto RCC = ExplicitRangeInCurrentContext(
+            RangeForASTEntityFromSourceLocation(IdLoc))) {
       Observer.recordDeclUseLocation(RCC.primary(), IdOut);
     }
   }
@@ -3607,9 +3953,7 @@ MaybeFew<GraphObserver::NodeId> IndexerASTVisitor::BuildNodeIdForExpr(
   bool IsBindingSite = false;
   auto RCC = RangeInCurrentContext(
       BuildNodeIdForImplicitStmt(Expr),
-      RangeForASTEntityFromSourceLocation(*Observer.getSourceManager(),
-                                          *Observer.getLangOptions(),
-                                          Expr->getExprLoc()));
+      RangeForASTEntityFromSourceLocation(Expr->getExprLoc()));
   if (!Expr->isValueDependent() && Expr->EvaluateAsRValue(Result, Context)) {
     // TODO(zarko): Represent constant values of any type as nodes in the
     // graph; link ranges to them. Right now we don't emit any node data for
@@ -3765,6 +4109,20 @@ MaybeFew<GraphObserver::NodeId> IndexerASTVisitor::BuildNodeIdForType(
 MaybeFew<GraphObserver::NodeId> IndexerASTVisitor::BuildNodeIdForType(
     const clang::QualType &QT) {
   CHECK(!QT.isNull());
+  // Check TypeNodes before making a TypeSourceInfo, which is allocated in the
+  // ASTContext on every call. Without ranges to emit, the TypeLoc version
+  // answers from TypeNodes too, except for the types it handles specially.
+  const clang::Type *T = QT.getTypePtr();
+  if (!isa<ObjCObjectPointerType>(T) && !isa<AttributedType>(T)) {
+    const auto Prev = TypeNodes.find(ComputeKeyFromQualType(Context, QT, T));
+    if (Prev != TypeNodes.end()) {
+      ReportProfilingEvent(Observer.getProfilingCallback(), "qual_type_ids",
+                           ProfilingEvent::Hit);
+      return Prev->second;
+    }
+    ReportProfilingEvent(Observer.getProfilingCallback(), "qual_type_ids",
+                         ProfilingEvent::Miss);
+  }
   TypeSourceInfo *TSI = Context.getTrivialTypeSourceInfo(QT, SourceLocation());
   return BuildNodeIdForType(TSI->getTypeLoc(), EmitRanges::No);
 }
@@ -4050,8 +4408,7 @@ MaybeFew<GraphObserver::NodeId> IndexerASTVisitor::BuildNodeIdForType(
                      AliasID, AliasedTypeID.primary(),
                      BuildNodeIdForType(
                          FollowAliasChain(T.getTypedefNameDecl())),
-                     Marks.GenerateMarkedSource(Observer.nodeIdForTypeAliasNode(
-                         AliasID, AliasedTypeID.primary())));
+                     &Marks);
     } break;
       UNSUPPORTED_CLANG_TYPE(Adjusted);
       UNSUPPORTED_CLANG_TYPE(Decayed);
@@ -4085,10 +4442,7 @@ MaybeFew<GraphObserver::NodeId> IndexerASTVisitor::BuildNodeIdForType(
             Claimability == GraphObserver::Claimability::Unclaimable
                 ? BuildNodeIdForDecl(SpecializedTemplateDecl)
                 : Observer.recordNominalTypeNode(
-                      BuildNameIdForDecl(SpecializedTemplateDecl),
-                      Marks.GenerateMarkedSource(
-                          Observer.nodeIdForNominalTypeNode(
-                              BuildNameIdForDecl(SpecializedTemplateDecl))),
+                      BuildNameIdForDecl(SpecializedTemplateDecl), &Marks,
                       Parent ? &Parent.primary() : nullptr);
         const auto &TAL = Spec->getTemplateArgs();
         std::vector<GraphObserver::NodeId> TemplateArgs;
@@ -4136,10 +4490,7 @@ MaybeFew<GraphObserver::NodeId> IndexerASTVisitor::BuildNodeIdForType(
             auto Marks = MarkedSources.Generate(Decl);
             auto DeclNameId = BuildNameIdForDecl(Decl);
             ID = Observer.recordNominalTypeNode(
-                DeclNameId,
-                Marks.GenerateMarkedSource(
-                    Observer.nodeIdForNominalTypeNode(DeclNameId)),
-                Parent ? &Parent.primary() : nullptr);
+                DeclNameId, &Marks, Parent ? &Parent.primary() : nullptr);
           }
         }
       }
@@ -4156,10 +4507,7 @@ MaybeFew<GraphObserver::NodeId> IndexerASTVisitor::BuildNodeIdForType(
           auto Marks = MarkedSources.Generate(Decl);
           auto DeclNameId = BuildNameIdForDecl(Decl);
           ID = Observer.recordNominalTypeNode(
-              DeclNameId,
-              Marks.GenerateMarkedSource(
-                  Observer.nodeIdForNominalTypeNode(DeclNameId)),
-              Parent ? &Parent.primary() : nullptr);
+              DeclNameId, &Marks, Parent ? &Parent.primary() : nullptr);
         }
       } else {
         if (Decl->getDefinition()) {
@@ -4259,9 +4607,7 @@ MaybeFew<GraphObserver::NodeId> IndexerASTVisitor::BuildNodeIdForType(
           DeclNode = BuildNodeIdForDecl(RD);
         }
         if (auto RCC = ExplicitRangeInCurrentContext(
-                RangeForSingleTokenFromSourceLocation(
-                    *Observer.getSourceManager(), *Observer.getLangOptions(),
-                    TNameLoc))) {
+                RangeForSingleTokenFromSourceLocation(TNameLoc))) {
           Observer.recordDeclUseLocation(RCC.primary(), DeclNode);
         }
       }
@@ -4325,10 +4671,7 @@ MaybeFew<GraphObserver::NodeId> IndexerASTVisitor::BuildNodeIdForType(
           auto Marks = MarkedSources.Generate(Decl);
           auto DeclNameId = BuildNameIdForDecl(Decl);
           ID = Observer.recordNominalTypeNode(
-              DeclNameId,
-              Marks.GenerateMarkedSource(
-                  Observer.nodeIdForNominalTypeNode(DeclNameId)),
-              Parent ? &Parent.primary() : nullptr);
+              DeclNameId, &Marks, Parent ? &Parent.primary() : nullptr);
         }
       } else {
         if (Decl->getDefinition() != nullptr) {
@@ -4407,10 +4750,7 @@ MaybeFew<GraphObserver::NodeId> IndexerASTVisitor::BuildNodeIdForType(
           auto Marks = MarkedSources.Generate(IFace);
           auto DeclNameId = BuildNameIdForDecl(IFace);
           ID = Observer.recordNominalTypeNode(
-              DeclNameId,
-              Marks.GenerateMarkedSource(
-                  Observer.nodeIdForNominalTypeNode(DeclNameId)),
-              Parent ? &Parent.primary() : nullptr);
+              DeclNameId, &Marks, Parent ? &Parent.primary() : nullptr);
         }
       }
     } break;
@@ -4496,9 +4836,7 @@ MaybeFew<GraphObserver::NodeId> IndexerASTVisitor::BuildNodeIdForType(
       InEmitRanges == IndexerASTVisitor::EmitRanges::Yes) {
     // If this is an empty SourceRange, try to expand it.
     if (SR.getBegin() == SR.getEnd()) {
-      SR = RangeForASTEntityFromSourceLocation(*Observer.getSourceManager(),
-                                               *Observer.getLangOptions(),
-                                               SR.getBegin());
+      SR = RangeForASTEntityFromSourceLocation(SR.getBegin());
     }
     if (auto RCC = ExplicitRangeInCurrentContext(SR)) {
       ID.Iter([&](const GraphObserver::NodeId &I) {
@@ -4524,8 +4862,7 @@ MaybeFew<GraphObserver::NodeId> IndexerASTVisitor::RecordIdTypeNode(
   for (ObjCProtocolDecl *P : Protocols) {
     auto SL = ProtocolLocs[i++];
     auto PID = BuildNodeIdForDecl(P);
-    auto SR = RangeForASTEntityFromSourceLocation(
-        *Observer.getSourceManager(), *Observer.getLangOptions(), SL);
+    auto SR = RangeForASTEntityFromSourceLocation(SL);
     if (auto ERCC = ExplicitRangeInCurrentContext(SR)) {
       Observer.recordDeclUseLocation(ERCC.primary(), PID);
     }
@@ -4611,10 +4948,8 @@ bool IndexerASTVisitor::VisitObjCCompatibleAliasDecl(
   const auto &OriginalInterface = Decl->getClassInterface();
   GraphObserver::NameId AliasID(BuildNameIdForDecl(Decl));
   auto AliasedTypeID(BuildNodeIdForDecl(OriginalInterface));
-  auto AliasNode = Observer.recordTypeAliasNode(
-      AliasID, AliasedTypeID, AliasedTypeID,
-      Marks.GenerateMarkedSource(
-          Observer.nodeIdForTypeAliasNode(AliasID, AliasedTypeID)));
+  auto AliasNode = Observer.recordTypeAliasNode(AliasID, AliasedTypeID,
+                                                AliasedTypeID, &Marks);
 
   // Record the definition of this type alias
   MaybeRecordDefinitionRange(ExplicitRangeInCurrentContext(AliasRange),
@@ -4658,8 +4993,7 @@ bool IndexerASTVisitor::VisitObjCImplementationDecl(
     LogErrorWithASTDump("Missing class interface", ImplDecl);
   }
   Observer.recordRecordNode(DeclNode, GraphObserver::RecordKind::Class,
-                            GraphObserver::Completeness::Definition,
-                            Marks.GenerateMarkedSource(DeclNode));
+                            GraphObserver::Completeness::Definition, &Marks);
   return true;
 }
 
@@ -4671,9 +5005,8 @@ bool IndexerASTVisitor::VisitObjCImplementationDecl(
 bool IndexerASTVisitor::VisitObjCCategoryImplDecl(
     const clang::ObjCCategoryImplDecl *ImplDecl) {
   auto Marks = MarkedSources.Generate(ImplDecl);
-  SourceRange NameRange = RangeForASTEntityFromSourceLocation(
-      *Observer.getSourceManager(), *Observer.getLangOptions(),
-      ImplDecl->getCategoryNameLoc());
+  SourceRange NameRange =
+      RangeForASTEntityFromSourceLocation(ImplDecl->getCategoryNameLoc());
   auto ImplDeclNode = BuildNodeIdForDecl(ImplDecl);
   MaybeRecordDefinitionRange(
       RangeInCurrentContext(ImplDecl->isImplicit(), ImplDeclNode, NameRange),
@@ -4684,8 +5017,7 @@ bool IndexerASTVisitor::VisitObjCCategoryImplDecl(
       Observer.getSourceManager()->getFileID(ImplDecl->getCategoryNameLoc());
 
   Observer.recordRecordNode(ImplDeclNode, GraphObserver::RecordKind::Category,
-                            GraphObserver::Completeness::Definition,
-                            Marks.GenerateMarkedSource(ImplDeclNode));
+                            GraphObserver::Completeness::Definition, &Marks);
 
   if (auto CategoryDecl = ImplDecl->getCategoryDecl()) {
     if (auto NameRangeInContext = ExplicitRangeInCurrentContext(NameRange)) {
@@ -4710,9 +5042,8 @@ bool IndexerASTVisitor::VisitObjCCategoryImplDecl(
       LOG(ERROR) << "Class extensions should not have a category impl.";
       return true;
     }
-    auto Range = RangeForASTEntityFromSourceLocation(
-        *Observer.getSourceManager(), *Observer.getLangOptions(),
-        ImplDecl->getCategoryNameLoc());
+    auto Range =
+        RangeForASTEntityFromSourceLocation(ImplDecl->getCategoryNameLoc());
     if (auto RCC = ExplicitRangeInCurrentContext(Range)) {
       auto ID = BuildNodeIdForDecl(CategoryDecl);
       Observer.recordDeclUseLocation(RCC.primary(), ID,
@@ -4729,9 +5060,8 @@ bool IndexerASTVisitor::VisitObjCCategoryImplDecl(
     auto ClassInterfaceNode = BuildNodeIdForDecl(BaseClassInterface);
     // The location for the category decl is actually the location of the
     // interface name.
-    const SourceRange &IFaceNameRange = RangeForASTEntityFromSourceLocation(
-        *Observer.getSourceManager(), *Observer.getLangOptions(),
-        ImplDecl->getLocation());
+    const SourceRange &IFaceNameRange =
+        RangeForASTEntityFromSourceLocation(ImplDecl->getLocation());
     if (auto RCC = ExplicitRangeInCurrentContext(IFaceNameRange)) {
       Observer.recordDeclUseLocation(RCC.primary(), ClassInterfaceNode);
     }
@@ -4774,9 +5104,8 @@ void IndexerASTVisitor::ConnectToSuperClassAndProtocols(
   // Draw a ref edge from the superclass usage in the interface declaration to
   // the superclass declaration.
   if (auto SC = IFace->getSuperClass()) {
-    auto SuperRange = RangeForASTEntityFromSourceLocation(
-        *Observer.getSourceManager(), *Observer.getLangOptions(),
-        IFace->getSuperClassLoc());
+    auto SuperRange =
+        RangeForASTEntityFromSourceLocation(IFace->getSuperClassLoc());
     if (auto SCRCC = ExplicitRangeInCurrentContext(SuperRange)) {
       auto SCID = BuildNodeIdForDecl(SC);
       Observer.recordDeclUseLocation(SCRCC.primary(), SCID,
@@ -4807,8 +5136,7 @@ void IndexerASTVisitor::ConnectToProtocols(
     Observer.recordExtendsEdge(BodyDeclNode, BuildNodeIdForDecl(*PIt),
                                false /* isVirtual */,
                                clang::AccessSpecifier::AS_none);
-    auto Range = RangeForASTEntityFromSourceLocation(
-        *Observer.getSourceManager(), *Observer.getLangOptions(), *PLocIt);
+    auto Range = RangeForASTEntityFromSourceLocation(*PLocIt);
     if (auto ERCC = ExplicitRangeInCurrentContext(Range)) {
       auto PID = BuildNodeIdForDecl(*PIt);
       Observer.recordDeclUseLocation(ERCC.primary(), PID,
@@ -4856,7 +5184,7 @@ bool IndexerASTVisitor::VisitObjCInterfaceDecl(
                           : GraphObserver::Completeness::Complete;
   Observer.recordRecordNode(BodyDeclNode, GraphObserver::RecordKind::Class,
                             Completeness, None());
-  Observer.recordMarkedSource(DeclNode, Marks.GenerateMarkedSource(DeclNode));
+  Observer.recordMarkedSource(DeclNode, &Marks);
   RecordCompletesForRedecls(Decl, NameRange, BodyDeclNode);
   ConnectToSuperClassAndProtocols(BodyDeclNode, Decl);
   return true;
@@ -4873,9 +5201,7 @@ bool IndexerASTVisitor::VisitObjCCategoryDecl(
   if (Decl->IsClassExtension()) {
     NameRange = RangeForNameOfDeclaration(Decl);
   } else {
-    NameRange = RangeForASTEntityFromSourceLocation(
-        *Observer.getSourceManager(), *Observer.getLangOptions(),
-        Decl->getCategoryNameLoc());
+    NameRange = RangeForASTEntityFromSourceLocation(Decl->getCategoryNameLoc());
   }
 
   auto DeclNode = BuildNodeIdForDecl(Decl);
@@ -4883,8 +5209,7 @@ bool IndexerASTVisitor::VisitObjCCategoryDecl(
       RangeInCurrentContext(Decl->isImplicit(), DeclNode, NameRange), DeclNode);
   AddChildOfEdgeToDeclContext(Decl, DeclNode);
   Observer.recordRecordNode(DeclNode, GraphObserver::RecordKind::Category,
-                            GraphObserver::Completeness::Complete,
-                            Marks.GenerateMarkedSource(DeclNode));
+                            GraphObserver::Completeness::Complete, &Marks);
   RecordCompletesForRedecls(Decl, NameRange, DeclNode);
   if (auto BaseClassInterface = Decl->getClassInterface()) {
     ConnectCategoryToBaseClass(DeclNode, BaseClassInterface);
@@ -4893,9 +5218,8 @@ bool IndexerASTVisitor::VisitObjCCategoryDecl(
     auto ClassInterfaceNode = BuildNodeIdForDecl(BaseClassInterface);
     // The location for the category decl is actually the location of the
     // interface name.
-    const SourceRange &IFaceNameRange = RangeForASTEntityFromSourceLocation(
-        *Observer.getSourceManager(), *Observer.getLangOptions(),
-        Decl->getLocation());
+    const SourceRange &IFaceNameRange =
+        RangeForASTEntityFromSourceLocation(Decl->getLocation());
     if (auto RCC = ExplicitRangeInCurrentContext(IFaceNameRange)) {
       Observer.recordDeclUseLocation(RCC.primary(), ClassInterfaceNode);
     }
@@ -4955,7 +5279,7 @@ bool IndexerASTVisitor::VisitObjCProtocolDecl(
   MaybeRecordDefinitionRange(
       RangeInCurrentContext(Decl->isImplicit(), DeclNode, NameRange), DeclNode);
   AddChildOfEdgeToDeclContext(Decl, DeclNode);
-  Observer.recordInterfaceNode(DeclNode, Marks.GenerateMarkedSource(DeclNode));
+  Observer.recordInterfaceNode(DeclNode, &Marks);
   ConnectToProtocols(DeclNode, Decl->protocol_loc_begin(),
                      Decl->protocol_loc_end(), Decl->protocol_begin(),
                      Decl->protocol_end());
@@ -4989,22 +5313,21 @@ bool IndexerASTVisitor::VisitObjCMethodDecl(const clang::ObjCMethodDecl *Decl) {
   }
 
   // Record overrides edges
-  SmallVector<const ObjCMethodDecl *, 4> overrides;
-  Decl->getOverriddenMethods(overrides);
+  const auto overrides = GetObjCOverriddenMethods(Decl);
   for (const auto &O : overrides) {
     Observer.recordOverridesEdge(Node, BuildNodeIdForDecl(O));
   }
   if (!overrides.empty()) {
-    MapOverrideRoots(Decl, [&](const ObjCMethodDecl *R) {
+    for (const auto *R : GetObjCOverrideRoots(Decl)) {
       Observer.recordOverridesRootEdge(Node, BuildNodeIdForDecl(R));
-    });
+    }
   }
 
   AddChildOfEdgeToDeclContext(Decl, Node);
   GraphObserver::FunctionSubkind Subkind = GraphObserver::FunctionSubkind::None;
   if (!IsFunctionDefinition) {
     Observer.recordFunctionNode(Node, GraphObserver::Completeness::Incomplete,
-                                Subkind, Marks.GenerateMarkedSource(Node));
+                                Subkind, &Marks);
 
     // If this is a decl in an extension, we need to connect it to its
     // implementation here.
@@ -5099,7 +5422,7 @@ bool IndexerASTVisitor::VisitObjCMethodDecl(const clang::ObjCMethodDecl *Decl) {
     }
   }
   Observer.recordFunctionNode(Node, GraphObserver::Completeness::Definition,
-                              Subkind, Marks.GenerateMarkedSource(Node));
+                              Subkind, &Marks);
   return true;
 }
 
@@ -5123,8 +5446,7 @@ void IndexerASTVisitor::ConnectParam(const Decl *Decl,
                               IsFunctionDefinition
                                   ? GraphObserver::Completeness::Definition
                                   : GraphObserver::Completeness::Incomplete,
-                              GraphObserver::VariableSubkind::None,
-                              Marks.GenerateMarkedSource(VarNodeId));
+                              GraphObserver::VariableSubkind::None, &Marks);
   MaybeRecordDefinitionRange(
       RangeInCurrentContext(Param->isImplicit() || Decl->isImplicit(),
                             VarNodeId, Range),
@@ -5159,8 +5481,7 @@ bool IndexerASTVisitor::VisitObjCPropertyDecl(
   Observer.recordVariableNode(
       DeclNode, GraphObserver::Completeness::Definition,
       // TODO(salguarnieri) Think about making a new subkind for properties.
-      GraphObserver::VariableSubkind::Field,
-      Marks.GenerateMarkedSource(DeclNode));
+      GraphObserver::VariableSubkind::Field, &Marks);
   if (const auto *TSI = Decl->getTypeSourceInfo()) {
     // TODO(zarko): Record storage classes for fields.
     AscribeSpelledType(TSI->getTypeLoc(), Decl->getType(), DeclNode);
@@ -5194,8 +5515,7 @@ bool IndexerASTVisitor::VisitObjCMessageExpr(
     } else if (auto ID = BuildNodeIdForType(CR)) {
       const SourceLocation &Loc = Expr->getReceiverRange().getBegin();
       if (Loc.isValid() && Loc.isFileID()) {
-        const SourceRange SR(RangeForSingleTokenFromSourceLocation(
-            *Observer.getSourceManager(), *Observer.getLangOptions(), Loc));
+        const SourceRange SR(RangeForSingleTokenFromSourceLocation(Loc));
         if (auto ERCC = ExplicitRangeInCurrentContext(SR)) {
           Observer.recordTypeSpellingLocation(
               ERCC.primary(), ID.primary(),
@@ -5230,8 +5550,7 @@ bool IndexerASTVisitor::VisitObjCMessageExpr(
         // make it easier for frontends to make use of this data.
         const SourceLocation &Loc = Expr->getSelectorLoc(0);
         if (Loc.isValid() && Loc.isFileID()) {
-          const SourceRange &range = RangeForSingleTokenFromSourceLocation(
-              *Observer.getSourceManager(), *Observer.getLangOptions(), Loc);
+          const SourceRange &range = RangeForSingleTokenFromSourceLocation(Loc);
           if (auto R = ExplicitRangeInCurrentContext(range)) {
             Observer.recordDeclUseLocation(
                 R.primary(), DeclId, GraphObserver::Claimability::Unclaimable);
@@ -5248,6 +5567,14 @@ const ObjCMethodDecl *IndexerASTVisitor::FindMethodDefn(
   if (MD == nullptr || I == nullptr || MD->isThisDeclarationADefinition()) {
     return MD;
   }
+  auto Inserted = ObjCMethodDefns.insert({{MD, I}, MD});
+  if (!Inserted.second) {
+    ReportProfilingEvent(Observer.getProfilingCallback(), "objc_method_defns",
+                         ProfilingEvent::Hit);
+    return Inserted.first->second;
+  }
+  ReportProfilingEvent(Observer.getProfilingCallback(), "objc_method_defns",
+                       ProfilingEvent::Miss);
   // If we can, look in the implementation, otherwise we look in the interface.
   const ObjCContainerDecl *CD = I->getImplementation();
   if (CD == nullptr) {
@@ -5255,9 +5582,46 @@ const ObjCMethodDecl *IndexerASTVisitor::FindMethodDefn(
   }
   if (const auto *MI =
           CD->getMethod(MD->getSelector(), MD->isInstanceMethod())) {
-    return MI;
+    Inserted.first->second = MI;
+  }
+  return Inserted.first->second;
+}
+
+IndexerASTVisitor::ObjCMethods IndexerASTVisitor::GetObjCOverriddenMethods(
+    const ObjCMethodDecl *MD) {
+  auto Found = ObjCOverriddenMethods.find(MD);
+  if (Found != ObjCOverriddenMethods.end()) {
+    ReportProfilingEvent(Observer.getProfilingCallback(), "objc_overrides",
+                         ProfilingEvent::Hit);
+    return Found->second;
+  }
+  ReportProfilingEvent(Observer.getProfilingCallback(), "objc_overrides",
+                       ProfilingEvent::Miss);
+  ObjCMethods Overrides;
+  MD->getOverriddenMethods(Overrides);
+  ObjCOverriddenMethods[MD] = Overrides;
+  return Overrides;
+}
+
+IndexerASTVisitor::ObjCMethods IndexerASTVisitor::GetObjCOverrideRoots(
+    const ObjCMethodDecl *MD) {
+  auto Found = ObjCOverrideRoots.find(MD);
+  if (Found != ObjCOverrideRoots.end()) {
+    return Found->second;
   }
-  return MD;
+  ObjCMethods Roots;
+  if (!MD->isOverriding()) {
+    Roots.push_back(MD);
+  } else {
+    // Methods of a class share their ancestors, so the roots of each
+    // overridden method are usually found already.
+    for (const auto *Overridden : GetObjCOverriddenMethods(MD)) {
+      const auto OverriddenRoots = GetObjCOverrideRoots(Overridden);
+      Roots.append(OverriddenRoots.begin(), OverriddenRoots.end());
+    }
+  }
+  ObjCOverrideRoots[MD] = Roots;
+  return Roots;
 }
 
 bool IndexerASTVisitor::VisitObjCPropertyRefExpr(
@@ -5283,8 +5647,7 @@ bool IndexerASTVisitor::VisitObjCPropertyRefExpr(
   if (SL.isValid()) {
     // This gives us the property name. If we just call Expr->getSourceRange()
     // we just get the range for the object's name.
-    SourceRange SR = RangeForASTEntityFromSourceLocation(
-        *Observer.getSourceManager(), *Observer.getLangOptions(), SL);
+    SourceRange SR = RangeForASTEntityFromSourceLocation(SL);
     auto StmtId = BuildNodeIdForImplicitStmt(Expr);
     if (auto RCC = RangeInCurrentContext(StmtId, SR)) {
       // Record the "field" access if this has an explicit property.
@@ -5292,9 +5655,7 @@ bool IndexerASTVisitor::VisitObjCPropertyRefExpr(
         GraphObserver::NodeId DeclId = BuildNodeIdForDecl(PD);
         Observer.recordDeclUseLocation(
             RCC.primary(), DeclId, GraphObserver::Claimability::Unclaimable);
-        for (const auto &S : Supports) {
-          S->InspectDeclRef(*this, SL, RCC.primary(), DeclId, PD);
-        }
+        Supports.InspectDeclRef(*this, SL, RCC.primary(), DeclId, PD);
       }
 
       // Record the method call.
@@ -35,125 +35,17 @@
 
 #include "GraphObserver.h"
 #include "IndexerLibrarySupport.h"
+#include "clang_utils.h"
+#include "decl_shards.h"
+#include "hot_decl_profiler.h"
+#include "indexed_parent_map.h"
 #include "indexer_worklist.h"
 #include "marked_source.h"
+#include "memory_breakdown.h"
+#include "unit_budget.h"
 
 namespace kythe {
 
-/// For a given node in the AST, this class keeps track of the node's
-/// parent (along some path from the AST root) and an integer index for that
-/// node in some arbitrary but consistent order defined by the parent.
-struct IndexedParent {
-  /// \brief The parent DynTypedNode associated with some key.
-  clang::ast_type_traits::DynTypedNode Parent;
-  /// \brief The index at which some associated key appears in `Parent`.
-  size_t Index;
-};
-
-inline bool operator==(const IndexedParent &L, const IndexedParent &R) {
-  // We compare IndexedParents for deduplicating memoizable DynTypedNodes
-  // below; semantically, this means that we keep the first child index
-  // we saw when following every path through a particular memoizable
-  // IndexedParent.
-  return L.Parent == R.Parent;
-}
-
-inline bool operator!=(const IndexedParent &L, const IndexedParent &R) {
-  return !(L == R);
-}
-
-using IndexedParentMap =
-    llvm::DenseMap<const void *,
-                   llvm::PointerIntPair<IndexedParent *, 1, bool>>;
-
-/// \return `true` if truncating tree traversal at `D` is safe, provided that
-/// `D` has been traversed previously.
-bool IsClaimableForTraverse(const clang::Decl *D);
-
-/// \return `true` if truncating tree traversal at `S` is safe, provided that
-/// `S` has been traversed previously.
-inline bool IsClaimableForTraverse(const clang::Stmt *S) { return false; }
-
-/// FIXME: Currently only builds up the map using \c Stmt and \c Decl nodes.
-/// TODO(zarko): Is this necessary to change for naming?
-class IndexedParentASTVisitor
-    : public clang::RecursiveASTVisitor<IndexedParentASTVisitor> {
- public:
-  /// \brief Builds and returns the translation unit's indexed parent map.
-  ///
-  /// The caller takes ownership of the returned `IndexedParentMap`.
-  static std::unique_ptr<IndexedParentMap> buildMap(
-      clang::TranslationUnitDecl &TU) {
-    std::unique_ptr<IndexedParentMap> ParentMap(new IndexedParentMap);
-    IndexedParentASTVisitor Visitor(ParentMap.get());
-    Visitor.TraverseDecl(&TU);
-    return ParentMap;
-  }
-
- private:
-  typedef RecursiveASTVisitor<IndexedParentASTVisitor> VisitorBase;
-
-  explicit IndexedParentASTVisitor(IndexedParentMap *Parents)
-      : Parents(Parents) {}
-
-  bool shouldVisitTemplateInstantiations() const { return true; }
-  bool shouldVisitImplicitCode() const { return true; }
-  // Disables data recursion. We intercept Traverse* methods in the RAV, which
-  // are not triggered during data recursion.
-  bool shouldUseDataRecursionFor(clang::Stmt *S) const { return false; }
-
-  // Traverse an arbitrary AST node type and record the node used to get to
-  // it as that node's parent. `T` is the type of the node and
-  // `BaseTraverseFn` is the type of a function (or other value with
-  // an operator()) that invokes the base RecursiveASTVisitor traversal logic
-  // on values of type `T*` and returns a boolean traversal result.
-  template <typename T, typename BaseTraverseFn>
-  bool TraverseNode(T *Node, BaseTraverseFn traverse) {
-    if (!Node) return true;
-    if (!ParentStack.empty()) {
-      auto &NodeOrVector = (*Parents)[Node];
-      if (NodeOrVector.getPointer() == nullptr) {
-        // It's not useful to store more than one parent.
-        NodeOrVector.setPointer(new IndexedParent(ParentStack.back()));
-      }
-    }
-    ParentStack.push_back(
-        {clang::ast_type_traits::DynTypedNode::create(*Node), 0});
-    bool SavedClaimableAtThisDepth = ClaimableAtThisDepth;
-    ClaimableAtThisDepth = false;  // for depth + 1
-    bool Result = traverse(Node);
-    if (ClaimableAtThisDepth || IsClaimableForTraverse(Node)) {
-      ClaimableAtThisDepth = true;  // for depth
-      (*Parents)[Node].setInt(1);
-    } else {
-      ClaimableAtThisDepth = SavedClaimableAtThisDepth;  // restore depth
-    }
-    ParentStack.pop_back();
-    if (!ParentStack.empty()) {
-      ParentStack.back().Index++;
-    }
-    return Result;
-  }
-
-  bool TraverseDecl(clang::Decl *DeclNode) {
-    return TraverseNode(DeclNode, [this](clang::Decl *Node) {
-      return VisitorBase::TraverseDecl(Node);
-    });
-  }
-
-  bool TraverseStmt(clang::Stmt *StmtNode) {
-    return TraverseNode(StmtNode, [this](clang::Stmt *Node) {
-      return VisitorBase::TraverseStmt(Node);
-    });
-  }
-
-  IndexedParentMap *Parents;
-  llvm::SmallVector<IndexedParent, 16> ParentStack;
-  bool ClaimableAtThisDepth = false;
-
-  friend class RecursiveASTVisitor<IndexedParentASTVisitor>;
-};
-
 /// \brief Specifies whether uncommonly-used data should be dropped.
 enum Verbosity : bool {
   Classic = true,  ///< Emit all data.
@@ -202,13 +94,11 @@ class IndexerASTVisitor : public clang::RecursiveASTVisitor<IndexerASTVisitor> {
         Verbosity(V),
         Observer(GO ? *GO : NullObserver),
         Context(C),
-        Supports(S),
+        Supports(S, Observer.getProfilingCallback()),
         Sema(Sema),
         MarkedSources(&Sema, &Observer),
         ShouldStopIndexing(std::move(ShouldStopIndexing)) {}
 
-  ~IndexerASTVisitor() { deleteAllParents(); }
-
   bool VisitDecl(const clang::Decl *Decl);
   bool VisitFieldDecl(const clang::FieldDecl *Decl);
   bool VisitVarDecl(const clang::VarDecl *Decl);
@@ -237,6 +127,10 @@ class IndexerASTVisitor : public clang::RecursiveASTVisitor<IndexerASTVisitor> {
   bool VisitEnumConstantDecl(const clang::EnumConstantDecl *Decl);
   bool VisitFunctionDecl(clang::FunctionDecl *Decl);
   bool TraverseDecl(clang::Decl *Decl);
+  /// \brief Records the node for an implicit instantiation outside the
+  /// sample of its template's instantiations (along with its edges to the
+  /// template), but nothing it contains.
+  bool VisitSampledOutInstantiation(clang::Decl *Decl);
 
   // Objective C specific nodes
   bool VisitObjCPropertyImplDecl(const clang::ObjCPropertyImplDecl *Decl);
@@ -552,9 +446,21 @@ class IndexerASTVisitor : public clang::RecursiveASTVisitor<IndexerASTVisitor> {
   void Work(clang::Decl *InitialDecl,
             std::unique_ptr<IndexerWorklist> NewWorklist) {
     Worklist = std::move(NewWorklist);
+    if (DeclShardCount > 1) {
+      if (const auto *TU =
+              llvm::dyn_cast<clang::TranslationUnitDecl>(InitialDecl)) {
+        SkippedDecls = DeclsOutsideShard(*TU, Context.getSourceManager(),
+                                         DeclShardIndex, DeclShardCount);
+      }
+    }
     Worklist->EnqueueJob(llvm::make_unique<IndexJob>(InitialDecl));
-    while (!ShouldStopIndexing() && Worklist->DoWork())
+    while (!ShouldStopIndexing() && !overHardBudget() && Worklist->DoWork())
       ;
+    if (DeclShardIndex != 0) {
+      // Shard 0 indexes the files' top-level comments.
+      Worklist.reset();
+      return;
+    }
     Observer.iterateOverClaimedFiles(
         [this, InitialDecl](clang::FileID Id,
                             const GraphObserver::NodeId &FileNode) {
@@ -568,6 +474,44 @@ class IndexerASTVisitor : public clang::RecursiveASTVisitor<IndexerASTVisitor> {
   /// from the same thread that's walking the AST.
   bool shouldStopIndexing() const { return ShouldStopIndexing(); }
 
+  /// \brief Checks declarations against `B` as they are traversed. Once
+  /// the unit passes a soft limit, the rest of it is indexed at
+  /// `Verbosity::Lite` without visiting template instantiations; once it
+  /// passes a hard limit, traversal stops. `B` may be null.
+  void setBudget(UnitBudgetMonitor *B) { Budget = B; }
+
+  /// \return the number of declarations traversed so far.
+  uint64_t traversedDecls() const { return TraversedDecls; }
+
+  /// \brief Samples `M` every `kMemorySampleInterval` declarations and
+  /// whenever the unit passes a budget limit (in which case the breakdown
+  /// is also printed). `M` may be null.
+  void setMemoryBreakdown(MemoryBreakdown *M) { Memory = M; }
+
+  /// \brief Charges time and entries to the top-level declarations (see
+  /// `IndexedParentASTVisitor::isSkeletonContext`) and the implicit
+  /// instantiation jobs they're spent on. `P` may be null.
+  void setHotDeclProfiler(HotDeclProfiler *P) { HotDecls = P; }
+
+  /// \brief Only traverses the top-level declarations in shard `Index` of
+  /// `Count` when `Work` is given the translation unit; see
+  /// `DeclsOutsideShard`. Shards other than 0 skip the files' top-level
+  /// comments.
+  void setDeclShard(unsigned Index, unsigned Count) {
+    DeclShardIndex = Index;
+    DeclShardCount = Count;
+  }
+
+  /// \brief How many declarations to traverse between samples of the
+  /// memory breakdown.
+  static constexpr uint64_t kMemorySampleInterval = 1 << 16;
+
+  /// \return an estimate of the bytes held by the parent map.
+  size_t parentMapBytes() const;
+
+  /// \return an estimate of the bytes held by the marked source cache.
+  size_t markedSourceBytes() const { return MarkedSources.allocated_bytes(); }
+
   /// Blames a call to `Callee` at `Range` on everything at the top of
   /// `BlameStack` (or does nothing if there's nobody to blame).
   void RecordCallEdges(const GraphObserver::Range &Range,
@@ -601,17 +545,51 @@ class IndexerASTVisitor : public clang::RecursiveASTVisitor<IndexerASTVisitor> {
   /// \param Token The token to overwrite.
   /// \return `Failure` if there was a failure, `Success` on success.
   LexerResult getRawToken(clang::SourceLocation StartLocation,
-                          clang::Token &Token) const {
-    return Observer.getPreprocessor()->getRawToken(StartLocation, Token,
-                                                   true /* ignoreWhiteSpace */)
-               ? LexerResult::Failure
-               : LexerResult::Success;
-  }
+                          clang::Token &Token) const;
+
+  /// \brief Calls the free function of the same name with the `Observer`'s
+  /// source manager and language options, remembering the result.
+  clang::SourceRange RangeForASTEntityFromSourceLocation(
+      clang::SourceLocation StartLocation) const;
+
+  /// \brief Calls the free function of the same name with the `Observer`'s
+  /// source manager and language options, remembering the result.
+  clang::SourceRange RangeForSingleTokenFromSourceLocation(
+      clang::SourceLocation StartLocation) const;
+
+  /// \brief Returns the result of lexing at `Loc` from `Cache`, computing it
+  /// with `Compute` (and remembering it) if it's not already there or if the
+  /// cache is disabled.
+  template <typename ValueType, typename ComputeFn>
+  ValueType MemoizeLexerResult(llvm::DenseMap<unsigned, ValueType> &Cache,
+                               clang::SourceLocation Loc,
+                               ComputeFn Compute) const;
+
+  /// \brief Results of `RangeForASTEntityFromSourceLocation`, keyed by raw
+  /// `SourceLocation` encoding.
+  mutable llvm::DenseMap<unsigned, clang::SourceRange> EntityRanges;
+
+  /// \brief Results of `RangeForSingleTokenFromSourceLocation`, keyed by raw
+  /// `SourceLocation` encoding.
+  mutable llvm::DenseMap<unsigned, clang::SourceRange> SingleTokenRanges;
+
+  /// \brief Results of `getRawToken`, keyed by raw `SourceLocation`
+  /// encoding.
+  mutable llvm::DenseMap<unsigned, std::pair<clang::Token, LexerResult>>
+      RawTokens;
 
   /// \brief Handle the file-level comments for `Id` with node ID `FileId`.
   void HandleFileLevelComments(clang::FileID Id,
                                const GraphObserver::NodeId &FileId);
 
+  /// \brief Sorts the translation unit's comments into `DocCommentsByFile`
+  /// with one pass over the comment list.
+  void IndexDocComments();
+
+  /// \return false if clang will find no documentation comment for `Decl`.
+  /// Must only be called after `IndexDocComments`.
+  bool MayHaveDocComment(const clang::Decl *Decl) const;
+
   /// \brief Emit data for `Comment` that documents `DocumentedNode`, using
   /// `DC` for lookups.
   void VisitComment(const clang::RawComment *Comment,
@@ -656,6 +634,28 @@ class IndexerASTVisitor : public clang::RecursiveASTVisitor<IndexerASTVisitor> {
 
   uint64_t SemanticHash(const clang::Selector &S);
 
+  /// \brief Returns the hash for `Key` in `Cache`, computing it with
+  /// `Compute` (and remembering it) if it's not already there.
+  ///
+  /// Hits and misses are reported to the profiling callback as `Label`.
+  /// `Compute` may recursively use `Cache`.
+  template <typename KeyType, typename ComputeFn>
+  uint64_t MemoizeSemanticHash(llvm::DenseMap<KeyType, uint64_t> &Cache,
+                               KeyType Key, const char *Label,
+                               ComputeFn Compute) {
+    auto Found = Cache.find(Key);
+    if (Found != Cache.end()) {
+      ReportProfilingEvent(Observer.getProfilingCallback(), Label,
+                           ProfilingEvent::Hit);
+      return Found->second;
+    }
+    ReportProfilingEvent(Observer.getProfilingCallback(), Label,
+                         ProfilingEvent::Miss);
+    uint64_t Hash = Compute();
+    Cache[Key] = Hash;
+    return Hash;
+  }
+
   /// \brief Attempts to find the ID of the first parent of `Decl` for
   /// attaching a `childof` relationship.
   MaybeFew<GraphObserver::NodeId> GetDeclChildOf(const clang::Decl *D);
@@ -706,7 +706,8 @@ class IndexerASTVisitor : public clang::RecursiveASTVisitor<IndexerASTVisitor> {
   ///
   /// 'NodeT' can be one of Decl, Stmt, Type, TypeLoc,
   /// NestedNameSpecifier or NestedNameSpecifierLoc.
-  template <typename NodeT> IndexedParent *getIndexedParent(const NodeT &Node) {
+  template <typename NodeT>
+  llvm::Optional<IndexedParent> getIndexedParent(const NodeT &Node) {
     return getIndexedParent(clang::ast_type_traits::DynTypedNode::create(Node));
   }
 
@@ -716,15 +717,21 @@ class IndexerASTVisitor : public clang::RecursiveASTVisitor<IndexerASTVisitor> {
   /// This excludes, for example, certain template instantiations.
   bool declDominatesPrunableSubtree(const clang::Decl *Decl);
 
-  IndexedParent *getIndexedParent(
+  llvm::Optional<IndexedParent> getIndexedParent(
+      const clang::ast_type_traits::DynTypedNode &Node);
+
+  /// \return the parent map's entry for `Node`, or null if it has none.
+  const PackedIndexedParent *getIndexedParentEntry(
       const clang::ast_type_traits::DynTypedNode &Node);
+
   /// A map from memoizable DynTypedNodes to their parent nodes
   /// and their child indices with respect to those parents.
   /// Filled on the first call to `getIndexedParents`.
   std::unique_ptr<IndexedParentMap> AllParents;
 
-  /// \brief Deallocates `AllParents`.
-  void deleteAllParents();
+  /// Used instead of `AllParents` if --experimental_lazy_parent_map is set.
+  /// Created on the first call to `getIndexedParents`.
+  std::unique_ptr<LazyIndexedParentMap> LazyParents;
 
   /// Records information about the template `Template` wrapping the node
   /// `BodyId`, including the edge linking the template and its body. Returns
@@ -777,6 +784,44 @@ class IndexerASTVisitor : public clang::RecursiveASTVisitor<IndexerASTVisitor> {
   /// makes sense only within the implementation of this class.
   std::unordered_map<int64_t, MaybeFew<GraphObserver::NodeId>> TypeNodes;
 
+  /// \brief The node ID builders whose results are kept in `NodeIdMemo`.
+  enum class MemoizedBuilder : unsigned {
+    DeclContext,            ///< BuildNodeIdForDeclContext
+    ImplicitInstantiation,  ///< BuildNodeIdForImplicitTemplateInstantiation
+    TemplateName            ///< BuildNodeIdForTemplateName
+  };
+
+  /// \brief Returns the result of `Build` for `Key`, remembering it in
+  /// `NodeIdMemo` under `Builder` unless `Build` read the RangeContext.
+  ///
+  /// Hits and misses are reported to the profiler under `Label`.
+  template <typename BuildFn>
+  MaybeFew<GraphObserver::NodeId> MemoizeNodeId(MemoizedBuilder Builder,
+                                                const void *Key,
+                                                const char *Label,
+                                                BuildFn Build);
+
+  /// \brief The uncached version of
+  /// `BuildNodeIdForImplicitTemplateInstantiation`.
+  MaybeFew<GraphObserver::NodeId> ComputeNodeIdForImplicitTemplateInstantiation(
+      const clang::Decl *Decl);
+
+  /// \brief The uncached version of `BuildNodeIdForTemplateName`.
+  MaybeFew<GraphObserver::NodeId> ComputeNodeIdForTemplateName(
+      const clang::TemplateName &Name, clang::SourceLocation L);
+
+  /// Results of the builders in `MemoizedBuilder`, by builder and key. A
+  /// result is only kept if building it never read the RangeContext, since
+  /// otherwise the ranges it emitted (and possibly the result) depend on
+  /// where in the traversal it was built. What's left depends only on the
+  /// key, as `TypeNodes` does.
+  llvm::DenseMap<std::pair<const void *, unsigned>,
+                 MaybeFew<GraphObserver::NodeId>>
+      NodeIdMemo;
+
+  /// The number of times the RangeContext has been read.
+  uint64_t RangeContextReads = 0;
+
   /// \brief Visit a DeclRefExpr or a ObjCIvarRefExpr
   ///
   /// DeclRefExpr and ObjCIvarRefExpr are similar entities and can be processed
@@ -864,14 +909,50 @@ class IndexerASTVisitor : public clang::RecursiveASTVisitor<IndexerASTVisitor> {
   const clang::ObjCMethodDecl *FindMethodDefn(
       const clang::ObjCMethodDecl *MD, const clang::ObjCInterfaceDecl *I);
 
+  /// \brief Results of `FindMethodDefn`, keyed by its arguments.
+  llvm::DenseMap<std::pair<const clang::ObjCMethodDecl *,
+                           const clang::ObjCInterfaceDecl *>,
+                 const clang::ObjCMethodDecl *>
+      ObjCMethodDefns;
+
+  using ObjCMethods = llvm::SmallVector<const clang::ObjCMethodDecl *, 4>;
+
+  /// \return the methods `MD` overrides, as `getOverriddenMethods` finds
+  /// them. This searches the class hierarchy, categories and protocols, so
+  /// results are kept in `ObjCOverriddenMethods`.
+  ObjCMethods GetObjCOverriddenMethods(const clang::ObjCMethodDecl *MD);
+
+  /// \return the methods at the roots of `MD`'s override chains (or just
+  /// `MD` if it overrides nothing), once for each chain.
+  ObjCMethods GetObjCOverrideRoots(const clang::ObjCMethodDecl *MD);
+
+  /// \brief Results of `GetObjCOverriddenMethods`.
+  llvm::DenseMap<const clang::ObjCMethodDecl *, ObjCMethods>
+      ObjCOverriddenMethods;
+
+  /// \brief Results of `GetObjCOverrideRoots`.
+  llvm::DenseMap<const clang::ObjCMethodDecl *, ObjCMethods> ObjCOverrideRoots;
+
   /// \brief Maps known Decls to their NodeIds.
   llvm::DenseMap<const clang::Decl *, GraphObserver::NodeId> DeclToNodeId;
 
   /// \brief Maps EnumDecls to semantic hashes.
   llvm::DenseMap<const clang::EnumDecl *, uint64_t> EnumToHash;
 
-  /// \brief Enabled library-specific callbacks.
-  const LibrarySupports &Supports;
+  /// \brief Maps canonical types (as opaque `QualType` pointers) to semantic
+  /// hashes.
+  llvm::DenseMap<const void *, uint64_t> TypeToHash;
+
+  /// \brief Maps template argument lists to semantic hashes.
+  llvm::DenseMap<const clang::TemplateArgumentList *, uint64_t>
+      TemplateArgumentListToHash;
+
+  /// \brief Maps template-like Decls to semantic hashes.
+  llvm::DenseMap<const clang::Decl *, uint64_t> TemplateDeclishToHash;
+
+  /// \brief Enabled library-specific callbacks, indexed by the nodes they
+  /// inspect.
+  LibrarySupportIndex Supports;
 
   /// \brief The `Sema` instance to use.
   clang::Sema &Sema;
@@ -882,6 +963,38 @@ class IndexerASTVisitor : public clang::RecursiveASTVisitor<IndexerASTVisitor> {
   /// \return true if we should stop indexing.
   std::function<bool()> ShouldStopIndexing;
 
+  /// \brief Samples the unit's resource use (if there's a budget) and
+  /// degrades indexing if the unit has just passed a soft limit.
+  /// \return false if the unit has passed a hard limit.
+  bool CheckBudget();
+
+  /// \return true if the unit has passed a hard limit.
+  bool overHardBudget() const {
+    return Budget != nullptr &&
+           Budget->state() == UnitBudgetMonitor::State::Hard;
+  }
+
+  /// \brief The unit's resource budget, or null if it has none.
+  UnitBudgetMonitor *Budget = nullptr;
+
+  /// \brief Where to account for the unit's memory, or null.
+  MemoryBreakdown *Memory = nullptr;
+
+  /// \brief Where to charge top-level declarations' costs, or null.
+  HotDeclProfiler *HotDecls = nullptr;
+
+  /// \brief The number of declarations traversed so far.
+  uint64_t TraversedDecls = 0;
+
+  /// \brief The shard of the unit's top-level declarations to traverse.
+  unsigned DeclShardIndex = 0;
+
+  /// \brief The number of shards the unit is split into.
+  unsigned DeclShardCount = 1;
+
+  /// \brief The top-level declarations outside this visitor's shard.
+  llvm::DenseSet<const clang::Decl *> SkippedDecls;
+
   /// \brief The active indexing job.
   std::unique_ptr<IndexJob> Job;
 
@@ -890,6 +1003,21 @@ class IndexerASTVisitor : public clang::RecursiveASTVisitor<IndexerASTVisitor> {
 
   /// \brief Comments we've already visited.
   std::unordered_set<const clang::RawComment *> VisitedComments;
+
+  /// \brief The comments in a file, in order.
+  struct FileDocComments {
+    /// The text of the file, or empty if it couldn't be loaded.
+    llvm::StringRef Buffer;
+    /// The offsets of each comment's first character and of the character
+    /// just past its end.
+    std::vector<std::pair<unsigned, unsigned>> Ranges;
+  };
+
+  /// \brief Comments by file, filled in by `IndexDocComments`.
+  llvm::DenseMap<clang::FileID, FileDocComments> DocCommentsByFile;
+
+  /// \brief Whether `DocCommentsByFile` is ready for use.
+  bool DocCommentsIndexed = false;
 };
 
 /// \brief An `ASTConsumer` that passes events to a `GraphObserver`.
@@ -911,12 +1039,65 @@ class IndexerASTConsumer : public clang::SemaConsumer {
 
   void HandleTranslationUnit(clang::ASTContext &Context) override {
     CHECK(Sema != nullptr);
-    IndexerASTVisitor Visitor(Context, IgnoreUnimplemented, TemplateMode,
-                              Verbosity, Supports, *Sema, ShouldStopIndexing,
-                              Observer);
+    // The visitor (and its parent map) lives as long as this consumer, so
+    // whoever takes the consumer over can free them with the AST.
+    Visitor = llvm::make_unique<IndexerASTVisitor>(
+        Context, IgnoreUnimplemented, TemplateMode, Verbosity, Supports, *Sema,
+        ShouldStopIndexing, Observer);
+    Visitor->setBudget(Budget);
+    Visitor->setMemoryBreakdown(Memory);
+    Visitor->setHotDeclProfiler(HotDecls);
+    Visitor->setDeclShard(DeclShardIndex, DeclShardCount);
+    // These are all freed with the AST, so they don't change once we're done.
+    ScopedMemoryTracking TrackAST(Memory, "clang_ast", [&Context] {
+      return Context.getASTAllocatedMemory() +
+             Context.getSideTableAllocatedMemory();
+    });
+    ScopedMemoryTracking TrackSourceManager(
+        Memory, "source_manager", [&Context] {
+          const auto &SM = Context.getSourceManager();
+          return SM.getContentCacheSize() + SM.getDataStructureSizes() +
+                 SM.getMemoryBufferSizes().malloc_bytes;
+        });
+    ScopedMemoryTracking TrackPreprocessor(Memory, "preprocessor", [this] {
+      return Sema->getPreprocessor().getTotalMemory();
+    });
+    ScopedMemoryTracking TrackParentMap(Memory, "parent_map", [this] {
+      return Visitor->parentMapBytes();
+    });
+    ScopedMemoryTracking TrackMarkedSource(Memory, "marked_source", [this] {
+      return Visitor->markedSourceBytes();
+    });
+    if (Memory != nullptr) {
+      Memory->sample("parsed");
+    }
     {
       ProfileBlock block(Observer->getProfilingCallback(), "traverse_tu");
-      Visitor.Work(Context.getTranslationUnitDecl(), CreateWorklist(&Visitor));
+      Visitor->Work(Context.getTranslationUnitDecl(),
+                    CreateWorklist(Visitor.get()));
+    }
+    if (Memory != nullptr) {
+      Memory->sample("traversed");
+    }
+    if (HotDecls != nullptr) {
+      // The declarations can only be described while the AST is around.
+      HotDecls->resolve([&Context](const void *Key) {
+        return DescribeDecl(static_cast<const clang::Decl *>(Key),
+                            Context.getSourceManager());
+      });
+    }
+    if (TraversedDeclCount != nullptr) {
+      *TraversedDeclCount = Visitor->traversedDecls();
+    }
+    if (Budget != nullptr &&
+        Budget->state() != UnitBudgetMonitor::State::Normal) {
+      // The source manager is gone once parsing is over, so we have to
+      // mark the output as incomplete now.
+      Observer->recordUnitDiagnostic(
+          (Budget->state() == UnitBudgetMonitor::State::Hard
+               ? "Indexing stopped early: "
+               : "Indexing degraded to lite mode: ") +
+          Budget->reason());
     }
   }
 
@@ -924,6 +1105,57 @@ class IndexerASTConsumer : public clang::SemaConsumer {
 
   void ForgetSema() override { Sema = nullptr; }
 
+  /// \brief Only consulted if the frontend options ask to skip function
+  /// bodies; see `setSkipUnclaimedFunctionBodies`.
+  bool shouldSkipFunctionBody(clang::Decl *D) override {
+    if (!SkipUnclaimedFunctionBodies) {
+      return false;
+    }
+    const auto *FD = D->getAsFunction();
+    // Claimed code may instantiate templates, and the instantiations need
+    // the bodies of their patterns.
+    if (FD == nullptr || FD->isDependentContext()) {
+      return false;
+    }
+    return !Observer->claimLocation(D->getLocation());
+  }
+
+  /// \brief Asks clang not to parse the bodies of non-template functions
+  /// that are defined in files the observer doesn't claim. The frontend
+  /// options must also ask to skip function bodies.
+  ///
+  /// Any entries for those bodies would be dropped anyway, but the
+  /// declarations lose their definitions and template instantiations that
+  /// only the skipped bodies use aren't indexed.
+  void setSkipUnclaimedFunctionBodies(bool S) {
+    SkipUnclaimedFunctionBodies = S;
+  }
+
+  /// \sa IndexerASTVisitor::setBudget
+  void setBudget(UnitBudgetMonitor *B) { Budget = B; }
+
+  /// \brief Sets `*D` to the number of declarations traversed once the
+  /// translation unit has been indexed. `D` may be null.
+  void setTraversedDeclCount(uint64_t *D) { TraversedDeclCount = D; }
+
+  /// \brief Tracks the AST, the parent map and the marked source cache in
+  /// `M` while the translation unit is indexed, sampling it after parsing
+  /// and after traversal. `M` may be null.
+  /// \sa IndexerASTVisitor::setMemoryBreakdown
+  void setMemoryBreakdown(MemoryBreakdown *M) { Memory = M; }
+
+  /// \brief Charges the costs of indexing the translation unit's
+  /// declarations to `P` and resolves it once traversal is over. `P` may be
+  /// null.
+  /// \sa IndexerASTVisitor::setHotDeclProfiler
+  void setHotDeclProfiler(HotDeclProfiler *P) { HotDecls = P; }
+
+  /// \sa IndexerASTVisitor::setDeclShard
+  void setDeclShard(unsigned Index, unsigned Count) {
+    DeclShardIndex = Index;
+    DeclShardCount = Count;
+  }
+
  private:
   GraphObserver *const Observer;
   /// Whether we should stop on missing cases or continue on.
@@ -941,6 +1173,22 @@ class IndexerASTConsumer : public clang::SemaConsumer {
   /// \return a new worklist for the given visitor.
   std::function<std::unique_ptr<IndexerWorklist>(IndexerASTVisitor *)>
       CreateWorklist;
+  /// Whether to skip function bodies in unclaimed files.
+  bool SkipUnclaimedFunctionBodies = false;
+  /// The unit's resource budget, or null if it has none.
+  UnitBudgetMonitor *Budget = nullptr;
+  /// Where to store the number of declarations traversed, or null.
+  uint64_t *TraversedDeclCount = nullptr;
+  /// Where to account for the unit's memory, or null.
+  MemoryBreakdown *Memory = nullptr;
+  /// The shard of the unit's top-level declarations to traverse.
+  unsigned DeclShardIndex = 0;
+  /// The number of shards the unit is split into.
+  unsigned DeclShardCount = 1;
+  /// Where to charge declarations' costs, or null.
+  HotDeclProfiler *HotDecls = nullptr;
+  /// The visitor that indexed the translation unit, once there is one.
+  std::unique_ptr<IndexerASTVisitor> Visitor;
 };
 
 }  // namespace kythe
@@ -18,19 +18,26 @@
 
 #include "IndexerFrontendAction.h"
 
+#include <algorithm>
+#include <map>
 #include <memory>
 #include <string>
+#include <thread>
+#include <unordered_map>
 #include <utility>
 
 #include "clang/Frontend/FrontendAction.h"
 #include "clang/Tooling/Tooling.h"
+#include "kythe/cxx/common/header_map.h"
 #include "kythe/cxx/common/indexing/KytheClaimClient.h"
 #include "kythe/cxx/common/indexing/KytheGraphRecorder.h"
 #include "kythe/cxx/common/indexing/KytheVFS.h"
+#include "kythe/cxx/common/indexing/replay_output_stream.h"
 #include "kythe/cxx/common/json_proto.h"
 #include "kythe/proto/analysis.pb.h"
 #include "kythe/proto/cxx.pb.h"
 #include "llvm/ADT/Twine.h"
+#include "llvm/Support/Path.h"
 #include "third_party/llvm/src/clang_builtin_headers.h"
 
 #include "KytheGraphObserver.h"
@@ -43,67 +50,323 @@ bool RunToolOnCode(std::unique_ptr<clang::FrontendAction> tool_action,
   return clang::tooling::runToolOnCode(tool_action.release(), code, filename);
 }
 
+void CompilerRemains::TakeFrom(clang::CompilerInstance &CI) {
+  Invocation = &CI.getInvocation();
+  if (CI.hasDiagnostics()) {
+    Diagnostics = &CI.getDiagnostics();
+  }
+  if (CI.hasFileManager()) {
+    Files = &CI.getFileManager();
+  }
+  if (CI.hasSourceManager()) {
+    Sources = &CI.getSourceManager();
+  }
+  if (CI.hasTarget()) {
+    Target = &CI.getTarget();
+  }
+  if (CI.hasPreprocessor()) {
+    Preprocessor = CI.getPreprocessorPtr();
+  }
+  if (CI.hasASTContext()) {
+    Context = &CI.getASTContext();
+  }
+  if (CI.hasASTConsumer()) {
+    Consumer = CI.takeASTConsumer();
+  }
+  if (CI.hasSema()) {
+    Sema = CI.takeSema();
+  }
+}
+
+void CompilerRemains::Hold(llvm::IntrusiveRefCntPtr<clang::FileManager> Files) {
+  this->Files = std::move(Files);
+}
+
 namespace {
 
-bool DecodeHeaderSearchInformation(const proto::CompilationUnit &Unit,
-                                   HeaderSearchInfo &Info) {
-  bool FoundDetails = false;
-  proto::CxxCompilationUnitDetails Details;
-  for (const auto &Any : Unit.details()) {
-    if (Any.type_url() == kCxxCompilationUnitDetailsURI) {
-      FoundDetails = UnpackAny(Any, &Details);
-      break;
+/// \brief Hands a unit's `CompilerRemains` to a `UnitTeardown` when it goes
+/// out of scope.
+class BuryOnExit {
+ public:
+  explicit BuryOnExit(UnitTeardown *Teardown) : Teardown(Teardown) {
+    if (Teardown != nullptr) {
+      Remains = llvm::make_unique<CompilerRemains>();
     }
   }
-  if (!FoundDetails) {
-    return false;
+  ~BuryOnExit() {
+    if (Teardown != nullptr) {
+      Teardown->Bury(std::move(Remains));
+    }
   }
-  if (!Info.CopyFrom(Details)) {
-    fprintf(stderr,
-            "Warning: unit has header search info, but it is ill-formed.\n");
-    return false;
+  /// \return the remains to fill in, or null if there's no teardown.
+  CompilerRemains *remains() { return Remains.get(); }
+
+ private:
+  UnitTeardown *Teardown;
+  std::unique_ptr<CompilerRemains> Remains;
+};
+
+/// \return the unit's header search information, or null if it has none
+/// (or it's ill-formed). Shared details are found in `Shared`.
+std::shared_ptr<const HeaderSearchInfo>
+DecodeHeaderSearchInformation(const proto::CompilationUnit &Unit,
+                              SharedCxxDetailsCache *Shared) {
+  for (const auto &Any : Unit.details()) {
+    if (Any.type_url() == kCxxCompilationUnitDetailsURI) {
+      proto::CxxCompilationUnitDetails Details;
+      if (!UnpackAny(Any, &Details)) {
+        return nullptr;
+      }
+      auto Info = std::make_shared<HeaderSearchInfo>();
+      if (!Info->CopyFrom(Details)) {
+        fprintf(stderr,
+                "Warning: unit has header search info, but it is "
+                "ill-formed.\n");
+        return nullptr;
+      }
+      return Info;
+    }
+    if (Any.type_url() == kCxxSharedDetailsRefURI) {
+      proto::CxxSharedDetailsRef Ref;
+      if (Shared == nullptr || !UnpackAny(Any, &Ref)) {
+        return nullptr;
+      }
+      auto Info = Shared->Find(Ref.digest());
+      if (Info == nullptr) {
+        fprintf(stderr,
+                "Warning: unit has shared header search info, but it is "
+                "missing or ill-formed.\n");
+      }
+      return Info;
+    }
   }
-  return true;
+  return nullptr;
 }
 
-std::string ConfigureSystemHeaders(const proto::CompilationUnit &Unit,
-                                   std::vector<proto::FileData> &Files) {
+std::string ConfigureSystemHeaders(
+    const proto::CompilationUnit &Unit,
+    google::protobuf::RepeatedPtrField<proto::FileData> &Files) {
   const std::string HeaderPath = "/kythe_builtins/include/";
   for (const auto *Header = builtin_headers_create(); Header->name != nullptr;
        ++Header) {
     auto Path = HeaderPath + Header->name;
     auto Data = Header->data;
-    proto::FileData NewFile;
-    NewFile.mutable_info()->set_path(Path);
-    NewFile.mutable_info()->set_digest("");
-    *NewFile.mutable_content() = Data;
-    Files.push_back(NewFile);
+    proto::FileData *NewFile = Files.Add();
+    NewFile->mutable_info()->set_path(Path);
+    NewFile->mutable_info()->set_digest("");
+    *NewFile->mutable_content() = Data;
   }
   return "-resource-dir=/kythe_builtins";
 }
+
+/// \brief Adds a header map to `Files` for each kind of file among `Info`'s
+/// include resolutions.
+/// \param WorkingDir The directory relative paths are relative to.
+/// \return The header maps that were added.
+std::vector<HeaderMapFile> ConfigureHeaderMaps(
+    const std::string &WorkingDir, const HeaderSearchInfo &Info,
+    google::protobuf::RepeatedPtrField<proto::FileData> &Files) {
+  std::map<clang::SrcMgr::CharacteristicKind,
+           std::vector<std::pair<std::string, std::string>>>
+      Entries;
+  for (const auto &Resolution : Info.include_resolutions) {
+    // Clang searches again for names that map to relative paths.
+    llvm::SmallString<1024> Path(Resolution.second.path);
+    if (llvm::sys::path::is_relative(Path)) {
+      Path = WorkingDir;
+      llvm::sys::path::append(Path, Resolution.second.path);
+    }
+    llvm::sys::path::remove_dots(Path, true);
+    Entries[Resolution.second.characteristic_kind].emplace_back(
+        Resolution.first, std::string(Path.str()));
+  }
+  std::vector<HeaderMapFile> Maps;
+  for (const auto &Kind : Entries) {
+    HeaderMapFile Map{"/kythe_builtins/header_maps/" +
+                          std::to_string(Kind.first) + ".hmap",
+                      Kind.first};
+    proto::FileData *NewFile = Files.Add();
+    NewFile->mutable_info()->set_path(Map.Path);
+    NewFile->mutable_info()->set_digest("");
+    *NewFile->mutable_content() = BuildHeaderMap(Kind.second);
+    Maps.push_back(std::move(Map));
+  }
+  return Maps;
+}
+
+/// \brief Appends `Field` to `Key` such that distinct field sequences produce
+/// distinct keys.
+void AppendKeyField(const std::string &Field, std::string *Key) {
+  Key->append(std::to_string(Field.size()));
+  Key->push_back(':');
+  Key->append(Field);
+}
 }  // anonymous namespace
 
-std::string IndexCompilationUnit(
-    const proto::CompilationUnit &Unit, std::vector<proto::FileData> &Files,
-    KytheClaimClient &Client, HashCache *Cache, KytheOutputStream &Output,
-    const IndexerOptions &Options, const MetadataSupports *MetaSupports,
+std::string ComputePreambleKey(const proto::CompilationUnit &Unit) {
+  const auto &Sources = Unit.source_file();
+  auto IsSource = [&Sources](const std::string &Path) {
+    return std::find(Sources.begin(), Sources.end(), Path) != Sources.end();
+  };
+  std::string Key;
+  AppendKeyField(Unit.working_directory(), &Key);
+  AppendKeyField(Unit.entry_context(), &Key);
+  for (const auto &Arg : Unit.argument()) {
+    if (!IsSource(Arg)) {
+      AppendKeyField(Arg, &Key);
+    }
+  }
+  for (const auto &Input : Unit.required_input()) {
+    if (IsSource(Input.info().path())) {
+      continue;
+    }
+    AppendKeyField(Input.info().path(), &Key);
+    AppendKeyField(Input.info().digest(), &Key);
+    for (const auto &Row : Input.context().row()) {
+      AppendKeyField(Row.source_context(), &Key);
+      AppendKeyField(Row.always_process() ? "1" : "0", &Key);
+      for (const auto &Col : Row.column()) {
+        AppendKeyField(std::to_string(Col.offset()), &Key);
+        AppendKeyField(Col.linked_context(), &Key);
+      }
+    }
+  }
+  return CompressString(Key, true);
+}
+
+void ApplyIndexingProfile(std::vector<std::string> *Args) {
+  std::vector<std::string> Adjusted;
+  size_t I = 0;
+  if (!Args->empty()) {
+    Adjusted.push_back(std::move((*Args)[I++]));
+  }
+  // Arguments after "--" are all inputs.
+  for (; I < Args->size() && (*Args)[I] != "--"; ++I) {
+    llvm::StringRef Arg((*Args)[I]);
+    if ((Arg.startswith("-X") || Arg == "-mllvm") && I + 1 < Args->size()) {
+      // The next argument belongs to this one, even if it looks like a
+      // warning flag.
+      Adjusted.push_back(std::move((*Args)[I++]));
+      Adjusted.push_back(std::move((*Args)[I]));
+      continue;
+    }
+    // -Wa, -Wl and -Wp pass options on to other tools (and -Wp,-D defines a
+    // macro), so they stay.
+    bool IsWarningFlag =
+        (Arg.startswith("-W") && !Arg.startswith("-Wa,") &&
+         !Arg.startswith("-Wl,") && !Arg.startswith("-Wp,")) ||
+        Arg.startswith("-pedantic");
+    if (!IsWarningFlag) {
+      Adjusted.push_back(std::move((*Args)[I]));
+    }
+  }
+  // These come last so that they override the build's own settings.
+  static const char *const kProfile[] = {
+      "-fno-caret-diagnostics",
+      "-fno-diagnostics-fixit-info",
+      "-fno-color-diagnostics",
+      "-fno-diagnostics-show-option",
+      "-fmacro-backtrace-limit=1",
+      "-ftemplate-backtrace-limit=1",
+      "-fconstexpr-backtrace-limit=1",
+      "-fno-spell-checking",
+  };
+  Adjusted.insert(Adjusted.end(), std::begin(kProfile), std::end(kProfile));
+  for (; I < Args->size(); ++I) {
+    Adjusted.push_back(std::move((*Args)[I]));
+  }
+  Args->swap(Adjusted);
+}
+
+bool PreambleKeyCache::Record(const std::string &Key) {
+  std::lock_guard<std::mutex> Lock(Mutex);
+  if (Keys.insert(Key).second) {
+    return false;
+  }
+  ++Hits;
+  return true;
+}
+
+size_t PreambleKeyCache::hits() const {
+  std::lock_guard<std::mutex> Lock(Mutex);
+  return Hits;
+}
+
+size_t PreambleKeyCache::misses() const {
+  std::lock_guard<std::mutex> Lock(Mutex);
+  return Keys.size();
+}
+
+namespace {
+/// \brief Indexes shard `ShardIndex` of `ShardCount` of `Unit`'s top-level
+/// declarations. The parameters are as for `IndexCompilationUnit`, but
+/// `Options.DeclShards` is ignored.
+std::string IndexCompilationUnitShard(
+    const proto::CompilationUnit &Unit,
+    google::protobuf::RepeatedPtrField<proto::FileData> &Files,
+    const std::vector<MappedFile> &MappedFiles, KytheClaimClient &Client,
+    HashCache *Cache, KytheOutputStream &Output, const IndexerOptions &Options,
+    const MetadataSupports *MetaSupports,
     std::function<std::unique_ptr<IndexerWorklist>(IndexerASTVisitor *)>
-        CreateWorklist) {
-  HeaderSearchInfo HSI;
-  bool HSIValid = DecodeHeaderSearchInformation(Unit, HSI);
+        CreateWorklist,
+    unsigned ShardIndex, unsigned ShardCount) {
+  // Every NodeId created for this unit is interned here, so the arena must
+  // outlive everything else in this function.
+  NodeIdArena Arena;
+  NodeIdArena::Scope ArenaScope(&Arena);
+  // Everything declared after this refers to the unit's AST, so the AST must
+  // only be buried once they're gone.
+  BuryOnExit Burial(Options.Teardown);
+  // The budget covers everything from here on, including parsing.
+  std::unique_ptr<UnitBudgetMonitor> Budget;
+  if (!Options.Budget.empty()) {
+    Budget = llvm::make_unique<UnitBudgetMonitor>(Options.Budget);
+  }
+  if (Options.PreambleCache != nullptr) {
+    ReportProfilingEvent(
+        Options.ReportProfileEvent, "preamble_cache",
+        Options.PreambleCache->Record(ComputePreambleKey(Unit))
+            ? ProfilingEvent::Hit
+            : ProfilingEvent::Miss);
+  }
+  std::shared_ptr<const HeaderSearchInfo> HSI =
+      DecodeHeaderSearchInformation(Unit, Options.SharedDetails);
+  const bool HSIValid = HSI != nullptr;
   std::string FixupArgument;
   if (!HSIValid) {
     FixupArgument = ConfigureSystemHeaders(Unit, Files);
   }
   clang::FileSystemOptions FSO;
   FSO.WorkingDir = Options.EffectiveWorkingDirectory;
+  const bool UsesModules =
+      (HSIValid && HSI->modules) ||
+      std::find(Unit.argument().begin(), Unit.argument().end(),
+                "-fmodules") != Unit.argument().end();
+  const bool ShareModules = UsesModules && !Options.ModuleCachePath.empty();
+  // Header map hits don't suggest modules to import.
+  std::vector<HeaderMapFile> HeaderMaps;
+  if (HSIValid && Options.UseIncludeResolutions && !UsesModules) {
+    HeaderMaps = ConfigureHeaderMaps(FSO.WorkingDir, *HSI, Files);
+  }
   std::vector<llvm::StringRef> Dirs;
-  for (auto &Path : HSI.paths) {
-    Dirs.push_back(Path.path);
+  if (HSIValid) {
+    for (const auto &Path : HSI->paths) {
+      Dirs.push_back(Path.path);
+    }
   }
   llvm::IntrusiveRefCntPtr<IndexVFS> VFS(
-      new IndexVFS(FSO.WorkingDir, Files, Dirs));
+      new IndexVFS(FSO.WorkingDir, Files, Dirs, MappedFiles));
+  if (ShareModules) {
+    // Clang writes the modules it builds straight to disk, then reads them
+    // back through the file manager.
+    VFS->AddRealDirectory(Options.ModuleCachePath);
+  }
   KytheGraphRecorder Recorder(&Output);
+  Recorder.set_entry_filter(Options.EntryFilter);
+  EntryDeduplicator Deduplicator;
+  if (Options.DedupEntries) {
+    Recorder.set_deduplicator(&Deduplicator);
+  }
   KytheGraphObserver Observer(&Recorder, &Client, MetaSupports, VFS,
                               Options.ReportProfileEvent);
   if (Cache != nullptr) {
@@ -113,20 +376,47 @@ std::string IndexCompilationUnit(
   if (Options.DropInstantiationIndependentData) {
     Observer.DropRedundantWraiths();
   }
+  Observer.set_range_dedup_limit(Options.RangeDedupLimit);
+  if (Options.DedupFingerprintBits != 0) {
+    Observer.set_dedup_fingerprint_bits(Options.DedupFingerprintBits);
+  }
+  IndexVFS *VFSPtr = VFS.get();
+  ScopedMemoryTracking TrackVFS(Options.Memory, "vfs_files",
+                                [VFSPtr] { return VFSPtr->heap_bytes(); });
+  ScopedMemoryTracking TrackOutput(
+      Options.Memory, "output_buffers",
+      [&Output] { return Output.buffered_bytes(); });
+  ScopedMemoryTracking TrackObserver(
+      Options.Memory, "graph_observer",
+      [&Observer] { return Observer.allocatedBytes(); });
+  if (Options.EmitBuiltinsPerUnit) {
+    Observer.EmitMetaNodes();
+  } else {
+    Observer.AssumeBuiltinsEmitted();
+  }
   Observer.set_claimant(Unit.v_name());
   Observer.set_starting_context(Unit.entry_context());
+  Observer.set_header_fingerprints(Options.HeaderFingerprints);
+  Observer.set_instantiation_fingerprints(Options.InstantiationFingerprints);
+  Observer.set_instantiation_sample_limit(Options.InstantiationSampleLimit);
+  Observer.set_claim_by_content(Options.ClaimByContent);
+  Observer.set_main_file_only(Options.MainFileOnly);
+  Observer.set_group_entries_by_file(Options.GroupEntriesByFile);
   for (const auto &Input : Unit.required_input()) {
     if (Input.has_info() && !Input.info().path().empty() &&
         Input.has_v_name()) {
       VFS->SetVName(Input.info().path(), Input.v_name());
     }
+    if (Options.ClaimByContent && Input.has_v_name() &&
+        !Input.info().digest().empty()) {
+      Observer.AddFileDigest(Input.v_name(), Input.info().digest());
+    }
     const std::string &FilePath = Input.info().path();
     for (const auto &Row : Input.context().row()) {
       if (Row.always_process()) {
-        auto ClaimableVname = Input.v_name();
-        ClaimableVname.set_signature(Row.source_context() +
-                                     ClaimableVname.signature());
-        Client.AssignClaim(ClaimableVname, Unit.v_name());
+        Client.AssignClaim(
+            Observer.FileClaimable(Input.v_name(), Row.source_context()),
+            Unit.v_name());
       }
       for (const auto &Col : Row.column()) {
         Observer.AddContextInformation(FilePath, Row.source_context(),
@@ -134,6 +424,29 @@ std::string IndexCompilationUnit(
       }
     }
   }
+  if (Options.PrefetchClaims && !Options.MainFileOnly) {
+    // These are the VNames `pushFile` will claim, since each file is entered
+    // in the contexts listed for it (or in no context, if there are none).
+    std::vector<proto::VName> ClaimableVNames;
+    for (const auto &Input : Unit.required_input()) {
+      if (!Input.has_v_name()) {
+        continue;
+      }
+      if (Input.context().row_size() == 0) {
+        ClaimableVNames.push_back(Observer.FileClaimable(Input.v_name(), ""));
+      }
+      for (const auto &Row : Input.context().row()) {
+        ClaimableVNames.push_back(
+            Observer.FileClaimable(Input.v_name(), Row.source_context()));
+      }
+      if (Options.ClaimByContent) {
+        // Copies whose content another unit claims still claim their nodes.
+        ClaimableVNames.push_back(Input.v_name());
+      }
+    }
+    ProfileBlock Block(Observer.getProfilingCallback(), "prefetch_claims");
+    Observer.PrefetchFileClaims(ClaimableVNames);
+  }
   if (MetaSupports != nullptr) {
     MetaSupports->UseVNameLookup(
         [VFS](const std::string &path, proto::VName *out) {
@@ -141,11 +454,27 @@ std::string IndexCompilationUnit(
         });
   }
   std::unique_ptr<IndexerFrontendAction> Action(new IndexerFrontendAction(
-      &Observer, HSIValid ? &HSI : nullptr, Options.ShouldStopIndexing,
+      &Observer, HSI.get(), Options.ShouldStopIndexing,
       std::move(CreateWorklist)));
   Action->setIgnoreUnimplemented(Options.UnimplementedBehavior);
   Action->setTemplateMode(Options.TemplateBehavior);
   Action->setVerbosity(Options.Verbosity);
+  Action->setSkipUnclaimedFunctionBodies(Options.SkipUnclaimedFunctionBodies ||
+                                         Options.MainFileOnly);
+  Action->setHeaderMaps(std::move(HeaderMaps));
+  Action->setCostProbe(Options.CostProbe);
+  Action->setDeclShard(ShardIndex, ShardCount);
+  Action->setBudget(Budget.get());
+  if (Options.Stats != nullptr) {
+    Action->setTraversedDeclCount(&Options.Stats->TraversedDecls);
+  }
+  Action->setMemoryBreakdown(Options.Memory);
+  if (Options.HotDecls != nullptr) {
+    Options.HotDecls->setEntryCounter(
+        [&Recorder] { return Recorder.entries_admitted(); });
+    Action->setHotDeclProfiler(Options.HotDecls);
+  }
+  Action->setRemains(Burial.remains());
   llvm::IntrusiveRefCntPtr<clang::FileManager> FileManager(
       new clang::FileManager(FSO, Options.AllowFSAccess ? nullptr : VFS));
   std::vector<std::string> Args(Unit.argument().begin(), Unit.argument().end());
@@ -154,6 +483,13 @@ std::string IndexCompilationUnit(
   if (!FixupArgument.empty()) {
     Args.insert(Args.begin() + 1, FixupArgument);
   }
+  if (Options.IndexingProfile) {
+    ApplyIndexingProfile(&Args);
+  }
+  if (ShareModules) {
+    // The driver uses the last cache path it's given.
+    Args.push_back("-fmodules-cache-path=" + Options.ModuleCachePath);
+  }
   // StdinAdjustSingleFrontendActionFactory takes ownership of its action.
   std::unique_ptr<StdinAdjustSingleFrontendActionFactory> Tool(
       new StdinAdjustSingleFrontendActionFactory(std::move(Action)));
@@ -162,9 +498,214 @@ std::string IndexCompilationUnit(
       Args, Tool.get(), FileManager.get(),
       std::make_shared<clang::PCHContainerOperations>());
   ProfileBlock block(Observer.getProfilingCallback(), "run_invocation");
-  if (!Invocation.run()) {
+  bool Succeeded = Invocation.run();
+  if (Options.Memory != nullptr) {
+    Options.Memory->sample("finished");
+  }
+  if (Options.Stats != nullptr) {
+    Options.Stats->VFSMisses = VFS->misses();
+  }
+  if (Burial.remains() != nullptr) {
+    // The compiler instance is gone, so this is the only other reference.
+    Burial.remains()->Hold(std::move(FileManager));
+  }
+  if (!Succeeded) {
     return "Errors during indexing.";
   }
+  if (Options.CostProbe != nullptr) {
+    return "";
+  }
+  if (Budget != nullptr &&
+      Budget->state() != UnitBudgetMonitor::State::Normal) {
+    // The unit's output is still usable, so this isn't an error.
+    fprintf(stderr, "Warning: unit %s was %s: %s\n",
+            Unit.v_name().signature().c_str(),
+            Budget->state() == UnitBudgetMonitor::State::Hard
+                ? "only partly indexed"
+                : "indexed in lite mode",
+            Budget->reason().c_str());
+  }
+  if (Budget != nullptr &&
+      Budget->state() != UnitBudgetMonitor::State::Normal) {
+    // Later runs shouldn't skip what this one didn't fully index.
+    return "";
+  }
+  Observer.RecordHeaderFingerprints();
+  Observer.RecordInstantiationFingerprints();
+  return "";
+}
+
+/// \brief Gives every shard of a unit the answer that the first shard to
+/// ask got, so that the shards agree on which files and instantiations the
+/// unit claims.
+class ShardClaimClient : public KytheClaimClient {
+ public:
+  explicit ShardClaimClient(KytheClaimClient *Client) : Client(Client) {}
+
+  bool Claim(const proto::VName &Claimant, const proto::VName &VName) override {
+    std::lock_guard<std::mutex> Lock(Mutex);
+    std::string Key = ClaimKey(Claimant, VName);
+    auto Found = Claims.find(Key);
+    if (Found != Claims.end()) {
+      return Found->second;
+    }
+    bool Claimed = Client->Claim(Claimant, VName);
+    Claims.emplace(std::move(Key), Claimed);
+    return Claimed;
+  }
+
+  bool ClaimBatch(std::vector<std::pair<std::string, bool>> *Tokens) override {
+    std::lock_guard<std::mutex> Lock(Mutex);
+    std::vector<std::pair<std::string, bool>> Unseen;
+    for (const auto &Token : *Tokens) {
+      if (Batches.find(Token.first) == Batches.end()) {
+        Unseen.push_back(Token);
+      }
+    }
+    if (!Unseen.empty()) {
+      Client->ClaimBatch(&Unseen);
+      for (const auto &Token : Unseen) {
+        Batches.emplace(Token.first, Token.second);
+      }
+    }
+    bool Any = false;
+    for (auto &Token : *Tokens) {
+      Token.second = Batches[Token.first];
+      Any |= Token.second;
+    }
+    return Any;
+  }
+
+  void ClaimAll(const proto::VName &Claimant,
+                const std::vector<proto::VName> &VNames,
+                std::vector<bool> *Claimed) override {
+    std::lock_guard<std::mutex> Lock(Mutex);
+    std::vector<proto::VName> Unseen;
+    for (const auto &VName : VNames) {
+      if (Claims.find(ClaimKey(Claimant, VName)) == Claims.end()) {
+        Unseen.push_back(VName);
+      }
+    }
+    if (!Unseen.empty()) {
+      std::vector<bool> UnseenClaimed;
+      Client->ClaimAll(Claimant, Unseen, &UnseenClaimed);
+      for (size_t I = 0; I < Unseen.size(); ++I) {
+        Claims.emplace(ClaimKey(Claimant, Unseen[I]), UnseenClaimed[I]);
+      }
+    }
+    Claimed->clear();
+    for (const auto &VName : VNames) {
+      Claimed->push_back(Claims[ClaimKey(Claimant, VName)]);
+    }
+  }
+
+  void AssignClaim(const proto::VName &Claimable,
+                   const proto::VName &Claimant) override {
+    std::lock_guard<std::mutex> Lock(Mutex);
+    Client->AssignClaim(Claimable, Claimant);
+  }
+
+  Stats stats() const override {
+    std::lock_guard<std::mutex> Lock(Mutex);
+    return Client->stats();
+  }
+
+ private:
+  static std::string ClaimKey(const proto::VName &Claimant,
+                              const proto::VName &VName) {
+    std::string Key = Claimant.SerializeAsString();
+    Key.push_back('\0');
+    return Key + VName.SerializeAsString();
+  }
+
+  /// The client that decides claims.
+  KytheClaimClient *Client;
+  /// Guards the other fields and `Client`.
+  mutable std::mutex Mutex;
+  /// Claims made with `Claim` or `ClaimAll`, by `ClaimKey`.
+  std::unordered_map<std::string, bool> Claims;
+  /// Tokens claimed with `ClaimBatch`.
+  std::unordered_map<std::string, bool> Batches;
+};
+}  // anonymous namespace
+
+std::string IndexCompilationUnit(
+    const proto::CompilationUnit &Unit,
+    google::protobuf::RepeatedPtrField<proto::FileData> &Files,
+    const std::vector<MappedFile> &MappedFiles, KytheClaimClient &Client,
+    HashCache *Cache, KytheOutputStream &Output, const IndexerOptions &Options,
+    const MetadataSupports *MetaSupports,
+    std::function<std::unique_ptr<IndexerWorklist>(IndexerASTVisitor *)>
+        CreateWorklist) {
+  const unsigned Count = Options.DeclShards;
+  if (Count <= 1 || Options.CostProbe != nullptr) {
+    return IndexCompilationUnitShard(Unit, Files, MappedFiles, Client, Cache,
+                                     Output, Options, MetaSupports,
+                                     std::move(CreateWorklist), 0, 1);
+  }
+  ShardClaimClient ShardClient(&Client);
+  // Shards that add builtin headers or header maps to their files need
+  // copies of their own.
+  const bool AddsFiles =
+      DecodeHeaderSearchInformation(Unit, Options.SharedDetails) == nullptr ||
+      Options.UseIncludeResolutions;
+  std::vector<google::protobuf::RepeatedPtrField<proto::FileData>> FileCopies(
+      AddsFiles ? Count - 1 : 0);
+  for (auto &Copy : FileCopies) {
+    Copy.CopyFrom(Files);
+  }
+  std::vector<ReplayOutputStream> Outputs(Count - 1);
+  std::vector<UnitStats> Stats(Count - 1);
+  std::vector<std::string> Errors(Count);
+  std::vector<std::thread> Threads;
+  for (unsigned Index = 1; Index < Count; ++Index) {
+    Threads.emplace_back([&, Index] {
+      std::unique_ptr<MetadataSupports> ShardMetaSupports =
+          Options.MakeShardMetaSupports ? Options.MakeShardMetaSupports()
+                                        : llvm::make_unique<MetadataSupports>();
+      IndexerOptions ShardOptions = Options;
+      // Profiling events must nest, so only shard 0 reports them.
+      ShardOptions.ReportProfileEvent = nullptr;
+      ShardOptions.PreambleCache = nullptr;
+      // Shard 0 checks and records the fingerprints for the whole unit.
+      ShardOptions.HeaderFingerprints = nullptr;
+      ShardOptions.InstantiationFingerprints = nullptr;
+      ShardOptions.Stats = &Stats[Index - 1];
+      ShardOptions.Memory = nullptr;
+      ShardOptions.HotDecls = nullptr;
+      Errors[Index] = IndexCompilationUnitShard(
+          Unit, AddsFiles ? FileCopies[Index - 1] : Files, MappedFiles,
+          ShardClient, Cache, Outputs[Index - 1], ShardOptions,
+          ShardMetaSupports.get(), CreateWorklist, Index, Count);
+    });
+  }
+  Errors[0] = IndexCompilationUnitShard(Unit, Files, MappedFiles, ShardClient,
+                                        Cache, Output, Options, MetaSupports,
+                                        CreateWorklist, 0, Count);
+  for (auto &Thread : Threads) {
+    Thread.join();
+  }
+  {
+    ProfileBlock Block(Options.ReportProfileEvent, "replay_shards");
+    // Entries would be charged to whatever category shard 0 left behind.
+    EntryAccounting *Accounting = Output.accounting();
+    Output.set_accounting(nullptr);
+    for (auto &ShardOutput : Outputs) {
+      ShardOutput.ReplayOnto(&Output);
+    }
+    Output.set_accounting(Accounting);
+  }
+  if (Options.Stats != nullptr) {
+    for (const auto &ShardStats : Stats) {
+      Options.Stats->TraversedDecls += ShardStats.TraversedDecls;
+      Options.Stats->VFSMisses += ShardStats.VFSMisses;
+    }
+  }
+  for (const auto &Error : Errors) {
+    if (!Error.empty()) {
+      return Error;
+    }
+  }
   return "";
 }
 
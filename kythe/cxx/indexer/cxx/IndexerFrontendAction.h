@@ -28,17 +28,24 @@
 
 #include <functional>
 #include <memory>
+#include <mutex>
 #include <set>
 #include <string>
+#include <unordered_set>
 #include <utility>
+#include <vector>
 
+#include "clang/AST/ASTContext.h"
+#include "clang/Basic/TargetInfo.h"
 #include "clang/Frontend/CompilerInstance.h"
 #include "clang/Frontend/FrontendAction.h"
 #include "clang/Lex/HeaderSearch.h"
 #include "clang/Lex/Preprocessor.h"
+#include "clang/Sema/Sema.h"
 #include "clang/Tooling/Tooling.h"
 #include "glog/logging.h"
 #include "kythe/cxx/common/cxx_details.h"
+#include "kythe/cxx/common/indexing/MappedFileStore.h"
 #include "kythe/cxx/common/kythe_metadata_file.h"
 #include "llvm/ADT/StringRef.h"
 #include "llvm/ADT/Twine.h"
@@ -48,19 +55,66 @@
 #include "IndexerASTHooks.h"
 #include "IndexerPPCallbacks.h"
 #include "ProtoLibrarySupport.h"
+#include "hot_decl_profiler.h"
+#include "memory_breakdown.h"
+#include "unit_budget.h"
+#include "unit_cost_probe.h"
+#include "unit_teardown.h"
 
 namespace kythe {
 namespace proto {
 class CompilationUnit;
 class FileData;
 }  // namespace proto
+class EntryKindFilter;
 class KytheClaimClient;
 
+/// \brief Keeps what a `clang::CompilerInstance` built for a unit (its AST,
+/// Sema, preprocessor, source manager and so on) alive after the instance is
+/// gone, so that a `UnitTeardown` can destroy it off the indexing thread.
+///
+/// These objects are reference-counted without atomics. Only bury the
+/// remains once nothing else refers to them.
+class CompilerRemains : public UnitTeardown::Remains {
+ public:
+  /// \brief Takes `CI`'s AST consumer and Sema and shares the rest of its
+  /// state. Call from `FrontendAction::EndSourceFileAction`, before the
+  /// instance frees them.
+  void TakeFrom(clang::CompilerInstance &CI);
+
+  /// \brief Adds `Files` (which must be the last reference to it other than
+  /// the one taken from the instance) to the remains.
+  void Hold(llvm::IntrusiveRefCntPtr<clang::FileManager> Files);
+
+ private:
+  // Members are destroyed in reverse order: Sema first (it tells the
+  // consumer to forget it), then the consumer and its visitor, then the AST
+  // and everything the AST refers to.
+  llvm::IntrusiveRefCntPtr<clang::CompilerInvocation> Invocation;
+  llvm::IntrusiveRefCntPtr<clang::DiagnosticsEngine> Diagnostics;
+  llvm::IntrusiveRefCntPtr<clang::FileManager> Files;
+  llvm::IntrusiveRefCntPtr<clang::SourceManager> Sources;
+  llvm::IntrusiveRefCntPtr<clang::TargetInfo> Target;
+  std::shared_ptr<clang::Preprocessor> Preprocessor;
+  llvm::IntrusiveRefCntPtr<clang::ASTContext> Context;
+  std::unique_ptr<clang::ASTConsumer> Consumer;
+  std::unique_ptr<clang::Sema> Sema;
+};
+
 /// \brief Runs a given tool on a piece of code with a given assumed filename.
 /// \returns true on success, false on failure.
 bool RunToolOnCode(std::unique_ptr<clang::FrontendAction> tool_action,
                    llvm::Twine code, const std::string &filename);
 
+/// \brief A header map that resolves names the extractor found on a unit's
+/// angled or system search paths.
+struct HeaderMapFile {
+  /// The header map's path in the unit's virtual filesystem.
+  std::string Path;
+  /// The kind of the files it resolves to.
+  clang::SrcMgr::CharacteristicKind Kind;
+};
+
 // A FrontendAction that extracts information about a translation unit both
 // from its AST (using an ASTConsumer) and from preprocessing (with a
 // PPCallbacks implementation).
@@ -100,6 +154,44 @@ class IndexerFrontendAction : public clang::ASTFrontendAction {
   /// \param V Degree of verbosity.
   void setVerbosity(Verbosity V) { Verbosity = V; }
 
+  /// \param Skip the bodies of functions in unclaimed files?
+  /// \sa IndexerASTConsumer::setSkipUnclaimedFunctionBodies
+  void setSkipUnclaimedFunctionBodies(bool S) {
+    SkipUnclaimedFunctionBodies = S;
+  }
+
+  /// \param The unit's resource budget, or null if it has none.
+  /// \sa IndexerASTVisitor::setBudget
+  void setBudget(UnitBudgetMonitor *B) { Budget = B; }
+  /// \param Where to store the number of declarations traversed, or null.
+  /// \sa IndexerASTConsumer::setTraversedDeclCount
+  void setTraversedDeclCount(uint64_t *D) { TraversedDeclCount = D; }
+  /// \param Where to account for the unit's memory, or null.
+  /// \sa IndexerASTConsumer::setMemoryBreakdown
+  void setMemoryBreakdown(MemoryBreakdown *M) { Memory = M; }
+  /// \param Where to charge declarations' costs, or null.
+  /// \sa IndexerASTConsumer::setHotDeclProfiler
+  void setHotDeclProfiler(HotDeclProfiler *P) { HotDecls = P; }
+  /// \param Where to keep the unit's AST when the action ends, or null to let
+  /// the compiler instance free it.
+  void setRemains(CompilerRemains *R) { Remains = R; }
+  /// \param Header maps to search ahead of the angled search paths. They are
+  /// only used along with the unit's HeaderSearchInfo.
+  void setHeaderMaps(std::vector<HeaderMapFile> M) {
+    HeaderMaps = std::move(M);
+  }
+  /// \param Where to store the costs of the unit, or null to index it. If
+  /// set, the unit is only preprocessed.
+  /// \sa RunCostProbe
+  void setCostProbe(UnitCostProbe *P) { CostProbe = P; }
+  /// \param The shard of the unit's top-level declarations to index, and
+  /// the number of shards.
+  /// \sa IndexerASTVisitor::setDeclShard
+  void setDeclShard(unsigned Index, unsigned Count) {
+    DeclShardIndex = Index;
+    DeclShardCount = Count;
+  }
+
  private:
   std::unique_ptr<clang::ASTConsumer> CreateASTConsumer(
       clang::CompilerInstance &CI, llvm::StringRef Filename) override {
@@ -127,6 +219,20 @@ class IndexerFrontendAction : public clang::ASTFrontendAction {
           }
         }
       }
+      // Every lookup that could have found a mapped name on the angled or
+      // system paths passes the first of them, so the maps go there.
+      std::vector<clang::DirectoryLookup> Maps;
+      for (const auto &Map : HeaderMaps) {
+        if (const clang::FileEntry *MapFile = FileManager.getFile(Map.Path)) {
+          if (const clang::HeaderMap *HM =
+                  HeaderSearch.CreateHeaderMap(MapFile)) {
+            Maps.push_back(clang::DirectoryLookup(HM, Map.Kind, false));
+          }
+        }
+      }
+      Lookups.insert(Lookups.begin() + HeaderConfig.angled_dir_idx,
+                     Maps.begin(), Maps.end());
+      HeaderConfig.system_dir_idx += Maps.size();
       HeaderSearch.ClearFileInfo();
       HeaderSearch.SetSearchPaths(Lookups, HeaderConfig.angled_dir_idx,
                                   HeaderConfig.system_dir_idx, false);
@@ -137,9 +243,19 @@ class IndexerFrontendAction : public clang::ASTFrontendAction {
       Observer->setLangOptions(&CI.getLangOpts());
       Observer->setPreprocessor(&CI.getPreprocessor());
     }
-    return llvm::make_unique<IndexerASTConsumer>(
+    auto Consumer = llvm::make_unique<IndexerASTConsumer>(
         Observer, IgnoreUnimplemented, TemplateMode, Verbosity, Supports,
         ShouldStopIndexing, CreateWorklist);
+    if (SkipUnclaimedFunctionBodies) {
+      CI.getFrontendOpts().SkipFunctionBodies = true;
+      Consumer->setSkipUnclaimedFunctionBodies(true);
+    }
+    Consumer->setBudget(Budget);
+    Consumer->setTraversedDeclCount(TraversedDeclCount);
+    Consumer->setMemoryBreakdown(Memory);
+    Consumer->setHotDeclProfiler(HotDecls);
+    Consumer->setDeclShard(DeclShardIndex, DeclShardCount);
+    return std::move(Consumer);
   }
 
   bool BeginSourceFileAction(clang::CompilerInstance &CI,
@@ -153,6 +269,19 @@ class IndexerFrontendAction : public clang::ASTFrontendAction {
     return true;
   }
 
+  void ExecuteAction() override {
+    if (CostProbe != nullptr) {
+      RunCostProbe(getCompilerInstance(), *Observer, CostProbe);
+      return;
+    }
+    clang::ASTFrontendAction::ExecuteAction();
+  }
+
+  void EndSourceFileAction() override {
+    if (Remains != nullptr) {
+      Remains->TakeFrom(getCompilerInstance());
+    }
+  }
   bool usesPreprocessorOnly() const override { return false; }
 
   /// The `GraphObserver` used for reporting information.
@@ -163,10 +292,30 @@ class IndexerFrontendAction : public clang::ASTFrontendAction {
   BehaviorOnTemplates TemplateMode = BehaviorOnTemplates::VisitInstantiations;
   /// Whether to emit all data.
   enum Verbosity Verbosity = kythe::Verbosity::Classic;
+  /// Whether to skip function bodies in unclaimed files.
+  bool SkipUnclaimedFunctionBodies = false;
+  /// The unit's resource budget, or null if it has none.
+  UnitBudgetMonitor *Budget = nullptr;
+  /// Where to store the number of declarations traversed, or null.
+  uint64_t *TraversedDeclCount = nullptr;
+  /// Where to account for the unit's memory, or null.
+  MemoryBreakdown *Memory = nullptr;
+  /// Where to charge declarations' costs, or null.
+  HotDeclProfiler *HotDecls = nullptr;
+  /// Where to keep the unit's AST, or null.
+  CompilerRemains *Remains = nullptr;
+  /// Where to store the unit's costs instead of indexing it, or null.
+  UnitCostProbe *CostProbe = nullptr;
+  /// The shard of the unit's top-level declarations to index.
+  unsigned DeclShardIndex = 0;
+  /// The number of shards the unit is split into.
+  unsigned DeclShardCount = 1;
   /// Configuration information for header search.
   HeaderSearchInfo HeaderConfig;
   /// Whether to use HeaderConfig.
   bool HeaderConfigValid;
+  /// Header maps to search ahead of HeaderConfig's angled paths.
+  std::vector<HeaderMapFile> HeaderMaps;
   /// Library-specific callbacks.
   LibrarySupports Supports;
   /// \return true if indexing should be cancelled.
@@ -213,6 +362,59 @@ class StdinAdjustSingleFrontendActionFactory
   clang::FrontendAction *create() override { return Action.release(); }
 };
 
+/// \brief Identifies the headers that a unit's translation shares with other
+/// units.
+///
+/// Two units have the same key iff they have the same arguments (ignoring
+/// their source files), working directory and starting preprocessor context,
+/// and they require the same headers (by digest and in the same order) with
+/// the same preprocessor context tables. Units with the same key would parse
+/// their headers identically, so they could share a precompiled preamble.
+/// \return a base64-encoded SHA-256 digest of `Unit`'s header configuration.
+std::string ComputePreambleKey(const proto::CompilationUnit &Unit);
+
+/// \brief Adjusts `Args`, a unit's compiler arguments (starting with the
+/// driver's name), for indexing rather than compiling.
+///
+/// Warning flags from the original build are removed (the indexer passes -w
+/// anyway), and diagnostics are told to skip carets, fix-its, colors and long
+/// backtraces. Typo correction is turned off: it only affects code with
+/// errors, where it's one of the most expensive things clang does. Nothing
+/// that changes how the unit is preprocessed or parsed is touched.
+void ApplyIndexingProfile(std::vector<std::string> *Args);
+
+/// \brief Counts how many units could have reused another unit's preamble.
+///
+/// Safe to share among threads.
+class PreambleKeyCache {
+ public:
+  /// \brief Remembers `Key`.
+  /// \return true if `Key` was remembered before.
+  bool Record(const std::string &Key);
+
+  /// \return the number of keys recorded more than once.
+  size_t hits() const;
+
+  /// \return the number of distinct keys recorded.
+  size_t misses() const;
+
+ private:
+  mutable std::mutex Mutex;
+  /// Every key passed to `Record`.
+  std::unordered_set<std::string> Keys;
+  /// The number of calls to `Record` that returned true.
+  size_t Hits = 0;
+};
+
+/// \brief Counters that `IndexCompilationUnit` fills in for a single unit.
+struct UnitStats {
+  /// \brief The number of declarations the indexer traversed.
+  uint64_t TraversedDecls = 0;
+  /// \brief The number of lookups of paths that weren't among the unit's
+  /// files (mostly header search probes).
+  uint64_t VFSMisses = 0;
+};
+
 /// \brief Options that control how the indexer behaves.
 struct IndexerOptions {
   /// \brief The directory to normalize paths against. Must be absolute.
@@ -227,23 +429,132 @@ struct IndexerOptions {
   enum Verbosity Verbosity = kythe::Verbosity::Classic;
   /// \brief Whether to allow access to the raw filesystem.
   bool AllowFSAccess = false;
+  /// \brief If not empty, an absolute path to a directory where units built
+  /// with modules keep the modules Clang builds for them implicitly, so that
+  /// later units can reuse them. Declarations that come from these modules
+  /// aren't indexed by the units that import them.
+  std::string ModuleCachePath;
+  /// \brief Whether to resolve includes that the extractor found on the
+  /// angled or system search paths with header maps, rather than searching
+  /// for them again.
+  bool UseIncludeResolutions = false;
   /// \brief Whether to drop data found to be template instantiation
   /// independent.
   bool DropInstantiationIndependentData = false;
+  /// \brief If nonzero, remember the nodes that have been written by 64- or
+  /// 128-bit fingerprints rather than by name.
+  unsigned DedupFingerprintBits = 0;
+  /// \brief If nonzero, forget which anchor ranges have been written once
+  /// this many are remembered, writing repeats again rather than letting the
+  /// set grow with the unit.
+  size_t RangeDedupLimit = 0;
   /// \brief A function that is called as the indexer enters and exits various
-  /// phases of execution (in strict LIFO order).
-  ProfilingCallback ReportProfileEvent = [](const char *, ProfilingEvent) {};
+  /// phases of execution (in strict LIFO order). Empty if profiling is off.
+  ProfilingCallback ReportProfileEvent;
   /// \brief A callback to determine whether to cancel indexing as quickly
   /// as possible.
   /// \return true if indexing should be cancelled.
   std::function<bool()> ShouldStopIndexing = [] { return false; };
+  /// \brief If not null, records each unit's `ComputePreambleKey` and reports
+  /// a "preamble_cache" hit or miss to `ReportProfileEvent`.
+  PreambleKeyCache *PreambleCache = nullptr;
+  /// \brief If not null, header search information for units whose C++
+  /// details are shared (see `CxxSharedDetailsRef`). Units that refer to
+  /// details missing from the cache are indexed without header search
+  /// information.
+  SharedCxxDetailsCache *SharedDetails = nullptr;
+  /// \brief If not null, the fingerprints of headers indexed by earlier runs.
+  /// Headers with recorded fingerprints are skipped; the fingerprints of the
+  /// other headers are added once the unit has been indexed without errors.
+  HashCache *HeaderFingerprints = nullptr;
+  /// \brief If not null, the fingerprints of implicit template instantiations
+  /// indexed by earlier runs. Instantiations with recorded fingerprints aren't
+  /// traversed; the fingerprints of the others are added once the unit has
+  /// been indexed without errors.
+  HashCache *InstantiationFingerprints = nullptr;
+  /// \brief If nonzero, index at most this many distinct implicit
+  /// instantiations of each primary template. The others only get their
+  /// nodes and their edges to the template.
+  size_t InstantiationSampleLimit = 0;
+  /// \brief If not null, selects kinds of entries to drop before they are
+  /// serialized.
+  const EntryKindFilter *EntryFilter = nullptr;
+  /// \brief If not null, destroys each unit's AST on a background thread
+  /// while the caller moves on.
+  UnitTeardown *Teardown = nullptr;
+  /// \brief Whether to drop entries that are exact duplicates of entries the
+  /// unit has already recorded.
+  bool DedupEntries = false;
+  /// \brief Whether to claim every required input in one batch before
+  /// parsing, rather than claiming each file as it is entered.
+  bool PrefetchClaims = false;
+  /// \brief Whether to claim files by their content digests (see
+  /// `ContentClaimable`) rather than their VNames, so that identical files
+  /// at different paths are indexed once.
+  bool ClaimByContent = false;
+  /// \brief Whether to skip parsing the bodies of non-template functions in
+  /// files that the unit doesn't claim.
+  bool SkipUnclaimedFunctionBodies = false;
+  /// \brief Whether to index only the unit's main source file, leaving the
+  /// files it includes unclaimed (and skipping their function bodies). For
+  /// reindexing a unit after an edit when its headers are already indexed.
+  /// \sa KytheGraphObserver::set_main_file_only
+  bool MainFileOnly = false;
+  /// \brief Whether to group output entries by the file they belong to.
+  /// \sa KytheGraphObserver::set_group_entries_by_file
+  bool GroupEntriesByFile = false;
+  /// \brief Whether to run clang with `ApplyIndexingProfile`.
+  bool IndexingProfile = false;
+  /// \brief If not null, only preprocess the unit, filling this in instead
+  /// of indexing. Entries for files and macros are still emitted, and files
+  /// are still claimed, so use a claim client and output stream that don't
+  /// keep them.
+  UnitCostProbe *CostProbe = nullptr;
+  /// \brief Limits on the time and memory each unit may use. A unit that
+  /// passes a soft limit is finished at `Verbosity::Lite` without template
+  /// instantiations; one that passes a hard limit stops early. Either way,
+  /// a diagnostic node tagged on the main source file explains why.
+  UnitBudget Budget;
+  /// \brief Whether each unit emits the builtin and meta nodes it uses. If
+  /// false, the caller must emit them with
+  /// `KytheGraphObserver::EmitBuiltinNodes` once per output stream.
+  bool EmitBuiltinsPerUnit = true;
+  /// \brief If not null, filled in with counters for the unit being
+  /// indexed. Only useful when the options are used for one unit at a time.
+  UnitStats *Stats = nullptr;
+  /// \brief If not null, each subsystem's memory is accounted for here as
+  /// the unit is indexed; see `MemoryBreakdown`. Only useful when the
+  /// options are used for one unit at a time.
+  MemoryBreakdown *Memory = nullptr;
+  /// \brief If not null, the time and entries spent on each top-level
+  /// declaration are charged here, and the hottest are described once the
+  /// unit has been traversed. Its entry counter is set to count the unit's
+  /// entries. Only useful when the options are used for one unit at a time.
+  HotDeclProfiler *HotDecls = nullptr;
+  /// \brief If greater than 1, the unit's top-level declarations are split
+  /// into this many shards (see `DeclsOutsideShard`), each indexed from its
+  /// own parse of the unit on its own thread with its own observer. Shard 0
+  /// writes straight to the output; the others are held in memory and
+  /// written after it, in order, so the output doesn't depend on which
+  /// shard finishes first. The shards agree on claims, but each repeats the
+  /// entries for the unit's files and macros. Profiling events, entry
+  /// accounting, the memory breakdown and hot declarations only cover shard
+  /// 0. Ignored for cost probes.
+  unsigned DeclShards = 1;
+  /// \brief Makes the metadata supports for shards other than 0, which
+  /// can't share the ones passed to `IndexCompilationUnit`. If empty, those
+  /// shards don't apply metadata files.
+  std::function<std::unique_ptr<MetadataSupports>()> MakeShardMetaSupports;
 };
 
 /// \brief Indexes `Unit`, reading from `Files` in the assumed and writing
 /// entries to `Output`.
 /// \param Unit The CompilationUnit to index
-/// \param Files A vector of files to read from. May be modified if the Unit
-/// does not contain a proper header search table.
+/// \param Files The files to read from. May be added to if the Unit does not
+/// contain a proper header search table; new files are allocated on `Files`'
+/// arena, if it has one.
+/// \param MappedFiles Additional files to read from whose content is held
+/// outside of a `FileData`.
 /// \param ClaimClient The claim client to use.
 /// \param Cache The hash cache to use, or nullptr if none.
 /// \param Output The output stream to use.
@@ -253,9 +564,11 @@ struct IndexerOptions {
 /// visitor.
 /// \return empty if OK; otherwise, an error description.
 std::string IndexCompilationUnit(
-    const proto::CompilationUnit &Unit, std::vector<proto::FileData> &Files,
-    KytheClaimClient &ClaimClient, HashCache *Cache, KytheOutputStream &Output,
-    const IndexerOptions &Options, const MetadataSupports *MetaSupports,
+    const proto::CompilationUnit &Unit,
+    google::protobuf::RepeatedPtrField<proto::FileData> &Files,
+    const std::vector<MappedFile> &MappedFiles, KytheClaimClient &ClaimClient,
+    HashCache *Cache, KytheOutputStream &Output, const IndexerOptions &Options,
+    const MetadataSupports *MetaSupports,
     std::function<std::unique_ptr<IndexerWorklist>(IndexerASTVisitor *)>
         CreateWorklist);
 
@@ -0,0 +1,186 @@
+/*
+ * Copyright 2017 Google Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// This file uses the Clang style conventions.
+
+#include "IndexerLibrarySupport.h"
+
+#include <algorithm>
+
+#include "clang/AST/DeclCXX.h"
+
+namespace kythe {
+namespace {
+
+/// \brief Returns the identifier naming `Decl`, or an empty string for decls
+/// (like constructors and operators) that aren't named by an identifier.
+llvm::StringRef GetIdentifierName(const clang::NamedDecl *Decl) {
+  if (const auto *Identifier = Decl->getIdentifier()) {
+    return Identifier->getName();
+  }
+  return llvm::StringRef();
+}
+
+/// \brief Sorts and deduplicates `Found` so plugins run in the order they
+/// were registered.
+void SortPlugins(llvm::SmallVectorImpl<size_t> *Found) {
+  std::sort(Found->begin(), Found->end());
+  Found->erase(std::unique(Found->begin(), Found->end()), Found->end());
+}
+
+}  // anonymous namespace
+
+LibrarySupportIndex::LibrarySupportIndex(const LibrarySupports &Supports,
+                                         const ProfilingCallback &Report)
+    : Report(Report) {
+  for (const auto &Support : Supports) {
+    size_t Index = Plugins.size();
+    Plugins.push_back(Plugin{Support.get(), Support->getInterests()});
+    const LibraryInterests &Interests = Plugins.back().Interests;
+    if (Interests.Variables || Interests.DeclRefs) {
+      if (!Interests.DeclNamePrefixes.empty()) {
+        for (const auto &Prefix : Interests.DeclNamePrefixes) {
+          DeclsByPrefix[Prefix].push_back(Index);
+          PrefixLengths.push_back(Prefix.size());
+        }
+      } else if (!Interests.DeclKinds.empty()) {
+        for (auto Kind : Interests.DeclKinds) {
+          DeclsByKind[Kind].push_back(Index);
+        }
+      } else {
+        AnyDecl.push_back(Index);
+      }
+    }
+    if (Interests.Calls) {
+      if (!Interests.CalleeNames.empty()) {
+        for (const auto &Name : Interests.CalleeNames) {
+          CallsByName[Name].push_back(Index);
+        }
+      } else {
+        AnyCallee.push_back(Index);
+      }
+    }
+  }
+  std::sort(PrefixLengths.begin(), PrefixLengths.end());
+  PrefixLengths.erase(std::unique(PrefixLengths.begin(), PrefixLengths.end()),
+                      PrefixLengths.end());
+}
+
+void LibrarySupportIndex::FindDeclPlugins(const clang::NamedDecl *Decl,
+                                          PluginList *Found) const {
+  Found->append(AnyDecl.begin(), AnyDecl.end());
+  auto ByKind = DeclsByKind.find(Decl->getKind());
+  if (ByKind != DeclsByKind.end()) {
+    Found->append(ByKind->second.begin(), ByKind->second.end());
+  }
+  if (!PrefixLengths.empty()) {
+    llvm::StringRef Name = GetIdentifierName(Decl);
+    for (size_t Length : PrefixLengths) {
+      if (Length > Name.size()) {
+        break;
+      }
+      auto ByPrefix = DeclsByPrefix.find(Name.substr(0, Length));
+      if (ByPrefix != DeclsByPrefix.end()) {
+        Found->append(ByPrefix->second.begin(), ByPrefix->second.end());
+      }
+    }
+  }
+  // Plugins indexed by name prefix may also restrict the kind.
+  Found->erase(std::remove_if(Found->begin(), Found->end(),
+                              [this, Decl](size_t Index) {
+                                const auto &Kinds =
+                                    Plugins[Index].Interests.DeclKinds;
+                                return !Kinds.empty() &&
+                                       std::find(Kinds.begin(), Kinds.end(),
+                                                 Decl->getKind()) ==
+                                           Kinds.end();
+                              }),
+               Found->end());
+  SortPlugins(Found);
+}
+
+void LibrarySupportIndex::FindCallPlugins(const clang::Decl *Callee,
+                                          PluginList *Found) const {
+  Found->append(AnyCallee.begin(), AnyCallee.end());
+  if (CallsByName.empty()) {
+    return;
+  }
+  auto AddByName = [this, Found](llvm::StringRef Name) {
+    if (Name.empty()) {
+      return;
+    }
+    auto ByName = CallsByName.find(Name);
+    if (ByName != CallsByName.end()) {
+      Found->append(ByName->second.begin(), ByName->second.end());
+    }
+  };
+  if (const auto *Named = llvm::dyn_cast_or_null<clang::NamedDecl>(Callee)) {
+    AddByName(GetIdentifierName(Named));
+  }
+  if (const auto *Method =
+          llvm::dyn_cast_or_null<clang::CXXMethodDecl>(Callee)) {
+    AddByName(GetIdentifierName(Method->getParent()));
+  }
+  SortPlugins(Found);
+}
+
+void LibrarySupportIndex::InspectVariable(
+    IndexerASTVisitor &V, GraphObserver::NodeId &DeclNodeId,
+    GraphObserver::NodeId &DeclBodyNodeId, const clang::VarDecl *Decl,
+    GraphObserver::Completeness Compl,
+    const std::vector<LibrarySupport::Completion> &Compls) {
+  PluginList Found;
+  FindDeclPlugins(Decl, &Found);
+  for (size_t Index : Found) {
+    const Plugin &P = Plugins[Index];
+    if (P.Interests.Variables) {
+      ProfileBlock Block(Report, P.Interests.ProfileLabel);
+      P.Support->InspectVariable(V, DeclNodeId, DeclBodyNodeId, Decl, Compl,
+                                 Compls);
+    }
+  }
+}
+
+void LibrarySupportIndex::InspectDeclRef(IndexerASTVisitor &V,
+                                         clang::SourceLocation DeclRefLocation,
+                                         const GraphObserver::Range &Ref,
+                                         GraphObserver::NodeId &RefId,
+                                         const clang::NamedDecl *TargetDecl) {
+  PluginList Found;
+  FindDeclPlugins(TargetDecl, &Found);
+  for (size_t Index : Found) {
+    const Plugin &P = Plugins[Index];
+    if (P.Interests.DeclRefs) {
+      ProfileBlock Block(Report, P.Interests.ProfileLabel);
+      P.Support->InspectDeclRef(V, DeclRefLocation, Ref, RefId, TargetDecl);
+    }
+  }
+}
+
+void LibrarySupportIndex::InspectCallExpr(IndexerASTVisitor &V,
+                                          const clang::CallExpr *CallExpr,
+                                          const GraphObserver::Range &Range,
+                                          GraphObserver::NodeId &CalleeId) {
+  PluginList Found;
+  FindCallPlugins(CallExpr->getCalleeDecl(), &Found);
+  for (size_t Index : Found) {
+    const Plugin &P = Plugins[Index];
+    ProfileBlock Block(Report, P.Interests.ProfileLabel);
+    P.Support->InspectCallExpr(V, CallExpr, Range, CalleeId);
+  }
+}
+
+}  // namespace kythe
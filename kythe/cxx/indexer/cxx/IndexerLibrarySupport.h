@@ -19,8 +19,14 @@
 #ifndef KYTHE_CXX_INDEXER_CXX_INDEXER_LIBRARY_SUPPORT_H_
 #define KYTHE_CXX_INDEXER_CXX_INDEXER_LIBRARY_SUPPORT_H_
 
+#include <string>
+#include <vector>
+
 #include "clang/AST/Decl.h"
 #include "clang/AST/Expr.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/ADT/StringMap.h"
 
 #include "kythe/cxx/common/indexing/KytheGraphRecorder.h"
 
@@ -30,6 +36,31 @@ namespace kythe {
 
 class IndexerASTVisitor;
 
+/// \brief The AST nodes a `LibrarySupport` wants to inspect.
+///
+/// The indexer indexes its plugins by these, so a plugin's hooks are only
+/// called for nodes it might care about. The defaults match everything.
+struct LibraryInterests {
+  /// Whether to call `InspectVariable`.
+  bool Variables = true;
+  /// Whether to call `InspectDeclRef`.
+  bool DeclRefs = true;
+  /// Whether to call `InspectCallExpr`.
+  bool Calls = true;
+  /// The kinds of the decls passed to `InspectVariable` and `InspectDeclRef`,
+  /// or empty for any kind.
+  std::vector<clang::Decl::Kind> DeclKinds;
+  /// Prefixes of the unqualified names of the decls passed to
+  /// `InspectVariable` and `InspectDeclRef`, or empty for any name.
+  std::vector<std::string> DeclNamePrefixes;
+  /// Names of the callees passed to `InspectCallExpr`, or empty for any
+  /// callee. A method also matches on the name of its class, since some
+  /// methods (like conversion operators) don't have a name of their own.
+  std::vector<std::string> CalleeNames;
+  /// The label under which the plugin's time is reported to the profiler.
+  const char *ProfileLabel = "library_support";
+};
+
 /// \brief A plugin for the IndexerASTVisitor for emitting library-specific
 /// nodes.
 ///
@@ -40,6 +71,10 @@ class LibrarySupport {
  public:
   virtual ~LibrarySupport() {}
 
+  /// \brief Returns the nodes this plugin's hooks should be called for.
+  /// Called once, before any of the hooks.
+  virtual LibraryInterests getInterests() const { return LibraryInterests(); }
+
   /// \brief A single completed declaration (in the Kythe `completes` sense).
   struct Completion {
     /// The Decl being completed.
@@ -97,6 +132,70 @@ class LibrarySupport {
 /// \brief A collection of library support implementations.
 using LibrarySupports = std::vector<std::unique_ptr<LibrarySupport>>;
 
+/// \brief Calls the `LibrarySupport` hooks interested in each AST node.
+///
+/// Plugins are indexed by decl kind, name prefix and callee name, so finding
+/// the plugins that care about a node takes a few hash lookups and unrelated
+/// nodes never reach a plugin. Plugins are called in the order they appear in
+/// `LibrarySupports`, and the time each takes is reported to the profiler
+/// under its `ProfileLabel`.
+class LibrarySupportIndex {
+ public:
+  /// \param Supports the plugins to dispatch to, which must outlive the index.
+  /// \param Report the profiler callback, which must outlive the index.
+  LibrarySupportIndex(const LibrarySupports &Supports,
+                      const ProfilingCallback &Report);
+
+  /// \copydoc LibrarySupport::InspectVariable
+  void InspectVariable(IndexerASTVisitor &V, GraphObserver::NodeId &DeclNodeId,
+                       GraphObserver::NodeId &DeclBodyNodeId,
+                       const clang::VarDecl *Decl,
+                       GraphObserver::Completeness Compl,
+                       const std::vector<LibrarySupport::Completion> &Compls);
+
+  /// \copydoc LibrarySupport::InspectDeclRef
+  void InspectDeclRef(IndexerASTVisitor &V,
+                      clang::SourceLocation DeclRefLocation,
+                      const GraphObserver::Range &Ref,
+                      GraphObserver::NodeId &RefId,
+                      const clang::NamedDecl *TargetDecl);
+
+  /// \copydoc LibrarySupport::InspectCallExpr
+  void InspectCallExpr(IndexerASTVisitor &V, const clang::CallExpr *CallExpr,
+                       const GraphObserver::Range &Range,
+                       GraphObserver::NodeId &CalleeId);
+
+ private:
+  struct Plugin {
+    LibrarySupport *Support;
+    LibraryInterests Interests;
+  };
+
+  /// Indices into `Plugins`, in increasing order.
+  using PluginList = llvm::SmallVector<size_t, 4>;
+
+  /// \brief Finds the plugins interested in `Decl`.
+  void FindDeclPlugins(const clang::NamedDecl *Decl, PluginList *Found) const;
+
+  /// \brief Finds the plugins interested in a call to `Callee`.
+  void FindCallPlugins(const clang::Decl *Callee, PluginList *Found) const;
+
+  std::vector<Plugin> Plugins;
+  /// Plugins interested in decls whatever their kind or name.
+  PluginList AnyDecl;
+  /// Plugins interested in decls of a given kind, whatever their name.
+  llvm::DenseMap<unsigned, PluginList> DeclsByKind;
+  /// Plugins interested in decls whose names start with a given prefix.
+  llvm::StringMap<PluginList> DeclsByPrefix;
+  /// The distinct lengths of the keys in `DeclsByPrefix`.
+  std::vector<size_t> PrefixLengths;
+  /// Plugins interested in every call.
+  PluginList AnyCallee;
+  /// Plugins interested in calls to callees with a given name.
+  llvm::StringMap<PluginList> CallsByName;
+  const ProfilingCallback &Report;
+};
+
 }  // namespace kythe
 
 #endif  // KYTHE_CXX_INDEXER_CXX_INDEXER_LIBRARY_SUPPORT_H_
@@ -23,6 +23,7 @@
 #include "clang/Basic/SourceManager.h"
 #include "clang/Lex/PPCallbacks.h"
 #include "clang/Lex/Preprocessor.h"
+#include "gflags/gflags.h"
 #include "glog/logging.h"
 #include "kythe/cxx/common/path_utils.h"
 #include "llvm/Support/Debug.h"
@@ -42,6 +43,13 @@
 // able to hook these locations to the macros that generate them, allowing us
 // to insert edges for token pastes.
 
+DEFINE_bool(experimental_coalesce_macro_expansions, false,
+            "Record each macro's indirect expansions at a given expansion "
+            "site only once.");
+DEFINE_int32(experimental_max_indirect_expansion_depth, 0,
+             "Don't record indirect macro expansions nested more deeply than "
+             "this (0 for no limit).");
+
 namespace kythe {
 
 IndexerPPCallbacks::IndexerPPCallbacks(clang::Preprocessor &PP,
@@ -162,7 +170,6 @@ void IndexerPPCallbacks::MacroExpands(const clang::Token &Token,
   }
 
   const clang::MacroInfo &Info = *Macro.getMacroInfo();
-  GraphObserver::NodeId MacroId = BuildNodeIdForMacro(Token, Info);
   if (!Range.getBegin().isFileID() || !Range.getEnd().isFileID()) {
     if (Verbosity) {
       auto NewBegin =
@@ -170,6 +177,26 @@ void IndexerPPCallbacks::MacroExpands(const clang::Token &Token,
       if (!NewBegin.isFileID()) {
         return;
       }
+      if (FLAGS_experimental_max_indirect_expansion_depth > 0 &&
+          ExpansionDepth(Range.getBegin()) >
+              static_cast<unsigned>(
+                  FLAGS_experimental_max_indirect_expansion_depth)) {
+        ReportProfilingEvent(Observer.getProfilingCallback(),
+                             "capped_macro_expansion", ProfilingEvent::Hit);
+        return;
+      }
+      if (FLAGS_experimental_coalesce_macro_expansions) {
+        bool Inserted =
+            IndirectExpansions.insert({NewBegin.getRawEncoding(), &Info})
+                .second;
+        ReportProfilingEvent(
+            Observer.getProfilingCallback(), "coalesced_macro_expansion",
+            Inserted ? ProfilingEvent::Miss : ProfilingEvent::Hit);
+        if (!Inserted) {
+          return;
+        }
+      }
+      GraphObserver::NodeId MacroId = BuildNodeIdForMacro(Token, Info);
       Range = clang::SourceRange(
           NewBegin,
           clang::Lexer::getLocForEndOfToken(
@@ -182,11 +209,22 @@ void IndexerPPCallbacks::MacroExpands(const clang::Token &Token,
                                             MacroId);
     }
   } else {
-    Observer.recordExpandsRange(RangeForTokenInCurrentContext(Token), MacroId);
+    Observer.recordExpandsRange(RangeForTokenInCurrentContext(Token),
+                                BuildNodeIdForMacro(Token, Info));
   }
   // TODO(zarko): Index macro arguments.
 }
 
+unsigned IndexerPPCallbacks::ExpansionDepth(clang::SourceLocation Loc) {
+  const auto &SM = *Observer.getSourceManager();
+  unsigned Depth = 0;
+  while (Loc.isMacroID()) {
+    Loc = SM.getImmediateExpansionRange(Loc).first;
+    ++Depth;
+  }
+  return Depth;
+}
+
 void IndexerPPCallbacks::Defined(const clang::Token &MacroName,
                                  const clang::MacroDefinition &Macro,
                                  clang::SourceRange Range) {
@@ -22,6 +22,7 @@
 #include "clang/Basic/SourceManager.h"
 #include "clang/Lex/PPCallbacks.h"
 #include "clang/Lex/Token.h"
+#include "llvm/ADT/DenseSet.h"
 
 #include "GraphObserver.h"
 #include "IndexerASTHooks.h"
@@ -102,6 +103,16 @@ class IndexerPPCallbacks : public clang::PPCallbacks {
   /// \brief Keeps track of all DeferredRecords we've made.
   std::vector<DeferredRecord> DeferredRecords;
 
+  /// \return the number of macro expansions `Loc` is nested in (for a
+  /// location in a top-level macro expansion, 1).
+  unsigned ExpansionDepth(clang::SourceLocation Loc);
+
+  /// \brief The (raw expansion site, macro) pairs for which an indirect
+  /// expansion has been recorded, if
+  /// --experimental_coalesce_macro_expansions is set.
+  llvm::DenseSet<std::pair<unsigned, const clang::MacroInfo *>>
+      IndirectExpansions;
+
   /// \brief Returns `SR` as a `Range` in the `IndexerPPCallbacks`'s current
   /// RangeContext.
   GraphObserver::Range RangeInCurrentContext(const clang::SourceRange &SR) {
@@ -36,6 +36,7 @@
 #include "clang/AST/Type.h"
 #include "clang/AST/TypeLoc.h"
 #include "clang/Basic/SourceManager.h"
+#include "llvm/ADT/StringMap.h"
 #include "kythe/cxx/common/indexing/KytheGraphRecorder.h"
 #include "kythe/cxx/common/language.h"
 #include "kythe/cxx/common/path_utils.h"
@@ -78,10 +79,18 @@ static const char *FunctionSubkindToString(
   return "invalid-fn-subkind";
 }
 
-kythe::proto::VName KytheGraphObserver::VNameFromFileEntry(
+const kythe::proto::VName &KytheGraphObserver::VNameFromFileEntry(
     const clang::FileEntry *file_entry) {
-  kythe::proto::VName out_name;
-  if (!vfs_->get_vname(file_entry, &out_name)) {
+  auto inserted = file_entry_vnames_.insert({file_entry, nullptr});
+  if (!inserted.second) {
+    return *inserted.first->second;
+  }
+  file_entry_vname_storage_.emplace_back();
+  kythe::proto::VName &out_name = file_entry_vname_storage_.back();
+  inserted.first->second = &out_name;
+  if (const auto *vname = vfs_->get_vname(file_entry)) {
+    out_name.CopyFrom(*vname);
+  } else {
     llvm::StringRef working_directory = vfs_->working_directory();
     llvm::StringRef file_name(file_entry->getName());
     if (file_name.startswith(working_directory)) {
@@ -144,7 +153,7 @@ void KytheGraphObserver::AppendFullLocationToStream(
     }
     posted_fileids->push_back(file_id);
     if (file_entry) {
-      kythe::proto::VName file_vname(VNameFromFileEntry(file_entry));
+      const kythe::proto::VName &file_vname = VNameFromFileEntry(file_entry);
       if (!file_vname.corpus().empty()) {
         Ostream << file_vname.corpus() << "/";
       }
@@ -174,88 +183,73 @@ void KytheGraphObserver::AppendRangeToStream(llvm::raw_ostream &Ostream,
                                Ostream);
   }
   if (Range.Kind == GraphObserver::Range::RangeKind::Wraith) {
-    Ostream << Range.Context.ToClaimedString();
-  }
-}
-
-/// \brief Attempt to associate a `SourceLocation` with a `FileEntry` by
-/// searching through the location's macro expansion history.
-/// \param loc The location to associate. Any `SourceLocation` is acceptable.
-/// \param source_manager The `SourceManager` that generated `loc`.
-/// \return a `FileEntry` if one was found, null otherwise.
-static const clang::FileEntry *SearchForFileEntry(
-    clang::SourceLocation loc, clang::SourceManager *source_manager) {
-  clang::FileID file_id = source_manager->getFileID(loc);
-  const clang::FileEntry *out = loc.isFileID() && loc.isValid()
-                                    ? source_manager->getFileEntryForID(file_id)
-                                    : nullptr;
-  if (out) {
-    return out;
-  }
-  auto expansion = source_manager->getExpansionLoc(loc);
-  if (expansion.isValid() && expansion != loc) {
-    out = SearchForFileEntry(expansion, source_manager);
-    if (out) {
-      return out;
-    }
+    Ostream << ClaimedString(Range.Context);
   }
-  auto spelling = source_manager->getSpellingLoc(loc);
-  if (spelling.isValid() && spelling != loc) {
-    out = SearchForFileEntry(spelling, source_manager);
+}
+
+const kythe::proto::VName *KytheGraphObserver::AnchorFileVName(
+    clang::FileID file_id) {
+  auto inserted = anchor_file_vnames_.insert({file_id, nullptr});
+  if (inserted.second) {
+    if (const clang::FileEntry *file_entry =
+            SourceManager->getFileEntryForID(file_id)) {
+      anchor_file_vname_storage_.push_back(VNameFromFileEntry(file_entry));
+      anchor_file_vname_storage_.back().clear_language();
+      inserted.first->second = &anchor_file_vname_storage_.back();
+    }
   }
-  return out;
+  return inserted.first->second;
 }
 
-kythe::proto::VName KytheGraphObserver::VNameFromRange(
-    const GraphObserver::Range &range) {
-  kythe::proto::VName out_name;
+void KytheGraphObserver::VNameFromRange(const GraphObserver::Range &range,
+                                        AnchorVName *anchor_name) {
+  VNameRef &out_name = anchor_name->vname_;
+  auto &signature = anchor_name->signature_;
+  signature.clear();
   if (range.Kind == GraphObserver::Range::RangeKind::Implicit) {
-    VNameRefFromNodeId(range.Context).Expand(&out_name);
-    out_name.mutable_signature()->append("@syntactic");
+    out_name = VNameRefFromNodeId(range.Context);
+    signature.append(out_name.signature);
+    signature.append("@syntactic");
   } else {
     const clang::SourceRange &source_range = range.PhysicalRange;
-    clang::SourceLocation begin = source_range.getBegin();
-    clang::SourceLocation end = source_range.getEnd();
-    CHECK(begin.isValid());
-    if (!end.isValid()) {
-      end = begin;
-    }
-    if (begin.isMacroID()) {
-      begin = SourceManager->getExpansionLoc(begin);
-    }
-    if (end.isMacroID()) {
-      end = SourceManager->getExpansionLoc(end);
-    }
-    if (const clang::FileEntry *file_entry =
-            SearchForFileEntry(begin, SourceManager)) {
-      out_name.CopyFrom(VNameFromFileEntry(file_entry));
+    CHECK(source_range.getBegin().isValid());
+    const auto begin = DecomposeExpansionLoc(source_range.getBegin());
+    const auto end = source_range.getEnd().isValid()
+                         ? DecomposeExpansionLoc(source_range.getEnd())
+                         : begin;
+    // `begin` is now in a file, so there's no macro expansion history to
+    // search for a `FileEntry`.
+    if (const auto *file_vname = AnchorFileVName(begin.first)) {
+      out_name = VNameRef(*file_vname);
     } else if (range.Kind == GraphObserver::Range::RangeKind::Wraith) {
-      VNameRefFromNodeId(range.Context).Expand(&out_name);
+      out_name = VNameRefFromNodeId(range.Context);
+    } else {
+      out_name = VNameRef();
     }
-    size_t begin_offset = SourceManager->getFileOffset(begin);
-    size_t end_offset = SourceManager->getFileOffset(end);
-    auto *const signature = out_name.mutable_signature();
-    signature->append("@");
-    signature->append(std::to_string(begin_offset));
-    signature->append(":");
-    signature->append(std::to_string(end_offset));
+    signature.append(out_name.signature);
+    char offsets[32];
+    int offsets_size = snprintf(offsets, sizeof(offsets), "@%u:%u",
+                                begin.second, end.second);
+    signature.append(offsets, offsets + offsets_size);
     if (range.Kind == GraphObserver::Range::RangeKind::Wraith) {
-      signature->append("@");
-      signature->append(range.Context.ToClaimedString());
+      signature.push_back('@');
+      signature.append(ClaimedString(range.Context));
     }
   }
-  out_name.set_language(supported_language::kIndexerLang);
-  out_name.set_signature(CompressString(out_name.signature()));
-  return out_name;
+  out_name.language = llvm::StringRef(supported_language::kIndexerLang);
+  if (signature.size() <= kSha256DigestBase64MaxEncodingLength) {
+    out_name.signature = signature.str();
+    return;
+  }
+  out_name.signature = llvm::StringRef(
+      anchor_name->compressed_,
+      CompressStringInto(signature, anchor_name->compressed_));
 }
 
 void KytheGraphObserver::RecordSourceLocation(
     const VNameRef &vname, clang::SourceLocation source_location,
     PropertyID offset_id) {
-  if (source_location.isMacroID()) {
-    source_location = SourceManager->getExpansionLoc(source_location);
-  }
-  size_t offset = SourceManager->getFileOffset(source_location);
+  size_t offset = DecomposeExpansionLoc(source_location).second;
   recorder_->AddProperty(vname, offset_id, offset);
 }
 
@@ -293,6 +287,20 @@ void KytheGraphObserver::recordIncludesRange(const Range &source_range,
                Claimability::Claimable);
 }
 
+void KytheGraphObserver::recordUnitDiagnostic(const std::string &message) {
+  const auto *file_vname = AnchorFileVName(SourceManager->getMainFileID());
+  if (file_vname == nullptr) {
+    return;
+  }
+  kythe::proto::VName diagnostic_vname(*file_vname);
+  diagnostic_vname.set_signature("diagnostic:" + message);
+  diagnostic_vname.set_language(supported_language::kIndexerLang);
+  VNameRef diagnostic(diagnostic_vname);
+  recorder_->AddProperty(diagnostic, NodeKindID::kDiagnostic);
+  recorder_->AddProperty(diagnostic, PropertyID::kMessage, message);
+  recorder_->AddEdge(VNameRef(*file_vname), EdgeKindID::kTagged, diagnostic);
+}
+
 void KytheGraphObserver::recordUserDefinedNode(const NodeId &node,
                                                const llvm::StringRef &kind,
                                                Completeness completeness) {
@@ -304,7 +312,7 @@ void KytheGraphObserver::recordUserDefinedNode(const NodeId &node,
 
 void KytheGraphObserver::recordVariableNode(
     const NodeId &node, Completeness completeness, VariableSubkind subkind,
-    const MaybeFew<MarkedSource> &marked_source) {
+    const LazyMarkedSource &marked_source) {
   VNameRef node_vname = VNameRefFromNodeId(node);
   recorder_->AddProperty(node_vname, NodeKindID::kVariable);
   recorder_->AddProperty(node_vname, PropertyID::kComplete,
@@ -320,7 +328,14 @@ void KytheGraphObserver::recordVariableNode(
 }
 
 void KytheGraphObserver::recordNamespaceNode(
-    const NodeId &node, const MaybeFew<MarkedSource> &marked_source) {
+    const NodeId &node, const LazyMarkedSource &marked_source) {
+  // Identities are interned for the lifetime of this observer, so equal
+  // pointers mean equal nodes.
+  if (!recorded_namespaces_
+           .insert(std::make_pair(node.getToken(), &node.getRawIdentity()))
+           .second) {
+    return;
+  }
   VNameRef node_vname = VNameRefFromNodeId(node);
   if (written_namespaces_.insert(node.ToClaimedString()).second) {
     recorder_->AddProperty(node_vname, NodeKindID::kPackage);
@@ -329,10 +344,13 @@ void KytheGraphObserver::recordNamespaceNode(
   }
 }
 
-void KytheGraphObserver::RecordRange(const proto::VName &anchor_name,
+void KytheGraphObserver::RecordRange(const VNameRef &anchor_name_ref,
                                      const GraphObserver::Range &range) {
+  if (deferring_nodes_ && range_dedup_limit_ != 0 &&
+      deferred_anchors_.size() >= range_dedup_limit_) {
+    deferred_anchors_.clear();
+  }
   if (!deferring_nodes_ || deferred_anchors_.insert(range).second) {
-    VNameRef anchor_name_ref(anchor_name);
     recorder_->AddProperty(anchor_name_ref, NodeKindID::kAnchor);
     if (range.Kind == GraphObserver::Range::RangeKind::Implicit) {
       recorder_->AddProperty(anchor_name_ref, PropertyID::kSubkind, "implicit");
@@ -354,21 +372,19 @@ void KytheGraphObserver::MetaHookDefines(const MetadataFile &meta,
                                          unsigned range_begin,
                                          unsigned range_end,
                                          const VNameRef &def) {
-  auto rules = meta.rules().equal_range(range_begin);
-  for (auto rule = rules.first; rule != rules.second; ++rule) {
-    if (rule->second.begin == range_begin && rule->second.end == range_end &&
-        (rule->second.edge_in == "/kythe/edge/defines" ||
-         rule->second.edge_in == "/kythe/edge/defines/binding")) {
+  for (const auto &rule : meta.RulesForRange(range_begin, range_end)) {
+    if (rule.edge_in == "/kythe/edge/defines" ||
+        rule.edge_in == "/kythe/edge/defines/binding") {
       EdgeKindID edge_kind;
-      if (of_spelling(rule->second.edge_out, &edge_kind)) {
-        if (rule->second.reverse_edge) {
-          recorder_->AddEdge(VNameRef(rule->second.vname), edge_kind, def);
+      if (of_spelling(rule.edge_out, &edge_kind)) {
+        if (rule.reverse_edge) {
+          recorder_->AddEdge(VNameRef(rule.vname), edge_kind, def);
         } else {
-          recorder_->AddEdge(def, edge_kind, VNameRef(rule->second.vname));
+          recorder_->AddEdge(def, edge_kind, VNameRef(rule.vname));
         }
       } else {
         fprintf(stderr, "Unknown edge kind %s from metadata\n",
-                rule->second.edge_out.c_str());
+                rule.edge_out.c_str());
       }
     }
   }
@@ -378,6 +394,10 @@ void KytheGraphObserver::RecordAnchor(
     const GraphObserver::NodeId &primary_anchored_to,
     EdgeKindID anchor_edge_kind, Claimability cl) {
   CHECK(!file_stack_.empty());
+  if (drop_redundant_wraiths_ && range_dedup_limit_ != 0 &&
+      range_edges_.size() >= range_dedup_limit_) {
+    range_edges_.clear();
+  }
   if (drop_redundant_wraiths_ &&
       !range_edges_
            .insert(RangeEdge{
@@ -388,13 +408,14 @@ void KytheGraphObserver::RecordAnchor(
            .second) {
     return;
   }
-  proto::VName anchor_name = VNameFromRange(source_range);
+  AnchorVName anchor_name;
+  VNameFromRange(source_range, &anchor_name);
   if (claimRange(source_range) || claimNode(primary_anchored_to)) {
-    RecordRange(anchor_name, source_range);
+    RecordRange(anchor_name.ref(), source_range);
     cl = Claimability::Unclaimable;
   }
   if (cl == Claimability::Unclaimable) {
-    recorder_->AddEdge(VNameRef(anchor_name), anchor_edge_kind,
+    recorder_->AddEdge(anchor_name.ref(), anchor_edge_kind,
                        VNameRefFromNodeId(primary_anchored_to));
     if (source_range.Kind == Range::RangeKind::Physical) {
       if (anchor_edge_kind == EdgeKindID::kDefinesBinding) {
@@ -402,18 +423,14 @@ void KytheGraphObserver::RecordAnchor(
             SourceManager->getFileID(source_range.PhysicalRange.getBegin());
         const auto metas = meta_.equal_range(def_file);
         if (metas.first != metas.second) {
-          auto begin = source_range.PhysicalRange.getBegin();
-          if (begin.isMacroID()) {
-            begin = SourceManager->getExpansionLoc(begin);
-          }
-          auto end = source_range.PhysicalRange.getEnd();
-          if (end.isMacroID()) {
-            end = SourceManager->getExpansionLoc(end);
-          }
-          unsigned range_begin = SourceManager->getFileOffset(begin);
-          unsigned range_end = SourceManager->getFileOffset(end);
+          unsigned range_begin =
+              DecomposeExpansionLoc(source_range.PhysicalRange.getBegin())
+                  .second;
+          unsigned range_end =
+              DecomposeExpansionLoc(source_range.PhysicalRange.getEnd())
+                  .second;
           for (auto meta = metas.first; meta != metas.second; ++meta) {
-            MetaHookDefines(*meta->second, VNameRef(anchor_name), range_begin,
+            MetaHookDefines(*meta->second, anchor_name.ref(), range_begin,
                             range_end, VNameRefFromNodeId(primary_anchored_to));
           }
         }
@@ -427,13 +444,14 @@ void KytheGraphObserver::RecordAnchor(
     const kythe::proto::VName &primary_anchored_to, EdgeKindID anchor_edge_kind,
     Claimability cl) {
   CHECK(!file_stack_.empty());
-  proto::VName anchor_name = VNameFromRange(source_range);
+  AnchorVName anchor_name;
+  VNameFromRange(source_range, &anchor_name);
   if (claimRange(source_range)) {
-    RecordRange(anchor_name, source_range);
+    RecordRange(anchor_name.ref(), source_range);
     cl = Claimability::Unclaimable;
   }
   if (cl == Claimability::Unclaimable) {
-    recorder_->AddEdge(VNameRef(anchor_name), anchor_edge_kind,
+    recorder_->AddEdge(anchor_name.ref(), anchor_edge_kind,
                        VNameRef(primary_anchored_to));
   }
 }
@@ -462,6 +480,17 @@ VNameRef KytheGraphObserver::VNameRefFromNodeId(
   return out_ref;
 }
 
+const std::string &KytheGraphObserver::ClaimedString(
+    const GraphObserver::NodeId &node_id) {
+  auto inserted = claimed_strings_.insert(
+      {{node_id.getToken(), &node_id.getRawIdentity()}, nullptr});
+  if (inserted.second) {
+    claimed_string_storage_.push_back(node_id.ToClaimedString());
+    inserted.first->second = &claimed_string_storage_.back();
+  }
+  return *inserted.first->second;
+}
+
 void KytheGraphObserver::recordParamEdge(const NodeId &param_of_id,
                                          uint32_t ordinal,
                                          const NodeId &param_id) {
@@ -554,13 +583,13 @@ void KytheGraphObserver::recordOverridesRootEdge(const NodeId &overrider,
 GraphObserver::NodeId KytheGraphObserver::nodeIdForTypeAliasNode(
     const NameId &alias_name, const NodeId &aliased_type) {
   return NodeId(&type_token_, "talias(" + alias_name.ToString() + "," +
-                                  aliased_type.ToClaimedString() + ")");
+                                  ClaimedString(aliased_type) + ")");
 }
 
 GraphObserver::NodeId KytheGraphObserver::recordTypeAliasNode(
     const NameId &alias_name, const NodeId &aliased_type,
     const MaybeFew<NodeId> &root_aliased_type,
-    const MaybeFew<MarkedSource> &marked_source) {
+    const LazyMarkedSource &marked_source) {
   NodeId type_id = nodeIdForTypeAliasNode(alias_name, aliased_type);
   if (!deferring_nodes_ ||
       written_types_.insert(type_id.ToClaimedString()).second) {
@@ -586,7 +615,7 @@ void KytheGraphObserver::recordDocumentationText(
   std::string signature = doc_text;
   for (const auto &link : doc_links) {
     signature.push_back(',');
-    signature.append(link.ToClaimedString());
+    signature.append(ClaimedString(link));
   }
   // Force hashing because the serving backend gets upset if certain
   // characters appear in VName fields.
@@ -595,11 +624,14 @@ void KytheGraphObserver::recordDocumentationText(
   if (written_docs_.insert(doc_id.ToClaimedString()).second) {
     recorder_->AddProperty(doc_vname, NodeKindID::kDoc);
     recorder_->AddProperty(doc_vname, PropertyID::kText, doc_text);
-    size_t param_index = 0;
+    std::vector<FanOutEdge> params;
+    params.reserve(doc_links.size());
     for (const auto &link : doc_links) {
-      recorder_->AddEdge(doc_vname, EdgeKindID::kParam,
-                         VNameRefFromNodeId(link), param_index++);
+      int64_t ordinal = params.size();
+      params.push_back(
+          FanOutEdge{EdgeKindID::kParam, VNameRefFromNodeId(link), ordinal});
     }
+    recorder_->AddEdges(doc_vname, params);
   }
   recorder_->AddEdge(doc_vname, EdgeKindID::kDocuments,
                      VNameRefFromNodeId(node));
@@ -651,7 +683,7 @@ GraphObserver::NodeId KytheGraphObserver::nodeIdForNominalTypeNode(
 }
 
 GraphObserver::NodeId KytheGraphObserver::recordNominalTypeNode(
-    const NameId &name_id, const MaybeFew<MarkedSource> &marked_source,
+    const NameId &name_id, const LazyMarkedSource &marked_source,
     const NodeId *parent) {
   NodeId id_out = nodeIdForNominalTypeNode(name_id);
   if (!deferring_nodes_ ||
@@ -667,29 +699,68 @@ GraphObserver::NodeId KytheGraphObserver::recordNominalTypeNode(
   return id_out;
 }
 
+const GraphObserver::NodeId *KytheGraphObserver::FindTypeNode(
+    const NodeId *tycon, const std::vector<const NodeId *> &params) {
+  type_node_key_.clear();
+  type_node_key_.push_back(tycon ? tycon->getToken() : nullptr);
+  type_node_key_.push_back(tycon ? &tycon->getRawIdentity() : nullptr);
+  for (const auto *param : params) {
+    type_node_key_.push_back(param->getToken());
+    type_node_key_.push_back(&param->getRawIdentity());
+  }
+  auto found = type_nodes_.find(type_node_key_);
+  if (found == type_nodes_.end()) {
+    ReportProfilingEvent(ReportProfileEvent, "type_node_identity",
+                         ProfilingEvent::Miss);
+    return nullptr;
+  }
+  ReportProfilingEvent(ReportProfileEvent, "type_node_identity",
+                       ProfilingEvent::Hit);
+  return &found->second;
+}
+
+GraphObserver::NodeId KytheGraphObserver::RememberTypeNode(
+    llvm::StringRef identity) {
+  GraphObserver::NodeId id(&type_token_, identity);
+  type_nodes_.emplace(type_node_key_, id);
+  return id;
+}
+
 GraphObserver::NodeId KytheGraphObserver::recordTsigmaNode(
     const std::vector<const NodeId *> &params) {
+  const NodeId *known = FindTypeNode(nullptr, params);
+  if (known != nullptr && deferring_nodes_) {
+    // The node was written when it was first built.
+    return *known;
+  }
   std::string identity;
-  llvm::raw_string_ostream ostream(identity);
-  bool comma = false;
-  ostream << "#sigma(";
-  for (const auto *next_id : params) {
-    if (comma) {
-      ostream << ",";
+  if (known == nullptr) {
+    llvm::raw_string_ostream ostream(identity);
+    bool comma = false;
+    ostream << "#sigma(";
+    for (const auto *next_id : params) {
+      if (comma) {
+        ostream << ",";
+      }
+      ostream << ClaimedString(*next_id);
+      comma = true;
     }
-    ostream << next_id->ToClaimedString();
-    comma = true;
+    ostream << ")";
   }
-  ostream << ")";
-  GraphObserver::NodeId id_out(&type_token_, ostream.str());
+  GraphObserver::NodeId id_out =
+      known ? *known : RememberTypeNode(llvm::StringRef(identity));
   if (!deferring_nodes_ ||
       written_types_.insert(id_out.ToClaimedString()).second) {
     VNameRef tsigma_vname(VNameRefFromNodeId(id_out));
     recorder_->AddProperty(tsigma_vname, NodeKindID::kTSigma);
-    for (uint32_t param_index = 0; param_index < params.size(); ++param_index) {
-      recorder_->AddEdge(tsigma_vname, EdgeKindID::kParam,
-                         VNameRefFromNodeId(*params[param_index]), param_index);
+    std::vector<FanOutEdge> param_edges;
+    param_edges.reserve(params.size());
+    for (const auto *param : params) {
+      int64_t ordinal = param_edges.size();
+      param_edges.push_back(
+          FanOutEdge{EdgeKindID::kParam, VNameRefFromNodeId(*param), ordinal});
     }
+    recorder_->AddEdges(tsigma_vname, param_edges);
   }
   return id_out;
 }
@@ -705,20 +776,28 @@ GraphObserver::NodeId KytheGraphObserver::recordTappNode(
   //   foo (bar baz)
   // We'll turn it into a C-style function application:
   //   foo(bar,baz) || foo(bar(baz))
+  const NodeId *known = FindTypeNode(&tycon_id, params);
+  if (known != nullptr && deferring_nodes_) {
+    // The node was written when it was first built.
+    return *known;
+  }
   std::string identity;
-  llvm::raw_string_ostream ostream(identity);
-  bool comma = false;
-  ostream << tycon_id.ToClaimedString();
-  ostream << "(";
-  for (const auto *next_id : params) {
-    if (comma) {
-      ostream << ",";
+  if (known == nullptr) {
+    llvm::raw_string_ostream ostream(identity);
+    bool comma = false;
+    ostream << ClaimedString(tycon_id);
+    ostream << "(";
+    for (const auto *next_id : params) {
+      if (comma) {
+        ostream << ",";
+      }
+      ostream << ClaimedString(*next_id);
+      comma = true;
     }
-    ostream << next_id->ToClaimedString();
-    comma = true;
+    ostream << ")";
   }
-  ostream << ")";
-  GraphObserver::NodeId id_out(&type_token_, ostream.str());
+  GraphObserver::NodeId id_out =
+      known ? *known : RememberTypeNode(llvm::StringRef(identity));
   if (!deferring_nodes_ ||
       written_types_.insert(id_out.ToClaimedString()).second) {
     VNameRef tapp_vname(VNameRefFromNodeId(id_out));
@@ -727,13 +806,16 @@ GraphObserver::NodeId KytheGraphObserver::recordTappNode(
       recorder_->AddProperty(tapp_vname, PropertyID::kParamDefault,
                              FirstDefaultParam);
     }
-    recorder_->AddEdge(tapp_vname, EdgeKindID::kParam,
-                       VNameRefFromNodeId(tycon_id), 0);
-    for (uint32_t param_index = 0; param_index < params.size(); ++param_index) {
-      recorder_->AddEdge(tapp_vname, EdgeKindID::kParam,
-                         VNameRefFromNodeId(*params[param_index]),
-                         param_index + 1);
+    std::vector<FanOutEdge> param_edges;
+    param_edges.reserve(params.size() + 1);
+    param_edges.push_back(
+        FanOutEdge{EdgeKindID::kParam, VNameRefFromNodeId(tycon_id), 0});
+    for (const auto *param : params) {
+      int64_t ordinal = param_edges.size();
+      param_edges.push_back(
+          FanOutEdge{EdgeKindID::kParam, VNameRefFromNodeId(*param), ordinal});
     }
+    recorder_->AddEdges(tapp_vname, param_edges);
   }
   return id_out;
 }
@@ -758,7 +840,7 @@ void KytheGraphObserver::recordIntegerConstantNode(const NodeId &node_id,
 
 void KytheGraphObserver::recordFunctionNode(
     const NodeId &node_id, Completeness completeness, FunctionSubkind subkind,
-    const MaybeFew<MarkedSource> &marked_source) {
+    const LazyMarkedSource &marked_source) {
   VNameRef node_vname = VNameRefFromNodeId(node_id);
   recorder_->AddProperty(node_vname, NodeKindID::kFunction);
   recorder_->AddProperty(node_vname, PropertyID::kComplete,
@@ -775,7 +857,7 @@ void KytheGraphObserver::recordAbsNode(const NodeId &node_id) {
 }
 
 void KytheGraphObserver::recordMarkedSource(
-    const NodeId &node_id, const MaybeFew<MarkedSource> &marked_source) {
+    const NodeId &node_id, const LazyMarkedSource &marked_source) {
   VNameRef node_vname = VNameRefFromNodeId(node_id);
   AddMarkedSource(node_vname, marked_source);
 }
@@ -805,7 +887,7 @@ void KytheGraphObserver::recordLookupNode(const NodeId &node_id,
 }
 
 void KytheGraphObserver::recordInterfaceNode(
-    const NodeId &node_id, const MaybeFew<MarkedSource> &marked_source) {
+    const NodeId &node_id, const LazyMarkedSource &marked_source) {
   VNameRef node_vname = VNameRefFromNodeId(node_id);
   recorder_->AddProperty(node_vname, NodeKindID::kInterface);
   AddMarkedSource(node_vname, marked_source);
@@ -813,7 +895,7 @@ void KytheGraphObserver::recordInterfaceNode(
 
 void KytheGraphObserver::recordRecordNode(
     const NodeId &node_id, RecordKind kind, Completeness completeness,
-    const MaybeFew<MarkedSource> &marked_source) {
+    const LazyMarkedSource &marked_source) {
   VNameRef node_vname = VNameRefFromNodeId(node_id);
   recorder_->AddProperty(node_vname, NodeKindID::kRecord);
   switch (kind) {
@@ -889,29 +971,174 @@ void KytheGraphObserver::recordDeclUseLocation(
   RecordAnchor(source_range, node, EdgeKindID::kRef, claimability);
 }
 
+namespace {
+/// \brief A node that is the same in every compilation unit.
+struct BuiltinSpec {
+  /// The node's (uncompressed) identity.
+  std::string identity;
+  /// Marked source for the node.
+  MarkedSource marked_source;
+};
+
+/// \brief The builtin and meta nodes known to the indexer.
+struct BuiltinTable {
+  /// Known builtins, in registration order.
+  std::vector<BuiltinSpec> builtins;
+  /// Maps from builtin spellings to indices in `builtins`.
+  llvm::StringMap<size_t> index;
+  /// Meta nodes, which are emitted for every unit.
+  std::vector<BuiltinSpec> meta_nodes;
+};
+
+/// \return the process-wide `BuiltinTable`.
+const BuiltinTable &GetBuiltinTable() {
+  static const BuiltinTable *const table = [] {
+    auto *table = new BuiltinTable();
+    auto RegisterBuiltin = [&](const std::string &name,
+                               const MarkedSource &marked_source) {
+      table->index[name] = table->builtins.size();
+      table->builtins.push_back({name + "#builtin", marked_source});
+    };
+    auto RegisterTokenBuiltin = [&](const std::string &name,
+                                    const std::string &token) {
+      MarkedSource sig;
+      sig.set_kind(MarkedSource::IDENTIFIER);
+      sig.set_pre_text(token);
+      RegisterBuiltin(name, sig);
+    };
+    RegisterTokenBuiltin("void", "void");
+    RegisterTokenBuiltin("bool", "bool");
+    RegisterTokenBuiltin("_Bool", "_Bool");
+    RegisterTokenBuiltin("signed char", "signed char");
+    RegisterTokenBuiltin("char", "char");
+    RegisterTokenBuiltin("char16_t", "char16_t");
+    RegisterTokenBuiltin("char32_t", "char32_t");
+    RegisterTokenBuiltin("wchar_t", "wchar_t");
+    RegisterTokenBuiltin("short", "short");
+    RegisterTokenBuiltin("int", "int");
+    RegisterTokenBuiltin("long", "long");
+    RegisterTokenBuiltin("long long", "long long");
+    RegisterTokenBuiltin("unsigned char", "unsigned char");
+    RegisterTokenBuiltin("unsigned short", "unsigned short");
+    RegisterTokenBuiltin("unsigned int", "unsigned int");
+    RegisterTokenBuiltin("unsigned long", "unsigned long");
+    RegisterTokenBuiltin("unsigned long long", "unsigned long long");
+    RegisterTokenBuiltin("float", "float");
+    RegisterTokenBuiltin("double", "double");
+    RegisterTokenBuiltin("long double", "long double");
+    RegisterTokenBuiltin("nullptr_t", "nullptr_t");
+    RegisterTokenBuiltin("<dependent type>", "dependent");
+    RegisterTokenBuiltin("auto", "auto");
+    RegisterTokenBuiltin("knrfn", "function");
+    RegisterTokenBuiltin("__int128", "__int128");
+    RegisterTokenBuiltin("unsigned __int128", "unsigned __int128");
+    RegisterTokenBuiltin("SEL", "SEL");
+    RegisterTokenBuiltin("id", "id");
+    RegisterTokenBuiltin("TypeUnion", "TypeUnion");
+
+    MarkedSource lhs_tycon_builtin;
+    auto *lhs_tycon = lhs_tycon_builtin.add_child();
+    auto *lookup = lhs_tycon_builtin.add_child();
+    lookup->set_kind(MarkedSource::LOOKUP_BY_PARAM);
+    lookup->set_lookup_index(1);
+    lhs_tycon->set_kind(MarkedSource::IDENTIFIER);
+    lhs_tycon->set_pre_text("const ");
+    RegisterBuiltin("const", lhs_tycon_builtin);
+    lhs_tycon->set_pre_text("volatile ");
+    RegisterBuiltin("volatile", lhs_tycon_builtin);
+    lhs_tycon->set_pre_text("restrict ");
+    RegisterBuiltin("restrict", lhs_tycon_builtin);
+
+    MarkedSource rhs_tycon_builtin;
+    lookup = rhs_tycon_builtin.add_child();
+    auto *rhs_tycon = rhs_tycon_builtin.add_child();
+    lookup->set_kind(MarkedSource::LOOKUP_BY_PARAM);
+    lookup->set_lookup_index(1);
+    rhs_tycon->set_kind(MarkedSource::IDENTIFIER);
+    rhs_tycon->set_pre_text("*");
+    RegisterBuiltin("ptr", rhs_tycon_builtin);
+    rhs_tycon->set_pre_text("&");
+    RegisterBuiltin("lvr", rhs_tycon_builtin);
+    rhs_tycon->set_pre_text("&&");
+    RegisterBuiltin("rvr", rhs_tycon_builtin);
+    rhs_tycon->set_pre_text("[incomplete]");
+    RegisterBuiltin("iarr", rhs_tycon_builtin);
+    rhs_tycon->set_pre_text("[const]");
+    RegisterBuiltin("carr", rhs_tycon_builtin);
+    rhs_tycon->set_pre_text("[dependent]");
+    RegisterBuiltin("darr", rhs_tycon_builtin);
+
+    MarkedSource function_tycon_builtin;
+    auto *return_type = function_tycon_builtin.add_child();
+    return_type->set_kind(MarkedSource::LOOKUP_BY_PARAM);
+    return_type->set_lookup_index(1);
+    auto *args = function_tycon_builtin.add_child();
+    args->set_kind(MarkedSource::PARAMETER_LOOKUP_BY_PARAM);
+    args->set_pre_text("(");
+    args->set_post_child_text(", ");
+    args->set_post_text(")");
+    args->set_lookup_index(2);
+    RegisterBuiltin("fn", function_tycon_builtin);
+    auto *vararg_keyword = function_tycon_builtin.add_child();
+    vararg_keyword->set_kind(MarkedSource::IDENTIFIER);
+    vararg_keyword->set_pre_text("vararg");
+    RegisterBuiltin("fnvararg", function_tycon_builtin);
+
+    MarkedSource tapp_signature;
+    auto *ctor_lookup = tapp_signature.add_child();
+    ctor_lookup->set_kind(MarkedSource::LOOKUP_BY_PARAM);
+    ctor_lookup->set_lookup_index(0);
+    auto *tapp_body = tapp_signature.add_child();
+    tapp_body->set_kind(MarkedSource::PARAMETER_LOOKUP_BY_PARAM_WITH_DEFAULTS);
+    tapp_body->set_pre_text("<");
+    tapp_body->set_lookup_index(1);
+    tapp_body->set_post_child_text(", ");
+    tapp_body->set_post_text(">");
+    table->meta_nodes.push_back({"tapp#meta", tapp_signature});
+    return table;
+  }();
+  return *table;
+}
+
+/// \brief Emits a builtin or meta node with the given `kind`.
+void EmitBuiltinSpec(KytheGraphRecorder *recorder, const BuiltinSpec &spec,
+                     NodeKindID kind) {
+  VNameRef ref;
+  ref.signature = spec.identity;
+  ref.language = llvm::StringRef(supported_language::kIndexerLang);
+  recorder->AddProperty(ref, kind);
+  recorder->AddMarkedSource(ref, spec.marked_source);
+}
+}  // anonymous namespace
+
 GraphObserver::NodeId KytheGraphObserver::getNodeIdForBuiltinType(
     const llvm::StringRef &spelling) {
-  const auto &info = builtins_.find(spelling.str());
-  if (info == builtins_.end()) {
-    if (FLAGS_fail_on_unimplemented_builtin) {
-      LOG(FATAL) << "Missing builtin " << spelling.str();
+  const auto &table = GetBuiltinTable();
+  const auto info = table.index.find(spelling);
+  if (info != table.index.end()) {
+    size_t index = info->second;
+    if (!builtins_emitted_[index]) {
+      builtins_emitted_[index] = true;
+      EmitBuiltinSpec(recorder_, table.builtins[index], NodeKindID::kBuiltin);
     }
-    LOG(ERROR) << "Missing builtin " << spelling.str();
-    MarkedSource sig;
-    sig.set_kind(MarkedSource::IDENTIFIER);
-    sig.set_pre_text(spelling);
-    builtins_.emplace(spelling.str(), Builtin{NodeId::CreateUncompressed(
-                                                  getDefaultClaimToken(),
-                                                  spelling.str() + "#builtin"),
-                                              sig, true});
-    auto *new_builtin = &builtins_.find(spelling.str())->second;
-    EmitBuiltin(new_builtin);
-    return new_builtin->node_id;
+    return builtin_ids_[index];
+  }
+  const auto missing = missing_builtins_.find(spelling.str());
+  if (missing != missing_builtins_.end()) {
+    return missing->second;
   }
-  if (!info->second.emitted) {
-    EmitBuiltin(&info->second);
+  if (FLAGS_fail_on_unimplemented_builtin) {
+    LOG(FATAL) << "Missing builtin " << spelling.str();
   }
-  return info->second.node_id;
+  LOG(ERROR) << "Missing builtin " << spelling.str();
+  BuiltinSpec spec;
+  spec.identity = spelling.str() + "#builtin";
+  spec.marked_source.set_kind(MarkedSource::IDENTIFIER);
+  spec.marked_source.set_pre_text(spelling);
+  EmitBuiltinSpec(recorder_, spec, NodeKindID::kBuiltin);
+  auto id = NodeId::CreateUncompressed(getDefaultClaimToken(), spec.identity);
+  missing_builtins_.emplace(spelling.str(), id);
+  return id;
 }
 
 void KytheGraphObserver::applyMetadataFile(clang::FileID id,
@@ -941,13 +1168,7 @@ bool KytheGraphObserver::isMainSourceFileRelatedLocation(
   if (location.isInvalid()) {
     return true;
   }
-  if (!location.isFileID()) {
-    location = SourceManager->getExpansionLoc(location);
-    if (!location.isValid() || !location.isFileID()) {
-      return true;
-    }
-  }
-  clang::FileID file = SourceManager->getFileID(location);
+  clang::FileID file = DecomposeExpansionLoc(location).first;
   if (file.isInvalid()) {
     return true;
   }
@@ -958,10 +1179,58 @@ bool KytheGraphObserver::isMainSourceFileRelatedLocation(
   return true;
 }
 
+namespace {
+/// \brief Adds `field` to `sha` such that distinct field sequences produce
+/// distinct digests.
+void AddFingerprintField(::SHA256_CTX *sha, llvm::StringRef field) {
+  uint64_t size = field.size();
+  ::SHA256_Update(sha, &size, sizeof(size));
+  ::SHA256_Update(sha, field.data(), field.size());
+}
+
+/// \brief Adds the fingerprints in `pending` to `store` and clears `pending`.
+void RegisterFingerprints(
+    HashCache *store,
+    std::vector<std::array<unsigned char, HashCache::kHashSize>> *pending) {
+  std::vector<const HashCache::Hash *> fingerprints;
+  fingerprints.reserve(pending->size());
+  for (const auto &fingerprint : *pending) {
+    fingerprints.push_back(
+        reinterpret_cast<const HashCache::Hash *>(fingerprint.data()));
+  }
+  store->RegisterHashes(fingerprints);
+  pending->clear();
+}
+}  // anonymous namespace
+
+bool KytheGraphObserver::InstantiationFingerprintRecorded(
+    const std::string &identifier) {
+  if (instantiation_fingerprints_ == nullptr) {
+    return false;
+  }
+  std::array<unsigned char, HashCache::kHashSize> fingerprint;
+  ::SHA256_CTX sha;
+  ::SHA256_Init(&sha);
+  AddFingerprintField(&sha, identifier);
+  AddFingerprintField(&sha, supported_language::kIndexerLang);
+  ::SHA256_Final(fingerprint.data(), &sha);
+  if (instantiation_fingerprints_->SawHash(
+          *reinterpret_cast<const HashCache::Hash *>(fingerprint.data()))) {
+    ReportProfilingEvent(ReportProfileEvent, "instantiation_fingerprint",
+                         ProfilingEvent::Hit);
+    return true;
+  }
+  ReportProfilingEvent(ReportProfileEvent, "instantiation_fingerprint",
+                       ProfilingEvent::Miss);
+  pending_instantiation_fingerprints_.push_back(fingerprint);
+  return false;
+}
+
 bool KytheGraphObserver::claimImplicitNode(const std::string &identifier) {
   kythe::proto::VName node_vname;
   node_vname.set_signature(identifier);
-  return client_->Claim(claimant_, node_vname);
+  return client_->Claim(claimant_, node_vname) &&
+         !InstantiationFingerprintRecorded(identifier);
 }
 
 void KytheGraphObserver::finishImplicitNode(const std::string &identifier) {
@@ -970,7 +1239,150 @@ void KytheGraphObserver::finishImplicitNode(const std::string &identifier) {
 
 bool KytheGraphObserver::claimBatch(
     std::vector<std::pair<std::string, bool>> *pairs) {
-  return client_->ClaimBatch(pairs);
+  if (!client_->ClaimBatch(pairs)) {
+    return false;
+  }
+  if (instantiation_fingerprints_ == nullptr) {
+    return true;
+  }
+  bool any_claimed = false;
+  for (auto &pair : *pairs) {
+    if (pair.second && InstantiationFingerprintRecorded(pair.first)) {
+      pair.second = false;
+    }
+    any_claimed |= pair.second;
+  }
+  return any_claimed;
+}
+
+bool KytheGraphObserver::claimInstantiationSample(
+    const std::string &primary_identifier, const std::string &identifier) {
+  if (instantiation_sample_limit_ == 0) {
+    return true;
+  }
+  auto found = sampled_instantiations_.find(identifier);
+  if (found != sampled_instantiations_.end()) {
+    return found->second;
+  }
+  unsigned char digest[SHA256_DIGEST_LENGTH];
+  ::SHA256(reinterpret_cast<const unsigned char *>(identifier.data()),
+           identifier.size(), digest);
+  uint64_t slot = 0;
+  for (size_t i = 0; i < sizeof(slot); ++i) {
+    slot = (slot << 8) | digest[i];
+  }
+  slot %= instantiation_sample_limit_;
+  std::vector<std::pair<std::string, bool>> tokens;
+  tokens.emplace_back("inst-sample#" + std::to_string(slot) + "#" +
+                          primary_identifier,
+                      true);
+  bool sampled;
+  auto winner = instantiation_slots_.find(tokens[0].first);
+  if (winner != instantiation_slots_.end()) {
+    // Don't ask the claim client about a slot twice; it may not remember.
+    sampled = winner->second == identifier;
+  } else {
+    sampled = client_->ClaimBatch(&tokens);
+    if (sampled) {
+      instantiation_slots_.emplace(tokens[0].first, identifier);
+    }
+  }
+  ReportProfileEvent("instantiation_sample",
+                     sampled ? ProfilingEvent::Hit : ProfilingEvent::Miss);
+  sampled_instantiations_.emplace(identifier, sampled);
+  return sampled;
+}
+
+void KytheGraphObserver::RecordInstantiationFingerprints() {
+  if (instantiation_fingerprints_ != nullptr) {
+    RegisterFingerprints(instantiation_fingerprints_,
+                         &pending_instantiation_fingerprints_);
+  }
+}
+
+bool KytheGraphObserver::HeaderFingerprintRecorded(
+    const clang::FileEntry *entry, const kythe::proto::VName &vname) {
+  if (header_fingerprints_ == nullptr) {
+    return false;
+  }
+  bool was_invalid = false;
+  const llvm::MemoryBuffer *buf =
+      SourceManager->getMemoryBufferForFile(entry, &was_invalid);
+  if (was_invalid || !buf) {
+    return false;
+  }
+  std::array<unsigned char, HashCache::kHashSize> fingerprint;
+  ::SHA256_CTX sha;
+  ::SHA256_Init(&sha);
+  AddFingerprintField(&sha, buf->getBuffer());
+  AddFingerprintField(&sha, vname.signature());
+  AddFingerprintField(&sha, vname.corpus());
+  AddFingerprintField(&sha, vname.root());
+  AddFingerprintField(&sha, vname.path());
+  AddFingerprintField(&sha, vname.language());
+  ::SHA256_Final(fingerprint.data(), &sha);
+  if (header_fingerprints_->SawHash(
+          *reinterpret_cast<const HashCache::Hash *>(fingerprint.data()))) {
+    ReportProfilingEvent(ReportProfileEvent, "header_fingerprint",
+                         ProfilingEvent::Hit);
+    return true;
+  }
+  ReportProfilingEvent(ReportProfileEvent, "header_fingerprint",
+                       ProfilingEvent::Miss);
+  pending_header_fingerprints_.push_back(fingerprint);
+  return false;
+}
+
+void KytheGraphObserver::RecordHeaderFingerprints() {
+  if (header_fingerprints_ != nullptr) {
+    RegisterFingerprints(header_fingerprints_, &pending_header_fingerprints_);
+  }
+}
+
+void KytheGraphObserver::PrefetchFileClaims(
+    const std::vector<kythe::proto::VName> &vnames) {
+  std::vector<bool> claimed;
+  client_->ClaimAll(claimant_, vnames, &claimed);
+  for (size_t i = 0; i < vnames.size(); ++i) {
+    prefetched_claims_.emplace(vnames[i], claimed[i]);
+  }
+}
+
+bool KytheGraphObserver::ClaimFile(const kythe::proto::VName &vname) {
+  const auto prefetched = prefetched_claims_.find(vname);
+  if (prefetched != prefetched_claims_.end()) {
+    return prefetched->second;
+  }
+  return client_->Claim(claimant_, vname);
+}
+
+kythe::proto::VName KytheGraphObserver::FileClaimable(
+    const kythe::proto::VName &vname,
+    const PreprocessorContext &context) const {
+  if (claim_by_content_) {
+    const auto digest = file_digests_.find(vname);
+    if (digest != file_digests_.end()) {
+      return ContentClaimable(digest->second, context);
+    }
+  }
+  kythe::proto::VName claimable = vname;
+  claimable.set_signature(context + vname.signature());
+  return claimable;
+}
+
+void KytheGraphObserver::RecordFileContent(const clang::FileEntry *entry,
+                                           const kythe::proto::VName &vname) {
+  if (!recorded_files_.insert(entry).second) {
+    return;
+  }
+  bool was_invalid = false;
+  const llvm::MemoryBuffer *buf =
+      SourceManager->getMemoryBufferForFile(entry, &was_invalid);
+  if (was_invalid || !buf) {
+    // TODO(zarko): diagnostic logging.
+  } else {
+    recorder_->AddFileContent(VNameRef(vname), buf->getBuffer());
+  }
 }
 
 void KytheGraphObserver::pushFile(clang::SourceLocation blame_location,
@@ -980,10 +1392,14 @@ void KytheGraphObserver::pushFile(clang::SourceLocation blame_location,
   bool has_previous_uid = !file_stack_.empty();
   llvm::sys::fs::UniqueID previous_uid;
   bool in_header = false;
+  unsigned previous_context_id = kNoContext;
+  unsigned previous_context_file = kNoContext;
   if (has_previous_uid) {
-    previous_uid = file_stack_.back().uid;
-    in_header = transitively_reached_through_header_.find(previous_uid) !=
-                transitively_reached_through_header_.end();
+    const FileState &previous = file_stack_.back();
+    previous_uid = previous.uid;
+    in_header = previous.in_header;
+    previous_context_id = previous.context_id;
+    previous_context_file = previous.context_file;
   }
   file_stack_.push_back(FileState{});
   FileState &state = file_stack_.back();
@@ -1007,7 +1423,18 @@ void KytheGraphObserver::pushFile(clang::SourceLocation blame_location,
         if (in_header ||
             (has_previous_uid &&
              !llvm::StringRef(entry->getName()).endswith(".inc"))) {
+          state.in_header = true;
           transitively_reached_through_header_.insert(state.uid);
+        } else {
+          // This file may have been reached through a header before.
+          state.in_header =
+              transitively_reached_through_header_.count(state.uid) != 0;
+        }
+        if (!context_files_.empty()) {
+          const auto context_file = context_files_.find(state.uid);
+          if (context_file != context_files_.end()) {
+            state.context_file = context_file->second;
+          }
         }
         // Attempt to compute the state-amended VName using the state table.
         // If we aren't working under any context, we won't end up making the
@@ -1015,16 +1442,23 @@ void KytheGraphObserver::pushFile(clang::SourceLocation blame_location,
         if (file_stack_.size() == 1) {
           // Start state.
           state.context = starting_context_;
+          const auto context_id = context_ids_.find(starting_context_);
+          if (context_id != context_ids_.end()) {
+            state.context_id = context_id->second;
+          }
         } else if (has_previous_uid && !previous_context.empty() &&
                    blame_location.isValid() && blame_location.isFileID()) {
           unsigned offset = SourceManager->getFileOffset(blame_location);
-          const auto path_info = path_to_context_data_.find(previous_uid);
-          if (path_info != path_to_context_data_.end()) {
-            const auto context_info = path_info->second.find(previous_context);
-            if (context_info != path_info->second.end()) {
-              const auto offset_info = context_info->second.find(offset);
-              if (offset_info != context_info->second.end()) {
-                state.context = offset_info->second;
+          if (previous_context_file != kNoContext) {
+            if (previous_context_id != kNoContext &&
+                file_contexts_.count(FileContextKey(previous_context_file,
+                                                    previous_context_id))) {
+              const auto offset_info = include_contexts_.find(
+                  IncludeContextKey(previous_context_file, previous_context_id,
+                                    offset));
+              if (offset_info != include_contexts_.end()) {
+                state.context_id = offset_info->second;
+                state.context = *contexts_[state.context_id];
               } else {
                 fprintf(stderr,
                         "Warning: when looking for %s[%s]:%u: missing source "
@@ -1048,35 +1482,40 @@ void KytheGraphObserver::pushFile(clang::SourceLocation blame_location,
           }
         }
         state.vname.set_signature(state.context + state.vname.signature());
-        if (client_->Claim(claimant_, state.vname)) {
-          if (recorded_files_.insert(entry).second) {
-            bool was_invalid = false;
-            const llvm::MemoryBuffer *buf =
-                SourceManager->getMemoryBufferForFile(entry, &was_invalid);
-            if (was_invalid || !buf) {
-              // TODO(zarko): diagnostic logging.
-            } else {
-              recorder_->AddFileContent(VNameRef(state.base_vname),
-                                        buf->getBuffer());
-            }
-          }
+        if (main_file_only_ && has_previous_uid) {
+          // An earlier run indexed this file; don't ask for (and possibly
+          // take) its claim.
+          state.claimed = false;
+        } else if (ClaimFile(FileClaimable(state.base_vname, state.context)) &&
+                   !(has_previous_uid &&
+                     HeaderFingerprintRecorded(entry, state.vname))) {
+          RecordFileContent(entry, state.base_vname);
         } else {
           state.claimed = false;
+          if (claim_by_content_ && ClaimFile(state.base_vname)) {
+            // Another copy of this content is indexed elsewhere; this one
+            // only needs its file node.
+            RecordFileContent(entry, state.base_vname);
+          }
         }
         KytheClaimToken token;
         token.set_vname(state.vname);
         token.set_rough_claimed(state.claimed);
-        claim_checked_files_.emplace(file, token);
-        if (state.claimed) {
-          KytheClaimToken file_token;
-          file_token.set_vname(state.vname);
-          file_token.set_rough_claimed(state.claimed);
-          file_token.set_language_independent(true);
-          claimed_file_specific_tokens_.emplace(file, file_token);
+        auto inserted = claim_checked_files_.insert({file, nullptr});
+        if (inserted.second) {
+          claim_checked_file_storage_.push_back(token);
+          inserted.first->second = &claim_checked_file_storage_.back();
+          if (state.claimed) {
+            KytheClaimToken file_token;
+            file_token.set_vname(state.vname);
+            file_token.set_rough_claimed(state.claimed);
+            file_token.set_language_independent(true);
+            claimed_file_specific_tokens_.emplace_back(file, file_token);
+          }
         }
         if (!has_previous_uid) {
           main_source_file_loc_ = source_location;
-          main_source_file_token_ = &claim_checked_files_[file];
+          main_source_file_token_ = inserted.first->second;
         }
       } else {
         // A builtin location.
@@ -1113,17 +1552,52 @@ bool KytheGraphObserver::claimLocation(clang::SourceLocation source_location) {
   if (!source_location.isValid()) {
     return true;
   }
-  if (source_location.isMacroID()) {
-    source_location = SourceManager->getExpansionLoc(source_location);
-  }
-  CHECK(source_location.isFileID());
-  clang::FileID file = SourceManager->getFileID(source_location);
+  clang::FileID file = DecomposeExpansionLoc(source_location).first;
   if (file.isInvalid()) {
     return true;
   }
+  const auto *token = FindClaimCheckedFile(file);
+  return token != nullptr ? token->rough_claimed() : false;
+}
+
+KytheClaimToken *KytheGraphObserver::FindClaimCheckedFile(clang::FileID file) {
+  // Consecutive lookups are usually for the same file.
+  if (file == last_claim_checked_file_ && last_claim_checked_token_) {
+    return last_claim_checked_token_;
+  }
   auto token = claim_checked_files_.find(file);
-  return token != claim_checked_files_.end() ? token->second.rough_claimed()
-                                             : false;
+  if (token == claim_checked_files_.end()) {
+    return nullptr;
+  }
+  last_claim_checked_file_ = file;
+  last_claim_checked_token_ = token->second;
+  return token->second;
+}
+
+std::pair<clang::FileID, unsigned> KytheGraphObserver::DecomposeExpansionLoc(
+    clang::SourceLocation loc) {
+  if (loc.isFileID()) {
+    return SourceManager->getDecomposedLoc(loc);
+  }
+  auto inserted = expansion_locs_.insert({loc.getRawEncoding(), {}});
+  if (inserted.second) {
+    ReportProfilingEvent(ReportProfileEvent, "macro_expansion_loc",
+                         ProfilingEvent::Miss);
+    inserted.first->second = SourceManager->getDecomposedExpansionLoc(loc);
+  } else {
+    ReportProfilingEvent(ReportProfileEvent, "macro_expansion_loc",
+                         ProfilingEvent::Hit);
+  }
+  return inserted.first->second;
+}
+
+unsigned KytheGraphObserver::InternContext(
+    const PreprocessorContext &context) {
+  auto inserted = context_ids_.emplace(context, contexts_.size());
+  if (inserted.second) {
+    contexts_.push_back(&inserted.first->first);
+  }
+  return inserted.first->second;
 }
 
 void KytheGraphObserver::AddContextInformation(
@@ -1131,8 +1605,13 @@ void KytheGraphObserver::AddContextInformation(
     unsigned offset, const PreprocessorContext &dest_context) {
   auto found_file = vfs_->status(path);
   if (found_file) {
-    path_to_context_data_[found_file->getUniqueID()][context][offset] =
-        dest_context;
+    unsigned context_file =
+        context_files_.emplace(found_file->getUniqueID(), context_files_.size())
+            .first->second;
+    unsigned context_id = InternContext(context);
+    file_contexts_.insert(FileContextKey(context_file, context_id));
+    include_contexts_[IncludeContextKey(context_file, context_id, offset)] =
+        InternContext(dest_context);
   } else {
     fprintf(stderr, "WARNING: Path %s could not be mapped to a VFS record.\n",
             path.c_str());
@@ -1144,16 +1623,21 @@ KytheClaimToken *KytheGraphObserver::getClaimTokenForLocation(
   if (!source_location.isValid()) {
     return &default_token_;
   }
-  if (source_location.isMacroID()) {
-    source_location = SourceManager->getExpansionLoc(source_location);
-  }
-  CHECK(source_location.isFileID());
-  clang::FileID file = SourceManager->getFileID(source_location);
+  clang::FileID file = DecomposeExpansionLoc(source_location).first;
   if (file.isInvalid()) {
     return &default_token_;
   }
-  auto token = claim_checked_files_.find(file);
-  return token != claim_checked_files_.end() ? &token->second : &default_token_;
+  auto *token = FindClaimCheckedFile(file);
+  return token != nullptr ? token : &default_token_;
+}
+
+void KytheGraphObserver::DelimitAt(clang::SourceLocation loc) {
+  if (!group_entries_by_file_) {
+    Delimit();
+    return;
+  }
+  recorder_->PushFileEntryGroup(
+      getClaimTokenForLocation(loc)->StampIdentity(std::string()));
 }
 
 KytheClaimToken *KytheGraphObserver::getClaimTokenForRange(
@@ -1173,140 +1657,114 @@ KytheClaimToken *KytheGraphObserver::getAnonymousNamespaceClaimToken(
 KytheClaimToken *KytheGraphObserver::getNamespaceClaimToken(
     clang::SourceLocation loc) {
   auto *file_token = getClaimTokenForLocation(loc);
-  auto token = namespace_tokens_.find(file_token);
-  if (token != namespace_tokens_.end()) {
-    return &token->second;
+  auto inserted = namespace_tokens_.insert({file_token, nullptr});
+  if (inserted.second) {
+    proto::VName vname;
+    vname.set_corpus(file_token->vname().corpus());
+    namespace_token_storage_.emplace_back();
+    KytheClaimToken &new_token = namespace_token_storage_.back();
+    new_token.set_vname(vname);
+    new_token.set_rough_claimed(file_token->rough_claimed());
+    inserted.first->second = &new_token;
   }
-  proto::VName vname;
-  vname.set_corpus(file_token->vname().corpus());
-  KytheClaimToken new_token;
-  new_token.set_vname(vname);
-  new_token.set_rough_claimed(file_token->rough_claimed());
-  namespace_tokens_.emplace(file_token, new_token);
-  return &namespace_tokens_.find(file_token)->second;
+  return inserted.first->second;
+}
+
+void KytheGraphObserver::EmitBuiltinNodes(KytheGraphRecorder *recorder) {
+  const auto &table = GetBuiltinTable();
+  for (const auto &builtin : table.builtins) {
+    EmitBuiltinSpec(recorder, builtin, NodeKindID::kBuiltin);
+  }
+  for (const auto &meta : table.meta_nodes) {
+    EmitBuiltinSpec(recorder, meta, NodeKindID::kMeta);
+  }
+}
+
+namespace {
+/// \return an estimate of the bytes a node-based set or map has allocated,
+/// given the bytes of each node's links.
+template <typename Container>
+size_t NodeContainerBytes(const Container &C, size_t LinkBytes) {
+  return C.size() * (sizeof(typename Container::value_type) + LinkBytes);
+}
+
+/// \return an estimate of the bytes an `std::unordered_set` has allocated.
+template <typename Set> size_t UnorderedSetBytes(const Set &S) {
+  // A next pointer and a cached hash per node and a pointer per bucket.
+  return NodeContainerBytes(S, 2 * sizeof(void *)) +
+         S.bucket_count() * sizeof(void *);
+}
+}  // anonymous namespace
+
+size_t KytheGraphObserver::allocatedBytes() const {
+  // Tree nodes have three pointers and a color.
+  const size_t TreeLinks = 4 * sizeof(void *);
+  size_t Bytes = written_docs_.allocatedBytes() +
+                 written_types_.allocatedBytes() +
+                 written_namespaces_.allocatedBytes() +
+                 recorded_namespaces_.getMemorySize() +
+                 UnorderedSetBytes(type_nodes_) +
+                 claimed_strings_.getMemorySize() +
+                 UnorderedSetBytes(recorded_files_) +
+                 UnorderedSetBytes(deferred_anchors_) +
+                 UnorderedSetBytes(range_edges_) +
+                 claim_checked_files_.getMemorySize() +
+                 expansion_locs_.getMemorySize() +
+                 namespace_tokens_.getMemorySize() +
+                 anchor_file_vnames_.getMemorySize() +
+                 file_entry_vnames_.getMemorySize() +
+                 UnorderedSetBytes(transitively_reached_through_header_) +
+                 UnorderedSetBytes(context_ids_) +
+                 UnorderedSetBytes(context_files_) +
+                 file_contexts_.getMemorySize() +
+                 include_contexts_.getMemorySize() +
+                 contexts_.capacity() * sizeof(void *) +
+                 NodeContainerBytes(prefetched_claims_, TreeLinks) +
+                 NodeContainerBytes(missing_builtins_, TreeLinks);
+  for (const auto *Storage :
+       {&anchor_file_vname_storage_, &file_entry_vname_storage_}) {
+    for (const auto &VName : *Storage) {
+      Bytes += VName.SpaceUsed();
+    }
+  }
+  for (const auto &Node : type_nodes_) {
+    Bytes += Node.first.capacity() * sizeof(void *);
+  }
+  for (const auto &Claimed : claimed_string_storage_) {
+    Bytes += sizeof(Claimed) + Claimed.capacity();
+  }
+  for (const auto &Context : context_ids_) {
+    Bytes += Context.first.capacity();
+  }
+  Bytes += (claim_checked_file_storage_.size() +
+            namespace_token_storage_.size()) *
+               sizeof(KytheClaimToken) +
+           claimed_file_specific_tokens_.size() *
+               sizeof(decltype(claimed_file_specific_tokens_)::value_type);
+  Bytes += (pending_header_fingerprints_.capacity() +
+            pending_instantiation_fingerprints_.capacity()) *
+           HashCache::kHashSize;
+  return Bytes;
 }
 
 void KytheGraphObserver::RegisterBuiltins() {
-  auto RegisterBuiltin = [&](const std::string &name,
-                             const MarkedSource &marked_source) {
-    builtins_.emplace(std::make_pair(
-        name, Builtin{NodeId::CreateUncompressed(getDefaultClaimToken(),
-                                                 name + "#builtin"),
-                      marked_source, false}));
-  };
-  auto RegisterTokenBuiltin = [&](const std::string &name,
-                                  const std::string &token) {
-    MarkedSource sig;
-    sig.set_kind(MarkedSource::IDENTIFIER);
-    sig.set_pre_text(token);
-    RegisterBuiltin(name, sig);
-  };
-  RegisterTokenBuiltin("void", "void");
-  RegisterTokenBuiltin("bool", "bool");
-  RegisterTokenBuiltin("_Bool", "_Bool");
-  RegisterTokenBuiltin("signed char", "signed char");
-  RegisterTokenBuiltin("char", "char");
-  RegisterTokenBuiltin("char16_t", "char16_t");
-  RegisterTokenBuiltin("char32_t", "char32_t");
-  RegisterTokenBuiltin("wchar_t", "wchar_t");
-  RegisterTokenBuiltin("short", "short");
-  RegisterTokenBuiltin("int", "int");
-  RegisterTokenBuiltin("long", "long");
-  RegisterTokenBuiltin("long long", "long long");
-  RegisterTokenBuiltin("unsigned char", "unsigned char");
-  RegisterTokenBuiltin("unsigned short", "unsigned short");
-  RegisterTokenBuiltin("unsigned int", "unsigned int");
-  RegisterTokenBuiltin("unsigned long", "unsigned long");
-  RegisterTokenBuiltin("unsigned long long", "unsigned long long");
-  RegisterTokenBuiltin("float", "float");
-  RegisterTokenBuiltin("double", "double");
-  RegisterTokenBuiltin("long double", "long double");
-  RegisterTokenBuiltin("nullptr_t", "nullptr_t");
-  RegisterTokenBuiltin("<dependent type>", "dependent");
-  RegisterTokenBuiltin("auto", "auto");
-  RegisterTokenBuiltin("knrfn", "function");
-  RegisterTokenBuiltin("__int128", "__int128");
-  RegisterTokenBuiltin("unsigned __int128", "unsigned __int128");
-  RegisterTokenBuiltin("SEL", "SEL");
-  RegisterTokenBuiltin("id", "id");
-  RegisterTokenBuiltin("TypeUnion", "TypeUnion");
-
-  MarkedSource lhs_tycon_builtin;
-  auto *lhs_tycon = lhs_tycon_builtin.add_child();
-  auto *lookup = lhs_tycon_builtin.add_child();
-  lookup->set_kind(MarkedSource::LOOKUP_BY_PARAM);
-  lookup->set_lookup_index(1);
-  lhs_tycon->set_kind(MarkedSource::IDENTIFIER);
-  lhs_tycon->set_pre_text("const ");
-  RegisterBuiltin("const", lhs_tycon_builtin);
-  lhs_tycon->set_pre_text("volatile ");
-  RegisterBuiltin("volatile", lhs_tycon_builtin);
-  lhs_tycon->set_pre_text("restrict ");
-  RegisterBuiltin("restrict", lhs_tycon_builtin);
-
-  MarkedSource rhs_tycon_builtin;
-  lookup = rhs_tycon_builtin.add_child();
-  auto *rhs_tycon = rhs_tycon_builtin.add_child();
-  lookup->set_kind(MarkedSource::LOOKUP_BY_PARAM);
-  lookup->set_lookup_index(1);
-  rhs_tycon->set_kind(MarkedSource::IDENTIFIER);
-  rhs_tycon->set_pre_text("*");
-  RegisterBuiltin("ptr", rhs_tycon_builtin);
-  rhs_tycon->set_pre_text("&");
-  RegisterBuiltin("lvr", rhs_tycon_builtin);
-  rhs_tycon->set_pre_text("&&");
-  RegisterBuiltin("rvr", rhs_tycon_builtin);
-  rhs_tycon->set_pre_text("[incomplete]");
-  RegisterBuiltin("iarr", rhs_tycon_builtin);
-  rhs_tycon->set_pre_text("[const]");
-  RegisterBuiltin("carr", rhs_tycon_builtin);
-  rhs_tycon->set_pre_text("[dependent]");
-  RegisterBuiltin("darr", rhs_tycon_builtin);
-
-  MarkedSource function_tycon_builtin;
-  auto *return_type = function_tycon_builtin.add_child();
-  return_type->set_kind(MarkedSource::LOOKUP_BY_PARAM);
-  return_type->set_lookup_index(1);
-  auto *args = function_tycon_builtin.add_child();
-  args->set_kind(MarkedSource::PARAMETER_LOOKUP_BY_PARAM);
-  args->set_pre_text("(");
-  args->set_post_child_text(", ");
-  args->set_post_text(")");
-  args->set_lookup_index(2);
-  RegisterBuiltin("fn", function_tycon_builtin);
-  auto *vararg_keyword = function_tycon_builtin.add_child();
-  vararg_keyword->set_kind(MarkedSource::IDENTIFIER);
-  vararg_keyword->set_pre_text("vararg");
-  RegisterBuiltin("fnvararg", function_tycon_builtin);
-}
-
-void KytheGraphObserver::EmitBuiltin(Builtin *builtin) {
-  builtin->emitted = true;
-  VNameRef ref(VNameRefFromNodeId(builtin->node_id));
-  recorder_->AddProperty(ref, NodeKindID::kBuiltin);
-  recorder_->AddMarkedSource(ref, builtin->marked_source);
+  const auto &table = GetBuiltinTable();
+  builtin_ids_.reserve(table.builtins.size());
+  for (const auto &builtin : table.builtins) {
+    builtin_ids_.push_back(
+        NodeId::CreateUncompressed(getDefaultClaimToken(), builtin.identity));
+  }
+  builtins_emitted_.assign(table.builtins.size(), false);
 }
 
 void KytheGraphObserver::EmitMetaNodes() {
-  auto EmitNode = [&](const std::string &name,
-                      const MarkedSource &marked_source) {
-    auto id =
-        NodeId::CreateUncompressed(getDefaultClaimToken(), name + "#meta");
-    VNameRef ref(VNameRefFromNodeId(id));
-    recorder_->AddProperty(ref, NodeKindID::kMeta);
-    recorder_->AddMarkedSource(ref, marked_source);
-  };
-  MarkedSource tapp_signature;
-  auto *ctor_lookup = tapp_signature.add_child();
-  ctor_lookup->set_kind(MarkedSource::LOOKUP_BY_PARAM);
-  ctor_lookup->set_lookup_index(0);
-  auto *tapp_body = tapp_signature.add_child();
-  tapp_body->set_kind(MarkedSource::PARAMETER_LOOKUP_BY_PARAM_WITH_DEFAULTS);
-  tapp_body->set_pre_text("<");
-  tapp_body->set_lookup_index(1);
-  tapp_body->set_post_child_text(", ");
-  tapp_body->set_post_text(">");
-  EmitNode("tapp", tapp_signature);
+  for (const auto &meta : GetBuiltinTable().meta_nodes) {
+    EmitBuiltinSpec(recorder_, meta, NodeKindID::kMeta);
+  }
+}
+
+void KytheGraphObserver::AssumeBuiltinsEmitted() {
+  builtins_emitted_.assign(builtins_emitted_.size(), true);
 }
 
 void *KytheClaimToken::clazz_ = nullptr;
@@ -17,20 +17,31 @@
 #ifndef KYTHE_CXX_INDEXER_CXX_KYTHE_GRAPH_OBSERVER_H_
 #define KYTHE_CXX_INDEXER_CXX_KYTHE_GRAPH_OBSERVER_H_
 
+#include <array>
+#include <deque>
 #include <functional>
+#include <map>
 #include <unordered_map>
 #include <unordered_set>
 #include <utility>
+#include <vector>
 
 #include "glog/logging.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/DenseSet.h"
+#include "llvm/ADT/Hashing.h"
+#include "llvm/ADT/SmallString.h"
 
 #include "GraphObserver.h"
 #include "kythe/cxx/common/indexing/KytheClaimClient.h"
 #include "kythe/cxx/common/indexing/KytheGraphRecorder.h"
+#include "kythe/cxx/common/indexing/KytheOutputStream.h"
 #include "kythe/cxx/common/indexing/KytheVFS.h"
 #include "kythe/cxx/common/kythe_metadata_file.h"
 #include "kythe/cxx/common/language.h"
+#include "kythe/cxx/common/vname_ordering.h"
 #include "kythe/cxx/indexer/cxx/IndexerASTHooks.h"
+#include "kythe/cxx/indexer/cxx/dedup_set.h"
 #include "kythe/proto/storage.pb.h"
 
 namespace kythe {
@@ -132,7 +143,11 @@ class KytheClaimToken : public GraphObserver::ClaimToken {
 
 /// \brief Records details in the form of Kythe nodes and edges about elements
 /// discovered during indexing to the provided `KytheGraphRecorder`.
-class KytheGraphObserver : public GraphObserver {
+///
+/// The class is final so that the observer's calls to its own record and
+/// claim methods, and calls made through a `KytheGraphObserver` pointer,
+/// are direct and can be inlined.
+class KytheGraphObserver final : public GraphObserver {
  public:
   KytheGraphObserver(KytheGraphRecorder *recorder, KytheClaimClient *client,
                      const MetadataSupports *meta_supports,
@@ -146,9 +161,23 @@ class KytheGraphObserver : public GraphObserver {
     type_token_.set_rough_claimed(true);
     ReportProfileEvent = std::move(ReportProfileEventCallback);
     RegisterBuiltins();
-    EmitMetaNodes();
   }
 
+  /// \brief Emits every known builtin and meta node to `recorder`.
+  ///
+  /// These nodes are the same for every compilation unit. A caller that
+  /// emits them once per output stream should call `AssumeBuiltinsEmitted`
+  /// on each observer writing to that stream.
+  static void EmitBuiltinNodes(KytheGraphRecorder *recorder);
+
+  /// \brief Emits the meta nodes. Unless `AssumeBuiltinsEmitted` is used,
+  /// this should be called once per compilation unit.
+  void EmitMetaNodes();
+
+  /// \brief Don't emit known builtins (or meta nodes), since
+  /// `EmitBuiltinNodes` has already written them to the output.
+  void AssumeBuiltinsEmitted();
+
   NodeId getNodeIdForBuiltinType(const llvm::StringRef &spelling) override;
 
   const KytheClaimToken *getDefaultClaimToken() const override {
@@ -158,7 +187,31 @@ class KytheGraphObserver : public GraphObserver {
   void applyMetadataFile(clang::FileID ID, const clang::FileEntry *FE) override;
   void StopDeferringNodes() { deferring_nodes_ = false; }
   void DropRedundantWraiths() { drop_redundant_wraiths_ = true; }
+  /// \brief Bounds the memory used to remember which anchor ranges (and,
+  /// with `DropRedundantWraiths`, which range edges) have been written.
+  ///
+  /// Once `limit` ranges are remembered they're all forgotten, so a range
+  /// seen again afterwards is written again. The repeats are exact duplicates
+  /// of earlier entries, so the set of entries produced doesn't change.
+  /// \param limit The number of ranges to remember, or 0 to remember them
+  /// until the end of the unit.
+  void set_range_dedup_limit(size_t limit) { range_dedup_limit_ = limit; }
+  /// \brief Remembers the doc, type and namespace nodes already written by
+  /// fingerprint instead of by name. Call before recording any nodes.
+  /// \param bits 0 to remember names exactly, or 64 or 128.
+  /// \sa DedupSet
+  void set_dedup_fingerprint_bits(unsigned bits) {
+    written_docs_ = DedupSet(bits);
+    written_types_ = DedupSet(bits);
+    written_namespaces_ = DedupSet(bits);
+  }
+  /// \return an estimate of the bytes held by the observer's dedup sets and
+  /// caches. The sizes of nodes' strings aren't counted.
+  size_t allocatedBytes() const;
   void Delimit() override { recorder_->PushEntryGroup(); }
+  /// \brief With `set_group_entries_by_file`, pushes a group for the file
+  /// whose claim token covers `loc`; otherwise, like `Delimit`.
+  void DelimitAt(clang::SourceLocation loc) override;
   void Undelimit() override { recorder_->PopEntryGroup(); }
 
   NodeId recordTappNode(const NodeId &TyconId,
@@ -173,18 +226,18 @@ class KytheGraphObserver : public GraphObserver {
   NodeId recordTypeAliasNode(
       const NameId &AliasName, const NodeId &AliasedType,
       const MaybeFew<NodeId> &RootAliasedType,
-      const MaybeFew<MarkedSource> &MarkedSource) override;
+      const LazyMarkedSource &MarkedSource) override;
 
   void recordFunctionNode(const NodeId &Node, Completeness FunctionCompleteness,
                           FunctionSubkind Subkind,
-                          const MaybeFew<MarkedSource> &MarkedSource) override;
+                          const LazyMarkedSource &MarkedSource) override;
 
   void recordAbsVarNode(const NodeId &Node) override;
 
   void recordAbsNode(const NodeId &Node) override;
 
   void recordMarkedSource(const NodeId &Node,
-                          const MaybeFew<MarkedSource> &MarkedSource) override;
+                          const LazyMarkedSource &MarkedSource) override;
 
   void recordLookupNode(const NodeId &Node,
                         const llvm::StringRef &Name) override;
@@ -193,11 +246,11 @@ class KytheGraphObserver : public GraphObserver {
                        const NodeId &ParamNode) override;
 
   void recordInterfaceNode(const NodeId &Node,
-                           const MaybeFew<MarkedSource> &MarkedSource) override;
+                           const LazyMarkedSource &MarkedSource) override;
 
   void recordRecordNode(const NodeId &Node, RecordKind Kind,
                         Completeness RecordCompleteness,
-                        const MaybeFew<MarkedSource> &MarkedSource) override;
+                        const LazyMarkedSource &MarkedSource) override;
 
   void recordEnumNode(const NodeId &Node, Completeness Compl,
                       EnumKind Kind) override;
@@ -208,7 +261,7 @@ class KytheGraphObserver : public GraphObserver {
   NodeId nodeIdForNominalTypeNode(const NameId &TypeName) override;
 
   NodeId recordNominalTypeNode(const NameId &TypeName,
-                               const MaybeFew<MarkedSource> &MarkedSource,
+                               const LazyMarkedSource &MarkedSource,
                                const NodeId *Parent) override;
 
   void recordCategoryExtendsEdge(const NodeId &InheritingNodeId,
@@ -223,10 +276,10 @@ class KytheGraphObserver : public GraphObserver {
 
   void recordVariableNode(const NodeId &DeclNode, Completeness VarCompleteness,
                           VariableSubkind Subkind,
-                          const MaybeFew<MarkedSource> &MarkedSource) override;
+                          const LazyMarkedSource &MarkedSource) override;
 
   void recordNamespaceNode(const NodeId &DeclNode,
-                           const MaybeFew<MarkedSource> &MarkedSource) override;
+                           const LazyMarkedSource &MarkedSource) override;
 
   void recordUserDefinedNode(const NodeId &Id, const llvm::StringRef &NodeKind,
                              Completeness Compl) override;
@@ -297,6 +350,8 @@ class KytheGraphObserver : public GraphObserver {
   void recordIncludesRange(const Range &SourceRange,
                            const clang::FileEntry *File) override;
 
+  void recordUnitDiagnostic(const std::string &Message) override;
+
   void recordBoundQueryRange(const Range &SourceRange,
                              const NodeId &MacroId) override;
 
@@ -344,6 +399,103 @@ class KytheGraphObserver : public GraphObserver {
     starting_context_ = context;
   }
 
+  /// \brief Skips claimed headers that were already indexed by earlier runs.
+  ///
+  /// Once this is set, `pushFile` fingerprints each header it claims by its
+  /// content and its context-amended VName. A header whose fingerprint is in
+  /// `fingerprints` is treated as unclaimed, so none of its entries are
+  /// emitted. The fingerprints of the other claimed headers are held until
+  /// `RecordHeaderFingerprints` is called.
+  /// \param fingerprints The store to consult, or null to claim as usual.
+  void set_header_fingerprints(HashCache *fingerprints) {
+    header_fingerprints_ = fingerprints;
+  }
+
+  /// \brief Adds the fingerprints of the headers this observer indexed to the
+  /// store passed to `set_header_fingerprints`. Call this only once the
+  /// headers' entries have been emitted successfully.
+  void RecordHeaderFingerprints();
+
+  /// \brief Skips implicit template instantiations that were already
+  /// indexed by earlier runs.
+  ///
+  /// Once this is set, `claimImplicitNode` and `claimBatch` fingerprint each
+  /// implicit node they claim by its identifier, which distinguishes between
+  /// instantiations with different arguments. A node whose fingerprint is in
+  /// `fingerprints` is treated as unclaimed, so its subtree isn't traversed.
+  /// The fingerprints of the other claimed nodes are held until
+  /// `RecordInstantiationFingerprints` is called.
+  /// \param fingerprints The store to consult, or null to claim as usual.
+  void set_instantiation_fingerprints(HashCache *fingerprints) {
+    instantiation_fingerprints_ = fingerprints;
+  }
+
+  /// \brief Adds the fingerprints of the implicit nodes this observer
+  /// claimed to the store passed to `set_instantiation_fingerprints`. Call
+  /// this only once their entries have been emitted successfully.
+  void RecordInstantiationFingerprints();
+
+  /// \brief Indexes at most `limit` distinct implicit instantiations of each
+  /// primary template (or all of them if `limit` is 0).
+  ///
+  /// Each instantiation hashes to one of `limit` slots for its template and
+  /// is indexed only if it wins that slot, which it claims through the claim
+  /// client. With a claim client shared by the whole corpus (such as a
+  /// dynamic claim cache) the limit is corpus-wide; otherwise it applies to
+  /// each observer. Fewer than `limit` instantiations may be indexed when
+  /// several hash to the same slot.
+  void set_instantiation_sample_limit(size_t limit) {
+    instantiation_sample_limit_ = limit;
+  }
+
+  /// \brief Claims the context-amended VNames of files that this observer
+  /// expects to enter, all at once.
+  ///
+  /// `pushFile` uses these results instead of asking the claim client about
+  /// each file as the preprocessor reaches it. VNames that no file turns out
+  /// to have are claimed but never indexed.
+  void PrefetchFileClaims(const std::vector<kythe::proto::VName> &vnames);
+
+  /// \brief Claims files by their content digests and preprocessor contexts
+  /// (see `ContentClaimable`) instead of by their context-amended VNames,
+  /// so that identical copies of a file are indexed once.
+  ///
+  /// A unit that loses the claim on a file's content still emits that
+  /// file's node if it wins the claim on the file's own VName, so every
+  /// copy keeps its path and text.
+  void set_claim_by_content(bool value) { claim_by_content_ = value; }
+
+  /// \brief Claims only the unit's main source file, as though every file it
+  /// includes were claimed by another unit.
+  ///
+  /// This is for reindexing a unit whose main file changed when its headers
+  /// were already indexed: only the main file's anchors and the nodes they
+  /// define are emitted, with edges to the (unclaimed) header nodes they use.
+  void set_main_file_only(bool value) { main_file_only_ = value; }
+
+  /// \brief Groups entries by the file whose claim token covers the
+  /// declaration they were recorded for, rather than by how declarations
+  /// nest, so that each buffer the output stream hashes holds a single
+  /// file's entries and a header that doesn't change between units
+  /// deduplicates whole.
+  /// \sa KytheOutputStream::PushFileBuffer
+  void set_group_entries_by_file(bool value) {
+    group_entries_by_file_ = value;
+  }
+
+  /// \brief Records that the file with VName `vname` has content with the
+  /// lowercase hex SHA-256 digest `digest`.
+  void AddFileDigest(const kythe::proto::VName &vname,
+                     const std::string &digest) {
+    file_digests_[vname] = digest;
+  }
+
+  /// \return the claimable for the file with VName `vname` entered in
+  /// `context`: `vname` amended with `context`, or the file's content
+  /// claimable if we're claiming by content and know its digest.
+  kythe::proto::VName FileClaimable(const kythe::proto::VName &vname,
+                                    const PreprocessorContext &context) const;
+
   KytheClaimToken *getClaimTokenForLocation(
       const clang::SourceLocation L) override;
 
@@ -364,15 +516,21 @@ class KytheGraphObserver : public GraphObserver {
 
   bool claimBatch(std::vector<std::pair<std::string, bool>> *pairs) override;
 
+  size_t instantiationSampleLimit() override {
+    return instantiation_sample_limit_;
+  }
+
+  bool claimInstantiationSample(const std::string &primary_identifier,
+                                const std::string &identifier) override;
+
   void iterateOverClaimedFiles(
       std::function<bool(clang::FileID, const NodeId &)> iter) override;
 
  private:
   void AddMarkedSource(const VNameRef &vname,
-                       const MaybeFew<MarkedSource> &signature) {
-    if (signature) {
-      recorder_->AddMarkedSource(vname, signature.primary());
-    }
+                       const LazyMarkedSource &signature) {
+    recorder_->AddMarkedSource(vname,
+                               [&signature] { return signature.serialize(); });
   }
 
   void RecordSourceLocation(const VNameRef &vname,
@@ -392,10 +550,55 @@ class KytheGraphObserver : public GraphObserver {
   void AppendFileBufferSliceHashToStream(clang::SourceLocation loc,
                                          llvm::raw_ostream &Ostream);
 
+  /// \brief The VName of an anchor.
+  ///
+  /// Anchors are the majority of the entries we emit, so their VNames are
+  /// built without allocating: the signature is kept inline and the other
+  /// fields refer to VNames cached by the `KytheGraphObserver`.
+  class AnchorVName {
+   public:
+    AnchorVName() = default;
+    AnchorVName(const AnchorVName &) = delete;
+    AnchorVName &operator=(const AnchorVName &) = delete;
+
+    /// \return the VName, which is valid as long as this `AnchorVName` and
+    /// the `KytheGraphObserver` that filled it in.
+    const VNameRef &ref() const { return vname_; }
+
+   private:
+    friend class KytheGraphObserver;
+    /// The VName; its signature refers to `signature_` or `compressed_`.
+    VNameRef vname_;
+    /// The signature before compression.
+    llvm::SmallString<64> signature_;
+    /// The signature after compression, if it was too long to use as-is.
+    char compressed_[kCompressedStringLength];
+  };
+
   VNameRef VNameRefFromNodeId(const GraphObserver::NodeId &node_id);
-  kythe::proto::VName VNameFromFileEntry(const clang::FileEntry *file_entry);
+  /// \return `node_id.ToClaimedString()`, which is only built the first time
+  /// it's asked for. The reference is valid for the lifetime of this
+  /// observer.
+  const std::string &ClaimedString(const GraphObserver::NodeId &node_id);
+  /// \brief Sets `type_node_key_` to the key of the tapp of `tycon` to
+  /// `params` (or, if `tycon` is null, of the tsigma of `params`).
+  /// \return the node from `type_nodes_` for that key, or null.
+  const NodeId *FindTypeNode(const NodeId *tycon,
+                             const std::vector<const NodeId *> &params);
+  /// \brief Makes a type node with `identity` and remembers it under
+  /// `type_node_key_`.
+  NodeId RememberTypeNode(llvm::StringRef identity);
+  /// \return the VName of `file_entry`. The reference is valid for the
+  /// lifetime of this observer.
+  const kythe::proto::VName &VNameFromFileEntry(
+      const clang::FileEntry *file_entry);
   kythe::proto::VName ClaimableVNameFromFileID(const clang::FileID &file_id);
-  kythe::proto::VName VNameFromRange(const GraphObserver::Range &range);
+  /// \brief Fills in `anchor_name` with the VName of the anchor for `range`.
+  void VNameFromRange(const GraphObserver::Range &range,
+                      AnchorVName *anchor_name);
+  /// \return the VName of the file `file_id`, without a signature or
+  /// language, or null if `file_id` has no `FileEntry`. Cached per FileID.
+  const kythe::proto::VName *AnchorFileVName(clang::FileID file_id);
   void RecordAnchor(const GraphObserver::Range &source_range,
                     const GraphObserver::NodeId &primary_anchored_to,
                     EdgeKindID anchor_edge_kind, Claimability claimability);
@@ -403,7 +606,7 @@ class KytheGraphObserver : public GraphObserver {
                     const kythe::proto::VName &primary_anchored_to,
                     EdgeKindID anchor_edge_kind, Claimability claimability);
   /// Records a Range.
-  void RecordRange(const proto::VName &range_vname,
+  void RecordRange(const VNameRef &range_vname,
                    const GraphObserver::Range &range);
   /// Execute metadata actions for `defines` edges.
   void MetaHookDefines(const MetadataFile &meta, const VNameRef &anchor,
@@ -417,7 +620,7 @@ class KytheGraphObserver : public GraphObserver {
              (std::hash<unsigned>()(
                   range.PhysicalRange.getEnd().getRawEncoding())
               << 1) ^
-             (std::hash<std::string>()(range.Context.getRawIdentity())) ^
+             range.Context.getIdentityHash() ^
              (range.Kind == Range::RangeKind::Physical
                   ? 0
                   : (range.Kind == Range::RangeKind::Wraith ? 1 : 2));
@@ -441,7 +644,7 @@ class KytheGraphObserver : public GraphObserver {
              (std::hash<unsigned>()(PhysicalRange.getEnd().getRawEncoding())
               << 1) ^
              (std::hash<unsigned>()(static_cast<unsigned>(EdgeKind))) ^
-             (std::hash<std::string>()(EdgeTarget.getRawIdentity()));
+             EdgeTarget.getIdentityHash();
     }
   };
 
@@ -449,6 +652,15 @@ class KytheGraphObserver : public GraphObserver {
     size_t operator()(const RangeEdge &range) const { return range.Hash; }
   };
 
+  struct UniqueIDHash {
+    size_t operator()(const llvm::sys::fs::UniqueID &uid) const {
+      return llvm::hash_combine(uid.getDevice(), uid.getFile());
+    }
+  };
+
+  /// Marks a file or context that has no entries in `include_contexts_`.
+  enum : unsigned { kNoContext = ~0u };
+
   /// A file we have entered but not left.
   struct FileState {
     PreprocessorContext context;     ///< The context for this file.
@@ -456,14 +668,21 @@ class KytheGraphObserver : public GraphObserver {
     kythe::proto::VName base_vname;  ///< The file's VName without context.
     llvm::sys::fs::UniqueID uid;     ///< The ID Clang uses for this file.
     bool claimed;                    ///< Whether we have claimed this file.
+    /// Whether this file was reached through a header file.
+    bool in_header = false;
+    /// The index of `context` in `contexts_`, or `kNoContext`.
+    unsigned context_id = kNoContext;
+    /// The index of this file in `context_files_`, or `kNoContext`.
+    unsigned context_file = kNoContext;
   };
   /// The files we have entered but not left.
   std::vector<FileState> file_stack_;
   /// A map from FileIDs to associated metadata.
-  std::multimap<clang::FileID, std::shared_ptr<MetadataFile>> meta_;
+  std::multimap<clang::FileID, std::shared_ptr<const MetadataFile>> meta_;
   /// All files that were ever reached through a header file, including header
   /// files themselves.
-  std::set<llvm::sys::fs::UniqueID> transitively_reached_through_header_;
+  std::unordered_set<llvm::sys::fs::UniqueID, UniqueIDHash>
+      transitively_reached_through_header_;
   /// A location in the main source file.
   clang::SourceLocation main_source_file_loc_;
   /// A claim token in the main source file.
@@ -473,25 +692,120 @@ class KytheGraphObserver : public GraphObserver {
   /// given include position. There will therefore be many FileIDs that map to
   /// one context + header pair; then, many context + header pairs may
   /// map to a single file's VName.
-  std::map<clang::FileID, KytheClaimToken> claim_checked_files_;
-  /// Tokens for files (independent of language) that we've claimed.
-  std::map<clang::FileID, KytheClaimToken> claimed_file_specific_tokens_;
+  llvm::DenseMap<clang::FileID, KytheClaimToken *> claim_checked_files_;
+  /// Storage for the values of `claim_checked_files_`. Elements never move.
+  std::deque<KytheClaimToken> claim_checked_file_storage_;
+  /// The FileID most recently found by `FindClaimCheckedFile`.
+  clang::FileID last_claim_checked_file_;
+  /// The token for `last_claim_checked_file_`.
+  KytheClaimToken *last_claim_checked_token_ = nullptr;
+  /// \return the token for `file` in `claim_checked_files_`, or null.
+  KytheClaimToken *FindClaimCheckedFile(clang::FileID file);
+  /// \return the file and offset where `loc` is expanded, as given by
+  /// `SourceManager::getDecomposedExpansionLoc`.
+  std::pair<clang::FileID, unsigned> DecomposeExpansionLoc(
+      clang::SourceLocation loc);
+  /// Maps from the raw encodings of macro locations to the file and offset
+  /// where they're expanded. Anchors in macro-heavy code resolve the same
+  /// expansion chains over and over.
+  llvm::DenseMap<unsigned, std::pair<clang::FileID, unsigned>>
+      expansion_locs_;
+  /// Tokens for files (independent of language) that we've claimed, in the
+  /// order in which they were claimed (which is also FileID order).
+  std::deque<std::pair<clang::FileID, KytheClaimToken>>
+      claimed_file_specific_tokens_;
   /// Maps from claim tokens to claim tokens with path and root dropped.
-  std::map<KytheClaimToken *, KytheClaimToken> namespace_tokens_;
+  llvm::DenseMap<const KytheClaimToken *, KytheClaimToken *> namespace_tokens_;
+  /// Storage for the values of `namespace_tokens_`. Elements never move.
+  std::deque<KytheClaimToken> namespace_token_storage_;
   /// The `KytheGraphRecorder` used to record graph data. Must not be null.
   KytheGraphRecorder *recorder_;
   /// A VName representing this `GraphObserver`'s claiming authority.
   kythe::proto::VName claimant_;
   /// The starting preprocessor context.
   PreprocessorContext starting_context_;
-  /// Maps from #include locations to the resulting preprocessor context.
-  using IncludeToContext = std::map<unsigned, PreprocessorContext>;
-  /// Maps from preprocessor contexts to context-specific records.
-  using ContextToIncludes = std::map<PreprocessorContext, IncludeToContext>;
-  /// Maps from file UID to its various context incarnations.
-  std::map<llvm::sys::fs::UniqueID, ContextToIncludes> path_to_context_data_;
+  /// \return the index of `context` in `contexts_`, adding it if needed.
+  unsigned InternContext(const PreprocessorContext &context);
+  /// \return the key in `file_contexts_` for the file `context_file` seen in
+  /// the context `context_id`.
+  static uint64_t FileContextKey(unsigned context_file, unsigned context_id) {
+    return (uint64_t(context_file) << 32) | context_id;
+  }
+  /// \return the key in `include_contexts_` for the #include at `offset` in
+  /// the file `context_file` when it's seen in the context `context_id`.
+  static std::pair<uint64_t, unsigned> IncludeContextKey(unsigned context_file,
+                                                         unsigned context_id,
+                                                         unsigned offset) {
+    return {FileContextKey(context_file, context_id), offset};
+  }
+  /// Maps from preprocessor contexts to their indices in `contexts_`.
+  std::unordered_map<PreprocessorContext, unsigned> context_ids_;
+  /// The keys of `context_ids_`, by index.
+  std::vector<const PreprocessorContext *> contexts_;
+  /// Maps from file UIDs that have context information to small indices.
+  std::unordered_map<llvm::sys::fs::UniqueID, unsigned, UniqueIDHash>
+      context_files_;
+  /// The file and context pairs (as built by `FileContextKey`) that have any
+  /// #includes.
+  llvm::DenseSet<uint64_t> file_contexts_;
+  /// Maps from #include locations (as built by `IncludeContextKey`) to the
+  /// index of the resulting preprocessor context.
+  llvm::DenseMap<std::pair<uint64_t, unsigned>, unsigned> include_contexts_;
   /// The `KytheClaimClient` used to reduce output redundancy. Not null.
   KytheClaimClient *client_;
+  /// \brief Fingerprints the header `entry` as claimed under `vname`.
+  /// \return true if the fingerprint was recorded by an earlier run.
+  bool HeaderFingerprintRecorded(const clang::FileEntry *entry,
+                                 const kythe::proto::VName &vname);
+  /// \brief Fingerprints the implicit node `identifier` as claimed.
+  /// \return true if the fingerprint was recorded by an earlier run.
+  bool InstantiationFingerprintRecorded(const std::string &identifier);
+  /// \brief Claims `vname` for a file, using `prefetched_claims_` if it can.
+  bool ClaimFile(const kythe::proto::VName &vname);
+  /// The results of `PrefetchFileClaims`.
+  std::map<kythe::proto::VName, bool, VNameLess> prefetched_claims_;
+  /// Whether files are claimed by content.
+  bool claim_by_content_ = false;
+  /// Whether to leave every file but the main source file unclaimed.
+  bool main_file_only_ = false;
+  /// Whether `DelimitAt` groups entries by file.
+  bool group_entries_by_file_ = false;
+  /// Maps from file VNames to the digests of their content.
+  std::map<kythe::proto::VName, std::string, VNameLess> file_digests_;
+  /// \brief Emits the node for `entry`, whose VName is `vname`, unless this
+  /// observer already has.
+  void RecordFileContent(const clang::FileEntry *entry,
+                         const kythe::proto::VName &vname);
+  /// The store of fingerprints for headers that have been indexed, or null.
+  HashCache *header_fingerprints_ = nullptr;
+  /// Fingerprints of the headers indexed by this observer that aren't yet in
+  /// `header_fingerprints_`.
+  std::vector<std::array<unsigned char, HashCache::kHashSize>>
+      pending_header_fingerprints_;
+  /// The store of fingerprints for implicit nodes that have been indexed, or
+  /// null.
+  HashCache *instantiation_fingerprints_ = nullptr;
+  /// Fingerprints of the implicit nodes claimed by this observer that aren't
+  /// yet in `instantiation_fingerprints_`.
+  std::vector<std::array<unsigned char, HashCache::kHashSize>>
+      pending_instantiation_fingerprints_;
+  /// The number of instantiations of each primary template to index, or 0.
+  size_t instantiation_sample_limit_ = 0;
+  /// Maps instantiations to whether they're in the sample.
+  std::unordered_map<std::string, bool> sampled_instantiations_;
+  /// Maps sample slot tokens this observer won to the instantiations that
+  /// won them.
+  std::unordered_map<std::string, std::string> instantiation_slots_;
+  /// Maps from FileIDs to the results of `AnchorFileVName`.
+  llvm::DenseMap<clang::FileID, const kythe::proto::VName *>
+      anchor_file_vnames_;
+  /// Storage for the values of `anchor_file_vnames_`. Elements never move.
+  std::deque<kythe::proto::VName> anchor_file_vname_storage_;
+  /// Maps from `FileEntry`s to the results of `VNameFromFileEntry`.
+  llvm::DenseMap<const clang::FileEntry *, const kythe::proto::VName *>
+      file_entry_vnames_;
+  /// Storage for the values of `file_entry_vnames_`. Elements never move.
+  std::deque<kythe::proto::VName> file_entry_vname_storage_;
   /// Contains the `FileEntry`s for files we have already recorded.
   /// These pointers are not owned by the `KytheGraphObserver`.
   std::unordered_set<const clang::FileEntry *> recorded_files_;
@@ -502,6 +816,9 @@ class KytheGraphObserver : public GraphObserver {
   /// A set of (source range, edge kind, target node) tuples, used if
   /// drop_redundant_wraiths_ is asserted.
   std::unordered_set<RangeEdge, ContextFreeRangeEdgeHash> range_edges_;
+  /// If nonzero, `deferred_anchors_` and `range_edges_` are cleared when they
+  /// reach this size.
+  size_t range_dedup_limit_ = 0;
   /// If true, anchors and edges from a given physical source location will
   /// be dropped if they were previously emitted from the same location
   /// with the same edge kind to the same target.
@@ -513,13 +830,41 @@ class KytheGraphObserver : public GraphObserver {
   /// redundantly), this will not obscure conflicting-fact errors.
   /// The set of doc nodes we've emitted so far (identified by
   /// `NodeId::ToString()`).
-  std::unordered_set<std::string> written_docs_;
+  DedupSet written_docs_;
   /// The set of type nodes we've emitted so far (identified by
   /// `NodeId::ToString()`).
-  std::unordered_set<std::string> written_types_;
+  DedupSet written_types_;
   /// The set of namespace nodes we've emitted so far (identified by
   /// `NodeId::ToString()`).
-  std::unordered_set<std::string> written_namespaces_;
+  DedupSet written_namespaces_;
+  /// The namespace nodes passed to `recordNamespaceNode` so far, by token and
+  /// interned identity. Every redeclaration of a namespace has the same pair,
+  /// so most calls are answered here without building a claimed string.
+  llvm::DenseSet<std::pair<const ClaimToken *, const std::string *>>
+      recorded_namespaces_;
+  /// \brief Hashes the keys of `type_nodes_`.
+  struct TypeNodeKeyHash {
+    size_t operator()(const std::vector<const void *> &key) const {
+      return llvm::hash_combine_range(key.begin(), key.end());
+    }
+  };
+  /// The tapp and tsigma nodes built so far, keyed by the token and interned
+  /// identity of each of their parts (with a null tycon for tsigmas). Parts
+  /// with the same tokens and identities always build the same identity, so
+  /// repeated types are answered here without building or compressing their
+  /// identity strings.
+  std::unordered_map<std::vector<const void *>, NodeId, TypeNodeKeyHash>
+      type_nodes_;
+  /// The key of the tapp or tsigma node being built.
+  std::vector<const void *> type_node_key_;
+  /// The claimed strings of nodes that are parts of other nodes' identities
+  /// (type parameters, wraith contexts and doc links), by token and interned
+  /// identity. A node that's a part of many others is only stamped once.
+  llvm::DenseMap<std::pair<const ClaimToken *, const std::string *>,
+                 const std::string *>
+      claimed_strings_;
+  /// Storage for the values of `claimed_strings_`.
+  std::deque<std::string> claimed_string_storage_;
   /// Whether to try and locally deduplicate nodes.
   bool deferring_nodes_ = true;
   /// \brief Enabled metadata import support.
@@ -530,23 +875,14 @@ class KytheGraphObserver : public GraphObserver {
   KytheClaimToken default_token_;
   /// The claim token to use for structural types.
   KytheClaimToken type_token_;
-  /// Information about builtin nodes.
-  struct Builtin {
-    /// This Builtin's NodeId.
-    NodeId node_id;
-    /// Marked source for this Builtin.
-    MarkedSource marked_source;
-    /// Whether this Builtin has been emitted.
-    bool emitted;
-  };
-  /// Add known Builtins to builtins_.
+  /// Create `NodeId`s for the known builtins.
   void RegisterBuiltins();
-  /// Emit a particular Builtin.
-  void EmitBuiltin(Builtin *builtin);
-  /// Emit entries for C++ meta nodes.
-  void EmitMetaNodes();
-  /// Registered builtins.
-  std::map<std::string, Builtin> builtins_;
+  /// The `NodeId`s of the known builtins, in the process-wide table's order.
+  std::vector<NodeId> builtin_ids_;
+  /// Whether each known builtin has been emitted.
+  std::vector<bool> builtins_emitted_;
+  /// Builtins we didn't know about, which are emitted when first seen.
+  std::map<std::string, NodeId> missing_builtins_;
 };
 
 }  // namespace kythe
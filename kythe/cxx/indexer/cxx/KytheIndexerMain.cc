@@ -22,25 +22,950 @@
 //   eg: indexer -i foo.cc -o foo.bin -- -DINDEXING
 //       indexer -i foo.cc | verifier foo.cc
 //       indexer some/index.kindex
+//       indexer --jobs=8 a.kindex b.kindex c.kindex
+
+#include <errno.h>
+#include <poll.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <unordered_set>
 
 #include "gflags/gflags.h"
+#include "glog/logging.h"
+#include "google/protobuf/io/zero_copy_stream_impl_lite.h"
 #include "google/protobuf/stubs/common.h"
+#include "kythe/cxx/common/indexing/KytheClaimClient.h"
+#include "kythe/cxx/common/indexing/KytheGraphRecorder.h"
 #include "kythe/cxx/common/indexing/frontend.h"
+#include "kythe/cxx/common/indexing/metrics_text.h"
 #include "kythe/cxx/common/protobuf_metadata_file.h"
+#include "kythe/cxx/common/remote_index_pack.h"
 #include "kythe/cxx/indexer/cxx/IndexerFrontendAction.h"
+#include "kythe/cxx/indexer/cxx/KytheGraphObserver.h"
+#include "kythe/cxx/indexer/cxx/heap_profile.h"
+#include "kythe/cxx/indexer/cxx/hot_decl_profiler.h"
+#include "kythe/cxx/indexer/cxx/indexer_profiler.h"
 #include "kythe/cxx/indexer/cxx/indexer_worklist.h"
+#include "kythe/cxx/indexer/cxx/memory_breakdown.h"
+#include "kythe/cxx/indexer/cxx/unit_cost_probe.h"
+#include "kythe/cxx/indexer/cxx/unit_report.h"
+#include "kythe/cxx/indexer/cxx/unit_teardown.h"
+#include "llvm/ADT/SmallString.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Path.h"
 
 DEFINE_bool(index_template_instantiations, true,
             "Index template instantiations.");
 DEFINE_bool(experimental_drop_instantiation_independent_data, false,
             "Don't emit template nodes and edges found to be "
             "instantiation-independent.");
+DEFINE_uint64(experimental_instantiation_sample_limit, 0,
+              "If nonzero, index at most this many distinct implicit "
+              "instantiations of each primary template. With "
+              "--experimental_dynamic_claim_cache the limit holds across the "
+              "corpus. Other instantiations keep only their nodes and their "
+              "edges to the template.");
+DEFINE_int32(experimental_dedup_fingerprint_bits, 0,
+             "Remember which nodes were written by 64- or 128-bit "
+             "fingerprints instead of by name (0 to use names).");
+DEFINE_uint64(experimental_range_dedup_limit, 0,
+              "If nonzero, forget which anchor ranges were written once this "
+              "many are remembered, bounding that memory on large units at "
+              "the cost of some duplicate entries.");
 DEFINE_bool(report_profiling_events, false,
             "Write profiling events to standard error.");
+DEFINE_bool(profile_units, false,
+            "Write a profile of each compilation unit, and of the whole run, "
+            "to standard error.");
+DEFINE_string(profile_trace_dir, "",
+              "Write a Chrome trace_event JSON file for each compilation unit "
+              "to this directory.");
+DEFINE_double(profile_trace_min_seconds, 0,
+              "With --profile_trace_dir, only write traces for compilation "
+              "units that took at least this long to index.");
+DEFINE_int32(profile_heap_depth, 0,
+             "Sample the allocator's heap statistics as profiled sections at "
+             "most this many levels deep are entered and left, and report how "
+             "much each section grew the heap in the profile and metrics (0 "
+             "to sample none). Build with --define allocator=tcmalloc or "
+             "jemalloc for statistics that scale past glibc's.");
+DEFINE_int32(heap_profile_signal, 0,
+             "On this signal (e.g. 10 for SIGUSR1), write a heap profile at "
+             "the next sampled section boundary or the end of a unit (0 to "
+             "not listen). Needs tcmalloc with HEAPPROFILE set or jemalloc "
+             "with MALLOC_CONF=prof:true.");
+DEFINE_bool(report_entry_accounting, false,
+            "Write a JSON line counting the entries and bytes emitted for each "
+            "fact and edge kind to standard error for each compilation unit, "
+            "and for the whole run.");
+DEFINE_bool(report_unit_memory, false,
+            "Write an estimate of the memory held by each of the indexer's "
+            "subsystems (the AST, parent map, dedup sets, marked source "
+            "cache, output buffers, VFS and so on) to standard error when "
+            "each compilation unit finishes or passes a unit limit.");
+DEFINE_int32(report_hot_decls, 0,
+             "Write this many top-level declarations and template "
+             "instantiations that took the longest to index, with the "
+             "entries they emitted and their locations, to standard error "
+             "for each compilation unit (0 to write none).");
+DEFINE_string(unit_report_file, "",
+              "Append a JSON line for each compilation unit to this file, "
+              "with the unit's VName and digest, time spent parsing, "
+              "traversing and emitting, peak RSS, declarations traversed, "
+              "entries by kind, hash cache hits, claims and VFS misses.");
+DEFINE_string(experimental_cost_probe_output, "",
+              "Instead of indexing, only preprocess each compilation unit and "
+              "append its token counts (claimed and unclaimed, per file) and "
+              "macro expansion counts to this file. Feed the file to "
+              "--experimental_cost_probes to schedule and balance later runs.");
+DEFINE_string(metrics_file, "",
+              "Keep this file up to date with the indexer's counters (units "
+              "and entries indexed, queue depth, cache and claim activity, "
+              "memory use and time per phase) in the Prometheus text format, "
+              "e.g. for node_exporter's textfile collector.");
+DEFINE_int32(metrics_period_s, 10,
+             "Rewrite --metrics_file after a unit finishes if this many "
+             "seconds have passed since it was last written.");
+DEFINE_string(experimental_keep_entry_kinds, "",
+              "If set, only emit entries of these comma-separated kinds (as "
+              "named by --report_entry_accounting).");
+DEFINE_string(experimental_drop_entry_kinds, "",
+              "Don't emit entries of these comma-separated kinds (as named by "
+              "--report_entry_accounting).");
 DEFINE_bool(experimental_index_lite, false,
             "Drop uncommonly-used data from the index.");
+DEFINE_bool(experimental_report_shared_preambles, false,
+            "Report how many units share their headers and preprocessor "
+            "context with an earlier unit.");
+DEFINE_bool(experimental_prefetch_claims, false,
+            "Claim all of a unit's files in one batch before indexing it.");
+DEFINE_bool(experimental_claim_by_content, false,
+            "Claim files by content digest and preprocessor context, so that "
+            "identical files at different paths are indexed once. Nodes "
+            "named after a file's path take the path of whichever copy was "
+            "indexed. Static claims must come from static_claim "
+            "--claim_by_content.");
+DEFINE_bool(experimental_skip_unclaimed_function_bodies, false,
+            "Don't parse the bodies of non-template functions in files that "
+            "another unit claims.");
+DEFINE_bool(experimental_interactive_reindex, false,
+            "With --experimental_serve_analysis_requests, index only the main "
+            "file of a request whose headers (by their digests, contexts and "
+            "the unit's arguments) an earlier request already indexed, "
+            "skipping the headers' function bodies. For editors that reindex "
+            "a file on every save.");
+DEFINE_bool(experimental_indexing_profile, false,
+            "Drop the build's warning flags and turn off diagnostic extras "
+            "(carets, fix-its, backtraces, typo correction) that the indexer "
+            "never reports.");
+DEFINE_uint64(experimental_unit_soft_time_limit_ms, 0,
+              "If nonzero, finish units that take longer than this in lite "
+              "mode without template instantiations.");
+DEFINE_uint64(experimental_unit_hard_time_limit_ms, 0,
+              "If nonzero, stop indexing units that take longer than this and "
+              "keep their partial output.");
+DEFINE_uint64(experimental_unit_soft_heap_limit_mb, 0,
+              "If nonzero, finish units in lite mode once the indexer has "
+              "allocated this much memory. Counts all --jobs.");
+DEFINE_uint64(experimental_unit_hard_heap_limit_mb, 0,
+              "If nonzero, stop indexing units once the indexer has allocated "
+              "this much memory. Counts all --jobs.");
+DEFINE_bool(experimental_dedup_entries, false,
+            "Drop entries that are exact duplicates of entries already "
+            "emitted for the same compilation unit.");
+DEFINE_bool(experimental_group_entries_by_file, false,
+            "Hash output for --cache deduplication in groups of entries for "
+            "a single claimed file rather than in groups that follow how "
+            "declarations nest, so unchanged headers deduplicate whole.");
+DEFINE_bool(experimental_emit_builtins_once, false,
+            "Emit builtin and meta nodes once at the start of the output "
+            "rather than once per compilation unit.");
+DEFINE_int32(experimental_claim_batch_size, 0,
+             "With --experimental_threaded_claiming, claim up to this many "
+             "deferred implicit declarations at once. 0 claims every "
+             "declaration deferred by a worklist pass in one batch.");
+DEFINE_bool(experimental_background_teardown, false,
+            "Free each unit's AST on a background thread while the next "
+            "unit is indexed.");
+DEFINE_bool(experimental_fork_workers, false,
+            "With --jobs, index each unit in a forked process that shares the "
+            "indexer's loaded state copy-on-write, so a crash only loses that "
+            "unit.");
+DEFINE_string(experimental_module_cache_path, "",
+              "If set, units built with modules keep the modules that clang "
+              "builds for them in this directory, and later units reuse them "
+              "instead of parsing their headers again. Modules are checked "
+              "against their headers' sizes only, so use a new directory for "
+              "each version of the source tree.");
+DEFINE_bool(experimental_use_include_resolutions, false,
+            "Resolve the includes that the extractor found on the angled or "
+            "system search paths with header maps rather than searching the "
+            "paths again.");
+DEFINE_int32(experimental_decl_shards, 1,
+             "Split each unit's top-level declarations into this many "
+             "shards, each indexed on its own thread from its own parse of "
+             "the unit. Output is written in shard order. For huge "
+             "generated files whose traversal dominates parsing.");
+DECLARE_bool(experimental_threaded_claiming);
+DECLARE_string(cache);
+DECLARE_string(experimental_dynamic_claim_cache);
+DECLARE_string(experimental_header_fingerprint_db);
+DECLARE_string(experimental_instantiation_fingerprint_db);
+DECLARE_string(experimental_hash_snapshot_out);
+DECLARE_int32(prefetch_units);
+DECLARE_string(index_pack);
+DECLARE_string(experimental_work_queue);
+DECLARE_bool(experimental_writer_thread);
+DECLARE_string(experimental_write_request_output);
 
 namespace kythe {
+namespace {
+
+/// \brief The profile of every job indexed so far.
+struct RunProfile {
+  /// Guards `profiler`, `entries` and `totals`.
+  std::mutex mutex;
+  /// The merged profiles of every job.
+  IndexerProfiler profiler;
+  /// The merged entry accounting of every job.
+  EntryAccounting entries{KytheGraphRecorder::AccountingCategories()};
+  /// If not null, where to write a `UnitReport` for each job.
+  UnitReportWriter *unit_reports = nullptr;
+  /// If not null, probe each job's cost instead of indexing it, and write
+  /// the probes here.
+  CostProbeWriter *cost_probes = nullptr;
+  /// If not null, where to export `totals` and the merged profile.
+  MetricsDump *metrics = nullptr;
+  /// \brief Totals over every job, kept for `metrics`.
+  struct Totals {
+    uint64_t units = 0;
+    uint64_t failed_units = 0;
+    double unit_seconds = 0;
+    /// These come from the `FileOutputStream`s jobs wrote to.
+    uint64_t output_bytes = 0;
+    uint64_t buffers_matched = 0;
+    uint64_t bytes_matched = 0;
+    uint64_t cache_stall_usec = 0;
+  } totals;
+  /// The number of jobs being indexed now.
+  std::atomic<size_t> active_jobs{0};
+  /// When the run started.
+  std::chrono::steady_clock::time_point start =
+      std::chrono::steady_clock::now();
+};
+
+/// \return the time spent in the profiled section at `path`, in seconds.
+double SectionSeconds(const IndexerProfiler &profiler,
+                      const std::string &path) {
+  const auto &sections = profiler.sections();
+  const auto section = sections.find(path);
+  return section == sections.end() ? 0 : section->second.InclusiveNanos / 1e9;
+}
+
+/// \brief Reports the profile of a single job and adds it to `run_profile`.
+void ReportJobProfile(const IndexerJob &job, const IndexerProfiler &profiler,
+                      RunProfile *run_profile) {
+  if (!FLAGS_profile_trace_dir.empty() &&
+      profiler.total_nanos() >= FLAGS_profile_trace_min_seconds * 1e9) {
+    std::string path = FLAGS_profile_trace_dir + "/unit_" +
+                       std::to_string(job.index) + ".json";
+    std::string error_text;
+    if (!profiler.WriteChromeTrace(path, &error_text)) {
+      fprintf(stderr, "Couldn't write trace %s: %s\n", path.c_str(),
+              error_text.c_str());
+    }
+  }
+  std::lock_guard<std::mutex> lock(run_profile->mutex);
+  if (FLAGS_profile_units) {
+    fprintf(stderr, "Profile for unit %zu (%s):\n%s", job.index,
+            job.unit->v_name().signature().c_str(), profiler.Summary().c_str());
+  }
+  run_profile->profiler.Merge(profiler);
+}
+
+/// \brief Reports the entries written for a single job and adds them to
+/// `run_profile`.
+void ReportJobEntries(const IndexerJob &job, const EntryAccounting &entries,
+                      RunProfile *run_profile) {
+  std::lock_guard<std::mutex> lock(run_profile->mutex);
+  fprintf(stderr, "{\"unit\":%zu,\"signature\":\"%s\",\"entries\":%s}\n",
+          job.index, job.unit->v_name().signature().c_str(),
+          entries.ToJson().c_str());
+  run_profile->entries.Merge(entries);
+}
+
+/// \brief Reports the hottest declarations of a single job.
+void ReportJobHotDecls(const IndexerJob &job, const HotDeclProfiler &hot_decls,
+                       RunProfile *run_profile) {
+  std::lock_guard<std::mutex> lock(run_profile->mutex);
+  fprintf(stderr, "Hot declarations for unit %zu (%s):\n%s", job.index,
+          job.unit->v_name().signature().c_str(), hot_decls.report().c_str());
+}
+
+/// \brief Reports the memory breakdown of a single job.
+void ReportJobMemory(const IndexerJob &job, const MemoryBreakdown &memory,
+                     RunProfile *run_profile) {
+  std::lock_guard<std::mutex> lock(run_profile->mutex);
+  fprintf(stderr, "Memory for unit %zu (%s):\n%s", job.index,
+          job.unit->v_name().signature().c_str(), memory.summary().c_str());
+}
+
+/// \return the metadata supports the indexer uses for each unit.
+std::unique_ptr<MetadataSupports> MakeMetaSupports() {
+  auto meta_supports = llvm::make_unique<MetadataSupports>();
+  meta_supports->Add(llvm::make_unique<ProtobufMetadataSupport>());
+  meta_supports->Add(llvm::make_unique<KytheMetadataSupport>());
+  return meta_supports;
+}
+
+/// \brief Indexes a single `job`, writing its entries to `output`.
+/// \param hash_cache The hash cache to deduplicate the entries with (usually
+/// `context.hash_cache()`), or null.
+/// \param run_profile If profiling was requested, collects the job's profile.
+/// \param elapsed_millis If not null, set to the time taken to index the job
+/// instead of recording it with `context`.
+/// \return empty if OK; otherwise, an error description.
+std::string IndexJob(IndexerJob *job, IndexerOptions options,
+                     const IndexerContext &context, HashCache *hash_cache,
+                     KytheOutputStream *output, RunProfile *run_profile,
+                     double *elapsed_millis = nullptr) {
+  options.EffectiveWorkingDirectory = job->working_directory;
+
+  // Unit reports and metrics take their phase times from the profile.
+  const bool report_unit = run_profile->unit_reports != nullptr;
+  const bool measure_unit = report_unit || run_profile->metrics != nullptr;
+  std::unique_ptr<IndexerProfiler> profiler;
+  if (FLAGS_profile_units || !FLAGS_profile_trace_dir.empty() ||
+      FLAGS_profile_heap_depth > 0 || measure_unit) {
+    profiler = llvm::make_unique<IndexerProfiler>();
+    profiler->set_record_trace(!FLAGS_profile_trace_dir.empty());
+    if (FLAGS_profile_heap_depth > 0) {
+      profiler->set_heap_sampler(
+          [](const char *label) {
+            DumpRequestedHeapProfile(label);
+            return AllocatedHeapBytes();
+          },
+          FLAGS_profile_heap_depth);
+    }
+    IndexerProfiler *job_profiler = profiler.get();
+    if (FLAGS_report_profiling_events) {
+      ProfilingCallback report = std::move(options.ReportProfileEvent);
+      options.ReportProfileEvent = [job_profiler, report](
+          const char *label, ProfilingEvent event) {
+        report(label, event);
+        job_profiler->Report(label, event);
+      };
+    } else {
+      options.ReportProfileEvent = job_profiler->callback();
+    }
+  }
+
+  std::unique_ptr<MetadataSupports> meta_supports = MakeMetaSupports();
+
+  UnitCostProbe probe;
+  if (run_profile->cost_probes != nullptr) {
+    options.CostProbe = &probe;
+  }
+  // Probes emit entries for files and macros, which are dropped.
+  NullOutputStream null_stream;
+  KytheOutputStream &job_output =
+      job->silent || options.CostProbe != nullptr
+          ? static_cast<KytheOutputStream &>(null_stream)
+          : *output;
+  EntryAccounting entries(KytheGraphRecorder::AccountingCategories());
+  if (FLAGS_report_entry_accounting || measure_unit) {
+    job_output.set_accounting(&entries);
+  }
+  UnitStats unit_stats;
+  std::unique_ptr<TimingOutputStream> timed_output;
+  FileOutputStream::Stats output_stats_before;
+  const auto *file_output = dynamic_cast<FileOutputStream *>(&job_output);
+  KytheClaimClient::Stats claim_stats_before;
+  if (measure_unit && file_output != nullptr) {
+    output_stats_before = file_output->stats_;
+  }
+  std::unique_ptr<HotDeclProfiler> hot_decls;
+  if (FLAGS_report_hot_decls > 0) {
+    hot_decls = llvm::make_unique<HotDeclProfiler>(FLAGS_report_hot_decls);
+    options.HotDecls = hot_decls.get();
+  }
+  if (report_unit || hot_decls) {
+    timed_output = llvm::make_unique<TimingOutputStream>(&job_output);
+  }
+  if (hot_decls) {
+    TimingOutputStream *timer = timed_output.get();
+    hot_decls->setEmitNanosCounter([timer] { return timer->nanos(); });
+  }
+  if (report_unit) {
+    options.Stats = &unit_stats;
+    claim_stats_before = context.claim_client()->stats();
+  }
+  KytheOutputStream &indexed_output =
+      timed_output ? *timed_output : job_output;
+  std::unique_ptr<MemoryBreakdown> memory;
+  if (FLAGS_report_unit_memory) {
+    memory = llvm::make_unique<MemoryBreakdown>();
+    options.Memory = memory.get();
+  }
+  std::string result;
+  ++run_profile->active_jobs;
+  auto start = std::chrono::steady_clock::now();
+  {
+    ProfileBlock block(options.ReportProfileEvent, "index_unit");
+    result = IndexCompilationUnit(
+        *job->unit, *job->virtual_files, job->mapped_files,
+        *context.claim_client(),
+        // A probe mustn't mark buffers as written.
+        options.CostProbe != nullptr ? nullptr : hash_cache,
+        indexed_output, options,
+        meta_supports.get(), [](IndexerASTVisitor *indexer) {
+          if (FLAGS_experimental_threaded_claiming) {
+            return IndexerWorklist::CreateClaimingWorklist(
+                indexer, std::max(FLAGS_experimental_claim_batch_size, 0));
+          }
+          return IndexerWorklist::CreateDefaultWorklist(indexer);
+        });
+  }
+  double millis = std::chrono::duration<double, std::milli>(
+                      std::chrono::steady_clock::now() - start)
+                      .count();
+  --run_profile->active_jobs;
+  if (elapsed_millis != nullptr) {
+    *elapsed_millis = millis;
+  } else if (options.CostProbe == nullptr) {
+    context.RecordJobCost(*job, millis);
+  }
+  if (options.CostProbe != nullptr && result.empty()) {
+    run_profile->cost_probes->Write(context.job_key(*job), probe);
+  }
+  if (FLAGS_report_entry_accounting || measure_unit) {
+    job_output.set_accounting(nullptr);
+  }
+  if (FLAGS_report_entry_accounting) {
+    ReportJobEntries(*job, entries, run_profile);
+  }
+  if (hot_decls) {
+    ReportJobHotDecls(*job, *hot_decls, run_profile);
+  }
+  if (memory) {
+    ReportJobMemory(*job, *memory, run_profile);
+  }
+  DumpRequestedHeapProfile("index_unit");
+  if (report_unit) {
+    UnitReport report;
+    report.Unit = job->unit->v_name();
+    report.Index = job->index;
+    report.Digest = UnitDigest(*job->unit);
+    report.Succeeded = result.empty();
+    const std::string invocation = "index_unit/run_invocation";
+    report.TraversalSeconds =
+        SectionSeconds(*profiler, invocation + "/traverse_tu");
+    report.ParseSeconds = std::max(
+        0.0, SectionSeconds(*profiler, invocation) - report.TraversalSeconds);
+    report.EmissionSeconds = timed_output->nanos() / 1e9;
+    report.TotalSeconds = millis / 1000;
+    report.PeakRssBytes = PeakRssBytes();
+    report.TraversedDecls = unit_stats.TraversedDecls;
+    report.EntriesJson = entries.ToJson();
+    if (file_output != nullptr) {
+      const auto &stats = file_output->stats_;
+      report.HashCacheHits =
+          stats.hashes_matched_ - output_stats_before.hashes_matched_;
+      report.HashCacheBytesMatched =
+          stats.bytes_matched_ - output_stats_before.bytes_matched_;
+    }
+    const auto claim_stats = context.claim_client()->stats();
+    report.ClaimRequests = claim_stats.requests - claim_stats_before.requests;
+    report.ClaimsRejected = claim_stats.rejected - claim_stats_before.rejected;
+    report.ClaimRoundTrips =
+        claim_stats.round_trips - claim_stats_before.round_trips;
+    report.ClaimRoundTripsSaved =
+        claim_stats.round_trips_saved - claim_stats_before.round_trips_saved;
+    report.VFSMisses = unit_stats.VFSMisses;
+    run_profile->unit_reports->Write(report);
+  }
+  if (profiler) {
+    ReportJobProfile(*job, *profiler, run_profile);
+  }
+  if (run_profile->metrics != nullptr) {
+    {
+      std::lock_guard<std::mutex> lock(run_profile->mutex);
+      auto &totals = run_profile->totals;
+      ++totals.units;
+      totals.failed_units += result.empty() ? 0 : 1;
+      totals.unit_seconds += millis / 1000;
+      if (file_output != nullptr) {
+        const auto &stats = file_output->stats_;
+        totals.output_bytes +=
+            stats.total_bytes_ - output_stats_before.total_bytes_;
+        totals.buffers_matched +=
+            stats.hashes_matched_ - output_stats_before.hashes_matched_;
+        totals.bytes_matched +=
+            stats.bytes_matched_ - output_stats_before.bytes_matched_;
+        totals.cache_stall_usec +=
+            stats.stall_usec_ - output_stats_before.stall_usec_;
+      }
+      if (!FLAGS_report_entry_accounting) {
+        run_profile->entries.Merge(entries);
+      }
+    }
+    std::string error_text;
+    if (!run_profile->metrics->MaybeWrite(&error_text)) {
+      fprintf(stderr, "Couldn't write metrics: %s\n", error_text.c_str());
+    }
+  }
+  return result;
+}
+
+/// \brief Adds the run's counters to `metrics`.
+void CollectMetrics(const IndexerContext &context, RunProfile *run_profile,
+                    MetricsText *metrics) {
+  const double uptime = std::chrono::duration<double>(
+                            std::chrono::steady_clock::now() -
+                            run_profile->start)
+                            .count();
+  metrics->AddGauge("kythe_indexer_uptime_seconds",
+                    "Time since the indexer started.", uptime);
+  metrics->AddGauge("kythe_indexer_active_units",
+                    "Compilation units being indexed now.",
+                    run_profile->active_jobs.load());
+  const auto depth = context.job_queue_depth();
+  metrics->AddGauge("kythe_indexer_queued_units",
+                    "Decoded compilation units waiting to be indexed.",
+                    depth.jobs);
+  metrics->AddGauge("kythe_indexer_queued_bytes",
+                    "File content held by the queued units.", depth.bytes);
+  metrics->AddGauge("kythe_indexer_resident_bytes",
+                    "The indexer's resident set size.", CurrentRssBytes());
+  metrics->AddGauge("kythe_indexer_peak_resident_bytes",
+                    "The indexer's peak resident set size.", PeakRssBytes());
+  HeapStats heap;
+  if (ReadHeapStats(&heap)) {
+    const MetricsText::Labels allocator = {{"allocator", HeapAllocatorName()}};
+    metrics->AddGauge("kythe_indexer_heap_allocated_bytes",
+                      "Heap bytes allocated and not yet freed.",
+                      heap.AllocatedBytes, allocator);
+    metrics->AddGauge("kythe_indexer_heap_bytes",
+                      "Heap bytes the allocator holds, including free "
+                      "blocks it keeps.",
+                      heap.HeapBytes, allocator);
+  }
+  if (HashCache *cache = context.hash_cache()) {
+    const auto stats = cache->stats();
+    const char *const help = "Hash cache lookups, by how they were answered.";
+    const std::pair<const char *, size_t> lookups[] = {
+        {"lru_hit", stats.lru_hits},
+        {"bloom_hit", stats.bloom_hits},
+        {"remote_hit", stats.remote_hits},
+        {"claimed_hit", stats.claimed_hits},
+        {"miss", stats.misses}};
+    for (const auto &lookup : lookups) {
+      metrics->AddCounter("kythe_indexer_hash_cache_lookups_total", help,
+                          lookup.second, {{"result", lookup.first}});
+    }
+  }
+  const auto claims = context.claim_client()->stats();
+  metrics->AddCounter("kythe_indexer_claims_total", "Claims decided.",
+                      claims.requests);
+  metrics->AddCounter("kythe_indexer_claims_rejected_total",
+                      "Claims that were rejected.", claims.rejected);
+  metrics->AddCounter("kythe_indexer_claim_round_trips_total",
+                      "Round trips made to the remote claim map.",
+                      claims.round_trips);
+  metrics->AddCounter("kythe_indexer_claim_round_trips_saved_total",
+                      "Round trips saved by claiming in batches.",
+                      claims.round_trips_saved);
+  if (!claims.latency_buckets.empty()) {
+    // The last bucket is unbounded.
+    std::vector<double> bounds;
+    for (size_t b = 0; b + 1 < claims.latency_buckets.size(); ++b) {
+      bounds.push_back((uint64_t(1) << b) / 1e6);
+    }
+    metrics->AddHistogram("kythe_indexer_claim_latency_seconds",
+                          "Round trips to the remote claim map.", bounds,
+                          claims.latency_buckets,
+                          claims.latency_buckets.back(),
+                          claims.latency_usec / 1e6);
+  }
+
+  std::lock_guard<std::mutex> lock(run_profile->mutex);
+  const auto &totals = run_profile->totals;
+  metrics->AddCounter("kythe_indexer_units_total",
+                      "Compilation units indexed.", totals.units);
+  metrics->AddCounter("kythe_indexer_unit_failures_total",
+                      "Compilation units that failed to index.",
+                      totals.failed_units);
+  metrics->AddCounter("kythe_indexer_unit_seconds_total",
+                      "Time spent indexing compilation units.",
+                      totals.unit_seconds);
+  metrics->AddCounter("kythe_indexer_output_bytes_total",
+                      "Bytes of entries produced, including those the hash "
+                      "cache dropped.",
+                      totals.output_bytes);
+  metrics->AddCounter("kythe_indexer_buffers_matched_total",
+                      "Entry buffers dropped because the hash cache had "
+                      "seen them.",
+                      totals.buffers_matched);
+  metrics->AddCounter("kythe_indexer_bytes_matched_total",
+                      "Bytes in the buffers the hash cache dropped.",
+                      totals.bytes_matched);
+  metrics->AddCounter("kythe_indexer_hash_cache_stall_seconds_total",
+                      "Time spent waiting for batched hash cache lookups.",
+                      totals.cache_stall_usec / 1e6);
+  const auto &entries = run_profile->entries;
+  for (size_t i = 0; i < entries.names().size(); ++i) {
+    const auto &counters = entries.counters()[i];
+    const MetricsText::Labels kind = {{"kind", entries.names()[i]}};
+    metrics->AddCounter("kythe_indexer_entries_total", "Entries emitted.",
+                        counters.entries, kind);
+    metrics->AddCounter("kythe_indexer_entry_bytes_total",
+                        "Bytes of entries emitted.", counters.bytes, kind);
+    metrics->AddCounter("kythe_indexer_dropped_entries_total",
+                        "Emitted entries the hash cache dropped.",
+                        counters.dropped_entries, kind);
+  }
+  for (const auto &section : run_profile->profiler.sections()) {
+    const MetricsText::Labels phase = {{"section", section.first}};
+    metrics->AddCounter("kythe_indexer_phase_seconds_total",
+                        "Time spent in each profiled section, including "
+                        "its children.",
+                        section.second.InclusiveNanos / 1e9, phase);
+    metrics->AddCounter("kythe_indexer_phase_calls_total",
+                        "Times each profiled section was entered.",
+                        section.second.Calls, phase);
+    if (section.second.HeapCalls != 0) {
+      metrics->AddGauge("kythe_indexer_phase_heap_growth_bytes",
+                        "Net heap allocated over the sampled calls of each "
+                        "profiled section (see --profile_heap_depth).",
+                        section.second.HeapGrowthBytes, phase);
+      metrics->AddGauge("kythe_indexer_phase_max_heap_bytes",
+                        "The most heap allocated as each profiled section "
+                        "was entered or left.",
+                        section.second.MaxHeapBytes, phase);
+    }
+  }
+}
+
+/// \brief Reports the result of indexing a job.
+/// \return true if the job was indexed without errors.
+bool ReportJobResult(const std::string &result) {
+  if (!result.empty()) {
+    fprintf(stderr, "Error: %s\n", result.c_str());
+    return false;
+  }
+  return true;
+}
+
+/// \brief Indexes all of `context`'s jobs on `context.worker_count()`
+/// threads.
+///
+/// Each worker buffers the entries for the job it's indexing in memory. The
+/// calling thread writes these buffers to `context.output()` one job at a time
+/// and in the order the jobs were handed out, so the output is a single
+/// well-formed entry stream. A worker doesn't start another job while
+/// `context.worker_count()` finished buffers are waiting to be written, so a
+/// slow job can't leave every later job's output piling up behind it.
+/// \param run_profile If profiling was requested, collects the jobs' profiles.
+/// \return true if all jobs were indexed without errors.
+bool IndexJobsConcurrently(IndexerContext *context,
+                           const IndexerOptions &options,
+                           RunProfile *run_profile) {
+  /// The outcome of indexing a single job.
+  struct JobResult {
+    /// Empty on success; otherwise, an error description.
+    std::string error;
+    /// Varint-delimited entries produced by the job.
+    std::string output;
+    /// The job's position in the input list.
+    size_t index = 0;
+  };
+  if (context->hash_cache() != nullptr) {
+    // Workers deduplicate their own output; this is just for stats.
+    context->output()->UseHashCache(context->hash_cache());
+  }
+  // Keyed by position. With --experimental_work_queue, fewer than
+  // `job_count()` jobs may be handed out; the writer stops once every worker
+  // is done and the next position never arrived.
+  std::map<size_t, JobResult> results;
+  size_t running_workers = context->worker_count();
+  std::mutex results_mutex;
+  std::condition_variable result_ready;
+  // Signalled when the writer takes a result out of `results`.
+  std::condition_variable result_taken;
+  std::vector<std::thread> workers;
+  for (size_t worker = 0; worker < context->worker_count(); ++worker) {
+    workers.emplace_back([&] {
+      std::unique_ptr<HashCache> worker_hash_cache =
+          context->NewWorkerHashCache();
+      HashCache *hash_cache = worker_hash_cache ? worker_hash_cache.get()
+                                                : context->hash_cache();
+      std::unique_ptr<IndexerJob> job;
+      for (;;) {
+        {
+          // Jobs are handed out in position order, so while no worker holds
+          // a job, the writer's next position is already in `results`.
+          std::unique_lock<std::mutex> lock(results_mutex);
+          result_taken.wait(lock, [&] {
+            return results.size() < context->worker_count();
+          });
+        }
+        if (!context->NextJob(&job)) {
+          break;
+        }
+        JobResult result;
+        {
+          google::protobuf::io::StringOutputStream raw_output(&result.output);
+          FileOutputStream output(&raw_output);
+          output.set_flush_after_each_entry(false);
+          output.set_buffer_digest(context->buffer_digest());
+          output.set_size_tuner(context->buffer_size_tuner());
+          result.error =
+              IndexJob(job.get(), options, *context, hash_cache, &output,
+                       run_profile);
+        }
+        size_t position = job->position;
+        result.index = job->index;
+        // Release the job's file content before waiting on anything else.
+        job.reset();
+        {
+          std::lock_guard<std::mutex> lock(results_mutex);
+          results[position] = std::move(result);
+        }
+        result_ready.notify_all();
+      }
+      {
+        std::lock_guard<std::mutex> lock(results_mutex);
+        --running_workers;
+      }
+      result_ready.notify_all();
+    });
+  }
+  bool had_errors = false;
+  for (size_t position = 0;; ++position) {
+    JobResult result;
+    {
+      std::unique_lock<std::mutex> lock(results_mutex);
+      result_ready.wait(lock, [&] {
+        return results.count(position) != 0 || running_workers == 0;
+      });
+      auto found = results.find(position);
+      if (found == results.end()) {
+        break;
+      }
+      result = std::move(found->second);
+      results.erase(found);
+    }
+    result_taken.notify_one();
+    context->output()->WriteDelimitedEntries(result.output);
+    context->CommitJob(result.index);
+    context->FinishJob(result.index, result.error.empty());
+    had_errors |= !ReportJobResult(result.error);
+  }
+  for (auto &worker : workers) {
+    worker.join();
+  }
+  return !had_errors;
+}
+
+/// \brief Follows a forked worker's entries and error text on its pipe.
+struct ForkedJobTrailer {
+  /// The number of bytes of entries.
+  uint64_t output_size;
+  /// The number of bytes of error text after the entries.
+  uint64_t error_size;
+  /// The time the worker took to index the job.
+  double millis;
+};
+
+/// \brief Writes all `size` bytes at `data` to `fd`.
+/// \return false on failure.
+bool WriteFully(int fd, const char *data, size_t size) {
+  while (size > 0) {
+    ssize_t written = ::write(fd, data, size);
+    if (written < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return false;
+    }
+    data += written;
+    size -= written;
+  }
+  return true;
+}
+
+/// \brief Indexes `job` in a forked worker process and sends the result to
+/// the parent over `fd`.
+/// \return the worker's exit status.
+int RunForkedJob(IndexerJob *job, const IndexerOptions &options,
+                 const IndexerContext &context, UnitReportWriter *unit_reports,
+                 int fd) {
+  std::string output;
+  std::string error;
+  ForkedJobTrailer trailer;
+  {
+    google::protobuf::io::StringOutputStream raw_output(&output);
+    FileOutputStream job_output(&raw_output);
+    job_output.set_flush_after_each_entry(false);
+    job_output.set_buffer_digest(context.buffer_digest());
+    job_output.set_size_tuner(context.buffer_size_tuner());
+    // Profiles are reported per unit; the parent never sees them.
+    RunProfile run_profile;
+    run_profile.unit_reports = unit_reports;
+    error = IndexJob(job, options, context, context.hash_cache(), &job_output,
+                     &run_profile, &trailer.millis);
+  }
+  trailer.output_size = output.size();
+  trailer.error_size = error.size();
+  bool sent = WriteFully(fd, output.data(), output.size()) &&
+              WriteFully(fd, error.data(), error.size()) &&
+              WriteFully(fd, reinterpret_cast<const char *>(&trailer),
+                         sizeof(trailer));
+  ::close(fd);
+  return sent ? 0 : 1;
+}
+
+/// \brief Indexes each of `context`'s jobs in its own forked process, running
+/// `context.worker_count()` processes at once.
+///
+/// Everything the context loaded before the first fork (the claim table,
+/// vname rules, mapped file store and so on) is shared with the workers
+/// copy-on-write. Each worker sends its entries back over a pipe; the parent
+/// writes them to `context.output()` in the order the jobs were handed out,
+/// so a worker that crashes only loses its own unit. Claims and caches that
+/// live in the parent's memory aren't updated by workers.
+/// \param unit_reports If not null, where workers write their unit reports.
+/// \return true if all jobs were indexed without errors.
+bool IndexJobsInForkedWorkers(IndexerContext *context,
+                              const IndexerOptions &options,
+                              UnitReportWriter *unit_reports) {
+  /// A job handed to a worker process.
+  struct ForkedJob {
+    std::unique_ptr<IndexerJob> job;
+    /// The worker's process ID.
+    pid_t pid;
+    /// The read end of the worker's pipe, or -1 once it has been closed.
+    int fd;
+    /// Everything read from `fd`.
+    std::string received;
+  };
+  if (context->hash_cache() != nullptr) {
+    // Workers deduplicate their own output; this is just for stats.
+    context->output()->UseHashCache(context->hash_cache());
+  }
+  std::deque<ForkedJob> running;
+  bool more_jobs = true;
+  bool had_errors = false;
+  char buffer[64 * 1024];
+  std::unique_ptr<IndexerJob> next_job;
+  while (more_jobs || !running.empty()) {
+    while (more_jobs && running.size() < context->worker_count()) {
+      if (!context->NextJob(&next_job)) {
+        more_jobs = false;
+        break;
+      }
+      int fds[2];
+      PCHECK(::pipe(fds) == 0) << "Couldn't create a pipe for a worker";
+      pid_t pid = ::fork();
+      PCHECK(pid >= 0) << "Couldn't fork a worker";
+      if (pid == 0) {
+        ::close(fds[0]);
+        for (const auto &other : running) {
+          ::close(other.fd);
+        }
+        // Don't run the parent's destructors or flush its streams.
+        ::_exit(RunForkedJob(next_job.get(), options, *context, unit_reports,
+                             fds[1]));
+      }
+      ::close(fds[1]);
+      ForkedJob forked;
+      forked.job = std::move(next_job);
+      forked.pid = pid;
+      forked.fd = fds[0];
+      // Only the worker needs the job's files. Clearing an arena message
+      // keeps its strings' buffers, so release the content explicitly.
+      for (auto &file : *forked.job->virtual_files) {
+        std::string().swap(*file.mutable_content());
+      }
+      forked.job->virtual_files->Clear();
+      forked.job->mapped_files.clear();
+      running.push_back(std::move(forked));
+    }
+    // Read from every worker so none blocks on a full pipe.
+    std::vector<pollfd> polled;
+    for (const auto &forked : running) {
+      if (forked.fd >= 0) {
+        polled.push_back({forked.fd, POLLIN, 0});
+      }
+    }
+    if (!polled.empty() && ::poll(polled.data(), polled.size(), -1) < 0) {
+      PCHECK(errno == EINTR) << "Couldn't poll workers";
+      continue;
+    }
+    for (auto &forked : running) {
+      auto ready = std::find_if(
+          polled.begin(), polled.end(), [&forked](const pollfd &entry) {
+            return entry.fd == forked.fd && entry.revents != 0;
+          });
+      if (forked.fd < 0 || ready == polled.end()) {
+        continue;
+      }
+      ssize_t count = ::read(forked.fd, buffer, sizeof(buffer));
+      if (count > 0) {
+        forked.received.append(buffer, count);
+      } else if (count == 0 || errno != EINTR) {
+        ::close(forked.fd);
+        forked.fd = -1;
+      }
+    }
+    while (!running.empty() && running.front().fd < 0) {
+      ForkedJob &forked = running.front();
+      int status = 0;
+      PCHECK(::waitpid(forked.pid, &status, 0) == forked.pid);
+      ForkedJobTrailer trailer;
+      const std::string &received = forked.received;
+      bool complete = received.size() >= sizeof(trailer);
+      if (complete) {
+        memcpy(&trailer, received.data() + received.size() - sizeof(trailer),
+               sizeof(trailer));
+        complete = trailer.output_size + trailer.error_size ==
+                   received.size() - sizeof(trailer);
+      }
+      if (!WIFEXITED(status) || WEXITSTATUS(status) != 0 || !complete) {
+        std::string reason =
+            WIFSIGNALED(status)
+                ? "was killed by signal " + std::to_string(WTERMSIG(status))
+                : "exited with status " + std::to_string(WEXITSTATUS(status));
+        context->FinishJob(forked.job->index, false);
+        had_errors |= !ReportJobResult(
+            "The worker for unit " + std::to_string(forked.job->index) + " (" +
+            forked.job->unit->v_name().signature() + ") " + reason + ".");
+      } else {
+        context->output()->WriteDelimitedEntries(
+            llvm::StringRef(received.data(), trailer.output_size));
+        context->CommitJob(forked.job->index);
+        context->RecordJobCost(*forked.job, trailer.millis);
+        context->FinishJob(forked.job->index, trailer.error_size == 0);
+        had_errors |= !ReportJobResult(
+            received.substr(trailer.output_size, trailer.error_size));
+      }
+      running.pop_front();
+    }
+  }
+  return !had_errors;
+}
+
+}  // anonymous namespace
 
 int main(int argc, char *argv[]) {
   GOOGLE_PROTOBUF_VERIFY_VERSION;
@@ -49,6 +974,28 @@ int main(int argc, char *argv[]) {
   gflags::SetUsageMessage(
       IndexerContext::UsageMessage("the Kythe C++ indexer", "indexer"));
   gflags::ParseCommandLineFlags(&argc, &argv, true);
+  if (FLAGS_experimental_fork_workers) {
+    // Only the forking thread survives in a worker, so a lock that any other
+    // thread held at the time would stay locked there. Keep the indexer to a
+    // single thread: decode each unit when it's needed rather than on the
+    // prefetch thread, and refuse the options that start threads of their
+    // own.
+    CHECK(FLAGS_experimental_work_queue.empty() &&
+          !IndexPackRemoteFilesystem::IsRemote(FLAGS_index_pack))
+        << "--experimental_fork_workers can't be used with a work queue or "
+           "a remote --index_pack.";
+    CHECK(!FLAGS_experimental_writer_thread &&
+          FLAGS_experimental_write_request_output.empty())
+        << "--experimental_fork_workers can't be used with a writer thread "
+           "or WriteRequest output.";
+    FLAGS_prefetch_units = 0;
+  }
+  if (FLAGS_heap_profile_signal != 0 &&
+      !RequestHeapProfileOnSignal(FLAGS_heap_profile_signal)) {
+    fprintf(stderr, "Error: couldn't listen for signal %d.\n",
+            FLAGS_heap_profile_signal);
+    return 1;
+  }
   std::vector<std::string> final_args(argv, argv + argc);
   IndexerContext context(final_args, "stdin.cc");
   IndexerOptions options;
@@ -62,37 +1009,210 @@ int main(int argc, char *argv[]) {
                                                     : kythe::Verbosity::Classic;
   options.DropInstantiationIndependentData =
       FLAGS_experimental_drop_instantiation_independent_data;
+  options.UseIncludeResolutions = FLAGS_experimental_use_include_resolutions;
+  CHECK(FLAGS_experimental_dedup_fingerprint_bits == 0 ||
+        FLAGS_experimental_dedup_fingerprint_bits == 64 ||
+        FLAGS_experimental_dedup_fingerprint_bits == 128)
+      << "--experimental_dedup_fingerprint_bits must be 0, 64 or 128.";
+  options.DedupFingerprintBits = FLAGS_experimental_dedup_fingerprint_bits;
+  options.RangeDedupLimit = FLAGS_experimental_range_dedup_limit;
   options.AllowFSAccess = context.allow_filesystem_access();
+  if (!FLAGS_experimental_module_cache_path.empty()) {
+    llvm::SmallString<256> module_cache_path(
+        FLAGS_experimental_module_cache_path);
+    if (std::error_code error =
+            llvm::sys::fs::make_absolute(module_cache_path)) {
+      fprintf(stderr, "Error: bad --experimental_module_cache_path: %s\n",
+              error.message().c_str());
+      return 1;
+    }
+    llvm::sys::path::remove_dots(module_cache_path, true);
+    options.ModuleCachePath = module_cache_path.str();
+  }
+  options.HeaderFingerprints = context.header_fingerprints();
+  options.InstantiationFingerprints = context.instantiation_fingerprints();
+  options.InstantiationSampleLimit =
+      FLAGS_experimental_instantiation_sample_limit;
+  options.PrefetchClaims = FLAGS_experimental_prefetch_claims;
+  options.ClaimByContent = FLAGS_experimental_claim_by_content;
+  options.DedupEntries = FLAGS_experimental_dedup_entries;
+  options.GroupEntriesByFile = FLAGS_experimental_group_entries_by_file;
+  options.SkipUnclaimedFunctionBodies =
+      FLAGS_experimental_skip_unclaimed_function_bodies;
+  options.IndexingProfile = FLAGS_experimental_indexing_profile;
+  options.DeclShards = std::max(FLAGS_experimental_decl_shards, 1);
+  options.MakeShardMetaSupports = MakeMetaSupports;
+  options.Budget.SoftWallMillis = FLAGS_experimental_unit_soft_time_limit_ms;
+  options.Budget.HardWallMillis = FLAGS_experimental_unit_hard_time_limit_ms;
+  options.Budget.SoftHeapBytes =
+      FLAGS_experimental_unit_soft_heap_limit_mb * 1024 * 1024;
+  options.Budget.HardHeapBytes =
+      FLAGS_experimental_unit_hard_heap_limit_mb * 1024 * 1024;
+  EntryKindFilter entry_filter;
+  if (!FLAGS_experimental_keep_entry_kinds.empty() ||
+      !FLAGS_experimental_drop_entry_kinds.empty()) {
+    std::string error_text;
+    if (!entry_filter.Configure(FLAGS_experimental_keep_entry_kinds,
+                                FLAGS_experimental_drop_entry_kinds,
+                                &error_text)) {
+      fprintf(stderr, "Error: %s\n", error_text.c_str());
+      return 1;
+    }
+    options.EntryFilter = &entry_filter;
+  }
   if (FLAGS_report_profiling_events) {
     options.ReportProfileEvent = [](const char *counter, ProfilingEvent event) {
+      static const char *const kEventNames[] = {"enter", "exit", "hit", "miss"};
       fprintf(stderr, "%s: %s\n", counter,
-              event == ProfilingEvent::Enter ? "enter" : "exit");
+              kEventNames[static_cast<int>(event)]);
     };
   }
+  PreambleKeyCache preamble_cache;
+  if (FLAGS_experimental_report_shared_preambles) {
+    options.PreambleCache = &preamble_cache;
+  }
+  options.SharedDetails = context.shared_cxx_details();
+  std::unique_ptr<UnitTeardown> teardown;
+  if (FLAGS_experimental_background_teardown) {
+    // Let each worker get one unit ahead of the teardown thread.
+    teardown = llvm::make_unique<UnitTeardown>(
+        std::max<size_t>(context.worker_count(), 1));
+    options.Teardown = teardown.get();
+  }
 
-  bool had_errors = false;
-  NullOutputStream null_stream;
-
-  for (auto &job : *context.jobs()) {
-    options.EffectiveWorkingDirectory = job.working_directory;
-
-    kythe::MetadataSupports meta_supports;
-    meta_supports.Add(llvm::make_unique<ProtobufMetadataSupport>());
-    meta_supports.Add(llvm::make_unique<KytheMetadataSupport>());
+  CHECK(!FLAGS_experimental_interactive_reindex || context.serving())
+      << "--experimental_interactive_reindex needs "
+         "--experimental_serve_analysis_requests.";
+  if (FLAGS_experimental_emit_builtins_once) {
+    CHECK(!context.serving())
+        << "Each analysis response must carry its own builtin nodes.";
+    KytheGraphRecorder recorder(context.output());
+    recorder.set_entry_filter(options.EntryFilter);
+    KytheGraphObserver::EmitBuiltinNodes(&recorder);
+    options.EmitBuiltinsPerUnit = false;
+  }
 
-    std::string result = IndexCompilationUnit(
-        job.unit, job.virtual_files, *context.claim_client(),
-        context.hash_cache(),
-        job.silent ? static_cast<KytheOutputStream &>(null_stream)
-                   : static_cast<KytheOutputStream &>(*context.output()),
-        options, &meta_supports, [](IndexerASTVisitor *indexer) {
-          return IndexerWorklist::CreateDefaultWorklist(indexer);
+  RunProfile run_profile;
+  UnitReportWriter unit_reports;
+  if (!FLAGS_unit_report_file.empty()) {
+    std::string error_text;
+    if (!unit_reports.Open(FLAGS_unit_report_file, &error_text)) {
+      fprintf(stderr, "Error: couldn't open %s: %s\n",
+              FLAGS_unit_report_file.c_str(), error_text.c_str());
+      return 1;
+    }
+    run_profile.unit_reports = &unit_reports;
+  }
+  CostProbeWriter cost_probes;
+  if (!FLAGS_experimental_cost_probe_output.empty()) {
+    CHECK(!context.serving() && !FLAGS_experimental_fork_workers)
+        << "--experimental_cost_probe_output can't be used with served or "
+           "forked jobs.";
+    // Dynamic and shared claims would keep the probe's claims from the run
+    // that indexes the units.
+    CHECK(dynamic_cast<StaticClaimClient *>(context.claim_client()) !=
+          nullptr)
+        << "--experimental_cost_probe_output needs static claims.";
+    std::string error_text;
+    if (!cost_probes.Open(FLAGS_experimental_cost_probe_output,
+                          &error_text)) {
+      fprintf(stderr, "Error: couldn't open %s: %s\n",
+              FLAGS_experimental_cost_probe_output.c_str(),
+              error_text.c_str());
+      return 1;
+    }
+    run_profile.cost_probes = &cost_probes;
+  }
+  std::unique_ptr<MetricsDump> metrics;
+  if (!FLAGS_metrics_file.empty()) {
+    CHECK(!FLAGS_experimental_fork_workers)
+        << "Forked workers' counters can't be exported with --metrics_file.";
+    metrics = llvm::make_unique<MetricsDump>(
+        FLAGS_metrics_file,
+        std::chrono::seconds(std::max(FLAGS_metrics_period_s, 0)),
+        [&context, &run_profile](MetricsText *text) {
+          CollectMetrics(context, &run_profile, text);
         });
+    run_profile.metrics = metrics.get();
+  }
+  bool had_errors = false;
 
-    if (!result.empty()) {
-      fprintf(stderr, "Error: %s\n", result.c_str());
+  if (context.serving()) {
+    // Errors in individual units are reported in their responses.
+    std::string error_text;
+    // The preamble keys of the units whose headers have been indexed.
+    std::unordered_set<std::string> indexed_preambles;
+    if (!context.ServeAnalysisRequests(
+            [&](IndexerJob *job, KytheOutputStream *output) {
+              if (!FLAGS_experimental_interactive_reindex) {
+                return IndexJob(job, options, context, context.hash_cache(),
+                                output, &run_profile);
+              }
+              std::string key = ComputePreambleKey(*job->unit);
+              IndexerOptions job_options = options;
+              job_options.MainFileOnly = indexed_preambles.count(key) != 0;
+              std::string result =
+                  IndexJob(job, job_options, context, context.hash_cache(),
+                           output, &run_profile);
+              if (result.empty()) {
+                indexed_preambles.insert(std::move(key));
+              }
+              return result;
+            },
+            &error_text)) {
+      fprintf(stderr, "Error: %s\n", error_text.c_str());
       had_errors = true;
     }
+  } else if (FLAGS_experimental_fork_workers) {
+    // Workers would share these connections and handles.
+    CHECK(FLAGS_cache.empty() &&
+          FLAGS_experimental_dynamic_claim_cache.empty() &&
+          FLAGS_experimental_header_fingerprint_db.empty() &&
+          FLAGS_experimental_instantiation_fingerprint_db.empty())
+        << "--experimental_fork_workers can't be used with memcached or "
+           "fingerprint databases.";
+    CHECK(FLAGS_experimental_hash_snapshot_out.empty())
+        << "Forked workers' hashes don't reach the snapshot.";
+    CHECK(!FLAGS_experimental_background_teardown)
+        << "Forked workers have no teardown thread.";
+    had_errors = !IndexJobsInForkedWorkers(&context, options,
+                                           run_profile.unit_reports);
+  } else if (context.worker_count() > 1) {
+    had_errors = !IndexJobsConcurrently(&context, options, &run_profile);
+  } else {
+    std::unique_ptr<IndexerJob> job;
+    while (context.NextJob(&job)) {
+      std::string result = IndexJob(job.get(), options, context,
+                                    context.hash_cache(), context.output(),
+                                    &run_profile);
+      context.CommitJob(job->index);
+      context.FinishJob(job->index, result.empty());
+      had_errors |= !ReportJobResult(result);
+    }
+  }
+
+  if (metrics) {
+    std::string error_text;
+    if (!metrics->Write(&error_text)) {
+      fprintf(stderr, "Couldn't write metrics: %s\n", error_text.c_str());
+    }
+  }
+
+  if (FLAGS_profile_units) {
+    fprintf(stderr, "Profile for all units:\n%s",
+            run_profile.profiler.Summary().c_str());
+  }
+
+  if (FLAGS_report_entry_accounting) {
+    fprintf(stderr, "{\"unit\":\"all\",\"entries\":%s}\n",
+            run_profile.entries.ToJson().c_str());
+  }
+
+  if (FLAGS_experimental_report_shared_preambles) {
+    fprintf(stderr, "Shared preambles: %zu of %zu units (%zu distinct)\n",
+            preamble_cache.hits(),
+            preamble_cache.hits() + preamble_cache.misses(),
+            preamble_cache.misses());
   }
 
   return (had_errors ? 1 : 0);
@@ -22,10 +22,13 @@
 #include <stdio.h>
 #include <stdlib.h>
 
+#include <algorithm>
+#include <map>
 #include <memory>
 #include <set>
 #include <string>
 #include <utility>
+#include <vector>
 
 #include "clang/AST/ASTConsumer.h"
 #include "clang/AST/ASTContext.h"
@@ -36,12 +39,16 @@
 #include "llvm/ADT/StringRef.h"
 #include "llvm/ADT/Twine.h"
 
+#include "gflags/gflags.h"
 #include "google/protobuf/stubs/common.h"
 #include "gtest/gtest.h"
 
 #include "kythe/cxx/common/indexing/KytheGraphRecorder.h"
 #include "kythe/cxx/common/indexing/RecordingOutputStream.h"
 #include "kythe/cxx/indexer/cxx/IndexerASTHooks.h"
+#include "kythe/proto/analysis.pb.h"
+
+DECLARE_bool(experimental_threaded_claiming);
 
 namespace kythe {
 namespace {
@@ -172,6 +179,36 @@ TEST_F(AnchorMarkTest, OverlappingMiddleNest) {
               (second == "ccc" && third == "bbb"));
 }
 
+TEST(NodeIdArenaTest, InternsIdentities) {
+  NodeIdArena arena;
+  std::string long_identity(100, 'x');
+  const std::string* short_id = arena.Intern("short");
+  EXPECT_EQ("short", *short_id);
+  EXPECT_EQ(short_id, arena.Intern("short"));
+  const std::string* long_id = arena.Intern(long_identity);
+  EXPECT_EQ(CompressString(long_identity), *long_id);
+  EXPECT_EQ(long_id, arena.Intern(long_identity));
+  EXPECT_EQ(long_id, arena.InternUncompressed(*long_id));
+  EXPECT_EQ(2, arena.identity_count());
+  EXPECT_EQ(1, arena.compression_count());
+}
+
+TEST(NodeIdArenaTest, NodeIdsUseCurrentArena) {
+  NodeIdArena arena;
+  NodeIdArena::Scope scope(&arena);
+  GraphObserver::NodeId first(nullptr, "some#id");
+  GraphObserver::NodeId second(nullptr, std::string("some#") + "id");
+  EXPECT_EQ(&first.getRawIdentity(), &second.getRawIdentity());
+  EXPECT_EQ(first.getIdentityHash(), second.getIdentityHash());
+  EXPECT_EQ(1, arena.identity_count());
+  {
+    NodeIdArena inner;
+    NodeIdArena::Scope inner_scope(&inner);
+    EXPECT_EQ(&inner, &NodeIdArena::Current());
+  }
+  EXPECT_EQ(&arena, &NodeIdArena::Current());
+}
+
 TEST(KytheIndexerUnitTest, GraphRecorderNodeKind) {
   RecordingOutputStream stream;
   KytheGraphRecorder recorder(&stream);
@@ -391,6 +428,218 @@ TEST(KytheIndexerUnitTest, TrivialHappyCase) {
       RunToolOnCode(std::move(Action), "int main() {}", "valid_main.cc"));
 }
 
+/// \brief A `GraphObserver` that records batch claims and refuses all but the
+/// first claim of each token.
+class BatchClaimingGraphObserver : public NullGraphObserver {
+ public:
+  bool claimBatch(std::vector<std::pair<std::string, bool>>* pairs) override {
+    bool claimed = false;
+    for (auto& pair : *pairs) {
+      ClaimedTokens.push_back(pair.first);
+      pair.second = Seen.insert(pair.first).second;
+      claimed |= pair.second;
+    }
+    return claimed;
+  }
+
+  std::vector<std::string> ClaimedTokens;
+
+ private:
+  std::set<std::string> Seen;
+};
+
+TEST(KytheIndexerUnitTest, ClaimingWorklistClaimsEachTokenOnce) {
+  bool OldThreadedClaiming = FLAGS_experimental_threaded_claiming;
+  FLAGS_experimental_threaded_claiming = true;
+  BatchClaimingGraphObserver Observer;
+  std::unique_ptr<clang::FrontendAction> Action(new IndexerFrontendAction(
+      &Observer, nullptr, []() { return false; },
+      [](IndexerASTVisitor* visitor) {
+        return IndexerWorklist::CreateClaimingWorklist(visitor, 2);
+      }));
+  ASSERT_TRUE(RunToolOnCode(std::move(Action),
+                            "template <typename T> void f(T) {}\n"
+                            "void g() { f(1); f(1); f(2.0); f('c'); }",
+                            "main.cc"));
+  FLAGS_experimental_threaded_claiming = OldThreadedClaiming;
+  std::set<std::string> Unique(Observer.ClaimedTokens.begin(),
+                               Observer.ClaimedTokens.end());
+  EXPECT_EQ(Unique.size(), Observer.ClaimedTokens.size());
+}
+
+/// \brief A `GraphObserver` that samples the first instantiation of each
+/// template it is asked about and counts specialization edges.
+class SamplingGraphObserver : public NullGraphObserver {
+ public:
+  size_t instantiationSampleLimit() override { return 1; }
+
+  bool claimInstantiationSample(const std::string& PrimaryIdentifier,
+                                const std::string& Identifier) override {
+    Instantiations.insert(Identifier);
+    auto& Sampled = SampledByPrimary[PrimaryIdentifier];
+    if (Sampled.empty()) {
+      Sampled = Identifier;
+    }
+    return Sampled == Identifier;
+  }
+
+  void recordSpecEdge(const NodeId& TermNodeId, const NodeId& AbsNodeId,
+                      Confidence Conf) override {
+    ++SpecEdges;
+  }
+
+  std::set<std::string> Instantiations;
+  std::map<std::string, std::string> SampledByPrimary;
+  size_t SpecEdges = 0;
+};
+
+TEST(KytheIndexerUnitTest, SampledOutInstantiationsKeepSpecEdges) {
+  SamplingGraphObserver Observer;
+  std::unique_ptr<clang::FrontendAction> Action(new IndexerFrontendAction(
+      &Observer, nullptr, []() { return false; },
+      [](IndexerASTVisitor* visitor) {
+        return IndexerWorklist::CreateDefaultWorklist(visitor);
+      }));
+  ASSERT_TRUE(RunToolOnCode(std::move(Action),
+                            "template <typename T> struct S { T t; };\n"
+                            "S<int> a; S<char> b; S<long> c;",
+                            "main.cc"));
+  EXPECT_EQ(3, Observer.Instantiations.size());
+  EXPECT_EQ(1, Observer.SampledByPrimary.size());
+  EXPECT_GE(Observer.SpecEdges, 3);
+}
+
+/// \brief A `GraphObserver` that remembers the functions it sees defined.
+class FunctionDefinitionObserver : public NullGraphObserver {
+ public:
+  void recordFunctionNode(const NodeId& Node, Completeness FunctionCompleteness,
+                          FunctionSubkind Subkind,
+                          const LazyMarkedSource& MarkedSource) override {
+    if (FunctionCompleteness == Completeness::Definition) {
+      Defined.insert(Node.ToString());
+    }
+  }
+
+  std::set<std::string> Defined;
+};
+
+/// \return the functions defined by indexing shard `Index` of `Count` of
+/// `Code`.
+std::set<std::string> DefinedInShard(const std::string& Code, unsigned Index,
+                                     unsigned Count) {
+  FunctionDefinitionObserver Observer;
+  std::unique_ptr<IndexerFrontendAction> Action(new IndexerFrontendAction(
+      &Observer, nullptr, []() { return false; },
+      [](IndexerASTVisitor* visitor) {
+        return IndexerWorklist::CreateDefaultWorklist(visitor);
+      }));
+  Action->setDeclShard(Index, Count);
+  EXPECT_TRUE(RunToolOnCode(std::move(Action), Code, "main.cc"));
+  return Observer.Defined;
+}
+
+TEST(KytheIndexerUnitTest, DeclShardsPartitionDefinitions) {
+  const std::string Code =
+      "void f() {}\n"
+      "namespace ns { void g() {} }\n"
+      "template <typename T> void h(T) {}\n"
+      "void i() { h(1); }\n";
+  auto All = DefinedInShard(Code, 0, 1);
+  auto First = DefinedInShard(Code, 0, 2);
+  auto Second = DefinedInShard(Code, 1, 2);
+  EXPECT_FALSE(First.empty());
+  EXPECT_FALSE(Second.empty());
+  std::set<std::string> Union = First;
+  Union.insert(Second.begin(), Second.end());
+  EXPECT_EQ(All, Union);
+  EXPECT_EQ(First.size() + Second.size(), Union.size());
+}
+
+/// \return a unit for `main.cc` that includes `header.h` from `Dir`.
+proto::CompilationUnit MakePreambleUnit(const std::string& Dir) {
+  proto::CompilationUnit Unit;
+  Unit.set_working_directory(Dir);
+  Unit.add_source_file("main.cc");
+  Unit.add_argument("clang++");
+  Unit.add_argument("-DFOO");
+  Unit.add_argument("main.cc");
+  auto* Main = Unit.add_required_input();
+  Main->mutable_info()->set_path("main.cc");
+  Main->mutable_info()->set_digest("main_digest");
+  auto* Header = Unit.add_required_input();
+  Header->mutable_info()->set_path("header.h");
+  Header->mutable_info()->set_digest("header_digest");
+  auto* Row = Header->mutable_context()->add_row();
+  Row->set_source_context("header_context");
+  auto* Col = Row->add_column();
+  Col->set_offset(10);
+  Col->set_linked_context("nested_context");
+  return Unit;
+}
+
+TEST(KytheIndexerUnitTest, PreambleKeyIgnoresSourceFiles) {
+  auto Unit = MakePreambleUnit("/a");
+  auto OtherUnit = MakePreambleUnit("/a");
+  OtherUnit.set_source_file(0, "other.cc");
+  OtherUnit.set_argument(2, "other.cc");
+  OtherUnit.mutable_required_input(0)->mutable_info()->set_path("other.cc");
+  OtherUnit.mutable_required_input(0)->mutable_info()->set_digest("other");
+  EXPECT_EQ(ComputePreambleKey(Unit), ComputePreambleKey(OtherUnit));
+}
+
+TEST(KytheIndexerUnitTest, PreambleKeyTracksHeadersAndContexts) {
+  const std::string Key = ComputePreambleKey(MakePreambleUnit("/a"));
+  EXPECT_NE(Key, ComputePreambleKey(MakePreambleUnit("/b")));
+  auto Unit = MakePreambleUnit("/a");
+  Unit.set_argument(1, "-DBAR");
+  EXPECT_NE(Key, ComputePreambleKey(Unit));
+  Unit = MakePreambleUnit("/a");
+  Unit.mutable_required_input(1)->mutable_info()->set_digest("changed");
+  EXPECT_NE(Key, ComputePreambleKey(Unit));
+  Unit = MakePreambleUnit("/a");
+  Unit.mutable_required_input(1)
+      ->mutable_context()
+      ->mutable_row(0)
+      ->mutable_column(0)
+      ->set_linked_context("changed");
+  EXPECT_NE(Key, ComputePreambleKey(Unit));
+  Unit = MakePreambleUnit("/a");
+  Unit.set_entry_context("changed");
+  EXPECT_NE(Key, ComputePreambleKey(Unit));
+}
+
+TEST(KytheIndexerUnitTest, IndexingProfileDropsWarningFlags) {
+  std::vector<std::string> Args = {
+      "clang++", "-w",         "-Wall",   "-Werror=unused", "-pedantic",
+      "-Wp,-DX", "-Wl,--as-needed", "-Xclang", "-Wfoo",     "-DFOO",
+      "main.cc", "--",         "-Wbar"};
+  ApplyIndexingProfile(&Args);
+  ASSERT_GE(Args.size(), 11u);
+  EXPECT_EQ("clang++", Args[0]);
+  EXPECT_EQ("-w", Args[1]);
+  EXPECT_EQ("-Wp,-DX", Args[2]);
+  EXPECT_EQ("-Wl,--as-needed", Args[3]);
+  EXPECT_EQ("-Xclang", Args[4]);
+  EXPECT_EQ("-Wfoo", Args[5]);
+  EXPECT_EQ("-DFOO", Args[6]);
+  EXPECT_EQ("main.cc", Args[7]);
+  // The profile's flags come after the build's, but before any "--".
+  EXPECT_EQ("-fno-spell-checking", Args[Args.size() - 3]);
+  EXPECT_EQ("--", Args[Args.size() - 2]);
+  EXPECT_EQ("-Wbar", Args[Args.size() - 1]);
+  EXPECT_NE(Args.end(),
+            std::find(Args.begin(), Args.end(), "-fno-caret-diagnostics"));
+}
+
+TEST(KytheIndexerUnitTest, PreambleKeyCacheCountsRepeats) {
+  PreambleKeyCache Cache;
+  EXPECT_FALSE(Cache.Record("a"));
+  EXPECT_FALSE(Cache.Record("b"));
+  EXPECT_TRUE(Cache.Record("a"));
+  EXPECT_EQ(1, Cache.hits());
+  EXPECT_EQ(2, Cache.misses());
+}
+
 /// \brief A `GraphObserver` that checks the sematics of `pushFile` and
 /// `popFile`.
 ///
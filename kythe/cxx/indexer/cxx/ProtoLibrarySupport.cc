@@ -57,8 +57,13 @@ namespace {
 
 using google::protobuf::io::Tokenizer;
 
-using ParseCallback =
-    std::function<void(const clang::CXXMethodDecl&, const clang::SourceRange&)>;
+// Called with each field found and the byte range of its name in the text.
+using ParseCallback = std::function<void(const clang::CXXMethodDecl&,
+                                         unsigned Begin, unsigned End)>;
+
+// Returns the accessor for the named field of a message, or null.
+using AccessorLookup = std::function<const clang::CXXMethodDecl*(
+    const clang::CXXRecordDecl&, llvm::StringRef)>;
 
 // A proto tokenizer Error collector that outputs to LOG(ERROR).
 class LogErrors : public google::protobuf::io::ErrorCollector {
@@ -74,10 +79,8 @@ class ParseTextProtoHandler {
  public:
   // Parses the message and returns true on success.
   static bool Parse(const ParseCallback& FoundField,
-                    const clang::StringLiteral* Literal,
-                    const clang::CXXRecordDecl& MsgDecl,
-                    const clang::ASTContext& Context,
-                    const clang::LangOptions& LangOpts);
+                    const AccessorLookup& FindAccessor, llvm::StringRef Text,
+                    const clang::CXXRecordDecl& MsgDecl);
 
  private:
   struct LineColumnPair {
@@ -93,9 +96,8 @@ class ParseTextProtoHandler {
   // found_field on findings. All objects should remain valid for the
   // lifetime of the handler.
   ParseTextProtoHandler(const ParseCallback& FoundField,
-                        const clang::StringLiteral* Literal,
-                        const clang::ASTContext& Context,
-                        const clang::LangOptions& LangOpts);
+                        const AccessorLookup& FindAccessor,
+                        llvm::StringRef Text);
 
   // Parses fields of a message with the given decl. Returns false on error. If
   // nested is true, then hitting a '}' token will return without error.
@@ -107,54 +109,38 @@ class ParseTextProtoHandler {
   //    "{ field1: 3 field2: 'value' }"
   bool ParseFieldValue(const clang::CXXMethodDecl& AccessorDecl);
 
-  // Returns the source location/range of a given position/token.
-  clang::SourceLocation GetSourceLocation(
-      const LineColumnPair& LineColumn) const;
-  clang::SourceRange GetTokenSourceRange(const Tokenizer::Token& Token) const;
+  // Returns the byte offset of a given position in the text.
+  unsigned GetByteOffset(const LineColumnPair& LineColumn) const;
 
-  const clang::StringLiteral* const Literal;
-  const clang::ASTContext& Context;
-  const clang::LangOptions& LangOpts;
-  const ParseCallback FoundField;
+  const llvm::StringRef Text;
+  const ParseCallback& FoundField;
+  const AccessorLookup& FindAccessor;
   google::protobuf::io::ArrayInputStream IStream;
   LogErrors Errors;
   Tokenizer TextTokenizer;
-  // Index of token (line,column) to byte offset in the string literal. See
+  // Index of token (line,column) to byte offset in the text. See
   // comment in constructor.
   std::map<LineColumnPair, int> LineColumnToOffset;
 };
 
-const clang::CXXMethodDecl* FindAccessorDeclWithName(
-    const clang::CXXRecordDecl& MsgDecl, const std::string& Name) {
-  for (const clang::CXXMethodDecl* Method : MsgDecl.methods()) {
-    // Accessors are user-provided, skip any compiler-generated operator/ctor.
-    if (Method->isUserProvided() && Method->getName() == Name.c_str()) {
-      return Method;
-    }
-  }
-  return nullptr;
-}
-
-ParseTextProtoHandler::ParseTextProtoHandler(
-    const ParseCallback& FoundField, const clang::StringLiteral* Literal,
-    const clang::ASTContext& Context, const clang::LangOptions& LangOpts)
-    : Literal(Literal),
-      Context(Context),
-      LangOpts(LangOpts),
+ParseTextProtoHandler::ParseTextProtoHandler(const ParseCallback& FoundField,
+                                             const AccessorLookup& FindAccessor,
+                                             llvm::StringRef Text)
+    : Text(Text),
       FoundField(FoundField),
-      IStream(Literal->getBytes().data(), Literal->getBytes().size()),
+      FindAccessor(FindAccessor),
+      IStream(Text.data(), Text.size()),
       TextTokenizer(&IStream, &Errors) {
   // We're building this table so that we can map io::Tokenizer lines and
-  // columns back to byte offsets in the string literal. See
+  // columns back to byte offsets in the text. See
   // Tokenizer::NextChar() for why we're doing this.
   // TODO(courbet): It would be much better to add support for byte offset in
   // the tokenizer directly.
   LineColumnPair LineColumn(0, 0);
   constexpr const int kTokenizerTabWidth = 8;
   LineColumnToOffset[LineColumn] = 0;
-  for (int ByteOffset = 0; ByteOffset < Literal->getBytes().size();
-       ++ByteOffset) {
-    const char c = Literal->getBytes()[ByteOffset];
+  for (int ByteOffset = 0; ByteOffset < Text.size(); ++ByteOffset) {
+    const char c = Text[ByteOffset];
     if (c == '\n') {
       ++LineColumn.Line;
       LineColumn.Column = 0;
@@ -169,11 +155,10 @@ ParseTextProtoHandler::ParseTextProtoHandler(
 }
 
 bool ParseTextProtoHandler::Parse(const ParseCallback& FoundField,
-                                  const clang::StringLiteral* Literal,
-                                  const clang::CXXRecordDecl& MsgDecl,
-                                  const clang::ASTContext& Context,
-                                  const clang::LangOptions& LangOpts) {
-  ParseTextProtoHandler handler(FoundField, Literal, Context, LangOpts);
+                                  const AccessorLookup& FindAccessor,
+                                  llvm::StringRef Text,
+                                  const clang::CXXRecordDecl& MsgDecl) {
+  ParseTextProtoHandler handler(FoundField, FindAccessor, Text);
   return handler.ParseMsg(MsgDecl, false);
 }
 
@@ -184,15 +169,15 @@ bool ParseTextProtoHandler::ParseMsg(const clang::CXXRecordDecl& MsgDecl,
     switch (Token.type) {
       case Tokenizer::TYPE_IDENTIFIER: {
         // Assume that this is a field name.
-        const auto* AccessorDecl =
-            FindAccessorDeclWithName(MsgDecl, Token.text);
+        const auto* AccessorDecl = FindAccessor(MsgDecl, Token.text);
         if (!AccessorDecl) {
           LOG(ERROR) << "Cannot find field " << Token.text << " for message "
                      << MsgDecl.getName().str();
           return false;
         }
         CHECK_GE(Token.line, 0);
-        FoundField(*AccessorDecl, GetTokenSourceRange(Token));
+        FoundField(*AccessorDecl, GetByteOffset({Token.line, Token.column}),
+                   GetByteOffset({Token.line, Token.end_column}));
         if (!ParseFieldValue(*AccessorDecl)) {
           return false;
         }
@@ -269,19 +254,11 @@ bool ParseTextProtoHandler::ParseFieldValue(
   return true;
 }
 
-clang::SourceLocation ParseTextProtoHandler::GetSourceLocation(
+unsigned ParseTextProtoHandler::GetByteOffset(
     const LineColumnPair& LineColumn) const {
   const auto OffsetIt = LineColumnToOffset.find(LineColumn);
   CHECK(OffsetIt != LineColumnToOffset.end());
-  return Literal->getLocationOfByte(OffsetIt->second,
-                                    Context.getSourceManager(), LangOpts,
-                                    Context.getTargetInfo());
-}
-
-clang::SourceRange ParseTextProtoHandler::GetTokenSourceRange(
-    const Tokenizer::Token& Token) const {
-  return clang::SourceRange(GetSourceLocation({Token.line, Token.column}),
-                            GetSourceLocation({Token.line, Token.end_column}));
+  return OffsetIt->second;
 }
 
 const clang::RecordDecl* LookupRecordDecl(const clang::ASTContext& ASTContext,
@@ -304,10 +281,27 @@ const clang::RecordDecl* LookupRecordDecl(const clang::ASTContext& ASTContext,
 
 }  // namespace
 
+LibraryInterests GoogleProtoLibrarySupport::getInterests() const {
+  LibraryInterests Interests;
+  Interests.Variables = false;
+  Interests.DeclRefs = false;
+  // The conversion operator has no name, but matches on its class's name.
+  llvm::StringRef Name(FLAGS_parseprotohelper_full_name);
+  size_t LastColons = Name.rfind("::");
+  if (LastColons != llvm::StringRef::npos) {
+    Name = Name.substr(LastColons + 2);
+  }
+  Interests.CalleeNames = {Name.str()};
+  Interests.ProfileLabel = "google_proto_library_support";
+  return Interests;
+}
+
 bool GoogleProtoLibrarySupport::CompilationUnitHasParseProtoHelperDecl(
     const clang::ASTContext& ASTContext, const clang::CallExpr& Expr) {
-  if (!Initialized) {
-    Initialized = true;
+  if (Context != &ASTContext) {
+    Context = &ASTContext;
+    Accessors.clear();
+    ParsedLiterals.clear();
     // Find the root namespace.
     const clang::DeclContext* const TranslationUnitContext =
         Expr.getCalleeDecl()->getTranslationUnitDecl();
@@ -318,6 +312,44 @@ bool GoogleProtoLibrarySupport::CompilationUnitHasParseProtoHelperDecl(
   return ParseProtoHelperDecl != nullptr;
 }
 
+const clang::CXXMethodDecl* GoogleProtoLibrarySupport::FindAccessor(
+    const clang::CXXRecordDecl& MsgDecl, llvm::StringRef Name) {
+  auto Inserted = Accessors.try_emplace(&MsgDecl);
+  auto& ByName = Inserted.first->second;
+  if (Inserted.second) {
+    for (const clang::CXXMethodDecl* Method : MsgDecl.methods()) {
+      // Accessors are user-provided, skip any compiler-generated operator/ctor.
+      if (Method->isUserProvided() && Method->getIdentifier()) {
+        ByName.try_emplace(Method->getName(), Method);
+      }
+    }
+  }
+  auto Found = ByName.find(Name);
+  return Found == ByName.end() ? nullptr : Found->second;
+}
+
+const std::vector<GoogleProtoLibrarySupport::FieldReference>&
+GoogleProtoLibrarySupport::ParseLiteral(const clang::StringLiteral& Literal,
+                                        const clang::CXXRecordDecl& MsgDecl) {
+  auto Inserted = ParsedLiterals.emplace(
+      std::make_pair(&MsgDecl, Literal.getBytes().str()),
+      std::vector<FieldReference>());
+  auto& Fields = Inserted.first->second;
+  if (Inserted.second) {
+    // Fields found before a parse error are still referenced.
+    ParseTextProtoHandler::Parse(
+        [&Fields](const clang::CXXMethodDecl& Accessor, unsigned Begin,
+                  unsigned End) {
+          Fields.push_back(FieldReference{&Accessor, Begin, End});
+        },
+        [this](const clang::CXXRecordDecl& Decl, llvm::StringRef Name) {
+          return FindAccessor(Decl, Name);
+        },
+        Literal.getBytes(), MsgDecl);
+  }
+  return Fields;
+}
+
 void GoogleProtoLibrarySupport::InspectCallExpr(
     IndexerASTVisitor& V, const clang::CallExpr* CallExpr,
     const GraphObserver::Range& Range, GraphObserver::NodeId& CalleeId) {
@@ -391,14 +423,19 @@ void GoogleProtoLibrarySupport::InspectCallExpr(
 
   CHECK(Literal);
 
-  const auto Callback = [&V](const clang::CXXMethodDecl& AccessorDecl,
-                             const clang::SourceRange& Range) {
-    V.RecordCallEdges(V.ExplicitRangeInCurrentContext(Range).primary(),
-                      V.BuildNodeIdForDecl(&AccessorDecl));
+  const clang::ASTContext& ASTContext = V.getASTContext();
+  const clang::LangOptions& LangOpts = *V.getGraphObserver().getLangOptions();
+  const auto GetLocation = [&](unsigned Offset) {
+    return Literal->getLocationOfByte(Offset, ASTContext.getSourceManager(),
+                                      LangOpts, ASTContext.getTargetInfo());
   };
-  ParseTextProtoHandler::Parse(
-      Callback, Literal, *Expr->getType()->getAsCXXRecordDecl(),
-      V.getASTContext(), *V.getGraphObserver().getLangOptions());
+  for (const auto& Field :
+       ParseLiteral(*Literal, *Expr->getType()->getAsCXXRecordDecl())) {
+    const clang::SourceRange FieldRange(GetLocation(Field.Begin),
+                                        GetLocation(Field.End));
+    V.RecordCallEdges(V.ExplicitRangeInCurrentContext(FieldRange).primary(),
+                      V.BuildNodeIdForDecl(Field.Accessor));
+  }
 }
 
 }  // namespace kythe
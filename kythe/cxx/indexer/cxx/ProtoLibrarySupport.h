@@ -19,6 +19,15 @@
 #ifndef KYTHE_CXX_INDEXER_CXX_PROTO_LIBRARY_SUPPORT_H_
 #define KYTHE_CXX_INDEXER_CXX_PROTO_LIBRARY_SUPPORT_H_
 
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "clang/AST/DeclCXX.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/StringMap.h"
+
 #include "IndexerLibrarySupport.h"
 
 namespace kythe {
@@ -28,18 +37,50 @@ class GoogleProtoLibrarySupport : public LibrarySupport {
  public:
   GoogleProtoLibrarySupport() {}
 
+  /// \brief Only calls to the ParseProtoHelper conversion are inspected.
+  LibraryInterests getInterests() const override;
+
   void InspectCallExpr(IndexerASTVisitor &V, const clang::CallExpr *CallExpr,
                        const GraphObserver::Range &Range,
                        GraphObserver::NodeId &CalleeId) override;
 
  private:
+  // A field named in a text proto literal.
+  struct FieldReference {
+    // The accessor for the field.
+    const clang::CXXMethodDecl *Accessor;
+    // The byte range of the field's name in the literal.
+    unsigned Begin;
+    unsigned End;
+  };
+
   // Lazily initializes ParseProtoHelperDecl, and returns true if
-  // ParseProtoHelper is available.
+  // ParseProtoHelper is available. Clears the caches below when called with
+  // a new compilation unit.
   bool CompilationUnitHasParseProtoHelperDecl(
       const clang::ASTContext &ASTContext, const clang::CallExpr &Expr);
 
-  bool Initialized = false;
+  // Returns the user-provided accessor of MsgDecl called Name, or null.
+  const clang::CXXMethodDecl *FindAccessor(const clang::CXXRecordDecl &MsgDecl,
+                                           llvm::StringRef Name);
+
+  // Returns the fields named in Literal, parsing it as a MsgDecl the first
+  // time it is seen.
+  const std::vector<FieldReference> &
+  ParseLiteral(const clang::StringLiteral &Literal,
+               const clang::CXXRecordDecl &MsgDecl);
+
+  // The compilation unit the members below describe.
+  const clang::ASTContext *Context = nullptr;
   const clang::Decl *ParseProtoHelperDecl = nullptr;
+  // The accessors of each message class, by name.
+  llvm::DenseMap<const clang::CXXRecordDecl *,
+                 llvm::StringMap<const clang::CXXMethodDecl *>>
+      Accessors;
+  // The fields named in each literal, by message class and literal bytes.
+  std::map<std::pair<const clang::CXXRecordDecl *, std::string>,
+           std::vector<FieldReference>>
+      ParsedLiterals;
 };
 
 }  // namespace kythe
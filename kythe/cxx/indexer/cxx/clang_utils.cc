@@ -16,10 +16,13 @@
 
 #include "kythe/cxx/indexer/cxx/clang_utils.h"
 
+#include "clang/AST/ASTContext.h"
 #include "clang/AST/DeclTemplate.h"
+#include "clang/AST/PrettyPrinter.h"
 #include "clang/Basic/CharInfo.h"
 #include "clang/Lex/Lexer.h"
 #include "glog/logging.h"
+#include "llvm/Support/raw_ostream.h"
 
 namespace kythe {
 bool isObjCSelector(const clang::DeclarationName &DN) {
@@ -229,4 +232,25 @@ const clang::Decl *FindSpecializedTemplate(const clang::Decl *decl) {
   }
   return decl;
 }
+std::string DescribeDecl(const clang::Decl *decl,
+                         const clang::SourceManager &source_manager) {
+  std::string description;
+  llvm::raw_string_ostream out(description);
+  if (llvm::isa<clang::TranslationUnitDecl>(decl)) {
+    out << "<translation unit>";
+  } else if (const auto *named = llvm::dyn_cast<clang::NamedDecl>(decl)) {
+    clang::PrintingPolicy policy(decl->getASTContext().getLangOpts());
+    named->getNameForDiagnostic(out, policy, /*Qualified=*/true);
+  } else {
+    out << decl->getDeclKindName() << "Decl";
+  }
+  if (FindSpecializedTemplate(decl) != decl) {
+    out << " (instantiation)";
+  }
+  if (decl->getLocation().isValid()) {
+    out << " at " << decl->getLocation().printToString(source_manager);
+  }
+  return out.str();
+}
+
 }  // namespace kythe
@@ -17,6 +17,8 @@
 #ifndef KYTHE_CXX_INDEXER_CXX_CLANG_UTILS_H_
 #define KYTHE_CXX_INDEXER_CXX_CLANG_UTILS_H_
 
+#include <string>
+
 #include "clang/AST/Decl.h"
 #include "clang/AST/DeclarationName.h"
 #include "clang/Basic/LangOptions.h"
@@ -125,6 +127,12 @@ bool IsTopLevelNonMacroMacroArgument(
 /// instantiated. Otherwise, returns `decl`.
 const clang::Decl *FindSpecializedTemplate(const clang::Decl *decl);
 
+/// \brief Describes `decl` for people reading a report: its qualified name
+/// (with template arguments), whether it's an implicit instantiation, and
+/// where it is, as in "ns::S<int> (instantiation) at a.h:10:8".
+std::string DescribeDecl(const clang::Decl *decl,
+                         const clang::SourceManager &source_manager);
+
 }  // namespace kythe
 
 #endif  // KYTHE_CXX_INDEXER_CXX_CLANG_UTILS_H_
@@ -0,0 +1,102 @@
+/*
+ * Copyright 2017 Google Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// This file uses the Clang style conventions.
+
+#include "kythe/cxx/indexer/cxx/decl_shards.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+#include "kythe/cxx/indexer/cxx/indexed_parent_map.h"
+
+namespace kythe {
+namespace {
+/// \brief Collects the top-level declarations under a declaration context.
+class TopLevelDeclCollector {
+ public:
+  TopLevelDeclCollector(const clang::SourceManager &SM, bool KeepOthers,
+                        llvm::DenseSet<const clang::Decl *> *Skipped)
+      : SM(SM), KeepOthers(KeepOthers), Skipped(Skipped) {}
+
+  void collect(const clang::DeclContext *DC) {
+    for (const clang::Decl *D : DC->decls()) {
+      clang::SourceLocation Begin = SM.getExpansionLoc(D->getLocStart());
+      bool InMainFile = Begin.isValid() && SM.isInMainFile(Begin);
+      const auto *Context = llvm::dyn_cast<clang::DeclContext>(D);
+      if (IndexedParentASTVisitor::isSkeletonContext(Context)) {
+        if (InMainFile || KeepOthers) {
+          collect(Context);
+        } else {
+          Skipped->insert(D);
+        }
+      } else if (InMainFile) {
+        MainDecls.emplace_back(D, weigh(D, Begin));
+      } else if (!KeepOthers) {
+        Skipped->insert(D);
+      }
+    }
+  }
+
+  /// The main file's top-level declarations in source order, with the
+  /// amount of source text each covers.
+  std::vector<std::pair<const clang::Decl *, uint64_t>> MainDecls;
+
+ private:
+  uint64_t weigh(const clang::Decl *D, clang::SourceLocation Begin) {
+    clang::SourceLocation End = SM.getExpansionLoc(D->getLocEnd());
+    if (End.isInvalid() || SM.getFileID(End) != SM.getFileID(Begin)) {
+      return 1;
+    }
+    unsigned BeginOffset = SM.getFileOffset(Begin);
+    unsigned EndOffset = SM.getFileOffset(End);
+    return EndOffset < BeginOffset ? 1 : EndOffset - BeginOffset + 1;
+  }
+
+  const clang::SourceManager &SM;
+  bool KeepOthers;
+  llvm::DenseSet<const clang::Decl *> *Skipped;
+};
+}  // anonymous namespace
+
+llvm::DenseSet<const clang::Decl *> DeclsOutsideShard(
+    const clang::TranslationUnitDecl &TU, const clang::SourceManager &SM,
+    unsigned Index, unsigned Count) {
+  llvm::DenseSet<const clang::Decl *> Skipped;
+  if (Count <= 1) {
+    return Skipped;
+  }
+  TopLevelDeclCollector Collector(SM, Index == 0, &Skipped);
+  Collector.collect(&TU);
+  uint64_t Total = 0;
+  for (const auto &Decl : Collector.MainDecls) {
+    Total += Decl.second;
+  }
+  // A declaration belongs to the shard in which its text starts.
+  uint64_t Before = 0;
+  for (const auto &Decl : Collector.MainDecls) {
+    uint64_t Shard = std::min<uint64_t>(Count - 1, Before * Count / Total);
+    if (Shard != Index) {
+      Skipped.insert(Decl.first);
+    }
+    Before += Decl.second;
+  }
+  return Skipped;
+}
+
+}  // namespace kythe
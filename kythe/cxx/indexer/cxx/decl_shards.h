@@ -0,0 +1,47 @@
+/*
+ * Copyright 2017 Google Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// This file uses the Clang style conventions.
+
+#ifndef KYTHE_CXX_INDEXER_CXX_DECL_SHARDS_H_
+#define KYTHE_CXX_INDEXER_CXX_DECL_SHARDS_H_
+
+#include "clang/AST/Decl.h"
+#include "clang/Basic/SourceManager.h"
+#include "llvm/ADT/DenseSet.h"
+
+namespace kythe {
+
+/// \brief Splits a translation unit's top-level declarations (those whose
+/// lexical context is the translation unit, a namespace or a linkage
+/// specification) into `Count` shards, so that each shard can be indexed
+/// from its own parse of the unit.
+///
+/// The top-level declarations in the main file are split into `Count` runs
+/// in source order, each covering about the same amount of source text.
+/// Everything outside the main file belongs to shard 0. Shards only depend
+/// on the AST, so every parse of the same unit gets the same shards.
+///
+/// \param Index The shard to keep, less than `Count`.
+/// \return the top-level declarations (and the namespaces outside the main
+/// file) that shard `Index` should not traverse.
+llvm::DenseSet<const clang::Decl *> DeclsOutsideShard(
+    const clang::TranslationUnitDecl &TU, const clang::SourceManager &SM,
+    unsigned Index, unsigned Count);
+
+}  // namespace kythe
+
+#endif  // KYTHE_CXX_INDEXER_CXX_DECL_SHARDS_H_
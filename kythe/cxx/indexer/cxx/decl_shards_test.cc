@@ -0,0 +1,97 @@
+/*
+ * Copyright 2017 Google Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// This file uses the Clang style conventions.
+
+#include "kythe/cxx/indexer/cxx/decl_shards.h"
+
+#include <set>
+#include <string>
+
+#include "clang/Frontend/ASTUnit.h"
+#include "clang/Tooling/Tooling.h"
+#include "gtest/gtest.h"
+
+namespace kythe {
+namespace {
+
+/// \return the names of the named declarations in `Decls`.
+std::set<std::string> Names(const llvm::DenseSet<const clang::Decl *> &Decls) {
+  std::set<std::string> Result;
+  for (const auto *D : Decls) {
+    if (const auto *ND = llvm::dyn_cast<clang::NamedDecl>(D)) {
+      Result.insert(ND->getNameAsString());
+    }
+  }
+  return Result;
+}
+
+constexpr char kCode[] = R"(
+int a() { return 1; }
+namespace ns {
+int b() { return 2; }
+extern "C" {
+int c() { return 3; }
+}
+}
+int d() { return 4; }
+)";
+
+TEST(DeclShardsTest, OneShardSkipsNothing) {
+  auto AST = clang::tooling::buildASTFromCode(kCode);
+  ASSERT_TRUE(AST != nullptr);
+  EXPECT_TRUE(DeclsOutsideShard(*AST->getASTContext().getTranslationUnitDecl(),
+                                AST->getSourceManager(), 0, 1)
+                  .empty());
+}
+
+TEST(DeclShardsTest, SplitsMainFileDeclsInOrder) {
+  auto AST = clang::tooling::buildASTFromCode(kCode);
+  ASSERT_TRUE(AST != nullptr);
+  const auto &TU = *AST->getASTContext().getTranslationUnitDecl();
+  const auto &SM = AST->getSourceManager();
+  // Each function is about as long as the others.
+  EXPECT_EQ((std::set<std::string>{"c", "d"}),
+            Names(DeclsOutsideShard(TU, SM, 0, 2)));
+  // Declarations outside the main file (like the builtin typedefs) are left
+  // to shard 0.
+  auto Second = Names(DeclsOutsideShard(TU, SM, 1, 2));
+  EXPECT_EQ(1, Second.count("a"));
+  EXPECT_EQ(1, Second.count("b"));
+  EXPECT_EQ(0, Second.count("c"));
+  EXPECT_EQ(0, Second.count("d"));
+  EXPECT_EQ(1, Second.count("__builtin_va_list"));
+  // Namespaces are entered by every shard.
+  EXPECT_EQ(0, Second.count("ns"));
+}
+
+TEST(DeclShardsTest, ExtraShardsAreEmpty) {
+  auto AST = clang::tooling::buildASTFromCode("int a;");
+  ASSERT_TRUE(AST != nullptr);
+  const auto &TU = *AST->getASTContext().getTranslationUnitDecl();
+  const auto &SM = AST->getSourceManager();
+  EXPECT_EQ(0, Names(DeclsOutsideShard(TU, SM, 0, 3)).count("a"));
+  EXPECT_EQ(1, Names(DeclsOutsideShard(TU, SM, 1, 3)).count("a"));
+  EXPECT_EQ(1, Names(DeclsOutsideShard(TU, SM, 2, 3)).count("a"));
+}
+
+}  // namespace
+}  // namespace kythe
+
+int main(int argc, char **argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,115 @@
+/*
+ * Copyright 2017 Google Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// This file uses the Clang style conventions.
+
+#include "kythe/cxx/indexer/cxx/dedup_set.h"
+
+#include <algorithm>
+
+#include "glog/logging.h"
+#include "llvm/ADT/Hashing.h"
+
+namespace kythe {
+namespace {
+/// \return the 64-bit FNV-1a hash of `Key`, which is independent of
+/// `llvm::hash_value`.
+uint64_t HashFNV1a(llvm::StringRef Key) {
+  uint64_t Hash = 14695981039346656037ULL;
+  for (unsigned char C : Key) {
+    Hash = (Hash ^ C) * 1099511628211ULL;
+  }
+  return Hash;
+}
+}  // anonymous namespace
+
+DedupSet::DedupSet(unsigned FingerprintBits) : Words(FingerprintBits / 64) {
+  CHECK(FingerprintBits == 0 || FingerprintBits == 64 ||
+        FingerprintBits == 128)
+      << "Fingerprints must have 0, 64 or 128 bits.";
+}
+
+bool DedupSet::insert(llvm::StringRef Key) {
+  if (Words == 0) {
+    if (!Keys.insert(Key.str()).second) {
+      return false;
+    }
+    KeyBytes += Key.size();
+    return true;
+  }
+  uint64_t Fingerprint[2] = {static_cast<uint64_t>(llvm::hash_value(Key)),
+                             Words > 1 ? HashFNV1a(Key) : 0};
+  if (Fingerprint[0] == 0 && Fingerprint[1] == 0) {
+    // All-zero slots are empty.
+    Fingerprint[0] = 1;
+  }
+  return insertFingerprint(Fingerprint);
+}
+
+bool DedupSet::insertFingerprint(const uint64_t *Fingerprint) {
+  // Keep the table at most half full.
+  if ((Fingerprints + 1) * 2 * Words > Slots.size()) {
+    grow();
+  }
+  size_t Mask = Slots.size() / Words - 1;
+  for (size_t Slot = Fingerprint[0] & Mask;; Slot = (Slot + 1) & Mask) {
+    uint64_t *Entry = &Slots[Slot * Words];
+    if (std::equal(Fingerprint, Fingerprint + Words, Entry)) {
+      return false;
+    }
+    if (std::all_of(Entry, Entry + Words, [](uint64_t W) { return W == 0; })) {
+      std::copy(Fingerprint, Fingerprint + Words, Entry);
+      ++Fingerprints;
+      return true;
+    }
+  }
+}
+
+void DedupSet::grow() {
+  std::vector<uint64_t> Old;
+  Old.swap(Slots);
+  Slots.resize(std::max<size_t>(Old.size() * 2, 64 * Words));
+  Fingerprints = 0;
+  for (size_t I = 0; I < Old.size(); I += Words) {
+    if (std::any_of(&Old[I], &Old[I] + Words,
+                    [](uint64_t W) { return W != 0; })) {
+      insertFingerprint(&Old[I]);
+    }
+  }
+}
+
+size_t DedupSet::size() const {
+  return Words == 0 ? Keys.size() : Fingerprints;
+}
+
+size_t DedupSet::allocatedBytes() const {
+  // Each exact key takes a hash node (a next pointer, the cached hash and the
+  // string) and a bucket pointer; keys too long for the small-string buffer
+  // also own their characters.
+  size_t NodeBytes = 2 * sizeof(void *) + sizeof(std::string);
+  size_t Exact = Keys.size() * NodeBytes +
+                 Keys.bucket_count() * sizeof(void *) + KeyBytes;
+  return Exact + Slots.capacity() * sizeof(uint64_t);
+}
+
+void DedupSet::clear() {
+  Keys.clear();
+  KeyBytes = 0;
+  Slots.clear();
+  Fingerprints = 0;
+}
+
+}  // namespace kythe
@@ -0,0 +1,85 @@
+/*
+ * Copyright 2017 Google Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// This file uses the Clang style conventions.
+
+#ifndef KYTHE_CXX_INDEXER_CXX_DEDUP_SET_H_
+#define KYTHE_CXX_INDEXER_CXX_DEDUP_SET_H_
+
+#include <cstdint>
+#include <string>
+#include <unordered_set>
+#include <vector>
+
+#include "llvm/ADT/StringRef.h"
+
+namespace kythe {
+
+/// \brief A set of strings that only answers whether a string was inserted
+/// before.
+///
+/// By default the set keeps the strings themselves. It can instead keep
+/// 64- or 128-bit fingerprints of them in an open-addressing table, which
+/// takes a small fraction of the memory but treats two strings with the same
+/// fingerprint as equal. A set of N strings with B-bit fingerprints has about
+/// N^2 / 2^(B+1) such collisions in expectation; for 10^7 strings that's
+/// about 3 * 10^-6 with 64 bits and negligible with 128 bits.
+class DedupSet {
+ public:
+  /// \param FingerprintBits 0 to keep exact strings; otherwise 64 or 128.
+  explicit DedupSet(unsigned FingerprintBits = 0);
+
+  /// \brief Adds `Key` to the set.
+  /// \return true if `Key` (or, with fingerprints, a string with the same
+  /// fingerprint) was not already in the set.
+  bool insert(llvm::StringRef Key);
+
+  /// \return the number of distinct keys (or fingerprints) in the set.
+  size_t size() const;
+
+  /// \return the number of bits per fingerprint, or 0 if keys are exact.
+  unsigned fingerprint_bits() const { return Words * 64; }
+
+  /// \brief Removes every key from the set.
+  void clear();
+
+  /// \return an estimate of the bytes the set has allocated.
+  size_t allocatedBytes() const;
+
+ private:
+  /// \brief Adds the fingerprint starting at `Fingerprint` (which is `Words`
+  /// long and not all zero) to `Slots`.
+  bool insertFingerprint(const uint64_t *Fingerprint);
+
+  /// \brief Doubles the number of slots.
+  void grow();
+
+  /// The number of 64-bit words in each fingerprint (0 if keys are exact).
+  unsigned Words;
+  /// The exact keys, if `Words` is 0.
+  std::unordered_set<std::string> Keys;
+  /// The total length of `Keys`.
+  size_t KeyBytes = 0;
+  /// Fingerprints, `Words` to a slot; a slot of zeros is empty. The number of
+  /// slots is zero or a power of two.
+  std::vector<uint64_t> Slots;
+  /// The number of nonempty slots.
+  size_t Fingerprints = 0;
+};
+
+}  // namespace kythe
+
+#endif  // KYTHE_CXX_INDEXER_CXX_DEDUP_SET_H_
@@ -0,0 +1,78 @@
+/*
+ * Copyright 2017 Google Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// This file uses the Clang style conventions.
+
+#include "kythe/cxx/indexer/cxx/dedup_set.h"
+
+#include <string>
+
+#include "gtest/gtest.h"
+
+namespace kythe {
+namespace {
+
+class DedupSetTest : public ::testing::TestWithParam<unsigned> {};
+
+TEST_P(DedupSetTest, InsertsEachKeyOnce) {
+  DedupSet Set(GetParam());
+  EXPECT_EQ(GetParam(), Set.fingerprint_bits());
+  EXPECT_TRUE(Set.insert("a"));
+  EXPECT_TRUE(Set.insert("b"));
+  EXPECT_TRUE(Set.insert(""));
+  EXPECT_FALSE(Set.insert("a"));
+  EXPECT_FALSE(Set.insert(""));
+  EXPECT_EQ(3, Set.size());
+}
+
+TEST_P(DedupSetTest, KeepsKeysWhileGrowing) {
+  DedupSet Set(GetParam());
+  for (int I = 0; I < 10000; ++I) {
+    EXPECT_TRUE(Set.insert("key" + std::to_string(I)));
+  }
+  for (int I = 0; I < 10000; ++I) {
+    EXPECT_FALSE(Set.insert("key" + std::to_string(I)));
+  }
+  EXPECT_EQ(10000, Set.size());
+}
+
+TEST_P(DedupSetTest, ClearForgetsKeys) {
+  DedupSet Set(GetParam());
+  EXPECT_TRUE(Set.insert("a"));
+  Set.clear();
+  EXPECT_EQ(0, Set.size());
+  EXPECT_TRUE(Set.insert("a"));
+}
+
+TEST_P(DedupSetTest, AllocatedBytesGrowWithKeys) {
+  DedupSet Set(GetParam());
+  size_t Empty = Set.allocatedBytes();
+  for (int I = 0; I < 1000; ++I) {
+    Set.insert("key" + std::to_string(I));
+  }
+  EXPECT_LT(Empty + 1000 * sizeof(uint64_t), Set.allocatedBytes());
+}
+
+INSTANTIATE_TEST_CASE_P(FingerprintBits, DedupSetTest,
+                        ::testing::Values(0, 64, 128));
+
+}  // namespace
+}  // namespace kythe
+
+int main(int argc, char **argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
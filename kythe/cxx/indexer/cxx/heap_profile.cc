@@ -0,0 +1,196 @@
+/*
+ * Copyright 2017 Google Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// This file uses the Clang style conventions.
+
+#include "kythe/cxx/indexer/cxx/heap_profile.h"
+
+#include <signal.h>
+#if defined(__GLIBC__)
+#include <malloc.h>
+#endif
+
+#include <atomic>
+#include <cstddef>
+#include <cstring>
+
+#include "glog/logging.h"
+
+#if defined(__linux__)
+// The allocators' own interfaces, declared weak so that they're null unless
+// the process was linked (or preloaded) with the allocator that has them.
+// See //third_party:malloc for the build variants that link them.
+extern "C" {
+// gperftools' tcmalloc.
+int MallocExtension_GetNumericProperty(const char *Property, size_t *Value)
+    __attribute__((weak));
+int IsHeapProfilerRunning() __attribute__((weak));
+void HeapProfilerDump(const char *Reason) __attribute__((weak));
+// jemalloc.
+int mallctl(const char *Name, void *OldValue, size_t *OldLength,
+            void *NewValue, size_t NewLength) __attribute__((weak));
+}
+#define KYTHE_HEAP_PROFILE_WEAK_ALLOCATORS 1
+#endif
+
+namespace kythe {
+namespace {
+/// Set by the signal handler installed by `RequestHeapProfileOnSignal`.
+/// Lock-free, so the handler may set it, and exchanged so that only one
+/// worker writes each requested profile.
+std::atomic<bool> HeapProfileRequested(false);
+
+void RequestHeapProfile(int) { HeapProfileRequested.store(true); }
+
+#if defined(KYTHE_HEAP_PROFILE_WEAK_ALLOCATORS)
+bool HaveTcmalloc() { return MallocExtension_GetNumericProperty != nullptr; }
+
+bool HaveJemalloc() { return mallctl != nullptr; }
+
+/// \brief Reads one of tcmalloc's numeric properties into `Value`.
+bool ReadTcmallocProperty(const char *Property, uint64_t *Value) {
+  size_t Read = 0;
+  if (!MallocExtension_GetNumericProperty(Property, &Read)) {
+    return false;
+  }
+  *Value = Read;
+  return true;
+}
+
+/// \brief Reads one of jemalloc's `size_t` statistics into `Value`.
+bool ReadJemallocStat(const char *Name, uint64_t *Value) {
+  size_t Read = 0;
+  size_t Length = sizeof(Read);
+  if (mallctl(Name, &Read, &Length, nullptr, 0) != 0) {
+    return false;
+  }
+  *Value = Read;
+  return true;
+}
+#endif
+}  // anonymous namespace
+
+const char *HeapAllocatorName() {
+#if defined(KYTHE_HEAP_PROFILE_WEAK_ALLOCATORS)
+  if (HaveTcmalloc()) {
+    return "tcmalloc";
+  }
+  if (HaveJemalloc()) {
+    return "jemalloc";
+  }
+#endif
+#if defined(__GLIBC__)
+  return "glibc";
+#else
+  return "unknown";
+#endif
+}
+
+bool ReadHeapStats(HeapStats *Stats) {
+#if defined(KYTHE_HEAP_PROFILE_WEAK_ALLOCATORS)
+  if (HaveTcmalloc()) {
+    return ReadTcmallocProperty("generic.current_allocated_bytes",
+                                &Stats->AllocatedBytes) &&
+           ReadTcmallocProperty("generic.heap_size", &Stats->HeapBytes);
+  }
+  if (HaveJemalloc()) {
+    // jemalloc's statistics are a snapshot taken when the epoch advances.
+    uint64_t Epoch = 1;
+    size_t Length = sizeof(Epoch);
+    mallctl("epoch", &Epoch, &Length, &Epoch, sizeof(Epoch));
+    return ReadJemallocStat("stats.allocated", &Stats->AllocatedBytes) &&
+           ReadJemallocStat("stats.resident", &Stats->HeapBytes);
+  }
+#endif
+#if defined(__GLIBC__)
+#if __GLIBC_PREREQ(2, 33)
+  struct mallinfo2 Info = ::mallinfo2();
+#else
+  // The older `mallinfo` counts in `int`s, which wrap past 2GiB.
+  struct mallinfo Info = ::mallinfo();
+#endif
+  Stats->AllocatedBytes = static_cast<uint64_t>(Info.uordblks) +
+                          static_cast<uint64_t>(Info.hblkhd);
+  Stats->HeapBytes =
+      static_cast<uint64_t>(Info.arena) + static_cast<uint64_t>(Info.hblkhd);
+  return true;
+#else
+  return false;
+#endif
+}
+
+uint64_t AllocatedHeapBytes() {
+  HeapStats Stats;
+  return ReadHeapStats(&Stats) ? Stats.AllocatedBytes : 0;
+}
+
+bool DumpHeapProfile(const char *Reason, std::string *ErrorText) {
+#if defined(KYTHE_HEAP_PROFILE_WEAK_ALLOCATORS)
+  if (HaveTcmalloc()) {
+    if (HeapProfilerDump == nullptr || IsHeapProfilerRunning == nullptr) {
+      *ErrorText = "this tcmalloc has no heap profiler";
+      return false;
+    }
+    if (!IsHeapProfilerRunning()) {
+      *ErrorText = "the heap profiler isn't running (set HEAPPROFILE)";
+      return false;
+    }
+    HeapProfilerDump(Reason);
+    return true;
+  }
+  if (HaveJemalloc()) {
+    // A null file name writes to jemalloc's `prof_prefix`.
+    const char *FileName = nullptr;
+    int Error =
+        mallctl("prof.dump", nullptr, nullptr, &FileName, sizeof(FileName));
+    if (Error != 0) {
+      *ErrorText = std::string("jemalloc couldn't write a profile (") +
+                   ::strerror(Error) + "; set MALLOC_CONF=prof:true)";
+      return false;
+    }
+    return true;
+  }
+#endif
+  *ErrorText = std::string("the ") + HeapAllocatorName() +
+               " allocator has no heap profiler";
+  return false;
+}
+
+bool RequestHeapProfileOnSignal(int Signal) {
+  struct sigaction Action;
+  ::memset(&Action, 0, sizeof(Action));
+  Action.sa_handler = RequestHeapProfile;
+  sigemptyset(&Action.sa_mask);
+  Action.sa_flags = SA_RESTART;
+  return ::sigaction(Signal, &Action, nullptr) == 0;
+}
+
+bool DumpRequestedHeapProfile(const char *Reason) {
+  if (!HeapProfileRequested.load(std::memory_order_relaxed) ||
+      !HeapProfileRequested.exchange(false)) {
+    return false;
+  }
+  std::string ErrorText;
+  if (DumpHeapProfile(Reason, &ErrorText)) {
+    LOG(INFO) << "Wrote a heap profile at " << Reason;
+  } else {
+    LOG(WARNING) << "Couldn't write a heap profile at " << Reason << ": "
+                 << ErrorText;
+  }
+  return true;
+}
+
+}  // namespace kythe
@@ -0,0 +1,75 @@
+/*
+ * Copyright 2017 Google Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// This file uses the Clang style conventions.
+
+#ifndef KYTHE_CXX_INDEXER_CXX_HEAP_PROFILE_H_
+#define KYTHE_CXX_INDEXER_CXX_HEAP_PROFILE_H_
+
+#include <cstdint>
+#include <string>
+
+namespace kythe {
+
+/// \brief Statistics about the process's heap, as its allocator sees them.
+struct HeapStats {
+  /// Bytes in blocks the program has allocated and not yet freed.
+  uint64_t AllocatedBytes = 0;
+  /// Bytes the allocator holds from the system, including free blocks it
+  /// hasn't returned. The difference from `AllocatedBytes` is fragmentation
+  /// and caching.
+  uint64_t HeapBytes = 0;
+};
+
+/// \return the allocator the process is running with: "tcmalloc" (from
+/// gperftools), "jemalloc", "glibc" or "unknown". The allocator is found at
+/// run time, so this also covers allocators loaded with `LD_PRELOAD`.
+const char *HeapAllocatorName();
+
+/// \brief Reads the allocator's statistics.
+/// \return false if the allocator doesn't report them.
+bool ReadHeapStats(HeapStats *Stats);
+
+/// \return the bytes the program has allocated and not yet freed, or 0 if
+/// the allocator doesn't say. This is cheap enough to call at the boundaries
+/// of coarse phases, but not around every allocation.
+uint64_t AllocatedHeapBytes();
+
+/// \brief Writes a heap profile through the allocator's heap profiler.
+///
+/// The profiler has to be running: with tcmalloc, set `HEAPPROFILE` to the
+/// profiles' path prefix; with jemalloc, set `MALLOC_CONF=prof:true` (and
+/// `prof_prefix` to choose where they go).
+/// \param Reason Why the profile was written; tcmalloc records it in the
+/// profile's name.
+/// \param ErrorText Set to a description of the problem on failure.
+/// \return true if a profile was written.
+bool DumpHeapProfile(const char *Reason, std::string *ErrorText);
+
+/// \brief Arranges for `Signal` to request a heap profile. The handler only
+/// records the request; call `DumpRequestedHeapProfile` somewhere safe to
+/// write it.
+/// \return false if the handler couldn't be installed.
+bool RequestHeapProfileOnSignal(int Signal);
+
+/// \brief Writes a heap profile if one was requested since the last call.
+/// \param Reason Passed to `DumpHeapProfile`.
+/// \return true if a profile was requested (whether or not it was written).
+bool DumpRequestedHeapProfile(const char *Reason);
+
+}  // namespace kythe
+
+#endif  // KYTHE_CXX_INDEXER_CXX_HEAP_PROFILE_H_
@@ -0,0 +1,84 @@
+/*
+ * Copyright 2017 Google Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// This file uses the Clang style conventions.
+
+#include "kythe/cxx/indexer/cxx/heap_profile.h"
+
+#include <signal.h>
+
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <string>
+
+#include "gtest/gtest.h"
+
+namespace kythe {
+namespace {
+
+TEST(HeapProfile, NamesTheAllocator) {
+  const std::string Name = HeapAllocatorName();
+  EXPECT_TRUE(Name == "tcmalloc" || Name == "jemalloc" || Name == "glibc" ||
+              Name == "unknown")
+      << Name;
+}
+
+TEST(HeapProfile, CountsLiveAllocations) {
+  HeapStats Before;
+  if (!ReadHeapStats(&Before)) {
+    return;
+  }
+  EXPECT_LE(Before.AllocatedBytes, Before.HeapBytes);
+  const size_t Size = 64 << 20;
+  std::unique_ptr<char[]> Block(new char[Size]);
+  // Touch the block so that the allocation can't be elided.
+  ::memset(Block.get(), 1, Size);
+  HeapStats During;
+  ASSERT_TRUE(ReadHeapStats(&During));
+  EXPECT_GE(During.AllocatedBytes, Before.AllocatedBytes + Size / 2);
+  Block.reset();
+  EXPECT_LT(AllocatedHeapBytes(), During.AllocatedBytes);
+}
+
+TEST(HeapProfile, ExplainsMissingProfiles) {
+  if (::getenv("HEAPPROFILE") != nullptr) {
+    return;
+  }
+  const std::string Name = HeapAllocatorName();
+  if (Name == "jemalloc") {
+    return;
+  }
+  std::string ErrorText;
+  EXPECT_FALSE(DumpHeapProfile("test", &ErrorText));
+  EXPECT_FALSE(ErrorText.empty());
+}
+
+TEST(HeapProfile, DumpsOncePerSignal) {
+  EXPECT_FALSE(DumpRequestedHeapProfile("before"));
+  ASSERT_TRUE(RequestHeapProfileOnSignal(SIGUSR2));
+  ASSERT_EQ(0, ::raise(SIGUSR2));
+  EXPECT_TRUE(DumpRequestedHeapProfile("after"));
+  EXPECT_FALSE(DumpRequestedHeapProfile("again"));
+}
+
+}  // namespace
+}  // namespace kythe
+
+int main(int argc, char **argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
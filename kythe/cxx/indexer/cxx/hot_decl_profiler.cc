@@ -0,0 +1,118 @@
+/*
+ * Copyright 2017 Google Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// This file uses the Clang style conventions.
+
+#include "kythe/cxx/indexer/cxx/hot_decl_profiler.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cinttypes>
+#include <cstdio>
+#include <utility>
+
+namespace kythe {
+
+HotDeclProfiler::HotDeclProfiler(size_t TopN, Counter Clock)
+    : TopN(TopN), Clock(std::move(Clock)) {
+  if (!this->Clock) {
+    this->Clock = [] {
+      return static_cast<uint64_t>(
+          std::chrono::duration_cast<std::chrono::nanoseconds>(
+              std::chrono::steady_clock::now().time_since_epoch())
+              .count());
+    };
+  }
+}
+
+void HotDeclProfiler::charge() {
+  uint64_t Nanos = Clock();
+  uint64_t EntriesNow = read(Entries);
+  uint64_t EmitNanosNow = read(EmitNanos);
+  if (!Stack.empty()) {
+    auto &C = Costs[Stack.back()];
+    C.SelfNanos += Nanos - LastNanos;
+    C.Entries += EntriesNow - LastEntries;
+    C.EmitNanos += EmitNanosNow - LastEmitNanos;
+  }
+  LastNanos = Nanos;
+  LastEntries = EntriesNow;
+  LastEmitNanos = EmitNanosNow;
+}
+
+void HotDeclProfiler::enter(const void *Key) {
+  charge();
+  Stack.push_back(Key);
+  ++Costs[Key].Visits;
+}
+
+void HotDeclProfiler::exit() {
+  charge();
+  Stack.pop_back();
+}
+
+void HotDeclProfiler::resolve(const Describer &Describe) {
+  std::vector<std::pair<const void *, Cost>> Sorted(Costs.begin(),
+                                                    Costs.end());
+  Costs.clear();
+  Decls = Sorted.size();
+  for (const auto &Entry : Sorted) {
+    Total.SelfNanos += Entry.second.SelfNanos;
+    Total.EmitNanos += Entry.second.EmitNanos;
+    Total.Entries += Entry.second.Entries;
+    Total.Visits += Entry.second.Visits;
+  }
+  size_t N = std::min(TopN, Sorted.size());
+  auto Hotter = [](const std::pair<const void *, Cost> &A,
+                   const std::pair<const void *, Cost> &B) {
+    return A.second.SelfNanos > B.second.SelfNanos;
+  };
+  std::partial_sort(Sorted.begin(), Sorted.begin() + N, Sorted.end(), Hotter);
+  Hottest.clear();
+  for (size_t I = 0; I < N; ++I) {
+    const auto &C = Sorted[I].second;
+    Hottest.emplace_back();
+    auto &Decl = Hottest.back();
+    Decl.Description = Describe(Sorted[I].first);
+    Decl.SelfNanos = C.SelfNanos;
+    Decl.EmitNanos = C.EmitNanos;
+    Decl.Entries = C.Entries;
+    Decl.Visits = C.Visits;
+  }
+}
+
+std::string HotDeclProfiler::report() const {
+  char Line[256];
+  snprintf(Line, sizeof(Line), "%10s %10s %10s %7s  %s\n", "self_ms",
+           "emit_ms", "entries", "visits", "declaration");
+  std::string Out = Line;
+  for (const auto &Decl : Hottest) {
+    snprintf(Line, sizeof(Line), "%10.3f %10.3f %10" PRIu64 " %7" PRIu64 "  ",
+             Decl.SelfNanos / 1e6, Decl.EmitNanos / 1e6, Decl.Entries,
+             Decl.Visits);
+    Out += Line;
+    Out += Decl.Description;
+    Out += "\n";
+  }
+  snprintf(Line, sizeof(Line),
+           "%10.3f %10.3f %10" PRIu64 " %7" PRIu64 "  (%zu in all)\n",
+           Total.SelfNanos / 1e6, Total.EmitNanos / 1e6, Total.Entries,
+           Total.Visits, Decls);
+  Out += Line;
+  return Out;
+}
+
+}  // namespace kythe
@@ -0,0 +1,154 @@
+/*
+ * Copyright 2017 Google Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// This file uses the Clang style conventions.
+
+#ifndef KYTHE_CXX_INDEXER_CXX_HOT_DECL_PROFILER_H_
+#define KYTHE_CXX_INDEXER_CXX_HOT_DECL_PROFILER_H_
+
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "llvm/ADT/DenseMap.h"
+
+namespace kythe {
+
+/// \brief Attributes a unit's indexing time and entries to the top-level
+/// declarations (and implicit instantiation jobs) they were spent on, so
+/// that the worst ones in a pathological unit can be reported.
+///
+/// The indexer `enter`s a declaration as it starts traversing it and `exit`s
+/// it when it's done. Time and entries are charged to the innermost
+/// declaration that has been entered, so a namespace is only charged for
+/// what isn't charged to the declarations inside it, and the charges add up
+/// to the unit's traversal. Declarations are identified by opaque keys until
+/// `resolve` describes the hottest ones. Not thread-safe.
+class HotDeclProfiler {
+ public:
+  /// \brief Returns a running total, such as the nanoseconds since some
+  /// fixed point or the number of entries written so far.
+  using Counter = std::function<uint64_t()>;
+
+  /// \param TopN How many declarations to report.
+  /// \param Clock Returns the time in nanoseconds; defaults to
+  /// `std::chrono::steady_clock`.
+  explicit HotDeclProfiler(size_t TopN, Counter Clock = Counter());
+
+  /// \brief Counts the entries recorded so far. Only called between
+  /// `enter`s and `exit`s.
+  void setEntryCounter(Counter C) { Entries = std::move(C); }
+
+  /// \brief Counts the nanoseconds spent writing entries so far. Only called
+  /// between `enter`s and `exit`s.
+  void setEmitNanosCounter(Counter C) { EmitNanos = std::move(C); }
+
+  /// \brief Starts charging the declaration identified by `Key`.
+  void enter(const void *Key);
+
+  /// \brief Goes back to charging the declaration that was being charged
+  /// before the last unmatched `enter`.
+  void exit();
+
+  /// \brief Enters a declaration for as long as it's in scope.
+  class Scope {
+   public:
+    /// \param Profiler The profiler to use; may be null, in which case the
+    /// scope does nothing.
+    Scope(HotDeclProfiler *Profiler, const void *Key) : Profiler(Profiler) {
+      if (Profiler != nullptr) {
+        Profiler->enter(Key);
+      }
+    }
+    Scope(const Scope &) = delete;
+    Scope &operator=(const Scope &) = delete;
+    ~Scope() {
+      if (Profiler != nullptr) {
+        Profiler->exit();
+      }
+    }
+
+   private:
+    HotDeclProfiler *Profiler;
+  };
+
+  /// \brief A declaration in the report.
+  struct HotDecl {
+    /// What the declaration is and where it is.
+    std::string Description;
+    /// The time charged to the declaration, including `EmitNanos`.
+    uint64_t SelfNanos = 0;
+    /// The time spent writing the declaration's entries.
+    uint64_t EmitNanos = 0;
+    /// The number of entries charged to the declaration.
+    uint64_t Entries = 0;
+    /// The number of times the declaration was entered.
+    uint64_t Visits = 0;
+  };
+
+  /// \brief Describes a key passed to `enter`.
+  using Describer = std::function<std::string(const void *Key)>;
+
+  /// \brief Picks the `TopN` declarations with the most time charged to them
+  /// and describes them with `Describe`, then forgets every key (so that
+  /// what they point to can be freed). Call once traversal is over.
+  void resolve(const Describer &Describe);
+
+  /// \return the declarations picked by `resolve`, hottest first.
+  const std::vector<HotDecl> &hottest() const { return Hottest; }
+
+  /// \return a table of `hottest`, followed by totals over every
+  /// declaration.
+  std::string report() const;
+
+ private:
+  /// \brief What's been charged to one declaration.
+  struct Cost {
+    uint64_t SelfNanos = 0;
+    uint64_t EmitNanos = 0;
+    uint64_t Entries = 0;
+    uint64_t Visits = 0;
+  };
+
+  /// \brief Charges everything since the last call to the top of `Stack`.
+  void charge();
+
+  /// \return `C()`, or 0 if `C` is empty.
+  static uint64_t read(const Counter &C) { return C ? C() : 0; }
+
+  size_t TopN;
+  Counter Clock;
+  Counter Entries;
+  Counter EmitNanos;
+  /// The declarations that have been entered and not exited, innermost last.
+  std::vector<const void *> Stack;
+  /// The counters' values when `charge` last ran.
+  uint64_t LastNanos = 0;
+  uint64_t LastEntries = 0;
+  uint64_t LastEmitNanos = 0;
+  /// What's been charged to each declaration, until `resolve`.
+  llvm::DenseMap<const void *, Cost> Costs;
+  /// The results of `resolve`.
+  std::vector<HotDecl> Hottest;
+  /// The number of declarations charged and their total cost.
+  size_t Decls = 0;
+  Cost Total;
+};
+
+}  // namespace kythe
+
+#endif  // KYTHE_CXX_INDEXER_CXX_HOT_DECL_PROFILER_H_
@@ -0,0 +1,141 @@
+/*
+ * Copyright 2017 Google Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// This file uses the Clang style conventions.
+
+#include "kythe/cxx/indexer/cxx/hot_decl_profiler.h"
+
+#include "gtest/gtest.h"
+
+namespace kythe {
+namespace {
+
+/// \brief Counters that the test advances by hand.
+struct FakeCounters {
+  HotDeclProfiler::Counter nanos() {
+    return [this] { return Nanos; };
+  }
+  HotDeclProfiler::Counter entries() {
+    return [this] { return Entries; };
+  }
+  HotDeclProfiler::Counter emitNanos() {
+    return [this] { return EmitNanos; };
+  }
+  uint64_t Nanos = 0;
+  uint64_t Entries = 0;
+  uint64_t EmitNanos = 0;
+};
+
+/// \brief Describes the keys the tests use, which point at C strings.
+std::string Describe(const void *Key) {
+  return static_cast<const char *>(Key);
+}
+
+TEST(HotDeclProfilerTest, ChargesInnermostDecl) {
+  FakeCounters Counters;
+  HotDeclProfiler Profiler(10, Counters.nanos());
+  Profiler.setEntryCounter(Counters.entries());
+  Profiler.setEmitNanosCounter(Counters.emitNanos());
+  static const char Outer[] = "ns";
+  static const char Inner[] = "ns::f";
+  {
+    HotDeclProfiler::Scope OuterScope(&Profiler, Outer);
+    Counters.Nanos += 100;
+    Counters.Entries += 1;
+    {
+      HotDeclProfiler::Scope InnerScope(&Profiler, Inner);
+      Counters.Nanos += 5000;
+      Counters.EmitNanos += 300;
+      Counters.Entries += 20;
+    }
+    Counters.Nanos += 50;
+  }
+  Profiler.resolve(Describe);
+  const auto &Hottest = Profiler.hottest();
+  ASSERT_EQ(2, Hottest.size());
+  EXPECT_EQ("ns::f", Hottest[0].Description);
+  EXPECT_EQ(5000, Hottest[0].SelfNanos);
+  EXPECT_EQ(300, Hottest[0].EmitNanos);
+  EXPECT_EQ(20, Hottest[0].Entries);
+  EXPECT_EQ(1, Hottest[0].Visits);
+  EXPECT_EQ("ns", Hottest[1].Description);
+  EXPECT_EQ(150, Hottest[1].SelfNanos);
+  EXPECT_EQ(1, Hottest[1].Entries);
+}
+
+TEST(HotDeclProfilerTest, SumsRepeatedVisits) {
+  FakeCounters Counters;
+  HotDeclProfiler Profiler(10, Counters.nanos());
+  static const char Decl[] = "S<int>";
+  for (int I = 0; I < 3; ++I) {
+    HotDeclProfiler::Scope Scope(&Profiler, Decl);
+    Counters.Nanos += 10;
+  }
+  Profiler.resolve(Describe);
+  ASSERT_EQ(1, Profiler.hottest().size());
+  EXPECT_EQ(30, Profiler.hottest()[0].SelfNanos);
+  EXPECT_EQ(3, Profiler.hottest()[0].Visits);
+}
+
+TEST(HotDeclProfilerTest, KeepsTopN) {
+  FakeCounters Counters;
+  HotDeclProfiler Profiler(2, Counters.nanos());
+  static const char *const Decls[] = {"a", "b", "c", "d"};
+  uint64_t Costs[] = {30, 10, 40, 20};
+  for (int I = 0; I < 4; ++I) {
+    HotDeclProfiler::Scope Scope(&Profiler, Decls[I]);
+    Counters.Nanos += Costs[I];
+  }
+  size_t Described = 0;
+  Profiler.resolve([&Described](const void *Key) {
+    ++Described;
+    return Describe(Key);
+  });
+  EXPECT_EQ(2, Described);
+  ASSERT_EQ(2, Profiler.hottest().size());
+  EXPECT_EQ("c", Profiler.hottest()[0].Description);
+  EXPECT_EQ("a", Profiler.hottest()[1].Description);
+  std::string Report = Profiler.report();
+  EXPECT_NE(std::string::npos, Report.find("(4 in all)"));
+  EXPECT_NE(std::string::npos, Report.find("0.000"));
+}
+
+TEST(HotDeclProfilerTest, IgnoresTimeOutsideDecls) {
+  FakeCounters Counters;
+  HotDeclProfiler Profiler(10, Counters.nanos());
+  static const char Decl[] = "f";
+  Counters.Nanos += 1000;
+  {
+    HotDeclProfiler::Scope Scope(&Profiler, Decl);
+    Counters.Nanos += 10;
+  }
+  Counters.Nanos += 1000;
+  Profiler.resolve(Describe);
+  ASSERT_EQ(1, Profiler.hottest().size());
+  EXPECT_EQ(10, Profiler.hottest()[0].SelfNanos);
+}
+
+TEST(HotDeclProfilerTest, NullScopeDoesNothing) {
+  HotDeclProfiler::Scope Scope(nullptr, "f");
+}
+
+}  // namespace
+}  // namespace kythe
+
+int main(int argc, char **argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,186 @@
+/*
+ * Copyright 2017 Google Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// This file uses the Clang style conventions.
+
+#include "indexed_parent_map.h"
+
+#include "clang/AST/DeclCXX.h"
+#include "glog/logging.h"
+
+namespace kythe {
+
+PackedIndexedParent::PackedIndexedParent(const IndexedParent &Parent)
+    : Index(Parent.Index) {
+  CHECK(Index == Parent.Index) << "Child index out of range.";
+  if (const auto *S = Parent.Parent.get<clang::Stmt>()) {
+    ParentNode.setPointerAndInt(S, true);
+  } else {
+    const auto *D = Parent.Parent.get<clang::Decl>();
+    CHECK(D != nullptr) << "Only Decls and Stmts may be parents.";
+    ParentNode.setPointerAndInt(D, false);
+  }
+}
+
+IndexedParent PackedIndexedParent::unpack() const {
+  if (ParentNode.getInt()) {
+    return {clang::ast_type_traits::DynTypedNode::create(
+                *static_cast<const clang::Stmt *>(ParentNode.getPointer())),
+            Index};
+  }
+  return {clang::ast_type_traits::DynTypedNode::create(
+              *static_cast<const clang::Decl *>(ParentNode.getPointer())),
+          Index};
+}
+
+std::unique_ptr<IndexedParentMap> IndexedParentASTVisitor::buildMap(
+    clang::TranslationUnitDecl &TU) {
+  std::unique_ptr<IndexedParentMap> ParentMap(new IndexedParentMap);
+  IndexedParentASTVisitor Visitor(ParentMap.get());
+  Visitor.TraverseDecl(&TU);
+  return ParentMap;
+}
+
+std::unique_ptr<IndexedParentMap> IndexedParentASTVisitor::buildSkeleton(
+    clang::TranslationUnitDecl &TU) {
+  std::unique_ptr<IndexedParentMap> ParentMap(new IndexedParentMap);
+  IndexedParentASTVisitor Visitor(ParentMap.get());
+  Visitor.BuildingSkeleton = true;
+  Visitor.TraverseDecl(&TU);
+  return ParentMap;
+}
+
+std::unique_ptr<IndexedParentMap> IndexedParentASTVisitor::buildSubtree(
+    clang::Decl *Unit, const IndexedParent &UnitParent) {
+  std::unique_ptr<IndexedParentMap> ParentMap(new IndexedParentMap);
+  IndexedParentASTVisitor Visitor(ParentMap.get());
+  Visitor.ParentStack.push_back(UnitParent);
+  Visitor.TraverseDecl(Unit);
+  return ParentMap;
+}
+
+bool IndexedParentASTVisitor::isSkeletonContext(const clang::DeclContext *DC) {
+  return DC != nullptr &&
+         (DC->isTranslationUnit() || DC->isNamespace() ||
+          DC->getDeclKind() == clang::Decl::LinkageSpec);
+}
+
+bool IndexedParentASTVisitor::TraverseDecl(clang::Decl *DeclNode) {
+  if (BuildingSkeleton && DeclNode != nullptr) {
+    if (!isSkeletonContext(llvm::dyn_cast<clang::DeclContext>(DeclNode))) {
+      // Record the unit as a child of its context without entering it.
+      return TraverseNode(DeclNode, [](clang::Decl *) { return true; });
+    }
+    bool Result = TraverseNode(DeclNode, [this](clang::Decl *Node) {
+      return VisitorBase::TraverseDecl(Node);
+    });
+    // We don't know whether the units underneath this context dominate
+    // prunable subtrees, so we conservatively assume that they don't.
+    (*Parents)[DeclNode].setClaimable();
+    return Result;
+  }
+  return TraverseNode(DeclNode, [this](clang::Decl *Node) {
+    return VisitorBase::TraverseDecl(Node);
+  });
+}
+
+LazyIndexedParentMap::LazyIndexedParentMap(clang::TranslationUnitDecl &TU,
+                                           size_t MaxCachedEntries)
+    : Skeleton(IndexedParentASTVisitor::buildSkeleton(TU)),
+      MaxCachedEntries(MaxCachedEntries) {}
+
+const clang::Decl *LazyIndexedParentMap::findUnit(
+    const clang::Decl *Decl) const {
+  if (IndexedParentASTVisitor::isSkeletonContext(
+          llvm::dyn_cast<clang::DeclContext>(Decl))) {
+    // Skeleton contexts are entirely described by the skeleton.
+    return nullptr;
+  }
+  while (Decl != nullptr) {
+    const auto *DC = Decl->getLexicalDeclContext();
+    if (DC == nullptr) {
+      return nullptr;
+    }
+    if (IndexedParentASTVisitor::isSkeletonContext(DC)) {
+      return Skeleton->count(Decl) != 0 ? Decl : nullptr;
+    }
+    Decl = clang::Decl::castFromDeclContext(DC);
+  }
+  return nullptr;
+}
+
+const IndexedParentMap &LazyIndexedParentMap::subtreeFor(
+    const clang::Decl *Unit) {
+  auto Found = SubtreeIndex.find(Unit);
+  if (Found != SubtreeIndex.end()) {
+    Subtrees.splice(Subtrees.begin(), Subtrees, Found->second);
+    return *Subtrees.front().Map;
+  }
+  const auto &UnitEntry = Skeleton->find(Unit)->second;
+  Subtrees.push_front(
+      {Unit, IndexedParentASTVisitor::buildSubtree(
+                 const_cast<clang::Decl *>(Unit), UnitEntry.unpack())});
+  SubtreeIndex[Unit] = Subtrees.begin();
+  CachedEntries += Subtrees.front().Map->size();
+  ++SubtreeBuilds;
+  while (CachedEntries > MaxCachedEntries && Subtrees.size() > 1) {
+    CachedEntries -= Subtrees.back().Map->size();
+    SubtreeIndex.erase(Subtrees.back().Unit);
+    Subtrees.pop_back();
+  }
+  return *Subtrees.front().Map;
+}
+
+void LazyIndexedParentMap::enterDecl(const clang::Decl *Decl) {
+  if (const auto *Unit = findUnit(Decl)) {
+    subtreeFor(Unit);
+  }
+}
+
+const PackedIndexedParent *LazyIndexedParentMap::find(
+    const clang::ast_type_traits::DynTypedNode &Node) {
+  const void *Key = Node.getMemoizationData();
+  if (const auto *Decl = Node.get<clang::Decl>()) {
+    if (const auto *Unit = findUnit(Decl)) {
+      const auto &Map = subtreeFor(Unit);
+      auto I = Map.find(Key);
+      if (I != Map.end()) {
+        return &I->second;
+      }
+    }
+  }
+  for (const auto &Subtree : Subtrees) {
+    auto I = Subtree.Map->find(Key);
+    if (I != Subtree.Map->end()) {
+      return &I->second;
+    }
+  }
+  auto I = Skeleton->find(Key);
+  return I == Skeleton->end() ? nullptr : &I->second;
+}
+
+size_t LazyIndexedParentMap::allocatedBytes() const {
+  size_t Bytes = sizeof(IndexedParentMap) + Skeleton->getMemorySize() +
+                 SubtreeIndex.getMemorySize();
+  for (const auto &Subtree : Subtrees) {
+    // Each list node holds a `Subtree` and two pointers.
+    Bytes += sizeof(Subtree) + 2 * sizeof(void *) + sizeof(IndexedParentMap) +
+             Subtree.Map->getMemorySize();
+  }
+  return Bytes;
+}
+
+}  // namespace kythe
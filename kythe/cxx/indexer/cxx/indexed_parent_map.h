@@ -0,0 +1,262 @@
+/*
+ * Copyright 2017 Google Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// This file uses the Clang style conventions.
+
+#ifndef KYTHE_CXX_INDEXER_CXX_INDEXED_PARENT_MAP_H_
+#define KYTHE_CXX_INDEXER_CXX_INDEXED_PARENT_MAP_H_
+
+#include <cstdint>
+#include <list>
+#include <memory>
+
+#include "clang/AST/ASTTypeTraits.h"
+#include "clang/AST/Decl.h"
+#include "clang/AST/RecursiveASTVisitor.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/PointerIntPair.h"
+#include "llvm/ADT/SmallVector.h"
+
+namespace kythe {
+
+/// For a given node in the AST, this class keeps track of the node's
+/// parent (along some path from the AST root) and an integer index for that
+/// node in some arbitrary but consistent order defined by the parent.
+struct IndexedParent {
+  /// \brief The parent DynTypedNode associated with some key.
+  clang::ast_type_traits::DynTypedNode Parent;
+  /// \brief The index at which some associated key appears in `Parent`.
+  size_t Index;
+};
+
+inline bool operator==(const IndexedParent &L, const IndexedParent &R) {
+  // We compare IndexedParents for deduplicating memoizable DynTypedNodes
+  // below; semantically, this means that we keep the first child index
+  // we saw when following every path through a particular memoizable
+  // IndexedParent.
+  return L.Parent == R.Parent;
+}
+
+inline bool operator!=(const IndexedParent &L, const IndexedParent &R) {
+  return !(L == R);
+}
+
+/// \brief An `IndexedParentMap` value: a node's `IndexedParent` (if it has
+/// one) and whether the node dominates a subtree that can't be pruned.
+///
+/// Parents are always `Decl`s or `Stmt`s, so they are stored as tagged
+/// pointers rather than as `DynTypedNode`s.
+class PackedIndexedParent {
+ public:
+  PackedIndexedParent() = default;
+
+  /// \brief Packs `Parent`, which must refer to a `Decl` or a `Stmt`.
+  explicit PackedIndexedParent(const IndexedParent &Parent);
+
+  /// \return true if this node has no parent.
+  bool empty() const { return ParentNode.getPointer() == nullptr; }
+
+  /// \return the unpacked parent. Must not be `empty()`.
+  IndexedParent unpack() const;
+
+  /// \return true if this node dominates a subtree that can't be pruned.
+  bool claimable() const { return Claimable; }
+  void setClaimable() { Claimable = true; }
+
+ private:
+  /// The parent node; the flag is set if it is a `Stmt`.
+  llvm::PointerIntPair<const void *, 1, bool> ParentNode;
+  /// The index of this node in `ParentNode`.
+  uint32_t Index = 0;
+  /// Whether this node dominates a subtree that can't be pruned.
+  bool Claimable = false;
+};
+
+using IndexedParentMap = llvm::DenseMap<const void *, PackedIndexedParent>;
+
+/// \return `true` if truncating tree traversal at `D` is safe, provided that
+/// `D` has been traversed previously.
+bool IsClaimableForTraverse(const clang::Decl *D);
+
+/// \return `true` if truncating tree traversal at `S` is safe, provided that
+/// `S` has been traversed previously.
+inline bool IsClaimableForTraverse(const clang::Stmt *S) { return false; }
+
+/// FIXME: Currently only builds up the map using \c Stmt and \c Decl nodes.
+/// TODO(zarko): Is this necessary to change for naming?
+class IndexedParentASTVisitor
+    : public clang::RecursiveASTVisitor<IndexedParentASTVisitor> {
+ public:
+  /// \brief Builds and returns the translation unit's indexed parent map.
+  static std::unique_ptr<IndexedParentMap> buildMap(
+      clang::TranslationUnitDecl &TU);
+
+  /// \brief Builds the part of the translation unit's indexed parent map
+  /// that covers the translation unit, the declaration contexts that
+  /// `isSkeletonContext`, and their children, but nothing underneath those
+  /// children. The nodes above the children are marked claimable.
+  static std::unique_ptr<IndexedParentMap> buildSkeleton(
+      clang::TranslationUnitDecl &TU);
+
+  /// \brief Builds the part of the translation unit's indexed parent map
+  /// that covers `Unit` and the nodes underneath it.
+  /// \param Unit One of the children in the skeleton.
+  /// \param UnitParent The parent of `Unit`, from the skeleton.
+  static std::unique_ptr<IndexedParentMap> buildSubtree(
+      clang::Decl *Unit, const IndexedParent &UnitParent);
+
+  /// \return true if `DC` encloses declarations without enclosing any of
+  /// their semantics (like a namespace or a linkage specification).
+  static bool isSkeletonContext(const clang::DeclContext *DC);
+
+ private:
+  typedef RecursiveASTVisitor<IndexedParentASTVisitor> VisitorBase;
+
+  explicit IndexedParentASTVisitor(IndexedParentMap *Parents)
+      : Parents(Parents) {}
+
+  bool shouldVisitTemplateInstantiations() const { return true; }
+  bool shouldVisitImplicitCode() const { return true; }
+  // Disables data recursion. We intercept Traverse* methods in the RAV, which
+  // are not triggered during data recursion.
+  bool shouldUseDataRecursionFor(clang::Stmt *S) const { return false; }
+
+  // Traverse an arbitrary AST node type and record the node used to get to
+  // it as that node's parent. `T` is the type of the node and
+  // `BaseTraverseFn` is the type of a function (or other value with
+  // an operator()) that invokes the base RecursiveASTVisitor traversal logic
+  // on values of type `T*` and returns a boolean traversal result.
+  template <typename T, typename BaseTraverseFn>
+  bool TraverseNode(T *Node, BaseTraverseFn traverse) {
+    if (!Node) return true;
+    if (!ParentStack.empty()) {
+      auto &Entry = (*Parents)[Node];
+      if (Entry.empty()) {
+        // It's not useful to store more than one parent.
+        Entry = PackedIndexedParent(ParentStack.back());
+      }
+    }
+    ParentStack.push_back(
+        {clang::ast_type_traits::DynTypedNode::create(*Node), 0});
+    bool SavedClaimableAtThisDepth = ClaimableAtThisDepth;
+    ClaimableAtThisDepth = false;  // for depth + 1
+    bool Result = traverse(Node);
+    if (ClaimableAtThisDepth || IsClaimableForTraverse(Node)) {
+      ClaimableAtThisDepth = true;  // for depth
+      (*Parents)[Node].setClaimable();
+    } else {
+      ClaimableAtThisDepth = SavedClaimableAtThisDepth;  // restore depth
+    }
+    ParentStack.pop_back();
+    if (!ParentStack.empty()) {
+      ParentStack.back().Index++;
+    }
+    return Result;
+  }
+
+  bool TraverseDecl(clang::Decl *DeclNode);
+
+  bool TraverseStmt(clang::Stmt *StmtNode) {
+    return TraverseNode(StmtNode, [this](clang::Stmt *Node) {
+      return VisitorBase::TraverseStmt(Node);
+    });
+  }
+
+  IndexedParentMap *Parents;
+  llvm::SmallVector<IndexedParent, 16> ParentStack;
+  bool ClaimableAtThisDepth = false;
+  /// Whether we're building a skeleton (see `buildSkeleton`).
+  bool BuildingSkeleton = false;
+
+  friend class RecursiveASTVisitor<IndexedParentASTVisitor>;
+};
+
+/// \brief Builds a translation unit's indexed parent map one top-level
+/// declaration at a time, as parents are requested, and keeps only the most
+/// recently used declarations' parts of it.
+///
+/// A "top-level" declaration is one whose lexical context is the translation
+/// unit or a namespace (or the like); see
+/// `IndexedParentASTVisitor::isSkeletonContext`. Each `Decl` is looked up in
+/// the part of the map for its top-level declaration, which is (re)built if
+/// necessary. Other nodes, and `Decl`s whose top-level declaration isn't in
+/// the map (like some template parameters), are looked up in the parts that
+/// happen to be built, most recently used first.
+///
+/// Nodes that are reachable from more than one top-level declaration may be
+/// given a different parent than `IndexedParentASTVisitor::buildMap` would
+/// give them. Nodes above the top-level declarations are never prunable.
+class LazyIndexedParentMap {
+ public:
+  /// \param TU The translation unit to map.
+  /// \param MaxCachedEntries Drop the least recently used parts of the map
+  /// once they have more than this many entries in total. The part for the
+  /// most recently used top-level declaration is always kept.
+  LazyIndexedParentMap(clang::TranslationUnitDecl &TU,
+                       size_t MaxCachedEntries);
+  LazyIndexedParentMap(const LazyIndexedParentMap &) = delete;
+  LazyIndexedParentMap &operator=(const LazyIndexedParentMap &) = delete;
+
+  /// \return the entry for `Node`, or null if it has none. The entry is
+  /// valid until the next call to a non-const member of this map.
+  const PackedIndexedParent *find(
+      const clang::ast_type_traits::DynTypedNode &Node);
+
+  /// \brief Makes sure that the part of the map for the top-level
+  /// declaration of `Decl` is built and is the most recently used.
+  void enterDecl(const clang::Decl *Decl);
+
+  /// \return the number of times a top-level declaration's part of the map
+  /// has been built.
+  size_t subtree_builds() const { return SubtreeBuilds; }
+
+  /// \return an estimate of the bytes the parts of the map that are built
+  /// have allocated.
+  size_t allocatedBytes() const;
+
+ private:
+  /// \brief A top-level declaration's part of the map.
+  struct Subtree {
+    const clang::Decl *Unit;
+    std::unique_ptr<IndexedParentMap> Map;
+  };
+
+  /// \return the top-level declaration under which `Decl` is traversed, or
+  /// null if it's not a descendant of a top-level declaration.
+  const clang::Decl *findUnit(const clang::Decl *Decl) const;
+
+  /// \return the part of the map for `Unit`, which is built if necessary and
+  /// becomes the most recently used.
+  const IndexedParentMap &subtreeFor(const clang::Decl *Unit);
+
+  /// Entries for the translation unit down to the top-level declarations.
+  std::unique_ptr<IndexedParentMap> Skeleton;
+  /// The parts of the map that are built, most recently used first.
+  std::list<Subtree> Subtrees;
+  /// Maps from top-level declarations to their places in `Subtrees`.
+  llvm::DenseMap<const clang::Decl *, std::list<Subtree>::iterator>
+      SubtreeIndex;
+  /// The total number of entries in `Subtrees`.
+  size_t CachedEntries = 0;
+  /// The number of entries to keep in `Subtrees`.
+  size_t MaxCachedEntries;
+  /// The number of `Subtree`s that have been built.
+  size_t SubtreeBuilds = 0;
+};
+
+}  // namespace kythe
+
+#endif  // KYTHE_CXX_INDEXER_CXX_INDEXED_PARENT_MAP_H_
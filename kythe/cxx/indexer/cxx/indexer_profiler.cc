@@ -0,0 +1,316 @@
+/*
+ * Copyright 2017 Google Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// This file uses the Clang style conventions.
+
+#include "kythe/cxx/indexer/cxx/indexer_profiler.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cinttypes>
+#include <cstdio>
+#include <cstring>
+
+#include "glog/logging.h"
+
+namespace kythe {
+namespace {
+uint64_t SteadyClockNanos() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+/// \return the `IndexerProfiler::SectionStats::Histogram` bucket for a call
+/// that took `Nanos`.
+size_t HistogramBucket(uint64_t Nanos) {
+  uint64_t Micros = Nanos / 1000;
+  if (Micros <= 1) {
+    return 0;
+  }
+  return std::min<size_t>(63 - __builtin_clzll(Micros),
+                          IndexerProfiler::kHistogramBuckets - 1);
+}
+
+/// \return the upper bound in milliseconds of the histogram bucket holding
+/// the call at `Fraction` of the way through `Stats`'s sorted calls.
+double HistogramQuantileMillis(const IndexerProfiler::SectionStats &Stats,
+                               double Fraction) {
+  uint64_t Rank = static_cast<uint64_t>(Fraction * (Stats.Calls - 1));
+  uint64_t Seen = 0;
+  for (size_t Bucket = 0; Bucket < IndexerProfiler::kHistogramBuckets;
+       ++Bucket) {
+    Seen += Stats.Histogram[Bucket];
+    if (Seen > Rank) {
+      return (2ull << Bucket) / 1000.0;
+    }
+  }
+  return Stats.MaxNanos / 1e6;
+}
+
+/// \brief Appends `Text` to `Out` as a JSON string literal.
+void AppendJsonString(const char *Text, std::string *Out) {
+  Out->push_back('"');
+  for (const char *C = Text; *C != '\0'; ++C) {
+    if (*C == '"' || *C == '\\') {
+      Out->push_back('\\');
+      Out->push_back(*C);
+    } else if (static_cast<unsigned char>(*C) < 0x20) {
+      char Escaped[8];
+      snprintf(Escaped, sizeof(Escaped), "\\u%04x", *C);
+      Out->append(Escaped);
+    } else {
+      Out->push_back(*C);
+    }
+  }
+  Out->push_back('"');
+}
+}  // anonymous namespace
+
+constexpr size_t IndexerProfiler::kHistogramBuckets;
+constexpr size_t IndexerProfiler::kBufferedEvents;
+
+IndexerProfiler::IndexerProfiler(Clock NowNanos)
+    : Now(std::move(NowNanos)),
+      NanosPerTick(Now ? 1.0 : CycleCounterNanosPerTick()),
+      Epoch(ReadTicks()),
+      Buffer(new BufferedEvent[kBufferedEvents]) {}
+
+double IndexerProfiler::CycleCounterNanosPerTick() {
+#if defined(__x86_64__) || defined(__i386__)
+  // Time the counter against the steady clock once per process. A
+  // millisecond is long enough to keep the error from reading either clock
+  // under 0.01%.
+  static const double NanosPerTick = [] {
+    const uint64_t StartNanos = SteadyClockNanos();
+    const uint64_t StartTicks = ReadCycleCounter();
+    uint64_t EndNanos;
+    do {
+      EndNanos = SteadyClockNanos();
+    } while (EndNanos - StartNanos < 1000000);
+    const uint64_t EndTicks = ReadCycleCounter();
+    return EndTicks > StartTicks
+               ? static_cast<double>(EndNanos - StartNanos) /
+                     (EndTicks - StartTicks)
+               : 1.0;
+  }();
+  return NanosPerTick;
+#else
+  return 1.0;
+#endif
+}
+
+void IndexerProfiler::Drain() {
+  for (size_t I = 0; I < BufferedCount; ++I) {
+    const BufferedEvent &Event = Buffer[I];
+    const uint64_t Ticks = Event.Ticks > Epoch ? Event.Ticks - Epoch : 0;
+    Apply(Event.Label, Event.Event,
+          static_cast<uint64_t>(Ticks * NanosPerTick), Event.HeapBytes);
+  }
+  BufferedCount = 0;
+}
+
+void IndexerProfiler::Apply(const char *Label, ProfilingEvent Event,
+                            uint64_t Nanos, uint64_t HeapBytes) {
+  switch (Event) {
+    case ProfilingEvent::Enter: {
+      SectionChildren &Siblings =
+          Stack.empty() ? TopLevel : Nodes[Stack.back().Node].Children;
+      size_t Node = Nodes.size();
+      for (const auto &Sibling : Siblings) {
+        if (Sibling.first == Label) {
+          Node = Sibling.second;
+          break;
+        }
+      }
+      if (Node == Nodes.size()) {
+        Siblings.emplace_back(Label, Node);
+        std::string Path = Stack.empty()
+                               ? std::string(Label)
+                               : *Nodes[Stack.back().Node].Path + "/" + Label;
+        auto Section = Sections.emplace(std::move(Path), SectionStats()).first;
+        // This may move `Siblings`.
+        Nodes.push_back(
+            SectionNode{&Section->first, &Section->second, SectionChildren()});
+      }
+      Stack.push_back(OpenSection{Label, Node, Nanos, 0, HeapBytes});
+      break;
+    }
+    case ProfilingEvent::Exit: {
+      CHECK(!Stack.empty()) << "Left section " << Label
+                            << " without entering it.";
+      const OpenSection &Section = Stack.back();
+      const SectionNode &Node = Nodes[Section.Node];
+      CHECK(::strcmp(Section.Label, Label) == 0)
+          << "Left section " << Label << " while in " << *Node.Path;
+      uint64_t Inclusive =
+          Nanos > Section.StartNanos ? Nanos - Section.StartNanos : 0;
+      auto &Stats = *Node.Stats;
+      ++Stats.Calls;
+      Stats.InclusiveNanos += Inclusive;
+      Stats.ExclusiveNanos +=
+          Inclusive > Section.ChildNanos ? Inclusive - Section.ChildNanos : 0;
+      Stats.MaxNanos = std::max(Stats.MaxNanos, Inclusive);
+      ++Stats.Histogram[HistogramBucket(Inclusive)];
+      if (static_cast<int64_t>(Stack.size()) <= HeapDepth) {
+        ++Stats.HeapCalls;
+        Stats.HeapGrowthBytes += static_cast<int64_t>(HeapBytes) -
+                                 static_cast<int64_t>(Section.StartHeapBytes);
+        Stats.MaxHeapBytes = std::max(
+            Stats.MaxHeapBytes, std::max(HeapBytes, Section.StartHeapBytes));
+      }
+      if (RecordTrace) {
+        Trace.push_back(TraceEvent{Label, Section.StartNanos, Inclusive});
+      }
+      Stack.pop_back();
+      if (Stack.empty()) {
+        TotalNanos += Inclusive;
+      } else {
+        Stack.back().ChildNanos += Inclusive;
+      }
+      break;
+    }
+    case ProfilingEvent::Hit:
+    case ProfilingEvent::Miss: {
+      CacheStats *&Stats = CacheIndex[Label];
+      if (Stats == nullptr) {
+        Stats = &Caches[Label];
+      }
+      if (Event == ProfilingEvent::Hit) {
+        ++Stats->Hits;
+      } else {
+        ++Stats->Misses;
+      }
+      break;
+    }
+  }
+}
+
+void IndexerProfiler::Merge(const IndexerProfiler &Other) {
+  for (const auto &Section : Other.Sections) {
+    auto &Stats = Sections[Section.first];
+    Stats.Calls += Section.second.Calls;
+    Stats.InclusiveNanos += Section.second.InclusiveNanos;
+    Stats.ExclusiveNanos += Section.second.ExclusiveNanos;
+    Stats.MaxNanos = std::max(Stats.MaxNanos, Section.second.MaxNanos);
+    for (size_t Bucket = 0; Bucket < kHistogramBuckets; ++Bucket) {
+      Stats.Histogram[Bucket] += Section.second.Histogram[Bucket];
+    }
+    Stats.HeapCalls += Section.second.HeapCalls;
+    Stats.HeapGrowthBytes += Section.second.HeapGrowthBytes;
+    Stats.MaxHeapBytes =
+        std::max(Stats.MaxHeapBytes, Section.second.MaxHeapBytes);
+  }
+  for (const auto &Cache : Other.Caches) {
+    auto &Stats = Caches[Cache.first];
+    Stats.Hits += Cache.second.Hits;
+    Stats.Misses += Cache.second.Misses;
+  }
+  TotalNanos += Other.TotalNanos;
+}
+
+std::string IndexerProfiler::Summary() const {
+  std::string Out;
+  char Line[256];
+  snprintf(Line, sizeof(Line), "%-40s %9s %11s %11s %10s %10s %10s\n",
+           "section", "calls", "incl_ms", "excl_ms", "max_ms", "p50_ms",
+           "p99_ms");
+  Out.append(Line);
+  // Paths sort with parents directly before their children, since labels
+  // only use characters that sort after '/'.
+  for (const auto &Section : Sections) {
+    const std::string &Path = Section.first;
+    const SectionStats &Stats = Section.second;
+    size_t Depth = std::count(Path.begin(), Path.end(), '/');
+    size_t NameStart = Path.rfind('/');
+    std::string Name = std::string(2 * Depth, ' ') +
+                       Path.substr(NameStart == std::string::npos
+                                       ? 0
+                                       : NameStart + 1);
+    snprintf(Line, sizeof(Line),
+             "%-40s %9" PRIu64 " %11.3f %11.3f %10.3f %10.3f %10.3f\n",
+             Name.c_str(), Stats.Calls, Stats.InclusiveNanos / 1e6,
+             Stats.ExclusiveNanos / 1e6, Stats.MaxNanos / 1e6,
+             HistogramQuantileMillis(Stats, 0.5),
+             HistogramQuantileMillis(Stats, 0.99));
+    Out.append(Line);
+  }
+  bool SampledHeap = false;
+  for (const auto &Section : Sections) {
+    if (Section.second.HeapCalls != 0) {
+      if (!SampledHeap) {
+        snprintf(Line, sizeof(Line), "%-40s %9s %11s %11s\n", "heap",
+                 "calls", "growth_mb", "max_mb");
+        Out.append(Line);
+        SampledHeap = true;
+      }
+      snprintf(Line, sizeof(Line), "%-40s %9" PRIu64 " %11.3f %11.3f\n",
+               Section.first.c_str(), Section.second.HeapCalls,
+               Section.second.HeapGrowthBytes / 1048576.0,
+               Section.second.MaxHeapBytes / 1048576.0);
+      Out.append(Line);
+    }
+  }
+  if (!Caches.empty()) {
+    snprintf(Line, sizeof(Line), "%-40s %9s %11s %11s\n", "cache", "hits",
+             "misses", "hit_rate");
+    Out.append(Line);
+    for (const auto &Cache : Caches) {
+      const CacheStats &Stats = Cache.second;
+      uint64_t Lookups = Stats.Hits + Stats.Misses;
+      double HitRate =
+          Lookups == 0 ? 0.0 : static_cast<double>(Stats.Hits) / Lookups;
+      snprintf(Line, sizeof(Line), "%-40s %9" PRIu64 " %11" PRIu64 " %11.3f\n",
+               Cache.first.c_str(), Stats.Hits, Stats.Misses, HitRate);
+      Out.append(Line);
+    }
+  }
+  return Out;
+}
+
+bool IndexerProfiler::WriteChromeTrace(const std::string &Path,
+                                       std::string *ErrorText) const {
+  std::string Json = "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+  char Times[96];
+  bool First = true;
+  for (const auto &Event : Trace) {
+    if (!First) {
+      Json.push_back(',');
+    }
+    First = false;
+    Json.append("\n{\"name\":");
+    AppendJsonString(Event.Label, &Json);
+    snprintf(Times, sizeof(Times),
+             ",\"ph\":\"X\",\"pid\":1,\"tid\":1,\"ts\":%.3f,\"dur\":%.3f}",
+             Event.StartNanos / 1e3, Event.DurationNanos / 1e3);
+    Json.append(Times);
+  }
+  Json.append("\n]}\n");
+  FILE *File = ::fopen(Path.c_str(), "w");
+  if (File == nullptr) {
+    *ErrorText = ::strerror(errno);
+    return false;
+  }
+  bool Wrote = ::fwrite(Json.data(), 1, Json.size(), File) == Json.size();
+  if (::fclose(File) != 0 || !Wrote) {
+    *ErrorText = "couldn't write " + Path;
+    return false;
+  }
+  return true;
+}
+
+}  // namespace kythe
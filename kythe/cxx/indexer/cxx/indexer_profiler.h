@@ -0,0 +1,290 @@
+/*
+ * Copyright 2017 Google Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// This file uses the Clang style conventions.
+
+#ifndef KYTHE_CXX_INDEXER_CXX_INDEXER_PROFILER_H_
+#define KYTHE_CXX_INDEXER_CXX_INDEXER_PROFILER_H_
+
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include <array>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "kythe/cxx/indexer/cxx/GraphObserver.h"
+
+namespace kythe {
+
+/// \brief Aggregates `ProfilingEvent`s into per-section statistics.
+///
+/// Sections are identified by their paths through the section hierarchy
+/// (for example, "index_unit/run_invocation"), so the same label entered from
+/// two different parents is counted twice. Not thread-safe; use one profiler
+/// per compilation unit and `Merge` them afterward.
+///
+/// `Report` is cheap enough to leave on: it reads the CPU's time stamp
+/// counter (or `CLOCK_MONOTONIC` where there isn't one) and appends the event
+/// to a fixed-size buffer. Buffered events are folded into the statistics
+/// when the buffer fills and whenever no section is left open, so section
+/// paths are only looked up in batches.
+///
+/// With a `HeapSampler`, the profiler also tracks how much each of the
+/// outermost sections grows the heap. Only the first few levels are sampled,
+/// since reading the allocator's statistics costs far more than reading the
+/// clock.
+class IndexerProfiler {
+ public:
+  /// \brief Returns the current time in nanoseconds.
+  using Clock = std::function<uint64_t()>;
+
+  /// \brief Returns the bytes allocated on the heap (as `AllocatedHeapBytes`
+  /// does) as the section labelled with its argument is entered or left.
+  using HeapSampler = std::function<uint64_t(const char *)>;
+
+  /// The number of events buffered before they're folded in.
+  static constexpr size_t kBufferedEvents = 4096;
+
+  /// The number of buckets in a `SectionStats::Histogram`.
+  static constexpr size_t kHistogramBuckets = 32;
+
+  /// \brief Statistics for a single path in the section hierarchy.
+  struct SectionStats {
+    /// How many times the section was left.
+    uint64_t Calls = 0;
+    /// Total time spent in the section, including its children.
+    uint64_t InclusiveNanos = 0;
+    /// Total time spent in the section, excluding its children.
+    uint64_t ExclusiveNanos = 0;
+    /// The longest time spent in a single call, including children.
+    uint64_t MaxNanos = 0;
+    /// Bucket `i` counts the calls whose inclusive time was in
+    /// [2^i, 2^(i+1)) microseconds; bucket 0 also has the shorter calls.
+    std::array<uint64_t, kHistogramBuckets> Histogram{};
+    /// How many calls had the heap sampled as they were entered and left.
+    uint64_t HeapCalls = 0;
+    /// The net change in allocated heap bytes over those calls. Memory that
+    /// outlives a call (in caches or output buffers, or leaked) counts here.
+    int64_t HeapGrowthBytes = 0;
+    /// The most heap allocated as one of those calls was entered or left.
+    uint64_t MaxHeapBytes = 0;
+  };
+
+  /// \brief Counts the results of lookups in a labelled cache.
+  struct CacheStats {
+    uint64_t Hits = 0;
+    uint64_t Misses = 0;
+  };
+
+  /// \param NowNanos The clock to use; defaults to the cycle counter.
+  explicit IndexerProfiler(Clock NowNanos = Clock());
+  IndexerProfiler(const IndexerProfiler &) = delete;
+  IndexerProfiler &operator=(const IndexerProfiler &) = delete;
+
+  /// \brief Records `Event` for the section or cache labelled `Label`.
+  ///
+  /// Enter and Exit events must be paired in strict LIFO order; this is
+  /// checked when the events are folded in. The statistics don't reflect
+  /// events reported while a section is still open.
+  void Report(const char *Label, ProfilingEvent Event) {
+    BufferedEvent &Buffered = Buffer[BufferedCount++];
+    Buffered = BufferedEvent{Label, Event, ReadTicks(), 0};
+    if (Event == ProfilingEvent::Enter) {
+      if (++OpenDepth <= HeapDepth) {
+        Buffered.HeapBytes = Heap(Label);
+      }
+    } else if (Event == ProfilingEvent::Exit) {
+      if (OpenDepth-- <= HeapDepth) {
+        Buffered.HeapBytes = Heap(Label);
+      }
+    }
+    if (OpenDepth <= 0 || BufferedCount == kBufferedEvents) {
+      Drain();
+    }
+  }
+
+  /// \return a callback that forwards events to `Report`. The profiler must
+  /// outlive the callback.
+  ProfilingCallback callback() {
+    return [this](const char *Label, ProfilingEvent Event) {
+      Report(Label, Event);
+    };
+  }
+
+  /// \brief Keeps every completed section so that it can be written out with
+  /// `WriteChromeTrace`. Uses memory in proportion to the number of events.
+  void set_record_trace(bool RecordTrace) { this->RecordTrace = RecordTrace; }
+
+  /// \brief Samples the heap with `Sampler` as sections at most `MaxDepth`
+  /// deep are entered and left (top-level sections are 1 deep). Call this
+  /// before reporting any events.
+  void set_heap_sampler(HeapSampler Sampler, int64_t MaxDepth) {
+    Heap = std::move(Sampler);
+    HeapDepth = Heap ? MaxDepth : 0;
+  }
+
+  /// \brief Adds the statistics (but not the trace) from `Other`, which
+  /// shouldn't have any sections open.
+  void Merge(const IndexerProfiler &Other);
+
+  /// \return statistics keyed by section path.
+  const std::map<std::string, SectionStats> &sections() const {
+    return Sections;
+  }
+
+  /// \return statistics keyed by cache label.
+  const std::map<std::string, CacheStats> &caches() const { return Caches; }
+
+  /// \return the time spent in top-level sections, in nanoseconds.
+  uint64_t total_nanos() const { return TotalNanos; }
+
+  /// \return a human-readable table of the statistics, with child sections
+  /// indented below their parents.
+  std::string Summary() const;
+
+  /// \brief Writes the recorded sections as a Chrome `trace_event` JSON file
+  /// (viewable in chrome://tracing).
+  /// \param Path The file to write.
+  /// \param ErrorText Set to a description of the problem on failure.
+  /// \return true on success.
+  bool WriteChromeTrace(const std::string &Path, std::string *ErrorText) const;
+
+ private:
+  /// An event that hasn't been folded into the statistics yet.
+  struct BufferedEvent {
+    const char *Label;
+    ProfilingEvent Event;
+    /// When the event happened, in the units of `ReadTicks`.
+    uint64_t Ticks;
+    /// The heap's allocated bytes, if it was sampled.
+    uint64_t HeapBytes;
+  };
+
+  /// The children of a `SectionNode`: each one's label and index. Labels
+  /// are compared by address, which is stable for the literals they usually
+  /// are; a label at two addresses gets two nodes that share a path and
+  /// statistics. Sections have few children, so a scan is cheapest.
+  using SectionChildren = std::vector<std::pair<const char *, size_t>>;
+
+  /// A path in the section hierarchy that has been entered.
+  struct SectionNode {
+    /// The path of this section, used as a key in `Sections`.
+    const std::string *Path;
+    /// The statistics for `Path`.
+    SectionStats *Stats;
+    /// The sections entered from this one.
+    SectionChildren Children;
+  };
+
+  /// A section that has been entered but not left.
+  struct OpenSection {
+    /// The label of this section.
+    const char *Label;
+    /// The index of this section's `SectionNode`.
+    size_t Node;
+    /// When the section was entered, relative to `Epoch`.
+    uint64_t StartNanos;
+    /// Time spent in this section's children so far.
+    uint64_t ChildNanos;
+    /// The heap's allocated bytes when the section was entered, if it was
+    /// sampled.
+    uint64_t StartHeapBytes;
+  };
+
+  /// A section that has been left, kept for `WriteChromeTrace`.
+  struct TraceEvent {
+    /// The label of the section.
+    const char *Label;
+    /// When the section was entered, relative to the profiler's creation.
+    uint64_t StartNanos;
+    /// How long the section lasted.
+    uint64_t DurationNanos;
+  };
+
+  /// \return the current time, in nanoseconds if `Now` is set or in cycle
+  /// counter ticks otherwise.
+  uint64_t ReadTicks() const { return Now ? Now() : ReadCycleCounter(); }
+
+  /// \return the value of the CPU's time stamp counter, or the monotonic
+  /// clock in nanoseconds where there isn't one.
+  static uint64_t ReadCycleCounter() {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    struct timespec Time;
+    ::clock_gettime(CLOCK_MONOTONIC, &Time);
+    return static_cast<uint64_t>(Time.tv_sec) * 1000000000 + Time.tv_nsec;
+#endif
+  }
+
+  /// \return how many nanoseconds a tick of `ReadCycleCounter` lasts.
+  static double CycleCounterNanosPerTick();
+
+  /// \brief Folds the buffered events into the statistics.
+  void Drain();
+
+  /// \brief Folds in one event, which happened `Nanos` after `Epoch` with
+  /// `HeapBytes` allocated (if the heap was sampled).
+  void Apply(const char *Label, ProfilingEvent Event, uint64_t Nanos,
+             uint64_t HeapBytes);
+
+  /// The clock to consult for `Report`, or empty to use the cycle counter.
+  Clock Now;
+  /// Samples the heap for sections at most `HeapDepth` deep.
+  HeapSampler Heap;
+  int64_t HeapDepth = 0;
+  /// How long one of `ReadTicks`'s ticks lasts, in nanoseconds.
+  double NanosPerTick;
+  /// The tick at which this profiler was created.
+  uint64_t Epoch;
+  /// The events that haven't been folded in yet.
+  std::unique_ptr<BufferedEvent[]> Buffer;
+  /// The number of events in `Buffer`.
+  size_t BufferedCount = 0;
+  /// The number of sections open once `Buffer` is folded in.
+  int64_t OpenDepth = 0;
+  /// The sections entered but not left, innermost last.
+  std::vector<OpenSection> Stack;
+  /// The section paths entered so far.
+  std::vector<SectionNode> Nodes;
+  /// The top-level sections in `Nodes`.
+  SectionChildren TopLevel;
+  /// Statistics keyed by section path.
+  std::map<std::string, SectionStats> Sections;
+  /// `Caches`'s entries keyed by label address.
+  std::unordered_map<const char *, CacheStats *> CacheIndex;
+  /// Statistics keyed by cache label.
+  std::map<std::string, CacheStats> Caches;
+  /// The time spent in top-level sections.
+  uint64_t TotalNanos = 0;
+  /// Whether to keep `Trace`.
+  bool RecordTrace = false;
+  /// Sections that have been left, if `RecordTrace` is set.
+  std::vector<TraceEvent> Trace;
+};
+
+}  // namespace kythe
+
+#endif  // KYTHE_CXX_INDEXER_CXX_INDEXER_PROFILER_H_
@@ -0,0 +1,212 @@
+/*
+ * Copyright 2017 Google Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// This file uses the Clang style conventions.
+
+#include "kythe/cxx/indexer/cxx/indexer_profiler.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <sstream>
+#include <string>
+
+#include "gtest/gtest.h"
+
+namespace kythe {
+namespace {
+
+/// \brief A clock that the test advances by hand.
+class FakeClock {
+ public:
+  IndexerProfiler::Clock clock() {
+    return [this] { return Nanos; };
+  }
+  void AdvanceMillis(uint64_t Millis) { Nanos += Millis * 1000000; }
+
+ private:
+  uint64_t Nanos = 0;
+};
+
+TEST(IndexerProfiler, SplitsInclusiveAndExclusiveTime) {
+  FakeClock Clock;
+  IndexerProfiler Profiler(Clock.clock());
+  Profiler.Report("unit", ProfilingEvent::Enter);
+  Clock.AdvanceMillis(1);
+  Profiler.Report("parse", ProfilingEvent::Enter);
+  Clock.AdvanceMillis(4);
+  Profiler.Report("parse", ProfilingEvent::Exit);
+  Profiler.Report("parse", ProfilingEvent::Enter);
+  Clock.AdvanceMillis(2);
+  Profiler.Report("parse", ProfilingEvent::Exit);
+  Clock.AdvanceMillis(3);
+  Profiler.Report("unit", ProfilingEvent::Exit);
+  const auto &Sections = Profiler.sections();
+  ASSERT_EQ(2, Sections.size());
+  const auto &Unit = Sections.at("unit");
+  EXPECT_EQ(1, Unit.Calls);
+  EXPECT_EQ(10000000, Unit.InclusiveNanos);
+  EXPECT_EQ(4000000, Unit.ExclusiveNanos);
+  const auto &Parse = Sections.at("unit/parse");
+  EXPECT_EQ(2, Parse.Calls);
+  EXPECT_EQ(6000000, Parse.InclusiveNanos);
+  EXPECT_EQ(6000000, Parse.ExclusiveNanos);
+  EXPECT_EQ(4000000, Parse.MaxNanos);
+  // 2ms and 4ms fall in the [2^10, 2^11) and [2^11, 2^12) microsecond
+  // buckets, respectively.
+  EXPECT_EQ(1, Parse.Histogram[10]);
+  EXPECT_EQ(1, Parse.Histogram[11]);
+  EXPECT_EQ(10000000, Profiler.total_nanos());
+}
+
+TEST(IndexerProfiler, CountsCacheLookups) {
+  IndexerProfiler Profiler;
+  Profiler.Report("hash", ProfilingEvent::Miss);
+  Profiler.Report("hash", ProfilingEvent::Hit);
+  Profiler.Report("hash", ProfilingEvent::Hit);
+  ASSERT_EQ(1, Profiler.caches().size());
+  EXPECT_EQ(2, Profiler.caches().at("hash").Hits);
+  EXPECT_EQ(1, Profiler.caches().at("hash").Misses);
+  EXPECT_NE(std::string::npos, Profiler.Summary().find("hash"));
+}
+
+TEST(IndexerProfiler, MergesUnits) {
+  FakeClock Clock;
+  IndexerProfiler Total(Clock.clock());
+  for (uint64_t Millis : {7, 3}) {
+    IndexerProfiler Unit(Clock.clock());
+    {
+      ProfilingCallback Callback = Unit.callback();
+      ProfileBlock Block(Callback, "unit");
+      Clock.AdvanceMillis(Millis);
+      Callback("hash", ProfilingEvent::Hit);
+    }
+    Total.Merge(Unit);
+  }
+  EXPECT_EQ(2, Total.sections().at("unit").Calls);
+  EXPECT_EQ(7000000, Total.sections().at("unit").MaxNanos);
+  EXPECT_EQ(10000000, Total.sections().at("unit").InclusiveNanos);
+  EXPECT_EQ(10000000, Total.total_nanos());
+  EXPECT_EQ(2, Total.caches().at("hash").Hits);
+}
+
+TEST(IndexerProfiler, WritesChromeTrace) {
+  FakeClock Clock;
+  IndexerProfiler Profiler(Clock.clock());
+  Profiler.set_record_trace(true);
+  Clock.AdvanceMillis(1);
+  Profiler.Report("unit", ProfilingEvent::Enter);
+  Clock.AdvanceMillis(2);
+  Profiler.Report("unit", ProfilingEvent::Exit);
+  const char *TempDir = getenv("TEST_TMPDIR");
+  std::string Path = std::string(TempDir ? TempDir : "/tmp") +
+                     "/indexer_profiler_trace.json";
+  std::string ErrorText;
+  ASSERT_TRUE(Profiler.WriteChromeTrace(Path, &ErrorText)) << ErrorText;
+  std::ifstream Input(Path);
+  std::stringstream Json;
+  Json << Input.rdbuf();
+  std::remove(Path.c_str());
+  EXPECT_EQ(
+      "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n"
+      "{\"name\":\"unit\",\"ph\":\"X\",\"pid\":1,\"tid\":1,"
+      "\"ts\":1000.000,\"dur\":2000.000}\n]}\n",
+      Json.str());
+}
+
+TEST(IndexerProfiler, FoldsInEventsOnceSectionsClose) {
+  FakeClock Clock;
+  IndexerProfiler Profiler(Clock.clock());
+  Profiler.Report("unit", ProfilingEvent::Enter);
+  // More events than fit in the buffer at once.
+  for (size_t I = 0; I < IndexerProfiler::kBufferedEvents; ++I) {
+    Profiler.Report("parse", ProfilingEvent::Enter);
+    Clock.AdvanceMillis(1);
+    Profiler.Report("parse", ProfilingEvent::Exit);
+  }
+  Profiler.Report("unit", ProfilingEvent::Exit);
+  const auto &Sections = Profiler.sections();
+  EXPECT_EQ(IndexerProfiler::kBufferedEvents,
+            Sections.at("unit/parse").Calls);
+  EXPECT_EQ(IndexerProfiler::kBufferedEvents * 1000000,
+            Sections.at("unit").InclusiveNanos);
+  EXPECT_EQ(0, Sections.at("unit").ExclusiveNanos);
+}
+
+TEST(IndexerProfiler, TimesSectionsWithTheCycleCounter) {
+  IndexerProfiler Profiler;
+  {
+    ProfilingCallback Callback = Profiler.callback();
+    ProfileBlock Block(Callback, "unit");
+    auto Start = std::chrono::steady_clock::now();
+    while (std::chrono::steady_clock::now() - Start <
+           std::chrono::milliseconds(5)) {
+    }
+  }
+  const auto &Unit = Profiler.sections().at("unit");
+  EXPECT_EQ(1, Unit.Calls);
+  EXPECT_LE(4000000, Unit.InclusiveNanos);
+  EXPECT_GE(1000000000, Unit.InclusiveNanos);
+}
+
+TEST(IndexerProfiler, SamplesTheHeapOfOuterSections) {
+  FakeClock Clock;
+  IndexerProfiler Profiler(Clock.clock());
+  uint64_t HeapBytes = 100;
+  std::string Sampled;
+  Profiler.set_heap_sampler(
+      [&](const char *Label) {
+        Sampled += Label;
+        Sampled += ";";
+        return HeapBytes;
+      },
+      1);
+  Profiler.Report("unit", ProfilingEvent::Enter);
+  HeapBytes = 300;
+  Profiler.Report("parse", ProfilingEvent::Enter);
+  HeapBytes = 250;
+  Profiler.Report("parse", ProfilingEvent::Exit);
+  HeapBytes = 150;
+  Profiler.Report("unit", ProfilingEvent::Exit);
+  EXPECT_EQ("unit;unit;", Sampled);
+  const auto &Unit = Profiler.sections().at("unit");
+  EXPECT_EQ(1, Unit.HeapCalls);
+  EXPECT_EQ(50, Unit.HeapGrowthBytes);
+  // Only the section's boundaries are sampled.
+  EXPECT_EQ(150, Unit.MaxHeapBytes);
+  EXPECT_EQ(0, Profiler.sections().at("unit/parse").HeapCalls);
+  IndexerProfiler Total;
+  Total.Merge(Profiler);
+  Total.Merge(Profiler);
+  EXPECT_EQ(2, Total.sections().at("unit").HeapCalls);
+  EXPECT_EQ(100, Total.sections().at("unit").HeapGrowthBytes);
+  EXPECT_NE(std::string::npos, Total.Summary().find("growth_mb"));
+}
+
+TEST(IndexerProfiler, EmptyCallbacksAreSkipped) {
+  ProfilingCallback Off;
+  { ProfileBlock Block(Off, "unit"); }
+  ReportProfilingEvent(Off, "hash", ProfilingEvent::Hit);
+}
+
+}  // namespace
+}  // namespace kythe
+
+int main(int argc, char **argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
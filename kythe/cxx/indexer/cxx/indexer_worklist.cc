@@ -15,6 +15,10 @@
  */
 
 #include "kythe/cxx/indexer/cxx/indexer_worklist.h"
+
+#include <limits>
+#include <unordered_set>
+
 #include "kythe/cxx/indexer/cxx/IndexerASTHooks.h"
 
 namespace kythe {
@@ -49,10 +53,96 @@ class IndexerWorklistImpl : public IndexerWorklist {
   /// \brief The indexer that will execute jobs.
   IndexerASTVisitor* indexer_;
 };
+
+class ClaimingIndexerWorklist : public IndexerWorklist {
+ public:
+  ClaimingIndexerWorklist(IndexerASTVisitor* indexer, size_t claim_batch_size)
+      : indexer_(indexer),
+        claim_batch_size_(claim_batch_size == 0
+                              ? std::numeric_limits<size_t>::max()
+                              : claim_batch_size) {}
+
+  void EnqueueJobForImplicitDecl(clang::Decl* decl,
+                                 bool set_prune_incomplete_functions,
+                                 const std::string& id) override {
+    worklist_.emplace_back(llvm::make_unique<IndexJob>(
+        indexer_->getCurrentJob(), decl, set_prune_incomplete_functions, id));
+  }
+
+  void EnqueueJob(std::unique_ptr<IndexJob> job) override {
+    worklist_.emplace_back(std::move(job));
+  }
+
+  bool DoWork() override {
+    std::vector<std::unique_ptr<IndexJob>> jobs = std::move(worklist_);
+    worklist_.clear();
+    for (size_t begin = 0; begin < jobs.size();) {
+      size_t end = ClaimBatch(&jobs, begin);
+      for (size_t job = begin; job < end; ++job) {
+        if (jobs[job] != nullptr) {
+          indexer_->RunJob(std::move(jobs[job]));
+        }
+      }
+      begin = end;
+    }
+    return !worklist_.empty();
+  }
+
+ private:
+  /// \brief Claims the jobs in `jobs` starting at `begin`, dropping (setting
+  /// to null) those that don't need to be run.
+  /// \return the index just past the last job that was processed.
+  size_t ClaimBatch(std::vector<std::unique_ptr<IndexJob>>* jobs,
+                    size_t begin) {
+    std::vector<std::pair<std::string, bool>> claims;
+    std::vector<size_t> claimed_jobs;
+    size_t end = begin;
+    for (; end < jobs->size() && claims.size() < claim_batch_size_; ++end) {
+      auto& job = (*jobs)[end];
+      if (job->ClaimId.empty()) {
+        continue;
+      }
+      if (!seen_claim_ids_.insert(job->ClaimId).second) {
+        // Claims aren't idempotent, and we've already decided this one.
+        job.reset();
+        continue;
+      }
+      claims.emplace_back(job->ClaimId, true);
+      claimed_jobs.push_back(end);
+    }
+    if (!claims.empty()) {
+      indexer_->getGraphObserver().claimBatch(&claims);
+      for (size_t claim = 0; claim < claims.size(); ++claim) {
+        if (!claims[claim].second) {
+          (*jobs)[claimed_jobs[claim]].reset();
+        }
+      }
+    }
+    return end;
+  }
+
+  /// \brief All queued work.
+  std::vector<std::unique_ptr<IndexJob>> worklist_;
+
+  /// \brief The indexer that will execute jobs.
+  IndexerASTVisitor* indexer_;
+
+  /// \brief The maximum number of claims to make at once. Each call to
+  /// `DoWork` claims everything queued so far when this is unbounded.
+  size_t claim_batch_size_;
+
+  /// \brief Every `ClaimId` we've tried to claim.
+  std::unordered_set<std::string> seen_claim_ids_;
+};
 }  // anonymous namespace
 
 std::unique_ptr<IndexerWorklist> IndexerWorklist::CreateDefaultWorklist(
     IndexerASTVisitor* indexer) {
   return llvm::make_unique<IndexerWorklistImpl>(indexer);
 }
+
+std::unique_ptr<IndexerWorklist> IndexerWorklist::CreateClaimingWorklist(
+    IndexerASTVisitor* indexer, size_t claim_batch_size) {
+  return llvm::make_unique<ClaimingIndexerWorklist>(indexer, claim_batch_size);
+}
 }  // namespace kythe
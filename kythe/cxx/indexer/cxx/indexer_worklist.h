@@ -24,10 +24,14 @@
 #include "clang/AST/Decl.h"
 #include "clang/Sema/Template.h"
 #include "kythe/cxx/indexer/cxx/GraphObserver.h"
+#include "kythe/cxx/indexer/cxx/shared_stack.h"
 
 namespace kythe {
 
 /// \brief An indexer task and its related state.
+///
+/// The context stacks are `SharedStack`s, so a job spawned from another
+/// shares its parent's stacks instead of copying them.
 struct IndexJob {
   explicit IndexJob(clang::Decl* Decl) : Decl(Decl), FileNode(nullptr, "") {}
   /// \brief Build an IndexJob to visit a file's top-level comment.
@@ -82,11 +86,11 @@ struct IndexJob {
   /// classes (so they have distinct ranges), but the programmer does *not*
   /// write down implicit specializations (so the context must be extended to
   /// give them distinct ranges).
-  std::vector<GraphObserver::NodeId> RangeContext;
+  SharedStack<GraphObserver::NodeId> RangeContext;
 
   /// \brief The current type variable context for the visitor (indexed by
   /// depth).
-  std::vector<clang::TemplateParameterList*> TypeContext;
+  SharedStack<clang::TemplateParameterList*> TypeContext;
 
   /// \brief At least 1 NodeId.
   using SomeNodes = llvm::SmallVector<GraphObserver::NodeId, 1>;
@@ -94,7 +98,7 @@ struct IndexJob {
   /// \brief A stack of ID groups to use when assigning blame for references
   /// (such as
   /// function calls).
-  std::vector<SomeNodes> BlameStack;
+  SharedStack<SomeNodes> BlameStack;
 
   /// \brief A string to represent this job for claiming.
   std::string ClaimId;
@@ -109,6 +113,19 @@ class IndexerWorklist {
   static std::unique_ptr<IndexerWorklist> CreateDefaultWorklist(
       IndexerASTVisitor* visitor);
 
+  /// \brief Create a worklist that claims jobs before running them.
+  ///
+  /// Jobs with a `ClaimId` are claimed through the visitor's `GraphObserver`
+  /// with `claimBatch`, up to `claim_batch_size` at a time (or all of the
+  /// jobs queued when `DoWork` starts if it is 0), and are dropped
+  /// if the claim fails. Jobs with a `ClaimId` that was already seen in this
+  /// worklist are dropped without being claimed again. The remaining jobs run
+  /// in the order they were enqueued. This is meant for use with
+  /// `--experimental_threaded_claiming`, which defers implicit declarations
+  /// to the worklist instead of claiming them during traversal.
+  static std::unique_ptr<IndexerWorklist> CreateClaimingWorklist(
+      IndexerASTVisitor* visitor, size_t claim_batch_size);
+
   /// \brief Enqueue a job to index an implicit declaration.
   /// \param decl the declaration to index.
   /// \param set_prune_incomplete_functions whether to prune incomplete
@@ -727,8 +727,8 @@ bool MarkedSourceGenerator::ReplaceMarkedSourceWithQualifiedName(
   return true;
 }
 
-MaybeFew<MarkedSource> MarkedSourceGenerator::GenerateMarkedSourceUsingSource(
-    const GraphObserver::NodeId &decl_id) {
+MaybeFew<MarkedSource>
+MarkedSourceGenerator::GenerateMarkedSourceUsingSource() {
   auto start_loc = decl_->getSourceRange().getBegin();
   if (start_loc.isMacroID()) {
     start_loc = cache_->source_manager().getExpansionLoc(start_loc);
@@ -760,8 +760,8 @@ MaybeFew<MarkedSource> MarkedSourceGenerator::GenerateMarkedSourceUsingSource(
     auto formatted_range = Reformat(cache_->lang_options(), range.str(),
                                     &replacements, &incomplete);
     if (incomplete) {
-      LOG(WARNING) << "Incomplete reformatting for " << decl_id.getRawIdentity()
-                   << " (" << decl_->getQualifiedNameAsString() << ")";
+      LOG(WARNING) << "Incomplete reformatting for "
+                   << decl_->getQualifiedNameAsString();
       return None();
     }
     DeclAnnotator annotator(cache_, &replacements, start_loc, formatted_range,
@@ -796,8 +796,7 @@ MarkedSource MarkedSourceGenerator::GenerateMarkedSourceForNamedDecl() {
   return out;
 }
 
-MaybeFew<MarkedSource> MarkedSourceGenerator::GenerateMarkedSource(
-    const GraphObserver::NodeId &decl_id) {
+MaybeFew<MarkedSource> MarkedSourceGenerator::GenerateMarkedSource() {
   // MarkedSource generation is expensive. If we're not going to write out the
   // marked source later on, don't spend time on it.
   // TODO(zarko): Introduce a similar check for documentation.
@@ -805,16 +804,49 @@ MaybeFew<MarkedSource> MarkedSourceGenerator::GenerateMarkedSource(
     return None();
   }
   if (llvm::isa<clang::VarDecl>(decl_) || llvm::isa<clang::FieldDecl>(decl_)) {
-    return GenerateMarkedSourceUsingSource(decl_id);
+    return GenerateMarkedSourceUsingSource();
   } else if (const auto *func = llvm::dyn_cast<clang::FunctionDecl>(decl_)) {
     if (FLAGS_pretty_print_function_prototypes) {
       return GenerateMarkedSourceForFunction(func);
     } else {
-      return GenerateMarkedSourceUsingSource(decl_id);
+      return GenerateMarkedSourceUsingSource();
     }
   } else if (llvm::isa<clang::ObjCMethodDecl>(decl_)) {
-    return GenerateMarkedSourceUsingSource(decl_id);
+    return GenerateMarkedSourceUsingSource();
   }
   return GenerateMarkedSourceForNamedDecl();
 }
+
+const std::string *MarkedSourceGenerator::serialize() {
+  if (!WillGenerateMarkedSource()) {
+    return nullptr;
+  }
+  auto key = std::make_tuple(decl_, end_loc_.getRawEncoding(),
+                             name_range_.getBegin().getRawEncoding(),
+                             name_range_.getEnd().getRawEncoding());
+  auto *serialized = cache_->serialized();
+  auto found = serialized->find(key);
+  if (found == serialized->end()) {
+    MaybeFew<std::string> bytes = None();
+    if (auto marked_source = GenerateMarkedSource()) {
+      bytes = Some(marked_source.primary().SerializeAsString());
+    }
+    found = serialized->emplace(key, std::move(bytes)).first;
+  }
+  return found->second ? &found->second.primary() : nullptr;
+}
+
+size_t MarkedSourceCache::allocated_bytes() const {
+  // Each map node holds its value and three pointers and a color.
+  size_t node_bytes =
+      sizeof(decltype(serialized_)::value_type) + 4 * sizeof(void *);
+  size_t bytes = first_default_template_argument_.getMemorySize() +
+                 serialized_.size() * node_bytes;
+  for (const auto &entry : serialized_) {
+    entry.second.Iter([&bytes](const std::string &value) {
+      bytes += sizeof(value) + value.capacity();
+    });
+  }
+  return bytes;
+}
 }  // namespace kythe
@@ -17,6 +17,10 @@
 #ifndef KYTHE_CXX_INDEXER_CXX_MARKED_SOURCE_H_
 #define KYTHE_CXX_INDEXER_CXX_MARKED_SOURCE_H_
 
+#include <map>
+#include <string>
+#include <tuple>
+
 #include "clang/AST/Decl.h"
 #include "clang/Basic/SourceManager.h"
 #include "clang/Sema/Sema.h"
@@ -32,7 +36,10 @@ class MarkedSourceCache;
 /// source for presentation as a signature in documentation. Typically this
 /// drops function and struct bodies while preserving the information in
 /// prototypes.
-class MarkedSourceGenerator {
+///
+/// Pass a generator to a `GraphObserver` as a `LazyMarkedSource`; the marked
+/// source is then only built if the observer writes it.
+class MarkedSourceGenerator : public LazyMarkedSource::Supplier {
  public:
   /// The decl in question is implicit. Inhibits marked source generation.
   void set_implicit(bool value) { implicit_ = value; }
@@ -49,10 +56,14 @@ class MarkedSourceGenerator {
   /// \note This does not guarantee that GenerateMarkedSource != None.
   bool WillGenerateMarkedSource() const;
 
-  /// Attempt to build a marked source given all available information. Assumes
-  /// that `decl_`'s ID is `decl_id`.
-  MaybeFew<MarkedSource> GenerateMarkedSource(
-      const GraphObserver::NodeId &decl_id);
+  /// Attempt to build a marked source given all available information.
+  MaybeFew<MarkedSource> GenerateMarkedSource();
+
+  /// \brief Builds and serializes the marked source, or finds it in the
+  /// cache if a generator with the same settings already has.
+  /// \return the serialized marked source, or null if there is none. The
+  /// result is owned by the `MarkedSourceCache`.
+  const std::string *serialize() override;
 
  private:
   friend class MarkedSourceCache;
@@ -61,8 +72,7 @@ class MarkedSourceGenerator {
       : cache_(cache), decl_(decl) {}
 
   /// Attempt to generate marked source using the original source code.
-  MaybeFew<MarkedSource> GenerateMarkedSourceUsingSource(
-      const GraphObserver::NodeId &decl_id);
+  MaybeFew<MarkedSource> GenerateMarkedSourceUsingSource();
 
   /// Generate marked source by pretty-printing a function's prototype.
   MarkedSource GenerateMarkedSourceForFunction(const clang::FunctionDecl *decl);
@@ -141,6 +151,20 @@ class MarkedSourceCache {
     return &first_default_template_argument_;
   }
 
+  /// \brief Identifies a decl along with the settings of the generator
+  /// building its marked source: the raw encodings of the marked source's end
+  /// and of the beginning and end of the decl's name.
+  using SerializedKey =
+      std::tuple<const clang::NamedDecl *, unsigned, unsigned, unsigned>;
+
+  /// \brief Serialized marked source, or None if there was none.
+  std::map<SerializedKey, MaybeFew<std::string>> *serialized() {
+    return &serialized_;
+  }
+
+  /// \return an estimate of the bytes the cache has allocated.
+  size_t allocated_bytes() const;
+
  private:
   const clang::SourceManager &source_manager_;
   const clang::LangOptions &lang_options_;
@@ -151,6 +175,10 @@ class MarkedSourceCache {
   /// specialization's arguments that is default.
   llvm::DenseMap<const clang::ClassTemplateSpecializationDecl *, unsigned>
       first_default_template_argument_;
+
+  /// Marked source that has already been built, so that no decl's is built
+  /// twice.
+  std::map<SerializedKey, MaybeFew<std::string>> serialized_;
 };
 }  // namespace kythe
 
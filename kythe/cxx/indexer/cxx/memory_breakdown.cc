@@ -0,0 +1,123 @@
+/*
+ * Copyright 2017 Google Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// This file uses the Clang style conventions.
+
+#include "kythe/cxx/indexer/cxx/memory_breakdown.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <utility>
+
+#include "llvm/Support/Process.h"
+
+namespace kythe {
+namespace {
+/// \brief Appends a row of `summary` to `Out`.
+void AppendRow(const std::string &Name, uint64_t Latest, uint64_t Peak,
+               const std::string &PeakPhase, std::string *Out) {
+  char Line[256];
+  snprintf(Line, sizeof(Line), "%-24s %12.3f %12.3f  %s\n", Name.c_str(),
+           Latest / 1048576.0, Peak / 1048576.0, PeakPhase.c_str());
+  Out->append(Line);
+}
+}  // anonymous namespace
+
+MemoryBreakdown::MemoryBreakdown(Estimator HeapBytes)
+    : HeapBytes(std::move(HeapBytes)) {
+  if (!this->HeapBytes) {
+    this->HeapBytes = [] {
+      return static_cast<uint64_t>(llvm::sys::Process::GetMallocUsage());
+    };
+  }
+}
+
+void MemoryBreakdown::track(const std::string &Name, Estimator Estimate) {
+  for (auto &S : Subsystems) {
+    if (S.Name == Name) {
+      S.Estimate = std::move(Estimate);
+      return;
+    }
+  }
+  Subsystems.emplace_back();
+  Subsystems.back().Name = Name;
+  Subsystems.back().Estimate = std::move(Estimate);
+}
+
+void MemoryBreakdown::untrack(const std::string &Name) {
+  for (auto &S : Subsystems) {
+    if (S.Name == Name) {
+      S.Estimate = nullptr;
+    }
+  }
+}
+
+void MemoryBreakdown::sample(const std::string &Phase) {
+  LatestPhase = Phase;
+  LatestTotal = 0;
+  for (auto &S : Subsystems) {
+    if (S.Estimate) {
+      S.Latest = S.Estimate();
+      if (S.Latest > S.Peak) {
+        S.Peak = S.Latest;
+        S.PeakPhase = Phase;
+      }
+    }
+    LatestTotal += S.Latest;
+  }
+  if (LatestTotal > PeakTotal) {
+    PeakTotal = LatestTotal;
+    PeakTotalPhase = Phase;
+  }
+  LatestHeap = HeapBytes();
+  PeakHeap = std::max(PeakHeap, LatestHeap);
+}
+
+const MemoryBreakdown::Subsystem *MemoryBreakdown::find(
+    const std::string &Name) const {
+  for (const auto &S : Subsystems) {
+    if (S.Name == Name) {
+      return &S;
+    }
+  }
+  return nullptr;
+}
+
+uint64_t MemoryBreakdown::latest(const std::string &Name) const {
+  const auto *S = find(Name);
+  return S == nullptr ? 0 : S->Latest;
+}
+
+uint64_t MemoryBreakdown::peak(const std::string &Name) const {
+  const auto *S = find(Name);
+  return S == nullptr ? 0 : S->Peak;
+}
+
+std::string MemoryBreakdown::summary() const {
+  char Line[256];
+  snprintf(Line, sizeof(Line), "%-24s %12s %12s  %s (latest: %s)\n",
+           "subsystem", "latest_mb", "peak_mb", "peaked_at",
+           LatestPhase.c_str());
+  std::string Out = Line;
+  for (const auto &S : Subsystems) {
+    AppendRow(S.Name, S.Latest, S.Peak, S.PeakPhase, &Out);
+  }
+  AppendRow("total", LatestTotal, PeakTotal, PeakTotalPhase, &Out);
+  AppendRow("process_heap", LatestHeap, PeakHeap, "", &Out);
+  return Out;
+}
+
+}  // namespace kythe
@@ -0,0 +1,130 @@
+/*
+ * Copyright 2017 Google Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// This file uses the Clang style conventions.
+
+#ifndef KYTHE_CXX_INDEXER_CXX_MEMORY_BREAKDOWN_H_
+#define KYTHE_CXX_INDEXER_CXX_MEMORY_BREAKDOWN_H_
+
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+
+namespace kythe {
+
+/// \brief Tracks how many bytes each of the indexer's subsystems holds over
+/// the course of a unit, so that a unit that runs out of memory can be
+/// blamed on (say) the AST or the parent map rather than on the indexer.
+///
+/// Subsystems register a function that estimates the bytes they hold from
+/// the sizes of their containers; `sample` calls every one at a phase
+/// boundary and keeps each subsystem's latest and peak estimate. Estimates
+/// cover the main allocations but not allocator overhead, so the process's
+/// heap usage is sampled alongside them for comparison. Not thread-safe.
+class MemoryBreakdown {
+ public:
+  /// \brief Returns a size in bytes.
+  using Estimator = std::function<uint64_t()>;
+
+  /// \param HeapBytes Returns the bytes allocated by the process; defaults to
+  /// `llvm::sys::Process::GetMallocUsage`.
+  explicit MemoryBreakdown(Estimator HeapBytes = Estimator());
+
+  /// \brief Starts sampling `Subsystem` with `Estimate`, replacing any
+  /// estimator it had.
+  void track(const std::string &Subsystem, Estimator Estimate);
+
+  /// \brief Stops sampling `Subsystem` (for example, because the estimator
+  /// refers to something that's about to be destroyed). Its latest and peak
+  /// estimates are kept and still count towards later totals.
+  void untrack(const std::string &Subsystem);
+
+  /// \brief Samples every tracked subsystem at `Phase`.
+  void sample(const std::string &Phase);
+
+  /// \return the largest sum of the subsystems' estimates in one sample.
+  uint64_t peakTotal() const { return PeakTotal; }
+
+  /// \return the latest estimate for `Subsystem` (or 0 if it has none).
+  uint64_t latest(const std::string &Subsystem) const;
+
+  /// \return the peak estimate for `Subsystem` (or 0 if it has none).
+  uint64_t peak(const std::string &Subsystem) const;
+
+  /// \return a table of each subsystem's latest and peak estimates and
+  /// where it peaked, followed by the totals and the process's heap usage.
+  std::string summary() const;
+
+ private:
+  struct Subsystem {
+    std::string Name;
+    /// Empty once the subsystem is untracked.
+    Estimator Estimate;
+    uint64_t Latest = 0;
+    uint64_t Peak = 0;
+    /// The phase of the sample with the peak estimate.
+    std::string PeakPhase;
+  };
+
+  /// \return the subsystem called `Name`, or null.
+  const Subsystem *find(const std::string &Name) const;
+
+  Estimator HeapBytes;
+  /// Every subsystem that has been tracked, in the order they were first
+  /// tracked.
+  std::vector<Subsystem> Subsystems;
+  /// The phase of the latest sample.
+  std::string LatestPhase;
+  /// The sum of the estimates in the latest sample.
+  uint64_t LatestTotal = 0;
+  uint64_t PeakTotal = 0;
+  /// The phase of the sample with the peak total.
+  std::string PeakTotalPhase;
+  /// The process's heap usage at the latest sample and at its peak.
+  uint64_t LatestHeap = 0;
+  uint64_t PeakHeap = 0;
+};
+
+/// \brief Tracks a subsystem in a `MemoryBreakdown` for as long as it's in
+/// scope.
+class ScopedMemoryTracking {
+ public:
+  /// \param Breakdown The breakdown to add to; may be null, in which case
+  /// nothing is tracked.
+  ScopedMemoryTracking(MemoryBreakdown *Breakdown, std::string Subsystem,
+                       MemoryBreakdown::Estimator Estimate)
+      : Breakdown(Breakdown), Subsystem(std::move(Subsystem)) {
+    if (Breakdown != nullptr) {
+      Breakdown->track(this->Subsystem, std::move(Estimate));
+    }
+  }
+  ScopedMemoryTracking(const ScopedMemoryTracking &) = delete;
+  ScopedMemoryTracking &operator=(const ScopedMemoryTracking &) = delete;
+  ~ScopedMemoryTracking() {
+    if (Breakdown != nullptr) {
+      Breakdown->untrack(Subsystem);
+    }
+  }
+
+ private:
+  MemoryBreakdown *Breakdown;
+  std::string Subsystem;
+};
+
+}  // namespace kythe
+
+#endif  // KYTHE_CXX_INDEXER_CXX_MEMORY_BREAKDOWN_H_
@@ -0,0 +1,113 @@
+/*
+ * Copyright 2017 Google Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// This file uses the Clang style conventions.
+
+#include "kythe/cxx/indexer/cxx/memory_breakdown.h"
+
+#include "gtest/gtest.h"
+
+namespace kythe {
+namespace {
+
+/// \brief A heap sampler that the test sets by hand.
+struct FakeHeap {
+  MemoryBreakdown::Estimator bytes() {
+    return [this] { return Bytes; };
+  }
+  uint64_t Bytes = 0;
+};
+
+TEST(MemoryBreakdownTest, KeepsLatestAndPeak) {
+  FakeHeap Heap;
+  MemoryBreakdown Memory(Heap.bytes());
+  uint64_t AST = 100;
+  Memory.track("clang_ast", [&AST] { return AST; });
+  Memory.sample("parsed");
+  AST = 300;
+  Memory.sample("traversal");
+  AST = 200;
+  Memory.sample("traversed");
+  EXPECT_EQ(200, Memory.latest("clang_ast"));
+  EXPECT_EQ(300, Memory.peak("clang_ast"));
+  EXPECT_EQ(300, Memory.peakTotal());
+}
+
+TEST(MemoryBreakdownTest, PeakTotalIsOneSample) {
+  FakeHeap Heap;
+  MemoryBreakdown Memory(Heap.bytes());
+  uint64_t A = 100, B = 0;
+  Memory.track("a", [&A] { return A; });
+  Memory.track("b", [&B] { return B; });
+  Memory.sample("first");
+  A = 0;
+  B = 150;
+  Memory.sample("second");
+  EXPECT_EQ(100, Memory.peak("a"));
+  EXPECT_EQ(150, Memory.peak("b"));
+  EXPECT_EQ(150, Memory.peakTotal());
+}
+
+TEST(MemoryBreakdownTest, UntrackedSubsystemsKeepTheirLatest) {
+  FakeHeap Heap;
+  MemoryBreakdown Memory(Heap.bytes());
+  uint64_t Calls = 0;
+  {
+    ScopedMemoryTracking Track(&Memory, "parent_map", [&Calls] {
+      ++Calls;
+      return uint64_t(64);
+    });
+    Memory.sample("parsed");
+  }
+  Memory.sample("finished");
+  EXPECT_EQ(1, Calls);
+  EXPECT_EQ(64, Memory.latest("parent_map"));
+  EXPECT_EQ(64, Memory.peakTotal());
+}
+
+TEST(MemoryBreakdownTest, ScopedTrackingAllowsNull) {
+  ScopedMemoryTracking Track(nullptr, "vfs_files", [] { return uint64_t(1); });
+}
+
+TEST(MemoryBreakdownTest, UnknownSubsystemsAreEmpty) {
+  FakeHeap Heap;
+  MemoryBreakdown Memory(Heap.bytes());
+  Memory.sample("parsed");
+  EXPECT_EQ(0, Memory.latest("clang_ast"));
+  EXPECT_EQ(0, Memory.peak("clang_ast"));
+}
+
+TEST(MemoryBreakdownTest, SummaryListsSubsystemsAndHeap) {
+  FakeHeap Heap;
+  MemoryBreakdown Memory(Heap.bytes());
+  Memory.track("marked_source", [] { return uint64_t(2 << 20); });
+  Heap.Bytes = 8 << 20;
+  Memory.sample("traversed");
+  std::string Summary = Memory.summary();
+  EXPECT_NE(std::string::npos, Summary.find("marked_source"));
+  EXPECT_NE(std::string::npos, Summary.find("2.000"));
+  EXPECT_NE(std::string::npos, Summary.find("process_heap"));
+  EXPECT_NE(std::string::npos, Summary.find("8.000"));
+  EXPECT_NE(std::string::npos, Summary.find("traversed"));
+}
+
+}  // namespace
+}  // namespace kythe
+
+int main(int argc, char **argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
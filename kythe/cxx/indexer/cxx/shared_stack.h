@@ -0,0 +1,163 @@
+/*
+ * Copyright 2017 Google Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// This file uses the Clang style conventions.
+
+#ifndef KYTHE_CXX_INDEXER_CXX_SHARED_STACK_H_
+#define KYTHE_CXX_INDEXER_CXX_SHARED_STACK_H_
+
+#include <atomic>
+#include <cstddef>
+#include <new>
+#include <utility>
+
+#include "glog/logging.h"
+
+namespace kythe {
+
+/// \brief A stack whose copies share their elements.
+///
+/// The stack is a reference-counted cons list, so copying one is O(1) and
+/// never allocates. `push_back` and `pop_back` change only the stack they
+/// are called on; copies keep the elements they had. Nodes are recycled
+/// through a per-thread free list, so pushing only allocates when the thread
+/// has never had as many nodes live at once.
+///
+/// Elements can't be changed in place. Indexing is from the bottom, as for a
+/// vector, and `operator[](I)` costs O(size() - I).
+template <typename T>
+class SharedStack {
+ public:
+  using value_type = T;
+  using size_type = size_t;
+
+  SharedStack() = default;
+  SharedStack(const SharedStack &Other) : Top(Other.Top) { retain(Top); }
+  SharedStack(SharedStack &&Other) noexcept : Top(Other.Top) {
+    Other.Top = nullptr;
+  }
+  SharedStack &operator=(SharedStack Other) {
+    std::swap(Top, Other.Top);
+    return *this;
+  }
+  ~SharedStack() { release(Top); }
+
+  bool empty() const { return Top == nullptr; }
+  size_t size() const { return Top ? Top->Size : 0; }
+
+  /// \return the element on top of the stack, which must not be empty.
+  const T &back() const {
+    DCHECK(Top != nullptr);
+    return Top->Value;
+  }
+
+  /// \return the `I`th element from the bottom of the stack.
+  const T &operator[](size_t I) const {
+    DCHECK_LT(I, size());
+    const Node *N = Top;
+    for (size_t Skip = Top->Size - 1 - I; Skip != 0; --Skip) {
+      N = N->Next;
+    }
+    return N->Value;
+  }
+
+  void push_back(T Value) {
+    // The new node takes over this stack's reference to the old top.
+    Top = new (allocate()) Node(std::move(Value), Top);
+  }
+
+  void pop_back() {
+    DCHECK(Top != nullptr);
+    Node *Old = Top;
+    Top = Old->Next;
+    retain(Top);
+    release(Old);
+  }
+
+  /// \return whether `Other` is this stack or a copy of it that hasn't been
+  /// changed since.
+  bool shares(const SharedStack &Other) const { return Top == Other.Top; }
+
+ private:
+  struct Node {
+    Node(T &&Value, Node *Next)
+        : Value(std::move(Value)),
+          Next(Next),
+          Size(Next ? Next->Size + 1 : 1) {}
+    T Value;
+    /// The node below this one, which this node holds a reference to.
+    Node *Next;
+    size_t Size;
+    std::atomic<unsigned> Refs{1};
+  };
+
+  /// \brief Storage for a released node, waiting to be reused.
+  struct FreeCell {
+    FreeCell *Next;
+  };
+  static_assert(sizeof(Node) >= sizeof(FreeCell), "Node too small to recycle");
+
+  /// \brief A thread's released nodes.
+  struct FreeList {
+    FreeCell *Head = nullptr;
+    ~FreeList() {
+      while (Head != nullptr) {
+        FreeCell *Cell = Head;
+        Head = Cell->Next;
+        ::operator delete(Cell);
+      }
+    }
+  };
+
+  static FreeList &freeList() {
+    static thread_local FreeList List;
+    return List;
+  }
+
+  static void *allocate() {
+    FreeList &List = freeList();
+    if (FreeCell *Cell = List.Head) {
+      List.Head = Cell->Next;
+      return Cell;
+    }
+    return ::operator new(sizeof(Node));
+  }
+
+  static void retain(Node *N) {
+    if (N != nullptr) {
+      N->Refs.fetch_add(1, std::memory_order_relaxed);
+    }
+  }
+
+  /// \brief Drops a reference to `N`, and to the nodes below it that this
+  /// leaves unused.
+  static void release(Node *N) {
+    while (N != nullptr &&
+           N->Refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+      Node *Next = N->Next;
+      N->~Node();
+      FreeList &List = freeList();
+      List.Head = new (static_cast<void *>(N)) FreeCell{List.Head};
+      N = Next;
+    }
+  }
+
+  Node *Top = nullptr;
+};
+
+}  // namespace kythe
+
+#endif  // KYTHE_CXX_INDEXER_CXX_SHARED_STACK_H_
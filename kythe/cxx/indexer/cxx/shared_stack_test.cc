@@ -0,0 +1,115 @@
+/*
+ * Copyright 2017 Google Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// This file uses the Clang style conventions.
+
+#include "kythe/cxx/indexer/cxx/shared_stack.h"
+
+#include <memory>
+#include <string>
+#include <thread>
+
+#include "gtest/gtest.h"
+
+namespace kythe {
+namespace {
+
+TEST(SharedStackTest, PushesAndPops) {
+  SharedStack<int> Stack;
+  EXPECT_TRUE(Stack.empty());
+  EXPECT_EQ(0u, Stack.size());
+  Stack.push_back(1);
+  Stack.push_back(2);
+  Stack.push_back(3);
+  EXPECT_FALSE(Stack.empty());
+  ASSERT_EQ(3u, Stack.size());
+  EXPECT_EQ(3, Stack.back());
+  EXPECT_EQ(1, Stack[0]);
+  EXPECT_EQ(2, Stack[1]);
+  EXPECT_EQ(3, Stack[2]);
+  Stack.pop_back();
+  EXPECT_EQ(2, Stack.back());
+  Stack.pop_back();
+  Stack.pop_back();
+  EXPECT_TRUE(Stack.empty());
+}
+
+TEST(SharedStackTest, CopiesAreIndependent) {
+  SharedStack<std::string> Parent;
+  Parent.push_back("a");
+  Parent.push_back("b");
+  SharedStack<std::string> Child(Parent);
+  EXPECT_TRUE(Child.shares(Parent));
+  Child.pop_back();
+  Child.push_back("c");
+  Child.push_back("d");
+  EXPECT_FALSE(Child.shares(Parent));
+  ASSERT_EQ(2u, Parent.size());
+  EXPECT_EQ("a", Parent[0]);
+  EXPECT_EQ("b", Parent.back());
+  ASSERT_EQ(3u, Child.size());
+  EXPECT_EQ("a", Child[0]);
+  EXPECT_EQ("c", Child[1]);
+  EXPECT_EQ("d", Child.back());
+  Parent = Child;
+  EXPECT_TRUE(Parent.shares(Child));
+  EXPECT_EQ("d", Parent.back());
+}
+
+TEST(SharedStackTest, DestroysElementsWhenUnused) {
+  auto Element = std::make_shared<int>(7);
+  {
+    SharedStack<std::shared_ptr<int>> Stack;
+    Stack.push_back(Element);
+    EXPECT_EQ(2, Element.use_count());
+    // The copy shares the node that holds the element.
+    SharedStack<std::shared_ptr<int>> Copy(Stack);
+    EXPECT_EQ(2, Element.use_count());
+    Stack.pop_back();
+    EXPECT_EQ(2, Element.use_count());
+    SharedStack<std::shared_ptr<int>> Moved(std::move(Copy));
+    EXPECT_EQ(2, Element.use_count());
+    Moved.pop_back();
+    EXPECT_EQ(1, Element.use_count());
+    Moved.push_back(Element);
+  }
+  EXPECT_EQ(1, Element.use_count());
+}
+
+TEST(SharedStackTest, ReleasesCopiesFromOtherThreads) {
+  SharedStack<int> Stack;
+  for (int I = 0; I < 1000; ++I) {
+    Stack.push_back(I);
+  }
+  SharedStack<int> Copy(Stack);
+  std::thread Worker([&Copy] {
+    while (!Copy.empty()) {
+      Copy.pop_back();
+    }
+  });
+  Worker.join();
+  ASSERT_EQ(1000u, Stack.size());
+  EXPECT_EQ(999, Stack.back());
+  EXPECT_EQ(500, Stack[500]);
+}
+
+}  // namespace
+}  // namespace kythe
+
+int main(int argc, char **argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,76 @@
+/*
+ * Copyright 2017 Google Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// This file uses the Clang style conventions.
+
+#include "kythe/cxx/indexer/cxx/unit_budget.h"
+
+#include <chrono>
+#include <utility>
+
+#include "kythe/cxx/indexer/cxx/heap_profile.h"
+
+namespace kythe {
+
+UnitBudgetMonitor::UnitBudgetMonitor(const UnitBudget &Budget,
+                                     Sampler NowMillis, Sampler HeapBytes,
+                                     unsigned CheckInterval)
+    : Budget(Budget),
+      NowMillis(std::move(NowMillis)),
+      HeapBytes(std::move(HeapBytes)),
+      CheckInterval(CheckInterval == 0 ? 1 : CheckInterval) {
+  if (!this->NowMillis) {
+    this->NowMillis = [] {
+      return static_cast<uint64_t>(
+          std::chrono::duration_cast<std::chrono::milliseconds>(
+              std::chrono::steady_clock::now().time_since_epoch())
+              .count());
+    };
+  }
+  if (!this->HeapBytes) {
+    this->HeapBytes = [] { return AllocatedHeapBytes(); };
+  }
+  StartMillis = this->NowMillis();
+}
+
+UnitBudgetMonitor::State UnitBudgetMonitor::check() {
+  if (Current == State::Hard || Countdown-- > 0) {
+    return Current;
+  }
+  Countdown = CheckInterval - 1;
+  uint64_t Millis = NowMillis() - StartMillis;
+  uint64_t Bytes =
+      Budget.SoftHeapBytes != 0 || Budget.HardHeapBytes != 0 ? HeapBytes() : 0;
+  checkLimit(Millis, Budget.SoftWallMillis, State::Soft, "wall time", "ms");
+  checkLimit(Bytes, Budget.SoftHeapBytes, State::Soft, "heap", "bytes");
+  checkLimit(Millis, Budget.HardWallMillis, State::Hard, "wall time", "ms");
+  checkLimit(Bytes, Budget.HardHeapBytes, State::Hard, "heap", "bytes");
+  return Current;
+}
+
+void UnitBudgetMonitor::checkLimit(uint64_t Used, uint64_t Limit,
+                                   State NewState, const char *Resource,
+                                   const char *Unit) {
+  if (Limit == 0 || Used < Limit || Current >= NewState) {
+    return;
+  }
+  Current = NewState;
+  Reason = std::string(Resource) + " passed the " +
+           (NewState == State::Hard ? "hard" : "soft") + " limit of " +
+           std::to_string(Limit) + " " + Unit;
+}
+
+}  // namespace kythe
@@ -0,0 +1,102 @@
+/*
+ * Copyright 2017 Google Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// This file uses the Clang style conventions.
+
+#ifndef KYTHE_CXX_INDEXER_CXX_UNIT_BUDGET_H_
+#define KYTHE_CXX_INDEXER_CXX_UNIT_BUDGET_H_
+
+#include <cstdint>
+#include <functional>
+#include <string>
+
+namespace kythe {
+
+/// \brief Limits on the resources that indexing a single unit may use.
+///
+/// Crossing a soft limit degrades the rest of the unit to lite indexing
+/// without template instantiations; crossing a hard limit stops it. Each
+/// limit is disabled if it is 0.
+struct UnitBudget {
+  /// Wall time since the unit was started, in milliseconds.
+  uint64_t SoftWallMillis = 0;
+  uint64_t HardWallMillis = 0;
+  /// Bytes allocated by the process. This counts every worker's allocations,
+  /// so it is only a rough per-unit measure when workers run concurrently.
+  uint64_t SoftHeapBytes = 0;
+  uint64_t HardHeapBytes = 0;
+
+  /// \return true if no limit is set.
+  bool empty() const {
+    return SoftWallMillis == 0 && HardWallMillis == 0 && SoftHeapBytes == 0 &&
+           HardHeapBytes == 0;
+  }
+};
+
+/// \brief Tracks a unit's resource use against a `UnitBudget`.
+///
+/// Resources are only sampled every so often, so `check` is cheap enough to
+/// call for every declaration. Not thread-safe.
+class UnitBudgetMonitor {
+ public:
+  /// \brief How far over its budget a unit is. Units never go back.
+  enum class State { Normal, Soft, Hard };
+
+  /// \brief Returns a resource measurement (milliseconds or bytes).
+  using Sampler = std::function<uint64_t()>;
+
+  /// \param Budget The limits to enforce.
+  /// \param NowMillis Returns the current time; defaults to a monotonic
+  /// clock. The unit starts when the monitor is constructed.
+  /// \param HeapBytes Returns the bytes allocated by the process; defaults to
+  /// `AllocatedHeapBytes`, which asks whichever allocator is linked in.
+  /// \param CheckInterval Sample once every this many calls to `check`.
+  explicit UnitBudgetMonitor(const UnitBudget &Budget,
+                             Sampler NowMillis = Sampler(),
+                             Sampler HeapBytes = Sampler(),
+                             unsigned CheckInterval = 1024);
+
+  /// \brief Samples the unit's resource use if it's time to do so.
+  /// \return the unit's state.
+  State check();
+
+  /// \return the unit's state as of the last sample.
+  State state() const { return Current; }
+
+  /// \return a description of the limit that put the unit into its current
+  /// state, or empty if the unit is within its budget.
+  const std::string &reason() const { return Reason; }
+
+ private:
+  /// \brief Moves the unit to `NewState` if it's past `Limit` (when nonzero).
+  void checkLimit(uint64_t Used, uint64_t Limit, State NewState,
+                  const char *Resource, const char *Unit);
+
+  UnitBudget Budget;
+  Sampler NowMillis;
+  Sampler HeapBytes;
+  unsigned CheckInterval;
+  /// Calls to `check` until the next sample.
+  unsigned Countdown = 0;
+  /// When the unit started, according to `NowMillis`.
+  uint64_t StartMillis;
+  State Current = State::Normal;
+  std::string Reason;
+};
+
+}  // namespace kythe
+
+#endif  // KYTHE_CXX_INDEXER_CXX_UNIT_BUDGET_H_
@@ -0,0 +1,93 @@
+/*
+ * Copyright 2017 Google Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// This file uses the Clang style conventions.
+
+#include "kythe/cxx/indexer/cxx/unit_budget.h"
+
+#include "gtest/gtest.h"
+
+namespace kythe {
+namespace {
+
+/// \brief Resource samplers that the test sets by hand.
+struct FakeResources {
+  UnitBudgetMonitor::Sampler millis() {
+    return [this] { return Millis; };
+  }
+  UnitBudgetMonitor::Sampler bytes() {
+    return [this] { return Bytes; };
+  }
+  uint64_t Millis = 1000;
+  uint64_t Bytes = 0;
+};
+
+TEST(UnitBudgetTest, EmptyBudget) {
+  UnitBudget Budget;
+  EXPECT_TRUE(Budget.empty());
+  Budget.HardHeapBytes = 1;
+  EXPECT_FALSE(Budget.empty());
+}
+
+TEST(UnitBudgetTest, DegradesThenStopsOnTime) {
+  FakeResources Resources;
+  UnitBudget Budget;
+  Budget.SoftWallMillis = 10;
+  Budget.HardWallMillis = 20;
+  UnitBudgetMonitor Monitor(Budget, Resources.millis(), Resources.bytes(), 1);
+  EXPECT_EQ(UnitBudgetMonitor::State::Normal, Monitor.check());
+  EXPECT_TRUE(Monitor.reason().empty());
+  Resources.Millis += 10;
+  EXPECT_EQ(UnitBudgetMonitor::State::Soft, Monitor.check());
+  EXPECT_EQ("wall time passed the soft limit of 10 ms", Monitor.reason());
+  Resources.Millis += 10;
+  EXPECT_EQ(UnitBudgetMonitor::State::Hard, Monitor.check());
+  EXPECT_EQ("wall time passed the hard limit of 20 ms", Monitor.reason());
+}
+
+TEST(UnitBudgetTest, StopsOnHeap) {
+  FakeResources Resources;
+  UnitBudget Budget;
+  Budget.HardHeapBytes = 100;
+  UnitBudgetMonitor Monitor(Budget, Resources.millis(), Resources.bytes(), 1);
+  EXPECT_EQ(UnitBudgetMonitor::State::Normal, Monitor.check());
+  Resources.Bytes = 100;
+  EXPECT_EQ(UnitBudgetMonitor::State::Hard, Monitor.check());
+  EXPECT_EQ("heap passed the hard limit of 100 bytes", Monitor.reason());
+  Resources.Bytes = 0;
+  EXPECT_EQ(UnitBudgetMonitor::State::Hard, Monitor.check());
+}
+
+TEST(UnitBudgetTest, SamplesEveryInterval) {
+  FakeResources Resources;
+  UnitBudget Budget;
+  Budget.SoftWallMillis = 10;
+  UnitBudgetMonitor Monitor(Budget, Resources.millis(), Resources.bytes(), 3);
+  EXPECT_EQ(UnitBudgetMonitor::State::Normal, Monitor.check());
+  Resources.Millis += 10;
+  EXPECT_EQ(UnitBudgetMonitor::State::Normal, Monitor.check());
+  EXPECT_EQ(UnitBudgetMonitor::State::Normal, Monitor.check());
+  EXPECT_EQ(UnitBudgetMonitor::State::Soft, Monitor.check());
+  EXPECT_EQ(UnitBudgetMonitor::State::Soft, Monitor.state());
+}
+
+}  // namespace
+}  // namespace kythe
+
+int main(int argc, char **argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,135 @@
+/*
+ * Copyright 2017 Google Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// This file uses the Clang style conventions.
+
+#include "kythe/cxx/indexer/cxx/unit_cost_probe.h"
+
+#include <cerrno>
+#include <cstring>
+
+#include "clang/Lex/PPCallbacks.h"
+#include "clang/Lex/Preprocessor.h"
+#include "llvm/ADT/STLExtras.h"
+
+namespace kythe {
+namespace {
+/// \brief Counts macro expansions for a `UnitCostProbe`.
+class MacroExpansionCounter : public clang::PPCallbacks {
+ public:
+  MacroExpansionCounter(const clang::SourceManager &SM, UnitCostProbe *Probe)
+      : SM(SM), Probe(Probe) {}
+
+  void MacroExpands(const clang::Token &Token,
+                    const clang::MacroDefinition &Macro,
+                    clang::SourceRange Range,
+                    const clang::MacroArgs *Args) override {
+    clang::SourceLocation Loc = SM.getExpansionLoc(Range.getBegin());
+    if (Loc.isValid()) {
+      ++Probe->Files[SM.getBufferName(Loc)].MacroExpansions;
+    }
+  }
+
+ private:
+  const clang::SourceManager &SM;
+  UnitCostProbe *Probe;
+};
+}  // anonymous namespace
+
+UnitCostProbe::FileCost UnitCostProbe::Total() const {
+  FileCost Sum;
+  for (const auto &File : Files) {
+    Sum.ClaimedTokens += File.second.ClaimedTokens;
+    Sum.UnclaimedTokens += File.second.UnclaimedTokens;
+    Sum.MacroExpansions += File.second.MacroExpansions;
+  }
+  return Sum;
+}
+
+std::string UnitCostProbe::ToTsv(const std::string &Key) const {
+  auto Line = [](const char *Kind, const FileCost &Cost,
+                 const std::string &Name) {
+    return std::string(Kind) + "\t" + std::to_string(Cost.ClaimedTokens) +
+           "\t" + std::to_string(Cost.UnclaimedTokens) + "\t" +
+           std::to_string(Cost.MacroExpansions) + "\t" + Name + "\n";
+  };
+  std::string Tsv = Line("unit", Total(), Key);
+  for (const auto &File : Files) {
+    Tsv += Line("file", File.second, File.first);
+  }
+  return Tsv;
+}
+
+void RunCostProbe(clang::CompilerInstance &CI, GraphObserver &Observer,
+                  UnitCostProbe *Probe) {
+  clang::Preprocessor &PP = CI.getPreprocessor();
+  const clang::SourceManager &SM = CI.getSourceManager();
+  PP.addPPCallbacks(llvm::make_unique<MacroExpansionCounter>(SM, Probe));
+  PP.EnterMainSourceFile();
+  // Runs of tokens usually come from the same file entry.
+  clang::FileID LastFile;
+  UnitCostProbe::FileCost *LastCost = nullptr;
+  bool LastClaimed = false;
+  clang::Token Token;
+  for (;;) {
+    PP.Lex(Token);
+    if (Token.is(clang::tok::eof)) {
+      break;
+    }
+    clang::SourceLocation Loc = SM.getExpansionLoc(Token.getLocation());
+    clang::FileID File = SM.getFileID(Loc);
+    if (LastCost == nullptr || File != LastFile) {
+      LastFile = File;
+      LastCost = &Probe->Files[SM.getBufferName(Loc)];
+      LastClaimed = Observer.claimLocation(Loc);
+    }
+    ++(LastClaimed ? LastCost->ClaimedTokens : LastCost->UnclaimedTokens);
+  }
+}
+
+CostProbeWriter::~CostProbeWriter() {
+  if (File != nullptr) {
+    ::fclose(File);
+  }
+}
+
+bool CostProbeWriter::Open(const std::string &Path, std::string *ErrorText) {
+  std::lock_guard<std::mutex> Lock(Mutex);
+  if (File != nullptr) {
+    ::fclose(File);
+  }
+  File = ::fopen(Path.c_str(), "a");
+  if (File == nullptr) {
+    *ErrorText = ::strerror(errno);
+    return false;
+  }
+  return true;
+}
+
+void CostProbeWriter::Write(const std::string &Key,
+                            const UnitCostProbe &Probe) {
+  std::string Lines = Probe.ToTsv(Key);
+  std::lock_guard<std::mutex> Lock(Mutex);
+  if (File == nullptr) {
+    return;
+  }
+  if (::fwrite(Lines.data(), 1, Lines.size(), File) != Lines.size() ||
+      ::fflush(File) != 0) {
+    fprintf(stderr, "Couldn't write a cost probe: %s\n", ::strerror(errno));
+  }
+}
+
+}  // namespace kythe
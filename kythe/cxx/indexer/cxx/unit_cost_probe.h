@@ -0,0 +1,96 @@
+/*
+ * Copyright 2017 Google Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// This file uses the Clang style conventions.
+
+#ifndef KYTHE_CXX_INDEXER_CXX_UNIT_COST_PROBE_H_
+#define KYTHE_CXX_INDEXER_CXX_UNIT_COST_PROBE_H_
+
+#include <cstdint>
+#include <cstdio>
+#include <map>
+#include <mutex>
+#include <string>
+
+#include "clang/Frontend/CompilerInstance.h"
+
+#include "GraphObserver.h"
+
+namespace kythe {
+
+/// \brief What preprocessing a compilation unit (without parsing it) says
+/// about how expensive it will be to index.
+///
+/// Token counts predict traversal cost far better than file counts: the
+/// indexer does work for most tokens the parser sees, and much more of it
+/// for tokens in files the unit claims.
+struct UnitCostProbe {
+  /// \brief The costs attributed to one file.
+  struct FileCost {
+    /// Tokens (after macro expansion) lexed while the file was claimed.
+    uint64_t ClaimedTokens = 0;
+    /// Tokens lexed while the file was not claimed.
+    uint64_t UnclaimedTokens = 0;
+    /// Macro expansions whose expansion site is in the file.
+    uint64_t MacroExpansions = 0;
+  };
+
+  /// The costs of each file, by path. Tokens that come from a macro are
+  /// charged to the file that expanded it.
+  std::map<std::string, FileCost> Files;
+
+  /// \return the sum of the costs of all the files.
+  FileCost Total() const;
+
+  /// \return the probe as tab-separated lines: first
+  /// "unit\tclaimed_tokens\tunclaimed_tokens\tmacro_expansions\t<Key>",
+  /// then a "file" line with the same columns for each file, ending with
+  /// its path.
+  std::string ToTsv(const std::string &Key) const;
+};
+
+/// \brief Preprocesses the main file of `CI` in place of parsing it, filling
+/// in `Probe`. Call from `FrontendAction::ExecuteAction`.
+/// \param Observer Says which locations are claimed. The preprocessor
+/// callbacks that enter files must tell it about them.
+void RunCostProbe(clang::CompilerInstance &CI, GraphObserver &Observer,
+                  UnitCostProbe *Probe);
+
+/// \brief Appends `UnitCostProbe`s to a file. Thread-safe.
+class CostProbeWriter {
+ public:
+  CostProbeWriter() = default;
+  CostProbeWriter(const CostProbeWriter &) = delete;
+  CostProbeWriter &operator=(const CostProbeWriter &) = delete;
+  ~CostProbeWriter();
+
+  /// \brief Opens `Path` for appending, creating it if necessary.
+  /// \return false on failure; `ErrorText` will say why.
+  bool Open(const std::string &Path, std::string *ErrorText);
+
+  /// \brief Writes `Probe` for the unit called `Key` and flushes it.
+  void Write(const std::string &Key, const UnitCostProbe &Probe);
+
+ private:
+  /// Guards `File`.
+  std::mutex Mutex;
+  /// The file to write to, or null.
+  FILE *File = nullptr;
+};
+
+}  // namespace kythe
+
+#endif  // KYTHE_CXX_INDEXER_CXX_UNIT_COST_PROBE_H_
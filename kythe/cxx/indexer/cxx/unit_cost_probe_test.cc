@@ -0,0 +1,101 @@
+/*
+ * Copyright 2017 Google Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// This file uses the Clang style conventions.
+
+#include "kythe/cxx/indexer/cxx/unit_cost_probe.h"
+
+#include "clang/Frontend/FrontendAction.h"
+#include "clang/Tooling/Tooling.h"
+#include "gtest/gtest.h"
+#include "llvm/ADT/StringRef.h"
+
+namespace kythe {
+namespace {
+
+/// \brief Claims everything or nothing.
+class FixedClaimObserver : public NullGraphObserver {
+ public:
+  explicit FixedClaimObserver(bool Claimed) : Claimed(Claimed) {}
+  bool claimLocation(clang::SourceLocation Loc) override { return Claimed; }
+
+ private:
+  bool Claimed;
+};
+
+/// \brief Probes the code it's run on.
+class ProbeAction : public clang::PreprocessorFrontendAction {
+ public:
+  ProbeAction(bool Claimed, UnitCostProbe *Probe)
+      : Observer(Claimed), Probe(Probe) {}
+
+ private:
+  void ExecuteAction() override {
+    RunCostProbe(getCompilerInstance(), Observer, Probe);
+  }
+
+  FixedClaimObserver Observer;
+  UnitCostProbe *Probe;
+};
+
+constexpr char kCode[] = R"(
+#define TWO 1 + 1
+int a = TWO;
+int b = TWO;
+)";
+
+TEST(UnitCostProbeTest, CountsExpandedTokensAndMacros) {
+  UnitCostProbe Probe;
+  ASSERT_TRUE(clang::tooling::runToolOnCode(new ProbeAction(true, &Probe),
+                                            kCode, "input.cc"));
+  // "int a = 1 + 1 ;" twice.
+  auto Total = Probe.Total();
+  EXPECT_EQ(14, Total.ClaimedTokens);
+  EXPECT_EQ(0, Total.UnclaimedTokens);
+  EXPECT_EQ(2, Total.MacroExpansions);
+  ASSERT_EQ(1, Probe.Files.size());
+  EXPECT_TRUE(
+      llvm::StringRef(Probe.Files.begin()->first).endswith("input.cc"));
+}
+
+TEST(UnitCostProbeTest, CountsUnclaimedTokens) {
+  UnitCostProbe Probe;
+  ASSERT_TRUE(clang::tooling::runToolOnCode(new ProbeAction(false, &Probe),
+                                            kCode, "input.cc"));
+  auto Total = Probe.Total();
+  EXPECT_EQ(0, Total.ClaimedTokens);
+  EXPECT_EQ(14, Total.UnclaimedTokens);
+}
+
+TEST(UnitCostProbeTest, FormatsTsv) {
+  UnitCostProbe Probe;
+  Probe.Files["a.h"].ClaimedTokens = 3;
+  Probe.Files["a.h"].MacroExpansions = 1;
+  Probe.Files["b.cc"].UnclaimedTokens = 5;
+  EXPECT_EQ(
+      "unit\t3\t5\t1\tunit.kindex\n"
+      "file\t3\t0\t1\ta.h\n"
+      "file\t0\t5\t0\tb.cc\n",
+      Probe.ToTsv("unit.kindex"));
+}
+
+}  // namespace
+}  // namespace kythe
+
+int main(int argc, char **argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
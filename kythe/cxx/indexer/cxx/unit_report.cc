@@ -0,0 +1,173 @@
+/*
+ * Copyright 2017 Google Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// This file uses the Clang style conventions.
+
+#include "kythe/cxx/indexer/cxx/unit_report.h"
+
+#include <openssl/sha.h>
+#include <sys/resource.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cinttypes>
+#include <cstring>
+
+namespace kythe {
+namespace {
+/// \brief Appends `Text` to `Out` as a JSON string literal.
+void AppendJsonString(const std::string &Text, std::string *Out) {
+  Out->push_back('"');
+  for (char C : Text) {
+    if (C == '"' || C == '\\') {
+      Out->push_back('\\');
+      Out->push_back(C);
+    } else if (static_cast<unsigned char>(C) < 0x20) {
+      char Escaped[8];
+      snprintf(Escaped, sizeof(Escaped), "\\u%04x", C);
+      Out->append(Escaped);
+    } else {
+      Out->push_back(C);
+    }
+  }
+  Out->push_back('"');
+}
+
+/// \brief Appends `"Key":Value` for an unsigned `Value`, after a comma.
+void AppendField(const char *Key, uint64_t Value, std::string *Out) {
+  char Field[64];
+  snprintf(Field, sizeof(Field), ",\"%s\":%" PRIu64, Key, Value);
+  Out->append(Field);
+}
+
+/// \brief Appends `"Key":Seconds` with microsecond precision, after a comma.
+void AppendSeconds(const char *Key, double Seconds, std::string *Out) {
+  char Field[64];
+  snprintf(Field, sizeof(Field), ",\"%s\":%.6f", Key, Seconds);
+  Out->append(Field);
+}
+}  // anonymous namespace
+
+std::string UnitReport::ToJson() const {
+  std::string Json = "{\"unit\":{\"signature\":";
+  AppendJsonString(Unit.signature(), &Json);
+  Json.append(",\"corpus\":");
+  AppendJsonString(Unit.corpus(), &Json);
+  Json.append(",\"root\":");
+  AppendJsonString(Unit.root(), &Json);
+  Json.append(",\"path\":");
+  AppendJsonString(Unit.path(), &Json);
+  Json.append(",\"language\":");
+  AppendJsonString(Unit.language(), &Json);
+  Json.append("}");
+  AppendField("index", Index, &Json);
+  Json.append(",\"digest\":");
+  AppendJsonString(Digest, &Json);
+  Json.append(Succeeded ? ",\"succeeded\":true" : ",\"succeeded\":false");
+  AppendSeconds("parse_seconds", ParseSeconds, &Json);
+  AppendSeconds("traversal_seconds", TraversalSeconds, &Json);
+  AppendSeconds("emission_seconds", EmissionSeconds, &Json);
+  AppendSeconds("total_seconds", TotalSeconds, &Json);
+  AppendField("peak_rss_bytes", PeakRssBytes, &Json);
+  AppendField("traversed_decls", TraversedDecls, &Json);
+  Json.append(",\"entries\":");
+  Json.append(EntriesJson.empty() ? "{}" : EntriesJson);
+  char Counters[256];
+  snprintf(Counters, sizeof(Counters),
+           ",\"hash_cache\":{\"hits\":%" PRIu64 ",\"bytes_matched\":%" PRIu64
+           "},\"claims\":{\"requests\":%" PRIu64 ",\"rejected\":%" PRIu64
+           ",\"round_trips\":%" PRIu64 ",\"round_trips_saved\":%" PRIu64 "}",
+           HashCacheHits, HashCacheBytesMatched, ClaimRequests,
+           ClaimsRejected, ClaimRoundTrips, ClaimRoundTripsSaved);
+  Json.append(Counters);
+  AppendField("vfs_misses", VFSMisses, &Json);
+  Json.append("}");
+  return Json;
+}
+
+uint64_t PeakRssBytes() {
+  struct rusage Usage;
+  if (::getrusage(RUSAGE_SELF, &Usage) != 0) {
+    return 0;
+  }
+#ifdef __APPLE__
+  return Usage.ru_maxrss;
+#else
+  // Linux reports kilobytes.
+  return static_cast<uint64_t>(Usage.ru_maxrss) * 1024;
+#endif
+}
+
+uint64_t CurrentRssBytes() {
+  FILE *Statm = fopen("/proc/self/statm", "r");
+  if (Statm == nullptr) {
+    return 0;
+  }
+  unsigned long long Size = 0;
+  unsigned long long Resident = 0;
+  const bool Read = fscanf(Statm, "%llu %llu", &Size, &Resident) == 2;
+  fclose(Statm);
+  return Read ? Resident * ::sysconf(_SC_PAGESIZE) : 0;
+}
+
+std::string UnitDigest(const proto::CompilationUnit &Unit) {
+  std::string Serialized;
+  Unit.SerializeToString(&Serialized);
+  unsigned char Hash[SHA256_DIGEST_LENGTH];
+  ::SHA256(reinterpret_cast<const unsigned char *>(Serialized.data()),
+           Serialized.size(), Hash);
+  static const char kHexDigits[] = "0123456789abcdef";
+  std::string Digest;
+  for (unsigned char Byte : Hash) {
+    Digest.push_back(kHexDigits[Byte >> 4]);
+    Digest.push_back(kHexDigits[Byte & 0xf]);
+  }
+  return Digest;
+}
+
+UnitReportWriter::~UnitReportWriter() {
+  if (File != nullptr) {
+    ::fclose(File);
+  }
+}
+
+bool UnitReportWriter::Open(const std::string &Path, std::string *ErrorText) {
+  std::lock_guard<std::mutex> Lock(Mutex);
+  if (File != nullptr) {
+    ::fclose(File);
+  }
+  File = ::fopen(Path.c_str(), "a");
+  if (File == nullptr) {
+    *ErrorText = ::strerror(errno);
+    return false;
+  }
+  return true;
+}
+
+void UnitReportWriter::Write(const UnitReport &Report) {
+  std::string Line = Report.ToJson();
+  Line.push_back('\n');
+  std::lock_guard<std::mutex> Lock(Mutex);
+  if (File == nullptr) {
+    return;
+  }
+  if (::fwrite(Line.data(), 1, Line.size(), File) != Line.size() ||
+      ::fflush(File) != 0) {
+    fprintf(stderr, "Couldn't write a unit report: %s\n", ::strerror(errno));
+  }
+}
+
+}  // namespace kythe
@@ -0,0 +1,180 @@
+/*
+ * Copyright 2017 Google Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// This file uses the Clang style conventions.
+
+#ifndef KYTHE_CXX_INDEXER_CXX_UNIT_REPORT_H_
+#define KYTHE_CXX_INDEXER_CXX_UNIT_REPORT_H_
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <mutex>
+#include <string>
+
+#include "kythe/cxx/common/indexing/KytheOutputStream.h"
+#include "kythe/proto/analysis.pb.h"
+
+namespace kythe {
+
+/// \brief Measurements of indexing a single compilation unit, for schedulers
+/// and capacity planning.
+struct UnitReport {
+  /// The unit's VName.
+  proto::VName Unit;
+  /// The unit's position in the indexer's input list.
+  size_t Index = 0;
+  /// The hex SHA-256 digest of the unit's wire encoding.
+  std::string Digest;
+  /// Whether the unit was indexed without errors.
+  bool Succeeded = true;
+  /// Time spent preprocessing, parsing and analyzing the unit, in seconds.
+  double ParseSeconds = 0;
+  /// Time spent traversing the AST (including emission), in seconds.
+  double TraversalSeconds = 0;
+  /// Time spent in the output stream serializing, deduplicating and writing
+  /// entries, in seconds.
+  double EmissionSeconds = 0;
+  /// Wall time for the whole unit, in seconds.
+  double TotalSeconds = 0;
+  /// The process's peak resident set size after the unit, in bytes. This
+  /// only grows, and it covers every worker when workers run concurrently.
+  uint64_t PeakRssBytes = 0;
+  /// The number of declarations the indexer traversed.
+  uint64_t TraversedDecls = 0;
+  /// `EntryAccounting::ToJson` for the unit's entries, or empty.
+  std::string EntriesJson;
+  /// Buffers (and their bytes) that the hash cache had already seen.
+  uint64_t HashCacheHits = 0;
+  uint64_t HashCacheBytesMatched = 0;
+  /// Claims decided by the claim client during the unit, and how many of
+  /// them were rejected. With concurrent workers, these include the claims
+  /// other units made at the same time.
+  uint64_t ClaimRequests = 0;
+  uint64_t ClaimsRejected = 0;
+  /// Round trips the claim client made to a remote claim map during the
+  /// unit, and how many more it would have made without batching.
+  uint64_t ClaimRoundTrips = 0;
+  uint64_t ClaimRoundTripsSaved = 0;
+  /// Lookups of paths that weren't among the unit's files.
+  uint64_t VFSMisses = 0;
+
+  /// \return the report as a single line of JSON (with no newline).
+  std::string ToJson() const;
+};
+
+/// \return the process's peak resident set size in bytes, or 0 if it isn't
+/// known.
+uint64_t PeakRssBytes();
+
+/// \return the process's current resident set size in bytes, or 0 if it
+/// isn't known (it's read from /proc, so only Linux reports it).
+uint64_t CurrentRssBytes();
+
+/// \return the hex SHA-256 digest of `Unit`'s wire encoding.
+std::string UnitDigest(const proto::CompilationUnit &Unit);
+
+/// \brief Appends `UnitReport`s to a file, one JSON line each. Thread-safe.
+class UnitReportWriter {
+ public:
+  UnitReportWriter() = default;
+  UnitReportWriter(const UnitReportWriter &) = delete;
+  UnitReportWriter &operator=(const UnitReportWriter &) = delete;
+  ~UnitReportWriter();
+
+  /// \brief Opens `Path` for appending, creating it if necessary.
+  /// \return false on failure; `ErrorText` will say why.
+  bool Open(const std::string &Path, std::string *ErrorText);
+
+  /// \brief Writes `Report` and flushes it, so that a crash loses at most
+  /// the unit being indexed.
+  void Write(const UnitReport &Report);
+
+ private:
+  /// Guards `File`.
+  std::mutex Mutex;
+  /// The file to write to, or null.
+  FILE *File = nullptr;
+};
+
+/// \brief Forwards everything to another stream, keeping track of how long
+/// that stream takes.
+class TimingOutputStream : public KytheOutputStream {
+ public:
+  /// \param Inner The stream to forward to. Must outlive this one.
+  explicit TimingOutputStream(KytheOutputStream *Inner) : Inner(Inner) {}
+
+  void Emit(const FactRef &Fact) override {
+    Timer T(this);
+    Inner->Emit(Fact);
+  }
+  void Emit(const EdgeRef &Edge) override {
+    Timer T(this);
+    Inner->Emit(Edge);
+  }
+  void Emit(const OrdinalEdgeRef &Edge) override {
+    Timer T(this);
+    Inner->Emit(Edge);
+  }
+  void EmitContent(const FactRef &Fact) override {
+    Timer T(this);
+    Inner->EmitContent(Fact);
+  }
+  void PushBuffer() override { Inner->PushBuffer(); }
+  void PushFileBuffer(llvm::StringRef File) override {
+    Inner->PushFileBuffer(File);
+  }
+  void PopBuffer() override {
+    // Closing a buffer is when it's hashed and written.
+    Timer T(this);
+    Inner->PopBuffer();
+  }
+  void UseHashCache(HashCache *Cache) override { Inner->UseHashCache(Cache); }
+  size_t buffered_bytes() const override { return Inner->buffered_bytes(); }
+  void set_accounting(EntryAccounting *Accounting) override {
+    KytheOutputStream::set_accounting(Accounting);
+    Inner->set_accounting(Accounting);
+  }
+
+  /// \return the time spent in `Inner`, in nanoseconds.
+  uint64_t nanos() const { return Nanos; }
+
+ private:
+  /// \brief Adds the time until it's destroyed to `Nanos`.
+  class Timer {
+   public:
+    explicit Timer(TimingOutputStream *Stream)
+        : Stream(Stream), Start(std::chrono::steady_clock::now()) {}
+    ~Timer() {
+      Stream->Nanos += std::chrono::duration_cast<std::chrono::nanoseconds>(
+                           std::chrono::steady_clock::now() - Start)
+                           .count();
+    }
+
+   private:
+    TimingOutputStream *Stream;
+    std::chrono::steady_clock::time_point Start;
+  };
+
+  /// The stream to forward to.
+  KytheOutputStream *Inner;
+  /// The time spent in `Inner`.
+  uint64_t Nanos = 0;
+};
+
+}  // namespace kythe
+
+#endif  // KYTHE_CXX_INDEXER_CXX_UNIT_REPORT_H_
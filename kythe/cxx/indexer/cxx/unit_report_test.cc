@@ -0,0 +1,151 @@
+/*
+ * Copyright 2017 Google Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// This file uses the Clang style conventions.
+
+#include "kythe/cxx/indexer/cxx/unit_report.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <sstream>
+
+#include "gtest/gtest.h"
+
+namespace kythe {
+namespace {
+
+/// \brief Counts the calls it receives.
+class CountingOutputStream : public KytheOutputStream {
+ public:
+  void Emit(const FactRef &Fact) override { ++Entries; }
+  void Emit(const EdgeRef &Edge) override { ++Entries; }
+  void Emit(const OrdinalEdgeRef &Edge) override { ++Entries; }
+  void PushBuffer() override { ++Pushes; }
+  void PopBuffer() override { ++Pops; }
+  int Entries = 0;
+  int Pushes = 0;
+  int Pops = 0;
+};
+
+TEST(UnitReportTest, ToJsonEscapesStrings) {
+  UnitReport Report;
+  Report.Unit.set_signature("a\"b\\c\n");
+  Report.Unit.set_language("c++");
+  const std::string Json = Report.ToJson();
+  EXPECT_NE(std::string::npos,
+            Json.find("{\"unit\":{\"signature\":\"a\\\"b\\\\c\\u000a\""))
+      << Json;
+  EXPECT_NE(std::string::npos, Json.find("\"language\":\"c++\"")) << Json;
+}
+
+TEST(UnitReportTest, ToJsonIncludesCounters) {
+  UnitReport Report;
+  Report.Index = 3;
+  Report.Digest = "abc";
+  Report.Succeeded = false;
+  Report.ParseSeconds = 1.5;
+  Report.TraversedDecls = 42;
+  Report.HashCacheHits = 7;
+  Report.ClaimsRejected = 2;
+  Report.ClaimRoundTripsSaved = 4;
+  Report.VFSMisses = 5;
+  const std::string Json = Report.ToJson();
+  EXPECT_NE(std::string::npos, Json.find(",\"index\":3,")) << Json;
+  EXPECT_NE(std::string::npos, Json.find("\"digest\":\"abc\"")) << Json;
+  EXPECT_NE(std::string::npos, Json.find("\"succeeded\":false")) << Json;
+  EXPECT_NE(std::string::npos, Json.find("\"parse_seconds\":1.500000"))
+      << Json;
+  EXPECT_NE(std::string::npos, Json.find("\"traversed_decls\":42")) << Json;
+  EXPECT_NE(std::string::npos, Json.find("\"entries\":{}")) << Json;
+  EXPECT_NE(std::string::npos, Json.find("\"hash_cache\":{\"hits\":7,"))
+      << Json;
+  EXPECT_NE(std::string::npos, Json.find("\"rejected\":2,")) << Json;
+  EXPECT_NE(std::string::npos, Json.find("\"round_trips_saved\":4}"))
+      << Json;
+  EXPECT_NE(std::string::npos, Json.find("\"vfs_misses\":5}")) << Json;
+  EXPECT_EQ(std::string::npos, Json.find('\n'));
+}
+
+TEST(UnitReportTest, UnitDigestIsStable) {
+  proto::CompilationUnit Unit;
+  Unit.mutable_v_name()->set_signature("unit");
+  const std::string Digest = UnitDigest(Unit);
+  EXPECT_EQ(64, Digest.size());
+  EXPECT_EQ(Digest, UnitDigest(Unit));
+  Unit.mutable_v_name()->set_signature("other");
+  EXPECT_NE(Digest, UnitDigest(Unit));
+}
+
+TEST(UnitReportTest, TimingStreamForwards) {
+  CountingOutputStream Inner;
+  TimingOutputStream Stream(&Inner);
+  VNameRef Source;
+  VNameRef Target;
+  FactRef Fact{&Source, "/kythe/node/kind", "record"};
+  EdgeRef Edge{&Source, "/kythe/edge/childof", &Target};
+  Stream.PushBuffer();
+  Stream.Emit(Fact);
+  Stream.EmitContent(Fact);
+  Stream.Emit(Edge);
+  Stream.PopBuffer();
+  EXPECT_EQ(3, Inner.Entries);
+  EXPECT_EQ(1, Inner.Pushes);
+  EXPECT_EQ(1, Inner.Pops);
+  EntryAccounting Accounting({"facts"});
+  Stream.set_accounting(&Accounting);
+  EXPECT_EQ(&Accounting, Inner.accounting());
+}
+
+TEST(UnitReportTest, WriterAppendsLines) {
+  const char *TmpDir = getenv("TEST_TMPDIR");
+  const std::string Path =
+      std::string(TmpDir != nullptr ? TmpDir : "/tmp") + "/unit_report.json";
+  std::remove(Path.c_str());
+  for (size_t Index = 0; Index < 2; ++Index) {
+    UnitReportWriter Writer;
+    std::string ErrorText;
+    ASSERT_TRUE(Writer.Open(Path, &ErrorText)) << ErrorText;
+    UnitReport Report;
+    Report.Index = Index;
+    Writer.Write(Report);
+  }
+  std::ifstream In(Path);
+  std::string Line;
+  size_t Lines = 0;
+  while (std::getline(In, Line)) {
+    EXPECT_EQ('{', Line.front());
+    EXPECT_EQ('}', Line.back());
+    ++Lines;
+  }
+  EXPECT_EQ(2, Lines);
+  std::remove(Path.c_str());
+}
+
+TEST(UnitReportTest, WriterReportsOpenErrors) {
+  UnitReportWriter Writer;
+  std::string ErrorText;
+  EXPECT_FALSE(Writer.Open("/nonexistent/dir/report.json", &ErrorText));
+  EXPECT_FALSE(ErrorText.empty());
+}
+
+}  // namespace
+}  // namespace kythe
+
+int main(int argc, char **argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,81 @@
+/*
+ * Copyright 2017 Google Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// This file uses the Clang style conventions.
+
+#include "kythe/cxx/indexer/cxx/unit_teardown.h"
+
+#include <utility>
+
+namespace kythe {
+
+UnitTeardown::UnitTeardown(size_t MaxPending)
+    : MaxPending(MaxPending == 0 ? 1 : MaxPending),
+      Thread([this] { Run(); }) {}
+
+UnitTeardown::~UnitTeardown() {
+  {
+    std::lock_guard<std::mutex> Lock(Mutex);
+    Stopping = true;
+  }
+  Changed.notify_all();
+  Thread.join();
+}
+
+void UnitTeardown::Bury(std::unique_ptr<Remains> R) {
+  if (R == nullptr) {
+    return;
+  }
+  {
+    std::unique_lock<std::mutex> Lock(Mutex);
+    Changed.wait(Lock, [this] {
+      return Queue.size() + (Busy ? 1 : 0) < MaxPending;
+    });
+    Queue.push_back(std::move(R));
+  }
+  Changed.notify_all();
+}
+
+void UnitTeardown::Drain() {
+  std::unique_lock<std::mutex> Lock(Mutex);
+  Changed.wait(Lock, [this] { return Queue.empty() && !Busy; });
+}
+
+size_t UnitTeardown::destroyed_count() const {
+  std::lock_guard<std::mutex> Lock(Mutex);
+  return Destroyed;
+}
+
+void UnitTeardown::Run() {
+  std::unique_lock<std::mutex> Lock(Mutex);
+  for (;;) {
+    Changed.wait(Lock, [this] { return Stopping || !Queue.empty(); });
+    if (Queue.empty()) {
+      return;
+    }
+    std::unique_ptr<Remains> R = std::move(Queue.front());
+    Queue.pop_front();
+    Busy = true;
+    Lock.unlock();
+    R.reset();
+    Lock.lock();
+    Busy = false;
+    ++Destroyed;
+    Changed.notify_all();
+  }
+}
+
+}  // namespace kythe
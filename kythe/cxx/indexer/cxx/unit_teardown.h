@@ -0,0 +1,90 @@
+/*
+ * Copyright 2017 Google Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// This file uses the Clang style conventions.
+
+#ifndef KYTHE_CXX_INDEXER_CXX_UNIT_TEARDOWN_H_
+#define KYTHE_CXX_INDEXER_CXX_UNIT_TEARDOWN_H_
+
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+namespace kythe {
+
+/// \brief Destroys what indexing a unit leaves behind on a background thread.
+///
+/// Freeing a large unit's AST means freeing tens of millions of small
+/// allocations, which can take seconds. Handing the unit's remains to a
+/// `UnitTeardown` lets the caller start on its next unit right away.
+///
+/// Safe to share among threads.
+class UnitTeardown {
+ public:
+  /// \brief Something to destroy; its destructor does the work.
+  class Remains {
+   public:
+    virtual ~Remains() {}
+  };
+
+  /// \param MaxPending The most remains to hold at once, counting the ones
+  /// being destroyed. `Bury` blocks until there's room, so no more than this
+  /// many units' ASTs are kept alive on the caller's behalf.
+  explicit UnitTeardown(size_t MaxPending = 1);
+
+  /// \brief Destroys any remains still queued, then stops the thread.
+  ~UnitTeardown();
+
+  UnitTeardown(const UnitTeardown &) = delete;
+  UnitTeardown &operator=(const UnitTeardown &) = delete;
+
+  /// \brief Queues `R` to be destroyed on the background thread.
+  void Bury(std::unique_ptr<Remains> R);
+
+  /// \brief Blocks until every queued remains has been destroyed.
+  void Drain();
+
+  /// \return the number of remains destroyed so far.
+  size_t destroyed_count() const;
+
+ private:
+  /// \brief Destroys remains until the queue is stopped.
+  void Run();
+
+  /// The most remains to hold at once.
+  const size_t MaxPending;
+  /// Guards all fields below.
+  mutable std::mutex Mutex;
+  /// Signalled whenever `Queue`, `Busy` or `Stopping` changes.
+  std::condition_variable Changed;
+  /// Remains that haven't been picked up by the thread yet.
+  std::deque<std::unique_ptr<Remains>> Queue;
+  /// Whether the thread is destroying remains it has taken off `Queue`.
+  bool Busy = false;
+  /// Set once the thread should exit after emptying `Queue`.
+  bool Stopping = false;
+  /// The number of remains destroyed so far.
+  size_t Destroyed = 0;
+  /// Destroys remains; started last, so every field above is initialized.
+  std::thread Thread;
+};
+
+}  // namespace kythe
+
+#endif  // KYTHE_CXX_INDEXER_CXX_UNIT_TEARDOWN_H_
@@ -0,0 +1,97 @@
+/*
+ * Copyright 2017 Google Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// This file uses the Clang style conventions.
+
+#include "kythe/cxx/indexer/cxx/unit_teardown.h"
+
+#include <atomic>
+#include <thread>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+namespace kythe {
+namespace {
+
+/// \brief Counts its destruction and records the thread it happened on.
+class CountedRemains : public UnitTeardown::Remains {
+ public:
+  CountedRemains(std::atomic<int> *Count, std::thread::id *Thread)
+      : Count(Count), Thread(Thread) {}
+  ~CountedRemains() override {
+    if (Thread != nullptr) {
+      *Thread = std::this_thread::get_id();
+    }
+    ++*Count;
+  }
+
+ private:
+  std::atomic<int> *Count;
+  std::thread::id *Thread;
+};
+
+TEST(UnitTeardownTest, DestroysOnAnotherThread) {
+  std::atomic<int> Count(0);
+  std::thread::id Thread;
+  UnitTeardown Teardown;
+  Teardown.Bury(std::unique_ptr<UnitTeardown::Remains>(
+      new CountedRemains(&Count, &Thread)));
+  Teardown.Drain();
+  EXPECT_EQ(1, Count);
+  EXPECT_EQ(1u, Teardown.destroyed_count());
+  EXPECT_NE(std::this_thread::get_id(), Thread);
+}
+
+TEST(UnitTeardownTest, DestroysEverythingBeforeExiting) {
+  std::atomic<int> Count(0);
+  {
+    UnitTeardown Teardown(3);
+    for (int I = 0; I < 10; ++I) {
+      Teardown.Bury(std::unique_ptr<UnitTeardown::Remains>(
+          new CountedRemains(&Count, nullptr)));
+    }
+    Teardown.Bury(nullptr);
+  }
+  EXPECT_EQ(10, Count);
+}
+
+TEST(UnitTeardownTest, SharedAmongThreads) {
+  std::atomic<int> Count(0);
+  UnitTeardown Teardown(2);
+  std::vector<std::thread> Workers;
+  for (int W = 0; W < 4; ++W) {
+    Workers.emplace_back([&] {
+      for (int I = 0; I < 25; ++I) {
+        Teardown.Bury(std::unique_ptr<UnitTeardown::Remains>(
+            new CountedRemains(&Count, nullptr)));
+      }
+    });
+  }
+  for (auto &Worker : Workers) {
+    Worker.join();
+  }
+  Teardown.Drain();
+  EXPECT_EQ(100, Count);
+}
+
+}  // namespace
+}  // namespace kythe
+
+int main(int argc, char **argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,470 @@
+/*
+ * Copyright 2017 Google Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+// entry_stats: summarizes streams of delimited Entry messages
+//
+// bazel run //kythe/cxx/tools:entry_stats -- -threads 32
+//     out-00000-of-00064 out-00001-of-00064 ...
+// reads each file (or stdin, if none are named) and prints tables of entry
+// counts and bytes by fact name, edge kind, node kind and corpus/path prefix,
+// followed by the -top_nodes nodes with the most bytes of entries.
+//
+// Files are read concurrently, and records are handed out in batches to
+// -threads workers that parse and tally them. A snappy-framed stream is
+// decompressed on the thread that reads it: entries straddle its chunks, so
+// it can't be split at chunk boundaries without decoding what comes before.
+// Shard the indexer's output (-experimental_output_shards) to spread that
+// work as well.
+//
+// A node's size is the total size of a run of consecutive entries with its
+// source VName. In sorted output (and in the indexer's, which writes each
+// node's facts together) that is every entry about the node.
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "gflags/gflags.h"
+#include "glog/logging.h"
+#include "google/protobuf/io/zero_copy_stream_impl.h"
+#include "kythe/cxx/common/delimited_proto_reader.h"
+#include "kythe/cxx/common/kythe_uri.h"
+#include "kythe/cxx/common/snappy_stream.h"
+#include "kythe/proto/storage.pb.h"
+
+DEFINE_string(input_compression, "none",
+              "Compression used for the input: \"none\" or \"snappy\" (as "
+              "written by the indexer's --output_compression=snappy).");
+DEFINE_int32(threads, 8, "Parse and tally entries on this many threads.");
+DEFINE_int32(batch_size, 4096, "Hand records to workers in batches this big.");
+DEFINE_int32(top_nodes, 20, "List this many of the largest nodes.");
+DEFINE_int32(path_depth, 1,
+             "Group paths by this many leading components in the "
+             "corpus/path prefix table.");
+
+namespace {
+/// \brief How many entries and bytes of entries were seen.
+struct Tally {
+  size_t count = 0;
+  size_t bytes = 0;
+  void Add(size_t size) {
+    ++count;
+    bytes += size;
+  }
+  void Merge(const Tally &o) {
+    count += o.count;
+    bytes += o.bytes;
+  }
+};
+
+using TallyMap = std::unordered_map<std::string, Tally>;
+
+/// \brief A run of consecutive entries with the same source.
+struct NodeRun {
+  /// The source VName, serialized.
+  std::string source;
+  Tally tally;
+};
+
+/// \brief Keeps the `limit` largest runs offered to it.
+class TopNodes {
+ public:
+  explicit TopNodes(size_t limit) : limit_(limit) {}
+
+  void Offer(NodeRun run) {
+    if (limit_ == 0) {
+      return;
+    }
+    if (heap_.size() == limit_) {
+      if (run.tally.bytes <= heap_.front().tally.bytes) {
+        return;
+      }
+      std::pop_heap(heap_.begin(), heap_.end(), Larger);
+      heap_.pop_back();
+    }
+    heap_.push_back(std::move(run));
+    std::push_heap(heap_.begin(), heap_.end(), Larger);
+  }
+
+  void Merge(TopNodes *o) {
+    for (auto &run : o->heap_) {
+      Offer(std::move(run));
+    }
+    o->heap_.clear();
+  }
+
+  /// \return the runs kept, largest first.
+  std::vector<NodeRun> Take() {
+    std::sort(heap_.begin(), heap_.end(), Larger);
+    return std::move(heap_);
+  }
+
+ private:
+  /// Orders the heap so that its front is the smallest run.
+  static bool Larger(const NodeRun &a, const NodeRun &b) {
+    return a.tally.bytes > b.tally.bytes;
+  }
+  size_t limit_;
+  std::vector<NodeRun> heap_;
+};
+
+/// \brief Everything tallied by one worker (and, once merged, by all).
+struct Stats {
+  Tally total;
+  size_t malformed = 0;
+  TallyMap fact_names;
+  TallyMap edge_kinds;
+  TallyMap node_kinds;
+  TallyMap prefixes;
+  TopNodes top_nodes{static_cast<size_t>(std::max(FLAGS_top_nodes, 0))};
+
+  void Merge(Stats *o) {
+    total.Merge(o->total);
+    malformed += o->malformed;
+    for (auto maps : {std::make_pair(&fact_names, &o->fact_names),
+                       std::make_pair(&edge_kinds, &o->edge_kinds),
+                       std::make_pair(&node_kinds, &o->node_kinds),
+                       std::make_pair(&prefixes, &o->prefixes)}) {
+      for (const auto &item : *maps.second) {
+        (*maps.first)[item.first].Merge(item.second);
+      }
+    }
+    top_nodes.Merge(&o->top_nodes);
+  }
+};
+
+/// \brief Records read from one input, in order.
+struct Batch {
+  /// The index of the input the records came from.
+  size_t input;
+  /// The position of this batch among the input's batches.
+  size_t sequence;
+  std::vector<std::string> records;
+};
+
+/// \brief The runs at either end of a batch, which may continue into the
+/// neighbouring batches.
+struct BatchEnds {
+  size_t input;
+  size_t sequence;
+  NodeRun first;
+  /// Empty if the whole batch was one run.
+  NodeRun last;
+  bool operator<(const BatchEnds &o) const {
+    return input < o.input || (input == o.input && sequence < o.sequence);
+  }
+};
+
+/// \brief A bounded queue of batches shared by readers and workers.
+class BatchQueue {
+ public:
+  explicit BatchQueue(size_t capacity) : capacity_(capacity) {}
+
+  void Push(Batch batch) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    not_full_.wait(lock, [this] { return queue_.size() < capacity_; });
+    queue_.push_back(std::move(batch));
+    not_empty_.notify_one();
+  }
+
+  /// \return false once the queue is closed and drained.
+  bool Pop(Batch *batch) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    not_empty_.wait(lock, [this] { return !queue_.empty() || closed_; });
+    if (queue_.empty()) {
+      return false;
+    }
+    *batch = std::move(queue_.front());
+    queue_.pop_front();
+    not_full_.notify_one();
+    return true;
+  }
+
+  void Close() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    closed_ = true;
+    not_empty_.notify_all();
+  }
+
+ private:
+  size_t capacity_;
+  std::mutex mutex_;
+  std::condition_variable not_full_;
+  std::condition_variable not_empty_;
+  std::deque<Batch> queue_;
+  bool closed_ = false;
+};
+
+/// \return the corpus/path prefix under which to file `vname`.
+std::string PathPrefix(const kythe::proto::VName &vname) {
+  std::string prefix = vname.corpus() + ":";
+  size_t end = 0;
+  for (int depth = 0; depth < FLAGS_path_depth && end < vname.path().size();
+       ++depth) {
+    end = vname.path().find('/', end + 1);
+    if (end == std::string::npos) {
+      end = vname.path().size();
+    }
+  }
+  prefix.append(vname.path(), 0, end);
+  return prefix;
+}
+
+/// \brief Tallies the records of `batch` into `stats`.
+/// \return the runs at the ends of the batch.
+BatchEnds TallyBatch(const Batch &batch, Stats *stats) {
+  BatchEnds ends;
+  ends.input = batch.input;
+  ends.sequence = batch.sequence;
+  kythe::proto::Entry entry;
+  NodeRun run;
+  bool first_run = true;
+  auto finish_run = [&] {
+    if (run.tally.count == 0) {
+      return;
+    }
+    if (first_run) {
+      ends.first = std::move(run);
+      first_run = false;
+    } else {
+      stats->top_nodes.Offer(std::move(run));
+    }
+    run = NodeRun();
+  };
+  std::string source;
+  for (const auto &record : batch.records) {
+    if (!entry.ParseFromString(record)) {
+      ++stats->malformed;
+      continue;
+    }
+    const size_t size = record.size();
+    stats->total.Add(size);
+    if (entry.edge_kind().empty()) {
+      stats->fact_names[entry.fact_name()].Add(size);
+      if (entry.fact_name() == "/kythe/node/kind") {
+        stats->node_kinds[entry.fact_value()].Add(size);
+      }
+    } else {
+      stats->edge_kinds[entry.edge_kind()].Add(size);
+    }
+    stats->prefixes[PathPrefix(entry.source())].Add(size);
+    entry.source().SerializeToString(&source);
+    if (source != run.source) {
+      finish_run();
+      run.source = source;
+    }
+    run.tally.Add(size);
+  }
+  if (first_run) {
+    ends.first = std::move(run);
+  } else {
+    ends.last = std::move(run);
+  }
+  return ends;
+}
+
+/// \brief Joins the runs that span batches and offers them to `top_nodes`.
+void StitchRuns(std::vector<BatchEnds> *all_ends, TopNodes *top_nodes) {
+  std::sort(all_ends->begin(), all_ends->end());
+  NodeRun carry;
+  size_t carry_input = 0;
+  auto extend = [&](size_t input, NodeRun *run) {
+    if (run->tally.count == 0) {
+      return;
+    }
+    if (input == carry_input && run->source == carry.source) {
+      carry.tally.Merge(run->tally);
+      return;
+    }
+    if (carry.tally.count != 0) {
+      top_nodes->Offer(std::move(carry));
+    }
+    carry = std::move(*run);
+    carry_input = input;
+  };
+  for (auto &ends : *all_ends) {
+    extend(ends.input, &ends.first);
+    if (ends.last.tally.count != 0) {
+      // The batch ended a run that isn't `first`, so `carry` can't continue.
+      if (carry.tally.count != 0) {
+        top_nodes->Offer(std::move(carry));
+      }
+      carry = std::move(ends.last);
+      carry_input = ends.input;
+    }
+  }
+  if (carry.tally.count != 0) {
+    top_nodes->Offer(std::move(carry));
+  }
+}
+
+/// \brief Reads `path` ("-" for stdin) into `queue` in batches.
+/// \return false (after saying why) if the input couldn't be read.
+bool ReadInput(size_t input, const std::string &path, BatchQueue *queue) {
+  std::unique_ptr<google::protobuf::io::FileInputStream> file_input;
+  std::unique_ptr<kythe::SnappyFramedInputStream> snappy_input;
+  std::unique_ptr<kythe::DelimitedProtoReader> reader;
+  int fd = -1;
+  if (FLAGS_input_compression == "none" && path != "-") {
+    // Uncompressed (or gzipped) files are mapped.
+    std::string error_text;
+    reader = kythe::DelimitedProtoReader::Open(path, true, &error_text);
+    if (!reader) {
+      fprintf(stderr, "%s\n", error_text.c_str());
+      return false;
+    }
+  } else {
+    fd = path == "-" ? STDIN_FILENO : ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+      ::perror(("Can't open " + path).c_str());
+      return false;
+    }
+    file_input.reset(new google::protobuf::io::FileInputStream(fd));
+    google::protobuf::io::ZeroCopyInputStream *raw_input = file_input.get();
+    if (FLAGS_input_compression == "snappy") {
+      snappy_input.reset(new kythe::SnappyFramedInputStream(raw_input));
+      raw_input = snappy_input.get();
+    }
+    reader.reset(new kythe::DelimitedProtoReader(raw_input));
+  }
+  Batch batch;
+  batch.input = input;
+  batch.sequence = 0;
+  while (reader->NextBatch(FLAGS_batch_size, &batch.records)) {
+    Batch next;
+    next.input = input;
+    next.sequence = batch.sequence + 1;
+    queue->Push(std::move(batch));
+    batch = std::move(next);
+  }
+  bool ok = true;
+  // A decompression error shows up as a truncated stream; report it instead.
+  if (snappy_input && !snappy_input->error().empty()) {
+    fprintf(stderr, "Error decompressing %s: %s\n", path.c_str(),
+            snappy_input->error().c_str());
+    ok = false;
+  } else if (!reader->error().empty()) {
+    fprintf(stderr, "Error reading %s after %zu entries: %s\n", path.c_str(),
+            reader->records_read(), reader->error().c_str());
+    ok = false;
+  }
+  if (fd > STDIN_FILENO) {
+    ::close(fd);
+  }
+  return ok;
+}
+
+/// \brief Prints `tallies` largest first under `title`.
+void PrintTable(const char *title, const TallyMap &tallies) {
+  std::vector<std::pair<std::string, Tally>> rows(tallies.begin(),
+                                                  tallies.end());
+  std::sort(rows.begin(), rows.end(),
+            [](const std::pair<std::string, Tally> &a,
+               const std::pair<std::string, Tally> &b) {
+              return a.second.bytes > b.second.bytes ||
+                     (a.second.bytes == b.second.bytes && a.first < b.first);
+            });
+  ::printf("\n%s\n", title);
+  for (const auto &row : rows) {
+    ::printf("%14zu %16zu  %s\n", row.second.count, row.second.bytes,
+             row.first.c_str());
+  }
+}
+}  // anonymous namespace
+
+int main(int argc, char *argv[]) {
+  GOOGLE_PROTOBUF_VERIFY_VERSION;
+  gflags::SetVersionString("0.1");
+  gflags::SetUsageMessage(
+      "entry_stats [flags] [entry-stream ...]: summarize Kythe entries");
+  gflags::ParseCommandLineFlags(&argc, &argv, true);
+  google::InitGoogleLogging(argv[0]);
+  CHECK(FLAGS_input_compression == "none" ||
+        FLAGS_input_compression == "snappy")
+      << "Unknown --input_compression.";
+  CHECK_GT(FLAGS_batch_size, 0);
+  std::vector<std::string> paths(argv + 1, argv + argc);
+  if (paths.empty()) {
+    paths.push_back("-");
+  }
+  const size_t threads = std::max(FLAGS_threads, 1);
+  BatchQueue queue(threads * 4);
+  std::vector<Stats> worker_stats(threads);
+  std::vector<std::vector<BatchEnds>> worker_ends(threads);
+  std::vector<std::thread> workers;
+  for (size_t i = 0; i < threads; ++i) {
+    workers.emplace_back([&queue, &worker_stats, &worker_ends, i] {
+      Batch batch;
+      while (queue.Pop(&batch)) {
+        worker_ends[i].push_back(TallyBatch(batch, &worker_stats[i]));
+      }
+    });
+  }
+  std::vector<char> read_ok(paths.size(), 0);
+  std::vector<std::thread> readers;
+  for (size_t input = 0; input < paths.size(); ++input) {
+    readers.emplace_back([&queue, &paths, &read_ok, input] {
+      read_ok[input] = ReadInput(input, paths[input], &queue);
+    });
+  }
+  for (auto &reader : readers) {
+    reader.join();
+  }
+  queue.Close();
+  for (auto &worker : workers) {
+    worker.join();
+  }
+  Stats stats;
+  std::vector<BatchEnds> all_ends;
+  for (size_t i = 0; i < threads; ++i) {
+    stats.Merge(&worker_stats[i]);
+    std::move(worker_ends[i].begin(), worker_ends[i].end(),
+              std::back_inserter(all_ends));
+  }
+  StitchRuns(&all_ends, &stats.top_nodes);
+  ::printf("%zu entries, %zu bytes\n", stats.total.count, stats.total.bytes);
+  PrintTable("fact names:", stats.fact_names);
+  PrintTable("edge kinds:", stats.edge_kinds);
+  PrintTable("node kinds:", stats.node_kinds);
+  PrintTable("corpus:path prefixes:", stats.prefixes);
+  ::printf("\nlargest nodes:\n");
+  for (const auto &run : stats.top_nodes.Take()) {
+    kythe::proto::VName vname;
+    vname.ParseFromString(run.source);
+    ::printf("%14zu %16zu  %s\n", run.tally.count, run.tally.bytes,
+             kythe::URI(vname).ToString().c_str());
+  }
+  if (stats.malformed != 0) {
+    fprintf(stderr, "%zu malformed entries\n", stats.malformed);
+  }
+  bool ok = stats.malformed == 0;
+  for (char input_ok : read_ok) {
+    ok = ok && input_ok;
+  }
+  return ok ? 0 : 1;
+}
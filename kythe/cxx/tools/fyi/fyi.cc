@@ -16,6 +16,9 @@
 
 #include "fyi.h"
 
+#include <algorithm>
+#include <unordered_map>
+
 #include "clang/Frontend/ASTUnit.h"
 #include "clang/Frontend/CompilerInstance.h"
 #include "clang/Frontend/TextDiagnosticPrinter.h"
@@ -33,6 +36,17 @@
 
 namespace kythe {
 namespace fyi {
+namespace {
+/// The most tickets we'll send in a single `EdgesRequest`.
+constexpr size_t kMaxTicketsPerRequest = 256;
+
+/// Inserted (once) ahead of the includes that we try. Clang's preamble ends
+/// at the first directive it doesn't recognize, which includes the null
+/// directive, so adding includes after the fence leaves the file's original
+/// preamble alone and lets `ASTUnit::Reparse` reuse its precompiled form.
+constexpr char kPreambleFence[] = "\n#";
+constexpr size_t kPreambleFenceLength = sizeof(kPreambleFence) - 1;
+}  // anonymous namespace
 
 /// \brief Tracks changes and edits to a single file identified by its full
 /// path.
@@ -71,6 +85,16 @@ class FileTracker {
     return llvm::StringRef(start, store->size() - 1);
   }
 
+  /// \brief Returns the current rewritten file as it should be presented to
+  /// the user (without the internal preamble fence).
+  std::string output_content() {
+    std::string content = backing_store();
+    if (buffer_has_fence_[active_buffer_]) {
+      content.erase(last_include_offset_, kPreambleFenceLength);
+    }
+    return content;
+  }
+
   /// \param Start a new pass involving this `FileTracker`
   void BeginPass() {
     file_begin_ = clang::SourceLocation();
@@ -111,9 +135,17 @@ class FileTracker {
       auto to_try = *untried_.begin();
       untried_.erase(untried_.begin());
       tried_.insert(to_try);
-      rewriter->InsertTextAfter(
-          file_begin_.getLocWithOffset(last_include_offset_),
-          "\n#include \"" + to_try + "\"\n");
+      std::string include = "\n#include \"" + to_try + "\"\n";
+      if (buffer_has_fence_[active_buffer_]) {
+        rewriter->InsertTextAfter(file_begin_.getLocWithOffset(
+                                      last_include_offset_ +
+                                      kPreambleFenceLength),
+                                  include);
+      } else {
+        rewriter->InsertTextAfter(
+            file_begin_.getLocWithOffset(last_include_offset_),
+            kPreambleFence + include);
+      }
       return true;
     }
     // We have nothing to do, so abort.
@@ -128,6 +160,8 @@ class FileTracker {
   void CommitRewrite(clang::FileID file_id, clang::Rewriter *rewriter) {
     assert(active_buffer_ < 2);
     can_undo_ = true;
+    // Rewrite always leaves a fence behind.
+    buffer_has_fence_[1 - active_buffer_] = true;
     active_buffer_ = 1 - active_buffer_;
     auto *store = &memory_buffer_backing_store_[active_buffer_];
     const clang::RewriteBuffer *buffer = rewriter->getRewriteBufferFor(file_id);
@@ -187,6 +221,7 @@ class FileTracker {
       memory_buffer_backing_store_[0].push_back(0);
       memory_buffer_ = llvm::MemoryBuffer::getMemBuffer(backing_store());
       can_undo_ = false;
+      buffer_has_fence_[0] = false;
       saw_initial_state_ = true;
     }
   }
@@ -233,6 +268,10 @@ class FileTracker {
   /// Can we undo the previous move?
   bool can_undo_ = false;
 
+  /// Whether each backing store has had `kPreambleFence` inserted at
+  /// `last_include_offset_`.
+  bool buffer_has_fence_[2] = {false, false};
+
   /// Have we ever seen the initial state of the file?
   bool saw_initial_state_ = false;
 
@@ -247,6 +286,25 @@ class FileTracker {
 
   /// Includes we have left to try.
   std::set<std::string> untried_;
+
+  /// Maps source tickets to the targets of the edges we followed from them.
+  /// Tickets that reached nothing map to an empty vector.
+  typedef std::unordered_map<std::string, std::vector<std::string>>
+      TicketCache;
+
+  /// Name tickets of typos found during this pass that we have not yet
+  /// looked up.
+  std::set<std::string> unresolved_names_;
+
+  /// Name nodes to the semantic nodes they name. Kept across passes so
+  /// that we only ever ask about each ticket once.
+  TicketCache named_cache_;
+
+  /// Semantic nodes to the anchors that define them.
+  TicketCache defines_cache_;
+
+  /// Anchors to the files that they are children of.
+  TicketCache childof_cache_;
 };
 
 /// \brief During non-reparse passes, PreprocessorHooks listens for events
@@ -349,35 +407,117 @@ class Action : public clang::ASTFrontendAction,
                     compiler->getFrontendOpts().SkipFunctionBodies);
   }
 
-  /// \brief Copies the tickets from `reply.edge_set` to `request.ticket`.
-  /// \return false if no tickets were copied
-  template <typename Reply, typename Request>
-  bool CopyTicketsFromEdgeSets(const Reply &reply, Request *request) {
-    for (const auto &edge_set : reply.edge_sets()) {
-      for (const auto &group : edge_set.second.groups()) {
-        for (const auto &edge : group.second.edge()) {
-          request->add_ticket(edge.target_ticket());
-        }
+  /// \brief Follows edges of kind `kind` from each of `tickets`.
+  ///
+  /// Tickets already in `cache` are answered from it; the rest are sent in
+  /// as few requests as possible, and their results are added to `cache`.
+  /// \param kind The edge kind to follow.
+  /// \param files_only If true, only keep targets that are file nodes.
+  /// \param tickets The tickets to start from.
+  /// \param cache Maps tickets to the targets we found for them before.
+  /// \param targets Gains the targets reached from any of `tickets`.
+  /// \return false if a request failed.
+  bool FollowEdges(const std::string &kind, bool files_only,
+                   const std::set<std::string> &tickets,
+                   FileTracker::TicketCache *cache,
+                   std::set<std::string> *targets) {
+    std::vector<const std::string *> missing;
+    for (const auto &ticket : tickets) {
+      auto found = cache->find(ticket);
+      if (found == cache->end()) {
+        missing.push_back(&ticket);
+      } else {
+        targets->insert(found->second.begin(), found->second.end());
       }
     }
-    return request->ticket_size() != 0;
-  }
-
-  /// \brief Adds the paths of all /kythe/node/file nodes from `reply.node` to
-  /// this Action's `FileTracker`'s include list.
-  template <typename Reply> void AddFileNodesToTracker(const Reply &reply) {
-    for (const auto &parent : reply.nodes()) {
-      bool is_file = false;
-      for (const auto &fact : parent.second.facts()) {
-        if (fact.first == "/kythe/node/kind") {
-          is_file = (fact.second == "/kythe/node/file");
-          break;
-        }
+    for (size_t begin = 0; begin < missing.size();
+         begin += kMaxTicketsPerRequest) {
+      size_t end = std::min(missing.size(), begin + kMaxTicketsPerRequest);
+      proto::EdgesRequest request;
+      for (size_t i = begin; i < end; ++i) {
+        request.add_ticket(*missing[i]);
+        // Remember tickets that had no edges at all.
+        (*cache)[*missing[i]];
       }
-      if (!is_file) {
-        continue;
+      request.add_kind(kind);
+      if (files_only) {
+        request.add_filter("/kythe/node/kind");
       }
-      auto maybe_uri = URI::FromString(parent.first);
+      do {
+        proto::EdgesReply reply;
+        std::string error_text;
+        if (!factory_.xrefs_->Edges(request, &reply, &error_text)) {
+          fprintf(stderr, "Xrefs error (%s): %s\n", kind.c_str(),
+                  error_text.c_str());
+          for (size_t i = begin; i < missing.size(); ++i) {
+            cache->erase(*missing[i]);
+          }
+          return false;
+        }
+        for (const auto &edge_set : reply.edge_sets()) {
+          auto *cached = &(*cache)[edge_set.first];
+          for (const auto &group : edge_set.second.groups()) {
+            for (const auto &edge : group.second.edge()) {
+              if (files_only && !IsFileNode(reply, edge.target_ticket())) {
+                continue;
+              }
+              cached->push_back(edge.target_ticket());
+              targets->insert(edge.target_ticket());
+            }
+          }
+        }
+        request.set_page_token(reply.next_page_token());
+      } while (!request.page_token().empty());
+    }
+    return true;
+  }
+
+  /// \brief Returns true if `reply.nodes` says that `ticket` is a file node.
+  static bool IsFileNode(const proto::EdgesReply &reply,
+                         const std::string &ticket) {
+    auto node = reply.nodes().find(ticket);
+    if (node == reply.nodes().end()) {
+      return false;
+    }
+    auto kind = node->second.facts().find("/kythe/node/kind");
+    return kind != node->second.facts().end() &&
+           kind->second == "/kythe/node/file";
+  }
+
+  /// \brief Looks up all of the typos we found during the last pass and
+  /// adds any files that might declare them to the tracker's include list.
+  ///
+  /// Rather than making three round trips for each typo as it happens, we
+  /// batch the lookups for a whole pass: names to nodes, nodes to their
+  /// defining anchors, and anchors to their files.
+  void ResolveTypos() {
+    if (tracker_->unresolved_names_.empty()) {
+      return;
+    }
+    std::set<std::string> names;
+    names.swap(tracker_->unresolved_names_);
+    // Figure out which nodes the names are bound to.
+    std::set<std::string> nodes;
+    if (!FollowEdges("%/kythe/edge/named", false, names,
+                     &tracker_->named_cache_, &nodes)) {
+      return;
+    }
+    // Get information about the places where those nodes were defined.
+    std::set<std::string> anchors;
+    if (!FollowEdges("%/kythe/edge/defines", false, nodes,
+                     &tracker_->defines_cache_, &anchors)) {
+      return;
+    }
+    // Finally, figure out whether we can make those definition sites visible
+    // to the site of the typo by adding an include.
+    std::set<std::string> files;
+    if (!FollowEdges("/kythe/edge/childof", true, anchors,
+                     &tracker_->childof_cache_, &files)) {
+      return;
+    }
+    // Add those files to the set of includes to try out.
+    for (const auto &file : files) {
+      auto maybe_uri = URI::FromString(file);
       if (maybe_uri.first) {
         tracker_->TryInclude(maybe_uri.second.v_name().path());
       }
@@ -394,50 +534,12 @@ class Action : public clang::ASTFrontendAction,
     // Conservatively assume that something went wrong if we had to invoke
     // typo correction.
     tracker_->pass_had_errors_ = true;
-    // Look for any name nodes that could help.
+    // Remember the name node that could help; we'll look it up (along with
+    // every other typo from this pass) in ResolveTypos.
     proto::VName name_node;
     name_node.set_signature(typo.getAsString() + "#n");
     name_node.set_language("c++");
-    proto::EdgesRequest named_edges_request;
-    auto name_uri = URI(name_node).ToString();
-    named_edges_request.add_ticket(name_uri);
-    // We've found at least one interesting name in the graph. Now we need
-    // to figure out which nodes those names are bound to.
-    named_edges_request.add_kind(ToStringRef("%/kythe/edge/named"));
-    proto::EdgesReply named_edges_reply;
-    std::string error_text;
-    if (!factory_.xrefs_->Edges(named_edges_request, &named_edges_reply,
-                                &error_text)) {
-      fprintf(stderr, "Xrefs error (named): %s\n", error_text.c_str());
-      return clang::TypoCorrection();
-    }
-    // Get information about the places where those nodes were defined.
-    proto::EdgesRequest defined_edges_request;
-    proto::EdgesReply defined_edges_reply;
-    if (!CopyTicketsFromEdgeSets(named_edges_reply, &defined_edges_request)) {
-      return clang::TypoCorrection();
-    }
-    defined_edges_request.add_kind(ToStringRef("%/kythe/edge/defines"));
-    if (!factory_.xrefs_->Edges(defined_edges_request, &defined_edges_reply,
-                                &error_text)) {
-      fprintf(stderr, "Xrefs error (defines): %s\n", error_text.c_str());
-      return clang::TypoCorrection();
-    }
-    // Finally, figure out whether we can make those definition sites visible
-    // to the site of the typo by adding an include.
-    proto::EdgesRequest childof_request;
-    proto::EdgesReply childof_reply;
-    if (!CopyTicketsFromEdgeSets(defined_edges_reply, &childof_request)) {
-      return clang::TypoCorrection();
-    }
-    childof_request.add_filter("/kythe/node/kind");
-    childof_request.add_kind(ToStringRef("/kythe/edge/childof"));
-    if (!factory_.xrefs_->Edges(childof_request, &childof_reply, &error_text)) {
-      fprintf(stderr, "Xrefs error (childof): %s\n", error_text.c_str());
-      return clang::TypoCorrection();
-    }
-    // Add those files to the set of includes to try out.
-    AddFileNodesToTracker(childof_reply);
+    tracker_->unresolved_names_.insert(URI(name_node).ToString());
     return clang::TypoCorrection();
   }
 
@@ -586,7 +688,7 @@ bool ActionFactory::runInvocation(
           /*Persistent*/ false, llvm::StringRef(),
           /*OnlyLocalDecls*/ false,
           /*CaptureDiagnostics*/ true,
-          /*PrecompilePreamble*/ true,
+          /*PrecompilePreambleAfterNParses*/ 1,
           /*CacheCodeCompletionResults*/ false,
           /*IncludeBriefCommentsInCodeCompletion*/ false,
           /*UserFilesAreVolatile*/ true,
@@ -630,6 +732,7 @@ bool ActionFactory::runInvocation(
          d != e; ++d) {
       action->tracker()->HandleStoredDiagnostic(*d);
     }
+    action->ResolveTypos();
     clang::Rewriter rewriter(ast_unit->getSourceManager(),
                              ast_unit->getLangOpts());
     if (action->tracker()->Rewrite(&rewriter)) {
@@ -643,9 +746,9 @@ bool ActionFactory::runInvocation(
   } while (action->tracker()->state() == FileTracker::State::kBusy &&
            ShouldRunAgain());
   if (action->tracker()->state() != FileTracker::State::kFailure) {
-    const auto buffer = action->tracker()->backing_store();
+    const auto buffer = action->tracker()->output_content();
     if (!buffer.empty()) {
-      printf("%s", buffer.str().c_str());
+      printf("%s", buffer.c_str());
     }
   }
   return action->tracker()->state() == FileTracker::State::kSuccess;
@@ -18,6 +18,8 @@
 #include "clang/Tooling/Tooling.h"
 #include "gflags/gflags.h"
 #include "glog/logging.h"
+#include "kythe/cxx/common/caching_xrefs_client.h"
+#include "kythe/cxx/common/leveldb_xrefs_client.h"
 #include "kythe/cxx/common/net_client.h"
 #include "kythe/cxx/tools/fyi/fyi.h"
 #include "llvm/Support/CommandLine.h"
@@ -31,6 +33,18 @@ static cl::OptionCategory fyi_options("Tool options");
 static cl::opt<std::string> xrefs("xrefs",
                                   cl::desc("Base URI for xrefs service"),
                                   cl::init("http://localhost:8080"));
+static cl::opt<std::string> xrefs_leveldb(
+    "xrefs_leveldb",
+    cl::desc("If set, read serving tables from this LevelDB instead of "
+             "querying -xrefs"));
+static cl::opt<std::string> xrefs_cache_dir(
+    "xrefs_cache_dir",
+    cl::desc("If set, also keep xrefs replies in this directory and reuse "
+             "them on later runs"));
+static cl::opt<unsigned> xrefs_cache_ttl_ms(
+    "xrefs_cache_ttl_ms",
+    cl::desc("If nonzero, reuse cached xrefs replies for at most this long"),
+    cl::init(0));
 
 int main(int argc, const char **argv) {
   GOOGLE_PROTOBUF_VERIFY_VERSION;
@@ -38,9 +52,26 @@ int main(int argc, const char **argv) {
   gflags::SetVersionString("0.1");
   gflags::SetUsageMessage("fyi: repair a C++ file with missing includes");
   clang::tooling::CommonOptionsParser options(argc, argv, fyi_options);
-  kythe::JsonClient::InitNetwork();
-  auto xrefs_db = llvm::make_unique<kythe::XrefsJsonClient>(
-      llvm::make_unique<kythe::JsonClient>(), xrefs);
+  std::unique_ptr<kythe::XrefsClient> xrefs_db;
+  if (!xrefs_leveldb.empty()) {
+    auto leveldb_db = llvm::make_unique<kythe::LevelDBXrefsClient>();
+    std::string error_text;
+    if (!leveldb_db->Open(xrefs_leveldb, &error_text)) {
+      fprintf(stderr, "%s\n", error_text.c_str());
+      return 1;
+    }
+    xrefs_db = std::move(leveldb_db);
+  } else {
+    kythe::JsonClient::InitNetwork();
+    xrefs_db = llvm::make_unique<kythe::XrefsJsonClient>(
+        llvm::make_unique<kythe::JsonClient>(), xrefs);
+  }
+  // Each iteration asks about many of the same names again.
+  kythe::CachingXrefsClient::Options cache_options;
+  cache_options.disk_cache_directory = xrefs_cache_dir;
+  cache_options.ttl_ms = xrefs_cache_ttl_ms;
+  xrefs_db = llvm::make_unique<kythe::CachingXrefsClient>(std::move(xrefs_db),
+                                                          cache_options);
   clang::tooling::ClangTool tool(options.getCompilations(),
                                  options.getSourcePathList());
   kythe::fyi::ActionFactory factory(std::move(xrefs_db), 5);
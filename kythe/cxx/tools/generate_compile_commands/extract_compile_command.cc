@@ -13,24 +13,51 @@
  * See the License for the specific language governing permissions and
  * limitations under the License.
  */
+
+// extract_compile_command turns the CppCompileInfo in Bazel extra action
+// files into clang compilation database entries. Given two arguments, it
+// writes the entry for one extra action file. With --batch_directory, it
+// instead finds every extra action file under that directory, parses them
+// with --jobs threads and writes a single compile_commands.json to --output,
+// leaving out repeats of the same action.
+
+#include <atomic>
+#include <functional>
+#include <mutex>
 #include <string>
+#include <thread>
+#include <unordered_set>
 #include <vector>
 
 #include <fcntl.h>
+#include <ftw.h>
 #include <stdio.h>
+#include <sys/param.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
 
+#include "gflags/gflags.h"
 #include "glog/logging.h"
 #include "google/protobuf/io/coded_stream.h"
 #include "google/protobuf/io/zero_copy_stream.h"
 #include "google/protobuf/io/zero_copy_stream_impl.h"
 #include "google/protobuf/stubs/common.h"
+#include "rapidjson/filewritestream.h"
 #include "rapidjson/stringbuffer.h"
 #include "rapidjson/writer.h"
 #include "third_party/bazel/src/main/protobuf/extra_actions_base.pb.h"
 
+DEFINE_string(batch_directory, "",
+              "Convert every extra action file under this directory.");
+DEFINE_string(extra_action_suffix, ".xa",
+              "In batch mode, the suffix of extra action files.");
+DEFINE_string(output, "compile_commands.json",
+              "In batch mode, where to write the compilation database.");
+DEFINE_int32(jobs, 0,
+             "In batch mode, the number of files to parse at once, or 0 to "
+             "use one thread per core.");
+
 namespace {
 using ::google::protobuf::io::FileInputStream;
 using ::google::protobuf::io::CodedInputStream;
@@ -80,27 +107,145 @@ std::string GetBuildDirectory() {
   return build_dir.erase(sandbox_start, sandbox_end - sandbox_start);
 }
 
+/// \brief Writes the database entry for `command` with `writer`.
+template <typename Writer>
+void WriteCompilationCommand(const std::string& source_file,
+                             const std::string& build_directory,
+                             const std::vector<std::string>& command,
+                             Writer* writer) {
+  writer->StartObject();
+  writer->Key("file");
+  writer->String(source_file.c_str());
+  writer->Key("directory");
+  writer->String(build_directory.c_str());
+  writer->Key("command");
+  writer->String(JoinCommand(command).c_str());
+  writer->EndObject();
+}
+
 std::string FormatCompilationCommand(const std::string& source_file,
                                      const std::vector<std::string>& command) {
   rapidjson::StringBuffer buffer;
   rapidjson::Writer<rapidjson::StringBuffer> writer(buffer);
-  writer.StartObject();
-  writer.Key("file");
-  writer.String(source_file.c_str());
-  writer.Key("directory");
-  writer.String(GetBuildDirectory().c_str());
-  writer.Key("command");
-  writer.String(JoinCommand(command).c_str());
-  writer.EndObject();
+  WriteCompilationCommand(source_file, GetBuildDirectory(), command, &writer);
   return buffer.GetString();
 }
+
+/// \brief Returns the compiler invocation described by `cpp_info`.
+std::vector<std::string> CommandFor(const blaze::CppCompileInfo& cpp_info) {
+  std::vector<std::string> args;
+  args.push_back(cpp_info.tool());
+  args.insert(args.end(), cpp_info.compiler_option().begin(),
+              cpp_info.compiler_option().end());
+  args.push_back("-c");
+  args.push_back(cpp_info.source_file());
+  args.push_back("-o");
+  args.push_back(cpp_info.output_file());
+  return args;
+}
+
+/// The extra action files found by `CollectExtraActionFile`.
+std::vector<std::string>* extra_action_files;
+
+int CollectExtraActionFile(const char* path, const struct stat* /*info*/,
+                           int type, struct FTW* /*ftw*/) {
+  const std::string& suffix = FLAGS_extra_action_suffix;
+  size_t length = strlen(path);
+  if (type == FTW_F && length >= suffix.size() &&
+      suffix.compare(0, suffix.size(), path + length - suffix.size()) == 0) {
+    extra_action_files->push_back(path);
+  }
+  return 0;
+}
+
+/// \brief Writes a compilation database for every C++ extra action file
+/// under `directory` to `output_path`.
+///
+/// Files are parsed in parallel; entries are streamed out in the order they
+/// are finished. An action is written once even if several extra action
+/// files (for instance, from different action listeners) describe it.
+bool WriteCompilationDatabase(const std::string& directory,
+                              const std::string& output_path) {
+  std::vector<std::string> files;
+  extra_action_files = &files;
+  if (::nftw(directory.c_str(), CollectExtraActionFile, 64, FTW_PHYS) != 0) {
+    perror("Failed to scan batch directory: ");
+    return false;
+  }
+  FILE* output = ::fopen(output_path.c_str(), "w");
+  if (output == nullptr) {
+    perror("Unable to open file for writing: ");
+    return false;
+  }
+  const std::string build_directory = GetBuildDirectory();
+  char output_buffer[64 * 1024];
+  rapidjson::FileWriteStream stream(output, output_buffer,
+                                    sizeof(output_buffer));
+  rapidjson::Writer<rapidjson::FileWriteStream> writer(stream);
+  std::mutex writer_mutex;
+  // Identifies the actions we've written by their source and output files and
+  // a hash of their command lines; keeping whole commands around for a large
+  // build would take gigabytes.
+  std::unordered_set<std::string> written_actions;
+  std::atomic<size_t> next_file(0);
+  size_t skipped = 0;
+  writer.StartArray();
+  auto convert_files = [&]() {
+    blaze::ExtraActionInfo info;
+    blaze::CppCompileInfo cpp_info;
+    for (size_t i = next_file++; i < files.size(); i = next_file++) {
+      if (!ReadExtraAction(files[i], &info, &cpp_info)) {
+        std::lock_guard<std::mutex> lock(writer_mutex);
+        ++skipped;
+        continue;
+      }
+      std::vector<std::string> command = CommandFor(cpp_info);
+      std::string action_key =
+          cpp_info.source_file() + '\0' + cpp_info.output_file() + '\0' +
+          std::to_string(std::hash<std::string>()(JoinCommand(command)));
+      std::lock_guard<std::mutex> lock(writer_mutex);
+      if (written_actions.insert(std::move(action_key)).second) {
+        WriteCompilationCommand(cpp_info.source_file(), build_directory,
+                                command, &writer);
+      }
+    }
+  };
+  int jobs = FLAGS_jobs > 0 ? FLAGS_jobs : std::thread::hardware_concurrency();
+  std::vector<std::thread> threads;
+  for (int i = 1; i < jobs; ++i) {
+    threads.emplace_back(convert_files);
+  }
+  convert_files();
+  for (auto& thread : threads) {
+    thread.join();
+  }
+  writer.EndArray();
+  stream.Flush();
+  bool ok = ::fclose(output) == 0;
+  LOG(INFO) << "Wrote " << written_actions.size() << " of " << files.size()
+            << " extra actions to " << output_path << " (" << skipped
+            << " were not C++ compiles)";
+  return ok;
+}
 }  // namespace
 
 int main(int argc, char** argv) {
   GOOGLE_PROTOBUF_VERIFY_VERSION;
   google::InitGoogleLogging(argv[0]);
+  gflags::SetUsageMessage(
+      "extra-action-file output-file\n"
+      "   or: --batch_directory=dir [--output=compile_commands.json]");
+  gflags::ParseCommandLineFlags(&argc, &argv, true);
+  if (!FLAGS_batch_directory.empty()) {
+    bool ok = WriteCompilationDatabase(FLAGS_batch_directory, FLAGS_output);
+    google::protobuf::ShutdownProtobufLibrary();
+    return ok ? 0 : 1;
+  }
   if (argc != 3) {
-    fprintf(stderr, "usage: %s extra-action-file output-file\n", argv[0]);
+    fprintf(stderr,
+            "usage: %s extra-action-file output-file\n"
+            "   or: %s --batch_directory=dir [--output=file] [--jobs=n]\n",
+            argv[0], argv[0]);
     return 1;
   }
   std::string extra_action_file = argv[1];
@@ -109,21 +254,13 @@ int main(int argc, char** argv) {
   blaze::CppCompileInfo cpp_info;
   if (!ReadExtraAction(extra_action_file, &info, &cpp_info)) return 1;
 
-  std::vector<std::string> args;
-  args.push_back(cpp_info.tool());
-  args.insert(args.end(), cpp_info.compiler_option().begin(),
-              cpp_info.compiler_option().end());
-  args.push_back("-c");
-  args.push_back(cpp_info.source_file());
-  args.push_back("-o");
-  args.push_back(cpp_info.output_file());
-
   FILE* output = ::fopen(output_file.c_str(), "w");
   if (output == nullptr) {
     perror("Unable to open file for writing: ");
     return 1;
   }
-  ::fputs(FormatCompilationCommand(cpp_info.source_file(), args).c_str(),
+  ::fputs(FormatCompilationCommand(cpp_info.source_file(), CommandFor(cpp_info))
+              .c_str(),
           output);
   ::fclose(output);
 
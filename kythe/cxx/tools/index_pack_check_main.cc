@@ -0,0 +1,360 @@
+/*
+ * Copyright 2017 Google Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+// index_pack_check: verifies an index pack and finds unreferenced data
+//
+// bazel run //kythe/cxx/tools:index_pack_check --
+//     -index_pack ~/linux/linux-3.19-rc6/kernel-pack
+// will print one line for each problem it finds:
+//
+// missing files/<sha>.data needed by units/<sha>.unit
+// corrupt files/<sha>.data: <reason>
+// orphan files/<sha>.data
+//
+// and exit with a nonzero status if any data is missing or corrupt. Orphans
+// (file data no unit refers to) are only reported unless -delete_orphans is
+// set, in which case they are removed; nothing is removed if any unit could
+// not be read, since its references are unknown.
+//
+// Digests are kept in binary form and, if they won't fit in
+// -memory_budget_mb, the digest space is split into ranges that are checked
+// one at a time (rereading the units for each).
+
+#include <openssl/sha.h>
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "gflags/gflags.h"
+#include "glog/logging.h"
+#include "kythe/cxx/common/cxx_details.h"
+#include "kythe/cxx/common/index_pack.h"
+#include "kythe/cxx/common/segmented_index_pack.h"
+#include "kythe/proto/analysis.pb.h"
+
+using kythe::IndexPack;
+using kythe::IndexPackFilesystem;
+using kythe::proto::CompilationUnit;
+
+DEFINE_string(index_pack, "", "Check this index pack.");
+DEFINE_int32(threads, 8, "Read and hash data on this many threads.");
+DEFINE_bool(check_contents, true,
+            "Check that file data matches the digest it is stored under.");
+DEFINE_bool(delete_orphans, false,
+            "Remove file data that no compilation unit refers to.");
+DEFINE_int32(memory_budget_mb, 512,
+             "Try to keep digests for reachability in this many megabytes.");
+
+namespace {
+/// \brief A binary SHA-256 digest.
+using Digest = std::array<uint8_t, SHA256_DIGEST_LENGTH>;
+
+/// \brief A reference to file data from a compilation unit.
+struct Reference {
+  Digest digest;
+  /// The index of the referring unit in the list of units.
+  uint32_t unit;
+  bool operator<(const Reference &o) const {
+    return digest < o.digest || (digest == o.digest && unit < o.unit);
+  }
+};
+
+/// \brief Decodes the lowercase hex digest `hex` into `digest`.
+/// \return false if `hex` isn't a well-formed digest.
+bool ParseDigest(const std::string &hex, Digest *digest) {
+  if (hex.size() != digest->size() * 2) {
+    return false;
+  }
+  auto nybble = [](char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    return -1;
+  };
+  for (size_t i = 0; i < digest->size(); ++i) {
+    int hi = nybble(hex[i * 2]);
+    int lo = nybble(hex[i * 2 + 1]);
+    if (hi < 0 || lo < 0) {
+      return false;
+    }
+    (*digest)[i] = static_cast<uint8_t>((hi << 4) | lo);
+  }
+  return true;
+}
+
+/// \brief Encodes `digest` as lowercase hex.
+std::string DigestToHex(const Digest &digest) {
+  static constexpr char kHexDigits[] = "0123456789abcdef";
+  std::string hex(digest.size() * 2, '\0');
+  for (size_t i = 0; i < digest.size(); ++i) {
+    hex[i * 2] = kHexDigits[digest[i] >> 4];
+    hex[i * 2 + 1] = kHexDigits[digest[i] & 0xF];
+  }
+  return hex;
+}
+
+/// \brief Counts what's been found so far.
+struct Totals {
+  size_t references = 0;
+  size_t files = 0;
+  size_t unreadable_units = 0;
+  size_t malformed_references = 0;
+  size_t missing = 0;
+  size_t corrupt = 0;
+  size_t orphans = 0;
+  size_t deleted = 0;
+};
+
+/// \brief Checks an index pack in one or more passes over ranges of digests.
+class PackChecker {
+ public:
+  PackChecker(IndexPack *pack, std::vector<std::string> units)
+      : pack_(pack), units_(std::move(units)) {
+    options_.parallelism = std::max(FLAGS_threads, 1);
+  }
+
+  /// \brief Reads every unit without keeping its references to learn how
+  /// many there are.
+  void CountReferences() {
+    pack_->ReadCompilationUnitBatch(
+        units_, options_, [this](size_t index, bool ok, CompilationUnit *unit,
+                                 const std::string &error_text) {
+          if (ok) {
+            totals_.references += unit->required_input_size();
+          }
+          return true;
+        });
+  }
+
+  /// \brief Checks the digests whose first byte maps to `pass` of `passes`.
+  /// \param files All file data in the pack, in hex.
+  void CheckPass(size_t pass, size_t passes,
+                 const std::vector<std::string> &files) {
+    auto in_pass = [pass, passes](const Digest &digest) {
+      return digest[0] * passes / 256 == pass;
+    };
+    std::vector<Reference> references;
+    pack_->ReadCompilationUnitBatch(
+        units_, options_,
+        [&](size_t index, bool ok, CompilationUnit *unit,
+            const std::string &error_text) {
+          if (!ok) {
+            // Only complain about each unit once.
+            if (pass == 0) {
+              ::printf("unreadable units/%s.unit: %s\n", units_[index].c_str(),
+                       error_text.c_str());
+              ++totals_.unreadable_units;
+            }
+            return true;
+          }
+          // Shared C++ details are file data, too.
+          std::vector<std::string> digests;
+          for (const auto &input : unit->required_input()) {
+            digests.push_back(input.info().digest());
+          }
+          std::string details_digest = kythe::SharedCxxDetailsDigest(*unit);
+          if (!details_digest.empty()) {
+            digests.push_back(details_digest);
+          }
+          for (const auto &digest : digests) {
+            Reference reference;
+            reference.unit = index;
+            if (!ParseDigest(digest, &reference.digest)) {
+              if (pass == 0) {
+                ::printf("malformed digest \"%s\" in units/%s.unit\n",
+                         digest.c_str(), units_[index].c_str());
+                ++totals_.malformed_references;
+              }
+            } else if (in_pass(reference.digest)) {
+              references.push_back(reference);
+            }
+          }
+          return true;
+        });
+    std::sort(references.begin(), references.end());
+    std::vector<Digest> present;
+    for (const auto &file : files) {
+      Digest digest;
+      if (ParseDigest(file, &digest) && in_pass(digest)) {
+        present.push_back(digest);
+      }
+    }
+    std::sort(present.begin(), present.end());
+    totals_.files += present.size();
+    if (FLAGS_check_contents) {
+      CheckContents(present);
+    }
+    // Walk both sorted lists together to find missing and orphaned data.
+    auto reference = references.begin();
+    for (const auto &digest : present) {
+      for (; reference != references.end() && reference->digest < digest;
+           ++reference) {
+        ReportMissing(*reference);
+      }
+      if (reference != references.end() && reference->digest == digest) {
+        while (reference != references.end() && reference->digest == digest) {
+          ++reference;
+        }
+        continue;
+      }
+      ReportOrphan(digest);
+    }
+    for (; reference != references.end(); ++reference) {
+      ReportMissing(*reference);
+    }
+  }
+
+  /// \brief Whether orphans may be deleted safely.
+  bool can_delete() const { return totals_.unreadable_units == 0; }
+
+  const Totals &totals() const { return totals_; }
+
+  size_t unit_count() const { return units_.size(); }
+
+ private:
+  /// \brief Rehashes each of `digests` on `FLAGS_threads` threads.
+  void CheckContents(const std::vector<Digest> &digests) {
+    std::atomic<size_t> next(0);
+    std::mutex output_mutex;
+    auto check = [&] {
+      std::string content;
+      for (size_t i; (i = next++) < digests.size();) {
+        const std::string hex = DigestToHex(digests[i]);
+        std::string problem;
+        if (!pack_->ReadFileData(hex, &content)) {
+          problem = content;
+        } else {
+          Digest actual;
+          ::SHA256(reinterpret_cast<const unsigned char *>(content.data()),
+                   content.size(), actual.data());
+          if (actual != digests[i]) {
+            problem = "content has digest " + DigestToHex(actual);
+          }
+        }
+        if (!problem.empty()) {
+          std::lock_guard<std::mutex> lock(output_mutex);
+          ::printf("corrupt files/%s.data: %s\n", hex.c_str(), problem.c_str());
+          ++totals_.corrupt;
+        }
+      }
+    };
+    std::vector<std::thread> workers;
+    for (int i = 1; i < FLAGS_threads; ++i) {
+      workers.emplace_back(check);
+    }
+    check();
+    for (auto &worker : workers) {
+      worker.join();
+    }
+  }
+
+  void ReportMissing(const Reference &reference) {
+    ::printf("missing files/%s.data needed by units/%s.unit\n",
+             DigestToHex(reference.digest).c_str(),
+             units_[reference.unit].c_str());
+    ++totals_.missing;
+  }
+
+  void ReportOrphan(const Digest &digest) {
+    const std::string hex = DigestToHex(digest);
+    ++totals_.orphans;
+    if (!FLAGS_delete_orphans || !can_delete()) {
+      ::printf("orphan files/%s.data\n", hex.c_str());
+      return;
+    }
+    std::string error_text;
+    if (pack_->DeleteFileData(hex, &error_text)) {
+      ::printf("deleted files/%s.data\n", hex.c_str());
+      ++totals_.deleted;
+    } else {
+      ::printf("orphan files/%s.data: couldn't delete: %s\n", hex.c_str(),
+               error_text.c_str());
+    }
+  }
+
+  IndexPack *pack_;
+  /// The hashes of all the units in the pack.
+  const std::vector<std::string> units_;
+  IndexPack::BatchReadOptions options_;
+  Totals totals_;
+};
+}  // anonymous namespace
+
+int main(int argc, char *argv[]) {
+  GOOGLE_PROTOBUF_VERIFY_VERSION;
+  gflags::SetVersionString("0.1");
+  gflags::ParseCommandLineFlags(&argc, &argv, true);
+  google::InitGoogleLogging(argv[0]);
+  CHECK(!FLAGS_index_pack.empty()) << "Need an index pack.";
+  CHECK_GT(FLAGS_memory_budget_mb, 0);
+  std::string error_text;
+  auto filesystem = kythe::OpenIndexPackFilesystem(
+      FLAGS_index_pack, FLAGS_delete_orphans
+                            ? IndexPackFilesystem::OpenMode::kReadWrite
+                            : IndexPackFilesystem::OpenMode::kReadOnly,
+      &error_text);
+  if (!filesystem) {
+    ::fprintf(stderr, "Error reading index pack: %s\n", error_text.c_str());
+    return 1;
+  }
+  IndexPack pack(std::move(filesystem));
+  std::vector<std::string> units, files;
+  if (!pack.ScanData(IndexPackFilesystem::DataKind::kCompilationUnit,
+                     [&units](const std::string &hash) {
+                       units.push_back(hash);
+                       return true;
+                     },
+                     &error_text) ||
+      !pack.ScanData(IndexPackFilesystem::DataKind::kFileData,
+                     [&files](const std::string &hash) {
+                       files.push_back(hash);
+                       return true;
+                     },
+                     &error_text)) {
+    ::fprintf(stderr, "Error scanning index pack: %s\n", error_text.c_str());
+    return 1;
+  }
+  CHECK_LE(units.size(), UINT32_MAX) << "Too many units.";
+  PackChecker checker(&pack, std::move(units));
+  checker.CountReferences();
+  const size_t budget = static_cast<size_t>(FLAGS_memory_budget_mb) << 20;
+  const size_t needed = checker.totals().references * sizeof(Reference) +
+                        files.size() * sizeof(Digest);
+  const size_t passes = std::min<size_t>(256, needed / budget + 1);
+  for (size_t pass = 0; pass < passes; ++pass) {
+    checker.CheckPass(pass, passes, files);
+  }
+  const Totals &totals = checker.totals();
+  ::fprintf(stderr,
+            "%zu units, %zu references, %zu files in %zu pass(es): "
+            "%zu unreadable units, %zu malformed references, %zu missing, "
+            "%zu corrupt, %zu orphans (%zu deleted)\n",
+            checker.unit_count(), totals.references, totals.files, passes,
+            totals.unreadable_units, totals.malformed_references,
+            totals.missing, totals.corrupt, totals.orphans, totals.deleted);
+  if (FLAGS_delete_orphans && !checker.can_delete()) {
+    ::fprintf(stderr, "Not deleting orphans: some units couldn't be read.\n");
+  }
+  return totals.unreadable_units || totals.malformed_references ||
+                 totals.missing || totals.corrupt
+             ? 1
+             : 0;
+}
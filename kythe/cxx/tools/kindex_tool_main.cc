@@ -1,19 +1,3 @@
-/*
- * Copyright 2014 Google Inc. All rights reserved.
- *
- * Licensed under the Apache License, Version 2.0 (the "License");
- * you may not use this file except in compliance with the License.
- * You may obtain a copy of the License at
- *
- *   http://www.apache.org/licenses/LICENSE-2.0
- *
- * Unless required by applicable law or agreed to in writing, software
- * distributed under the License is distributed on an "AS IS" BASIS,
- * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
- * See the License for the specific language governing permissions and
- * limitations under the License.
- */
-
 // kindex_tool: convert between .kindex files and ASCII protocol buffers.
 //
 // kindex_tool -explode some/file.kindex
@@ -22,26 +6,68 @@
 // kindex_tool -assemble some/file.kindex some/unit some/content...
 //   assembles some/file.kindex using some/unit as the CompilationUnit and
 //   any other input files as FileData
+// kindex_tool -to_index_pack some/pack some/file.kindex...
+//   adds the contents of each .kindex file to the index pack at some/pack
+// kindex_tool -find_units some/pack [-unit_key=source|output|target] key...
+//   prints the units in some/pack that each key maps to in its unit index
+// kindex_tool -rebuild_unit_index some/pack
+//   rebuilds the unit index of some/pack from all of its units
+//
+// Every mode handles one record (the unit or a single FileData) at a time, so
+// memory use is bounded by the largest record rather than by the size of the
+// .kindex file.
 
 #include <fcntl.h>
 #include <sys/stat.h>
 
+#include <atomic>
+#include <functional>
+#include <thread>
+
 #include "gflags/gflags.h"
 #include "glog/logging.h"
 #include "google/protobuf/io/coded_stream.h"
 #include "google/protobuf/io/gzip_stream.h"
 #include "google/protobuf/io/zero_copy_stream.h"
 #include "google/protobuf/io/zero_copy_stream_impl.h"
+#include "google/protobuf/io/zero_copy_stream_impl_lite.h"
 #include "google/protobuf/stubs/common.h"
 #include "google/protobuf/text_format.h"
+#include "kythe/cxx/common/blob_compression.h"
+#include "kythe/cxx/common/delimited_proto_reader.h"
+#include "kythe/cxx/common/index_pack.h"
+#include "kythe/cxx/common/kythe_uri.h"
+#include "kythe/cxx/common/segmented_index_pack.h"
 #include "kythe/proto/analysis.pb.h"
 #include "kythe/proto/filecontext.pb.h"
 
 DEFINE_string(assemble, "", "Assemble positional args into output file");
 DEFINE_string(explode, "", "Explode this kindex file into its constituents");
+DEFINE_string(to_index_pack, "",
+              "Add the kindex files named by positional args to the index "
+              "pack rooted at this directory (creating it if needed)");
 DEFINE_bool(canonicalize_hashes, false,
             "Replace transcripts with sequence numbers");
 DEFINE_bool(suppress_details, false, "Suppress CU details.");
+DEFINE_int32(compression_threads, 1,
+             "With -assemble, compress up to this many records at once, "
+             "writing each as its own gzip member");
+DEFINE_string(index_pack_compression, "gzip",
+              "With -to_index_pack, how to compress new blobs: gzip, "
+              "gzip:<level> or snappy[:<threads>]");
+DEFINE_int32(jobs, 1,
+             "With -to_index_pack, convert up to this many kindex files at "
+             "once; with -rebuild_unit_index, read this many units at once");
+DEFINE_string(find_units, "",
+              "Print the units in the index pack rooted at this directory "
+              "that the positional args map to in its unit index");
+DEFINE_string(unit_key, "source",
+              "With -find_units, what the positional args are: source (the "
+              "kythe:// URI of a main source file), output (an output key) "
+              "or target (a build target)");
+DEFINE_string(rebuild_unit_index, "",
+              "Rebuild the unit index of the index pack rooted at this "
+              "directory from all of its units");
 
 /// \brief Gives each `hash` a unique, shorter ID based on visitation order.
 static void CanonicalizeHash(std::map<google::protobuf::string, size_t>* hashes,
@@ -51,102 +77,321 @@ static void CanonicalizeHash(std::map<google::protobuf::string, size_t>* hashes,
       google::protobuf::string("hash" + std::to_string(inserted.first->second));
 }
 
-static void DumpIndexFile(const std::string& path) {
+/// \brief Reads the records of the .kindex file at `path` in order, one at a
+/// time.
+/// \param on_unit Called with the `CompilationUnit`.
+/// \param on_file_data Called with each `FileData`.
+static void ReadIndexFile(
+    const std::string& path,
+    const std::function<void(kythe::proto::CompilationUnit*)>& on_unit,
+    const std::function<void(kythe::proto::FileData*)>& on_file_data) {
+  // With --jobs, files are already read in parallel.
+  std::string error_text;
+  auto reader =
+      kythe::DelimitedProtoReader::Open(path, FLAGS_jobs <= 1, &error_text);
+  CHECK(reader != nullptr) << "Couldn't open input file " << path << ": "
+                           << error_text;
+  kythe::proto::CompilationUnit unit;
+  CHECK(reader->NextMessage(&unit)) << "Never saw a CompilationUnit in "
+                                    << path << ": " << reader->error();
+  on_unit(&unit);
+  kythe::proto::FileData content;
+  while (reader->NextMessage(&content)) {
+    on_file_data(&content);
+  }
+  CHECK(reader->error().empty()) << path << ": " << reader->error();
+}
+
+/// \brief Writes `message` as text to a new file at `out_path`.
+static void PrintToFile(const google::protobuf::Message& message,
+                        const std::string& out_path) {
   using namespace google::protobuf::io;
-  int in_fd = open(path.c_str(), O_RDONLY, S_IREAD | S_IWRITE);
-  CHECK_GE(in_fd, 0) << "Couldn't open input file " << path;
-  FileInputStream file_input_stream(in_fd);
-  GzipInputStream gzip_input_stream(&file_input_stream);
-  google::protobuf::uint32 byte_size;
-  bool decoded_unit = false;
+  int out_fd =
+      open(out_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, S_IREAD | S_IWRITE);
+  CHECK_GE(out_fd, 0) << "Couldn't open " << out_path << " for writing.";
+  FileOutputStream file_output_stream(out_fd);
+  CHECK(google::protobuf::TextFormat::Print(message, &file_output_stream));
+  CHECK(file_output_stream.Close());
+}
+
+static void DumpIndexFile(const std::string& path) {
   std::map<google::protobuf::string, size_t> hash_table;
-  for (;;) {
-    CodedInputStream coded_input_stream(&gzip_input_stream);
-    coded_input_stream.SetTotalBytesLimit(INT_MAX, -1);
-    if (!coded_input_stream.ReadVarint32(&byte_size)) {
-      break;
-    }
-    coded_input_stream.PushLimit(byte_size);
-    if (!decoded_unit) {
-      kythe::proto::CompilationUnit unit;
-      CHECK(unit.ParseFromCodedStream(&coded_input_stream));
-      std::string out_path = path + "_UNIT";
-      int out_fd = open(out_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC,
-                        S_IREAD | S_IWRITE);
-      CHECK_GE(out_fd, 0) << "Couldn't open " << out_path << " for writing.";
-      if (FLAGS_suppress_details) {
-        unit.clear_details();
-      }
-      if (FLAGS_canonicalize_hashes) {
-        CanonicalizeHash(&hash_table, unit.mutable_entry_context());
-        for (int i = 0; i < unit.required_input_size(); ++i) {
-          auto* input = unit.mutable_required_input(i);
-          for (int r = 0; r < input->context().row_size(); ++r) {
-            auto* row = input->mutable_context()->mutable_row(r);
-            CanonicalizeHash(&hash_table, row->mutable_source_context());
-            for (int c = 0; c < row->column_size(); ++c) {
-              auto* col = row->mutable_column(c);
-              CanonicalizeHash(&hash_table, col->mutable_linked_context());
+  ReadIndexFile(
+      path,
+      [&](kythe::proto::CompilationUnit* unit) {
+        if (FLAGS_suppress_details) {
+          unit->clear_details();
+        }
+        if (FLAGS_canonicalize_hashes) {
+          CanonicalizeHash(&hash_table, unit->mutable_entry_context());
+          for (int i = 0; i < unit->required_input_size(); ++i) {
+            auto* input = unit->mutable_required_input(i);
+            for (int r = 0; r < input->context().row_size(); ++r) {
+              auto* row = input->mutable_context()->mutable_row(r);
+              CanonicalizeHash(&hash_table, row->mutable_source_context());
+              for (int c = 0; c < row->column_size(); ++c) {
+                auto* col = row->mutable_column(c);
+                CanonicalizeHash(&hash_table, col->mutable_linked_context());
+              }
             }
           }
         }
-      }
-      FileOutputStream file_output_stream(out_fd);
-      CHECK(google::protobuf::TextFormat::Print(unit, &file_output_stream));
-      CHECK(file_output_stream.Close());
-      decoded_unit = true;
+        PrintToFile(*unit, path + "_UNIT");
+      },
+      [&](kythe::proto::FileData* content) {
+        CHECK(content->has_info() && !content->info().digest().empty());
+        PrintToFile(*content, path + "_" + content->info().digest());
+      });
+}
+
+/// \brief Writes delimited records to a .kindex file.
+///
+/// With one thread, the file is a single gzip stream. With more, up to that
+/// many records are compressed at once and each is written as its own gzip
+/// member; gzip readers (including `GzipInputStream`) read the concatenated
+/// members as one stream.
+class IndexFileWriter {
+ public:
+  IndexFileWriter(const std::string& path, size_t threads)
+      : path_(path), threads_(std::max<size_t>(threads, 1)) {
+    fd_ = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, S_IREAD | S_IWRITE);
+    CHECK(fd_ >= 0) << "Couldn't open " << path << " for writing.";
+    file_stream_.reset(new google::protobuf::io::FileOutputStream(fd_));
+    if (threads_ == 1) {
+      gzip_stream_.reset(new google::protobuf::io::GzipOutputStream(
+          file_stream_.get(), GzipOptions()));
+    }
+  }
+
+  /// \brief Writes `record`, preceded by its size.
+  void Write(const google::protobuf::Message& record) {
+    if (gzip_stream_) {
+      google::protobuf::io::CodedOutputStream coded_stream(gzip_stream_.get());
+      coded_stream.WriteVarint32(record.ByteSize());
+      CHECK(record.SerializeToCodedStream(&coded_stream));
+      CHECK(!coded_stream.HadError()) << "Couldn't write to " << path_;
+      return;
+    }
+    pending_.emplace_back();
+    {
+      google::protobuf::io::StringOutputStream string_stream(&pending_.back());
+      google::protobuf::io::CodedOutputStream coded_stream(&string_stream);
+      coded_stream.WriteVarint32(record.ByteSize());
+      CHECK(record.SerializeToCodedStream(&coded_stream));
+    }
+    if (pending_.size() == threads_) {
+      CompressPending();
+    }
+  }
+
+  /// \brief Finishes writing the file.
+  void Close() {
+    if (gzip_stream_) {
+      CHECK(gzip_stream_->Close()) << "Couldn't write to " << path_;
+      gzip_stream_.reset();
     } else {
-      kythe::proto::FileData content;
-      CHECK(content.ParseFromCodedStream(&coded_input_stream));
-      CHECK(content.has_info() && !content.info().digest().empty());
-      std::string out_path = path + "_" + content.info().digest();
-      int out_fd = open(out_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC,
-                        S_IREAD | S_IWRITE);
-      CHECK_GE(out_fd, 0) << "Couldn't open " << out_path << " for writing.";
-      FileOutputStream file_output_stream(out_fd);
-      CHECK(google::protobuf::TextFormat::Print(content, &file_output_stream));
-      CHECK(file_output_stream.Close());
+      CompressPending();
+    }
+    CHECK(file_stream_->Close()) << "Couldn't write to " << path_;
+  }
+
+ private:
+  static google::protobuf::io::GzipOutputStream::Options GzipOptions() {
+    google::protobuf::io::GzipOutputStream::Options options;
+    options.format = google::protobuf::io::GzipOutputStream::GZIP;
+    return options;
+  }
+
+  /// \brief Compresses each of `pending_` (concurrently) into a gzip member
+  /// and writes the members in order.
+  void CompressPending() {
+    std::vector<std::string> members(pending_.size());
+    std::vector<std::thread> threads;
+    for (size_t i = 0; i < pending_.size(); ++i) {
+      threads.emplace_back([this, &members, i] {
+        google::protobuf::io::StringOutputStream string_stream(&members[i]);
+        google::protobuf::io::GzipOutputStream gzip_stream(&string_stream,
+                                                           GzipOptions());
+        {
+          google::protobuf::io::CodedOutputStream coded_stream(&gzip_stream);
+          coded_stream.WriteRaw(pending_[i].data(), pending_[i].size());
+        }
+        CHECK(gzip_stream.Close());
+      });
+    }
+    for (auto& thread : threads) {
+      thread.join();
+    }
+    pending_.clear();
+    google::protobuf::io::CodedOutputStream coded_stream(file_stream_.get());
+    for (const auto& member : members) {
+      coded_stream.WriteRaw(member.data(), member.size());
     }
+    CHECK(!coded_stream.HadError()) << "Couldn't write to " << path_;
   }
+
+  /// The path to the file being written.
+  std::string path_;
+  /// The number of records to compress at once.
+  size_t threads_;
+  /// The file being written.
+  int fd_;
+  /// Writes to `fd_`.
+  std::unique_ptr<google::protobuf::io::FileOutputStream> file_stream_;
+  /// Compresses records onto `file_stream_` if `threads_` is 1.
+  std::unique_ptr<google::protobuf::io::GzipOutputStream> gzip_stream_;
+  /// Delimited records waiting to be compressed (if `threads_` isn't 1).
+  std::vector<std::string> pending_;
+};
+
+/// \brief Parses the text-format message in the file at `path`.
+static void ParseFromFile(const std::string& path,
+                          google::protobuf::Message* message) {
+  int in_fd = open(path.c_str(), O_RDONLY, S_IREAD | S_IWRITE);
+  CHECK_GE(in_fd, 0) << "Couldn't open input file " << path;
+  google::protobuf::io::FileInputStream file_input_stream(in_fd);
+  CHECK(google::protobuf::TextFormat::Parse(&file_input_stream, message))
+      << "Couldn't parse " << path;
   CHECK(file_input_stream.Close());
 }
 
 static void BuildIndexFile(const std::string& outfile,
                            const std::vector<std::string>& elements) {
   CHECK(!elements.empty()) << "Need at least a CompilationUnit!";
-  using namespace google::protobuf::io;
-  int out_fd =
-      open(outfile.c_str(), O_WRONLY | O_CREAT | O_TRUNC, S_IREAD | S_IWRITE);
-  CHECK(out_fd >= 0) << "Couldn't open " << outfile << " for writing.";
+  IndexFileWriter writer(outfile, std::max(FLAGS_compression_threads, 1));
   {
-    FileOutputStream file_output_stream(out_fd);
-    GzipOutputStream::Options options;
-    options.format = GzipOutputStream::GZIP;
-    GzipOutputStream gzip_stream(&file_output_stream, options);
-    CodedOutputStream coded_stream(&gzip_stream);
-
     kythe::proto::CompilationUnit unit;
-    int in_fd = open(elements[0].c_str(), O_RDONLY, S_IREAD | S_IWRITE);
-    CHECK_GE(in_fd, 0) << "Couldn't open input file " << elements[0];
-    FileInputStream file_input_stream(in_fd);
-    CHECK(google::protobuf::TextFormat::Parse(&file_input_stream, &unit));
-    coded_stream.WriteVarint32(unit.ByteSize());
-    CHECK(unit.SerializeToCodedStream(&coded_stream));
-    CHECK(file_input_stream.Close());
-
-    for (size_t i = 1; i < elements.size(); ++i) {
-      kythe::proto::FileData content;
-      int in_fd = open(elements[i].c_str(), O_RDONLY, S_IREAD | S_IWRITE);
-      CHECK_GE(in_fd, 0) << "Couldn't open input file " << elements[i];
-      FileInputStream file_input_stream(in_fd);
-      CHECK(google::protobuf::TextFormat::Parse(&file_input_stream, &content));
-      coded_stream.WriteVarint32(content.ByteSize());
-      CHECK(content.SerializeToCodedStream(&coded_stream));
-      CHECK(file_input_stream.Close());
+    ParseFromFile(elements[0], &unit);
+    writer.Write(unit);
+  }
+  for (size_t i = 1; i < elements.size(); ++i) {
+    kythe::proto::FileData content;
+    ParseFromFile(elements[i], &content);
+    writer.Write(content);
+  }
+  writer.Close();
+}
+
+/// \brief Adds the contents of each of `kindex_files` to the index pack at
+/// `pack_root`, converting up to `FLAGS_jobs` files at once.
+static void ConvertToIndexPack(const std::string& pack_root,
+                               const std::vector<std::string>& kindex_files) {
+  kythe::BlobCompression compression;
+  std::string error_text;
+  CHECK(kythe::ParseBlobCompression(FLAGS_index_pack_compression,
+                                    &compression, &error_text))
+      << error_text;
+  std::atomic<size_t> next_file(0);
+  auto convert = [&] {
+    std::string error_text;
+    auto filesystem = kythe::OpenIndexPackFilesystem(
+        pack_root, kythe::IndexPackFilesystem::OpenMode::kReadWrite,
+        &error_text);
+    CHECK(filesystem) << "Couldn't open index pack in " << pack_root << ": "
+                      << error_text;
+    filesystem->set_blob_compression(compression);
+    kythe::IndexPack pack(std::move(filesystem));
+    for (size_t index = next_file++; index < kindex_files.size();
+         index = next_file++) {
+      const std::string& path = kindex_files[index];
+      // The unit comes first in a .kindex file but is added last, so that a
+      // unit is never visible in the pack without its inputs.
+      kythe::proto::CompilationUnit unit;
+      ReadIndexFile(
+          path,
+          [&unit](kythe::proto::CompilationUnit* read) { unit.Swap(read); },
+          [&](kythe::proto::FileData* content) {
+            CHECK(pack.AddFileData(*content, &error_text))
+                << path << ": " << error_text;
+          });
+      CHECK(pack.AddCompilationUnit(unit, &error_text))
+          << path << ": " << error_text;
     }
-    CHECK(!coded_stream.HadError());
+  };
+  size_t jobs = std::min<size_t>(std::max(FLAGS_jobs, 1), kindex_files.size());
+  std::vector<std::thread> threads;
+  for (size_t i = 1; i < jobs; ++i) {
+    threads.emplace_back(convert);
+  }
+  convert();
+  for (auto& thread : threads) {
+    thread.join();
   }
-  CHECK(close(out_fd) == 0);
+}
+
+/// \brief Prints the units that each of `keys` maps to in the unit index of
+/// the index pack at `pack_root`.
+/// \return false if any lookup failed.
+static bool FindUnits(const std::string& pack_root,
+                      const std::vector<std::string>& keys) {
+  kythe::UnitIndex::KeyKind kind;
+  if (FLAGS_unit_key == "source") {
+    kind = kythe::UnitIndex::KeyKind::kSourceVName;
+  } else if (FLAGS_unit_key == "output") {
+    kind = kythe::UnitIndex::KeyKind::kOutputKey;
+  } else if (FLAGS_unit_key == "target") {
+    kind = kythe::UnitIndex::KeyKind::kBuildTarget;
+  } else {
+    fprintf(stderr, "Unknown -unit_key %s.\n", FLAGS_unit_key.c_str());
+    return false;
+  }
+  std::string error_text;
+  auto filesystem = kythe::OpenIndexPackFilesystem(
+      pack_root, kythe::IndexPackFilesystem::OpenMode::kReadOnly,
+      &error_text);
+  if (!filesystem) {
+    fprintf(stderr, "Couldn't open index pack in %s: %s\n", pack_root.c_str(),
+            error_text.c_str());
+    return false;
+  }
+  kythe::IndexPack pack(std::move(filesystem));
+  bool ok = true;
+  std::vector<std::string> hashes;
+  for (const auto& key : keys) {
+    std::string lookup = key;
+    if (kind == kythe::UnitIndex::KeyKind::kSourceVName) {
+      auto uri = kythe::URI::FromString(key);
+      if (!uri.first) {
+        fprintf(stderr, "%s isn't a Kythe URI.\n", key.c_str());
+        ok = false;
+        continue;
+      }
+      lookup = kythe::UnitIndex::SourceVNameKey(uri.second.v_name());
+    }
+    if (!pack.FindCompilationUnits(kind, lookup, &hashes, &error_text)) {
+      fprintf(stderr, "Couldn't look up %s: %s\n", key.c_str(),
+              error_text.c_str());
+      ok = false;
+      continue;
+    }
+    for (const auto& hash : hashes) {
+      printf("units/%s.unit\n", hash.c_str());
+    }
+  }
+  return ok;
+}
+
+/// \brief Rebuilds the unit index of the index pack at `pack_root`.
+/// \return false on failure.
+static bool RebuildUnitIndex(const std::string& pack_root) {
+  std::string error_text;
+  auto filesystem = kythe::OpenIndexPackFilesystem(
+      pack_root, kythe::IndexPackFilesystem::OpenMode::kReadWrite,
+      &error_text);
+  if (!filesystem) {
+    fprintf(stderr, "Couldn't open index pack in %s: %s\n", pack_root.c_str(),
+            error_text.c_str());
+    return false;
+  }
+  kythe::IndexPack pack(std::move(filesystem));
+  kythe::IndexPack::BatchReadOptions options;
+  options.parallelism = std::max(FLAGS_jobs, 1);
+  if (!pack.RebuildUnitIndex(options, &error_text)) {
+    fprintf(stderr, "Couldn't rebuild the unit index: %s\n",
+            error_text.c_str());
+    return false;
+  }
+  return true;
 }
 
 int main(int argc, char* argv[]) {
@@ -160,7 +405,19 @@ kindex_tool -explode some/file.kindex
 
 kindex_tool -assemble some/file.kindex some/unit some/content...
   assembles some/file.kindex using some/unit as the CompilationUnit and
-  any other input files as FileData)");
+  any other input files as FileData
+
+kindex_tool -to_index_pack some/pack some/file.kindex...
+  adds the unit and file data from each .kindex file to the index pack
+  rooted at some/pack
+
+kindex_tool -find_units some/pack [-unit_key=source|output|target] key...
+  prints the units in the index pack rooted at some/pack that each key
+  maps to in its unit index
+
+kindex_tool -rebuild_unit_index some/pack
+  rebuilds the unit index of the index pack rooted at some/pack, which is
+  needed before -find_units if the pack had units before it had an index)");
   gflags::ParseCommandLineFlags(&argc, &argv, true);
   if (!FLAGS_explode.empty()) {
     DumpIndexFile(FLAGS_explode);
@@ -168,8 +425,18 @@ kindex_tool -assemble some/file.kindex some/unit some/content...
     CHECK(argc >= 2) << "Need at least the unit.";
     std::vector<std::string> constituent_parts(argv + 1, argv + argc);
     BuildIndexFile(FLAGS_assemble, constituent_parts);
+  } else if (!FLAGS_to_index_pack.empty()) {
+    std::vector<std::string> kindex_files(argv + 1, argv + argc);
+    ConvertToIndexPack(FLAGS_to_index_pack, kindex_files);
+  } else if (!FLAGS_find_units.empty()) {
+    std::vector<std::string> keys(argv + 1, argv + argc);
+    return FindUnits(FLAGS_find_units, keys) ? 0 : 1;
+  } else if (!FLAGS_rebuild_unit_index.empty()) {
+    return RebuildUnitIndex(FLAGS_rebuild_unit_index) ? 0 : 1;
   } else {
-    fprintf(stderr, "Specify either -assemble or -explode.\n");
+    fprintf(stderr,
+            "Specify -assemble, -explode, -to_index_pack, -find_units or "
+            "-rebuild_unit_index.\n");
     return -1;
   }
   return 0;
@@ -0,0 +1,227 @@
+/*
+ * Copyright 2017 Google Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+// merge_entries: merges sorted entry streams into one
+//
+// bazel run //kythe/cxx/tools:merge_entries -- -o merged.entries
+//     out-00000-of-00064 out-00001-of-00064 ...
+// reads streams of delimited Entry messages, each sorted in GraphStore order
+// and without duplicates (like the indexer's output with
+// -experimental_sort_output), and writes one sorted stream in which each
+// entry appears once. Inputs may also be listed, one per line, in
+// -inputs_file.
+//
+// Output options follow the indexer's: -output_compression=snappy,
+// -output_format=entry_pack, or -leveldb_output to write a LevelDB
+// GraphStore instead of -o.
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <fstream>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "gflags/gflags.h"
+#include "glog/logging.h"
+#include "google/protobuf/io/zero_copy_stream_impl.h"
+#include "kythe/cxx/common/delimited_proto_reader.h"
+#include "kythe/cxx/common/indexing/entry_merger.h"
+#include "kythe/cxx/common/indexing/entry_pack.h"
+#include "kythe/cxx/common/indexing/leveldb_output_stream.h"
+#include "kythe/cxx/common/snappy_stream.h"
+#include "llvm/ADT/STLExtras.h"
+
+DEFINE_string(o, "-", "Output filename");
+DEFINE_string(inputs_file, "",
+              "Also merge the files named in this file, one per line.");
+DEFINE_string(input_compression, "none",
+              "Compression used for the inputs: \"none\" (or gzip, which is "
+              "detected) or \"snappy\".");
+DEFINE_string(output_compression, "none",
+              "Compress the output: \"none\" or \"snappy\".");
+DEFINE_uint64(compression_block_size, 1 << 20,
+              "With -output_compression=snappy, compress this many bytes at "
+              "a time.");
+DEFINE_bool(compression_thread, false,
+            "Compress and write output on a helper thread.");
+DEFINE_string(output_format, "entries",
+              "Write \"entries\" (a stream of delimited Entry messages) or "
+              "an \"entry_pack\" (see entry_pack.h).");
+DEFINE_string(leveldb_output, "",
+              "Write entries into a LevelDB GraphStore at this path instead "
+              "of to -o.");
+DEFINE_uint64(batch_bytes, 256 * 1024,
+              "Read this many bytes of entries from each input at a time.");
+DEFINE_uint64(prefetch_threads, 4, "Read inputs ahead on this many threads.");
+
+namespace {
+/// \brief The streams under a snappy-compressed input's reader.
+struct SnappyInput {
+  int fd = -1;
+  std::unique_ptr<google::protobuf::io::FileInputStream> file;
+  std::unique_ptr<kythe::SnappyFramedInputStream> snappy;
+  ~SnappyInput() {
+    snappy.reset();
+    file.reset();
+    if (fd >= 0) {
+      ::close(fd);
+    }
+  }
+};
+
+/// \brief Opens `path` as -input_compression directs. Exits on error.
+/// \param snappy_inputs Holds the streams a snappy input reads from.
+std::unique_ptr<kythe::DelimitedProtoReader> OpenInput(
+    const std::string &path,
+    std::vector<std::unique_ptr<SnappyInput>> *snappy_inputs) {
+  if (FLAGS_input_compression == "snappy") {
+    auto input = llvm::make_unique<SnappyInput>();
+    input->fd = ::open(path.c_str(), O_RDONLY);
+    if (input->fd < 0) {
+      ::perror(("Can't open " + path).c_str());
+      ::exit(1);
+    }
+    input->file.reset(new google::protobuf::io::FileInputStream(input->fd));
+    input->snappy.reset(new kythe::SnappyFramedInputStream(input->file.get()));
+    auto reader =
+        llvm::make_unique<kythe::DelimitedProtoReader>(input->snappy.get());
+    snappy_inputs->push_back(std::move(input));
+    return reader;
+  }
+  std::string error_text;
+  auto reader = kythe::DelimitedProtoReader::Open(path, false, &error_text);
+  if (!reader) {
+    fprintf(stderr, "%s\n", error_text.c_str());
+    ::exit(1);
+  }
+  return reader;
+}
+}  // anonymous namespace
+
+int main(int argc, char *argv[]) {
+  GOOGLE_PROTOBUF_VERIFY_VERSION;
+  gflags::SetVersionString("0.1");
+  gflags::SetUsageMessage(
+      "merge_entries [flags] sorted-entries ...: merge sorted entry streams");
+  gflags::ParseCommandLineFlags(&argc, &argv, true);
+  google::InitGoogleLogging(argv[0]);
+  CHECK(FLAGS_input_compression == "none" ||
+        FLAGS_input_compression == "snappy")
+      << "Unknown --input_compression.";
+  std::vector<std::string> paths(argv + 1, argv + argc);
+  if (!FLAGS_inputs_file.empty()) {
+    std::ifstream inputs_file(FLAGS_inputs_file);
+    CHECK(inputs_file) << "Can't open " << FLAGS_inputs_file;
+    for (std::string line; std::getline(inputs_file, line);) {
+      if (!line.empty()) {
+        paths.push_back(line);
+      }
+    }
+  }
+
+  // Set up the sink, as the indexer does for the same flags.
+  int fd = -1;
+  std::unique_ptr<google::protobuf::io::FileOutputStream> raw;
+  std::unique_ptr<kythe::SnappyFramedOutputStream> compressed;
+  std::unique_ptr<kythe::EntryPackOutputStream> packed;
+  std::unique_ptr<kythe::LevelDBOutputStream> leveldb_output;
+  std::unique_ptr<kythe::LevelDBEntrySink> leveldb_sink;
+  google::protobuf::io::ZeroCopyOutputStream *output = nullptr;
+  std::string error_text;
+  if (!FLAGS_leveldb_output.empty()) {
+    CHECK_EQ(FLAGS_output_compression, "none")
+        << "LevelDB output can't be compressed.";
+    CHECK_EQ(FLAGS_output_format, "entries")
+        << "LevelDB output has its own format.";
+    leveldb_output = llvm::make_unique<kythe::LevelDBOutputStream>();
+    if (!leveldb_output->Open(FLAGS_leveldb_output, &error_text)) {
+      fprintf(stderr, "Can't open LevelDB output: %s\n", error_text.c_str());
+      return 1;
+    }
+    leveldb_sink =
+        llvm::make_unique<kythe::LevelDBEntrySink>(leveldb_output.get());
+    output = leveldb_sink.get();
+  } else {
+    fd = FLAGS_o == "-" ? STDOUT_FILENO
+                        : ::open(FLAGS_o.c_str(), O_WRONLY | O_CREAT | O_TRUNC,
+                                 S_IREAD | S_IWRITE);
+    if (fd == -1) {
+      ::perror("Can't open output file");
+      return 1;
+    }
+    raw.reset(new google::protobuf::io::FileOutputStream(fd));
+    output = raw.get();
+    if (FLAGS_output_compression == "snappy") {
+      compressed = llvm::make_unique<kythe::SnappyFramedOutputStream>(
+          output, FLAGS_compression_block_size, FLAGS_compression_thread);
+      output = compressed.get();
+    } else {
+      CHECK_EQ(FLAGS_output_compression, "none")
+          << "Unknown --output_compression.";
+    }
+    if (FLAGS_output_format == "entry_pack") {
+      packed = llvm::make_unique<kythe::EntryPackOutputStream>(output);
+      output = packed.get();
+    } else {
+      CHECK_EQ(FLAGS_output_format, "entries") << "Unknown --output_format.";
+    }
+  }
+
+  std::vector<std::unique_ptr<SnappyInput>> snappy_inputs;
+  kythe::SortedEntryMerger::Options options;
+  options.batch_bytes = FLAGS_batch_bytes;
+  options.prefetch_threads = FLAGS_prefetch_threads;
+  size_t entries_read = 0, entries_written = 0;
+  {
+    kythe::SortedEntryMerger merger(output, options);
+    for (const auto &path : paths) {
+      merger.AddInput(path, OpenInput(path, &snappy_inputs));
+    }
+    if (!merger.Merge(&error_text)) {
+      fprintf(stderr, "Error merging entries: %s\n", error_text.c_str());
+      return 1;
+    }
+    entries_read = merger.entries_read();
+    entries_written = merger.entries_written();
+  }
+
+  if (leveldb_output) {
+    if (!leveldb_sink->Close(&error_text) ||
+        !leveldb_output->Close(&error_text)) {
+      fprintf(stderr, "Error writing LevelDB output: %s\n",
+              error_text.c_str());
+      return 1;
+    }
+  } else {
+    if (packed && !packed->Close(&error_text)) {
+      fprintf(stderr, "Error packing output: %s\n", error_text.c_str());
+      return 1;
+    }
+    if (compressed && !compressed->Close()) {
+      fprintf(stderr, "Error writing compressed output\n");
+      return 1;
+    }
+    if (!raw->Close()) {
+      ::perror("Error closing output file");
+      return 1;
+    }
+  }
+  fprintf(stderr, "Merged %zu inputs: read %zu entries, wrote %zu\n",
+          paths.size(), entries_read, entries_written);
+  return 0;
+}
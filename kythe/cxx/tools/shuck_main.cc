@@ -30,51 +30,118 @@
 //
 // The -slice_dependencies option will list all of the compilation units
 // making claims on the paths you pass in as well as all of the data files
-// on which they depend.
-
-#include <fcntl.h>
-#include <sys/stat.h>
+// on which they depend. With -transitive, units claiming those units'
+// dependencies are added too, and so on until nothing new is claimed.
+//
+// The -slice_to option writes that minimal index pack to a new directory.
+// Each unit and data file is published there without recompression: as a
+// reflink where the filesystem supports it, otherwise as a hard link, and
+// only otherwise as a copy (on -read_threads threads).
 
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <mutex>
 #include <set>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
 
 #include "gflags/gflags.h"
 #include "glog/logging.h"
-#include "google/protobuf/io/coded_stream.h"
-#include "google/protobuf/io/gzip_stream.h"
-#include "google/protobuf/io/zero_copy_stream_impl.h"
+#include "kythe/cxx/common/cxx_details.h"
+#include "kythe/cxx/common/delimited_proto_reader.h"
 #include "kythe/cxx/common/index_pack.h"
+#include "kythe/cxx/common/segmented_index_pack.h"
 #include "kythe/proto/analysis.pb.h"
 #include "kythe/proto/claim.pb.h"
 
+using kythe::IndexPackFilesystem;
+using kythe::IndexPackPosixFilesystem;
 using kythe::proto::ClaimAssignment;
 using kythe::proto::CompilationUnit;
 
 DEFINE_string(index_pack, "", "Read from this index pack.");
 DEFINE_string(static_claim, "", "Read from this claim file.");
 DEFINE_bool(slice_dependencies, false, "Describe a miminal index pack.");
+DEFINE_bool(transitive, false,
+            "Also slice the units that claim the dependencies of sliced "
+            "units, recursively.");
+DEFINE_string(slice_to, "", "Write a minimal index pack to this directory.");
+DEFINE_int32(read_threads, 8,
+             "Read compilation units and claims (and copy data for "
+             "-slice_to) on this many threads.");
 
-template <typename ProtoType, typename ClosureType>
-void ReadGzippedDelimitedProtoSequence(const std::string &path, ClosureType f) {
-  namespace io = ::google::protobuf::io;
-  int fd = ::open(path.c_str(), O_RDONLY, S_IREAD | S_IWRITE);
-  CHECK_GE(fd, 0) << "Couldn't open input file " << path << ": "
-                  << ::strerror(errno);
-  io::FileInputStream file_input_stream(fd);
-  io::GzipInputStream gzip_input_stream(&file_input_stream);
-  google::protobuf::uint32 byte_size;
-  for (;;) {
-    io::CodedInputStream coded_input_stream(&gzip_input_stream);
-    coded_input_stream.SetTotalBytesLimit(INT_MAX, -1);
-    if (!coded_input_stream.ReadVarint32(&byte_size)) {
-      break;
+namespace {
+/// \brief The parts of an index pack that make up a slice.
+struct Slice {
+  /// Indices of the units in the slice.
+  std::set<size_t> units;
+  /// Digests of the file data the units in the slice need.
+  std::set<std::string> files;
+};
+
+/// \brief Publishes `slice` of `source` in `target` on `FLAGS_read_threads`
+/// threads.
+/// \param unit_ids The names of all of the units in `source`.
+/// \return true if every unit and file was published.
+bool WriteSlice(const Slice &slice, const std::vector<std::string> &unit_ids,
+                IndexPackPosixFilesystem *source,
+                IndexPackPosixFilesystem *target) {
+  std::vector<std::pair<IndexPackFilesystem::DataKind, const std::string *>>
+      items;
+  for (size_t unit : slice.units) {
+    items.emplace_back(IndexPackFilesystem::DataKind::kCompilationUnit,
+                       &unit_ids[unit]);
+  }
+  for (const auto &file : slice.files) {
+    items.emplace_back(IndexPackFilesystem::DataKind::kFileData, &file);
+  }
+  std::atomic<size_t> next(0);
+  std::mutex mutex;
+  size_t methods[4] = {0, 0, 0, 0};
+  bool ok = true;
+  auto publish = [&] {
+    std::string error_text;
+    for (size_t i; (i = next++) < items.size();) {
+      IndexPackPosixFilesystem::CloneMethod method;
+      bool published = target->CloneFileContentFrom(
+          source, items[i].first, *items[i].second, &method, &error_text);
+      std::lock_guard<std::mutex> lock(mutex);
+      if (published) {
+        ++methods[static_cast<size_t>(method)];
+      } else {
+        ::fprintf(stderr, "Error publishing %s: %s\n",
+                  items[i].second->c_str(), error_text.c_str());
+        ok = false;
+      }
     }
-    coded_input_stream.PushLimit(byte_size);
-    ProtoType proto;
-    CHECK(proto.ParseFromCodedStream(&coded_input_stream));
-    f(proto);
+  };
+  std::vector<std::thread> threads;
+  for (int i = 1; i < FLAGS_read_threads; ++i) {
+    threads.emplace_back(publish);
+  }
+  publish();
+  for (auto &thread : threads) {
+    thread.join();
   }
-  ::close(fd);
+  ::fprintf(stderr,
+            "Sliced %zu units and %zu files: %zu already present, "
+            "%zu reflinked, %zu hard linked, %zu copied\n",
+            slice.units.size(), slice.files.size(),
+            methods[static_cast<size_t>(
+                IndexPackPosixFilesystem::CloneMethod::kAlreadyPresent)],
+            methods[static_cast<size_t>(
+                IndexPackPosixFilesystem::CloneMethod::kReflink)],
+            methods[static_cast<size_t>(
+                IndexPackPosixFilesystem::CloneMethod::kHardLink)],
+            methods[static_cast<size_t>(
+                IndexPackPosixFilesystem::CloneMethod::kCopy)]);
+  return ok;
 }
+}  // anonymous namespace
 
 int main(int argc, char *argv[]) {
   GOOGLE_PROTOBUF_VERIFY_VERSION;
@@ -84,52 +151,156 @@ int main(int argc, char *argv[]) {
   CHECK(!FLAGS_static_claim.empty()) << "Need a static claim table.";
   const std::set<std::string> paths(argv + 1, argv + argc);
   CHECK(!paths.empty()) << "Specify one or more paths.";
+  const bool slicing = FLAGS_slice_dependencies || !FLAGS_slice_to.empty();
   std::set<std::string> compilations;
-  ReadGzippedDelimitedProtoSequence<ClaimAssignment>(
-      FLAGS_static_claim,
-      [&compilations, &paths](const ClaimAssignment &claim) {
-        if (paths.count(claim.dependency_v_name().path())) {
-          compilations.insert(claim.compilation_v_name().signature());
-        }
-      });
+  // Who claims each path; only kept when the slice is transitive.
+  std::unordered_map<std::string, std::vector<std::string>> claimants;
   std::string error_text;
-  auto filesystem = kythe::IndexPackPosixFilesystem::Open(
-      FLAGS_index_pack, kythe::IndexPackFilesystem::OpenMode::kReadOnly,
-      &error_text);
+  CHECK(kythe::ForEachDelimitedMessage<ClaimAssignment>(
+      FLAGS_static_claim, std::max(FLAGS_read_threads, 1),
+      [&compilations, &paths, &claimants, slicing](ClaimAssignment *claim) {
+        if (paths.count(claim->dependency_v_name().path())) {
+          compilations.insert(claim->compilation_v_name().signature());
+        }
+        if (slicing && FLAGS_transitive) {
+          claimants[claim->dependency_v_name().path()].push_back(
+              claim->compilation_v_name().signature());
+        }
+      },
+      &error_text))
+      << error_text;
+  std::unique_ptr<IndexPackFilesystem> filesystem;
+  IndexPackPosixFilesystem *posix_source = nullptr;
+  if (!FLAGS_slice_to.empty()) {
+    // Blobs are published as-is, so they need to be separate files.
+    if (kythe::IndexPackSegmentedFilesystem::IsSegmented(FLAGS_index_pack)) {
+      ::fprintf(stderr, "-slice_to can't read segmented index packs.\n");
+      return 1;
+    }
+    auto posix = IndexPackPosixFilesystem::Open(
+        FLAGS_index_pack, IndexPackFilesystem::OpenMode::kReadOnly,
+        &error_text);
+    posix_source = posix.get();
+    filesystem = std::move(posix);
+  } else {
+    filesystem = kythe::OpenIndexPackFilesystem(
+        FLAGS_index_pack, IndexPackFilesystem::OpenMode::kReadOnly,
+        &error_text);
+  }
   if (!filesystem) {
     ::fprintf(stderr, "Error reading index pack: %s\n", error_text.c_str());
     return 1;
   }
   kythe::IndexPack pack(std::move(filesystem));
-  if (!pack.ScanData(
-          kythe::IndexPackFilesystem::DataKind::kCompilationUnit,
-          [&pack, &paths, &compilations](const std::string &file_id) {
-            std::string error_text;
-            CompilationUnit unit;
-            CHECK(pack.ReadCompilationUnit(file_id, &unit, &error_text))
-                << "Error reading unit " << file_id << ": " << error_text;
-            bool claimed = compilations.count(unit.v_name().signature());
-            for (const auto &input : unit.required_input()) {
-              if (paths.count(input.v_name().path())) {
-                if (!FLAGS_slice_dependencies || claimed) {
-                  ::printf("units/%s.unit\n", file_id.c_str());
-                  if (!FLAGS_slice_dependencies && claimed) {
-                    ::printf("# prev claim contains");
-                    for (const auto &arg : unit.source_file()) {
-                      ::printf(" %s", arg.c_str());
-                    }
-                    ::printf("\n");
-                  }
+  std::vector<std::string> file_ids;
+  if (!pack.ScanData(IndexPackFilesystem::DataKind::kCompilationUnit,
+                     [&file_ids](const std::string &file_id) {
+                       file_ids.push_back(file_id);
+                       return true;
+                     },
+                     &error_text)) {
+    ::fprintf(stderr, "Error scanning index pack: %s\n", error_text.c_str());
+  }
+  Slice slice;
+  // Paths whose claimants haven't been added to the slice yet.
+  std::set<std::string> frontier;
+  std::set<std::string> seen_paths(paths);
+  std::unordered_map<std::string, size_t> unit_by_signature;
+  auto add_to_slice = [&](size_t index, const CompilationUnit &unit) {
+    slice.units.insert(index);
+    std::string details_digest = kythe::SharedCxxDetailsDigest(unit);
+    if (!details_digest.empty()) {
+      slice.files.insert(details_digest);
+    }
+    for (const auto &input : unit.required_input()) {
+      slice.files.insert(input.info().digest());
+      if (FLAGS_transitive && seen_paths.insert(input.v_name().path()).second) {
+        frontier.insert(input.v_name().path());
+      }
+    }
+  };
+  kythe::IndexPack::BatchReadOptions options;
+  options.parallelism = std::max(FLAGS_read_threads, 1);
+  options.in_order = true;
+  pack.ReadCompilationUnitBatch(
+      file_ids, options,
+      [&](size_t index, bool ok, CompilationUnit *unit,
+          const std::string &error_text) {
+        const std::string &file_id = file_ids[index];
+        CHECK(ok) << "Error reading unit " << file_id << ": " << error_text;
+        bool claimed = compilations.count(unit->v_name().signature());
+        if (FLAGS_transitive) {
+          unit_by_signature.emplace(unit->v_name().signature(), index);
+        }
+        bool depends = false;
+        for (const auto &input : unit->required_input()) {
+          if (paths.count(input.v_name().path())) {
+            depends = true;
+            if (!slicing) {
+              ::printf("units/%s.unit\n", file_id.c_str());
+              if (claimed) {
+                ::printf("# prev claim contains");
+                for (const auto &arg : unit->source_file()) {
+                  ::printf(" %s", arg.c_str());
                 }
-              }
-              if (FLAGS_slice_dependencies && claimed) {
-                ::printf("files/%s.data\n", input.info().digest().c_str());
+                ::printf("\n");
               }
             }
-            return true;
-          },
-          &error_text)) {
-    ::fprintf(stderr, "Error scanning index pack: %s\n", error_text.c_str());
+          }
+        }
+        if (slicing && claimed && depends) {
+          add_to_slice(index, *unit);
+        }
+        return true;
+      });
+  // Add the claimants of the paths that the slice reached, until no new
+  // units are added.
+  while (!frontier.empty()) {
+    std::vector<std::string> new_ids;
+    std::vector<size_t> new_indices;
+    for (const auto &path : frontier) {
+      for (const auto &signature : claimants[path]) {
+        auto unit = unit_by_signature.find(signature);
+        if (unit != unit_by_signature.end() &&
+            !slice.units.count(unit->second)) {
+          new_ids.push_back(file_ids[unit->second]);
+          new_indices.push_back(unit->second);
+          // Reserve the unit so it isn't read twice in this round.
+          slice.units.insert(unit->second);
+        }
+      }
+    }
+    frontier.clear();
+    pack.ReadCompilationUnitBatch(
+        new_ids, options,
+        [&](size_t index, bool ok, CompilationUnit *unit,
+            const std::string &error_text) {
+          CHECK(ok) << "Error reading unit " << new_ids[index] << ": "
+                    << error_text;
+          add_to_slice(new_indices[index], *unit);
+          return true;
+        });
+  }
+  if (FLAGS_slice_dependencies) {
+    for (size_t unit : slice.units) {
+      ::printf("units/%s.unit\n", file_ids[unit].c_str());
+    }
+    for (const auto &file : slice.files) {
+      ::printf("files/%s.data\n", file.c_str());
+    }
+  }
+  if (!FLAGS_slice_to.empty()) {
+    auto target = IndexPackPosixFilesystem::Open(
+        FLAGS_slice_to, IndexPackFilesystem::OpenMode::kReadWrite,
+        &error_text);
+    if (!target) {
+      ::fprintf(stderr, "Error opening %s: %s\n", FLAGS_slice_to.c_str(),
+                error_text.c_str());
+      return 1;
+    }
+    if (!WriteSlice(slice, file_ids, posix_source, target.get())) {
+      return 1;
+    }
   }
   return 0;
 }
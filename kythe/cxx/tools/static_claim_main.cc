@@ -18,168 +18,356 @@
 // static_claim
 //   reads the names of .kindex files from standard input or an
 //   index pack and emits a static claim assignment to standard output
+//   (and, with --shard_dir, a claim shard for each unit)
 
 #include <fcntl.h>
 #include <sys/stat.h>
+#include <unistd.h>
 
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <condition_variable>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <functional>
 #include <iostream>
 #include <map>
+#include <memory>
+#include <mutex>
+#include <numeric>
 #include <set>
+#include <thread>
+#include <unordered_map>
+#include <vector>
 
 #include "gflags/gflags.h"
 #include "glog/logging.h"
 #include "google/protobuf/io/coded_stream.h"
 #include "google/protobuf/io/gzip_stream.h"
 #include "google/protobuf/io/zero_copy_stream_impl.h"
+#include "google/protobuf/text_format.h"
+#include "kythe/cxx/common/delimited_proto_reader.h"
 #include "kythe/cxx/common/index_pack.h"
+#include "kythe/cxx/common/indexing/claim_table.h"
+#include "kythe/cxx/common/segmented_index_pack.h"
 #include "kythe/cxx/common/vname_ordering.h"
 #include "kythe/proto/analysis.pb.h"
 #include "kythe/proto/claim.pb.h"
 
+using kythe::ClaimTable;
 using kythe::proto::ClaimAssignment;
 using kythe::proto::CompilationUnit;
 using kythe::proto::VName;
 
 DEFINE_bool(text, false, "Dump output as text instead of protobuf.");
+DEFINE_bool(table, false,
+            "Emit a hash-indexed claim table that indexers can map into "
+            "memory instead of a compressed stream of claims.");
 DEFINE_bool(show_stats, false, "Show some statistics.");
 DEFINE_string(index_pack, "", "Read from an index pack instead of stdin.");
-
-struct Claimable;
+DEFINE_int32(jobs, 1, "Read and parse this many compilation units at once.");
+DEFINE_string(balance, "count",
+              "How to balance claims: 'count' gives each claimable to the "
+              "candidate with the fewest claimables; 'size' and 'cost' weigh "
+              "claimables by file size or by --cost_file and even out the "
+              "claimed work of each unit.");
+DEFINE_string(cost_file, "",
+              "For --balance=cost, a file of '<cost> <path>' lines giving "
+              "the (historical) cost of indexing each file.");
+DEFINE_double(default_cost, 1.0,
+              "For --balance=cost, the cost of files not in --cost_file.");
+DEFINE_string(previous_claims, "",
+              "Update this claim stream (written by an earlier run) instead "
+              "of starting over. Only added and changed units need to be "
+              "read; claims held by other units are kept.");
+DEFINE_bool(claim_by_content, false,
+            "Claim each (content digest, preprocessor context) pair instead "
+            "of each (file, context) pair, so that identical files at "
+            "different paths are only indexed once. Each file's own VName is "
+            "also claimed, by the unit that emits its file node. Indexers "
+            "must be run with --experimental_claim_by_content.");
+DEFINE_string(removed_units, "",
+              "With --previous_claims, a file of VNames (in text format, one "
+              "per line) of units that were removed.");
+DEFINE_string(shard_dir, "",
+              "Also write a claim shard for each unit to this directory, "
+              "holding the claims on that unit's dependencies. Indexers "
+              "given --experimental_static_claim_shards load only the shards "
+              "of the units they index.");
 
 /// \brief Something (like a compilation unit) that can take responsibility for
 /// a claimable object.
 struct Claimant {
   /// \brief This Claimant's VName.
   VName vname;
-  /// \brief The set of confirmed claims that this Claimant has. Non-owning.
-  std::set<Claimable *> claims;
+  /// \brief False if this Claimant is only known from a previous claim
+  /// stream (as an unchanged unit).
+  bool read = true;
+  /// \brief The names of the claim shards to write for the units with this
+  /// VName (usually one).
+  std::vector<std::string> shards;
 };
 
-/// \brief Stably compares `Claimants` by vname.
-struct ClaimantPointerLess {
-  bool operator()(const Claimant *lhs, const Claimant *rhs) const {
-    return kythe::VNameLess()(lhs->vname, rhs->vname);
-  }
-};
+/// \brief Marks a claimable that no claimant has kept.
+constexpr uint32_t kNoClaimant = 0xffffffff;
 
 /// \brief An object (like a header transcript) that a Claimant can take
 /// responsibility for.
 struct Claimable {
   /// \brief This Claimable's VName.
   VName vname;
-  /// \brief Of the `claimants`, which one has responsibility. Non-owning.
-  Claimant *elected_claimant;
-  /// \brief All of the Claimants that can possibly be given responsibility.
-  std::set<Claimant *, ClaimantPointerLess> claimants;
+  /// \brief The indices of all of the Claimants that can possibly be given
+  /// responsibility. May contain duplicates.
+  std::vector<uint32_t> claimants;
+  /// \brief The estimated cost of indexing this Claimable.
+  double cost = 0.0;
+  /// \brief The claimant that keeps this Claimable from a previous claim
+  /// stream, or `kNoClaimant`.
+  uint32_t kept_claimant = kNoClaimant;
 };
 
 /// \brief Populates the compilation unit from a kindex.
 /// \param path Path to the .kindex file.
 /// \param unit Unit proto to fill.
-static void ReadCompilationUnit(const std::string &path,
-                                CompilationUnit *unit) {
-  namespace io = google::protobuf::io;
+/// \param file_sizes If non-null, filled with the size of each file in the
+/// kindex, keyed by digest.
+static void ReadCompilationUnit(
+    const std::string &path, CompilationUnit *unit,
+    std::unordered_map<std::string, size_t> *file_sizes) {
   CHECK(unit != nullptr);
+  std::string error_text;
+  // Units are already read on --jobs threads, so inflate on this one.
+  auto reader = kythe::DelimitedProtoReader::Open(path, false, &error_text);
+  CHECK(reader != nullptr) << "Couldn't open input file " << path << ": "
+                           << error_text;
+  CHECK(reader->NextMessage(unit))
+      << "Couldn't read compilation unit from " << path << ": "
+      << reader->error();
+  kythe::proto::FileData file_data;
+  while (file_sizes != nullptr && reader->NextMessage(&file_data)) {
+    (*file_sizes)[file_data.info().digest()] = file_data.content().size();
+  }
+  CHECK(reader->error().empty()) << "Couldn't read file data from " << path
+                                 << ": " << reader->error();
+}
+
+/// \brief Calls `handle` for every claim in a claim stream.
+/// \param path Path to a stream written by this tool (without `--text` or
+/// `--table`).
+static void ReadClaimStream(
+    const std::string &path,
+    const std::function<void(const ClaimAssignment &)> &handle) {
   int in_fd = ::open(path.c_str(), O_RDONLY, S_IREAD | S_IWRITE);
-  CHECK_GE(in_fd, 0) << "Couldn't open input file " << path;
-  io::FileInputStream file_input_stream(in_fd);
-  io::GzipInputStream gzip_input_stream(&file_input_stream);
-  io::CodedInputStream coded_input_stream(&gzip_input_stream);
-  google::protobuf::uint32 byte_size;
-  bool decoded_unit = false;
-  CHECK(coded_input_stream.ReadVarint32(&byte_size))
-      << "Couldn't find length of compilation unit in " << path;
-  auto limit = coded_input_stream.PushLimit(byte_size);
-  CHECK(unit->ParseFromCodedStream(&coded_input_stream))
-      << "Couldn't parse compilation unit from " << path;
-  coded_input_stream.PopLimit(limit);
-  CHECK(file_input_stream.Close());
+  CHECK_GE(in_fd, 0) << "Couldn't open claim stream " << path;
+  char magic[ClaimTable::kMagicSize];
+  ssize_t magic_size = ::pread(in_fd, magic, sizeof(magic), 0);
+  CHECK(::close(in_fd) == 0) << "errno was: " << errno;
+  CHECK(magic_size <= 0 ||
+        !ClaimTable::HasMagic(llvm::StringRef(magic, magic_size)))
+      << path << " is a claim table; only claim streams can be updated.";
+  std::string error_text;
+  CHECK(kythe::ForEachDelimitedMessage<ClaimAssignment>(
+      path, std::max(FLAGS_jobs, 1),
+      [&handle](ClaimAssignment *claim) { handle(*claim); }, &error_text))
+      << "Couldn't read claims: " << error_text;
 }
 
-/// \brief Maps from vnames to claimants (like compilation units).
-using ClaimantMap = std::map<VName, Claimant, kythe::VNameLess>;
+/// \brief Hashes `ClaimTable::Fingerprint`s (which are already uniformly
+/// distributed).
+struct FingerprintHash {
+  size_t operator()(const ClaimTable::Fingerprint &fingerprint) const {
+    size_t hash;
+    ::memcpy(&hash, fingerprint.data(), sizeof(hash));
+    return hash;
+  }
+};
 
-/// \brief Maps from vnames to claimables.
-///
-/// The vname for a claimable with a transcript (like a header file)
-/// is formed from the underlying vname with its signature changed to
-/// include the transcript as a prefix.
-using ClaimableMap = std::map<VName, Claimable, kythe::VNameLess>;
+/// \brief Receives a claim assignment.
+using ClaimCallback =
+    std::function<void(const VName &claimable, const VName &claimant)>;
+
+/// \brief Writes the claims that `assign` passes to its callback to
+/// `out_fd` as a gzip-compressed stream of varint-prefixed ClaimAssignments,
+/// then closes `out_fd`.
+static void WriteClaimStream(
+    int out_fd, const std::function<void(const ClaimCallback &)> &assign) {
+  namespace io = google::protobuf::io;
+  {
+    io::FileOutputStream file_output_stream(out_fd);
+    io::GzipOutputStream::Options options;
+    options.format = io::GzipOutputStream::GZIP;
+    io::GzipOutputStream gzip_stream(&file_output_stream, options);
+    io::CodedOutputStream coded_stream(&gzip_stream);
+    assign([&coded_stream](const VName &claimable, const VName &claimant) {
+      ClaimAssignment claim;
+      claim.mutable_compilation_v_name()->CopyFrom(claimant);
+      claim.mutable_dependency_v_name()->CopyFrom(claimable);
+      coded_stream.WriteVarint32(claim.ByteSize());
+      CHECK(claim.SerializeToCodedStream(&coded_stream));
+    });
+    CHECK(!coded_stream.HadError());
+  }
+  CHECK(::close(out_fd) == 0) << "errno was: " << errno;
+}
+
+/// \brief Estimates the cost of indexing a required input.
+using InputCost = std::function<double(const CompilationUnit::FileInput &)>;
+
+/// \brief Summarizes how much work an assignment gives each claimant.
+struct LoadStats {
+  /// The largest total cost claimed by a single claimant.
+  double max = 0.0;
+  /// The mean total cost claimed by a claimant.
+  double mean = 0.0;
+};
 
 /// \brief Generates and exports a mapping from claimants to claimables.
+///
+/// `HandleCompilationUnit` may be called from several threads at once.
+/// Claimables are kept in a table keyed by the fingerprints of their VNames
+/// and split into shards with their own locks; each lists its candidate
+/// claimants as indices into `claimants_`.
 class ClaimTool {
  public:
-  /// \brief Selects a claimant for every claimable.
+  /// \brief Selects a claimant for every claimable and passes each claim to
+  /// `emit`, releasing claimables as it goes. The tool is empty afterward.
   ///
-  /// We apply a simple heuristic: for every claimable, for every possible
-  /// claimant, we choose the claimant with the fewest claimables assigned to
-  /// it when trying to assign a new claimable.
-  void AssignClaims() {
-    // claimables_ is sorted by VName.
-    for (auto &claimable : claimables_) {
-      CHECK(!claimable.second.claimants.empty());
-      Claimant *emptiest_claimant = *claimable.second.claimants.begin();
-      // claimants is also sorted by VName, so this assignment should be stable.
-      for (auto &claimant : claimable.second.claimants) {
-        if (claimant->claims.size() < emptiest_claimant->claims.size()) {
-          emptiest_claimant = claimant;
-        }
+  /// Claimables are visited (and ties are broken) in VName order, so the
+  /// assignment doesn't depend on the order in which units were read.
+  ///
+  /// When updating previous claims, claims held by units that weren't read
+  /// (and weren't removed) are passed through. So are claims held by units
+  /// that were read and still depend on what they claim. Everything else
+  /// that the units read depend on is assigned again.
+  void AssignClaims(const ClaimCallback &emit) {
+    if (!previous_claims_.empty()) {
+      MatchPreviousClaims();
+    }
+    std::vector<uint32_t> by_vname(claimants_.size());
+    std::iota(by_vname.begin(), by_vname.end(), 0);
+    std::sort(by_vname.begin(), by_vname.end(), [this](uint32_t l, uint32_t r) {
+      return kythe::VNameLess()(claimants_[l].vname, claimants_[r].vname);
+    });
+    std::vector<uint32_t> rank(claimants_.size());
+    for (uint32_t i = 0; i < by_vname.size(); ++i) {
+      rank[by_vname[i]] = i;
+    }
+    std::vector<Claimable *> claimables;
+    claimables.reserve(claimable_count());
+    for (auto &shard : shards_) {
+      for (auto &claimable : shard.claimables) {
+        CHECK(!claimable.second.claimants.empty());
+        claimables.push_back(&claimable.second);
       }
-      emptiest_claimant->claims.insert(&claimable.second);
-      claimable.second.elected_claimant = emptiest_claimant;
+    }
+    std::sort(claimables.begin(), claimables.end(),
+              [](const Claimable *l, const Claimable *r) {
+                return kythe::VNameLess()(l->vname, r->vname);
+              });
+    std::vector<uint32_t> elected = AssignByCount(claimables, rank);
+    unbalanced_load_ = MeasureLoad(claimables, elected);
+    if (balance_by_cost_) {
+      elected = AssignByCost(claimables, rank);
+    }
+    balanced_load_ = MeasureLoad(claimables, elected);
+    if (!shard_directory_.empty()) {
+      WriteShards(claimables, elected);
+    }
+    if (!previous_claims_.empty()) {
+      ReadClaimStream(previous_claims_, [this, &emit](
+                                            const ClaimAssignment &claim) {
+        if (FindClaimable(claim.dependency_v_name()) != nullptr) {
+          // We've assigned this again (or kept it) below.
+          return;
+        }
+        auto claimant = claimant_index_.find(claim.compilation_v_name());
+        if (removed_claimants_.count(claim.compilation_v_name()) ||
+            (claimant != claimant_index_.end() &&
+             claimants_[claimant->second].read)) {
+          // No unit we know about depends on this anymore.
+          ++orphaned_claims_;
+          return;
+        }
+        ++kept_claims_;
+        emit(claim.dependency_v_name(), claim.compilation_v_name());
+      });
+    }
+    for (size_t i = 0; i < claimables.size(); ++i) {
+      emit(claimables[i]->vname, claimants_[elected[i]].vname);
+      VName().Swap(&claimables[i]->vname);
+      std::vector<uint32_t>().swap(claimables[i]->claimants);
+    }
+    for (auto &shard : shards_) {
+      shard.claimables.clear();
     }
   }
 
   /// \brief Export claim data to `out_fd` in the format specified by
-  /// `FLAGS_text`.
+  /// `FLAGS_text` and `FLAGS_table`.
   void WriteClaimFile(int out_fd) {
-    if (FLAGS_text) {
-      for (auto &claimable : claimables_) {
-        if (claimable.second.elected_claimant) {
-          ClaimAssignment claim;
-          claim.mutable_compilation_v_name()->CopyFrom(
-              claimable.second.elected_claimant->vname);
-          claim.mutable_dependency_v_name()->CopyFrom(claimable.second.vname);
-          ::printf("%s", claim.DebugString().c_str());
+    if (FLAGS_table) {
+      kythe::ClaimTable::Builder builder;
+      AssignClaims([&builder](const VName &claimable, const VName &claimant) {
+        builder.AssignClaim(claimable, claimant);
+      });
+      std::string table;
+      builder.Build(&table);
+      for (size_t written = 0; written < table.size();) {
+        ssize_t result =
+            ::write(out_fd, table.data() + written, table.size() - written);
+        if (result < 0 && errno == EINTR) {
+          continue;
         }
+        CHECK_GT(result, 0) << "errno was: " << errno;
+        written += result;
       }
+      CHECK(::close(out_fd) == 0) << "errno was: " << errno;
       return;
     }
-    namespace io = google::protobuf::io;
-    {
-      io::FileOutputStream file_output_stream(out_fd);
-      io::GzipOutputStream::Options options;
-      options.format = io::GzipOutputStream::GZIP;
-      io::GzipOutputStream gzip_stream(&file_output_stream, options);
-      io::CodedOutputStream coded_stream(&gzip_stream);
-      for (auto &claimable : claimables_) {
-        const auto &elected_claimant = claimable.second.elected_claimant;
-        if (elected_claimant) {
-          ClaimAssignment claim;
-          claim.mutable_compilation_v_name()->CopyFrom(elected_claimant->vname);
-          claim.mutable_dependency_v_name()->CopyFrom(claimable.second.vname);
-          coded_stream.WriteVarint32(claim.ByteSize());
-          CHECK(claim.SerializeToCodedStream(&coded_stream));
-        }
-      }
-      CHECK(!coded_stream.HadError());
+    if (FLAGS_text) {
+      AssignClaims([](const VName &claimable, const VName &claimant) {
+        ClaimAssignment claim;
+        claim.mutable_compilation_v_name()->CopyFrom(claimant);
+        claim.mutable_dependency_v_name()->CopyFrom(claimable);
+        ::printf("%s", claim.DebugString().c_str());
+      });
+      return;
     }
-    CHECK(::close(out_fd) == 0) << "errno was: " << errno;
+    WriteClaimStream(out_fd,
+                     [this](const ClaimCallback &emit) { AssignClaims(emit); });
   }
 
   /// \brief Add `unit` as a possible claimant and remember all of its
   /// dependencies (and their different transcripts) as claimables.
-  void HandleCompilationUnit(const CompilationUnit &unit) {
-    auto insert_result =
-        claimants_.emplace(unit.v_name(), Claimant{unit.v_name()});
-    if (!insert_result.second) {
-      LOG(WARNING) << "Compilation unit with name "
-                   << unit.v_name().DebugString()
-                   << " had the same VName as another previous unit.";
+  /// \param cost Estimates the cost of each of `unit`'s inputs.
+  void HandleCompilationUnit(const CompilationUnit &unit,
+                             const InputCost &cost) {
+    uint32_t claimant = AddClaimant(unit.v_name());
+    if (!shard_directory_.empty()) {
+      std::string shard = kythe::ClaimShardName(unit);
+      std::lock_guard<std::mutex> lock(claimants_mutex_);
+      claimants_[claimant].shards.push_back(std::move(shard));
     }
+    size_t input_count = 0, include_count = 0;
     for (auto &input : unit.required_input()) {
-      ++total_input_count_;
-      if (input.context().row_size()) {
+      ++input_count;
+      if (FLAGS_claim_by_content) {
+        AddCandidate(input.v_name(), claimant, 0.0);
+        for (const auto &row : input.context().row()) {
+          ++include_count;
+          AddCandidate(kythe::ContentClaimable(input.info().digest(),
+                                               row.source_context()),
+                       claimant, cost(input));
+        }
+        if (!input.context().row_size()) {
+          ++include_count;
+          AddCandidate(kythe::ContentClaimable(input.info().digest(), ""),
+                       claimant, cost(input));
+        }
+      } else if (input.context().row_size()) {
         VName input_vname = input.v_name();
         if (!input_vname.signature().empty()) {
           // We generally expect that file vnames have no signature.
@@ -194,39 +382,430 @@ class ClaimTool {
           // the file included at h with context c (otherwise the index file
           // isn't well-formed). We therefore only need to claim each unique
           // row.
-          ++total_include_count_;
+          ++include_count;
           VName cxt_vname = input_vname;
           cxt_vname.set_signature(row.source_context() +
                                   input_vname.signature());
-          auto input_insert_result =
-              claimables_.emplace(cxt_vname, Claimable{cxt_vname, nullptr});
-          input_insert_result.first->second.claimants.insert(
-              &insert_result.first->second);
+          AddCandidate(cxt_vname, claimant, cost(input));
         }
       } else {
-        ++total_include_count_;
-        auto input_insert_result = claimables_.emplace(
-            input.v_name(), Claimable{input.v_name(), nullptr});
-        input_insert_result.first->second.claimants.insert(
-            &insert_result.first->second);
+        ++include_count;
+        AddCandidate(input.v_name(), claimant, cost(input));
       }
     }
+    total_input_count_ += input_count;
+    total_include_count_ += include_count;
   }
 
-  const ClaimantMap &claimants() const { return claimants_; }
-  const ClaimableMap &claimables() const { return claimables_; }
+  size_t claimant_count() {
+    std::lock_guard<std::mutex> lock(claimants_mutex_);
+    return claimants_.size();
+  }
+  size_t claimable_count() {
+    size_t count = 0;
+    for (auto &shard : shards_) {
+      std::lock_guard<std::mutex> lock(shard.mutex);
+      count += shard.claimables.size();
+    }
+    return count;
+  }
   size_t total_include_count() const { return total_include_count_; }
   size_t total_input_count() const { return total_input_count_; }
 
+  /// \brief Balance claimed cost instead of claim counts?
+  void set_balance_by_cost(bool value) { balance_by_cost_ = value; }
+
+  /// \brief Updates the claims in the claim stream at `path` instead of
+  /// starting from scratch. Units that are read replace their previous
+  /// versions.
+  /// \param removed Units that no longer exist.
+  void set_previous_claims(const std::string &path,
+                           std::set<VName, kythe::VNameLess> removed) {
+    previous_claims_ = path;
+    removed_claimants_ = std::move(removed);
+  }
+
+  /// \brief Also writes a claim shard for each unit read to `directory`,
+  /// which must exist. Can't be combined with `set_previous_claims`, since
+  /// the shards of units that aren't read couldn't be brought up to date.
+  void set_shard_directory(const std::string &directory) {
+    shard_directory_ = directory;
+  }
+
+  /// \return the number of claim shards written.
+  size_t shards_written() const { return shards_written_; }
+
+  /// \return the number of previous claims that were kept.
+  size_t kept_claims() const { return kept_claims_; }
+  /// \return the number of previous claims that no known unit needs.
+  size_t orphaned_claims() const { return orphaned_claims_; }
+
+  /// \return the load of the assignment made by counting claims.
+  const LoadStats &unbalanced_load() const { return unbalanced_load_; }
+  /// \return the load of the assignment that was written.
+  const LoadStats &balanced_load() const { return balanced_load_; }
+
  private:
+  /// \brief A slice of the claimable table.
+  struct Shard {
+    /// Guards `claimables`.
+    std::mutex mutex;
+    /// Resources that may be claimed, keyed by VName fingerprint.
+    std::unordered_map<ClaimTable::Fingerprint, Claimable, FingerprintHash>
+        claimables;
+  };
+
+  /// \return the index of the claimant for `vname`, adding it if needed.
+  /// \param read Whether the claimant is a unit that was read.
+  uint32_t AddClaimant(const VName &vname, bool read = true) {
+    std::lock_guard<std::mutex> lock(claimants_mutex_);
+    auto inserted = claimant_index_.emplace(vname, claimants_.size());
+    if (inserted.second) {
+      claimants_.push_back(Claimant{vname, read});
+    } else if (read) {
+      LOG(WARNING) << "Compilation unit with name " << vname.DebugString()
+                   << " had the same VName as another previous unit.";
+    }
+    return inserted.first->second;
+  }
+
+  /// \return the claimable for `vname`, or null if no unit read needs it.
+  Claimable *FindClaimable(const VName &vname) {
+    ClaimTable::Fingerprint fingerprint;
+    ClaimTable::FingerprintVName(vname, &fingerprint);
+    auto &shard = shards_[fingerprint.back() % shards_.size()];
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    auto found = shard.claimables.find(fingerprint);
+    return found == shard.claimables.end() ? nullptr : &found->second;
+  }
+
+  /// \brief Decides which claimables keep their claimants from
+  /// `previous_claims_`.
+  void MatchPreviousClaims() {
+    ReadClaimStream(previous_claims_, [this](const ClaimAssignment &claim) {
+      const auto &owner = claim.compilation_v_name();
+      Claimable *claimable = FindClaimable(claim.dependency_v_name());
+      if (claimable == nullptr || removed_claimants_.count(owner)) {
+        return;
+      }
+      auto found = claimant_index_.find(owner);
+      if (found == claimant_index_.end()) {
+        // The owner didn't change, so it still depends on the claimable.
+        claimable->kept_claimant = AddClaimant(owner, false);
+      } else if (!claimants_[found->second].read ||
+                 std::find(claimable->claimants.begin(),
+                           claimable->claimants.end(),
+                           found->second) != claimable->claimants.end()) {
+        claimable->kept_claimant = found->second;
+      }
+      if (claimable->kept_claimant != kNoClaimant) {
+        ++kept_claims_;
+      }
+    });
+  }
+
+  /// \brief For every claimable, chooses the candidate claimant with the
+  /// fewest claimables assigned to it so far.
+  /// \param claimables Claimables in VName order.
+  /// \param rank The VName order of each claimant.
+  /// \return the claimant elected for each claimable.
+  std::vector<uint32_t> AssignByCount(
+      const std::vector<Claimable *> &claimables,
+      const std::vector<uint32_t> &rank) const {
+    std::vector<size_t> claim_counts(claimants_.size(), 0);
+    std::vector<uint32_t> elected(claimables.size());
+    for (size_t i = 0; i < claimables.size(); ++i) {
+      if (claimables[i]->kept_claimant != kNoClaimant) {
+        elected[i] = claimables[i]->kept_claimant;
+        ++claim_counts[elected[i]];
+        continue;
+      }
+      uint32_t emptiest_claimant = claimables[i]->claimants.front();
+      for (uint32_t claimant : claimables[i]->claimants) {
+        size_t claims = claim_counts[claimant];
+        size_t emptiest_claims = claim_counts[emptiest_claimant];
+        if (claims < emptiest_claims ||
+            (claims == emptiest_claims &&
+             rank[claimant] < rank[emptiest_claimant])) {
+          emptiest_claimant = claimant;
+        }
+      }
+      ++claim_counts[emptiest_claimant];
+      elected[i] = emptiest_claimant;
+    }
+    return elected;
+  }
+
+  /// \brief Greedily evens out the cost claimed by each claimant.
+  ///
+  /// Claimables that are kept or that have a single candidate are assigned
+  /// first, since those loads can't be moved. The rest are assigned from most
+  /// to least costly, each to the candidate with the least claimed cost so
+  /// far (the classic longest-processing-time-first heuristic).
+  /// \param claimables Claimables in VName order.
+  /// \param rank The VName order of each claimant.
+  /// \return the claimant elected for each claimable.
+  std::vector<uint32_t> AssignByCost(const std::vector<Claimable *> &claimables,
+                                     const std::vector<uint32_t> &rank) const {
+    auto is_forced = [&claimables](size_t i) {
+      if (claimables[i]->kept_claimant != kNoClaimant) {
+        return true;
+      }
+      const auto &candidates = claimables[i]->claimants;
+      return std::all_of(
+          candidates.begin(), candidates.end(),
+          [&candidates](uint32_t c) { return c == candidates.front(); });
+    };
+    std::vector<size_t> order(claimables.size());
+    std::iota(order.begin(), order.end(), 0);
+    std::stable_sort(order.begin(), order.end(),
+                     [&claimables, &is_forced](size_t l, size_t r) {
+                       bool l_forced = is_forced(l), r_forced = is_forced(r);
+                       if (l_forced != r_forced) {
+                         return l_forced;
+                       }
+                       return claimables[l]->cost > claimables[r]->cost;
+                     });
+    std::vector<double> loads(claimants_.size(), 0.0);
+    std::vector<uint32_t> elected(claimables.size());
+    for (size_t i : order) {
+      if (claimables[i]->kept_claimant != kNoClaimant) {
+        elected[i] = claimables[i]->kept_claimant;
+        loads[elected[i]] += claimables[i]->cost;
+        continue;
+      }
+      uint32_t lightest_claimant = claimables[i]->claimants.front();
+      for (uint32_t claimant : claimables[i]->claimants) {
+        double load = loads[claimant];
+        double lightest_load = loads[lightest_claimant];
+        if (load < lightest_load ||
+            (load == lightest_load &&
+             rank[claimant] < rank[lightest_claimant])) {
+          lightest_claimant = claimant;
+        }
+      }
+      loads[lightest_claimant] += claimables[i]->cost;
+      elected[i] = lightest_claimant;
+    }
+    return elected;
+  }
+
+  /// \brief Writes the claim shard of every unit that was read: the claims
+  /// on each claimable that the unit is a candidate for, whoever won them.
+  /// \param claimables Claimables in VName order.
+  /// \param elected The claimant elected for each claimable.
+  void WriteShards(const std::vector<Claimable *> &claimables,
+                   const std::vector<uint32_t> &elected) {
+    std::vector<std::vector<uint32_t>> shard_claims(claimants_.size());
+    for (uint32_t i = 0; i < claimables.size(); ++i) {
+      for (uint32_t claimant : claimables[i]->claimants) {
+        auto &claims = shard_claims[claimant];
+        // Candidates may be listed more than once.
+        if (claims.empty() || claims.back() != i) {
+          claims.push_back(i);
+        }
+      }
+    }
+    for (uint32_t claimant = 0; claimant < claimants_.size(); ++claimant) {
+      for (const auto &shard : claimants_[claimant].shards) {
+        std::string path = shard_directory_ + "/" + shard;
+        int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        CHECK_GE(fd, 0) << "Couldn't open " << path << ": errno was " << errno;
+        WriteClaimStream(fd, [&](const ClaimCallback &emit) {
+          for (uint32_t i : shard_claims[claimant]) {
+            emit(claimables[i]->vname, claimants_[elected[i]].vname);
+          }
+        });
+        ++shards_written_;
+      }
+      std::vector<uint32_t>().swap(shard_claims[claimant]);
+    }
+  }
+
+  /// \return the load that `elected` puts on claimants.
+  LoadStats MeasureLoad(const std::vector<Claimable *> &claimables,
+                        const std::vector<uint32_t> &elected) const {
+    // We only know the full load of units that were read.
+    std::vector<double> loads(claimants_.size(), 0.0);
+    double total = 0.0;
+    for (size_t i = 0; i < claimables.size(); ++i) {
+      if (claimants_[elected[i]].read) {
+        loads[elected[i]] += claimables[i]->cost;
+        total += claimables[i]->cost;
+      }
+    }
+    size_t read_count = std::count_if(
+        claimants_.begin(), claimants_.end(),
+        [](const Claimant &claimant) { return claimant.read; });
+    LoadStats stats;
+    if (read_count != 0) {
+      stats.max = *std::max_element(loads.begin(), loads.end());
+      stats.mean = total / read_count;
+    }
+    return stats;
+  }
+
+  /// \brief Makes `claimant` a candidate for the claimable `vname`.
+  void AddCandidate(const VName &vname, uint32_t claimant, double cost) {
+    ClaimTable::Fingerprint fingerprint;
+    ClaimTable::FingerprintVName(vname, &fingerprint);
+    auto &shard = shards_[fingerprint.back() % shards_.size()];
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    auto inserted = shard.claimables.emplace(fingerprint, Claimable());
+    auto &claimable = inserted.first->second;
+    if (inserted.second) {
+      claimable.vname = vname;
+    }
+    claimable.cost = std::max(claimable.cost, cost);
+    if (claimable.claimants.empty() || claimable.claimants.back() != claimant) {
+      claimable.claimants.push_back(claimant);
+    }
+  }
+
+  /// Guards `claimant_index_` and `claimants_`.
+  std::mutex claimants_mutex_;
+  /// Maps from claimant VNames to indices in `claimants_`.
+  std::map<VName, uint32_t, kythe::VNameLess> claimant_index_;
   /// Objects that may claim resources.
-  ClaimantMap claimants_;
+  std::vector<Claimant> claimants_;
   /// Resources that may be claimed.
-  ClaimableMap claimables_;
-  /// Number of required inputs.
-  size_t total_include_count_ = 0;
+  std::array<Shard, 64> shards_;
   /// Number of #includes.
-  size_t total_input_count_ = 0;
+  std::atomic<size_t> total_include_count_{0};
+  /// Number of required inputs.
+  std::atomic<size_t> total_input_count_{0};
+  /// Balance claimed cost instead of claim counts?
+  bool balance_by_cost_ = false;
+  /// The claim stream to update, if any.
+  std::string previous_claims_;
+  /// Units that were removed since `previous_claims_` was written.
+  std::set<VName, kythe::VNameLess> removed_claimants_;
+  /// The directory to write claim shards to, or empty.
+  std::string shard_directory_;
+  /// The number of claim shards written.
+  size_t shards_written_ = 0;
+  /// The number of previous claims that were kept.
+  size_t kept_claims_ = 0;
+  /// The number of previous claims that no known unit needs.
+  size_t orphaned_claims_ = 0;
+  /// The load of the assignment made by counting claims.
+  LoadStats unbalanced_load_;
+  /// The load of the assignment that was written.
+  LoadStats balanced_load_;
+};
+
+/// \brief Reads a file of text-format VNames, one per line.
+/// \return false if the file couldn't be read or parsed.
+static bool ReadVNameList(const std::string &path,
+                          std::set<VName, kythe::VNameLess> *vnames) {
+  std::ifstream input(path);
+  if (!input) {
+    return false;
+  }
+  std::string line;
+  while (std::getline(input, line)) {
+    if (line.empty()) {
+      continue;
+    }
+    VName vname;
+    if (!google::protobuf::TextFormat::ParseFromString(line, &vname)) {
+      return false;
+    }
+    vnames->insert(vname);
+  }
+  return input.eof();
+}
+
+/// \brief Reads a cost file made of `<cost> <path>` lines.
+/// \return false if the file couldn't be read.
+static bool ReadCostFile(const std::string &path,
+                         std::unordered_map<std::string, double> *costs) {
+  std::ifstream input(path);
+  if (!input) {
+    return false;
+  }
+  std::string line;
+  while (std::getline(input, line)) {
+    size_t space = line.find(' ');
+    if (line.empty() || space == std::string::npos) {
+      continue;
+    }
+    (*costs)[line.substr(space + 1)] = std::atof(line.c_str());
+  }
+  return input.eof();
+}
+
+/// \brief Hands strings (like paths) from one producer to a pool of workers,
+/// holding only a bounded number of them at once.
+class WorkQueue {
+ public:
+  /// \param workers The number of threads to run `handle` on.
+  /// \param capacity The number of items to hold before `Push` blocks.
+  WorkQueue(size_t workers, size_t capacity,
+            std::function<void(const std::string &)> handle)
+      : capacity_(capacity), handle_(std::move(handle)) {
+    for (size_t i = 0; i < workers; ++i) {
+      workers_.emplace_back([this]() { Work(); });
+    }
+  }
+
+  /// \brief Queues `item`, waiting for room if the queue is full.
+  void Push(std::string item) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    room_.wait(lock, [this]() { return items_.size() < capacity_; });
+    items_.push_back(std::move(item));
+    ready_.notify_one();
+  }
+
+  /// \brief Waits for every queued item to be handled.
+  void Finish() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      done_ = true;
+    }
+    ready_.notify_all();
+    for (auto &worker : workers_) {
+      worker.join();
+    }
+    workers_.clear();
+  }
+
+  ~WorkQueue() { Finish(); }
+
+ private:
+  void Work() {
+    for (;;) {
+      std::string item;
+      {
+        std::unique_lock<std::mutex> lock(mutex_);
+        ready_.wait(lock, [this]() { return done_ || !items_.empty(); });
+        if (items_.empty()) {
+          return;
+        }
+        item = std::move(items_.front());
+        items_.pop_front();
+        room_.notify_one();
+      }
+      handle_(item);
+    }
+  }
+
+  /// The number of items to queue before `Push` blocks.
+  size_t capacity_;
+  /// Handles each item.
+  std::function<void(const std::string &)> handle_;
+  /// Guards `items_` and `done_`.
+  std::mutex mutex_;
+  /// Signalled when an item is queued or the queue is finished.
+  std::condition_variable ready_;
+  /// Signalled when an item is dequeued.
+  std::condition_variable room_;
+  /// Items waiting to be handled.
+  std::deque<std::string> items_;
+  /// Set once no more items will be pushed.
+  bool done_ = false;
+  /// The worker threads.
+  std::vector<std::thread> workers_;
 };
 
 int main(int argc, char *argv[]) {
@@ -237,14 +816,122 @@ int main(int argc, char *argv[]) {
   gflags::ParseCommandLineFlags(&argc, &argv, true);
   std::string next_index_file;
   ClaimTool tool;
+  if (FLAGS_balance != "count" && FLAGS_balance != "size" &&
+      FLAGS_balance != "cost") {
+    ::fprintf(stderr, "Unknown --balance mode %s.\n", FLAGS_balance.c_str());
+    return 1;
+  }
+  tool.set_balance_by_cost(FLAGS_balance != "count");
+  if (!FLAGS_previous_claims.empty()) {
+    std::set<VName, kythe::VNameLess> removed;
+    if (!FLAGS_removed_units.empty() &&
+        !ReadVNameList(FLAGS_removed_units, &removed)) {
+      ::fprintf(stderr, "Couldn't read removed units from %s.\n",
+                FLAGS_removed_units.c_str());
+      return 1;
+    }
+    tool.set_previous_claims(FLAGS_previous_claims, std::move(removed));
+  }
+  if (!FLAGS_shard_dir.empty()) {
+    if (!FLAGS_previous_claims.empty()) {
+      ::fprintf(stderr, "--shard_dir can't be used with --previous_claims.\n");
+      return 1;
+    }
+    if (::mkdir(FLAGS_shard_dir.c_str(), 0755) != 0 && errno != EEXIST) {
+      ::fprintf(stderr, "Couldn't create %s: %s\n", FLAGS_shard_dir.c_str(),
+                ::strerror(errno));
+      return 1;
+    }
+    tool.set_shard_directory(FLAGS_shard_dir);
+  }
+  std::unordered_map<std::string, double> cost_table;
+  if (FLAGS_balance == "cost" && !ReadCostFile(FLAGS_cost_file, &cost_table)) {
+    ::fprintf(stderr, "Couldn't read cost file %s.\n",
+              FLAGS_cost_file.c_str());
+    return 1;
+  }
+  // Estimates costs for --balance=count and --balance=cost.
+  InputCost input_cost = [&cost_table](
+      const CompilationUnit::FileInput &input) {
+    if (FLAGS_balance == "count") {
+      return 1.0;
+    }
+    auto found = cost_table.find(input.v_name().path());
+    return found == cost_table.end() ? FLAGS_default_cost : found->second;
+  };
+  std::unique_ptr<kythe::IndexPack> pack;
+  // Reads, parses and remembers the unit with the given path or file ID.
+  std::function<void(const std::string &)> handle_unit;
   if (FLAGS_index_pack.empty()) {
+    handle_unit = [&tool, &input_cost](const std::string &path) {
+      CompilationUnit unit;
+      if (FLAGS_balance != "size") {
+        ReadCompilationUnit(path, &unit, nullptr);
+        tool.HandleCompilationUnit(unit, input_cost);
+        return;
+      }
+      std::unordered_map<std::string, size_t> file_sizes;
+      ReadCompilationUnit(path, &unit, &file_sizes);
+      tool.HandleCompilationUnit(
+          unit, [&file_sizes](const CompilationUnit::FileInput &input) {
+            auto found = file_sizes.find(input.info().digest());
+            return found == file_sizes.end() ? 0.0 : found->second;
+          });
+    };
+  } else {
+    std::string error_text;
+    auto filesystem = kythe::OpenIndexPackFilesystem(
+        FLAGS_index_pack, kythe::IndexPackFilesystem::OpenMode::kReadOnly,
+        &error_text);
+    if (!filesystem) {
+      ::fprintf(stderr, "Error reading index pack: %s\n", error_text.c_str());
+      return 1;
+    }
+    pack = std::unique_ptr<kythe::IndexPack>(
+        new kythe::IndexPack(std::move(filesystem)));
+    if (FLAGS_balance == "size") {
+      // Files are shared between units, so only read each one once.
+      auto file_sizes =
+          std::make_shared<std::unordered_map<std::string, size_t>>();
+      auto file_sizes_mutex = std::make_shared<std::mutex>();
+      input_cost = [&pack, file_sizes, file_sizes_mutex](
+          const CompilationUnit::FileInput &input) {
+        const auto &digest = input.info().digest();
+        {
+          std::lock_guard<std::mutex> lock(*file_sizes_mutex);
+          auto found = file_sizes->find(digest);
+          if (found != file_sizes->end()) {
+            return static_cast<double>(found->second);
+          }
+        }
+        std::string content;
+        size_t size = pack->ReadFileData(digest, &content) ? content.size() : 0;
+        std::lock_guard<std::mutex> lock(*file_sizes_mutex);
+        (*file_sizes)[digest] = size;
+        return static_cast<double>(size);
+      };
+    }
+    handle_unit = [&tool, &pack, &input_cost](const std::string &file_id) {
+      std::string error_text;
+      CompilationUnit unit;
+      CHECK(pack->ReadCompilationUnit(file_id, &unit, &error_text))
+          << "Error reading unit " << file_id << ": " << error_text;
+      tool.HandleCompilationUnit(unit, input_cost);
+    };
+  }
+  std::unique_ptr<WorkQueue> queue;
+  // Handles a unit now or hands it to a worker.
+  std::function<void(const std::string &)> add_unit = handle_unit;
+  if (FLAGS_jobs > 1) {
+    queue.reset(new WorkQueue(FLAGS_jobs, FLAGS_jobs * 4, handle_unit));
+    add_unit = [&queue](const std::string &name) { queue->Push(name); };
+  }
+  if (!pack) {
     while (getline(std::cin, next_index_file)) {
       if (next_index_file.empty()) {
         continue;
       }
-      CompilationUnit unit;
-      ReadCompilationUnit(next_index_file, &unit);
-      tool.HandleCompilationUnit(unit);
+      add_unit(next_index_file);
     }
     if (!std::cin.eof()) {
       ::fprintf(stderr, "Error reading from standard input.\n");
@@ -252,38 +939,43 @@ int main(int argc, char *argv[]) {
     }
   } else {
     std::string error_text;
-    auto filesystem = kythe::IndexPackPosixFilesystem::Open(
-        FLAGS_index_pack, kythe::IndexPackFilesystem::OpenMode::kReadOnly,
-        &error_text);
-    if (!filesystem) {
-      ::fprintf(stderr, "Error reading index pack: %s\n", error_text.c_str());
-      return 1;
-    }
-    kythe::IndexPack pack(std::move(filesystem));
-    if (!pack.ScanData(
-            kythe::IndexPackFilesystem::DataKind::kCompilationUnit,
-            [&tool, &pack](const std::string &file_id) {
-              std::string error_text;
-              CompilationUnit unit;
-              CHECK(pack.ReadCompilationUnit(file_id, &unit, &error_text))
-                  << "Error reading unit " << file_id << ": " << error_text;
-              tool.HandleCompilationUnit(unit);
-              return true;
-            },
-            &error_text)) {
+    if (!pack->ScanData(kythe::IndexPackFilesystem::DataKind::kCompilationUnit,
+                        [&add_unit](const std::string &file_id) {
+                          add_unit(file_id);
+                          return true;
+                        },
+                        &error_text)) {
       ::fprintf(stderr, "Error scanning index pack: %s\n", error_text.c_str());
       return 1;
     }
   }
-  tool.AssignClaims();
+  if (queue) {
+    queue->Finish();
+  }
+  size_t claimable_count = tool.claimable_count();
+  size_t claimant_count = tool.claimant_count();
   tool.WriteClaimFile(STDOUT_FILENO);
   if (FLAGS_show_stats) {
-    ::printf("Number of claimables: %lu\n", tool.claimables().size());
-    ::printf(" Number of claimants: %lu\n", tool.claimants().size());
+    ::printf("Number of claimables: %lu\n", claimable_count);
+    ::printf(" Number of claimants: %lu\n", claimant_count);
     ::printf("   Total input count: %lu\n", tool.total_input_count());
     ::printf(" Total include count: %lu\n", tool.total_include_count());
     ::printf("%%claimables/includes: %f\n",
-             tool.claimables().size() * 100.0 / tool.total_include_count());
+             claimable_count * 100.0 / tool.total_include_count());
+    // Loads are measured in claimables for --balance=count.
+    const auto &before = tool.unbalanced_load();
+    const auto &after = tool.balanced_load();
+    ::printf("Max/mean load before: %f/%f (%f imbalance)\n", before.max,
+             before.mean, before.mean == 0.0 ? 0.0 : before.max / before.mean);
+    ::printf(" Max/mean load after: %f/%f (%f imbalance)\n", after.max,
+             after.mean, after.mean == 0.0 ? 0.0 : after.max / after.mean);
+    if (!FLAGS_shard_dir.empty()) {
+      ::printf(" Claim shards written: %lu\n", tool.shards_written());
+    }
+    if (!FLAGS_previous_claims.empty()) {
+      ::printf("Kept/orphaned claims: %lu/%lu\n", tool.kept_claims(),
+               tool.orphaned_claims());
+    }
   }
   return 0;
 }
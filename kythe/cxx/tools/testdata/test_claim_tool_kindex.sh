@@ -12,3 +12,6 @@ mkdir -p "${OUT_DIR}"
   "${BASE_DIR}/claim_test_2.kindex_UNIT"
 ls "${OUT_DIR}"/claim_test_*.kindex | "${CLAIM_TOOL_BIN}" -text \
     | diff "${BASE_DIR}/claim_test.expected" -
+# Reading units in parallel shouldn't change the assignment.
+ls "${OUT_DIR}"/claim_test_*.kindex | "${CLAIM_TOOL_BIN}" -text -jobs=4 \
+    | diff "${BASE_DIR}/claim_test.expected" -
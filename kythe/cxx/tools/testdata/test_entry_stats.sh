@@ -0,0 +1,21 @@
+#!/bin/bash -e
+# This script checks that entry_stats tallies entries and stitches nodes that
+# span batches.
+BASE_DIR="$PWD/kythe/cxx/tools/testdata"
+OUT_DIR="$TEST_TMPDIR"
+STATS_BIN="kythe/cxx/tools/entry_stats"
+ENTRYSTREAM_BIN="kythe/go/platform/tools/entrystream/entrystream"
+mkdir -p "${OUT_DIR}"
+"${ENTRYSTREAM_BIN}" --read_json < "${BASE_DIR}/entry_stats_test.json" \
+    > "${OUT_DIR}/entries"
+"${STATS_BIN}" -threads 4 -batch_size 1 -top_nodes 1 "${OUT_DIR}/entries" \
+    "${OUT_DIR}/entries" > "${OUT_DIR}/stats.out"
+grep -q "^12 entries, " "${OUT_DIR}/stats.out"
+grep -Eq "^ +6 +[0-9]+  /kythe/node/kind$" "${OUT_DIR}/stats.out"
+grep -Eq "^ +4 +[0-9]+  /kythe/edge/childof$" "${OUT_DIR}/stats.out"
+grep -Eq "^ +2 +[0-9]+  function$" "${OUT_DIR}/stats.out"
+grep -Eq "^ +10 +[0-9]+  c:a$" "${OUT_DIR}/stats.out"
+grep -Eq "^ +2 +[0-9]+  c:x$" "${OUT_DIR}/stats.out"
+# The three entries about f are one node even though each is in its own batch.
+tail -n 1 "${OUT_DIR}/stats.out" | \
+    grep -Eq "^ +3 +[0-9]+  kythe://c\?path=a/b.cc#f$"
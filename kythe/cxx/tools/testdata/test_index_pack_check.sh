@@ -0,0 +1,33 @@
+#!/bin/bash -e
+# This script checks that index_pack_check finds orphaned and corrupt data.
+BASE_DIR="$PWD/kythe/cxx/tools/testdata"
+OUT_DIR="$TEST_TMPDIR"
+KINDEX_TOOL_BIN="kythe/cxx/tools/kindex_tool"
+CHECK_TOOL_BIN="kythe/cxx/tools/index_pack_check"
+INDEX_PACK_BIN="kythe/go/platform/tools/indexpack/indexpack"
+mkdir -p "${OUT_DIR}"
+rm -rf -- "${OUT_DIR}/pack"
+"${KINDEX_TOOL_BIN}" -assemble "${OUT_DIR}/claim_test_1.kindex" \
+  "${BASE_DIR}/claim_test_1.kindex_UNIT"
+"${INDEX_PACK_BIN}" --to_archive "${OUT_DIR}/pack" \
+    "${OUT_DIR}/claim_test_1.kindex" >/dev/null
+"${CHECK_TOOL_BIN}" -index_pack "${OUT_DIR}/pack" > "${OUT_DIR}/clean.out"
+diff /dev/null "${OUT_DIR}/clean.out"
+# Add file data that nothing refers to.
+ORPHAN_SHA=$(printf orphan | sha256sum | cut -d' ' -f1)
+printf orphan | gzip > "${OUT_DIR}/pack/files/${ORPHAN_SHA}.data"
+"${CHECK_TOOL_BIN}" -index_pack "${OUT_DIR}/pack" > "${OUT_DIR}/orphan.out"
+echo "orphan files/${ORPHAN_SHA}.data" | diff - "${OUT_DIR}/orphan.out"
+"${CHECK_TOOL_BIN}" -index_pack "${OUT_DIR}/pack" -delete_orphans \
+    > "${OUT_DIR}/delete.out"
+echo "deleted files/${ORPHAN_SHA}.data" | diff - "${OUT_DIR}/delete.out"
+test ! -e "${OUT_DIR}/pack/files/${ORPHAN_SHA}.data"
+# Replace some referenced data with the wrong content.
+VICTIM=$(ls "${OUT_DIR}/pack/files" | head -n 1)
+printf corrupt | gzip > "${OUT_DIR}/pack/files/${VICTIM}"
+if "${CHECK_TOOL_BIN}" -index_pack "${OUT_DIR}/pack" \
+    > "${OUT_DIR}/corrupt.out"; then
+  echo "expected index_pack_check to fail" >&2
+  exit 1
+fi
+grep -q "^corrupt files/${VICTIM}: " "${OUT_DIR}/corrupt.out"
@@ -14,3 +14,20 @@ mkdir -p "${OUT_DIR}"
 diff "${BASE_DIR}/java.kindex_UNIT" "${OUT_DIR}/test.kindex_UNIT"
 diff "${BASE_DIR}/java.kindex_cf28b786fa21d0c45156e8011ac809afc454703fa03d767a5aeeed382f902795" \
     "${OUT_DIR}/test.kindex_cf28b786fa21d0c45156e8011ac809afc454703fa03d767a5aeeed382f902795"
+
+# Compressing records in parallel writes the same records.
+"${KINDEX_TOOL_BIN}" -assemble "${OUT_DIR}/parallel.kindex" \
+  -compression_threads=4 \
+  "${BASE_DIR}/java.kindex_UNIT" \
+  "${BASE_DIR}/java.kindex_cf28b786fa21d0c45156e8011ac809afc454703fa03d767a5aeeed382f902795"
+"${KINDEX_TOOL_BIN}" -explode "${OUT_DIR}/parallel.kindex"
+diff "${BASE_DIR}/java.kindex_UNIT" "${OUT_DIR}/parallel.kindex_UNIT"
+diff "${BASE_DIR}/java.kindex_cf28b786fa21d0c45156e8011ac809afc454703fa03d767a5aeeed382f902795" \
+    "${OUT_DIR}/parallel.kindex_cf28b786fa21d0c45156e8011ac809afc454703fa03d767a5aeeed382f902795"
+
+# Both files hold the same unit, so the pack ends up with one of each.
+rm -rf -- "${OUT_DIR}/pack"
+"${KINDEX_TOOL_BIN}" -to_index_pack "${OUT_DIR}/pack" -jobs=2 \
+  "${OUT_DIR}/test.kindex" "${OUT_DIR}/parallel.kindex"
+[[ $(ls "${OUT_DIR}/pack/units" | wc -l) -eq 1 ]]
+[[ -f "${OUT_DIR}/pack/files/cf28b786fa21d0c45156e8011ac809afc454703fa03d767a5aeeed382f902795.data" ]]
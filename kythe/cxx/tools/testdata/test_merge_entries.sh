@@ -0,0 +1,24 @@
+#!/bin/bash -e
+# This script checks that merge_entries merges sorted streams into the same
+# stream that sorting them all together would produce.
+BASE_DIR="$PWD/kythe/cxx/tools/testdata"
+OUT_DIR="$TEST_TMPDIR"
+MERGE_BIN="kythe/cxx/tools/merge_entries"
+ENTRYSTREAM_BIN="kythe/go/platform/tools/entrystream/entrystream"
+mkdir -p "${OUT_DIR}"
+head -n 3 "${BASE_DIR}/entry_stats_test.json" | \
+    "${ENTRYSTREAM_BIN}" --read_json --unique > "${OUT_DIR}/first"
+# The second input overlaps the first.
+tail -n 4 "${BASE_DIR}/entry_stats_test.json" | \
+    "${ENTRYSTREAM_BIN}" --read_json --unique > "${OUT_DIR}/second"
+"${ENTRYSTREAM_BIN}" --read_json --unique \
+    < "${BASE_DIR}/entry_stats_test.json" > "${OUT_DIR}/expected"
+"${MERGE_BIN}" -o "${OUT_DIR}/merged" -batch_bytes 1 \
+    "${OUT_DIR}/first" "${OUT_DIR}/second" "${OUT_DIR}/first"
+cmp "${OUT_DIR}/expected" "${OUT_DIR}/merged"
+# Out-of-order input is rejected.
+cat "${OUT_DIR}/second" "${OUT_DIR}/first" > "${OUT_DIR}/unsorted"
+if "${MERGE_BIN}" -o "${OUT_DIR}/merged" "${OUT_DIR}/unsorted" 2>/dev/null; then
+  echo "expected merge_entries to fail" >&2
+  exit 1
+fi
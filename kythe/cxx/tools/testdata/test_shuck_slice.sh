@@ -0,0 +1,31 @@
+#!/bin/bash -e
+# This script checks that shuck can write a sliced index pack.
+BASE_DIR="$PWD/kythe/cxx/tools/testdata"
+OUT_DIR="$TEST_TMPDIR"
+KINDEX_TOOL_BIN="kythe/cxx/tools/kindex_tool"
+CLAIM_TOOL_BIN="kythe/cxx/tools/static_claim"
+SHUCK_BIN="kythe/cxx/tools/shuck"
+CHECK_TOOL_BIN="kythe/cxx/tools/index_pack_check"
+INDEX_PACK_BIN="kythe/go/platform/tools/indexpack/indexpack"
+mkdir -p "${OUT_DIR}"
+rm -rf -- "${OUT_DIR}/pack" "${OUT_DIR}/slice"
+"${KINDEX_TOOL_BIN}" -assemble "${OUT_DIR}/claim_test_1.kindex" \
+  "${BASE_DIR}/claim_test_1.kindex_UNIT"
+"${KINDEX_TOOL_BIN}" -assemble "${OUT_DIR}/claim_test_2.kindex" \
+  "${BASE_DIR}/claim_test_2.kindex_UNIT"
+"${INDEX_PACK_BIN}" --to_archive "${OUT_DIR}/pack" \
+    "${OUT_DIR}"/claim_test_*.kindex >/dev/null
+"${CLAIM_TOOL_BIN}" -index_pack "${OUT_DIR}/pack" > "${OUT_DIR}/claims"
+"${SHUCK_BIN}" -index_pack "${OUT_DIR}/pack" \
+    -static_claim "${OUT_DIR}/claims" -slice_dependencies \
+    -slice_to "${OUT_DIR}/slice" b.h > "${OUT_DIR}/slice.txt"
+# Only claim_test_2 claims b.h.
+test "$(grep -c '^units/' "${OUT_DIR}/slice.txt")" -eq 1
+# The slice has exactly what was listed and nothing is missing from it.
+(cd "${OUT_DIR}/slice" && ls units/*.unit files/*.data) \
+    | sort | diff <(sort "${OUT_DIR}/slice.txt") -
+"${CHECK_TOOL_BIN}" -index_pack "${OUT_DIR}/slice"
+# Slicing again publishes nothing new.
+"${SHUCK_BIN}" -index_pack "${OUT_DIR}/pack" \
+    -static_claim "${OUT_DIR}/claims" -slice_to "${OUT_DIR}/slice" b.h \
+    2>&1 | grep -q ' 0 reflinked, 0 hard linked, 0 copied'
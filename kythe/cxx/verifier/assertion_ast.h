@@ -18,10 +18,13 @@
 #define KYTHE_CXX_VERIFIER_ASSERTION_AST_H_
 
 #include <algorithm>
+#include <memory>
+#include <string>
 #include <unordered_map>
 #include <vector>
 
 #include "glog/logging.h"
+#include "llvm/ADT/StringRef.h"
 
 #include "kythe/cxx/verifier/location.hh"
 #include "pretty_printer.h"
@@ -34,52 +37,88 @@ namespace verifier {
 typedef size_t Symbol;
 
 /// \brief Maps strings to `Symbol`s.
+///
+/// The text of each symbol is copied once into large blocks owned by the
+/// table. Symbols are found through an open-addressing hash table that
+/// stores each symbol's hash, so most probes don't need to look at text.
 class SymbolTable {
  public:
+  SymbolTable() : slots_(kInitialSlotCount) {}
+  SymbolTable(const SymbolTable &) = delete;
+  SymbolTable &operator=(const SymbolTable &) = delete;
+
   /// \brief Returns the `Symbol` associated with `string`, or makes a new one.
-  Symbol intern(const std::string &string) {
-    const auto old = symbols_.find(string);
-    if (old != symbols_.end()) {
-      return old->second;
-    }
-    Symbol next_symbol = reverse_map_.size();
-    symbols_[string] = next_symbol;
-    // Note that references to elements of `unordered_map` are not invalidated
-    // upon insert (really, upon rehash), so keeping around pointers in
-    // `reverse_map_` is safe.
-    reverse_map_.push_back(&symbols_.find(string)->first);
-    return next_symbol;
-  }
-  /// \brief Returns the text associated with `symbol`.
-  const std::string &text(Symbol symbol) const { return *reverse_map_[symbol]; }
+  Symbol intern(llvm::StringRef string);
+
+  /// \brief Makes room for `count` symbols in total without rehashing.
+  void Reserve(size_t count);
+
+  /// \brief Returns the text associated with `symbol`. The text lives as long
+  /// as the table.
+  llvm::StringRef text(Symbol symbol) const { return texts_[symbol]; }
 
   /// \brief Returns a string associated with `symbol` that disambiguates
   /// nonces.
   std::string PrettyText(Symbol symbol) const {
-    auto *text = reverse_map_[symbol];
-    if (text == &unique_symbol_) {
+    llvm::StringRef text = texts_[symbol];
+    if (text.data() == kUniqueText) {
       return "(unique#" + std::to_string(symbol) + ")";
-    } else if (!text->empty()) {
-      return *text;
+    } else if (!text.empty()) {
+      return text.str();
     } else {
       return "\"\"";
     }
   }
 
+  /// \brief Prints the same text as `PrettyText(symbol)` to `printer`
+  /// without copying it first.
+  void PrintPrettyText(Symbol symbol, PrettyPrinter *printer) const {
+    llvm::StringRef text = texts_[symbol];
+    if (text.data() == kUniqueText) {
+      printer->Print(PrettyText(symbol));
+    } else if (!text.empty()) {
+      printer->Print(text);
+    } else {
+      printer->Print("\"\"");
+    }
+  }
+
   /// \brief Returns a `Symbol` that can never be spelled (but which still has
   /// a printable name).
   Symbol unique() {
-    reverse_map_.push_back(&unique_symbol_);
-    return reverse_map_.size() - 1;
+    texts_.push_back(llvm::StringRef(kUniqueText));
+    hashes_.push_back(0);
+    return texts_.size() - 1;
   }
 
  private:
-  /// Maps text to unique `Symbol`s.
-  std::unordered_map<std::string, Symbol> symbols_;
-  /// Maps `Symbol`s back to their original text.
-  std::vector<const std::string *> reverse_map_;
+  /// An entry in the open-addressing table: a symbol plus one, or zero if
+  /// the slot is empty.
+  using Slot = size_t;
+  /// The number of slots in a new table. Must be a power of two.
+  static constexpr size_t kInitialSlotCount = 1024;
+  /// The size of the blocks that hold symbol text.
+  static constexpr size_t kTextBlockSize = 1 << 20;
   /// The text to use for unique() symbols.
-  std::string unique_symbol_ = "(unique)";
+  static const char kUniqueText[];
+
+  /// \brief Copies `string` into a text block.
+  llvm::StringRef CopyText(llvm::StringRef string);
+  /// \brief Rebuilds `slots_` with room for at least `slot_count` slots.
+  void Rehash(size_t slot_count);
+
+  /// Maps hashes to symbols. Its size is a power of two, and it is kept no
+  /// more than half full.
+  std::vector<Slot> slots_;
+  /// Maps `Symbol`s back to their original text.
+  std::vector<llvm::StringRef> texts_;
+  /// The hash of each `Symbol`'s text.
+  std::vector<size_t> hashes_;
+  /// Blocks holding symbol text.
+  std::vector<std::unique_ptr<char[]>> text_blocks_;
+  /// The unused part of the last block in `text_blocks_`.
+  char *next_text_ = nullptr;
+  size_t text_left_ = 0;
 };
 
 /// \brief Performs bump-pointer allocation of pointer-aligned memory.
@@ -124,6 +163,25 @@ class Arena {
     return current_block_ + offset_ - bytes;
   }
 
+  /// \brief A point in an `Arena`'s allocation history.
+  struct Mark {
+    size_t offset;
+    size_t next_block_index;
+    char *current_block;
+  };
+
+  /// \brief Returns the current point in the allocation history.
+  Mark mark() const { return Mark{offset_, next_block_index_, current_block_}; }
+
+  /// \brief Releases everything allocated since `mark` was taken. The memory
+  /// is kept and reused for later allocations.
+  /// \warning Objects allocated since `mark` must no longer be referenced.
+  void Rewind(const Mark &mark) {
+    offset_ = mark.offset;
+    next_block_index_ = mark.next_block_index;
+    current_block_ = mark.current_block;
+  }
+
  private:
   /// The size of a pointer on this machine. We support only machines with
   /// power-of-two address size and alignment requirements.
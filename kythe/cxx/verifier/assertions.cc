@@ -16,13 +16,104 @@
 
 #include "assertions.h"
 
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
 #include <sstream>
+#include <unordered_set>
 
+#include "llvm/ADT/Hashing.h"
 #include "verifier.h"
 
 namespace kythe {
 namespace verifier {
 
+const char SymbolTable::kUniqueText[] = "(unique)";
+constexpr size_t SymbolTable::kInitialSlotCount;
+constexpr size_t SymbolTable::kTextBlockSize;
+
+Symbol SymbolTable::intern(llvm::StringRef string) {
+  size_t hash = llvm::hash_value(string);
+  size_t mask = slots_.size() - 1;
+  for (size_t slot = hash & mask;; slot = (slot + 1) & mask) {
+    Slot entry = slots_[slot];
+    if (entry == 0) {
+      break;
+    }
+    Symbol symbol = entry - 1;
+    if (hashes_[symbol] == hash && texts_[symbol] == string) {
+      return symbol;
+    }
+  }
+  Symbol symbol = texts_.size();
+  texts_.push_back(CopyText(string));
+  hashes_.push_back(hash);
+  if (2 * (symbol + 1) > slots_.size()) {
+    Rehash(2 * slots_.size());
+  } else {
+    for (size_t slot = hash & mask;; slot = (slot + 1) & mask) {
+      if (slots_[slot] == 0) {
+        slots_[slot] = symbol + 1;
+        break;
+      }
+    }
+  }
+  return symbol;
+}
+
+void SymbolTable::Reserve(size_t count) {
+  size_t slot_count = slots_.size();
+  while (2 * count > slot_count) {
+    slot_count *= 2;
+  }
+  if (slot_count != slots_.size()) {
+    Rehash(slot_count);
+  }
+  texts_.reserve(count);
+  hashes_.reserve(count);
+}
+
+void SymbolTable::Rehash(size_t slot_count) {
+  slots_.assign(slot_count, 0);
+  size_t mask = slot_count - 1;
+  for (Symbol symbol = 0; symbol < texts_.size(); ++symbol) {
+    if (texts_[symbol].data() == kUniqueText) {
+      // unique() symbols can't be looked up.
+      continue;
+    }
+    for (size_t slot = hashes_[symbol] & mask;; slot = (slot + 1) & mask) {
+      if (slots_[slot] == 0) {
+        slots_[slot] = symbol + 1;
+        break;
+      }
+    }
+  }
+}
+
+llvm::StringRef SymbolTable::CopyText(llvm::StringRef string) {
+  if (string.empty()) {
+    return llvm::StringRef();
+  }
+  char *copy;
+  if (string.size() > kTextBlockSize / 4) {
+    // Give big strings (like file text) blocks of their own so that they
+    // don't waste the rest of the current block.
+    text_blocks_.emplace_back(new char[string.size()]);
+    copy = text_blocks_.back().get();
+  } else {
+    if (string.size() > text_left_) {
+      text_blocks_.emplace_back(new char[kTextBlockSize]);
+      next_text_ = text_blocks_.back().get();
+      text_left_ = kTextBlockSize;
+    }
+    copy = next_text_;
+    next_text_ += string.size();
+    text_left_ -= string.size();
+  }
+  memcpy(copy, string.data(), string.size());
+  return llvm::StringRef(copy, string.size());
+}
+
 void EVar::Dump(const SymbolTable &symbol_table, PrettyPrinter *printer) {
   printer->Print("EVar(");
   printer->Print(this);
@@ -36,15 +127,13 @@ void EVar::Dump(const SymbolTable &symbol_table, PrettyPrinter *printer) {
 }
 
 void Identifier::Dump(const SymbolTable &symbol_table, PrettyPrinter *printer) {
-  printer->Print(symbol_table.PrettyText(symbol_));
+  symbol_table.PrintPrettyText(symbol_, printer);
 }
 
 void Range::Dump(const SymbolTable &symbol_table, PrettyPrinter *printer) {
-  printer->Print("Range(");
-  printer->Print(std::to_string(begin_));
-  printer->Print(",");
-  printer->Print(std::to_string(end_));
-  printer->Print(")");
+  char buf[64];
+  int size = snprintf(buf, sizeof(buf), "Range(%zu,%zu)", begin_, end_);
+  printer->Print(llvm::StringRef(buf, size));
 }
 
 void Tuple::Dump(const SymbolTable &symbol_table, PrettyPrinter *printer) {
@@ -111,7 +200,7 @@ bool AssertionParser::CheckForSingletonEVars() {
   for (const auto &singleton : singleton_evars_) {
     Error(singleton.first->location(),
           "singleton variable " +
-              verifier_.symbol_table()->text(singleton.second) +
+              verifier_.symbol_table()->text(singleton.second).str() +
               " used only here");
   }
   had_errors_ = old_had_errors;
@@ -127,6 +216,22 @@ AssertionParser::AssertionParser(Verifier *verifier, bool trace_lex,
   groups_.push_back(GoalGroup{GoalGroup::kNoneMayFail});
 }
 
+void AssertionParser::Reset() {
+  groups_.clear();
+  groups_.push_back(GoalGroup{GoalGroup::kNoneMayFail});
+  inside_goal_group_ = false;
+  unresolved_locations_.clear();
+  node_stack_.clear();
+  location_spec_stack_.clear();
+  files_.clear();
+  line_.clear();
+  had_errors_ = false;
+  inspections_.clear();
+  identifier_context_.clear();
+  evar_context_.clear();
+  singleton_evars_.clear();
+}
+
 bool AssertionParser::Unescape(const char *yytext, std::string *out) {
   if (out == nullptr || *yytext != '\"') {
     return false;
@@ -561,5 +666,455 @@ void AssertionParser::ScanBeginFile(const RE2 &goal_comment_regex,
   ScanBeginString(goal_comment_regex, buffer, trace_scanning);
 }
 
+namespace {
+/// Starts (and versions) serialized rules.
+constexpr char kSerializedRulesMagic[] = "kythe-verifier-rules 1\n";
+
+/// The kinds of records for nodes in serialized rules.
+enum SerializedNodeKind : uint64_t {
+  kSerializedBuiltin,     ///< One of the verifier's own identifiers.
+  kSerializedIdentifier,  ///< An identifier no other file can share.
+  kSerializedInterned,    ///< An identifier shared with other rule files.
+  kSerializedEVar,        ///< An EVar, with its name if it has one.
+  kSerializedRange,       ///< A `Range`.
+  kSerializedTuple,       ///< A `Tuple` of earlier nodes.
+  kSerializedApp          ///< An `App` of earlier nodes.
+};
+
+void AppendVarint(uint64_t value, std::string *out) {
+  while (value >= 0x80) {
+    out->push_back(static_cast<char>((value & 0x7F) | 0x80));
+    value >>= 7;
+  }
+  out->push_back(static_cast<char>(value));
+}
+
+void AppendString(llvm::StringRef text, std::string *out) {
+  AppendVarint(text.size(), out);
+  out->append(text.data(), text.size());
+}
+
+/// \brief Reads what `AppendVarint` and `AppendString` wrote. Once a read
+/// fails, every later read fails too.
+class SerializedRulesReader {
+ public:
+  explicit SerializedRulesReader(llvm::StringRef data) : data_(data) {}
+
+  uint64_t Varint() {
+    uint64_t value = 0;
+    for (unsigned shift = 0; ok_ && !data_.empty() && shift < 64;
+         shift += 7) {
+      uint8_t byte = data_.front();
+      data_ = data_.drop_front();
+      value |= static_cast<uint64_t>(byte & 0x7F) << shift;
+      if (!(byte & 0x80)) {
+        return value;
+      }
+    }
+    ok_ = false;
+    return 0;
+  }
+
+  /// \brief Reads a varint that must be less than `limit`.
+  uint64_t Index(uint64_t limit) {
+    uint64_t value = Varint();
+    if (value >= limit) {
+      ok_ = false;
+      return 0;
+    }
+    return value;
+  }
+
+  /// \brief Reads a count of things that take at least a byte each.
+  uint64_t Count() { return Index(data_.size() + 1); }
+
+  llvm::StringRef String() {
+    uint64_t size = Count();
+    llvm::StringRef text = data_.take_front(size);
+    data_ = data_.drop_front(size);
+    return text;
+  }
+
+  yy::location Location(const std::string *file) {
+    yy::location location;
+    for (yy::position *position : {&location.begin, &location.end}) {
+      uint64_t has_file = Index(2);
+      position->filename = has_file ? file : nullptr;
+      position->line = static_cast<decltype(position->line)>(Varint());
+      position->column = static_cast<decltype(position->column)>(Varint());
+    }
+    return location;
+  }
+
+  /// \brief Makes this and every later read fail.
+  void Fail() { ok_ = false; }
+
+  bool ok() const { return ok_; }
+
+  /// \brief Whether everything was read without error.
+  bool done() const { return ok_ && data_.empty(); }
+
+ private:
+  llvm::StringRef data_;
+  bool ok_ = true;
+};
+}  // anonymous namespace
+
+/// \brief Numbers the nodes reachable from some goals and writes each one
+/// after the nodes it refers to.
+class AssertionParser::SerializedRulesWriter {
+ public:
+  SerializedRulesWriter(const AssertionParser &parser,
+                        std::vector<AstNode *> builtins)
+      : symbol_table_(*parser.verifier_.symbol_table()),
+        file_(&parser.files_.back()),
+        builtins_(std::move(builtins)) {
+    for (const auto &binding : parser.identifier_context_) {
+      interned_.insert(binding.second);
+    }
+    for (const auto &binding : parser.evar_context_) {
+      names_.emplace(binding.second, binding.first);
+    }
+    for (const auto &singleton : parser.singleton_evars_) {
+      singletons_.insert(singleton.first);
+    }
+  }
+
+  /// \brief Writes `node` (if it hasn't been already) and sets `index` to
+  /// its number.
+  /// \return false if `node` can't be serialized.
+  bool Add(AstNode *node, uint64_t *index) {
+    auto found = indices_.find(node);
+    if (found != indices_.end()) {
+      *index = found->second;
+      return true;
+    }
+    std::string record;
+    auto builtin = std::find(builtins_.begin(), builtins_.end(), node);
+    if (builtin != builtins_.end()) {
+      AppendVarint(kSerializedBuiltin, &record);
+      AppendVarint(builtin - builtins_.begin(), &record);
+    } else if (Identifier *id = node->AsIdentifier()) {
+      AppendVarint(interned_.count(id) ? kSerializedInterned
+                                       : kSerializedIdentifier,
+                   &record);
+      if (!AppendLocation(id->location(), &record)) {
+        return false;
+      }
+      AppendString(symbol_table_.text(id->symbol()), &record);
+    } else if (EVar *evar = node->AsEVar()) {
+      uint64_t current = 0;
+      if (evar->current() != nullptr) {
+        if (!Add(evar->current(), &current)) {
+          return false;
+        }
+        ++current;
+      }
+      auto name = names_.find(evar);
+      AppendVarint(kSerializedEVar, &record);
+      if (!AppendLocation(evar->location(), &record)) {
+        return false;
+      }
+      if (name == names_.end()) {
+        AppendVarint(0, &record);
+      } else {
+        // Named EVars are only ever bound by solving.
+        if (current != 0) {
+          return false;
+        }
+        AppendVarint(singletons_.count(evar) ? 2 : 1, &record);
+        AppendString(symbol_table_.text(name->second), &record);
+      }
+      AppendVarint(current, &record);
+    } else if (Range *range = node->AsRange()) {
+      AppendVarint(kSerializedRange, &record);
+      if (!AppendLocation(range->location(), &record)) {
+        return false;
+      }
+      AppendVarint(range->begin(), &record);
+      AppendVarint(range->end(), &record);
+    } else if (Tuple *tuple = node->AsTuple()) {
+      std::vector<uint64_t> elements(tuple->size());
+      for (size_t e = 0; e < tuple->size(); ++e) {
+        if (!Add(tuple->element(e), &elements[e])) {
+          return false;
+        }
+      }
+      AppendVarint(kSerializedTuple, &record);
+      if (!AppendLocation(tuple->location(), &record)) {
+        return false;
+      }
+      AppendVarint(elements.size(), &record);
+      for (uint64_t element : elements) {
+        AppendVarint(element, &record);
+      }
+    } else if (App *app = node->AsApp()) {
+      uint64_t lhs, rhs;
+      if (!Add(app->lhs(), &lhs) || !Add(app->rhs(), &rhs)) {
+        return false;
+      }
+      AppendVarint(kSerializedApp, &record);
+      if (!AppendLocation(app->location(), &record)) {
+        return false;
+      }
+      AppendVarint(lhs, &record);
+      AppendVarint(rhs, &record);
+    } else {
+      return false;
+    }
+    nodes_.append(record);
+    *index = indices_.size();
+    indices_.emplace(node, *index);
+    return true;
+  }
+
+  /// \brief Appends the number of nodes and the nodes themselves to `out`.
+  void Finish(std::string *out) const {
+    AppendVarint(indices_.size(), out);
+    out->append(nodes_);
+  }
+
+ private:
+  /// \brief Appends `location`, which must be in the file being written.
+  bool AppendLocation(const yy::location &location, std::string *out) {
+    for (const yy::position *position : {&location.begin, &location.end}) {
+      if (position->filename != nullptr && position->filename != file_) {
+        return false;
+      }
+      AppendVarint(position->filename != nullptr, out);
+      AppendVarint(position->line, out);
+      AppendVarint(position->column, out);
+    }
+    return true;
+  }
+
+  const SymbolTable &symbol_table_;
+  /// The file whose rules are being written.
+  const std::string *file_;
+  /// Nodes that are written by their position in this list.
+  std::vector<AstNode *> builtins_;
+  /// Identifiers that later files would share.
+  std::unordered_set<AstNode *> interned_;
+  /// The names of named EVars.
+  std::unordered_map<AstNode *, Symbol> names_;
+  /// EVars that were only used once.
+  std::unordered_set<AstNode *> singletons_;
+  /// The number of each node written so far.
+  std::unordered_map<AstNode *, uint64_t> indices_;
+  /// The records for the nodes written so far.
+  std::string nodes_;
+};
+
+std::vector<AstNode *> AssertionParser::SerializedBuiltins() const {
+  return {verifier_.eq_id(),           verifier_.fact_id(),
+          verifier_.vname_id(),        verifier_.root_id(),
+          verifier_.empty_string_id(), verifier_.ordinal_id()};
+}
+
+AssertionParser::ParseMark AssertionParser::mark() const {
+  return ParseMark{groups_.size(), groups_[0].goals.size(),
+                   inspections_.size(),
+                   identifier_context_.empty() && evar_context_.empty()};
+}
+
+bool AssertionParser::SerializeRulesSince(const ParseMark &mark,
+                                          std::string *out) const {
+  if (!mark.fresh || files_.empty() || inside_goal_group_ ||
+      !unresolved_locations_.empty()) {
+    return false;
+  }
+  SerializedRulesWriter writer(*this, SerializedBuiltins());
+  std::string goals;
+  auto add_goals = [&](const GoalGroup &group, size_t first) {
+    AppendVarint(group.goals.size() - first, &goals);
+    for (size_t g = first; g < group.goals.size(); ++g) {
+      uint64_t index;
+      if (!writer.Add(group.goals[g], &index)) {
+        return false;
+      }
+      AppendVarint(index, &goals);
+    }
+    return true;
+  };
+  if (!add_goals(groups_[0], mark.global_goal_count)) {
+    return false;
+  }
+  AppendVarint(groups_.size() - mark.group_count, &goals);
+  for (size_t g = mark.group_count; g < groups_.size(); ++g) {
+    AppendVarint(groups_[g].accept_if == GoalGroup::kSomeMustFail, &goals);
+    if (!add_goals(groups_[g], 0)) {
+      return false;
+    }
+  }
+  AppendVarint(inspections_.size() - mark.inspection_count, &goals);
+  for (size_t i = mark.inspection_count; i < inspections_.size(); ++i) {
+    uint64_t index;
+    if (!writer.Add(inspections_[i].evar, &index)) {
+      return false;
+    }
+    AppendString(inspections_[i].label, &goals);
+    AppendVarint(index, &goals);
+    AppendVarint(inspections_[i].kind == Inspection::Kind::IMPLICIT, &goals);
+  }
+  out->assign(kSerializedRulesMagic);
+  writer.Finish(out);
+  out->append(goals);
+  return true;
+}
+
+bool AssertionParser::LoadSerializedRules(const std::string &filename,
+                                          llvm::StringRef data) {
+  if (!data.startswith(kSerializedRulesMagic)) {
+    return false;
+  }
+  SerializedRulesReader reader(
+      data.drop_front(sizeof(kSerializedRulesMagic) - 1));
+  files_.push_back(filename);
+  const std::string *file = &files_.back();
+  SymbolTable *symbol_table = verifier_.symbol_table();
+  const std::vector<AstNode *> builtins = SerializedBuiltins();
+  // Nothing changes until everything has been read; until then the nodes
+  // are just (abandoned) arena garbage if something goes wrong.
+  std::vector<AstNode *> nodes(reader.Count());
+  std::vector<std::pair<Symbol, Identifier *>> new_identifiers;
+  struct NewEVar {
+    Symbol name;
+    EVar *evar;
+    bool singleton;
+  };
+  std::vector<NewEVar> new_evars;
+  std::unordered_set<EVar *> old_evars;
+  // Reads a reference to one of the first `limit` nodes.
+  auto node_at = [&](uint64_t limit) -> AstNode * {
+    uint64_t index = reader.Index(limit);
+    return reader.ok() ? nodes[index] : nullptr;
+  };
+  for (size_t n = 0; n < nodes.size() && reader.ok(); ++n) {
+    uint64_t kind = reader.Varint();
+    if (kind == kSerializedBuiltin) {
+      nodes[n] = builtins[reader.Index(builtins.size())];
+      continue;
+    }
+    yy::location location = reader.Location(file);
+    switch (kind) {
+      case kSerializedIdentifier:
+        nodes[n] = new (arena_)
+            Identifier(location, symbol_table->intern(reader.String()));
+        break;
+      case kSerializedInterned: {
+        Symbol symbol = symbol_table->intern(reader.String());
+        auto old_binding = identifier_context_.find(symbol);
+        if (old_binding != identifier_context_.end()) {
+          nodes[n] = old_binding->second;
+        } else {
+          auto *id = new (arena_) Identifier(location, symbol);
+          new_identifiers.emplace_back(symbol, id);
+          nodes[n] = id;
+        }
+        break;
+      }
+      case kSerializedEVar: {
+        uint64_t flags = reader.Index(3);
+        Symbol name = flags ? symbol_table->intern(reader.String()) : 0;
+        uint64_t current = reader.Index(n + 1);
+        auto old_binding = flags ? evar_context_.find(name)
+                                 : evar_context_.end();
+        if (flags && current != 0) {
+          reader.Fail();  // Named EVars are never prebound.
+        } else if (old_binding != evar_context_.end()) {
+          old_evars.insert(old_binding->second);
+          nodes[n] = old_binding->second;
+        } else {
+          auto *evar = new (arena_) EVar(location);
+          if (current != 0) {
+            evar->set_current(nodes[current - 1]);
+          }
+          if (flags) {
+            new_evars.push_back(NewEVar{name, evar, flags == 2});
+          }
+          nodes[n] = evar;
+        }
+        break;
+      }
+      case kSerializedRange: {
+        uint64_t begin = reader.Varint();
+        uint64_t end = reader.Varint();
+        nodes[n] = new (arena_) Range(location, begin, end);
+        break;
+      }
+      case kSerializedTuple: {
+        uint64_t size = reader.Count();
+        AstNode **elements =
+            static_cast<AstNode **>(arena_->New(size * sizeof(AstNode *)));
+        for (uint64_t e = 0; e < size; ++e) {
+          elements[e] = node_at(n);
+        }
+        nodes[n] = new (arena_) Tuple(location, size, elements);
+        break;
+      }
+      case kSerializedApp: {
+        AstNode *lhs = node_at(n);
+        AstNode *rhs = node_at(n);
+        nodes[n] = new (arena_) App(location, lhs, rhs);
+        break;
+      }
+      default:
+        reader.Fail();
+        break;
+    }
+  }
+  auto read_goals = [&](std::vector<AstNode *> *goals) {
+    uint64_t count = reader.Count();
+    for (uint64_t g = 0; g < count && reader.ok(); ++g) {
+      goals->push_back(node_at(nodes.size()));
+    }
+  };
+  std::vector<AstNode *> global_goals;
+  read_goals(&global_goals);
+  std::vector<GoalGroup> groups(reader.Count());
+  for (auto &group : groups) {
+    group.accept_if = reader.Index(2) ? GoalGroup::kSomeMustFail
+                                      : GoalGroup::kNoneMayFail;
+    read_goals(&group.goals);
+  }
+  std::vector<Inspection> inspections;
+  for (uint64_t i = 0, count = reader.Count(); i < count && reader.ok(); ++i) {
+    llvm::StringRef label = reader.String();
+    AstNode *node = node_at(nodes.size());
+    EVar *evar = node != nullptr ? node->AsEVar() : nullptr;
+    bool implicit = reader.Index(2);
+    if (evar == nullptr) {
+      reader.Fail();
+    } else if (!(implicit && old_evars.count(evar))) {
+      // EVars from earlier files were already inspected by default if
+      // they were going to be.
+      inspections.emplace_back(label.str(), evar,
+                               implicit ? Inspection::Kind::IMPLICIT
+                                        : Inspection::Kind::EXPLICIT);
+    }
+  }
+  if (!reader.done()) {
+    files_.pop_back();
+    return false;
+  }
+  groups_[0].goals.insert(groups_[0].goals.end(), global_goals.begin(),
+                          global_goals.end());
+  groups_.insert(groups_.end(), groups.begin(), groups.end());
+  inspections_.insert(inspections_.end(), inspections.begin(),
+                      inspections.end());
+  identifier_context_.insert(new_identifiers.begin(), new_identifiers.end());
+  for (EVar *evar : old_evars) {
+    singleton_evars_.erase(evar);
+  }
+  for (const auto &evar : new_evars) {
+    evar_context_.emplace(evar.name, evar.evar);
+    if (evar.singleton) {
+      singleton_evars_[evar.evar] = evar.name;
+    }
+  }
+  had_errors_ = false;
+  return true;
+}
+
 }  // namespace verifier
 }  // namespace kythe
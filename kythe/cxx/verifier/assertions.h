@@ -115,6 +115,39 @@ class AssertionParser {
   /// \return true if there were singletons.
   bool CheckForSingletonEVars();
 
+  /// \brief Whether every EVar is added to the inspection list.
+  bool inspects_all_evars() const { return default_inspect_; }
+
+  /// \brief Forgets every goal, inspection and file that has been loaded.
+  /// Settings like `InspectAllEVars` are kept.
+  void Reset();
+
+  /// \brief How much had been parsed at some point, as returned by `mark`.
+  struct ParseMark {
+    size_t group_count;        ///< The number of goal groups.
+    size_t global_goal_count;  ///< The number of goals in group 0.
+    size_t inspection_count;   ///< The number of inspections.
+    bool fresh;                ///< No atoms had been created yet.
+  };
+
+  /// \brief Remembers how much has been parsed so far.
+  ParseMark mark() const;
+
+  /// \brief Serializes the goals and inspections parsed since `mark` so that
+  /// `LoadSerializedRules` can restore them without the source text.
+  ///
+  /// Only rules that were parsed before any others (at the start of a run or
+  /// after `Reset`) can be serialized, since later files may share EVars and
+  /// identifiers with earlier ones; the serialized rules can be loaded at any
+  /// point, as if they had been parsed there.
+  /// \return false if the rules since `mark` can't be serialized.
+  bool SerializeRulesSince(const ParseMark &mark, std::string *out) const;
+
+  /// \brief Restores rules saved by `SerializeRulesSince` as though they had
+  /// just been parsed from `filename`.
+  /// \return false, leaving the parser unchanged, if `data` is malformed.
+  bool LoadSerializedRules(const std::string &filename, llvm::StringRef data);
+
  private:
   friend class yy::AssertionParserImpl;
 
@@ -272,6 +305,11 @@ class AssertionParser {
     }
   }
 
+  class SerializedRulesWriter;
+
+  /// \brief The verifier's own nodes that serialized rules may refer to.
+  std::vector<AstNode *> SerializedBuiltins() const;
+
   Verifier &verifier_;
 
   /// The arena from the verifier; needed by the parser implementation.
@@ -0,0 +1,267 @@
+/*
+ * Copyright 2017 Google Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "entry_stream_loader.h"
+
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "google/protobuf/io/coded_stream.h"
+#include "google/protobuf/wire_format_lite.h"
+
+namespace kythe {
+namespace verifier {
+namespace {
+using google::protobuf::io::CodedInputStream;
+using google::protobuf::internal::WireFormatLite;
+
+/// The amount of input to gather before decoding it.
+constexpr size_t kChunkSize = 4 * 1024 * 1024;
+
+/// The number of decoded chunks that may wait to be added to the database.
+constexpr size_t kMaxPendingChunks = 4;
+
+/// The longest a varint can be.
+constexpr size_t kMaxVarintSize = 10;
+
+/// \brief Some input together with the entries decoded from it.
+struct Chunk {
+  /// The input. Decoded entries point into this buffer.
+  std::string data;
+  /// The entries in `data`.
+  std::vector<EntryFields> entries;
+};
+
+/// \brief Reads a length-delimited field from `input`, which must read from
+/// the buffer starting at `base`.
+bool ReadBytes(CodedInputStream *input, const char *base,
+               llvm::StringRef *out) {
+  google::protobuf::uint32 size;
+  if (!input->ReadVarint32(&size)) {
+    return false;
+  }
+  int position = input->CurrentPosition();
+  if (!input->Skip(size)) {
+    return false;
+  }
+  *out = llvm::StringRef(base + position, size);
+  return true;
+}
+
+/// \brief Decodes a wire-format `VName`.
+bool DecodeVName(llvm::StringRef encoded, VNameFields *vname) {
+  CodedInputStream input(
+      reinterpret_cast<const google::protobuf::uint8 *>(encoded.data()),
+      encoded.size());
+  vname->encoded = encoded;
+  while (google::protobuf::uint32 tag = input.ReadTag()) {
+    int field = WireFormatLite::GetTagFieldNumber(tag);
+    if (field >= 1 && field <= 5 &&
+        WireFormatLite::GetTagWireType(tag) ==
+            WireFormatLite::WIRETYPE_LENGTH_DELIMITED) {
+      if (!ReadBytes(&input, encoded.data(), &vname->fields[field - 1])) {
+        return false;
+      }
+    } else if (!WireFormatLite::SkipField(&input, tag)) {
+      return false;
+    }
+  }
+  return input.ConsumedEntireMessage();
+}
+}  // anonymous namespace
+
+bool DecodeEntry(llvm::StringRef entry, EntryFields *fields) {
+  CodedInputStream input(
+      reinterpret_cast<const google::protobuf::uint8 *>(entry.data()),
+      entry.size());
+  while (google::protobuf::uint32 tag = input.ReadTag()) {
+    if (WireFormatLite::GetTagWireType(tag) !=
+        WireFormatLite::WIRETYPE_LENGTH_DELIMITED) {
+      if (!WireFormatLite::SkipField(&input, tag)) {
+        return false;
+      }
+      continue;
+    }
+    llvm::StringRef bytes;
+    if (!ReadBytes(&input, entry.data(), &bytes)) {
+      return false;
+    }
+    switch (WireFormatLite::GetTagFieldNumber(tag)) {
+      case 1:
+        fields->has_source = true;
+        if (!DecodeVName(bytes, &fields->source)) {
+          return false;
+        }
+        break;
+      case 2:
+        fields->edge_kind = bytes;
+        break;
+      case 3:
+        fields->has_target = true;
+        if (!DecodeVName(bytes, &fields->target)) {
+          return false;
+        }
+        break;
+      case 4:
+        fields->fact_name = bytes;
+        break;
+      case 5:
+        fields->fact_value = bytes;
+        break;
+    }
+  }
+  return input.ConsumedEntireMessage();
+}
+
+bool EntryStreamLoader::Load(google::protobuf::io::ZeroCopyInputStream *input,
+                             std::string *error_text) {
+  std::mutex mutex;
+  std::condition_variable chunk_ready;
+  std::condition_variable chunk_taken;
+  // The following are guarded by `mutex`.
+  std::deque<std::unique_ptr<Chunk>> chunks;
+  bool reader_done = false;
+  bool cancelled = false;
+  std::string reader_error;
+
+  std::thread reader([&] {
+    // The start of an entry that didn't fit in the last chunk.
+    std::string carry;
+    // The offset in the stream of the start of `carry`.
+    size_t carry_offset = 0;
+    // The size of the entry at the start of `carry`, if known.
+    size_t carry_entry_size = 0;
+    bool end_of_input = false;
+    while (!end_of_input) {
+      std::unique_ptr<Chunk> chunk(new Chunk);
+      chunk->data.swap(carry);
+      chunk->data.reserve(kChunkSize);
+      do {
+        const void *data;
+        int size;
+        if (!input->Next(&data, &size)) {
+          end_of_input = true;
+          break;
+        }
+        chunk->data.append(static_cast<const char *>(data), size);
+      } while (chunk->data.size() < std::max(kChunkSize, carry_entry_size));
+      std::string error;
+      size_t offset = 0;
+      carry_entry_size = 0;
+      while (offset < chunk->data.size()) {
+        size_t available = chunk->data.size() - offset;
+        CodedInputStream header(
+            reinterpret_cast<const google::protobuf::uint8 *>(
+                chunk->data.data()) +
+                offset,
+            available);
+        google::protobuf::uint32 entry_size;
+        if (!header.ReadVarint32(&entry_size)) {
+          if (available >= kMaxVarintSize) {
+            error = "Malformed entry size at offset " +
+                    std::to_string(carry_offset + offset);
+          }
+          break;
+        }
+        size_t header_size = header.CurrentPosition();
+        if (available - header_size < entry_size) {
+          carry_entry_size = header_size + entry_size;
+          break;
+        }
+        chunk->entries.emplace_back();
+        if (!DecodeEntry(llvm::StringRef(chunk->data.data() + offset +
+                                             header_size,
+                                         entry_size),
+                         &chunk->entries.back())) {
+          chunk->entries.pop_back();
+          error = "Malformed entry at offset " +
+                  std::to_string(carry_offset + offset);
+          break;
+        }
+        offset += header_size + entry_size;
+      }
+      if (error.empty() && end_of_input && offset != chunk->data.size()) {
+        error = "Truncated entry at offset " +
+                std::to_string(carry_offset + offset);
+      }
+      carry.assign(chunk->data, offset, std::string::npos);
+      carry_offset += offset;
+      bool done = end_of_input || !error.empty();
+      {
+        std::unique_lock<std::mutex> lock(mutex);
+        chunk_taken.wait(lock, [&] {
+          return cancelled || chunks.size() < kMaxPendingChunks;
+        });
+        if (cancelled) {
+          return;
+        }
+        chunks.push_back(std::move(chunk));
+        reader_error = error;
+        reader_done = done;
+      }
+      chunk_ready.notify_one();
+      if (done) {
+        return;
+      }
+    }
+  });
+
+  bool ok = true;
+  for (;;) {
+    std::unique_ptr<Chunk> chunk;
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      chunk_ready.wait(lock, [&] { return reader_done || !chunks.empty(); });
+      if (chunks.empty()) {
+        break;
+      }
+      chunk = std::move(chunks.front());
+      chunks.pop_front();
+    }
+    chunk_taken.notify_one();
+    for (const auto &entry : chunk->entries) {
+      if (!verifier_->AssertSingleFact(database_name_, facts_loaded_,
+                                       entry)) {
+        *error_text = "Error asserting fact " + std::to_string(facts_loaded_);
+        ok = false;
+        break;
+      }
+      ++facts_loaded_;
+    }
+    if (!ok) {
+      break;
+    }
+  }
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    cancelled = true;
+  }
+  chunk_taken.notify_one();
+  reader.join();
+  if (ok && !reader_error.empty()) {
+    *error_text = reader_error;
+    ok = false;
+  }
+  return ok;
+}
+
+}  // namespace verifier
+}  // namespace kythe
@@ -0,0 +1,66 @@
+/*
+ * Copyright 2017 Google Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef KYTHE_CXX_VERIFIER_ENTRY_STREAM_LOADER_H_
+#define KYTHE_CXX_VERIFIER_ENTRY_STREAM_LOADER_H_
+
+#include <string>
+
+#include "google/protobuf/io/zero_copy_stream.h"
+#include "llvm/ADT/StringRef.h"
+
+#include "verifier.h"
+
+namespace kythe {
+namespace verifier {
+
+/// \brief Decodes a wire-format `Entry` without copying any of its strings.
+/// \return false if `entry` isn't a well-formed `Entry`.
+bool DecodeEntry(llvm::StringRef entry, EntryFields *fields);
+
+/// \brief Loads a stream of varint-delimited wire-format `Entry` messages
+/// (like the output of a `FileOutputStream`) into a `Verifier`.
+///
+/// A reader thread copies the input into large chunks, splits them into
+/// entries and decodes those, while the calling thread adds the facts from
+/// the chunks that are already decoded to the database.
+class EntryStreamLoader {
+ public:
+  /// \param verifier The verifier to add facts to. Not owned.
+  /// \param database_name as for `Verifier::AssertSingleFact`.
+  EntryStreamLoader(Verifier *verifier, std::string *database_name)
+      : verifier_(verifier), database_name_(database_name) {}
+
+  /// \brief Reads entries from `input` until it is exhausted.
+  /// \param input The stream to read. Not owned.
+  /// \return false if the input was malformed or truncated or a fact couldn't
+  /// be added; `error_text` will say why.
+  bool Load(google::protobuf::io::ZeroCopyInputStream *input,
+            std::string *error_text);
+
+  /// \return the number of facts added so far.
+  size_t facts_loaded() const { return facts_loaded_; }
+
+ private:
+  Verifier *verifier_;
+  std::string *database_name_;
+  size_t facts_loaded_ = 0;
+};
+
+}  // namespace verifier
+}  // namespace kythe
+
+#endif  // KYTHE_CXX_VERIFIER_ENTRY_STREAM_LOADER_H_
@@ -14,7 +14,10 @@
  * limitations under the License.
  */
 
+#include <unistd.h>
 #include <bitset>
+#include <cerrno>
+#include <cstring>
 
 #include "pretty_printer.h"
 
@@ -35,16 +38,117 @@ void StringPrettyPrinter::Print(const void *ptr) {
   }
 }
 
+void StringPrettyPrinter::Print(llvm::StringRef string) {
+  data_.write(string.data(), string.size());
+}
+
+FileHandlePrettyPrinter::~FileHandlePrettyPrinter() { Flush(); }
+
 void FileHandlePrettyPrinter::Print(const std::string &string) {
-  fprintf(file_, "%s", string.c_str());
+  Append(string.data(), string.size());
 }
 
 void FileHandlePrettyPrinter::Print(const char *string) {
-  fprintf(file_, "%s", string);
+  Append(string, strlen(string));
 }
 
 void FileHandlePrettyPrinter::Print(const void *ptr) {
-  fprintf(file_, "0x%016llx", reinterpret_cast<unsigned long long>(ptr));
+  char buf[32];
+  int size = snprintf(buf, sizeof(buf), "0x%016llx",
+                      reinterpret_cast<unsigned long long>(ptr));
+  Append(buf, size);
+}
+
+void FileHandlePrettyPrinter::Print(llvm::StringRef string) {
+  Append(string.data(), string.size());
+}
+
+void FileHandlePrettyPrinter::Append(const char *data, size_t size) {
+  if (buffer_.size() + size > buffer_size_) {
+    Flush();
+  }
+  if (buffer_.capacity() < buffer_size_) {
+    // Only reserve once there's something to print.
+    buffer_.reserve(buffer_size_);
+  }
+  buffer_.append(data, size);
+}
+
+bool FileHandlePrettyPrinter::Flush() {
+  bool ok = buffer_.empty() ||
+            fwrite(buffer_.data(), 1, buffer_.size(), file_) == buffer_.size();
+  buffer_.clear();
+  return ok;
+}
+
+FileDescriptorPrettyPrinter::~FileDescriptorPrettyPrinter() { Flush(); }
+
+void FileDescriptorPrettyPrinter::Print(const std::string &string) {
+  Append(string.data(), string.size());
+}
+
+void FileDescriptorPrettyPrinter::Print(const char *string) {
+  Append(string, strlen(string));
+}
+
+void FileDescriptorPrettyPrinter::Print(const void *ptr) {
+  char buf[32];
+  int size = snprintf(buf, sizeof(buf), "0x%016llx",
+                      reinterpret_cast<unsigned long long>(ptr));
+  Append(buf, size);
+}
+
+void FileDescriptorPrettyPrinter::Print(llvm::StringRef string) {
+  Append(string.data(), string.size());
+}
+
+void FileDescriptorPrettyPrinter::Append(const char *data, size_t size) {
+  if (buffer_.size() + size > buffer_size_) {
+    Flush();
+  }
+  buffer_.append(data, size);
+}
+
+bool FileDescriptorPrettyPrinter::Flush() {
+  const char *data = buffer_.data();
+  size_t size = buffer_.size();
+  while (size > 0) {
+    ssize_t written = write(fd_, data, size);
+    if (written < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      buffer_.clear();
+      return false;
+    }
+    data += written;
+    size -= written;
+  }
+  buffer_.clear();
+  return true;
+}
+
+/// \brief Prints `string` to `printer`, replacing each character for which
+/// `escape` returns non-null with what it returns. Runs of characters that
+/// need no escaping are printed with one call.
+template <typename Escape>
+static void PrintEscaped(const char *string, PrettyPrinter *printer,
+                         Escape escape) {
+  std::string run;
+  for (; *string; ++string) {
+    if (const char *replacement = escape(*string)) {
+      if (!run.empty()) {
+        printer->Print(run);
+        run.clear();
+      }
+      printer->Print(replacement);
+    } else {
+      run.push_back(*string);
+    }
+  }
+  if (!run.empty()) {
+    printer->Print(run);
+  }
 }
 
 void QuoteEscapingPrettyPrinter::Print(const std::string &string) {
@@ -52,19 +156,18 @@ void QuoteEscapingPrettyPrinter::Print(const std::string &string) {
 }
 
 void QuoteEscapingPrettyPrinter::Print(const char *string) {
-  char buf[2];
-  buf[1] = 0;
-  while ((buf[0] = *string++)) {
-    if (buf[0] == '\"') {
-      wrapped_.Print("\\\"");
-    } else if (buf[0] == '\n') {
-      wrapped_.Print("\\n");
-    } else if (buf[0] == '\'') {
-      wrapped_.Print("\\\'");
-    } else {
-      wrapped_.Print(buf);
+  PrintEscaped(string, &wrapped_, [](char c) -> const char * {
+    switch (c) {
+      case '\"':
+        return "\\\"";
+      case '\n':
+        return "\\n";
+      case '\'':
+        return "\\\'";
+      default:
+        return nullptr;
     }
-  }
+  });
 }
 
 void QuoteEscapingPrettyPrinter::Print(const void *ptr) { wrapped_.Print(ptr); }
@@ -74,21 +177,20 @@ void HtmlEscapingPrettyPrinter::Print(const std::string &string) {
 }
 
 void HtmlEscapingPrettyPrinter::Print(const char *string) {
-  char buf[2];
-  buf[1] = 0;
-  while ((buf[0] = *string++)) {
-    if (buf[0] == '\"') {
-      wrapped_.Print("&quot;");
-    } else if (buf[0] == '&') {
-      wrapped_.Print("&amp;");
-    } else if (buf[0] == '<') {
-      wrapped_.Print("&lt;");
-    } else if (buf[0] == '>') {
-      wrapped_.Print("&gt;");
-    } else {
-      wrapped_.Print(buf);
+  PrintEscaped(string, &wrapped_, [](char c) -> const char * {
+    switch (c) {
+      case '\"':
+        return "&quot;";
+      case '&':
+        return "&amp;";
+      case '<':
+        return "&lt;";
+      case '>':
+        return "&gt;";
+      default:
+        return nullptr;
     }
-  }
+  });
 }
 
 void HtmlEscapingPrettyPrinter::Print(const void *ptr) { wrapped_.Print(ptr); }
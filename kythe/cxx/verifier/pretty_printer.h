@@ -17,9 +17,12 @@
 #ifndef KYTHE_CXX_VERIFIER_PRETTY_PRINTER_H_
 #define KYTHE_CXX_VERIFIER_PRETTY_PRINTER_H_
 
+#include <cstdio>
 #include <sstream>
 #include <string>
 
+#include "llvm/ADT/StringRef.h"
+
 namespace kythe {
 namespace verifier {
 
@@ -35,6 +38,10 @@ class PrettyPrinter {
   /// \brief Prints `ptr` in hex with a 0x prefix (or 0 for null pointers).
   virtual void Print(const void *ptr) = 0;
 
+  /// \brief Prints `string`, which need not be null-terminated. Printers
+  /// that can avoid copying `string` should override this.
+  virtual void Print(llvm::StringRef string) { Print(string.str()); }
+
   virtual ~PrettyPrinter();
 };
 
@@ -47,6 +54,8 @@ class StringPrettyPrinter : public PrettyPrinter {
   void Print(const char *string) override;
   /// \copydoc PrettyPrinter::Print(const void *)
   void Print(const void *ptr) override;
+  /// \copydoc PrettyPrinter::Print(llvm::StringRef)
+  void Print(llvm::StringRef string) override;
   /// Returns the `string` printed to thus far.
   std::string str() { return data_.str(); }
 
@@ -56,19 +65,71 @@ class StringPrettyPrinter : public PrettyPrinter {
 };
 
 /// \brief A `PrettyPrinter` that directs its output to a file handle.
+///
+/// Output is collected in a buffer and written with one `fwrite` when the
+/// buffer fills up, when `Flush` is called, or when the printer is
+/// destroyed, so anything else written to the same handle meanwhile will
+/// come first.
 class FileHandlePrettyPrinter : public PrettyPrinter {
  public:
   /// \param file The file handle to print to.
-  explicit FileHandlePrettyPrinter(FILE *file) : file_(file) {}
+  /// \param buffer_size The amount of output to hold before writing.
+  explicit FileHandlePrettyPrinter(FILE *file, size_t buffer_size = 1 << 16)
+      : file_(file), buffer_size_(buffer_size) {}
+  /// \brief Writes any buffered output.
+  ~FileHandlePrettyPrinter() override;
   /// \copydoc PrettyPrinter::Print(const std::string&)
   void Print(const std::string &string) override;
   /// \copydoc PrettyPrinter::Print(const char *)
   void Print(const char *string) override;
   /// \copydoc PrettyPrinter::Print(const void *)
   void Print(const void *ptr) override;
+  /// \copydoc PrettyPrinter::Print(llvm::StringRef)
+  void Print(llvm::StringRef string) override;
+  /// \brief Writes any buffered output.
+  /// \return false if the output couldn't be written.
+  bool Flush();
 
  private:
+  /// Buffers `size` bytes at `data`, writing out the buffer if it fills up.
+  void Append(const char *data, size_t size);
+
   FILE *file_;
+  size_t buffer_size_;
+  std::string buffer_;
+};
+
+/// \brief A `PrettyPrinter` that buffers its output and writes it to a file
+/// descriptor whenever the buffer fills up.
+class FileDescriptorPrettyPrinter : public PrettyPrinter {
+ public:
+  /// \param fd The file descriptor to write to. Not closed.
+  /// \param buffer_size The amount of output to hold before writing.
+  explicit FileDescriptorPrettyPrinter(int fd, size_t buffer_size = 1 << 16)
+      : fd_(fd), buffer_size_(buffer_size) {
+    buffer_.reserve(buffer_size);
+  }
+  /// \brief Writes any buffered output.
+  ~FileDescriptorPrettyPrinter() override;
+  /// \copydoc PrettyPrinter::Print(const std::string&)
+  void Print(const std::string &string) override;
+  /// \copydoc PrettyPrinter::Print(const char *)
+  void Print(const char *string) override;
+  /// \copydoc PrettyPrinter::Print(const void *)
+  void Print(const void *ptr) override;
+  /// \copydoc PrettyPrinter::Print(llvm::StringRef)
+  void Print(llvm::StringRef string) override;
+  /// \brief Writes any buffered output.
+  /// \return false if the output couldn't be written.
+  bool Flush();
+
+ private:
+  /// Buffers `size` bytes at `data`, writing out the buffer if it fills up.
+  void Append(const char *data, size_t size);
+
+  int fd_;
+  size_t buffer_size_;
+  std::string buffer_;
 };
 
 /// \brief A `PrettyPrinter` that wraps another `PrettyPrinter` but escapes
@@ -0,0 +1,19 @@
+#!/bin/bash
+# This script checks that the verifier reports each test in a batch
+# manifest separately and fails if any of them fail.
+HAD_ERRORS=0
+VERIFIER="../verifier"
+cd "$(dirname "$0")"
+"${VERIFIER}" --batch_manifest=batch_manifest.txt 2>/dev/null \
+    | diff - batch_expected_output.txt
+RESULTS=( ${PIPESTATUS[0]} ${PIPESTATUS[1]} )
+if [ ${RESULTS[0]} -ne 1 ]; then
+  echo "[ VERIFIER DID NOT FAIL ]"
+  HAD_ERRORS=1
+elif [ ${RESULTS[1]} -ne 0 ]; then
+  echo "[ WRONG BATCH REPORT ]"
+  HAD_ERRORS=1
+else
+  echo "[ OK ]"
+fi
+exit ${HAD_ERRORS}
@@ -16,6 +16,19 @@
 
 #include "verifier.h"
 
+#include <openssl/sha.h>
+#include <unistd.h>
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <numeric>
+#include <thread>
+#include <unordered_map>
+
 #include "glog/logging.h"
 #include "google/protobuf/text_format.h"
 
@@ -23,13 +36,12 @@
 #include "kythe/cxx/common/kythe_uri.h"
 #include "kythe/proto/common.pb.h"
 #include "kythe/proto/storage.pb.h"
+#include "llvm/ADT/STLExtras.h"
 
 namespace kythe {
 namespace verifier {
 namespace {
 
-typedef std::vector<AstNode *> Database;
-
 /// \brief The return code from a verifier thunk.
 using ThunkRet = size_t;
 /// \brief The operation failed normally.
@@ -44,11 +56,74 @@ static ThunkRet kImpossible = {3};
 /// establishing that cut without changing assignments.
 static ThunkRet kFirstCut = {4};
 
-typedef const std::function<ThunkRet()> &Thunk;
+/// \brief A continuation. The solver is written in continuation-passing
+/// style and every step passes a new lambda down the stack, so this is a
+/// non-owning reference: unlike `std::function`, it never allocates to hold
+/// a lambda's captures. Every continuation outlives the calls it is passed
+/// to.
+typedef llvm::function_ref<ThunkRet()> Thunk;
 
 static std::string *kDefaultDatabase = new std::string("builtin");
 static std::string *kStandardIn = new std::string("-");
 
+/// \brief Parses the decimal offset at the start of `text`, or returns 0 if
+/// there isn't one.
+static size_t ParseOffset(llvm::StringRef text) {
+  size_t offset = 0;
+  for (char c : text) {
+    if (c < '0' || c > '9') {
+      break;
+    }
+    offset = offset * 10 + (c - '0');
+  }
+  return offset;
+}
+
+/// \brief Reads all of the file at `path` into `content`.
+/// \return false if the file couldn't be read.
+static bool ReadWholeFile(const std::string &path, std::string *content) {
+  FILE *input = ::fopen(path.c_str(), "rb");
+  if (input == nullptr) {
+    return false;
+  }
+  content->clear();
+  char buffer[1 << 16];
+  for (size_t read; (read = ::fread(buffer, 1, sizeof(buffer), input)) != 0;) {
+    content->append(buffer, read);
+  }
+  bool ok = !::ferror(input);
+  ::fclose(input);
+  return ok;
+}
+
+/// \brief Writes `content` to `path` by way of a temporary file, so that
+/// readers never see part of it.
+/// \return false if the file couldn't be written.
+static bool WriteFileAtomically(const std::string &path,
+                                const std::string &content) {
+  std::string temp_path = path + ".XXXXXX";
+  int fd = ::mkstemp(&temp_path[0]);
+  if (fd < 0) {
+    return false;
+  }
+  bool ok = true;
+  for (size_t written = 0; ok && written < content.size();) {
+    ssize_t result =
+        ::write(fd, content.data() + written, content.size() - written);
+    if (result < 0 && errno != EINTR) {
+      ok = false;
+    } else if (result > 0) {
+      written += result;
+    }
+  }
+  ok = ::close(fd) == 0 && ok;
+  ok = ok && ::rename(temp_path.c_str(), path.c_str()) == 0;
+  if (!ok) {
+    ::unlink(temp_path.c_str());
+  }
+  return ok;
+}
+
 static bool EncodedIdentEqualTo(AstNode *a, AstNode *b) {
   Identifier *ia = a->AsIdentifier();
   Identifier *ib = b->AsIdentifier();
@@ -115,40 +190,6 @@ static bool EncodedVNameOrIdentEqualTo(AstNode *a, AstNode *b) {
   }
 }
 
-/// \brief Sort entries such that those that set fact values are adjacent.
-static bool EncodedFactLessThan(AstNode *a, AstNode *b) {
-  Tuple *ta = a->AsApp()->rhs()->AsTuple();
-  Tuple *tb = b->AsApp()->rhs()->AsTuple();
-  if (EncodedVNameOrIdentLessThan(ta->element(0), tb->element(0))) {
-    return true;
-  }
-  if (!EncodedVNameOrIdentEqualTo(ta->element(0), tb->element(0))) {
-    return false;
-  }
-  if (EncodedIdentLessThan(ta->element(1), tb->element(1))) {
-    return true;
-  }
-  if (!EncodedIdentEqualTo(ta->element(1), tb->element(1))) {
-    return false;
-  }
-  if (EncodedVNameOrIdentLessThan(ta->element(2), tb->element(2))) {
-    return true;
-  }
-  if (!EncodedVNameOrIdentEqualTo(ta->element(2), tb->element(2))) {
-    return false;
-  }
-  if (EncodedIdentLessThan(ta->element(3), tb->element(3))) {
-    return true;
-  }
-  if (!EncodedIdentEqualTo(ta->element(3), tb->element(3))) {
-    return false;
-  }
-  if (EncodedIdentLessThan(ta->element(4), tb->element(4))) {
-    return true;
-  }
-  return false;
-}
-
 static AstNode *DerefEVar(AstNode *node) {
   while (node) {
     if (auto *evar = node->AsEVar()) {
@@ -164,6 +205,42 @@ static Identifier *SafeAsIdentifier(AstNode *node) {
   return node == nullptr ? nullptr : node->AsIdentifier();
 }
 
+/// \brief A column of a fact tuple.
+enum FactColumn : size_t {
+  kSource = 0,
+  kEdgeKind = 1,
+  kTarget = 2,
+  kFactName = 3,
+  kFactValue = 4
+};
+
+/// \brief The order in which a fact index collates fact tuple columns.
+using ColumnOrder = std::array<FactColumn, 5>;
+
+/// \brief The orders in which facts are indexed. `Verifier::facts_` is kept
+/// in the first order; `Verifier::fact_indices_` holds the positions of the
+/// facts sorted by each of the others.
+///
+/// The first order groups each node's facts and edges together, which is
+/// what `PrepareDatabase` needs to check the database and what the Graphviz
+/// and JSON dumps print; it also serves goals that know their source (like
+/// `Node.text ?Text`). In practice most unification happens between tuples
+/// with the edge kind, fact name and fact value present; then the source
+/// node is missing some of the time; then the target node is missing most of
+/// the time. The other orders serve these goals, including edge goals that
+/// only know their target (like `?A defines/binding Node`).
+static const ColumnOrder kLookupOrders[] = {
+    {{kSource, kEdgeKind, kTarget, kFactName, kFactValue}},
+    {{kEdgeKind, kFactName, kFactValue, kSource, kTarget}},
+    {{kEdgeKind, kFactName, kFactValue, kTarget, kSource}}};
+
+static constexpr size_t kLookupOrderCount =
+    sizeof(kLookupOrders) / sizeof(kLookupOrders[0]);
+
+static bool IsVNameColumn(FactColumn column) {
+  return column == kSource || column == kTarget;
+}
+
 struct AtomFactKey {
   Identifier *edge_kind;
   Identifier *fact_name;
@@ -185,7 +262,10 @@ struct AtomFactKey {
       return;
     }
     if (auto *app = maybe_vname->AsApp()) {
-      if (DerefEVar(app->lhs()) != vname_head) {
+      // VNames spelled out in goals have their own `vname` identifiers.
+      Identifier *head = SafeAsIdentifier(DerefEVar(app->lhs()));
+      if (head == nullptr ||
+          head->symbol() != vname_head->AsIdentifier()->symbol()) {
         return;
       }
       AstNode *maybe_tuple = DerefEVar(app->rhs());
@@ -202,6 +282,26 @@ struct AtomFactKey {
       }
     }
   }
+  /// \return the key's value for an identifier column (or null if unbound).
+  Identifier *ident(FactColumn column) const {
+    switch (column) {
+      case kEdgeKind:
+        return edge_kind;
+      case kFactName:
+        return fact_name;
+      default:
+        return fact_value;
+    }
+  }
+  /// \return the key's fields for a VName column (null where unbound).
+  Identifier *const *vname(FactColumn column) const {
+    return column == kSource ? source_vname : target_vname;
+  }
+  /// \return true if the key binds the leading field of `column`.
+  bool binds(FactColumn column) const {
+    return IsVNameColumn(column) ? vname(column)[0] != nullptr
+                                 : ident(column) != nullptr;
+  }
 };
 
 namespace {
@@ -209,57 +309,51 @@ namespace {
 enum class Order { LT, EQ, GT };
 
 // How we order incomplete keys depends on whether we're looking for
-// an upper or lower bound. See below for details. The node passed in
-// must be an application of Fact to a full fact tuple.
-static Order CompareFactWithKey(Order incomplete, AstNode *a, AtomFactKey *k) {
-  Tuple *ta = a->AsApp()->rhs()->AsTuple();
-  if (k->edge_kind == nullptr) {
-    return incomplete;
-  } else if (EncodedIdentLessThan(ta->element(1), k->edge_kind)) {
-    return Order::LT;
-  } else if (!EncodedIdentEqualTo(ta->element(1), k->edge_kind)) {
-    return Order::GT;
+// an upper or lower bound. See below for details.
+static Order CompareColumnWithKey(Order incomplete, const PackedFact &fact,
+                                  FactColumn column, const AtomFactKey &k) {
+  if (!IsVNameColumn(column)) {
+    Identifier *key = k.ident(column);
+    if (key == nullptr) {
+      return incomplete;
+    } else if (EncodedIdentLessThan(fact.columns[column], key)) {
+      return Order::LT;
+    } else if (!EncodedIdentEqualTo(fact.columns[column], key)) {
+      return Order::GT;
+    }
+    return Order::EQ;
   }
-  if (k->fact_name == nullptr) {
+  Identifier *const *tuple = k.vname(column);
+  if (tuple[0] == nullptr) {
     return incomplete;
-  } else if (EncodedIdentLessThan(ta->element(3), k->fact_name)) {
-    return Order::LT;
-  } else if (!EncodedIdentEqualTo(ta->element(3), k->fact_name)) {
-    return Order::GT;
   }
-  if (k->fact_value == nullptr) {
-    return incomplete;
-  } else if (EncodedIdentLessThan(ta->element(4), k->fact_value)) {
-    return Order::LT;
-  } else if (!EncodedIdentEqualTo(ta->element(4), k->fact_value)) {
+  App *app = fact.columns[column]->AsApp();
+  if (app == nullptr) {
+    // This column holds an identifier, and vnames are ordered before
+    // identifiers.
     return Order::GT;
   }
-  auto vname_compare = [incomplete](Tuple *va, Identifier *tuple[5]) {
-    for (size_t i = 0; i < 5; ++i) {
-      if (tuple[i] == nullptr) {
-        return incomplete;
-      }
-      if (EncodedIdentLessThan(va->element(i), tuple[i])) {
-        return Order::LT;
-      }
-      if (!EncodedIdentEqualTo(va->element(i), tuple[i])) {
-        return Order::GT;
-      }
+  Tuple *va = app->rhs()->AsTuple();
+  for (size_t i = 0; i < 5; ++i) {
+    if (tuple[i] == nullptr) {
+      return incomplete;
     }
-    return Order::EQ;
-  };
-  if (Tuple *vs = ta->element(0)->AsApp()->rhs()->AsTuple()) {
-    auto ord = vname_compare(vs, k->source_vname);
-    if (ord != Order::EQ) {
-      return ord;
+    if (EncodedIdentLessThan(va->element(i), tuple[i])) {
+      return Order::LT;
+    }
+    if (!EncodedIdentEqualTo(va->element(i), tuple[i])) {
+      return Order::GT;
     }
   }
-  if (auto *app = ta->element(2)->AsApp()) {
-    if (Tuple *vt = app->rhs()->AsTuple()) {
-      auto ord = vname_compare(vt, k->target_vname);
-      if (ord != Order::EQ) {
-        return ord;
-      }
+  return Order::EQ;
+}
+
+static Order CompareFactWithKey(Order incomplete, const ColumnOrder &order,
+                                const PackedFact &fact, const AtomFactKey &k) {
+  for (FactColumn column : order) {
+    Order ord = CompareColumnWithKey(incomplete, fact, column, k);
+    if (ord != Order::EQ) {
+      return ord;
     }
   }
   return Order::EQ;
@@ -270,56 +364,178 @@ static Order CompareFactWithKey(Order incomplete, AstNode *a, AtomFactKey *k) {
 // (0,0,2,3) (0,1,2,3) (0,1,2,4) (1,1,2,4)
 //          ^---  (0,1,_,_)  ---^
 
-static bool FastLookupKeyLessThanFact(AtomFactKey *k, AstNode *a) {
-  // This is used to find upper bounds, so keys with incomplete suffixes should
-  // be ordered after all facts that share their complete prefixes.
-  return CompareFactWithKey(Order::LT, a, k) == Order::GT;
-}
+// Each of these functors also accepts the position of a fact in `facts`, so
+// that they can search and sort the secondary indices.
 
-static bool FastLookupFactLessThanKey(AstNode *a, AtomFactKey *k) {
-  // This is used to find lower bounds, so keys with incomplete suffixes should
-  // be ordered after facts with lower prefixes but before facts with complete
-  // suffixes.
-  return CompareFactWithKey(Order::GT, a, k) == Order::LT;
-}
+struct FastLookupKeyLessThanFact {
+  const ColumnOrder &order;
+  const std::vector<PackedFact> &facts;
+  bool operator()(const AtomFactKey &k, const PackedFact &a) const {
+    // This is used to find upper bounds, so keys with incomplete suffixes
+    // should be ordered after all facts that share their complete prefixes.
+    return CompareFactWithKey(Order::LT, order, a, k) == Order::GT;
+  }
+  bool operator()(const AtomFactKey &k, uint32_t a) const {
+    return (*this)(k, facts[a]);
+  }
+};
 
-//  Sort entries in lexicographic order, collating as:
-// `(edge_kind, fact_name, fact_value, source_node, target_node)`.
-// In practice most unification was happening between tuples
-// with the first three fields present; then source_node
-// missing some of the time; then target_node missing most of
-// the time.
-static bool FastLookupFactLessThan(AstNode *a, AstNode *b) {
-  Tuple *ta = a->AsApp()->rhs()->AsTuple();
-  Tuple *tb = b->AsApp()->rhs()->AsTuple();
-  if (EncodedIdentLessThan(ta->element(1), tb->element(1))) {
-    return true;
+struct FastLookupFactLessThanKey {
+  const ColumnOrder &order;
+  const std::vector<PackedFact> &facts;
+  bool operator()(const PackedFact &a, const AtomFactKey &k) const {
+    // This is used to find lower bounds, so keys with incomplete suffixes
+    // should be ordered after facts with lower prefixes but before facts with
+    // complete suffixes.
+    return CompareFactWithKey(Order::GT, order, a, k) == Order::LT;
+  }
+  bool operator()(uint32_t a, const AtomFactKey &k) const {
+    return (*this)(facts[a], k);
   }
-  if (!EncodedIdentEqualTo(ta->element(1), tb->element(1))) {
+};
+
+/// \brief Sorts entries in lexicographic order, collating their columns
+/// as specified by `order`.
+struct FastLookupFactLessThan {
+  const ColumnOrder &order;
+  const std::vector<PackedFact> &facts;
+  bool operator()(uint32_t a, uint32_t b) const {
+    return (*this)(facts[a], facts[b]);
+  }
+  bool operator()(const PackedFact &a, const PackedFact &b) const {
+    for (FactColumn column : order) {
+      AstNode *ea = a.columns[column];
+      AstNode *eb = b.columns[column];
+      if (IsVNameColumn(column)) {
+        if (EncodedVNameOrIdentLessThan(ea, eb)) {
+          return true;
+        }
+        if (!EncodedVNameOrIdentEqualTo(ea, eb)) {
+          return false;
+        }
+      } else {
+        if (EncodedIdentLessThan(ea, eb)) {
+          return true;
+        }
+        if (!EncodedIdentEqualTo(ea, eb)) {
+          return false;
+        }
+      }
+    }
     return false;
   }
-  if (EncodedIdentLessThan(ta->element(3), tb->element(3))) {
-    return true;
+};
+
+/// \brief Sorts `[begin, end)` by `less`, splitting the work among up to
+/// `thread_count` threads. Each thread sorts a slice; then neighbouring
+/// slices are merged in parallel until one is left.
+template <typename Iterator, typename Compare>
+static void ParallelSort(Iterator begin, Iterator end, Compare less,
+                         size_t thread_count) {
+  // Below this many elements per thread, threads cost more than they save.
+  constexpr size_t kMinSliceSize = 1 << 14;
+  size_t size = end - begin;
+  size_t slices = std::min(thread_count, size / kMinSliceSize);
+  if (slices <= 1) {
+    std::sort(begin, end, less);
+    return;
   }
-  if (!EncodedIdentEqualTo(ta->element(3), tb->element(3))) {
-    return false;
+  std::vector<Iterator> bounds;
+  for (size_t i = 0; i < slices; ++i) {
+    bounds.push_back(begin + size * i / slices);
   }
-  if (EncodedIdentLessThan(ta->element(4), tb->element(4))) {
-    return true;
+  bounds.push_back(end);
+  std::vector<std::thread> workers;
+  for (size_t i = 0; i < slices; ++i) {
+    workers.emplace_back([&bounds, &less, i] {
+      std::sort(bounds[i], bounds[i + 1], less);
+    });
   }
-  if (!EncodedIdentEqualTo(ta->element(4), tb->element(4))) {
-    return false;
+  for (auto &worker : workers) {
+    worker.join();
+  }
+  while (bounds.size() > 2) {
+    std::vector<Iterator> merged;
+    workers.clear();
+    size_t i = 0;
+    for (; i + 2 < bounds.size(); i += 2) {
+      workers.emplace_back([&bounds, &less, i] {
+        std::inplace_merge(bounds[i], bounds[i + 1], bounds[i + 2], less);
+      });
+      merged.push_back(bounds[i]);
+    }
+    if (i + 1 < bounds.size()) {
+      // An odd slice out waits for the next round.
+      merged.push_back(bounds[i]);
+    }
+    merged.push_back(end);
+    for (auto &worker : workers) {
+      worker.join();
+    }
+    bounds.swap(merged);
   }
-  if (EncodedVNameOrIdentLessThan(ta->element(0), tb->element(0))) {
-    return true;
+}
+
+/// \brief Adds the `EVar`s that appear in `node` to `evars`.
+static void CollectEVars(AstNode *node, std::vector<EVar *> *evars) {
+  if (App *app = node->AsApp()) {
+    CollectEVars(app->lhs(), evars);
+    CollectEVars(app->rhs(), evars);
+  } else if (Tuple *tuple = node->AsTuple()) {
+    for (size_t i = 0, c = tuple->size(); i != c; ++i) {
+      CollectEVars(tuple->element(i), evars);
+    }
+  } else if (EVar *evar = node->AsEVar()) {
+    evars->push_back(evar);
+    if (AstNode *current = evar->current()) {
+      CollectEVars(current, evars);
+    }
   }
-  if (!EncodedVNameOrIdentEqualTo(ta->element(0), tb->element(0))) {
-    return false;
+}
+
+/// \brief Partitions goal groups such that groups sharing an `EVar` are in
+/// the same partition. Since the database is read-only, each partition can be
+/// solved independently of the others.
+/// \param evars Set to every `EVar` that appears in a goal.
+/// \return the partitions, each a list of group indices in ascending order,
+/// ordered by their first group index.
+static std::vector<std::vector<size_t>> PartitionGoalGroups(
+    AssertionParser *context, std::vector<EVar *> *evars) {
+  const auto &groups = context->groups();
+  std::vector<size_t> parent(groups.size());
+  std::iota(parent.begin(), parent.end(), 0);
+  auto find = [&parent](size_t group) {
+    while (parent[group] != group) {
+      group = parent[group] = parent[parent[group]];
+    }
+    return group;
+  };
+  std::unordered_map<EVar *, size_t> first_group;
+  for (size_t group = 0; group < groups.size(); ++group) {
+    size_t first_evar = evars->size();
+    for (AstNode *goal : groups[group].goals) {
+      CollectEVars(goal, evars);
+    }
+    for (size_t i = first_evar; i < evars->size(); ++i) {
+      auto inserted = first_group.emplace((*evars)[i], group);
+      if (!inserted.second) {
+        size_t a = find(inserted.first->second), b = find(group);
+        // Keep the lowest group as the root so partitions stay ordered.
+        parent[std::max(a, b)] = std::min(a, b);
+      }
+    }
   }
-  if (EncodedVNameOrIdentLessThan(ta->element(2), tb->element(2))) {
-    return true;
+  std::vector<std::vector<size_t>> partitions;
+  std::vector<size_t> partition_for_root(groups.size());
+  for (size_t group = 0; group < groups.size(); ++group) {
+    size_t root = find(group);
+    if (root == group) {
+      partition_for_root[root] = partitions.size();
+      partitions.emplace_back();
+    }
+    partitions[partition_for_root[root]].push_back(group);
   }
-  return false;
+  return partitions;
 }
 
 // The Solver acts in a closed world: any universal quantification can be
@@ -334,11 +550,16 @@ class Solver {
  public:
   using Inspection = AssertionParser::Inspection;
 
-  Solver(Verifier *context, Database &database,
-         std::multimap<std::pair<size_t, size_t>, AstNode *> &anchors,
+  /// \param facts The facts, sorted in `kLookupOrders[0]`.
+  /// \param indices The positions of the facts, sorted in each of the other
+  /// `kLookupOrders`.
+  Solver(Verifier *context, const std::vector<PackedFact> &facts,
+         const std::vector<std::vector<uint32_t>> &indices,
+         const std::vector<AnchorSpan> &anchors,
          std::function<bool(Verifier *, const Inspection &)> &inspect)
       : context_(*context),
-        database_(database),
+        facts_(facts),
+        indices_(indices),
         anchors_(anchors),
         inspect_(inspect) {}
 
@@ -414,6 +635,9 @@ class Solver {
       return f();
     }
     if (Occurs(e, t)) {
+      if (quiet_) {
+        return kInvalidProgram;
+      }
       FileHandlePrettyPrinter printer(stderr);
       printer.Print("Detected a cycle involving ");
       e->Dump(*context_.symbol_table(), &printer);
@@ -430,31 +654,96 @@ class Solver {
     return f_ret;
   }
 
-  ThunkRet MatchAtomVersusDatabase(AstNode *atom, ThunkRet cut, Thunk f) {
+  ThunkRet UnifyColumns(Tuple *st, const PackedFact &fact, size_t ofs,
+                        ThunkRet cut, Thunk f) {
+    if (ofs == 5) return f();
+    return Unify(st->element(ofs), fact.columns[ofs], cut,
+                 [this, st, &fact, ofs, cut, &f]() {
+                   return UnifyColumns(st, fact, ofs + 1, cut, f);
+                 });
+  }
+
+  /// \brief Unifies `atom` with `fact`. Goals of the usual form
+  /// `fact(a, b, c, d, e)` are unified column by column; anything else is
+  /// unified with a materialized copy of the fact.
+  ThunkRet UnifyFact(AstNode *atom, const PackedFact &fact, ThunkRet cut,
+                     Thunk f) {
+    if (App *app = atom->AsApp()) {
+      if (Tuple *tuple = app->rhs()->AsTuple()) {
+        if (tuple->size() != 5) {
+          return kNoException;
+        }
+        return Unify(app->lhs(), context_.fact_id(), cut,
+                     [this, tuple, &fact, cut, &f]() {
+                       return UnifyColumns(tuple, fact, 0, cut, f);
+                     });
+      }
+    }
+    return Unify(atom, context_.MaterializeFact(fact), cut, f);
+  }
+
+  /// \brief The facts that might unify with a goal: positions `[begin, end)`
+  /// in `index`, or in `facts_` if `index` is null.
+  struct CandidateRange {
+    const std::vector<uint32_t> *index = nullptr;
+    size_t begin = 0;
+    size_t end = 0;
+    size_t size() const { return end - begin; }
+  };
+
+  /// \brief Finds the narrowest range of facts that `atom` might unify with
+  /// among the indices that can use what is currently known about it. If
+  /// none of them can, the range is the whole database.
+  CandidateRange FindCandidates(AstNode *atom) {
+    CandidateRange range;
+    range.end = facts_.size();
     if (auto *app = atom->AsApp()) {
       if (app->lhs() == context_.fact_id()) {
         if (auto *tuple = app->rhs()->AsTuple()) {
           if (tuple->size() == 5) {
             AtomFactKey key(context_.vname_id(), tuple);
-            // Make use of the fast lookup sort order.
-            auto begin = std::lower_bound(database_.begin(), database_.end(),
-                                          &key, FastLookupFactLessThanKey);
-            auto end = std::upper_bound(database_.begin(), database_.end(),
-                                        &key, FastLookupKeyLessThanFact);
-            for (auto i = begin; i != end; ++i) {
-              ThunkRet exc = Unify(atom, *i, cut, f);
-              if (exc != kNoException) {
-                return exc;
+            for (size_t i = 0; i < kLookupOrderCount; ++i) {
+              const ColumnOrder &order = kLookupOrders[i];
+              if (!key.binds(order[0])) {
+                continue;
+              }
+              FastLookupFactLessThanKey fact_less{order, facts_};
+              FastLookupKeyLessThanFact key_less{order, facts_};
+              size_t lower, upper;
+              if (i == 0) {
+                auto first = std::lower_bound(facts_.begin(), facts_.end(),
+                                              key, fact_less);
+                lower = first - facts_.begin();
+                upper = std::upper_bound(first, facts_.end(), key, key_less) -
+                        facts_.begin();
+              } else {
+                const auto &positions = indices_[i - 1];
+                auto first = std::lower_bound(positions.begin(),
+                                              positions.end(), key, fact_less);
+                lower = first - positions.begin();
+                upper = std::upper_bound(first, positions.end(), key,
+                                         key_less) -
+                        positions.begin();
+              }
+              if (upper - lower < range.size()) {
+                range.index = i == 0 ? nullptr : &indices_[i - 1];
+                range.begin = lower;
+                range.end = upper;
               }
             }
-            return kNoException;
           }
         }
       }
     }
-    // Not enough information to filter by.
-    for (size_t fact = 0; fact < database_.size(); ++fact) {
-      ThunkRet exc = Unify(atom, database_[fact], cut, f);
+    return range;
+  }
+
+  ThunkRet MatchAtomVersusDatabase(AstNode *atom, ThunkRet cut, Thunk f) {
+    CandidateRange range = FindCandidates(atom);
+    for (size_t i = range.begin; i != range.end; ++i) {
+      const PackedFact &fact =
+          range.index == nullptr ? facts_[i] : facts_[(*range.index)[i]];
+      ThunkRet exc = UnifyFact(atom, fact, cut, f);
       if (exc != kNoException) {
         return exc;
       }
@@ -485,14 +774,15 @@ class Solver {
     if (auto *tu = MatchEqualsArgs(atom)) {
       if (Range *r = tu->element(0)->AsRange()) {
         auto anchors =
-            anchors_.equal_range(std::make_pair(r->begin(), r->end()));
+            std::equal_range(anchors_.begin(), anchors_.end(),
+                             AnchorSpan{r->begin(), r->end(), nullptr});
         if (anchors.first == anchors.second) {
           // There's no anchor with this range in the database.
           // This goal can therefore never succeed.
           return kImpossible;
         }
         for (auto anchor = anchors.first; anchor != anchors.second; ++anchor) {
-          ThunkRet unify_ret = Unify(anchor->second, tu->element(1), cut, f);
+          ThunkRet unify_ret = Unify(anchor->vname, tu->element(1), cut, f);
           if (unify_ret != kNoException) {
             return unify_ret;
           }
@@ -529,6 +819,50 @@ class Solver {
     });
   }
 
+  /// \brief Estimates how many ways `goal` might be solved given the current
+  /// bindings. Equality goals don't search the database, so they cost nothing.
+  size_t EstimateCost(AstNode *goal) {
+    return MatchEqualsArgs(goal) ? 0 : FindCandidates(goal).size();
+  }
+
+  /// \brief Like `SolveGoalArray`, but rather than solving goals in source
+  /// order, solves whichever goal not yet in `solved` has the fewest
+  /// candidate facts given the current bindings. `highest_goal_reached_`
+  /// still names a goal by its position in the source.
+  /// \param depth The number of goals in `solved`.
+  ThunkRet SolvePlannedGoals(AssertionParser::GoalGroup *group,
+                             std::vector<bool> *solved, size_t depth,
+                             ThunkRet cut, Thunk f) {
+    const auto &goals = group->goals;
+    size_t next = goals.size();
+    size_t next_cost = 0;
+    for (size_t goal = 0; goal < goals.size(); ++goal) {
+      if ((*solved)[goal]) {
+        continue;
+      }
+      size_t cost = EstimateCost(goals[goal]);
+      if (next == goals.size() || cost < next_cost) {
+        next = goal;
+        next_cost = cost;
+      }
+    }
+    if (depth + 1 > planned_depth_reached_) {
+      // Report the first goal we tried at the deepest level we reached.
+      planned_depth_reached_ = depth + 1;
+      highest_goal_reached_ = next;
+    }
+    if (next == goals.size()) {
+      return f();
+    }
+    (*solved)[next] = true;
+    ThunkRet result =
+        SolveGoal(goals[next], cut, [this, group, solved, depth, cut, &f]() {
+          return SolvePlannedGoals(group, solved, depth + 1, cut, f);
+        });
+    (*solved)[next] = false;
+    return result;
+  }
+
   bool PerformInspection() {
     for (const auto &inspection : context_.parser()->inspections()) {
       if (!inspect_(&context_, inspection)) {
@@ -538,33 +872,55 @@ class Solver {
     return true;
   }
 
-  ThunkRet SolveGoalGroups(AssertionParser *context, Thunk f) {
-    for (size_t cur = 0, cut = kFirstCut; cur < context->groups().size();
-         ++cur, ++cut) {
+  /// \brief Solves the goal groups at `indices` in order.
+  /// \return kSolved if every group was accepted; kNoException if a group was
+  /// rejected by its acceptance criterion; or some other exception.
+  ThunkRet SolveGoalGroupList(AssertionParser *context,
+                              const std::vector<size_t> &indices) {
+    for (size_t cur : indices) {
+      ThunkRet cut = kFirstCut + cur;
       auto *group = &context->groups()[cur];
       if (cur > highest_group_reached_) {
         highest_goal_reached_ = 0;
         highest_group_reached_ = cur;
+        planned_depth_reached_ = 0;
+      }
+      ThunkRet result;
+      if (reorder_goals_) {
+        std::vector<bool> solved(group->goals.size(), false);
+        result = SolvePlannedGoals(group, &solved, 0, cut,
+                                   [cut]() { return cut; });
+      } else {
+        result = SolveGoalArray(group, 0, cut, [cut]() { return cut; });
       }
-      ThunkRet result = SolveGoalArray(
-          group, 0, cut,
-          [this, context, group, cur, cut, &f]() { return cut; });
       // Lots of unwinding later...
       if (result == cut) {
         // That last goal group succeeded.
         if (group->accept_if != AssertionParser::GoalGroup::kNoneMayFail) {
-          return PerformInspection() ? kNoException : kInvalidProgram;
+          return kNoException;
         }
       } else if (result == kNoException || result == kImpossible) {
         // That last goal group failed.
         if (group->accept_if != AssertionParser::GoalGroup::kSomeMustFail) {
-          return PerformInspection() ? kNoException : kInvalidProgram;
+          return kNoException;
         }
       } else {
         return result;
       }
     }
-    return PerformInspection() ? f() : kInvalidProgram;
+    return kSolved;
+  }
+
+  ThunkRet SolveGoalGroups(AssertionParser *context, Thunk f) {
+    std::vector<size_t> indices(context->groups().size());
+    std::iota(indices.begin(), indices.end(), 0);
+    ThunkRet result = SolveGoalGroupList(context, indices);
+    if (result == kSolved) {
+      return PerformInspection() ? f() : kInvalidProgram;
+    } else if (result == kNoException) {
+      return PerformInspection() ? kNoException : kInvalidProgram;
+    }
+    return result;
   }
 
   bool Solve() {
@@ -572,17 +928,82 @@ class Solver {
     return exn == kSolved;
   }
 
+  /// \brief Solves independent partitions of the goal groups on up to
+  /// `thread_count` threads.
+  ///
+  /// If every group is accepted, the outcome is the same as `Solve()`'s.
+  /// Otherwise the goals are reset and solved again with `Solve()`, so that
+  /// diagnostics, inspections and the highest goal reached are exactly those
+  /// of a sequential run.
+  bool Solve(size_t thread_count) {
+    AssertionParser *context = context_.parser();
+    std::vector<EVar *> evars;
+    auto partitions = PartitionGoalGroups(context, &evars);
+    if (thread_count <= 1 || partitions.size() <= 1) {
+      return Solve();
+    }
+    std::vector<std::unique_ptr<Solver>> solvers;
+    for (size_t i = 0; i < partitions.size(); ++i) {
+      solvers.emplace_back(std::unique_ptr<Solver>(
+          new Solver(&context_, facts_, indices_, anchors_, inspect_)));
+      solvers.back()->quiet_ = true;
+      solvers.back()->reorder_goals_ = reorder_goals_;
+    }
+    std::vector<ThunkRet> results(partitions.size(), kNoException);
+    std::atomic<size_t> next_partition(0);
+    std::vector<std::thread> workers;
+    for (size_t t = 0; t < std::min(thread_count, partitions.size()); ++t) {
+      workers.emplace_back([&] {
+        for (size_t p; (p = next_partition++) < partitions.size();) {
+          results[p] = solvers[p]->SolveGoalGroupList(context, partitions[p]);
+        }
+      });
+    }
+    for (auto &worker : workers) {
+      worker.join();
+    }
+    if (std::all_of(results.begin(), results.end(),
+                    [](ThunkRet result) { return result == kSolved; })) {
+      // The last group decides the highest goal reached, just as it does
+      // when groups are solved in order.
+      for (size_t p = 0; p < partitions.size(); ++p) {
+        if (partitions[p].back() + 1 == context->groups().size()) {
+          highest_group_reached_ = solvers[p]->highest_group_reached_;
+          highest_goal_reached_ = solvers[p]->highest_goal_reached_;
+        }
+      }
+      return PerformInspection();
+    }
+    for (EVar *evar : evars) {
+      evar->set_current(nullptr);
+    }
+    return Solve();
+  }
+
   size_t highest_group_reached() const { return highest_group_reached_; }
 
   size_t highest_goal_reached() const { return highest_goal_reached_; }
 
+  /// \brief Solve the goals in each group in order of selectivity rather
+  /// than in source order. This doesn't change which groups succeed, only
+  /// the order in which solutions are found.
+  void set_reorder_goals(bool reorder_goals) { reorder_goals_ = reorder_goals; }
+
  private:
   Verifier &context_;
-  Database &database_;
-  std::multimap<std::pair<size_t, size_t>, AstNode *> &anchors_;
+  const std::vector<PackedFact> &facts_;
+  const std::vector<std::vector<uint32_t>> &indices_;
+  const std::vector<AnchorSpan> &anchors_;
   std::function<bool(Verifier *, const Inspection &)> &inspect_;
   size_t highest_group_reached_ = 0;
   size_t highest_goal_reached_ = 0;
+  /// If true, don't print diagnostics while solving.
+  bool quiet_ = false;
+  /// If true, use `SolvePlannedGoals` rather than `SolveGoalArray`.
+  bool reorder_goals_ = false;
+  /// One more than the deepest level `SolvePlannedGoals` reached in the
+  /// highest group reached, or 0 if it hasn't been called for that group.
+  size_t planned_depth_reached_ = 0;
 };
 }  // anonymous namespace
 
@@ -639,6 +1060,24 @@ Verifier::Verifier(bool trace_lex, bool trace_parse)
       IdentifierFor(builtin_location_, "/kythe/edge/code");
   marked_source_false_id_ = IdentifierFor(builtin_location_, "false");
   SetGoalCommentPrefix("//-");
+  builtins_mark_ = arena_.mark();
+}
+
+void Verifier::Reset() {
+  parser_.Reset();
+  facts_.clear();
+  fact_indices_.clear();
+  anchors_.clear();
+  database_prepared_ = false;
+  highest_group_reached_ = 0;
+  highest_goal_reached_ = 0;
+  saved_assignments_.clear();
+  fake_files_.clear();
+  database_identifiers_.clear();
+  database_vnames_.clear();
+  prefilter_.reset();
+  facts_skipped_ = 0;
+  arena_.Rewind(builtins_mark_);
 }
 
 void Verifier::SetGoalCommentPrefix(const std::string &it) {
@@ -688,19 +1127,56 @@ bool Verifier::LoadInlineProtoFile(const std::string &file_data) {
 }
 
 bool Verifier::LoadInlineRuleFile(const std::string &filename) {
-  bool parsed = parser_.ParseInlineRuleFile(filename, *goal_comment_regex_);
-  if (!parsed) {
+  std::string content;
+  if (rule_cache_directory_.empty() || !ReadWholeFile(filename, &content)) {
+    // Let the parser report any problems with the file.
+    return parser_.ParseInlineRuleFile(filename, *goal_comment_regex_);
+  }
+  const std::string cache_path = RuleCachePath(content);
+  std::string serialized;
+  if (ReadWholeFile(cache_path, &serialized) &&
+      parser_.LoadSerializedRules(filename, serialized)) {
+    return true;
+  }
+  auto mark = parser_.mark();
+  if (!parser_.ParseInlineRuleString(content, filename,
+                                     *goal_comment_regex_)) {
     return false;
   }
+  if (parser_.SerializeRulesSince(mark, &serialized) &&
+      !WriteFileAtomically(cache_path, serialized)) {
+    LOG(WARNING) << "Couldn't write " << cache_path;
+  }
   return true;
 }
 
+std::string Verifier::RuleCachePath(const std::string &content) const {
+  // Everything that changes what parsing produces goes into the key.
+  ::SHA256_CTX sha;
+  ::SHA256_Init(&sha);
+  auto add = [&sha](const std::string &data) {
+    ::SHA256_Update(&sha, data.data(), data.size() + 1);
+  };
+  add(goal_comment_regex_->pattern());
+  add(parser_.inspects_all_evars() ? "inspect" : "");
+  add(content);
+  unsigned char digest[SHA256_DIGEST_LENGTH];
+  ::SHA256_Final(digest, &sha);
+  static constexpr char kHexDigits[] = "0123456789abcdef";
+  std::string path = rule_cache_directory_ + "/";
+  for (unsigned char byte : digest) {
+    path.push_back(kHexDigits[byte >> 4]);
+    path.push_back(kHexDigits[byte & 0xF]);
+  }
+  return path + ".rules";
+}
+
 bool Verifier::LoadInMemoryRuleFile(AstNode *vname, Symbol text) {
   StringPrettyPrinter printer;
   vname->Dump(symbol_table_, &printer);
   fake_files_[printer.str()] = text;
-  return parser_.ParseInlineRuleString(symbol_table_.text(text), printer.str(),
-                                       *goal_comment_regex_);
+  return parser_.ParseInlineRuleString(symbol_table_.text(text).str(),
+                                       printer.str(), *goal_comment_regex_);
 }
 
 void Verifier::IgnoreDuplicateFacts() { ignore_dups_ = true; }
@@ -847,7 +1323,7 @@ void Verifier::DumpErrorGoal(size_t group, size_t index) {
     auto has_symbol = fake_files_.find(*goal_end.filename);
     if (has_symbol != fake_files_.end()) {
       printed_goal = PrintInMemoryFileSection(
-          symbol_table_.text(has_symbol->second), goal_begin.line - 1,
+          symbol_table_.text(has_symbol->second).str(), goal_begin.line - 1,
           goal_begin.column - 1, goal_end.line - 1, goal_end.column - 1,
           &printer);
     } else if (*goal_end.filename != *kStandardIn &&
@@ -871,8 +1347,9 @@ bool Verifier::VerifyAllGoals(
   if (!PrepareDatabase()) {
     return false;
   }
-  Solver solver(this, facts_, anchors_, inspect);
-  bool result = solver.Solve();
+  Solver solver(this, facts_, fact_indices_, anchors_, inspect);
+  solver.set_reorder_goals(reorder_goals_);
+  bool result = solver.Solve(thread_count_);
   highest_goal_reached_ = solver.highest_goal_reached();
   highest_group_reached_ = solver.highest_group_reached();
   return result;
@@ -919,48 +1396,21 @@ AstNode *Verifier::MakePredicate(const yy::location &location, AstNode *head,
   return new (&arena_) App(location, head, tuple);
 }
 
-/// \brief Sort nodes such that nodes and facts are grouped.
-static bool GraphvizSortOrder(AstNode *a, AstNode *b) {
-  Tuple *ta = a->AsApp()->rhs()->AsTuple();
-  Tuple *tb = b->AsApp()->rhs()->AsTuple();
-  if (EncodedVNameOrIdentLessThan(ta->element(0), tb->element(0))) {
-    return true;
-  }
-  if (!EncodedVNameOrIdentEqualTo(ta->element(0), tb->element(0))) {
-    return false;
-  }
-  if (EncodedIdentLessThan(ta->element(1), tb->element(1))) {
-    return true;
-  }
-  if (!EncodedIdentEqualTo(ta->element(1), tb->element(1))) {
-    return false;
-  }
-  if (EncodedVNameOrIdentLessThan(ta->element(2), tb->element(2))) {
-    return true;
-  }
-  if (!EncodedVNameOrIdentEqualTo(ta->element(2), tb->element(2))) {
-    return false;
-  }
-  if (EncodedIdentLessThan(ta->element(3), tb->element(3))) {
-    return true;
-  }
-  if (!EncodedIdentEqualTo(ta->element(3), tb->element(3))) {
-    return false;
-  }
-  if (EncodedIdentLessThan(ta->element(4), tb->element(4))) {
-    return true;
-  }
-  return false;
+AstNode *Verifier::MaterializeFact(const PackedFact &fact) {
+  std::lock_guard<std::mutex> lock(materialize_mutex_);
+  AstNode **values = (AstNode **)arena_.New(sizeof(AstNode *) * 5);
+  std::copy(fact.columns, fact.columns + 5, values);
+  AstNode *tuple =
+      new (&arena_) Tuple(fact.columns[0]->location(), 5, values);
+  return new (&arena_) App(fact_id_, tuple);
 }
 
-static bool EncodedFactEqualTo(AstNode *a, AstNode *b) {
-  Tuple *ta = a->AsApp()->rhs()->AsTuple();
-  Tuple *tb = b->AsApp()->rhs()->AsTuple();
-  return EncodedVNameOrIdentEqualTo(ta->element(0), tb->element(0)) &&
-         EncodedIdentEqualTo(ta->element(1), tb->element(1)) &&
-         EncodedVNameOrIdentEqualTo(ta->element(2), tb->element(2)) &&
-         EncodedIdentEqualTo(ta->element(3), tb->element(3)) &&
-         EncodedIdentEqualTo(ta->element(4), tb->element(4));
+static bool EncodedFactEqualTo(const PackedFact &a, const PackedFact &b) {
+  return EncodedVNameOrIdentEqualTo(a.columns[0], b.columns[0]) &&
+         EncodedIdentEqualTo(a.columns[1], b.columns[1]) &&
+         EncodedVNameOrIdentEqualTo(a.columns[2], b.columns[2]) &&
+         EncodedIdentEqualTo(a.columns[3], b.columns[3]) &&
+         EncodedIdentEqualTo(a.columns[4], b.columns[4]);
 }
 
 static bool EncodedVNameHasValidForm(Verifier *cxt, AstNode *a) {
@@ -972,33 +1422,32 @@ static bool EncodedVNameHasValidForm(Verifier *cxt, AstNode *a) {
          ta->element(4) != cxt->empty_string_id();
 }
 
-static bool EncodedFactHasValidForm(Verifier *cxt, AstNode *a) {
-  Tuple *ta = a->AsApp()->rhs()->AsTuple();
-  if (ta->element(0) == cxt->empty_string_id() ||
-      !EncodedVNameHasValidForm(cxt, ta->element(0))) {
+static bool EncodedFactHasValidForm(Verifier *cxt, const PackedFact &a) {
+  if (a.columns[0] == cxt->empty_string_id() ||
+      !EncodedVNameHasValidForm(cxt, a.columns[0])) {
     // Always need a source.
     return false;
   }
-  if (ta->element(1) == cxt->empty_string_id()) {
+  if (a.columns[1] == cxt->empty_string_id()) {
     // (source, "", "", string, _)
-    return ta->element(2) == cxt->empty_string_id() &&
-           ta->element(3) != cxt->empty_string_id();
+    return a.columns[2] == cxt->empty_string_id() &&
+           a.columns[3] != cxt->empty_string_id();
   } else {
     // (source, edge, target, ...
-    if (ta->element(2) == cxt->empty_string_id() ||
-        !EncodedVNameHasValidForm(cxt, ta->element(2))) {
+    if (a.columns[2] == cxt->empty_string_id() ||
+        !EncodedVNameHasValidForm(cxt, a.columns[2])) {
       return false;
     }
-    if (EncodedIdentEqualTo(ta->element(3), cxt->root_id())) {
+    if (EncodedIdentEqualTo(a.columns[3], cxt->root_id())) {
       // ... /, )
-      return EncodedIdentEqualTo(ta->element(4), cxt->empty_string_id());
+      return EncodedIdentEqualTo(a.columns[4], cxt->empty_string_id());
     } else {
       // ... /kythe/ordinal, base10string )
-      if (!EncodedIdentEqualTo(ta->element(3), cxt->ordinal_id())) {
+      if (!EncodedIdentEqualTo(a.columns[3], cxt->ordinal_id())) {
         return false;
       }
-      const std::string &ordinal_val =
-          cxt->symbol_table()->text(ta->element(4)->AsIdentifier()->symbol());
+      llvm::StringRef ordinal_val =
+          cxt->symbol_table()->text(a.columns[4]->AsIdentifier()->symbol());
       // TODO: check if valid int
       return true;
     }
@@ -1016,41 +1465,44 @@ bool Verifier::PrepareDatabase() {
   // vname (ident, ident, ident, ident, ident)
   // and all idents will have been uniqued (so we can compare them purely
   // by symbol ID).
-  std::sort(facts_.begin(), facts_.end(), EncodedFactLessThan);
+  ParallelSort(facts_.begin(), facts_.end(),
+               FastLookupFactLessThan{kLookupOrders[0], facts_}, thread_count_);
   // Now we can do a simple pairwise check on each of the facts to see
   // whether the invariants hold.
   bool is_ok = true;
+  anchors_.clear();
   AstNode *last_anchor_vname = nullptr;
   AstNode *last_file_vname = nullptr;
   size_t last_anchor_start = ~0;
   for (size_t f = 0; f < facts_.size(); ++f) {
-    AstNode *fb = facts_[f];
+    const PackedFact &fb = facts_[f];
 
     if (!EncodedFactHasValidForm(this, fb)) {
       printer.Print("Fact has invalid form:\n  ");
-      fb->Dump(symbol_table_, &printer);
+      MaterializeFact(fb)->Dump(symbol_table_, &printer);
       printer.Print("\n");
       is_ok = false;
       continue;
     }
-    Tuple *tb = fb->AsApp()->rhs()->AsTuple();
-    if (tb->element(1) == empty_string_id_ &&
-        tb->element(2) == empty_string_id_) {
-      bool is_kind_fact = EncodedIdentEqualTo(tb->element(3), kind_id_);
+    if (fb.columns[1] == empty_string_id_ &&
+        fb.columns[2] == empty_string_id_) {
+      bool is_kind_fact = EncodedIdentEqualTo(fb.columns[3], kind_id_);
       // Check to see if this fact entry describes part of a file.
       // NB: kind_id_ is ordered before text_id_.
       if (assertions_from_file_nodes_) {
         if (is_kind_fact) {
-          if (EncodedIdentEqualTo(tb->element(4), file_id_)) {
-            last_file_vname = tb->element(0);
+          if (EncodedIdentEqualTo(fb.columns[4], file_id_)) {
+            last_file_vname = fb.columns[0];
           } else {
             last_file_vname = nullptr;
           }
         } else if (last_file_vname != nullptr &&
-                   EncodedIdentEqualTo(tb->element(3), text_id_)) {
-          if (EncodedVNameOrIdentEqualTo(last_file_vname, tb->element(0))) {
+                   EncodedIdentEqualTo(fb.columns[3], text_id_)) {
+          if (EncodedVNameOrIdentEqualTo(last_file_vname, fb.columns[0])) {
+            // The parser reports its own errors; keep them in order.
+            printer.Flush();
             if (!LoadInMemoryRuleFile(
-                    tb->element(0), tb->element(4)->AsIdentifier()->symbol())) {
+                    fb.columns[0], fb.columns[4]->AsIdentifier()->symbol())) {
               is_ok = false;
             }
           }
@@ -1058,21 +1510,20 @@ bool Verifier::PrepareDatabase() {
         }
       }
       // Check to see if this fact entry describes part of an anchor.
-      // We've arranged via EncodedFactLessThan to sort kind_id_ before
+      // We've arranged via kLookupOrders[0] to sort kind_id_ before
       // start_id_ and start_id_ before end_id_ and to group all node facts
       // together in uninterrupted runs.
-      if (is_kind_fact && EncodedIdentEqualTo(tb->element(4), anchor_id_)) {
+      if (is_kind_fact && EncodedIdentEqualTo(fb.columns[4], anchor_id_)) {
         // Start tracking a new anchor.
-        last_anchor_vname = tb->element(0);
+        last_anchor_vname = fb.columns[0];
         last_anchor_start = ~0;
       } else if (last_anchor_vname != nullptr &&
-                 EncodedIdentEqualTo(tb->element(3), start_id_) &&
-                 tb->element(4)->AsIdentifier()) {
-        if (EncodedVNameOrIdentEqualTo(last_anchor_vname, tb->element(0))) {
+                 EncodedIdentEqualTo(fb.columns[3], start_id_) &&
+                 fb.columns[4]->AsIdentifier()) {
+        if (EncodedVNameOrIdentEqualTo(last_anchor_vname, fb.columns[0])) {
           // This is a fact about the anchor we're tracking.
-          std::stringstream(
-              symbol_table_.text(tb->element(4)->AsIdentifier()->symbol())) >>
-              last_anchor_start;
+          last_anchor_start = ParseOffset(
+              symbol_table_.text(fb.columns[4]->AsIdentifier()->symbol()));
         } else {
           // This is a fact about node we're not tracking; given our sort order,
           // we'll never get enough information for the node we are tracking,
@@ -1081,14 +1532,12 @@ bool Verifier::PrepareDatabase() {
           last_anchor_start = ~0;
         }
       } else if (last_anchor_start != ~0 &&
-                 EncodedIdentEqualTo(tb->element(3), end_id_) &&
-                 tb->element(4)->AsIdentifier()) {
-        if (EncodedVNameOrIdentEqualTo(last_anchor_vname, tb->element(0))) {
+                 EncodedIdentEqualTo(fb.columns[3], end_id_) &&
+                 fb.columns[4]->AsIdentifier()) {
+        if (EncodedVNameOrIdentEqualTo(last_anchor_vname, fb.columns[0])) {
           // We have enough information about the anchor we're tracking.
-          size_t last_anchor_end = ~0;
-          std::stringstream(
-              symbol_table_.text(tb->element(4)->AsIdentifier()->symbol())) >>
-              last_anchor_end;
+          size_t last_anchor_end = ParseOffset(
+              symbol_table_.text(fb.columns[4]->AsIdentifier()->symbol()));
           AddAnchor(last_anchor_vname, last_anchor_start, last_anchor_end);
         }
         last_anchor_vname = nullptr;
@@ -1099,36 +1548,35 @@ bool Verifier::PrepareDatabase() {
       continue;
     }
 
-    AstNode *fa = facts_[f - 1];
+    const PackedFact &fa = facts_[f - 1];
     if (!ignore_dups_ && EncodedFactEqualTo(fa, fb)) {
       printer.Print("Two facts were equal:\n  ");
-      fa->Dump(symbol_table_, &printer);
+      MaterializeFact(fa)->Dump(symbol_table_, &printer);
       printer.Print("\n  ");
-      fb->Dump(symbol_table_, &printer);
+      MaterializeFact(fb)->Dump(symbol_table_, &printer);
       printer.Print("\n");
       is_ok = false;
       continue;
     }
-    Tuple *ta = fa->AsApp()->rhs()->AsTuple();
-    if (EncodedVNameEqualTo(ta->element(0)->AsApp(), tb->element(0)->AsApp()) &&
-        ta->element(1) == empty_string_id_ &&
-        tb->element(1) == empty_string_id_ &&
-        ta->element(2) == empty_string_id_ &&
-        tb->element(2) == empty_string_id_ &&
-        EncodedIdentEqualTo(ta->element(3), tb->element(3)) &&
-        !EncodedIdentEqualTo(ta->element(4), tb->element(4))) {
-      if (EncodedIdentEqualTo(ta->element(3), code_id_)) {
+    if (EncodedVNameEqualTo(fa.columns[0]->AsApp(), fb.columns[0]->AsApp()) &&
+        fa.columns[1] == empty_string_id_ &&
+        fb.columns[1] == empty_string_id_ &&
+        fa.columns[2] == empty_string_id_ &&
+        fb.columns[2] == empty_string_id_ &&
+        EncodedIdentEqualTo(fa.columns[3], fb.columns[3]) &&
+        !EncodedIdentEqualTo(fa.columns[4], fb.columns[4])) {
+      if (EncodedIdentEqualTo(fa.columns[3], code_id_)) {
         // TODO(zarko): Add documentation for these new edges (T195).
         printer.Print(
             "Two /kythe/code facts about a node differed in value:\n  ");
-        ta->element(0)->Dump(symbol_table_, &printer);
+        fa.columns[0]->Dump(symbol_table_, &printer);
         printer.Print("\n  ");
         printer.Print("\nThe decoded values were:\n");
         auto print_decoded = [&](AstNode *value) {
           if (auto *ident = value->AsIdentifier()) {
             proto::common::MarkedSource marked_source;
-            if (!marked_source.ParseFromString(
-                    symbol_table_.text(ident->symbol()))) {
+            llvm::StringRef text = symbol_table_.text(ident->symbol());
+            if (!marked_source.ParseFromArray(text.data(), text.size())) {
               printer.Print("(failed to decode)\n");
             } else {
               printer.Print(marked_source.DebugString());
@@ -1138,21 +1586,33 @@ bool Verifier::PrepareDatabase() {
             printer.Print("(not an identifier)\n");
           }
         };
-        print_decoded(ta->element(4));
+        print_decoded(fa.columns[4]);
         printer.Print("\n -----------------  versus  ----------------- \n\n");
-        print_decoded(tb->element(4));
+        print_decoded(fb.columns[4]);
       } else {
         printer.Print("Two facts about a node differed in value:\n  ");
-        fa->Dump(symbol_table_, &printer);
+        MaterializeFact(fa)->Dump(symbol_table_, &printer);
         printer.Print("\n  ");
-        fb->Dump(symbol_table_, &printer);
+        MaterializeFact(fb)->Dump(symbol_table_, &printer);
         printer.Print("\n");
       }
       is_ok = false;
     }
   }
+  // Anchors were found in fact order; keep that order among anchors with the
+  // same span so they're tried in the same order as before.
+  std::stable_sort(anchors_.begin(), anchors_.end());
   if (is_ok) {
-    std::sort(facts_.begin(), facts_.end(), FastLookupFactLessThan);
+    // `facts_` is already in the first lookup order.
+    fact_indices_.clear();
+    for (size_t i = 1; i < kLookupOrderCount; ++i) {
+      fact_indices_.emplace_back(facts_.size());
+      auto &index = fact_indices_.back();
+      std::iota(index.begin(), index.end(), 0);
+      ParallelSort(index.begin(), index.end(),
+                   FastLookupFactLessThan{kLookupOrders[i], facts_},
+                   thread_count_);
+    }
   }
   database_prepared_ = is_ok;
   return is_ok;
@@ -1201,10 +1661,9 @@ AstNode *Verifier::ConvertMarkedSource(const yy::location &loc,
     if (child_vname == nullptr) {
       return nullptr;
     }
-    facts_.push_back(MakePredicate(
-        loc, fact_id_,
-        {vname, marked_source_child_id_, child_vname, ordinal_id_,
-         IdentifierFor(builtin_location_, std::to_string(child))}));
+    facts_.push_back(
+        PackedFact{{vname, marked_source_child_id_, child_vname, ordinal_id_,
+                    IdentifierFor(builtin_location_, std::to_string(child))}});
   }
   for (const auto &link : source.link()) {
     if (link.definition_size() != 1) {
@@ -1216,15 +1675,13 @@ AstNode *Verifier::ConvertMarkedSource(const yy::location &loc,
       std::cerr << loc << ": bad URI in link" << std::endl;
       return nullptr;
     }
-    facts_.push_back(MakePredicate(loc, fact_id_,
-                                   {vname, marked_source_link_id_,
-                                    ConvertVName(loc, from_uri.second.v_name()),
-                                    root_id_, empty_string_id_}));
+    facts_.push_back(PackedFact{{vname, marked_source_link_id_,
+                                 ConvertVName(loc, from_uri.second.v_name()),
+                                 root_id_, empty_string_id_}});
   }
   auto emit_fact = [&](AstNode *fact_id, AstNode *fact_value) {
-    facts_.push_back(MakePredicate(
-        loc, fact_id_,
-        {vname, empty_string_id_, empty_string_id_, fact_id, fact_value}));
+    facts_.push_back(PackedFact{
+        {vname, empty_string_id_, empty_string_id_, fact_id, fact_value}});
   };
   switch (source.kind()) {
     case proto::common::MarkedSource::BOX:
@@ -1277,73 +1734,312 @@ AstNode *Verifier::ConvertMarkedSource(const yy::location &loc,
   return vname;
 }
 
+bool GoalPrefilter::NodeColumn::Admits(const llvm::StringRef *node) const {
+  if (node == nullptr) {
+    return admits_none;
+  }
+  for (size_t i = 0; i < 5; ++i) {
+    if (!fields[i].Admits(node[i])) {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool GoalPrefilter::Admits(const llvm::StringRef *source,
+                           llvm::StringRef edge_kind,
+                           const llvm::StringRef *target,
+                           llvm::StringRef fact_name,
+                           llvm::StringRef fact_value) const {
+  // Split dotted edge kinds the same way `Verifier::AssertFact` does.
+  auto dot_pos = edge_kind.rfind('.');
+  if (dot_pos != llvm::StringRef::npos && dot_pos > 0 &&
+      dot_pos < edge_kind.size() - 1) {
+    fact_name = "/kythe/ordinal";
+    fact_value = edge_kind.substr(dot_pos + 1);
+    edge_kind = edge_kind.substr(0, dot_pos);
+  } else if (admits_code && fact_name == "/kythe/code") {
+    return true;
+  } else if (admits_anchors && edge_kind.empty() &&
+             ((fact_name == "/kythe/node/kind" && fact_value == "anchor") ||
+              fact_name == "/kythe/loc/start" ||
+              fact_name == "/kythe/loc/end")) {
+    return true;
+  }
+  return sources.Admits(source) && edge_kinds.Admits(edge_kind) &&
+         targets.Admits(target) && fact_names.Admits(fact_name) &&
+         fact_values.Admits(fact_value);
+}
+
+namespace {
+/// \brief Follows `node` through any `EVar`s that have been assigned.
+AstNode *Dereference(AstNode *node) {
+  while (EVar *evar = node->AsEVar()) {
+    if (evar->current() == nullptr) {
+      break;
+    }
+    node = evar->current();
+  }
+  return node;
+}
+
+/// \brief Admits the text of `node` to `column`, or anything at all if
+/// `node` isn't an identifier.
+void AddToColumn(const SymbolTable &symbol_table, AstNode *node,
+                 GoalPrefilter::Column *column) {
+  if (Identifier *identifier = Dereference(node)->AsIdentifier()) {
+    column->texts.insert(symbol_table.text(identifier->symbol()));
+  } else {
+    column->any = true;
+  }
+}
+
+/// \brief Admits the nodes that might unify with `node` to `column`.
+void AddToNodeColumn(const SymbolTable &symbol_table, AstNode *node,
+                     GoalPrefilter::NodeColumn *column) {
+  node = Dereference(node);
+  if (Identifier *identifier = node->AsIdentifier()) {
+    // Nodes in the database are VNames or the empty identifier.
+    if (symbol_table.text(identifier->symbol()).empty()) {
+      column->admits_none = true;
+    }
+    return;
+  }
+  App *app = node->AsApp();
+  Tuple *tuple = app != nullptr ? app->rhs()->AsTuple() : nullptr;
+  if (tuple != nullptr && tuple->size() == 5) {
+    for (size_t i = 0; i < 5; ++i) {
+      AddToColumn(symbol_table, tuple->element(i), &column->fields[i]);
+    }
+    return;
+  }
+  column->admits_none = true;
+  for (auto &field : column->fields) {
+    field.any = true;
+  }
+}
+
+/// \brief Points `fields` at the signature, corpus, root, path and language
+/// of `vname`.
+void GetVNameFields(const kythe::proto::VName &vname, llvm::StringRef *fields) {
+  fields[0] = vname.signature();
+  fields[1] = vname.corpus();
+  fields[2] = vname.root();
+  fields[3] = vname.path();
+  fields[4] = vname.language();
+}
+}  // anonymous namespace
+
+void Verifier::PrefilterFactsByGoals() {
+  prefilter_.reset();
+  if (assertions_from_file_nodes_) {
+    // Most of the goals haven't been read yet.
+    return;
+  }
+  std::unique_ptr<GoalPrefilter> prefilter(new GoalPrefilter);
+  prefilter->admits_code = convert_marked_source_;
+  Symbol fact_symbol = fact_id_->AsIdentifier()->symbol();
+  for (const auto &group : parser_.groups()) {
+    for (AstNode *goal : group.goals) {
+      App *app = goal->AsApp();
+      Tuple *tuple = app != nullptr ? app->rhs()->AsTuple() : nullptr;
+      Identifier *head =
+          app != nullptr ? Dereference(app->lhs())->AsIdentifier() : nullptr;
+      if (head == nullptr || tuple == nullptr) {
+        // We can't tell what this goal might unify with.
+        return;
+      }
+      if (head->symbol() == eq_id_->symbol() && tuple->size() == 2) {
+        // Equality goals only look at the database to find anchors.
+        if (Dereference(tuple->element(0))->AsRange()) {
+          prefilter->admits_anchors = true;
+        }
+        continue;
+      }
+      if (head->symbol() != fact_symbol || tuple->size() != 5) {
+        return;
+      }
+      AddToNodeColumn(symbol_table_, tuple->element(0), &prefilter->sources);
+      AddToColumn(symbol_table_, tuple->element(1), &prefilter->edge_kinds);
+      AddToNodeColumn(symbol_table_, tuple->element(2), &prefilter->targets);
+      AddToColumn(symbol_table_, tuple->element(3), &prefilter->fact_names);
+      AddToColumn(symbol_table_, tuple->element(4), &prefilter->fact_values);
+    }
+  }
+  prefilter_ = std::move(prefilter);
+}
+
 bool Verifier::AssertSingleFact(std::string *database, unsigned int fact_id,
                                 const kythe::proto::Entry &entry) {
+  if (prefilter_) {
+    llvm::StringRef source[5], target[5];
+    GetVNameFields(entry.source(), source);
+    GetVNameFields(entry.target(), target);
+    if (!prefilter_->Admits(entry.has_source() ? source : nullptr,
+                            entry.edge_kind(),
+                            entry.has_target() ? target : nullptr,
+                            entry.fact_name(), entry.fact_value())) {
+      ++facts_skipped_;
+      return true;
+    }
+  }
+  yy::location loc;
+  loc.initialize(database);
+  loc.begin.column = 1;
+  loc.begin.line = fact_id;
+  loc.end = loc.begin;
+  return AssertFact(
+      loc,
+      entry.has_source() ? ConvertVName(loc, entry.source()) : empty_string_id_,
+      entry.edge_kind(),
+      entry.has_target() ? ConvertVName(loc, entry.target()) : empty_string_id_,
+      entry.fact_name(), entry.fact_value());
+}
+
+bool Verifier::AssertSingleFact(std::string *database, unsigned int fact_id,
+                                const EntryFields &entry) {
+  if (prefilter_ &&
+      !prefilter_->Admits(entry.has_source ? entry.source.fields : nullptr,
+                          entry.edge_kind,
+                          entry.has_target ? entry.target.fields : nullptr,
+                          entry.fact_name, entry.fact_value)) {
+    ++facts_skipped_;
+    return true;
+  }
   yy::location loc;
   loc.initialize(database);
   loc.begin.column = 1;
   loc.begin.line = fact_id;
   loc.end = loc.begin;
+  return AssertFact(
+      loc,
+      entry.has_source ? DatabaseVNameFor(loc, entry.source) : empty_string_id_,
+      entry.edge_kind,
+      entry.has_target ? DatabaseVNameFor(loc, entry.target) : empty_string_id_,
+      entry.fact_name, entry.fact_value);
+}
+
+bool Verifier::AssertFact(const yy::location &loc, AstNode *source,
+                          llvm::StringRef edge_kind, AstNode *target,
+                          llvm::StringRef fact_name,
+                          llvm::StringRef fact_value) {
   Symbol code_symbol = code_id_->AsIdentifier()->symbol();
-  AstNode **values = (AstNode **)arena_.New(sizeof(AstNode *) * 5);
-  values[0] =
-      entry.has_source() ? ConvertVName(loc, entry.source()) : empty_string_id_;
+  PackedFact fact;
+  AstNode **values = fact.columns;
+  values[0] = source;
+  values[2] = target;
   // We're removing support for ordinal facts. Support them during the
   // transition, but also support the new dot-separated edge kinds that serve
   // the same purpose.
-  auto dot_pos = entry.edge_kind().rfind('.');
-  bool is_code = false;
-  if (dot_pos != std::string::npos && dot_pos > 0 &&
-      dot_pos < entry.edge_kind().size() - 1) {
-    values[1] = IdentifierFor(loc, entry.edge_kind().substr(0, dot_pos));
+  auto dot_pos = edge_kind.rfind('.');
+  if (dot_pos != llvm::StringRef::npos && dot_pos > 0 &&
+      dot_pos < edge_kind.size() - 1) {
+    values[1] = DatabaseIdentifierFor(loc, edge_kind.substr(0, dot_pos));
     values[3] = ordinal_id_;
-    values[4] = IdentifierFor(loc, entry.edge_kind().substr(dot_pos + 1));
+    values[4] = DatabaseIdentifierFor(loc, edge_kind.substr(dot_pos + 1));
   } else {
-    values[1] = entry.edge_kind().empty()
-                    ? empty_string_id_
-                    : IdentifierFor(loc, entry.edge_kind());
-    values[3] = entry.fact_name().empty()
-                    ? empty_string_id_
-                    : IdentifierFor(loc, entry.fact_name());
+    values[1] = DatabaseIdentifierFor(loc, edge_kind);
+    values[3] = DatabaseIdentifierFor(loc, fact_name);
     if (values[3]->AsIdentifier()->symbol() == code_symbol &&
         convert_marked_source_) {
       // Code facts are turned into subgraphs, so this fact entry will turn
       // into an edge entry.
-      if ((values[2] = ConvertCodeFact(loc, entry.fact_value())) == nullptr) {
+      if ((values[2] = ConvertCodeFact(loc, fact_value.str())) == nullptr) {
         return false;
       }
       values[1] = marked_source_code_edge_id_;
       values[3] = root_id_;
       values[4] = empty_string_id_;
-      is_code = true;
     } else {
-      values[4] = entry.fact_value().empty()
-                      ? empty_string_id_
-                      : IdentifierFor(loc, entry.fact_value());
+      values[4] = DatabaseIdentifierFor(loc, fact_value);
     }
   }
-  if (!is_code) {
-    values[2] = entry.has_target() ? ConvertVName(loc, entry.target())
-                                   : empty_string_id_;
-  }
-
-  AstNode *tuple = new (&arena_) Tuple(loc, 5, values);
-  AstNode *fact = new (&arena_) App(fact_id_, tuple);
 
   database_prepared_ = false;
   facts_.push_back(fact);
   return true;
 }
 
-void Verifier::DumpAsJson() {
+AstNode *Verifier::DatabaseIdentifierFor(const yy::location &loc,
+                                         llvm::StringRef text) {
+  if (text.empty()) {
+    return empty_string_id_;
+  }
+  Symbol symbol = symbol_table_.intern(text);
+  if (symbol >= database_identifiers_.size()) {
+    database_identifiers_.resize(symbol + 1, nullptr);
+  }
+  Identifier *&identifier = database_identifiers_[symbol];
+  if (identifier == nullptr) {
+    identifier = new (&arena_) Identifier(loc, symbol);
+  }
+  return identifier;
+}
+
+AstNode *Verifier::DatabaseVNameFor(const yy::location &loc,
+                                    const VNameFields &vname) {
+  AstNode *&node = database_vnames_[vname.encoded];
+  if (node == nullptr) {
+    AstNode **values = (AstNode **)arena_.New(sizeof(AstNode *) * 5);
+    for (size_t i = 0; i < 5; ++i) {
+      values[i] = DatabaseIdentifierFor(loc, vname.fields[i]);
+    }
+    AstNode *tuple = new (&arena_) Tuple(loc, 5, values);
+    node = new (&arena_) App(vname_id_, tuple);
+  }
+  return node;
+}
+
+namespace {
+/// \brief A `DumpFilter` resolved against a `SymbolTable`.
+class FactFilter {
+ public:
+  FactFilter(const DumpFilter &filter, SymbolTable *symbol_table)
+      : match_path_(!filter.path.empty()),
+        match_signature_(!filter.signature.empty()),
+        path_(match_path_ ? symbol_table->intern(filter.path) : 0),
+        signature_(match_signature_ ? symbol_table->intern(filter.signature)
+                                    : 0) {}
+
+  /// \return true if `fact` should be dumped.
+  bool Matches(const PackedFact &fact) const {
+    return (!match_path_ && !match_signature_) ||
+           NodeMatches(fact.columns[kSource]) ||
+           NodeMatches(fact.columns[kTarget]);
+  }
+
+ private:
+  bool NodeMatches(AstNode *node) const {
+    App *app = node->AsApp();
+    if (app == nullptr) {
+      return false;
+    }
+    Tuple *vname = app->rhs()->AsTuple();
+    return (!match_path_ ||
+            vname->element(3)->AsIdentifier()->symbol() == path_) &&
+           (!match_signature_ ||
+            vname->element(0)->AsIdentifier()->symbol() == signature_);
+  }
+
+  bool match_path_;
+  bool match_signature_;
+  Symbol path_;
+  Symbol signature_;
+};
+}  // anonymous namespace
+
+void Verifier::DumpAsJson(const DumpFilter &dump_filter) {
   if (!PrepareDatabase()) {
     return;
   }
-  // Use the same sort order as we do with Graphviz.
-  std::sort(facts_.begin(), facts_.end(), GraphvizSortOrder);
-  FileHandlePrettyPrinter printer(stdout);
+  FactFilter filter(dump_filter, &symbol_table_);
+  // Use the same sort order as we do with Graphviz, which is the order that
+  // `PrepareDatabase` leaves `facts_` in.
+  const auto &facts = facts_;
+  // Write facts out as we go rather than holding the dump in memory.
+  fflush(stdout);
+  FileDescriptorPrettyPrinter printer(STDOUT_FILENO);
   QuoteEscapingPrettyPrinter escaping_printer(printer);
-  FileHandlePrettyPrinter dprinter(stderr);
   auto DumpAsJson = [this, &printer, &escaping_printer](const char *label,
                                                         AstNode *node) {
     printer.Print(label);
@@ -1373,24 +2069,29 @@ void Verifier::DumpAsJson() {
     }
   };
   printer.Print("[");
-  for (size_t i = 0; i < facts_.size(); ++i) {
-    AstNode *fact = facts_[i];
-    Tuple *t = fact->AsApp()->rhs()->AsTuple();
-    printer.Print("{");
-    DumpVName("\"source\":", t->element(0));
-    DumpAsJson(",\"edge_kind\":", t->element(1));
-    DumpVName(",\"target\":", t->element(2));
-    DumpAsJson(",\"fact_name\":", t->element(3));
-    DumpAsJson(",\"fact_value\":", t->element(4));
-    printer.Print(i + 1 == facts_.size() ? "}" : "},");
+  bool first = true;
+  for (const auto &fact : facts) {
+    if (!filter.Matches(fact)) {
+      continue;
+    }
+    AstNode *const *t = fact.columns;
+    printer.Print(first ? "{" : ",{");
+    first = false;
+    DumpVName("\"source\":", t[0]);
+    DumpAsJson(",\"edge_kind\":", t[1]);
+    DumpVName(",\"target\":", t[2]);
+    DumpAsJson(",\"fact_name\":", t[3]);
+    DumpAsJson(",\"fact_value\":", t[4]);
+    printer.Print("}");
   }
   printer.Print("]\n");
 }
 
-void Verifier::DumpAsDot() {
+void Verifier::DumpAsDot(const DumpFilter &dump_filter) {
   if (!PrepareDatabase()) {
     return;
   }
+  FactFilter filter(dump_filter, &symbol_table_);
   std::map<std::string, std::string> vname_labels;
   for (const auto &label_vname : saved_assignments_) {
     if (!label_vname.second) {
@@ -1411,7 +2112,7 @@ void Verifier::DumpAsDot() {
     }
   }
   auto GetLabel = [&](AstNode *node) {
-    if (!node) {
+    if (!node || vname_labels.empty()) {
       return std::string();
     }
     StringPrettyPrinter id_string;
@@ -1424,38 +2125,44 @@ void Verifier::DumpAsDot() {
       return std::string();
     }
   };
-  std::sort(facts_.begin(), facts_.end(), GraphvizSortOrder);
-  FileHandlePrettyPrinter printer(stdout);
+  // `PrepareDatabase` sorted the facts such that nodes and facts are grouped.
+  const auto &facts = facts_;
+  // Write the graph out as we go rather than holding it in memory.
+  fflush(stdout);
+  FileDescriptorPrettyPrinter printer(STDOUT_FILENO);
   QuoteEscapingPrettyPrinter quote_printer(printer);
   HtmlEscapingPrettyPrinter html_printer(printer);
-  FileHandlePrettyPrinter dprinter(stderr);
   printer.Print("digraph G {\n");
-  for (size_t i = 0; i < facts_.size(); ++i) {
-    AstNode *fact = facts_[i];
-    Tuple *t = fact->AsApp()->rhs()->AsTuple();
+  for (size_t i = 0; i < facts.size(); ++i) {
+    if (!filter.Matches(facts[i])) {
+      // Node facts are grouped by source, so if this is the first fact in a
+      // node's block, the rest of the block will be skipped too.
+      continue;
+    }
+    AstNode *const *t = facts[i].columns;
     printer.Print("\"");
-    t->element(0)->Dump(symbol_table_, &quote_printer);
+    t[0]->Dump(symbol_table_, &quote_printer);
     printer.Print("\"");
-    if (t->element(1) == empty_string_id()) {
-      std::string label = GetLabel(t->element(0));
+    if (t[1] == empty_string_id()) {
+      std::string label = GetLabel(t[0]);
       // Node. We sorted these above st all the facts should come subsequent.
       // Figure out if the node is an anchor.
       bool is_anchor_node = false;
       bool is_file_node = false;
-      size_t first_fact = i, last_fact = facts_.size();
-      for (; i < facts_.size(); ++i) {
-        Tuple *nt = facts_[i]->AsApp()->rhs()->AsTuple();
-        if (!EncodedVNameOrIdentEqualTo(nt->element(0), t->element(0)) ||
-            nt->element(1) != empty_string_id()) {
+      size_t first_fact = i, last_fact = facts.size();
+      for (; i < facts.size(); ++i) {
+        AstNode *const *nt = facts[i].columns;
+        if (!EncodedVNameOrIdentEqualTo(nt[0], t[0]) ||
+            nt[1] != empty_string_id()) {
           // Moved past the fact block or moved to a different source node.
           last_fact = i;
           break;
         }
-        if (EncodedIdentEqualTo(nt->element(3), kind_id_)) {
-          if (EncodedIdentEqualTo(nt->element(4), anchor_id_)) {
+        if (EncodedIdentEqualTo(nt[3], kind_id_)) {
+          if (EncodedIdentEqualTo(nt[4], anchor_id_)) {
             // Keep on scanning to find the end of the fact block.
             is_anchor_node = true;
-          } else if (EncodedIdentEqualTo(nt->element(4), file_id_)) {
+          } else if (EncodedIdentEqualTo(nt[4], file_id_)) {
             is_file_node = true;
           }
         }
@@ -1470,27 +2177,27 @@ void Verifier::DumpAsDot() {
       } else {
         printer.Print(" [ label=<<TABLE>");
         printer.Print("<TR><TD COLSPAN=\"2\">");
-        Tuple *nt = facts_[first_fact]->AsApp()->rhs()->AsTuple();
+        AstNode *const *nt = facts[first_fact].columns;
         // Since all of our facts are well-formed, we know this is a vname.
-        nt->element(0)->AsApp()->rhs()->Dump(symbol_table_, &html_printer);
+        nt[0]->AsApp()->rhs()->Dump(symbol_table_, &html_printer);
         if (!label.empty()) {
           html_printer.Print(" = ");
           html_printer.Print(label);
         }
         printer.Print("</TD></TR>");
         for (i = first_fact; i < last_fact; ++i) {
-          Tuple *nt = facts_[i]->AsApp()->rhs()->AsTuple();
+          AstNode *const *nt = facts[i].columns;
           printer.Print("<TR><TD>");
-          nt->element(3)->Dump(symbol_table_, &html_printer);
+          nt[3]->Dump(symbol_table_, &html_printer);
           printer.Print("</TD><TD>");
-          if (is_file_node && EncodedIdentEqualTo(nt->element(3), text_id_)) {
+          if (is_file_node && EncodedIdentEqualTo(nt[3], text_id_)) {
             // Don't clutter the graph with file content.
             printer.Print("...");
-          } else if (EncodedIdentEqualTo(nt->element(3), code_id_)) {
+          } else if (EncodedIdentEqualTo(nt[3], code_id_)) {
             // Don't print encoded proto data.
             printer.Print("...");
           } else {
-            nt->element(4)->Dump(symbol_table_, &html_printer);
+            nt[4]->Dump(symbol_table_, &html_printer);
           }
           printer.Print("</TD></TR>");
         }
@@ -1504,12 +2211,12 @@ void Verifier::DumpAsDot() {
     } else {
       // Edge.
       printer.Print(" -> \"");
-      t->element(2)->Dump(symbol_table_, &quote_printer);
+      t[2]->Dump(symbol_table_, &quote_printer);
       printer.Print("\" [ label=\"");
-      t->element(1)->Dump(symbol_table_, &quote_printer);
-      if (t->element(4) != empty_string_id()) {
+      t[1]->Dump(symbol_table_, &quote_printer);
+      if (t[4] != empty_string_id()) {
         printer.Print(".");
-        t->element(4)->Dump(symbol_table_, &quote_printer);
+        t[4]->Dump(symbol_table_, &quote_printer);
       }
       printer.Print("\" ];\n");
     }
@@ -18,16 +18,120 @@
 #define KYTHE_CXX_VERIFIER_H_
 
 #include <functional>
+#include <memory>
+#include <mutex>
 #include <string>
+#include <vector>
 
 #include "kythe/proto/common.pb.h"
 #include "kythe/proto/storage.pb.h"
+#include "llvm/ADT/StringMap.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/ADT/StringSet.h"
 
 #include "assertions.h"
 
 namespace kythe {
 namespace verifier {
 
+/// \brief The fields of a wire-format `VName`, pointing into the buffer it
+/// was decoded from.
+struct VNameFields {
+  /// The whole encoded message. Equal encodings decode to equal `VName`s.
+  llvm::StringRef encoded;
+  /// The signature, corpus, root, path and language, in that order.
+  llvm::StringRef fields[5];
+};
+
+/// \brief The fields of a wire-format `Entry`, pointing into the buffer it
+/// was decoded from.
+struct EntryFields {
+  bool has_source = false;
+  VNameFields source;
+  llvm::StringRef edge_kind;
+  bool has_target = false;
+  VNameFields target;
+  llvm::StringRef fact_name;
+  llvm::StringRef fact_value;
+};
+
+/// \brief A fact in the verifier's database: its source, edge kind, target,
+/// fact name and fact value, in that order.
+///
+/// Each column points to an interned `Identifier` or VName `App`, so facts
+/// share their nodes rather than each owning an `App(fact, Tuple)`.
+struct PackedFact {
+  AstNode *columns[5];
+};
+
+/// \brief An anchor in the verifier's database and the offsets it spans.
+struct AnchorSpan {
+  size_t begin;
+  size_t end;
+  /// The anchor's VName.
+  AstNode *vname;
+  /// \brief Orders spans by offsets only.
+  bool operator<(const AnchorSpan &o) const {
+    return begin < o.begin || (begin == o.begin && end < o.end);
+  }
+};
+
+/// \brief Selects the facts that `Verifier::DumpAsDot` and
+/// `Verifier::DumpAsJson` print. A fact is printed if its source or target
+/// matches every nonempty field.
+struct DumpFilter {
+  /// If nonempty, match only nodes with this path.
+  std::string path;
+  /// If nonempty, match only nodes with this signature.
+  std::string signature;
+};
+
+/// \brief An overapproximation of the facts that might unify with some goal,
+/// built from the text of the goals' ground terms.
+///
+/// Each column is checked on its own, so a fact may be admitted even though
+/// no single goal matches all of its columns. Facts that are needed to find
+/// anchors by their offsets are admitted when some goal does that.
+struct GoalPrefilter {
+  /// \brief The texts that an identifier column may hold.
+  struct Column {
+    /// Set when a goal has anything but an identifier in this column.
+    bool any = false;
+    llvm::StringSet<> texts;
+    bool Admits(llvm::StringRef text) const {
+      return any || texts.count(text) != 0;
+    }
+  };
+
+  /// \brief The nodes that a source or target column may hold.
+  struct NodeColumn {
+    /// Set when a goal has the empty identifier (no node) in this column.
+    bool admits_none = false;
+    /// The signature, corpus, root, path and language of VNames, in that
+    /// order.
+    Column fields[5];
+    /// \param node The node's fields, or null if there is no node.
+    bool Admits(const llvm::StringRef *node) const;
+  };
+
+  /// \param source The source's fields, or null if it has none.
+  /// \param target The target's fields, or null if it has none.
+  /// \return false if no goal can unify with a fact built from these fields.
+  bool Admits(const llvm::StringRef *source, llvm::StringRef edge_kind,
+              const llvm::StringRef *target, llvm::StringRef fact_name,
+              llvm::StringRef fact_value) const;
+
+  NodeColumn sources;
+  Column edge_kinds;
+  NodeColumn targets;
+  Column fact_names;
+  Column fact_values;
+  /// Admit the node kind, start and end facts that make up anchors.
+  bool admits_anchors = false;
+  /// Admit code facts, which are converted to subgraphs.
+  bool admits_code = false;
+};
+
 /// \brief Runs logic programs.
 ///
 /// The `Verifier` combines an `AssertionContext` with a database of Kythe
@@ -64,6 +168,11 @@ class Verifier {
   /// \brief Dump all goals to standard out.
   void ShowGoals();
 
+  /// \brief Forgets all facts, goals and results so that another database can
+  /// be verified against other rules. Settings (like the goal comment regex
+  /// and `IgnoreDuplicateFacts`) and the arena's memory are kept.
+  void Reset();
+
   /// \brief Prints out a particular goal with its original source location
   /// to standard error.
   /// \param group_index The index of the goal's group.
@@ -71,11 +180,15 @@ class Verifier {
   /// \sa highest_goal_reached, highest_group_reached
   void DumpErrorGoal(size_t group_index, size_t goal_index);
 
-  /// \brief Dump known facts to standard out as a GraphViz graph.
-  void DumpAsDot();
+  /// \brief Dump known facts to standard out as a GraphViz graph. Output is
+  /// written as it is produced.
+  /// \param filter Selects the facts to dump.
+  void DumpAsDot(const DumpFilter &filter = DumpFilter());
 
-  /// \brief Dump known facts to standard out as JSON.
-  void DumpAsJson();
+  /// \brief Dump known facts to standard out as JSON. Output is written as
+  /// it is produced.
+  /// \param filter Selects the facts to dump.
+  void DumpAsJson(const DumpFilter &filter = DumpFilter());
 
   /// \brief Attempts to satisfy all goals from all loaded rule files and facts.
   /// \param inspect function to call on any inspection request
@@ -96,6 +209,15 @@ class Verifier {
   bool AssertSingleFact(std::string *database_name, unsigned int fact_id,
                         const kythe::proto::Entry &entry);
 
+  /// \brief Adds a single Kythe fact, decoded from a wire-format `Entry`, to
+  /// the database. This avoids building an intermediate `Entry` message, and
+  /// facts with byte-identical `VName`s share their AST nodes.
+  /// \param database_name as for the `Entry` overload.
+  /// \param fact_id as for the `Entry` overload.
+  /// \return false if something went wrong.
+  bool AssertSingleFact(std::string *database_name, unsigned int fact_id,
+                        const EntryFields &entry);
+
   /// \brief Perform basic well-formedness checks on the input database.
   /// \pre The database contains only fact-shaped terms, as generated by
   /// `AssertSingleFact`.
@@ -129,6 +251,11 @@ class Verifier {
   AstNode *MakePredicate(const yy::location &location, AstNode *head,
                          std::initializer_list<AstNode *> values);
 
+  /// \brief Builds an `App(fact, Tuple)` node for `fact`, for use where a
+  /// real `AstNode` is needed (as in diagnostics). Safe to call while
+  /// solving on several threads.
+  AstNode *MaterializeFact(const PackedFact &fact);
+
   /// \brief The head used for equality predicates.
   Identifier *eq_id() { return eq_id_; }
 
@@ -174,11 +301,61 @@ class Verifier {
   /// \brief Convert MarkedSource-valued facts to graphs.
   void ConvertMarkedSource() { convert_marked_source_ = true; }
 
+  /// \brief Solve the goals in each group in order of how few facts can
+  /// satisfy them, rather than in source order. Diagnostics still refer to
+  /// goals as they appear in the source.
+  void ReorderGoals() { reorder_goals_ = true; }
+
+  /// \brief Skip facts that can't unify with any goal loaded so far (see
+  /// `GoalPrefilter`) rather than adding them to the database. Call this
+  /// after loading rules and before asserting facts; goals loaded later
+  /// aren't considered. Skipped facts aren't checked for duplicates or
+  /// well-formedness. Has no effect if assertions come from file nodes.
+  void PrefilterFactsByGoals();
+
+  /// \brief Returns how many facts were skipped because of
+  /// `PrefilterFactsByGoals`.
+  size_t facts_skipped() const { return facts_skipped_; }
+
+  /// \brief Prepare the database and solve goal groups that share no EVars
+  /// on up to `thread_count` threads. Results and diagnostics are the same as
+  /// for one thread.
+  void SetThreadCount(size_t thread_count) { thread_count_ = thread_count; }
+
   /// \brief Check for singleton EVars.
   /// \return true if there were singletons.
   bool CheckForSingletonEVars() { return parser_.CheckForSingletonEVars(); }
 
+  /// \brief Keep parsed rule files in `directory`, keyed by their content
+  /// and the settings that affect parsing, and load them from there rather
+  /// than parsing them again. Only a rule file loaded before any others is
+  /// added to the cache (see `AssertionParser::SerializeRulesSince`), but
+  /// rule files can be loaded from it in any position.
+  void UseRuleCache(const std::string &directory) {
+    rule_cache_directory_ = directory;
+  }
+
  private:
+  /// \brief Returns where the parsed form of a rule file containing
+  /// `content` is cached.
+  std::string RuleCachePath(const std::string &content) const;
+
+  /// \brief Adds a fact with the given fields to the database.
+  /// \param source The source node (`empty_string_id_` if there is none).
+  /// \param target The target node (`empty_string_id_` if there is none).
+  bool AssertFact(const yy::location &loc, AstNode *source,
+                  llvm::StringRef edge_kind, AstNode *target,
+                  llvm::StringRef fact_name, llvm::StringRef fact_value);
+
+  /// \brief Returns the single `Identifier` used in database facts for
+  /// `text`, or `empty_string_id_` if `text` is empty.
+  AstNode *DatabaseIdentifierFor(const yy::location &loc,
+                                 llvm::StringRef text);
+
+  /// \brief Returns the node for a decoded `VName`, sharing it with earlier
+  /// facts that used the same encoding.
+  AstNode *DatabaseVNameFor(const yy::location &loc, const VNameFields &vname);
+
   /// \brief Generate a VName that will not conflict with any other VName.
   AstNode *NewUniqueVName(const yy::location &loc);
 
@@ -204,7 +381,7 @@ class Verifier {
 
   /// \brief Adds an anchor VName.
   void AddAnchor(AstNode *vname, size_t begin, size_t end) {
-    anchors_.emplace(std::make_pair(begin, end), vname);
+    anchors_.push_back(AnchorSpan{begin, end, vname});
   }
 
   /// \sa parser()
@@ -216,11 +393,29 @@ class Verifier {
   /// \sa symbol_table()
   SymbolTable symbol_table_;
 
+  /// The end of the builtin nodes in `arena_`. `Reset` rewinds to here.
+  Arena::Mark builtins_mark_;
+
   /// All known facts.
-  std::vector<AstNode *> facts_;
+  std::vector<PackedFact> facts_;
 
-  /// Multimap from anchor offsets to anchor VName tuples.
-  std::multimap<std::pair<size_t, size_t>, AstNode *> anchors_;
+  /// The positions in `facts_` of its facts, sorted in each secondary lookup
+  /// order. Built by `PrepareDatabase`.
+  std::vector<std::vector<uint32_t>> fact_indices_;
+
+  /// Guards `arena_` while facts are materialized during solving.
+  std::mutex materialize_mutex_;
+
+  /// Anchor VName tuples sorted by their offsets (and otherwise in the
+  /// order they were found). Built by `PrepareDatabase`.
+  std::vector<AnchorSpan> anchors_;
+
+  /// If set, facts that it doesn't admit are skipped.
+  /// \sa PrefilterFactsByGoals
+  std::unique_ptr<GoalPrefilter> prefilter_;
+
+  /// \sa facts_skipped()
+  size_t facts_skipped_ = 0;
 
   /// Has the database been prepared?
   bool database_prepared_ = false;
@@ -302,11 +497,27 @@ class Verifier {
   /// group.
   std::unique_ptr<RE2> goal_comment_regex_;
 
+  /// If nonempty, the directory where parsed rule files are cached.
+  std::string rule_cache_directory_;
+
   /// If true, convert MarkedSource-valued facts to subgraphs. If false,
   /// MarkedSource-valued facts will be replaced with opaque but unique
   /// identifiers.
   bool convert_marked_source_ = false;
 
+  /// If true, solve goals in order of selectivity.
+  bool reorder_goals_ = false;
+
+  /// The number of threads to use to prepare the database and solve goal
+  /// groups.
+  size_t thread_count_ = 1;
+
+  /// Identifiers used in database facts, indexed by symbol.
+  std::vector<Identifier *> database_identifiers_;
+
+  /// Maps encoded `VName`s to their nodes in database facts.
+  llvm::StringMap<AstNode *> database_vnames_;
+
   /// Identifier for MarkedSource child edges.
   AstNode *marked_source_child_id_;
 
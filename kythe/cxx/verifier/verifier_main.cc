@@ -14,19 +14,28 @@
  * limitations under the License.
  */
 
+#include <fcntl.h>
 #include <stdio.h>
 #include <unistd.h>
+#include <fstream>
+#include <iterator>
+#include <memory>
+#include <sstream>
 #include <string>
+#include <vector>
 
 #include "gflags/gflags.h"
 #include "glog/logging.h"
-#include "google/protobuf/io/coded_stream.h"
 #include "google/protobuf/io/zero_copy_stream.h"
 #include "google/protobuf/io/zero_copy_stream_impl.h"
 
+#include "kythe/cxx/common/delimited_proto_reader.h"
+#include "kythe/cxx/common/indexing/entry_pack.h"
+#include "kythe/cxx/common/snappy_stream.h"
 #include "kythe/proto/storage.pb.h"
 
 #include "assertion_ast.h"
+#include "entry_stream_loader.h"
 #include "verifier.h"
 
 DEFINE_bool(show_protos, false, "Show protocol buffers read from standard in");
@@ -34,6 +43,10 @@ DEFINE_bool(show_goals, false, "Show goals after parsing");
 DEFINE_bool(ignore_dups, false, "Ignore duplicate facts during verification");
 DEFINE_bool(graphviz, false, "Only dump facts as a GraphViz-compatible graph");
 DEFINE_bool(annotated_graphviz, false, "Solve and annotate a GraphViz graph.");
+DEFINE_string(graph_path, "",
+              "If nonempty, only graph facts about nodes with this path.");
+DEFINE_string(graph_signature, "",
+              "If nonempty, only graph facts about nodes with this signature.");
 DEFINE_string(goal_prefix, "//-", "Denote goals with this string.");
 DEFINE_bool(use_file_nodes, false, "Look for assertions in UTF8 file nodes.");
 DEFINE_bool(check_for_singletons, false, "Fail on singleton variables.");
@@ -43,6 +56,215 @@ DEFINE_string(
     "The regex must match the entire line. Expects one capture group.");
 DEFINE_bool(convert_marked_source, false,
             "Convert MarkedSource-valued facts to subgraphs.");
+DEFINE_string(input_compression, "none",
+              "Compression used for standard input: \"none\" or \"snappy\" "
+              "(as written by the indexer's --output_compression=snappy).");
+DEFINE_string(input_format, "entries",
+              "Format of standard input: \"entries\" or \"entry_pack\" (as "
+              "written by the indexer's --experimental_output_format).");
+DEFINE_int32(threads, 1,
+             "Sort the database and solve goal groups that share no "
+             "variables on this many threads.");
+DEFINE_bool(experimental_reorder_goals, false,
+            "Solve the goals in each group in order of how few facts can "
+            "satisfy them rather than in the order they were written.");
+DEFINE_string(rule_cache_dir, "",
+              "If nonempty, keep parsed rule files in this directory and load "
+              "them from there when their contents haven't changed.");
+DEFINE_bool(prefilter_facts, true,
+            "Skip facts that can't unify with any goal while reading standard "
+            "input. Skipped facts aren't checked for duplicates or "
+            "well-formedness; turn this off when debugging unexpected "
+            "results. Ignored with --graphviz and --annotated_graphviz.");
+DEFINE_string(batch_manifest, "",
+              "If nonempty, verify each test listed in this file instead of "
+              "reading standard input. Each line names a test's entry stream "
+              "followed by its rule files, separated by spaces. Tests share "
+              "one verifier process and are reported one by one.");
+
+namespace {
+
+/// \brief Loads each of `rule_files` into `v`.
+/// \return false (after saying why) if one couldn't be loaded.
+bool LoadRuleFiles(kythe::verifier::Verifier *v,
+                   const std::vector<std::string> &rule_files) {
+  if (rule_files.empty() && !FLAGS_use_file_nodes) {
+    fprintf(stderr, "No rule files specified\n");
+    return false;
+  }
+  for (const auto &rule_file : rule_files) {
+    if (rule_file.empty()) {
+      continue;
+    }
+    if (!v->LoadInlineRuleFile(rule_file)) {
+      fprintf(stderr, "Failed loading %s.\n", rule_file.c_str());
+      return false;
+    }
+  }
+  return true;
+}
+
+/// \brief Reads facts from `file_input` into `v` as directed by
+/// --input_compression and --input_format.
+/// \param dbname The name to use for the database in locations. Must outlive
+/// the facts.
+/// \return false (after saying why) if the facts couldn't be read.
+bool ReadFacts(google::protobuf::io::ZeroCopyInputStream *file_input,
+               std::string *dbname, kythe::verifier::Verifier *v) {
+  size_t facts = 0;
+  kythe::proto::Entry entry;
+  google::protobuf::io::ZeroCopyInputStream *raw_input = file_input;
+  std::unique_ptr<kythe::SnappyFramedInputStream> snappy_input;
+  if (FLAGS_input_compression == "snappy") {
+    snappy_input.reset(new kythe::SnappyFramedInputStream(file_input));
+    raw_input = snappy_input.get();
+  } else if (FLAGS_input_compression != "none") {
+    fprintf(stderr, "Unknown --input_compression %s\n",
+            FLAGS_input_compression.c_str());
+    return false;
+  }
+  std::unique_ptr<kythe::EntryPackReader> pack_reader;
+  if (FLAGS_input_format == "entry_pack") {
+    pack_reader.reset(new kythe::EntryPackReader(raw_input));
+  } else if (FLAGS_input_format != "entries") {
+    fprintf(stderr, "Unknown --input_format %s\n", FLAGS_input_format.c_str());
+    return false;
+  }
+  if (pack_reader) {
+    kythe::EntryRef entry_ref;
+    while (pack_reader->Next(&entry_ref)) {
+      entry_ref.Expand(&entry);
+      if (FLAGS_show_protos) {
+        entry.PrintDebugString();
+      }
+      if (!v->AssertSingleFact(dbname, facts, entry)) {
+        fprintf(stderr, "Error asserting fact %zu\n", facts);
+        return false;
+      }
+      ++facts;
+    }
+    if (!pack_reader->error().empty()) {
+      fprintf(stderr, "Error reading around fact %zu: %s\n", facts,
+              pack_reader->error().c_str());
+      return false;
+    }
+  } else if (!FLAGS_show_protos) {
+    kythe::verifier::EntryStreamLoader loader(v, dbname);
+    std::string error_text;
+    bool loaded = loader.Load(raw_input, &error_text);
+    facts = loader.facts_loaded();
+    // A decompression error shows up as a truncated stream; report it below.
+    if (!loaded && (!snappy_input || snappy_input->error().empty())) {
+      fprintf(stderr, "Error reading around fact %zu: %s\n", facts,
+              error_text.c_str());
+      return false;
+    }
+  } else {
+    kythe::DelimitedProtoReader reader(raw_input);
+    while (reader.NextMessage(&entry)) {
+      entry.PrintDebugString();
+      if (!v->AssertSingleFact(dbname, facts, entry)) {
+        fprintf(stderr, "Error asserting fact %zu\n", facts);
+        return false;
+      }
+      ++facts;
+    }
+    // A decompression error shows up as a truncated stream; report it below.
+    if (!reader.error().empty() &&
+        (!snappy_input || snappy_input->error().empty())) {
+      fprintf(stderr, "Error reading around fact %zu: %s\n", facts,
+              reader.error().c_str());
+      return false;
+    }
+  }
+  if (snappy_input && !snappy_input->error().empty()) {
+    fprintf(stderr, "Error decompressing input: %s\n",
+            snappy_input->error().c_str());
+    return false;
+  }
+  return true;
+}
+
+/// \brief Solves the goals loaded into `v`.
+/// \return false (after saying how far we got) if they couldn't be solved.
+bool SolveGoals(kythe::verifier::Verifier *v) {
+  if (FLAGS_show_goals) {
+    v->ShowGoals();
+  }
+  if (!v->VerifyAllGoals()) {
+    fprintf(stderr,
+            "Could not verify all goals. The furthest we reached was:\n  ");
+    v->DumpErrorGoal(v->highest_group_reached(), v->highest_goal_reached());
+    return false;
+  }
+  return true;
+}
+
+/// \brief Verifies the entry stream at `entries_path` against `rule_files`.
+bool RunTest(kythe::verifier::Verifier *v, const std::string &entries_path,
+             const std::vector<std::string> &rule_files, std::string *dbname) {
+  if (!LoadRuleFiles(v, rule_files)) {
+    return false;
+  }
+  if (FLAGS_check_for_singletons && v->CheckForSingletonEVars()) {
+    return false;
+  }
+  if (FLAGS_prefilter_facts) {
+    v->PrefilterFactsByGoals();
+  }
+  int fd = open(entries_path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    fprintf(stderr, "Can't open %s\n", entries_path.c_str());
+    return false;
+  }
+  google::protobuf::io::FileInputStream file_input(fd, 1 << 20);
+  file_input.SetCloseOnDelete(true);
+  *dbname = entries_path;
+  return ReadFacts(&file_input, dbname, v) && SolveGoals(v);
+}
+
+/// \brief Runs each test listed in the file at `manifest_path`, resetting
+/// `v` between tests.
+/// \return the exit code for the batch.
+int RunBatch(kythe::verifier::Verifier *v, const std::string &manifest_path) {
+  std::ifstream manifest(manifest_path);
+  if (!manifest) {
+    fprintf(stderr, "Can't open %s\n", manifest_path.c_str());
+    return 1;
+  }
+  std::string dbname;
+  size_t tests = 0, failures = 0;
+  std::string line;
+  while (std::getline(manifest, line)) {
+    std::istringstream fields(line);
+    std::string entries_path;
+    if (!(fields >> entries_path) || entries_path[0] == '#') {
+      continue;
+    }
+    std::vector<std::string> rule_files(
+        (std::istream_iterator<std::string>(fields)),
+        std::istream_iterator<std::string>());
+    v->Reset();
+    bool passed = RunTest(v, entries_path, rule_files, &dbname);
+    ++tests;
+    if (!passed) {
+      ++failures;
+    }
+    // Flush so that each report follows the diagnostics that explain it.
+    fflush(stderr);
+    printf("%s %s", passed ? "PASS" : "FAIL", entries_path.c_str());
+    for (const auto &rule_file : rule_files) {
+      printf(" %s", rule_file.c_str());
+    }
+    printf("\n");
+    fflush(stdout);
+  }
+  printf("%zu of %zu tests passed\n", tests - failures, tests);
+  return failures == 0 ? 0 : 1;
+}
+
+}  // anonymous namespace
+
 
 int main(int argc, char **argv) {
   GOOGLE_PROTOBUF_VERIFY_VERSION;
@@ -55,6 +277,7 @@ Example:
   ${INDEXER_BIN} -i $1 | ${VERIFIER_BIN} --show_protos --show_goals $1
   cat foo.entries | ${VERIFIER_BIN} goals1.cc goals2.cc
   cat foo.entries | ${VERIFIER_BIN} --use_file_nodes
+  ${VERIFIER_BIN} --batch_manifest=tests.txt
 )");
   ::gflags::ParseCommandLineFlags(&argc, &argv, true);
   ::google::InitGoogleLogging(argv[0]);
@@ -86,69 +309,55 @@ Example:
     v.ConvertMarkedSource();
   }
 
-  if (!FLAGS_graphviz) {
-    std::vector<std::string> rule_files(argv + 1, argv + argc);
-    if (rule_files.empty() && !FLAGS_use_file_nodes) {
-      fprintf(stderr, "No rule files specified\n");
-      return 1;
-    }
+  if (FLAGS_experimental_reorder_goals) {
+    v.ReorderGoals();
+  }
 
-    for (const auto &rule_file : rule_files) {
-      if (rule_file.empty()) {
-        continue;
-      }
-      if (!v.LoadInlineRuleFile(rule_file)) {
-        fprintf(stderr, "Failed loading %s.\n", rule_file.c_str());
-        return 2;
-      }
-    }
+  if (FLAGS_threads > 1) {
+    v.SetThreadCount(FLAGS_threads);
   }
 
-  if (FLAGS_check_for_singletons && v.CheckForSingletonEVars()) {
-    return 1;
+  if (!FLAGS_rule_cache_dir.empty()) {
+    v.UseRuleCache(FLAGS_rule_cache_dir);
   }
 
-  std::string dbname = "database";
-  size_t facts = 0;
-  kythe::proto::Entry entry;
-  google::protobuf::uint32 byte_size;
-  google::protobuf::io::FileInputStream raw_input(STDIN_FILENO);
-  for (;;) {
-    google::protobuf::io::CodedInputStream coded_input(&raw_input);
-    coded_input.SetTotalBytesLimit(INT_MAX, -1);
-    if (!coded_input.ReadVarint32(&byte_size)) {
-      break;
-    }
-    auto limit = coded_input.PushLimit(byte_size);
-    if (!entry.ParseFromCodedStream(&coded_input)) {
-      fprintf(stderr, "Error reading around fact %zu\n", facts);
+  if (!FLAGS_batch_manifest.empty()) {
+    if (FLAGS_graphviz || FLAGS_annotated_graphviz || argc > 1) {
+      fprintf(stderr,
+              "--batch_manifest can't be used with rule files or graphs\n");
       return 1;
     }
-    if (FLAGS_show_protos) {
-      entry.PrintDebugString();
-    }
-    if (!v.AssertSingleFact(&dbname, facts, entry)) {
-      fprintf(stderr, "Error asserting fact %zu\n", facts);
-      return 1;
+    return RunBatch(&v, FLAGS_batch_manifest);
+  }
+
+  if (!FLAGS_graphviz) {
+    std::vector<std::string> rule_files(argv + 1, argv + argc);
+    if (!LoadRuleFiles(&v, rule_files)) {
+      return rule_files.empty() ? 1 : 2;
     }
-    ++facts;
   }
 
-  if (FLAGS_show_goals) {
-    v.ShowGoals();
+  if (FLAGS_check_for_singletons && v.CheckForSingletonEVars()) {
+    return 1;
   }
 
-  int result = 0;
+  if (FLAGS_prefilter_facts && !FLAGS_graphviz && !FLAGS_annotated_graphviz) {
+    v.PrefilterFactsByGoals();
+  }
 
-  if (!v.VerifyAllGoals()) {
-    fprintf(stderr,
-            "Could not verify all goals. The furthest we reached was:\n  ");
-    v.DumpErrorGoal(v.highest_group_reached(), v.highest_goal_reached());
-    result = 1;
+  std::string dbname = "database";
+  google::protobuf::io::FileInputStream file_input(STDIN_FILENO, 1 << 20);
+  if (!ReadFacts(&file_input, &dbname, &v)) {
+    return 1;
   }
 
+  int result = SolveGoals(&v) ? 0 : 1;
+
   if (FLAGS_graphviz || FLAGS_annotated_graphviz) {
-    v.DumpAsDot();
+    kythe::verifier::DumpFilter filter;
+    filter.path = FLAGS_graph_path;
+    filter.signature = FLAGS_graph_signature;
+    v.DumpAsDot(filter);
   }
 
   return result;
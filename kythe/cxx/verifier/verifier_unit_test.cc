@@ -14,11 +14,18 @@
  * limitations under the License.
  */
 
+#include <dirent.h>
+#include <stdlib.h>
+#include <fstream>
 #include <regex>
+#include <set>
 
 #include "verifier.h"
 
+#include "entry_stream_loader.h"
 #include "glog/logging.h"
+#include "google/protobuf/io/coded_stream.h"
+#include "google/protobuf/io/zero_copy_stream_impl_lite.h"
 #include "google/protobuf/text_format.h"
 #include "gtest/gtest.h"
 
@@ -80,6 +87,82 @@ TEST(VerifierUnitTest, HtmlPrettyPrinter) {
   EXPECT_EQ("0", zero_ptrvoid.str());
 }
 
+TEST(VerifierUnitTest, FileHandlePrettyPrinterBuffers) {
+  FILE *file = tmpfile();
+  ASSERT_NE(nullptr, file);
+  auto contents = [file]() {
+    fflush(file);
+    rewind(file);
+    std::string text;
+    char buf[64];
+    for (size_t read; (read = fread(buf, 1, sizeof(buf), file)) != 0;) {
+      text.append(buf, read);
+    }
+    return text;
+  };
+  {
+    FileHandlePrettyPrinter printer(file, 8);
+    printer.Print("abc");
+    printer.Print(std::string("def"));
+    EXPECT_EQ("", contents());
+    // This doesn't fit, so the first six bytes are written out.
+    printer.Print(llvm::StringRef("ghijkl", 4));
+    EXPECT_EQ("abcdef", contents());
+    printer.Print(static_cast<void *>(nullptr));
+    EXPECT_EQ("abcdefghij", contents());
+    ASSERT_TRUE(printer.Flush());
+    EXPECT_EQ("abcdefghij0x0000000000000000", contents());
+    printer.Print("!");
+  }
+  EXPECT_EQ("abcdefghij0x0000000000000000!", contents());
+  fclose(file);
+}
+
+TEST(VerifierUnitTest, SymbolTablePrintsPrettyText) {
+  SymbolTable table;
+  Symbol empty = table.intern("");
+  Symbol a = table.intern("a");
+  Symbol unique = table.unique();
+  for (Symbol symbol : {empty, a, unique}) {
+    StringPrettyPrinter printer;
+    table.PrintPrettyText(symbol, &printer);
+    EXPECT_EQ(table.PrettyText(symbol), printer.str());
+  }
+}
+
+TEST(VerifierUnitTest, SymbolTableInternsText) {
+  SymbolTable table;
+  Symbol empty = table.intern("");
+  Symbol a = table.intern("a");
+  std::string big(1 << 20, 'x');
+  Symbol big_symbol = table.intern(big);
+  EXPECT_NE(empty, a);
+  EXPECT_EQ(a, table.intern(std::string("a")));
+  EXPECT_EQ(empty, table.intern(""));
+  EXPECT_EQ(big_symbol, table.intern(big));
+  EXPECT_EQ("a", table.text(a));
+  EXPECT_EQ("", table.text(empty));
+  EXPECT_EQ(big, table.text(big_symbol));
+  EXPECT_EQ("\"\"", table.PrettyText(empty));
+}
+
+TEST(VerifierUnitTest, SymbolTableKeepsSymbolsAcrossGrowth) {
+  SymbolTable table;
+  std::vector<Symbol> symbols;
+  Symbol unique = table.unique();
+  for (size_t i = 0; i < 10000; ++i) {
+    symbols.push_back(table.intern(std::to_string(i)));
+  }
+  table.Reserve(100000);
+  for (size_t i = 0; i < symbols.size(); ++i) {
+    EXPECT_EQ(symbols[i], table.intern(std::to_string(i)));
+    EXPECT_EQ(std::to_string(i), table.text(symbols[i]));
+  }
+  EXPECT_NE(unique, table.intern("(unique)"));
+  EXPECT_EQ("(unique#" + std::to_string(unique) + ")",
+            table.PrettyText(unique));
+}
+
 TEST(VerifierUnitTest, UnescapeStringLiterals) {
   std::string tmp = "tmp";
   EXPECT_TRUE(AssertionParser::Unescape(R"("")", &tmp));
@@ -432,6 +515,56 @@ fact_value: ""
   ASSERT_TRUE(v.VerifyAllGoals());
 }
 
+TEST(VerifierUnitTest, AnchorsWithTheSameSpanAreAllTried) {
+  Verifier v;
+  ASSERT_TRUE(v.LoadInlineProtoFile(R"(entries {
+#- @text defines SomeNode
+##text (line 3 column 2 offset 38-42)
+source { root:"0" }
+fact_name: "/kythe/node/kind"
+fact_value: "file"
+}
+entries {
+source { root:"1" }
+fact_name: "/kythe/node/kind"
+fact_value: "anchor"
+}
+entries {
+source { root:"1" }
+fact_name: "/kythe/loc/start"
+fact_value: "38"
+}
+entries {
+source { root:"1" }
+fact_name: "/kythe/loc/end"
+fact_value: "42"
+}
+entries {
+source { root:"3" }
+fact_name: "/kythe/node/kind"
+fact_value: "anchor"
+}
+entries {
+source { root:"3" }
+fact_name: "/kythe/loc/start"
+fact_value: "38"
+}
+entries {
+source { root:"3" }
+fact_name: "/kythe/loc/end"
+fact_value: "42"
+}
+entries {
+source { root:"3" }
+edge_kind: "/kythe/edge/defines"
+target { root:"2" }
+fact_name: "/"
+fact_value: ""
+})"));
+  ASSERT_TRUE(v.PrepareDatabase());
+  ASSERT_TRUE(v.VerifyAllGoals());
+}
+
 TEST(VerifierUnitTest, GenerateStartOffsetEVarRelativeLine) {
   Verifier v;
   ASSERT_TRUE(v.LoadInlineProtoFile(R"(entries {
@@ -2085,7 +2218,7 @@ fact_value: ""
         if (AstNode *node = inspection.evar->current()) {
           if (Identifier *ident = node->AsIdentifier()) {
             std::string ident_content =
-                cxt->symbol_table()->text(ident->symbol());
+                cxt->symbol_table()->text(ident->symbol()).str();
             if (ident_content == inspection.label) {
               if (inspection.label == "Signature") signature = true;
               if (inspection.label == "Root") root = true;
@@ -2129,7 +2262,7 @@ fact_value: ""
         if (AstNode *node = inspection.evar->current()) {
           if (Identifier *ident = node->AsIdentifier()) {
             std::string ident_content =
-                cxt->symbol_table()->text(ident->symbol());
+                cxt->symbol_table()->text(ident->symbol()).str();
             if (ident_content == inspection.label) {
               if (inspection.label == "Signature") signature = true;
               if (inspection.label == "Path") path = true;
@@ -2420,7 +2553,7 @@ fact_value: ""
         if (AstNode *node = inspection.evar->current()) {
           if (Identifier *ident = node->AsIdentifier()) {
             std::string ident_content =
-                cxt->symbol_table()->text(ident->symbol());
+                cxt->symbol_table()->text(ident->symbol()).str();
             if (ident_content == inspection.label) {
               if (inspection.label == "Signature") signature = true;
               if (inspection.label == "Corpus") corpus = true;
@@ -2468,7 +2601,7 @@ fact_value: ""
         if (AstNode *node = inspection.evar->current()) {
           if (Identifier *ident = node->AsIdentifier()) {
             std::string ident_content =
-                cxt->symbol_table()->text(ident->symbol());
+                cxt->symbol_table()->text(ident->symbol()).str();
             if ((inspection.label != "Path" &&
                  ident_content == inspection.label) ||
                 (inspection.label == "_" && ident_content == "Path")) {
@@ -2517,7 +2650,7 @@ fact_value: ""
         if (AstNode *node = inspection.evar->current()) {
           if (Identifier *ident = node->AsIdentifier()) {
             std::string ident_content =
-                cxt->symbol_table()->text(ident->symbol());
+                cxt->symbol_table()->text(ident->symbol()).str();
             if (ident_content == inspection.label) {
               if (inspection.label == "Signature") signature = true;
               if (inspection.label == "Corpus") corpus = true;
@@ -2562,7 +2695,7 @@ fact_value: ""
         if (AstNode *node = inspection.evar->current()) {
           if (Identifier *ident = node->AsIdentifier()) {
             std::string ident_content =
-                cxt->symbol_table()->text(ident->symbol());
+                cxt->symbol_table()->text(ident->symbol()).str();
             if ((inspection.label != "Path" &&
                  ident_content == inspection.label) ||
                 (inspection.label == "Path" &&
@@ -2940,6 +3073,669 @@ TEST(VerifierUnitTest, ConvertMarkedSourceDuplicateFactsWellFormed) {
   ASSERT_TRUE(v.VerifyAllGoals());
 }
 
+TEST(VerifierUnitTest, EdgeLookupByTarget) {
+  Verifier v;
+  ASSERT_TRUE(v.LoadInlineProtoFile(R"(entries {
+#- vname(Signature?, "", "", "", "") defines vname("t2", "", "", "", "")
+source { signature:"a1" }
+edge_kind: "/kythe/edge/defines"
+target { signature:"t1" }
+fact_name: "/"
+fact_value: ""
+}
+entries {
+source { signature:"a2" }
+edge_kind: "/kythe/edge/defines"
+target { signature:"t2" }
+fact_name: "/"
+fact_value: ""
+}
+entries {
+source { signature:"a3" }
+edge_kind: "/kythe/edge/defines"
+target { signature:"t3" }
+fact_name: "/"
+fact_value: ""
+})"));
+  std::string signature;
+  ASSERT_TRUE(v.VerifyAllGoals(
+      [&signature](Verifier *cxt,
+                   const AssertionParser::Inspection &inspection) {
+        if (AstNode *node = inspection.evar->current()) {
+          if (Identifier *ident = node->AsIdentifier()) {
+            signature = cxt->symbol_table()->text(ident->symbol()).str();
+          }
+          return true;
+        }
+        return false;
+      }));
+  EXPECT_EQ("a2", signature);
+}
+
+TEST(VerifierUnitTest, EdgeLookupByMissingTargetFails) {
+  Verifier v;
+  ASSERT_TRUE(v.LoadInlineProtoFile(R"(entries {
+#- vname(_, "", "", "", "") defines vname("t3", "", "", "", "")
+source { signature:"a1" }
+edge_kind: "/kythe/edge/defines"
+target { signature:"t1" }
+fact_name: "/"
+fact_value: ""
+}
+entries {
+source { signature:"a2" }
+edge_kind: "/kythe/edge/defines"
+target { signature:"t2" }
+fact_name: "/"
+fact_value: ""
+})"));
+  ASSERT_FALSE(v.VerifyAllGoals());
+}
+
+TEST(VerifierUnitTest, FactLookupBySource) {
+  Verifier v;
+  ASSERT_TRUE(v.LoadInlineProtoFile(R"(entries {
+#- vname("n2", "", "", "", "").text Text?
+source { signature:"n1" }
+fact_name: "/kythe/text"
+fact_value: "one"
+}
+entries {
+source { signature:"n2" }
+fact_name: "/kythe/text"
+fact_value: "two"
+}
+entries {
+source { signature:"n3" }
+fact_name: "/kythe/text"
+fact_value: "three"
+})"));
+  std::string text;
+  ASSERT_TRUE(v.VerifyAllGoals(
+      [&text](Verifier *cxt, const AssertionParser::Inspection &inspection) {
+        if (AstNode *node = inspection.evar->current()) {
+          if (Identifier *ident = node->AsIdentifier()) {
+            text = cxt->symbol_table()->text(ident->symbol()).str();
+          }
+          return true;
+        }
+        return false;
+      }));
+  EXPECT_EQ("two", text);
+}
+
+TEST(VerifierUnitTest, ParallelGroupsPass) {
+  Verifier v;
+  v.SetThreadCount(4);
+  ASSERT_TRUE(v.LoadInlineProtoFile(R"(entries {
+#- { SomeNode.content 42 }
+#- { OtherNode.content 43 }
+#- { SomeNode.text "some" }
+#- !{ ThirdNode.content 44 }
+source { root:"1" }
+fact_name: "/kythe/content"
+fact_value: "42"
+}
+entries {
+source { root:"1" }
+fact_name: "/kythe/text"
+fact_value: "some"
+}
+entries {
+source { root:"2" }
+fact_name: "/kythe/content"
+fact_value: "43"
+})"));
+  ASSERT_TRUE(v.PrepareDatabase());
+  ASSERT_TRUE(v.VerifyAllGoals());
+}
+
+// As FailWithCutInGroups, but the groups share SomeNode, so they must still
+// be solved in order.
+TEST(VerifierUnitTest, ParallelFailWithCutInGroups) {
+  Verifier v;
+  v.SetThreadCount(4);
+  ASSERT_TRUE(v.LoadInlineProtoFile(R"(entries {
+#- { SomeNode.content SomeValue }
+#- { OtherNode.content 42 }
+#- { SomeNode.content 43 }
+source { root:"1" }
+fact_name: "/kythe/content"
+fact_value: "42"
+}
+entries {
+source { root:"2" }
+fact_name: "/kythe/content"
+fact_value: "43"
+})"));
+  ASSERT_TRUE(v.PrepareDatabase());
+  ASSERT_FALSE(v.VerifyAllGoals());
+}
+
+TEST(VerifierUnitTest, ParallelFailureMatchesSequentialFailure) {
+  const std::string program = R"(entries {
+#- { SomeNode.content 42 }
+#- { OtherNode.content 42
+#-   OtherNode.text "missing" }
+#- { ThirdNode.content 44 }
+source { root:"1" }
+fact_name: "/kythe/content"
+fact_value: "42"
+})";
+  Verifier sequential;
+  ASSERT_TRUE(sequential.LoadInlineProtoFile(program));
+  ASSERT_FALSE(sequential.VerifyAllGoals());
+  Verifier parallel;
+  parallel.SetThreadCount(4);
+  ASSERT_TRUE(parallel.LoadInlineProtoFile(program));
+  ASSERT_FALSE(parallel.VerifyAllGoals());
+  EXPECT_EQ(2, parallel.highest_group_reached());
+  EXPECT_EQ(sequential.highest_group_reached(),
+            parallel.highest_group_reached());
+  EXPECT_EQ(sequential.highest_goal_reached(), parallel.highest_goal_reached());
+}
+
+/// \return a program with enough facts for the database to be sorted on
+/// several threads, with goals about the `node` with signature `goal_node`.
+std::string ManyNodeProgram(size_t node_count, size_t goal_node) {
+  std::string goal = std::to_string(goal_node);
+  std::string program = "entries {\n#- { Node.content " + goal +
+                        "\n#-   Node.text \"t" + goal + "\" }\n";
+  for (size_t i = node_count; i-- > 0;) {
+    std::string node = std::to_string(i);
+    if (i + 1 != node_count) {
+      program += "entries {\n";
+    }
+    program += "source { signature:\"" + node +
+               "\" }\nfact_name: \"/kythe/content\"\nfact_value: \"" +
+               node + "\"\n}\n";
+    program += "entries {\nsource { signature:\"" + node +
+               "\" }\nfact_name: \"/kythe/text\"\nfact_value: \"t" + node +
+               "\"\n}\n";
+  }
+  return program;
+}
+
+TEST(VerifierUnitTest, ParallelPrepareDatabase) {
+  Verifier v;
+  v.SetThreadCount(4);
+  ASSERT_TRUE(v.LoadInlineProtoFile(ManyNodeProgram(40000, 31337)));
+  ASSERT_TRUE(v.PrepareDatabase());
+  ASSERT_TRUE(v.VerifyAllGoals());
+}
+
+TEST(VerifierUnitTest, ParallelPrepareDatabaseFindsDuplicates) {
+  Verifier v;
+  v.SetThreadCount(4);
+  ASSERT_TRUE(v.LoadInlineProtoFile(ManyNodeProgram(40000, 1) + R"(entries {
+source { signature:"20000" }
+fact_name: "/kythe/text"
+fact_value: "t20000"
+})"));
+  ASSERT_FALSE(v.PrepareDatabase());
+}
+
+TEST(VerifierUnitTest, ReorderedGoalsPass) {
+  Verifier v;
+  v.ReorderGoals();
+  ASSERT_TRUE(v.LoadInlineProtoFile(R"(entries {
+#- Node.content Content?
+#- Other.content Content
+#- Other.text "other"
+#- !{ Node.text "other" }
+source { root:"1" }
+fact_name: "/kythe/content"
+fact_value: "42"
+}
+entries {
+source { root:"2" }
+fact_name: "/kythe/content"
+fact_value: "42"
+}
+entries {
+source { root:"2" }
+fact_name: "/kythe/text"
+fact_value: "other"
+}
+entries {
+source { root:"3" }
+fact_name: "/kythe/content"
+fact_value: "43"
+})"));
+  std::string content;
+  ASSERT_TRUE(v.VerifyAllGoals(
+      [&content](Verifier *cxt, const AssertionParser::Inspection &inspection) {
+        if (AstNode *node = inspection.evar->current()) {
+          if (Identifier *ident = node->AsIdentifier()) {
+            content = cxt->symbol_table()->text(ident->symbol()).str();
+          }
+        }
+        return true;
+      }));
+  EXPECT_EQ("42", content);
+}
+
+TEST(VerifierUnitTest, ReorderedGoalsReportSourceGoal) {
+  Verifier v;
+  v.ReorderGoals();
+  ASSERT_TRUE(v.LoadInlineProtoFile(R"(entries {
+#- Node.content 42
+#- Node.text "missing"
+#- Node.content 42
+source { root:"1" }
+fact_name: "/kythe/content"
+fact_value: "42"
+})"));
+  ASSERT_FALSE(v.VerifyAllGoals());
+  EXPECT_EQ(0, v.highest_group_reached());
+  // The second goal has no candidates, so it is tried (and fails) first.
+  EXPECT_EQ(1, v.highest_goal_reached());
+}
+
+TEST(VerifierUnitTest, DumpAsJsonFiltersByPath) {
+  Verifier v;
+  ASSERT_TRUE(v.LoadInlineProtoFile(R"(entries {
+source { signature:"a" path:"a.cc" }
+fact_name: "/kythe/text"
+fact_value: "\"a\""
+}
+entries {
+source { signature:"b" path:"b.cc" }
+edge_kind: "/kythe/edge/ref"
+target { signature:"a" path:"a.cc" }
+fact_name: "/"
+}
+entries {
+source { signature:"b" path:"b.cc" }
+fact_name: "/kythe/text"
+fact_value: "b"
+})"));
+  DumpFilter filter;
+  filter.path = "a.cc";
+  testing::internal::CaptureStdout();
+  v.DumpAsJson(filter);
+  std::string json = testing::internal::GetCapturedStdout();
+  EXPECT_NE(std::string::npos, json.find("\"fact_value\":\"\\\"a\\\"\""))
+      << json;
+  EXPECT_NE(std::string::npos, json.find("/kythe/edge/ref")) << json;
+  EXPECT_EQ(std::string::npos, json.find("\"fact_value\":\"b\"")) << json;
+  EXPECT_EQ('[', json.front());
+  EXPECT_EQ("]\n", json.substr(json.size() - 2));
+  EXPECT_EQ(std::string::npos, json.find(",,"));
+  EXPECT_EQ(std::string::npos, json.find("[,"));
+}
+
+TEST(VerifierUnitTest, DumpAsDotFiltersBySignature) {
+  Verifier v;
+  ASSERT_TRUE(v.LoadInlineProtoFile(R"(entries {
+source { signature:"a" }
+fact_name: "/kythe/text"
+fact_value: "a_text"
+}
+entries {
+source { signature:"b" }
+fact_name: "/kythe/text"
+fact_value: "b_text"
+})"));
+  DumpFilter filter;
+  filter.signature = "b";
+  testing::internal::CaptureStdout();
+  v.DumpAsDot(filter);
+  std::string dot = testing::internal::GetCapturedStdout();
+  EXPECT_EQ(0, dot.find("digraph G {\n")) << dot;
+  EXPECT_NE(std::string::npos, dot.find("b_text")) << dot;
+  EXPECT_EQ(std::string::npos, dot.find("a_text")) << dot;
+}
+
+TEST(VerifierUnitTest, ResetForgetsFactsAndGoals) {
+  Verifier v;
+  ASSERT_TRUE(v.LoadInlineProtoFile(R"(entries {
+#- SomeNode.content 42
+source { root:"1" }
+fact_name: "/kythe/content"
+fact_value: "42"
+})"));
+  ASSERT_TRUE(v.VerifyAllGoals());
+  v.Reset();
+  // The old fact would satisfy this goal, and the old goal fails here.
+  ASSERT_TRUE(v.LoadInlineProtoFile(R"(entries {
+#- !{ SomeNode.content 42 }
+source { root:"1" }
+fact_name: "/kythe/content"
+fact_value: "43"
+})"));
+  ASSERT_TRUE(v.VerifyAllGoals());
+  v.Reset();
+  ASSERT_TRUE(v.LoadInlineProtoFile(R"(entries {
+#- SomeNode.content 44
+source { root:"1" }
+fact_name: "/kythe/content"
+fact_value: "43"
+})"));
+  ASSERT_FALSE(v.VerifyAllGoals());
+  EXPECT_EQ(0, v.highest_group_reached());
+}
+
+/// \return `entries` as a stream of varint-delimited wire-format messages.
+std::string DelimitEntries(const std::vector<kythe::proto::Entry> &entries) {
+  std::string out;
+  {
+    google::protobuf::io::StringOutputStream raw_stream(&out);
+    google::protobuf::io::CodedOutputStream coded_stream(&raw_stream);
+    for (const auto &entry : entries) {
+      coded_stream.WriteVarint32(entry.ByteSize());
+      entry.SerializeWithCachedSizes(&coded_stream);
+    }
+  }
+  return out;
+}
+
+/// \return a fact entry about the node with signature `signature`.
+kythe::proto::Entry MakeFactEntry(const std::string &signature,
+                                  const std::string &name,
+                                  const std::string &value) {
+  kythe::proto::Entry entry;
+  entry.mutable_source()->set_signature(signature);
+  entry.set_fact_name(name);
+  entry.set_fact_value(value);
+  return entry;
+}
+
+TEST(VerifierUnitTest, PrefilterSkipsFactsNoGoalCanUse) {
+  Verifier v;
+  ASSERT_TRUE(v.LoadInlineProtoFile(R"(
+#- SomeNode.content 42
+#- SomeNode childof vname("1", "", "", "a.cc", "")
+)"));
+  v.PrefilterFactsByGoals();
+  kythe::proto::Entry content = MakeFactEntry("2", "/kythe/content", "42");
+  kythe::proto::Entry text = MakeFactEntry("2", "/kythe/text", "42");
+  kythe::proto::Entry childof;
+  childof.mutable_source()->set_signature("2");
+  childof.set_edge_kind("/kythe/edge/childof");
+  childof.mutable_target()->set_signature("1");
+  childof.mutable_target()->set_path("a.cc");
+  childof.set_fact_name("/");
+  kythe::proto::Entry other_childof = childof;
+  other_childof.mutable_target()->set_path("b.cc");
+  kythe::proto::Entry ref = childof;
+  ref.set_edge_kind("/kythe/edge/ref");
+  std::string dbname = "database";
+  unsigned int fact_id = 0;
+  for (const auto &entry : {content, text, childof, other_childof, ref}) {
+    ASSERT_TRUE(v.AssertSingleFact(&dbname, fact_id++, entry));
+  }
+  EXPECT_EQ(3, v.facts_skipped());
+  ASSERT_TRUE(v.VerifyAllGoals());
+}
+
+TEST(VerifierUnitTest, PrefilterKeepsFactsForNegatedGoals) {
+  Verifier v;
+  ASSERT_TRUE(v.LoadInlineProtoFile("#- !{ SomeNode.content 43 }\n"));
+  v.PrefilterFactsByGoals();
+  std::string dbname = "database";
+  ASSERT_TRUE(v.AssertSingleFact(&dbname, 0,
+                                 MakeFactEntry("1", "/kythe/content", "43")));
+  EXPECT_EQ(0, v.facts_skipped());
+  ASSERT_FALSE(v.VerifyAllGoals());
+}
+
+TEST(VerifierUnitTest, PrefilterIsForgottenOnReset) {
+  Verifier v;
+  ASSERT_TRUE(v.LoadInlineProtoFile("#- SomeNode.content 42\n"));
+  v.PrefilterFactsByGoals();
+  std::string dbname = "database";
+  ASSERT_TRUE(
+      v.AssertSingleFact(&dbname, 0, MakeFactEntry("1", "/kythe/text", "42")));
+  EXPECT_EQ(1, v.facts_skipped());
+  v.Reset();
+  EXPECT_EQ(0, v.facts_skipped());
+  ASSERT_TRUE(v.LoadInlineProtoFile("#- SomeNode.text 42\n"));
+  ASSERT_TRUE(
+      v.AssertSingleFact(&dbname, 0, MakeFactEntry("1", "/kythe/text", "42")));
+  EXPECT_EQ(0, v.facts_skipped());
+  ASSERT_TRUE(v.VerifyAllGoals());
+}
+
+TEST(GoalPrefilterTest, AdmitsAnchorsAndOrdinalEdges) {
+  GoalPrefilter prefilter;
+  prefilter.sources.fields[0].texts.insert("a");
+  for (auto &field : prefilter.sources.fields) {
+    field.any = field.texts.empty();
+  }
+  prefilter.edge_kinds.texts.insert("/kythe/edge/param");
+  prefilter.targets.admits_none = true;
+  prefilter.fact_names.texts.insert("/kythe/ordinal");
+  prefilter.fact_values.texts.insert("0");
+  llvm::StringRef a[5] = {"a", "", "", "", ""};
+  llvm::StringRef b[5] = {"b", "", "", "", ""};
+  EXPECT_TRUE(prefilter.Admits(a, "/kythe/edge/param.0", nullptr, "/", ""));
+  EXPECT_FALSE(prefilter.Admits(a, "/kythe/edge/param.1", nullptr, "/", ""));
+  EXPECT_FALSE(prefilter.Admits(b, "/kythe/edge/param.0", nullptr, "/", ""));
+  EXPECT_FALSE(prefilter.Admits(b, "", nullptr, "/kythe/loc/start", "1"));
+  prefilter.admits_anchors = true;
+  EXPECT_TRUE(prefilter.Admits(b, "", nullptr, "/kythe/loc/start", "1"));
+  EXPECT_TRUE(prefilter.Admits(b, "", nullptr, "/kythe/node/kind", "anchor"));
+  EXPECT_FALSE(prefilter.Admits(b, "", nullptr, "/kythe/node/kind", "file"));
+}
+
+TEST(EntryStreamLoaderTest, DecodesEntry) {
+  kythe::proto::Entry entry = MakeFactEntry("s", "/kythe/text", "t");
+  entry.mutable_source()->set_language("l");
+  entry.set_edge_kind("/kythe/edge/e");
+  entry.mutable_target();
+  std::string encoded = entry.SerializeAsString();
+  EntryFields fields;
+  ASSERT_TRUE(DecodeEntry(encoded, &fields));
+  EXPECT_TRUE(fields.has_source);
+  EXPECT_EQ("s", fields.source.fields[0]);
+  EXPECT_EQ("", fields.source.fields[1]);
+  EXPECT_EQ("l", fields.source.fields[4]);
+  EXPECT_EQ(entry.source().SerializeAsString(), fields.source.encoded);
+  EXPECT_EQ("/kythe/edge/e", fields.edge_kind);
+  EXPECT_TRUE(fields.has_target);
+  EXPECT_EQ("/kythe/text", fields.fact_name);
+  EXPECT_EQ("t", fields.fact_value);
+  EXPECT_FALSE(DecodeEntry(encoded.substr(0, encoded.size() - 1), &fields));
+}
+
+TEST(EntryStreamLoaderTest, LoadsFacts) {
+  Verifier v;
+  ASSERT_TRUE(v.LoadInlineProtoFile(R"(
+#- vname("1", "", "", "", "").content 42
+#- vname("2", "", "", "", "") childof.3 vname("1", "", "", "", "")
+#- vname("3", "", "", "", "").text Big?
+)"));
+  kythe::proto::Entry edge;
+  edge.mutable_source()->set_signature("2");
+  edge.set_edge_kind("/kythe/edge/childof.3");
+  edge.mutable_target()->set_signature("1");
+  edge.set_fact_name("/");
+  // Big enough that the entry spans more than one chunk.
+  std::string big(5 * 1024 * 1024, 'x');
+  std::string data = DelimitEntries(
+      {MakeFactEntry("1", "/kythe/content", "42"), edge,
+       MakeFactEntry("3", "/kythe/text", big),
+       MakeFactEntry("1", "/kythe/node/kind", "record")});
+  google::protobuf::io::ArrayInputStream input(data.data(), data.size(), 4096);
+  std::string database_name = "stream";
+  EntryStreamLoader loader(&v, &database_name);
+  std::string error_text;
+  ASSERT_TRUE(loader.Load(&input, &error_text)) << error_text;
+  EXPECT_EQ(4, loader.facts_loaded());
+  std::string big_text;
+  ASSERT_TRUE(v.VerifyAllGoals(
+      [&big_text](Verifier *cxt,
+                  const AssertionParser::Inspection &inspection) {
+        if (AstNode *node = inspection.evar->current()) {
+          if (Identifier *ident = node->AsIdentifier()) {
+            big_text = cxt->symbol_table()->text(ident->symbol()).str();
+          }
+        }
+        return true;
+      }));
+  EXPECT_TRUE(big == big_text);
+}
+
+TEST(EntryStreamLoaderTest, RejectsTruncatedInput) {
+  Verifier v;
+  std::string data = DelimitEntries({MakeFactEntry("1", "/kythe/text", "a"),
+                                     MakeFactEntry("2", "/kythe/text", "b")});
+  data.resize(data.size() - 1);
+  google::protobuf::io::ArrayInputStream input(data.data(), data.size());
+  std::string database_name = "stream";
+  EntryStreamLoader loader(&v, &database_name);
+  std::string error_text;
+  EXPECT_FALSE(loader.Load(&input, &error_text));
+  EXPECT_EQ(1, loader.facts_loaded());
+  EXPECT_NE(std::string::npos, error_text.find("Truncated")) << error_text;
+}
+
+TEST(EntryStreamLoaderTest, RejectsMalformedEntry) {
+  Verifier v;
+  std::string data = DelimitEntries({MakeFactEntry("1", "/kythe/text", "a")});
+  // Claim that the source VName is longer than the entry.
+  data[2] = 0x7f;
+  google::protobuf::io::ArrayInputStream input(data.data(), data.size());
+  std::string database_name = "stream";
+  EntryStreamLoader loader(&v, &database_name);
+  std::string error_text;
+  EXPECT_FALSE(loader.Load(&input, &error_text));
+  EXPECT_EQ(0, loader.facts_loaded());
+  EXPECT_NE(std::string::npos, error_text.find("Malformed")) << error_text;
+}
+
+/// \brief Makes a new empty directory for a test to use.
+std::string MakeTempDirectory() {
+  const char *tmpdir = getenv("TEST_TMPDIR");
+  std::string path = std::string(tmpdir ? tmpdir : "/tmp") + "/rulesXXXXXX";
+  CHECK(mkdtemp(&path[0]) != nullptr);
+  return path;
+}
+
+/// \brief Returns the names of the cached rule files in `directory`.
+std::set<std::string> CachedRuleFiles(const std::string &directory) {
+  std::set<std::string> names;
+  DIR *dir = opendir(directory.c_str());
+  CHECK(dir != nullptr);
+  while (struct dirent *entry = readdir(dir)) {
+    llvm::StringRef name(entry->d_name);
+    if (name.endswith(".rules")) {
+      names.insert(name.str());
+    }
+  }
+  closedir(dir);
+  return names;
+}
+
+void WriteTestFile(const std::string &path, const std::string &content) {
+  std::ofstream out(path);
+  out << content;
+  CHECK(out.good());
+}
+
+/// An anchor at offsets 56-59 that defines a node whose offset is 56.
+constexpr char kCachedRuleFacts[] = R"(entries {
+source { root:"1" }
+fact_name: "/kythe/node/kind"
+fact_value: "anchor"
+}
+entries {
+source { root:"1" }
+fact_name: "/kythe/loc/start"
+fact_value: "56"
+}
+entries {
+source { root:"1" }
+fact_name: "/kythe/loc/end"
+fact_value: "59"
+}
+entries {
+source { root:"1" }
+edge_kind: "/kythe/edge/defines"
+target { root:"2" }
+fact_name: "/"
+fact_value: ""
+}
+entries {
+source { root:"2" }
+fact_name: "/kythe/offset"
+fact_value: "56"
+})";
+
+/// \brief Verifies the rule files at `paths` against `kCachedRuleFacts`
+/// with a verifier that caches rules in `cache`.
+/// \param singletons Set to whether there were singleton EVars.
+bool VerifyWithRuleCache(const std::string &cache,
+                         const std::vector<std::string> &paths,
+                         bool *singletons = nullptr) {
+  Verifier v;
+  v.UseRuleCache(cache);
+  for (const auto &path : paths) {
+    if (!v.LoadInlineRuleFile(path)) {
+      return false;
+    }
+  }
+  if (singletons != nullptr) {
+    *singletons = v.CheckForSingletonEVars();
+  }
+  return v.LoadInlineProtoFile(kCachedRuleFacts) && v.VerifyAllGoals();
+}
+
+TEST(VerifierUnitTest, RuleCacheRestoresParsedRules) {
+  const std::string dir = MakeTempDirectory();
+  const std::string pass = dir + "/pass.cc";
+  const std::string fail = dir + "/fail.cc";
+  WriteTestFile(pass, R"(//- @foo defines SomeNode
+//- SomeNode.offset @^foo
+int foo;
+//- !{ SomeNode.offset 57 }
+)");
+  WriteTestFile(fail, R"(//- @foo defines SomeNode
+//- SomeNode.offset @$foo
+int foo;
+//- !{ SomeNode.offset 57 }
+)");
+  ASSERT_TRUE(VerifyWithRuleCache(dir, {pass}));
+  auto cached = CachedRuleFiles(dir);
+  ASSERT_EQ(1, cached.size());
+  const std::string pass_rules = dir + "/" + *cached.begin();
+  ASSERT_TRUE(VerifyWithRuleCache(dir, {pass}));
+  ASSERT_FALSE(VerifyWithRuleCache(dir, {fail}));
+  cached = CachedRuleFiles(dir);
+  ASSERT_EQ(2, cached.size());
+  cached.erase(*cached.begin() == pass_rules.substr(dir.size() + 1)
+                   ? cached.begin()
+                   : std::next(cached.begin()));
+  const std::string fail_rules = dir + "/" + *cached.begin();
+  ASSERT_FALSE(VerifyWithRuleCache(dir, {fail}));
+  // Prove that the cache is used by swapping in the other file's rules.
+  ASSERT_EQ(0, rename(fail_rules.c_str(), pass_rules.c_str()));
+  EXPECT_FALSE(VerifyWithRuleCache(dir, {pass}));
+  // Unreadable entries are replaced by parsing again.
+  WriteTestFile(pass_rules, "kythe-verifier-rules 1\n\x05");
+  EXPECT_TRUE(VerifyWithRuleCache(dir, {pass}));
+  EXPECT_TRUE(VerifyWithRuleCache(dir, {pass}));
+}
+
+TEST(VerifierUnitTest, CachedRulesShareEVarsWithEarlierFiles) {
+  const std::string dir = MakeTempDirectory();
+  const std::string first = dir + "/first.cc";
+  const std::string second = dir + "/second.cc";
+  WriteTestFile(first, "//- Anchor defines SomeNode\n//- Anchor.loc/end 59\n");
+  WriteTestFile(second, "//- SomeNode.loc/end 59\n");
+  bool singletons = false;
+  // On its own, `second` is satisfied by the anchor.
+  ASSERT_TRUE(VerifyWithRuleCache(dir, {second}, &singletons));
+  EXPECT_TRUE(singletons);
+  ASSERT_EQ(1, CachedRuleFiles(dir).size());
+  // After `first`, the cached copy of `second` must refer to the same
+  // `SomeNode`, which is defined by the anchor (and so can't be one).
+  EXPECT_FALSE(VerifyWithRuleCache(dir, {first, second}, &singletons));
+  EXPECT_FALSE(singletons);
+  EXPECT_EQ(2, CachedRuleFiles(dir).size());
+}
+
 }  // anonymous namespace
 }  // namespace verifier
 }  // namespace kythe
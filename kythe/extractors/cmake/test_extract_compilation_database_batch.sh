@@ -0,0 +1,28 @@
+#!/bin/bash -e
+
+# Copyright 2017 Google Inc. All rights reserved.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#   http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+# This script checks that cxx_extractor_batch can extract a simple
+# compilation database to an index pack.
+BASE_DIR="$PWD/kythe/extractors/cmake"
+OUT_DIR="$TEST_TMPDIR/pack"
+EXPECTED_FILE_HASH="deac66ccb79f6d31c0fa7d358de48e083c15c02ff50ec1ebd4b64314b9e6e196"
+EXTRACTOR="$PWD/kythe/cxx/extractor/cxx_extractor_batch"
+cd "${BASE_DIR}/testdata"
+KYTHE_CORPUS=test_corpus KYTHE_ROOT_DIRECTORY="${BASE_DIR}" \
+    KYTHE_OUTPUT_DIRECTORY="${OUT_DIR}" KYTHE_INDEX_PACK=1 \
+    "${EXTRACTOR}" --jobs=2 "${BASE_DIR}/testdata/compilation_database.json"
+[[ $(ls -1 "${OUT_DIR}"/units/*.unit | wc -l) -eq 1 ]]
+[[ -e "${OUT_DIR}/files/${EXPECTED_FILE_HASH}.data" ]]
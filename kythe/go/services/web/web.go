@@ -32,7 +32,10 @@ import (
 	"github.com/golang/protobuf/proto"
 )
 
-const jsonBodyType = "application/json; charset=utf-8"
+const (
+	jsonBodyType  = "application/json; charset=utf-8"
+	protoBodyType = "application/x-protobuf"
+)
 
 // JSONMarshaler is the marshaler used to encode all JSON web requests.
 var JSONMarshaler = jsonpb.Marshaler{
@@ -84,6 +87,24 @@ func ReadJSONBody(r *http.Request, msg proto.Message) error {
 	return jsonpb.UnmarshalString(string(rec), msg)
 }
 
+// ReadBody reads the entire body of r and unmarshals it into msg: as a
+// serialized protobuf if its Content-Type is "application/x-protobuf";
+// otherwise as JSON. If the request body is empty, no error is returned and
+// msg is unchanged.
+func ReadBody(r *http.Request, msg proto.Message) error {
+	if ct := r.Header.Get("Content-Type"); !strings.HasPrefix(ct, protoBodyType) {
+		return ReadJSONBody(r, msg)
+	}
+	rec, err := ioutil.ReadAll(r.Body)
+	if err != nil {
+		return fmt.Errorf("body read error: %v", err)
+	}
+	if len(rec) == 0 {
+		return nil
+	}
+	return proto.Unmarshal(rec, msg)
+}
+
 // WriteResponse writes msg to w as a serialized protobuf if the "proto" query
 // parameter is set; otherwise as JSON.
 func WriteResponse(w http.ResponseWriter, r *http.Request, msg proto.Message) error {
@@ -103,7 +124,7 @@ func WriteJSONResponse(w http.ResponseWriter, r *http.Request, v interface{}) er
 
 // WriteProtoResponse serializes msg to w.
 func WriteProtoResponse(w http.ResponseWriter, r *http.Request, msg proto.Message) error {
-	w.Header().Set("Content-Type", "application/x-protobuf")
+	w.Header().Set("Content-Type", protoBodyType)
 	cw := httpencoding.CompressData(w, r)
 	defer cw.Close()
 	rec, err := proto.Marshal(msg)
@@ -1817,7 +1817,9 @@ func WebClient(addr string) Service {
 //     Response: JSON encoded xrefs.DocumentationReply
 //
 // Note: /nodes, /edges, /decorations, and /xrefs will return their responses as
-// serialized protobufs if the "proto" query parameter is set.
+// serialized protobufs if the "proto" query parameter is set. Every handler
+// also accepts a serialized protobuf request with the Content-Type
+// "application/x-protobuf".
 func RegisterHTTPHandlers(ctx context.Context, xs Service, mux *http.ServeMux) {
 	mux.HandleFunc("/xrefs", func(w http.ResponseWriter, r *http.Request) {
 		start := time.Now()
@@ -1825,7 +1827,7 @@ func RegisterHTTPHandlers(ctx context.Context, xs Service, mux *http.ServeMux) {
 			log.Printf("xrefs.CrossReferences:\t%s", time.Since(start))
 		}()
 		var req xpb.CrossReferencesRequest
-		if err := web.ReadJSONBody(r, &req); err != nil {
+		if err := web.ReadBody(r, &req); err != nil {
 			http.Error(w, err.Error(), http.StatusBadRequest)
 			return
 		}
@@ -1845,7 +1847,7 @@ func RegisterHTTPHandlers(ctx context.Context, xs Service, mux *http.ServeMux) {
 			log.Printf("xrefs.Decorations:\t%s", time.Since(start))
 		}()
 		var req xpb.DecorationsRequest
-		if err := web.ReadJSONBody(r, &req); err != nil {
+		if err := web.ReadBody(r, &req); err != nil {
 			http.Error(w, err.Error(), http.StatusBadRequest)
 			return
 		}
@@ -1865,7 +1867,7 @@ func RegisterHTTPHandlers(ctx context.Context, xs Service, mux *http.ServeMux) {
 			log.Printf("xrefs.Documentation:\t%s", time.Since(start))
 		}()
 		var req xpb.DocumentationRequest
-		if err := web.ReadJSONBody(r, &req); err != nil {
+		if err := web.ReadBody(r, &req); err != nil {
 			http.Error(w, err.Error(), http.StatusBadRequest)
 			return
 		}
@@ -1886,7 +1888,7 @@ func RegisterHTTPHandlers(ctx context.Context, xs Service, mux *http.ServeMux) {
 		}()
 
 		var req gpb.NodesRequest
-		if err := web.ReadJSONBody(r, &req); err != nil {
+		if err := web.ReadBody(r, &req); err != nil {
 			http.Error(w, err.Error(), http.StatusBadRequest)
 			return
 		}
@@ -1906,7 +1908,7 @@ func RegisterHTTPHandlers(ctx context.Context, xs Service, mux *http.ServeMux) {
 		}()
 
 		var req gpb.EdgesRequest
-		if err := web.ReadJSONBody(r, &req); err != nil {
+		if err := web.ReadBody(r, &req); err != nil {
 			http.Error(w, err.Error(), http.StatusBadRequest)
 			return
 		}
@@ -6,15 +6,16 @@
 set -e
 
 bazel build \
-  --experimental_action_listener=//kythe/cxx/tools/generate_compile_commands:extract_json \
+  --experimental_action_listener=//kythe/cxx/tools/generate_compile_commands:write_extra_actions \
   --noshow_progress \
   --noshow_loading_progress \
   $(bazel query 'kind(cc_.*, //...)') > /dev/null
 
+bazel build --noshow_progress --noshow_loading_progress \
+  //kythe/cxx/tools/generate_compile_commands:extract_compile_command > /dev/null
+
+EXTRACT="$(bazel info bazel-bin)/kythe/cxx/tools/generate_compile_commands/extract_compile_command"
 pushd $(bazel info execution_root) > /dev/null
-echo "[" > compile_commands.json
-find . -name '*.compile_command.json' -exec bash -c 'cat {} && echo ,' \; >> compile_commands.json
-sed -i '$s/,$//' compile_commands.json
-echo "]" >> compile_commands.json
+# The trailing slash lets the scan follow the bazel-out symlink.
+"${EXTRACT}" --batch_directory="bazel-out/" --output=compile_commands.json
 popd > /dev/null
-